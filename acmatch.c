@@ -0,0 +1,386 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "acmatch.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif /* __SSE2__ */
+
+/*
+ * Aho-Corasick multi-pattern matcher for octet streams.
+ *
+ * Patterns are compiled into a DFA with one transition per state and octet
+ * class, octets not occurring in any pattern sharing class 0, so scanning
+ * costs one table lookup per octet regardless of the number of patterns.
+ * The scan state of a stream is a single integer, so a stream can be
+ * scanned in arbitrary pieces, such as the chains of an evbuffer, without
+ * ever making it contiguous.  Transitions are stored as premultiplied row
+ * offsets with ACMATCH_HIT set if patterns end in the target state.
+ *
+ * While in the initial state, octets which cannot start a pattern are
+ * skipped using memchr(3) for a single start octet, SSE2 compares for up to
+ * ACMATCH_SIMDMAX start octets, and a lookup table otherwise.
+ */
+
+#define ACMATCH_HIT	0x80000000U
+#define ACMATCH_NONE	0xFFFFFFFFU
+#define ACMATCH_SIMDMAX	4
+
+typedef struct acmatch_pat {
+	size_t off;
+	size_t len;
+	unsigned int id;
+} acmatch_pat_t;
+
+typedef struct acmatch_out {
+	unsigned int id;
+	uint32_t next;
+} acmatch_out_t;
+
+struct acmatch {
+	/* patterns added */
+	unsigned char *buf;
+	size_t bufsz;
+	size_t buflen;
+	acmatch_pat_t *pats;
+	size_t patssz;
+	size_t npats;
+
+	/* compiled automaton */
+	uint16_t cls[256];
+	uint32_t nclasses;
+	uint32_t *delta;                /* nstates * nclasses */
+	uint32_t *out;                  /* first output per state */
+	acmatch_out_t *outs;
+	size_t nstates;
+	uint8_t startmap[256];
+	unsigned char start[ACMATCH_SIMDMAX];
+	unsigned int nstart;
+};
+
+acmatch_t *
+acmatch_new(void)
+{
+	return calloc(1, sizeof(acmatch_t));
+}
+
+static void
+acmatch_reset(acmatch_t *ac)
+{
+	if (ac->delta)
+		free(ac->delta);
+	if (ac->out)
+		free(ac->out);
+	if (ac->outs)
+		free(ac->outs);
+	ac->delta = NULL;
+	ac->out = NULL;
+	ac->outs = NULL;
+	ac->nstates = 0;
+	ac->nstart = 0;
+}
+
+void
+acmatch_free(acmatch_t *ac)
+{
+	acmatch_reset(ac);
+	if (ac->buf)
+		free(ac->buf);
+	if (ac->pats)
+		free(ac->pats);
+	free(ac);
+}
+
+/*
+ * Add a pattern of sz octets, reported as id when matched.  Takes effect
+ * on the next acmatch_compile().
+ * Returns 0 on success, -1 with errno set on failure.
+ */
+int
+acmatch_add(acmatch_t *ac, const void *pat, size_t sz, unsigned int id)
+{
+	if (sz == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (ac->buflen + sz > ac->bufsz) {
+		size_t n = ac->bufsz ? ac->bufsz * 2 : 1024;
+		unsigned char *p;
+
+		while (n < ac->buflen + sz)
+			n *= 2;
+		if (!(p = realloc(ac->buf, n)))
+			return -1;
+		ac->buf = p;
+		ac->bufsz = n;
+	}
+	if (ac->npats == ac->patssz) {
+		size_t n = ac->patssz ? ac->patssz * 2 : 16;
+		acmatch_pat_t *p;
+
+		if (!(p = realloc(ac->pats, n * sizeof(acmatch_pat_t))))
+			return -1;
+		ac->pats = p;
+		ac->patssz = n;
+	}
+	memcpy(ac->buf + ac->buflen, pat, sz);
+	ac->pats[ac->npats].off = ac->buflen;
+	ac->pats[ac->npats].len = sz;
+	ac->pats[ac->npats].id = id;
+	ac->buflen += sz;
+	ac->npats++;
+	return 0;
+}
+
+/*
+ * Compile the patterns added so far.  The automaton must not be scanned
+ * while compiling; scan states of the previous automaton are invalid
+ * afterwards.
+ * Returns 0 on success, -1 with errno set on failure.
+ */
+int
+acmatch_compile(acmatch_t *ac)
+{
+	uint32_t *fail = NULL, *queue = NULL, *delta;
+	size_t maxstates, head, tail, i, j;
+	uint32_t nc, s, t, r;
+
+	acmatch_reset(ac);
+	memset(ac->cls, 0, sizeof(ac->cls));
+	nc = 1;
+	for (i = 0; i < ac->buflen; i++) {
+		if (!ac->cls[ac->buf[i]])
+			ac->cls[ac->buf[i]] = nc++;
+	}
+	ac->nclasses = nc;
+	maxstates = ac->buflen + 1;
+	if (maxstates > (ACMATCH_HIT - 1) / nc) {
+		errno = E2BIG;
+		return -1;
+	}
+	if (!(ac->delta = calloc(maxstates * nc, sizeof(uint32_t))) ||
+	    !(ac->out = malloc(maxstates * sizeof(uint32_t))) ||
+	    (ac->npats &&
+	     !(ac->outs = malloc(ac->npats * sizeof(acmatch_out_t)))))
+		goto errout;
+	memset(ac->out, 0xFF, maxstates * sizeof(uint32_t));
+
+	/* trie, with rows indexed by state number and 0 meaning no edge */
+	ac->nstates = 1;
+	for (i = 0; i < ac->npats; i++) {
+		const unsigned char *p = ac->buf + ac->pats[i].off;
+
+		s = 0;
+		for (j = 0; j < ac->pats[i].len; j++) {
+			t = ac->delta[s * nc + ac->cls[p[j]]];
+			if (!t) {
+				t = ac->nstates++;
+				ac->delta[s * nc + ac->cls[p[j]]] = t;
+			}
+			s = t;
+		}
+		ac->outs[i].id = ac->pats[i].id;
+		ac->outs[i].next = ac->out[s];
+		ac->out[s] = i;
+	}
+
+	/* breadth first: failure links, outputs and missing transitions */
+	if (!(fail = calloc(ac->nstates, sizeof(uint32_t))) ||
+	    !(queue = malloc(ac->nstates * sizeof(uint32_t))))
+		goto errout;
+	head = tail = 0;
+	for (j = 0; j < nc; j++) {
+		if ((t = ac->delta[j]))
+			queue[tail++] = t;
+	}
+	while (head < tail) {
+		s = queue[head++];
+		if (ac->out[s] == ACMATCH_NONE) {
+			ac->out[s] = ac->out[fail[s]];
+		} else {
+			for (r = ac->out[s]; ac->outs[r].next != ACMATCH_NONE;
+			     r = ac->outs[r].next);
+			ac->outs[r].next = ac->out[fail[s]];
+		}
+		for (j = 0; j < nc; j++) {
+			t = ac->delta[s * nc + j];
+			if (t) {
+				fail[t] = ac->delta[fail[s] * nc + j];
+				queue[tail++] = t;
+			} else {
+				ac->delta[s * nc + j] =
+				        ac->delta[fail[s] * nc + j];
+			}
+		}
+	}
+	free(fail);
+	free(queue);
+
+	/* premultiply and flag states with outputs */
+	for (i = 0; i < ac->nstates * nc; i++) {
+		t = ac->delta[i];
+		ac->delta[i] = t * nc | (ac->out[t] != ACMATCH_NONE ?
+		                         ACMATCH_HIT : 0);
+	}
+	if ((delta = realloc(ac->delta,
+	                     ac->nstates * nc * sizeof(uint32_t))))
+		ac->delta = delta;
+
+	/* octets leaving the initial state */
+	memset(ac->startmap, 0, sizeof(ac->startmap));
+	for (i = 0; i < 256; i++) {
+		if (!ac->delta[ac->cls[i]])
+			continue;
+		ac->startmap[i] = 1;
+		if (ac->nstart < ACMATCH_SIMDMAX)
+			ac->start[ac->nstart] = i;
+		ac->nstart++;
+	}
+	return 0;
+
+errout:
+	if (fail)
+		free(fail);
+	if (queue)
+		free(queue);
+	acmatch_reset(ac);
+	errno = ENOMEM;
+	return -1;
+}
+
+/*
+ * Return the number of patterns added.
+ */
+size_t
+acmatch_patterns(const acmatch_t *ac)
+{
+	return ac->npats;
+}
+
+/*
+ * Return the number of states of the compiled automaton.
+ */
+size_t
+acmatch_states(const acmatch_t *ac)
+{
+	return ac->nstates;
+}
+
+/*
+ * Return a pointer to the first octet in [p, end) which can start a
+ * pattern, or end if there is none.
+ */
+static const unsigned char *
+acmatch_skip(const acmatch_t *ac, const unsigned char *p,
+             const unsigned char *end)
+{
+	if (ac->nstart == 0)
+		return end;
+	if (ac->nstart == 1) {
+		p = memchr(p, ac->start[0], end - p);
+		return p ? p : end;
+	}
+#ifdef __SSE2__
+	if (ac->nstart <= ACMATCH_SIMDMAX) {
+		__m128i v[ACMATCH_SIMDMAX], b, m;
+		unsigned int i;
+		int mask;
+
+		for (i = 0; i < ac->nstart; i++)
+			v[i] = _mm_set1_epi8((char)ac->start[i]);
+		while (end - p >= 16) {
+			b = _mm_loadu_si128((const __m128i *)(const void *)p);
+			m = _mm_cmpeq_epi8(b, v[0]);
+			for (i = 1; i < ac->nstart; i++)
+				m = _mm_or_si128(m, _mm_cmpeq_epi8(b, v[i]));
+			if ((mask = _mm_movemask_epi8(m)))
+				return p + __builtin_ctz(mask);
+			p += 16;
+		}
+	}
+#endif /* __SSE2__ */
+	while (p < end && !ac->startmap[*p])
+		p++;
+	return p;
+}
+
+/*
+ * Scan sz octets at buf, continuing from and updating the scan state at
+ * state, and call cb for each pattern matched.
+ * Returns 1 if cb stopped the scan, 0 otherwise.
+ */
+int
+acmatch_scan(const acmatch_t *ac, acmatch_state_t *state, const void *buf,
+             size_t sz, acmatch_cb_t cb, void *arg)
+{
+	const unsigned char *p = buf, *end = p + sz;
+	uint32_t s = *state;
+
+	if (!ac->delta)
+		return 0;
+	while (p < end) {
+		if (s == 0 && (p = acmatch_skip(ac, p, end)) == end)
+			break;
+		s = ac->delta[(s & ~ACMATCH_HIT) + ac->cls[*p++]];
+		if (unlikely(s & ACMATCH_HIT)) {
+			uint32_t r = ac->out[(s & ~ACMATCH_HIT) / ac->nclasses];
+
+			for (; r != ACMATCH_NONE; r = ac->outs[r].next) {
+				if (cb(ac->outs[r].id, arg)) {
+					*state = s;
+					return 1;
+				}
+			}
+		}
+	}
+	*state = s;
+	return 0;
+}
+
+/*
+ * Scan the octets of iovcnt iovecs in order, as acmatch_scan().
+ */
+int
+acmatch_scan_iov(const acmatch_t *ac, acmatch_state_t *state,
+                 const struct iovec *iov, int iovcnt, acmatch_cb_t cb,
+                 void *arg)
+{
+	for (int i = 0; i < iovcnt; i++) {
+		if (acmatch_scan(ac, state, iov[i].iov_base, iov[i].iov_len,
+		                 cb, arg))
+			return 1;
+	}
+	return 0;
+}
+
+/* vim: set noet ft=c: */
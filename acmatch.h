@@ -0,0 +1,63 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ACMATCH_H
+#define ACMATCH_H
+
+#include "attrib.h"
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stdint.h>
+
+typedef struct acmatch acmatch_t;
+
+/* scan state of one stream, ACMATCH_INIT before the first octet */
+typedef uint32_t acmatch_state_t;
+#define ACMATCH_INIT	0
+
+/* called for each pattern id ending at the octet scanned last; returns
+ * nonzero to stop scanning */
+typedef int (*acmatch_cb_t)(unsigned int, void *);
+
+acmatch_t * acmatch_new(void) MALLOC;
+void acmatch_free(acmatch_t *) NONNULL(1);
+int acmatch_add(acmatch_t *, const void *, size_t, unsigned int) NONNULL(1,2)
+    WUNRES;
+int acmatch_compile(acmatch_t *) NONNULL(1) WUNRES;
+size_t acmatch_patterns(const acmatch_t *) NONNULL(1) WUNRES;
+size_t acmatch_states(const acmatch_t *) NONNULL(1) WUNRES;
+int acmatch_scan(const acmatch_t *, acmatch_state_t *, const void *, size_t,
+                 acmatch_cb_t, void *) NONNULL(1,2,5) WUNRES;
+int acmatch_scan_iov(const acmatch_t *, acmatch_state_t *,
+                     const struct iovec *, int, acmatch_cb_t, void *)
+    NONNULL(1,2,5) WUNRES;
+
+#endif /* !ACMATCH_H */
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,251 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "acmatch.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <check.h>
+
+#define MAXIDS 64
+
+static unsigned int hits[MAXIDS];
+static unsigned int nhits;
+
+static int
+count_cb(unsigned int id, UNUSED void *arg)
+{
+	fail_unless(id < MAXIDS, "bad id");
+	hits[id]++;
+	nhits++;
+	return 0;
+}
+
+static int
+stop_cb(unsigned int id, void *arg)
+{
+	*(unsigned int *)arg = id;
+	return 1;
+}
+
+static acmatch_t *
+compile(const char **pats, size_t n)
+{
+	acmatch_t *ac;
+
+	memset(hits, 0, sizeof(hits));
+	nhits = 0;
+	ac = acmatch_new();
+	fail_unless(!!ac, "no matcher");
+	for (size_t i = 0; i < n; i++) {
+		fail_unless(acmatch_add(ac, pats[i], strlen(pats[i]), i) == 0,
+		            "add failed");
+	}
+	fail_unless(acmatch_compile(ac) == 0, "compile failed");
+	return ac;
+}
+
+START_TEST(acmatch_01)
+{
+	const char *pats[] = {"he", "she", "his", "hers"};
+	acmatch_state_t st = ACMATCH_INIT;
+	acmatch_t *ac;
+
+	ac = compile(pats, 4);
+	fail_unless(acmatch_patterns(ac) == 4, "wrong pattern count");
+	fail_unless(acmatch_states(ac) == 10, "wrong state count");
+	fail_unless(!acmatch_scan(ac, &st, "ushers", 6, count_cb, NULL),
+	            "stopped");
+	fail_unless(nhits == 3, "wrong number of matches");
+	fail_unless(hits[0] == 1 && hits[1] == 1 && hits[3] == 1,
+	            "wrong matches");
+	acmatch_free(ac);
+}
+END_TEST
+
+START_TEST(acmatch_02)
+{
+	const char *pats[] = {"he", "she", "his", "hers"};
+	const char *text = "ushers and his hershey";
+	acmatch_state_t st = ACMATCH_INIT;
+	struct iovec iov[3];
+	acmatch_t *ac;
+
+	/* byte by byte */
+	ac = compile(pats, 4);
+	for (size_t i = 0; i < strlen(text); i++) {
+		fail_unless(!acmatch_scan(ac, &st, text + i, 1, count_cb,
+		                          NULL), "stopped");
+	}
+	fail_unless(nhits == 8, "wrong number of matches %u", nhits);
+	fail_unless(hits[0] == 3 && hits[1] == 2 && hits[2] == 1 &&
+	            hits[3] == 2, "wrong matches");
+
+	/* iovecs split within patterns */
+	memset(hits, 0, sizeof(hits));
+	nhits = 0;
+	st = ACMATCH_INIT;
+	iov[0].iov_base = (void *)text;
+	iov[0].iov_len = 3;
+	iov[1].iov_base = (void *)(text + 3);
+	iov[1].iov_len = 13;
+	iov[2].iov_base = (void *)(text + 16);
+	iov[2].iov_len = strlen(text) - 16;
+	fail_unless(!acmatch_scan_iov(ac, &st, iov, 3, count_cb, NULL),
+	            "stopped");
+	fail_unless(nhits == 8, "wrong number of matches %u", nhits);
+	acmatch_free(ac);
+}
+END_TEST
+
+START_TEST(acmatch_03)
+{
+	const char *pats[] = {"abc", "abd", "bd"};
+	acmatch_state_t st = ACMATCH_INIT;
+	unsigned int id = MAXIDS;
+	acmatch_t *ac;
+	char buf[200];
+
+	/* single start octet, match beyond the first 16 octets */
+	ac = compile(pats, 2);
+	memset(buf, 'x', sizeof(buf));
+	memcpy(buf + 150, "abd", 3);
+	fail_unless(acmatch_scan(ac, &st, buf, sizeof(buf), stop_cb, &id),
+	            "not stopped");
+	fail_unless(id == 1, "wrong match");
+	acmatch_free(ac);
+
+	/* stop at the first of two patterns ending at the same octet */
+	ac = compile(pats, 3);
+	st = ACMATCH_INIT;
+	id = MAXIDS;
+	fail_unless(acmatch_scan(ac, &st, buf, sizeof(buf), stop_cb, &id),
+	            "not stopped");
+	fail_unless(id == 1 || id == 2, "wrong match");
+	acmatch_free(ac);
+}
+END_TEST
+
+START_TEST(acmatch_04)
+{
+	acmatch_state_t st = ACMATCH_INIT;
+	acmatch_t *ac;
+
+	ac = compile(NULL, 0);
+	fail_unless(acmatch_add(ac, "", 0, 0) == -1, "added empty pattern");
+	fail_unless(!acmatch_scan(ac, &st, "anything", 8, count_cb, NULL),
+	            "stopped");
+	fail_unless(nhits == 0, "matched without patterns");
+	fail_unless(acmatch_add(ac, "\0\xff", 2, 5) == 0, "add failed");
+	fail_unless(acmatch_compile(ac) == 0, "recompile failed");
+	fail_unless(!acmatch_scan(ac, &st, "a\0\xff\0\xff", 5, count_cb,
+	                          NULL), "stopped");
+	fail_unless(hits[5] == 2, "binary pattern not matched");
+	acmatch_free(ac);
+}
+END_TEST
+
+/*
+ * Compare against naive matching on random patterns and text over small
+ * alphabets, scanned in random pieces.
+ */
+static void
+acmatch_random(const char *alphabet, size_t alen, unsigned int seed)
+{
+	char pats[MAXIDS][8];
+	size_t patlen[MAXIDS];
+	unsigned int expect[MAXIDS];
+	char text[4096];
+	acmatch_state_t st = ACMATCH_INIT;
+	acmatch_t *ac;
+	size_t off, n;
+
+	srandom(seed);
+	memset(hits, 0, sizeof(hits));
+	memset(expect, 0, sizeof(expect));
+	nhits = 0;
+	ac = acmatch_new();
+	for (int i = 0; i < MAXIDS; i++) {
+		patlen[i] = 1 + random() % 6;
+		for (size_t j = 0; j < patlen[i]; j++)
+			pats[i][j] = alphabet[random() % alen];
+		fail_unless(acmatch_add(ac, pats[i], patlen[i], i) == 0,
+		            "add failed");
+	}
+	fail_unless(acmatch_compile(ac) == 0, "compile failed");
+	for (size_t i = 0; i < sizeof(text); i++)
+		text[i] = (random() % 4) ? 'z' : alphabet[random() % alen];
+	for (int i = 0; i < MAXIDS; i++) {
+		for (size_t j = 0; j + patlen[i] <= sizeof(text); j++) {
+			if (!memcmp(text + j, pats[i], patlen[i]))
+				expect[i]++;
+		}
+	}
+	for (off = 0; off < sizeof(text); off += n) {
+		n = 1 + random() % 100;
+		if (n > sizeof(text) - off)
+			n = sizeof(text) - off;
+		fail_unless(!acmatch_scan(ac, &st, text + off, n, count_cb,
+		                          NULL), "stopped");
+	}
+	for (int i = 0; i < MAXIDS; i++) {
+		fail_unless(hits[i] == expect[i], "pattern %i: %u != %u",
+		            i, hits[i], expect[i]);
+	}
+	acmatch_free(ac);
+}
+
+START_TEST(acmatch_05)
+{
+	acmatch_random("ab", 2, 1);
+	acmatch_random("abc\0", 4, 2);
+	acmatch_random("0123456789abcdef", 16, 3);
+}
+END_TEST
+
+Suite *
+acmatch_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("acmatch");
+
+	tc = tcase_create("acmatch");
+	tcase_add_test(tc, acmatch_01);
+	tcase_add_test(tc, acmatch_02);
+	tcase_add_test(tc, acmatch_03);
+	tcase_add_test(tc, acmatch_04);
+	tcase_add_test(tc, acmatch_05);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,204 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "admit.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <netinet/in.h>
+
+/*
+ * Admission control counters, checked for every accepted connection before
+ * any memory is allocated for it.  Besides the global and per-proxyspec
+ * counters, there is a fixed-size table of per-source counters indexed by a
+ * hash of the client IP address, or of the /64 prefix for IPv6 clients, as
+ * those usually have a whole prefix to pick addresses from.  Sources sharing
+ * a bucket share their limits, which errs on the side of limiting too early,
+ * but keeps the table compact and lookups free of locking and allocation.
+ *
+ * Counters are updated atomically, but checking and counting a connection
+ * are separate steps, so concurrent accepts on different threads can
+ * overshoot a limit by a few connections.
+ */
+
+struct admit {
+	admit_ctr_t global;
+	unsigned int mask;
+	admit_ctr_t src[];
+};
+
+/*
+ * Create admission counters with 2^bits per-source buckets.
+ */
+admit_t *
+admit_new(unsigned int bits)
+{
+	admit_t *admit;
+	size_t n = (size_t)1 << bits;
+
+	admit = malloc(sizeof(admit_t) + n * sizeof(admit_ctr_t));
+	if (!admit)
+		return NULL;
+	memset(admit, 0, sizeof(admit_t) + n * sizeof(admit_ctr_t));
+	admit->mask = n - 1;
+	return admit;
+}
+
+void
+admit_free(admit_t *admit)
+{
+	free(admit);
+}
+
+admit_ctr_t *
+admit_global(admit_t *admit)
+{
+	return &admit->global;
+}
+
+/*
+ * Return the per-source counters for the IP address of addr.
+ */
+admit_ctr_t *
+admit_source(admit_t *admit, const struct sockaddr *addr)
+{
+	const unsigned char *p;
+	unsigned int h = 2166136261U;
+	size_t sz;
+
+	switch (addr->sa_family) {
+	case AF_INET:
+		p = (const unsigned char *)
+		    &((const struct sockaddr_in *)addr)->sin_addr;
+		sz = sizeof(struct in_addr);
+		break;
+	case AF_INET6:
+		p = (const unsigned char *)
+		    &((const struct sockaddr_in6 *)addr)->sin6_addr;
+		sz = 8;
+		break;
+	default:
+		return &admit->src[0];
+	}
+	for (size_t i = 0; i < sz; i++) {
+		h ^= p[i];
+		h *= 16777619U;
+	}
+	h ^= h >> 16;
+	return &admit->src[h & admit->mask];
+}
+
+/*
+ * Return 1 if any limit is set in limits, 0 otherwise.
+ */
+int
+admit_limited(const admit_limits_t *limits)
+{
+	return limits->conns || limits->rate;
+}
+
+/*
+ * Return 1 if admitting one more connection at time now in seconds would
+ * exceed limits, 0 otherwise.  Handshake is 1 if the connection counts
+ * towards the handshake rate.
+ */
+int
+admit_over(admit_ctr_t *ctr, const admit_limits_t *limits, int handshake,
+           unsigned int now)
+{
+	unsigned long long rate;
+
+	if (limits->conns &&
+	    __atomic_load_n(&ctr->conns, __ATOMIC_RELAXED) >= limits->conns)
+		return 1;
+	if (handshake && limits->rate) {
+		rate = __atomic_load_n(&ctr->rate, __ATOMIC_RELAXED);
+		if ((rate >> 32) == now &&
+		    (unsigned int)rate >= limits->rate)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Count a handshake at time now in seconds towards the handshake rate.
+ * Returns the number of handshakes counted in the current window.
+ */
+static unsigned int
+admit_rate_inc(admit_ctr_t *ctr, unsigned int now)
+{
+	unsigned long long rate, next;
+
+	rate = __atomic_load_n(&ctr->rate, __ATOMIC_RELAXED);
+	do {
+		if ((rate >> 32) == now)
+			next = rate + 1;
+		else
+			next = ((unsigned long long)now << 32) | 1;
+	} while (!__atomic_compare_exchange_n(&ctr->rate, &rate, next, 1,
+	                                      __ATOMIC_RELAXED,
+	                                      __ATOMIC_RELAXED));
+	return (unsigned int)next;
+}
+
+/*
+ * Count a connection admitted at time now in seconds.
+ */
+void
+admit_enter(admit_ctr_t *ctr, int handshake, unsigned int now)
+{
+	__atomic_add_fetch(&ctr->conns, 1, __ATOMIC_RELAXED);
+	if (handshake)
+		(void)admit_rate_inc(ctr, now);
+}
+
+/*
+ * Count a renegotiation of an admitted connection at time now in seconds
+ * towards the handshake rate.  Returns 1 if that exceeds limits, 0 otherwise.
+ */
+int
+admit_handshake(admit_ctr_t *ctr, const admit_limits_t *limits,
+                unsigned int now)
+{
+	unsigned int n = admit_rate_inc(ctr, now);
+
+	return limits->rate && n > limits->rate;
+}
+
+/*
+ * Count a connection admitted with admit_enter() as closed.
+ */
+void
+admit_leave(admit_ctr_t *ctr)
+{
+	__atomic_sub_fetch(&ctr->conns, 1, __ATOMIC_RELAXED);
+}
+
+/* vim: set noet ft=c: */
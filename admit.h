@@ -0,0 +1,72 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef ADMIT_H
+#define ADMIT_H
+
+#include "attrib.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/*
+ * Admission limits of one scope; 0 means no limit.
+ */
+typedef struct admit_limits {
+	unsigned int conns;     /* concurrent connections */
+	unsigned int rate;      /* new handshakes per second */
+} admit_limits_t;
+
+/*
+ * Admission counters of one scope.  The handshake rate is counted in fixed
+ * one second windows, packed as (second << 32) | handshakes.
+ */
+typedef struct admit_ctr {
+	unsigned int conns;
+	unsigned long long rate;
+} admit_ctr_t;
+
+typedef struct admit admit_t;
+
+admit_t * admit_new(unsigned int) MALLOC;
+void admit_free(admit_t *) NONNULL(1);
+admit_ctr_t * admit_global(admit_t *) NONNULL(1) WUNRES;
+admit_ctr_t * admit_source(admit_t *, const struct sockaddr *)
+              NONNULL(1,2) WUNRES;
+int admit_limited(const admit_limits_t *) NONNULL(1) WUNRES;
+int admit_over(admit_ctr_t *, const admit_limits_t *, int, unsigned int)
+    NONNULL(1,2) WUNRES;
+void admit_enter(admit_ctr_t *, int, unsigned int) NONNULL(1);
+int admit_handshake(admit_ctr_t *, const admit_limits_t *, unsigned int)
+    NONNULL(1,2) WUNRES;
+void admit_leave(admit_ctr_t *) NONNULL(1);
+
+#endif /* !ADMIT_H */
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,195 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "admit.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <check.h>
+
+static void
+admit_test_addr(struct sockaddr_storage *ss, const char *ip)
+{
+	memset(ss, 0, sizeof(*ss));
+	if (strchr(ip, ':')) {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+		sin6->sin6_family = AF_INET6;
+		inet_pton(AF_INET6, ip, &sin6->sin6_addr);
+	} else {
+		struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+		sin->sin_family = AF_INET;
+		inet_pton(AF_INET, ip, &sin->sin_addr);
+	}
+}
+
+START_TEST(admit_01)
+{
+	admit_limits_t limits = {3, 0};
+	admit_ctr_t ctr;
+	int i;
+
+	memset(&ctr, 0, sizeof(ctr));
+	for (i = 0; i < 3; i++) {
+		fail_unless(!admit_over(&ctr, &limits, 1, 100),
+		            "over conns limit too early");
+		admit_enter(&ctr, 1, 100);
+	}
+	fail_unless(admit_over(&ctr, &limits, 0, 100), "not over conns limit");
+	admit_leave(&ctr);
+	fail_unless(!admit_over(&ctr, &limits, 0, 100),
+	            "still over conns limit after leave");
+}
+END_TEST
+
+START_TEST(admit_02)
+{
+	admit_limits_t limits = {0, 2};
+	admit_ctr_t ctr;
+
+	memset(&ctr, 0, sizeof(ctr));
+	admit_enter(&ctr, 1, 100);
+	admit_enter(&ctr, 0, 100);
+	fail_unless(!admit_over(&ctr, &limits, 1, 100),
+	            "non-handshake counted towards rate");
+	admit_enter(&ctr, 1, 100);
+	fail_unless(admit_over(&ctr, &limits, 1, 100), "not over rate");
+	fail_unless(!admit_over(&ctr, &limits, 0, 100),
+	            "rate applied to non-handshake");
+	fail_unless(!admit_over(&ctr, &limits, 1, 101),
+	            "rate not reset in next second");
+	admit_enter(&ctr, 1, 101);
+	fail_unless(!admit_over(&ctr, &limits, 1, 101),
+	            "rate window not restarted");
+}
+END_TEST
+
+START_TEST(admit_03)
+{
+	struct sockaddr_storage a, b;
+	admit_t *admit;
+
+	admit = admit_new(10);
+	fail_unless(!!admit, "admit_new failed");
+	admit_test_addr(&a, "192.0.2.1");
+	admit_test_addr(&b, "192.0.2.1");
+	((struct sockaddr_in *)&b)->sin_port = htons(4711);
+	fail_unless(admit_source(admit, (struct sockaddr *)&a) ==
+	            admit_source(admit, (struct sockaddr *)&b),
+	            "port affects source bucket");
+	admit_test_addr(&a, "2001:db8:1:2::1");
+	admit_test_addr(&b, "2001:db8:1:2:ffff::2");
+	fail_unless(admit_source(admit, (struct sockaddr *)&a) ==
+	            admit_source(admit, (struct sockaddr *)&b),
+	            "IPv6 /64 not sharing source bucket");
+	fail_unless(admit_global(admit) != admit_source(admit,
+	            (struct sockaddr *)&a), "global is a source bucket");
+	admit_free(admit);
+}
+END_TEST
+
+START_TEST(admit_04)
+{
+	struct sockaddr_storage ss;
+	admit_t *admit;
+	int distinct = 0;
+	admit_ctr_t *first;
+
+	admit = admit_new(10);
+	admit_test_addr(&ss, "198.51.100.1");
+	first = admit_source(admit, (struct sockaddr *)&ss);
+	for (int i = 2; i < 34; i++) {
+		char ip[16];
+		snprintf(ip, sizeof(ip), "198.51.100.%d", i);
+		admit_test_addr(&ss, ip);
+		if (admit_source(admit, (struct sockaddr *)&ss) != first)
+			distinct++;
+	}
+	fail_unless(distinct > 28, "sources not spread over buckets");
+	admit_free(admit);
+}
+END_TEST
+
+START_TEST(admit_05)
+{
+	admit_limits_t limits;
+
+	memset(&limits, 0, sizeof(limits));
+	fail_unless(!admit_limited(&limits), "limited without limits");
+	limits.rate = 1;
+	fail_unless(admit_limited(&limits), "not limited with rate");
+}
+END_TEST
+
+START_TEST(admit_06)
+{
+	admit_limits_t limits = {0, 2};
+	admit_ctr_t ctr;
+
+	memset(&ctr, 0, sizeof(ctr));
+	admit_enter(&ctr, 1, 100);
+	fail_unless(!admit_handshake(&ctr, &limits, 100),
+	            "renegotiation over rate too early");
+	fail_unless(admit_handshake(&ctr, &limits, 100),
+	            "renegotiation not over rate");
+	fail_unless(ctr.conns == 1, "renegotiation counted as connection");
+	fail_unless(admit_over(&ctr, &limits, 1, 100),
+	            "renegotiations not counted towards rate");
+	fail_unless(!admit_handshake(&ctr, &limits, 101),
+	            "rate window not restarted");
+	limits.rate = 0;
+	fail_unless(!admit_handshake(&ctr, &limits, 101),
+	            "over rate without limit");
+}
+END_TEST
+
+Suite *
+admit_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("admit");
+
+	tc = tcase_create("admit");
+	tcase_add_test(tc, admit_01);
+	tcase_add_test(tc, admit_02);
+	tcase_add_test(tc, admit_03);
+	tcase_add_test(tc, admit_04);
+	tcase_add_test(tc, admit_05);
+	tcase_add_test(tc, admit_06);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
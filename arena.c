@@ -0,0 +1,143 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "arena.h"
+
+#include <string.h>
+
+/*
+ * Bump allocator for many small allocations sharing a common lifetime, such
+ * as the strings owned by a connection.  Allocations are carved from chunks
+ * of ARENA_CHUNK_SIZE octets; allocations larger than that get a chunk of
+ * their own.  Individual allocations cannot be freed; all of them are
+ * released at once with arena_reset() or arena_free().
+ */
+
+#define ARENA_CHUNK_SIZE	512
+#define ARENA_ALIGN		sizeof(void *)
+
+struct arena_chunk {
+	arena_chunk_t *next;
+	size_t sz;
+	size_t used;
+	unsigned char buf[];
+};
+
+/*
+ * Allocate sz octets from the arena, aligned for pointers.
+ * Returns NULL on out of memory condition.
+ */
+void *
+arena_alloc(arena_t *arena, size_t sz)
+{
+	arena_chunk_t *chunk = arena->chunk;
+	void *p;
+
+	sz = (sz + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	if (!chunk || chunk->sz - chunk->used < sz) {
+		size_t chunksz = sz > ARENA_CHUNK_SIZE ? sz : ARENA_CHUNK_SIZE;
+
+		chunk = malloc(sizeof(arena_chunk_t) + chunksz);
+		if (!chunk)
+			return NULL;
+		chunk->sz = chunksz;
+		chunk->used = 0;
+		chunk->next = arena->chunk;
+		arena->chunk = chunk;
+	}
+	p = chunk->buf + chunk->used;
+	chunk->used += sz;
+	return p;
+}
+
+/*
+ * Copy the first len octets of s into the arena as a terminated string.
+ * Returns NULL on out of memory condition.
+ */
+char *
+arena_strndup(arena_t *arena, const char *s, size_t len)
+{
+	char *p;
+
+	p = arena_alloc(arena, len + 1);
+	if (!p)
+		return NULL;
+	memcpy(p, s, len);
+	p[len] = '\0';
+	return p;
+}
+
+char *
+arena_strdup(arena_t *arena, const char *s)
+{
+	return arena_strndup(arena, s, strlen(s));
+}
+
+/*
+ * Release all allocations, keeping the most recent chunk for reuse if it is
+ * of the default size.
+ */
+void
+arena_reset(arena_t *arena)
+{
+	arena_chunk_t *chunk, *next;
+
+	chunk = arena->chunk;
+	if (!chunk)
+		return;
+	if (chunk->sz == ARENA_CHUNK_SIZE) {
+		chunk->used = 0;
+		next = chunk->next;
+		chunk->next = NULL;
+		chunk = next;
+	} else {
+		arena->chunk = NULL;
+	}
+	while (chunk) {
+		next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+}
+
+/*
+ * Release all allocations and all memory held by the arena.
+ */
+void
+arena_free(arena_t *arena)
+{
+	arena_chunk_t *chunk, *next;
+
+	for (chunk = arena->chunk; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+	arena->chunk = NULL;
+}
+
+/* vim: set noet ft=c: */
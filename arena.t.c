@@ -0,0 +1,120 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "arena.h"
+
+#include <string.h>
+
+#include <check.h>
+
+START_TEST(arena_alloc_01)
+{
+	arena_t arena;
+	char *a, *b;
+
+	memset(&arena, 0, sizeof(arena));
+	a = arena_strdup(&arena, "GET");
+	b = arena_strndup(&arena, "/index.html HTTP/1.1", 11);
+	fail_unless(a && b, "allocation failed");
+	fail_unless(!strcmp(a, "GET"), "first string mismatch");
+	fail_unless(!strcmp(b, "/index.html"), "second string mismatch");
+	fail_unless(!((size_t)b % sizeof(void *)), "not aligned");
+	arena_free(&arena);
+	fail_unless(!arena.chunk, "chunks left after free");
+}
+END_TEST
+
+START_TEST(arena_alloc_02)
+{
+	arena_t arena;
+	unsigned char *big;
+	char *s;
+
+	memset(&arena, 0, sizeof(arena));
+	s = arena_strdup(&arena, "small");
+	big = arena_alloc(&arena, 10000);
+	fail_unless(s && big, "allocation failed");
+	memset(big, 'x', 10000);
+	fail_unless(!strcmp(s, "small"), "small string overwritten");
+	arena_free(&arena);
+}
+END_TEST
+
+START_TEST(arena_reset_01)
+{
+	arena_t arena;
+	char *a, *b;
+
+	memset(&arena, 0, sizeof(arena));
+	a = arena_strdup(&arena, "first");
+	fail_unless(!!a, "allocation failed");
+	arena_reset(&arena);
+	fail_unless(!!arena.chunk, "chunk not kept");
+	b = arena_strdup(&arena, "second");
+	fail_unless(b == a, "chunk not reused");
+	fail_unless(!strcmp(b, "second"), "string mismatch");
+	arena_free(&arena);
+}
+END_TEST
+
+START_TEST(arena_reset_02)
+{
+	arena_t arena;
+
+	memset(&arena, 0, sizeof(arena));
+	arena_reset(&arena);
+	fail_unless(!arena.chunk, "empty arena not empty");
+	fail_unless(!!arena_alloc(&arena, 10000), "allocation failed");
+	arena_reset(&arena);
+	fail_unless(!arena.chunk, "oversized chunk kept");
+	arena_free(&arena);
+}
+END_TEST
+
+Suite *
+arena_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("arena");
+
+	tc = tcase_create("arena_alloc");
+	tcase_add_test(tc, arena_alloc_01);
+	tcase_add_test(tc, arena_alloc_02);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("arena_reset");
+	tcase_add_test(tc, arena_reset_01);
+	tcase_add_test(tc, arena_reset_02);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,125 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bench.h"
+
+#include "base64.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* size of a typical DER encoded OCSP request and of a larger blob */
+#define BASE64_BENCH_SMALL 83
+#define BASE64_BENCH_LARGE 4096
+/* encodes to 16 KiB, the request line limit of common web servers */
+#define BASE64_BENCH_WORST 12288
+
+typedef struct base64_bench {
+	char *coded;
+	size_t sz;
+} base64_bench_t;
+
+static void
+base64_bench_dec(void *arg, size_t n)
+{
+	base64_bench_t *b = arg;
+	unsigned char *buf;
+	size_t sz;
+
+	while (n--) {
+		if (!(buf = base64_dec(b->coded, b->sz, &sz))) {
+			fprintf(stderr, "base64_dec() failed\n");
+			exit(EXIT_FAILURE);
+		}
+		free(buf);
+	}
+}
+
+static void
+base64_bench_setup(base64_bench_t *b, size_t sz)
+{
+	unsigned char *plain;
+	size_t i;
+
+	if (!(plain = malloc(sz))) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < sz; i++) {
+		plain[i] = (unsigned char)(i * 7 + 3);
+	}
+	if (!(b->coded = base64_enc(plain, sz, &b->sz))) {
+		fprintf(stderr, "base64_enc() failed\n");
+		exit(EXIT_FAILURE);
+	}
+	free(plain);
+}
+
+/*
+ * Worst case for the OCSP GET request detection:  Base64 from a 16 KiB request
+ * URI path component, once valid and once with an invalid character in the
+ * last quartet, which is only detected after decoding everything before it.
+ */
+static void
+base64_bench_dec_worst(void *arg, size_t n)
+{
+	base64_bench_t *b = arg;
+	unsigned char *buf;
+	size_t sz;
+
+	while (n--) {
+		buf = base64_dec(b->coded, b->sz, &sz);
+		if (!buf != (b->coded[b->sz - 1] == '%')) {
+			fprintf(stderr, "base64_dec() failed\n");
+			exit(EXIT_FAILURE);
+		}
+		free(buf);
+	}
+}
+
+void
+base64_bench(void)
+{
+	base64_bench_t small, large, worst;
+
+	base64_bench_setup(&small, BASE64_BENCH_SMALL);
+	base64_bench_setup(&large, BASE64_BENCH_LARGE);
+	base64_bench_setup(&worst, BASE64_BENCH_WORST);
+	bench_run("Base64DecSmall", 1, base64_bench_dec, &small);
+	bench_run("Base64DecLarge", 1, base64_bench_dec, &large);
+	bench_run_worst("Base64DecWorst", base64_bench_dec_worst, &worst);
+	worst.coded[worst.sz - 1] = '%';
+	bench_run_worst("Base64DecWorstInvalid", base64_bench_dec_worst,
+	                &worst);
+	free(worst.coded);
+	free(large.coded);
+	free(small.coded);
+}
+
+/* vim: set noet ft=c: */
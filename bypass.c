@@ -0,0 +1,392 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bypass.h"
+
+#include "khash.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+/*
+ * Bypass lists name destinations which must never be intercepted, such as
+ * sites using certificate pinning.  Each entry is either a host name, which
+ * matches the name itself and all names below it, optionally written with a
+ * leading "*." or ".", or an address with optional prefix length.
+ *
+ * Names are kept in a hash set, such that matching an SNI costs one lookup
+ * per label, independent of the number of entries.  Networks are stored as
+ * address ranges in a single IPv6 space, with IPv4 mapped to ::ffff:0:0/96;
+ * compiling sorts them and merges overlapping ranges, such that matching an
+ * address is a binary search for the last range starting at or below it.
+ */
+
+KHASH_SET_INIT_STR(cstrset_t)
+
+#define BYPASS_NAMESZ   256
+
+typedef struct {
+	uint8_t lo[16];
+	uint8_t hi[16];
+} bypass_range_t;
+
+struct bypass {
+	khash_t(cstrset_t) *names;
+	bypass_range_t *nets;
+	size_t nnets;
+	size_t netsz;
+	unsigned int compiled : 1;
+};
+
+bypass_t *
+bypass_new(void)
+{
+	bypass_t *bp;
+
+	if (!(bp = malloc(sizeof(bypass_t))))
+		return NULL;
+	memset(bp, 0, sizeof(bypass_t));
+	if (!(bp->names = kh_init(cstrset_t))) {
+		free(bp);
+		return NULL;
+	}
+	bp->compiled = 1;
+	return bp;
+}
+
+void
+bypass_free(bypass_t *bp)
+{
+	for (khiter_t it = kh_begin(bp->names); it != kh_end(bp->names);
+	     it++) {
+		if (kh_exist(bp->names, it))
+			free((char *)kh_key(bp->names, it));
+	}
+	kh_destroy(cstrset_t, bp->names);
+	free(bp->nets);
+	free(bp);
+}
+
+size_t
+bypass_names(bypass_t *bp)
+{
+	return kh_size(bp->names);
+}
+
+size_t
+bypass_nets(bypass_t *bp)
+{
+	return bp->nnets;
+}
+
+/*
+ * Copy name into buf in lower case, without trailing dot.
+ * Returns the length of the copy, or 0 if the name is empty or too long.
+ */
+static size_t
+bypass_name_lower(char *buf, const char *name, size_t sz)
+{
+	if (sz > 0 && name[sz - 1] == '.')
+		sz--;
+	if (sz == 0 || sz >= BYPASS_NAMESZ)
+		return 0;
+	for (size_t i = 0; i < sz; i++)
+		buf[i] = tolower((unsigned char)name[i]);
+	buf[sz] = '\0';
+	return sz;
+}
+
+static int
+bypass_add_name(bypass_t *bp, const char *s, size_t sz)
+{
+	char buf[BYPASS_NAMESZ];
+	char *key;
+	int ret;
+
+	if (sz >= 2 && s[0] == '*' && s[1] == '.') {
+		s += 2;
+		sz -= 2;
+	} else if (sz >= 1 && s[0] == '.') {
+		s++;
+		sz--;
+	}
+	if (!(sz = bypass_name_lower(buf, s, sz)) || strpbrk(buf, "*/") ||
+	    buf[0] == '.' || strstr(buf, "..")) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (kh_get(cstrset_t, bp->names, buf) != kh_end(bp->names))
+		return 0;
+	if (!(key = strdup(buf)))
+		return -1;
+	kh_put(cstrset_t, bp->names, key, &ret);
+	if (ret == -1) {
+		free(key);
+		errno = ENOMEM;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Parse an address with optional prefix length into a range.
+ * Returns 1 on success, 0 if s is not an address, -1 if it is an address
+ * with an invalid prefix length.
+ */
+static int
+bypass_parse_net(bypass_range_t *r, const char *s, size_t sz)
+{
+	char buf[INET6_ADDRSTRLEN + 4];
+	char *slash, *end;
+	unsigned long len, max;
+
+	if (sz == 0 || sz >= sizeof(buf))
+		return 0;
+	memcpy(buf, s, sz);
+	buf[sz] = '\0';
+	if ((slash = strchr(buf, '/')))
+		*slash = '\0';
+	memset(r->lo, 0, sizeof(r->lo));
+	if (inet_pton(AF_INET, buf, r->lo + 12) == 1) {
+		r->lo[10] = r->lo[11] = 0xff;
+		max = 32;
+	} else if (inet_pton(AF_INET6, buf, r->lo) == 1) {
+		max = 128;
+	} else {
+		return 0;
+	}
+	len = max;
+	if (slash) {
+		len = strtoul(slash + 1, &end, 10);
+		if (slash[1] == '\0' || *end != '\0' || len > max)
+			return -1;
+	}
+	len += 128 - max;
+	memcpy(r->hi, r->lo, sizeof(r->hi));
+	for (unsigned int i = 0; i < 16; i++) {
+		unsigned int bits = len > i * 8 ? len - i * 8 : 0;
+		uint8_t mask = bits >= 8 ? 0xff : (uint8_t)(0xff00 >> bits);
+
+		r->lo[i] &= mask;
+		r->hi[i] |= ~mask;
+	}
+	return 1;
+}
+
+static int
+bypass_add_entry(bypass_t *bp, const char *s, size_t sz)
+{
+	bypass_range_t r;
+	int rv;
+
+	if ((rv = bypass_parse_net(&r, s, sz)) == -1) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (rv == 0)
+		return bypass_add_name(bp, s, sz);
+	if (bp->nnets == bp->netsz) {
+		size_t n = bp->netsz ? bp->netsz * 2 : 16;
+		bypass_range_t *p = realloc(bp->nets,
+		                            n * sizeof(bypass_range_t));
+		if (!p)
+			return -1;
+		bp->nets = p;
+		bp->netsz = n;
+	}
+	bp->nets[bp->nnets++] = r;
+	bp->compiled = 0;
+	return 0;
+}
+
+/*
+ * Add the whitespace or comma separated entries in s.
+ * Returns 0 on success, -1 with errno set to EINVAL on syntax errors or to
+ * ENOMEM when out of memory.
+ */
+int
+bypass_add(bypass_t *bp, const char *s)
+{
+	const char *sep;
+	int n = 0;
+
+	for (;;) {
+		s += strspn(s, " \t,");
+		if (!*s)
+			break;
+		sep = s + strcspn(s, " \t,");
+		if (bypass_add_entry(bp, s, sep - s) == -1)
+			return -1;
+		s = sep;
+		n++;
+	}
+	if (!n) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Add the entries from the file at path, one or more per line, with empty
+ * lines and lines starting with # ignored.
+ * Returns 0 on success, -1 with errno set on failure; syntax errors are
+ * reported as EINVAL.
+ */
+int
+bypass_load(bypass_t *bp, const char *path)
+{
+	char *line = NULL;
+	size_t linesz = 0;
+	ssize_t n;
+	FILE *f;
+	int rv = 0;
+
+	if (!(f = fopen(path, "r")))
+		return -1;
+	while ((n = getline(&line, &linesz, f)) != -1) {
+		char *p = line + strspn(line, " \t\r\n");
+
+		if (!*p || *p == '#')
+			continue;
+		p[strcspn(p, "\r\n#")] = '\0';
+		if (bypass_add(bp, p) == -1) {
+			rv = -1;
+			break;
+		}
+	}
+	if (rv == 0 && ferror(f)) {
+		errno = EIO;
+		rv = -1;
+	}
+	free(line);
+	fclose(f);
+	return rv;
+}
+
+static int
+bypass_range_cmp(const void *a, const void *b)
+{
+	return memcmp(((const bypass_range_t *)a)->lo,
+	              ((const bypass_range_t *)b)->lo, 16);
+}
+
+/*
+ * Sort networks and merge overlapping ranges.  Must be called after adding
+ * entries and before matching.
+ */
+int
+bypass_compile(bypass_t *bp)
+{
+	size_t i, n;
+
+	if (bp->compiled)
+		return 0;
+	qsort(bp->nets, bp->nnets, sizeof(bypass_range_t), bypass_range_cmp);
+	for (i = 1, n = 0; i < bp->nnets; i++) {
+		if (memcmp(bp->nets[i].lo, bp->nets[n].hi, 16) <= 0) {
+			if (memcmp(bp->nets[i].hi, bp->nets[n].hi, 16) > 0)
+				memcpy(bp->nets[n].hi, bp->nets[i].hi, 16);
+		} else {
+			bp->nets[++n] = bp->nets[i];
+		}
+	}
+	if (bp->nnets)
+		bp->nnets = n + 1;
+	bp->compiled = 1;
+	return 0;
+}
+
+/*
+ * Returns 1 if sni or any of its parent domains is on the bypass list.
+ */
+int
+bypass_match_sni(bypass_t *bp, const char *sni)
+{
+	char buf[BYPASS_NAMESZ];
+	const char *p;
+
+	if (!kh_size(bp->names) ||
+	    !bypass_name_lower(buf, sni, strlen(sni)))
+		return 0;
+	for (p = buf; p; p = strchr(p, '.')) {
+		if (*p == '.')
+			p++;
+		if (kh_get(cstrset_t, bp->names, p) != kh_end(bp->names))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Returns 1 if addr is within any of the networks on the bypass list.
+ */
+int
+bypass_match_addr(bypass_t *bp, const struct sockaddr *addr,
+                  socklen_t addrlen)
+{
+	uint8_t key[16];
+	size_t lo, hi, mid;
+
+	if (!bp->nnets)
+		return 0;
+	memset(key, 0, sizeof(key));
+	if (addr->sa_family == AF_INET &&
+	    addrlen >= (socklen_t)sizeof(struct sockaddr_in)) {
+		key[10] = key[11] = 0xff;
+		memcpy(key + 12,
+		       &((const struct sockaddr_in *)addr)->sin_addr, 4);
+	} else if (addr->sa_family == AF_INET6 &&
+	           addrlen >= (socklen_t)sizeof(struct sockaddr_in6)) {
+		memcpy(key, &((const struct sockaddr_in6 *)addr)->sin6_addr,
+		       16);
+	} else {
+		return 0;
+	}
+	/* find the last range starting at or below key */
+	lo = 0;
+	hi = bp->nnets;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (memcmp(bp->nets[mid].lo, key, 16) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo > 0 && memcmp(key, bp->nets[lo - 1].hi, 16) <= 0;
+}
+
+/* vim: set noet ft=c: */
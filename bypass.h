@@ -0,0 +1,53 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BYPASS_H
+#define BYPASS_H
+
+#include "attrib.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stddef.h>
+
+typedef struct bypass bypass_t;
+
+bypass_t * bypass_new(void) MALLOC;
+void bypass_free(bypass_t *) NONNULL(1);
+int bypass_add(bypass_t *, const char *) NONNULL(1,2) WUNRES;
+int bypass_load(bypass_t *, const char *) NONNULL(1,2) WUNRES;
+int bypass_compile(bypass_t *) NONNULL(1) WUNRES;
+int bypass_match_sni(bypass_t *, const char *) NONNULL(1,2) WUNRES;
+int bypass_match_addr(bypass_t *, const struct sockaddr *, socklen_t)
+    NONNULL(1,2) WUNRES;
+size_t bypass_names(bypass_t *) NONNULL(1) WUNRES;
+size_t bypass_nets(bypass_t *) NONNULL(1) WUNRES;
+
+#endif /* !BYPASS_H */
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,227 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bypass.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <check.h>
+
+static int
+bypass_t_addr(bypass_t *bp, const char *s)
+{
+	struct sockaddr_in sin;
+	struct sockaddr_in6 sin6;
+
+	memset(&sin, 0, sizeof(sin));
+	memset(&sin6, 0, sizeof(sin6));
+	if (inet_pton(AF_INET, s, &sin.sin_addr) == 1) {
+		sin.sin_family = AF_INET;
+		return bypass_match_addr(bp, (struct sockaddr *)&sin,
+		                         sizeof(sin));
+	}
+	if (inet_pton(AF_INET6, s, &sin6.sin6_addr) == 1) {
+		sin6.sin6_family = AF_INET6;
+		return bypass_match_addr(bp, (struct sockaddr *)&sin6,
+		                         sizeof(sin6));
+	}
+	return -1;
+}
+
+START_TEST(bypass_01)
+{
+	bypass_t *bp;
+
+	bp = bypass_new();
+	fail_unless(!!bp, "bypass_new failed");
+	fail_unless(bypass_add(bp, "bank.example, *.Pinned.ORG.") == 0,
+	            "add failed");
+	fail_unless(bypass_add(bp, ".cdn.test") == 0, "add failed");
+	fail_unless(bypass_add(bp, "bank.example") == 0, "add dup failed");
+	fail_unless(bypass_names(bp) == 3, "wrong number of names");
+	fail_unless(bypass_nets(bp) == 0, "wrong number of nets");
+	fail_unless(bypass_compile(bp) == 0, "compile failed");
+
+	fail_unless(bypass_match_sni(bp, "bank.example") == 1, "exact");
+	fail_unless(bypass_match_sni(bp, "www.BANK.example.") == 1, "sub");
+	fail_unless(bypass_match_sni(bp, "a.b.pinned.org") == 1, "deep");
+	fail_unless(bypass_match_sni(bp, "pinned.org") == 1, "wildcard base");
+	fail_unless(bypass_match_sni(bp, "cdn.test") == 1, "dot base");
+	fail_unless(bypass_match_sni(bp, "mybank.example") == 0,
+	            "matched across label boundary");
+	fail_unless(bypass_match_sni(bp, "example") == 0, "parent matched");
+	fail_unless(bypass_match_sni(bp, "bank.example.com") == 0,
+	            "prefix matched");
+	fail_unless(bypass_match_sni(bp, "") == 0, "empty matched");
+	fail_unless(bypass_t_addr(bp, "10.0.0.1") == 0, "addr matched");
+	bypass_free(bp);
+}
+END_TEST
+
+START_TEST(bypass_02)
+{
+	bypass_t *bp;
+
+	bp = bypass_new();
+	fail_unless(bypass_add(bp, "10.1.0.0/16 192.0.2.7") == 0,
+	            "add failed");
+	fail_unless(bypass_add(bp, "10.1.128.0/17,2001:db8::/32") == 0,
+	            "add failed");
+	fail_unless(bypass_add(bp, "10.0.0.0/8") == 0, "add failed");
+	fail_unless(bypass_add(bp, "172.16.0.1/12") == 0, "add failed");
+	fail_unless(bypass_add(bp, "2001:db8:1::/48") == 0, "add failed");
+	fail_unless(bypass_nets(bp) == 7, "wrong number of nets");
+	fail_unless(bypass_compile(bp) == 0, "compile failed");
+	fail_unless(bypass_nets(bp) == 4, "overlapping nets not merged");
+
+	fail_unless(bypass_t_addr(bp, "10.0.0.0") == 1, "net start");
+	fail_unless(bypass_t_addr(bp, "10.255.255.255") == 1, "net end");
+	fail_unless(bypass_t_addr(bp, "10.1.200.1") == 1, "nested");
+	fail_unless(bypass_t_addr(bp, "9.255.255.255") == 0, "below");
+	fail_unless(bypass_t_addr(bp, "11.0.0.0") == 0, "above");
+	fail_unless(bypass_t_addr(bp, "192.0.2.7") == 1, "host");
+	fail_unless(bypass_t_addr(bp, "192.0.2.8") == 0, "host+1");
+	fail_unless(bypass_t_addr(bp, "172.31.255.255") == 1, "unaligned");
+	fail_unless(bypass_t_addr(bp, "172.32.0.0") == 0, "unaligned+1");
+	fail_unless(bypass_t_addr(bp, "2001:db8:ffff::1") == 1, "v6");
+	fail_unless(bypass_t_addr(bp, "2001:db9::") == 0, "v6 above");
+	fail_unless(bypass_t_addr(bp, "::ffff:10.2.3.4") == 1, "v4 mapped");
+	fail_unless(bypass_t_addr(bp, "::a02:304") == 0, "v4 compatible");
+	fail_unless(bypass_t_addr(bp, "0.0.0.0") == 0, "zero");
+	fail_unless(bypass_match_sni(bp, "10.1.2.3") == 0,
+	            "address matched as name");
+	bypass_free(bp);
+}
+END_TEST
+
+START_TEST(bypass_03)
+{
+	bypass_t *bp;
+
+	bp = bypass_new();
+	fail_unless(bypass_add(bp, "0.0.0.0/0") == 0, "add failed");
+	fail_unless(bypass_compile(bp) == 0, "compile failed");
+	fail_unless(bypass_t_addr(bp, "255.255.255.255") == 1, "v4 any");
+	fail_unless(bypass_t_addr(bp, "::1") == 0, "v6 matched v4 any");
+	bypass_free(bp);
+
+	bp = bypass_new();
+	fail_unless(bypass_add(bp, "::/0") == 0, "add failed");
+	fail_unless(bypass_compile(bp) == 0, "compile failed");
+	fail_unless(bypass_t_addr(bp, "::") == 1, "v6 any low");
+	fail_unless(bypass_t_addr(bp, "ffff:ffff:ffff:ffff:ffff:ffff:ffff:"
+	                              "ffff") == 1, "v6 any high");
+	fail_unless(bypass_t_addr(bp, "1.2.3.4") == 1, "v4 in v6 any");
+	bypass_free(bp);
+}
+END_TEST
+
+START_TEST(bypass_04)
+{
+	bypass_t *bp;
+
+	bp = bypass_new();
+	errno = 0;
+	fail_unless(bypass_add(bp, "10.0.0.0/33") == -1, "bad prefix");
+	fail_unless(errno == EINVAL, "wrong errno");
+	fail_unless(bypass_add(bp, "::/129") == -1, "bad v6 prefix");
+	fail_unless(bypass_add(bp, "10.0.0.0/") == -1, "empty prefix");
+	fail_unless(bypass_add(bp, "a.*.example") == -1, "inner wildcard");
+	fail_unless(bypass_add(bp, "a..example") == -1, "empty label");
+	fail_unless(bypass_add(bp, "*.") == -1, "empty wildcard");
+	fail_unless(bypass_add(bp, " , ") == -1, "no entries");
+	fail_unless(bypass_names(bp) == 0 && bypass_nets(bp) == 0,
+	            "invalid entries added");
+	bypass_free(bp);
+}
+END_TEST
+
+START_TEST(bypass_05)
+{
+	char path[] = "/tmp/sslsplit.test.XXXXXX";
+	bypass_t *bp;
+	FILE *f;
+	int fd;
+
+	fd = mkstemp(path);
+	fail_unless(fd != -1, "mkstemp failed");
+	f = fdopen(fd, "w");
+	fprintf(f, "# pinned\n\n  bank.example  # comment\n"
+	           "198.51.100.0/24, pinned.org\r\n");
+	fclose(f);
+
+	bp = bypass_new();
+	fail_unless(bypass_load(bp, path) == 0, "load failed");
+	fail_unless(bypass_compile(bp) == 0, "compile failed");
+	fail_unless(bypass_names(bp) == 2, "wrong number of names");
+	fail_unless(bypass_nets(bp) == 1, "wrong number of nets");
+	fail_unless(bypass_match_sni(bp, "x.pinned.org") == 1, "name");
+	fail_unless(bypass_t_addr(bp, "198.51.100.99") == 1, "net");
+
+	f = fopen(path, "w");
+	fprintf(f, "ok.example\n10.0.0.0/40\n");
+	fclose(f);
+	errno = 0;
+	fail_unless(bypass_load(bp, path) == -1, "bad file loaded");
+	fail_unless(errno == EINVAL, "wrong errno");
+	unlink(path);
+	errno = 0;
+	fail_unless(bypass_load(bp, path) == -1, "missing file loaded");
+	fail_unless(errno == ENOENT, "wrong errno for missing file");
+	bypass_free(bp);
+}
+END_TEST
+
+Suite *
+bypass_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("bypass");
+
+	tc = tcase_create("bypass");
+	tcase_add_test(tc, bypass_01);
+	tcase_add_test(tc, bypass_02);
+	tcase_add_test(tc, bypass_03);
+	tcase_add_test(tc, bypass_04);
+	tcase_add_test(tc, bypass_05);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
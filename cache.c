@@ -29,13 +29,445 @@
 #include "cache.h"
 
 #include "log.h"
+#include "mempool.h"
+#include "stats.h"
+#include "usdt.h"
 #include "khash.h"
 
+#include <string.h>
+#include <limits.h>
 #include <pthread.h>
 
 /*
  * Generic, thread-safe cache.
+ *
+ * The cache is split into CACHE_SHARDS independent hash maps, each protected
+ * by its own reader/writer lock.  Keys are assigned to shards by the high
+ * bits of a multiplicative hash over the key hash; the maps themselves index
+ * their buckets by the low bits of the key hash, so shard selection does not
+ * degrade the distribution within shards.  Lookups only take the read lock,
+ * except for evicting an entry found to be invalid.
+ *
+ * The size of each shard can be bounded by number of entries and by bytes,
+ * as reported by the optional size callback.  When a shard exceeds either
+ * limit, entries are evicted using the CLOCK approximation of LRU:  all
+ * entries of a shard form a ring, lookups set the referenced bit of an entry
+ * (which is safe under the read lock), and the clock hand sweeps the ring,
+ * clearing referenced bits and evicting the first unreferenced entry.
+ *
+ * If the backend provides the full and resize callbacks, shards grow
+ * incrementally instead of rehashing all entries at once inside a write:
+ * when the map of a shard is about to rehash, a new map of twice the size is
+ * swapped in, and the entries of the previous map are migrated by up to
+ * CACHE_MIGRATE_CHUNK buckets per write and garbage collection chunk.
+ * Lookups consult both maps while a shard is growing.
+ *
+ * The map values as seen by the backend callbacks are cache_entry_t pointers
+ * wrapping the actual values.
+ *
+ * Optionally, a small direct-mapped L1 table per thread sits in front of the
+ * shards, such that lookups of hot keys do not touch any shared lock.  Each
+ * L1 slot holds its own copy of the key and its own reference to the value,
+ * and records the generation of the shard it was filled from.  Deleting or
+ * replacing entries and flushing bump the generation of the affected shards,
+ * invalidating all L1 slots filled from them.  Eviction and garbage
+ * collection do not; values are verified on every L1 hit instead, and hot
+ * entries may thus outlive their eviction from the shards in L1.  The L1
+ * tables are self-contained, such that they can be freed on thread exit.
+ *
+ * If the backend provides the demote callback, entries are kept in two
+ * tiers:  entries that went CACHE_IDLE_PASSES garbage collection passes
+ * without being looked up are replaced by a compact representation of their
+ * value returned by the demote callback, which the backend must be able to
+ * verify, free and size like any other value.  The next lookup of a demoted
+ * entry gets a decoded value from the unpack callback as usual, which is then
+ * also stored back into the entry under the write lock, promoting it to the
+ * hot tier again.  L1 hits do not count as lookups of the entry.
+ *
+ * If the backend sets ttl_passes, entries expire after going ttl_passes
+ * garbage collection passes without being looked up, doubled for each pass
+ * in which the entry was looked up, up to CACHE_TTL_MAXHITS passes; within
+ * the lifetime enforced by the unpack callback, entries that keep getting
+ * hits thus stay around, while entries looked up rarely or never expire
+ * early.  Eviction uses the same counts:  the clock hand decrements the
+ * count of an unreferenced entry instead of evicting it while it is nonzero.
+ * Completing a pass over a shard also bumps its generation, such that hot
+ * entries served from L1 are looked up in the shard once per pass.
+ */
+
+typedef struct cache_entry {
+	cache_val_t val;
+	cache_key_t key;
+	size_t sz;
+	unsigned int ref;
+	unsigned short idle;		/* GC passes without lookup */
+	unsigned char cold;		/* val is demoted */
+	unsigned char hits;		/* GC passes with lookups, for TTL */
+	struct cache_entry *prev;
+	struct cache_entry *next;
+} cache_entry_t;
+
+typedef struct cache_l1_entry {
+	cache_key_t key;		/* NULL if slot is empty */
+	cache_val_t val;
+	unsigned int hash;
+	unsigned int gen;
+} cache_l1_entry_t;
+
+typedef struct cache_l1 {
+	size_t mask;
+	cache_free_key_cb_t free_key_cb;
+	cache_free_val_cb_t free_val_cb;
+	cache_l1_entry_t slot[];
+} cache_l1_t;
+
+static unsigned int
+cache_shardidx(unsigned int hash)
+{
+	unsigned int h = hash * 2654435761U;
+
+	return h >> (sizeof(h) * 8 - CACHE_SHARD_BITS);
+}
+
+static cache_shard_t *
+cache_shard(cache_t *cache, cache_key_t key)
+{
+	return &cache->shard[cache_shardidx(cache->hash_cb(key))];
+}
+
+/*
+ * Invalidate all L1 slots filled from shard.
+ * Caller must hold the write lock of the shard.
+ */
+static void
+cache_shard_bump(cache_t *cache, cache_shard_t *shard)
+{
+	__atomic_add_fetch(&cache->gen[shard - cache->shard], 1,
+	                   __ATOMIC_RELEASE);
+}
+
+static void
+cache_l1_clear(cache_l1_t *l1, cache_l1_entry_t *le)
+{
+	if (!le->key)
+		return;
+	l1->free_key_cb(le->key);
+	l1->free_val_cb(le->val);
+	le->key = NULL;
+	le->val = NULL;
+}
+
+static void
+cache_l1_free(void *arg)
+{
+	cache_l1_t *l1 = arg;
+
+	for (size_t i = 0; i <= l1->mask; i++)
+		cache_l1_clear(l1, &l1->slot[i]);
+	mempool_huge_free(l1);
+}
+
+/*
+ * Return the L1 table of the calling thread, creating it on first use.
+ * Returns NULL if L1 is disabled for cache or on allocation failure.
+ */
+static cache_l1_t *
+cache_l1(cache_t *cache)
+{
+	cache_l1_t *l1;
+
+	if (!cache->l1slots)
+		return NULL;
+	if ((l1 = pthread_getspecific(cache->l1key)))
+		return l1;
+	if (!(l1 = mempool_huge_calloc(1, sizeof(cache_l1_t) +
+	               cache->l1slots * sizeof(cache_l1_entry_t))))
+		return NULL;
+	l1->mask = cache->l1slots - 1;
+	l1->free_key_cb = cache->free_key_cb;
+	l1->free_val_cb = cache->free_val_cb;
+	if (pthread_setspecific(cache->l1key, l1)) {
+		mempool_huge_free(l1);
+		return NULL;
+	}
+	return l1;
+}
+
+/*
+ * Fill L1 slot le with a copy of key and a new reference to val, which was
+ * found in a shard at generation gen.
  */
+static void
+cache_l1_fill(cache_t *cache, cache_l1_t *l1, cache_l1_entry_t *le,
+              cache_key_t key, unsigned int hash, unsigned int gen,
+              cache_val_t val)
+{
+	cache_key_t k;
+	cache_val_t v;
+
+	cache_l1_clear(l1, le);
+	if (!(k = cache->dup_key_cb(key)))
+		return;
+	if (!(v = cache->unpackverify_val_cb(val, 1))) {
+		cache->free_key_cb(k);
+		return;
+	}
+	le->key = k;
+	le->val = v;
+	le->hash = hash;
+	le->gen = gen;
+}
+
+/*
+ * Link entry e into the ring of shard, just behind the clock hand such that
+ * it will be visited last.  Caller must hold the write lock of the shard.
+ */
+static void
+cache_shard_link(cache_shard_t *shard, cache_entry_t *e)
+{
+	if (!shard->hand) {
+		e->prev = e->next = e;
+		shard->hand = e;
+	} else {
+		e->next = shard->hand;
+		e->prev = shard->hand->prev;
+		e->prev->next = e;
+		shard->hand->prev = e;
+	}
+	shard->entries++;
+	shard->bytes += e->sz;
+}
+
+/*
+ * Unlink entry e from the ring of shard.
+ * Caller must hold the write lock of the shard.
+ */
+static void
+cache_shard_unlink(cache_shard_t *shard, cache_entry_t *e)
+{
+	if (e->next == e) {
+		shard->hand = NULL;
+	} else {
+		e->prev->next = e->next;
+		e->next->prev = e->prev;
+		if (shard->hand == e)
+			shard->hand = e->next;
+	}
+	shard->entries--;
+	shard->bytes -= e->sz;
+}
+
+/*
+ * Delete the entry at iterator it of map, which is one of the maps of shard.
+ * Caller must hold the write lock of the shard.
+ */
+static void
+cache_shard_del(cache_t *cache, cache_shard_t *shard, cache_map_t map,
+                khiter_t it)
+{
+	cache_entry_t *e = cache->get_val_cb(map, it);
+
+	cache_shard_unlink(shard, e);
+	cache->free_val_cb(e->val);
+	cache->free_key_cb(cache->get_key_cb(map, it));
+	cache->del_cb(map, it);
+	mempool_huge_free(e);
+}
+
+/*
+ * Look up key in the map of shard and, while growing, in its previous map.
+ * Sets *map to the map the key was found in, or the map of shard if none.
+ * Returns the iterator, or the end iterator of *map if not found.
+ * Caller must hold the read or write lock of the shard.
+ */
+static khiter_t
+cache_shard_get(cache_t *cache, cache_shard_t *shard, cache_key_t key,
+                cache_map_t *map)
+{
+	khiter_t it;
+
+	*map = shard->map;
+	it = cache->get_cb(shard->map, key);
+	if (it != cache->end_cb(shard->map) || !shard->oldmap)
+		return it;
+	it = cache->get_cb(shard->oldmap, key);
+	if (it == cache->end_cb(shard->oldmap))
+		return cache->end_cb(shard->map);
+	*map = shard->oldmap;
+	return it;
+}
+
+/*
+ * Move the entry at iterator it of the previous map of shard to its map.
+ * The map is sized such that this does not rehash it.
+ * Caller must hold the write lock of the shard.
+ */
+static void
+cache_shard_move(cache_t *cache, cache_shard_t *shard, khiter_t it)
+{
+	cache_entry_t *e = cache->get_val_cb(shard->oldmap, it);
+	khiter_t newit;
+	int ret;
+
+	newit = cache->put_cb(shard->map, e->key, &ret);
+	cache->set_val_cb(shard->map, newit, e);
+	cache->del_cb(shard->oldmap, it);
+}
+
+/*
+ * Migrate up to n buckets of the previous map of shard, if any, to its map,
+ * and free the previous map once done.
+ * Caller must hold the write lock of the shard.
+ */
+static void
+cache_shard_migrate(cache_t *cache, cache_shard_t *shard, size_t n)
+{
+	cache_iter_t it, end;
+
+	if (!shard->oldmap)
+		return;
+	end = cache->end_cb(shard->oldmap);
+	for (it = shard->migrate_it; it != end && n > 0; it++, n--) {
+		if (cache->exist_cb(shard->oldmap, it))
+			cache_shard_move(cache, shard, it);
+	}
+	shard->migrate_it = it;
+	if (it == end) {
+		cache->map_free_cb(shard->oldmap);
+		shard->oldmap = NULL;
+	}
+}
+
+/*
+ * Before inserting into shard, swap in a map of twice the size if the map
+ * would otherwise rehash on insert.  Falls back to letting the map rehash
+ * if the new map cannot be allocated.
+ * Caller must hold the write lock of the shard.
+ */
+static void
+cache_shard_grow(cache_t *cache, cache_shard_t *shard)
+{
+	cache_map_t map;
+
+	/* small maps are cheap to rehash in place */
+	if (!cache->full_cb || shard->entries < CACHE_MIGRATE_CHUNK ||
+	    !cache->full_cb(shard->map))
+		return;
+	/* inserts outpaced migration; finish it in one go */
+	cache_shard_migrate(cache, shard, (size_t)-1);
+	if (!cache->full_cb(shard->map))
+		return;
+	if (!(map = cache->map_new_cb()))
+		return;
+	if (cache->resize_cb(map, 2 * (shard->entries + 1)) == -1) {
+		cache->map_free_cb(map);
+		return;
+	}
+	shard->oldmap = shard->map;
+	shard->migrate_it = cache->begin_cb(shard->oldmap);
+	shard->map = map;
+}
+
+/*
+ * Update the size of entry e of shard after replacing its value.
+ * Caller must hold the write lock of the shard.
+ */
+static void
+cache_shard_resize(cache_t *cache, cache_shard_t *shard, cache_entry_t *e)
+{
+	size_t sz = cache->size_cb ? cache->size_cb(e->key, e->val) : 0;
+
+	shard->bytes -= e->sz;
+	shard->bytes += sz;
+	e->sz = sz;
+}
+
+/*
+ * Count a garbage collection pass in which entry e was looked up.
+ * May be called under the read lock of the shard; concurrent lookups may
+ * overshoot CACHE_TTL_MAXHITS, which users of the count must allow for.
+ */
+static void
+cache_entry_hit(cache_entry_t *e)
+{
+	if (__atomic_load_n(&e->hits, __ATOMIC_RELAXED) < CACHE_TTL_MAXHITS)
+		__atomic_add_fetch(&e->hits, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Number of idle garbage collection passes after which entry e expires.
+ */
+static size_t
+cache_entry_ttl(cache_t *cache, cache_entry_t *e)
+{
+	unsigned int hits = e->hits;
+
+	if (hits > CACHE_TTL_MAXHITS)
+		hits = CACHE_TTL_MAXHITS;
+	return (size_t)cache->ttl_passes << hits;
+}
+
+/*
+ * Age entry e of shard by one garbage collection pass.  Returns 1 if the
+ * entry has outlived its time to live and must be deleted by the caller.
+ * Otherwise, demotes the entry once it has been idle for CACHE_IDLE_PASSES
+ * passes, retrying every CACHE_IDLE_PASSES passes on failure.  L1 slots keep
+ * their own reference to the previous value and are therefore left alone.
+ * Caller must hold the write lock of the shard.
+ */
+static int
+cache_shard_age(cache_t *cache, cache_shard_t *shard, cache_entry_t *e)
+{
+	cache_val_t val;
+
+	if (e->idle < USHRT_MAX)
+		e->idle++;
+	if (cache->ttl_passes && e->idle >= cache_entry_ttl(cache, e))
+		return 1;
+	if (!cache->demote_val_cb || e->cold || e->idle % CACHE_IDLE_PASSES)
+		return 0;
+	if (!(val = cache->demote_val_cb(e->val)))
+		return 0;
+	cache->free_val_cb(e->val);
+	e->val = val;
+	e->cold = 1;
+	cache_shard_resize(cache, shard, e);
+	if (cache->stats != -1)
+		stats_inc(STATS_CACHE(cache->stats, STATS_DEMOTE));
+	return 0;
+}
+
+/*
+ * Evict entries from shard until it is within its limits again.
+ * Caller must hold the write lock of the shard.
+ */
+static void
+cache_shard_evict(cache_t *cache, cache_shard_t *shard)
+{
+	cache_entry_t *e;
+	cache_map_t map;
+	khiter_t it;
+
+	while (shard->hand &&
+	       ((shard->maxentries && shard->entries > shard->maxentries) ||
+	        (shard->maxbytes && shard->bytes > shard->maxbytes))) {
+		e = shard->hand;
+		if (e->ref) {
+			e->ref = 0;
+			shard->hand = e->next;
+			continue;
+		}
+		if (cache->ttl_passes && e->hits) {
+			e->hits--;
+			shard->hand = e->next;
+			continue;
+		}
+		it = cache_shard_get(cache, shard, e->key, &map);
+		cache_shard_del(cache, shard, map, it);
+		if (cache->stats != -1)
+			stats_inc(STATS_CACHE(cache->stats, STATS_EVICT));
+	}
+}
 
 /*
  * Create a new cache based on the initializer callback init_cb.
@@ -44,17 +476,31 @@ cache_t *
 cache_new(cache_init_cb_t init_cb)
 {
 	cache_t *cache;
+	int i;
 
 	if (!(cache = malloc(sizeof(cache_t))))
 		return NULL;
-
-	if (pthread_mutex_init(&cache->mutex, NULL)) {
-		free(cache);
-		return NULL;
-	}
+	memset(cache, 0, sizeof(cache_t));
+	cache->stats = -1;
 
 	init_cb(cache);
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		if (pthread_rwlock_init(&cache->shard[i].lock, NULL))
+			goto errout;
+		if (!(cache->shard[i].map = cache->map_new_cb())) {
+			pthread_rwlock_destroy(&cache->shard[i].lock);
+			goto errout;
+		}
+	}
 	return cache;
+
+errout:
+	while (--i >= 0) {
+		cache->map_free_cb(cache->shard[i].map);
+		pthread_rwlock_destroy(&cache->shard[i].lock);
+	}
+	free(cache);
+	return NULL;
 }
 
 /*
@@ -63,7 +509,11 @@ cache_new(cache_init_cb_t init_cb)
 int
 cache_reinit(cache_t *cache)
 {
-	return pthread_mutex_init(&cache->mutex, NULL) ? -1 : 0;
+	for (int i = 0; i < CACHE_SHARDS; i++) {
+		if (pthread_rwlock_init(&cache->shard[i].lock, NULL))
+			return -1;
+	}
+	return 0;
 }
 
 /*
@@ -73,97 +523,551 @@ cache_reinit(cache_t *cache)
 void
 cache_free(cache_t *cache)
 {
+	cache_shard_t *shard;
+	cache_entry_t *e;
 	khiter_t it;
 
-	for (it = cache->begin_cb(); it != cache->end_cb(); it++) {
-		if (cache->exist_cb(it)) {
-			cache->free_key_cb(cache->get_key_cb(it));
-			cache->free_val_cb(cache->get_val_cb(it));
+	if (cache->l1slots) {
+		/* L1 tables of other threads are freed on their exit */
+		cache_l1_t *l1 = pthread_getspecific(cache->l1key);
+		if (l1)
+			cache_l1_free(l1);
+		pthread_key_delete(cache->l1key);
+	}
+	for (int i = 0; i < CACHE_SHARDS; i++) {
+		shard = &cache->shard[i];
+		cache_shard_migrate(cache, shard, (size_t)-1);
+		for (it = cache->begin_cb(shard->map);
+		     it != cache->end_cb(shard->map); it++) {
+			if (cache->exist_cb(shard->map, it)) {
+				e = cache->get_val_cb(shard->map, it);
+				cache->free_key_cb(cache->get_key_cb(
+				                   shard->map, it));
+				cache->free_val_cb(e->val);
+				mempool_huge_free(e);
+			}
 		}
+		cache->map_free_cb(shard->map);
+		pthread_rwlock_destroy(&shard->lock);
 	}
-	cache->fini_cb();
-	pthread_mutex_destroy(&cache->mutex);
 	free(cache);
 }
 
+/*
+ * Limit the cache to maxentries entries and maxbytes bytes as reported by
+ * the size callback; 0 means unlimited.  The limits are split evenly across
+ * shards and enforced per shard, evicting entries immediately if necessary.
+ */
+void
+cache_set_limits(cache_t *cache, size_t maxentries, size_t maxbytes)
+{
+	cache_shard_t *shard;
+
+	for (int i = 0; i < CACHE_SHARDS; i++) {
+		shard = &cache->shard[i];
+		STATS_RWLOCK_WRLOCK(&shard->lock, STATS_LOCK_CACHE);
+		shard->maxentries = maxentries ?
+		                    (maxentries + CACHE_SHARDS - 1) /
+		                    CACHE_SHARDS : 0;
+		shard->maxbytes = maxbytes ?
+		                  (maxbytes + CACHE_SHARDS - 1) /
+		                  CACHE_SHARDS : 0;
+		cache_shard_evict(cache, shard);
+		STATS_RWLOCK_UNLOCK(&shard->lock, STATS_LOCK_CACHE);
+	}
+}
+
+/*
+ * Enable per-thread L1 front caches of slots entries, rounded down to a power
+ * of two.  Requires the equal_key and dup_key callbacks, and values for which
+ * the unpackverify callback returns the stored value itself.  L1 stays
+ * disabled if no thread-specific data key is available.
+ * Must be called before the cache is used by multiple threads.
+ */
+void
+cache_l1_setup(cache_t *cache, size_t slots)
+{
+	size_t n = 1;
+
+	if (cache->l1slots || !slots ||
+	    !cache->equal_key_cb || !cache->dup_key_cb)
+		return;
+	while (n <= slots / 2)
+		n <<= 1;
+	if (pthread_key_create(&cache->l1key, cache_l1_free) == 0)
+		cache->l1slots = n;
+}
+
+/*
+ * Size the maps of all shards for a total of entries entries up front, such
+ * that they do not need to grow until then.  No-op for backends without
+ * resize callback.  Meant to be called before the cache is populated, since
+ * resizing a populated map rehashes it at once.
+ */
+void
+cache_presize(cache_t *cache, size_t entries)
+{
+	cache_shard_t *shard;
+
+	if (!cache->resize_cb || !entries)
+		return;
+	for (int i = 0; i < CACHE_SHARDS; i++) {
+		shard = &cache->shard[i];
+		STATS_RWLOCK_WRLOCK(&shard->lock, STATS_LOCK_CACHE);
+		cache_shard_migrate(cache, shard, (size_t)-1);
+		if (cache->resize_cb(shard->map, (entries + CACHE_SHARDS - 1) /
+		                                 CACHE_SHARDS) == -1)
+			log_err_printf("Warning: failed to presize cache\n");
+		STATS_RWLOCK_UNLOCK(&shard->lock, STATS_LOCK_CACHE);
+	}
+}
+
+/*
+ * Return the number of entries in the cache.
+ */
+size_t
+cache_entries(cache_t *cache)
+{
+	size_t n = 0;
+
+	for (int i = 0; i < CACHE_SHARDS; i++) {
+		STATS_RWLOCK_RDLOCK(&cache->shard[i].lock, STATS_LOCK_CACHE);
+		n += cache->shard[i].entries;
+		STATS_RWLOCK_UNLOCK(&cache->shard[i].lock, STATS_LOCK_CACHE);
+	}
+	return n;
+}
+
+/*
+ * Return the number of bytes in the cache, as reported by the size callback.
+ */
+size_t
+cache_bytes(cache_t *cache)
+{
+	size_t n = 0;
+
+	for (int i = 0; i < CACHE_SHARDS; i++) {
+		STATS_RWLOCK_RDLOCK(&cache->shard[i].lock, STATS_LOCK_CACHE);
+		n += cache->shard[i].bytes;
+		STATS_RWLOCK_UNLOCK(&cache->shard[i].lock, STATS_LOCK_CACHE);
+	}
+	return n;
+}
+
+/*
+ * Call cb for the key and value of every valid entry of the cache, shard by
+ * shard under the read lock.  The callback must not call back into the cache
+ * and must take its own reference if it keeps the value.  Iteration stops
+ * early if the callback returns non-zero, which is then returned.
+ * Values of demoted entries are passed in their compact representation.
+ */
+int
+cache_foreach(cache_t *cache, cache_foreach_cb_t cb, void *arg)
+{
+	cache_shard_t *shard;
+	cache_entry_t *e;
+	int rv = 0;
+
+	for (int i = 0; i < CACHE_SHARDS && !rv; i++) {
+		shard = &cache->shard[i];
+		STATS_RWLOCK_RDLOCK(&shard->lock, STATS_LOCK_CACHE);
+		e = shard->hand;
+		if (e) {
+			do {
+				if (cache->unpackverify_val_cb(e->val, 0) &&
+				    (rv = cb(e->key, e->val, arg)))
+					break;
+				e = e->next;
+			} while (e != shard->hand);
+		}
+		STATS_RWLOCK_UNLOCK(&shard->lock, STATS_LOCK_CACHE);
+	}
+	return rv;
+}
+
+/*
+ * Gather hash quality metrics over all entries of the cache:  the number of
+ * entries not stored in the bucket their hash maps to, the sum of the probe
+ * lengths of all entries and the longest probe length, where the probe length
+ * is the number of buckets a lookup visits beyond the first.  This walks the
+ * probe sequence of every entry and is meant for on-demand reporting only.
+ * All maps are khash maps, whose end iterator is the number of buckets.
+ */
+static void
+cache_map_probes(cache_t *cache, cache_map_t map, size_t *collisions,
+                 size_t *probes, size_t *maxprobe)
+{
+	cache_iter_t nbuckets, mask;
+
+	nbuckets = cache->end_cb(map);
+	mask = nbuckets - 1;
+	for (cache_iter_t it = cache->begin_cb(map); it != nbuckets; it++) {
+		cache_iter_t j, step = 0;
+
+		if (!cache->exist_cb(map, it))
+			continue;
+		j = cache->hash_cb(cache->get_key_cb(map, it)) & mask;
+		while (j != it && step < nbuckets)
+			j = (j + (++step)) & mask;
+		if (step) {
+			(*collisions)++;
+			*probes += step;
+			if (step > *maxprobe)
+				*maxprobe = step;
+		}
+	}
+}
+
+void
+cache_probes(cache_t *cache, size_t *collisions, size_t *probes,
+             size_t *maxprobe)
+{
+	*collisions = *probes = *maxprobe = 0;
+	for (int i = 0; i < CACHE_SHARDS; i++) {
+		cache_shard_t *shard = &cache->shard[i];
+
+		STATS_RWLOCK_RDLOCK(&shard->lock, STATS_LOCK_CACHE);
+		cache_map_probes(cache, shard->map,
+		                 collisions, probes, maxprobe);
+		if (shard->oldmap)
+			cache_map_probes(cache, shard->oldmap,
+			                 collisions, probes, maxprobe);
+		STATS_RWLOCK_UNLOCK(&shard->lock, STATS_LOCK_CACHE);
+	}
+}
+
+/*
+ * Garbage collect at most CACHE_GC_CHUNK buckets of shard, starting at
+ * bucket it, under a single acquisition of the write lock.
+ * Returns the bucket to continue at, or the end iterator of the shard's map
+ * once the whole shard has been scanned.
+ */
+static khiter_t
+cache_gc_chunk(cache_t *cache, cache_shard_t *shard, khiter_t it)
+{
+	cache_entry_t *e;
+	khiter_t end;
+
+	STATS_RWLOCK_WRLOCK(&shard->lock, STATS_LOCK_CACHE);
+	cache_shard_migrate(cache, shard, CACHE_GC_CHUNK);
+	/* the map may have shrunk or been resized since the last chunk */
+	if (it < cache->begin_cb(shard->map))
+		it = cache->begin_cb(shard->map);
+	end = cache->end_cb(shard->map);
+	if (it > end)
+		it = end;
+	if (end - it > CACHE_GC_CHUNK)
+		end = it + CACHE_GC_CHUNK;
+	for (; it != end; it++) {
+		if (cache->exist_cb(shard->map, it)) {
+			e = cache->get_val_cb(shard->map, it);
+			if (!cache->unpackverify_val_cb(e->val, 0)) {
+				cache_shard_del(cache, shard, shard->map, it);
+			} else if ((cache->demote_val_cb ||
+			            cache->ttl_passes) &&
+			           cache_shard_age(cache, shard, e)) {
+				cache_shard_del(cache, shard, shard->map, it);
+				if (cache->stats != -1)
+					stats_inc(STATS_CACHE(cache->stats,
+					                      STATS_EXPIRE));
+			}
+		}
+	}
+	if (it == cache->end_cb(shard->map)) {
+		it = (khiter_t)-1;
+		if (cache->ttl_passes)
+			cache_shard_bump(cache, shard);
+	}
+	STATS_RWLOCK_UNLOCK(&shard->lock, STATS_LOCK_CACHE);
+	return it;
+}
+
+/*
+ * Garbage collect the whole cache in one go, but without holding any shard
+ * lock for longer than it takes to scan CACHE_GC_CHUNK buckets.
+ */
 void
 cache_gc(cache_t *cache)
 {
 	khiter_t it;
-	cache_val_t val;
 
-	pthread_mutex_lock(&cache->mutex);
-	for (it = cache->begin_cb(); it != cache->end_cb(); it++) {
-		if (cache->exist_cb(it)) {
-			val = cache->get_val_cb(it);
-			if (!cache->unpackverify_val_cb(val, 0)) {
-				cache->free_val_cb(val);
-				cache->free_key_cb(cache->get_key_cb(it));
-				cache->del_cb(it);
+	for (int i = 0; i < CACHE_SHARDS; i++) {
+		it = 0;
+		while ((it = cache_gc_chunk(cache, &cache->shard[i], it))
+		       != (khiter_t)-1);
+	}
+}
+
+/*
+ * Remove all entries from the cache, shard by shard.  Entries inserted
+ * concurrently into shards that have already been flushed are retained.
+ */
+void
+cache_flush(cache_t *cache)
+{
+	for (int i = 0; i < CACHE_SHARDS; i++) {
+		cache_shard_t *shard = &cache->shard[i];
+
+		STATS_RWLOCK_WRLOCK(&shard->lock, STATS_LOCK_CACHE);
+		cache_shard_migrate(cache, shard, (size_t)-1);
+		for (khiter_t it = cache->begin_cb(shard->map);
+		     it != cache->end_cb(shard->map); it++) {
+			if (cache->exist_cb(shard->map, it))
+				cache_shard_del(cache, shard, shard->map, it);
+		}
+		cache_shard_bump(cache, shard);
+		STATS_RWLOCK_UNLOCK(&shard->lock, STATS_LOCK_CACHE);
+	}
+}
+
+/*
+ * Incrementally garbage collect the cache, scanning at most budget buckets
+ * across shards, continuing where the previous call left off.
+ * Returns 1 if a full pass over all shards was completed by this call,
+ * 0 otherwise.
+ * Multiple concurrent callers of cache_gc_step() on the same cache are not
+ * supported, but concurrent cache accesses are.
+ */
+int
+cache_gc_step(cache_t *cache, size_t budget)
+{
+	khiter_t it;
+	int done = 0;
+
+	while (budget > 0) {
+		it = cache_gc_chunk(cache, &cache->shard[cache->gc_shard],
+		                    cache->gc_it);
+		if (it == (khiter_t)-1) {
+			cache->gc_it = 0;
+			if (++cache->gc_shard == CACHE_SHARDS) {
+				cache->gc_shard = 0;
+				done = 1;
+				break;
 			}
+		} else {
+			cache->gc_it = it;
+		}
+		budget = budget > CACHE_GC_CHUNK ? budget - CACHE_GC_CHUNK : 0;
+	}
+	return done;
+}
+
+/*
+ * Promote the entry for key, if it still holds the demoted value cval, by
+ * replacing it with a new reference to the decoded value val.
+ */
+static void
+cache_shard_promote(cache_t *cache, cache_shard_t *shard, cache_key_t key,
+                    cache_val_t cval, cache_val_t val)
+{
+	cache_entry_t *e;
+	cache_map_t map;
+	khiter_t it;
+
+	STATS_RWLOCK_WRLOCK(&shard->lock, STATS_LOCK_CACHE);
+	it = cache_shard_get(cache, shard, key, &map);
+	if (it != cache->end_cb(map)) {
+		e = cache->get_val_cb(map, it);
+		if (e->cold && e->val == cval &&
+		    (val = cache->unpackverify_val_cb(val, 1))) {
+			cache->free_val_cb(e->val);
+			e->val = val;
+			e->cold = 0;
+			e->idle = 0;
+			cache_entry_hit(e);
+			cache_shard_resize(cache, shard, e);
+			cache_shard_evict(cache, shard);
 		}
 	}
-	pthread_mutex_unlock(&cache->mutex);
+	STATS_RWLOCK_UNLOCK(&shard->lock, STATS_LOCK_CACHE);
 }
 
+/*
+ * Look up key without taking ownership of it, such that the key can live on
+ * the stack of the caller.  Keys are only copied to the heap on insert.
+ */
 cache_val_t
-cache_get(cache_t *cache, cache_key_t key)
+cache_get_borrowed(cache_t *cache, cache_key_t key)
 {
-	cache_val_t rval = NULL;
+	cache_shard_t *shard;
+	cache_entry_t *e;
+	cache_val_t rval = NULL, cval = NULL;
+	cache_l1_t *l1;
+	cache_l1_entry_t *le = NULL;
+	cache_map_t map;
 	khiter_t it;
+	unsigned int h, i, gen;
+	int invalid = 0;
 
 	if (!key)
 		return NULL;
 
-	pthread_mutex_lock(&cache->mutex);
-	it = cache->get_cb(key);
-	if (it != cache->end_cb()) {
-		cache_val_t val;
-		val = cache->get_val_cb(it);
-		if (!(rval = cache->unpackverify_val_cb(val, 1))) {
-			cache->free_val_cb(val);
-			cache->free_key_cb(cache->get_key_cb(it));
-			cache->del_cb(it);
+	h = cache->hash_cb(key);
+	i = cache_shardidx(h);
+	shard = &cache->shard[i];
+	if ((l1 = cache_l1(cache))) {
+		le = &l1->slot[h & l1->mask];
+		if (le->key && le->hash == h &&
+		    cache->equal_key_cb(le->key, key)) {
+			if (le->gen == __atomic_load_n(&cache->gen[i],
+			                               __ATOMIC_ACQUIRE) &&
+			    (rval = cache->unpackverify_val_cb(le->val, 1)))
+				goto out;
+			cache_l1_clear(l1, le);
 		}
 	}
-	cache->free_key_cb(key);
-	pthread_mutex_unlock(&cache->mutex);
+
+	STATS_RWLOCK_RDLOCK(&shard->lock, STATS_LOCK_CACHE);
+	gen = __atomic_load_n(&cache->gen[i], __ATOMIC_RELAXED);
+	it = cache_shard_get(cache, shard, key, &map);
+	if (it != cache->end_cb(map)) {
+		e = cache->get_val_cb(map, it);
+		if ((rval = cache->unpackverify_val_cb(e->val, 1))) {
+			__atomic_store_n(&e->ref, 1, __ATOMIC_RELAXED);
+			if (e->cold) {
+				cval = e->val;
+			} else if (e->idle) {
+				__atomic_store_n(&e->idle, 0,
+				                 __ATOMIC_RELAXED);
+				cache_entry_hit(e);
+			}
+		} else {
+			invalid = 1;
+		}
+	}
+	STATS_RWLOCK_UNLOCK(&shard->lock, STATS_LOCK_CACHE);
+
+	if (invalid) {
+		/* entry may have been replaced or removed in the meantime */
+		STATS_RWLOCK_WRLOCK(&shard->lock, STATS_LOCK_CACHE);
+		it = cache_shard_get(cache, shard, key, &map);
+		if (it != cache->end_cb(map)) {
+			e = cache->get_val_cb(map, it);
+			if (!cache->unpackverify_val_cb(e->val, 0))
+				cache_shard_del(cache, shard, map, it);
+		}
+		STATS_RWLOCK_UNLOCK(&shard->lock, STATS_LOCK_CACHE);
+	}
+	if (cval)
+		cache_shard_promote(cache, shard, key, cval, rval);
+	if (rval && le)
+		cache_l1_fill(cache, l1, le, key, h, gen, rval);
+out:
+	if (cache->stats != -1)
+		stats_inc(STATS_CACHE(cache->stats,
+		                      rval ? STATS_HIT : STATS_MISS));
+	USDT_PROBE2(cache__get, cache->stats, rval != NULL);
 	return rval;
 }
 
+/*
+ * Look up key and free it.
+ */
+cache_val_t
+cache_get(cache_t *cache, cache_key_t key)
+{
+	cache_val_t val;
+
+	if (!key)
+		return NULL;
+	val = cache_get_borrowed(cache, key);
+	cache->free_key_cb(key);
+	return val;
+}
+
 void
 cache_set(cache_t *cache, cache_key_t key, cache_val_t val)
 {
+	cache_shard_t *shard;
+	cache_entry_t *e;
 	khiter_t it;
+	size_t sz;
 	int ret;
 
 	if (!key || !val)
 		return;
 
-	pthread_mutex_lock(&cache->mutex);
-	it = cache->put_cb(key, &ret);
+	sz = cache->size_cb ? cache->size_cb(key, val) : 0;
+	USDT_PROBE2(cache__set, cache->stats, sz);
+	shard = cache_shard(cache, key);
+	STATS_RWLOCK_WRLOCK(&shard->lock, STATS_LOCK_CACHE);
+	cache_shard_migrate(cache, shard, CACHE_MIGRATE_CHUNK);
+	cache_shard_grow(cache, shard);
+	if (shard->oldmap) {
+		/* replace entries in place in the current map only */
+		it = cache->get_cb(shard->oldmap, key);
+		if (it != cache->end_cb(shard->oldmap))
+			cache_shard_move(cache, shard, it);
+	}
+	it = cache->put_cb(shard->map, key, &ret);
 	if (!ret) {
 		cache->free_key_cb(key);
-		cache->free_val_cb(cache->get_val_cb(it));
+		e = cache->get_val_cb(shard->map, it);
+		cache->free_val_cb(e->val);
+		cache_shard_bump(cache, shard);
+		shard->bytes -= e->sz;
+		shard->bytes += sz;
+	} else {
+		if (!(e = mempool_huge_malloc(sizeof(cache_entry_t)))) {
+			cache->del_cb(shard->map, it);
+			STATS_RWLOCK_UNLOCK(&shard->lock, STATS_LOCK_CACHE);
+			cache->free_key_cb(key);
+			cache->free_val_cb(val);
+			return;
+		}
+		e->key = key;
+		e->sz = 0;
+		e->hits = 0;
+		cache_shard_link(shard, e);
+		shard->bytes += sz;
+		cache->set_val_cb(shard->map, it, e);
 	}
-	cache->set_val_cb(it, val);
-	pthread_mutex_unlock(&cache->mutex);
+	e->val = val;
+	e->sz = sz;
+	e->ref = 1;
+	e->idle = 0;
+	e->cold = 0;
+	cache_shard_evict(cache, shard);
+	STATS_RWLOCK_UNLOCK(&shard->lock, STATS_LOCK_CACHE);
 }
 
-void
-cache_del(cache_t *cache, cache_key_t key)
+/*
+ * Remove key without taking ownership of it, see cache_get_borrowed().
+ * Returns 1 if key was removed, 0 if it was not in the cache; of several
+ * threads removing the same key, only one sees 1.
+ */
+int
+cache_del_borrowed(cache_t *cache, cache_key_t key)
 {
+	cache_shard_t *shard;
+	cache_map_t map;
 	khiter_t it;
+	int rv = 0;
+
+	if (!key)
+		return 0;
 
-	pthread_mutex_lock(&cache->mutex);
-	it = cache->get_cb(key);
-	if (it != cache->end_cb()) {
-		cache->free_val_cb(cache->get_val_cb(it));
-		cache->free_key_cb(cache->get_key_cb(it));
-		cache->del_cb(it);
+	shard = cache_shard(cache, key);
+	STATS_RWLOCK_WRLOCK(&shard->lock, STATS_LOCK_CACHE);
+	it = cache_shard_get(cache, shard, key, &map);
+	if (it != cache->end_cb(map)) {
+		cache_shard_del(cache, shard, map, it);
+		cache_shard_bump(cache, shard);
+		rv = 1;
 	}
+	cache_shard_migrate(cache, shard, CACHE_MIGRATE_CHUNK);
+	STATS_RWLOCK_UNLOCK(&shard->lock, STATS_LOCK_CACHE);
+	return rv;
+}
+
+void
+cache_del(cache_t *cache, cache_key_t key)
+{
+	if (!key)
+		return;
+
+	cache_del_borrowed(cache, key);
 	cache->free_key_cb(key);
-	pthread_mutex_unlock(&cache->mutex);
 }
 
 /* vim: set noet ft=c: */
@@ -31,29 +31,91 @@
 
 #include "attrib.h"
 
+#include <stddef.h>
 #include <pthread.h>
 
 typedef void * cache_val_t;
 typedef void * cache_key_t;
+typedef void * cache_map_t;
 typedef unsigned int cache_iter_t; /* must match khiter_t */
 
-typedef cache_iter_t (*cache_begin_cb_t)(void);
-typedef cache_iter_t (*cache_end_cb_t)(void);
-typedef int (*cache_exist_cb_t)(cache_iter_t);
-typedef void (*cache_del_cb_t)(cache_iter_t);
-typedef cache_iter_t (*cache_get_cb_t)(cache_key_t);
-typedef cache_iter_t (*cache_put_cb_t)(cache_key_t, int *);
+typedef cache_map_t (*cache_map_new_cb_t)(void);
+typedef void (*cache_map_free_cb_t)(cache_map_t);
+typedef unsigned int (*cache_hash_cb_t)(cache_key_t);
+typedef cache_iter_t (*cache_begin_cb_t)(cache_map_t);
+typedef cache_iter_t (*cache_end_cb_t)(cache_map_t);
+typedef int (*cache_exist_cb_t)(cache_map_t, cache_iter_t);
+typedef void (*cache_del_cb_t)(cache_map_t, cache_iter_t);
+typedef cache_iter_t (*cache_get_cb_t)(cache_map_t, cache_key_t);
+typedef cache_iter_t (*cache_put_cb_t)(cache_map_t, cache_key_t, int *);
 typedef void (*cache_free_key_cb_t)(cache_key_t);
 typedef void (*cache_free_val_cb_t)(cache_val_t);
-typedef cache_key_t (*cache_get_key_cb_t)(cache_iter_t);
-typedef cache_val_t (*cache_get_val_cb_t)(cache_iter_t);
-typedef void (*cache_set_val_cb_t)(cache_iter_t, cache_val_t);
+typedef cache_key_t (*cache_get_key_cb_t)(cache_map_t, cache_iter_t);
+typedef cache_val_t (*cache_get_val_cb_t)(cache_map_t, cache_iter_t);
+typedef void (*cache_set_val_cb_t)(cache_map_t, cache_iter_t, cache_val_t);
 typedef cache_val_t (*cache_unpackverify_val_cb_t)(cache_val_t, int);
-typedef void (*cache_fini_cb_t)(void);
+typedef size_t (*cache_size_cb_t)(cache_key_t, cache_val_t);
+typedef int (*cache_equal_key_cb_t)(cache_key_t, cache_key_t);
+typedef cache_key_t (*cache_dup_key_cb_t)(cache_key_t);
+typedef int (*cache_full_cb_t)(cache_map_t);
+typedef int (*cache_resize_cb_t)(cache_map_t, size_t);
+typedef int (*cache_foreach_cb_t)(cache_key_t, cache_val_t, void *);
+typedef cache_val_t (*cache_demote_val_cb_t)(cache_val_t);
+
+/*
+ * Number of shards per cache; must be a power of two.
+ */
+#define CACHE_SHARD_BITS	4
+#define CACHE_SHARDS		(1 << CACHE_SHARD_BITS)
+
+/*
+ * Maximum number of hash buckets scanned by garbage collection per write
+ * lock acquisition; bounds the time lookups can be blocked by GC.
+ */
+#define CACHE_GC_CHUNK		1024
+
+/*
+ * Number of hash buckets of the previous map of a growing shard migrated to
+ * the new map per write to the shard.
+ */
+#define CACHE_MIGRATE_CHUNK	64
+
+/*
+ * Number of slots of the per-thread L1 front caches; must be a power of two.
+ */
+#define CACHE_L1_SLOTS		512
+
+/*
+ * Number of garbage collection passes an entry must go without being looked
+ * up before it is demoted to its compact representation by the optional
+ * demote callback.
+ */
+#define CACHE_IDLE_PASSES	30
+
+/*
+ * Maximum number of garbage collection passes with lookups counted for an
+ * entry of a cache with adaptive time to live; see cache_t.ttl_passes.
+ */
+#define CACHE_TTL_MAXHITS	8
+
+typedef struct cache_shard {
+	pthread_rwlock_t lock;
+	cache_map_t map;
+	cache_map_t oldmap;		/* previous map while growing, or NULL */
+	cache_iter_t migrate_it;	/* next bucket of oldmap to migrate */
+	struct cache_entry *hand;	/* CLOCK hand over ring of entries */
+	size_t entries;
+	size_t bytes;
+	size_t maxentries;		/* 0 for unlimited */
+	size_t maxbytes;		/* 0 for unlimited */
+} cache_shard_t;
 
 typedef struct cache {
-	pthread_mutex_t mutex;
+	cache_shard_t shard[CACHE_SHARDS];
 
+	cache_map_new_cb_t map_new_cb;
+	cache_map_free_cb_t map_free_cb;
+	cache_hash_cb_t hash_cb;
 	cache_begin_cb_t begin_cb;
 	cache_end_cb_t end_cb;
 	cache_exist_cb_t exist_cb;
@@ -66,7 +128,27 @@ typedef struct cache {
 	cache_get_val_cb_t get_val_cb;
 	cache_set_val_cb_t set_val_cb;
 	cache_unpackverify_val_cb_t unpackverify_val_cb;
-	cache_fini_cb_t fini_cb;
+	cache_size_cb_t size_cb;	/* optional */
+	cache_equal_key_cb_t equal_key_cb;	/* optional, for L1 */
+	cache_dup_key_cb_t dup_key_cb;		/* optional, for L1 */
+	cache_full_cb_t full_cb;		/* optional, for growth */
+	cache_resize_cb_t resize_cb;		/* optional, for growth */
+	cache_demote_val_cb_t demote_val_cb;	/* optional, for tiering */
+
+	/* adaptive time to live in garbage collection passes, or 0 */
+	unsigned int ttl_passes;
+
+	/* STATS_CACHE_* index for hit, miss and eviction counters, or -1 */
+	int stats;
+
+	/* incremental garbage collection cursor */
+	int gc_shard;
+	cache_iter_t gc_it;
+
+	/* per-thread L1 front cache, see cache_l1_setup() */
+	pthread_key_t l1key;
+	size_t l1slots;			/* 0 if disabled */
+	unsigned int gen[CACHE_SHARDS];	/* invalidation generation per shard */
 } cache_t;
 
 typedef void (*cache_init_cb_t)(struct cache *);
@@ -74,10 +156,21 @@ typedef void (*cache_init_cb_t)(struct cache *);
 cache_t * cache_new(cache_init_cb_t) MALLOC;
 int cache_reinit(cache_t *) NONNULL(1) WUNRES;
 void cache_free(cache_t *) NONNULL(1);
+void cache_set_limits(cache_t *, size_t, size_t) NONNULL(1);
+void cache_l1_setup(cache_t *, size_t) NONNULL(1);
+void cache_presize(cache_t *, size_t) NONNULL(1);
+size_t cache_entries(cache_t *) NONNULL(1) WUNRES;
+size_t cache_bytes(cache_t *) NONNULL(1) WUNRES;
+int cache_foreach(cache_t *, cache_foreach_cb_t, void *) NONNULL(1,2);
+void cache_probes(cache_t *, size_t *, size_t *, size_t *) NONNULL(1,2,3,4);
 void cache_gc(cache_t *) NONNULL(1);
+int cache_gc_step(cache_t *, size_t) NONNULL(1);
+void cache_flush(cache_t *) NONNULL(1);
 cache_val_t cache_get(cache_t *, cache_key_t) NONNULL(1) WUNRES;
+cache_val_t cache_get_borrowed(cache_t *, cache_key_t) NONNULL(1) WUNRES;
 void cache_set(cache_t *, cache_key_t, cache_val_t) NONNULL(1);
 void cache_del(cache_t *, cache_key_t) NONNULL(1);
+int cache_del_borrowed(cache_t *, cache_key_t) NONNULL(1);
 
 #endif /* !CACHE_H */
 
@@ -0,0 +1,222 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "cachedns.h"
+
+#include "mempool.h"
+
+#define kcalloc(N,Z) mempool_huge_calloc(N,Z)
+#define kmalloc(Z) mempool_huge_malloc(Z)
+#define krealloc(P,Z) mempool_huge_realloc(P,Z)
+#define kfree(P) mempool_huge_free(P)
+#include "khash.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+
+/*
+ * Cache for DNS answers to SNI hostname lookups, shared across all connection
+ * handling threads.  Both positive and negative answers are cached until
+ * their expiry time, which is derived from the TTL of the answer.
+ *
+ * key: char *            address family and lower case hostname
+ * val: cachedns_val_t *  resolved addresses or error, expiry time
+ */
+
+KHASH_INIT(dnsmap_t, char*, void*, 1, kh_str_hash_func, kh_str_hash_equal)
+
+static cache_iter_t
+cachedns_begin_cb(UNUSED cache_map_t map)
+{
+	return kh_begin((khash_t(dnsmap_t) *)map);
+}
+
+static cache_iter_t
+cachedns_end_cb(cache_map_t map)
+{
+	return kh_end((khash_t(dnsmap_t) *)map);
+}
+
+static int
+cachedns_exist_cb(cache_map_t map, cache_iter_t it)
+{
+	return kh_exist((khash_t(dnsmap_t) *)map, it);
+}
+
+static void
+cachedns_del_cb(cache_map_t map, cache_iter_t it)
+{
+	kh_del(dnsmap_t, (khash_t(dnsmap_t) *)map, it);
+}
+
+static cache_iter_t
+cachedns_get_cb(cache_map_t map, cache_key_t key)
+{
+	return kh_get(dnsmap_t, (khash_t(dnsmap_t) *)map, key);
+}
+
+static cache_iter_t
+cachedns_put_cb(cache_map_t map, cache_key_t key, int *ret)
+{
+	return kh_put(dnsmap_t, (khash_t(dnsmap_t) *)map, key, ret);
+}
+
+static void
+cachedns_free_key_cb(cache_key_t key)
+{
+	free(key);
+}
+
+static void
+cachedns_free_val_cb(cache_val_t val)
+{
+	free(val);
+}
+
+static cache_key_t
+cachedns_get_key_cb(cache_map_t map, cache_iter_t it)
+{
+	return kh_key((khash_t(dnsmap_t) *)map, it);
+}
+
+static cache_val_t
+cachedns_get_val_cb(cache_map_t map, cache_iter_t it)
+{
+	return kh_val((khash_t(dnsmap_t) *)map, it);
+}
+
+static void
+cachedns_set_val_cb(cache_map_t map, cache_iter_t it, cache_val_t val)
+{
+	kh_val((khash_t(dnsmap_t) *)map, it) = val;
+}
+
+static cache_val_t
+cachedns_unpackverify_val_cb(cache_val_t val, int copy)
+{
+	if (((cachedns_val_t *)val)->expiry <= time(NULL))
+		return NULL;
+	if (copy)
+		return cachedns_mkval(val);
+	return ((void*)-1);
+}
+
+static cache_map_t
+cachedns_map_new_cb(void)
+{
+	return kh_init(dnsmap_t);
+}
+
+static void
+cachedns_map_free_cb(cache_map_t map)
+{
+	kh_destroy(dnsmap_t, (khash_t(dnsmap_t) *)map);
+}
+
+static int
+cachedns_full_cb(cache_map_t map)
+{
+	khash_t(dnsmap_t) *h = map;
+
+	return h->n_occupied >= h->upper_bound;
+}
+
+static int
+cachedns_resize_cb(cache_map_t map, size_t n)
+{
+	return kh_resize(dnsmap_t, (khash_t(dnsmap_t) *)map,
+	                 (khint_t)(n / __ac_HASH_UPPER) + 1);
+}
+
+static unsigned int
+cachedns_hash_cb(cache_key_t key)
+{
+	return kh_str_hash_func(key);
+}
+
+static size_t
+cachedns_size_cb(cache_key_t key, UNUSED cache_val_t val)
+{
+	return strlen(key) + 1 + sizeof(cachedns_val_t);
+}
+
+void
+cachedns_init_cb(cache_t *cache)
+{
+	cache->map_new_cb               = cachedns_map_new_cb;
+	cache->map_free_cb              = cachedns_map_free_cb;
+	cache->hash_cb                  = cachedns_hash_cb;
+	cache->begin_cb                 = cachedns_begin_cb;
+	cache->end_cb                   = cachedns_end_cb;
+	cache->exist_cb                 = cachedns_exist_cb;
+	cache->del_cb                   = cachedns_del_cb;
+	cache->get_cb                   = cachedns_get_cb;
+	cache->put_cb                   = cachedns_put_cb;
+	cache->free_key_cb              = cachedns_free_key_cb;
+	cache->free_val_cb              = cachedns_free_val_cb;
+	cache->get_key_cb               = cachedns_get_key_cb;
+	cache->get_val_cb               = cachedns_get_val_cb;
+	cache->set_val_cb               = cachedns_set_val_cb;
+	cache->unpackverify_val_cb      = cachedns_unpackverify_val_cb;
+	cache->size_cb                  = cachedns_size_cb;
+	cache->full_cb                  = cachedns_full_cb;
+	cache->resize_cb                = cachedns_resize_cb;
+}
+
+/*
+ * Create a key from address family and hostname; hostnames are case
+ * insensitive.  Returns NULL on out of memory condition.
+ */
+cache_key_t
+cachedns_mkkey(int af, const char *host)
+{
+	char *key, *p;
+	size_t sz;
+
+	sz = strlen(host) + 16;
+	if (!(key = malloc(sz)))
+		return NULL;
+	snprintf(key, sz, "%d/%s", af, host);
+	for (p = key; *p; p++)
+		*p = tolower((unsigned char)*p);
+	return key;
+}
+
+cache_val_t
+cachedns_mkval(const cachedns_val_t *val)
+{
+	cachedns_val_t *v;
+
+	if (!(v = malloc(sizeof(cachedns_val_t))))
+		return NULL;
+	memcpy(v, val, sizeof(cachedns_val_t));
+	return v;
+}
+
+/* vim: set noet ft=c: */
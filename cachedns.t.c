@@ -0,0 +1,128 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "cachemgr.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#include <check.h>
+
+static void
+cachemgr_setup(void)
+{
+	if (cachemgr_preinit() == -1)
+		exit(EXIT_FAILURE);
+}
+
+static void
+cachemgr_teardown(void)
+{
+	cachemgr_fini();
+}
+
+static void
+cachedns_fill(cachedns_val_t *val, time_t expiry)
+{
+	struct sockaddr_in *sin = (struct sockaddr_in *)&val->addr[0];
+
+	memset(val, 0, sizeof(cachedns_val_t));
+	val->expiry = expiry;
+	val->refresh = expiry;
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = htonl(0x7F000001);
+	val->addrlen[0] = sizeof(struct sockaddr_in);
+	val->num = 1;
+}
+
+START_TEST(cache_dns_01)
+{
+	cachedns_val_t val, *rv;
+
+	cachedns_fill(&val, time(NULL) + 3600);
+	rv = cachemgr_dns_get(AF_INET, "example.org");
+	fail_unless(rv == NULL, "result was already in empty cache");
+	cachemgr_dns_set(AF_INET, "example.org", &val);
+	rv = cachemgr_dns_get(AF_INET, "example.org");
+	fail_unless(!!rv, "cache did not return a result");
+	fail_unless(rv->num == 1, "cache returned wrong address count");
+	fail_unless(!memcmp(&rv->addr[0], &val.addr[0],
+	                    sizeof(struct sockaddr_in)),
+	            "cache returned wrong address");
+	free(rv);
+	cachemgr_dns_del(AF_INET, "example.org");
+	rv = cachemgr_dns_get(AF_INET, "example.org");
+	fail_unless(rv == NULL, "cache returned deleted result");
+}
+END_TEST
+
+START_TEST(cache_dns_02)
+{
+	cachedns_val_t val, *rv;
+
+	cachedns_fill(&val, time(NULL) - 1);
+	cachemgr_dns_set(AF_INET, "example.org", &val);
+	rv = cachemgr_dns_get(AF_INET, "example.org");
+	fail_unless(rv == NULL, "cache returned expired result");
+}
+END_TEST
+
+START_TEST(cache_dns_03)
+{
+	cachedns_val_t val, *rv;
+
+	cachedns_fill(&val, time(NULL) + 3600);
+	cachemgr_dns_set(AF_INET, "Example.ORG", &val);
+	rv = cachemgr_dns_get(AF_INET, "example.org");
+	fail_unless(!!rv, "hostname lookup is case sensitive");
+	free(rv);
+	rv = cachemgr_dns_get(AF_INET6, "example.org");
+	fail_unless(rv == NULL, "address family not part of key");
+}
+END_TEST
+
+Suite *
+cachedns_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("cachedns");
+
+	tc = tcase_create("cache_dns");
+	tcase_add_checked_fixture(tc, cachemgr_setup, cachemgr_teardown);
+	tcase_add_test(tc, cache_dns_01);
+	tcase_add_test(tc, cache_dns_02);
+	tcase_add_test(tc, cache_dns_03);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
@@ -30,6 +30,13 @@
 
 #include "dynbuf.h"
 #include "ssl.h"
+#include "util.h"
+#include "mempool.h"
+
+#define kcalloc(N,Z) mempool_huge_calloc(N,Z)
+#define kmalloc(Z) mempool_huge_malloc(Z)
+#define krealloc(P,Z) mempool_huge_realloc(P,Z)
+#define kfree(P) mempool_huge_free(P)
 #include "khash.h"
 
 #include <netinet/in.h>
@@ -37,27 +44,15 @@
 /*
  * Cache for outgoing dst connection SSL sessions.
  *
- * key: dynbuf_t *  original destination IP address, port and SNI string
- * val: dynbuf_t *  ASN.1 serialized SSL_SESSION
+ * key: dynbuf_t *  original destination IP address, port, SNI string and
+ *                  slot number
+ * val: SSL_SESSION *
+ *
+ * Each destination and SNI has CACHEDSESS_SLOTS slots, so that several TLS
+ * 1.3 tickets can be kept for it, see cachemgr_dsess_set().
  */
 
-static inline khint_t
-kh_dynbuf_hash_func(dynbuf_t *b)
-{
-	khint_t *p = (khint_t *)b->buf;
-	khint_t h = 0;
-	int rem;
-
-	if ((rem = b->sz % sizeof(khint_t))) {
-		memcpy(&h, b->buf + b->sz - rem, rem);
-	}
-
-	while (p < (khint_t*)(b->buf + b->sz - rem)) {
-		h ^= *p++;
-	}
-
-	return h;
-}
+#define kh_dynbuf_hash_func(b) util_hash((b)->buf, (b)->sz)
 
 #define kh_dynbuf_hash_equal(a, b) \
         (((a)->sz == (b)->sz) && \
@@ -66,42 +61,40 @@ kh_dynbuf_hash_func(dynbuf_t *b)
 KHASH_INIT(dynbufmap_t, dynbuf_t*, dynbuf_t*, 1, kh_dynbuf_hash_func,
            kh_dynbuf_hash_equal)
 
-static khash_t(dynbufmap_t) *dstsessmap;
-
 static cache_iter_t
-cachedsess_begin_cb(void)
+cachedsess_begin_cb(UNUSED cache_map_t map)
 {
-	return kh_begin(dstsessmap);
+	return kh_begin((khash_t(dynbufmap_t) *)map);
 }
 
 static cache_iter_t
-cachedsess_end_cb(void)
+cachedsess_end_cb(cache_map_t map)
 {
-	return kh_end(dstsessmap);
+	return kh_end((khash_t(dynbufmap_t) *)map);
 }
 
 static int
-cachedsess_exist_cb(cache_iter_t it)
+cachedsess_exist_cb(cache_map_t map, cache_iter_t it)
 {
-	return kh_exist(dstsessmap, it);
+	return kh_exist((khash_t(dynbufmap_t) *)map, it);
 }
 
 static void
-cachedsess_del_cb(cache_iter_t it)
+cachedsess_del_cb(cache_map_t map, cache_iter_t it)
 {
-	kh_del(dynbufmap_t, dstsessmap, it);
+	kh_del(dynbufmap_t, (khash_t(dynbufmap_t) *)map, it);
 }
 
 static cache_iter_t
-cachedsess_get_cb(cache_key_t key)
+cachedsess_get_cb(cache_map_t map, cache_key_t key)
 {
-	return kh_get(dynbufmap_t, dstsessmap, key);
+	return kh_get(dynbufmap_t, (khash_t(dynbufmap_t) *)map, key);
 }
 
 static cache_iter_t
-cachedsess_put_cb(cache_key_t key, int *ret)
+cachedsess_put_cb(cache_map_t map, cache_key_t key, int *ret)
 {
-	return kh_put(dynbufmap_t, dstsessmap, key, ret);
+	return kh_put(dynbufmap_t, (khash_t(dynbufmap_t) *)map, key, ret);
 }
 
 static void
@@ -113,59 +106,97 @@ cachedsess_free_key_cb(cache_key_t key)
 static void
 cachedsess_free_val_cb(cache_val_t val)
 {
-	dynbuf_free(val);
+	SSL_SESSION_free(val);
 }
 
 static cache_key_t
-cachedsess_get_key_cb(cache_iter_t it)
+cachedsess_get_key_cb(cache_map_t map, cache_iter_t it)
 {
-	return kh_key(dstsessmap, it);
+	return kh_key((khash_t(dynbufmap_t) *)map, it);
 }
 
 static cache_val_t
-cachedsess_get_val_cb(cache_iter_t it)
+cachedsess_get_val_cb(cache_map_t map, cache_iter_t it)
 {
-	return kh_val(dstsessmap, it);
+	return kh_val((khash_t(dynbufmap_t) *)map, it);
 }
 
 static void
-cachedsess_set_val_cb(cache_iter_t it, cache_val_t val)
+cachedsess_set_val_cb(cache_map_t map, cache_iter_t it, cache_val_t val)
 {
-	kh_val(dstsessmap, it) = val;
+	kh_val((khash_t(dynbufmap_t) *)map, it) = val;
 }
 
 static cache_val_t
 cachedsess_unpackverify_val_cb(cache_val_t val, int copy)
 {
-	dynbuf_t *valbuf = val;
-	SSL_SESSION *sess;
-	const unsigned char *p;
-
-	p = (const unsigned char *)valbuf->buf;
-	sess = d2i_SSL_SESSION(NULL, &p, valbuf->sz); /* increments p */
-	if (!sess)
-		return NULL;
-	if (!ssl_session_is_valid(sess)) {
-		SSL_SESSION_free(sess);
+	if (!ssl_session_is_valid(val))
 		return NULL;
+	if (copy) {
+		ssl_session_refcount_inc(val);
+		return val;
 	}
-	if (copy)
-		return sess;
-	SSL_SESSION_free(sess);
 	return ((void*)-1);
 }
 
+static cache_map_t
+cachedsess_map_new_cb(void)
+{
+	return kh_init(dynbufmap_t);
+}
+
 static void
-cachedsess_fini_cb(void)
+cachedsess_map_free_cb(cache_map_t map)
+{
+	kh_destroy(dynbufmap_t, (khash_t(dynbufmap_t) *)map);
+}
+
+static int
+cachedsess_full_cb(cache_map_t map)
+{
+	khash_t(dynbufmap_t) *h = map;
+
+	return h->n_occupied >= h->upper_bound;
+}
+
+static int
+cachedsess_resize_cb(cache_map_t map, size_t n)
 {
-	kh_destroy(dynbufmap_t, dstsessmap);
+	return kh_resize(dynbufmap_t, (khash_t(dynbufmap_t) *)map,
+	                 (khint_t)(n / __ac_HASH_UPPER) + 1);
+}
+
+static unsigned int
+cachedsess_hash_cb(cache_key_t key)
+{
+	return kh_dynbuf_hash_func((dynbuf_t *)key);
+}
+
+static int
+cachedsess_equal_key_cb(cache_key_t a, cache_key_t b)
+{
+	return kh_dynbuf_hash_equal((dynbuf_t *)a, (dynbuf_t *)b);
+}
+
+static cache_key_t
+cachedsess_dup_key_cb(cache_key_t key)
+{
+	return dynbuf_new_copy(((dynbuf_t *)key)->buf, ((dynbuf_t *)key)->sz);
+}
+
+static size_t
+cachedsess_size_cb(cache_key_t key, cache_val_t val)
+{
+	return sizeof(dynbuf_t) + ((dynbuf_t *)key)->sz +
+	       ssl_session_memsz(val);
 }
 
 void
 cachedsess_init_cb(cache_t *cache)
 {
-	dstsessmap = kh_init(dynbufmap_t);
-
+	cache->map_new_cb               = cachedsess_map_new_cb;
+	cache->map_free_cb              = cachedsess_map_free_cb;
+	cache->hash_cb                  = cachedsess_hash_cb;
 	cache->begin_cb                 = cachedsess_begin_cb;
 	cache->end_cb                   = cachedsess_end_cb;
 	cache->exist_cb                 = cachedsess_exist_cb;
@@ -178,57 +209,96 @@ cachedsess_init_cb(cache_t *cache)
 	cache->get_val_cb               = cachedsess_get_val_cb;
 	cache->set_val_cb               = cachedsess_set_val_cb;
 	cache->unpackverify_val_cb      = cachedsess_unpackverify_val_cb;
-	cache->fini_cb                  = cachedsess_fini_cb;
+	cache->size_cb                  = cachedsess_size_cb;
+	cache->equal_key_cb             = cachedsess_equal_key_cb;
+	cache->dup_key_cb               = cachedsess_dup_key_cb;
+	cache->full_cb                  = cachedsess_full_cb;
+	cache->resize_cb                = cachedsess_resize_cb;
+	cache->ttl_passes               = CACHEDSESS_TTL_PASSES;
 }
 
-cache_key_t
-cachedsess_mkkey(const struct sockaddr *addr, UNUSED const socklen_t addrlen,
-                 const char *sni)
+/*
+ * Serialise the key for addr, sni and slot into buf if it fits into bufsz.
+ * Returns the size of the key, or 0 for unsupported address families.
+ */
+static size_t
+cachedsess_keyfill(const struct sockaddr *addr, const char *sni,
+                   unsigned int slot, unsigned char *buf, size_t bufsz)
 {
-	dynbuf_t tmp, *db;
+	unsigned char *ip;
+	size_t iplen, snilen, sz;
 	short port;
-	size_t snilen;
 
 	switch (((struct sockaddr_storage *)addr)->ss_family) {
 		case AF_INET:
-			tmp.buf = (unsigned char *)
-			          &((struct sockaddr_in*)addr)->sin_addr;
-			tmp.sz = sizeof(struct in_addr);
+			ip = (unsigned char *)
+			     &((struct sockaddr_in*)addr)->sin_addr;
+			iplen = sizeof(struct in_addr);
 			port = ((struct sockaddr_in*)addr)->sin_port;
 			break;
 		case AF_INET6:
-			tmp.buf = (unsigned char *)
-			          &((struct sockaddr_in6*)addr)->sin6_addr;
-			tmp.sz = sizeof(struct in6_addr);
+			ip = (unsigned char *)
+			     &((struct sockaddr_in6*)addr)->sin6_addr;
+			iplen = sizeof(struct in6_addr);
 			port = ((struct sockaddr_in6*)addr)->sin6_port;
 			break;
 		default:
-			return NULL;
+			return 0;
 	}
 
 	snilen = sni ? strlen(sni) : 0;
-	if (!(db = dynbuf_new_alloc(tmp.sz + sizeof(port) + snilen)))
+	sz = iplen + sizeof(port) + snilen + 1;
+	if (sz > bufsz)
+		return sz;
+	memcpy(buf, ip, iplen);
+	memcpy(buf + iplen, (char*)&port, sizeof(port));
+	if (snilen)
+		memcpy(buf + iplen + sizeof(port), sni, snilen);
+	buf[iplen + sizeof(port) + snilen] = slot;
+	return sz;
+}
+
+cache_key_t
+cachedsess_mkkey(const struct sockaddr *addr, UNUSED const socklen_t addrlen,
+                 const char *sni, unsigned int slot)
+{
+	dynbuf_t *db;
+	size_t sz;
+
+	if (!(sz = cachedsess_keyfill(addr, sni, slot, NULL, 0)))
 		return NULL;
-	memcpy(db->buf, tmp.buf, tmp.sz);
-	memcpy(db->buf + tmp.sz, (char*)&port, sizeof(port));
-	memcpy(db->buf + tmp.sz + sizeof(port), sni, snilen);
+	if (!(db = dynbuf_new_alloc(sz)))
+		return NULL;
+	cachedsess_keyfill(addr, sni, slot, db->buf, db->sz);
 	return db;
 }
 
-cache_val_t
-cachedsess_mkval(SSL_SESSION *sess)
+/*
+ * Build the key for addr, sni and slot in the caller provided db and buf of
+ * bufsz octets, for looking up with cache_get_borrowed().  Returns NULL if
+ * the key does not fit into buf; use cachedsess_mkkey() in that case.
+ */
+cache_key_t
+cachedsess_mkkey_tmp(const struct sockaddr *addr,
+                     UNUSED const socklen_t addrlen, const char *sni,
+                     unsigned int slot, dynbuf_t *db, unsigned char *buf,
+                     size_t bufsz)
 {
-	dynbuf_t *db;
-	unsigned char *p;
-	size_t asn1sz;
+	size_t sz;
 
-	asn1sz = i2d_SSL_SESSION(sess, NULL);
-	if (!asn1sz || !(db = dynbuf_new_alloc(asn1sz))) {
+	sz = cachedsess_keyfill(addr, sni, slot, buf, bufsz);
+	if (!sz || sz > bufsz)
 		return NULL;
-	}
-	p = db->buf;
-	i2d_SSL_SESSION(sess, &p); /* updates p */
+	db->buf = buf;
+	db->sz = sz;
 	return db;
 }
 
+cache_val_t
+cachedsess_mkval(SSL_SESSION *sess)
+{
+	ssl_session_refcount_inc(sess);
+	return sess;
+}
+
 /* vim: set noet ft=c: */
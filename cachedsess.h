@@ -30,6 +30,7 @@
 #define CACHEDSESS_H
 
 #include "cache.h"
+#include "dynbuf.h"
 #include "attrib.h"
 
 #include <sys/types.h>
@@ -37,10 +38,31 @@
 
 #include <openssl/ssl.h>
 
+/*
+ * Number of sessions kept per destination and SNI.
+ */
+#define CACHEDSESS_SLOTS	4
+
+/*
+ * Buffer size for cachedsess_mkkey_tmp() fitting any IPv6 address with a
+ * DNS name as SNI.
+ */
+#define CACHEDSESS_TMPKEYSZ	(16 + 2 + 255 + 1)
+
+/*
+ * Garbage collection passes a destination never connected to again keeps
+ * its sessions cached.
+ */
+#define CACHEDSESS_TTL_PASSES	120
+
 void cachedsess_init_cb(struct cache *) NONNULL(1);
 
 cache_key_t cachedsess_mkkey(const struct sockaddr *, const socklen_t,
-                             const char *) NONNULL(1) WUNRES;
+                             const char *, unsigned int) NONNULL(1) WUNRES;
+cache_key_t cachedsess_mkkey_tmp(const struct sockaddr *, const socklen_t,
+                                 const char *, unsigned int, dynbuf_t *,
+                                 unsigned char *, size_t)
+            NONNULL(1,5,6) WUNRES;
 cache_val_t cachedsess_mkval(SSL_SESSION *) NONNULL(1) WUNRES;
 
 #endif /* !CACHEDSESS_H */
@@ -92,7 +92,7 @@ START_TEST(cache_dsess_01)
 	cachemgr_dsess_set((struct sockaddr*)&addr, addrlen, sni, s1);
 	s2 = cachemgr_dsess_get((struct sockaddr*)&addr, addrlen, sni);
 	fail_unless(!!s2, "cache returned no session");
-	fail_unless(s2 != s1, "cache returned same pointer");
+	fail_unless(s2 == s1, "cache did not return same pointer");
 	SSL_SESSION_free(s1);
 	SSL_SESSION_free(s2);
 }
@@ -128,6 +128,227 @@ START_TEST(cache_dsess_03)
 }
 END_TEST
 
+START_TEST(cache_dsess_10)
+{
+	SSL_SESSION *s1, *s2;
+
+	s1 = ssl_session_from_file(TMP_SESS_FILE);
+	fail_unless(!!s1, "creating session failed");
+
+	cachemgr_dsess_set((struct sockaddr*)&addr, addrlen, sni, s1);
+	cachemgr_dsess_set((struct sockaddr*)&addr, addrlen, NULL, s1);
+	cachemgr_dsess_flush();
+	s2 = cachemgr_dsess_get((struct sockaddr*)&addr, addrlen, sni);
+	fail_unless(s2 == NULL, "cache returned flushed session");
+	s2 = cachemgr_dsess_get((struct sockaddr*)&addr, addrlen, NULL);
+	fail_unless(s2 == NULL, "cache returned flushed session");
+	SSL_SESSION_free(s1);
+}
+END_TEST
+
+START_TEST(cache_dsess_11)
+{
+	SSL_SESSION *s1, *s2;
+	char longsni[CACHEDSESS_TMPKEYSZ + 1];
+
+	memset(longsni, 'a', sizeof(longsni) - 1);
+	longsni[sizeof(longsni) - 1] = '\0';
+	s1 = ssl_session_from_file(TMP_SESS_FILE);
+	fail_unless(!!s1, "creating session failed");
+	fail_unless(ssl_session_is_valid(s1), "session invalid");
+
+	cachemgr_dsess_set((struct sockaddr*)&addr, addrlen, longsni, s1);
+	s2 = cachemgr_dsess_get((struct sockaddr*)&addr, addrlen, sni);
+	fail_unless(!s2, "cache returned session for other SNI");
+	s2 = cachemgr_dsess_get((struct sockaddr*)&addr, addrlen, longsni);
+	fail_unless(!!s2, "cache returned no session for overlong SNI");
+	fail_unless(s2 == s1, "cache did not return same pointer");
+	SSL_SESSION_free(s1);
+	SSL_SESSION_free(s2);
+}
+END_TEST
+
+START_TEST(cache_dsess_05)
+{
+	SSL_SESSION *s1, *s2;
+	struct sockaddr_in *sin = (struct sockaddr_in *)&addr;
+
+	s1 = ssl_session_from_file(TMP_SESS_FILE);
+	fail_unless(!!s1, "creating session failed");
+
+	/* enough distinct keys to populate all cache shards */
+	for (int i = 0; i < 256; i++) {
+		sin->sin_port = htons(i);
+		cachemgr_dsess_set((struct sockaddr*)&addr, addrlen, sni, s1);
+	}
+	for (int i = 0; i < 256; i++) {
+		sin->sin_port = htons(i);
+		s2 = cachemgr_dsess_get((struct sockaddr*)&addr, addrlen, sni);
+		fail_unless(!!s2, "cache returned no session");
+		SSL_SESSION_free(s2);
+	}
+	for (int i = 0; i < 256; i += 2) {
+		sin->sin_port = htons(i);
+		cachemgr_dsess_del((struct sockaddr*)&addr, addrlen, sni);
+	}
+	for (int i = 0; i < 256; i++) {
+		sin->sin_port = htons(i);
+		s2 = cachemgr_dsess_get((struct sockaddr*)&addr, addrlen, sni);
+		fail_unless(!s2 == !(i % 2), "wrong entry deleted");
+		if (s2)
+			SSL_SESSION_free(s2);
+	}
+	SSL_SESSION_free(s1);
+}
+END_TEST
+
+START_TEST(cache_dsess_06)
+{
+	SSL_SESSION *s1;
+	struct sockaddr_in *sin = (struct sockaddr_in *)&addr;
+	size_t bytes;
+
+	s1 = ssl_session_from_file(TMP_SESS_FILE);
+	fail_unless(!!s1, "creating session failed");
+
+	cache_set_limits(cachemgr_dsess, CACHE_SHARDS, 0);
+	for (int i = 0; i < 256; i++) {
+		sin->sin_port = htons(i);
+		cachemgr_dsess_set((struct sockaddr*)&addr, addrlen, sni, s1);
+		fail_unless(cache_entries(cachemgr_dsess) <= CACHE_SHARDS,
+		            "entry limit exceeded");
+	}
+	fail_unless(cache_entries(cachemgr_dsess) > 0, "cache empty");
+
+	/* shrinking the byte limit evicts immediately */
+	bytes = cache_bytes(cachemgr_dsess);
+	fail_unless(bytes > 0, "no bytes accounted");
+	cache_set_limits(cachemgr_dsess, 0, bytes / 2);
+	fail_unless(cache_bytes(cachemgr_dsess) <= bytes / 2 + CACHE_SHARDS,
+	            "byte limit exceeded");
+	fail_unless(cache_bytes(cachemgr_dsess) < bytes, "nothing evicted");
+
+	/* deleting everything leaves the accounting at zero */
+	cache_set_limits(cachemgr_dsess, 0, 0);
+	for (int i = 0; i < 256; i++) {
+		sin->sin_port = htons(i);
+		cachemgr_dsess_del((struct sockaddr*)&addr, addrlen, sni);
+	}
+	fail_unless(cache_entries(cachemgr_dsess) == 0, "entries left");
+	fail_unless(cache_bytes(cachemgr_dsess) == 0, "bytes left");
+	SSL_SESSION_free(s1);
+}
+END_TEST
+
+START_TEST(cache_dsess_07)
+{
+	SSL_SESSION *s1, *s2;
+	struct sockaddr_in *sin = (struct sockaddr_in *)&addr;
+	int steps;
+
+	s1 = ssl_session_from_file(TMP_SESS_FILE);
+	fail_unless(!!s1, "creating session failed");
+	s2 = ssl_session_from_file(TMP_SESS_FILE);
+	fail_unless(!!s2, "creating session failed");
+	SSL_SESSION_set_time(s2, time(NULL) - SSL_SESSION_get_timeout(s2) - 1);
+	fail_unless(!ssl_session_is_valid(s2), "session valid");
+
+	for (int i = 0; i < 256; i++) {
+		sin->sin_port = htons(i);
+		cachemgr_dsess_set((struct sockaddr*)&addr, addrlen, sni,
+		                   (i % 2) ? s1 : s2);
+	}
+	fail_unless(cache_entries(cachemgr_dsess) == 256, "entries missing");
+	for (steps = 1; !cache_gc_step(cachemgr_dsess, 1); steps++);
+	fail_unless(steps >= CACHE_SHARDS, "pass completed too early");
+	fail_unless(cache_entries(cachemgr_dsess) == 128,
+	            "expired sessions not collected");
+	SSL_SESSION_free(s1);
+	SSL_SESSION_free(s2);
+}
+END_TEST
+
+START_TEST(cache_dsess_08)
+{
+	SSL_SESSION *s1;
+	struct sockaddr_in *sin = (struct sockaddr_in *)&addr;
+	size_t coll, probes, maxprobe;
+
+	s1 = ssl_session_from_file(TMP_SESS_FILE);
+	fail_unless(!!s1, "creating session failed");
+	/* keys differing only in address and port */
+	for (int i = 0; i < 1024; i++) {
+		sin->sin_port = htons(i);
+		sin->sin_addr.s_addr = htonl(0x0a000000 | (i << 8));
+		cachemgr_dsess_set((struct sockaddr*)&addr, addrlen, sni, s1);
+	}
+	fail_unless(cache_entries(cachemgr_dsess) == 1024, "entries missing");
+	cache_probes(cachemgr_dsess, &coll, &probes, &maxprobe);
+	fail_unless(coll < 1024, "all entries collide");
+	fail_unless(probes >= coll && maxprobe <= probes,
+	            "inconsistent probe metrics");
+	fail_unless(probes < 2 * 1024, "long average probe length");
+	fail_unless(maxprobe < 64, "long probe chain");
+	SSL_SESSION_free(s1);
+}
+END_TEST
+
+#if defined(TLS1_3_VERSION) && !defined(LIBRESSL_VERSION_NUMBER)
+static SSL_SESSION *
+ssl_session_tls13(void)
+{
+	SSL_SESSION *sess;
+
+	sess = SSL_SESSION_new();
+	if (!sess)
+		return NULL;
+	SSL_SESSION_set_protocol_version(sess, TLS1_3_VERSION);
+	SSL_SESSION_set_time(sess, time(NULL) - 1);
+	SSL_SESSION_set_timeout(sess, 300);
+	return sess;
+}
+
+START_TEST(cache_dsess_09)
+{
+	SSL_SESSION *t[3], *s1, *s2;
+
+	s1 = ssl_session_from_file(TMP_SESS_FILE);
+	fail_unless(!!s1, "creating session failed");
+	fail_unless(!ssl_session_is_single_use(s1), "session single use");
+	for (int i = 0; i < 3; i++) {
+		t[i] = ssl_session_tls13();
+		fail_unless(!!t[i], "creating TLS 1.3 session failed");
+		fail_unless(ssl_session_is_single_use(t[i]),
+		            "TLS 1.3 session not single use");
+		cachemgr_dsess_set((struct sockaddr*)&addr, addrlen, sni,
+		                   t[i]);
+	}
+	/* each ticket is handed out once */
+	for (int i = 0; i < 3; i++) {
+		s2 = cachemgr_dsess_get((struct sockaddr*)&addr, addrlen, sni);
+		fail_unless(s2 == t[0] || s2 == t[1] || s2 == t[2],
+		            "cache returned no ticket");
+		for (int j = 0; j < 3; j++) {
+			if (s2 == t[j])
+				t[j] = NULL;
+		}
+		SSL_SESSION_free(s2);
+	}
+	s2 = cachemgr_dsess_get((struct sockaddr*)&addr, addrlen, sni);
+	fail_unless(!s2, "ticket returned twice");
+
+	/* sessions of older protocol versions are reused */
+	cachemgr_dsess_set((struct sockaddr*)&addr, addrlen, sni, s1);
+	for (int i = 0; i < 3; i++) {
+		s2 = cachemgr_dsess_get((struct sockaddr*)&addr, addrlen, sni);
+		fail_unless(s2 == s1, "cache did not return session");
+		SSL_SESSION_free(s2);
+	}
+	SSL_SESSION_free(s1);
+}
+END_TEST
+#endif /* TLS1_3_VERSION && !LIBRESSL_VERSION_NUMBER */
+
 #if (OPENSSL_VERSION_NUMBER < 0x10100000L) || defined(LIBRESSL_VERSION_NUMBER)
 START_TEST(cache_dsess_04)
 {
@@ -139,19 +360,23 @@ START_TEST(cache_dsess_04)
 
 	fail_unless(s1->references == 1, "refcount != 1");
 	cachemgr_dsess_set((struct sockaddr*)&addr, addrlen, sni, s1);
-	fail_unless(s1->references == 1, "refcount != 1");
+	fail_unless(s1->references == 2, "refcount != 2");
 	s2 = cachemgr_dsess_get((struct sockaddr*)&addr, addrlen, sni);
-	fail_unless(s1->references == 1, "refcount != 1");
 	fail_unless(!!s2, "cache returned no session");
-	fail_unless(s2->references == 1, "refcount != 1");
+	/* one reference each for s2 and the L1 slot of this thread */
+	fail_unless(s1->references == 4, "refcount != 4");
 	cachemgr_dsess_set((struct sockaddr*)&addr, addrlen, sni, s1);
-	fail_unless(s1->references == 1, "refcount != 1");
+	fail_unless(s1->references == 4, "refcount != 4");
 	cachemgr_dsess_del((struct sockaddr*)&addr, addrlen, sni);
-	fail_unless(s1->references == 1, "refcount != 1");
+	fail_unless(s1->references == 3, "refcount != 3");
 	cachemgr_dsess_set((struct sockaddr*)&addr, addrlen, sni, s1);
+	fail_unless(s1->references == 4, "refcount != 4");
+	SSL_SESSION_free(s2);
+	fail_unless(s1->references == 3, "refcount != 3");
+	cachemgr_fini();
 	fail_unless(s1->references == 1, "refcount != 1");
 	SSL_SESSION_free(s1);
-	SSL_SESSION_free(s2);
+	fail_unless(cachemgr_preinit() != -1, "reinit");
 }
 END_TEST
 #endif
@@ -169,6 +394,15 @@ cachedsess_suite(void)
 	tcase_add_test(tc, cache_dsess_01);
 	tcase_add_test(tc, cache_dsess_02);
 	tcase_add_test(tc, cache_dsess_03);
+	tcase_add_test(tc, cache_dsess_05);
+	tcase_add_test(tc, cache_dsess_06);
+	tcase_add_test(tc, cache_dsess_07);
+	tcase_add_test(tc, cache_dsess_08);
+	tcase_add_test(tc, cache_dsess_10);
+	tcase_add_test(tc, cache_dsess_11);
+#if defined(TLS1_3_VERSION) && !defined(LIBRESSL_VERSION_NUMBER)
+	tcase_add_test(tc, cache_dsess_09);
+#endif /* TLS1_3_VERSION && !LIBRESSL_VERSION_NUMBER */
 #if (OPENSSL_VERSION_NUMBER < 0x10100000L) || defined(LIBRESSL_VERSION_NUMBER)
 	tcase_add_test(tc, cache_dsess_04);
 #endif
@@ -29,14 +29,56 @@
 #include "cachefkcrt.h"
 
 #include "ssl.h"
+#include "mempool.h"
+
+#include <stdint.h>
+#include <time.h>
+
+#define kcalloc(N,Z) mempool_huge_calloc(N,Z)
+#define kmalloc(Z) mempool_huge_malloc(Z)
+#define krealloc(P,Z) mempool_huge_realloc(P,Z)
+#define kfree(P) mempool_huge_free(P)
 #include "khash.h"
 
 /*
  * Cache for generated fake certificates.
  *
- * key: char[SSL_X509_FPRSZ]  fingerprint of original server cert
+ * key: char[SSL_X509_FPRSZ]  fingerprint of original server cert, or for
+ *                            ECDSA certs, SHA-1 over that and a tag
  * val: X509 *                generated fake certificate
+ *
+ * Values carry the fingerprints and names derived from them and the original
+ * certificate as ssl_x509_memo_t, such that cache hits are ready to log and
+ * to look up in the SSL_CTX cache without hashing or walking names again.
+ *
+ * Certificates not looked up for a while are demoted to their DER encoding,
+ * which takes about a fifth of the memory of a decoded X509, and decoded
+ * again on the next lookup.  Demoted values are cachefkcrt_der_t pointers
+ * tagged by setting the lowest bit, which is always clear in X509 pointers.
+ * The memoised metadata does not survive demotion; the private key attached
+ * with ssl_x509_leafkey_set() does.
+ *
+ * Certificates expire before the end of their validity if not looked up for
+ * an adaptive time to live, starting at CACHEFKCRT_TTL_PASSES garbage
+ * collection passes for certificates never looked up.
+ */
+
+/*
+ * Approximate ratio of the memory footprint of a decoded X509 to the size of
+ * its DER encoding, as measured on typical forged certificates.
  */
+#define CACHEFKCRT_X509_FACTOR	5
+
+typedef struct cachefkcrt_der {
+	time_t notbefore;
+	time_t notafter;
+	EVP_PKEY *leafkey;		/* attached private key, or NULL */
+	int len;
+	unsigned char der[];
+} cachefkcrt_der_t;
+
+#define CACHEFKCRT_IS_DER(V)	((uintptr_t)(V) & 1)
+#define CACHEFKCRT_DER(V)	((cachefkcrt_der_t *)((uintptr_t)(V) - 1))
 
 static inline khint_t
 kh_x509fpr_hash_func(void *b)
@@ -56,42 +98,40 @@ kh_x509fpr_hash_func(void *b)
 KHASH_INIT(sha1map_t, void*, void*, 1, kh_x509fpr_hash_func,
            kh_x509fpr_hash_equal)
 
-static khash_t(sha1map_t) *certmap;
-
 static cache_iter_t
-cachefkcrt_begin_cb(void)
+cachefkcrt_begin_cb(UNUSED cache_map_t map)
 {
-	return kh_begin(certmap);
+	return kh_begin((khash_t(sha1map_t) *)map);
 }
 
 static cache_iter_t
-cachefkcrt_end_cb(void)
+cachefkcrt_end_cb(cache_map_t map)
 {
-	return kh_end(certmap);
+	return kh_end((khash_t(sha1map_t) *)map);
 }
 
 static int
-cachefkcrt_exist_cb(cache_iter_t it)
+cachefkcrt_exist_cb(cache_map_t map, cache_iter_t it)
 {
-	return kh_exist(certmap, it);
+	return kh_exist((khash_t(sha1map_t) *)map, it);
 }
 
 static void
-cachefkcrt_del_cb(cache_iter_t it)
+cachefkcrt_del_cb(cache_map_t map, cache_iter_t it)
 {
-	kh_del(sha1map_t, certmap, it);
+	kh_del(sha1map_t, (khash_t(sha1map_t) *)map, it);
 }
 
 static cache_iter_t
-cachefkcrt_get_cb(cache_key_t key)
+cachefkcrt_get_cb(cache_map_t map, cache_key_t key)
 {
-	return kh_get(sha1map_t, certmap, key);
+	return kh_get(sha1map_t, (khash_t(sha1map_t) *)map, key);
 }
 
 static cache_iter_t
-cachefkcrt_put_cb(cache_key_t key, int *ret)
+cachefkcrt_put_cb(cache_map_t map, cache_key_t key, int *ret)
 {
-	return kh_put(sha1map_t, certmap, key, ret);
+	return kh_put(sha1map_t, (khash_t(sha1map_t) *)map, key, ret);
 }
 
 static void
@@ -103,30 +143,66 @@ cachefkcrt_free_key_cb(cache_key_t key)
 static void
 cachefkcrt_free_val_cb(cache_val_t val)
 {
-	X509_free(val);
+	cachefkcrt_der_t *d;
+
+	if (!CACHEFKCRT_IS_DER(val)) {
+		X509_free(val);
+		return;
+	}
+	d = CACHEFKCRT_DER(val);
+	if (d->leafkey)
+		EVP_PKEY_free(d->leafkey);
+	free(d);
 }
 
 static cache_key_t
-cachefkcrt_get_key_cb(cache_iter_t it)
+cachefkcrt_get_key_cb(cache_map_t map, cache_iter_t it)
 {
-	return kh_key(certmap, it);
+	return kh_key((khash_t(sha1map_t) *)map, it);
 }
 
 static cache_val_t
-cachefkcrt_get_val_cb(cache_iter_t it)
+cachefkcrt_get_val_cb(cache_map_t map, cache_iter_t it)
 {
-	return kh_val(certmap, it);
+	return kh_val((khash_t(sha1map_t) *)map, it);
 }
 
 static void
-cachefkcrt_set_val_cb(cache_iter_t it, cache_val_t val)
+cachefkcrt_set_val_cb(cache_map_t map, cache_iter_t it, cache_val_t val)
+{
+	kh_val((khash_t(sha1map_t) *)map, it) = val;
+}
+
+/*
+ * Decode a demoted certificate into a new X509, validity checked by the
+ * caller.  Returns NULL on errors.
+ */
+static X509 *
+cachefkcrt_der_decode(cachefkcrt_der_t *d)
 {
-	kh_val(certmap, it) = val;
+	const unsigned char *p = d->der;
+	X509 *crt;
+
+	if (!(crt = d2i_X509(NULL, &p, d->len)))
+		return NULL;
+	if (d->leafkey && ssl_x509_leafkey_set(crt, d->leafkey) == -1) {
+		X509_free(crt);
+		return NULL;
+	}
+	return crt;
 }
 
 static cache_val_t
 cachefkcrt_unpackverify_val_cb(cache_val_t val, int copy)
 {
+	if (CACHEFKCRT_IS_DER(val)) {
+		cachefkcrt_der_t *d = CACHEFKCRT_DER(val);
+		time_t now = time(NULL);
+
+		if (now >= d->notafter || now < d->notbefore)
+			return NULL;
+		return copy ? cachefkcrt_der_decode(d) : ((void*)-1);
+	}
 	if (!ssl_x509_is_valid(val))
 		return NULL;
 	if (copy) {
@@ -136,17 +212,119 @@ cachefkcrt_unpackverify_val_cb(cache_val_t val, int copy)
 	return ((void*)-1);
 }
 
+static cache_map_t
+cachefkcrt_map_new_cb(void)
+{
+	return kh_init(sha1map_t);
+}
+
 static void
-cachefkcrt_fini_cb(void)
+cachefkcrt_map_free_cb(cache_map_t map)
+{
+	kh_destroy(sha1map_t, (khash_t(sha1map_t) *)map);
+}
+
+static int
+cachefkcrt_full_cb(cache_map_t map)
 {
-	kh_destroy(sha1map_t, certmap);
+	khash_t(sha1map_t) *h = map;
+
+	return h->n_occupied >= h->upper_bound;
+}
+
+static int
+cachefkcrt_resize_cb(cache_map_t map, size_t n)
+{
+	return kh_resize(sha1map_t, (khash_t(sha1map_t) *)map,
+	                 (khint_t)(n / __ac_HASH_UPPER) + 1);
+}
+
+static unsigned int
+cachefkcrt_hash_cb(cache_key_t key)
+{
+	return kh_x509fpr_hash_func(key);
+}
+
+static int
+cachefkcrt_equal_key_cb(cache_key_t a, cache_key_t b)
+{
+	return kh_x509fpr_hash_equal(a, b);
+}
+
+static cache_key_t
+cachefkcrt_dup_key_cb(cache_key_t key)
+{
+	unsigned char *fpr;
+
+	if (!(fpr = malloc(CACHEFKCRT_KEYSZ)))
+		return NULL;
+	memcpy(fpr, key, CACHEFKCRT_KEYSZ);
+	return fpr;
+}
+
+/*
+ * Convert t to time_t.  Returns -1 on errors.
+ */
+static int
+cachefkcrt_time(const ASN1_TIME *t, time_t *tt)
+{
+	int days, secs;
+
+	if (!ASN1_TIME_diff(&days, &secs, NULL, t))
+		return -1;
+	*tt = time(NULL) + (time_t)days * 24 * 60 * 60 + secs;
+	return 0;
+}
+
+/*
+ * Demote a decoded certificate to its DER encoding.  Returns NULL on errors,
+ * leaving the certificate decoded.
+ */
+static cache_val_t
+cachefkcrt_demote_val_cb(cache_val_t val)
+{
+	cachefkcrt_der_t *d;
+	unsigned char *p;
+	int sz;
+
+	if ((sz = i2d_X509(val, NULL)) <= 0)
+		return NULL;
+	if (!(d = malloc(sizeof(cachefkcrt_der_t) + sz)))
+		return NULL;
+	if (cachefkcrt_time(X509_get_notBefore(val), &d->notbefore) == -1 ||
+	    cachefkcrt_time(X509_get_notAfter(val), &d->notafter) == -1) {
+		free(d);
+		return NULL;
+	}
+	p = d->der;
+	d->len = i2d_X509(val, &p);
+	if ((d->leafkey = ssl_x509_leafkey_get(val)))
+		ssl_key_refcount_inc(d->leafkey);
+	return (cache_val_t)((uintptr_t)d + 1);
+}
+
+/*
+ * Approximate memory footprint by the DER encoded size of the certificate,
+ * scaled by CACHEFKCRT_X509_FACTOR unless demoted.
+ */
+static size_t
+cachefkcrt_size_cb(UNUSED cache_key_t key, cache_val_t val)
+{
+	int sz;
+
+	if (CACHEFKCRT_IS_DER(val))
+		return SSL_X509_FPRSZ + sizeof(cachefkcrt_der_t) +
+		       CACHEFKCRT_DER(val)->len;
+	sz = i2d_X509(val, NULL);
+	return SSL_X509_FPRSZ + (sz > 0 ? sz : 0) * CACHEFKCRT_X509_FACTOR;
 }
 
 void
 cachefkcrt_init_cb(cache_t *cache)
 {
-	certmap = kh_init(sha1map_t);
-
+	cache->map_new_cb               = cachefkcrt_map_new_cb;
+	cache->map_free_cb              = cachefkcrt_map_free_cb;
+	cache->hash_cb                  = cachefkcrt_hash_cb;
 	cache->begin_cb                 = cachefkcrt_begin_cb;
 	cache->end_cb                   = cachefkcrt_end_cb;
 	cache->exist_cb                 = cachefkcrt_exist_cb;
@@ -159,7 +337,24 @@ cachefkcrt_init_cb(cache_t *cache)
 	cache->get_val_cb               = cachefkcrt_get_val_cb;
 	cache->set_val_cb               = cachefkcrt_set_val_cb;
 	cache->unpackverify_val_cb      = cachefkcrt_unpackverify_val_cb;
-	cache->fini_cb                  = cachefkcrt_fini_cb;
+	cache->size_cb                  = cachefkcrt_size_cb;
+	cache->equal_key_cb             = cachefkcrt_equal_key_cb;
+	cache->dup_key_cb               = cachefkcrt_dup_key_cb;
+	cache->full_cb                  = cachefkcrt_full_cb;
+	cache->resize_cb                = cachefkcrt_resize_cb;
+	cache->demote_val_cb            = cachefkcrt_demote_val_cb;
+	cache->ttl_passes               = CACHEFKCRT_TTL_PASSES;
+}
+
+/*
+ * Build the key for keycrt in fpr of CACHEFKCRT_KEYSZ octets provided by the
+ * caller, for looking up with cache_get_borrowed().
+ */
+cache_key_t
+cachefkcrt_mkkey_tmp(X509 *keycrt, unsigned char *fpr)
+{
+	ssl_x509_fingerprint_sha1(keycrt, fpr);
+	return fpr;
 }
 
 cache_key_t
@@ -167,15 +362,86 @@ cachefkcrt_mkkey(X509 *keycrt)
 {
 	unsigned char *fpr;
 
-	if (!(fpr = malloc(SSL_X509_FPRSZ)))
+	if (!(fpr = malloc(CACHEFKCRT_KEYSZ)))
 		return NULL;
-	ssl_x509_fingerprint_sha1(keycrt, fpr);
+	return cachefkcrt_mkkey_tmp(keycrt, fpr);
+}
+
+/*
+ * Derive the ECDSA variant key from the SHA-1 fingerprint crtfpr into fpr.
+ */
+static cache_key_t
+cachefkcrt_ec_digest(const unsigned char *crtfpr, unsigned char *fpr)
+{
+	static const unsigned char tag[] = "ECDSA";
+	unsigned char buf[SSL_X509_FPRSZ + sizeof(tag)];
+
+	memcpy(buf, crtfpr, SSL_X509_FPRSZ);
+	memcpy(buf + SSL_X509_FPRSZ, tag, sizeof(tag));
+	if (!EVP_Digest(buf, sizeof(buf), fpr, NULL, ssl_md(SSL_MD_SHA1),
+	                NULL))
+		return NULL;
+	return fpr;
+}
+
+/*
+ * Key for the ECDSA variant of the fake certificate forged for keycrt, which
+ * is cached alongside the RSA variant.
+ */
+cache_key_t
+cachefkcrt_mkkey_ec_tmp(X509 *keycrt, unsigned char *fpr)
+{
+	unsigned char crtfpr[SSL_X509_FPRSZ];
+
+	if (ssl_x509_fingerprint_sha1(keycrt, crtfpr) == -1)
+		return NULL;
+	return cachefkcrt_ec_digest(crtfpr, fpr);
+}
+
+cache_key_t
+cachefkcrt_mkkey_ec(X509 *keycrt)
+{
+	unsigned char *fpr;
+
+	if (!(fpr = malloc(CACHEFKCRT_KEYSZ)))
+		return NULL;
+	if (!cachefkcrt_mkkey_ec_tmp(keycrt, fpr)) {
+		free(fpr);
+		return NULL;
+	}
 	return fpr;
 }
 
+/*
+ * Key for the fake certificate forged for the certificate with the SHA-1
+ * fingerprint crtfpr, or its ECDSA variant if ecdsa is set, for inserting
+ * certificates without having the original certificate at hand.
+ */
+cache_key_t
+cachefkcrt_mkkey_fpr(const unsigned char *crtfpr, int ecdsa)
+{
+	unsigned char *fpr;
+
+	if (!(fpr = malloc(CACHEFKCRT_KEYSZ)))
+		return NULL;
+	if (!ecdsa) {
+		memcpy(fpr, crtfpr, CACHEFKCRT_KEYSZ);
+	} else if (!cachefkcrt_ec_digest(crtfpr, fpr)) {
+		free(fpr);
+		return NULL;
+	}
+	return fpr;
+}
+
+/*
+ * Value for the fake certificate valcrt forged for keycrt.  Memoises the
+ * derived metadata on valcrt unless already done; on failure, users fall back
+ * to computing it themselves.
+ */
 cache_val_t
-cachefkcrt_mkval(X509 *valcrt)
+cachefkcrt_mkval(X509 *valcrt, X509 *keycrt)
 {
+	ssl_x509_memo_set(valcrt, keycrt);
 	ssl_x509_refcount_inc(valcrt);
 	return valcrt;
 }
@@ -30,14 +30,27 @@
 #define CACHEFKCRT_H
 
 #include "cache.h"
+#include "ssl.h"
 #include "attrib.h"
 
 #include <openssl/x509.h>
 
+#define CACHEFKCRT_KEYSZ	SSL_X509_FPRSZ
+
+/*
+ * Garbage collection passes a certificate never looked up stays cached.
+ */
+#define CACHEFKCRT_TTL_PASSES	240
+
 void cachefkcrt_init_cb(struct cache *) NONNULL(1);
 
 cache_key_t cachefkcrt_mkkey(X509 *) NONNULL(1) WUNRES;
-cache_val_t cachefkcrt_mkval(X509 *) NONNULL(1) WUNRES;
+cache_key_t cachefkcrt_mkkey_tmp(X509 *, unsigned char *) NONNULL(1,2) WUNRES;
+cache_key_t cachefkcrt_mkkey_ec(X509 *) NONNULL(1) WUNRES;
+cache_key_t cachefkcrt_mkkey_ec_tmp(X509 *, unsigned char *)
+            NONNULL(1,2) WUNRES;
+cache_key_t cachefkcrt_mkkey_fpr(const unsigned char *, int) NONNULL(1) WUNRES;
+cache_val_t cachefkcrt_mkval(X509 *, X509 *) NONNULL(1,2) WUNRES;
 
 #endif /* !CACHEFKCRT_H */
 
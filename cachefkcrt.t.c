@@ -28,13 +28,20 @@
 
 #include "ssl.h"
 #include "cachemgr.h"
+#include "cache.h"
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 #include <check.h>
 
 #define TESTCERT "extra/pki/rsa.crt"
+#define CAKEY "extra/pki/rsa.key"
+#define ORIGCERT "extra/pki/server.crt"
+#define LEAFKEY "extra/pki/server.key"
 
 static void
 cachemgr_setup(void)
@@ -91,6 +98,283 @@ START_TEST(cache_fkcrt_03)
 }
 END_TEST
 
+START_TEST(cache_fkcrt_05)
+{
+	X509 *c1, *c2;
+
+	c1 = ssl_x509_load(TESTCERT);
+	fail_unless(!!c1, "loading certificate failed");
+	cachemgr_fkcrt_set_ec(c1, c1);
+	c2 = cachemgr_fkcrt_get(c1);
+	fail_unless(c2 == NULL, "ECDSA variant returned for RSA key");
+	c2 = cachemgr_fkcrt_get_ec(c1);
+	fail_unless(c2 == c1, "cache did not return ECDSA variant");
+	X509_free(c2);
+	cachemgr_fkcrt_del_ec(c1);
+	c2 = cachemgr_fkcrt_get_ec(c1);
+	fail_unless(c2 == NULL, "cache returned deleted certificate");
+	X509_free(c1);
+}
+END_TEST
+
+START_TEST(cache_fkcrt_06)
+{
+	X509 *cacrt, *origcrt, *fkcrt, *c;
+	EVP_PKEY *cakey, *leafkey;
+	unsigned int epoch = cachemgr_fkcrt_epoch;
+
+	fail_unless(cachemgr_share(1024*1024) == 0, "sharing failed");
+	cacrt = ssl_x509_load(TESTCERT);
+	cakey = ssl_key_load(CAKEY);
+	origcrt = ssl_x509_load(ORIGCERT);
+	leafkey = ssl_key_load(LEAFKEY);
+	fail_unless(cacrt && cakey && origcrt && leafkey, "loading failed");
+	fkcrt = ssl_x509_forge(cacrt, cakey, origcrt, leafkey, NULL, NULL);
+	fail_unless(!!fkcrt, "forging failed");
+
+	c = cachemgr_fkcrt_shared_get(origcrt, 0, cacrt, leafkey, epoch);
+	fail_unless(c == NULL, "shared tier not empty");
+	cachemgr_fkcrt_insert(origcrt, fkcrt, 0, epoch);
+	cachemgr_fkcrt_del(origcrt);
+	c = cachemgr_fkcrt_shared_get(origcrt, 1, cacrt, leafkey, epoch);
+	fail_unless(c == NULL, "shared tier returned ECDSA variant");
+	c = cachemgr_fkcrt_shared_get(origcrt, 0, origcrt, leafkey, epoch);
+	fail_unless(c == NULL, "shared tier ignored CA mismatch");
+	c = cachemgr_fkcrt_shared_get(origcrt, 0, cacrt, cakey, epoch);
+	fail_unless(c == NULL, "shared tier ignored leaf key mismatch");
+	c = cachemgr_fkcrt_shared_get(origcrt, 0, cacrt, leafkey, epoch);
+	fail_unless(!!c, "shared tier did not return certificate");
+	fail_unless(!X509_cmp(c, fkcrt), "shared tier returned wrong cert");
+	X509_free(c);
+	c = cachemgr_fkcrt_get(origcrt);
+	fail_unless(!!c, "shared tier hit not inserted locally");
+	X509_free(c);
+
+	cachemgr_fkcrt_flush();
+	c = cachemgr_fkcrt_shared_get(origcrt, 0, cacrt, leafkey,
+	                              cachemgr_fkcrt_epoch);
+	fail_unless(c == NULL, "shared tier not flushed");
+
+	X509_free(fkcrt);
+	X509_free(cacrt);
+	X509_free(origcrt);
+	EVP_PKEY_free(cakey);
+	EVP_PKEY_free(leafkey);
+}
+END_TEST
+
+START_TEST(cache_fkcrt_07)
+{
+	X509 *cacrt, *origcrt, *fkcrt, *c;
+	EVP_PKEY *cakey, *leafkey;
+	const ssl_x509_memo_t *memo;
+	char *fpr, *origfpr, *orignames;
+
+	cacrt = ssl_x509_load(TESTCERT);
+	cakey = ssl_key_load(CAKEY);
+	origcrt = ssl_x509_load(ORIGCERT);
+	leafkey = ssl_key_load(LEAFKEY);
+	fail_unless(cacrt && cakey && origcrt && leafkey, "loading failed");
+	fkcrt = ssl_x509_forge(cacrt, cakey, origcrt, leafkey, NULL, NULL);
+	fail_unless(!!fkcrt, "forging failed");
+	fail_unless(!ssl_x509_memo_get(fkcrt), "memo before caching");
+
+	cachemgr_fkcrt_set(origcrt, fkcrt);
+	c = cachemgr_fkcrt_get(origcrt);
+	fail_unless(c == fkcrt, "cache did not return same pointer");
+	memo = ssl_x509_memo_get(c);
+	fail_unless(!!memo, "no memo on cached certificate");
+	fpr = ssl_x509_fingerprint(fkcrt, 0);
+	origfpr = ssl_x509_fingerprint(origcrt, 0);
+	orignames = ssl_x509_names_to_str(origcrt);
+	fail_unless(fpr && origfpr && orignames, "computing failed");
+	fail_unless(!strcmp(memo->fprstr, fpr), "fingerprint mismatch");
+	fail_unless(!strcmp(memo->origfprstr, origfpr),
+	            "original fingerprint mismatch");
+	fail_unless(!strcmp(memo->orignames, orignames), "names mismatch");
+	cachemgr_fkcrt_set(origcrt, fkcrt);
+	fail_unless(ssl_x509_memo_get(fkcrt) == memo, "memo replaced");
+
+	free(fpr);
+	free(origfpr);
+	free(orignames);
+	X509_free(c);
+	X509_free(fkcrt);
+	X509_free(cacrt);
+	X509_free(origcrt);
+	EVP_PKEY_free(cakey);
+	EVP_PKEY_free(leafkey);
+}
+END_TEST
+
+START_TEST(cache_fkcrt_08)
+{
+	X509 *cacrt, *origcrt, *fkcrt, *c;
+	EVP_PKEY *cakey, *leafkey;
+	size_t hot, cold;
+
+	cacrt = ssl_x509_load(TESTCERT);
+	cakey = ssl_key_load(CAKEY);
+	origcrt = ssl_x509_load(ORIGCERT);
+	leafkey = ssl_key_load(LEAFKEY);
+	fail_unless(cacrt && cakey && origcrt && leafkey, "loading failed");
+	fkcrt = ssl_x509_forge(cacrt, cakey, origcrt, leafkey, NULL, NULL);
+	fail_unless(!!fkcrt, "forging failed");
+	fail_unless(ssl_x509_leafkey_set(fkcrt, leafkey) == 0, "attaching");
+
+	cachemgr_fkcrt_set(origcrt, fkcrt);
+	hot = cache_bytes(cachemgr_fkcrt);
+	for (int i = 0; i < CACHE_IDLE_PASSES - 1; i++)
+		cache_gc(cachemgr_fkcrt);
+	fail_unless(cache_bytes(cachemgr_fkcrt) == hot, "demoted early");
+	cache_gc(cachemgr_fkcrt);
+	cold = cache_bytes(cachemgr_fkcrt);
+	fail_unless(cold * 3 < hot, "not demoted");
+
+	c = cachemgr_fkcrt_get(origcrt);
+	fail_unless(!!c, "cache did not return demoted certificate");
+	fail_unless(c != fkcrt, "demoted certificate not decoded");
+	fail_unless(!X509_cmp(c, fkcrt), "decoded certificate differs");
+	fail_unless(ssl_x509_leafkey_get(c) == leafkey, "leaf key lost");
+	fail_unless(cache_bytes(cachemgr_fkcrt) == hot, "not promoted");
+	X509_free(c);
+
+	/* promoted entries are aged again from scratch */
+	cache_gc(cachemgr_fkcrt);
+	fail_unless(cache_bytes(cachemgr_fkcrt) == hot, "demoted again");
+
+	X509_free(fkcrt);
+	X509_free(cacrt);
+	X509_free(origcrt);
+	EVP_PKEY_free(cakey);
+	EVP_PKEY_free(leafkey);
+}
+END_TEST
+
+static char *
+cache_fkcrt_write(const char *dir, X509 *origcrt, X509 *fkcrt)
+{
+	char *fn, *origfpr, *fpr;
+	FILE *f;
+
+	origfpr = ssl_x509_fingerprint(origcrt, 0);
+	fpr = ssl_x509_fingerprint(fkcrt, 0);
+	fail_unless(origfpr && fpr, "computing fingerprints failed");
+	fail_unless(asprintf(&fn, "%s/%s-%s.crt", dir, origfpr, fpr) != -1,
+	            "asprintf failed");
+	f = fopen(fn, "w");
+	fail_unless(!!f, "opening file failed");
+	fail_unless(PEM_write_X509(f, fkcrt) == 1, "writing failed");
+	fclose(f);
+	free(origfpr);
+	free(fpr);
+	return fn;
+}
+
+START_TEST(cache_fkcrt_09)
+{
+	X509 *cacrt, *origcrt, *fkcrt, *fkcrt2, *c;
+	EVP_PKEY *cakey, *leafkey;
+	char dir[] = "/tmp/sslsplit.test.XXXXXX";
+	char *fn, *fn2, *junk;
+	int dirfd;
+	FILE *f;
+
+	fail_unless(!!mkdtemp(dir), "mkdtemp failed");
+	cacrt = ssl_x509_load(TESTCERT);
+	cakey = ssl_key_load(CAKEY);
+	origcrt = ssl_x509_load(ORIGCERT);
+	leafkey = ssl_key_load(LEAFKEY);
+	fail_unless(cacrt && cakey && origcrt && leafkey, "loading failed");
+	fkcrt = ssl_x509_forge(cacrt, cakey, origcrt, leafkey, NULL, NULL);
+	fkcrt2 = ssl_x509_forge(cacrt, cakey, origcrt, cakey, NULL, NULL);
+	fail_unless(fkcrt && fkcrt2, "forging failed");
+	fn = cache_fkcrt_write(dir, origcrt, fkcrt);
+	fn2 = cache_fkcrt_write(dir, origcrt, fkcrt2);
+	fail_unless(asprintf(&junk, "%s/README.crt", dir) != -1, "asprintf");
+	f = fopen(junk, "w");
+	fail_unless(!!f, "opening file failed");
+	fclose(f);
+	dirfd = open(dir, O_RDONLY|O_DIRECTORY);
+	fail_unless(dirfd != -1, "opening directory failed");
+
+	/* certificate using another leaf key is skipped */
+	fail_unless(cachemgr_fkcrt_load(dirfd, cacrt, leafkey, NULL, NULL,
+	                                cachemgr_fkcrt_epoch) == 1,
+	            "did not load exactly one certificate");
+	c = cachemgr_fkcrt_get(origcrt);
+	fail_unless(!!c, "cache did not return loaded certificate");
+	fail_unless(!X509_cmp(c, fkcrt), "cache returned wrong certificate");
+	X509_free(c);
+	c = cachemgr_fkcrt_get_ec(origcrt);
+	fail_unless(c == NULL, "cache returned ECDSA variant");
+
+	/* ... unless it matches the ECDSA variant configuration */
+	fail_unless(cachemgr_fkcrt_load(dirfd, cacrt, leafkey, cacrt, cakey,
+	                                cachemgr_fkcrt_epoch) == 2,
+	            "did not load exactly two certificates");
+	c = cachemgr_fkcrt_get_ec(origcrt);
+	fail_unless(!!c, "cache did not return ECDSA variant");
+	fail_unless(!X509_cmp(c, fkcrt2), "cache returned wrong variant");
+	X509_free(c);
+
+	/* certificates not signed by the CA are skipped */
+	cachemgr_fkcrt_flush();
+	fail_unless(cachemgr_fkcrt_load(dirfd, origcrt, leafkey, NULL, NULL,
+	                                cachemgr_fkcrt_epoch) == 0,
+	            "loaded certificate signed by another CA");
+	c = cachemgr_fkcrt_get(origcrt);
+	fail_unless(c == NULL, "cache returned certificate");
+
+	close(dirfd);
+	unlink(fn);
+	unlink(fn2);
+	unlink(junk);
+	rmdir(dir);
+	free(fn);
+	free(fn2);
+	free(junk);
+	X509_free(fkcrt);
+	X509_free(fkcrt2);
+	X509_free(cacrt);
+	X509_free(origcrt);
+	EVP_PKEY_free(cakey);
+	EVP_PKEY_free(leafkey);
+}
+END_TEST
+
+START_TEST(cache_fkcrt_10)
+{
+	X509 *c1, *c2, *c;
+
+	c1 = ssl_x509_load(TESTCERT);
+	c2 = ssl_x509_load(ORIGCERT);
+	fail_unless(c1 && c2, "loading certificates failed");
+	cachemgr_fkcrt_set(c1, c1);
+	cachemgr_fkcrt_set(c2, c2);
+
+	/* entries looked up in every pass outlive those never looked up */
+	for (int i = 0; i < CACHEFKCRT_TTL_PASSES; i++) {
+		c = cachemgr_fkcrt_get(c1);
+		fail_unless(!!c, "cache did not return used certificate");
+		X509_free(c);
+		cache_gc(cachemgr_fkcrt);
+	}
+	c = cachemgr_fkcrt_get(c2);
+	fail_unless(c == NULL, "unused certificate did not expire");
+
+	/* and stay around for longer once they go idle */
+	for (int i = 0; i < CACHEFKCRT_TTL_PASSES; i++)
+		cache_gc(cachemgr_fkcrt);
+	c = cachemgr_fkcrt_get(c1);
+	fail_unless(!!c, "used certificate expired early");
+	X509_free(c);
+
+	X509_free(c1);
+	X509_free(c2);
+}
+END_TEST
+
 #if (OPENSSL_VERSION_NUMBER < 0x10100000L) || defined(LIBRESSL_VERSION_NUMBER)
 START_TEST(cache_fkcrt_04)
 {
@@ -102,15 +386,16 @@ START_TEST(cache_fkcrt_04)
 	cachemgr_fkcrt_set(c1, c1);
 	fail_unless(c1->references == 2, "refcount != 2");
 	c2 = cachemgr_fkcrt_get(c1);
-	fail_unless(c1->references == 3, "refcount != 3");
+	/* one reference each for c2 and the L1 slot of this thread */
+	fail_unless(c1->references == 4, "refcount != 4");
 	cachemgr_fkcrt_set(c1, c1);
-	fail_unless(c1->references == 3, "refcount != 3");
+	fail_unless(c1->references == 4, "refcount != 4");
 	cachemgr_fkcrt_del(c1);
-	fail_unless(c1->references == 2, "refcount != 2");
-	cachemgr_fkcrt_set(c1, c1);
 	fail_unless(c1->references == 3, "refcount != 3");
+	cachemgr_fkcrt_set(c1, c1);
+	fail_unless(c1->references == 4, "refcount != 4");
 	X509_free(c1);
-	fail_unless(c1->references == 2, "refcount != 2");
+	fail_unless(c1->references == 3, "refcount != 3");
 	cachemgr_fini();
 	fail_unless(c1->references == 1, "refcount != 1");
 	X509_free(c2);
@@ -136,6 +421,12 @@ cachefkcrt_suite(void)
 	tcase_add_test(tc, cache_fkcrt_01);
 	tcase_add_test(tc, cache_fkcrt_02);
 	tcase_add_test(tc, cache_fkcrt_03);
+	tcase_add_test(tc, cache_fkcrt_05);
+	tcase_add_test(tc, cache_fkcrt_06);
+	tcase_add_test(tc, cache_fkcrt_07);
+	tcase_add_test(tc, cache_fkcrt_08);
+	tcase_add_test(tc, cache_fkcrt_09);
+	tcase_add_test(tc, cache_fkcrt_10);
 #if (OPENSSL_VERSION_NUMBER < 0x10100000L) || defined(LIBRESSL_VERSION_NUMBER)
 	tcase_add_test(tc, cache_fkcrt_04);
 #endif
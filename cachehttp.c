@@ -0,0 +1,271 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "cachehttp.h"
+
+#include "dynbuf.h"
+#include "util.h"
+#include "mempool.h"
+
+#define kcalloc(N,Z) mempool_huge_calloc(N,Z)
+#define kmalloc(Z) mempool_huge_malloc(Z)
+#define krealloc(P,Z) mempool_huge_realloc(P,Z)
+#define kfree(P) mempool_huge_free(P)
+#include "khash.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+/*
+ * Cache for HTTP responses to GET requests on http proxyspecs, shared by all
+ * connection handling threads.  Entries are valid until their freshness
+ * lifetime from Cache-Control has passed.  Values are immutable once stored
+ * and reference counted, such that a hit hands out the stored response
+ * without copying it.
+ *
+ * key: dynbuf_t *          destination address, Host and URI
+ * val: cachehttp_val_t *   response as forwarded to the client
+ */
+
+#define kh_dynbuf_hash_func(b) util_hash((b)->buf, (b)->sz)
+
+#define kh_dynbuf_hash_equal(a, b) \
+        (((a)->sz == (b)->sz) && \
+         (memcmp((a)->buf, (b)->buf, (a)->sz) == 0))
+
+KHASH_INIT(httpmap_t, dynbuf_t*, void*, 1, kh_dynbuf_hash_func,
+           kh_dynbuf_hash_equal)
+
+static cache_iter_t
+cachehttp_begin_cb(UNUSED cache_map_t map)
+{
+	return kh_begin((khash_t(httpmap_t) *)map);
+}
+
+static cache_iter_t
+cachehttp_end_cb(cache_map_t map)
+{
+	return kh_end((khash_t(httpmap_t) *)map);
+}
+
+static int
+cachehttp_exist_cb(cache_map_t map, cache_iter_t it)
+{
+	return kh_exist((khash_t(httpmap_t) *)map, it);
+}
+
+static void
+cachehttp_del_cb(cache_map_t map, cache_iter_t it)
+{
+	kh_del(httpmap_t, (khash_t(httpmap_t) *)map, it);
+}
+
+static cache_iter_t
+cachehttp_get_cb(cache_map_t map, cache_key_t key)
+{
+	return kh_get(httpmap_t, (khash_t(httpmap_t) *)map, key);
+}
+
+static cache_iter_t
+cachehttp_put_cb(cache_map_t map, cache_key_t key, int *ret)
+{
+	return kh_put(httpmap_t, (khash_t(httpmap_t) *)map, key, ret);
+}
+
+static void
+cachehttp_free_key_cb(cache_key_t key)
+{
+	dynbuf_free(key);
+}
+
+static void
+cachehttp_free_val_cb(cache_val_t val)
+{
+	cachehttp_val_free(val);
+}
+
+static cache_key_t
+cachehttp_get_key_cb(cache_map_t map, cache_iter_t it)
+{
+	return kh_key((khash_t(httpmap_t) *)map, it);
+}
+
+static cache_val_t
+cachehttp_get_val_cb(cache_map_t map, cache_iter_t it)
+{
+	return kh_val((khash_t(httpmap_t) *)map, it);
+}
+
+static void
+cachehttp_set_val_cb(cache_map_t map, cache_iter_t it, cache_val_t val)
+{
+	kh_val((khash_t(httpmap_t) *)map, it) = val;
+}
+
+static cache_val_t
+cachehttp_unpackverify_val_cb(cache_val_t val, int copy)
+{
+	if (((cachehttp_val_t *)val)->expiry <= time(NULL))
+		return NULL;
+	if (copy)
+		return cachehttp_mkval(val);
+	return ((void*)-1);
+}
+
+static cache_map_t
+cachehttp_map_new_cb(void)
+{
+	return kh_init(httpmap_t);
+}
+
+static void
+cachehttp_map_free_cb(cache_map_t map)
+{
+	kh_destroy(httpmap_t, (khash_t(httpmap_t) *)map);
+}
+
+static int
+cachehttp_full_cb(cache_map_t map)
+{
+	khash_t(httpmap_t) *h = map;
+
+	return h->n_occupied >= h->upper_bound;
+}
+
+static int
+cachehttp_resize_cb(cache_map_t map, size_t n)
+{
+	return kh_resize(httpmap_t, (khash_t(httpmap_t) *)map,
+	                 (khint_t)(n / __ac_HASH_UPPER) + 1);
+}
+
+static unsigned int
+cachehttp_hash_cb(cache_key_t key)
+{
+	return kh_dynbuf_hash_func((dynbuf_t *)key);
+}
+
+static size_t
+cachehttp_size_cb(cache_key_t key, cache_val_t val)
+{
+	return sizeof(dynbuf_t) + ((dynbuf_t *)key)->sz +
+	       sizeof(cachehttp_val_t) + ((cachehttp_val_t *)val)->sz +
+	       ((cachehttp_val_t *)val)->etagsz;
+}
+
+void
+cachehttp_init_cb(cache_t *cache)
+{
+	cache->map_new_cb               = cachehttp_map_new_cb;
+	cache->map_free_cb              = cachehttp_map_free_cb;
+	cache->hash_cb                  = cachehttp_hash_cb;
+	cache->begin_cb                 = cachehttp_begin_cb;
+	cache->end_cb                   = cachehttp_end_cb;
+	cache->exist_cb                 = cachehttp_exist_cb;
+	cache->del_cb                   = cachehttp_del_cb;
+	cache->get_cb                   = cachehttp_get_cb;
+	cache->put_cb                   = cachehttp_put_cb;
+	cache->free_key_cb              = cachehttp_free_key_cb;
+	cache->free_val_cb              = cachehttp_free_val_cb;
+	cache->get_key_cb               = cachehttp_get_key_cb;
+	cache->get_val_cb               = cachehttp_get_val_cb;
+	cache->set_val_cb               = cachehttp_set_val_cb;
+	cache->unpackverify_val_cb      = cachehttp_unpackverify_val_cb;
+	cache->size_cb                  = cachehttp_size_cb;
+	cache->full_cb                  = cachehttp_full_cb;
+	cache->resize_cb                = cachehttp_resize_cb;
+}
+
+/*
+ * Create a key from the destination address of the connection, the Host
+ * header and the request URI.  The destination is part of the key, such that
+ * a client cannot place responses of a server of its choosing in the cache
+ * for a Host served elsewhere.  Host names are case-insensitive.
+ * Returns NULL on out of memory condition.
+ */
+cache_key_t
+cachehttp_mkkey(const char *dst, const char *host, const char *uri)
+{
+	size_t dstsz = strlen(dst), hostsz = strlen(host), urisz = strlen(uri);
+	dynbuf_t *db;
+	unsigned char *p;
+
+	if (!(db = dynbuf_new_alloc(dstsz + hostsz + urisz + 2)))
+		return NULL;
+	p = db->buf;
+	memcpy(p, dst, dstsz);
+	p += dstsz;
+	*p++ = '\n';
+	for (size_t i = 0; i < hostsz; i++)
+		*p++ = tolower((unsigned char)host[i]);
+	*p++ = '\n';
+	memcpy(p, uri, urisz);
+	return db;
+}
+
+/*
+ * Allocate a value for a response of sz octets with an ETag of etagsz
+ * octets, holding one reference.  The caller fills in the fields and data.
+ * Returns NULL on out of memory condition.
+ */
+cachehttp_val_t *
+cachehttp_val_new(size_t sz, size_t etagsz)
+{
+	cachehttp_val_t *v;
+
+	if (!(v = malloc(sizeof(cachehttp_val_t) + sz + etagsz)))
+		return NULL;
+	memset(v, 0, sizeof(cachehttp_val_t));
+	v->refc = 1;
+	v->sz = sz;
+	v->etagsz = etagsz;
+	return v;
+}
+
+/*
+ * Take another reference to an immutable value.
+ */
+cache_val_t
+cachehttp_mkval(cachehttp_val_t *val)
+{
+	__atomic_add_fetch(&val->refc, 1, __ATOMIC_RELAXED);
+	return val;
+}
+
+/*
+ * Release a reference to a value, as returned by cachemgr_http_get().
+ */
+void
+cachehttp_val_free(cachehttp_val_t *val)
+{
+	if (__atomic_sub_fetch(&val->refc, 1, __ATOMIC_ACQ_REL) == 0)
+		free(val);
+}
+
+/* vim: set noet ft=c: */
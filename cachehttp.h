@@ -0,0 +1,58 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CACHEHTTP_H
+#define CACHEHTTP_H
+
+#include "cache.h"
+#include "attrib.h"
+
+#include <time.h>
+
+typedef struct cachehttp_val {
+	int refc;			/* references, see cachehttp_mkval() */
+	time_t stored;			/* time the entry was stored */
+	time_t expiry;			/* entry is stale from this time */
+	unsigned long long age;		/* Age of the response when stored */
+	size_t hdrsz;			/* size of header w/o Age, empty line */
+	size_t etagsz;			/* size of etag, 0 if none */
+	size_t sz;			/* size of response */
+	unsigned char data[];		/* response, followed by etag */
+} cachehttp_val_t;
+
+void cachehttp_init_cb(struct cache *) NONNULL(1);
+
+cache_key_t cachehttp_mkkey(const char *, const char *, const char *)
+            NONNULL(1,2,3) WUNRES;
+cache_val_t cachehttp_mkval(cachehttp_val_t *) NONNULL(1) WUNRES;
+cachehttp_val_t * cachehttp_val_new(size_t, size_t) MALLOC;
+void cachehttp_val_free(cachehttp_val_t *) NONNULL(1);
+
+#endif /* !CACHEHTTP_H */
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,137 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "cachemgr.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <check.h>
+
+#define DST "[127.0.0.1]:80"
+#define DST2 "[127.0.0.2]:80"
+
+static void
+cachemgr_setup(void)
+{
+	if (cachemgr_preinit() == -1)
+		exit(EXIT_FAILURE);
+}
+
+static void
+cachemgr_teardown(void)
+{
+	cachemgr_fini();
+}
+
+static cachehttp_val_t *
+cachehttp_val_make(time_t expiry)
+{
+	cachehttp_val_t *val;
+
+	val = cachehttp_val_new(8, 4);
+	if (!val)
+		return NULL;
+	val->stored = time(NULL);
+	val->expiry = expiry;
+	val->hdrsz = 4;
+	memcpy(val->data, "HDR\nbody\"e1\"", 12);
+	return val;
+}
+
+START_TEST(cache_http_01)
+{
+	cachehttp_val_t *val, *v;
+
+	val = cachehttp_val_make(time(NULL) + 60);
+	fail_unless(!!val, "allocating value failed");
+	cachemgr_http_set(DST, "www.example.org", "/a", val);
+	v = cachemgr_http_get(DST, "www.example.org", "/a");
+	fail_unless(v == val, "cache did not return the stored response");
+	fail_unless(v->refc == 3, "wrong reference count");
+	fail_unless(v->sz == 8 && v->etagsz == 4 &&
+	            !memcmp(v->data + v->sz, "\"e1\"", 4),
+	            "cache returned wrong response");
+	cachehttp_val_free(v);
+	cachehttp_val_free(val);
+}
+END_TEST
+
+START_TEST(cache_http_02)
+{
+	cachehttp_val_t *val, *v;
+
+	val = cachehttp_val_make(time(NULL) + 60);
+	fail_unless(!!val, "allocating value failed");
+	cachemgr_http_set(DST, "www.example.org", "/a", val);
+	cachehttp_val_free(val);
+	v = cachemgr_http_get(DST, "WWW.Example.ORG", "/a");
+	fail_unless(!!v, "host not matched case-insensitively");
+	cachehttp_val_free(v);
+	v = cachemgr_http_get(DST, "www.example.org", "/A");
+	fail_unless(v == NULL, "uri matched case-insensitively");
+	v = cachemgr_http_get(DST2, "www.example.org", "/a");
+	fail_unless(v == NULL, "cache returned response of other dst");
+	v = cachemgr_http_get(DST, "www.example.org\n/a", "");
+	fail_unless(v == NULL, "key components not separated");
+}
+END_TEST
+
+START_TEST(cache_http_03)
+{
+	cachehttp_val_t *val, *v;
+
+	val = cachehttp_val_make(time(NULL) - 1);
+	fail_unless(!!val, "allocating value failed");
+	cachemgr_http_set(DST, "www.example.org", "/a", val);
+	cachehttp_val_free(val);
+	v = cachemgr_http_get(DST, "www.example.org", "/a");
+	fail_unless(v == NULL, "cache returned expired response");
+}
+END_TEST
+
+Suite *
+cachehttp_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("cachehttp");
+
+	tc = tcase_create("cache_http");
+	tcase_add_checked_fixture(tc, cachemgr_setup, cachemgr_teardown);
+	tcase_add_test(tc, cache_http_01);
+	tcase_add_test(tc, cache_http_02);
+	tcase_add_test(tc, cache_http_03);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,278 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bench.h"
+
+#include "cachemgr.h"
+#include "cert.h"
+#include "ssl.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#define BENCHCERT "extra/pki/server.crt"
+#define BENCHPEM "extra/pki/server.pem"
+#define BENCHSNI "daniel.roe.ch"
+
+static X509 *crt;
+static cert_t *cert;
+static SSL_CTX *sslctx;
+static SSL_SESSION *sess;
+static cachedns_val_t dnsval;
+static struct sockaddr_in addr;
+
+static void
+cachemgr_bench_fkcrt_get(UNUSED void *arg, size_t n)
+{
+	X509 *c;
+
+	while (n--) {
+		if ((c = cachemgr_fkcrt_get(crt)))
+			X509_free(c);
+	}
+}
+
+static void
+cachemgr_bench_fkcrt_set(UNUSED void *arg, size_t n)
+{
+	while (n--) {
+		cachemgr_fkcrt_set(crt, crt);
+	}
+}
+
+static void
+cachemgr_bench_tgcrt_get(UNUSED void *arg, size_t n)
+{
+	cert_t *c;
+
+	while (n--) {
+		if ((c = cachemgr_tgcrt_get(BENCHSNI)))
+			cert_free(c);
+	}
+}
+
+static void
+cachemgr_bench_tgcrt_set(UNUSED void *arg, size_t n)
+{
+	while (n--) {
+		cachemgr_tgcrt_set(BENCHSNI, cert);
+	}
+}
+
+static void
+cachemgr_bench_sslctx_get(UNUSED void *arg, size_t n)
+{
+	SSL_CTX *ctx;
+
+	while (n--) {
+		if ((ctx = cachemgr_sslctx_get(crt)))
+			SSL_CTX_free(ctx);
+	}
+}
+
+static void
+cachemgr_bench_sslctx_set(UNUSED void *arg, size_t n)
+{
+	while (n--) {
+		cachemgr_sslctx_set(crt, sslctx);
+	}
+}
+
+static void
+cachemgr_bench_vrfy_get(UNUSED void *arg, size_t n)
+{
+	void *expiry;
+
+	while (n--) {
+		if ((expiry = cachemgr_vrfy_get(crt, NULL)))
+			free(expiry);
+	}
+}
+
+static void
+cachemgr_bench_vrfy_set(UNUSED void *arg, size_t n)
+{
+	time_t expiry = time(NULL) + 3600;
+
+	while (n--) {
+		cachemgr_vrfy_set(crt, NULL, expiry);
+	}
+}
+
+static void
+cachemgr_bench_dns_get(UNUSED void *arg, size_t n)
+{
+	cachedns_val_t *val;
+
+	while (n--) {
+		if ((val = cachemgr_dns_get(AF_INET, BENCHSNI)))
+			free(val);
+	}
+}
+
+static void
+cachemgr_bench_dns_set(UNUSED void *arg, size_t n)
+{
+	while (n--) {
+		cachemgr_dns_set(AF_INET, BENCHSNI, &dnsval);
+	}
+}
+
+static void
+cachemgr_bench_ssess_get(UNUSED void *arg, size_t n)
+{
+	const unsigned char *id;
+	unsigned int len;
+	SSL_SESSION *s;
+
+	id = SSL_SESSION_get_id(sess, &len);
+	while (n--) {
+		if ((s = cachemgr_ssess_get(id, len)))
+			SSL_SESSION_free(s);
+	}
+}
+
+static void
+cachemgr_bench_ssess_set(UNUSED void *arg, size_t n)
+{
+	while (n--) {
+		cachemgr_ssess_set(sess);
+	}
+}
+
+static void
+cachemgr_bench_dsess_get(UNUSED void *arg, size_t n)
+{
+	SSL_SESSION *s;
+
+	while (n--) {
+		if ((s = cachemgr_dsess_get((struct sockaddr *)&addr,
+		                            sizeof(addr), BENCHSNI)))
+			SSL_SESSION_free(s);
+	}
+}
+
+static void
+cachemgr_bench_dsess_set(UNUSED void *arg, size_t n)
+{
+	while (n--) {
+		cachemgr_dsess_set((struct sockaddr *)&addr, sizeof(addr),
+		                   BENCHSNI, sess);
+	}
+}
+
+static struct {
+	const char *name;
+	bench_func_t get;
+	bench_func_t set;
+} cachemgr_benches[] = {
+	{"Fkcrt", cachemgr_bench_fkcrt_get, cachemgr_bench_fkcrt_set},
+	{"Tgcrt", cachemgr_bench_tgcrt_get, cachemgr_bench_tgcrt_set},
+	{"SSLCtx", cachemgr_bench_sslctx_get, cachemgr_bench_sslctx_set},
+	{"Vrfy", cachemgr_bench_vrfy_get, cachemgr_bench_vrfy_set},
+	{"DNS", cachemgr_bench_dns_get, cachemgr_bench_dns_set},
+	{"Ssess", cachemgr_bench_ssess_get, cachemgr_bench_ssess_set},
+	{"Dsess", cachemgr_bench_dsess_get, cachemgr_bench_dsess_set},
+};
+
+static void
+cachemgr_bench_setup(void)
+{
+	static const unsigned char id[] = "sslsplit bench session id";
+
+	if (cachemgr_preinit() == -1) {
+		fprintf(stderr, "Failed to initialize caches\n");
+		exit(EXIT_FAILURE);
+	}
+	crt = ssl_x509_load(BENCHCERT);
+	cert = cert_new_load(BENCHPEM);
+	sslctx = SSL_CTX_new(SSLv23_server_method());
+	sess = SSL_SESSION_new();
+	if (!crt || !cert || !sslctx || !sess) {
+		fprintf(stderr, "Failed to set up cache values\n");
+		exit(EXIT_FAILURE);
+	}
+	if (SSL_SESSION_set1_id(sess, id, sizeof(id) - 1) != 1) {
+		fprintf(stderr, "Failed to set session id\n");
+		exit(EXIT_FAILURE);
+	}
+	SSL_SESSION_set_time(sess, time(NULL));
+	SSL_SESSION_set_timeout(sess, 86400);
+
+	memset(&dnsval, 0, sizeof(dnsval));
+	dnsval.expiry = time(NULL) + 3600;
+	dnsval.refresh = dnsval.expiry;
+	dnsval.num = 1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(443);
+	addr.sin_addr.s_addr = htonl(0x7F000001);
+	memcpy(&dnsval.addr[0], &addr, sizeof(addr));
+	dnsval.addrlen[0] = sizeof(addr);
+}
+
+static void
+cachemgr_bench_teardown(void)
+{
+	cachemgr_fini();
+	SSL_SESSION_free(sess);
+	SSL_CTX_free(sslctx);
+	cert_free(cert);
+	X509_free(crt);
+}
+
+void
+cachemgr_bench(void)
+{
+	char name[64];
+	size_t i;
+
+	cachemgr_bench_setup();
+	for (i = 0; i < sizeof(cachemgr_benches) /
+	                sizeof(cachemgr_benches[0]); i++) {
+		/* sets first, such that gets measure the hit path */
+		snprintf(name, sizeof(name), "Cache%sSet",
+		         cachemgr_benches[i].name);
+		bench_run(name, 1, cachemgr_benches[i].set, NULL);
+		if (bench_nthreads() > 1)
+			bench_run(name, bench_nthreads(),
+			          cachemgr_benches[i].set, NULL);
+		snprintf(name, sizeof(name), "Cache%sGet",
+		         cachemgr_benches[i].name);
+		bench_run(name, 1, cachemgr_benches[i].get, NULL);
+		if (bench_nthreads() > 1)
+			bench_run(name, bench_nthreads(),
+			          cachemgr_benches[i].get, NULL);
+	}
+	cachemgr_bench_teardown();
+}
+
+/* vim: set noet ft=c: */
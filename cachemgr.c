@@ -29,21 +29,96 @@
 #include "cachemgr.h"
 
 #include "cachefkcrt.h"
+#include "cachesslctx.h"
+#include "cachevrfy.h"
 #include "cachetgcrt.h"
 #include "cachessess.h"
 #include "cachedsess.h"
+#include "cachedns.h"
+#include "cachesni.h"
+#include "cachepass.h"
+#include "cacheocsp.h"
+#include "cachehttp.h"
+#include "dynbuf.h"
+#include "ssl.h"
+#include "sys.h"
+#include "util.h"
 #include "log.h"
+#include "stats.h"
 #include "attrib.h"
 
 #include <string.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
 
 #include <netinet/in.h>
 
+#include <openssl/rand.h>
+#include <openssl/pem.h>
+
 cache_t *cachemgr_fkcrt;
 cache_t *cachemgr_tgcrt;
 cache_t *cachemgr_ssess;
 cache_t *cachemgr_dsess;
+cache_t *cachemgr_sslctx;
+cache_t *cachemgr_vrfy;
+cache_t *cachemgr_dns;
+cache_t *cachemgr_sni;
+cache_t *cachemgr_pass;
+cache_t *cachemgr_ocsp;
+cache_t *cachemgr_http;
+certstore_t *cachemgr_fkstore;
+sessstore_t *cachemgr_sessstore;
+certindex_t *cachemgr_tgidx;
+certmatch_t *cachemgr_tgmatch;
+shmcache_t *cachemgr_shfkcrt;
+shmcache_t *cachemgr_shsess;
+rcache_t *cachemgr_rcache;
+unsigned int cachemgr_fkcrt_epoch;
+
+/*
+ * Shared second tier of the forged certificate and session caches for
+ * multiple worker processes, see cachemgr_share().  Entries are stored in
+ * DER encoding, keyed by a type byte followed by the key of the respective
+ * local cache.  Forged certificates are stored along with their private key
+ * if they do not use the shared leaf key.  Whatever a lookup finds in the
+ * shared tier is verified against the configuration of the calling process
+ * and then inserted into the local cache of that process.
+ *
+ * The remote tier, see cachemgr_remote(), uses the same keys and encoding
+ * for forged certificates and src sessions, such that all instances sharing
+ * the remote servers find each other's entries.  Since the keys only depend
+ * on the original certificate or the session ID, entries from instances
+ * using another CA or leaf key fail verification and are treated as misses.
+ */
+#define CACHEMGR_SHFKCRT_SLOTSZ	4096
+#define CACHEMGR_SHSESS_SLOTSZ	1024
+#define CACHEMGR_SHKEY_FKCRT	'F'
+#define CACHEMGR_SHKEY_FKCRT_EC	'E'
+#define CACHEMGR_SHKEY_SSESS	'S'
+#define CACHEMGR_SHKEY_DSESS	'D'
+
+/*
+ * Warming up the forged certificate cache from the certificates written to
+ * certgendir by an earlier run, see cachemgr_fkcrt_warm().  The directory is
+ * opened before dropping privileges and read by a background thread, which
+ * is stopped and joined by cachemgr_fini().
+ */
+typedef struct cachemgr_warm {
+	int dirfd;
+	unsigned int epoch;
+	X509 *cacrt;
+	EVP_PKEY *leafkey;
+	X509 *eccacrt;
+	EVP_PKEY *ecleafkey;
+} cachemgr_warm_t;
+
+static int cachemgr_warm_dirfd = -1;
+static int cachemgr_warm_stop;
+static int cachemgr_warm_running;
+static pthread_t cachemgr_warm_thr;
 
 /*
  * Garbage collector thread entry point.
@@ -64,23 +139,72 @@ cachemgr_gc_thread(UNUSED void * arg)
 int
 cachemgr_preinit(void)
 {
+	uint64_t seed;
+
+	/* per-process seed for the hash of binary cache keys */
+	if (RAND_bytes((unsigned char *)&seed, sizeof(seed)) != 1)
+		seed = ((uint64_t)sys_rand32() << 32) | sys_rand32();
+	util_hash_init(seed);
+
 	if (!(cachemgr_fkcrt = cache_new(cachefkcrt_init_cb)))
-		goto out4;
+		goto out9;
 	if (!(cachemgr_tgcrt = cache_new(cachetgcrt_init_cb)))
-		goto out3;
+		goto out8;
 	if (!(cachemgr_ssess = cache_new(cachessess_init_cb)))
-		goto out2;
+		goto out7;
 	if (!(cachemgr_dsess = cache_new(cachedsess_init_cb)))
+		goto out6;
+	if (!(cachemgr_sslctx = cache_new(cachesslctx_init_cb)))
+		goto out5;
+	if (!(cachemgr_vrfy = cache_new(cachevrfy_init_cb)))
+		goto out4;
+	if (!(cachemgr_dns = cache_new(cachedns_init_cb)))
+		goto out3;
+	if (!(cachemgr_sni = cache_new(cachesni_init_cb)))
+		goto out2;
+	if (!(cachemgr_pass = cache_new(cachepass_init_cb)))
 		goto out1;
+	if (!(cachemgr_ocsp = cache_new(cacheocsp_init_cb)))
+		goto out0;
+	if (!(cachemgr_http = cache_new(cachehttp_init_cb)))
+		goto outhttp;
+	cachemgr_fkcrt->stats = STATS_CACHE_FKCRT;
+	cachemgr_tgcrt->stats = STATS_CACHE_TGCRT;
+	cachemgr_ssess->stats = STATS_CACHE_SSESS;
+	cachemgr_dsess->stats = STATS_CACHE_DSESS;
+	cachemgr_sslctx->stats = STATS_CACHE_SSLCTX;
+	cachemgr_vrfy->stats = STATS_CACHE_VRFY;
+	cachemgr_dns->stats = STATS_CACHE_DNS;
+	cachemgr_sni->stats = STATS_CACHE_SNI;
+	cachemgr_pass->stats = STATS_CACHE_PASS;
+	cachemgr_ocsp->stats = STATS_CACHE_OCSP;
+	cachemgr_http->stats = STATS_CACHE_HTTP;
+	cache_l1_setup(cachemgr_fkcrt, CACHE_L1_SLOTS);
+	cache_l1_setup(cachemgr_tgcrt, CACHE_L1_SLOTS);
+	cache_l1_setup(cachemgr_dsess, CACHE_L1_SLOTS);
 	return 0;
 
+outhttp:
+	cache_free(cachemgr_ocsp);
+out0:
+	cache_free(cachemgr_pass);
 out1:
-	cache_free(cachemgr_ssess);
+	cache_free(cachemgr_sni);
 out2:
-	cache_free(cachemgr_tgcrt);
+	cache_free(cachemgr_dns);
 out3:
-	cache_free(cachemgr_fkcrt);
+	cache_free(cachemgr_vrfy);
 out4:
+	cache_free(cachemgr_sslctx);
+out5:
+	cache_free(cachemgr_dsess);
+out6:
+	cache_free(cachemgr_ssess);
+out7:
+	cache_free(cachemgr_tgcrt);
+out8:
+	cache_free(cachemgr_fkcrt);
+out9:
 	return -1;
 }
 
@@ -99,6 +223,22 @@ cachemgr_init(void)
 		return -1;
 	if (cache_reinit(cachemgr_dsess))
 		return -1;
+	if (cache_reinit(cachemgr_sslctx))
+		return -1;
+	if (cache_reinit(cachemgr_vrfy))
+		return -1;
+	if (cache_reinit(cachemgr_dns))
+		return -1;
+	if (cache_reinit(cachemgr_sni))
+		return -1;
+	if (cache_reinit(cachemgr_pass))
+		return -1;
+	if (cache_reinit(cachemgr_ocsp))
+		return -1;
+	if (cache_reinit(cachemgr_http))
+		return -1;
+	if (cachemgr_rcache && rcache_run(cachemgr_rcache) == -1)
+		return -1;
 	return 0;
 }
 
@@ -110,10 +250,94 @@ cachemgr_init(void)
 void
 cachemgr_fini(void)
 {
+	if (cachemgr_warm_running) {
+		__atomic_store_n(&cachemgr_warm_stop, 1, __ATOMIC_SEQ_CST);
+		pthread_join(cachemgr_warm_thr, NULL);
+		cachemgr_warm_running = 0;
+	}
+	if (cachemgr_warm_dirfd != -1) {
+		close(cachemgr_warm_dirfd);
+		cachemgr_warm_dirfd = -1;
+	}
+	cachemgr_warm_stop = 0;
+	cache_free(cachemgr_http);
+	cache_free(cachemgr_ocsp);
+	cache_free(cachemgr_pass);
+	cache_free(cachemgr_sni);
+	cache_free(cachemgr_dns);
+	cache_free(cachemgr_vrfy);
+	cache_free(cachemgr_sslctx);
 	cache_free(cachemgr_dsess);
 	cache_free(cachemgr_ssess);
 	cache_free(cachemgr_tgcrt);
 	cache_free(cachemgr_fkcrt);
+	if (cachemgr_fkstore) {
+		certstore_close(cachemgr_fkstore);
+		cachemgr_fkstore = NULL;
+	}
+	if (cachemgr_sessstore) {
+		sessstore_close(cachemgr_sessstore);
+		cachemgr_sessstore = NULL;
+	}
+	if (cachemgr_tgidx) {
+		certindex_free(cachemgr_tgidx);
+		cachemgr_tgidx = NULL;
+	}
+	if (cachemgr_tgmatch) {
+		certmatch_free(cachemgr_tgmatch);
+		cachemgr_tgmatch = NULL;
+	}
+	if (cachemgr_shfkcrt) {
+		shmcache_free(cachemgr_shfkcrt);
+		cachemgr_shfkcrt = NULL;
+	}
+	if (cachemgr_shsess) {
+		shmcache_free(cachemgr_shsess);
+		cachemgr_shsess = NULL;
+	}
+	if (cachemgr_rcache) {
+		rcache_free(cachemgr_rcache);
+		cachemgr_rcache = NULL;
+	}
+	cachemgr_fkcrt_epoch = 0;
+}
+
+/*
+ * Set up the shared second tier of the forged certificate and session
+ * caches with a total of size bytes, three quarters of which for forged
+ * certificates.  Must be called after cachemgr_preinit(), since the hash
+ * seed must be the same in all processes, and before forking the worker
+ * processes.  Returns -1 on error, 0 on success.
+ */
+int
+cachemgr_share(size_t size)
+{
+	if (!(cachemgr_shfkcrt = shmcache_new(size / 4 * 3,
+	                                      CACHEMGR_SHFKCRT_SLOTSZ)))
+		return -1;
+	if (!(cachemgr_shsess = shmcache_new(size / 4,
+	                                     CACHEMGR_SHSESS_SLOTSZ))) {
+		shmcache_free(cachemgr_shfkcrt);
+		cachemgr_shfkcrt = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Set up the remote tier of the forged certificate and src session caches
+ * on the comma-separated list of memcached servers, with timeout
+ * milliseconds for each network operation.  Must be called before dropping
+ * privileges, since server names are resolved immediately; the remote cache
+ * thread is started by cachemgr_init().
+ * Returns -1 on error, 0 on success.
+ */
+int
+cachemgr_remote(const char *servers, unsigned int timeout)
+{
+	if (!(cachemgr_rcache = rcache_new(servers, timeout)))
+		return -1;
+	return 0;
 }
 
 /*
@@ -125,7 +349,8 @@ cachemgr_fini(void)
 void
 cachemgr_gc(void)
 {
-	pthread_t fkcrt_thr, dsess_thr, ssess_thr;
+	pthread_t fkcrt_thr, dsess_thr, ssess_thr, sslctx_thr, vrfy_thr;
+	pthread_t dns_thr, sni_thr, pass_thr, ocsp_thr, http_thr;
 	int rv;
 
 	/* the tgcrt cache does not need cleanup */
@@ -148,6 +373,48 @@ cachemgr_gc(void)
 		log_err_printf("cachemgr_gc: pthread_create failed: %s\n",
 		               strerror(rv));
 	}
+	rv = pthread_create(&sslctx_thr, NULL, cachemgr_gc_thread,
+	                    cachemgr_sslctx);
+	if (rv) {
+		log_err_printf("cachemgr_gc: pthread_create failed: %s\n",
+		               strerror(rv));
+	}
+	rv = pthread_create(&vrfy_thr, NULL, cachemgr_gc_thread,
+	                    cachemgr_vrfy);
+	if (rv) {
+		log_err_printf("cachemgr_gc: pthread_create failed: %s\n",
+		               strerror(rv));
+	}
+	rv = pthread_create(&dns_thr, NULL, cachemgr_gc_thread,
+	                    cachemgr_dns);
+	if (rv) {
+		log_err_printf("cachemgr_gc: pthread_create failed: %s\n",
+		               strerror(rv));
+	}
+	rv = pthread_create(&sni_thr, NULL, cachemgr_gc_thread,
+	                    cachemgr_sni);
+	if (rv) {
+		log_err_printf("cachemgr_gc: pthread_create failed: %s\n",
+		               strerror(rv));
+	}
+	rv = pthread_create(&pass_thr, NULL, cachemgr_gc_thread,
+	                    cachemgr_pass);
+	if (rv) {
+		log_err_printf("cachemgr_gc: pthread_create failed: %s\n",
+		               strerror(rv));
+	}
+	rv = pthread_create(&ocsp_thr, NULL, cachemgr_gc_thread,
+	                    cachemgr_ocsp);
+	if (rv) {
+		log_err_printf("cachemgr_gc: pthread_create failed: %s\n",
+		               strerror(rv));
+	}
+	rv = pthread_create(&http_thr, NULL, cachemgr_gc_thread,
+	                    cachemgr_http);
+	if (rv) {
+		log_err_printf("cachemgr_gc: pthread_create failed: %s\n",
+		               strerror(rv));
+	}
 
 	rv = pthread_join(fkcrt_thr, NULL);
 	if (rv) {
@@ -164,6 +431,1000 @@ cachemgr_gc(void)
 		log_err_printf("cachemgr_gc: pthread_join failed: %s\n",
 		               strerror(rv));
 	}
+	rv = pthread_join(sslctx_thr, NULL);
+	if (rv) {
+		log_err_printf("cachemgr_gc: pthread_join failed: %s\n",
+		               strerror(rv));
+	}
+	rv = pthread_join(vrfy_thr, NULL);
+	if (rv) {
+		log_err_printf("cachemgr_gc: pthread_join failed: %s\n",
+		               strerror(rv));
+	}
+	rv = pthread_join(dns_thr, NULL);
+	if (rv) {
+		log_err_printf("cachemgr_gc: pthread_join failed: %s\n",
+		               strerror(rv));
+	}
+	rv = pthread_join(sni_thr, NULL);
+	if (rv) {
+		log_err_printf("cachemgr_gc: pthread_join failed: %s\n",
+		               strerror(rv));
+	}
+	rv = pthread_join(pass_thr, NULL);
+	if (rv) {
+		log_err_printf("cachemgr_gc: pthread_join failed: %s\n",
+		               strerror(rv));
+	}
+	rv = pthread_join(ocsp_thr, NULL);
+	if (rv) {
+		log_err_printf("cachemgr_gc: pthread_join failed: %s\n",
+		               strerror(rv));
+	}
+	rv = pthread_join(http_thr, NULL);
+	if (rv) {
+		log_err_printf("cachemgr_gc: pthread_join failed: %s\n",
+		               strerror(rv));
+	}
+}
+
+/*
+ * Incrementally garbage collect the caches, scanning at most budget hash
+ * buckets per cache, continuing where the previous call left off.  Meant to
+ * be called periodically from the main event loop; does not spawn threads.
+ * Returns the number of caches for which a full pass was completed.
+ */
+int
+cachemgr_gc_step(size_t budget)
+{
+	int n = 0;
+
+	/* the tgcrt cache does not need cleanup */
+	n += cache_gc_step(cachemgr_fkcrt, budget);
+	n += cache_gc_step(cachemgr_ssess, budget);
+	n += cache_gc_step(cachemgr_dsess, budget);
+	n += cache_gc_step(cachemgr_sslctx, budget);
+	n += cache_gc_step(cachemgr_vrfy, budget);
+	n += cache_gc_step(cachemgr_dns, budget);
+	n += cache_gc_step(cachemgr_sni, budget);
+	n += cache_gc_step(cachemgr_pass, budget);
+	n += cache_gc_step(cachemgr_ocsp, budget);
+	n += cache_gc_step(cachemgr_http, budget);
+	return n;
+}
+
+/*
+ * Invalidate all forged certificates and the state derived from them after
+ * the CA or the leaf keys have changed.  Returns the new epoch, which the
+ * configuration forging certificates from now on must carry; certificates
+ * forged for older epochs are not inserted anymore, and lookups from older
+ * configurations must bypass the cache, see cachemgr_fkcrt_current().
+ */
+unsigned int
+cachemgr_fkcrt_flush(void)
+{
+	unsigned int epoch;
+
+	epoch = __atomic_add_fetch(&cachemgr_fkcrt_epoch, 1, __ATOMIC_SEQ_CST);
+	cache_flush(cachemgr_fkcrt);
+	cache_flush(cachemgr_sslctx);
+	cache_flush(cachemgr_ssess);
+	cache_flush(cachemgr_ocsp);
+	if (cachemgr_shfkcrt) {
+		shmcache_flush(cachemgr_shfkcrt);
+		shmcache_flush(cachemgr_shsess);
+	}
+	return epoch;
+}
+
+/*
+ * Flush all cached SSL_CTXs after reloading, since they are set up from the
+ * configuration in effect when they were created.
+ */
+void
+cachemgr_sslctx_flush(void)
+{
+	cache_flush(cachemgr_sslctx);
+}
+
+/*
+ * Flush all dst sessions, e.g. because they were established with a client
+ * certificate that is no longer configured.  The shared tier holds src and
+ * dst sessions in the same table, so src sessions are flushed from it too.
+ */
+void
+cachemgr_dsess_flush(void)
+{
+	cache_flush(cachemgr_dsess);
+	if (cachemgr_shsess)
+		shmcache_flush(cachemgr_shsess);
+}
+
+/*
+ * Restore the src and dst session caches from the session store, if any.
+ * Returns the number of restored sessions, or -1 on error.
+ */
+ssize_t
+cachemgr_sess_load(void)
+{
+	if (!cachemgr_sessstore)
+		return 0;
+	return sessstore_load(cachemgr_sessstore, cachemgr_ssess,
+	                      cachemgr_dsess);
+}
+
+/*
+ * Snapshot the src and dst session caches to the session store, if any.
+ * Only the local caches are saved, not the shared or remote tiers.
+ * Returns the number of saved sessions, or -1 on error.
+ */
+ssize_t
+cachemgr_sess_save(void)
+{
+	if (!cachemgr_sessstore)
+		return 0;
+	return sessstore_save(cachemgr_sessstore, cachemgr_ssess,
+	                      cachemgr_dsess);
+}
+
+/*
+ * Insert fkcrt into the local forged certificate cache only.
+ */
+static void
+cachemgr_fkcrt_insert_local(X509 *origcrt, X509 *fkcrt, int ecdsa,
+                            unsigned int epoch)
+{
+	if (!cachemgr_fkcrt_current(epoch))
+		return;
+	if (ecdsa) {
+		cachemgr_fkcrt_set_ec(origcrt, fkcrt);
+	} else {
+		cachemgr_fkcrt_set(origcrt, fkcrt);
+	}
+	/* raced with cachemgr_fkcrt_flush() */
+	if (!cachemgr_fkcrt_current(epoch)) {
+		if (ecdsa) {
+			cachemgr_fkcrt_del_ec(origcrt);
+		} else {
+			cachemgr_fkcrt_del(origcrt);
+		}
+	}
+}
+
+static int
+cachemgr_fkcrt_shkey(X509 *origcrt, int ecdsa, unsigned char *key)
+{
+	key[0] = ecdsa ? CACHEMGR_SHKEY_FKCRT_EC : CACHEMGR_SHKEY_FKCRT;
+	return ssl_x509_fingerprint_sha1(origcrt, key + 1);
+}
+
+/*
+ * Encode fkcrt for the shared and remote tiers, along with its private key
+ * if it has one attached.  Returns a newly allocated buffer of *valsz octets
+ * that must be cleansed before freeing, or NULL.
+ */
+static unsigned char *
+cachemgr_fkcrt_pack(X509 *fkcrt, size_t *valsz)
+{
+	unsigned char *val, *p;
+	EVP_PKEY *pkey;
+	int crtsz, keysz = 0;
+
+	if ((crtsz = i2d_X509(fkcrt, NULL)) <= 0)
+		return NULL;
+	if ((pkey = ssl_x509_leafkey_get(fkcrt)) &&
+	    (keysz = i2d_PrivateKey(pkey, NULL)) <= 0)
+		return NULL;
+	if (!(val = malloc(4 + crtsz + keysz)))
+		return NULL;
+	val[0] = (crtsz >> 24) & 0xff;
+	val[1] = (crtsz >> 16) & 0xff;
+	val[2] = (crtsz >> 8) & 0xff;
+	val[3] = crtsz & 0xff;
+	p = val + 4;
+	i2d_X509(fkcrt, &p);
+	if (pkey)
+		i2d_PrivateKey(pkey, &p);
+	*valsz = 4 + crtsz + keysz;
+	return val;
+}
+
+/*
+ * Store fkcrt in the shared tier, unless it does not fit into a slot, and
+ * in the remote tier if remote is set, until it expires.
+ */
+static void
+cachemgr_fkcrt_share(X509 *origcrt, X509 *fkcrt, int ecdsa, int remote)
+{
+	unsigned char key[1 + SSL_X509_FPRSZ];
+	unsigned char *val;
+	size_t valsz;
+	time_t ttl;
+
+	if (cachemgr_fkcrt_shkey(origcrt, ecdsa, key) == -1)
+		return;
+	if (!(val = cachemgr_fkcrt_pack(fkcrt, &valsz)))
+		return;
+	if (cachemgr_shfkcrt &&
+	    valsz <= shmcache_maxvalsz(cachemgr_shfkcrt, sizeof(key)))
+		shmcache_set(cachemgr_shfkcrt, key, sizeof(key), val, valsz);
+	if (remote && cachemgr_rcache &&
+	    (ttl = ssl_x509_expiry(fkcrt) - time(NULL)) > 0)
+		rcache_set(cachemgr_rcache, key, sizeof(key), val, valsz, ttl);
+	OPENSSL_cleanse(val, valsz);
+	free(val);
+}
+
+/*
+ * Verify that the forged certificate crt is still valid, was signed by cacrt,
+ * and either matches its own private key pkey or, if pkey is NULL, uses
+ * leafkey.  Returns 1 if it does, 0 otherwise.
+ */
+static int
+cachemgr_fkcrt_verify(X509 *crt, EVP_PKEY *pkey, X509 *cacrt,
+                      EVP_PKEY *leafkey)
+{
+	EVP_PKEY *capub, *pub;
+	int ok;
+
+	ok = ssl_x509_is_valid(crt);
+	if (ok && (capub = X509_get_pubkey(cacrt))) {
+		ok = X509_verify(crt, capub) == 1;
+		EVP_PKEY_free(capub);
+	} else {
+		ok = 0;
+	}
+	if (ok && pkey) {
+		ok = X509_check_private_key(crt, pkey) == 1;
+	} else if (ok && (pub = X509_get_pubkey(crt))) {
+		ok = EVP_PKEY_eq(pub, leafkey) == 1;
+		EVP_PKEY_free(pub);
+	} else {
+		ok = 0;
+	}
+	return ok;
+}
+
+/*
+ * Decode a forged certificate from the shared tier and verify it using
+ * cachemgr_fkcrt_verify().  Returns the certificate or NULL.
+ */
+static X509 *
+cachemgr_fkcrt_unshare(const unsigned char *val, size_t valsz, X509 *cacrt,
+                       EVP_PKEY *leafkey)
+{
+	const unsigned char *p;
+	EVP_PKEY *pkey = NULL;
+	size_t crtsz;
+	X509 *crt;
+
+	if (valsz < 4)
+		return NULL;
+	crtsz = ((size_t)val[0] << 24) | ((size_t)val[1] << 16) |
+	        ((size_t)val[2] << 8) | (size_t)val[3];
+	if (crtsz > valsz - 4)
+		return NULL;
+	p = val + 4;
+	if (!(crt = d2i_X509(NULL, &p, crtsz)))
+		return NULL;
+	if (valsz > 4 + crtsz) {
+		p = val + 4 + crtsz;
+		pkey = d2i_AutoPrivateKey(NULL, &p, valsz - 4 - crtsz);
+		if (!pkey)
+			goto errout;
+	}
+
+	if (!cachemgr_fkcrt_verify(crt, pkey, cacrt, leafkey))
+		goto errout;
+	if (pkey && ssl_x509_leafkey_set(crt, pkey) == -1)
+		goto errout;
+	if (pkey)
+		EVP_PKEY_free(pkey);
+	return crt;
+
+errout:
+	if (pkey)
+		EVP_PKEY_free(pkey);
+	X509_free(crt);
+	return NULL;
+}
+
+/*
+ * Look up the forged certificate for origcrt in the shared tier for a
+ * configuration with the given epoch, CA certificate cacrt and shared leaf
+ * key leafkey.  Certificates found are inserted into the local cache.
+ * Returns a new reference to the certificate, or NULL.
+ */
+X509 *
+cachemgr_fkcrt_shared_get(X509 *origcrt, int ecdsa, X509 *cacrt,
+                          EVP_PKEY *leafkey, unsigned int epoch)
+{
+	unsigned char key[1 + SSL_X509_FPRSZ];
+	unsigned char *val;
+	size_t valsz;
+	X509 *crt;
+
+	if (!cachemgr_shfkcrt || cachemgr_fkcrt_shkey(origcrt, ecdsa,
+	                                              key) == -1)
+		return NULL;
+	if (shmcache_get(cachemgr_shfkcrt, key, sizeof(key),
+	                 &val, &valsz) != 1)
+		return NULL;
+	crt = cachemgr_fkcrt_unshare(val, valsz, cacrt, leafkey);
+	OPENSSL_cleanse(val, valsz);
+	free(val);
+	if (crt)
+		cachemgr_fkcrt_insert_local(origcrt, crt, ecdsa, epoch);
+	return crt;
+}
+
+/*
+ * Look up the forged certificate for origcrt in the remote tier, like
+ * cachemgr_fkcrt_shared_get().  Certificates found are also inserted into
+ * the shared tier.  Blocks the calling thread until the remote servers
+ * respond or time out; must not be called from connection handling threads.
+ * Returns a new reference to the certificate, or NULL.
+ */
+X509 *
+cachemgr_fkcrt_remote_get(X509 *origcrt, int ecdsa, X509 *cacrt,
+                          EVP_PKEY *leafkey, unsigned int epoch)
+{
+	unsigned char key[1 + SSL_X509_FPRSZ];
+	unsigned char *val;
+	size_t valsz;
+	X509 *crt;
+
+	if (!cachemgr_rcache || cachemgr_fkcrt_shkey(origcrt, ecdsa,
+	                                             key) == -1)
+		return NULL;
+	if (rcache_get(cachemgr_rcache, key, sizeof(key), &val, &valsz) != 1)
+		return NULL;
+	crt = cachemgr_fkcrt_unshare(val, valsz, cacrt, leafkey);
+	OPENSSL_cleanse(val, valsz);
+	free(val);
+	if (crt) {
+		cachemgr_fkcrt_insert_local(origcrt, crt, ecdsa, epoch);
+		if (cachemgr_shfkcrt && cachemgr_fkcrt_current(epoch))
+			cachemgr_fkcrt_share(origcrt, crt, ecdsa, 0);
+	}
+	return crt;
+}
+
+/*
+ * Insert fkcrt, forged for origcrt by a configuration with the given epoch,
+ * into the forged certificate cache and its shared and remote tiers, if set
+ * up, as the ECDSA variant if ecdsa is set.
+ * Does nothing if the epoch is no longer current.
+ */
+void
+cachemgr_fkcrt_insert(X509 *origcrt, X509 *fkcrt, int ecdsa,
+                      unsigned int epoch)
+{
+	cachemgr_fkcrt_insert_local(origcrt, fkcrt, ecdsa, epoch);
+	if ((cachemgr_shfkcrt || cachemgr_rcache) &&
+	    cachemgr_fkcrt_current(epoch))
+		cachemgr_fkcrt_share(origcrt, fkcrt, ecdsa, 1);
+}
+
+/*
+ * Parse the SHA-1 fingerprint of the original certificate from the name of a
+ * forged certificate written to certgendir, <origfpr>-<usedfpr>.crt with both
+ * fingerprints as 40 hex characters, into fpr.
+ * Returns -1 if name is not of that form, 0 otherwise.
+ */
+static int
+cachemgr_fkcrt_warm_name(const char *name, unsigned char *fpr)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	const char *hi, *lo;
+
+	if (strlen(name) != SSL_X509_FPRSZ * 4 + 5 ||
+	    name[SSL_X509_FPRSZ * 2] != '-' ||
+	    strcmp(name + SSL_X509_FPRSZ * 4 + 1, ".crt"))
+		return -1;
+	for (int i = 0; i < SSL_X509_FPRSZ * 4 + 1; i++) {
+		if (i != SSL_X509_FPRSZ * 2 && !strchr(hex, name[i]))
+			return -1;
+	}
+	for (int i = 0; i < SSL_X509_FPRSZ; i++) {
+		hi = strchr(hex, name[i * 2]);
+		lo = strchr(hex, name[i * 2 + 1]);
+		fpr[i] = ((hi - hex) << 4) | (lo - hex);
+	}
+	return 0;
+}
+
+/*
+ * Insert all forged certificates found in the certgendir opened as dirfd into
+ * the local forged certificate cache, keyed by the fingerprint of their
+ * original certificate taken from the file name.  Certificates that are
+ * expired, or were not signed by cacrt using leafkey, nor by eccacrt using
+ * ecleafkey as ECDSA variants, are skipped, as are all other files.
+ * Stops early after cachemgr_fini() was called or the epoch changed.
+ * Returns the number of inserted certificates, or -1 on error.
+ */
+ssize_t
+cachemgr_fkcrt_load(int dirfd, X509 *cacrt, EVP_PKEY *leafkey,
+                    X509 *eccacrt, EVP_PKEY *ecleafkey, unsigned int epoch)
+{
+	unsigned char fpr[SSL_X509_FPRSZ];
+	struct dirent *de;
+	cache_key_t key;
+	ssize_t n = 0;
+	DIR *dir;
+	FILE *f;
+	X509 *crt;
+	int fd, ecdsa;
+
+	/* own file offset, dirfd is shared by all worker processes */
+	fd = openat(dirfd, ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+	if (!(dir = fdopendir(fd))) {
+		close(fd);
+		return -1;
+	}
+	while ((de = readdir(dir))) {
+		if (__atomic_load_n(&cachemgr_warm_stop, __ATOMIC_SEQ_CST) ||
+		    !cachemgr_fkcrt_current(epoch))
+			break;
+		if (cachemgr_fkcrt_warm_name(de->d_name, fpr) == -1)
+			continue;
+		fd = openat(dirfd, de->d_name, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+		if (fd == -1)
+			continue;
+		if (!(f = fdopen(fd, "r"))) {
+			close(fd);
+			continue;
+		}
+		crt = PEM_read_X509(f, NULL, NULL, NULL);
+		fclose(f);
+		if (!crt) {
+			ERR_clear_error();
+			continue;
+		}
+		if (cachemgr_fkcrt_verify(crt, NULL, cacrt, leafkey)) {
+			ecdsa = 0;
+		} else if (eccacrt && ecleafkey &&
+		           cachemgr_fkcrt_verify(crt, NULL, eccacrt,
+		                                 ecleafkey)) {
+			ecdsa = 1;
+		} else {
+			X509_free(crt);
+			continue;
+		}
+		if (!(key = cachefkcrt_mkkey_fpr(fpr, ecdsa))) {
+			X509_free(crt);
+			continue;
+		}
+		cache_set(cachemgr_fkcrt, key, crt);
+		/* raced with cachemgr_fkcrt_flush() */
+		if (!cachemgr_fkcrt_current(epoch)) {
+			cache_del(cachemgr_fkcrt, cachefkcrt_mkkey_fpr(fpr,
+			                                               ecdsa));
+			break;
+		}
+		n++;
+	}
+	closedir(dir);
+	return n;
+}
+
+static void *
+cachemgr_fkcrt_warm_thread(void *arg)
+{
+	cachemgr_warm_t *warm = arg;
+	ssize_t n;
+
+	n = cachemgr_fkcrt_load(warm->dirfd, warm->cacrt, warm->leafkey,
+	                        warm->eccacrt, warm->ecleafkey, warm->epoch);
+	if (n == -1) {
+		log_err_printf("Failed to read forged certificates for "
+		               "cache warmup: %s (%i)\n",
+		               strerror(errno), errno);
+	} else {
+		log_dbg_printf("Warmed up forged certificate cache with %zi "
+		               "certificates\n", n);
+	}
+	X509_free(warm->cacrt);
+	EVP_PKEY_free(warm->leafkey);
+	if (warm->eccacrt)
+		X509_free(warm->eccacrt);
+	if (warm->ecleafkey)
+		EVP_PKEY_free(warm->ecleafkey);
+	free(warm);
+	return NULL;
+}
+
+/*
+ * Open certgendir dir for warming up the forged certificate cache later on.
+ * Must be called before dropping privileges and chroot.
+ * Returns -1 on error, 0 on success.
+ */
+int
+cachemgr_fkcrt_warm_open(const char *dir)
+{
+	if (cachemgr_warm_dirfd != -1)
+		close(cachemgr_warm_dirfd);
+	cachemgr_warm_dirfd = open(dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	return cachemgr_warm_dirfd == -1 ? -1 : 0;
+}
+
+/*
+ * Start warming up the forged certificate cache from the directory opened
+ * by cachemgr_fkcrt_warm_open() in a background thread, for a configuration
+ * with CA certificate cacrt and leaf key leafkey, and optionally eccacrt and
+ * ecleafkey for ECDSA variants.  Must be called after cachemgr_init().
+ * Returns -1 on error, 0 on success or if no directory was opened.
+ */
+int
+cachemgr_fkcrt_warm(X509 *cacrt, EVP_PKEY *leafkey,
+                    X509 *eccacrt, EVP_PKEY *ecleafkey)
+{
+	cachemgr_warm_t *warm;
+	int rv;
+
+	if (cachemgr_warm_dirfd == -1 || cachemgr_warm_running)
+		return 0;
+	if (!(warm = malloc(sizeof(cachemgr_warm_t))))
+		return -1;
+	warm->dirfd = cachemgr_warm_dirfd;
+	warm->epoch = __atomic_load_n(&cachemgr_fkcrt_epoch,
+	                              __ATOMIC_SEQ_CST);
+	warm->cacrt = cacrt;
+	ssl_x509_refcount_inc(cacrt);
+	warm->leafkey = leafkey;
+	ssl_key_refcount_inc(leafkey);
+	if (eccacrt && ecleafkey) {
+		warm->eccacrt = eccacrt;
+		ssl_x509_refcount_inc(eccacrt);
+		warm->ecleafkey = ecleafkey;
+		ssl_key_refcount_inc(ecleafkey);
+	} else {
+		warm->eccacrt = NULL;
+		warm->ecleafkey = NULL;
+	}
+	rv = pthread_create(&cachemgr_warm_thr, NULL,
+	                    cachemgr_fkcrt_warm_thread, warm);
+	if (rv) {
+		log_err_printf("cachemgr_fkcrt_warm: pthread_create failed: "
+		               "%s\n", strerror(rv));
+		X509_free(warm->cacrt);
+		EVP_PKEY_free(warm->leafkey);
+		if (warm->eccacrt)
+			X509_free(warm->eccacrt);
+		if (warm->ecleafkey)
+			EVP_PKEY_free(warm->ecleafkey);
+		free(warm);
+		return -1;
+	}
+	cachemgr_warm_running = 1;
+	return 0;
+}
+
+/*
+ * Store session sess in the shared tier under key, unless it is too large,
+ * and in the remote tier if remote is set, until it times out.
+ */
+static void
+cachemgr_sess_share(const unsigned char *key, size_t keysz,
+                    SSL_SESSION *sess, int remote)
+{
+	unsigned char *val, *p;
+	long ttl;
+	int sz;
+
+	if ((sz = i2d_SSL_SESSION(sess, NULL)) <= 0)
+		return;
+	if (!(val = malloc(sz)))
+		return;
+	p = val;
+	i2d_SSL_SESSION(sess, &p);
+	if (cachemgr_shsess &&
+	    (size_t)sz <= shmcache_maxvalsz(cachemgr_shsess, keysz))
+		shmcache_set(cachemgr_shsess, key, keysz, val, sz);
+	ttl = SSL_SESSION_get_time(sess) + SSL_SESSION_get_timeout(sess) -
+	      time(NULL);
+	if (remote && cachemgr_rcache && ttl > 0)
+		rcache_set(cachemgr_rcache, key, keysz, val, sz, ttl);
+	OPENSSL_cleanse(val, sz);
+	free(val);
+}
+
+/*
+ * Decode a session from the shared or remote tier.
+ * Returns a new session if valid, NULL otherwise.
+ */
+static SSL_SESSION *
+cachemgr_sess_unshare(unsigned char *val, size_t valsz)
+{
+	const unsigned char *p;
+	SSL_SESSION *sess;
+
+	p = val;
+	sess = d2i_SSL_SESSION(NULL, &p, valsz);
+	OPENSSL_cleanse(val, valsz);
+	free(val);
+	if (sess && !ssl_session_is_valid(sess)) {
+		SSL_SESSION_free(sess);
+		return NULL;
+	}
+	return sess;
+}
+
+/*
+ * Look up the session stored under key in the shared tier.
+ * Returns a new session if found and still valid, NULL otherwise.
+ */
+static SSL_SESSION *
+cachemgr_sess_shared_get(const unsigned char *key, size_t keysz)
+{
+	unsigned char *val;
+	size_t valsz;
+
+	if (shmcache_get(cachemgr_shsess, key, keysz, &val, &valsz) != 1)
+		return NULL;
+	return cachemgr_sess_unshare(val, valsz);
+}
+
+/*
+ * Build the shared tier key of a src session with ID id into key, which
+ * must hold 1 + SSL_MAX_SSL_SESSION_ID_LENGTH bytes.
+ * Returns the size of the key, or 0 if id is too long.
+ */
+static size_t
+cachemgr_ssess_shkey(const unsigned char *id, size_t idlen,
+                     unsigned char *key)
+{
+	if (idlen > SSL_MAX_SSL_SESSION_ID_LENGTH)
+		return 0;
+	key[0] = CACHEMGR_SHKEY_SSESS;
+	memcpy(key + 1, id, idlen);
+	return 1 + idlen;
+}
+
+/*
+ * Store src session sess in the shared and remote tiers.
+ */
+void
+cachemgr_ssess_share(SSL_SESSION *sess)
+{
+	unsigned char key[1 + SSL_MAX_SSL_SESSION_ID_LENGTH];
+	const unsigned char *id;
+	unsigned int idlen;
+	size_t keysz;
+
+	if (!cachemgr_shsess && !cachemgr_rcache)
+		return;
+	id = SSL_SESSION_get_id(sess, &idlen);
+	if ((keysz = cachemgr_ssess_shkey(id, idlen, key)))
+		cachemgr_sess_share(key, keysz, sess, 1);
+}
+
+/*
+ * Remove src session sess from the shared and remote tiers.
+ */
+void
+cachemgr_ssess_unshare(SSL_SESSION *sess)
+{
+	unsigned char key[1 + SSL_MAX_SSL_SESSION_ID_LENGTH];
+	const unsigned char *id;
+	unsigned int idlen;
+	size_t keysz;
+
+	if (!cachemgr_shsess && !cachemgr_rcache)
+		return;
+	id = SSL_SESSION_get_id(sess, &idlen);
+	if (!(keysz = cachemgr_ssess_shkey(id, idlen, key)))
+		return;
+	if (cachemgr_shsess)
+		shmcache_del(cachemgr_shsess, key, keysz);
+	if (cachemgr_rcache)
+		rcache_del(cachemgr_rcache, key, keysz);
+}
+
+/*
+ * Remove src session sess from the local cache and the shared tier, making
+ * its further use impossible.  Returns 1 if sess was removed from the local
+ * cache by this call, 0 if it was not there (anymore).
+ */
+int
+cachemgr_ssess_take(SSL_SESSION *sess)
+{
+	const unsigned char *id;
+	unsigned int idlen;
+	int rv;
+
+	id = SSL_SESSION_get_id(sess, &idlen);
+	rv = cache_del_borrowed(cachemgr_ssess,
+	                        cachessess_mkkey_tmp(id, idlen));
+	cachemgr_ssess_unshare(sess);
+	return rv;
+}
+
+/*
+ * Look up the src session with ID id in the shared tier and insert it into
+ * the local cache if found.  Returns a new reference to the session or NULL.
+ */
+SSL_SESSION *
+cachemgr_ssess_shared_get(const unsigned char *id, size_t idlen)
+{
+	unsigned char key[1 + SSL_MAX_SSL_SESSION_ID_LENGTH];
+	SSL_SESSION *sess;
+	size_t keysz;
+
+	if (!cachemgr_shsess || !(keysz = cachemgr_ssess_shkey(id, idlen,
+	                                                       key)))
+		return NULL;
+	if ((sess = cachemgr_sess_shared_get(key, keysz)))
+		cachemgr_ssess_set(sess);
+	return sess;
+}
+
+/*
+ * Completion callback of cachemgr_ssess_prefetch(), called on the remote
+ * cache thread.
+ */
+static void
+cachemgr_ssess_fetched_cb(unsigned char *val, size_t valsz, UNUSED void *arg)
+{
+	SSL_SESSION *sess;
+
+	if (!val)
+		return;
+	if ((sess = cachemgr_sess_unshare(val, valsz))) {
+		cachemgr_ssess_set(sess);
+		SSL_SESSION_free(sess);
+	}
+}
+
+/*
+ * Start looking up the src session with ID id in the remote tier and insert
+ * it into the local cache when found.  Never blocks; the session is
+ * available to connections that look it up after the remote servers have
+ * responded.
+ */
+void
+cachemgr_ssess_prefetch(const unsigned char *id, size_t idlen)
+{
+	unsigned char key[1 + SSL_MAX_SSL_SESSION_ID_LENGTH];
+	size_t keysz;
+
+	if (!cachemgr_rcache || !idlen ||
+	    !(keysz = cachemgr_ssess_shkey(id, idlen, key)))
+		return;
+	if (rcache_get_async(cachemgr_rcache, key, keysz,
+	                     cachemgr_ssess_fetched_cb, NULL) == -1)
+		log_dbg_printf("Remote session cache lookup dropped\n");
+}
+
+/*
+ * Dst sessions are kept in CACHEDSESS_SLOTS slots per destination and SNI.
+ * TLS 1.3 tickets should only be used once and servers usually send several
+ * after each handshake, so they are spread over the slots and removed when
+ * taken, which lets concurrent connections to the same server each resume
+ * with a ticket of their own.  Older sessions can be resumed any number of
+ * times and only use the first slot.
+ */
+static unsigned int cachemgr_dsess_slot;
+
+/*
+ * Look up a dst session for addr and sni.  Returns a new reference to the
+ * session or NULL.  Single use sessions are removed from the cache.
+ */
+SSL_SESSION *
+cachemgr_dsess_get(const struct sockaddr *addr, socklen_t addrlen,
+                   const char *sni)
+{
+	unsigned char buf[CACHEDSESS_TMPKEYSZ];
+	dynbuf_t tmp;
+	cache_key_t key;
+	SSL_SESSION *sess;
+	unsigned int base, slot = 0;
+
+	/* first slot first, then the others starting at a rotating offset to
+	 * keep concurrent lookups from picking the same ticket */
+	base = __atomic_fetch_add(&cachemgr_dsess_slot, 1, __ATOMIC_RELAXED);
+	for (unsigned int i = 0; i < CACHEDSESS_SLOTS; i++) {
+		if (i > 0)
+			slot = 1 + (base + i) % (CACHEDSESS_SLOTS - 1);
+		/* look up on the stack unless the SNI is overlong */
+		key = cachedsess_mkkey_tmp(addr, addrlen, sni, slot,
+		                           &tmp, buf, sizeof(buf));
+		if (key)
+			sess = cache_get_borrowed(cachemgr_dsess, key);
+		else
+			sess = cache_get(cachemgr_dsess, cachedsess_mkkey(addr,
+			                 addrlen, sni, slot));
+		if (!sess)
+			continue;
+		if (ssl_session_is_single_use(sess)) {
+			if (key)
+				cache_del_borrowed(cachemgr_dsess, key);
+			else
+				cache_del(cachemgr_dsess, cachedsess_mkkey(
+				          addr, addrlen, sni, slot));
+		}
+		return sess;
+	}
+	return NULL;
+}
+
+/*
+ * Store dst session sess for addr and sni, into the next slot for single use
+ * sessions, possibly replacing an older one.
+ */
+void
+cachemgr_dsess_set(const struct sockaddr *addr, socklen_t addrlen,
+                   const char *sni, SSL_SESSION *sess)
+{
+	unsigned int slot = 0;
+
+	if (ssl_session_is_single_use(sess))
+		slot = __atomic_fetch_add(&cachemgr_dsess_slot, 1,
+		                          __ATOMIC_RELAXED) % CACHEDSESS_SLOTS;
+	cache_set(cachemgr_dsess, cachedsess_mkkey(addr, addrlen, sni, slot),
+	          cachedsess_mkval(sess));
+}
+
+/*
+ * Remove all dst sessions for addr and sni.
+ */
+void
+cachemgr_dsess_del(const struct sockaddr *addr, socklen_t addrlen,
+                   const char *sni)
+{
+	for (unsigned int slot = 0; slot < CACHEDSESS_SLOTS; slot++)
+		cache_del(cachemgr_dsess, cachedsess_mkkey(addr, addrlen, sni,
+		                                           slot));
+}
+
+/*
+ * Build the shared tier key of a dst session, or return NULL.
+ */
+static unsigned char *
+cachemgr_dsess_shkey(const struct sockaddr *addr, socklen_t addrlen,
+                     const char *sni, size_t *keysz)
+{
+	dynbuf_t *db;
+	unsigned char *key;
+
+	if (!(db = cachedsess_mkkey(addr, addrlen, sni, 0)))
+		return NULL;
+	if ((key = malloc(1 + db->sz))) {
+		key[0] = CACHEMGR_SHKEY_DSESS;
+		memcpy(key + 1, db->buf, db->sz);
+		*keysz = 1 + db->sz;
+	}
+	dynbuf_free(db);
+	return key;
+}
+
+/*
+ * Store dst session sess for addr and sni in the shared tier.
+ */
+void
+cachemgr_dsess_share(const struct sockaddr *addr, socklen_t addrlen,
+                     const char *sni, SSL_SESSION *sess)
+{
+	unsigned char *key;
+	size_t keysz;
+
+	if (!cachemgr_shsess)
+		return;
+	if ((key = cachemgr_dsess_shkey(addr, addrlen, sni, &keysz))) {
+		cachemgr_sess_share(key, keysz, sess, 0);
+		free(key);
+	}
+}
+
+/*
+ * Look up the dst session for addr and sni in the shared tier and insert it
+ * into the local cache if found.  Returns a new reference to the session or
+ * NULL.
+ */
+SSL_SESSION *
+cachemgr_dsess_shared_get(const struct sockaddr *addr, socklen_t addrlen,
+                          const char *sni)
+{
+	SSL_SESSION *sess = NULL;
+	unsigned char *key;
+	size_t keysz;
+
+	if (!cachemgr_shsess)
+		return NULL;
+	if ((key = cachemgr_dsess_shkey(addr, addrlen, sni, &keysz))) {
+		if ((sess = cachemgr_sess_shared_get(key, keysz)))
+			cachemgr_dsess_set(addr, addrlen, sni, sess);
+		free(key);
+	}
+	return sess;
+}
+
+/*
+ * Look up the target cert for name.  With a target cert index, a cert not
+ * in the cache is loaded from its file and cached for all of its names
+ * that still refer to that file in the index.  Loading happens on the
+ * calling thread; concurrent lookups of the same cert may load it more than
+ * once.  Since the cache only ever holds names from the read-only index,
+ * the index is consulted first, such that the common case of names without
+ * a target cert returns without locking or allocating.
+ * Returns the cert with its reference count incremented, or NULL.
+ */
+cert_t *
+cachemgr_tgcrt_lookup(const char *name)
+{
+	const char *filename;
+	cert_t *cert;
+	char **names;
+
+	if (!cachemgr_tgidx)
+		return cachemgr_tgcrt_get(name);
+	if (!(filename = certindex_get(cachemgr_tgidx, name)))
+		return NULL;
+	if ((cert = cachemgr_tgcrt_get(name)))
+		return cert;
+	if (!(cert = cert_new_load(filename))) {
+		log_err_printf("Failed to load cert and key from PEM file "
+		               "'%s'\n", filename);
+		return NULL;
+	}
+	if (X509_check_private_key(cert->crt, cert->key) != 1) {
+		log_err_printf("Cert does not match key in PEM file "
+		               "'%s'\n", filename);
+		cert_free(cert);
+		return NULL;
+	}
+	cachemgr_tgcrt_set(name, cert);
+	if (!(names = ssl_x509_names(cert->crt)))
+		return cert;
+	for (char **p = names; *p; p++) {
+		/* be deliberately vulnerable to NULL prefix attacks */
+		char *sep;
+		if ((sep = strchr(*p, '!'))) {
+			*sep = '\0';
+		}
+		if (strcmp(*p, name) &&
+		    certindex_get(cachemgr_tgidx, *p) == filename)
+			cachemgr_tgcrt_set(*p, cert);
+		free(*p);
+	}
+	free(names);
+	return cert;
+}
+
+/*
+ * Look up the target cert for name, falling back to the wildcarded form of
+ * name as produced by ssl_wildcardify().  Target certs loaded at startup are
+ * looked up in the read-only match table without locking or allocating.
+ * Returns the cert with its reference count incremented, or NULL.
+ */
+cert_t *
+cachemgr_tgcrt_match(const char *name)
+{
+	char buf[256];
+	const char *dot;
+	char *wildcarded;
+	cert_t *cert;
+	size_t sz;
+
+	if (cachemgr_tgmatch)
+		return certmatch_get(cachemgr_tgmatch, name);
+	if ((cert = cachemgr_tgcrt_lookup(name)))
+		return cert;
+	if (!(dot = strchr(name, '.')))
+		dot = "";
+	sz = strlen(dot);
+	if (sz + 2 <= sizeof(buf)) {
+		buf[0] = '*';
+		memcpy(buf + 1, dot, sz + 1);
+		return cachemgr_tgcrt_lookup(buf);
+	}
+	if (!(wildcarded = ssl_wildcardify(name)))
+		return NULL;
+	cert = cachemgr_tgcrt_lookup(wildcarded);
+	free(wildcarded);
+	return cert;
 }
 
 /* vim: set noet ft=c: */
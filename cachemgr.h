@@ -34,33 +34,164 @@
 #include "cachetgcrt.h"
 #include "cachessess.h"
 #include "cachedsess.h"
+#include "cachesslctx.h"
+#include "cachevrfy.h"
+#include "cachedns.h"
+#include "cachesni.h"
+#include "cachepass.h"
+#include "cacheocsp.h"
+#include "cachehttp.h"
+#include "certstore.h"
+#include "sessstore.h"
+#include "certindex.h"
+#include "certmatch.h"
+#include "shmcache.h"
+#include "rcache.h"
 
 extern cache_t *cachemgr_fkcrt;
 extern cache_t *cachemgr_tgcrt;
 extern cache_t *cachemgr_ssess;
 extern cache_t *cachemgr_dsess;
+extern cache_t *cachemgr_sslctx;
+extern cache_t *cachemgr_vrfy;
+extern cache_t *cachemgr_dns;
+extern cache_t *cachemgr_sni;
+extern cache_t *cachemgr_pass;
+extern cache_t *cachemgr_ocsp;
+extern cache_t *cachemgr_http;
+extern certstore_t *cachemgr_fkstore;
+extern sessstore_t *cachemgr_sessstore;
+extern certindex_t *cachemgr_tgidx;
+extern certmatch_t *cachemgr_tgmatch;
+extern shmcache_t *cachemgr_shfkcrt;
+extern shmcache_t *cachemgr_shsess;
+extern rcache_t *cachemgr_rcache;
+extern unsigned int cachemgr_fkcrt_epoch;
 
 int cachemgr_preinit(void) WUNRES;
 int cachemgr_init(void) WUNRES;
 void cachemgr_fini(void);
 void cachemgr_gc(void);
+int cachemgr_gc_step(size_t);
+cert_t * cachemgr_tgcrt_lookup(const char *) NONNULL(1) WUNRES;
+cert_t * cachemgr_tgcrt_match(const char *) NONNULL(1) WUNRES;
+unsigned int cachemgr_fkcrt_flush(void);
+void cachemgr_sslctx_flush(void);
+void cachemgr_dsess_flush(void);
+ssize_t cachemgr_sess_load(void) WUNRES;
+ssize_t cachemgr_sess_save(void);
+void cachemgr_fkcrt_insert(X509 *, X509 *, int, unsigned int) NONNULL(1,2);
+ssize_t cachemgr_fkcrt_load(int, X509 *, EVP_PKEY *, X509 *, EVP_PKEY *,
+                            unsigned int) NONNULL(2,3) WUNRES;
+int cachemgr_fkcrt_warm_open(const char *) NONNULL(1) WUNRES;
+int cachemgr_fkcrt_warm(X509 *, EVP_PKEY *, X509 *, EVP_PKEY *)
+    NONNULL(1,2) WUNRES;
+int cachemgr_share(size_t) WUNRES;
+int cachemgr_remote(const char *, unsigned int) NONNULL(1) WUNRES;
+X509 * cachemgr_fkcrt_shared_get(X509 *, int, X509 *, EVP_PKEY *,
+                                 unsigned int) NONNULL(1,3,4) WUNRES;
+X509 * cachemgr_fkcrt_remote_get(X509 *, int, X509 *, EVP_PKEY *,
+                                 unsigned int) NONNULL(1,3,4) WUNRES;
+void cachemgr_ssess_share(SSL_SESSION *) NONNULL(1);
+void cachemgr_ssess_unshare(SSL_SESSION *) NONNULL(1);
+int cachemgr_ssess_take(SSL_SESSION *) NONNULL(1) WUNRES;
+SSL_SESSION * cachemgr_ssess_shared_get(const unsigned char *, size_t)
+              NONNULL(1) WUNRES;
+void cachemgr_ssess_prefetch(const unsigned char *, size_t) NONNULL(1);
+SSL_SESSION * cachemgr_dsess_get(const struct sockaddr *, socklen_t,
+                                 const char *) NONNULL(1) WUNRES;
+void cachemgr_dsess_set(const struct sockaddr *, socklen_t, const char *,
+                        SSL_SESSION *) NONNULL(1,4);
+void cachemgr_dsess_del(const struct sockaddr *, socklen_t, const char *)
+     NONNULL(1);
+void cachemgr_dsess_share(const struct sockaddr *, socklen_t, const char *,
+                          SSL_SESSION *) NONNULL(1,4);
+SSL_SESSION * cachemgr_dsess_shared_get(const struct sockaddr *, socklen_t,
+                                        const char *) NONNULL(1) WUNRES;
 
+#define cachemgr_fkcrt_current(epoch) \
+        ((epoch) == __atomic_load_n(&cachemgr_fkcrt_epoch, __ATOMIC_SEQ_CST))
+
+/* lookups build their keys in compound literals on the stack */
 #define cachemgr_fkcrt_get(key) \
-        cache_get(cachemgr_fkcrt, cachefkcrt_mkkey(key))
+        cache_get_borrowed(cachemgr_fkcrt, cachefkcrt_mkkey_tmp((key), \
+                           (unsigned char [CACHEFKCRT_KEYSZ]){0}))
 #define cachemgr_fkcrt_set(key, val) \
-        cache_set(cachemgr_fkcrt, cachefkcrt_mkkey(key), cachefkcrt_mkval(val))
+        cache_set(cachemgr_fkcrt, cachefkcrt_mkkey(key), \
+                  cachefkcrt_mkval((val), (key)))
 #define cachemgr_fkcrt_del(key) \
         cache_del(cachemgr_fkcrt, cachefkcrt_mkkey(key))
+#define cachemgr_fkcrt_get_ec(key) \
+        cache_get_borrowed(cachemgr_fkcrt, cachefkcrt_mkkey_ec_tmp((key), \
+                           (unsigned char [CACHEFKCRT_KEYSZ]){0}))
+#define cachemgr_fkcrt_set_ec(key, val) \
+        cache_set(cachemgr_fkcrt, cachefkcrt_mkkey_ec(key), \
+                  cachefkcrt_mkval((val), (key)))
+#define cachemgr_fkcrt_del_ec(key) \
+        cache_del(cachemgr_fkcrt, cachefkcrt_mkkey_ec(key))
 
 #define cachemgr_tgcrt_get(key) \
-        cache_get(cachemgr_tgcrt, cachetgcrt_mkkey(key))
+        cache_get_borrowed(cachemgr_tgcrt, (cache_key_t)(key))
 #define cachemgr_tgcrt_set(key, val) \
         cache_set(cachemgr_tgcrt, cachetgcrt_mkkey(key), cachetgcrt_mkval(val))
 #define cachemgr_tgcrt_del(key) \
         cache_del(cachemgr_tgcrt, cachetgcrt_mkkey(key))
 
+#define cachemgr_sslctx_get(key) \
+        cachemgr_sslctx_get_in(key, 0)
+#define cachemgr_sslctx_set(key, val) \
+        cachemgr_sslctx_set_in(key, 0, val)
+#define cachemgr_sslctx_del(key) \
+        cache_del(cachemgr_sslctx, cachesslctx_mkkey(key, 0))
+#define cachemgr_sslctx_get_in(key, dom) \
+        cache_get(cachemgr_sslctx, cachesslctx_mkkey(key, dom))
+#define cachemgr_sslctx_set_in(key, dom, val) \
+        cache_set(cachemgr_sslctx, cachesslctx_mkkey(key, dom), \
+                  cachesslctx_mkval(val))
+
+#define cachemgr_vrfy_get(crt, chain) \
+        cache_get(cachemgr_vrfy, cachevrfy_mkkey((crt), (chain)))
+#define cachemgr_vrfy_set(crt, chain, expiry) \
+        cache_set(cachemgr_vrfy, cachevrfy_mkkey((crt), (chain)), \
+                  cachevrfy_mkval(expiry))
+#define cachemgr_vrfy_del(crt, chain) \
+        cache_del(cachemgr_vrfy, cachevrfy_mkkey((crt), (chain)))
+
+#define cachemgr_dns_get(af, host) \
+        cache_get(cachemgr_dns, cachedns_mkkey((af), (host)))
+#define cachemgr_dns_set(af, host, val) \
+        cache_set(cachemgr_dns, cachedns_mkkey((af), (host)), \
+                  cachedns_mkval(val))
+#define cachemgr_dns_del(af, host) \
+        cache_del(cachemgr_dns, cachedns_mkkey((af), (host)))
+#define cachemgr_sni_get(sni) \
+        cache_get(cachemgr_sni, cachesni_mkkey(sni))
+#define cachemgr_sni_set(sni, val) \
+        cache_set(cachemgr_sni, cachesni_mkkey(sni), cachesni_mkval(val))
+#define cachemgr_sni_del(sni) \
+        cache_del(cachemgr_sni, cachesni_mkkey(sni))
+#define cachemgr_pass_get(addr, addrlen, sni) \
+        cache_get(cachemgr_pass, cachepass_mkkey((addr), (addrlen), (sni)))
+#define cachemgr_pass_set(addr, addrlen, sni, val) \
+        cache_set(cachemgr_pass, cachepass_mkkey((addr), (addrlen), (sni)), \
+                  cachepass_mkval(val))
+#define cachemgr_pass_del(addr, addrlen, sni) \
+        cache_del(cachemgr_pass, cachepass_mkkey((addr), (addrlen), (sni)))
+#define cachemgr_ocsp_get(crt) \
+        cache_get(cachemgr_ocsp, cacheocsp_mkkey(crt))
+#define cachemgr_ocsp_set(crt, val) \
+        cache_set(cachemgr_ocsp, cacheocsp_mkkey(crt), cacheocsp_mkval(val))
+#define cachemgr_ocsp_del(crt) \
+        cache_del(cachemgr_ocsp, cacheocsp_mkkey(crt))
+#define cachemgr_http_get(dst, host, uri) \
+        cache_get(cachemgr_http, cachehttp_mkkey(dst, host, uri))
+#define cachemgr_http_set(dst, host, uri, val) \
+        cache_set(cachemgr_http, cachehttp_mkkey(dst, host, uri), \
+                  cachehttp_mkval(val))
+
 #define cachemgr_ssess_get(key, keysz) \
-        cache_get(cachemgr_ssess, cachessess_mkkey((key), (keysz)))
+        cache_get_borrowed(cachemgr_ssess, \
+                           cachessess_mkkey_tmp((key), (keysz)))
 #define cachemgr_ssess_set(val) \
         { \
                 unsigned int len; \
@@ -73,16 +204,9 @@ void cachemgr_gc(void);
         { \
                 unsigned int len; \
                 const unsigned char* id = SSL_SESSION_get_id(val, &len); \
-                cache_del(cachemgr_ssess, \
-                          cachessess_mkkey(id, len)); \
+                cache_del_borrowed(cachemgr_ssess, \
+                                   cachessess_mkkey_tmp(id, len)); \
         }
-#define cachemgr_dsess_get(addr, addrlen, sni) \
-        cache_get(cachemgr_dsess, cachedsess_mkkey((addr), (addrlen), (sni)))
-#define cachemgr_dsess_set(addr, addrlen, sni, val) \
-        cache_set(cachemgr_dsess, cachedsess_mkkey((addr), (addrlen), (sni)), \
-                                  cachedsess_mkval(val))
-#define cachemgr_dsess_del(addr, addrlen, sni) \
-        cache_del(cachemgr_dsess, cachedsess_mkkey((addr), (addrlen), (sni)))
 
 #endif /* !CACHEMGR_H */
 
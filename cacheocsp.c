@@ -0,0 +1,228 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "cacheocsp.h"
+
+#include "dynbuf.h"
+#include "util.h"
+#include "mempool.h"
+
+#define kcalloc(N,Z) mempool_huge_calloc(N,Z)
+#define kmalloc(Z) mempool_huge_malloc(Z)
+#define krealloc(P,Z) mempool_huge_realloc(P,Z)
+#define kfree(P) mempool_huge_free(P)
+#include "khash.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Cache for the OCSP responses stapled to forged certificates, signed by
+ * the CA that forged them.  Entries are valid until the nextUpdate time of
+ * the response, and are renewed in the background from their refresh time,
+ * such that handshakes always find a fresh response.
+ *
+ * key: dynbuf_t *          serial number of the forged certificate
+ * val: cacheocsp_val_t *   DER encoded OCSP response with refresh time
+ */
+
+#define kh_dynbuf_hash_func(b) util_hash((b)->buf, (b)->sz)
+
+#define kh_dynbuf_hash_equal(a, b) \
+        (((a)->sz == (b)->sz) && \
+         (memcmp((a)->buf, (b)->buf, (a)->sz) == 0))
+
+KHASH_INIT(ocspmap_t, dynbuf_t*, void*, 1, kh_dynbuf_hash_func,
+           kh_dynbuf_hash_equal)
+
+static cache_iter_t
+cacheocsp_begin_cb(UNUSED cache_map_t map)
+{
+	return kh_begin((khash_t(ocspmap_t) *)map);
+}
+
+static cache_iter_t
+cacheocsp_end_cb(cache_map_t map)
+{
+	return kh_end((khash_t(ocspmap_t) *)map);
+}
+
+static int
+cacheocsp_exist_cb(cache_map_t map, cache_iter_t it)
+{
+	return kh_exist((khash_t(ocspmap_t) *)map, it);
+}
+
+static void
+cacheocsp_del_cb(cache_map_t map, cache_iter_t it)
+{
+	kh_del(ocspmap_t, (khash_t(ocspmap_t) *)map, it);
+}
+
+static cache_iter_t
+cacheocsp_get_cb(cache_map_t map, cache_key_t key)
+{
+	return kh_get(ocspmap_t, (khash_t(ocspmap_t) *)map, key);
+}
+
+static cache_iter_t
+cacheocsp_put_cb(cache_map_t map, cache_key_t key, int *ret)
+{
+	return kh_put(ocspmap_t, (khash_t(ocspmap_t) *)map, key, ret);
+}
+
+static void
+cacheocsp_free_key_cb(cache_key_t key)
+{
+	dynbuf_free(key);
+}
+
+static void
+cacheocsp_free_val_cb(cache_val_t val)
+{
+	free(val);
+}
+
+static cache_key_t
+cacheocsp_get_key_cb(cache_map_t map, cache_iter_t it)
+{
+	return kh_key((khash_t(ocspmap_t) *)map, it);
+}
+
+static cache_val_t
+cacheocsp_get_val_cb(cache_map_t map, cache_iter_t it)
+{
+	return kh_val((khash_t(ocspmap_t) *)map, it);
+}
+
+static void
+cacheocsp_set_val_cb(cache_map_t map, cache_iter_t it, cache_val_t val)
+{
+	kh_val((khash_t(ocspmap_t) *)map, it) = val;
+}
+
+static cache_val_t
+cacheocsp_unpackverify_val_cb(cache_val_t val, int copy)
+{
+	if (((cacheocsp_val_t *)val)->expiry <= time(NULL))
+		return NULL;
+	if (copy)
+		return cacheocsp_mkval(val);
+	return ((void*)-1);
+}
+
+static cache_map_t
+cacheocsp_map_new_cb(void)
+{
+	return kh_init(ocspmap_t);
+}
+
+static void
+cacheocsp_map_free_cb(cache_map_t map)
+{
+	kh_destroy(ocspmap_t, (khash_t(ocspmap_t) *)map);
+}
+
+static int
+cacheocsp_full_cb(cache_map_t map)
+{
+	khash_t(ocspmap_t) *h = map;
+
+	return h->n_occupied >= h->upper_bound;
+}
+
+static int
+cacheocsp_resize_cb(cache_map_t map, size_t n)
+{
+	return kh_resize(ocspmap_t, (khash_t(ocspmap_t) *)map,
+	                 (khint_t)(n / __ac_HASH_UPPER) + 1);
+}
+
+static unsigned int
+cacheocsp_hash_cb(cache_key_t key)
+{
+	return kh_dynbuf_hash_func((dynbuf_t *)key);
+}
+
+static size_t
+cacheocsp_size_cb(cache_key_t key, cache_val_t val)
+{
+	return sizeof(dynbuf_t) + ((dynbuf_t *)key)->sz +
+	       sizeof(cacheocsp_val_t) + ((cacheocsp_val_t *)val)->sz;
+}
+
+void
+cacheocsp_init_cb(cache_t *cache)
+{
+	cache->map_new_cb               = cacheocsp_map_new_cb;
+	cache->map_free_cb              = cacheocsp_map_free_cb;
+	cache->hash_cb                  = cacheocsp_hash_cb;
+	cache->begin_cb                 = cacheocsp_begin_cb;
+	cache->end_cb                   = cacheocsp_end_cb;
+	cache->exist_cb                 = cacheocsp_exist_cb;
+	cache->del_cb                   = cacheocsp_del_cb;
+	cache->get_cb                   = cacheocsp_get_cb;
+	cache->put_cb                   = cacheocsp_put_cb;
+	cache->free_key_cb              = cacheocsp_free_key_cb;
+	cache->free_val_cb              = cacheocsp_free_val_cb;
+	cache->get_key_cb               = cacheocsp_get_key_cb;
+	cache->get_val_cb               = cacheocsp_get_val_cb;
+	cache->set_val_cb               = cacheocsp_set_val_cb;
+	cache->unpackverify_val_cb      = cacheocsp_unpackverify_val_cb;
+	cache->size_cb                  = cacheocsp_size_cb;
+	cache->full_cb                  = cacheocsp_full_cb;
+	cache->resize_cb                = cacheocsp_resize_cb;
+}
+
+/*
+ * Create a key from the serial number of a forged certificate.
+ * Returns NULL on out of memory condition.
+ */
+cache_key_t
+cacheocsp_mkkey(X509 *crt)
+{
+	const ASN1_INTEGER *serial;
+
+	serial = X509_get0_serialNumber(crt);
+	return dynbuf_new_copy(ASN1_STRING_get0_data(serial),
+	                       ASN1_STRING_length(serial));
+}
+
+cache_val_t
+cacheocsp_mkval(const cacheocsp_val_t *val)
+{
+	cacheocsp_val_t *v;
+
+	if (!(v = malloc(sizeof(cacheocsp_val_t) + val->sz)))
+		return NULL;
+	memcpy(v, val, sizeof(cacheocsp_val_t) + val->sz);
+	return v;
+}
+
+/* vim: set noet ft=c: */
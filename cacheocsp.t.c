@@ -0,0 +1,138 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "ssl.h"
+#include "cachemgr.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <check.h>
+
+#define TESTCERT "extra/pki/rsa.crt"
+#define TESTCERT2 "extra/pki/server.crt"
+
+static void
+cachemgr_setup(void)
+{
+	if ((ssl_init() == -1) || (cachemgr_preinit() == -1))
+		exit(EXIT_FAILURE);
+}
+
+static void
+cachemgr_teardown(void)
+{
+	cachemgr_fini();
+	ssl_fini();
+}
+
+static void
+cacheocsp_val_init(cacheocsp_val_t *val, time_t expiry)
+{
+	val->refresh = expiry - 30;
+	val->expiry = expiry;
+	val->sz = 4;
+	memcpy(val->der, "\x30\x03\x0a\x01", 4);
+}
+
+START_TEST(cache_ocsp_01)
+{
+	unsigned char buf[sizeof(cacheocsp_val_t) + 4];
+	cacheocsp_val_t *val = (cacheocsp_val_t *)buf, *v;
+	X509 *c;
+
+	c = ssl_x509_load(TESTCERT);
+	fail_unless(!!c, "loading certificate failed");
+	cacheocsp_val_init(val, time(NULL) + 60);
+	cachemgr_ocsp_set(c, val);
+	v = cachemgr_ocsp_get(c);
+	fail_unless(!!v, "cache did not return a response");
+	fail_unless(v != val, "cache did not return a copy");
+	fail_unless(v->sz == 4 && !memcmp(v->der, val->der, 4),
+	            "cache returned wrong response");
+	fail_unless(v->refresh == val->refresh, "wrong refresh time");
+	free(v);
+	X509_free(c);
+}
+END_TEST
+
+START_TEST(cache_ocsp_02)
+{
+	unsigned char buf[sizeof(cacheocsp_val_t) + 4];
+	cacheocsp_val_t *val = (cacheocsp_val_t *)buf, *v;
+	X509 *c1, *c2;
+
+	c1 = ssl_x509_load(TESTCERT);
+	c2 = ssl_x509_load(TESTCERT2);
+	fail_unless(c1 && c2, "loading certificates failed");
+	cacheocsp_val_init(val, time(NULL) + 60);
+	cachemgr_ocsp_set(c1, val);
+	v = cachemgr_ocsp_get(c2);
+	fail_unless(v == NULL, "cache returned response for other serial");
+	X509_free(c1);
+	X509_free(c2);
+}
+END_TEST
+
+START_TEST(cache_ocsp_03)
+{
+	unsigned char buf[sizeof(cacheocsp_val_t) + 4];
+	cacheocsp_val_t *val = (cacheocsp_val_t *)buf, *v;
+	X509 *c;
+
+	c = ssl_x509_load(TESTCERT);
+	fail_unless(!!c, "loading certificate failed");
+	cacheocsp_val_init(val, time(NULL) - 1);
+	cachemgr_ocsp_set(c, val);
+	v = cachemgr_ocsp_get(c);
+	fail_unless(v == NULL, "cache returned expired response");
+	X509_free(c);
+}
+END_TEST
+
+Suite *
+cacheocsp_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("cacheocsp");
+
+	tc = tcase_create("cache_ocsp");
+	tcase_add_checked_fixture(tc, cachemgr_setup, cachemgr_teardown);
+	tcase_add_test(tc, cache_ocsp_01);
+	tcase_add_test(tc, cache_ocsp_02);
+	tcase_add_test(tc, cache_ocsp_03);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
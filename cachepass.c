@@ -0,0 +1,272 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "cachepass.h"
+
+#include "dynbuf.h"
+#include "util.h"
+#include "mempool.h"
+
+#define kcalloc(N,Z) mempool_huge_calloc(N,Z)
+#define kmalloc(Z) mempool_huge_malloc(Z)
+#define krealloc(P,Z) mempool_huge_realloc(P,Z)
+#define kfree(P) mempool_huge_free(P)
+#include "khash.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <netinet/in.h>
+
+/*
+ * Negative cache of destinations for which SSL interception failed in a way
+ * that is bound to happen again, such as client certificate authentication
+ * required by the server, a server not speaking SSL, or a client rejecting
+ * the forged certificate because of certificate pinning.  Connections to
+ * cached destinations are passed through without attempting interception
+ * until the entry expires.
+ *
+ * key: dynbuf_t *          original destination IP address, port and SNI
+ * val: cachepass_val_t *   expiry time and reason
+ */
+
+#define kh_dynbuf_hash_func(b) util_hash((b)->buf, (b)->sz)
+
+#define kh_dynbuf_hash_equal(a, b) \
+        (((a)->sz == (b)->sz) && \
+         (memcmp((a)->buf, (b)->buf, (a)->sz) == 0))
+
+KHASH_INIT(passmap_t, dynbuf_t*, void*, 1, kh_dynbuf_hash_func,
+           kh_dynbuf_hash_equal)
+
+static cache_iter_t
+cachepass_begin_cb(UNUSED cache_map_t map)
+{
+	return kh_begin((khash_t(passmap_t) *)map);
+}
+
+static cache_iter_t
+cachepass_end_cb(cache_map_t map)
+{
+	return kh_end((khash_t(passmap_t) *)map);
+}
+
+static int
+cachepass_exist_cb(cache_map_t map, cache_iter_t it)
+{
+	return kh_exist((khash_t(passmap_t) *)map, it);
+}
+
+static void
+cachepass_del_cb(cache_map_t map, cache_iter_t it)
+{
+	kh_del(passmap_t, (khash_t(passmap_t) *)map, it);
+}
+
+static cache_iter_t
+cachepass_get_cb(cache_map_t map, cache_key_t key)
+{
+	return kh_get(passmap_t, (khash_t(passmap_t) *)map, key);
+}
+
+static cache_iter_t
+cachepass_put_cb(cache_map_t map, cache_key_t key, int *ret)
+{
+	return kh_put(passmap_t, (khash_t(passmap_t) *)map, key, ret);
+}
+
+static void
+cachepass_free_key_cb(cache_key_t key)
+{
+	dynbuf_free(key);
+}
+
+static void
+cachepass_free_val_cb(cache_val_t val)
+{
+	free(val);
+}
+
+static cache_key_t
+cachepass_get_key_cb(cache_map_t map, cache_iter_t it)
+{
+	return kh_key((khash_t(passmap_t) *)map, it);
+}
+
+static cache_val_t
+cachepass_get_val_cb(cache_map_t map, cache_iter_t it)
+{
+	return kh_val((khash_t(passmap_t) *)map, it);
+}
+
+static void
+cachepass_set_val_cb(cache_map_t map, cache_iter_t it, cache_val_t val)
+{
+	kh_val((khash_t(passmap_t) *)map, it) = val;
+}
+
+static cache_val_t
+cachepass_unpackverify_val_cb(cache_val_t val, int copy)
+{
+	if (((cachepass_val_t *)val)->expiry <= time(NULL))
+		return NULL;
+	if (copy)
+		return cachepass_mkval(val);
+	return ((void*)-1);
+}
+
+static cache_map_t
+cachepass_map_new_cb(void)
+{
+	return kh_init(passmap_t);
+}
+
+static void
+cachepass_map_free_cb(cache_map_t map)
+{
+	kh_destroy(passmap_t, (khash_t(passmap_t) *)map);
+}
+
+static int
+cachepass_full_cb(cache_map_t map)
+{
+	khash_t(passmap_t) *h = map;
+
+	return h->n_occupied >= h->upper_bound;
+}
+
+static int
+cachepass_resize_cb(cache_map_t map, size_t n)
+{
+	return kh_resize(passmap_t, (khash_t(passmap_t) *)map,
+	                 (khint_t)(n / __ac_HASH_UPPER) + 1);
+}
+
+static unsigned int
+cachepass_hash_cb(cache_key_t key)
+{
+	return kh_dynbuf_hash_func((dynbuf_t *)key);
+}
+
+static size_t
+cachepass_size_cb(cache_key_t key, UNUSED cache_val_t val)
+{
+	return sizeof(dynbuf_t) + ((dynbuf_t *)key)->sz +
+	       sizeof(cachepass_val_t);
+}
+
+void
+cachepass_init_cb(cache_t *cache)
+{
+	cache->map_new_cb               = cachepass_map_new_cb;
+	cache->map_free_cb              = cachepass_map_free_cb;
+	cache->hash_cb                  = cachepass_hash_cb;
+	cache->begin_cb                 = cachepass_begin_cb;
+	cache->end_cb                   = cachepass_end_cb;
+	cache->exist_cb                 = cachepass_exist_cb;
+	cache->del_cb                   = cachepass_del_cb;
+	cache->get_cb                   = cachepass_get_cb;
+	cache->put_cb                   = cachepass_put_cb;
+	cache->free_key_cb              = cachepass_free_key_cb;
+	cache->free_val_cb              = cachepass_free_val_cb;
+	cache->get_key_cb               = cachepass_get_key_cb;
+	cache->get_val_cb               = cachepass_get_val_cb;
+	cache->set_val_cb               = cachepass_set_val_cb;
+	cache->unpackverify_val_cb      = cachepass_unpackverify_val_cb;
+	cache->size_cb                  = cachepass_size_cb;
+	cache->full_cb                  = cachepass_full_cb;
+	cache->resize_cb                = cachepass_resize_cb;
+}
+
+/*
+ * Create a key from the destination address and the optional SNI.
+ * Returns NULL on out of memory condition or unknown address family.
+ */
+cache_key_t
+cachepass_mkkey(const struct sockaddr *addr, UNUSED const socklen_t addrlen,
+                const char *sni)
+{
+	dynbuf_t tmp, *db;
+	short port;
+	size_t snilen;
+
+	switch (((struct sockaddr_storage *)addr)->ss_family) {
+		case AF_INET:
+			tmp.buf = (unsigned char *)
+			          &((struct sockaddr_in*)addr)->sin_addr;
+			tmp.sz = sizeof(struct in_addr);
+			port = ((struct sockaddr_in*)addr)->sin_port;
+			break;
+		case AF_INET6:
+			tmp.buf = (unsigned char *)
+			          &((struct sockaddr_in6*)addr)->sin6_addr;
+			tmp.sz = sizeof(struct in6_addr);
+			port = ((struct sockaddr_in6*)addr)->sin6_port;
+			break;
+		default:
+			return NULL;
+	}
+
+	snilen = sni ? strlen(sni) : 0;
+	if (!(db = dynbuf_new_alloc(tmp.sz + sizeof(port) + snilen)))
+		return NULL;
+	memcpy(db->buf, tmp.buf, tmp.sz);
+	memcpy(db->buf + tmp.sz, (char*)&port, sizeof(port));
+	if (snilen)
+		memcpy(db->buf + tmp.sz + sizeof(port), sni, snilen);
+	return db;
+}
+
+cache_val_t
+cachepass_mkval(const cachepass_val_t *val)
+{
+	cachepass_val_t *v;
+
+	if (!(v = malloc(sizeof(cachepass_val_t))))
+		return NULL;
+	memcpy(v, val, sizeof(cachepass_val_t));
+	return v;
+}
+
+const char *
+cachepass_reason_str(int reason)
+{
+	switch (reason) {
+		case CACHEPASS_DSTSSL:
+			return "server handshake failed";
+		case CACHEPASS_NOCERT:
+			return "no certificate";
+		case CACHEPASS_SRCSSL:
+			return "client rejected certificate";
+		default:
+			return "unknown";
+	}
+}
+
+/* vim: set noet ft=c: */
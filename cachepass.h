@@ -0,0 +1,61 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef CACHEPASS_H
+#define CACHEPASS_H
+
+#include "cache.h"
+#include "attrib.h"
+
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/*
+ * Reasons for which interception of a destination failed.
+ */
+#define CACHEPASS_DSTSSL	0	/* server handshake failed */
+#define CACHEPASS_NOCERT	1	/* no certificate to forge from */
+#define CACHEPASS_SRCSSL	2	/* client rejected forged certificate */
+
+typedef struct cachepass_val {
+	time_t expiry;			/* entry is invalid from this time */
+	int reason;			/* CACHEPASS_* */
+} cachepass_val_t;
+
+void cachepass_init_cb(struct cache *) NONNULL(1);
+
+cache_key_t cachepass_mkkey(const struct sockaddr *, const socklen_t,
+                            const char *) NONNULL(1) WUNRES;
+cache_val_t cachepass_mkval(const cachepass_val_t *) NONNULL(1) WUNRES;
+const char * cachepass_reason_str(int) WUNRES;
+
+#endif /* !CACHEPASS_H */
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,131 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "cachemgr.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#include <check.h>
+
+static void
+cachemgr_setup(void)
+{
+	if (cachemgr_preinit() == -1)
+		exit(EXIT_FAILURE);
+}
+
+static void
+cachemgr_teardown(void)
+{
+	cachemgr_fini();
+}
+
+static struct sockaddr *
+cachepass_addr(struct sockaddr_in *sin, unsigned short port)
+{
+	memset(sin, 0, sizeof(struct sockaddr_in));
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = htonl(0x7F000001);
+	sin->sin_port = htons(port);
+	return (struct sockaddr *)sin;
+}
+
+START_TEST(cache_pass_01)
+{
+	struct sockaddr_in sin;
+	cachepass_val_t val, *v;
+
+	val.expiry = time(NULL) + 60;
+	val.reason = CACHEPASS_SRCSSL;
+	cachemgr_pass_set(cachepass_addr(&sin, 443), sizeof(sin),
+	                  "daniel.roe.ch", &val);
+	v = cachemgr_pass_get(cachepass_addr(&sin, 443), sizeof(sin),
+	                      "daniel.roe.ch");
+	fail_unless(!!v, "cache did not return an entry");
+	fail_unless(v->reason == CACHEPASS_SRCSSL, "wrong reason");
+	free(v);
+}
+END_TEST
+
+START_TEST(cache_pass_02)
+{
+	struct sockaddr_in sin;
+	cachepass_val_t val, *v;
+
+	val.expiry = time(NULL) + 60;
+	val.reason = CACHEPASS_DSTSSL;
+	cachemgr_pass_set(cachepass_addr(&sin, 443), sizeof(sin),
+	                  "daniel.roe.ch", &val);
+	v = cachemgr_pass_get(cachepass_addr(&sin, 443), sizeof(sin),
+	                      "www.roe.ch");
+	fail_unless(v == NULL, "cache returned entry for other SNI");
+	v = cachemgr_pass_get(cachepass_addr(&sin, 443), sizeof(sin), NULL);
+	fail_unless(v == NULL, "cache returned entry for no SNI");
+	v = cachemgr_pass_get(cachepass_addr(&sin, 8443), sizeof(sin),
+	                      "daniel.roe.ch");
+	fail_unless(v == NULL, "cache returned entry for other port");
+}
+END_TEST
+
+START_TEST(cache_pass_03)
+{
+	struct sockaddr_in sin;
+	cachepass_val_t val, *v;
+
+	val.expiry = time(NULL) - 1;
+	val.reason = CACHEPASS_NOCERT;
+	cachemgr_pass_set(cachepass_addr(&sin, 443), sizeof(sin), NULL,
+	                  &val);
+	v = cachemgr_pass_get(cachepass_addr(&sin, 443), sizeof(sin), NULL);
+	fail_unless(v == NULL, "cache returned expired entry");
+}
+END_TEST
+
+Suite *
+cachepass_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("cachepass");
+
+	tc = tcase_create("cache_pass");
+	tcase_add_checked_fixture(tc, cachemgr_setup, cachemgr_teardown);
+	tcase_add_test(tc, cache_pass_01);
+	tcase_add_test(tc, cache_pass_02);
+	tcase_add_test(tc, cache_pass_03);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
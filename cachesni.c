@@ -0,0 +1,220 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "cachesni.h"
+
+#include "ssl.h"
+#include "mempool.h"
+
+#define kcalloc(N,Z) mempool_huge_calloc(N,Z)
+#define kmalloc(Z) mempool_huge_malloc(Z)
+#define krealloc(P,Z) mempool_huge_realloc(P,Z)
+#define kfree(P) mempool_huge_free(P)
+#include "khash.h"
+
+#include <string.h>
+#include <ctype.h>
+
+/*
+ * Cache for the original server certificates last seen for an SNI hostname,
+ * used to predict the forged certificate before the upstream handshake has
+ * completed.  Entries are valid as long as the certificate is.
+ *
+ * key: char *    lower case SNI hostname
+ * val: X509 *    original server certificate
+ */
+
+KHASH_INIT(snimap_t, char*, void*, 1, kh_str_hash_func, kh_str_hash_equal)
+
+static cache_iter_t
+cachesni_begin_cb(UNUSED cache_map_t map)
+{
+	return kh_begin((khash_t(snimap_t) *)map);
+}
+
+static cache_iter_t
+cachesni_end_cb(cache_map_t map)
+{
+	return kh_end((khash_t(snimap_t) *)map);
+}
+
+static int
+cachesni_exist_cb(cache_map_t map, cache_iter_t it)
+{
+	return kh_exist((khash_t(snimap_t) *)map, it);
+}
+
+static void
+cachesni_del_cb(cache_map_t map, cache_iter_t it)
+{
+	kh_del(snimap_t, (khash_t(snimap_t) *)map, it);
+}
+
+static cache_iter_t
+cachesni_get_cb(cache_map_t map, cache_key_t key)
+{
+	return kh_get(snimap_t, (khash_t(snimap_t) *)map, key);
+}
+
+static cache_iter_t
+cachesni_put_cb(cache_map_t map, cache_key_t key, int *ret)
+{
+	return kh_put(snimap_t, (khash_t(snimap_t) *)map, key, ret);
+}
+
+static void
+cachesni_free_key_cb(cache_key_t key)
+{
+	free(key);
+}
+
+static void
+cachesni_free_val_cb(cache_val_t val)
+{
+	X509_free(val);
+}
+
+static cache_key_t
+cachesni_get_key_cb(cache_map_t map, cache_iter_t it)
+{
+	return kh_key((khash_t(snimap_t) *)map, it);
+}
+
+static cache_val_t
+cachesni_get_val_cb(cache_map_t map, cache_iter_t it)
+{
+	return kh_val((khash_t(snimap_t) *)map, it);
+}
+
+static void
+cachesni_set_val_cb(cache_map_t map, cache_iter_t it, cache_val_t val)
+{
+	kh_val((khash_t(snimap_t) *)map, it) = val;
+}
+
+static cache_val_t
+cachesni_unpackverify_val_cb(cache_val_t val, int copy)
+{
+	if (!ssl_x509_is_valid(val))
+		return NULL;
+	if (copy) {
+		ssl_x509_refcount_inc(val);
+		return val;
+	}
+	return ((void*)-1);
+}
+
+static cache_map_t
+cachesni_map_new_cb(void)
+{
+	return kh_init(snimap_t);
+}
+
+static void
+cachesni_map_free_cb(cache_map_t map)
+{
+	kh_destroy(snimap_t, (khash_t(snimap_t) *)map);
+}
+
+static int
+cachesni_full_cb(cache_map_t map)
+{
+	khash_t(snimap_t) *h = map;
+
+	return h->n_occupied >= h->upper_bound;
+}
+
+static int
+cachesni_resize_cb(cache_map_t map, size_t n)
+{
+	return kh_resize(snimap_t, (khash_t(snimap_t) *)map,
+	                 (khint_t)(n / __ac_HASH_UPPER) + 1);
+}
+
+static unsigned int
+cachesni_hash_cb(cache_key_t key)
+{
+	return kh_str_hash_func(key);
+}
+
+static size_t
+cachesni_size_cb(cache_key_t key, cache_val_t val)
+{
+	int sz = i2d_X509(val, NULL);
+
+	return strlen(key) + 1 + (sz > 0 ? sz : 0);
+}
+
+void
+cachesni_init_cb(cache_t *cache)
+{
+	cache->map_new_cb               = cachesni_map_new_cb;
+	cache->map_free_cb              = cachesni_map_free_cb;
+	cache->hash_cb                  = cachesni_hash_cb;
+	cache->begin_cb                 = cachesni_begin_cb;
+	cache->end_cb                   = cachesni_end_cb;
+	cache->exist_cb                 = cachesni_exist_cb;
+	cache->del_cb                   = cachesni_del_cb;
+	cache->get_cb                   = cachesni_get_cb;
+	cache->put_cb                   = cachesni_put_cb;
+	cache->free_key_cb              = cachesni_free_key_cb;
+	cache->free_val_cb              = cachesni_free_val_cb;
+	cache->get_key_cb               = cachesni_get_key_cb;
+	cache->get_val_cb               = cachesni_get_val_cb;
+	cache->set_val_cb               = cachesni_set_val_cb;
+	cache->unpackverify_val_cb      = cachesni_unpackverify_val_cb;
+	cache->size_cb                  = cachesni_size_cb;
+	cache->full_cb                  = cachesni_full_cb;
+	cache->resize_cb                = cachesni_resize_cb;
+}
+
+/*
+ * Create a key from an SNI hostname; hostnames are case insensitive.
+ * Returns NULL on out of memory condition.
+ */
+cache_key_t
+cachesni_mkkey(const char *sni)
+{
+	char *key, *p;
+
+	if (!(key = strdup(sni)))
+		return NULL;
+	for (p = key; *p; p++)
+		*p = tolower((unsigned char)*p);
+	return key;
+}
+
+cache_val_t
+cachesni_mkval(X509 *valcrt)
+{
+	ssl_x509_refcount_inc(valcrt);
+	return valcrt;
+}
+
+/* vim: set noet ft=c: */
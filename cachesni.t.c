@@ -0,0 +1,242 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "ssl.h"
+#include "cachemgr.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <check.h>
+
+#define TESTCERT "extra/pki/rsa.crt"
+#define TESTCERT2 "extra/pki/server.crt"
+
+static void
+cachemgr_setup(void)
+{
+	if ((ssl_init() == -1) || (cachemgr_preinit() == -1))
+		exit(EXIT_FAILURE);
+}
+
+static void
+cachemgr_teardown(void)
+{
+	cachemgr_fini();
+	ssl_fini();
+}
+
+START_TEST(cache_sni_01)
+{
+	X509 *c1, *c2;
+
+	c1 = ssl_x509_load(TESTCERT);
+	fail_unless(!!c1, "loading certificate failed");
+	cachemgr_sni_set("daniel.roe.ch", c1);
+	c2 = cachemgr_sni_get("daniel.roe.ch");
+	fail_unless(!!c2, "cache did not return a certificate");
+	fail_unless(c2 == c1, "cache did not return same pointer");
+	X509_free(c1);
+	X509_free(c2);
+}
+END_TEST
+
+START_TEST(cache_sni_02)
+{
+	X509 *c;
+
+	c = cachemgr_sni_get("daniel.roe.ch");
+	fail_unless(c == NULL, "certificate was already in empty cache");
+}
+END_TEST
+
+START_TEST(cache_sni_03)
+{
+	X509 *c1, *c2;
+
+	c1 = ssl_x509_load(TESTCERT);
+	fail_unless(!!c1, "loading certificate failed");
+	cachemgr_sni_set("daniel.roe.ch", c1);
+	cachemgr_sni_del("daniel.roe.ch");
+	c2 = cachemgr_sni_get("daniel.roe.ch");
+	fail_unless(c2 == NULL, "cache returned deleted certificate");
+	X509_free(c1);
+}
+END_TEST
+
+START_TEST(cache_sni_04)
+{
+	X509 *c1, *c2;
+
+	c1 = ssl_x509_load(TESTCERT);
+	fail_unless(!!c1, "loading certificate failed");
+	cachemgr_sni_set("Daniel.Roe.CH", c1);
+	c2 = cachemgr_sni_get("daniel.roe.ch");
+	fail_unless(c2 == c1, "lookup is case sensitive");
+	X509_free(c1);
+	X509_free(c2);
+}
+END_TEST
+
+START_TEST(cache_sni_05)
+{
+	X509 *c1, *c2, *c3;
+
+	c1 = ssl_x509_load(TESTCERT);
+	fail_unless(!!c1, "loading certificate failed");
+	c2 = ssl_x509_load(TESTCERT2);
+	fail_unless(!!c2, "loading certificate failed");
+	cachemgr_sni_set("daniel.roe.ch", c1);
+	cachemgr_sni_set("daniel.roe.ch", c2);
+	c3 = cachemgr_sni_get("daniel.roe.ch");
+	fail_unless(c3 == c2, "cache did not return replaced certificate");
+	X509_free(c1);
+	X509_free(c2);
+	X509_free(c3);
+}
+END_TEST
+
+#define MANY 20000
+
+static char present[MANY];
+
+/*
+ * Insert, replace and delete enough entries for the shards to grow
+ * incrementally several times, interleaved with lookups.
+ */
+static void
+cache_sni_fill(X509 *c1, X509 *c2)
+{
+	char name[32];
+	X509 *c;
+
+	for (int i = 0; i < MANY; i++) {
+		snprintf(name, sizeof(name), "%i.example.org", i);
+		cachemgr_sni_set(name, c1);
+		present[i] = 1;
+		if (i % 3 == 0) {
+			snprintf(name, sizeof(name), "%i.example.org", i / 2);
+			c = cachemgr_sni_get(name);
+			fail_unless(!present[i / 2] || c == c1 || c == c2,
+			            "entry lost while growing");
+			if (c)
+				X509_free(c);
+			cachemgr_sni_set(name, c2);
+			present[i / 2] = 1;
+		}
+		if (i % 5 == 0) {
+			snprintf(name, sizeof(name), "%i.example.org", i / 5);
+			cachemgr_sni_del(name);
+			present[i / 5] = 0;
+		}
+	}
+}
+
+static void
+cache_sni_check(X509 *c1, X509 *c2)
+{
+	char name[32];
+	size_t n = 0;
+	X509 *c;
+
+	for (int i = 0; i < MANY; i++) {
+		snprintf(name, sizeof(name), "%i.example.org", i);
+		c = cachemgr_sni_get(name);
+		if (present[i]) {
+			fail_unless(c == c1 || c == c2, "entry lost");
+			n++;
+		} else {
+			fail_unless(c == NULL, "deleted entry found");
+		}
+		if (c)
+			X509_free(c);
+	}
+	fail_unless(n == cache_entries(cachemgr_sni), "entries miscounted");
+}
+
+START_TEST(cache_sni_06)
+{
+	X509 *c1, *c2;
+
+	c1 = ssl_x509_load(TESTCERT);
+	fail_unless(!!c1, "loading certificate failed");
+	c2 = ssl_x509_load(TESTCERT2);
+	fail_unless(!!c2, "loading certificate failed");
+	memset(present, 0, sizeof(present));
+	cache_sni_fill(c1, c2);
+	cache_sni_check(c1, c2);
+	cache_gc(cachemgr_sni);
+	cache_sni_check(c1, c2);
+	X509_free(c1);
+	X509_free(c2);
+}
+END_TEST
+
+START_TEST(cache_sni_07)
+{
+	X509 *c1, *c2;
+
+	c1 = ssl_x509_load(TESTCERT);
+	fail_unless(!!c1, "loading certificate failed");
+	c2 = ssl_x509_load(TESTCERT2);
+	fail_unless(!!c2, "loading certificate failed");
+	memset(present, 0, sizeof(present));
+	cache_presize(cachemgr_sni, MANY);
+	cache_sni_fill(c1, c2);
+	cache_sni_check(c1, c2);
+	X509_free(c1);
+	X509_free(c2);
+}
+END_TEST
+
+Suite *
+cachesni_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("cachesni");
+
+	tc = tcase_create("cache_sni");
+	tcase_add_checked_fixture(tc, cachemgr_setup, cachemgr_teardown);
+	tcase_add_test(tc, cache_sni_01);
+	tcase_add_test(tc, cache_sni_02);
+	tcase_add_test(tc, cache_sni_03);
+	tcase_add_test(tc, cache_sni_04);
+	tcase_add_test(tc, cache_sni_05);
+	tcase_add_test(tc, cache_sni_06);
+	tcase_add_test(tc, cache_sni_07);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
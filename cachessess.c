@@ -30,32 +30,23 @@
 
 #include "dynbuf.h"
 #include "ssl.h"
+#include "util.h"
+#include "mempool.h"
+
+#define kcalloc(N,Z) mempool_huge_calloc(N,Z)
+#define kmalloc(Z) mempool_huge_malloc(Z)
+#define krealloc(P,Z) mempool_huge_realloc(P,Z)
+#define kfree(P) mempool_huge_free(P)
 #include "khash.h"
 
 /*
  * Cache for incoming src connection SSL sessions.
  *
  * key: dynbuf_t *  SSL session ID
- * val: dynbuf_t *  ASN.1 serialized SSL_SESSION
+ * val: SSL_SESSION *
  */
 
-static inline khint_t
-kh_dynbuf_hash_func(dynbuf_t *b)
-{
-	khint_t *p = (khint_t *)b->buf;
-	khint_t h = 0;
-	int rem;
-
-	if ((rem = b->sz % sizeof(khint_t))) {
-		memcpy(&h, b->buf + b->sz - rem, rem);
-	}
-
-	while (p < (khint_t*)(b->buf + b->sz - rem)) {
-		h ^= *p++;
-	}
-
-	return h;
-}
+#define kh_dynbuf_hash_func(b) util_hash((b)->buf, (b)->sz)
 
 #define kh_dynbuf_hash_equal(a, b) \
         (((a)->sz == (b)->sz) && \
@@ -64,42 +55,40 @@ kh_dynbuf_hash_func(dynbuf_t *b)
 KHASH_INIT(dynbufmap_t, dynbuf_t*, dynbuf_t*, 1, kh_dynbuf_hash_func,
            kh_dynbuf_hash_equal)
 
-static khash_t(dynbufmap_t) *srcsessmap;
-
 static cache_iter_t
-cachessess_begin_cb(void)
+cachessess_begin_cb(UNUSED cache_map_t map)
 {
-	return kh_begin(srcsessmap);
+	return kh_begin((khash_t(dynbufmap_t) *)map);
 }
 
 static cache_iter_t
-cachessess_end_cb(void)
+cachessess_end_cb(cache_map_t map)
 {
-	return kh_end(srcsessmap);
+	return kh_end((khash_t(dynbufmap_t) *)map);
 }
 
 static int
-cachessess_exist_cb(cache_iter_t it)
+cachessess_exist_cb(cache_map_t map, cache_iter_t it)
 {
-	return kh_exist(srcsessmap, it);
+	return kh_exist((khash_t(dynbufmap_t) *)map, it);
 }
 
 static void
-cachessess_del_cb(cache_iter_t it)
+cachessess_del_cb(cache_map_t map, cache_iter_t it)
 {
-	kh_del(dynbufmap_t, srcsessmap, it);
+	kh_del(dynbufmap_t, (khash_t(dynbufmap_t) *)map, it);
 }
 
 static cache_iter_t
-cachessess_get_cb(cache_key_t key)
+cachessess_get_cb(cache_map_t map, cache_key_t key)
 {
-	return kh_get(dynbufmap_t, srcsessmap, key);
+	return kh_get(dynbufmap_t, (khash_t(dynbufmap_t) *)map, key);
 }
 
 static cache_iter_t
-cachessess_put_cb(cache_key_t key, int *ret)
+cachessess_put_cb(cache_map_t map, cache_key_t key, int *ret)
 {
-	return kh_put(dynbufmap_t, srcsessmap, key, ret);
+	return kh_put(dynbufmap_t, (khash_t(dynbufmap_t) *)map, key, ret);
 }
 
 static void
@@ -111,59 +100,85 @@ cachessess_free_key_cb(cache_key_t key)
 static void
 cachessess_free_val_cb(cache_val_t val)
 {
-	dynbuf_free(val);
+	SSL_SESSION_free(val);
 }
 
 static cache_key_t
-cachessess_get_key_cb(cache_iter_t it)
+cachessess_get_key_cb(cache_map_t map, cache_iter_t it)
 {
-	return kh_key(srcsessmap, it);
+	return kh_key((khash_t(dynbufmap_t) *)map, it);
 }
 
 static cache_val_t
-cachessess_get_val_cb(cache_iter_t it)
+cachessess_get_val_cb(cache_map_t map, cache_iter_t it)
 {
-	return kh_val(srcsessmap, it);
+	return kh_val((khash_t(dynbufmap_t) *)map, it);
 }
 
 static void
-cachessess_set_val_cb(cache_iter_t it, cache_val_t val)
+cachessess_set_val_cb(cache_map_t map, cache_iter_t it, cache_val_t val)
 {
-	kh_val(srcsessmap, it) = val;
+	kh_val((khash_t(dynbufmap_t) *)map, it) = val;
 }
 
 static cache_val_t
 cachessess_unpackverify_val_cb(cache_val_t val, int copy)
 {
-	dynbuf_t *valbuf = val;
-	SSL_SESSION *sess;
-	const unsigned char *p;
-
-	p = (const unsigned char *)valbuf->buf;
-	sess = d2i_SSL_SESSION(NULL, &p, valbuf->sz); /* increments p */
-	if (!sess)
-		return NULL;
-	if (!ssl_session_is_valid(sess)) {
-		SSL_SESSION_free(sess);
+	if (!ssl_session_is_valid(val))
 		return NULL;
+	if (copy) {
+		ssl_session_refcount_inc(val);
+		return val;
 	}
-	if (copy)
-		return sess;
-	SSL_SESSION_free(sess);
 	return ((void*)-1);
 }
 
+static cache_map_t
+cachessess_map_new_cb(void)
+{
+	return kh_init(dynbufmap_t);
+}
+
 static void
-cachessess_fini_cb(void)
+cachessess_map_free_cb(cache_map_t map)
 {
-	kh_destroy(dynbufmap_t, srcsessmap);
+	kh_destroy(dynbufmap_t, (khash_t(dynbufmap_t) *)map);
+}
+
+static int
+cachessess_full_cb(cache_map_t map)
+{
+	khash_t(dynbufmap_t) *h = map;
+
+	return h->n_occupied >= h->upper_bound;
+}
+
+static int
+cachessess_resize_cb(cache_map_t map, size_t n)
+{
+	return kh_resize(dynbufmap_t, (khash_t(dynbufmap_t) *)map,
+	                 (khint_t)(n / __ac_HASH_UPPER) + 1);
+}
+
+static unsigned int
+cachessess_hash_cb(cache_key_t key)
+{
+	return kh_dynbuf_hash_func((dynbuf_t *)key);
+}
+
+static size_t
+cachessess_size_cb(cache_key_t key, cache_val_t val)
+{
+	return sizeof(dynbuf_t) + ((dynbuf_t *)key)->sz +
+	       ssl_session_memsz(val);
 }
 
 void
 cachessess_init_cb(cache_t *cache)
 {
-	srcsessmap = kh_init(dynbufmap_t);
-
+	cache->map_new_cb               = cachessess_map_new_cb;
+	cache->map_free_cb              = cachessess_map_free_cb;
+	cache->hash_cb                  = cachessess_hash_cb;
 	cache->begin_cb                 = cachessess_begin_cb;
 	cache->end_cb                   = cachessess_end_cb;
 	cache->exist_cb                 = cachessess_exist_cb;
@@ -176,7 +191,10 @@ cachessess_init_cb(cache_t *cache)
 	cache->get_val_cb               = cachessess_get_val_cb;
 	cache->set_val_cb               = cachessess_set_val_cb;
 	cache->unpackverify_val_cb      = cachessess_unpackverify_val_cb;
-	cache->fini_cb                  = cachessess_fini_cb;
+	cache->size_cb                  = cachessess_size_cb;
+	cache->full_cb                  = cachessess_full_cb;
+	cache->resize_cb                = cachessess_resize_cb;
+	cache->ttl_passes               = CACHESSESS_TTL_PASSES;
 }
 
 cache_key_t
@@ -188,17 +206,8 @@ cachessess_mkkey(const unsigned char *id, const size_t idlen)
 cache_val_t
 cachessess_mkval(SSL_SESSION *sess)
 {
-	dynbuf_t *db;
-	unsigned char *p;
-	size_t asn1sz;
-
-	asn1sz = i2d_SSL_SESSION(sess, NULL);
-	if (!asn1sz || !(db = dynbuf_new_alloc(asn1sz))) {
-		return NULL;
-	}
-	p = db->buf;
-	i2d_SSL_SESSION(sess, &p); /* updates p */
-	return db;
+	ssl_session_refcount_inc(sess);
+	return sess;
 }
 
 /* vim: set noet ft=c: */
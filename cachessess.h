@@ -30,14 +30,27 @@
 #define CACHESSESS_H
 
 #include "cache.h"
+#include "dynbuf.h"
 #include "attrib.h"
 
 #include <openssl/ssl.h>
 
+/*
+ * Garbage collection passes a session never resumed stays cached.
+ */
+#define CACHESSESS_TTL_PASSES	120
+
 void cachessess_init_cb(struct cache *) NONNULL(1);
 
 cache_key_t cachessess_mkkey(const unsigned char *, const size_t)
             NONNULL(1) WUNRES;
+
+/*
+ * Key referring to session id of idlen octets without copying it, for
+ * looking up with cache_get_borrowed(); valid within the enclosing block.
+ */
+#define cachessess_mkkey_tmp(id, idlen) \
+        (&(dynbuf_t){(unsigned char *)(id), (idlen)})
 cache_val_t cachessess_mkval(SSL_SESSION *) NONNULL(1) WUNRES;
 
 #endif /* !CACHESSESS_H */
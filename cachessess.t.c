@@ -88,7 +88,7 @@ START_TEST(cache_ssess_01)
 	session_id = SSL_SESSION_get_id(s1, &len);
 	s2 = cachemgr_ssess_get(session_id, len);
 	fail_unless(!!s2, "cache returned no session");
-	fail_unless(s2 != s1, "cache returned same pointer");
+	fail_unless(s2 == s1, "cache did not return same pointer");
 	SSL_SESSION_free(s1);
 	SSL_SESSION_free(s2);
 }
@@ -130,6 +130,26 @@ START_TEST(cache_ssess_03)
 }
 END_TEST
 
+START_TEST(cache_ssess_take_01)
+{
+	SSL_SESSION *s1, *s2;
+	const unsigned char* session_id;
+	unsigned int len;
+
+	s1 = ssl_session_from_file(TMP_SESS_FILE);
+	fail_unless(!!s1, "creating session failed");
+	fail_unless(ssl_session_is_valid(s1), "session invalid");
+
+	cachemgr_ssess_set(s1);
+	fail_unless(cachemgr_ssess_take(s1) == 1, "first take failed");
+	fail_unless(cachemgr_ssess_take(s1) == 0, "second take succeeded");
+	session_id = SSL_SESSION_get_id(s1, &len);
+	s2 = cachemgr_ssess_get(session_id, len);
+	fail_unless(s2 == NULL, "cache returned taken session");
+	SSL_SESSION_free(s1);
+}
+END_TEST
+
 #if (OPENSSL_VERSION_NUMBER < 0x10100000L) || defined(LIBRESSL_VERSION_NUMBER)
 START_TEST(cache_ssess_04)
 {
@@ -143,20 +163,23 @@ START_TEST(cache_ssess_04)
 
 	fail_unless(s1->references == 1, "refcount != 1");
 	cachemgr_ssess_set(s1);
-	fail_unless(s1->references == 1, "refcount != 1");
+	fail_unless(s1->references == 2, "refcount != 2");
 	session_id = SSL_SESSION_get_id(s1, &len);
 	s2 = cachemgr_ssess_get(session_id, len);
-	fail_unless(s1->references == 1, "refcount != 1");
 	fail_unless(!!s2, "cache returned no session");
-	fail_unless(s2->references == 1, "refcount != 1");
+	fail_unless(s1->references == 3, "refcount != 3");
 	cachemgr_ssess_set(s1);
-	fail_unless(s1->references == 1, "refcount != 1");
+	fail_unless(s1->references == 3, "refcount != 3");
 	cachemgr_ssess_del(s1);
-	fail_unless(s1->references == 1, "refcount != 1");
+	fail_unless(s1->references == 2, "refcount != 2");
 	cachemgr_ssess_set(s1);
+	fail_unless(s1->references == 3, "refcount != 3");
+	SSL_SESSION_free(s2);
+	fail_unless(s1->references == 2, "refcount != 2");
+	cachemgr_fini();
 	fail_unless(s1->references == 1, "refcount != 1");
 	SSL_SESSION_free(s1);
-	SSL_SESSION_free(s2);
+	fail_unless(cachemgr_preinit() != -1, "reinit");
 }
 END_TEST
 #endif
@@ -174,6 +197,7 @@ cachessess_suite(void)
 	tcase_add_test(tc, cache_ssess_01);
 	tcase_add_test(tc, cache_ssess_02);
 	tcase_add_test(tc, cache_ssess_03);
+	tcase_add_test(tc, cache_ssess_take_01);
 #if (OPENSSL_VERSION_NUMBER < 0x10100000L) || defined(LIBRESSL_VERSION_NUMBER)
 	tcase_add_test(tc, cache_ssess_04);
 #endif
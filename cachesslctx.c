@@ -0,0 +1,243 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "cachesslctx.h"
+
+#include "ssl.h"
+#include "mempool.h"
+
+#define kcalloc(N,Z) mempool_huge_calloc(N,Z)
+#define kmalloc(Z) mempool_huge_malloc(Z)
+#define krealloc(P,Z) mempool_huge_realloc(P,Z)
+#define kfree(P) mempool_huge_free(P)
+#include "khash.h"
+
+/*
+ * Cache for ready-to-use server side SSL_CTX objects, such that connections
+ * using a certificate for which a context has already been set up only need
+ * to call SSL_new().  Entries turn invalid with the certificate they use.
+ *
+ * key: char[SSL_X509_FPRSZ]  fingerprint of the certificate used
+ * val: SSL_CTX *             context set up with cert, key and chain
+ */
+
+static inline khint_t
+kh_sslctxfpr_hash_func(void *b)
+{
+	khint_t *p = (khint_t*)(((char*)b) + SSL_X509_FPRSZ);
+	khint_t h = 0;
+
+	/* assumes fpr is uniformly distributed */
+	while (--p >= (khint_t*)b)
+		h ^= *p;
+	return h;
+}
+
+#define kh_sslctxfpr_hash_equal(a, b) \
+        (memcmp((char*)(a), (char*)(b), SSL_X509_FPRSZ) == 0)
+
+KHASH_INIT(sha1map_t, void*, void*, 1, kh_sslctxfpr_hash_func,
+           kh_sslctxfpr_hash_equal)
+
+static cache_iter_t
+cachesslctx_begin_cb(UNUSED cache_map_t map)
+{
+	return kh_begin((khash_t(sha1map_t) *)map);
+}
+
+static cache_iter_t
+cachesslctx_end_cb(cache_map_t map)
+{
+	return kh_end((khash_t(sha1map_t) *)map);
+}
+
+static int
+cachesslctx_exist_cb(cache_map_t map, cache_iter_t it)
+{
+	return kh_exist((khash_t(sha1map_t) *)map, it);
+}
+
+static void
+cachesslctx_del_cb(cache_map_t map, cache_iter_t it)
+{
+	kh_del(sha1map_t, (khash_t(sha1map_t) *)map, it);
+}
+
+static cache_iter_t
+cachesslctx_get_cb(cache_map_t map, cache_key_t key)
+{
+	return kh_get(sha1map_t, (khash_t(sha1map_t) *)map, key);
+}
+
+static cache_iter_t
+cachesslctx_put_cb(cache_map_t map, cache_key_t key, int *ret)
+{
+	return kh_put(sha1map_t, (khash_t(sha1map_t) *)map, key, ret);
+}
+
+static void
+cachesslctx_free_key_cb(cache_key_t key)
+{
+	free(key);
+}
+
+static void
+cachesslctx_free_val_cb(cache_val_t val)
+{
+	SSL_CTX_free(val);
+}
+
+static cache_key_t
+cachesslctx_get_key_cb(cache_map_t map, cache_iter_t it)
+{
+	return kh_key((khash_t(sha1map_t) *)map, it);
+}
+
+static cache_val_t
+cachesslctx_get_val_cb(cache_map_t map, cache_iter_t it)
+{
+	return kh_val((khash_t(sha1map_t) *)map, it);
+}
+
+static void
+cachesslctx_set_val_cb(cache_map_t map, cache_iter_t it, cache_val_t val)
+{
+	kh_val((khash_t(sha1map_t) *)map, it) = val;
+}
+
+static cache_val_t
+cachesslctx_unpackverify_val_cb(cache_val_t val, int copy)
+{
+	X509 *crt = SSL_CTX_get0_certificate(val);
+
+	if (!crt || !ssl_x509_is_valid(crt))
+		return NULL;
+	if (copy) {
+		ssl_ctx_refcount_inc(val);
+		return val;
+	}
+	return ((void*)-1);
+}
+
+static cache_map_t
+cachesslctx_map_new_cb(void)
+{
+	return kh_init(sha1map_t);
+}
+
+static void
+cachesslctx_map_free_cb(cache_map_t map)
+{
+	kh_destroy(sha1map_t, (khash_t(sha1map_t) *)map);
+}
+
+static int
+cachesslctx_full_cb(cache_map_t map)
+{
+	khash_t(sha1map_t) *h = map;
+
+	return h->n_occupied >= h->upper_bound;
+}
+
+static int
+cachesslctx_resize_cb(cache_map_t map, size_t n)
+{
+	return kh_resize(sha1map_t, (khash_t(sha1map_t) *)map,
+	                 (khint_t)(n / __ac_HASH_UPPER) + 1);
+}
+
+static unsigned int
+cachesslctx_hash_cb(cache_key_t key)
+{
+	return kh_sslctxfpr_hash_func(key);
+}
+
+/*
+ * Only the key is counted; the SSL_CTX itself is accounted for as memory
+ * allocated by OpenSSL.
+ */
+static size_t
+cachesslctx_size_cb(UNUSED cache_key_t key, UNUSED cache_val_t val)
+{
+	return SSL_X509_FPRSZ;
+}
+
+void
+cachesslctx_init_cb(cache_t *cache)
+{
+	cache->map_new_cb               = cachesslctx_map_new_cb;
+	cache->map_free_cb              = cachesslctx_map_free_cb;
+	cache->hash_cb                  = cachesslctx_hash_cb;
+	cache->begin_cb                 = cachesslctx_begin_cb;
+	cache->end_cb                   = cachesslctx_end_cb;
+	cache->exist_cb                 = cachesslctx_exist_cb;
+	cache->del_cb                   = cachesslctx_del_cb;
+	cache->get_cb                   = cachesslctx_get_cb;
+	cache->put_cb                   = cachesslctx_put_cb;
+	cache->free_key_cb              = cachesslctx_free_key_cb;
+	cache->free_val_cb              = cachesslctx_free_val_cb;
+	cache->get_key_cb               = cachesslctx_get_key_cb;
+	cache->get_val_cb               = cachesslctx_get_val_cb;
+	cache->set_val_cb               = cachesslctx_set_val_cb;
+	cache->unpackverify_val_cb      = cachesslctx_unpackverify_val_cb;
+	cache->size_cb                  = cachesslctx_size_cb;
+	cache->full_cb                  = cachesslctx_full_cb;
+	cache->resize_cb                = cachesslctx_resize_cb;
+}
+
+/*
+ * Forged certificates from the certificate cache carry their fingerprint
+ * already, see cachefkcrt.c.  Contexts for the same certificate can be kept
+ * apart in separate domains, such as one per OpenSSL library context; the
+ * domain is mixed into the fingerprint, 0 leaves it unchanged.
+ */
+cache_key_t
+cachesslctx_mkkey(X509 *keycrt, unsigned int dom)
+{
+	const ssl_x509_memo_t *memo;
+	unsigned char *fpr;
+
+	if (!(fpr = malloc(SSL_X509_FPRSZ)))
+		return NULL;
+	if ((memo = ssl_x509_memo_get(keycrt)))
+		memcpy(fpr, memo->fpr, SSL_X509_FPRSZ);
+	else
+		ssl_x509_fingerprint_sha1(keycrt, fpr);
+	for (size_t i = 0; dom; i++, dom >>= 8)
+		fpr[i] ^= dom & 0xff;
+	return fpr;
+}
+
+cache_val_t
+cachesslctx_mkval(SSL_CTX *valctx)
+{
+	ssl_ctx_refcount_inc(valctx);
+	return valctx;
+}
+
+/* vim: set noet ft=c: */
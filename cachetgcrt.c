@@ -29,6 +29,12 @@
 #include "cachetgcrt.h"
 
 #include "ssl.h"
+#include "mempool.h"
+
+#define kcalloc(N,Z) mempool_huge_calloc(N,Z)
+#define kmalloc(Z) mempool_huge_malloc(Z)
+#define krealloc(P,Z) mempool_huge_realloc(P,Z)
+#define kfree(P) mempool_huge_free(P)
 #include "khash.h"
 
 /*
@@ -41,42 +47,40 @@
 
 KHASH_INIT(cstrmap_t, char*, void*, 1, kh_str_hash_func, kh_str_hash_equal)
 
-static khash_t(cstrmap_t) *certmap;
-
 static cache_iter_t
-cachetgcrt_begin_cb(void)
+cachetgcrt_begin_cb(UNUSED cache_map_t map)
 {
-	return kh_begin(certmap);
+	return kh_begin((khash_t(cstrmap_t) *)map);
 }
 
 static cache_iter_t
-cachetgcrt_end_cb(void)
+cachetgcrt_end_cb(cache_map_t map)
 {
-	return kh_end(certmap);
+	return kh_end((khash_t(cstrmap_t) *)map);
 }
 
 static int
-cachetgcrt_exist_cb(cache_iter_t it)
+cachetgcrt_exist_cb(cache_map_t map, cache_iter_t it)
 {
-	return kh_exist(certmap, it);
+	return kh_exist((khash_t(cstrmap_t) *)map, it);
 }
 
 static void
-cachetgcrt_del_cb(cache_iter_t it)
+cachetgcrt_del_cb(cache_map_t map, cache_iter_t it)
 {
-	kh_del(cstrmap_t, certmap, it);
+	kh_del(cstrmap_t, (khash_t(cstrmap_t) *)map, it);
 }
 
 static cache_iter_t
-cachetgcrt_get_cb(cache_key_t key)
+cachetgcrt_get_cb(cache_map_t map, cache_key_t key)
 {
-	return kh_get(cstrmap_t, certmap, key);
+	return kh_get(cstrmap_t, (khash_t(cstrmap_t) *)map, key);
 }
 
 static cache_iter_t
-cachetgcrt_put_cb(cache_key_t key, int *ret)
+cachetgcrt_put_cb(cache_map_t map, cache_key_t key, int *ret)
 {
-	return kh_put(cstrmap_t, certmap, key, ret);
+	return kh_put(cstrmap_t, (khash_t(cstrmap_t) *)map, key, ret);
 }
 
 static void
@@ -92,21 +96,21 @@ cachetgcrt_free_val_cb(cache_val_t val)
 }
 
 static cache_key_t
-cachetgcrt_get_key_cb(cache_iter_t it)
+cachetgcrt_get_key_cb(cache_map_t map, cache_iter_t it)
 {
-	return kh_key(certmap, it);
+	return kh_key((khash_t(cstrmap_t) *)map, it);
 }
 
 static cache_val_t
-cachetgcrt_get_val_cb(cache_iter_t it)
+cachetgcrt_get_val_cb(cache_map_t map, cache_iter_t it)
 {
-	return kh_val(certmap, it);
+	return kh_val((khash_t(cstrmap_t) *)map, it);
 }
 
 static void
-cachetgcrt_set_val_cb(cache_iter_t it, cache_val_t val)
+cachetgcrt_set_val_cb(cache_map_t map, cache_iter_t it, cache_val_t val)
 {
-	kh_val(certmap, it) = val;
+	kh_val((khash_t(cstrmap_t) *)map, it) = val;
 }
 
 static cache_val_t
@@ -119,17 +123,66 @@ cachetgcrt_unpackverify_val_cb(cache_val_t val, int copy)
 	return ((void*)-1);
 }
 
+static cache_map_t
+cachetgcrt_map_new_cb(void)
+{
+	return kh_init(cstrmap_t);
+}
+
 static void
-cachetgcrt_fini_cb(void)
+cachetgcrt_map_free_cb(cache_map_t map)
+{
+	kh_destroy(cstrmap_t, (khash_t(cstrmap_t) *)map);
+}
+
+static int
+cachetgcrt_full_cb(cache_map_t map)
+{
+	khash_t(cstrmap_t) *h = map;
+
+	return h->n_occupied >= h->upper_bound;
+}
+
+static int
+cachetgcrt_resize_cb(cache_map_t map, size_t n)
 {
-	kh_destroy(cstrmap_t, certmap);
+	return kh_resize(cstrmap_t, (khash_t(cstrmap_t) *)map,
+	                 (khint_t)(n / __ac_HASH_UPPER) + 1);
+}
+
+static unsigned int
+cachetgcrt_hash_cb(cache_key_t key)
+{
+	return kh_str_hash_func(key);
+}
+
+static int
+cachetgcrt_equal_key_cb(cache_key_t a, cache_key_t b)
+{
+	return kh_str_hash_equal((char *)a, (char *)b);
+}
+
+static cache_key_t
+cachetgcrt_dup_key_cb(cache_key_t key)
+{
+	return strdup(key);
+}
+
+/*
+ * Certificates loaded for several names are counted once for each name.
+ */
+static size_t
+cachetgcrt_size_cb(cache_key_t key, cache_val_t val)
+{
+	return strlen(key) + 1 + cert_memsz(val);
 }
 
 void
 cachetgcrt_init_cb(cache_t *cache)
 {
-	certmap = kh_init(cstrmap_t);
-
+	cache->map_new_cb               = cachetgcrt_map_new_cb;
+	cache->map_free_cb              = cachetgcrt_map_free_cb;
+	cache->hash_cb                  = cachetgcrt_hash_cb;
 	cache->begin_cb                 = cachetgcrt_begin_cb;
 	cache->end_cb                   = cachetgcrt_end_cb;
 	cache->exist_cb                 = cachetgcrt_exist_cb;
@@ -142,7 +195,11 @@ cachetgcrt_init_cb(cache_t *cache)
 	cache->get_val_cb               = cachetgcrt_get_val_cb;
 	cache->set_val_cb               = cachetgcrt_set_val_cb;
 	cache->unpackverify_val_cb      = cachetgcrt_unpackverify_val_cb;
-	cache->fini_cb                  = cachetgcrt_fini_cb;
+	cache->size_cb                  = cachetgcrt_size_cb;
+	cache->equal_key_cb             = cachetgcrt_equal_key_cb;
+	cache->dup_key_cb               = cachetgcrt_dup_key_cb;
+	cache->full_cb                  = cachetgcrt_full_cb;
+	cache->resize_cb                = cachetgcrt_resize_cb;
 }
 
 cache_key_t
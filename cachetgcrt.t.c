@@ -99,15 +99,16 @@ START_TEST(cache_tgcrt_04)
 	cachemgr_tgcrt_set("daniel.roe.ch", c1);
 	fail_unless(c1->references == 2, "refcount != 2");
 	c2 = cachemgr_tgcrt_get("daniel.roe.ch");
-	fail_unless(c1->references == 3, "refcount != 3");
+	/* one reference each for c2 and the L1 slot of this thread */
+	fail_unless(c1->references == 4, "refcount != 4");
 	cachemgr_tgcrt_set("daniel.roe.ch", c1);
-	fail_unless(c1->references == 3, "refcount != 3");
+	fail_unless(c1->references == 4, "refcount != 4");
 	cachemgr_tgcrt_del("daniel.roe.ch");
-	fail_unless(c1->references == 2, "refcount != 2");
-	cachemgr_tgcrt_set("daniel.roe.ch", c1);
 	fail_unless(c1->references == 3, "refcount != 3");
+	cachemgr_tgcrt_set("daniel.roe.ch", c1);
+	fail_unless(c1->references == 4, "refcount != 4");
 	cert_free(c1);
-	fail_unless(c1->references == 2, "refcount != 2");
+	fail_unless(c1->references == 3, "refcount != 3");
 	cachemgr_fini();
 	fail_unless(c1->references == 1, "refcount != 1");
 	cert_free(c2);
@@ -119,6 +120,54 @@ START_TEST(cache_tgcrt_04)
 }
 END_TEST
 
+START_TEST(cache_tgcrt_05)
+{
+	cert_t *c1, *c2, *c3;
+
+	c1 = cert_new_load(TESTCERT);
+	fail_unless(!!c1, "loading certificate failed");
+	c2 = cert_new_load(TESTCERT);
+	fail_unless(!!c2, "loading certificate failed");
+	cachemgr_tgcrt_set("daniel.roe.ch", c1);
+	c3 = cachemgr_tgcrt_get("daniel.roe.ch");
+	fail_unless(c3 == c1, "cache did not return same pointer");
+	cert_free(c3);
+	c3 = cachemgr_tgcrt_get("daniel.roe.ch");
+	fail_unless(c3 == c1, "L1 did not return same pointer");
+	cert_free(c3);
+	cachemgr_tgcrt_set("daniel.roe.ch", c2);
+	c3 = cachemgr_tgcrt_get("daniel.roe.ch");
+	fail_unless(c3 == c2, "L1 returned replaced certificate");
+	cert_free(c3);
+	cache_flush(cachemgr_tgcrt);
+	c3 = cachemgr_tgcrt_get("daniel.roe.ch");
+	fail_unless(c3 == NULL, "L1 returned flushed certificate");
+	cert_free(c1);
+	cert_free(c2);
+}
+END_TEST
+
+START_TEST(cache_tgcrt_06)
+{
+	cert_t *c1, *c2;
+
+	cachemgr_tgidx = certindex_new();
+	fail_unless(!!cachemgr_tgidx, "creating index failed");
+	fail_unless(certindex_add(cachemgr_tgidx, "daniel.roe.ch",
+	                          TESTCERT) == 0, "adding name failed");
+	c1 = cachemgr_tgcrt_lookup("www.example.org");
+	fail_unless(c1 == NULL, "lookup returned unindexed name");
+	fail_unless(cache_entries(cachemgr_tgcrt) == 0,
+	            "unindexed name cached");
+	c1 = cachemgr_tgcrt_lookup("daniel.roe.ch");
+	fail_unless(!!c1, "lookup did not load indexed name");
+	c2 = cachemgr_tgcrt_lookup("daniel.roe.ch");
+	fail_unless(c2 == c1, "lookup did not return cached cert");
+	cert_free(c1);
+	cert_free(c2);
+}
+END_TEST
+
 Suite *
 cachetgcrt_suite(void)
 {
@@ -133,6 +182,8 @@ cachetgcrt_suite(void)
 	tcase_add_test(tc, cache_tgcrt_02);
 	tcase_add_test(tc, cache_tgcrt_03);
 	tcase_add_test(tc, cache_tgcrt_04);
+	tcase_add_test(tc, cache_tgcrt_05);
+	tcase_add_test(tc, cache_tgcrt_06);
 	suite_add_tcase(s, tc);
 
 	return s;
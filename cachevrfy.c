@@ -0,0 +1,265 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "cachevrfy.h"
+
+#include "ssl.h"
+#include "mempool.h"
+
+#define kcalloc(N,Z) mempool_huge_calloc(N,Z)
+#define kmalloc(Z) mempool_huge_malloc(Z)
+#define krealloc(P,Z) mempool_huge_realloc(P,Z)
+#define kfree(P) mempool_huge_free(P)
+#include "khash.h"
+
+#include <time.h>
+
+/*
+ * Cache for successful verification results of original server certificate
+ * chains.  Entries expire when the first certificate in the chain expires.
+ *
+ * key: char[SSL_X509_FPRSZ]  SHA-1 over the fingerprints of the chain
+ * val: time_t *              expiry time of the verification result
+ */
+
+static inline khint_t
+kh_vrfyfpr_hash_func(void *b)
+{
+	khint_t *p = (khint_t*)(((char*)b) + SSL_X509_FPRSZ);
+	khint_t h = 0;
+
+	/* assumes fpr is uniformly distributed */
+	while (--p >= (khint_t*)b)
+		h ^= *p;
+	return h;
+}
+
+#define kh_vrfyfpr_hash_equal(a, b) \
+        (memcmp((char*)(a), (char*)(b), SSL_X509_FPRSZ) == 0)
+
+KHASH_INIT(sha1map_t, void*, void*, 1, kh_vrfyfpr_hash_func,
+           kh_vrfyfpr_hash_equal)
+
+static cache_iter_t
+cachevrfy_begin_cb(UNUSED cache_map_t map)
+{
+	return kh_begin((khash_t(sha1map_t) *)map);
+}
+
+static cache_iter_t
+cachevrfy_end_cb(cache_map_t map)
+{
+	return kh_end((khash_t(sha1map_t) *)map);
+}
+
+static int
+cachevrfy_exist_cb(cache_map_t map, cache_iter_t it)
+{
+	return kh_exist((khash_t(sha1map_t) *)map, it);
+}
+
+static void
+cachevrfy_del_cb(cache_map_t map, cache_iter_t it)
+{
+	kh_del(sha1map_t, (khash_t(sha1map_t) *)map, it);
+}
+
+static cache_iter_t
+cachevrfy_get_cb(cache_map_t map, cache_key_t key)
+{
+	return kh_get(sha1map_t, (khash_t(sha1map_t) *)map, key);
+}
+
+static cache_iter_t
+cachevrfy_put_cb(cache_map_t map, cache_key_t key, int *ret)
+{
+	return kh_put(sha1map_t, (khash_t(sha1map_t) *)map, key, ret);
+}
+
+static void
+cachevrfy_free_key_cb(cache_key_t key)
+{
+	free(key);
+}
+
+static void
+cachevrfy_free_val_cb(cache_val_t val)
+{
+	free(val);
+}
+
+static cache_key_t
+cachevrfy_get_key_cb(cache_map_t map, cache_iter_t it)
+{
+	return kh_key((khash_t(sha1map_t) *)map, it);
+}
+
+static cache_val_t
+cachevrfy_get_val_cb(cache_map_t map, cache_iter_t it)
+{
+	return kh_val((khash_t(sha1map_t) *)map, it);
+}
+
+static void
+cachevrfy_set_val_cb(cache_map_t map, cache_iter_t it, cache_val_t val)
+{
+	kh_val((khash_t(sha1map_t) *)map, it) = val;
+}
+
+static cache_val_t
+cachevrfy_unpackverify_val_cb(cache_val_t val, int copy)
+{
+	time_t *expiry;
+
+	if (*(time_t *)val <= time(NULL))
+		return NULL;
+	if (copy) {
+		if (!(expiry = malloc(sizeof(time_t))))
+			return NULL;
+		*expiry = *(time_t *)val;
+		return expiry;
+	}
+	return ((void*)-1);
+}
+
+static cache_map_t
+cachevrfy_map_new_cb(void)
+{
+	return kh_init(sha1map_t);
+}
+
+static void
+cachevrfy_map_free_cb(cache_map_t map)
+{
+	kh_destroy(sha1map_t, (khash_t(sha1map_t) *)map);
+}
+
+static int
+cachevrfy_full_cb(cache_map_t map)
+{
+	khash_t(sha1map_t) *h = map;
+
+	return h->n_occupied >= h->upper_bound;
+}
+
+static int
+cachevrfy_resize_cb(cache_map_t map, size_t n)
+{
+	return kh_resize(sha1map_t, (khash_t(sha1map_t) *)map,
+	                 (khint_t)(n / __ac_HASH_UPPER) + 1);
+}
+
+static unsigned int
+cachevrfy_hash_cb(cache_key_t key)
+{
+	return kh_vrfyfpr_hash_func(key);
+}
+
+static size_t
+cachevrfy_size_cb(UNUSED cache_key_t key, UNUSED cache_val_t val)
+{
+	return SSL_X509_FPRSZ + sizeof(time_t);
+}
+
+void
+cachevrfy_init_cb(cache_t *cache)
+{
+	cache->map_new_cb               = cachevrfy_map_new_cb;
+	cache->map_free_cb              = cachevrfy_map_free_cb;
+	cache->hash_cb                  = cachevrfy_hash_cb;
+	cache->begin_cb                 = cachevrfy_begin_cb;
+	cache->end_cb                   = cachevrfy_end_cb;
+	cache->exist_cb                 = cachevrfy_exist_cb;
+	cache->del_cb                   = cachevrfy_del_cb;
+	cache->get_cb                   = cachevrfy_get_cb;
+	cache->put_cb                   = cachevrfy_put_cb;
+	cache->free_key_cb              = cachevrfy_free_key_cb;
+	cache->free_val_cb              = cachevrfy_free_val_cb;
+	cache->get_key_cb               = cachevrfy_get_key_cb;
+	cache->get_val_cb               = cachevrfy_get_val_cb;
+	cache->set_val_cb               = cachevrfy_set_val_cb;
+	cache->unpackverify_val_cb      = cachevrfy_unpackverify_val_cb;
+	cache->size_cb                  = cachevrfy_size_cb;
+	cache->full_cb                  = cachevrfy_full_cb;
+	cache->resize_cb                = cachevrfy_resize_cb;
+}
+
+/*
+ * Create a key from the peer certificate and the chain as presented by the
+ * peer.  The leaf certificate is skipped in the chain if present there.
+ * Returns NULL on errors.
+ */
+cache_key_t
+cachevrfy_mkkey(X509 *keycrt, STACK_OF(X509) *keychain)
+{
+	unsigned char *buf, *fpr;
+	size_t n;
+	int i;
+
+	n = 1 + (keychain ? sk_X509_num(keychain) : 0);
+	if (!(buf = malloc(n * SSL_X509_FPRSZ)))
+		return NULL;
+	if (ssl_x509_fingerprint_sha1(keycrt, buf) == -1)
+		goto leave;
+	n = 1;
+	for (i = 0; keychain && i < sk_X509_num(keychain); i++) {
+		X509 *crt = sk_X509_value(keychain, i);
+		if (!X509_cmp(crt, keycrt))
+			continue;
+		if (ssl_x509_fingerprint_sha1(crt,
+		                              buf + n * SSL_X509_FPRSZ) == -1)
+			goto leave;
+		n++;
+	}
+	if (!(fpr = malloc(SSL_X509_FPRSZ)))
+		goto leave;
+	if (!EVP_Digest(buf, n * SSL_X509_FPRSZ, fpr, NULL,
+	                ssl_md(SSL_MD_SHA1), NULL)) {
+		free(fpr);
+		goto leave;
+	}
+	free(buf);
+	return fpr;
+
+leave:
+	free(buf);
+	return NULL;
+}
+
+cache_val_t
+cachevrfy_mkval(time_t valexpiry)
+{
+	time_t *expiry;
+
+	if (!(expiry = malloc(sizeof(time_t))))
+		return NULL;
+	*expiry = valexpiry;
+	return expiry;
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,142 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "ssl.h"
+#include "cachemgr.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <check.h>
+
+#define TESTCERT "extra/pki/rsa.crt"
+#define TESTCERT2 "extra/pki/server.crt"
+
+static void
+cachemgr_setup(void)
+{
+	if ((ssl_init() == -1) || (cachemgr_preinit() == -1))
+		exit(EXIT_FAILURE);
+}
+
+static void
+cachemgr_teardown(void)
+{
+	cachemgr_fini();
+	ssl_fini();
+}
+
+START_TEST(cache_vrfy_01)
+{
+	time_t *expiry;
+	X509 *c1;
+
+	c1 = ssl_x509_load(TESTCERT);
+	fail_unless(!!c1, "loading certificate failed");
+	expiry = cachemgr_vrfy_get(c1, NULL);
+	fail_unless(expiry == NULL, "result was already in empty cache");
+	cachemgr_vrfy_set(c1, NULL, time(NULL) + 3600);
+	expiry = cachemgr_vrfy_get(c1, NULL);
+	fail_unless(!!expiry, "cache did not return a result");
+	free(expiry);
+	cachemgr_vrfy_del(c1, NULL);
+	expiry = cachemgr_vrfy_get(c1, NULL);
+	fail_unless(expiry == NULL, "cache returned deleted result");
+	X509_free(c1);
+}
+END_TEST
+
+START_TEST(cache_vrfy_02)
+{
+	time_t *expiry;
+	X509 *c1;
+
+	c1 = ssl_x509_load(TESTCERT);
+	fail_unless(!!c1, "loading certificate failed");
+	cachemgr_vrfy_set(c1, NULL, time(NULL) - 1);
+	expiry = cachemgr_vrfy_get(c1, NULL);
+	fail_unless(expiry == NULL, "cache returned expired result");
+	X509_free(c1);
+}
+END_TEST
+
+START_TEST(cache_vrfy_03)
+{
+	STACK_OF(X509) *chain1, *chain2;
+	time_t *expiry;
+	X509 *c1, *c2;
+
+	c1 = ssl_x509_load(TESTCERT2);
+	fail_unless(!!c1, "loading certificate failed");
+	c2 = ssl_x509_load(TESTCERT);
+	fail_unless(!!c2, "loading certificate failed");
+	chain1 = sk_X509_new_null();
+	sk_X509_push(chain1, c1);
+	chain2 = sk_X509_new_null();
+	sk_X509_push(chain2, c1);
+	sk_X509_push(chain2, c2);
+
+	/* leaf in presented chain is skipped */
+	cachemgr_vrfy_set(c1, chain1, time(NULL) + 3600);
+	expiry = cachemgr_vrfy_get(c1, NULL);
+	fail_unless(!!expiry, "leaf in chain changed key");
+	free(expiry);
+	/* different chain with same leaf is a different key */
+	expiry = cachemgr_vrfy_get(c1, chain2);
+	fail_unless(expiry == NULL, "different chain returned result");
+	cachemgr_vrfy_set(c1, chain2, time(NULL) + 3600);
+	expiry = cachemgr_vrfy_get(c1, chain2);
+	fail_unless(!!expiry, "cache did not return a result");
+	free(expiry);
+
+	sk_X509_free(chain1);
+	sk_X509_free(chain2);
+	X509_free(c1);
+	X509_free(c2);
+}
+END_TEST
+
+Suite *
+cachevrfy_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("cachevrfy");
+
+	tc = tcase_create("cache_vrfy");
+	tcase_add_checked_fixture(tc, cachemgr_setup, cachemgr_teardown);
+	tcase_add_test(tc, cache_vrfy_01);
+	tcase_add_test(tc, cache_vrfy_02);
+	tcase_add_test(tc, cache_vrfy_03);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
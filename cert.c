@@ -34,6 +34,13 @@
 
 /*
  * Certificate, including private key and certificate chain.
+ *
+ * Once a cert is shared, i.e. once it has been handed out to more than one
+ * owner using cert_refcount_inc(), it is immutable; readers on any thread
+ * access its members without locking.  The setters may only be used on a
+ * cert that has not been shared yet, such as one fresh from cert_new();
+ * to change a shared cert, make a copy using cert_new3_copy() and modify
+ * that instead.  Reference counts are maintained atomically.
  */
 
 cert_t *
@@ -44,10 +51,6 @@ cert_new(void)
 	if (!(c = malloc(sizeof(cert_t))))
 		return NULL;
 	memset(c, 0, sizeof(cert_t));
-	if (pthread_mutex_init(&c->mutex, NULL)) {
-		free(c);
-		return NULL;
-	}
 	c->references = 1;
 	return c;
 }
@@ -63,10 +66,6 @@ cert_new3(EVP_PKEY *key, X509 *crt, STACK_OF(X509) *chain)
 
 	if (!(c = malloc(sizeof(cert_t))))
 		return NULL;
-	if (pthread_mutex_init(&c->mutex, NULL)) {
-		free(c);
-		return NULL;
-	}
 	c->key = key;
 	c->crt = crt;
 	c->chain = chain;
@@ -85,10 +84,6 @@ cert_new3_copy(EVP_PKEY *key, X509 *crt, STACK_OF(X509) *chain)
 
 	if (!(c = malloc(sizeof(cert_t))))
 		return NULL;
-	if (pthread_mutex_init(&c->mutex, NULL)) {
-		free(c);
-		return NULL;
-	}
 	c->key = key;
 	ssl_key_refcount_inc(c->key);
 	c->crt = crt;
@@ -112,10 +107,6 @@ cert_new_load(const char *filename)
 	if (!(c = malloc(sizeof(cert_t))))
 		return NULL;
 	memset(c, 0, sizeof(cert_t));
-	if (pthread_mutex_init(&c->mutex, NULL)) {
-		free(c);
-		return NULL;
-	}
 
 	if (ssl_x509chain_load(&c->crt, &c->chain, filename) == -1) {
 		free(c);
@@ -140,18 +131,16 @@ cert_new_load(const char *filename)
 void
 cert_refcount_inc(cert_t *c)
 {
-	pthread_mutex_lock(&c->mutex);
-	c->references++;
-	pthread_mutex_unlock(&c->mutex);
+	__atomic_add_fetch(&c->references, 1, __ATOMIC_RELAXED);
 }
 
 /*
- * Thread-safe setter functions; they copy the value (refcounts are inc'd).
+ * Setter functions for certs that are not shared yet; they copy the value
+ * (refcounts are inc'd).
  */
 void
 cert_set_key(cert_t *c, EVP_PKEY *key)
 {
-	pthread_mutex_lock(&c->mutex);
 	if (c->key) {
 		EVP_PKEY_free(c->key);
 	}
@@ -159,12 +148,10 @@ cert_set_key(cert_t *c, EVP_PKEY *key)
 	if (c->key) {
 		ssl_key_refcount_inc(c->key);
 	}
-	pthread_mutex_unlock(&c->mutex);
 }
 void
 cert_set_crt(cert_t *c, X509 *crt)
 {
-	pthread_mutex_lock(&c->mutex);
 	if (c->crt) {
 		X509_free(c->crt);
 	}
@@ -172,12 +159,10 @@ cert_set_crt(cert_t *c, X509 *crt)
 	if (c->crt) {
 		ssl_x509_refcount_inc(c->crt);
 	}
-	pthread_mutex_unlock(&c->mutex);
 }
 void
 cert_set_chain(cert_t *c, STACK_OF(X509) *chain)
 {
-	pthread_mutex_lock(&c->mutex);
 	if (c->chain) {
 		sk_X509_pop_free(c->chain, X509_free);
 	}
@@ -189,23 +174,18 @@ cert_set_chain(cert_t *c, STACK_OF(X509) *chain)
 	} else {
 		c->chain = NULL;
 	}
-	pthread_mutex_unlock(&c->mutex);
 }
 
 /*
- * Free cert including internal objects.
+ * Decrement reference count and free cert including internal objects once
+ * the last reference is gone.
  */
 void
 cert_free(cert_t *c)
 {
-	pthread_mutex_lock(&c->mutex);
-	c->references--;
-	if (c->references) {
-		pthread_mutex_unlock(&c->mutex);
+	/* release our accesses to the cert to the thread that frees it */
+	if (__atomic_sub_fetch(&c->references, 1, __ATOMIC_ACQ_REL))
 		return;
-	}
-	pthread_mutex_unlock(&c->mutex);
-	pthread_mutex_destroy(&c->mutex);
 	if (c->key) {
 		EVP_PKEY_free(c->key);
 	}
@@ -218,4 +198,27 @@ cert_free(cert_t *c)
 	free(c);
 }
 
+/*
+ * Approximate memory footprint of a cert by the DER encoded sizes of the
+ * certificate, the chain and the private key, like ssl_session_memsz().
+ * Certificates in the chain are shared with other certs and counted in full
+ * for each of them.
+ */
+size_t
+cert_memsz(cert_t *c)
+{
+	size_t n = sizeof(cert_t);
+	int sz;
+
+	if (c->crt && (sz = i2d_X509(c->crt, NULL)) > 0)
+		n += sz;
+	for (int i = 0; c->chain && i < sk_X509_num(c->chain); i++) {
+		if ((sz = i2d_X509(sk_X509_value(c->chain, i), NULL)) > 0)
+			n += sz;
+	}
+	if (c->key && (sz = i2d_PrivateKey(c->key, NULL)) > 0)
+		n += sz;
+	return n;
+}
+
 /* vim: set noet ft=c: */
@@ -32,13 +32,11 @@
 #include "attrib.h"
 
 #include <openssl/ssl.h>
-#include <pthread.h>
 
 typedef struct cert {
 	EVP_PKEY *key;
 	X509 *crt;
 	STACK_OF(X509) * chain;
-	pthread_mutex_t mutex;
 	size_t references;
 } cert_t;
 
@@ -51,6 +49,7 @@ void cert_set_key(cert_t *, EVP_PKEY *) NONNULL(1);
 void cert_set_crt(cert_t *, X509 *) NONNULL(1);
 void cert_set_chain(cert_t *, STACK_OF(X509) *) NONNULL(1);
 void cert_free(cert_t *) NONNULL(1);
+size_t cert_memsz(cert_t *) NONNULL(1) WUNRES;
 
 #endif /* !CERT_H */
 
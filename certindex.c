@@ -0,0 +1,358 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "certindex.h"
+
+#include "ssl.h"
+#include "sys.h"
+#include "log.h"
+#include "khash.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <openssl/pem.h>
+
+/*
+ * Index of the target certificates in the directory given by -t, mapping
+ * each name a certificate is valid for to the file it was read from, such
+ * that certificate, chain and key can be loaded on first use instead of at
+ * startup.  The index is built before any connection handling threads are
+ * started and read-only afterwards, so lookups need no locking.  As with
+ * loading all certificates at startup, a later file for the same name
+ * supersedes earlier ones.
+ *
+ * Building the index from the directory only decodes the first certificate
+ * found in each file.  The index file skips even that; it is a text file
+ * made up of a magic line followed by a "F <filename>" line for each file
+ * and a "N <name>" line for each name of the preceding file.
+ */
+
+#define CERTINDEX_MAGIC "SSLsplit-tgidx-1"
+
+KHASH_INIT(cstrsizemap_t, char*, size_t, 1, kh_str_hash_func,
+           kh_str_hash_equal)
+
+struct certindex {
+	khash_t(cstrsizemap_t) *map;
+	char **files;
+	size_t nfiles;
+	size_t szfiles;
+};
+
+certindex_t *
+certindex_new(void)
+{
+	certindex_t *idx;
+
+	if (!(idx = calloc(1, sizeof(certindex_t))))
+		return NULL;
+	if (!(idx->map = kh_init(cstrsizemap_t))) {
+		free(idx);
+		return NULL;
+	}
+	return idx;
+}
+
+void
+certindex_free(certindex_t *idx)
+{
+	for (khiter_t it = kh_begin(idx->map); it != kh_end(idx->map); it++) {
+		if (kh_exist(idx->map, it))
+			free(kh_key(idx->map, it));
+	}
+	kh_destroy(cstrsizemap_t, idx->map);
+	for (size_t i = 0; i < idx->nfiles; i++)
+		free(idx->files[i]);
+	free(idx->files);
+	free(idx);
+}
+
+/*
+ * Make filename the current file, to which added names refer.  Consecutive
+ * names of the same file share a copy of the filename.
+ * Returns -1 on out of memory condition, 0 on success.
+ */
+static int
+certindex_file(certindex_t *idx, const char *filename)
+{
+	if (idx->nfiles && !strcmp(idx->files[idx->nfiles - 1], filename))
+		return 0;
+	if (idx->nfiles == idx->szfiles) {
+		size_t sz = idx->szfiles ? idx->szfiles * 2 : 64;
+		char **files;
+
+		if (!(files = realloc(idx->files, sz * sizeof(char *))))
+			return -1;
+		idx->files = files;
+		idx->szfiles = sz;
+	}
+	if (!(idx->files[idx->nfiles] = strdup(filename)))
+		return -1;
+	idx->nfiles++;
+	return 0;
+}
+
+/*
+ * Add name for the certificate in filename.
+ * Returns -1 on out of memory condition, 0 on success.
+ */
+int
+certindex_add(certindex_t *idx, const char *name, const char *filename)
+{
+	khiter_t it;
+	char *key;
+	int ret;
+
+	if (certindex_file(idx, filename) == -1)
+		return -1;
+	if (!(key = strdup(name)))
+		return -1;
+	it = kh_put(cstrsizemap_t, idx->map, key, &ret);
+	if (ret == -1) {
+		free(key);
+		return -1;
+	}
+	if (ret == 0)
+		free(key);
+	kh_val(idx->map, it) = idx->nfiles - 1;
+	return 0;
+}
+
+/*
+ * Return the file holding the certificate for name, or NULL if there is
+ * none.  Thread-safe once the index is complete.
+ */
+const char *
+certindex_get(certindex_t *idx, const char *name)
+{
+	khiter_t it;
+
+	it = kh_get(cstrsizemap_t, idx->map, (char *)name);
+	if (it == kh_end(idx->map))
+		return NULL;
+	return idx->files[kh_val(idx->map, it)];
+}
+
+/*
+ * Return the number of names in the index.
+ */
+size_t
+certindex_entries(certindex_t *idx)
+{
+	return kh_size(idx->map);
+}
+
+/*
+ * Return the number of files referenced by the index.
+ */
+size_t
+certindex_files(certindex_t *idx)
+{
+	return idx->nfiles;
+}
+
+static int
+certindex_scan_cb(const char *filename, void *arg)
+{
+	certindex_t *idx = arg;
+	X509 *crt;
+	BIO *bio;
+	char **names;
+	int rv = 0;
+
+	if (!(bio = BIO_new_file(filename, "r"))) {
+		log_err_printf("Failed to open '%s'\n", filename);
+		return -1;
+	}
+	crt = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+	BIO_free(bio);
+	if (!crt) {
+		log_err_printf("Failed to load cert from PEM file '%s'\n",
+		               filename);
+		return -1;
+	}
+	names = ssl_x509_names(crt);
+	X509_free(crt);
+	if (!names)
+		return -1;
+	for (char **p = names; *p; p++) {
+		/* be deliberately vulnerable to NULL prefix attacks */
+		char *sep;
+		if ((sep = strchr(*p, '!'))) {
+			*sep = '\0';
+		}
+		if (rv == 0 && certindex_add(idx, *p, filename) == -1)
+			rv = -1;
+		free(*p);
+	}
+	free(names);
+	return rv;
+}
+
+/*
+ * Add the names of the certificates in all files in directory dirname.
+ * Returns -1 on error, 0 on success.
+ */
+int
+certindex_scan(certindex_t *idx, const char *dirname)
+{
+	return sys_dir_eachfile(dirname, certindex_scan_cb, idx);
+}
+
+/*
+ * Add the names from the index file filename.
+ * Returns -1 on error, 0 on success, 1 if the file does not exist.
+ */
+int
+certindex_load(certindex_t *idx, const char *filename)
+{
+	char *line = NULL;
+	char *file = NULL;
+	size_t linesz = 0;
+	ssize_t n;
+	FILE *f;
+	int rv = -1;
+
+	if (!(f = fopen(filename, "r"))) {
+		if (errno == ENOENT)
+			return 1;
+		log_err_printf("Failed to open '%s': %s\n",
+		               filename, strerror(errno));
+		return -1;
+	}
+	if ((n = getline(&line, &linesz, f)) == -1 ||
+	    strcmp(line, CERTINDEX_MAGIC "\n")) {
+		log_err_printf("Not a certificate index: '%s'\n", filename);
+		goto out;
+	}
+	while ((n = getline(&line, &linesz, f)) != -1) {
+		if (n < 3 || line[1] != ' ' || line[n - 1] != '\n')
+			goto bad;
+		line[n - 1] = '\0';
+		if (line[0] == 'F') {
+			if (certindex_file(idx, line + 2) == -1)
+				goto out;
+			file = idx->files[idx->nfiles - 1];
+		} else if (line[0] == 'N' && file) {
+			if (certindex_add(idx, line + 2, file) == -1)
+				goto out;
+		} else {
+			goto bad;
+		}
+	}
+	if (ferror(f)) {
+		log_err_printf("Failed to read '%s': %s\n",
+		               filename, strerror(errno));
+		goto out;
+	}
+	rv = 0;
+	goto out;
+bad:
+	log_err_printf("Malformed certificate index '%s'\n", filename);
+out:
+	free(line);
+	fclose(f);
+	return rv;
+}
+
+typedef struct certindex_entry {
+	size_t file;
+	const char *name;
+} certindex_entry_t;
+
+static int
+certindex_entry_cmp(const void *a, const void *b)
+{
+	const certindex_entry_t *ea = a, *eb = b;
+
+	return ea->file < eb->file ? -1 : ea->file > eb->file ? 1 : 0;
+}
+
+/*
+ * Write the index to filename, replacing it atomically.  Names and files
+ * containing newlines cannot be represented and are skipped.
+ * Returns -1 on error, 0 on success.
+ */
+int
+certindex_save(certindex_t *idx, const char *filename)
+{
+	certindex_entry_t *e;
+	size_t n = 0, file = (size_t)-1;
+	char *tmpname;
+	FILE *f;
+	int rv = -1;
+
+	if (asprintf(&tmpname, "%s.tmp", filename) == -1)
+		return -1;
+	if (!(e = malloc((kh_size(idx->map) + 1) * sizeof(certindex_entry_t))))
+		goto out1;
+	for (khiter_t it = kh_begin(idx->map); it != kh_end(idx->map); it++) {
+		if (!kh_exist(idx->map, it))
+			continue;
+		e[n].file = kh_val(idx->map, it);
+		e[n].name = kh_key(idx->map, it);
+		if (!strchr(e[n].name, '\n') &&
+		    !strchr(idx->files[e[n].file], '\n'))
+			n++;
+	}
+	/* group names by file */
+	qsort(e, n, sizeof(certindex_entry_t), certindex_entry_cmp);
+	if (!(f = fopen(tmpname, "w"))) {
+		log_err_printf("Failed to open '%s': %s\n",
+		               tmpname, strerror(errno));
+		goto out2;
+	}
+	fprintf(f, CERTINDEX_MAGIC "\n");
+	for (size_t i = 0; i < n; i++) {
+		if (e[i].file != file) {
+			file = e[i].file;
+			fprintf(f, "F %s\n", idx->files[file]);
+		}
+		fprintf(f, "N %s\n", e[i].name);
+	}
+	rv = ferror(f) ? -1 : 0;
+	if (fclose(f) == EOF)
+		rv = -1;
+	if (rv == -1 || rename(tmpname, filename) == -1) {
+		log_err_printf("Failed to write '%s': %s\n",
+		               filename, strerror(errno));
+		unlink(tmpname);
+		rv = -1;
+	}
+out2:
+	free(e);
+out1:
+	free(tmpname);
+	return rv;
+}
+
+/* vim: set noet ft=c: */
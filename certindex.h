@@ -0,0 +1,50 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CERTINDEX_H
+#define CERTINDEX_H
+
+#include "attrib.h"
+
+#include <stddef.h>
+
+typedef struct certindex certindex_t;
+
+certindex_t * certindex_new(void) MALLOC;
+void certindex_free(certindex_t *) NONNULL(1);
+int certindex_add(certindex_t *, const char *, const char *) NONNULL(1,2,3);
+const char * certindex_get(certindex_t *, const char *) NONNULL(1,2);
+size_t certindex_entries(certindex_t *) NONNULL(1) WUNRES;
+size_t certindex_files(certindex_t *) NONNULL(1) WUNRES;
+int certindex_scan(certindex_t *, const char *) NONNULL(1,2) WUNRES;
+int certindex_load(certindex_t *, const char *) NONNULL(1,2) WUNRES;
+int certindex_save(certindex_t *, const char *) NONNULL(1,2) WUNRES;
+
+#endif /* !CERTINDEX_H */
+
+/* vim: set noet ft=c: */
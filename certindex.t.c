@@ -0,0 +1,152 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ssl.h"
+#include "certindex.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <check.h>
+
+#define TESTDIR "extra/pki/targets"
+#define TESTCERT "extra/pki/targets/daniel.roe.ch.pem"
+
+static char template[] = "/tmp/sslsplit.test.XXXXXX";
+static char *basedir;
+static char *indexfile;
+
+static void
+certindex_setup(void)
+{
+	if (ssl_init() == -1)
+		exit(EXIT_FAILURE);
+	basedir = strdup(template);
+	if (!mkdtemp(basedir)) {
+		perror("mkdtemp");
+		exit(EXIT_FAILURE);
+	}
+	if (asprintf(&indexfile, "%s/leaf.idx", basedir) == -1) {
+		perror("asprintf");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void
+certindex_teardown(void)
+{
+	unlink(indexfile);
+	rmdir(basedir);
+	free(indexfile);
+	free(basedir);
+	ssl_fini();
+}
+
+START_TEST(certindex_01)
+{
+	certindex_t *idx;
+	const char *file;
+
+	idx = certindex_new();
+	fail_unless(!!idx, "new failed");
+	fail_unless(certindex_scan(idx, TESTDIR) == 0, "scan failed");
+	fail_unless(certindex_files(idx) == 2, "wrong number of files");
+	fail_unless(certindex_entries(idx) == 2, "wrong number of names");
+	file = certindex_get(idx, "daniel.roe.ch");
+	fail_unless(!!file, "name not found");
+	fail_unless(!strcmp(file, TESTCERT), "wrong file");
+	fail_unless(!!certindex_get(idx, "*.roe.ch"), "wildcard not found");
+	fail_unless(!certindex_get(idx, "www.roe.ch"), "unknown name found");
+	certindex_free(idx);
+}
+END_TEST
+
+START_TEST(certindex_02)
+{
+	certindex_t *idx;
+	const char *file;
+
+	idx = certindex_new();
+	fail_unless(!!idx, "new failed");
+	fail_unless(certindex_load(idx, indexfile) == 1,
+	            "missing index file not reported");
+	fail_unless(certindex_scan(idx, TESTDIR) == 0, "scan failed");
+	fail_unless(certindex_save(idx, indexfile) == 0, "save failed");
+	certindex_free(idx);
+
+	idx = certindex_new();
+	fail_unless(!!idx, "new failed");
+	fail_unless(certindex_load(idx, indexfile) == 0, "load failed");
+	fail_unless(certindex_files(idx) == 2, "files not loaded");
+	fail_unless(certindex_entries(idx) == 2, "names not loaded");
+	file = certindex_get(idx, "daniel.roe.ch");
+	fail_unless(!!file, "name not found after load");
+	fail_unless(!strcmp(file, TESTCERT), "wrong file after load");
+	certindex_free(idx);
+}
+END_TEST
+
+START_TEST(certindex_03)
+{
+	certindex_t *idx;
+	FILE *f;
+
+	f = fopen(indexfile, "w");
+	fail_unless(!!f, "fopen failed");
+	fputs("not an index\n", f);
+	fclose(f);
+
+	idx = certindex_new();
+	fail_unless(!!idx, "new failed");
+	fail_unless(certindex_load(idx, indexfile) == -1,
+	            "bad index file accepted");
+	certindex_free(idx);
+}
+END_TEST
+
+Suite *
+certindex_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("certindex");
+
+	tc = tcase_create("certindex");
+	tcase_add_checked_fixture(tc, certindex_setup, certindex_teardown);
+	tcase_add_test(tc, certindex_01);
+	tcase_add_test(tc, certindex_02);
+	tcase_add_test(tc, certindex_03);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,196 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "certmatch.h"
+
+#include "khash.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Table of the target certificates loaded from the directory given by -t,
+ * mapping each name a certificate is valid for to the certificate itself.
+ * The table is built before any connection handling threads are started and
+ * read-only afterwards, so lookups need no locking.  A lookup matches both
+ * the exact name and its wildcarded form as produced by ssl_wildcardify(),
+ * without building the wildcarded name: the hash of "*" followed by the
+ * remainder of the name from its first dot is computed in place.
+ */
+
+KHASH_INIT(cstrcertmap_t, char*, cert_t*, 1, kh_str_hash_func,
+           kh_str_hash_equal)
+
+struct certmatch {
+	khash_t(cstrcertmap_t) *map;
+};
+
+certmatch_t *
+certmatch_new(void)
+{
+	certmatch_t *m;
+
+	if (!(m = malloc(sizeof(certmatch_t))))
+		return NULL;
+	if (!(m->map = kh_init(cstrcertmap_t))) {
+		free(m);
+		return NULL;
+	}
+	return m;
+}
+
+void
+certmatch_free(certmatch_t *m)
+{
+	for (khiter_t it = kh_begin(m->map); it != kh_end(m->map); it++) {
+		if (kh_exist(m->map, it)) {
+			free(kh_key(m->map, it));
+			cert_free(kh_val(m->map, it));
+		}
+	}
+	kh_destroy(cstrcertmap_t, m->map);
+	free(m);
+}
+
+/*
+ * Add name for cert, superseding any previous cert for the same name.
+ * Increments the reference count of cert.
+ * Returns -1 on out of memory condition, 0 on success.
+ */
+int
+certmatch_add(certmatch_t *m, const char *name, cert_t *cert)
+{
+	khiter_t it;
+	char *key;
+	int ret;
+
+	it = kh_get(cstrcertmap_t, m->map, (char *)name);
+	if (it != kh_end(m->map)) {
+		cert_free(kh_val(m->map, it));
+	} else {
+		if (!(key = strdup(name)))
+			return -1;
+		it = kh_put(cstrcertmap_t, m->map, key, &ret);
+		if (ret == -1) {
+			free(key);
+			return -1;
+		}
+	}
+	cert_refcount_inc(cert);
+	kh_val(m->map, it) = cert;
+	return 0;
+}
+
+/*
+ * Hash of "*" followed by s, consistent with kh_str_hash_func().
+ */
+static khint_t
+certmatch_hash_wildcard(const char *s)
+{
+	khint_t h = '*';
+
+	for (; *s; s++)
+		h = (h << 5) - h + (khint_t)*s;
+	return h;
+}
+
+/*
+ * Look up the bucket of the wildcarded form of name, i.e. "*" followed by
+ * name from its first dot, or just "*" for names without a dot.  This is an
+ * open-coded kh_get() with the hash and key comparison of the wildcarded
+ * name computed from name in place.
+ */
+static khiter_t
+certmatch_get_wildcard(certmatch_t *m, const char *name)
+{
+	khash_t(cstrcertmap_t) *h = m->map;
+	const char *dot;
+	khint_t k, i, last, mask, step = 0;
+
+	if (!h->n_buckets)
+		return kh_end(h);
+	if (!(dot = strchr(name, '.')))
+		dot = "";
+	mask = h->n_buckets - 1;
+	k = certmatch_hash_wildcard(dot);
+	i = k & mask;
+	last = i;
+	while (!__ac_isempty(h->flags, i) &&
+	       (__ac_isdel(h->flags, i) ||
+	        h->keys[i][0] != '*' || strcmp(h->keys[i] + 1, dot))) {
+		i = (i + (++step)) & mask;
+		if (i == last)
+			return kh_end(h);
+	}
+	return __ac_iseither(h->flags, i) ? kh_end(h) : i;
+}
+
+/*
+ * Look up the cert for name, falling back to the wildcarded form of name.
+ * Returns the cert with its reference count incremented, or NULL.
+ */
+cert_t *
+certmatch_get(certmatch_t *m, const char *name)
+{
+	khiter_t it;
+	cert_t *cert;
+
+	it = kh_get(cstrcertmap_t, m->map, (char *)name);
+	if (it == kh_end(m->map))
+		it = certmatch_get_wildcard(m, name);
+	if (it == kh_end(m->map))
+		return NULL;
+	cert = kh_val(m->map, it);
+	cert_refcount_inc(cert);
+	return cert;
+}
+
+size_t
+certmatch_entries(certmatch_t *m)
+{
+	return kh_size(m->map);
+}
+
+/*
+ * Return the approximate memory footprint of the table; as in the target
+ * cert cache, certificates for several names are counted once for each name.
+ */
+size_t
+certmatch_bytes(certmatch_t *m)
+{
+	size_t n = 0;
+
+	for (khiter_t it = kh_begin(m->map); it != kh_end(m->map); it++) {
+		if (kh_exist(m->map, it))
+			n += strlen(kh_key(m->map, it)) + 1 +
+			     cert_memsz(kh_val(m->map, it));
+	}
+	return n;
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,143 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ssl.h"
+#include "cert.h"
+#include "certmatch.h"
+
+#include <stdlib.h>
+
+#include <check.h>
+
+#define TESTCERT "extra/pki/targets/daniel.roe.ch.pem"
+#define TESTCERT2 "extra/pki/targets/wildcard.roe.ch.pem"
+
+static certmatch_t *m;
+static cert_t *c1, *c2;
+
+static void
+certmatch_setup(void)
+{
+	if (ssl_init() == -1)
+		exit(EXIT_FAILURE);
+	c1 = cert_new_load(TESTCERT);
+	c2 = cert_new_load(TESTCERT2);
+	m = certmatch_new();
+	if (!c1 || !c2 || !m)
+		exit(EXIT_FAILURE);
+}
+
+static void
+certmatch_teardown(void)
+{
+	certmatch_free(m);
+	cert_free(c2);
+	cert_free(c1);
+	ssl_fini();
+}
+
+START_TEST(certmatch_01)
+{
+	cert_t *c;
+
+	fail_unless(certmatch_add(m, "daniel.roe.ch", c1) == 0, "add failed");
+	fail_unless(certmatch_entries(m) == 1, "wrong number of entries");
+	c = certmatch_get(m, "daniel.roe.ch");
+	fail_unless(c == c1, "exact name not matched");
+	cert_free(c);
+	c = certmatch_get(m, "www.roe.ch");
+	fail_unless(c == NULL, "unrelated name matched");
+}
+END_TEST
+
+START_TEST(certmatch_02)
+{
+	cert_t *c;
+
+	fail_unless(certmatch_add(m, "daniel.roe.ch", c1) == 0, "add failed");
+	fail_unless(certmatch_add(m, "*.roe.ch", c2) == 0, "add failed");
+	c = certmatch_get(m, "daniel.roe.ch");
+	fail_unless(c == c1, "exact name not preferred");
+	cert_free(c);
+	c = certmatch_get(m, "www.roe.ch");
+	fail_unless(c == c2, "wildcard not matched");
+	cert_free(c);
+	c = certmatch_get(m, "www.daniel.roe.ch");
+	fail_unless(c == NULL, "wildcard matched more than one label");
+	c = certmatch_get(m, "roe.ch");
+	fail_unless(c == NULL, "wildcard matched parent domain");
+}
+END_TEST
+
+START_TEST(certmatch_03)
+{
+	cert_t *c;
+
+	fail_unless(certmatch_add(m, "*", c2) == 0, "add failed");
+	c = certmatch_get(m, "localhost");
+	fail_unless(c == c2, "bare wildcard not matched");
+	cert_free(c);
+	c = certmatch_get(m, "www.roe.ch");
+	fail_unless(c == NULL, "bare wildcard matched dotted name");
+}
+END_TEST
+
+START_TEST(certmatch_04)
+{
+	cert_t *c;
+
+	fail_unless(certmatch_add(m, "daniel.roe.ch", c1) == 0, "add failed");
+	fail_unless(certmatch_add(m, "daniel.roe.ch", c2) == 0, "add failed");
+	fail_unless(certmatch_entries(m) == 1, "wrong number of entries");
+	c = certmatch_get(m, "daniel.roe.ch");
+	fail_unless(c == c2, "later cert did not supersede");
+	cert_free(c);
+	fail_unless(c1->references == 1, "superseded cert not released");
+}
+END_TEST
+
+Suite *
+certmatch_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("certmatch");
+
+	tc = tcase_create("certmatch");
+	tcase_add_checked_fixture(tc, certmatch_setup, certmatch_teardown);
+	tcase_add_test(tc, certmatch_01);
+	tcase_add_test(tc, certmatch_02);
+	tcase_add_test(tc, certmatch_03);
+	tcase_add_test(tc, certmatch_04);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,407 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "certstore.h"
+
+#include "ssl.h"
+#include "log.h"
+#include "khash.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+/*
+ * Persistent store for forged leaf certificates.
+ *
+ * The store is a single append-only file.  It starts with a header made up
+ * of a magic string and the SHA-1 digest over the CA certificate, the public
+ * leaf key and the CRL URL, i.e. over everything except the original server
+ * certificate that goes into a forged certificate.  If the header does not
+ * match the running configuration, the store is discarded and started over.
+ *
+ * The header is followed by a sequence of records:
+ *
+ *   unsigned char[SSL_X509_FPRSZ]   fingerprint of original server cert
+ *   uint32_t (big endian)           length of DER encoding
+ *   unsigned char[]                 DER encoded forged certificate
+ *
+ * On open, the existing records are mmap'ed and indexed by fingerprint only;
+ * certificates are decoded lazily on first lookup.  New certificates are
+ * appended, a later record for the same fingerprint supersedes earlier ones.
+ * A truncated trailing record, e.g. after a crash, is cut off on open.
+ */
+
+#define CERTSTORE_MAGIC         "SSLsplit-fkcrt-1"
+#define CERTSTORE_MAGICSZ       (sizeof(CERTSTORE_MAGIC) - 1)
+#define CERTSTORE_HDRSZ         (CERTSTORE_MAGICSZ + SSL_X509_FPRSZ)
+#define CERTSTORE_RECHDRSZ      (SSL_X509_FPRSZ + 4)
+#define CERTSTORE_MAXDERSZ      (1 << 20)
+
+typedef struct {
+	unsigned char fpr[SSL_X509_FPRSZ];
+} certstore_fpr_t;
+
+static inline khint_t
+kh_certstore_fpr_hash_func(certstore_fpr_t k)
+{
+	khint_t h;
+
+	/* assumes fpr is uniformly distributed */
+	memcpy(&h, k.fpr, sizeof(h));
+	return h;
+}
+
+#define kh_certstore_fpr_hash_equal(a, b) \
+        (memcmp((a).fpr, (b).fpr, SSL_X509_FPRSZ) == 0)
+
+KHASH_INIT(fproffmap_t, certstore_fpr_t, off_t, 1, kh_certstore_fpr_hash_func,
+           kh_certstore_fpr_hash_equal)
+
+struct certstore {
+	pthread_mutex_t mutex;
+	khash_t(fproffmap_t) *index;
+	int fd;
+	unsigned char *map;     /* records present at open, read-only */
+	size_t maplen;          /* length of the mapping */
+	size_t mapsz;           /* bytes of map covered by valid records */
+	off_t size;             /* offset at which to append */
+};
+
+/*
+ * Compute the digest identifying the forging configuration.
+ * Returns -1 on error, 0 on success.
+ */
+static int
+certstore_cfgdigest(X509 *cacrt, EVP_PKEY *leafkey, const char *crlurl,
+                    unsigned char *digest)
+{
+	unsigned char *buf, *p;
+	int crtsz, keysz;
+	size_t urlsz, sz;
+	unsigned int digestsz = SSL_X509_FPRSZ;
+	int rv;
+
+	crtsz = i2d_X509(cacrt, NULL);
+	keysz = i2d_PUBKEY(leafkey, NULL);
+	if (crtsz <= 0 || keysz <= 0)
+		return -1;
+	urlsz = crlurl ? strlen(crlurl) : 0;
+	sz = crtsz + keysz + urlsz;
+	if (!(buf = malloc(sz)))
+		return -1;
+	p = buf;
+	i2d_X509(cacrt, &p);
+	i2d_PUBKEY(leafkey, &p);
+	if (urlsz)
+		memcpy(p, crlurl, urlsz);
+	rv = EVP_Digest(buf, sz, digest, &digestsz, ssl_md(SSL_MD_SHA1),
+	                NULL) ? 0 : -1;
+	free(buf);
+	return rv;
+}
+
+/*
+ * Discard all contents and write a fresh header.
+ * Returns -1 on error, 0 on success.
+ */
+static int
+certstore_reset(certstore_t *store, const unsigned char *digest)
+{
+	unsigned char hdr[CERTSTORE_HDRSZ];
+
+	if (ftruncate(store->fd, 0) == -1)
+		return -1;
+	memcpy(hdr, CERTSTORE_MAGIC, CERTSTORE_MAGICSZ);
+	memcpy(hdr + CERTSTORE_MAGICSZ, digest, SSL_X509_FPRSZ);
+	if (write(store->fd, hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr))
+		return -1;
+	store->size = CERTSTORE_HDRSZ;
+	return 0;
+}
+
+/*
+ * Index the records in the mapped file.
+ * Returns the offset after the last complete record, or -1 on error.
+ */
+static off_t
+certstore_scan(certstore_t *store, size_t sz)
+{
+	certstore_fpr_t key;
+	size_t off, len;
+	khiter_t it;
+	int ret;
+
+	off = CERTSTORE_HDRSZ;
+	while (off + CERTSTORE_RECHDRSZ <= sz) {
+		const unsigned char *p = store->map + off + SSL_X509_FPRSZ;
+
+		len = ((size_t)p[0] << 24) | ((size_t)p[1] << 16) |
+		      ((size_t)p[2] << 8) | (size_t)p[3];
+		if (len == 0 || len > CERTSTORE_MAXDERSZ ||
+		    off + CERTSTORE_RECHDRSZ + len > sz)
+			break;
+		memcpy(key.fpr, store->map + off, SSL_X509_FPRSZ);
+		it = kh_put(fproffmap_t, store->index, key, &ret);
+		if (ret == -1)
+			return -1;
+		kh_val(store->index, it) = off;
+		off += CERTSTORE_RECHDRSZ + len;
+	}
+	return off;
+}
+
+/*
+ * Open or create the certificate store at path for forging with the given
+ * CA certificate, leaf key and CRL URL.  Must be called before dropping
+ * privileges and before spawning any threads.
+ * Returns NULL on error.
+ */
+certstore_t *
+certstore_open(const char *path, X509 *cacrt, EVP_PKEY *leafkey,
+               const char *crlurl)
+{
+	certstore_t *store;
+	unsigned char digest[SSL_X509_FPRSZ];
+	struct stat st;
+	off_t off;
+
+	if (certstore_cfgdigest(cacrt, leafkey, crlurl, digest) == -1)
+		return NULL;
+	if (!(store = calloc(1, sizeof(certstore_t))))
+		return NULL;
+	if (!(store->index = kh_init(fproffmap_t)))
+		goto out3;
+	if (pthread_mutex_init(&store->mutex, NULL))
+		goto out2;
+	store->fd = open(path, O_RDWR|O_CREAT|O_APPEND, 0600);
+	if (store->fd == -1) {
+		log_err_printf("Failed to open cert store '%s': %s (%i)\n",
+		               path, strerror(errno), errno);
+		goto out1;
+	}
+	if (fstat(store->fd, &st) == -1)
+		goto out0;
+
+	if (st.st_size >= (off_t)CERTSTORE_HDRSZ) {
+		store->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+		                  store->fd, 0);
+		if (store->map == MAP_FAILED) {
+			store->map = NULL;
+			goto out0;
+		}
+		store->maplen = store->mapsz = st.st_size;
+		if (memcmp(store->map, CERTSTORE_MAGIC, CERTSTORE_MAGICSZ) ||
+		    memcmp(store->map + CERTSTORE_MAGICSZ, digest,
+		           SSL_X509_FPRSZ)) {
+			log_dbg_printf("Cert store '%s' does not match CA and "
+			               "leaf key, starting over\n", path);
+			munmap(store->map, store->maplen);
+			store->map = NULL;
+			store->maplen = store->mapsz = 0;
+		}
+	}
+
+	if (!store->map) {
+		if (certstore_reset(store, digest) == -1)
+			goto out0;
+		return store;
+	}
+
+	if ((off = certstore_scan(store, store->mapsz)) == -1)
+		goto out0;
+	if (off < st.st_size) {
+		log_dbg_printf("Cert store '%s' has a truncated record at "
+		               "offset %lld, discarding tail\n",
+		               path, (long long)off);
+		if (ftruncate(store->fd, off) == -1)
+			goto out0;
+	}
+	store->mapsz = off;
+	store->size = off;
+	return store;
+
+out0:
+	if (store->map)
+		munmap(store->map, store->maplen);
+	close(store->fd);
+out1:
+	pthread_mutex_destroy(&store->mutex);
+out2:
+	kh_destroy(fproffmap_t, store->index);
+out3:
+	free(store);
+	return NULL;
+}
+
+/*
+ * Close the store and free all associated resources.
+ */
+void
+certstore_close(certstore_t *store)
+{
+	if (store->map)
+		munmap(store->map, store->maplen);
+	close(store->fd);
+	pthread_mutex_destroy(&store->mutex);
+	kh_destroy(fproffmap_t, store->index);
+	free(store);
+}
+
+/*
+ * Look up the forged certificate for original server certificate origcrt.
+ * Returns a new reference to a valid certificate, or NULL if the store does
+ * not contain a valid certificate for origcrt.
+ */
+X509 *
+certstore_get(certstore_t *store, X509 *origcrt)
+{
+	certstore_fpr_t key;
+	unsigned char rechdr[CERTSTORE_RECHDRSZ];
+	unsigned char *buf = NULL;
+	const unsigned char *p;
+	size_t len;
+	off_t off;
+	khiter_t it;
+	X509 *crt;
+
+	if (ssl_x509_fingerprint_sha1(origcrt, key.fpr) == -1)
+		return NULL;
+
+	pthread_mutex_lock(&store->mutex);
+	it = kh_get(fproffmap_t, store->index, key);
+	off = (it != kh_end(store->index)) ? kh_val(store->index, it) : -1;
+	pthread_mutex_unlock(&store->mutex);
+	if (off == -1)
+		return NULL;
+
+	if ((size_t)off < store->mapsz) {
+		p = store->map + off + SSL_X509_FPRSZ;
+	} else {
+		if (pread(store->fd, rechdr, sizeof(rechdr), off) !=
+		    (ssize_t)sizeof(rechdr))
+			return NULL;
+		p = rechdr + SSL_X509_FPRSZ;
+	}
+	len = ((size_t)p[0] << 24) | ((size_t)p[1] << 16) |
+	      ((size_t)p[2] << 8) | (size_t)p[3];
+	if ((size_t)off < store->mapsz) {
+		p += 4;
+	} else {
+		if (!(buf = malloc(len)))
+			return NULL;
+		if (pread(store->fd, buf, len, off + CERTSTORE_RECHDRSZ) !=
+		    (ssize_t)len) {
+			free(buf);
+			return NULL;
+		}
+		p = buf;
+	}
+	crt = d2i_X509(NULL, &p, len);
+	if (buf)
+		free(buf);
+	if (crt && !ssl_x509_is_valid(crt)) {
+		X509_free(crt);
+		return NULL;
+	}
+	return crt;
+}
+
+/*
+ * Append forged certificate fkcrt for original server certificate origcrt.
+ * Returns -1 on error, 0 on success.
+ */
+int
+certstore_put(certstore_t *store, X509 *origcrt, X509 *fkcrt)
+{
+	certstore_fpr_t key;
+	unsigned char *buf, *p;
+	size_t sz;
+	ssize_t n;
+	khiter_t it;
+	int len, ret, rv = -1;
+
+	if (ssl_x509_fingerprint_sha1(origcrt, key.fpr) == -1)
+		return -1;
+	len = i2d_X509(fkcrt, NULL);
+	if (len <= 0 || len > CERTSTORE_MAXDERSZ)
+		return -1;
+	sz = CERTSTORE_RECHDRSZ + len;
+	if (!(buf = malloc(sz)))
+		return -1;
+	memcpy(buf, key.fpr, SSL_X509_FPRSZ);
+	buf[SSL_X509_FPRSZ + 0] = (len >> 24) & 0xff;
+	buf[SSL_X509_FPRSZ + 1] = (len >> 16) & 0xff;
+	buf[SSL_X509_FPRSZ + 2] = (len >> 8) & 0xff;
+	buf[SSL_X509_FPRSZ + 3] = len & 0xff;
+	p = buf + CERTSTORE_RECHDRSZ;
+	i2d_X509(fkcrt, &p);
+
+	pthread_mutex_lock(&store->mutex);
+	n = write(store->fd, buf, sz);
+	if (n != (ssize_t)sz) {
+		/* cut off partial record so the next append stays aligned */
+		if (n > 0 && ftruncate(store->fd, store->size) == -1) {
+			log_err_printf("Failed to truncate cert store: "
+			               "%s (%i)\n", strerror(errno), errno);
+		}
+		goto out;
+	}
+	it = kh_put(fproffmap_t, store->index, key, &ret);
+	if (ret != -1) {
+		kh_val(store->index, it) = store->size;
+		rv = 0;
+	}
+	store->size += sz;
+out:
+	pthread_mutex_unlock(&store->mutex);
+	free(buf);
+	return rv;
+}
+
+/*
+ * Returns the number of distinct certificates in the store.
+ */
+size_t
+certstore_entries(certstore_t *store)
+{
+	size_t n;
+
+	pthread_mutex_lock(&store->mutex);
+	n = kh_size(store->index);
+	pthread_mutex_unlock(&store->mutex);
+	return n;
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,196 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ssl.h"
+#include "certstore.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <check.h>
+
+#define CACERT "extra/pki/rsa.crt"
+#define CAKEY "extra/pki/rsa.key"
+#define TESTCERT "extra/pki/server.crt"
+#define TESTKEY "extra/pki/server.key"
+
+static char template[] = "/tmp/sslsplit.test.XXXXXX";
+static char *basedir;
+static char *storefile;
+static X509 *cacrt, *origcrt, *fkcrt;
+static EVP_PKEY *cakey, *leafkey;
+
+static void
+certstore_setup(void)
+{
+	if (ssl_init() == -1)
+		exit(EXIT_FAILURE);
+	basedir = strdup(template);
+	if (!mkdtemp(basedir)) {
+		perror("mkdtemp");
+		exit(EXIT_FAILURE);
+	}
+	if (asprintf(&storefile, "%s/fkcrt.db", basedir) == -1) {
+		perror("asprintf");
+		exit(EXIT_FAILURE);
+	}
+	cacrt = ssl_x509_load(CACERT);
+	cakey = ssl_key_load(CAKEY);
+	origcrt = ssl_x509_load(TESTCERT);
+	leafkey = ssl_key_load(TESTKEY);
+	if (!cacrt || !cakey || !origcrt || !leafkey)
+		exit(EXIT_FAILURE);
+	fkcrt = ssl_x509_forge(cacrt, cakey, origcrt, leafkey, NULL, NULL);
+	if (!fkcrt)
+		exit(EXIT_FAILURE);
+}
+
+static void
+certstore_teardown(void)
+{
+	X509_free(fkcrt);
+	EVP_PKEY_free(leafkey);
+	X509_free(origcrt);
+	EVP_PKEY_free(cakey);
+	X509_free(cacrt);
+	unlink(storefile);
+	rmdir(basedir);
+	free(storefile);
+	free(basedir);
+	ssl_fini();
+}
+
+START_TEST(certstore_01)
+{
+	certstore_t *store;
+	X509 *crt;
+
+	store = certstore_open(storefile, cacrt, leafkey, NULL);
+	fail_unless(!!store, "open failed");
+	fail_unless(certstore_entries(store) == 0, "new store not empty");
+	crt = certstore_get(store, origcrt);
+	fail_unless(crt == NULL, "certificate found in empty store");
+	fail_unless(certstore_put(store, origcrt, fkcrt) == 0, "put failed");
+	crt = certstore_get(store, origcrt);
+	fail_unless(!!crt, "certificate not found");
+	fail_unless(X509_cmp(crt, fkcrt) == 0, "certificate differs");
+	X509_free(crt);
+	crt = certstore_get(store, fkcrt);
+	fail_unless(crt == NULL, "certificate found for wrong key");
+	certstore_close(store);
+}
+END_TEST
+
+START_TEST(certstore_02)
+{
+	certstore_t *store;
+	X509 *crt;
+
+	store = certstore_open(storefile, cacrt, leafkey, NULL);
+	fail_unless(!!store, "open failed");
+	fail_unless(certstore_put(store, origcrt, fkcrt) == 0, "put failed");
+	certstore_close(store);
+
+	store = certstore_open(storefile, cacrt, leafkey, NULL);
+	fail_unless(!!store, "reopen failed");
+	fail_unless(certstore_entries(store) == 1, "entry not loaded");
+	crt = certstore_get(store, origcrt);
+	fail_unless(!!crt, "certificate not found after reopen");
+	fail_unless(X509_cmp(crt, fkcrt) == 0, "certificate differs");
+	X509_free(crt);
+	certstore_close(store);
+}
+END_TEST
+
+START_TEST(certstore_03)
+{
+	certstore_t *store;
+
+	store = certstore_open(storefile, cacrt, leafkey, NULL);
+	fail_unless(!!store, "open failed");
+	fail_unless(certstore_put(store, origcrt, fkcrt) == 0, "put failed");
+	certstore_close(store);
+
+	store = certstore_open(storefile, cacrt, leafkey, "http://x/ca.crl");
+	fail_unless(!!store, "reopen failed");
+	fail_unless(certstore_entries(store) == 0, "mismatching store used");
+	certstore_close(store);
+}
+END_TEST
+
+START_TEST(certstore_04)
+{
+	certstore_t *store;
+	struct stat st;
+	X509 *crt;
+
+	store = certstore_open(storefile, cacrt, leafkey, NULL);
+	fail_unless(!!store, "open failed");
+	fail_unless(certstore_put(store, origcrt, fkcrt) == 0, "put failed");
+	fail_unless(certstore_put(store, fkcrt, fkcrt) == 0, "put failed");
+	certstore_close(store);
+	fail_unless(stat(storefile, &st) == 0, "stat failed");
+	fail_unless(truncate(storefile, st.st_size - 1) == 0, "trunc failed");
+
+	store = certstore_open(storefile, cacrt, leafkey, NULL);
+	fail_unless(!!store, "reopen failed");
+	fail_unless(certstore_entries(store) == 1, "truncated entry used");
+	fail_unless(certstore_put(store, fkcrt, fkcrt) == 0, "put failed");
+	crt = certstore_get(store, fkcrt);
+	fail_unless(!!crt, "appended certificate not found");
+	X509_free(crt);
+	crt = certstore_get(store, origcrt);
+	fail_unless(!!crt, "mapped certificate not found");
+	X509_free(crt);
+	certstore_close(store);
+}
+END_TEST
+
+Suite *
+certstore_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("certstore");
+
+	tc = tcase_create("certstore");
+	tcase_add_checked_fixture(tc, certstore_setup, certstore_teardown);
+	tcase_add_test(tc, certstore_01);
+	tcase_add_test(tc, certstore_02);
+	tcase_add_test(tc, certstore_03);
+	tcase_add_test(tc, certstore_04);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
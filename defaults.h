@@ -92,6 +92,125 @@
  */
 #define DFLT_LEAFKEY_RSABITS 2048
 
+/*
+ * Default number of certificate forging threads.  Forging is only needed on
+ * forged certificate cache misses, so a small number of threads suffices to
+ * keep signature operations off the connection handling threads.
+ */
+#define DFLT_FORGE_THREADS 2
+
+/*
+ * Default session ticket key rotation interval in seconds.  Tickets issued
+ * with a key remain valid for resumption for up to SSLTICKET_MAXKEYS - 1
+ * further intervals.
+ */
+#define DFLT_TICKET_ROTATE 3600
+
+/*
+ * Default time in seconds for which destinations that failed interception
+ * are passed through without another attempt, if passthrough is enabled.
+ */
+#define DFLT_PASS_TTL 300
+
+/*
+ * Default directory for log overflow files of logs with overflow policy
+ * spill.  The files are unlinked immediately after creation.
+ */
+#define DFLT_SPILLDIR "/tmp"
+
+/*
+ * Default memory budget in bytes of log data queued per content logger.
+ * Connections are throttled while a content logger exceeds its budget.
+ */
+#define DFLT_LOG_MEMBUDGET (32*1024*1024)
+
+/*
+ * Default memory budget in bytes for the sum of the output buffer limits of
+ * all connections.  Limits shrink while the sum exceeds the budget.
+ */
+#define DFLT_OUTBUF_MEMBUDGET (512*1024*1024)
+
+/*
+ * Default size in bytes of the forged certificate and session caches shared
+ * between multiple worker processes.
+ */
+#define DFLT_SHCACHE_SIZE (64*1024*1024)
+
+/*
+ * Default timeout in milliseconds for each network operation on the remote
+ * cache servers.
+ */
+#define DFLT_RCACHE_TIMEOUT 50
+
+/*
+ * Default size in bytes at which the segment files of a segmented content
+ * log are rotated.
+ */
+#define DFLT_CONTENTLOG_SEGSZ (256*1024*1024)
+
+/*
+ * Default size in bytes of the largest HTTP response, including headers,
+ * stored in the HTTP response cache.
+ */
+#define DFLT_HTTP_CACHE_MAXOBJ (1024*1024)
+
+/*
+ * Default size in bytes of the data area of the shared memory content tap.
+ */
+#define DFLT_CONTENTTAP_SZ (64*1024*1024)
+
+/*
+ * Default maximum size in bytes of the frames buffered for the content
+ * stream collector.
+ */
+#define DFLT_CONTENTSTREAM_SZ (16*1024*1024)
+
+/*
+ * Default maximum size in bytes of content retained by the flight recorder
+ * per connection handling thread.
+ */
+#define DFLT_CONTENTLOG_REC_TOTAL (16*1024*1024)
+
+/*
+ * Default interval in seconds between health checks of mirror targets.
+ */
+#define DFLT_MIRROR_CHK_INTERVAL 10
+
+/*
+ * Default maximum time in milliseconds that data written to a compressed log
+ * stays buffered in the compressor before it is written out.
+ */
+#define DFLT_LOG_FLUSH_INTERVAL 1000
+
+/*
+ * Default connection timeouts in seconds: connecting to the server, the client
+ * side handshake, receiving the first HTTP request header, inactivity of an
+ * established connection, and receiving the complete ClientHello, which is
+ * buffered per connection.  0 disables the timeout.
+ */
+#define DFLT_CONNECT_TIMEOUT 30
+#define DFLT_HANDSHAKE_TIMEOUT 30
+#define DFLT_HEADER_TIMEOUT 60
+#define DFLT_IDLE_TIMEOUT 0
+#define DFLT_HELLO_TIMEOUT 10
+
+/*
+ * Default inactivity in seconds after which an established connection frees
+ * its TLS record buffers and the per-connection state no longer needed for
+ * forwarding.  0 disables compacting idle connections.
+ */
+#define DFLT_DORMANT_TIMEOUT 0
+
+/*
+ * Maximum connection timeout in seconds.
+ */
+#define MAX_TIMEOUT 86400
+
+/*
+ * Maximum number of writer threads per per-connection content log.
+ */
+#define MAX_CONTENT_LOG_THREADS 64
+
 #endif /* !DEFAULTS_H */
 
 /* vim: set noet ft=c: */
@@ -0,0 +1,489 @@
+#!/usr/bin/env python3
+# vim: set ft=python list et ts=8 sts=4 sw=4:
+
+# SSLsplit contributed code:  End-to-end load generator and benchmark.
+# This script starts a local TLS origin server and an sslsplit instance
+# proxying to it, drives a number of workloads through sslsplit and reports
+# connections per second, handshake latency percentiles, throughput and the
+# resident set size of sslsplit.  Each workload can be run with content
+# logging off or writing to a file, to PCAP or to a mirror interface, in
+# order to measure the cost of a feature before enabling it.
+#
+# The origin server and the load generating clients are Python processes
+# running on the same host, so absolute numbers are bounded by what these
+# achieve; use the numbers to compare modes and releases, not hosts.
+#
+# Example:
+#   sslsplit-bench.py -s ./sslsplit -w handshake,bulk -m off,file,pcap
+
+# Copyright (C) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS''
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+# LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+# CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+# SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+# INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+# CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+# ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+# POSSIBILITY OF SUCH DAMAGE.
+
+import argparse
+import http.server
+import json
+import multiprocessing
+import os
+import shutil
+import signal
+import socket
+import socketserver
+import ssl
+import subprocess
+import sys
+import tempfile
+import time
+
+PKIDIR = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                      os.pardir, 'pki')
+CACRT = os.path.join(PKIDIR, 'rsa.crt')
+CAKEY = os.path.join(PKIDIR, 'rsa.key')
+SERVERPEM = os.path.join(PKIDIR, 'server.pem')
+
+WORKLOADS = ('handshake', 'resume', 'bulk', 'idle', 'keepalive')
+MODES = ('off', 'file', 'pcap', 'mirror')
+CHUNK = 65536
+
+
+class OriginHandler(http.server.BaseHTTPRequestHandler):
+    """
+    GET /          small response
+    GET /bulk/<n>  response of n octets
+    """
+    protocol_version = 'HTTP/1.1'
+    disable_nagle_algorithm = True
+
+    def log_message(self, *args):
+        pass
+
+    def do_GET(self):
+        if self.path.startswith('/bulk/'):
+            size = int(self.path[6:])
+        else:
+            size = 64
+        self.send_response(200)
+        self.send_header('Content-Type', 'application/octet-stream')
+        self.send_header('Content-Length', str(size))
+        self.end_headers()
+        chunk = b'x' * CHUNK
+        while size > 0:
+            self.wfile.write(chunk[:min(size, CHUNK)])
+            size -= CHUNK
+
+
+class OriginServer(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+    request_queue_size = 1024
+
+    def server_bind(self):
+        if hasattr(socket, 'SO_REUSEPORT'):
+            self.socket.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEPORT, 1)
+        http.server.HTTPServer.server_bind(self)
+
+
+def origin_main(port):
+    signal.signal(signal.SIGINT, signal.SIG_IGN)
+    ctx = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+    ctx.load_cert_chain(SERVERPEM)
+    srv = OriginServer(('127.0.0.1', port), OriginHandler)
+    srv.socket = ctx.wrap_socket(srv.socket, server_side=True)
+    srv.serve_forever()
+
+
+def free_port():
+    s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    s.bind(('127.0.0.1', 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def wait_port(port, timeout=15.0):
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        try:
+            socket.create_connection(('127.0.0.1', port), 0.5).close()
+            return True
+        except OSError:
+            time.sleep(0.1)
+    return False
+
+
+def pids_tree(pid):
+    """
+    Return pid and its descendants, which includes the privsep child
+    handling the connections.
+    """
+    pids = [pid]
+    try:
+        out = subprocess.run(['ps', '-A', '-o', 'pid=,ppid='],
+                             capture_output=True, text=True).stdout
+    except OSError:
+        return pids
+    children = {}
+    for line in out.splitlines():
+        p, pp = line.split()
+        children.setdefault(int(pp), []).append(int(p))
+    i = 0
+    while i < len(pids):
+        pids.extend(children.get(pids[i], []))
+        i += 1
+    return pids
+
+
+def rss_kb(pid):
+    """
+    Total RSS of sslsplit in KiB.
+    """
+    total = 0
+    for p in pids_tree(pid):
+        try:
+            with open('/proc/%d/status' % p) as f:
+                for line in f:
+                    if line.startswith('VmRSS:'):
+                        total += int(line.split()[1])
+            continue
+        except OSError:
+            pass
+        out = subprocess.run(['ps', '-o', 'rss=', '-p', str(p)],
+                             capture_output=True, text=True).stdout.strip()
+        if out:
+            total += int(out)
+    return total
+
+
+def client_ctx():
+    ctx = ssl.SSLContext(ssl.PROTOCOL_TLS_CLIENT)
+    ctx.check_hostname = False
+    ctx.verify_mode = ssl.CERT_NONE
+    return ctx
+
+
+def connect(ctx, port, session=None):
+    """
+    Connect and handshake, return the TLS socket and the handshake latency
+    in seconds, measured from connect() to the end of the handshake.
+    """
+    start = time.perf_counter()
+    raw = socket.create_connection(('127.0.0.1', port))
+    raw.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    s = ctx.wrap_socket(raw, server_hostname='daniel.roe.ch',
+                        session=session)
+    return s, time.perf_counter() - start
+
+
+def request(s, path, close):
+    """
+    Send a GET request and read the response, return the body size.
+    """
+    s.sendall(('GET %s HTTP/1.1\r\nHost: daniel.roe.ch\r\n'
+               'Connection: %s\r\n\r\n' %
+               (path, 'close' if close else 'keep-alive')).encode())
+    f = s.makefile('rb')
+    length = None
+    while True:
+        line = f.readline()
+        if not line:
+            raise OSError('connection closed in response header')
+        if line in (b'\r\n', b'\n'):
+            break
+        if line.lower().startswith(b'content-length:'):
+            length = int(line.split(b':', 1)[1])
+    if length is None:
+        raise OSError('response without Content-Length')
+    got = 0
+    while got < length:
+        data = f.read(min(CHUNK, length - got))
+        if not data:
+            raise OSError('connection closed in response body')
+        got += len(data)
+    f.close()
+    return got
+
+
+def worker(args):
+    """
+    Run one workload in a client process until the deadline.  Returns a
+    dict with counters and the handshake latencies.
+    """
+    workload, port, deadline, bulksize = args
+    signal.signal(signal.SIGINT, signal.SIG_IGN)
+    ctx = client_ctx()
+    res = {'conns': 0, 'reqs': 0, 'bytes': 0, 'errors': 0,
+           'resumed': 0, 'latency': []}
+    session = None
+    s = None
+    while time.time() < deadline:
+        try:
+            if workload in ('handshake', 'resume'):
+                s, lat = connect(ctx, port,
+                                 session if workload == 'resume' else None)
+                res['latency'].append(lat)
+                res['conns'] += 1
+                if s.session_reused:
+                    res['resumed'] += 1
+                res['bytes'] += request(s, '/', True)
+                res['reqs'] += 1
+                if workload == 'resume':
+                    session = s.session
+                s.close()
+                s = None
+            elif workload == 'bulk':
+                s, lat = connect(ctx, port)
+                res['latency'].append(lat)
+                res['conns'] += 1
+                res['bytes'] += request(s, '/bulk/%d' % bulksize, True)
+                res['reqs'] += 1
+                s.close()
+                s = None
+            elif workload == 'keepalive':
+                if not s:
+                    s, lat = connect(ctx, port)
+                    res['latency'].append(lat)
+                    res['conns'] += 1
+                res['bytes'] += request(s, '/', False)
+                res['reqs'] += 1
+        except (OSError, ssl.SSLError):
+            res['errors'] += 1
+            if s:
+                s.close()
+                s = None
+            session = None
+    if s:
+        s.close()
+    return res
+
+
+def idle(port, nconns, hold, sslsplit_pid):
+    """
+    Open nconns connections, keep them idle for hold seconds and measure
+    the RSS of sslsplit while they are open.
+    """
+    ctx = client_ctx()
+    res = {'conns': 0, 'reqs': 0, 'bytes': 0, 'errors': 0,
+           'resumed': 0, 'latency': []}
+    socks = []
+    for i in range(nconns):
+        try:
+            s, lat = connect(ctx, port)
+            res['bytes'] += request(s, '/', False)
+            res['reqs'] += 1
+            res['latency'].append(lat)
+            res['conns'] += 1
+            socks.append(s)
+        except (OSError, ssl.SSLError):
+            res['errors'] += 1
+    time.sleep(hold)
+    res['rss'] = rss_kb(sslsplit_pid)
+    for s in socks:
+        s.close()
+    return res
+
+
+def percentile(values, p):
+    if not values:
+        return float('nan')
+    values = sorted(values)
+    k = min(len(values) - 1, int(p / 100.0 * len(values)))
+    return values[k]
+
+
+def start_sslsplit(opts, mode, workdir, port, originport):
+    argv = [opts.sslsplit, '-k', CAKEY, '-c', CACRT]
+    if mode == 'file':
+        argv += ['-L', os.path.join(workdir, 'content.log')]
+    elif mode == 'pcap':
+        argv += ['-X', os.path.join(workdir, 'content.pcap')]
+    elif mode == 'mirror':
+        argv += ['-I', opts.mirror_if, '-T', opts.mirror_target]
+    if opts.keepalive_opt:
+        argv += ['-o', 'HTTPKeepAlive=yes']
+    argv += opts.sslsplit_arg
+    argv += ['https', '127.0.0.1', str(port), '127.0.0.1', str(originport)]
+    log = open(os.path.join(workdir, 'sslsplit-%s.log' % mode), 'w')
+    proc = subprocess.Popen(argv, stdout=log, stderr=subprocess.STDOUT)
+    log.close()
+    if not wait_port(port) or proc.poll() is not None:
+        proc.kill()
+        proc.wait()
+        return None
+    return proc
+
+
+def run(opts, workload, mode, originport, workdir):
+    port = free_port()
+    proc = start_sslsplit(opts, mode, workdir, port, originport)
+    if not proc:
+        return {'workload': workload, 'mode': mode,
+                'error': 'sslsplit failed to start, see %s' %
+                         os.path.join(workdir, 'sslsplit-%s.log' % mode)}
+    rss0 = rss_kb(proc.pid)
+    start = time.time()
+    if workload == 'idle':
+        results = [idle(port, opts.idle, opts.duration, proc.pid)]
+        rssmax = results[0]['rss']
+    else:
+        deadline = start + opts.duration
+        nclients = max(1, opts.clients)
+        with multiprocessing.Pool(nclients) as pool:
+            async_res = pool.map_async(worker,
+                                       [(workload, port, deadline,
+                                         opts.bulk_size)] * nclients)
+            rssmax = rss0
+            while not async_res.ready():
+                async_res.wait(0.25)
+                rssmax = max(rssmax, rss_kb(proc.pid))
+            results = async_res.get()
+    elapsed = time.time() - start
+    proc.send_signal(signal.SIGTERM)
+    try:
+        proc.wait(10)
+    except subprocess.TimeoutExpired:
+        proc.kill()
+        proc.wait()
+
+    latency = []
+    total = {'conns': 0, 'reqs': 0, 'bytes': 0, 'errors': 0, 'resumed': 0}
+    for r in results:
+        latency.extend(r['latency'])
+        for k in total:
+            total[k] += r[k]
+    return {
+        'workload': workload,
+        'mode': mode,
+        'seconds': round(elapsed, 3),
+        'conns': total['conns'],
+        'conns_per_sec': round(total['conns'] / elapsed, 1),
+        'reqs_per_sec': round(total['reqs'] / elapsed, 1),
+        'resumed': total['resumed'],
+        'errors': total['errors'],
+        'handshake_p50_ms': round(percentile(latency, 50) * 1000, 3),
+        'handshake_p99_ms': round(percentile(latency, 99) * 1000, 3),
+        'gbit_per_sec': round(total['bytes'] * 8 / elapsed / 1e9, 3),
+        'rss_start_kb': rss0,
+        'rss_max_kb': rssmax,
+    }
+
+
+def print_table(rows):
+    cols = ('workload', 'mode', 'conns_per_sec', 'reqs_per_sec',
+            'handshake_p50_ms', 'handshake_p99_ms', 'gbit_per_sec',
+            'rss_max_kb', 'resumed', 'errors')
+    head = ('workload', 'mode', 'conn/s', 'req/s', 'p50 ms', 'p99 ms',
+            'Gbit/s', 'RSS KiB', 'resumed', 'errors')
+    print(('%-10s %-7s' + ' %10s' * (len(cols) - 2)) % head)
+    for r in rows:
+        if 'error' in r:
+            print('%-10s %-7s %s' % (r['workload'], r['mode'], r['error']))
+            continue
+        print(('%-10s %-7s' + ' %10s' * (len(cols) - 2)) %
+              tuple(r[c] for c in cols))
+
+
+def main():
+    p = argparse.ArgumentParser(
+        description='End-to-end load generator and benchmark for sslsplit')
+    p.add_argument('-s', '--sslsplit', default='./sslsplit',
+                   help='sslsplit binary (default: ./sslsplit)')
+    p.add_argument('-w', '--workloads', default=','.join(WORKLOADS),
+                   help='comma separated workloads out of %s '
+                        '(default: all)' % ', '.join(WORKLOADS))
+    p.add_argument('-m', '--modes', default='off',
+                   help='comma separated content logging modes out of %s '
+                        '(default: off)' % ', '.join(MODES))
+    p.add_argument('-d', '--duration', type=float, default=10.0,
+                   help='seconds per run (default: 10)')
+    p.add_argument('-c', '--clients', type=int,
+                   default=multiprocessing.cpu_count(),
+                   help='client processes (default: number of CPUs)')
+    p.add_argument('-n', '--idle', type=int, default=1000,
+                   help='connections for the idle workload (default: 1000)')
+    p.add_argument('-b', '--bulk-size', type=int, default=64 * 1024 * 1024,
+                   help='response size for the bulk workload '
+                        '(default: 64 MiB)')
+    p.add_argument('--origin-procs', type=int, default=2,
+                   help='origin server processes (default: 2)')
+    p.add_argument('--mirror-if', default='lo',
+                   help='interface for mirror mode (default: lo)')
+    p.add_argument('--mirror-target', default='127.0.0.2',
+                   help='target address for mirror mode '
+                        '(default: 127.0.0.2)')
+    p.add_argument('-a', '--sslsplit-arg', action='append', default=[],
+                   help='additional sslsplit argument, may be repeated')
+    p.add_argument('-j', '--json', action='store_true',
+                   help='print results as JSON instead of a table')
+    p.add_argument('-k', '--keep', action='store_true',
+                   help='keep the working directory with logs')
+    opts = p.parse_args()
+
+    workloads = opts.workloads.split(',')
+    modes = opts.modes.split(',')
+    for w in workloads:
+        if w not in WORKLOADS:
+            p.error('unknown workload %s' % w)
+    for m in modes:
+        if m not in MODES:
+            p.error('unknown mode %s' % m)
+    for f in (opts.sslsplit, CACRT, CAKEY, SERVERPEM):
+        if not os.path.exists(f):
+            p.error('%s not found; run make and make -C extra/pki testreqs'
+                    % f)
+
+    originport = free_port()
+    origins = [multiprocessing.Process(target=origin_main,
+                                       args=(originport,), daemon=True)
+               for i in range(max(1, opts.origin_procs))]
+    for o in origins:
+        o.start()
+    if not wait_port(originport):
+        print('origin server failed to start', file=sys.stderr)
+        sys.exit(1)
+
+    workdir = tempfile.mkdtemp(prefix='sslsplit-bench-')
+    rows = []
+    try:
+        for w in workloads:
+            for m in modes:
+                print('running %s with content logging %s' % (w, m),
+                      file=sys.stderr)
+                opts.keepalive_opt = (w == 'keepalive')
+                rows.append(run(opts, w, m, originport, workdir))
+    finally:
+        for o in origins:
+            o.terminate()
+        if opts.keep:
+            print('logs kept in %s' % workdir, file=sys.stderr)
+        else:
+            shutil.rmtree(workdir, ignore_errors=True)
+
+    if opts.json:
+        json.dump(rows, sys.stdout, indent=2)
+        print()
+    else:
+        print_table(rows)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,747 @@
+#!/usr/bin/env python3
+# vim: set ft=python list et ts=8 sts=4 sw=4:
+
+# SSLsplit contributed code:  Replay benchmark driven by connect logs.
+# This script reads an sslsplit connect log in text or JSON format, with
+# per-connection lines, rollup aggregates or both, and replays the recorded
+# connections against a local sslsplit instance in front of synthetic
+# origin servers: the same SNI values, in the same order and at the same
+# pace, optionally sped up, with the recorded octet counts.  While it runs,
+# it reports connection rates, handshake and connection latencies, and the
+# hit rates of the sslsplit caches as read from the stats socket.
+#
+# The origins present a self-signed certificate per SNI value, generated
+# with the openssl command line tool before the replay starts, such that
+# the forged certificate cache sees the SNI cardinality of the log.  Above
+# --max-certs distinct names, names share certificates by hash.  All
+# destination addresses map to the origins, so only caches keyed by name
+# see the recorded destination mix.  Connections that resumed a client
+# session in the log (ConnectLogTimings or JSON format) resume the last
+# session for their SNI, if any.  Octet counts are taken from the log where
+# present; per-connection lines only have the octets up to the time they
+# were logged, rollup lines have the totals.  Failed connections in rollup
+# lines are not replayed.
+#
+# With -A, the log is written out anonymised instead, as JSON lines that
+# this script reads back: names and addresses are replaced by keyed hashes,
+# preserving which connections share them, and all other fields except
+# timing, kind, port, octets and cache hits are dropped.
+#
+# Example:
+#   sslsplit-replay.py -A trace.json -K secret connect.log
+#   sslsplit-replay.py -s ./sslsplit -x 10 trace.json
+
+# Copyright (C) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS''
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+# LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+# CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+# SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+# INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+# CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+# ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+# POSSIBILITY OF SUCH DAMAGE.
+
+import argparse
+import calendar
+import concurrent.futures
+import gzip
+import hashlib
+import hmac
+import json
+import multiprocessing
+import os
+import queue
+import shutil
+import signal
+import socket
+import socketserver
+import ssl
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import zlib
+
+PKIDIR = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                      os.pardir, 'pki')
+CACRT = os.path.join(PKIDIR, 'rsa.crt')
+CAKEY = os.path.join(PKIDIR, 'rsa.key')
+SERVERPEM = os.path.join(PKIDIR, 'server.pem')
+
+TLS_KINDS = ('ssl', 'https', 'upgrade', 'passthrough')
+TCP_KINDS = ('tcp', 'http')
+CACHES = ('fkcrt', 'sslctx', 'dsess', 'ssess', 'sni', 'vrfy')
+CHUNK = 65536
+
+
+class Conn(object):
+    """
+    One connection to replay.
+    """
+    __slots__ = ('ts', 'kind', 'sni', 'dst', 'dport', 'srcbytes',
+                 'dstbytes', 'resume')
+
+    def __init__(self, ts, kind, sni, dst, dport, srcbytes, dstbytes,
+                 resume):
+        self.ts = ts
+        self.kind = kind
+        self.sni = sni
+        self.dst = dst
+        self.dport = dport
+        self.srcbytes = srcbytes
+        self.dstbytes = dstbytes
+        self.resume = resume
+
+    def tls(self):
+        return self.kind in TLS_KINDS
+
+
+def dash(s):
+    return None if s in (None, '-') else s
+
+
+def parse_text(line):
+    """
+    Parse a text connect log line into a list of Conn, or None if the line
+    is not a connect log line.
+    """
+    tok = line.split()
+    if len(tok) < 8 or tok[2] != 'UTC':
+        return None
+    try:
+        ts = calendar.timegm(time.strptime(tok[0] + ' ' + tok[1],
+                                           '%Y-%m-%d %H:%M:%S'))
+    except ValueError:
+        return None
+    tok = tok[3:]
+    kv = {}
+    for t in tok:
+        k, sep, v = t.partition(':')
+        if sep and k in ('sni', 'bytes', 'cache', 'conns', 'period'):
+            kv[k] = v
+    srcbytes = dstbytes = 0
+    if 'bytes' in kv:
+        b = kv['bytes'].split(':')
+        if len(b) == 2 and b[0].isdigit() and b[1].isdigit():
+            srcbytes, dstbytes = int(b[0]), int(b[1])
+    if tok[0] == 'rollup':
+        if len(tok) < 6 or tok[5] != 'ok':
+            return []
+        return expand_rollup(ts, tok[1], dash(tok[2]), tok[3], tok[4],
+                             int(kv.get('conns', '1')),
+                             int(kv.get('period', '1')),
+                             srcbytes, dstbytes)
+    kind = tok[0]
+    if kind not in TLS_KINDS + TCP_KINDS:
+        return None
+    sni = dash(kv.get('sni'))
+    if kind in ('http', 'https') and not sni:
+        sni = dash(tok[5])
+    cache = kv.get('cache', '').split(':')
+    resume = len(cache) == 3 and cache[2] == 'hit'
+    return [Conn(ts, kind, sni, tok[3], tok[4], srcbytes, dstbytes,
+                 resume)]
+
+
+def parse_json(line):
+    """
+    Parse a JSON connect log line into a list of Conn, or None.
+    """
+    try:
+        obj = json.loads(line)
+    except ValueError:
+        return None
+    if not isinstance(obj, dict) or 'kind' not in obj or 'ts' not in obj:
+        return None
+    ts = obj['ts'] / 1000000.0
+    if obj['kind'] == 'rollup':
+        if obj.get('outcome') != 'ok':
+            return []
+        return expand_rollup(ts, obj.get('proto'), obj.get('name'),
+                             obj.get('dst'), str(obj.get('dport')),
+                             obj.get('conns') or 1, obj.get('period') or 1,
+                             obj.get('srcbytes') or 0,
+                             obj.get('dstbytes') or 0)
+    if obj['kind'] not in TLS_KINDS + TCP_KINDS:
+        return None
+    return [Conn(ts, obj['kind'], obj.get('sni') or obj.get('host'),
+                 obj.get('dst'), str(obj.get('dport')),
+                 obj.get('srcbytes') or 0, obj.get('dstbytes') or 0,
+                 obj.get('src_cache') == 'hit')]
+
+
+def expand_rollup(ts, kind, name, dst, dport, conns, period, srcbytes,
+                  dstbytes):
+    """
+    Spread the connections of a rollup aggregate evenly over the period
+    ending at ts, each with an equal share of the octets.
+    """
+    if kind not in TLS_KINDS + TCP_KINDS or conns < 1:
+        return []
+    step = float(period) / conns
+    return [Conn(ts - period + i * step, kind, name, dst, dport,
+                 srcbytes // conns, dstbytes // conns, False)
+            for i in range(conns)]
+
+
+def read_log(paths):
+    """
+    Read connect logs, return the connections sorted by time and the number
+    of lines that were not understood.  Text lines only have timestamps in
+    seconds; their connections are spread evenly over their second.
+    """
+    conns = []
+    seconds = {}
+    skipped = 0
+    for path in paths:
+        op = gzip.open if path.endswith('.gz') else open
+        with op(path, 'rt', errors='replace') as f:
+            for line in f:
+                line = line.strip()
+                if not line:
+                    continue
+                if line[0] == '{':
+                    res = parse_json(line)
+                else:
+                    res = parse_text(line)
+                    if res and len(res) == 1:
+                        seconds.setdefault(res[0].ts, []).append(res[0])
+                if res is None:
+                    skipped += 1
+                else:
+                    conns.extend(res)
+    for same in seconds.values():
+        for i, c in enumerate(same):
+            c.ts += float(i) / len(same)
+    conns.sort(key=lambda c: c.ts)
+    return conns, skipped
+
+
+def anonymise(conns, key, out):
+    """
+    Write conns as JSON lines with names and addresses replaced by keyed
+    hashes.
+    """
+    def h(s):
+        return hmac.new(key, s.encode(), hashlib.sha256).digest()
+
+    def name(s):
+        return None if not s else 'n%s.invalid' % h(s)[:6].hex()
+
+    def addr(s):
+        if not s:
+            return None
+        d = h(s)
+        if ':' in s:
+            return 'fd00::%x:%x' % (d[0] << 8 | d[1], d[2] << 8 | d[3])
+        return '10.%d.%d.%d' % (d[0], d[1], d[2])
+
+    with open(out, 'w') as f:
+        for c in conns:
+            json.dump({'v': 1, 'ts': int(c.ts * 1000000), 'kind': c.kind,
+                       'sni': name(c.sni), 'dst': addr(c.dst),
+                       'dport': int(c.dport) if c.dport.isdigit() else 0,
+                       'srcbytes': c.srcbytes, 'dstbytes': c.dstbytes,
+                       'src_cache': 'hit' if c.resume else None},
+                      f, separators=(',', ':'))
+            f.write('\n')
+
+
+def make_certs(names, maxcerts, workdir):
+    """
+    Generate a self-signed certificate per name, or per hash bucket above
+    maxcerts names.  Returns a dict mapping bucket to PEM path, or None if
+    openssl is not available.
+    """
+    openssl = shutil.which('openssl')
+    if not openssl:
+        return None
+    index = dict((n, i) for i, n in enumerate(names))
+    first = {}
+    for n in names:
+        first.setdefault(bucket(n, len(names), maxcerts, index), n)
+    pems = {}
+    for b, n in first.items():
+        pem = os.path.join(workdir, 'origin-%d.pem' % b)
+        subprocess.run([openssl, 'req', '-x509', '-newkey', 'ec',
+                        '-pkeyopt', 'ec_paramgen_curve:prime256v1',
+                        '-nodes', '-days', '30', '-subj', '/CN=' + n[:64],
+                        '-addext', 'subjectAltName=DNS:' + n,
+                        '-keyout', pem, '-out', pem + '.crt'],
+                       check=True, stdout=subprocess.DEVNULL,
+                       stderr=subprocess.DEVNULL)
+        with open(pem, 'a') as out, open(pem + '.crt') as crt:
+            out.write(crt.read())
+        pems[b] = pem
+    return pems
+
+
+def bucket(name, nnames, maxcerts, index):
+    if nnames <= maxcerts:
+        return index[name]
+    return zlib.crc32(name.encode()) % maxcerts
+
+
+class OriginHandler(socketserver.BaseRequestHandler):
+    """
+    Synthetic origin: reads a line "<srcbytes> <dstbytes>", then srcbytes
+    octets, writes dstbytes octets and waits for the client to close.
+    """
+    def handle(self):
+        s = self.request
+        try:
+            if self.server.tlsctx:
+                s = self.server.tlsctx.wrap_socket(s, server_side=True)
+            f = s.makefile('rb')
+            hdr = f.readline().split()
+            if len(hdr) != 2:
+                return
+            left = int(hdr[0])
+            while left > 0:
+                data = f.read(min(CHUNK, left))
+                if not data:
+                    return
+                left -= len(data)
+            left = int(hdr[1])
+            chunk = b'x' * CHUNK
+            while left > 0:
+                s.sendall(chunk[:min(CHUNK, left)])
+                left -= CHUNK
+            while s.recv(CHUNK):
+                pass
+        except (OSError, ValueError, ssl.SSLError):
+            pass
+        finally:
+            s.close()
+
+
+class OriginServer(socketserver.ThreadingMixIn, socketserver.TCPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+    request_queue_size = 1024
+
+    def server_bind(self):
+        if hasattr(socket, 'SO_REUSEPORT'):
+            self.socket.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEPORT, 1)
+        socketserver.TCPServer.server_bind(self)
+
+
+def origin_main(port, pems, buckets, nnames, maxcerts):
+    signal.signal(signal.SIGINT, signal.SIG_IGN)
+    srv = OriginServer(('127.0.0.1', port), OriginHandler)
+    srv.tlsctx = None
+    if pems is not False:
+        ctxs = {}
+        default = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+        default.load_cert_chain(SERVERPEM)
+        for b, pem in (pems or {}).items():
+            ctxs[b] = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+            ctxs[b].load_cert_chain(pem)
+
+        def sni_cb(sslsock, name, ctx):
+            if name in buckets:
+                c = ctxs.get(bucket(name, nnames, maxcerts, buckets))
+                if c:
+                    sslsock.context = c
+        default.sni_callback = sni_cb
+        srv.tlsctx = default
+    srv.serve_forever()
+
+
+def free_port():
+    s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    s.bind(('127.0.0.1', 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def wait_port(port, timeout=15.0):
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        try:
+            socket.create_connection(('127.0.0.1', port), 0.5).close()
+            return True
+        except OSError:
+            time.sleep(0.1)
+    return False
+
+
+def replay_one(c, port, tlsctx, sessions, lock, hold):
+    """
+    Replay one connection.  Returns (handshake latency, total latency) in
+    seconds and whether a session was resumed.
+    """
+    start = time.perf_counter()
+    raw = socket.create_connection(('127.0.0.1', port))
+    raw.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    s = raw
+    resumed = False
+    try:
+        if tlsctx:
+            sess = None
+            if c.resume and c.sni:
+                with lock:
+                    sess = sessions.get(c.sni)
+            s = tlsctx.wrap_socket(raw, server_hostname=c.sni,
+                                   session=sess)
+            resumed = s.session_reused
+        hs = time.perf_counter() - start
+        s.sendall(b'%d %d\n' % (c.srcbytes, c.dstbytes))
+        left = c.srcbytes
+        chunk = b'y' * CHUNK
+        while left > 0:
+            s.sendall(chunk[:min(CHUNK, left)])
+            left -= CHUNK
+        left = c.dstbytes
+        while left > 0:
+            data = s.recv(min(CHUNK, left))
+            if not data:
+                raise OSError('connection closed early')
+            left -= len(data)
+        if tlsctx and c.sni and s.session:
+            with lock:
+                sessions[c.sni] = s.session
+        if hold:
+            time.sleep(hold)
+    finally:
+        s.close()
+    return hs, time.perf_counter() - start, resumed
+
+
+def client_main(k, nprocs, conns, ports, t0, speed, threads, hold, resq):
+    """
+    Replay every nprocs-th connection starting at k, each on its own
+    thread once its time has come, and report results to resq.
+    """
+    signal.signal(signal.SIGINT, signal.SIG_IGN)
+    tlsctx = ssl.SSLContext(ssl.PROTOCOL_TLS_CLIENT)
+    tlsctx.check_hostname = False
+    tlsctx.verify_mode = ssl.CERT_NONE
+    sessions = {}
+    lock = threading.Lock()
+    ts0 = conns[0].ts if conns else 0
+
+    def run(c, due):
+        late = max(0.0, time.time() - due)
+        try:
+            hs, total, resumed = replay_one(
+                c, ports[c.tls()], tlsctx if c.tls() else None,
+                sessions, lock, hold)
+            resq.put((True, hs, total, late, resumed, c.tls(),
+                      c.srcbytes + c.dstbytes))
+        except (OSError, ssl.SSLError, ValueError):
+            resq.put((False, 0, 0, late, False, c.tls(), 0))
+
+    with concurrent.futures.ThreadPoolExecutor(threads) as pool:
+        for i in range(k, len(conns), nprocs):
+            c = conns[i]
+            due = t0 + (c.ts - ts0) / speed if speed > 0 else t0
+            wait = due - time.time()
+            if wait > 0:
+                time.sleep(wait)
+            pool.submit(run, c, due)
+    resq.put(None)
+
+
+def scrape(path):
+    """
+    Read the cache lookup counters from the stats socket; returns a dict
+    mapping (cache, result) to the count.
+    """
+    res = {}
+    if not path:
+        return res
+    try:
+        s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        s.settimeout(2.0)
+        s.connect(path)
+        s.shutdown(socket.SHUT_WR)
+        data = b''
+        while True:
+            d = s.recv(CHUNK)
+            if not d:
+                break
+            data += d
+        s.close()
+    except OSError:
+        return res
+    for line in data.decode(errors='replace').splitlines():
+        if not line.startswith('sslsplit_cache_lookups_total{'):
+            continue
+        labels, _, val = line.partition('} ')
+        lab = dict(kv.split('=', 1) for kv in
+                   labels.split('{', 1)[1].split(','))
+        res[(lab['cache'].strip('"'), lab['result'].strip('"'))] = \
+            int(val)
+    return res
+
+
+def hitrate(cur, prev, cache):
+    hit = cur.get((cache, 'hit'), 0) - prev.get((cache, 'hit'), 0)
+    miss = cur.get((cache, 'miss'), 0) - prev.get((cache, 'miss'), 0)
+    if hit + miss <= 0:
+        return None
+    return 100.0 * hit / (hit + miss)
+
+
+def percentile(values, p):
+    if not values:
+        return float('nan')
+    values = sorted(values)
+    k = min(len(values) - 1, int(p / 100.0 * len(values)))
+    return values[k]
+
+
+class Window(object):
+    def __init__(self):
+        self.conns = self.errors = self.resumed = self.octets = 0
+        self.hs = []
+        self.total = []
+        self.late = []
+
+    def add(self, r):
+        ok, hs, total, late, resumed, tls, octets = r
+        self.late.append(late)
+        if not ok:
+            self.errors += 1
+            return
+        self.conns += 1
+        self.octets += octets
+        self.resumed += resumed
+        if tls:
+            self.hs.append(hs)
+        self.total.append(total)
+
+    def row(self, elapsed, secs, cur, prev):
+        r = {
+            'elapsed': round(elapsed, 1),
+            'conns': self.conns,
+            'conns_per_sec': round(self.conns / secs, 1) if secs else 0,
+            'errors': self.errors,
+            'resumed': self.resumed,
+            'mbit_per_sec': round(self.octets * 8 / secs / 1e6, 3)
+                            if secs else 0,
+            'handshake_p50_ms': round(percentile(self.hs, 50) * 1000, 3),
+            'handshake_p99_ms': round(percentile(self.hs, 99) * 1000, 3),
+            'conn_p50_ms': round(percentile(self.total, 50) * 1000, 3),
+            'conn_p99_ms': round(percentile(self.total, 99) * 1000, 3),
+            'late_p99_ms': round(percentile(self.late, 99) * 1000, 3),
+        }
+        for cache in CACHES:
+            rate = hitrate(cur, prev, cache)
+            r['hit_' + cache] = round(rate, 1) if rate is not None else None
+        return r
+
+
+def fmt_row(r, head=False):
+    cols = (('elapsed', 'time'), ('conns_per_sec', 'conn/s'),
+            ('errors', 'errors'), ('handshake_p50_ms', 'hs p50'),
+            ('handshake_p99_ms', 'hs p99'), ('conn_p99_ms', 'conn p99'),
+            ('late_p99_ms', 'late p99')) + \
+           tuple(('hit_' + c, c + '%') for c in CACHES)
+    if head:
+        return ' '.join('%9s' % h for _, h in cols)
+    return ' '.join('%9s' % ('-' if r[k] is None else r[k])
+                    for k, _ in cols)
+
+
+def start_sslsplit(opts, workdir, tlsport, tcpport, origintls, origintcp,
+                   statspath):
+    argv = [opts.sslsplit, '-k', CAKEY, '-c', CACRT,
+            '-o', 'StatsSocket=' + statspath]
+    argv += opts.sslsplit_arg
+    argv += ['ssl', '127.0.0.1', str(tlsport), '127.0.0.1', str(origintls),
+             'tcp', '127.0.0.1', str(tcpport), '127.0.0.1', str(origintcp)]
+    log = open(os.path.join(workdir, 'sslsplit.log'), 'w')
+    proc = subprocess.Popen(argv, stdout=log, stderr=subprocess.STDOUT)
+    log.close()
+    if not wait_port(tlsport) or proc.poll() is not None:
+        proc.kill()
+        proc.wait()
+        return None
+    return proc
+
+
+def main():
+    p = argparse.ArgumentParser(
+        description='Replay benchmark for sslsplit driven by connect logs')
+    p.add_argument('log', nargs='+',
+                   help='connect log(s) in text or JSON format, '
+                        'optionally gzip compressed')
+    p.add_argument('-s', '--sslsplit', default='./sslsplit',
+                   help='sslsplit binary (default: ./sslsplit)')
+    p.add_argument('-x', '--speed', type=float, default=1.0,
+                   help='replay speed factor; 0 replays as fast as '
+                        'possible (default: 1)')
+    p.add_argument('-n', '--limit', type=int, default=0,
+                   help='replay at most this many connections')
+    p.add_argument('-i', '--interval', type=float, default=5.0,
+                   help='seconds between reports (default: 5)')
+    p.add_argument('-c', '--clients', type=int,
+                   default=multiprocessing.cpu_count(),
+                   help='client processes (default: number of CPUs)')
+    p.add_argument('-t', '--threads', type=int, default=64,
+                   help='concurrent connections per client process '
+                        '(default: 64)')
+    p.add_argument('--hold', type=float, default=0.0,
+                   help='seconds to keep each connection open after the '
+                        'transfer (default: 0)')
+    p.add_argument('--max-certs', type=int, default=256,
+                   help='distinct origin certificates (default: 256)')
+    p.add_argument('--origin-procs', type=int, default=2,
+                   help='origin server processes per protocol '
+                        '(default: 2)')
+    p.add_argument('-A', '--anonymise', metavar='OUT',
+                   help='write the log anonymised to OUT and exit')
+    p.add_argument('-K', '--key',
+                   help='key for anonymising; use the same key to keep '
+                        'pseudonyms consistent across logs '
+                        '(default: random)')
+    p.add_argument('-a', '--sslsplit-arg', action='append', default=[],
+                   help='additional sslsplit argument, may be repeated')
+    p.add_argument('-j', '--json', action='store_true',
+                   help='print reports as JSON lines instead of a table')
+    p.add_argument('-k', '--keep', action='store_true',
+                   help='keep the working directory with logs')
+    opts = p.parse_args()
+
+    conns, skipped = read_log(opts.log)
+    if opts.limit > 0:
+        conns = conns[:opts.limit]
+    print('read %d connections, skipped %d lines' % (len(conns), skipped),
+          file=sys.stderr)
+    if opts.anonymise:
+        key = opts.key.encode() if opts.key else os.urandom(32)
+        anonymise(conns, key, opts.anonymise)
+        return
+    if not conns:
+        p.error('no connections to replay')
+    for f in (opts.sslsplit, CACRT, CAKEY, SERVERPEM):
+        if not os.path.exists(f):
+            p.error('%s not found; run make and make -C extra/pki testreqs'
+                    % f)
+
+    workdir = tempfile.mkdtemp(prefix='sslsplit-replay-')
+    names = sorted(set(c.sni for c in conns if c.tls() and c.sni))
+    index = dict((n, i) for i, n in enumerate(names))
+    print('generating origin certificates for %d names' % len(names),
+          file=sys.stderr)
+    pems = make_certs(names, opts.max_certs, workdir)
+    if pems is None:
+        print('openssl not found; all origins use one certificate',
+              file=sys.stderr)
+
+    procs = []
+    origintls, origintcp = free_port(), free_port()
+    for port, tls in ((origintls, True), (origintcp, False)):
+        for i in range(max(1, opts.origin_procs)):
+            procs.append(multiprocessing.Process(
+                target=origin_main,
+                args=(port, pems if tls else False, index, len(names),
+                      opts.max_certs),
+                daemon=True))
+    for o in procs:
+        o.start()
+    proc = None
+    try:
+        if not wait_port(origintls) or not wait_port(origintcp):
+            print('origin servers failed to start', file=sys.stderr)
+            sys.exit(1)
+        tlsport, tcpport = free_port(), free_port()
+        statspath = os.path.join(workdir, 'stats.sock')
+        proc = start_sslsplit(opts, workdir, tlsport, tcpport, origintls,
+                              origintcp, statspath)
+        if not proc:
+            print('sslsplit failed to start, see %s' %
+                  os.path.join(workdir, 'sslsplit.log'), file=sys.stderr)
+            sys.exit(1)
+
+        span = conns[-1].ts - conns[0].ts
+        print('replaying %d connections spanning %.1fs at speed %s' %
+              (len(conns), span, opts.speed), file=sys.stderr)
+        resq = multiprocessing.Queue()
+        nclients = max(1, opts.clients)
+        t0 = time.time() + 0.5
+        clients = [multiprocessing.Process(
+                       target=client_main,
+                       args=(k, nclients, conns, {True: tlsport,
+                                                  False: tcpport},
+                             t0, opts.speed, max(1, opts.threads),
+                             opts.hold, resq),
+                       daemon=True)
+                   for k in range(nclients)]
+        for c in clients:
+            c.start()
+
+        if not opts.json:
+            print(fmt_row(None, True))
+        start = time.time()
+        base = prev = scrape(statspath)
+        win, tot = Window(), Window()
+        last = start
+        done = 0
+        while done < nclients:
+            try:
+                r = resq.get(timeout=max(0.05, last + opts.interval -
+                                         time.time()))
+                if r is None:
+                    done += 1
+                else:
+                    win.add(r)
+                    tot.add(r)
+            except queue.Empty:
+                pass
+            now = time.time()
+            if now >= last + opts.interval or done == nclients:
+                cur = scrape(statspath)
+                row = win.row(now - start, now - last, cur, prev)
+                if opts.json:
+                    print(json.dumps(row))
+                else:
+                    print(fmt_row(row))
+                sys.stdout.flush()
+                win, prev, last = Window(), cur, now
+        for c in clients:
+            c.join()
+        row = tot.row(time.time() - start, time.time() - start,
+                      scrape(statspath), base)
+        row['total'] = True
+        if opts.json:
+            print(json.dumps(row))
+        else:
+            print('total:')
+            print(fmt_row(row))
+    finally:
+        if proc:
+            proc.send_signal(signal.SIGTERM)
+            try:
+                proc.wait(10)
+            except subprocess.TimeoutExpired:
+                proc.kill()
+                proc.wait()
+        for o in procs:
+            o.terminate()
+        if opts.keep:
+            print('logs kept in %s' % workdir, file=sys.stderr)
+        else:
+            shutil.rmtree(workdir, ignore_errors=True)
+
+
+if __name__ == '__main__':
+    main()
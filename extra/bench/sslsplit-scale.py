@@ -0,0 +1,705 @@
+#!/usr/bin/env python3
+# vim: set ft=python list et ts=8 sts=4 sw=4:
+
+# SSLsplit contributed code:  Concurrent connection scalability test.
+# This script starts local echo origins and an sslsplit instance in front of
+# them, then ramps up the number of concurrently open connections through
+# sslsplit in steps, by default 10k, 100k and 1M, and holds them open.  Most
+# connections stay idle once established; a fraction keep trickling a single
+# octet every few seconds.  At every step it reports the resident set size
+# and file descriptor count of sslsplit, the memory per connection, and the
+# latency from connect() to the first octet echoed through sslsplit while
+# ramping up, which includes accepting and connecting upstream.  If the
+# memory cost of the connections added by a step exceeds that of the first
+# step by more than the tolerance, the step is flagged as growing
+# non-linearly and the exit status is 1.
+#
+# The connections are spread over one proxyspec and origin port per 28k
+# connections or so, bounded by the local port range, since all endpoints
+# are on the loopback interface.  Each connection costs two file descriptors
+# in sslsplit and one each in the clients and the origins; the script raises
+# its soft RLIMIT_NOFILE to the hard limit, which sslsplit inherits, and
+# skips steps that cannot fit.  Ramping to 1M connections needs a host with
+# raised fs.nr_open and fs.file-max, a hard limit of at least 2M open files
+# and several GiB of memory for the Python side.
+#
+# Example:
+#   sslsplit-scale.py -s ./sslsplit -n 10000,100000 -m ssl -j
+
+# Copyright (C) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS''
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+# LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+# CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+# SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+# INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+# CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+# ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+# POSSIBILITY OF SUCH DAMAGE.
+
+import argparse
+import errno
+import json
+import math
+import multiprocessing
+import os
+import resource
+import selectors
+import shutil
+import signal
+import socket
+import ssl
+import subprocess
+import sys
+import tempfile
+import time
+
+PKIDIR = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                      os.pardir, 'pki')
+CACRT = os.path.join(PKIDIR, 'rsa.crt')
+CAKEY = os.path.join(PKIDIR, 'rsa.key')
+SERVERPEM = os.path.join(PKIDIR, 'server.pem')
+
+MODES = ('tcp', 'ssl')
+TICK = 0.1
+
+
+def raise_nofile():
+    """
+    Raise the soft limit on open files to the hard limit and return it.
+    """
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    if hard == resource.RLIM_INFINITY:
+        try:
+            with open('/proc/sys/fs/nr_open') as f:
+                hard = int(f.read())
+        except OSError:
+            hard = 1048576
+    if soft < hard:
+        try:
+            resource.setrlimit(resource.RLIMIT_NOFILE, (hard, hard))
+        except (ValueError, OSError):
+            hard = soft
+    return hard
+
+
+def local_ports():
+    """
+    Number of ephemeral ports, i.e. connections per destination address.
+    """
+    try:
+        with open('/proc/sys/net/ipv4/ip_local_port_range') as f:
+            lo, hi = f.read().split()
+        return int(hi) - int(lo) + 1
+    except (OSError, ValueError):
+        return 28232
+
+
+def free_ports(n):
+    socks = []
+    for i in range(n):
+        s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        s.bind(('127.0.0.1', 0))
+        socks.append(s)
+    ports = [s.getsockname()[1] for s in socks]
+    for s in socks:
+        s.close()
+    return ports
+
+
+def wait_port(port, timeout=15.0):
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        try:
+            socket.create_connection(('127.0.0.1', port), 0.5).close()
+            return True
+        except OSError:
+            time.sleep(0.1)
+    return False
+
+
+def pids_tree(pid):
+    """
+    Return pid and its descendants, which includes the privsep child
+    handling the connections.
+    """
+    pids = [pid]
+    try:
+        out = subprocess.run(['ps', '-A', '-o', 'pid=,ppid='],
+                             capture_output=True, text=True).stdout
+    except OSError:
+        return pids
+    children = {}
+    for line in out.splitlines():
+        p, pp = line.split()
+        children.setdefault(int(pp), []).append(int(p))
+    i = 0
+    while i < len(pids):
+        pids.extend(children.get(pids[i], []))
+        i += 1
+    return pids
+
+
+def footprint(pid):
+    """
+    Total RSS in KiB and number of open file descriptors of sslsplit.
+    """
+    rss = fds = 0
+    for p in pids_tree(pid):
+        try:
+            with open('/proc/%d/status' % p) as f:
+                for line in f:
+                    if line.startswith('VmRSS:'):
+                        rss += int(line.split()[1])
+            fds += len(os.listdir('/proc/%d/fd' % p))
+        except OSError:
+            pass
+    return rss, fds
+
+
+class Hist(object):
+    """
+    Latency histogram with 5% wide buckets, mergeable across processes.
+    """
+    BASE = math.log(1.05)
+
+    def __init__(self, buckets=None):
+        self.buckets = buckets or {}
+
+    def add(self, seconds):
+        k = int(math.log(max(seconds, 1e-6) * 1e6) / Hist.BASE)
+        self.buckets[k] = self.buckets.get(k, 0) + 1
+
+    def merge(self, other):
+        for k, v in other.buckets.items():
+            self.buckets[k] = self.buckets.get(k, 0) + v
+
+    def count(self):
+        return sum(self.buckets.values())
+
+    def percentile(self, p):
+        total = self.count()
+        if not total:
+            return float('nan')
+        want = p / 100.0 * total
+        seen = 0
+        for k in sorted(self.buckets):
+            seen += self.buckets[k]
+            if seen >= want:
+                return math.exp((k + 1) * Hist.BASE) / 1e6
+        return float('nan')
+
+
+def origin_main(ports, mode):
+    """
+    Echo server on all ports, completing TLS handshakes in ssl mode.
+    Several origin processes share the ports using SO_REUSEPORT.
+    """
+    signal.signal(signal.SIGINT, signal.SIG_IGN)
+    raise_nofile()
+    ctx = None
+    if mode == 'ssl':
+        ctx = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+        ctx.load_cert_chain(SERVERPEM)
+    sel = selectors.DefaultSelector()
+    for port in ports:
+        ls = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        ls.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        ls.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEPORT, 1)
+        ls.bind(('127.0.0.1', port))
+        ls.listen(4096)
+        ls.setblocking(False)
+        sel.register(ls, selectors.EVENT_READ, None)
+    while True:
+        for key, ev in sel.select():
+            s = key.fileobj
+            if key.data is None:
+                while True:
+                    try:
+                        c, _ = s.accept()
+                    except (BlockingIOError, InterruptedError):
+                        break
+                    except OSError:
+                        time.sleep(0.01)
+                        break
+                    c.setblocking(False)
+                    if ctx:
+                        c = ctx.wrap_socket(c, server_side=True,
+                                            do_handshake_on_connect=False)
+                    sel.register(c, selectors.EVENT_READ, [bool(ctx)])
+                continue
+            state = key.data
+            try:
+                if state[0]:
+                    s.do_handshake()
+                    state[0] = False
+                    sel.modify(s, selectors.EVENT_READ, state)
+                    continue
+                data = s.recv(4096)
+                if not data:
+                    raise ConnectionError()
+                s.send(data)
+            except ssl.SSLWantReadError:
+                sel.modify(s, selectors.EVENT_READ, state)
+            except ssl.SSLWantWriteError:
+                sel.modify(s, selectors.EVENT_WRITE, state)
+            except (BlockingIOError, InterruptedError):
+                pass
+            except (OSError, ssl.SSLError):
+                sel.unregister(s)
+                s.close()
+
+
+class ClientConn(object):
+    __slots__ = ('sock', 'phase', 't0', 'trickle')
+
+    CONNECTING = 0
+    HANDSHAKE = 1
+    PING = 2
+    UP = 3
+
+
+class Client(object):
+    """
+    Opens and holds this client process' share of the connections.
+    """
+
+    def __init__(self, ports, mode, trickle, interval, inflight):
+        self.ports = ports
+        self.ctx = None
+        if mode == 'ssl':
+            self.ctx = ssl.SSLContext(ssl.PROTOCOL_TLS_CLIENT)
+            self.ctx.check_hostname = False
+            self.ctx.verify_mode = ssl.CERT_NONE
+        self.trickle = trickle
+        self.interval = interval
+        self.inflight = inflight
+        self.sel = selectors.DefaultSelector()
+        self.opened = 0
+        self.pending = 0
+        self.up = 0
+        self.errors = 0
+        self.trickling = []
+        self.trickle_pos = 0
+        self.trickle_acc = 0.0
+        self.trickle_due = 0.0
+        self.hist = Hist()
+
+    def open_one(self):
+        port = self.ports[self.opened % len(self.ports)]
+        self.opened += 1
+        c = ClientConn()
+        c.phase = ClientConn.CONNECTING
+        c.t0 = time.perf_counter()
+        self.trickle_acc += self.trickle
+        c.trickle = self.trickle_acc >= 1.0
+        if c.trickle:
+            self.trickle_acc -= 1.0
+        try:
+            c.sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        except OSError:
+            self.errors += 1
+            return
+        c.sock.setblocking(False)
+        rv = c.sock.connect_ex(('127.0.0.1', port))
+        if rv not in (0, errno.EINPROGRESS):
+            c.sock.close()
+            self.errors += 1
+            return
+        self.pending += 1
+        self.sel.register(c.sock, selectors.EVENT_WRITE, c)
+
+    def fail(self, c):
+        self.sel.unregister(c.sock)
+        if c.phase == ClientConn.UP:
+            self.up -= 1
+        else:
+            self.pending -= 1
+        c.sock.close()
+        self.errors += 1
+
+    def ping(self, c):
+        c.phase = ClientConn.PING
+        c.sock.send(b'.')
+        self.sel.modify(c.sock, selectors.EVENT_READ, c)
+
+    def handle(self, c):
+        try:
+            if c.phase == ClientConn.CONNECTING:
+                err = c.sock.getsockopt(socket.SOL_SOCKET, socket.SO_ERROR)
+                if err:
+                    raise OSError(err, os.strerror(err))
+                if not self.ctx:
+                    self.ping(c)
+                    return
+                self.sel.unregister(c.sock)
+                c.sock = self.ctx.wrap_socket(c.sock,
+                                              server_hostname='daniel.roe.ch',
+                                              do_handshake_on_connect=False)
+                self.sel.register(c.sock, selectors.EVENT_WRITE, c)
+                c.phase = ClientConn.HANDSHAKE
+            if c.phase == ClientConn.HANDSHAKE:
+                c.sock.do_handshake()
+                self.ping(c)
+                return
+            data = c.sock.recv(4096)
+            if not data:
+                raise ConnectionError('closed by peer')
+            if c.phase == ClientConn.PING:
+                self.hist.add(time.perf_counter() - c.t0)
+                c.phase = ClientConn.UP
+                self.pending -= 1
+                self.up += 1
+                if c.trickle:
+                    self.trickling.append(c)
+        except ssl.SSLWantReadError:
+            self.sel.modify(c.sock, selectors.EVENT_READ, c)
+        except ssl.SSLWantWriteError:
+            self.sel.modify(c.sock, selectors.EVENT_WRITE, c)
+        except (BlockingIOError, InterruptedError):
+            pass
+        except (OSError, ssl.SSLError):
+            self.fail(c)
+
+    def tick(self, elapsed):
+        """
+        Send one octet on the share of trickling connections due.
+        """
+        if not self.trickling:
+            return
+        self.trickle_due += len(self.trickling) * elapsed / self.interval
+        n = min(int(self.trickle_due), len(self.trickling))
+        self.trickle_due -= n
+        for i in range(n):
+            if self.trickle_pos >= len(self.trickling):
+                self.trickle_pos = 0
+            c = self.trickling[self.trickle_pos]
+            if c.phase != ClientConn.UP or c.sock.fileno() == -1:
+                self.trickling.pop(self.trickle_pos)
+                continue
+            try:
+                c.sock.send(b'.')
+            except (BlockingIOError, ssl.SSLWantWriteError,
+                    ssl.SSLWantReadError):
+                pass
+            except (OSError, ssl.SSLError):
+                self.fail(c)
+            self.trickle_pos += 1
+
+    def poll(self, timeout):
+        for key, ev in self.sel.select(timeout):
+            if key.data is None:
+                return True
+            self.handle(key.data)
+        return False
+
+    def run(self, pipe):
+        self.sel.register(pipe, selectors.EVENT_READ, None)
+        target = 0
+        budget = 0
+        start = None
+        last = time.perf_counter()
+        while True:
+            while (self.up + self.pending < target and
+                   self.pending < self.inflight and
+                   self.errors < budget):
+                self.open_one()
+            if self.poll(TICK) and pipe.poll():
+                cmd = pipe.recv()
+                if cmd[0] == 'ramp':
+                    target = cmd[1]
+                    budget = self.errors + max(100, target // 100)
+                    start = time.perf_counter()
+                    self.hist = Hist()
+                elif cmd[0] == 'quit':
+                    return
+            now = time.perf_counter()
+            self.tick(now - last)
+            last = now
+            if start is not None and (self.up >= target or
+                                      (self.pending == 0 and
+                                       self.errors >= budget)):
+                pipe.send({'up': self.up, 'errors': self.errors,
+                           'seconds': now - start,
+                           'hist': self.hist.buckets})
+                start = None
+
+
+def client_main(pipe, ports, mode, trickle, interval, inflight):
+    signal.signal(signal.SIGINT, signal.SIG_IGN)
+    raise_nofile()
+    Client(ports, mode, trickle, interval, inflight).run(pipe)
+
+
+def start_sslsplit(opts, workdir, listen, origin):
+    argv = [opts.sslsplit]
+    if opts.mode == 'ssl':
+        argv += ['-k', CAKEY, '-c', CACRT]
+    argv += opts.sslsplit_arg
+    for lp, op in zip(listen, origin):
+        argv += [opts.mode, '127.0.0.1', str(lp), '127.0.0.1', str(op)]
+    log = open(os.path.join(workdir, 'sslsplit.log'), 'w')
+    proc = subprocess.Popen(argv, stdout=log, stderr=subprocess.STDOUT)
+    log.close()
+    if not wait_port(listen[0]) or proc.poll() is not None:
+        proc.kill()
+        proc.wait()
+        return None
+    return proc
+
+
+def ramp(pipes, n):
+    """
+    Ramp all client processes to a total of n open connections; returns
+    the number open, errors, seconds taken and the latency histogram.
+    """
+    share = [n // len(pipes) + (i < n % len(pipes))
+             for i in range(len(pipes))]
+    for p, k in zip(pipes, share):
+        p.send(('ramp', k))
+    res = {'up': 0, 'errors': 0, 'seconds': 0.0, 'hist': Hist()}
+    for p in pipes:
+        r = p.recv()
+        res['up'] += r['up']
+        res['errors'] += r['errors']
+        res['seconds'] = max(res['seconds'], r['seconds'])
+        res['hist'].merge(Hist(r['hist']))
+    return res
+
+
+def run(opts, steps, nofile, workdir):
+    perspec = max(1, int(local_ports() * 0.9))
+    nspecs = (steps[-1] + perspec - 1) // perspec
+    ports = free_ports(2 * nspecs)
+    listen, origin = ports[:nspecs], ports[nspecs:]
+
+    origins = [multiprocessing.Process(target=origin_main,
+                                       args=(origin, opts.mode), daemon=True)
+               for i in range(max(1, opts.origin_procs))]
+    for o in origins:
+        o.start()
+    if not wait_port(origin[0]):
+        return None, 'origin server failed to start'
+    proc = start_sslsplit(opts, workdir, listen, origin)
+    if not proc:
+        for o in origins:
+            o.terminate()
+        return None, 'sslsplit failed to start, see %s' % \
+                     os.path.join(workdir, 'sslsplit.log')
+
+    nclients = max(1, opts.clients)
+    pipes, clients = [], []
+    for i in range(nclients):
+        a, b = multiprocessing.Pipe()
+        c = multiprocessing.Process(target=client_main,
+                                    args=(b, listen, opts.mode,
+                                          opts.trickle, opts.interval,
+                                          max(1, opts.inflight // nclients)),
+                                    daemon=True)
+        c.start()
+        pipes.append(a)
+        clients.append(c)
+
+    rows = []
+    try:
+        time.sleep(1)
+        rss0, fds0 = footprint(proc.pid)
+        prev_n, prev_rss = 0, rss0
+        base = None
+        skipped = []
+        failed = False
+        for n in steps:
+            # descriptors per connection depend on the features in use,
+            # such as splice pipes, so are taken from the previous step
+            if rows and rows[-1]['fds_per_conn'] * n + fds0 > nofile:
+                print('skipping %d connections: RLIMIT_NOFILE hard limit '
+                      '%d too low for %s fds per connection' %
+                      (n, nofile, rows[-1]['fds_per_conn']), file=sys.stderr)
+                skipped.append(n)
+                continue
+            print('ramping to %d connections' % n, file=sys.stderr)
+            r = ramp(pipes, n)
+            time.sleep(opts.hold)
+            if proc.poll() is not None:
+                print('sslsplit exited with status %d while ramping to %d '
+                      'connections, see %s' %
+                      (proc.returncode, n,
+                       os.path.join(workdir, 'sslsplit.log')),
+                      file=sys.stderr)
+                failed = True
+                break
+            rss, fds = footprint(proc.pid)
+            added = r['up'] - prev_n
+            marginal = (rss - prev_rss) / added if added > 0 else \
+                       float('nan')
+            if base is None and added > 0:
+                base = marginal
+            row = {
+                'target': n,
+                'conns': r['up'],
+                'errors': r['errors'],
+                'ramp_seconds': round(r['seconds'], 3),
+                'conns_per_sec': round(added / r['seconds'], 1)
+                                 if r['seconds'] > 0 else 0.0,
+                'accept_p50_ms': round(r['hist'].percentile(50) * 1000, 3),
+                'accept_p99_ms': round(r['hist'].percentile(99) * 1000, 3),
+                'accept_max_ms': round(r['hist'].percentile(100) * 1000, 3),
+                'rss_kb': rss,
+                'fds': fds,
+                'kb_per_conn': round((rss - rss0) / r['up'], 3)
+                               if r['up'] else float('nan'),
+                'fds_per_conn': round((fds - fds0) / r['up'], 3)
+                                if r['up'] else float('nan'),
+                'marginal_kb_per_conn': round(marginal, 3),
+                'nonlinear': bool(base and base > 0 and
+                                  marginal > base * (1 + opts.tolerance)),
+            }
+            rows.append(row)
+            prev_n, prev_rss = r['up'], rss
+            if r['up'] < n:
+                print('only %d of %d connections open, stopping' %
+                      (r['up'], n), file=sys.stderr)
+                break
+        for p in pipes:
+            p.send(('quit',))
+        for c in clients:
+            c.join(30)
+        time.sleep(opts.hold)
+        rss_end, fds_end = footprint(proc.pid) if not failed else (0, 0)
+        summary = {'rss_start_kb': rss0, 'fds_start': fds0,
+                   'rss_end_kb': rss_end, 'fds_end': fds_end}
+    finally:
+        for c in clients:
+            if c.is_alive():
+                c.terminate()
+        proc.send_signal(signal.SIGTERM)
+        try:
+            proc.wait(30)
+        except subprocess.TimeoutExpired:
+            proc.kill()
+            proc.wait()
+        for o in origins:
+            o.terminate()
+    return {'mode': opts.mode, 'steps': rows, 'skipped': skipped,
+            'failed': failed, 'summary': summary}, None
+
+
+def print_table(res):
+    cols = ('target', 'conns', 'errors', 'conns_per_sec', 'accept_p50_ms',
+            'accept_p99_ms', 'accept_max_ms', 'rss_kb', 'fds',
+            'kb_per_conn', 'marginal_kb_per_conn')
+    head = ('target', 'open', 'errors', 'conn/s', 'p50 ms', 'p99 ms',
+            'max ms', 'RSS KiB', 'fds', 'KiB/conn', 'marginal')
+    print(' '.join(['%10s'] * len(cols)) % head)
+    for r in res['steps']:
+        print(' '.join(['%10s'] * len(cols)) % tuple(r[c] for c in cols) +
+              ('  NONLINEAR' if r['nonlinear'] else ''))
+    s = res['summary']
+    print('RSS %d KiB and %d fds before, %d KiB and %d fds after closing' %
+          (s['rss_start_kb'], s['fds_start'], s['rss_end_kb'],
+           s['fds_end']))
+    if res['skipped']:
+        print('skipped: %s' % ', '.join(str(n) for n in res['skipped']))
+    if res['failed']:
+        print('sslsplit exited during the test')
+
+
+def main():
+    p = argparse.ArgumentParser(
+        description='Concurrent connection scalability test for sslsplit')
+    p.add_argument('-s', '--sslsplit', default='./sslsplit',
+                   help='sslsplit binary (default: ./sslsplit)')
+    p.add_argument('-n', '--steps', default='10000,100000,1000000',
+                   help='comma separated numbers of concurrent connections '
+                        'to ramp up to (default: 10000,100000,1000000)')
+    p.add_argument('-m', '--mode', default='tcp', choices=MODES,
+                   help='proxyspec type (default: tcp)')
+    p.add_argument('-t', '--trickle', type=float, default=0.1,
+                   help='fraction of connections trickling (default: 0.1)')
+    p.add_argument('-i', '--interval', type=float, default=5.0,
+                   help='seconds between octets on a trickling connection '
+                        '(default: 5)')
+    p.add_argument('-H', '--hold', type=float, default=5.0,
+                   help='seconds to hold the connections at each step '
+                        'before measuring (default: 5)')
+    p.add_argument('-T', '--tolerance', type=float, default=0.25,
+                   help='relative increase of the memory per added '
+                        'connection over the first step to flag as '
+                        'non-linear (default: 0.25)')
+    p.add_argument('-c', '--clients', type=int,
+                   default=multiprocessing.cpu_count(),
+                   help='client processes (default: number of CPUs)')
+    p.add_argument('--inflight', type=int, default=1024,
+                   help='connections being set up at a time '
+                        '(default: 1024)')
+    p.add_argument('--origin-procs', type=int, default=2,
+                   help='origin server processes (default: 2)')
+    p.add_argument('-a', '--sslsplit-arg', action='append', default=[],
+                   help='additional sslsplit argument, may be repeated')
+    p.add_argument('-j', '--json', action='store_true',
+                   help='print results as JSON instead of a table')
+    p.add_argument('-k', '--keep', action='store_true',
+                   help='keep the working directory with logs')
+    opts = p.parse_args()
+
+    try:
+        steps = sorted(int(x) for x in opts.steps.split(','))
+    except ValueError:
+        p.error('invalid steps %s' % opts.steps)
+    if not steps or steps[0] <= 0:
+        p.error('invalid steps %s' % opts.steps)
+    files = [opts.sslsplit]
+    if opts.mode == 'ssl':
+        files += [CACRT, CAKEY, SERVERPEM]
+    for f in files:
+        if not os.path.exists(f):
+            p.error('%s not found; run make and make -C extra/pki testreqs'
+                    % f)
+
+    # sslsplit needs two descriptors per connection and inherits the limit
+    nofile = raise_nofile()
+    fit = [n for n in steps if 2 * n + 1024 <= nofile]
+    for n in steps:
+        if n not in fit:
+            print('skipping %d connections: RLIMIT_NOFILE hard limit %d '
+                  'too low' % (n, nofile), file=sys.stderr)
+    if not fit:
+        sys.exit(1)
+
+    workdir = tempfile.mkdtemp(prefix='sslsplit-scale-')
+    try:
+        res, err = run(opts, fit, nofile, workdir)
+    finally:
+        if opts.keep:
+            print('logs kept in %s' % workdir, file=sys.stderr)
+        else:
+            shutil.rmtree(workdir, ignore_errors=True)
+    if err:
+        print(err, file=sys.stderr)
+        sys.exit(1)
+    res['skipped'] += [n for n in steps if n not in fit]
+
+    if opts.json:
+        json.dump(res, sys.stdout, indent=2)
+        print()
+    else:
+        print_table(res)
+    if res['failed'] or any(r['nonlinear'] for r in res['steps']):
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,145 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Example inspection plugin.  Terminates connections in which either peer
+ * sends any of the octet strings given as space-separated argument, also if
+ * they span reads, and prints the octets seen per connection when it is
+ * closed.  The strings are matched using the matcher in acmatch.c, so the
+ * cost per octet does not depend on the number of strings.
+ *
+ * make -C extra/inspect
+ * InspectPlugin /path/to/pattern-inspect.so forbidden-string another-one
+ */
+
+#define INSPECT_PLUGIN
+#include "inspect.h"
+#include "acmatch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+static acmatch_t *patterns;
+
+typedef struct pattern_conn {
+	unsigned long long octets[2];
+	acmatch_state_t state[2];
+} pattern_conn_t;
+
+static int
+pattern_init(const char *arg)
+{
+	const char *p;
+	size_t n;
+
+	if (!arg || !(patterns = acmatch_new()))
+		goto errout;
+	for (p = arg; *p; p += n) {
+		p += strspn(p, " \t");
+		if (!(n = strcspn(p, " \t")))
+			break;
+		if (acmatch_add(patterns, p, n,
+		                acmatch_patterns(patterns)) == -1)
+			goto errout;
+	}
+	if (acmatch_compile(patterns) == -1)
+		goto errout;
+	return 0;
+
+errout:
+	fprintf(stderr, "pattern-inspect: need space-separated patterns\n");
+	return -1;
+}
+
+static void
+pattern_fini(void)
+{
+	acmatch_free(patterns);
+}
+
+static int
+pattern_conn_new(const inspect_conn_t *conn, void **state)
+{
+	(void)conn;
+	return (*state = calloc(1, sizeof(pattern_conn_t))) ? 0 : -1;
+}
+
+static int
+pattern_match(unsigned int id, void *arg)
+{
+	(void)id;
+	(void)arg;
+	return 1;
+}
+
+static int
+pattern_data(const inspect_conn_t *conn, void *state, int req,
+             const struct iovec *iov, int iovcnt)
+{
+	pattern_conn_t *pc = state;
+
+	(void)conn;
+	for (int i = 0; i < iovcnt; i++)
+		pc->octets[req] += iov[i].iov_len;
+	if (acmatch_scan_iov(patterns, &pc->state[req], iov, iovcnt,
+	                     pattern_match, NULL))
+		return INSPECT_DROP;
+	return INSPECT_PASS;
+}
+
+static void
+pattern_conn_free(const inspect_conn_t *conn, void *state)
+{
+	pattern_conn_t *pc = state;
+	char host[INET6_ADDRSTRLEN] = "?";
+	const void *a = NULL;
+
+	if (conn->srcaddr->sa_family == AF_INET)
+		a = &((const struct sockaddr_in *)conn->srcaddr)->sin_addr;
+	else if (conn->srcaddr->sa_family == AF_INET6)
+		a = &((const struct sockaddr_in6 *)conn->srcaddr)->sin6_addr;
+	if (a)
+		inet_ntop(conn->srcaddr->sa_family, a, host, sizeof(host));
+	fprintf(stderr, "pattern-inspect: %s %s sni %s: %llu octets from "
+	                "client, %llu from server\n", conn->proto, host,
+	                conn->sni ? conn->sni : "-",
+	                pc->octets[1], pc->octets[0]);
+	free(pc);
+}
+
+const inspect_plugin_t sslsplit_inspect_plugin = {
+	INSPECT_ABI_VERSION, "pattern",
+	pattern_init, pattern_fini, pattern_conn_new, pattern_data,
+	pattern_conn_free
+};
+
+/* vim: set noet ft=c: */
@@ -6,7 +6,8 @@
 # corresponding PCAP file.  Information which is not contained in the
 # log, such as TCP sequence numbers, IP ID etc are emulated and do not
 # correspond to the values in the original traffic.  Note that the
-# algorithms used do not scale well for large volumes of traffic.
+# algorithms used do not scale well for large volumes of traffic; the
+# sslsplit-log2pcap utility built with sslsplit is much faster.
 
 # Copyright (C) 2015, Maciej Kotowicz <mak@lokalhost.pl>.
 # Copyright (C) 2015, Daniel Roethlisberger <daniel@roe.ch>.
@@ -4,6 +4,10 @@
 # SSLsplit contributed code:  Log parser for sslsplit -L
 # This script reads the log from standard input and parses it.
 # Standard input can point to a file or a named pipe.
+# Given a ContentLogSegmentDir and a connection ID as arguments, it extracts
+# that connection from the segment store instead.
+# Given -d and a ContentLogDedupDir, it reassembles the data of a
+# per-connection content log read from standard input from the chunk store.
 
 # Copyright (C) 2015, Maciej Kotowicz <mak@lokalhost.pl>.
 # Copyright (C) 2015, Daniel Roethlisberger <daniel@roe.ch>.
@@ -34,6 +38,9 @@ import sys
 import os
 import select
 import re
+import struct
+import glob
+import hashlib
 
 def read_line(f):
     """Read a single line from a file stream; return empty string on EOF"""
@@ -66,7 +73,7 @@ class LogSyntaxError(Exception):
 def parse_header(line):
     """Parse the header line into a dict with useful fields"""
     # 2015-09-27 14:55:41 UTC [192.0.2.1]:56721 -> [192.0.2.2]:443 (37):
-    m = re.match(r'(\d{4}-\d{2}-\d{2} \d{2}:\d{2}:\d{2} \S+) \[(.+?)\]:(\d+) -> \[(.+?)\]:(\d+) \((\d+|EOF)\):?', line)
+    m = re.match(r'(\d{4}-\d{2}-\d{2} \d{2}:\d{2}:\d{2} \S+) \[(.+?)\]:(\d+) -> \[(.+?)\]:(\d+) \((\d+|EOF|TRUNCATED)\):?', line)
     if not m:
         raise LogSyntaxError(line)
     res = {}
@@ -75,8 +82,9 @@ def parse_header(line):
     res['src_port'] = int(m.group(3))
     res['dst_addr'] = m.group(4)
     res['dst_port'] = int(m.group(5))
-    if m.group(6) == 'EOF':
-        res['eof'] = True
+    res['truncated'] = m.group(6) == 'TRUNCATED'
+    if m.group(6) in ('EOF', 'TRUNCATED'):
+        res['eof'] = m.group(6) == 'EOF'
     else:
         res['eof'] = False
         res['size'] = int(m.group(6))
@@ -89,11 +97,108 @@ def parse_log(f):
         if not line:
             break
         res = parse_header(line)
-        if (not res['eof']):
+        if not res['eof'] and not res['truncated']:
             res['data'] = read_count(f, res['size'])
         yield res
 
+SEGMENT_REC = struct.Struct('<QQQIIII')
+SEGMENT_REQUEST = 1
+SEGMENT_EOF = 2
+SEGMENT_TRUNC = 4
+
+def parse_segment_conns(segdir):
+    """Read the connection lines of a ContentLogSegmentDir store"""
+    for fn in sorted(glob.glob(os.path.join(segdir, '*.conn'))):
+        with open(fn) as f:
+            for line in f:
+                fields = line.split()
+                if len(fields) != 13:
+                    raise LogSyntaxError(line)
+                res = {}
+                (res['id'], res['shard'], res['opened'], res['closed'],
+                 res['lastseg'], res['lastrec'], res['chunks'],
+                 res['bytes']) = [int(x) for x in fields[:8]]
+                res['src_addr'] = fields[8]
+                res['src_port'] = int(fields[9])
+                res['dst_addr'] = fields[10]
+                res['dst_port'] = int(fields[11])
+                res['sni'] = None if fields[12] == '-' else fields[12]
+                yield res
+
+def read_segment_conn(segdir, conn):
+    """Extract the chunks of one connection from a ContentLogSegmentDir
+    store by following its chain of chunk records backwards; returns a list
+    of log entries in order"""
+    chunks = []
+    seg, rec = conn['lastseg'], conn['lastrec']
+    while seg:
+        base = os.path.join(segdir, '%u-%u' % (seg, conn['shard']))
+        with open(base + '.idx', 'rb') as f:
+            f.seek(rec * SEGMENT_REC.size)
+            (connid, usec, offset, size, flags,
+             seg, rec) = SEGMENT_REC.unpack(f.read(SEGMENT_REC.size))
+        if connid != conn['id']:
+            raise LogSyntaxError('%s.idx: wrong connection id' % base)
+        res = {}
+        res['timestamp'] = usec / 1000000.0
+        res['request'] = bool(flags & SEGMENT_REQUEST)
+        res['eof'] = bool(flags & SEGMENT_EOF)
+        res['truncated'] = bool(flags & SEGMENT_TRUNC)
+        if size:
+            with open(base + '.seg', 'rb') as f:
+                f.seek(offset)
+                res['data'] = f.read(size)
+        chunks.append(res)
+    chunks.reverse()
+    return chunks
+
+DEDUP_MAGIC = 'SSLsplit dedup 1\n'
+
+def read_dedup(f, casdir):
+    """Reassemble the data of a per-connection content log written with
+    ContentLogDedupDir from its manifest and the chunk store; yields the
+    chunks in order"""
+    if f.readline() != DEDUP_MAGIC:
+        raise LogSyntaxError('not a deduplicated content log')
+    while True:
+        line = f.readline()
+        if not line:
+            break
+        if line.startswith('='):
+            size = int(line[1:])
+            data = read_count(f, size)
+            if len(data) != size:
+                raise LogSyntaxError('truncated inline chunk')
+        elif line.startswith('@'):
+            fields = line[1:].split()
+            if len(fields) != 4:
+                raise LogSyntaxError(line)
+            digest, pack = fields[0], fields[1]
+            offset, size = int(fields[2]), int(fields[3])
+            with open(os.path.join(casdir, pack + '.pack'), 'rb') as p:
+                p.seek(offset)
+                data = p.read(size)
+            if hashlib.sha256(data).hexdigest() != digest:
+                raise LogSyntaxError('%s.pack: bad chunk at %u' % (pack,
+                                                                  offset))
+        else:
+            raise LogSyntaxError(line)
+        yield data
+
 if __name__ == '__main__':
+    if len(sys.argv) == 3 and sys.argv[1] == '-d':
+        # logreader.py -d casdir < log
+        for data in read_dedup(sys.stdin, sys.argv[2]):
+            sys.stdout.write(data)
+        sys.exit(0)
+    if len(sys.argv) == 3:
+        # logreader.py segdir connid
+        for conn in parse_segment_conns(sys.argv[1]):
+            if conn['id'] == int(sys.argv[2]):
+                print conn
+                for result in read_segment_conn(sys.argv[1], conn):
+                    print result
+        sys.exit(0)
     for result in parse_log(sys.stdin):
         print result
 
@@ -0,0 +1,283 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "httphdr.h"
+
+#include <string.h>
+#include <strings.h>
+
+/*
+ * HTTP header field parsing on lines in place, without allocation and
+ * without requiring NUL termination, such that header lines can be parsed
+ * directly in the evbuffer they were received into.
+ */
+
+/*
+ * Perfect hash over the header field names of interest; the length and the
+ * case-folded first and last characters are enough to tell them apart.
+ * Names not listed here may hash to any slot and are rejected by comparing
+ * the full name.
+ */
+#define HTTPHDR_HASH(name, len) \
+        (((len) * 5 + ((name)[0] | 0x20) + ((name)[(len) - 1] | 0x20) * 23) \
+         & 63)
+
+typedef struct {
+	const char *name;
+	size_t len;
+	httphdr_name_t id;
+} httphdr_slot_t;
+
+#define S(n, id) { n, sizeof(n) - 1, id }
+static const httphdr_slot_t httphdr_slots[64] = {
+	[ 1] = S("Content-Length", HTTPHDR_CONTENT_LENGTH),
+	[ 2] = S("If-None-Match", HTTPHDR_IF_NONE_MATCH),
+	[ 3] = S("Age", HTTPHDR_AGE),
+	[ 4] = S("Authorization", HTTPHDR_AUTHORIZATION),
+	[ 5] = S("Pragma", HTTPHDR_PRAGMA),
+	[10] = S("Transfer-Encoding", HTTPHDR_TRANSFER_ENCODING),
+	[15] = S("Strict-Transport-Security",
+	         HTTPHDR_STRICT_TRANSPORT_SECURITY),
+	[16] = S("Public-Key-Pins", HTTPHDR_PUBLIC_KEY_PINS),
+	[22] = S("Public-Key-Pins-Report-Only",
+	         HTTPHDR_PUBLIC_KEY_PINS_REPORT_ONLY),
+	[24] = S("Cache-Control", HTTPHDR_CACHE_CONTROL),
+	[30] = S("Range", HTTPHDR_RANGE),
+	[40] = S("Host", HTTPHDR_HOST),
+	[41] = S("Vary", HTTPHDR_VARY),
+	[43] = S("Upgrade", HTTPHDR_UPGRADE),
+	[45] = S("Accept-Encoding", HTTPHDR_ACCEPT_ENCODING),
+	[47] = S("Alternate-Protocol", HTTPHDR_ALTERNATE_PROTOCOL),
+	[48] = S("Keep-Alive", HTTPHDR_KEEP_ALIVE),
+	[50] = S("Content-Type", HTTPHDR_CONTENT_TYPE),
+	[52] = S("Content-Encoding", HTTPHDR_CONTENT_ENCODING),
+	[55] = S("Connection", HTTPHDR_CONNECTION),
+	[56] = S("Set-Cookie", HTTPHDR_SET_COOKIE),
+	[58] = S("ETag", HTTPHDR_ETAG),
+	[62] = S("Expect-CT", HTTPHDR_EXPECT_CT),
+};
+#undef S
+
+/*
+ * Skip space and tab characters at the beginning of the sz bytes at s.
+ */
+static const char *
+httphdr_skipws(const char *s, size_t *sz)
+{
+	while (*sz > 0 && (*s == ' ' || *s == '\t')) {
+		s++;
+		(*sz)--;
+	}
+	return s;
+}
+
+/*
+ * Classify the header line of sz bytes at line, excluding the line
+ * terminator.  Sets value and valuesz to the field value with leading
+ * whitespace removed, or to NULL and 0 if the line is not a header field.
+ * Returns the field name, or HTTPHDR_OTHER for names not of interest.
+ */
+httphdr_name_t
+httphdr_parse(const char *line, size_t sz, const char **value,
+              size_t *valuesz)
+{
+	const httphdr_slot_t *slot;
+	const char *colon;
+	size_t len;
+
+	if (!(colon = memchr(line, ':', sz))) {
+		*value = NULL;
+		*valuesz = 0;
+		return HTTPHDR_OTHER;
+	}
+	*valuesz = sz - (colon - line) - 1;
+	*value = httphdr_skipws(colon + 1, valuesz);
+
+	len = colon - line;
+	if (len == 0)
+		return HTTPHDR_OTHER;
+	slot = &httphdr_slots[HTTPHDR_HASH(line, len)];
+	if (slot->len != len || strncasecmp(line, slot->name, len))
+		return HTTPHDR_OTHER;
+	return slot->id;
+}
+
+/*
+ * Return 1 if the comma separated field value of sz bytes at value contains
+ * token, with or without parameters or an argument, 0 if not.
+ */
+int
+httphdr_has_token(const char *value, size_t sz, const char *token)
+{
+	size_t toklen = strlen(token);
+	const char *comma;
+
+	while (value) {
+		value = httphdr_skipws(value, &sz);
+		if (sz >= toklen && !strncasecmp(value, token, toklen) &&
+		    (sz == toklen || strchr(",;= \t", value[toklen])))
+			return 1;
+		comma = memchr(value, ',', sz);
+		if (!comma)
+			break;
+		sz -= comma + 1 - value;
+		value = comma + 1;
+	}
+	return 0;
+}
+
+/*
+ * Return 1 if the last element of the comma separated field value of sz
+ * bytes at value is token, with or without parameters, 0 if not.  Used for
+ * the final coding of Transfer-Encoding.
+ */
+int
+httphdr_last_token(const char *value, size_t sz, const char *token)
+{
+	size_t toklen = strlen(token);
+	size_t i;
+
+	if (!value)
+		return 0;
+	for (i = sz; i > 0 && value[i - 1] != ','; i--);
+	value += i;
+	sz -= i;
+	value = httphdr_skipws(value, &sz);
+	return sz >= toklen && !strncasecmp(value, token, toklen) &&
+	       (sz == toklen || (value[toklen] && strchr("; \t", value[toklen])));
+}
+
+/*
+ * Find the directive token=NUM in the comma separated field value of sz bytes
+ * at value, such as max-age=60 in Cache-Control, and parse its argument,
+ * which may be quoted, into num.
+ * Returns -1 if the directive is missing or its argument is not a number,
+ * 0 on success.
+ */
+int
+httphdr_token_ull(const char *value, size_t sz, const char *token,
+                  unsigned long long *num)
+{
+	size_t toklen = strlen(token);
+	const char *comma;
+
+	while (value) {
+		value = httphdr_skipws(value, &sz);
+		if (sz > toklen && !strncasecmp(value, token, toklen) &&
+		    value[toklen] == '=') {
+			value += toklen + 1;
+			sz -= toklen + 1;
+			if (sz > 0 && *value == '"') {
+				value++;
+				sz--;
+			}
+			return httphdr_to_ull(value, sz, num);
+		}
+		comma = memchr(value, ',', sz);
+		if (!comma)
+			break;
+		sz -= comma + 1 - value;
+		value = comma + 1;
+	}
+	return -1;
+}
+
+/*
+ * Return 1 if the sz bytes at value equal str, ignoring case, 0 if not.
+ */
+int
+httphdr_equals(const char *value, size_t sz, const char *str)
+{
+	return value && strlen(str) == sz && !strncasecmp(value, str, sz);
+}
+
+/*
+ * Parse the leading decimal digits of the sz bytes at value into num.
+ * Returns -1 if there are no digits or on overflow, 0 on success.
+ */
+int
+httphdr_to_ull(const char *value, size_t sz, unsigned long long *num)
+{
+	unsigned long long n = 0;
+	size_t i;
+
+	for (i = 0; i < sz && value[i] >= '0' && value[i] <= '9'; i++) {
+		if (n > (~0ULL - (value[i] - '0')) / 10)
+			return -1;
+		n = n * 10 + (value[i] - '0');
+	}
+	if (i == 0)
+		return -1;
+	*num = n;
+	return 0;
+}
+
+/*
+ * Parse the Content-Length field value of sz bytes at value into num.  The
+ * value must consist of decimal digits, optionally followed by whitespace.
+ * Returns -1 if it does not, e.g. for a list of values, or on overflow, 0 on
+ * success.
+ */
+int
+httphdr_length(const char *value, size_t sz, unsigned long long *num)
+{
+	size_t i;
+
+	if (!value || httphdr_to_ull(value, sz, num) == -1)
+		return -1;
+	for (i = 0; i < sz && value[i] >= '0' && value[i] <= '9'; i++);
+	for (; i < sz; i++) {
+		if (value[i] != ' ' && value[i] != '\t')
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Return 1 if the request method in the sz bytes at method is idempotent
+ * (RFC 7231 section 4.2.2), such that the request may safely be replayed,
+ * 0 if not or if it is unknown.  Method names are case-sensitive.
+ */
+int
+httphdr_method_idempotent(const char *method, size_t sz)
+{
+	static const char *idempotent[] = {
+		"GET", "HEAD", "OPTIONS", "TRACE", "PUT", "DELETE"
+	};
+	size_t i;
+
+	for (i = 0; i < sizeof(idempotent) / sizeof(idempotent[0]); i++) {
+		if (strlen(idempotent[i]) == sz &&
+		    !memcmp(method, idempotent[i], sz))
+			return 1;
+	}
+	return 0;
+}
+
+/* vim: set noet ft=c: */
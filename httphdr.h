@@ -0,0 +1,81 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef HTTPHDR_H
+#define HTTPHDR_H
+
+#include "attrib.h"
+
+#include <stdlib.h>
+
+typedef enum {
+	HTTPHDR_OTHER = 0,
+	HTTPHDR_HOST,
+	HTTPHDR_CONTENT_TYPE,
+	HTTPHDR_CONTENT_LENGTH,
+	HTTPHDR_CONTENT_ENCODING,
+	HTTPHDR_TRANSFER_ENCODING,
+	HTTPHDR_CONNECTION,
+	HTTPHDR_KEEP_ALIVE,
+	HTTPHDR_UPGRADE,
+	HTTPHDR_ACCEPT_ENCODING,
+	HTTPHDR_PUBLIC_KEY_PINS,
+	HTTPHDR_PUBLIC_KEY_PINS_REPORT_ONLY,
+	HTTPHDR_STRICT_TRANSPORT_SECURITY,
+	HTTPHDR_EXPECT_CT,
+	HTTPHDR_ALTERNATE_PROTOCOL,
+	HTTPHDR_AUTHORIZATION,
+	HTTPHDR_CACHE_CONTROL,
+	HTTPHDR_PRAGMA,
+	HTTPHDR_RANGE,
+	HTTPHDR_IF_NONE_MATCH,
+	HTTPHDR_ETAG,
+	HTTPHDR_AGE,
+	HTTPHDR_VARY,
+	HTTPHDR_SET_COOKIE
+} httphdr_name_t;
+
+/* set of field names as bit mask */
+#define HTTPHDR_BIT(id) (1U << (id))
+
+httphdr_name_t httphdr_parse(const char *, size_t, const char **, size_t *)
+               NONNULL(1,3,4);
+int httphdr_has_token(const char *, size_t, const char *) NONNULL(3);
+int httphdr_last_token(const char *, size_t, const char *) NONNULL(3);
+int httphdr_token_ull(const char *, size_t, const char *,
+                      unsigned long long *) NONNULL(3,4) WUNRES;
+int httphdr_equals(const char *, size_t, const char *) NONNULL(3);
+int httphdr_to_ull(const char *, size_t, unsigned long long *) NONNULL(3);
+int httphdr_length(const char *, size_t, unsigned long long *) NONNULL(3)
+    WUNRES;
+int httphdr_method_idempotent(const char *, size_t) NONNULL(1);
+
+#endif /* !HTTPHDR_H */
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,255 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "httphdr.h"
+
+#include <string.h>
+
+#include <check.h>
+
+#define PARSE(l, v, vsz) httphdr_parse((l), strlen(l), (v), (vsz))
+
+START_TEST(httphdr_parse_01)
+{
+	static const struct {
+		const char *line;
+		httphdr_name_t id;
+	} hdrs[] = {
+		{ "Host: a", HTTPHDR_HOST },
+		{ "Content-Type: a", HTTPHDR_CONTENT_TYPE },
+		{ "Content-Length: a", HTTPHDR_CONTENT_LENGTH },
+		{ "Content-Encoding: a", HTTPHDR_CONTENT_ENCODING },
+		{ "Transfer-Encoding: a", HTTPHDR_TRANSFER_ENCODING },
+		{ "Connection: a", HTTPHDR_CONNECTION },
+		{ "Keep-Alive: a", HTTPHDR_KEEP_ALIVE },
+		{ "Upgrade: a", HTTPHDR_UPGRADE },
+		{ "Accept-Encoding: a", HTTPHDR_ACCEPT_ENCODING },
+		{ "Public-Key-Pins: a", HTTPHDR_PUBLIC_KEY_PINS },
+		{ "Public-Key-Pins-Report-Only: a",
+		  HTTPHDR_PUBLIC_KEY_PINS_REPORT_ONLY },
+		{ "Strict-Transport-Security: a",
+		  HTTPHDR_STRICT_TRANSPORT_SECURITY },
+		{ "Expect-CT: a", HTTPHDR_EXPECT_CT },
+		{ "Alternate-Protocol: a", HTTPHDR_ALTERNATE_PROTOCOL },
+		{ "Authorization: a", HTTPHDR_AUTHORIZATION },
+		{ "Cache-Control: a", HTTPHDR_CACHE_CONTROL },
+		{ "Pragma: a", HTTPHDR_PRAGMA },
+		{ "Range: a", HTTPHDR_RANGE },
+		{ "If-None-Match: a", HTTPHDR_IF_NONE_MATCH },
+		{ "ETag: a", HTTPHDR_ETAG },
+		{ "Age: a", HTTPHDR_AGE },
+		{ "Vary: a", HTTPHDR_VARY },
+		{ "Set-Cookie: a", HTTPHDR_SET_COOKIE },
+		{ "hOST: a", HTTPHDR_HOST },
+		{ "STRICT-TRANSPORT-SECURITY: a",
+		  HTTPHDR_STRICT_TRANSPORT_SECURITY },
+	};
+	const char *value;
+	size_t valuesz;
+
+	for (size_t i = 0; i < sizeof(hdrs) / sizeof(hdrs[0]); i++) {
+		fail_unless(PARSE(hdrs[i].line, &value, &valuesz) ==
+		            hdrs[i].id, "wrong id for %s", hdrs[i].line);
+		fail_unless(valuesz == 1 && value[0] == 'a',
+		            "wrong value for %s", hdrs[i].line);
+	}
+}
+END_TEST
+
+START_TEST(httphdr_parse_02)
+{
+	const char *value;
+	size_t valuesz;
+
+	fail_unless(PARSE("Hosts: a", &value, &valuesz) == HTTPHDR_OTHER,
+	            "longer name matched");
+	fail_unless(PARSE("Hos: a", &value, &valuesz) == HTTPHDR_OTHER,
+	            "shorter name matched");
+	fail_unless(PARSE("Host : a", &value, &valuesz) == HTTPHDR_OTHER,
+	            "name with whitespace matched");
+	fail_unless(PARSE("Hxxt: a", &value, &valuesz) == HTTPHDR_OTHER,
+	            "colliding name matched");
+	fail_unless(PARSE(": a", &value, &valuesz) == HTTPHDR_OTHER,
+	            "empty name matched");
+	fail_unless(PARSE("X-Foo:\t  bar ", &value, &valuesz) ==
+	            HTTPHDR_OTHER, "unknown name matched");
+	fail_unless(valuesz == 4 && !memcmp(value, "bar ", 4),
+	            "wrong value");
+	fail_unless(PARSE("Host", &value, &valuesz) == HTTPHDR_OTHER,
+	            "line without colon matched");
+	fail_unless(value == NULL && valuesz == 0, "value without colon");
+	fail_unless(httphdr_parse("Host: a", 4, &value, &valuesz) ==
+	            HTTPHDR_OTHER, "parsed beyond line");
+}
+END_TEST
+
+START_TEST(httphdr_has_token_01)
+{
+	static const char *v = "keep-alive, Upgrade;q=1";
+
+	fail_unless(httphdr_has_token(v, strlen(v), "upgrade"),
+	            "token not found");
+	fail_unless(httphdr_has_token(v, strlen(v), "keep-alive"),
+	            "first token not found");
+	fail_unless(!httphdr_has_token(v, strlen(v), "keep"),
+	            "prefix of token found");
+	fail_unless(!httphdr_has_token(v, 10, "upgrade"),
+	            "token found beyond value");
+	fail_unless(httphdr_has_token("gzip", 4, "gzip"),
+	            "unterminated token not found");
+	fail_unless(!httphdr_has_token("gzi", 3, "gzip"),
+	            "truncated token found");
+	fail_unless(!httphdr_has_token("", 0, "gzip"),
+	            "token found in empty value");
+	fail_unless(httphdr_has_token("no-cache=\"a\"", 12, "no-cache"),
+	            "token with argument not found");
+}
+END_TEST
+
+START_TEST(httphdr_token_ull_01)
+{
+	static const char *v = "public, max-age=600, s-maxage=\"60\"";
+	unsigned long long n;
+
+	fail_unless(httphdr_token_ull(v, strlen(v), "max-age", &n) == 0 &&
+	            n == 600, "directive not parsed");
+	fail_unless(httphdr_token_ull(v, strlen(v), "S-MaxAge", &n) == 0 &&
+	            n == 60, "quoted directive not parsed");
+	fail_unless(httphdr_token_ull(v, strlen(v), "public", &n) == -1,
+	            "directive without argument parsed");
+	fail_unless(httphdr_token_ull(v, strlen(v), "age", &n) == -1,
+	            "suffix of directive parsed");
+	fail_unless(httphdr_token_ull(v, 15, "max-age", &n) == -1,
+	            "directive parsed beyond value");
+	fail_unless(httphdr_token_ull("max-age=x", 9, "max-age", &n) == -1,
+	            "non-numeric argument parsed");
+}
+END_TEST
+
+START_TEST(httphdr_equals_01)
+{
+	fail_unless(httphdr_equals("GZip", 4, "gzip"), "not equal");
+	fail_unless(!httphdr_equals("gzip ", 5, "gzip"), "equal with ws");
+	fail_unless(!httphdr_equals("gzip", 3, "gzip"), "equal truncated");
+	fail_unless(!httphdr_equals(NULL, 0, ""), "equal to NULL");
+}
+END_TEST
+
+START_TEST(httphdr_to_ull_01)
+{
+	unsigned long long n;
+
+	fail_unless(httphdr_to_ull("1234", 4, &n) == 0 && n == 1234,
+	            "not parsed");
+	fail_unless(httphdr_to_ull("12345", 2, &n) == 0 && n == 12,
+	            "parsed beyond value");
+	fail_unless(httphdr_to_ull("42 ", 3, &n) == 0 && n == 42,
+	            "trailing characters not ignored");
+	fail_unless(httphdr_to_ull("x", 1, &n) == -1, "no digits parsed");
+	fail_unless(httphdr_to_ull("99999999999999999999", 20, &n) == -1,
+	            "overflow not detected");
+}
+END_TEST
+
+START_TEST(httphdr_last_token_01)
+{
+	fail_unless(httphdr_last_token("chunked", 7, "chunked"), "single");
+	fail_unless(httphdr_last_token("gzip, Chunked ", 14, "chunked"),
+	            "last");
+	fail_unless(httphdr_last_token("gzip,chunked;x=1", 16, "chunked"),
+	            "last with parameter");
+	fail_unless(!httphdr_last_token("chunked, gzip", 13, "chunked"),
+	            "not last");
+	fail_unless(!httphdr_last_token("gzip, chunkedx", 14, "chunked"),
+	            "prefix");
+	fail_unless(!httphdr_last_token("", 0, "chunked"), "empty");
+	fail_unless(!httphdr_last_token(NULL, 0, "chunked"), "NULL");
+}
+END_TEST
+
+START_TEST(httphdr_length_01)
+{
+	unsigned long long n;
+
+	fail_unless(httphdr_length("1234", 4, &n) == 0 && n == 1234,
+	            "not parsed");
+	fail_unless(httphdr_length("42 \t", 4, &n) == 0 && n == 42,
+	            "trailing whitespace not ignored");
+	fail_unless(httphdr_length("42, 42", 6, &n) == -1, "list parsed");
+	fail_unless(httphdr_length("42x", 3, &n) == -1, "garbage parsed");
+	fail_unless(httphdr_length("", 0, &n) == -1, "empty parsed");
+	fail_unless(httphdr_length("99999999999999999999", 20, &n) == -1,
+	            "overflow not detected");
+}
+END_TEST
+
+START_TEST(httphdr_method_idempotent_01)
+{
+	fail_unless(httphdr_method_idempotent("GET", 3), "GET");
+	fail_unless(httphdr_method_idempotent("HEAD", 4), "HEAD");
+	fail_unless(httphdr_method_idempotent("DELETE", 6), "DELETE");
+	fail_unless(httphdr_method_idempotent("GET /", 3), "GET prefix");
+	fail_unless(!httphdr_method_idempotent("POST", 4), "POST");
+	fail_unless(!httphdr_method_idempotent("PATCH", 5), "PATCH");
+	fail_unless(!httphdr_method_idempotent("get", 3), "case ignored");
+	fail_unless(!httphdr_method_idempotent("GE", 2), "GE");
+	fail_unless(!httphdr_method_idempotent("GETS", 4), "GETS");
+}
+END_TEST
+
+Suite *
+httphdr_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("httphdr");
+
+	tc = tcase_create("httphdr_parse");
+	tcase_add_test(tc, httphdr_parse_01);
+	tcase_add_test(tc, httphdr_parse_02);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("httphdr_value");
+	tcase_add_test(tc, httphdr_has_token_01);
+	tcase_add_test(tc, httphdr_last_token_01);
+	tcase_add_test(tc, httphdr_token_ull_01);
+	tcase_add_test(tc, httphdr_equals_01);
+	tcase_add_test(tc, httphdr_to_ull_01);
+	tcase_add_test(tc, httphdr_length_01);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("httphdr_method");
+	tcase_add_test(tc, httphdr_method_idempotent_01);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
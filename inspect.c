@@ -0,0 +1,287 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "inspect.h"
+
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <dlfcn.h>
+
+#include <event2/buffer.h>
+
+/*
+ * Registry of content inspection plugins and per-connection dispatch.
+ * Plugins are registered once at startup before any connection is handled
+ * and are not changed afterwards, so the registry is read without locking.
+ */
+
+/* iovecs passed to the data callback per call */
+#define INSPECT_IOVMAX	16
+
+typedef struct inspect_entry {
+	const inspect_plugin_t *plugin;
+	void *handle;                   /* dlopen handle or NULL */
+} inspect_entry_t;
+
+static inspect_entry_t inspect_plugins[INSPECT_MAXPLUGINS];
+static int inspect_nplugins = 0;
+
+struct inspect_ctx {
+	inspect_conn_t conn;
+	struct sockaddr_storage srcaddr;
+	struct sockaddr_storage dstaddr;
+	char *sni;
+	/* bit i set if plugin i inspects the connection */
+	unsigned int active;
+	void *state[INSPECT_MAXPLUGINS];
+};
+
+/*
+ * Register plugin, calling its init callback with arg.  The plugin is not
+ * unloaded by inspect_fini().
+ * Returns 0 on success, -1 on failure.
+ */
+int
+inspect_register(const inspect_plugin_t *plugin, const char *arg)
+{
+	if (inspect_nplugins == INSPECT_MAXPLUGINS) {
+		log_err_printf("Too many inspection plugins, maximum is %i\n",
+		               INSPECT_MAXPLUGINS);
+		return -1;
+	}
+	if (plugin->abi != INSPECT_ABI_VERSION || !plugin->name ||
+	    !plugin->data) {
+		log_err_printf("Inspection plugin %s is incompatible "
+		               "(ABI %u, expected %u)\n",
+		               plugin->name ? plugin->name : "?",
+		               plugin->abi, INSPECT_ABI_VERSION);
+		return -1;
+	}
+	if (plugin->init && plugin->init(arg) == -1) {
+		log_err_printf("Failed to initialize inspection plugin %s\n",
+		               plugin->name);
+		return -1;
+	}
+	inspect_plugins[inspect_nplugins].plugin = plugin;
+	inspect_plugins[inspect_nplugins].handle = NULL;
+	inspect_nplugins++;
+	return 0;
+}
+
+/*
+ * Load and register the plugin from the shared object at the path in spec,
+ * optionally followed by whitespace and an argument passed to its init
+ * callback.
+ * Returns 0 on success, -1 on failure.
+ */
+int
+inspect_load(const char *spec)
+{
+	const inspect_plugin_t *plugin;
+	const char *arg;
+	char *path;
+	void *handle;
+	size_t len;
+
+	for (len = 0; spec[len] && !isspace((unsigned char)spec[len]); len++);
+	for (arg = spec + len; isspace((unsigned char)*arg); arg++);
+	if (!*arg)
+		arg = NULL;
+	if (!(path = malloc(len + 1)))
+		return -1;
+	memcpy(path, spec, len);
+	path[len] = '\0';
+
+	if (!(handle = dlopen(path, RTLD_NOW|RTLD_LOCAL))) {
+		log_err_printf("Failed to load inspection plugin %s: %s\n",
+		               path, dlerror());
+		goto errout;
+	}
+	if (!(plugin = dlsym(handle, INSPECT_SYMBOL))) {
+		log_err_printf("Failed to load inspection plugin %s: "
+		               "no symbol %s\n", path, INSPECT_SYMBOL);
+		goto errout;
+	}
+	if (inspect_register(plugin, arg) == -1)
+		goto errout;
+	inspect_plugins[inspect_nplugins - 1].handle = handle;
+	log_dbg_printf("Loaded inspection plugin %s from %s\n",
+	               plugin->name, path);
+	free(path);
+	return 0;
+
+errout:
+	if (handle)
+		dlclose(handle);
+	free(path);
+	return -1;
+}
+
+/*
+ * Return the number of plugins registered.
+ */
+int
+inspect_count(void)
+{
+	return inspect_nplugins;
+}
+
+/*
+ * Finalize and unload all plugins, in reverse order of registration.
+ * No connections may be inspected anymore.
+ */
+void
+inspect_fini(void)
+{
+	while (inspect_nplugins > 0) {
+		inspect_entry_t *e = &inspect_plugins[--inspect_nplugins];
+
+		if (e->plugin->fini)
+			e->plugin->fini();
+		if (e->handle)
+			dlclose(e->handle);
+	}
+}
+
+/*
+ * Set up inspection of a new connection by all registered plugins.
+ * Returns the per-connection context or NULL if out of memory.
+ */
+inspect_ctx_t *
+inspect_conn_new(const char *proto,
+                 const struct sockaddr *srcaddr, socklen_t srcaddrlen,
+                 const struct sockaddr *dstaddr, socklen_t dstaddrlen,
+                 const char *sni, int thridx)
+{
+	inspect_ctx_t *ctx;
+
+	if (!(ctx = calloc(1, sizeof(inspect_ctx_t))))
+		return NULL;
+	if (sni && !(ctx->sni = strdup(sni))) {
+		free(ctx);
+		return NULL;
+	}
+	memcpy(&ctx->srcaddr, srcaddr, srcaddrlen);
+	memcpy(&ctx->dstaddr, dstaddr, dstaddrlen);
+	ctx->conn.proto = proto;
+	ctx->conn.srcaddr = (struct sockaddr *)&ctx->srcaddr;
+	ctx->conn.srcaddrlen = srcaddrlen;
+	ctx->conn.dstaddr = (struct sockaddr *)&ctx->dstaddr;
+	ctx->conn.dstaddrlen = dstaddrlen;
+	ctx->conn.sni = ctx->sni;
+	ctx->conn.thridx = thridx;
+
+	for (int i = 0; i < inspect_nplugins; i++) {
+		const inspect_plugin_t *plugin = inspect_plugins[i].plugin;
+
+		if (!plugin->conn_new ||
+		    plugin->conn_new(&ctx->conn, &ctx->state[i]) == 0)
+			ctx->active |= 1U << i;
+	}
+	return ctx;
+}
+
+/*
+ * Pass the first sz octets in buf, read from the client if req is 1 or
+ * from the server if req is 0, to the plugins inspecting the connection.
+ * The plugins see the octets in place in the chains of buf, in calls of
+ * at most INSPECT_IOVMAX iovecs each; buf is not modified.
+ * Returns INSPECT_PASS, or INSPECT_DROP if a plugin asked to terminate the
+ * connection.
+ */
+int
+inspect_conn_data(inspect_ctx_t *ctx, struct evbuffer *buf, size_t sz,
+                  int req)
+{
+	struct evbuffer_iovec vec[INSPECT_IOVMAX];
+	struct iovec iov[INSPECT_IOVMAX];
+	struct evbuffer_ptr ptr;
+	size_t len;
+	int n;
+
+	if (!ctx->active || sz == 0)
+		return INSPECT_PASS;
+	if (evbuffer_ptr_set(buf, &ptr, 0, EVBUFFER_PTR_SET) == -1)
+		return INSPECT_PASS;
+	while (sz > 0) {
+		n = evbuffer_peek(buf, sz, &ptr, vec, INSPECT_IOVMAX);
+		if (n <= 0)
+			break;
+		if (n > INSPECT_IOVMAX)
+			n = INSPECT_IOVMAX;
+		len = 0;
+		for (int i = 0; i < n; i++) {
+			iov[i].iov_base = vec[i].iov_base;
+			iov[i].iov_len = vec[i].iov_len;
+			if (iov[i].iov_len > sz - len)
+				iov[i].iov_len = sz - len;
+			len += iov[i].iov_len;
+		}
+		for (int i = 0; i < inspect_nplugins; i++) {
+			const inspect_plugin_t *plugin;
+
+			if (!(ctx->active & (1U << i)))
+				continue;
+			plugin = inspect_plugins[i].plugin;
+			if (plugin->data(&ctx->conn, ctx->state[i], req,
+			                 iov, n) != INSPECT_PASS) {
+				log_err_rl_printf("Connection dropped by "
+				                  "inspection plugin %s\n",
+				                  plugin->name);
+				return INSPECT_DROP;
+			}
+		}
+		sz -= len;
+		if (sz > 0 && evbuffer_ptr_set(buf, &ptr, len,
+		                               EVBUFFER_PTR_ADD) == -1)
+			break;
+	}
+	return INSPECT_PASS;
+}
+
+/*
+ * Tear down inspection of a connection that was closed.
+ */
+void
+inspect_conn_free(inspect_ctx_t *ctx)
+{
+	for (int i = 0; i < inspect_nplugins; i++) {
+		const inspect_plugin_t *plugin = inspect_plugins[i].plugin;
+
+		if ((ctx->active & (1U << i)) && plugin->conn_free)
+			plugin->conn_free(&ctx->conn, ctx->state[i]);
+	}
+	if (ctx->sni)
+		free(ctx->sni);
+	free(ctx);
+}
+
+/* vim: set noet ft=c: */
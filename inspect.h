@@ -0,0 +1,112 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef INSPECT_H
+#define INSPECT_H
+
+#include "attrib.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/*
+ * Content inspection plugin interface.
+ *
+ * A plugin is a shared object exporting an inspect_plugin_t named
+ * INSPECT_SYMBOL.  For every connection, conn_new is called before the first
+ * octets are forwarded; if it returns 0, data is called with the octets read
+ * from either peer, in order, before they are forwarded.  The octets are
+ * passed as read-only iovecs pointing into the connection's input buffers
+ * and are only valid during the call.  Callbacks are called from the
+ * connection handling threads, concurrently for different connections, and
+ * block forwarding on the connection while they run.
+ */
+
+#define INSPECT_ABI_VERSION	1
+#define INSPECT_SYMBOL		"sslsplit_inspect_plugin"
+
+/* return values of the data callback */
+#define INSPECT_PASS		0	/* forward the octets */
+#define INSPECT_DROP		1	/* terminate the connection */
+
+/* connection metadata, valid until conn_free */
+typedef struct inspect_conn {
+	const char *proto;              /* "tcp", "ssl", "http" or "https" */
+	const struct sockaddr *srcaddr;
+	socklen_t srcaddrlen;
+	const struct sockaddr *dstaddr;
+	socklen_t dstaddrlen;
+	const char *sni;                /* SNI sent by the client or NULL */
+	int thridx;                     /* connection handling thread */
+} inspect_conn_t;
+
+typedef struct inspect_plugin {
+	unsigned int abi;               /* INSPECT_ABI_VERSION */
+	const char *name;
+	/* optional, called once with the argument configured, or NULL;
+	 * returns 0 on success, -1 on failure */
+	int (*init)(const char *);
+	/* optional, called once before exiting */
+	void (*fini)(void);
+	/* optional, returns 0 to inspect the connection, setting the
+	 * per-connection state passed to the other callbacks, or -1 */
+	int (*conn_new)(const inspect_conn_t *, void **);
+	/* called with 1 for octets from the client and 0 for octets from
+	 * the server; returns INSPECT_PASS or INSPECT_DROP */
+	int (*data)(const inspect_conn_t *, void *, int,
+	            const struct iovec *, int);
+	/* optional, called once the connection is closed */
+	void (*conn_free)(const inspect_conn_t *, void *);
+} inspect_plugin_t;
+
+/* maximum number of plugins loaded */
+#define INSPECT_MAXPLUGINS	8
+
+#ifndef INSPECT_PLUGIN
+struct evbuffer;
+typedef struct inspect_ctx inspect_ctx_t;
+
+int inspect_register(const inspect_plugin_t *, const char *) NONNULL(1)
+    WUNRES;
+int inspect_load(const char *) NONNULL(1) WUNRES;
+int inspect_count(void) WUNRES;
+void inspect_fini(void);
+
+inspect_ctx_t * inspect_conn_new(const char *,
+                                 const struct sockaddr *, socklen_t,
+                                 const struct sockaddr *, socklen_t,
+                                 const char *, int) NONNULL(1,2,4) MALLOC;
+int inspect_conn_data(inspect_ctx_t *, struct evbuffer *, size_t, int)
+    NONNULL(1,2) WUNRES;
+void inspect_conn_free(inspect_ctx_t *) NONNULL(1);
+#endif /* !INSPECT_PLUGIN */
+
+#endif /* !INSPECT_H */
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,250 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "inspect.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <netinet/in.h>
+
+#include <event2/buffer.h>
+
+#include <check.h>
+
+/* test plugin recording what it was passed */
+static char seen[2][256];
+static size_t seenlen[2];
+static const void *seenbase;
+static int calls, conns, frees, inits;
+static int refuse;
+
+static int
+test_init(const char *arg)
+{
+	inits++;
+	return (arg && !strcmp(arg, "fail")) ? -1 : 0;
+}
+
+static int
+test_conn_new(const inspect_conn_t *conn, void **state)
+{
+	if (refuse)
+		return -1;
+	conns++;
+	*state = (void *)conn->proto;
+	return 0;
+}
+
+static int
+test_data(UNUSED const inspect_conn_t *conn, UNUSED void *state, int req,
+          const struct iovec *iov, int iovcnt)
+{
+	calls++;
+	if (!seenbase)
+		seenbase = iov[0].iov_base;
+	for (int i = 0; i < iovcnt; i++) {
+		if (seenlen[req] + iov[i].iov_len > sizeof(seen[req]))
+			return INSPECT_DROP;
+		memcpy(seen[req] + seenlen[req], iov[i].iov_base,
+		       iov[i].iov_len);
+		seenlen[req] += iov[i].iov_len;
+	}
+	if (memmem(seen[req], seenlen[req], "DROP", 4))
+		return INSPECT_DROP;
+	return INSPECT_PASS;
+}
+
+static void
+test_conn_free(UNUSED const inspect_conn_t *conn, void *state)
+{
+	fail_unless(!strcmp(state, "tcp"), "wrong state");
+	frees++;
+}
+
+static const inspect_plugin_t test_plugin = {
+	INSPECT_ABI_VERSION, "test",
+	test_init, NULL, test_conn_new, test_data, test_conn_free
+};
+
+static struct sockaddr_in addr;
+
+static inspect_ctx_t *
+test_conn(void)
+{
+	return inspect_conn_new("tcp", (struct sockaddr *)&addr, sizeof(addr),
+	                        (struct sockaddr *)&addr, sizeof(addr),
+	                        NULL, 0);
+}
+
+static void
+inspect_setup(void)
+{
+	memset(seen, 0, sizeof(seen));
+	memset(seenlen, 0, sizeof(seenlen));
+	seenbase = NULL;
+	calls = conns = frees = inits = refuse = 0;
+	addr.sin_family = AF_INET;
+	fail_unless(inspect_register(&test_plugin, NULL) == 0,
+	            "register failed");
+}
+
+static void
+inspect_teardown(void)
+{
+	inspect_fini();
+}
+
+START_TEST(inspect_01)
+{
+	static char chunk[3][32];
+	struct evbuffer *buf;
+	inspect_ctx_t *ctx;
+
+	buf = evbuffer_new();
+	for (int i = 0; i < 3; i++) {
+		memset(chunk[i], 'a' + i, sizeof(chunk[i]));
+		evbuffer_add_reference(buf, chunk[i], sizeof(chunk[i]),
+		                       NULL, NULL);
+	}
+	ctx = test_conn();
+	fail_unless(!!ctx, "no ctx");
+	fail_unless(conns == 1, "conn_new not called");
+	fail_unless(inspect_conn_data(ctx, buf, 80, 1) == INSPECT_PASS,
+	            "dropped");
+	fail_unless(seenlen[1] == 80, "wrong length");
+	fail_unless(seenlen[0] == 0, "wrong direction");
+	fail_unless(seen[1][0] == 'a' && seen[1][32] == 'b' &&
+	            seen[1][64] == 'c' && seen[1][79] == 'c',
+	            "wrong octets");
+	fail_unless(seenbase == chunk[0], "octets were copied");
+	fail_unless(evbuffer_get_length(buf) == 96, "buffer modified");
+	inspect_conn_free(ctx);
+	fail_unless(frees == 1, "conn_free not called");
+	evbuffer_free(buf);
+}
+END_TEST
+
+START_TEST(inspect_02)
+{
+	struct evbuffer *buf;
+	inspect_ctx_t *ctx;
+	char c = 'x';
+
+	/* more chains than iovecs per call */
+	buf = evbuffer_new();
+	for (int i = 0; i < 40; i++) {
+		evbuffer_add_reference(buf, &c, 1, NULL, NULL);
+	}
+	ctx = test_conn();
+	fail_unless(inspect_conn_data(ctx, buf, 40, 0) == INSPECT_PASS,
+	            "dropped");
+	fail_unless(seenlen[0] == 40, "wrong length");
+	fail_unless(calls == 3, "wrong number of calls");
+	fail_unless(inspect_conn_data(ctx, buf, 0, 0) == INSPECT_PASS,
+	            "dropped");
+	fail_unless(calls == 3, "called without octets");
+	inspect_conn_free(ctx);
+	evbuffer_free(buf);
+}
+END_TEST
+
+START_TEST(inspect_03)
+{
+	struct evbuffer *buf;
+	inspect_ctx_t *ctx;
+
+	buf = evbuffer_new();
+	evbuffer_add(buf, "GET /DR", 7);
+	ctx = test_conn();
+	fail_unless(inspect_conn_data(ctx, buf, 7, 1) == INSPECT_PASS,
+	            "dropped early");
+	evbuffer_drain(buf, 7);
+	evbuffer_add(buf, "OP HTTP/1.1\r\n", 13);
+	fail_unless(inspect_conn_data(ctx, buf, 13, 1) == INSPECT_DROP,
+	            "not dropped");
+	inspect_conn_free(ctx);
+	evbuffer_free(buf);
+}
+END_TEST
+
+START_TEST(inspect_04)
+{
+	struct evbuffer *buf;
+	inspect_ctx_t *ctx;
+
+	refuse = 1;
+	buf = evbuffer_new();
+	evbuffer_add(buf, "DROP", 4);
+	ctx = test_conn();
+	fail_unless(inspect_conn_data(ctx, buf, 4, 1) == INSPECT_PASS,
+	            "inspected without conn_new");
+	fail_unless(calls == 0, "data called without conn_new");
+	inspect_conn_free(ctx);
+	fail_unless(frees == 0, "conn_free called without conn_new");
+	evbuffer_free(buf);
+}
+END_TEST
+
+START_TEST(inspect_05)
+{
+	inspect_plugin_t plugin = test_plugin;
+
+	plugin.abi = INSPECT_ABI_VERSION + 1;
+	fail_unless(inspect_register(&plugin, NULL) == -1,
+	            "registered incompatible plugin");
+	fail_unless(inspect_register(&test_plugin, "fail") == -1,
+	            "registered plugin failing init");
+	fail_unless(inspect_count() == 1, "wrong count");
+	fail_unless(inspect_load("/nonexistent.so arg") == -1,
+	            "loaded nonexistent plugin");
+	fail_unless(inspect_count() == 1, "wrong count");
+}
+END_TEST
+
+Suite *
+inspect_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("inspect");
+
+	tc = tcase_create("inspect");
+	tcase_add_checked_fixture(tc, inspect_setup, inspect_teardown);
+	tcase_add_test(tc, inspect_01);
+	tcase_add_test(tc, inspect_02);
+	tcase_add_test(tc, inspect_03);
+	tcase_add_test(tc, inspect_04);
+	tcase_add_test(tc, inspect_05);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,480 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "iouring.h"
+
+#ifdef HAVE_IOURING
+#include "log.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/*
+ * Minimal io_uring wrapper driving a submission and completion ring from a
+ * libevent event base, using the raw system calls instead of liburing.
+ *
+ * Operations are submitted from the thread running the event base.  The
+ * ring file descriptor becomes readable when completions are available; the
+ * read event reaps all of them and calls the callbacks of their operations.
+ * Operations queued from within callbacks are submitted together in a single
+ * io_uring_enter() call after all completions have been processed, all
+ * others are submitted immediately.
+ *
+ * A pool of equally sized buffers is registered with the kernel if
+ * possible, such that receives into them can use IORING_OP_READ_FIXED
+ * without the kernel mapping the pages on every call.  Sends always use
+ * IORING_OP_SEND with MSG_NOSIGNAL.
+ */
+
+struct iouring {
+	int fd;
+	struct event *ev;
+	/* submission queue */
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_flags;
+	unsigned int *sq_array;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int sq_local_tail;
+	unsigned int to_submit;
+	struct io_uring_sqe *sqes;
+	/* completion queue */
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+	/* mappings */
+	void *sq_ring;
+	size_t sq_ring_sz;
+	void *cq_ring;
+	size_t cq_ring_sz;
+	size_t sqes_sz;
+	/* buffer pool */
+	unsigned char *bufmem;
+	size_t bufsz;
+	unsigned int nbufs;
+	int *freebufs;
+	unsigned int nfree;
+	unsigned int fixed : 1;         /* buffers are registered */
+	unsigned int reaping : 1;       /* 1 while calling callbacks */
+};
+
+static int
+iouring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+iouring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+              unsigned int flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+	                    flags, NULL, 0);
+}
+
+static int
+iouring_register(int fd, unsigned int opcode, void *arg, unsigned int nargs)
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nargs);
+}
+
+/*
+ * Submit all queued operations.
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+iouring_submit(iouring_t *ring)
+{
+	int n;
+
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+	while (ring->to_submit > 0) {
+		n = iouring_enter(ring->fd, ring->to_submit, 0, 0);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EBUSY) {
+				/* retried after the next completions */
+				return 0;
+			}
+			log_err_printf("Error from io_uring_enter: %s (%i)\n",
+			               strerror(errno), errno);
+			return -1;
+		}
+		ring->to_submit -= n;
+	}
+	return 0;
+}
+
+static void
+iouring_reap(iouring_t *ring)
+{
+	struct io_uring_cqe *cqe;
+	iouring_op_t *op;
+	unsigned int head, tail;
+	int res;
+
+	ring->reaping = 1;
+	for (;;) {
+		head = *ring->cq_head;
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			/* flush completions the kernel had to hold back */
+			if (!(__atomic_load_n(ring->sq_flags, __ATOMIC_RELAXED) &
+			      IORING_SQ_CQ_OVERFLOW))
+				break;
+			if (iouring_enter(ring->fd, 0, 0,
+			                  IORING_ENTER_GETEVENTS) == -1 &&
+			    errno != EINTR)
+				break;
+			continue;
+		}
+		cqe = &ring->cqes[head & ring->cq_mask];
+		op = (iouring_op_t *)(uintptr_t)cqe->user_data;
+		res = cqe->res;
+		__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+		if (op)
+			op->cb(op, res);
+	}
+	ring->reaping = 0;
+	if (ring->to_submit > 0)
+		iouring_submit(ring);
+}
+
+static void
+iouring_readcb(UNUSED evutil_socket_t fd, UNUSED short what, void *arg)
+{
+	iouring_reap(arg);
+}
+
+/*
+ * Create a ring with room for entries submitted operations and a pool of
+ * nbufs buffers of bufsz octets each, driven by evbase.
+ * Returns NULL on failure, e.g. if the kernel does not support io_uring.
+ */
+iouring_t *
+iouring_new(struct event_base *evbase, unsigned int entries,
+            unsigned int nbufs, size_t bufsz)
+{
+	struct io_uring_params p;
+	struct iovec *iov = NULL;
+	iouring_t *ring;
+	unsigned char *sq, *cq;
+
+	if (!(ring = malloc(sizeof(iouring_t))))
+		return NULL;
+	memset(ring, 0, sizeof(iouring_t));
+	ring->sq_ring = ring->cq_ring = MAP_FAILED;
+	ring->sqes = MAP_FAILED;
+	ring->bufmem = MAP_FAILED;
+
+	memset(&p, 0, sizeof(p));
+	if ((ring->fd = iouring_setup(entries, &p)) == -1) {
+		log_dbg_printf("Error from io_uring_setup: %s (%i)\n",
+		               strerror(errno), errno);
+		free(ring);
+		return NULL;
+	}
+	if (!(p.features & IORING_FEAT_NODROP)) {
+		log_dbg_printf("io_uring lacks IORING_FEAT_NODROP\n");
+		goto errout;
+	}
+
+	ring->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_sz = p.cq_off.cqes +
+	                   p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_sz > ring->sq_ring_sz)
+			ring->sq_ring_sz = ring->cq_ring_sz;
+		ring->cq_ring_sz = 0;
+	}
+	ring->sq_ring = mmap(NULL, ring->sq_ring_sz, PROT_READ|PROT_WRITE,
+	                     MAP_SHARED|MAP_POPULATE, ring->fd,
+	                     IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		goto errout;
+	if (ring->cq_ring_sz) {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_sz,
+		                     PROT_READ|PROT_WRITE,
+		                     MAP_SHARED|MAP_POPULATE, ring->fd,
+		                     IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED)
+			goto errout;
+	}
+	ring->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ|PROT_WRITE,
+	                  MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto errout;
+
+	sq = ring->sq_ring;
+	cq = ring->cq_ring_sz ? ring->cq_ring : ring->sq_ring;
+	ring->sq_head = (unsigned int *)(sq + p.sq_off.head);
+	ring->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	ring->sq_flags = (unsigned int *)(sq + p.sq_off.flags);
+	ring->sq_array = (unsigned int *)(sq + p.sq_off.array);
+	ring->sq_mask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+	ring->sq_entries = p.sq_entries;
+	ring->sq_local_tail = *ring->sq_tail;
+	ring->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	ring->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	ring->cq_mask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	if (nbufs > 0) {
+		ring->bufmem = mmap(NULL, nbufs * bufsz, PROT_READ|PROT_WRITE,
+		                    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (ring->bufmem == MAP_FAILED)
+			goto errout;
+		if (!(ring->freebufs = malloc(nbufs * sizeof(int))))
+			goto errout;
+		if (!(iov = malloc(nbufs * sizeof(struct iovec))))
+			goto errout;
+		for (unsigned int i = 0; i < nbufs; i++) {
+			iov[i].iov_base = ring->bufmem + i * bufsz;
+			iov[i].iov_len = bufsz;
+			ring->freebufs[i] = nbufs - 1 - i;
+		}
+		ring->nbufs = ring->nfree = nbufs;
+		ring->bufsz = bufsz;
+		/* may fail on RLIMIT_MEMLOCK; buffers still usable unfixed */
+		if (iouring_register(ring->fd, IORING_REGISTER_BUFFERS,
+		                     iov, nbufs) == 0) {
+			ring->fixed = 1;
+		} else {
+			log_dbg_printf("Failed to register io_uring buffers: "
+			               "%s (%i)\n", strerror(errno), errno);
+		}
+		free(iov);
+		iov = NULL;
+	}
+
+	/* only polled for readability, but libevent insists in debug mode */
+	evutil_make_socket_nonblocking(ring->fd);
+	ring->ev = event_new(evbase, ring->fd, EV_READ|EV_PERSIST,
+	                     iouring_readcb, ring);
+	if (!ring->ev || event_add(ring->ev, NULL) == -1)
+		goto errout;
+	return ring;
+
+errout:
+	if (iov)
+		free(iov);
+	iouring_free(ring);
+	return NULL;
+}
+
+/*
+ * Destroy the ring.  Operations still in flight are cancelled by the kernel
+ * without their callbacks being called.
+ */
+void
+iouring_free(iouring_t *ring)
+{
+	if (ring->ev)
+		event_free(ring->ev);
+	if (ring->fd != -1)
+		close(ring->fd);
+	if (ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_sz);
+	if (ring->cq_ring != MAP_FAILED)
+		munmap(ring->cq_ring, ring->cq_ring_sz);
+	if (ring->sq_ring != MAP_FAILED)
+		munmap(ring->sq_ring, ring->sq_ring_sz);
+	if (ring->bufmem != MAP_FAILED)
+		munmap(ring->bufmem, ring->nbufs * ring->bufsz);
+	if (ring->freebufs)
+		free(ring->freebufs);
+	free(ring);
+}
+
+/*
+ * Take a buffer from the pool and set *buf to its memory.
+ * Returns the buffer index, or -1 if the pool is exhausted.
+ */
+int
+iouring_buf_get(iouring_t *ring, unsigned char **buf)
+{
+	int idx;
+
+	if (ring->nfree == 0)
+		return -1;
+	idx = ring->freebufs[--ring->nfree];
+	*buf = ring->bufmem + (size_t)idx * ring->bufsz;
+	return idx;
+}
+
+void
+iouring_buf_put(iouring_t *ring, int idx)
+{
+	ring->freebufs[ring->nfree++] = idx;
+}
+
+size_t
+iouring_buf_size(iouring_t *ring)
+{
+	return ring->bufsz;
+}
+
+/*
+ * Return a cleared submission queue entry for op, or NULL if the submission
+ * queue is full even after submitting everything queued.
+ */
+static struct io_uring_sqe *
+iouring_sqe(iouring_t *ring, iouring_op_t *op)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int idx;
+
+	if (ring->sq_local_tail - __atomic_load_n(ring->sq_head,
+	                                          __ATOMIC_ACQUIRE) >=
+	    ring->sq_entries) {
+		if (iouring_submit(ring) == -1 ||
+		    ring->sq_local_tail - __atomic_load_n(ring->sq_head,
+		                                          __ATOMIC_ACQUIRE) >=
+		    ring->sq_entries) {
+			errno = EBUSY;
+			return NULL;
+		}
+	}
+	idx = ring->sq_local_tail & ring->sq_mask;
+	sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->user_data = (uint64_t)(uintptr_t)op;
+	ring->sq_array[idx] = idx;
+	ring->sq_local_tail++;
+	ring->to_submit++;
+	return sqe;
+}
+
+static int
+iouring_queued(iouring_t *ring)
+{
+	if (ring->reaping)
+		return 0;
+	return iouring_submit(ring);
+}
+
+/*
+ * Receive up to len octets from socket fd into pool buffer buf at offset
+ * off.  Returns 0 if the operation was submitted, -1 otherwise.
+ */
+int
+iouring_recv(iouring_t *ring, iouring_op_t *op, int fd, int buf, size_t off,
+             size_t len)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!(sqe = iouring_sqe(ring, op)))
+		return -1;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)(ring->bufmem +
+	                                  (size_t)buf * ring->bufsz + off);
+	sqe->len = len;
+	if (ring->fixed) {
+		sqe->opcode = IORING_OP_READ_FIXED;
+		sqe->buf_index = buf;
+	} else {
+		sqe->opcode = IORING_OP_RECV;
+	}
+	return iouring_queued(ring);
+}
+
+/*
+ * Send len octets from pool buffer buf at offset off to socket fd.
+ * Returns 0 if the operation was submitted, -1 otherwise.
+ */
+int
+iouring_send(iouring_t *ring, iouring_op_t *op, int fd, int buf, size_t off,
+             size_t len)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!(sqe = iouring_sqe(ring, op)))
+		return -1;
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)(ring->bufmem +
+	                                  (size_t)buf * ring->bufsz + off);
+	sqe->len = len;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	return iouring_queued(ring);
+}
+
+/*
+ * Request cancellation of the operation op in flight; its callback is still
+ * called, usually with -ECANCELED.
+ * Returns 0 if the request was submitted, -1 otherwise.
+ */
+int
+iouring_cancel(iouring_t *ring, iouring_op_t *op)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!(sqe = iouring_sqe(ring, NULL)))
+		return -1;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = (uint64_t)(uintptr_t)op;
+	return iouring_queued(ring);
+}
+#endif /* HAVE_IOURING */
+
+/*
+ * Returns 1 if io_uring is supported by the build and usable with the running
+ * kernel, 0 otherwise.
+ */
+int
+iouring_available(void)
+{
+#ifdef HAVE_IOURING
+	struct io_uring_params p;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+	if ((fd = iouring_setup(1, &p)) == -1)
+		return 0;
+	close(fd);
+	return !!(p.features & IORING_FEAT_NODROP);
+#else /* !HAVE_IOURING */
+	return 0;
+#endif /* !HAVE_IOURING */
+}
+
+/* vim: set noet ft=c: */
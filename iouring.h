@@ -0,0 +1,72 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef IOURING_H
+#define IOURING_H
+
+#include "attrib.h"
+
+int iouring_available(void) WUNRES;
+
+#ifdef HAVE_IOURING
+#include <stddef.h>
+
+#include <event2/event.h>
+
+typedef struct iouring iouring_t;
+typedef struct iouring_op iouring_op_t;
+typedef void (*iouring_cb_t)(iouring_op_t *, int);
+
+/*
+ * Caller-owned state of a submitted operation, usually embedded in a larger
+ * structure.  cb is called on the event base of the ring with the result of
+ * the operation, i.e. the number of octets transferred or -errno.  The
+ * operation must stay valid until then.
+ */
+struct iouring_op {
+	iouring_cb_t cb;
+	void *arg;
+};
+
+iouring_t * iouring_new(struct event_base *, unsigned int, unsigned int,
+                        size_t) NONNULL(1) MALLOC;
+void iouring_free(iouring_t *) NONNULL(1);
+int iouring_buf_get(iouring_t *, unsigned char **) NONNULL(1,2) WUNRES;
+void iouring_buf_put(iouring_t *, int) NONNULL(1);
+size_t iouring_buf_size(iouring_t *) NONNULL(1) WUNRES;
+int iouring_recv(iouring_t *, iouring_op_t *, int, int, size_t, size_t)
+     NONNULL(1,2) WUNRES;
+int iouring_send(iouring_t *, iouring_op_t *, int, int, size_t, size_t)
+     NONNULL(1,2) WUNRES;
+int iouring_cancel(iouring_t *, iouring_op_t *) NONNULL(1,2) WUNRES;
+#endif /* HAVE_IOURING */
+
+#endif /* !IOURING_H */
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,175 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "iouring.h"
+
+#include <sys/socket.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <check.h>
+
+#ifdef HAVE_IOURING
+typedef struct {
+	iouring_op_t op;
+	int res;
+	int calls;
+} test_op_t;
+
+static void
+test_op_cb(iouring_op_t *op, int res)
+{
+	test_op_t *t = (test_op_t *)op;
+
+	t->res = res;
+	t->calls++;
+}
+
+static void
+test_run(struct event_base *evbase, test_op_t *t)
+{
+	while (t->calls == 0)
+		event_base_loop(evbase, EVLOOP_ONCE);
+}
+
+START_TEST(iouring_01)
+{
+	struct event_base *evbase;
+	iouring_t *ring;
+	unsigned char *mem;
+	test_op_t t;
+	char buf[8];
+	int sv[2];
+	int b;
+
+	if (!iouring_available())
+		return;
+	fail_unless(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0,
+	            "socketpair failed");
+	evbase = event_base_new();
+	fail_unless(!!evbase, "no evbase");
+	ring = iouring_new(evbase, 8, 2, 64);
+	fail_unless(!!ring, "iouring_new failed");
+	fail_unless(iouring_buf_size(ring) == 64, "wrong buffer size");
+	b = iouring_buf_get(ring, &mem);
+	fail_unless(b != -1, "no buffer");
+
+	memset(&t, 0, sizeof(t));
+	t.op.cb = test_op_cb;
+	fail_unless(iouring_recv(ring, &t.op, sv[0], b, 0, 64) == 0,
+	            "recv not submitted");
+	fail_unless(write(sv[1], "hello", 5) == 5, "write failed");
+	test_run(evbase, &t);
+	fail_unless(t.res == 5, "wrong recv result");
+	fail_unless(!memcmp(mem, "hello", 5), "wrong data received");
+
+	memset(&t, 0, sizeof(t));
+	t.op.cb = test_op_cb;
+	fail_unless(iouring_send(ring, &t.op, sv[0], b, 1, 4) == 0,
+	            "send not submitted");
+	test_run(evbase, &t);
+	fail_unless(t.res == 4, "wrong send result");
+	fail_unless(read(sv[1], buf, sizeof(buf)) == 4, "read failed");
+	fail_unless(!memcmp(buf, "ello", 4), "wrong data sent");
+
+	iouring_buf_put(ring, b);
+	iouring_free(ring);
+	event_base_free(evbase);
+	close(sv[0]);
+	close(sv[1]);
+}
+END_TEST
+
+START_TEST(iouring_02)
+{
+	struct event_base *evbase;
+	iouring_t *ring;
+	unsigned char *mem;
+	test_op_t t;
+	int sv[2];
+	int b;
+
+	if (!iouring_available())
+		return;
+	fail_unless(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0,
+	            "socketpair failed");
+	evbase = event_base_new();
+	ring = iouring_new(evbase, 8, 1, 64);
+	fail_unless(!!ring, "iouring_new failed");
+	b = iouring_buf_get(ring, &mem);
+	fail_unless(b != -1, "no buffer");
+	fail_unless(iouring_buf_get(ring, &mem) == -1, "pool not exhausted");
+
+	memset(&t, 0, sizeof(t));
+	t.op.cb = test_op_cb;
+	fail_unless(iouring_recv(ring, &t.op, sv[0], b, 0, 64) == 0,
+	            "recv not submitted");
+	fail_unless(iouring_cancel(ring, &t.op) == 0, "cancel not submitted");
+	test_run(evbase, &t);
+	fail_unless(t.res < 0, "cancelled recv did not fail");
+	fail_unless(t.calls == 1, "callback not called once");
+
+	iouring_buf_put(ring, b);
+	iouring_free(ring);
+	event_base_free(evbase);
+	close(sv[0]);
+	close(sv[1]);
+}
+END_TEST
+#endif /* HAVE_IOURING */
+
+START_TEST(iouring_03)
+{
+#ifndef HAVE_IOURING
+	fail_unless(!iouring_available(), "available without support");
+#endif /* !HAVE_IOURING */
+}
+END_TEST
+
+Suite *
+iouring_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("iouring");
+
+	tc = tcase_create("iouring");
+#ifdef HAVE_IOURING
+	tcase_add_test(tc, iouring_01);
+	tcase_add_test(tc, iouring_02);
+#endif /* HAVE_IOURING */
+	tcase_add_test(tc, iouring_03);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
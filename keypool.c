@@ -0,0 +1,207 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "keypool.h"
+
+#include "ssl.h"
+#include "log.h"
+#include "defaults.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/*
+ * Pool of freshly generated leaf keys, such that every forged certificate
+ * can get a key of its own without paying for key generation on the
+ * handshake path.  A background thread keeps the pool filled up to its size;
+ * keypool_get() takes a key out of the pool and wakes up the thread to
+ * replace it.  If the pool has run dry, the key is generated synchronously
+ * by the caller.  Keys are RSA keys of DFLT_LEAFKEY_RSABITS bits, or EC keys
+ * on DFLT_CURVE.
+ */
+
+struct keypool {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t thr;
+	int running;
+	int stopping;
+	int ec;
+	EVP_PKEY **keys;
+	size_t size;
+	size_t count;
+};
+
+static EVP_PKEY *
+keypool_genkey(keypool_t *pool)
+{
+#ifndef OPENSSL_NO_EC
+	if (pool->ec)
+		return ssl_key_genec(DFLT_CURVE);
+#endif /* !OPENSSL_NO_EC */
+	return ssl_key_genrsa(DFLT_LEAFKEY_RSABITS);
+}
+
+/*
+ * Create a key pool of size keys, of EC keys if ec is non-zero and of RSA
+ * keys otherwise.  The pool starts out empty until keypool_run() is called.
+ */
+keypool_t *
+keypool_new(size_t size, int ec)
+{
+	keypool_t *pool;
+
+	if (!(pool = malloc(sizeof(keypool_t))))
+		return NULL;
+	memset(pool, 0, sizeof(keypool_t));
+	if (!(pool->keys = malloc(size * sizeof(EVP_PKEY *))))
+		goto out3;
+	if (pthread_mutex_init(&pool->mutex, NULL))
+		goto out2;
+	if (pthread_cond_init(&pool->cond, NULL))
+		goto out1;
+	pool->size = size;
+	pool->ec = ec;
+	return pool;
+
+out1:
+	pthread_mutex_destroy(&pool->mutex);
+out2:
+	free(pool->keys);
+out3:
+	free(pool);
+	return NULL;
+}
+
+/*
+ * Thread entry point; generates keys while the pool is not full.
+ */
+static void *
+keypool_thr(void *arg)
+{
+	keypool_t *pool = arg;
+	EVP_PKEY *key;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->mutex);
+		while (!pool->stopping && pool->count == pool->size)
+			pthread_cond_wait(&pool->cond, &pool->mutex);
+		if (pool->stopping) {
+			pthread_mutex_unlock(&pool->mutex);
+			break;
+		}
+		pthread_mutex_unlock(&pool->mutex);
+
+		if (!(key = keypool_genkey(pool))) {
+			log_err_printf("Failed to generate key for key pool\n");
+			break;
+		}
+
+		pthread_mutex_lock(&pool->mutex);
+		if (pool->count < pool->size) {
+			pool->keys[pool->count++] = key;
+			key = NULL;
+		}
+		pthread_mutex_unlock(&pool->mutex);
+		if (key)
+			EVP_PKEY_free(key);
+	}
+	return NULL;
+}
+
+/*
+ * Start the key generating thread.  This must be called after forking.
+ * Returns -1 on failure, 0 on success.
+ */
+int
+keypool_run(keypool_t *pool)
+{
+	if (pthread_create(&pool->thr, NULL, keypool_thr, pool))
+		return -1;
+	pool->running = 1;
+	log_dbg_printf("Started key pool of %zu %s keys\n", pool->size,
+	               pool->ec ? "EC" : "RSA");
+	return 0;
+}
+
+/*
+ * Stop the key generating thread and free the pool with all keys in it.
+ */
+void
+keypool_free(keypool_t *pool)
+{
+	if (pool->running) {
+		pthread_mutex_lock(&pool->mutex);
+		pool->stopping = 1;
+		pthread_cond_signal(&pool->cond);
+		pthread_mutex_unlock(&pool->mutex);
+		pthread_join(pool->thr, NULL);
+	}
+	while (pool->count)
+		EVP_PKEY_free(pool->keys[--pool->count]);
+	free(pool->keys);
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool);
+}
+
+/*
+ * Take a key out of the pool, generating one synchronously if the pool is
+ * empty.  Returns a new key owned by the caller, or NULL on error.
+ */
+EVP_PKEY *
+keypool_get(keypool_t *pool)
+{
+	EVP_PKEY *key = NULL;
+
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->count)
+		key = pool->keys[--pool->count];
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+	if (!key)
+		key = keypool_genkey(pool);
+	return key;
+}
+
+/*
+ * Return the number of keys ready in the pool.
+ */
+size_t
+keypool_avail(keypool_t *pool)
+{
+	size_t n;
+
+	pthread_mutex_lock(&pool->mutex);
+	n = pool->count;
+	pthread_mutex_unlock(&pool->mutex);
+	return n;
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,121 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ssl.h"
+#include "keypool.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <check.h>
+
+static void
+keypool_setup(void)
+{
+	if (ssl_init() == -1)
+		exit(EXIT_FAILURE);
+}
+
+static void
+keypool_teardown(void)
+{
+	ssl_fini();
+}
+
+#ifndef OPENSSL_NO_EC
+START_TEST(keypool_01)
+{
+	keypool_t *pool;
+	EVP_PKEY *k1, *k2;
+
+	pool = keypool_new(4, 1);
+	fail_unless(!!pool, "new failed");
+	fail_unless(keypool_avail(pool) == 0, "pool not empty before run");
+	/* empty pool generates synchronously */
+	k1 = keypool_get(pool);
+	fail_unless(!!k1, "no key from empty pool");
+	fail_unless(EVP_PKEY_base_id(k1) == EVP_PKEY_EC, "not an EC key");
+	EVP_PKEY_free(k1);
+	keypool_free(pool);
+
+	pool = keypool_new(4, 1);
+	fail_unless(!!pool, "new failed");
+	fail_unless(keypool_run(pool) == 0, "run failed");
+	for (int i = 0; i < 500 && keypool_avail(pool) < 4; i++)
+		usleep(10000);
+	fail_unless(keypool_avail(pool) == 4, "pool not filled");
+	k1 = keypool_get(pool);
+	k2 = keypool_get(pool);
+	fail_unless(!!k1 && !!k2, "no key from pool");
+	fail_unless(EVP_PKEY_eq(k1, k2) != 1, "same key handed out twice");
+	EVP_PKEY_free(k1);
+	EVP_PKEY_free(k2);
+	for (int i = 0; i < 500 && keypool_avail(pool) < 4; i++)
+		usleep(10000);
+	fail_unless(keypool_avail(pool) == 4, "pool not refilled");
+	keypool_free(pool);
+}
+END_TEST
+#endif /* !OPENSSL_NO_EC */
+
+START_TEST(keypool_02)
+{
+	keypool_t *pool;
+	EVP_PKEY *k;
+
+	pool = keypool_new(1, 0);
+	fail_unless(!!pool, "new failed");
+	fail_unless(keypool_run(pool) == 0, "run failed");
+	k = keypool_get(pool);
+	fail_unless(!!k, "no key from pool");
+	fail_unless(EVP_PKEY_base_id(k) == EVP_PKEY_RSA, "not an RSA key");
+	EVP_PKEY_free(k);
+	keypool_free(pool);
+}
+END_TEST
+
+Suite *
+keypool_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("keypool");
+
+	tc = tcase_create("keypool");
+	tcase_add_checked_fixture(tc, keypool_setup, keypool_teardown);
+#ifndef OPENSSL_NO_EC
+	tcase_add_test(tc, keypool_01);
+#endif /* !OPENSSL_NO_EC */
+	tcase_add_test(tc, keypool_02);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
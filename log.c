@@ -34,6 +34,16 @@
 #include "privsep.h"
 #include "defaults.h"
 #include "logpkt.h"
+#include "logdec.h"
+#include "logseg.h"
+#include "logcas.h"
+#include "logz.h"
+#include "logfdc.h"
+#include "logsync.h"
+#include "logtap.h"
+#include "logstream.h"
+#include "base64.h"
+#include "khash.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -44,6 +54,8 @@
 #include <fcntl.h>
 #include <syslog.h>
 #include <assert.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <netinet/in.h>
 
@@ -92,6 +104,36 @@ log_err_writecb(UNUSED void *fh, UNUSED unsigned long ctl,
 	return -1;
 }
 
+/*
+ * Vectored write callback for the error log; each segment is a NUL
+ * terminated message.
+ */
+static ssize_t
+log_err_writevcb(UNUSED void *fh, UNUSED unsigned long ctl,
+                 const struct iovec *iov, int iovcnt)
+{
+	struct iovec v[iovcnt];
+	ssize_t sz = 0;
+
+	for (int i = 0; i < iovcnt; i++) {
+		v[i].iov_base = iov[i].iov_base;
+		v[i].iov_len = iov[i].iov_len ? iov[i].iov_len - 1 : 0;
+		sz += iov[i].iov_len;
+	}
+	switch (err_mode) {
+		case LOG_ERR_MODE_STDERR:
+			if (sys_writev_all(STDERR_FILENO, v, iovcnt) == -1)
+				return -1;
+			return sz;
+		case LOG_ERR_MODE_SYSLOG:
+			for (int i = 0; i < iovcnt; i++)
+				syslog(LOG_ERR, "%s",
+				       (const char *)iov[i].iov_base);
+			return sz;
+	}
+	return -1;
+}
+
 int
 log_err_printf(const char *fmt, ...)
 {
@@ -120,6 +162,63 @@ log_err_mode(int mode)
 	err_mode = mode;
 }
 
+/*
+ * Error log with rate limiting, for error messages which may be repeated
+ * for every connection or every chunk of data under failure conditions.
+ * While rl suppresses messages, they are only counted, without formatting
+ * them; the next message written is suffixed with the number of messages
+ * suppressed before it.  Safe to call from multiple threads.
+ */
+int
+log_err_ratelimited(log_ratelimit_t *rl, const char *fmt, ...)
+{
+	struct timespec ts;
+	unsigned long suppressed;
+	long long now, next;
+	va_list ap;
+	char *buf, *p;
+	size_t sz;
+	int rv;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		return -1;
+	now = ts.tv_sec;
+	next = __atomic_load_n(&rl->next, __ATOMIC_RELAXED);
+	if (now < next || !__atomic_compare_exchange_n(&rl->next, &next,
+	                          now + LOG_ERR_RATELIMIT_SECS, 0,
+	                          __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		__atomic_add_fetch(&rl->suppressed, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	suppressed = __atomic_exchange_n(&rl->suppressed, 0,
+	                                 __ATOMIC_RELAXED);
+
+	va_start(ap, fmt);
+	rv = vasprintf(&buf, fmt, ap);
+	va_end(ap);
+	if (rv < 0)
+		return -1;
+	if (!suppressed)
+		goto out;
+	sz = strlen(buf);
+	if (sz && buf[sz - 1] == '\n')
+		buf[--sz] = '\0';
+	rv = asprintf(&p, "%s (suppressed %lu repeats)\n", buf, suppressed);
+	free(buf);
+	if (rv < 0)
+		return -1;
+	buf = p;
+out:
+	if (err_shortcut_logger) {
+		return logger_write_freebuf(err_log, NULL, 0,
+		                            buf, strlen(buf) + 1);
+	} else {
+		log_err_writecb(NULL, 0, (unsigned char*)buf, strlen(buf) + 1);
+		free(buf);
+	}
+	return 0;
+}
+
 
 /*
  * Debug log.  Redirects logging to error log.
@@ -177,7 +276,9 @@ log_dbg_mode(int mode)
 
 /*
  * Master key log.  Logs master keys in SSLKEYLOGFILE format.
- * Uses a logger thread.
+ * Uses a logger thread.  Lines are collected in a buffer, which is written
+ * when full or after LogFlushInterval, in order to turn one small write per
+ * handshake into few large ones.
  */
 
 logger_t *masterkey_log = NULL;
@@ -185,6 +286,58 @@ static int masterkey_fd = -1;
 static char *masterkey_fn = NULL;
 static int masterkey_clisock = -1;
 
+/* interval in ms after which buffered log data is written out */
+static unsigned int log_flush_interval = DFLT_LOG_FLUSH_INTERVAL;
+
+#define MASTERKEY_BUFSZ 65536
+static unsigned char masterkey_buf[MASTERKEY_BUFSZ];
+static size_t masterkey_buflen = 0;
+static long long masterkey_since;       /* ms when buffer became non-empty */
+
+static long long
+log_masterkey_now(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		return 0;
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Write sz octets from buf to the master key log file, retrying on short
+ * writes.  Returns 0 on success, -1 on failure.
+ */
+static int
+log_masterkey_writeall(const void *buf, size_t sz)
+{
+	struct iovec iov;
+
+	iov.iov_base = (void *)buf;
+	iov.iov_len = sz;
+	if (sys_writev_all(masterkey_fd, &iov, 1) == -1) {
+		log_err_rl_printf("Warning: Failed to write to masterkey log:"
+		                  " %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Write out the buffered lines.
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+log_masterkey_flush(void)
+{
+	size_t n = masterkey_buflen;
+
+	if (n == 0)
+		return 0;
+	masterkey_buflen = 0;
+	return log_masterkey_writeall(masterkey_buf, n);
+}
+
 static int
 log_masterkey_preinit(const char *logfile)
 {
@@ -206,6 +359,7 @@ log_masterkey_preinit(const char *logfile)
 static int
 log_masterkey_reopencb(void)
 {
+	log_masterkey_flush();
 	close(masterkey_fd);
 	masterkey_fd = privsep_client_openfile(masterkey_clisock,
 	                                       masterkey_fn,
@@ -221,27 +375,165 @@ log_masterkey_reopencb(void)
 }
 
 /*
- * Do the actual write to the open master key log file descriptor.
+ * Append sz octets from buf to the buffer, flushing it first if they do not
+ * fit.  Lines larger than the buffer are written directly.
+ * Returns 0 on success, -1 on failure.
  */
+static int
+log_masterkey_append(const void *buf, size_t sz)
+{
+	if (masterkey_buflen + sz > sizeof(masterkey_buf) &&
+	    log_masterkey_flush() == -1)
+		return -1;
+	if (sz > sizeof(masterkey_buf))
+		return log_masterkey_writeall(buf, sz);
+	if (masterkey_buflen == 0)
+		masterkey_since = log_masterkey_now();
+	memcpy(masterkey_buf + masterkey_buflen, buf, sz);
+	masterkey_buflen += sz;
+	return 0;
+}
+
 static ssize_t
 log_masterkey_writecb(UNUSED void *fh, UNUSED unsigned long ctl,
                       const void *buf, size_t sz)
 {
-	if (write(masterkey_fd, buf, sz) == -1) {
-		log_err_printf("Warning: Failed to write to masterkey log:"
-		               " %s\n", strerror(errno));
+	if (log_masterkey_append(buf, sz) == -1)
 		return -1;
-	}
 	return sz;
 }
 
+static ssize_t
+log_masterkey_writevcb(UNUSED void *fh, UNUSED unsigned long ctl,
+                       const struct iovec *iov, int iovcnt)
+{
+	ssize_t rv = 0;
+
+	for (int i = 0; i < iovcnt; i++) {
+		if (log_masterkey_append(iov[i].iov_base,
+		                         iov[i].iov_len) == -1)
+			return -1;
+		rv += iov[i].iov_len;
+	}
+	return rv;
+}
+
+/*
+ * Flush callback: write out the buffer once it has been pending for
+ * LogFlushInterval, or immediately if force is set.
+ */
+static int
+log_masterkey_flushcb(UNUSED void *arg, int force)
+{
+	long long due;
+
+	if (masterkey_buflen == 0)
+		return -1;
+	due = masterkey_since + log_flush_interval - log_masterkey_now();
+	if (!force && due > 0)
+		return due;
+	log_masterkey_flush();
+	return -1;
+}
+
 static void
 log_masterkey_fini(void)
 {
+	log_masterkey_flush();
 	close(masterkey_fd);
 }
 
 
+/*
+ * Log compression.  With LogCompression, the content, pcap and connect logs
+ * are written through a logz_t compressed stream per file.  The streams of
+ * each logger are kept on a list, from which the logger's flush callback
+ * finishes the gzip members of streams that have been holding data for the
+ * flush interval.
+ */
+
+static int log_compress = 0;
+
+static int
+log_zflushcb(void *arg, int force)
+{
+	return logz_flush_due(arg, log_flush_interval, force);
+}
+
+/*
+ * Write to fd, through compressed stream z if not NULL.
+ */
+static ssize_t
+log_zwrite(int fd, logz_t *z, const void *buf, size_t sz)
+{
+	if (z)
+		return logz_write(z, buf, sz);
+	return write(fd, buf, sz);
+}
+
+/*
+ * Finish the current gzip member of z before closing its file.
+ */
+static void
+log_zfinish(logz_t *z, const char *fn)
+{
+	if (z && logz_finish(z) == -1)
+		log_err_rl_printf("Warning: Failed to write to '%s': %s (%i)\n",
+		                  fn, strerror(errno), errno);
+}
+
+/*
+ * Preallocation, write-back and syncing of the single-file content and pcap
+ * logs and the segment store, see logsync.c.
+ */
+static logsync_policy_t log_sync_policy;
+static int log_sync = 0;
+
+/*
+ * Start tracking single-file log fd, which is appended to.
+ */
+static void
+log_sync_init(logsync_t *ls, int fd)
+{
+	off_t off;
+
+	if (!log_sync)
+		return;
+	if ((off = lseek(fd, 0, SEEK_END)) == -1)
+		off = 0;
+	logsync_init(ls, &log_sync_policy, fd, off);
+}
+
+/*
+ * Account for the data appended to single-file log fd since the last call,
+ * including data written by its compressed stream.
+ */
+static void
+log_sync_wrote(logsync_t *ls, const char *fn)
+{
+	off_t off;
+
+	if (!log_sync)
+		return;
+	if ((off = lseek(ls->fd, 0, SEEK_CUR)) == -1 || off <= ls->end)
+		return;
+	if (logsync_wrote(ls, off - ls->end) == -1)
+		log_err_rl_printf("Warning: Failed to sync '%s' to disk: "
+		                  "%s (%i)\n", fn, strerror(errno), errno);
+}
+
+static void
+log_sync_close(logsync_t *ls, const char *fn)
+{
+	if (!log_sync)
+		return;
+	log_sync_wrote(ls, fn);
+	if (logsync_close(ls) == -1)
+		log_err_rl_printf("Warning: Failed to sync '%s' to disk: "
+		                  "%s (%i)\n", fn, strerror(errno), errno);
+}
+
+
 /*
  * Connection log.  Logs a one-liner to a file-based connection log.
  * Uses a logger thread.
@@ -251,6 +543,9 @@ logger_t *connect_log = NULL;
 static int connect_fd = -1;
 static char *connect_fn = NULL;
 static int connect_clisock = -1;
+static int connect_json = 0;
+static logz_t *connect_z = NULL;
+static logz_list_t connect_zlist;
 
 static int
 log_connect_preinit(const char *logfile)
@@ -267,12 +562,21 @@ log_connect_preinit(const char *logfile)
 		connect_fd = -1;
 		return -1;
 	}
+	if (log_compress &&
+	    !(connect_z = logz_new(connect_fd, &connect_zlist))) {
+		free(connect_fn);
+		connect_fn = NULL;
+		close(connect_fd);
+		connect_fd = -1;
+		return -1;
+	}
 	return 0;
 }
 
 static int
 log_connect_reopencb(void)
 {
+	log_zfinish(connect_z, connect_fn);
 	close(connect_fd);
 	connect_fd = privsep_client_openfile(connect_clisock,
 	                                     connect_fn,
@@ -284,6 +588,8 @@ log_connect_reopencb(void)
 		connect_fn = NULL;
 		return -1;
 	}
+	if (connect_z)
+		logz_setfd(connect_z, connect_fd);
 	return 0;
 }
 
@@ -291,7 +597,8 @@ log_connect_reopencb(void)
  * Do the actual write to the open connection log file descriptor.
  * We prepend a timestamp here, which means that timestamps are slightly
  * delayed from the time of actual logging.  Since we only have second
- * resolution that should not make any difference.
+ * resolution that should not make any difference.  JSON lines carry their
+ * own timestamp and are written as they are.
  */
 static ssize_t
 log_connect_writecb(UNUSED void *fh, UNUSED unsigned long ctl,
@@ -302,6 +609,14 @@ log_connect_writecb(UNUSED void *fh, UNUSED unsigned long ctl,
 	struct tm *utc;
 	size_t n;
 
+	if (connect_json) {
+		if (log_zwrite(connect_fd, connect_z, buf, sz) == -1) {
+			log_err_rl_printf("Warning: Failed to write to connect "
+			                  "log: %s\n", strerror(errno));
+			return -1;
+		}
+		return sz;
+	}
 	time(&epoch);
 	utc = gmtime(&epoch);
 	n = strftime(timebuf, sizeof(timebuf), "%Y-%m-%d %H:%M:%S UTC ", utc);
@@ -309,18 +624,65 @@ log_connect_writecb(UNUSED void *fh, UNUSED unsigned long ctl,
 		log_err_printf("Error from strftime(): buffer too small\n");
 		return -1;
 	}
-	if ((write(connect_fd, timebuf, n) == -1) ||
-	    (write(connect_fd, buf, sz) == -1)) {
-		log_err_printf("Warning: Failed to write to connect log: %s\n",
-		               strerror(errno));
+	if ((log_zwrite(connect_fd, connect_z, timebuf, n) == -1) ||
+	    (log_zwrite(connect_fd, connect_z, buf, sz) == -1)) {
+		log_err_rl_printf("Warning: Failed to write to connect log: "
+		                  "%s\n", strerror(errno));
 		return -1;
 	}
 	return sz;
 }
 
+/*
+ * Vectored write callback for the connect log; all lines of a batch are
+ * prefixed with the same timestamp, except for JSON lines.
+ */
+static ssize_t
+log_connect_writevcb(UNUSED void *fh, UNUSED unsigned long ctl,
+                     const struct iovec *iov, int iovcnt)
+{
+	struct iovec v[2 * iovcnt];
+	char timebuf[32];
+	time_t epoch;
+	struct tm *utc;
+	size_t n = 0;
+	ssize_t rv;
+	int k = 0;
+
+	if (!connect_json) {
+		time(&epoch);
+		utc = gmtime(&epoch);
+		n = strftime(timebuf, sizeof(timebuf),
+		             "%Y-%m-%d %H:%M:%S UTC ", utc);
+		if (n == 0) {
+			log_err_printf("Error from strftime(): "
+			               "buffer too small\n");
+			return -1;
+		}
+	}
+	for (int i = 0; i < iovcnt; i++) {
+		if (n > 0) {
+			v[k].iov_base = timebuf;
+			v[k++].iov_len = n;
+		}
+		v[k++] = iov[i];
+	}
+	if ((rv = connect_z ? logz_writev(connect_z, v, k)
+	                    : sys_writev_all(connect_fd, v, k)) == -1) {
+		log_err_rl_printf("Warning: Failed to write to connect log: "
+		                  "%s\n", strerror(errno));
+		return -1;
+	}
+	return rv;
+}
+
 static void
 log_connect_fini(void)
 {
+	if (connect_z) {
+		logz_free(connect_z);
+		connect_z = NULL;
+	}
 	close(connect_fd);
 }
 
@@ -337,6 +699,9 @@ log_connect_fini(void)
 
 #define PREPFLAG_REQUEST 1
 #define PREPFLAG_EOF     2
+#define PREPFLAG_TRUNC   4
+/* prepflags also carry the LBFLAG_DECODE bits of message body octets to be
+ * decoded for the file content log; pcap and mirror logs ignore them */
 
 typedef struct log_content_file_ctx {
 	union {
@@ -352,7 +717,18 @@ typedef struct log_content_file_ctx {
 			int fd;
 			char *filename;
 		} spec;
+		struct {
+			logseg_t *store;
+			logseg_conn_t conn;
+		} seg;
 	} u;
+	logdec_t *dec;
+	logdec_t *wsdec[2];     /* WebSocket decoders, response and request */
+	logz_t *z;              /* compressed stream of dir/spec file */
+	logz_list_t *zlist;     /* list for z if compressing */
+	logfdc_t *fdc;          /* fd cache of dir/spec file if bounded */
+	logfdc_ent_t fdcent;
+	logcas_conn_t *cas;     /* chunking state of dir/spec file if dedup */
 } log_content_file_ctx_t;
 
 typedef struct log_content_pcap_ctx {
@@ -367,18 +743,88 @@ typedef struct log_content_pcap_ctx {
 		} spec;
 	} u;
 	logpkt_ctx_t state;
+	logz_list_t *zlist;     /* list for state.z if compressing */
+	logfdc_t *fdc;          /* fd cache of dir/spec file if bounded */
+	logfdc_ent_t fdcent;
+	logpkt_pcapng_t ng;     /* pcapng state of dir/spec file */
+	char *ng_desc;
+	char *ng_comment;
 } log_content_pcap_ctx_t;
 
 #ifndef WITHOUT_MIRROR
 typedef struct log_content_mirror_ctx {
 	logpkt_ctx_t state;
+	uint32_t hash;          /* flow hash selecting the target */
+	size_t target;          /* index of the current target */
 } log_content_mirror_ctx_t;
+
+/*
+ * Mirror targets; connections are spread across them by a hash of their
+ * addresses and ports, see log_content_mirror_select().  Ether addresses
+ * and the up flags are written by the health check thread under
+ * content_mirror_mutex, up is read without the mutex on the fast path.
+ */
+typedef struct log_content_mirror_target {
+	char *ip;
+	uint8_t ether[ETHER_ADDR_LEN];
+	int resolved;           /* ether was looked up at least once */
+	int up;                 /* target replied to the last probe */
+} log_content_mirror_target_t;
+
+#define LOG_MIRROR_MAX_TARGETS	16
+#define LOG_MIRROR_PROBE_TRIES	3       /* ARP requests per probe */
+#define LOG_MIRROR_START_ROUNDS	16      /* probes until one target is up */
 #endif /* !WITHOUT_MIRROR */
 
+typedef struct log_content_tap_ctx {
+	logtap_conn_t conn;
+} log_content_tap_ctx_t;
+
+typedef struct log_content_stream_ctx {
+	logtap_conn_t conn;
+} log_content_stream_ctx_t;
+
+/*
+ * Per-connection content logs can be sharded into several loggers with one
+ * writer thread each; connections are assigned to a shard by the index of
+ * their connection handling thread.  Single-file content logs always use a
+ * single logger.  Opening per-connection files through the privsep client
+ * sockets is serialized among the shards.
+ *
+ * The privsep server hands out the directory of each per-connection log once
+ * at startup.  As long as the directory is writable by the unprivileged user,
+ * per-connection files are created beneath it with openat(), avoiding a
+ * privsep round-trip per connection.
+ */
+typedef struct log_content_dir {
+	const char *path;       /* directory path, prefix of filenames */
+	size_t len;             /* length of path */
+	int fd;                 /* directory fd or -1 */
+	int openat;             /* create files using openat() beneath fd */
+} log_content_dir_t;
+
 static int content_file_clisock = -1;
-static logger_t *content_file_log = NULL;
+static logger_t *content_file_log[MAX_CONTENT_LOG_THREADS];
+static unsigned int content_file_nlogs = 0;
+static log_content_dir_t content_file_dir = {NULL, 0, -1, 0};
+static logseg_t *content_file_seg[MAX_CONTENT_LOG_THREADS];
+static logz_list_t content_file_zlist[MAX_CONTENT_LOG_THREADS];
+static logfdc_t content_file_fdc[MAX_CONTENT_LOG_THREADS];
+static logcas_t *content_file_cas = NULL;
+static log_content_dir_t content_file_casdir = {NULL, 0, -1, 0};
 static int content_pcap_clisock = -1;
-static logger_t *content_pcap_log = NULL;
+static logger_t *content_pcap_log[MAX_CONTENT_LOG_THREADS];
+static unsigned int content_pcap_nlogs = 0;
+static log_content_dir_t content_pcap_dir = {NULL, 0, -1, 0};
+static logz_list_t content_pcap_zlist[MAX_CONTENT_LOG_THREADS];
+static logfdc_t content_pcap_fdc[MAX_CONTENT_LOG_THREADS];
+static logz_t *content_pcap_z = NULL;   /* single-file pcap log */
+static int content_pcap_isng = 0;
+static logpkt_pcapng_t content_pcap_ng; /* single-file pcapng log */
+#define CONTENT_FILE_LOG(ctx) \
+	(content_file_log[(ctx)->shard % content_file_nlogs])
+#define CONTENT_PCAP_LOG(ctx) \
+	(content_pcap_log[(ctx)->shard % content_pcap_nlogs])
 static uint8_t content_pcap_src_ether[ETHER_ADDR_LEN] = {
 	0x02, 0x00, 0x00, 0x11, 0x11, 0x11};
 static uint8_t content_pcap_dst_ether[ETHER_ADDR_LEN] = {
@@ -386,10 +832,95 @@ static uint8_t content_pcap_dst_ether[ETHER_ADDR_LEN] = {
 #ifndef WITHOUT_MIRROR
 static logger_t *content_mirror_log = NULL;
 static libnet_t *content_mirror_libnet = NULL;
+static logpkt_tx_t *content_mirror_tx = NULL;
 static size_t content_mirror_mtu = 0;
 static uint8_t content_mirror_src_ether[ETHER_ADDR_LEN];
-static uint8_t content_mirror_dst_ether[ETHER_ADDR_LEN];
+static log_content_mirror_target_t content_mirror_targets[
+	LOG_MIRROR_MAX_TARGETS];
+static size_t content_mirror_ntargets = 0;
+static pthread_mutex_t content_mirror_mutex = PTHREAD_MUTEX_INITIALIZER;
+static libnet_t *content_mirror_arp_libnet = NULL;
+static logpkt_arp_t *content_mirror_arp = NULL;
+static unsigned int content_mirror_chk_interval = 0;
+static pthread_cond_t content_mirror_chk_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t content_mirror_chk_thr;
+static int content_mirror_chk_running = 0;
+static int content_mirror_chk_stopping = 0;
+
+/*
+ * Hash of the addresses and ports of a connection, independent of the
+ * process such that connections map to the same targets across restarts
+ * and across instances configured with the same targets.
+ */
+static uint32_t
+log_content_mirror_hash(const struct sockaddr *srcaddr,
+                        const struct sockaddr *dstaddr)
+{
+	const struct sockaddr *sa[2] = {srcaddr, dstaddr};
+	uint32_t h = 2166136261U;
+
+	for (int i = 0; i < 2; i++) {
+		const unsigned char *p;
+		size_t sz;
+
+		if (sa[i]->sa_family == AF_INET) {
+			const struct sockaddr_in *sin = (void *)sa[i];
+			p = (const unsigned char *)&sin->sin_addr;
+			sz = sizeof(sin->sin_addr);
+			h = (h ^ (sin->sin_port & 0xff)) * 16777619U;
+			h = (h ^ (sin->sin_port >> 8)) * 16777619U;
+		} else {
+			const struct sockaddr_in6 *sin6 = (void *)sa[i];
+			p = (const unsigned char *)&sin6->sin6_addr;
+			sz = sizeof(sin6->sin6_addr);
+			h = (h ^ (sin6->sin6_port & 0xff)) * 16777619U;
+			h = (h ^ (sin6->sin6_port >> 8)) * 16777619U;
+		}
+		for (size_t j = 0; j < sz; j++)
+			h = (h ^ p[j]) * 16777619U;
+	}
+	return h;
+}
+
+/*
+ * Select the target for a connection with flow hash hash and copy its ether
+ * address to ether.  This is the target selected by the hash if it is up,
+ * otherwise the next target that is up, such that only the connections of a
+ * failed target move.  If no target is up, fall back to the next target that
+ * was ever resolved, of which there is at least one.  Returns the index of
+ * the selected target.
+ */
+static size_t
+log_content_mirror_select(uint32_t hash, uint8_t *ether)
+{
+	size_t idx = hash % content_mirror_ntargets;
+	size_t sel = idx;
+
+	pthread_mutex_lock(&content_mirror_mutex);
+	for (size_t i = 0; i < content_mirror_ntargets; i++) {
+		size_t j = (idx + i) % content_mirror_ntargets;
+		if (content_mirror_targets[j].up) {
+			sel = j;
+			goto out;
+		}
+	}
+	for (size_t i = 0; i < content_mirror_ntargets; i++) {
+		size_t j = (idx + i) % content_mirror_ntargets;
+		if (content_mirror_targets[j].resolved) {
+			sel = j;
+			goto out;
+		}
+	}
+out:
+	memcpy(ether, content_mirror_targets[sel].ether, ETHER_ADDR_LEN);
+	pthread_mutex_unlock(&content_mirror_mutex);
+	return sel;
+}
 #endif /* !WITHOUT_MIRROR */
+static logger_t *content_tap_log = NULL;
+static logtap_t *content_tap = NULL;
+static logger_t *content_stream_log = NULL;
+static logstream_t *content_stream = NULL;
 
 /*
  * Split a pathname into static LHS (including final slashes) and dynamic RHS.
@@ -451,169 +982,608 @@ log_content_split_pathspec(const char *path, char **lhs, char **rhs)
 }
 
 /*
- * Generate a log path based on the given log spec.
- * Returns an allocated buffer which must be freed by caller, or NULL on error.
+ * Per-connection log path specs (-F, -y) are compiled once at startup into a
+ * sequence of literal runs and format specifiers, such that generating the
+ * path of a connection is a single pass over the compiled ops instead of
+ * re-parsing the spec for every connection.
  */
-#define PATH_BUF_INC	1024
-static char * MALLOC NONNULL(1,2,3)
-log_content_format_pathspec(const char *logspec,
-                            char *srchost, char *srcport,
-                            char *dsthost, char *dstport,
-                            char *exec_path, char *user, char *group)
-{
-	/* set up buffer to hold our generated file path */
-	size_t path_buflen = PATH_BUF_INC;
-	char *path_buf = malloc(path_buflen);
-	if (path_buf == NULL) {
-		log_err_printf("failed to allocate path buffer\n");
-		return NULL;
-	}
+typedef struct log_pathspec_op {
+	char spec;              /* format specifier, or '\0' for literal */
+	size_t len;             /* length of literal */
+	const char *lit;        /* literal, points into trailing storage */
+} log_pathspec_op_t;
+
+typedef struct log_pathspec {
+	size_t nops;
+	size_t litlen;          /* sum of all literal lengths */
+	log_pathspec_op_t op[];
+} log_pathspec_t;
+
+typedef struct log_pathspec_args {
+	char *srchost;
+	char *srcport;
+	char *dsthost;
+	char *dstport;
+	char *exec_path;
+	char *user;
+	char *group;
+	char timebuf[24];       /* sized for ISO 8601 format */
+	char addrbuf[INET6_ADDRSTRLEN + 8]; /* host,port */
+} log_pathspec_args_t;
+
+static log_pathspec_t *content_file_spec = NULL;
+static log_pathspec_t *content_pcap_spec = NULL;
 
-	/* initialize the buffer as an empty C string */
-	path_buf[0] = '\0';
+/*
+ * Compile log spec into a newly allocated log_pathspec_t to be freed by the
+ * caller.  Invalid and unknown format specifiers are discarded.
+ * Returns NULL on memory allocation failure.
+ */
+static log_pathspec_t * MALLOC NONNULL(1)
+log_pathspec_compile(const char *logspec)
+{
+	log_pathspec_t *ps;
+	log_pathspec_op_t *op = NULL;
+	size_t speclen = strlen(logspec);
+	char *lit;
+
+	/* at most one op per character of the spec */
+	ps = malloc(sizeof(log_pathspec_t) +
+	            (speclen + 1) * sizeof(log_pathspec_op_t) + speclen + 1);
+	if (!ps)
+		return NULL;
+	ps->nops = 0;
+	ps->litlen = 0;
+	lit = (char *)&ps->op[speclen + 1];
 
-	/* iterate over format specifiers */
-	size_t path_len = 0;
 	for (const char *p = logspec; *p != '\0'; p++) {
-		const char *elem = NULL;
-		size_t elem_len = 0;
-
-		const char iso8601[] =  "%Y%m%dT%H%M%SZ";
-		char timebuf[24]; /* sized for ISO 8601 format */
-		char addrbuf[INET6_ADDRSTRLEN + 8]; /* [host]:port */
-
-		/* parse the format string and generate the next path element */
-		switch (*p) {
-		case '%':
+		if (*p == '%') {
 			p++;
-			/* handle format specifiers. */
 			switch (*p) {
 			case '\0':
-				/* unexpected eof; backtrack and discard
-				 * invalid format spec */
+				/* discard invalid format spec at end */
 				p--;
-				elem_len = 0;
-				break;
+				continue;
+			case 'd': case 'D': case 'p':
+			case 's': case 'S': case 'q':
+			case 'x': case 'X':
+			case 'u': case 'g':
+			case 'T':
+				op = &ps->op[ps->nops++];
+				op->spec = *p;
+				op->len = 0;
+				op->lit = NULL;
+				op = NULL;
+				continue;
 			case '%':
-				elem = p;
-				elem_len = 1;
-				break;
-			case 'd':
-				if (snprintf(addrbuf, sizeof(addrbuf),
-				             "%s,%s", dsthost, dstport) < 0) {
-					addrbuf[0] = '?';
-					addrbuf[1] = '\0';
-				}
-				elem = addrbuf;
-				elem_len = strlen(addrbuf);
-				break;
-			case 'D':
-				elem = dsthost;
-				elem_len = strlen(dsthost);
 				break;
-			case 'p':
-				elem = dstport;
-				elem_len = strlen(dstport);
-				break;
-			case 's':
-				if (snprintf(addrbuf, sizeof(addrbuf),
-				             "%s,%s", srchost, srcport) < 0) {
-					addrbuf[0] = '?';
-					addrbuf[1] = '\0';
-				}
-				elem = addrbuf;
-				elem_len = strlen(addrbuf);
-				break;
-			case 'S':
-				elem = srchost;
-				elem_len = strlen(srchost);
-				break;
-			case 'q':
-				elem = srcport;
-				elem_len = strlen(srcport);
-				break;
-			case 'x':
-				if (exec_path) {
-					char *match = exec_path;
-					while ((match = strchr(match, '/')) != NULL) {
-						match++;
-						elem = match;
-					}
-					elem_len = elem ? strlen(elem) : 0;
-				} else {
-					elem_len = 0;
-				}
-				break;
-			case 'X':
-				elem = exec_path;
-				elem_len = exec_path ? strlen(exec_path) : 0;
-				break;
-			case 'u':
-				elem = user;
-				elem_len = user ? strlen(user) : 0;
-				break;
-			case 'g':
-				elem = group;
-				elem_len = group ? strlen(group) : 0;
-				break;
-			case 'T': {
-				time_t epoch;
-				struct tm *utc;
+			default:
+				/* discard unknown format spec */
+				continue;
+			}
+		}
+		/* literal character, append to current literal run */
+		if (!op) {
+			op = &ps->op[ps->nops++];
+			op->spec = '\0';
+			op->len = 0;
+			op->lit = lit;
+		}
+		*lit++ = *p;
+		op->len++;
+		ps->litlen++;
+	}
+	return ps;
+}
 
-				time(&epoch);
-				utc = gmtime(&epoch);
-				strftime(timebuf, sizeof(timebuf), iso8601, utc);
+static void
+log_pathspec_free(void)
+{
+	if (content_file_spec) {
+		free(content_file_spec);
+		content_file_spec = NULL;
+	}
+	if (content_pcap_spec) {
+		free(content_pcap_spec);
+		content_pcap_spec = NULL;
+	}
+}
 
-				elem = timebuf;
-				elem_len = sizeof(timebuf);
-				break;
-			}}
-			break;
-		default:
-			elem = p;
-			elem_len = 1;
-			break;
+/*
+ * Return the expansion of format specifier spec and store its length in len.
+ * Returns NULL with len set to 0 if the element is empty.
+ */
+static const char * NONNULL(2,3)
+log_pathspec_elem(char spec, log_pathspec_args_t *a, size_t *len)
+{
+	const char *elem = NULL;
+
+	switch (spec) {
+	case 'd':
+		if (snprintf(a->addrbuf, sizeof(a->addrbuf), "%s,%s",
+		             a->dsthost, a->dstport) < 0) {
+			a->addrbuf[0] = '?';
+			a->addrbuf[1] = '\0';
 		}
+		elem = a->addrbuf;
+		break;
+	case 'D':
+		elem = a->dsthost;
+		break;
+	case 'p':
+		elem = a->dstport;
+		break;
+	case 's':
+		if (snprintf(a->addrbuf, sizeof(a->addrbuf), "%s,%s",
+		             a->srchost, a->srcport) < 0) {
+			a->addrbuf[0] = '?';
+			a->addrbuf[1] = '\0';
+		}
+		elem = a->addrbuf;
+		break;
+	case 'S':
+		elem = a->srchost;
+		break;
+	case 'q':
+		elem = a->srcport;
+		break;
+	case 'x':
+		if (a->exec_path) {
+			elem = strrchr(a->exec_path, '/');
+			if (elem)
+				elem++;
+		}
+		break;
+	case 'X':
+		elem = a->exec_path;
+		break;
+	case 'u':
+		elem = a->user;
+		break;
+	case 'g':
+		elem = a->group;
+		break;
+	case 'T':
+		if (!a->timebuf[0]) {
+			time_t epoch;
+			struct tm utc;
+
+			time(&epoch);
+			if (!gmtime_r(&epoch, &utc) ||
+			    !strftime(a->timebuf, sizeof(a->timebuf),
+			              "%Y%m%dT%H%M%SZ", &utc))
+				a->timebuf[0] = '\0';
+		}
+		elem = a->timebuf;
+		break;
+	}
+	*len = elem ? strlen(elem) : 0;
+	return elem;
+}
 
-		if (elem_len > 0) {
-			/* growing the buffer to fit elem_len + terminating \0 */
-			if (path_buflen - path_len < elem_len + 1) {
-				/* Grow in PATH_BUF_INC chunks.
-				 * Note that the use of `PATH_BUF_INC' provides
-				 * our guaranteed space for a trailing '\0' */
-				path_buflen += elem_len + PATH_BUF_INC;
-				char *newbuf = realloc(path_buf, path_buflen);
-				if (newbuf == NULL) {
-					log_err_printf("failed to reallocate"
-					               " path buffer\n");
-					free(path_buf);
-					return NULL;
-				}
-				path_buf = newbuf;
-			}
-
-			strncat(path_buf, elem, elem_len);
+/*
+ * Generate a log path based on the given compiled log spec.
+ * Returns an allocated buffer which must be freed by caller, or NULL on error.
+ */
+static char * MALLOC NONNULL(1,2,3,4,5)
+log_pathspec_format(const log_pathspec_t *ps,
+                    char *srchost, char *srcport,
+                    char *dsthost, char *dstport,
+                    char *exec_path, char *user, char *group)
+{
+	log_pathspec_args_t a;
+	const char *elem;
+	size_t path_len, elem_len;
+	char *path_buf, *p;
+
+	a.srchost = srchost;
+	a.srcport = srcport;
+	a.dsthost = dsthost;
+	a.dstport = dstport;
+	a.exec_path = exec_path;
+	a.user = user;
+	a.group = group;
+	a.timebuf[0] = '\0';
+
+	/* size the path such that it can be allocated once */
+	path_len = ps->litlen;
+	for (size_t i = 0; i < ps->nops; i++) {
+		if (ps->op[i].spec) {
+			log_pathspec_elem(ps->op[i].spec, &a, &elem_len);
 			path_len += elem_len;
 		}
 	}
 
-	/* apply terminating NUL */
-	assert(path_buflen > path_len);
-	path_buf[path_len] = '\0';
+	path_buf = malloc(path_len + 1);
+	if (!path_buf) {
+		log_err_printf("failed to allocate path buffer\n");
+		return NULL;
+	}
+	p = path_buf;
+	for (size_t i = 0; i < ps->nops; i++) {
+		if (ps->op[i].spec) {
+			elem = log_pathspec_elem(ps->op[i].spec, &a, &elem_len);
+		} else {
+			elem = ps->op[i].lit;
+			elem_len = ps->op[i].len;
+		}
+		if (elem_len > 0) {
+			memcpy(p, elem, elem_len);
+			p += elem_len;
+		}
+	}
+	assert((size_t)(p - path_buf) == path_len);
+	*p = '\0';
 	return path_buf;
 }
-#undef PATH_BUF_INC
 
 /*
- * log_content_ctx_t is preallocated by the caller (part of connection ctx).
+ * Flight recorder for the file and pcap content logs (ContentLogRecorder).
+ *
+ * Instead of being written, content destined to the file and pcap logs of
+ * a connection is retained in memory, at most content_rec_sz octets per
+ * connection and content_rec_total octets per connection handling thread,
+ * dropping the oldest content first.  A trigger flushes the retained
+ * content of all connections through the file and pcap logs, opening their
+ * files on the first flush; connections keep recording afterwards and are
+ * flushed again by the next trigger.  Connections which are closed without
+ * ever having been flushed leave no trace in the file and pcap logs.
+ *
+ * Every connection handling thread records into its own shard, so the
+ * shard mutex is only ever contended by a trigger.  The oldest item of a
+ * shard is always also the oldest item of its connection.
+ */
+#define LOG_REC_SHARDS 64
+
+typedef struct log_content_rec_item {
+	struct log_content_rec_item *prev, *next;   /* shard, oldest first */
+	struct log_content_rec_item *cnext;         /* connection */
+	struct log_content_rec_ctx *rec;
+	logbuf_t *lb;           /* NULL for a truncation marker */
+	unsigned long prepflags;
+	size_t sz;
+} log_content_rec_item_t;
+
+typedef struct log_content_rec_ctx {
+	log_content_ctx_t *ctx;
+	struct log_content_rec_ctx *prev, *next;    /* connections of shard */
+	log_content_rec_item_t *head, *tail;        /* oldest first */
+	size_t bytes;
+	int opened;             /* file and pcap logs opened by a flush */
+} log_content_rec_ctx_t;
+
+typedef struct log_content_rec_shard {
+	pthread_mutex_t mutex;
+	log_content_rec_item_t *head, *tail;
+	size_t bytes;
+	log_content_rec_ctx_t *conns;
+} log_content_rec_shard_t;
+
+static log_content_rec_shard_t content_rec[LOG_REC_SHARDS];
+static size_t content_rec_sz = 0;       /* 0 if recorder disabled */
+static size_t content_rec_total = 0;
+static int content_rec_file_kind = 0;
+static int content_rec_pcap_kind = 0;
+
+#define LOG_REC_SINGLE  0
+#define LOG_REC_DIR     1
+#define LOG_REC_SPEC    2
+#define LOG_REC_SEG     3
+
+static void
+log_content_rec_preinit(opts_t *opts)
+{
+	content_rec_sz = opts->contentlog_rec_sz;
+	content_rec_total = opts->contentlog_rec_total;
+	if (opts->contentlog_isdir)
+		content_rec_file_kind = LOG_REC_DIR;
+	else if (opts->contentlog_isspec)
+		content_rec_file_kind = LOG_REC_SPEC;
+	else if (opts->contentlog_isseg)
+		content_rec_file_kind = LOG_REC_SEG;
+	if (opts->pcaplog_isdir)
+		content_rec_pcap_kind = LOG_REC_DIR;
+	else if (opts->pcaplog_isspec)
+		content_rec_pcap_kind = LOG_REC_SPEC;
+	memset(content_rec, 0, sizeof(content_rec));
+	for (size_t i = 0; i < LOG_REC_SHARDS; i++)
+		pthread_mutex_init(&content_rec[i].mutex, NULL);
+}
+
+static void
+log_content_rec_fini(void)
+{
+	if (!content_rec_sz)
+		return;
+	for (size_t i = 0; i < LOG_REC_SHARDS; i++)
+		pthread_mutex_destroy(&content_rec[i].mutex);
+	content_rec_sz = 0;
+}
+
+static log_content_rec_shard_t *
+log_content_rec_shard(log_content_ctx_t *ctx)
+{
+	return &content_rec[ctx->shard % LOG_REC_SHARDS];
+}
+
+/*
+ * Unlink and return the oldest item of rec.  Called with the shard mutex
+ * held.
+ */
+static log_content_rec_item_t *
+log_content_rec_pop(log_content_rec_shard_t *shard,
+                    log_content_rec_ctx_t *rec)
+{
+	log_content_rec_item_t *item = rec->head;
+
+	rec->head = item->cnext;
+	if (!rec->head)
+		rec->tail = NULL;
+	rec->bytes -= item->sz;
+	if (item->prev)
+		item->prev->next = item->next;
+	else
+		shard->head = item->next;
+	if (item->next)
+		item->next->prev = item->prev;
+	else
+		shard->tail = item->prev;
+	shard->bytes -= item->sz;
+	return item;
+}
+
+static void
+log_content_rec_item_free(log_content_rec_item_t *item)
+{
+	if (item->lb)
+		logbuf_free(item->lb);
+	free(item);
+}
+
+/*
+ * Retain lb with prepflags for a later flush, or a truncation marker if lb
+ * is NULL, evicting the oldest content over budget.  On failure, lb is
+ * freed.
+ */
+static int
+log_content_rec_add(log_content_ctx_t *ctx, unsigned long prepflags,
+                    logbuf_t *lb)
+{
+	log_content_rec_shard_t *shard = log_content_rec_shard(ctx);
+	log_content_rec_ctx_t *rec = ctx->rec;
+	log_content_rec_item_t *item;
+
+	item = malloc(sizeof(log_content_rec_item_t));
+	if (!item) {
+		if (lb)
+			logbuf_free(lb);
+		return -1;
+	}
+	item->rec = rec;
+	item->lb = lb;
+	item->prepflags = prepflags;
+	item->sz = lb ? (size_t)lb->sz : 0;
+	item->cnext = NULL;
+	item->next = NULL;
+
+	pthread_mutex_lock(&shard->mutex);
+	item->prev = shard->tail;
+	if (shard->tail)
+		shard->tail->next = item;
+	else
+		shard->head = item;
+	shard->tail = item;
+	shard->bytes += item->sz;
+	if (rec->tail)
+		rec->tail->cnext = item;
+	else
+		rec->head = item;
+	rec->tail = item;
+	rec->bytes += item->sz;
+
+	/* always keep the newest item, even if larger than the budget */
+	while (rec->bytes > content_rec_sz && rec->head != item)
+		log_content_rec_item_free(log_content_rec_pop(shard, rec));
+	while (shard->bytes > content_rec_total && shard->head != item)
+		log_content_rec_item_free(log_content_rec_pop(shard,
+		                                              shard->head->rec));
+	pthread_mutex_unlock(&shard->mutex);
+	return 0;
+}
+
+/*
+ * Write the retained content of rec to the file and pcap logs.  Called with
+ * the shard mutex held.  Returns the number of octets flushed.
+ */
+static size_t
+log_content_rec_flush(log_content_rec_shard_t *shard,
+                      log_content_rec_ctx_t *rec)
+{
+	log_content_ctx_t *ctx = rec->ctx;
+	log_content_rec_item_t *item;
+	logbuf_t *lbpcap;
+	size_t bytes = 0;
+
+	if (!rec->head)
+		return 0;
+	if (!rec->opened) {
+		/* from here on the logs own ctx->file and ctx->pcap */
+		rec->opened = 1;
+		if ((ctx->file &&
+		     logger_open(CONTENT_FILE_LOG(ctx), ctx->file) == -1) ||
+		    (ctx->pcap &&
+		     logger_open(CONTENT_PCAP_LOG(ctx), ctx->pcap) == -1))
+			log_err_printf("Warning: Failed to open recorded "
+			               "content log\n");
+	}
+	while (rec->head) {
+		item = log_content_rec_pop(shard, rec);
+		bytes += item->sz;
+		if (!item->lb) {
+			if (ctx->file &&
+			    logger_submit(CONTENT_FILE_LOG(ctx), ctx->file,
+			                  item->prepflags, NULL) == -1)
+				log_err_printf("Warning: Failed to flush "
+				               "recorded content\n");
+			free(item);
+			continue;
+		}
+		if (ctx->pcap) {
+			lbpcap = ctx->file ? logbuf_new_shared(item->lb)
+			                   : item->lb;
+			if (lbpcap && logger_submit(CONTENT_PCAP_LOG(ctx),
+			                            ctx->pcap, item->prepflags,
+			                            lbpcap) == -1)
+				logbuf_free(lbpcap);
+			if (!ctx->file)
+				item->lb = NULL;
+		}
+		if (ctx->file) {
+			if (logger_submit(CONTENT_FILE_LOG(ctx), ctx->file,
+			                  item->prepflags, item->lb) == 0)
+				item->lb = NULL;
+		}
+		log_content_rec_item_free(item);
+	}
+	return bytes;
+}
+
+/*
+ * Flush the retained content of all recording connections to the file and
+ * pcap logs.  Safe to call from any thread.
+ */
+void
+log_content_recorder_trigger(void)
+{
+	log_content_rec_shard_t *shard;
+	log_content_rec_ctx_t *rec;
+	size_t bytes = 0, conns = 0, n;
+
+	if (!content_rec_sz)
+		return;
+	for (size_t i = 0; i < LOG_REC_SHARDS; i++) {
+		shard = &content_rec[i];
+		pthread_mutex_lock(&shard->mutex);
+		for (rec = shard->conns; rec; rec = rec->next) {
+			n = log_content_rec_flush(shard, rec);
+			if (n) {
+				bytes += n;
+				conns++;
+			}
+		}
+		pthread_mutex_unlock(&shard->mutex);
+	}
+	log_dbg_printf("Flight recorder flushed %zu octets of %zu "
+	               "connections\n", bytes, conns);
+}
+
+static int
+log_content_rec_new(log_content_ctx_t *ctx)
+{
+	log_content_rec_shard_t *shard = log_content_rec_shard(ctx);
+	log_content_rec_ctx_t *rec;
+
+	rec = malloc(sizeof(log_content_rec_ctx_t));
+	if (!rec)
+		return -1;
+	memset(rec, 0, sizeof(log_content_rec_ctx_t));
+	rec->ctx = ctx;
+	ctx->rec = rec;
+
+	pthread_mutex_lock(&shard->mutex);
+	rec->next = shard->conns;
+	if (shard->conns)
+		shard->conns->prev = rec;
+	shard->conns = rec;
+	pthread_mutex_unlock(&shard->mutex);
+	return 0;
+}
+
+/*
+ * Stop recording ctx and drop its retained content.  Returns whether the
+ * file and pcap logs were opened by a flush.
+ */
+static int
+log_content_rec_free(log_content_ctx_t *ctx)
+{
+	log_content_rec_shard_t *shard = log_content_rec_shard(ctx);
+	log_content_rec_ctx_t *rec = ctx->rec;
+	int opened;
+
+	pthread_mutex_lock(&shard->mutex);
+	while (rec->head)
+		log_content_rec_item_free(log_content_rec_pop(shard, rec));
+	if (rec->prev)
+		rec->prev->next = rec->next;
+	else
+		shard->conns = rec->next;
+	if (rec->next)
+		rec->next->prev = rec->prev;
+	pthread_mutex_unlock(&shard->mutex);
+
+	opened = rec->opened;
+	free(rec);
+	ctx->rec = NULL;
+	return opened;
+}
+
+/*
+ * Free the file and pcap log contexts of a connection whose logs were never
+ * opened, without writing anything.
+ */
+static void
+log_content_rec_discard(log_content_ctx_t *ctx)
+{
+	if (ctx->file) {
+		switch (content_rec_file_kind) {
+		case LOG_REC_DIR:
+			free(ctx->file->u.dir.filename);
+			break;
+		case LOG_REC_SPEC:
+			free(ctx->file->u.spec.filename);
+			break;
+		case LOG_REC_SEG:
+			logseg_conn_free(&ctx->file->u.seg.conn);
+			break;
+		default:
+			free(ctx->file->u.single.header_req);
+			free(ctx->file->u.single.header_resp);
+			break;
+		}
+		free(ctx->file);
+		ctx->file = NULL;
+	}
+	if (ctx->pcap) {
+		switch (content_rec_pcap_kind) {
+		case LOG_REC_DIR:
+			free(ctx->pcap->u.dir.filename);
+			break;
+		case LOG_REC_SPEC:
+			free(ctx->pcap->u.spec.filename);
+			break;
+		default:
+			break;
+		}
+		if (ctx->pcap->ng_desc)
+			free(ctx->pcap->ng_desc);
+		if (ctx->pcap->ng_comment)
+			free(ctx->pcap->ng_comment);
+		free(ctx->pcap);
+		ctx->pcap = NULL;
+	}
+}
+
+/*
+ * log_content_ctx_t is preallocated by the caller (part of connection ctx).
  */
 int
-log_content_open(log_content_ctx_t *ctx, opts_t *opts,
+log_content_open(log_content_ctx_t *ctx, opts_t *opts, int thridx,
                  const struct sockaddr *srcaddr, socklen_t srcaddrlen,
                  const struct sockaddr *dstaddr, socklen_t dstaddrlen,
                  char *srchost, char *srcport,
                  char *dsthost, char *dstport,
-                 char *exec_path, char *user, char *group)
+                 char *exec_path, char *user, char *group, char *sni,
+                 char *origcrtfpr)
 {
 	char timebuf[24];
 	time_t epoch;
@@ -621,12 +1591,13 @@ log_content_open(log_content_ctx_t *ctx, opts_t *opts,
 	char *dsthost_clean = NULL;
 	char *srchost_clean = NULL;
 
-	if (ctx->file || ctx->pcap
+	if (ctx->file || ctx->pcap || ctx->tap || ctx->stream
 #ifndef WITHOUT_MIRROR
 	    || ctx->mirror
 #endif /* !WITHOUT_MIRROR */
 	    )
 		return 0; /* does this actually happen? */
+	ctx->shard = thridx >= 0 ? thridx : 0;
 
 	if (opts->contentlog_isdir || opts->contentlog_isspec ||
 	    opts->pcaplog_isdir    || opts->pcaplog_isspec) {
@@ -668,14 +1639,31 @@ log_content_open(log_content_ctx_t *ctx, opts_t *opts,
 		if (!ctx->file)
 			goto errout;
 		memset(ctx->file, 0, sizeof(log_content_file_ctx_t));
+		if (log_compress &&
+		    (opts->contentlog_isdir || opts->contentlog_isspec))
+			ctx->file->zlist = &content_file_zlist[
+			        ctx->shard % content_file_nlogs];
+		if (opts->contentlog_maxfiles &&
+		    (opts->contentlog_isdir || opts->contentlog_isspec))
+			ctx->file->fdc = &content_file_fdc[
+			        ctx->shard % content_file_nlogs];
+		if (content_file_cas &&
+		    (opts->contentlog_isdir || opts->contentlog_isspec)) {
+			ctx->file->cas = malloc(sizeof(logcas_conn_t));
+			if (!ctx->file->cas)
+				goto errout;
+			logcas_conn_init(ctx->file->cas, content_file_cas,
+			                 ctx->shard % content_file_nlogs);
+		}
 
 		if (opts->contentlog_isdir) {
 			/* per-connection-file content log (-S) */
 			if (asprintf(&ctx->file->u.dir.filename,
-			             "%s/%s-%s,%s-%s,%s.log",
+			             "%s/%s-%s,%s-%s,%s.log%s",
 			             opts->contentlog, timebuf,
 			             srchost_clean, srcport,
-			             dsthost_clean, dstport) < 0) {
+			             dsthost_clean, dstport,
+			             log_compress ? ".gz" : "") < 0) {
 				log_err_printf("Failed to format filename:"
 				               " %s (%i)\n",
 				               strerror(errno), errno);
@@ -684,16 +1672,22 @@ log_content_open(log_content_ctx_t *ctx, opts_t *opts,
 		} else if (opts->contentlog_isspec) {
 			/* per-connection-file content log with logspec (-F) */
 			ctx->file->u.spec.filename =
-				log_content_format_pathspec(opts->contentlog,
-				                            srchost_clean,
-				                            srcport,
-				                            dsthost_clean,
-				                            dstport,
-				                            exec_path,
-				                            user, group);
+				log_pathspec_format(content_file_spec,
+				                    srchost_clean, srcport,
+				                    dsthost_clean, dstport,
+				                    exec_path, user, group);
 			if (!ctx->file->u.spec.filename) {
 				goto errout;
 			}
+		} else if (opts->contentlog_isseg) {
+			/* segmented content log */
+			ctx->file->u.seg.store = content_file_seg[ctx->shard %
+			                                          content_file_nlogs];
+			if (logseg_conn_init(&ctx->file->u.seg.conn,
+			                     srchost, srcport, dsthost, dstport,
+			                     sni) == -1) {
+				goto errout;
+			}
 		} else {
 			/* single-file content log (-L) */
 			if (asprintf(&ctx->file->u.single.header_req,
@@ -716,17 +1710,53 @@ log_content_open(log_content_ctx_t *ctx, opts_t *opts,
 			goto errout;
 		memset(ctx->pcap, 0, sizeof(log_content_pcap_ctx_t));
 
-		logpkt_ctx_init(&ctx->pcap->state, NULL, 0,
+		logpkt_ctx_init(&ctx->pcap->state, NULL, NULL, 0,
 		                content_pcap_src_ether, content_pcap_dst_ether,
 		                srcaddr, srcaddrlen, dstaddr, dstaddrlen);
+		if (log_compress && (opts->pcaplog_isdir ||
+		                     opts->pcaplog_isspec))
+			ctx->pcap->zlist = &content_pcap_zlist[
+			        ctx->shard % content_pcap_nlogs];
+		else
+			ctx->pcap->state.z = content_pcap_z;
+		if (opts->contentlog_maxfiles && (opts->pcaplog_isdir ||
+		                                  opts->pcaplog_isspec))
+			ctx->pcap->fdc = &content_pcap_fdc[
+			        ctx->shard % content_pcap_nlogs];
+		ctx->pcap->state.noacks = opts->pcaplog_noacks;
+
+		if (content_pcap_isng) {
+			/* describe the connection once per pcapng section */
+			if (asprintf(&ctx->pcap->ng_desc, "[%s]:%s -> [%s]:%s",
+			             srchost, srcport, dsthost, dstport) < 0) {
+				ctx->pcap->ng_desc = NULL;
+				goto errout;
+			}
+			if ((sni || origcrtfpr) &&
+			    asprintf(&ctx->pcap->ng_comment,
+			             "sni:%s origcrt:%s",
+			             sni ? sni : "-",
+			             origcrtfpr ? origcrtfpr : "-") < 0) {
+				ctx->pcap->ng_comment = NULL;
+				goto errout;
+			}
+			logpkt_ctx_set_pcapng(&ctx->pcap->state,
+			                      (opts->pcaplog_isdir ||
+			                       opts->pcaplog_isspec) ?
+			                      &ctx->pcap->ng : &content_pcap_ng,
+			                      ctx->pcap->ng_desc,
+			                      ctx->pcap->ng_comment);
+		}
 
 		if (opts->pcaplog_isdir) {
 			/* per-connection-file pcap log (-Y) */
 			if (asprintf(&ctx->pcap->u.dir.filename,
-			             "%s/%s-%s,%s-%s,%s.pcap",
+			             "%s/%s-%s,%s-%s,%s.%s%s",
 			             opts->pcaplog, timebuf,
 			             srchost_clean, srcport,
-			             dsthost_clean, dstport) < 0) {
+			             dsthost_clean, dstport,
+			             content_pcap_isng ? "pcapng" : "pcap",
+			             log_compress ? ".gz" : "") < 0) {
 				log_err_printf("Failed to format filename:"
 				               " %s (%i)\n",
 				               strerror(errno), errno);
@@ -735,13 +1765,10 @@ log_content_open(log_content_ctx_t *ctx, opts_t *opts,
 		} else if (opts->pcaplog_isspec) {
 			/* per-connection-file pcap log with logspec (-y) */
 			ctx->pcap->u.spec.filename =
-				log_content_format_pathspec(opts->pcaplog,
-				                            srchost_clean,
-				                            srcport,
-				                            dsthost_clean,
-				                            dstport,
-				                            exec_path,
-				                            user, group);
+				log_pathspec_format(content_pcap_spec,
+				                    srchost_clean, srcport,
+				                    dsthost_clean, dstport,
+				                    exec_path, user, group);
 			if (!ctx->pcap->u.spec.filename) {
 				goto errout;
 			}
@@ -757,20 +1784,55 @@ log_content_open(log_content_ctx_t *ctx, opts_t *opts,
 
 		logpkt_ctx_init(&ctx->mirror->state,
 		                content_mirror_libnet,
+		                content_mirror_tx,
 		                content_mirror_mtu,
 		                content_mirror_src_ether,
-		                content_mirror_dst_ether,
+		                content_mirror_src_ether,
 		                srcaddr, srcaddrlen, dstaddr, dstaddrlen);
+		ctx->mirror->hash = log_content_mirror_hash(srcaddr, dstaddr);
+		ctx->mirror->target = log_content_mirror_select(
+		                      ctx->mirror->hash,
+		                      ctx->mirror->state.dst_ether);
 	}
 #endif /* !WITHOUT_MIRROR */
 
+	if (content_tap_log) {
+		ctx->tap = malloc(sizeof(log_content_tap_ctx_t));
+		if (!ctx->tap)
+			goto errout;
+		if (logtap_conn_init(&ctx->tap->conn, srchost, srcport,
+		                     dsthost, dstport, sni) == -1) {
+			free(ctx->tap);
+			ctx->tap = NULL;
+			goto errout;
+		}
+	}
+
+	if (content_stream_log) {
+		ctx->stream = malloc(sizeof(log_content_stream_ctx_t));
+		if (!ctx->stream)
+			goto errout;
+		if (logtap_conn_init(&ctx->stream->conn, srchost, srcport,
+		                     dsthost, dstport, sni) == -1) {
+			free(ctx->stream);
+			ctx->stream = NULL;
+			goto errout;
+		}
+	}
+
+	/* record instead of opening file and pcap logs until triggered */
+	if (content_rec_sz && !ctx->live && (ctx->file || ctx->pcap)) {
+		if (log_content_rec_new(ctx) == -1)
+			goto errout;
+	}
+
 	/* submit open events */
-	if (ctx->file) {
-		if (logger_open(content_file_log, ctx->file) == -1)
+	if (ctx->file && !ctx->rec) {
+		if (logger_open(CONTENT_FILE_LOG(ctx), ctx->file) == -1)
 			goto errout;
 	}
-	if (ctx->pcap) {
-		if (logger_open(content_pcap_log, ctx->pcap) == -1)
+	if (ctx->pcap && !ctx->rec) {
+		if (logger_open(CONTENT_PCAP_LOG(ctx), ctx->pcap) == -1)
 			goto errout;
 	}
 #ifndef WITHOUT_MIRROR
@@ -779,6 +1841,14 @@ log_content_open(log_content_ctx_t *ctx, opts_t *opts,
 			goto errout;
 	}
 #endif /* !WITHOUT_MIRROR */
+	if (ctx->tap) {
+		if (logger_open(content_tap_log, ctx->tap) == -1)
+			goto errout;
+	}
+	if (ctx->stream) {
+		if (logger_open(content_stream_log, ctx->stream) == -1)
+			goto errout;
+	}
 
 	if (srchost_clean)
 		free(srchost_clean);
@@ -791,14 +1861,31 @@ errout:
 		free(srchost_clean);
 	if (dsthost_clean)
 		free(dsthost_clean);
-	if (ctx->file)
+	if (ctx->rec)
+		(void)log_content_rec_free(ctx);
+	if (ctx->file) {
+		if (ctx->file->cas)
+			free(ctx->file->cas);
 		free(ctx->file);
+	}
 	if (ctx->pcap) {
+		if (ctx->pcap->ng_desc)
+			free(ctx->pcap->ng_desc);
+		if (ctx->pcap->ng_comment)
+			free(ctx->pcap->ng_comment);
 		free(ctx->pcap);
 	}
 	if (ctx->mirror) {
 		free(ctx->mirror);
 	}
+	if (ctx->tap) {
+		logtap_conn_free(&ctx->tap->conn);
+		free(ctx->tap);
+	}
+	if (ctx->stream) {
+		logtap_conn_free(&ctx->stream->conn);
+		free(ctx->stream);
+	}
 	memset(ctx, 0, sizeof(log_content_ctx_t));
 	return -1;
 }
@@ -809,38 +1896,91 @@ errout:
 int
 log_content_submit(log_content_ctx_t *ctx, logbuf_t *lb, int is_request)
 {
-	unsigned long prepflags = 0;
-	logbuf_t *lbpcap, *lbmirror;
+	return log_content_submit_body(ctx, lb, is_request, 0);
+}
+
+/*
+ * Submit message body octets with content or transfer coding.  The file
+ * content log decodes them according to the LBFLAG_DECODE bits in decode,
+ * where LBFLAG_NEWBODY marks the first octets of a new message body.
+ * The pcap and mirror logs and the tap receive the octets as they were
+ * forwarded.
+ * On failure, lb is not freed.
+ */
+int
+log_content_submit_body(log_content_ctx_t *ctx, logbuf_t *lb, int is_request,
+                        unsigned long decode)
+{
+	unsigned long prepflags = decode & LBFLAG_DECODE;
+	logbuf_t *lbpcap, *lbmirror, *lbtap, *lbstream;
+	unsigned int nfile, npcap;
 
 	if (is_request)
 		prepflags |= PREPFLAG_REQUEST;
 
+	/* the flight recorder takes the place of the file and pcap logs */
+	nfile = ctx->rec ? 0 : content_file_nlogs;
+	npcap = ctx->rec ? 0 : content_pcap_nlogs;
+
+	/* all content logs share the same immutable buffer */
 	lb = logbuf_make_contiguous(lb);
 	if (!lb)
 		return -1;
 
-	lbpcap = lbmirror = lb;
-	if (content_file_log) {
-		if (content_pcap_log) {
-			lbpcap = logbuf_new_deepcopy(lb, 1);
+	lbpcap = lbmirror = lbtap = lbstream = lb;
+	if (content_stream_log && (nfile || npcap || ctx->rec
+#ifndef WITHOUT_MIRROR
+	                           || content_mirror_log
+#endif /* !WITHOUT_MIRROR */
+	                           || content_tap_log)) {
+		lbstream = logbuf_new_shared(lb);
+		if (!lbstream)
+			return -1;
+	}
+	if (content_tap_log && (nfile || npcap || ctx->rec
+#ifndef WITHOUT_MIRROR
+	                        || content_mirror_log
+#endif /* !WITHOUT_MIRROR */
+	                        )) {
+		lbtap = logbuf_new_shared(lb);
+		if (!lbtap)
+			goto errout;
+	}
+	if (nfile) {
+		if (npcap) {
+			lbpcap = logbuf_new_shared(lb);
 			if (!lbpcap)
 				goto errout;
 		}
 #ifndef WITHOUT_MIRROR
 		if (content_mirror_log) {
-			lbmirror = logbuf_new_deepcopy(lb, 1);
+			lbmirror = logbuf_new_shared(lb);
 			if (!lbmirror)
 				goto errout;
 		}
-	} else if (content_pcap_log && content_mirror_log) {
-		lbmirror = logbuf_new_deepcopy(lb, 1);
+	} else if ((npcap || ctx->rec) && content_mirror_log) {
+		lbmirror = logbuf_new_shared(lb);
 		if (!lbmirror)
 			goto errout;
 #endif /* !WITHOUT_MIRROR */
 	}
 
-	if (content_pcap_log) {
-		if (logger_submit(content_pcap_log, ctx->pcap,
+	if (content_stream_log) {
+		if (logger_submit(content_stream_log, ctx->stream,
+		                  prepflags, lbstream) == -1) {
+			goto errout;
+		}
+		lbstream = NULL;
+	}
+	if (content_tap_log) {
+		if (logger_submit(content_tap_log, ctx->tap,
+		                  prepflags, lbtap) == -1) {
+			goto errout;
+		}
+		lbtap = NULL;
+	}
+	if (npcap) {
+		if (logger_submit(CONTENT_PCAP_LOG(ctx), ctx->pcap,
 		                  prepflags, lbpcap) == -1) {
 			goto errout;
 		}
@@ -855,21 +1995,56 @@ log_content_submit(log_content_ctx_t *ctx, logbuf_t *lb, int is_request)
 		lbmirror = NULL;
 	}
 #endif /* !WITHOUT_MIRROR */
-	if (content_file_log) {
-		if (logger_submit(content_file_log, ctx->file,
+	if (nfile) {
+		if (logger_submit(CONTENT_FILE_LOG(ctx), ctx->file,
 		                  prepflags, lb) == -1) {
 			return -1;
 		}
 	}
+	if (ctx->rec) {
+		/* always consumes lb, the other logs already got theirs */
+		(void)log_content_rec_add(ctx, prepflags, lb);
+	}
 	return 0;
 errout:
 	if (lbpcap && lbpcap != lb)
 		logbuf_free(lbpcap);
 	if (lbmirror && lbmirror != lb)
 		logbuf_free(lbmirror);
+	if (lbtap && lbtap != lb)
+		logbuf_free(lbtap);
+	if (lbstream && lbstream != lb)
+		logbuf_free(lbstream);
 	return -1;
 }
 
+/*
+ * Record in the file content log that the octets from the requestor
+ * (is_request is 1) or the responder (is_request is 0) are truncated from
+ * here on.  Raw per-connection files have no framing to record it in, the
+ * pcap and mirror logs simply end.
+ */
+int
+log_content_truncate(log_content_ctx_t *ctx, int is_request)
+{
+	unsigned long prepflags = PREPFLAG_TRUNC;
+
+	if (is_request)
+		prepflags |= PREPFLAG_REQUEST;
+	if (ctx->rec) {
+		if (ctx->file)
+			return log_content_rec_add(ctx, prepflags, NULL);
+		return 0;
+	}
+	if (content_file_nlogs && ctx->file) {
+		if (logger_submit(CONTENT_FILE_LOG(ctx), ctx->file,
+		                  prepflags, NULL) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
 int
 log_content_close(log_content_ctx_t *ctx, int by_requestor)
 {
@@ -887,23 +2062,26 @@ log_content_close(log_content_ctx_t *ctx, int by_requestor)
 	 * a chance to insert an EOF footer to be logged before actually
 	 * closing the file.  The logger_close() call will actually close the
 	 * log.  Some logs prefer to use the close callback for logging the
-	 * close event to the log. */
-	if (content_file_log && ctx->file) {
-		if (logger_submit(content_file_log, ctx->file,
+	 * close event to the log.  Recorded connections which were never
+	 * flushed are discarded without a trace. */
+	if (ctx->rec && !log_content_rec_free(ctx))
+		log_content_rec_discard(ctx);
+	if (content_file_nlogs && ctx->file) {
+		if (logger_submit(CONTENT_FILE_LOG(ctx), ctx->file,
 		                  prepflags, NULL) == -1) {
 			return -1;
 		}
-		if (logger_close(content_file_log, ctx->file, ctl) == -1) {
+		if (logger_close(CONTENT_FILE_LOG(ctx), ctx->file, ctl) == -1) {
 			return -1;
 		}
 		ctx->file = NULL;
 	}
-	if (content_pcap_log && ctx->pcap) {
-		if (logger_submit(content_pcap_log, ctx->pcap,
+	if (content_pcap_nlogs && ctx->pcap) {
+		if (logger_submit(CONTENT_PCAP_LOG(ctx), ctx->pcap,
 		                  prepflags, NULL) == -1) {
 			return -1;
 		}
-		if (logger_close(content_pcap_log, ctx->pcap, ctl) == -1) {
+		if (logger_close(CONTENT_PCAP_LOG(ctx), ctx->pcap, ctl) == -1) {
 			return -1;
 		}
 		ctx->pcap = NULL;
@@ -920,6 +2098,18 @@ log_content_close(log_content_ctx_t *ctx, int by_requestor)
 		ctx->mirror = NULL;
 	}
 #endif /* !WITHOUT_MIRROR */
+	if (content_tap_log && ctx->tap) {
+		if (logger_close(content_tap_log, ctx->tap, ctl) == -1) {
+			return -1;
+		}
+		ctx->tap = NULL;
+	}
+	if (content_stream_log && ctx->stream) {
+		if (logger_close(content_stream_log, ctx->stream, ctl) == -1) {
+			return -1;
+		}
+		ctx->stream = NULL;
+	}
 	return 0;
 }
 
@@ -930,100 +2120,445 @@ log_content_close(log_content_ctx_t *ctx, int by_requestor)
  * Callback functions are executed in the logger thread.
  */
 
+static void
+log_content_file_dec_free(log_content_file_ctx_t *ctx)
+{
+	if (ctx->dec)
+		logdec_free(ctx->dec);
+	for (int i = 0; i < 2; i++) {
+		if (ctx->wsdec[i])
+			logdec_free(ctx->wsdec[i]);
+	}
+}
+
+/*
+ * Decode message body octets according to the LBFLAG_DECODE bits in ctl.
+ * WebSocket streams are decoded with a decoder per direction, selected by
+ * LBFLAG_IS_REQ.
+ * Returns 1 and sets *out and *outsz to the decoded octets, which must be
+ * freed by the caller, if the octets were decoded; 0 if they should be
+ * written as is; -1 on out of memory condition.
+ */
 static int
-log_content_file_dir_opencb(void *fh)
+log_content_file_decode(log_content_file_ctx_t *ctx, unsigned long ctl,
+                        const void *buf, size_t sz,
+                        unsigned char **out, size_t *outsz)
 {
-	log_content_file_ctx_t *ctx = fh;
+	logdec_t **wsdec;
 
-	if ((ctx->u.dir.fd = privsep_client_openfile(content_file_clisock,
-	                                             ctx->u.dir.filename,
-	                                             0)) == -1) {
-		log_err_printf("Opening logdir file '%s' failed: %s (%i)\n",
-		               ctx->u.dir.filename,
-		               strerror(errno), errno);
-		return -1;
+	if (!(ctl & LBFLAG_DECODE))
+		return 0;
+	if (ctl & LBFLAG_WEBSOCKET) {
+		wsdec = &ctx->wsdec[!!(ctl & LBFLAG_IS_REQ)];
+		if (!*wsdec && !(*wsdec = logdec_new(LOGDEC_WEBSOCKET)))
+			return -1;
+		if (logdec_decode(*wsdec, buf, sz, out, outsz) == -1)
+			return -1;
+		return 1;
 	}
-	return 0;
+	if (ctl & LBFLAG_NEWBODY) {
+		if (ctx->dec)
+			logdec_free(ctx->dec);
+		ctx->dec = logdec_new(((ctl & LBFLAG_INFLATE) ?
+		                       LOGDEC_INFLATE : 0) |
+		                      ((ctl & LBFLAG_CHUNKED) ?
+		                       LOGDEC_CHUNKED : 0));
+		if (!ctx->dec)
+			return -1;
+	}
+	if (!ctx->dec)
+		return 0;
+	if (logdec_decode(ctx->dec, buf, sz, out, outsz) == -1)
+		return -1;
+	return 1;
 }
 
-static void
-log_content_file_dir_closecb(void *fh, UNUSED unsigned long ctl)
+/*
+ * Output of the manifest of a deduplicated dir/spec file, see logcas.c.
+ */
+typedef struct log_content_file_out {
+	int fd;
+	logz_t *z;
+} log_content_file_out_t;
+
+static ssize_t
+log_content_file_casout(void *arg, const void *buf, size_t sz)
 {
-	log_content_file_ctx_t *ctx = fh;
+	log_content_file_out_t *out = arg;
 
-	if (ctx->u.dir.filename)
-		free(ctx->u.dir.filename);
-	if (ctx->u.dir.fd != 1)
-		close(ctx->u.dir.fd);
-	free(ctx);
+	return log_zwrite(out->fd, out->z, buf, sz);
 }
 
+/*
+ * Write buf to fd, decoding message body octets if requested by ctl.  With
+ * ContentLogDedupDir, the octets are cut into chunks which are written to
+ * the chunk store, and fd receives the manifest referring to them.
+ */
 static ssize_t
-log_content_file_dir_writecb(void *fh, UNUSED unsigned long ctl,
-                             const void *buf, size_t sz)
+log_content_file_write(log_content_file_ctx_t *ctx, int fd, unsigned long ctl,
+                       const void *buf, size_t sz)
 {
-	log_content_file_ctx_t *ctx = fh;
+	unsigned char *decbuf = NULL;
+	size_t decsz;
+	ssize_t rv;
 
-	if (write(ctx->u.dir.fd, buf, sz) == -1) {
-		log_err_printf("Warning: Failed to write to content log: %s\n",
-		               strerror(errno));
+	rv = log_content_file_decode(ctx, ctl, buf, sz, &decbuf, &decsz);
+	if (rv == -1) {
+		log_err_rl_printf("Warning: Failed to decode content log\n");
 		return -1;
 	}
-	return sz;
+	if (rv == 1) {
+		buf = decbuf;
+		sz = decsz;
+	}
+	rv = sz;
+	if (ctx->cas) {
+		log_content_file_out_t out = {fd, ctx->z};
+
+		if (logcas_write(ctx->cas, ctl & LBFLAG_IS_REQ, buf, sz,
+		                 log_content_file_casout, &out) == -1) {
+			log_err_rl_printf("Warning: Failed to write to content "
+			                  "log or chunk store: %s\n",
+			                  strerror(errno));
+			rv = -1;
+		}
+	} else if (sz > 0 && log_zwrite(fd, ctx->z, buf, sz) == -1) {
+		log_err_rl_printf("Warning: Failed to write to content log: "
+		                  "%s\n", strerror(errno));
+		rv = -1;
+	}
+	if (decbuf)
+		free(decbuf);
+	return rv;
 }
 
-static int
-log_content_file_spec_opencb(void *fh)
+static logbuf_t *
+log_content_file_prepcb(UNUSED void *fh, unsigned long prepflags,
+                        logbuf_t *lb)
 {
-	log_content_file_ctx_t *ctx = fh;
+	if (lb)
+		logbuf_ctl_set(lb, (prepflags & LBFLAG_DECODE) |
+		                   ((prepflags & PREPFLAG_REQUEST) ?
+		                    LBFLAG_IS_REQ : LBFLAG_IS_RESP));
+	return lb;
+}
 
-	if ((ctx->u.spec.fd = privsep_client_openfile(content_file_clisock,
-	                                              ctx->u.spec.filename,
-	                                              1)) == -1) {
-		log_err_printf("Opening logspec file '%s' failed: %s (%i)\n",
-		               ctx->u.spec.filename, strerror(errno), errno);
-		return -1;
+/*
+ * Obtain the directory fd for per-connection log directory *path* from the
+ * privsep server.  Falls back to opening all files through the privsep server
+ * on failure.
+ */
+static void
+log_content_dir_open(log_content_dir_t *dir, int clisock, const char *path)
+{
+	dir->fd = privsep_client_opendir(clisock, path);
+	if (dir->fd == -1) {
+		log_dbg_printf("Failed to open log directory '%s', opening log "
+		               "files through privsep: %s (%i)\n",
+		               path, strerror(errno), errno);
+		return;
 	}
-	return 0;
+	dir->path = path;
+	dir->len = strlen(path);
+	dir->openat = 1;
 }
 
 static void
-log_content_file_spec_closecb(void *fh, UNUSED unsigned long ctl)
+log_content_dir_close(log_content_dir_t *dir)
 {
-	log_content_file_ctx_t *ctx = fh;
-
-	if (ctx->u.spec.filename)
-		free(ctx->u.spec.filename);
-	if (ctx->u.spec.fd != -1)
-		close(ctx->u.spec.fd);
-	free(ctx);
+	if (dir->fd != -1) {
+		close(dir->fd);
+		dir->fd = -1;
+	}
+	dir->openat = 0;
 }
 
-static ssize_t
-log_content_file_spec_writecb(void *fh, UNUSED unsigned long ctl,
-                              const void *buf, size_t sz)
+/*
+ * Open a per-connection log file, using openat() beneath the log directory
+ * *dir* if possible, through privsep client socket *clisock* otherwise.
+ * Called from the writer threads of all shards.
+ */
+static int
+log_content_openfile(int clisock, log_content_dir_t *dir, const char *fn,
+                     int mkpath)
 {
-	log_content_file_ctx_t *ctx = fh;
+	int fd;
 
-	if (write(ctx->u.spec.fd, buf, sz) == -1) {
-		log_err_printf("Warning: Failed to write to content log: %s\n",
-		               strerror(errno));
-		return -1;
+	if (__atomic_load_n(&dir->openat, __ATOMIC_RELAXED) &&
+	    !strncmp(fn, dir->path, dir->len) && fn[dir->len] == '/') {
+		fd = sys_openat_mkpath(dir->fd, fn + dir->len + 1, mkpath,
+		                       DFLT_DIRMODE, DFLT_FILEMODE);
+		if (fd != -1)
+			return fd;
+		if (errno == EACCES || errno == EPERM) {
+			log_dbg_printf("Log directory '%s' not writable, "
+			               "opening log files through privsep\n",
+			               dir->path);
+			__atomic_store_n(&dir->openat, 0, __ATOMIC_RELAXED);
+		}
 	}
-	return sz;
+
+	return privsep_client_openfile(clisock, fn, mkpath);
 }
 
-static int content_file_single_fd = -1;
-static char *content_file_single_fn = NULL;
+/*
+ * Reopen per-connection log files closed by the bounded fd caches of the
+ * writer threads, see logfdc.c.
+ */
+static int
+log_content_file_reopen(const char *fn)
+{
+	return log_content_openfile(content_file_clisock, &content_file_dir,
+	                            fn, 0);
+}
 
 static int
-log_content_file_single_preinit(const char *logfile)
+log_content_pcap_reopen(const char *fn)
 {
-	content_file_single_fd = open(logfile, O_WRONLY|O_APPEND|O_CREAT,
-	                       DFLT_FILEMODE);
-	if (content_file_single_fd == -1) {
-		log_err_printf("Failed to open '%s' for writing: %s (%i)\n",
-		               logfile, strerror(errno), errno);
+	return log_content_openfile(content_pcap_clisock, &content_pcap_dir,
+	                            fn, 0);
+}
+
+static int
+log_content_fdc_use(logfdc_t *fdc, logfdc_ent_t *ent)
+{
+	if (logfdc_use(fdc, ent) == -1) {
+		log_err_rl_printf("Reopening log file '%s' failed: %s (%i)\n",
+		                  ent->fn, strerror(errno), errno);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Write the last chunk of a deduplicated dir/spec file and free its chunking
+ * state before closing the file *fd*, which may have been closed by the fd
+ * cache.
+ */
+static void
+log_content_file_cas_close(log_content_file_ctx_t *ctx, int *fd)
+{
+	log_content_file_out_t out;
+
+	if (!ctx->cas)
+		return;
+	if ((!ctx->fdcent.fd ||
+	     log_content_fdc_use(ctx->fdc, &ctx->fdcent) == 0) && *fd != -1) {
+		out.fd = *fd;
+		out.z = ctx->z;
+		if (logcas_flush(ctx->cas, log_content_file_casout,
+		                 &out) == -1)
+			log_err_rl_printf("Warning: Failed to write to content "
+			                  "log or chunk store: %s\n",
+			                  strerror(errno));
+	}
+	logcas_conn_free(ctx->cas);
+	free(ctx->cas);
+	ctx->cas = NULL;
+}
+
+static int
+log_content_file_cas_openfile(const char *fn)
+{
+	return log_content_openfile(content_file_clisock,
+	                            &content_file_casdir, fn, 0);
+}
+
+static int
+log_content_file_dir_opencb(void *fh)
+{
+	log_content_file_ctx_t *ctx = fh;
+
+	if ((ctx->u.dir.fd = log_content_openfile(content_file_clisock,
+	                                          &content_file_dir,
+	                                          ctx->u.dir.filename,
+	                                          0)) == -1) {
+		log_err_rl_printf("Opening logdir file '%s' failed: %s (%i)\n",
+		                  ctx->u.dir.filename,
+		                  strerror(errno), errno);
+		return -1;
+	}
+	if (ctx->zlist && !(ctx->z = logz_new(ctx->u.dir.fd, ctx->zlist)))
+		return -1;
+	if (ctx->fdc)
+		logfdc_add(ctx->fdc, &ctx->fdcent, &ctx->u.dir.fd, &ctx->z,
+		           ctx->u.dir.filename);
+	return 0;
+}
+
+static void
+log_content_file_dir_closecb(void *fh, UNUSED unsigned long ctl)
+{
+	log_content_file_ctx_t *ctx = fh;
+
+	log_content_file_cas_close(ctx, &ctx->u.dir.fd);
+	log_content_file_dec_free(ctx);
+	if (ctx->fdc)
+		logfdc_remove(ctx->fdc, &ctx->fdcent);
+	if (ctx->z)
+		logz_free(ctx->z);
+	if (ctx->u.dir.filename)
+		free(ctx->u.dir.filename);
+	if (ctx->u.dir.fd != -1)
+		close(ctx->u.dir.fd);
+	free(ctx);
+}
+
+static ssize_t
+log_content_file_dir_writecb(void *fh, unsigned long ctl,
+                             const void *buf, size_t sz)
+{
+	log_content_file_ctx_t *ctx = fh;
+
+	if (ctx->fdcent.fd &&
+	    log_content_fdc_use(ctx->fdc, &ctx->fdcent) == -1)
+		return -1;
+	return log_content_file_write(ctx, ctx->u.dir.fd, ctl, buf, sz);
+}
+
+static int
+log_content_file_spec_opencb(void *fh)
+{
+	log_content_file_ctx_t *ctx = fh;
+
+	if ((ctx->u.spec.fd = log_content_openfile(content_file_clisock,
+	                                           &content_file_dir,
+	                                           ctx->u.spec.filename,
+	                                           1)) == -1) {
+		log_err_rl_printf("Opening logspec file '%s' failed: %s (%i)\n",
+		                  ctx->u.spec.filename, strerror(errno), errno);
+		return -1;
+	}
+	if (ctx->zlist && !(ctx->z = logz_new(ctx->u.spec.fd, ctx->zlist)))
+		return -1;
+	if (ctx->fdc)
+		logfdc_add(ctx->fdc, &ctx->fdcent, &ctx->u.spec.fd, &ctx->z,
+		           ctx->u.spec.filename);
+	return 0;
+}
+
+static void
+log_content_file_spec_closecb(void *fh, UNUSED unsigned long ctl)
+{
+	log_content_file_ctx_t *ctx = fh;
+
+	log_content_file_cas_close(ctx, &ctx->u.spec.fd);
+	log_content_file_dec_free(ctx);
+	if (ctx->fdc)
+		logfdc_remove(ctx->fdc, &ctx->fdcent);
+	if (ctx->z)
+		logz_free(ctx->z);
+	if (ctx->u.spec.filename)
+		free(ctx->u.spec.filename);
+	if (ctx->u.spec.fd != -1)
+		close(ctx->u.spec.fd);
+	free(ctx);
+}
+
+static ssize_t
+log_content_file_spec_writecb(void *fh, unsigned long ctl,
+                              const void *buf, size_t sz)
+{
+	log_content_file_ctx_t *ctx = fh;
+
+	if (ctx->fdcent.fd &&
+	    log_content_fdc_use(ctx->fdc, &ctx->fdcent) == -1)
+		return -1;
+	return log_content_file_write(ctx, ctx->u.spec.fd, ctl, buf, sz);
+}
+
+/*
+ * Segmented content log: all connections of a shard are appended to the
+ * shard's segment store, see logseg.c.
+ */
+static int
+log_content_file_seg_openfile(const char *fn)
+{
+	return log_content_openfile(content_file_clisock, &content_file_dir,
+	                            fn, 0);
+}
+
+static logbuf_t *
+log_content_file_seg_prepcb(void *fh, unsigned long prepflags,
+                            logbuf_t *lb)
+{
+	/* truncation is recorded as an empty chunk record */
+	if (!lb && (prepflags & PREPFLAG_TRUNC)) {
+		if (!(lb = logbuf_new(NULL, 0, NULL)))
+			return NULL;
+		lb->fh = fh;
+		logbuf_ctl_set(lb, LBFLAG_TRUNC);
+	}
+	if (lb)
+		logbuf_ctl_set(lb, (prepflags & LBFLAG_DECODE) |
+		                   ((prepflags & PREPFLAG_REQUEST) ?
+		                    LBFLAG_IS_REQ : LBFLAG_IS_RESP));
+	return lb;
+}
+
+static void
+log_content_file_seg_closecb(void *fh, unsigned long ctl)
+{
+	log_content_file_ctx_t *ctx = fh;
+
+	if (logseg_close(ctx->u.seg.store, &ctx->u.seg.conn,
+	                 (ctl & LBFLAG_IS_REQ) ? LOGSEG_REQUEST : 0) == -1) {
+		log_err_rl_printf("Warning: Failed to write to content log "
+		                  "segment: %s\n", strerror(errno));
+	}
+	log_content_file_dec_free(ctx);
+	logseg_conn_free(&ctx->u.seg.conn);
+	free(ctx);
+}
+
+static ssize_t
+log_content_file_seg_writecb(void *fh, unsigned long ctl,
+                             const void *buf, size_t sz)
+{
+	log_content_file_ctx_t *ctx = fh;
+	unsigned char *decbuf = NULL;
+	size_t decsz;
+	ssize_t rv;
+
+	rv = log_content_file_decode(ctx, ctl, buf, sz, &decbuf, &decsz);
+	if (rv == -1) {
+		log_err_rl_printf("Warning: Failed to decode content log\n");
+		return -1;
+	}
+	if (rv == 1) {
+		buf = decbuf;
+		sz = decsz;
+	}
+	rv = sz;
+	if ((sz > 0 || (ctl & LBFLAG_TRUNC)) &&
+	    logseg_write(ctx->u.seg.store, &ctx->u.seg.conn,
+	                 ((ctl & LBFLAG_IS_REQ) ? LOGSEG_REQUEST : 0) |
+	                 ((ctl & LBFLAG_TRUNC) ? LOGSEG_TRUNC : 0),
+	                 buf, sz) == -1) {
+		log_err_rl_printf("Warning: Failed to write to content log "
+		                  "segment: %s\n", strerror(errno));
+		rv = -1;
+	}
+	if (decbuf)
+		free(decbuf);
+	return rv;
+}
+
+static int content_file_single_fd = -1;
+static char *content_file_single_fn = NULL;
+static logz_t *content_file_single_z = NULL;
+static logsync_t content_file_single_sync;
+
+static void log_content_file_single_fini(void);
+
+static int
+log_content_file_single_preinit(const char *logfile)
+{
+	content_file_single_fd = open(logfile, O_WRONLY|O_APPEND|O_CREAT,
+	                       DFLT_FILEMODE);
+	if (content_file_single_fd == -1) {
+		log_err_rl_printf("Failed to open '%s' for writing: %s (%i)\n",
+		                  logfile, strerror(errno), errno);
 		return -1;
 	}
 	content_file_single_fn = strdup(logfile);
@@ -1032,12 +2567,26 @@ log_content_file_single_preinit(const char *logfile)
 		content_file_single_fd = -1;
 		return -1;
 	}
+	if (log_compress &&
+	    !(content_file_single_z = logz_new(content_file_single_fd,
+	                                       &content_file_zlist[0]))) {
+		log_content_file_single_fini();
+		return -1;
+	}
+	log_sync_init(&content_file_single_sync, content_file_single_fd);
 	return 0;
 }
 
 static void
 log_content_file_single_fini(void)
 {
+	if (content_file_single_z) {
+		logz_free(content_file_single_z);
+		content_file_single_z = NULL;
+	}
+	if (content_file_single_fd != -1)
+		log_sync_close(&content_file_single_sync,
+		               content_file_single_fn);
 	if (content_file_single_fn) {
 		free(content_file_single_fn);
 		content_file_single_fn = NULL;
@@ -1051,15 +2600,21 @@ log_content_file_single_fini(void)
 static int
 log_content_file_single_reopencb(void)
 {
+	log_zfinish(content_file_single_z, content_file_single_fn);
+	log_sync_close(&content_file_single_sync, content_file_single_fn);
 	close(content_file_single_fd);
 	content_file_single_fd = privsep_client_openfile(content_file_clisock,
 	                                                 content_file_single_fn,
 	                                                 0);
 	if (content_file_single_fd == -1) {
-		log_err_printf("Failed to open '%s' for writing: %s (%i)\n",
-		               content_file_single_fn, strerror(errno), errno);
+		log_err_rl_printf("Failed to open '%s' for writing: %s (%i)\n",
+		                  content_file_single_fn, strerror(errno),
+		                  errno);
 		return -1;
 	}
+	if (content_file_single_z)
+		logz_setfd(content_file_single_z, content_file_single_fd);
+	log_sync_init(&content_file_single_sync, content_file_single_fd);
 	return 0;
 }
 
@@ -1068,6 +2623,7 @@ log_content_file_single_closecb(void *fh, UNUSED unsigned long ctl)
 {
 	log_content_file_ctx_t *ctx = fh;
 
+	log_content_file_dec_free(ctx);
 	if (ctx->u.single.header_req) {
 		free(ctx->u.single.header_req);
 	}
@@ -1077,44 +2633,31 @@ log_content_file_single_closecb(void *fh, UNUSED unsigned long ctl)
 	free(ctx);
 }
 
-static ssize_t
-log_content_file_single_writecb(void *fh, UNUSED unsigned long ctl,
-                                const void *buf, size_t sz)
-{
-	UNUSED log_content_file_ctx_t *ctx = fh;
-
-	if (write(content_file_single_fd, buf, sz) == -1) {
-		log_err_printf("Warning: Failed to write to content log: %s\n",
-		               strerror(errno));
-		return -1;
-	}
-	return sz;
-}
-
+/*
+ * Prepend timestamp, header and size tag to lb, or return timestamp, header
+ * and EOF or TRUNCATED tag if lb is NULL, according to prepflags.
+ * On failure, lb is freed and NULL is returned.
+ */
 static logbuf_t *
-log_content_file_single_prepcb(void *fh, unsigned long prepflags,
-                               logbuf_t *lb)
+log_content_file_single_head(const char *header, unsigned long prepflags,
+                             logbuf_t *lb)
 {
-	log_content_file_ctx_t *ctx = fh;
-	int is_request = !!(prepflags & PREPFLAG_REQUEST);
 	logbuf_t *head;
 	time_t epoch;
 	struct tm *utc;
-	char *header;
-
-	if (!(header = is_request ? ctx->u.single.header_req
-	                          : ctx->u.single.header_resp))
-		goto out;
 
-	/* prepend size tag or EOF, and newline */
+	/* prepend size tag, EOF or TRUNCATED, and newline */
 	if (prepflags & PREPFLAG_EOF) {
 		head = logbuf_new_printf(NULL, " (EOF)\n");
+	} else if (prepflags & PREPFLAG_TRUNC) {
+		head = logbuf_new_printf(NULL, " (TRUNCATED)\n");
 	} else {
 		head = logbuf_new_printf(lb, " (%zu):\n", logbuf_size(lb));
 	}
 	if (!head) {
 		log_err_printf("Failed to allocate memory\n");
-		logbuf_free(lb);
+		if (lb)
+			logbuf_free(lb);
 		return NULL;
 	}
 	lb = head;
@@ -1140,21 +2683,92 @@ log_content_file_single_prepcb(void *fh, unsigned long prepflags,
 	utc = gmtime(&epoch);
 	lb->sz = strftime((char*)lb->buf, lb->sz, "%Y-%m-%d %H:%M:%S UTC ",
 	                  utc);
-
-out:
 	return lb;
 }
 
+static ssize_t
+log_content_file_single_writecb(void *fh, unsigned long ctl,
+                                const void *buf, size_t sz)
+{
+	log_content_file_ctx_t *ctx = fh;
+	unsigned char *decbuf;
+	size_t decsz;
+	logbuf_t *lb;
+	int rv;
+
+	/* Message body octets to be decoded are submitted without header by
+	 * the prep callback, in order to log the size of the decoded data. */
+	rv = log_content_file_decode(ctx, ctl, buf, sz, &decbuf, &decsz);
+	if (rv == -1) {
+		log_err_rl_printf("Warning: Failed to decode content log\n");
+		return -1;
+	}
+	if (rv == 1 || (ctl & LBFLAG_DECODE)) {
+		if (rv == 1) {
+			if (!decsz)
+				return 0;
+			lb = logbuf_new(decbuf, decsz, NULL);
+		} else {
+			lb = logbuf_new_copy(buf, sz, NULL);
+		}
+		if (!lb)
+			return -1;
+		lb = log_content_file_single_head(
+		        (ctl & LBFLAG_IS_REQ) ?
+		        ctx->u.single.header_req : ctx->u.single.header_resp,
+		        0, lb);
+		if (!lb)
+			return -1;
+		lb->fh = fh;
+		return logbuf_write_free(lb, log_content_file_single_writecb);
+	}
+
+	if (log_zwrite(content_file_single_fd, content_file_single_z,
+	               buf, sz) == -1) {
+		log_err_rl_printf("Warning: Failed to write to content log: "
+		                  "%s\n", strerror(errno));
+		return -1;
+	}
+	log_sync_wrote(&content_file_single_sync, content_file_single_fn);
+	return sz;
+}
+
+static logbuf_t *
+log_content_file_single_prepcb(void *fh, unsigned long prepflags,
+                               logbuf_t *lb)
+{
+	log_content_file_ctx_t *ctx = fh;
+	int is_request = !!(prepflags & PREPFLAG_REQUEST);
+	char *header;
+
+	if (!(header = is_request ? ctx->u.single.header_req
+	                          : ctx->u.single.header_resp))
+		return lb;
+
+	/* header is prepended by the write callback after decoding */
+	if (lb && (prepflags & LBFLAG_DECODE)) {
+		logbuf_ctl_set(lb, (prepflags & LBFLAG_DECODE) |
+		                   (is_request ? LBFLAG_IS_REQ
+		                               : LBFLAG_IS_RESP));
+		return lb;
+	}
+
+	return log_content_file_single_head(header, prepflags, lb);
+}
+
 /*
  * Pcap writer for -X/-Y/-y options.
  */
 static int content_pcap_fd = -1;
 static char *content_pcap_fn = NULL;
+static logsync_t content_pcap_sync;
 
 /*
  * Initialize pcap content logging.  For single-file mode, pcapfile is the
  * path to the file.  For dir/spec modes, pcapfile is NULL.
  */
+static void log_content_pcap_fini(void);
+
 static int
 log_content_pcap_preinit(const char *pcapfile)
 {
@@ -1165,30 +2779,44 @@ log_content_pcap_preinit(const char *pcapfile)
 
 	content_pcap_fd = open(pcapfile, O_RDWR|O_CREAT, DFLT_FILEMODE);
 	if (content_pcap_fd == -1) {
-		log_err_printf("Failed to open '%s' for writing: %s (%i)\n",
-		               pcapfile, strerror(errno), errno);
+		log_err_rl_printf("Failed to open '%s' for writing: %s (%i)\n",
+		                  pcapfile, strerror(errno), errno);
+		return -1;
+	}
+	if (log_compress &&
+	    !(content_pcap_z = logz_new(content_pcap_fd,
+	                                &content_pcap_zlist[0]))) {
+		close(content_pcap_fd);
+		content_pcap_fd = -1;
 		return -1;
 	}
-	if (logpkt_pcap_open_fd(content_pcap_fd) == -1) {
+	if (logpkt_pcap_open_fd(content_pcap_fd, content_pcap_z,
+	                        content_pcap_isng ? &content_pcap_ng
+	                                          : NULL) == -1) {
 		log_err_printf("Failed to prepare '%s' for PCAP writing"
 		               ": %s (%i)\n",
 		               pcapfile, strerror(errno), errno);
-		close(content_pcap_fd);
-		content_pcap_fd = -1;
+		log_content_pcap_fini();
 		return -1;
 	}
 	content_pcap_fn = strdup(pcapfile);
 	if (!content_pcap_fn) {
-		close(content_pcap_fd);
-		content_pcap_fd = -1;
+		log_content_pcap_fini();
 		return -1;
 	}
+	log_sync_init(&content_pcap_sync, content_pcap_fd);
 	return 0;
 }
 
 static void
 log_content_pcap_fini(void)
 {
+	if (content_pcap_z) {
+		logz_free(content_pcap_z);
+		content_pcap_z = NULL;
+	}
+	if (content_pcap_fd != -1 && content_pcap_fn)
+		log_sync_close(&content_pcap_sync, content_pcap_fn);
 	if (content_pcap_fn) {
 		free(content_pcap_fn);
 		content_pcap_fn = NULL;
@@ -1201,16 +2829,22 @@ log_content_pcap_fini(void)
 
 static int
 log_content_pcap_reopencb(void) {
+	log_zfinish(content_pcap_z, content_pcap_fn);
+	log_sync_close(&content_pcap_sync, content_pcap_fn);
 	close(content_pcap_fd);
 	content_pcap_fd = privsep_client_openfile(content_pcap_clisock,
 	                                          content_pcap_fn,
 	                                          0);
 	if (content_pcap_fd == -1) {
-		log_err_printf("Failed to open '%s' for writing: %s (%i)\n",
-		               content_pcap_fn, strerror(errno), errno);
+		log_err_rl_printf("Failed to open '%s' for writing: %s (%i)\n",
+		                  content_pcap_fn, strerror(errno), errno);
 		return -1;
 	}
-	if (logpkt_pcap_open_fd(content_pcap_fd) == -1) {
+	if (content_pcap_z)
+		logz_setfd(content_pcap_z, content_pcap_fd);
+	if (logpkt_pcap_open_fd(content_pcap_fd, content_pcap_z,
+	                        content_pcap_isng ? &content_pcap_ng
+	                                          : NULL) == -1) {
 		log_err_printf("Failed to prepare '%s' for PCAP writing"
 		               ": %s (%i)\n",
 		               content_pcap_fn, strerror(errno), errno);
@@ -1218,6 +2852,7 @@ log_content_pcap_reopencb(void) {
 		content_pcap_fd = -1;
 		return -1;
 	}
+	log_sync_init(&content_pcap_sync, content_pcap_fd);
 	return 0;
 }
 
@@ -1228,12 +2863,17 @@ log_content_pcap_closecb_base(void *fh, unsigned long ctl, int fd) {
 	                                      : LOGPKT_RESPONSE;
 
 	logpkt_write_close(&ctx->state, fd, direction);
+	if (ctx->ng_desc)
+		free(ctx->ng_desc);
+	if (ctx->ng_comment)
+		free(ctx->ng_comment);
 }
 
 static void
 log_content_pcap_closecb(void *fh, unsigned long ctl) {
 	log_content_pcap_ctx_t *ctx = fh;
 	log_content_pcap_closecb_base(fh, ctl, content_pcap_fd);
+	log_sync_wrote(&content_pcap_sync, content_pcap_fn);
 	free(ctx);
 }
 
@@ -1249,15 +2889,19 @@ log_content_pcap_writecb_base(void *fh, unsigned long ctl,
 
 	return sz;
 errout:
-	log_err_printf("Warning: Failed to write to pcap log: %s (%i)\n",
-	               strerror(errno), errno);
+	log_err_rl_printf("Warning: Failed to write to pcap log: %s (%i)\n",
+	                  strerror(errno), errno);
 	return -1;
 }
 
 static ssize_t
 log_content_pcap_writecb(void *fh, unsigned long ctl,
                          const void *buf, size_t sz) {
-	return log_content_pcap_writecb_base(fh, ctl, buf, sz, content_pcap_fd);
+	ssize_t rv;
+
+	rv = log_content_pcap_writecb_base(fh, ctl, buf, sz, content_pcap_fd);
+	log_sync_wrote(&content_pcap_sync, content_pcap_fn);
+	return rv;
 }
 
 static int
@@ -1265,21 +2909,38 @@ log_content_pcap_dir_opencb(void *fh)
 {
 	log_content_pcap_ctx_t *ctx = fh;
 
-	if ((ctx->u.dir.fd = privsep_client_openfile(content_pcap_clisock,
-	                                             ctx->u.dir.filename,
-	                                             0)) == -1) {
-		log_err_printf("Opening pcapdir file '%s' failed: %s (%i)\n",
-		               ctx->u.dir.filename, strerror(errno), errno);
+	if ((ctx->u.dir.fd = log_content_openfile(content_pcap_clisock,
+	                                          &content_pcap_dir,
+	                                          ctx->u.dir.filename,
+	                                          0)) == -1) {
+		log_err_rl_printf("Opening pcapdir file '%s' failed: %s (%i)\n",
+		                  ctx->u.dir.filename, strerror(errno), errno);
 		return -1;
 	}
-	return logpkt_pcap_open_fd(ctx->u.dir.fd);
+	if (ctx->zlist &&
+	    !(ctx->state.z = logz_new(ctx->u.dir.fd, ctx->zlist)))
+		return -1;
+	if (logpkt_pcap_open_fd(ctx->u.dir.fd, ctx->state.z,
+	                        ctx->state.ng) == -1)
+		return -1;
+	if (ctx->fdc)
+		logfdc_add(ctx->fdc, &ctx->fdcent, &ctx->u.dir.fd,
+		           &ctx->state.z, ctx->u.dir.filename);
+	return 0;
 }
 
 static void
 log_content_pcap_dir_closecb(void *fh, unsigned long ctl)
 {
 	log_content_pcap_ctx_t *ctx = fh;
+	if (ctx->fdcent.fd) {
+		/* reopen to write the closing packets */
+		(void)log_content_fdc_use(ctx->fdc, &ctx->fdcent);
+		logfdc_remove(ctx->fdc, &ctx->fdcent);
+	}
 	log_content_pcap_closecb_base(fh, ctl, ctx->u.dir.fd);
+	if (ctx->state.z)
+		logz_free(ctx->state.z);
 	if (ctx->u.dir.filename)
 		free(ctx->u.dir.filename);
 	if (ctx->u.dir.fd != -1)
@@ -1292,6 +2953,9 @@ log_content_pcap_dir_writecb(void *fh, unsigned long ctl,
                              const void *buf, size_t sz)
 {
 	log_content_pcap_ctx_t *ctx = fh;
+	if (ctx->fdcent.fd &&
+	    log_content_fdc_use(ctx->fdc, &ctx->fdcent) == -1)
+		return -1;
 	return log_content_pcap_writecb_base(fh, ctl, buf, sz, ctx->u.dir.fd);
 }
 
@@ -1300,21 +2964,39 @@ log_content_pcap_spec_opencb(void *fh)
 {
 	log_content_pcap_ctx_t *ctx = fh;
 
-	if ((ctx->u.spec.fd = privsep_client_openfile(content_pcap_clisock,
-	                                              ctx->u.spec.filename,
-	                                              1)) == -1) {
-		log_err_printf("Opening pcapspec file '%s' failed: %s (%i)\n",
-		               ctx->u.spec.filename, strerror(errno), errno);
+	if ((ctx->u.spec.fd = log_content_openfile(content_pcap_clisock,
+	                                           &content_pcap_dir,
+	                                           ctx->u.spec.filename,
+	                                           1)) == -1) {
+		log_err_rl_printf("Opening pcapspec file '%s' failed: "
+		                  "%s (%i)\n", ctx->u.spec.filename,
+		                  strerror(errno), errno);
 		return -1;
 	}
-	return logpkt_pcap_open_fd(ctx->u.spec.fd);
+	if (ctx->zlist &&
+	    !(ctx->state.z = logz_new(ctx->u.spec.fd, ctx->zlist)))
+		return -1;
+	if (logpkt_pcap_open_fd(ctx->u.spec.fd, ctx->state.z,
+	                        ctx->state.ng) == -1)
+		return -1;
+	if (ctx->fdc)
+		logfdc_add(ctx->fdc, &ctx->fdcent, &ctx->u.spec.fd,
+		           &ctx->state.z, ctx->u.spec.filename);
+	return 0;
 }
 
 static void
 log_content_pcap_spec_closecb(void *fh, unsigned long ctl)
 {
 	log_content_pcap_ctx_t *ctx = fh;
+	if (ctx->fdcent.fd) {
+		/* reopen to write the closing packets */
+		(void)log_content_fdc_use(ctx->fdc, &ctx->fdcent);
+		logfdc_remove(ctx->fdc, &ctx->fdcent);
+	}
 	log_content_pcap_closecb_base(fh, ctl, ctx->u.spec.fd);
+	if (ctx->state.z)
+		logz_free(ctx->state.z);
 	if (ctx->u.spec.filename)
 		free(ctx->u.spec.filename);
 	if (ctx->u.spec.fd != -1)
@@ -1327,162 +3009,699 @@ log_content_pcap_spec_writecb(void *fh, unsigned long ctl,
                               const void *buf, size_t sz)
 {
 	log_content_pcap_ctx_t *ctx = fh;
+	if (ctx->fdcent.fd &&
+	    log_content_fdc_use(ctx->fdc, &ctx->fdcent) == -1)
+		return -1;
 	return log_content_pcap_writecb_base(fh, ctl, buf, sz, ctx->u.spec.fd);
 }
 
 static logbuf_t *
-log_content_pcap_prepcb(UNUSED void *fh, unsigned long prepflags,
-                        logbuf_t *lb) {
-	/* log_content_pcap_ctx_t *ctx = fh; */
-	if (prepflags & PREPFLAG_EOF)
-		return lb;
-	logbuf_ctl_set(lb, (prepflags & PREPFLAG_REQUEST) ? LBFLAG_IS_REQ
-	                                                  : LBFLAG_IS_RESP);
+log_content_pcap_prepcb(UNUSED void *fh, unsigned long prepflags,
+                        logbuf_t *lb) {
+	/* log_content_pcap_ctx_t *ctx = fh; */
+	if (prepflags & PREPFLAG_EOF)
+		return lb;
+	logbuf_ctl_set(lb, (prepflags & PREPFLAG_REQUEST) ? LBFLAG_IS_REQ
+	                                                  : LBFLAG_IS_RESP);
+	return lb;
+}
+
+/*
+ * Mirror writer for -T/-I options.
+ */
+
+#ifndef WITHOUT_MIRROR
+/*
+ * Probe all mirror targets by ARP and update their ether addresses and up
+ * flags, storing the ether address of the interface in src_ether.  Returns
+ * the number of targets that are up.
+ */
+static size_t
+log_content_mirror_probe(uint8_t *src_ether)
+{
+	uint8_t ether[ETHER_ADDR_LEN];
+	size_t nup = 0;
+
+	for (size_t i = 0; i < content_mirror_ntargets; i++) {
+		log_content_mirror_target_t *t = &content_mirror_targets[i];
+		int up;
+
+		up = logpkt_ether_lookup(content_mirror_arp_libnet,
+		                         content_mirror_arp,
+		                         src_ether, ether, t->ip,
+		                         LOG_MIRROR_PROBE_TRIES) == 0;
+		pthread_mutex_lock(&content_mirror_mutex);
+		if (up && memcmp(t->ether, ether, ETHER_ADDR_LEN)) {
+			if (t->resolved)
+				log_err_printf("Mirror target %s changed "
+				               "ether address\n", t->ip);
+			memcpy(t->ether, ether, ETHER_ADDR_LEN);
+			t->resolved = 1;
+		}
+		if (up != t->up) {
+			if (content_mirror_chk_running)
+				log_err_printf("Mirror target %s is %s\n",
+				               t->ip, up ? "up" : "down");
+			__atomic_store_n(&t->up, up, __ATOMIC_RELAXED);
+		}
+		pthread_mutex_unlock(&content_mirror_mutex);
+		if (up)
+			nup++;
+	}
+	return nup;
+}
+
+/*
+ * Health check thread, probing all mirror targets every
+ * content_mirror_chk_interval seconds.  Connections move away from targets
+ * found down on their next write; connections already mirrored to another
+ * target stay there when a target comes back up.
+ */
+static void *
+log_content_mirror_chk_thread(UNUSED void *arg)
+{
+	uint8_t src_ether[ETHER_ADDR_LEN];
+	struct timespec deadline;
+
+	pthread_mutex_lock(&content_mirror_mutex);
+	for (;;) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += content_mirror_chk_interval;
+		while (!content_mirror_chk_stopping &&
+		       pthread_cond_timedwait(&content_mirror_chk_cond,
+		                              &content_mirror_mutex,
+		                              &deadline) != ETIMEDOUT);
+		if (content_mirror_chk_stopping)
+			break;
+		pthread_mutex_unlock(&content_mirror_mutex);
+		log_content_mirror_probe(src_ether);
+		pthread_mutex_lock(&content_mirror_mutex);
+	}
+	pthread_mutex_unlock(&content_mirror_mutex);
+	return NULL;
+}
+
+static int
+log_content_mirror_chk_start(void)
+{
+	if (!content_mirror_chk_interval)
+		return 0;
+	if (pthread_create(&content_mirror_chk_thr, NULL,
+	                   log_content_mirror_chk_thread, NULL)) {
+		log_err_printf("Failed to start mirror health checks\n");
+		return -1;
+	}
+	content_mirror_chk_running = 1;
+	return 0;
+}
+
+static void
+log_content_mirror_chk_stop(void)
+{
+	if (!content_mirror_chk_running)
+		return;
+	pthread_mutex_lock(&content_mirror_mutex);
+	content_mirror_chk_stopping = 1;
+	pthread_cond_signal(&content_mirror_chk_cond);
+	pthread_mutex_unlock(&content_mirror_mutex);
+	pthread_join(content_mirror_chk_thr, NULL);
+	content_mirror_chk_running = 0;
+}
+
+/*
+ * Move a connection to another target if its target is down.
+ */
+static void
+log_content_mirror_failover(log_content_mirror_ctx_t *ctx)
+{
+	if (__atomic_load_n(&content_mirror_targets[ctx->target].up,
+	                    __ATOMIC_RELAXED))
+		return;
+	ctx->target = log_content_mirror_select(ctx->hash,
+	                                        ctx->state.dst_ether);
+}
+
+static void log_content_mirror_fini(void);
+
+/*
+ * Set up mirroring to the comma-separated list of IPv4 targets on interface
+ * ifname, with health checks every interval seconds or none if 0.  Targets
+ * are probed while still privileged; at least one must reply.
+ */
+static int
+log_content_mirror_preinit(const char *ifname, const char *targets,
+                           unsigned int interval)
+{
+	char errbuf[LIBNET_ERRBUF_SIZE];
+	char *list, *p, *ip, *save;
+	size_t nup = 0;
+
+	list = strdup(targets);
+	if (!list)
+		return -1;
+	for (p = list; (ip = strtok_r(p, ", \t", &save)); p = NULL) {
+		if (content_mirror_ntargets == LOG_MIRROR_MAX_TARGETS) {
+			log_err_printf("Too many mirror targets, max %i\n",
+			               LOG_MIRROR_MAX_TARGETS);
+			goto errout;
+		}
+		if (sys_get_af(ip) != AF_INET) {
+			log_err_printf("Mirroring target must be an IPv4 "
+			               "address: %s\n", ip);
+			goto errout;
+		}
+		content_mirror_targets[content_mirror_ntargets].ip = strdup(ip);
+		if (!content_mirror_targets[content_mirror_ntargets].ip)
+			goto errout;
+		content_mirror_ntargets++;
+	}
+	free(list);
+	list = NULL;
+	if (!content_mirror_ntargets) {
+		log_err_printf("No mirror target given\n");
+		goto errout;
+	}
+
+	/* cast to char* needed on OpenBSD */
+	content_mirror_libnet = libnet_init(LIBNET_LINK, (char *)ifname,
+	                                    errbuf);
+	if (content_mirror_libnet == NULL) {
+		log_err_printf("Failed to init mirror libnet: %s\n", errbuf);
+		goto errout;
+	}
+	libnet_seed_prand(content_mirror_libnet);
+
+	/* separate handle for ARP, used by the health check thread while
+	 * the mirror log thread writes packets through the first one */
+	content_mirror_arp_libnet = libnet_init(LIBNET_LINK, (char *)ifname,
+	                                        errbuf);
+	if (content_mirror_arp_libnet == NULL) {
+		log_err_printf("Failed to init mirror libnet: %s\n", errbuf);
+		goto errout;
+	}
+	content_mirror_arp = logpkt_arp_new(ifname);
+	if (!content_mirror_arp)
+		goto errout;
+
+	content_mirror_mtu = sys_get_mtu(ifname);
+	if (content_mirror_mtu == 0) {
+		log_err_printf("Failed to lookup MTU of interface %s\n",
+		               ifname);
+		goto errout;
+	}
+
+	for (int i = 0; i < LOG_MIRROR_START_ROUNDS && !nup; i++) {
+		nup = log_content_mirror_probe(content_mirror_src_ether);
+	}
+	if (!nup) {
+		log_err_printf("Failed to lookup target ether\n");
+		goto errout;
+	}
+	for (size_t i = 0; i < content_mirror_ntargets; i++) {
+		if (!content_mirror_targets[i].up)
+			log_err_printf("Mirror target %s is down\n",
+			               content_mirror_targets[i].ip);
+	}
+	content_mirror_chk_interval = interval;
+
+	/* batched transmission where supported, libnet_write() otherwise */
+	content_mirror_tx = logpkt_tx_new(ifname, content_mirror_mtu);
+	if (!content_mirror_tx) {
+		log_dbg_printf("Mirroring without batched transmission: %s\n",
+		               strerror(errno));
+	}
+
+	return 0;
+
+errout:
+	if (list)
+		free(list);
+	log_content_mirror_fini();
+	return -1;
+}
+
+static void
+log_content_mirror_fini(void)
+{
+	log_content_mirror_chk_stop();
+	if (content_mirror_tx) {
+		logpkt_tx_free(content_mirror_tx);
+		content_mirror_tx = NULL;
+	}
+	if (content_mirror_arp) {
+		logpkt_arp_free(content_mirror_arp);
+		content_mirror_arp = NULL;
+	}
+	if (content_mirror_arp_libnet) {
+		libnet_destroy(content_mirror_arp_libnet);
+		content_mirror_arp_libnet = NULL;
+	}
+	if (content_mirror_libnet) {
+		libnet_destroy(content_mirror_libnet);
+		content_mirror_libnet = NULL;
+	}
+	for (size_t i = 0; i < content_mirror_ntargets; i++) {
+		free(content_mirror_targets[i].ip);
+		memset(&content_mirror_targets[i], 0,
+		       sizeof(log_content_mirror_target_t));
+	}
+	content_mirror_ntargets = 0;
+}
+
+static void
+log_content_mirror_closecb(void *fh, unsigned long ctl) {
+	log_content_mirror_ctx_t *ctx = fh;
+	int direction = (ctl & LBFLAG_IS_REQ) ? LOGPKT_REQUEST
+	                                      : LOGPKT_RESPONSE;
+
+	log_content_mirror_failover(ctx);
+	logpkt_write_close(&ctx->state, -1, direction);
+	free(ctx);
+}
+
+static ssize_t
+log_content_mirror_writecb(void *fh, unsigned long ctl,
+                           const void *buf, size_t sz) {
+	log_content_mirror_ctx_t *ctx = fh;
+	int direction = (ctl & LBFLAG_IS_REQ) ? LOGPKT_REQUEST
+	                                      : LOGPKT_RESPONSE;
+
+	log_content_mirror_failover(ctx);
+	if (logpkt_write_payload(&ctx->state, -1, direction, buf, sz) == -1)
+		goto errout;
+	return sz;
+
+errout:
+	log_err_rl_printf("Warning: Failed to write to mirror log: %s (%i)\n",
+	                  strerror(errno), errno);
+	return -1;
+}
+
+static logbuf_t *
+log_content_mirror_prepcb(UNUSED void *fh, unsigned long prepflags,
+                          logbuf_t *lb) {
+	/* log_content_mirror_ctx_t *ctx = fh; */
+	if (prepflags & PREPFLAG_EOF)
+		return lb;
+	logbuf_ctl_set(lb, (prepflags & PREPFLAG_REQUEST) ? LBFLAG_IS_REQ
+	                                                  : LBFLAG_IS_RESP);
+	return lb;
+}
+#endif /* !WITHOUT_MIRROR */
+
+/*
+ * Shared memory content tap, see logtap.c.  The single writer thread of the
+ * tap log is the single producer of the ring.
+ */
+static int
+log_content_tap_preinit(const char *path, size_t size)
+{
+	content_tap = logtap_new(path, size);
+	if (!content_tap) {
+		log_err_printf("Failed to create content tap '%s': %s (%i)\n",
+		               path, strerror(errno), errno);
+		return -1;
+	}
+	return 0;
+}
+
+static void
+log_content_tap_fini(void)
+{
+	if (content_tap) {
+		logtap_free(content_tap);
+		content_tap = NULL;
+	}
+}
+
+static int
+log_content_tap_opencb(void *fh)
+{
+	log_content_tap_ctx_t *ctx = fh;
+	int rv;
+
+	rv = logtap_open(content_tap, &ctx->conn);
+	logtap_conn_free(&ctx->conn);
+	return rv;
+}
+
+static void
+log_content_tap_closecb(void *fh, unsigned long ctl)
+{
+	log_content_tap_ctx_t *ctx = fh;
+
+	if (logtap_close(content_tap, &ctx->conn,
+	                 (ctl & LBFLAG_IS_REQ) ? LOGTAP_REQUEST : 0) == -1) {
+		log_err_rl_printf("Warning: Failed to write to content tap: "
+		                  "%s (%i)\n", strerror(errno), errno);
+	}
+	logtap_conn_free(&ctx->conn);
+	free(ctx);
+}
+
+static ssize_t
+log_content_tap_writecb(void *fh, unsigned long ctl,
+                        const void *buf, size_t sz)
+{
+	log_content_tap_ctx_t *ctx = fh;
+
+	if (logtap_write(content_tap, &ctx->conn,
+	                 (ctl & LBFLAG_IS_REQ) ? LOGTAP_REQUEST : 0,
+	                 buf, sz) == -1) {
+		log_err_rl_printf("Warning: Failed to write to content tap: "
+		                  "%s (%i)\n", strerror(errno), errno);
+		return -1;
+	}
+	return sz;
+}
+
+static logbuf_t *
+log_content_tap_prepcb(UNUSED void *fh, unsigned long prepflags,
+                       logbuf_t *lb)
+{
+	if (lb)
+		logbuf_ctl_set(lb, (prepflags & PREPFLAG_REQUEST) ?
+		                   LBFLAG_IS_REQ : LBFLAG_IS_RESP);
 	return lb;
 }
 
 /*
- * Mirror writer for -T/-I options.
+ * Network streaming export, see logstream.c.  The single writer thread of
+ * the stream log is the single producer of the stream; the stream sends
+ * the frames on its own thread.
  */
-
-#ifndef WITHOUT_MIRROR
 static int
-log_content_mirror_preinit(const char *ifname, const char *targetip) {
-	char errbuf[LIBNET_ERRBUF_SIZE];
-
-	/* cast to char* needed on OpenBSD */
-	content_mirror_libnet = libnet_init(LIBNET_LINK, (char *)ifname,
-	                                    errbuf);
-	if (content_mirror_libnet == NULL) {
-		log_err_printf("Failed to init mirror libnet: %s\n", errbuf);
-		return -1;
-	}
-	libnet_seed_prand(content_mirror_libnet);
-
-	content_mirror_mtu = sys_get_mtu(ifname);
-	if (content_mirror_mtu == 0) {
-		log_err_printf("Failed to lookup MTU of interface %s\n",
-		               ifname);
-		return -1;
-	}
-
-	if (logpkt_ether_lookup(content_mirror_libnet,
-	                        content_mirror_src_ether,
-	                        content_mirror_dst_ether,
-	                        targetip, ifname) == -1) {
-		log_err_printf("Failed to lookup target ether\n");
-		libnet_destroy(content_mirror_libnet);
+log_content_stream_preinit(const char *dest, size_t size)
+{
+	content_stream = logstream_new(dest, size);
+	if (!content_stream) {
+		log_err_printf("Failed to create content stream to '%s': "
+		               "%s (%i)\n", dest, strerror(errno), errno);
 		return -1;
 	}
-
 	return 0;
 }
 
 static void
-log_content_mirror_fini(void)
+log_content_stream_fini(void)
 {
-	if (content_mirror_libnet) {
-		libnet_destroy(content_mirror_libnet);
+	if (content_stream) {
+		logstream_free(content_stream);
+		content_stream = NULL;
 	}
 }
 
+static int
+log_content_stream_opencb(void *fh)
+{
+	log_content_stream_ctx_t *ctx = fh;
+
+	logstream_open(content_stream, &ctx->conn);
+	logtap_conn_free(&ctx->conn);
+	return 0;
+}
+
 static void
-log_content_mirror_closecb(void *fh, unsigned long ctl) {
-	log_content_mirror_ctx_t *ctx = fh;
-	int direction = (ctl & LBFLAG_IS_REQ) ? LOGPKT_REQUEST
-	                                      : LOGPKT_RESPONSE;
+log_content_stream_closecb(void *fh, unsigned long ctl)
+{
+	log_content_stream_ctx_t *ctx = fh;
 
-	logpkt_write_close(&ctx->state, -1, direction);
+	logstream_close(content_stream, &ctx->conn,
+	                (ctl & LBFLAG_IS_REQ) ? LOGSTREAM_REQUEST : 0);
+	logtap_conn_free(&ctx->conn);
 	free(ctx);
 }
 
 static ssize_t
-log_content_mirror_writecb(void *fh, unsigned long ctl,
-                           const void *buf, size_t sz) {
-	log_content_mirror_ctx_t *ctx = fh;
-	int direction = (ctl & LBFLAG_IS_REQ) ? LOGPKT_REQUEST
-	                                      : LOGPKT_RESPONSE;
+log_content_stream_writecb(void *fh, unsigned long ctl,
+                           const void *buf, size_t sz)
+{
+	log_content_stream_ctx_t *ctx = fh;
 
-	if (logpkt_write_payload(&ctx->state, -1, direction, buf, sz) == -1)
-		goto errout;
+	logstream_write(content_stream, &ctx->conn,
+	                (ctl & LBFLAG_IS_REQ) ? LOGSTREAM_REQUEST : 0,
+	                buf, sz);
 	return sz;
-
-errout:
-	log_err_printf("Warning: Failed to write to mirror log: %s (%i)\n",
-	               strerror(errno), errno);
-	return -1;
-}
-
-static logbuf_t *
-log_content_mirror_prepcb(UNUSED void *fh, unsigned long prepflags,
-                          logbuf_t *lb) {
-	/* log_content_mirror_ctx_t *ctx = fh; */
-	if (prepflags & PREPFLAG_EOF)
-		return lb;
-	logbuf_ctl_set(lb, (prepflags & PREPFLAG_REQUEST) ? LBFLAG_IS_REQ
-	                                                  : LBFLAG_IS_RESP);
-	return lb;
 }
-#endif /* !WITHOUT_MIRROR */
 
 /*
  * Certificate writer for -w/-W options.
+ *
+ * Each certificate file name, which contains the certificate fingerprints,
+ * is submitted only once per process lifetime.  Connection handling threads
+ * only copy the DER encoding of the certificate, which OpenSSL keeps cached,
+ * into a log buffer following the NUL-terminated file name; PEM encoding
+ * happens in the logger thread.
  */
 static logger_t *cert_log = NULL;
 static int cert_clisock = -1; /* privsep client socket for cert logger */
 
+KHASH_SET_INIT_STR(cstrset_t)
+
+static khash_t(cstrset_t) *cert_seen = NULL;
+static pthread_mutex_t cert_seen_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Mark fn as submitted.  Returns 1 if it was new, 0 if it was submitted
+ * before and -1 on memory allocation failure.
+ */
+static int
+log_cert_seen_add(const char *fn)
+{
+	char *key;
+	int ret, rv = 0;
+
+	pthread_mutex_lock(&cert_seen_mutex);
+	if (!cert_seen && !(cert_seen = kh_init(cstrset_t))) {
+		rv = -1;
+		goto out;
+	}
+	if (kh_get(cstrset_t, cert_seen, fn) != kh_end(cert_seen))
+		goto out;
+	if (!(key = strdup(fn))) {
+		rv = -1;
+		goto out;
+	}
+	kh_put(cstrset_t, cert_seen, key, &ret);
+	if (ret == -1) {
+		free(key);
+		rv = -1;
+		goto out;
+	}
+	rv = 1;
+out:
+	pthread_mutex_unlock(&cert_seen_mutex);
+	return rv;
+}
+
+/*
+ * Forget fn after failing to write it, such that it is retried.
+ */
+static void
+log_cert_seen_del(const char *fn)
+{
+	khiter_t k;
+	char *key;
+
+	pthread_mutex_lock(&cert_seen_mutex);
+	if (cert_seen &&
+	    (k = kh_get(cstrset_t, cert_seen, fn)) != kh_end(cert_seen)) {
+		key = (char *)kh_key(cert_seen, k);
+		kh_del(cstrset_t, cert_seen, k);
+		free(key);
+	}
+	pthread_mutex_unlock(&cert_seen_mutex);
+}
+
+static void
+log_cert_seen_free(void)
+{
+	khiter_t k;
+
+	if (!cert_seen)
+		return;
+	for (k = kh_begin(cert_seen); k != kh_end(cert_seen); k++) {
+		if (kh_exist(cert_seen, k))
+			free((char *)kh_key(cert_seen, k));
+	}
+	kh_destroy(cstrset_t, cert_seen);
+	cert_seen = NULL;
+}
+
 int
 log_cert_submit(const char *fn, X509 *crt)
 {
-	void *fh;
 	logbuf_t *lb;
-	char *pem;
-
-	if (!(fh = strdup(fn)))
+	unsigned char *p;
+	size_t fnsz;
+	int dersz, rv;
+
+	if ((rv = log_cert_seen_add(fn)) != 1)
+		return rv;
+	fnsz = strlen(fn) + 1;
+	if ((dersz = i2d_X509(crt, NULL)) <= 0)
 		goto errout1;
-	if (!(pem = ssl_x509_to_pem(crt)))
+	if (!(lb = logbuf_new_alloc(fnsz + dersz, NULL)))
+		goto errout1;
+	memcpy(lb->buf, fn, fnsz);
+	p = lb->buf + fnsz;
+	if (i2d_X509(crt, &p) != dersz)
 		goto errout2;
-	if (!(lb = logbuf_new(pem, strlen(pem), NULL)))
-		goto errout3;
-	return logger_submit(cert_log, fh, 0, lb);
-errout3:
-	free(pem);
+	if (logger_submit(cert_log, NULL, 0, lb) == -1)
+		goto errout1;
+	return 0;
 errout2:
-	free(fh);
+	logbuf_free(lb);
 errout1:
+	log_cert_seen_del(fn);
 	return -1;
 }
 
+/*
+ * Encode the DER certificate der as PEM with 64 character lines.
+ * Returns the allocated PEM and its size in *sz, or NULL on failure.
+ */
+static char *
+log_cert_pem(const unsigned char *der, size_t dersz, size_t *sz)
+{
+	static const char begin[] = "-----BEGIN CERTIFICATE-----\n";
+	static const char end[] = "-----END CERTIFICATE-----\n";
+	char *b64, *pem, *p;
+	size_t b64sz, n;
+
+	if (!(b64 = base64_enc(der, dersz, &b64sz)))
+		return NULL;
+	if (!(pem = malloc(sizeof(begin) + b64sz + b64sz / 64 + sizeof(end)))) {
+		free(b64);
+		return NULL;
+	}
+	memcpy(pem, begin, sizeof(begin) - 1);
+	p = pem + sizeof(begin) - 1;
+	for (size_t i = 0; i < b64sz; i += n) {
+		n = b64sz - i < 64 ? b64sz - i : 64;
+		memcpy(p, b64 + i, n);
+		p += n;
+		*p++ = '\n';
+	}
+	memcpy(p, end, sizeof(end) - 1);
+	p += sizeof(end) - 1;
+	free(b64);
+	*sz = p - pem;
+	return pem;
+}
+
 static ssize_t
-log_cert_writecb(void *fh, UNUSED unsigned long ctl,
+log_cert_writecb(UNUSED void *fh, UNUSED unsigned long ctl,
                  const void *buf, size_t sz)
 {
-	char *fn = fh;
+	const char *fn = buf;
+	size_t fnsz, pemsz;
+	char *pem;
 	int fd;
 
+	if (!(fnsz = strnlen(fn, sz)) || fnsz == sz)
+		return -1;
+	fnsz++;
 	if ((fd = privsep_client_certfile(cert_clisock, fn)) == -1) {
 		if (errno != EEXIST) {
 			log_err_printf("Failed to open '%s': %s (%i)\n",
 			               fn, strerror(errno), errno);
+			log_cert_seen_del(fn);
 			return -1;
 		}
 		return sz;
 	}
-	if (write(fd, buf, sz) == -1) {
-		log_err_printf("Warning: Failed to write to '%s': %s (%i)\n",
-		               fn, strerror(errno), errno);
+	if (!(pem = log_cert_pem((const unsigned char *)buf + fnsz,
+	                         sz - fnsz, &pemsz))) {
+		log_err_printf("Warning: Failed to encode '%s'\n", fn);
+		close(fd);
+		log_cert_seen_del(fn);
+		return -1;
+	}
+	if (write(fd, pem, pemsz) == -1) {
+		log_err_rl_printf("Warning: Failed to write to '%s': %s (%i)\n",
+		                  fn, strerror(errno), errno);
+		free(pem);
 		close(fd);
+		log_cert_seen_del(fn);
 		return -1;
 	}
+	free(pem);
 	close(fd);
 	return sz;
 }
 
-
 /*
  * Initialization and destruction.
  */
 
+/*
+ * Set the overflow policy configured for a log on its logger.  The error log
+ * always uses the default policy and blocks.
+ * Returns -1 on errors, 0 otherwise.
+ */
+static int
+log_set_overflow(logger_t *logger, opts_t *opts, int log)
+{
+	const char *spilldir;
+
+	spilldir = opts->log_spilldir ? opts->log_spilldir : DFLT_SPILLDIR;
+	if (logger_set_overflow(logger, opts->log_overflow[log],
+	                        spilldir) == -1) {
+		log_err_printf("Failed to create log overflow file in '%s': "
+		               "%s (%i)\n", spilldir, strerror(errno), errno);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Initialize the fd caches of *n* content loggers, splitting the limit of
+ * open per-connection log files evenly among them.
+ */
+static void
+log_content_fdc_init(logfdc_t *fdcs, unsigned int n, opts_t *opts,
+                     logfdc_open_func_t openfn)
+{
+	size_t max;
+
+	if (!opts->contentlog_maxfiles)
+		return;
+	max = opts->contentlog_maxfiles / n;
+	for (unsigned int i = 0; i < n; i++)
+		logfdc_init(&fdcs[i], max ? max : 1, openfn);
+}
+
+/*
+ * Create *n* content loggers with the given callbacks, splitting the memory
+ * budget evenly among them.  *nlogs* counts the loggers created so far, also
+ * on failure.
+ * Return -1 on errors, 0 otherwise.
+ */
+static int
+log_content_new_loggers(logger_t **logs, unsigned int *nlogs, unsigned int n,
+                        logger_reopen_func_t reopencb,
+                        logger_open_func_t opencb,
+                        logger_close_func_t closecb,
+                        logger_write_func_t writecb,
+                        logger_prep_func_t prepcb,
+                        logz_list_t *zlists,
+                        opts_t *opts, int log)
+{
+	for (unsigned int i = 0; i < n; i++) {
+		if (!(logs[i] = logger_new(reopencb, opencb, closecb,
+		                           writecb, prepcb, log_exceptcb)))
+			return -1;
+		(*nlogs)++;
+		if (zlists)
+			logger_set_flush(logs[i], log_zflushcb, &zlists[i]);
+		if (log_set_overflow(logs[i], opts, log) == -1)
+			return -1;
+		logger_set_membudget(logs[i], opts->log_membudget / n);
+	}
+	return 0;
+}
+
 /*
  * Log pre-init: open all log files but don't start any threads, since we may
  * fork() after pre-initialization.
@@ -1497,19 +3716,41 @@ log_preinit(opts_t *opts)
 	logger_write_func_t writecb;
 	logger_prep_func_t prepcb;
 
+	log_compress = opts->log_compress;
+	log_flush_interval = opts->log_flush_interval;
+	log_sync_policy.prealloc = opts->log_prealloc;
+	log_sync_policy.fsyncsz = opts->log_fsyncsz;
+	log_sync_policy.fsync_close = opts->log_fsync_close;
+	log_sync_policy.dropcache = opts->log_dropcache;
+	log_sync = logsync_policy_isset(&log_sync_policy);
+	connect_json = opts->connectlog_json;
+	content_pcap_isng = opts->pcaplog_ng;
+	if (opts->contentlog_rec_sz && (opts->contentlog || opts->pcaplog))
+		log_content_rec_preinit(opts);
+
 	if (opts->contentlog) {
 		if (opts->contentlog_isdir) {
 			reopencb = NULL;
 			opencb = log_content_file_dir_opencb;
 			closecb = log_content_file_dir_closecb;
 			writecb = log_content_file_dir_writecb;
-			prepcb = NULL;
+			prepcb = log_content_file_prepcb;
 		} else if (opts->contentlog_isspec) {
+			content_file_spec = log_pathspec_compile(
+			                    opts->contentlog);
+			if (!content_file_spec)
+				goto out;
 			reopencb = NULL;
 			opencb = log_content_file_spec_opencb;
 			closecb = log_content_file_spec_closecb;
 			writecb = log_content_file_spec_writecb;
-			prepcb = NULL;
+			prepcb = log_content_file_prepcb;
+		} else if (opts->contentlog_isseg) {
+			reopencb = NULL;
+			opencb = NULL;
+			closecb = log_content_file_seg_closecb;
+			writecb = log_content_file_seg_writecb;
+			prepcb = log_content_file_seg_prepcb;
 		} else {
 			if (log_content_file_single_preinit(opts->contentlog) == -1)
 				goto out;
@@ -1519,12 +3760,25 @@ log_preinit(opts_t *opts)
 			writecb = log_content_file_single_writecb;
 			prepcb = log_content_file_single_prepcb;
 		}
-		if (!(content_file_log = logger_new(reopencb, opencb, closecb,
-		                                    writecb, prepcb,
-		                                    log_exceptcb))) {
+		if (log_content_new_loggers(content_file_log,
+		                            &content_file_nlogs,
+		                            opts->contentlog_isdir ||
+		                            opts->contentlog_isspec ||
+		                            opts->contentlog_isseg ?
+		                            opts->content_log_threads : 1,
+		                            reopencb, opencb, closecb,
+		                            writecb, prepcb,
+		                            log_compress &&
+		                            !opts->contentlog_isseg ?
+		                            content_file_zlist : NULL,
+		                            opts, OPTS_LOG_CONTENT) == -1) {
 			log_content_file_single_fini();
 			goto out;
 		}
+		if (opts->contentlog_isdir || opts->contentlog_isspec)
+			log_content_fdc_init(content_file_fdc,
+			                     content_file_nlogs, opts,
+			                     log_content_file_reopen);
 	}
 	if (opts->pcaplog) {
 		if (log_content_pcap_preinit((opts->pcaplog_isdir ||
@@ -1539,6 +3793,12 @@ log_preinit(opts_t *opts)
 			writecb = log_content_pcap_dir_writecb;
 			prepcb = log_content_pcap_prepcb;
 		} else if (opts->pcaplog_isspec) {
+			content_pcap_spec = log_pathspec_compile(
+			                    opts->pcaplog);
+			if (!content_pcap_spec) {
+				log_content_pcap_fini();
+				goto out;
+			}
 			reopencb = NULL;
 			opencb = log_content_pcap_spec_opencb;
 			closecb = log_content_pcap_spec_closecb;
@@ -1551,17 +3811,29 @@ log_preinit(opts_t *opts)
 			writecb = log_content_pcap_writecb;
 			prepcb = log_content_pcap_prepcb;
 		}
-		if (!(content_pcap_log = logger_new(reopencb, opencb, closecb,
-		                                    writecb, prepcb,
-		                                    log_exceptcb))) {
+		if (log_content_new_loggers(content_pcap_log,
+		                            &content_pcap_nlogs,
+		                            opts->pcaplog_isdir ||
+		                            opts->pcaplog_isspec ?
+		                            opts->content_log_threads : 1,
+		                            reopencb, opencb, closecb,
+		                            writecb, prepcb,
+		                            log_compress ?
+		                            content_pcap_zlist : NULL,
+		                            opts, OPTS_LOG_PCAP) == -1) {
 			log_content_pcap_fini();
 			goto out;
 		}
+		if (opts->pcaplog_isdir || opts->pcaplog_isspec)
+			log_content_fdc_init(content_pcap_fdc,
+			                     content_pcap_nlogs, opts,
+			                     log_content_pcap_reopen);
 	}
 #ifndef WITHOUT_MIRROR
 	if (opts->mirrorif) {
 		if (log_content_mirror_preinit(opts->mirrorif,
-		                               opts->mirrortarget) == -1)
+		                               opts->mirrortarget,
+		                               opts->mirror_chk_interval) == -1)
 			goto out;
 		reopencb = NULL;
 		opencb = NULL;
@@ -1574,8 +3846,48 @@ log_preinit(opts_t *opts)
 			log_content_mirror_fini();
 			goto out;
 		}
+		if (log_set_overflow(content_mirror_log, opts,
+		                     OPTS_LOG_MIRROR) == -1)
+			goto out;
+		logger_set_membudget(content_mirror_log, opts->log_membudget);
 	}
 #endif /* !WITHOUT_MIRROR */
+	if (opts->contenttap) {
+		if (log_content_tap_preinit(opts->contenttap,
+		                            opts->contenttap_sz) == -1)
+			goto out;
+		if (!(content_tap_log = logger_new(NULL,
+		                                   log_content_tap_opencb,
+		                                   log_content_tap_closecb,
+		                                   log_content_tap_writecb,
+		                                   log_content_tap_prepcb,
+		                                   log_exceptcb))) {
+			log_content_tap_fini();
+			goto out;
+		}
+		if (log_set_overflow(content_tap_log, opts,
+		                     OPTS_LOG_TAP) == -1)
+			goto out;
+		logger_set_membudget(content_tap_log, opts->log_membudget);
+	}
+	if (opts->contentstream) {
+		if (log_content_stream_preinit(opts->contentstream,
+		                               opts->contentstream_sz) == -1)
+			goto out;
+		if (!(content_stream_log = logger_new(NULL,
+		                                      log_content_stream_opencb,
+		                                      log_content_stream_closecb,
+		                                      log_content_stream_writecb,
+		                                      log_content_tap_prepcb,
+		                                      log_exceptcb))) {
+			log_content_stream_fini();
+			goto out;
+		}
+		if (log_set_overflow(content_stream_log, opts,
+		                     OPTS_LOG_STREAM) == -1)
+			goto out;
+		logger_set_membudget(content_stream_log, opts->log_membudget);
+	}
 	if (opts->connectlog) {
 		if (log_connect_preinit(opts->connectlog) == -1)
 			goto out;
@@ -1586,6 +3898,13 @@ log_preinit(opts_t *opts)
 			log_connect_fini();
 			goto out;
 		}
+		logger_set_writev(connect_log, log_connect_writevcb);
+		if (log_compress)
+			logger_set_flush(connect_log, log_zflushcb,
+			                 &connect_zlist);
+		if (log_set_overflow(connect_log, opts,
+		                     OPTS_LOG_CONNECT) == -1)
+			goto out;
 	}
 	if (opts->masterkeylog) {
 		if (log_masterkey_preinit(opts->masterkeylog) == -1)
@@ -1597,15 +3916,23 @@ log_preinit(opts_t *opts)
 			log_masterkey_fini();
 			goto out;
 		}
+		logger_set_writev(masterkey_log, log_masterkey_writevcb);
+		logger_set_flush(masterkey_log, log_masterkey_flushcb, NULL);
+		if (log_set_overflow(masterkey_log, opts,
+		                     OPTS_LOG_MASTERKEY) == -1)
+			goto out;
 	}
 	if (opts->certgendir) {
 		if (!(cert_log = logger_new(NULL, NULL, NULL, log_cert_writecb,
 		                            NULL, log_exceptcb)))
 			goto out;
+		if (log_set_overflow(cert_log, opts, OPTS_LOG_CERT) == -1)
+			goto out;
 	}
 	if (!(err_log = logger_new(NULL, NULL, NULL, log_err_writecb, NULL,
 	                           log_exceptcb)))
 		goto out;
+	logger_set_writev(err_log, log_err_writevcb);
 	return 0;
 
 out:
@@ -1613,20 +3940,31 @@ out:
 		log_connect_fini();
 		logger_free(connect_log);
 	}
-	if (content_file_log) {
+	if (content_file_nlogs) {
 		log_content_file_single_fini();
-		logger_free(content_file_log);
+		for (unsigned int i = 0; i < content_file_nlogs; i++)
+			logger_free(content_file_log[i]);
 	}
-	if (content_pcap_log) {
+	if (content_pcap_nlogs) {
 		log_content_pcap_fini();
-		logger_free(content_pcap_log);
+		for (unsigned int i = 0; i < content_pcap_nlogs; i++)
+			logger_free(content_pcap_log[i]);
 	}
+	log_pathspec_free();
 #ifndef WITHOUT_MIRROR
 	if (content_mirror_log) {
 		log_content_mirror_fini();
 		logger_free(content_mirror_log);
 	}
 #endif /* !WITHOUT_MIRROR */
+	if (content_tap_log) {
+		log_content_tap_fini();
+		logger_free(content_tap_log);
+	}
+	if (content_stream_log) {
+		log_content_stream_fini();
+		logger_free(content_stream_log);
+	}
 	if (cert_log) {
 		logger_free(cert_log);
 	}
@@ -1649,20 +3987,31 @@ log_preinit_undo(void)
 		log_connect_fini();
 		logger_free(connect_log);
 	}
-	if (content_file_log) {
+	if (content_file_nlogs) {
 		log_content_file_single_fini();
-		logger_free(content_file_log);
+		for (unsigned int i = 0; i < content_file_nlogs; i++)
+			logger_free(content_file_log[i]);
 	}
-	if (content_pcap_log) {
+	if (content_pcap_nlogs) {
 		log_content_pcap_fini();
-		logger_free(content_pcap_log);
+		for (unsigned int i = 0; i < content_pcap_nlogs; i++)
+			logger_free(content_pcap_log[i]);
 	}
+	log_pathspec_free();
 #ifndef WITHOUT_MIRROR
 	if (content_mirror_log) {
 		log_content_mirror_fini();
 		logger_free(content_mirror_log);
 	}
 #endif /* !WITHOUT_MIRROR */
+	if (content_tap_log) {
+		log_content_tap_fini();
+		logger_free(content_tap_log);
+	}
+	if (content_stream_log) {
+		log_content_stream_fini();
+		logger_free(content_stream_log);
+	}
 	if (masterkey_log) {
 		log_masterkey_fini();
 		logger_free(masterkey_log);
@@ -1700,18 +4049,53 @@ log_init(opts_t *opts, proxy_ctx_t *ctx, int clisock[5])
 		privsep_client_close(clisock[1]);
 	}
 
-	if (content_file_log) {
+	if (content_file_nlogs) {
 		content_file_clisock = clisock[2];
-		if (logger_start(content_file_log) == -1)
-			return -1;
+		if (opts->contentlog_isdir || opts->contentlog_isspec ||
+		    opts->contentlog_isseg)
+			log_content_dir_open(&content_file_dir, clisock[2],
+			                     opts->contentlog_isspec ?
+			                     opts->contentlog_basedir :
+			                     opts->contentlog);
+		if (opts->contentlog_isseg) {
+			for (unsigned int i = 0; i < content_file_nlogs; i++) {
+				content_file_seg[i] = logseg_new(
+				        opts->contentlog, i,
+				        opts->contentlog_segsz,
+				        log_content_file_seg_openfile);
+				if (!content_file_seg[i])
+					return -1;
+				logseg_set_sync(content_file_seg[i],
+				                &log_sync_policy);
+			}
+		}
+		if (opts->contentlog_dedupdir &&
+		    (opts->contentlog_isdir || opts->contentlog_isspec)) {
+			log_content_dir_open(&content_file_casdir, clisock[2],
+			                     opts->contentlog_dedupdir);
+			content_file_cas = logcas_new(
+			        opts->contentlog_dedupdir, content_file_nlogs,
+			        log_content_file_cas_openfile);
+			if (!content_file_cas)
+				return -1;
+		}
+		for (unsigned int i = 0; i < content_file_nlogs; i++)
+			if (logger_start(content_file_log[i]) == -1)
+				return -1;
 	} else {
 		privsep_client_close(clisock[2]);
 	}
 
-	if (content_pcap_log) {
+	if (content_pcap_nlogs) {
 		content_pcap_clisock = clisock[3];
-		if (logger_start(content_pcap_log) == -1)
-			return -1;
+		if (opts->pcaplog_isdir || opts->pcaplog_isspec)
+			log_content_dir_open(&content_pcap_dir, clisock[3],
+			                     opts->pcaplog_isdir ?
+			                     opts->pcaplog :
+			                     opts->pcaplog_basedir);
+		for (unsigned int i = 0; i < content_pcap_nlogs; i++)
+			if (logger_start(content_pcap_log[i]) == -1)
+				return -1;
 	} else {
 		privsep_client_close(clisock[3]);
 	}
@@ -1720,8 +4104,20 @@ log_init(opts_t *opts, proxy_ctx_t *ctx, int clisock[5])
 	if (content_mirror_log) {
 		if (logger_start(content_mirror_log) == -1)
 			return -1;
+		if (log_content_mirror_chk_start() == -1)
+			return -1;
 	}
 #endif /* !WITHOUT_MIRROR */
+	if (content_tap_log) {
+		if (logger_start(content_tap_log) == -1)
+			return -1;
+	}
+	if (content_stream_log) {
+		if (logstream_start(content_stream) == -1)
+			return -1;
+		if (logger_start(content_stream_log) == -1)
+			return -1;
+	}
 
 	if (cert_log) {
 		cert_clisock = clisock[4];
@@ -1744,6 +4140,10 @@ log_fini(void)
 	 * tearing down the logging infrastructure */
 	err_shortcut_logger = 1;
 
+#ifndef WITHOUT_MIRROR
+	if (content_mirror_log)
+		log_content_mirror_chk_stop();
+#endif /* !WITHOUT_MIRROR */
 	if (cert_log)
 		logger_leave(cert_log);
 	if (masterkey_log)
@@ -1752,10 +4152,14 @@ log_fini(void)
 	if (content_mirror_log)
 		logger_leave(content_mirror_log);
 #endif /* !WITHOUT_MIRROR */
-	if (content_pcap_log)
-		logger_leave(content_pcap_log);
-	if (content_file_log)
-		logger_leave(content_file_log);
+	if (content_tap_log)
+		logger_leave(content_tap_log);
+	if (content_stream_log)
+		logger_leave(content_stream_log);
+	for (unsigned int i = 0; i < content_pcap_nlogs; i++)
+		logger_leave(content_pcap_log[i]);
+	for (unsigned int i = 0; i < content_file_nlogs; i++)
+		logger_leave(content_file_log[i]);
 	if (connect_log)
 		logger_leave(connect_log);
 	if (err_log)
@@ -1769,10 +4173,14 @@ log_fini(void)
 	if (content_mirror_log)
 		logger_join(content_mirror_log);
 #endif /* !WITHOUT_MIRROR */
-	if (content_pcap_log)
-		logger_join(content_pcap_log);
-	if (content_file_log)
-		logger_join(content_file_log);
+	if (content_tap_log)
+		logger_join(content_tap_log);
+	if (content_stream_log)
+		logger_join(content_stream_log);
+	for (unsigned int i = 0; i < content_pcap_nlogs; i++)
+		logger_join(content_pcap_log[i]);
+	for (unsigned int i = 0; i < content_file_nlogs; i++)
+		logger_join(content_file_log[i]);
 	if (connect_log)
 		logger_join(connect_log);
 	if (err_log)
@@ -1780,16 +4188,21 @@ log_fini(void)
 
 	if (cert_log)
 		logger_free(cert_log);
+	log_cert_seen_free();
 	if (masterkey_log)
 		logger_free(masterkey_log);
 #ifndef WITHOUT_MIRROR
 	if (content_mirror_log)
 		logger_free(content_mirror_log);
 #endif /* !WITHOUT_MIRROR */
-	if (content_pcap_log)
-		logger_free(content_pcap_log);
-	if (content_file_log)
-		logger_free(content_file_log);
+	if (content_tap_log)
+		logger_free(content_tap_log);
+	if (content_stream_log)
+		logger_free(content_stream_log);
+	for (unsigned int i = 0; i < content_pcap_nlogs; i++)
+		logger_free(content_pcap_log[i]);
+	for (unsigned int i = 0; i < content_file_nlogs; i++)
+		logger_free(content_file_log[i]);
 	if (connect_log)
 		logger_free(connect_log);
 	if (err_log)
@@ -1801,10 +4214,29 @@ log_fini(void)
 	if (content_mirror_log)
 		log_content_mirror_fini();
 #endif /* !WITHOUT_MIRROR */
-	if (content_pcap_log)
+	if (content_tap_log)
+		log_content_tap_fini();
+	if (content_stream_log)
+		log_content_stream_fini();
+	if (content_pcap_nlogs)
 		log_content_pcap_fini();
-	if (content_file_log)
+	if (content_file_nlogs)
 		log_content_file_single_fini();
+	log_content_rec_fini();
+	for (unsigned int i = 0; i < content_file_nlogs; i++) {
+		if (content_file_seg[i]) {
+			logseg_free(content_file_seg[i]);
+			content_file_seg[i] = NULL;
+		}
+	}
+	if (content_file_cas) {
+		logcas_free(content_file_cas);
+		content_file_cas = NULL;
+	}
+	log_content_dir_close(&content_pcap_dir);
+	log_content_dir_close(&content_file_dir);
+	log_content_dir_close(&content_file_casdir);
+	log_pathspec_free();
 	if (connect_log)
 		log_connect_fini();
 
@@ -1820,6 +4252,197 @@ log_fini(void)
 		privsep_client_close(connect_clisock);
 }
 
+/*
+ * Logs with their name, for reporting statistics.
+ */
+static struct {
+	const char *name;
+	logger_t **loggers;
+	unsigned int nloggers;
+	unsigned long long dropped;
+} log_stats_logs[] = {
+	{"content", content_file_log, MAX_CONTENT_LOG_THREADS, 0},
+	{"pcap", content_pcap_log, MAX_CONTENT_LOG_THREADS, 0},
+#ifndef WITHOUT_MIRROR
+	{"mirror", &content_mirror_log, 1, 0},
+#endif /* !WITHOUT_MIRROR */
+	{"tap", &content_tap_log, 1, 0},
+	{"stream", &content_stream_log, 1, 0},
+	{"connect", &connect_log, 1, 0},
+	{"masterkey", &masterkey_log, 1, 0},
+	{"cert", &cert_log, 1, 0},
+};
+
+/*
+ * Sum up the statistics of all loggers of log *i* into *st*.
+ * Returns 0 if the log is active, -1 otherwise.
+ */
+static int
+log_stats_sum(size_t i, logger_stats_t *st)
+{
+	logger_stats_t shard;
+	int rv = -1;
+
+	memset(st, 0, sizeof(logger_stats_t));
+	for (unsigned int j = 0; j < log_stats_logs[i].nloggers; j++) {
+		if (!log_stats_logs[i].loggers[j])
+			continue;
+		logger_stats(log_stats_logs[i].loggers[j], &shard);
+		st->depth += shard.depth;
+		st->size += shard.size;
+		st->bytes += shard.bytes;
+		st->budget += shard.budget;
+		st->dropped_bufs += shard.dropped_bufs;
+		st->dropped_bytes += shard.dropped_bytes;
+		st->spilled_bufs += shard.spilled_bufs;
+		st->spilled_bytes += shard.spilled_bytes;
+		st->spill_pending += shard.spill_pending;
+		rv = 0;
+	}
+	return rv;
+}
+
+/*
+ * Get the summed up statistics of log i into st and its name into name, for
+ * exporting statistics.  If the log is not active, name is set to NULL.
+ * Returns -1 once i is beyond the last log, 0 otherwise.
+ */
+int
+log_stats_get(size_t i, const char **name, logger_stats_t *st)
+{
+	if (i >= sizeof(log_stats_logs) / sizeof(log_stats_logs[0]))
+		return -1;
+	*name = log_stats_sum(i, st) == -1 ? NULL : log_stats_logs[i].name;
+	return 0;
+}
+
+/*
+ * Returns the number of log buffers still queued by all logs except the
+ * error log, counting data pending in the overflow file of a log as one,
+ * for draining the log queues on shutdown.  Buffers are taken off the queue
+ * before they are written, so 0 does not imply that the writer threads are
+ * idle; log_fini() still waits for them.
+ */
+size_t
+log_pending(void)
+{
+	logger_stats_t st;
+	size_t n = 0;
+
+	for (size_t i = 0; i < sizeof(log_stats_logs) /
+	                       sizeof(log_stats_logs[0]); i++) {
+		if (log_stats_sum(i, &st) == -1)
+			continue;
+		n += st.depth;
+		if (st.spill_pending)
+			n++;
+	}
+	return n;
+}
+
+/*
+ * Make the writer threads of all logs except the error log drop what is
+ * still queued, such that log_fini() returns in bounded time.
+ */
+void
+log_discard(void)
+{
+	for (size_t i = 0; i < sizeof(log_stats_logs) /
+	                       sizeof(log_stats_logs[0]); i++) {
+		for (unsigned int j = 0; j < log_stats_logs[i].nloggers; j++) {
+			if (log_stats_logs[i].loggers[j])
+				logger_discard(log_stats_logs[i].loggers[j]);
+		}
+	}
+}
+
+/*
+ * Returns 1 if any of the content loggers exceeds its memory budget and
+ * connections should stop reading until it has caught up, 0 otherwise.
+ * Called from the connection handling threads.
+ */
+int
+log_content_over_budget(void)
+{
+	for (unsigned int i = 0; i < content_file_nlogs; i++)
+		if (logger_over_budget(content_file_log[i]))
+			return 1;
+	for (unsigned int i = 0; i < content_pcap_nlogs; i++)
+		if (logger_over_budget(content_pcap_log[i]))
+			return 1;
+#ifndef WITHOUT_MIRROR
+	if (content_mirror_log && logger_over_budget(content_mirror_log))
+		return 1;
+#endif /* !WITHOUT_MIRROR */
+	if (content_tap_log && logger_over_budget(content_tap_log))
+		return 1;
+	if (content_stream_log && logger_over_budget(content_stream_log))
+		return 1;
+	return 0;
+}
+
+/*
+ * Log queue depth, dropped and spilled log data of all active logs to the
+ * error log.  Called from the main event loop thread.
+ */
+void
+log_stats(void)
+{
+	logger_stats_t st;
+
+	for (size_t i = 0; i < sizeof(log_stats_logs) /
+	                       sizeof(log_stats_logs[0]); i++) {
+		if (log_stats_sum(i, &st) == -1)
+			continue;
+		log_err_printf("Log %s: queued %zu/%zu (%zu bytes) "
+		               "dropped %llu (%llu bytes) "
+		               "spilled %llu (%llu bytes, %llu pending)\n",
+		               log_stats_logs[i].name, st.depth, st.size, st.bytes,
+		               st.dropped_bufs, st.dropped_bytes,
+		               st.spilled_bufs, st.spilled_bytes,
+		               st.spill_pending);
+	}
+	if (content_stream)
+		log_err_printf("Content stream: dropped %llu frames\n",
+		               (unsigned long long)
+		               logstream_dropped(content_stream));
+	if (content_file_cas) {
+		logcas_stats_t cst;
+
+		logcas_stats(content_file_cas, &cst);
+		log_err_printf("Content dedup: stored %llu chunks (%llu bytes) "
+		               "deduplicated %llu chunks (%llu bytes) "
+		               "inline %llu bytes\n",
+		               cst.stored_chunks, cst.stored_bytes,
+		               cst.dedup_chunks, cst.dedup_bytes,
+		               cst.inline_bytes);
+	}
+}
+
+/*
+ * Warn about log buffers dropped since the last check.  Called periodically
+ * from the main event loop thread.
+ */
+void
+log_stats_check(void)
+{
+	logger_stats_t st;
+
+	for (size_t i = 0; i < sizeof(log_stats_logs) /
+	                       sizeof(log_stats_logs[0]); i++) {
+		if (log_stats_sum(i, &st) == -1)
+			continue;
+		if (st.dropped_bufs == log_stats_logs[i].dropped)
+			continue;
+		log_err_printf("Warning: Log %s dropped %llu log buffers "
+		               "(%llu bytes total) because it cannot keep up\n",
+		               log_stats_logs[i].name,
+		               st.dropped_bufs - log_stats_logs[i].dropped,
+		               st.dropped_bytes);
+		log_stats_logs[i].dropped = st.dropped_bufs;
+	}
+}
+
 int
 log_reopen(void)
 {
@@ -1828,11 +4451,11 @@ log_reopen(void)
 	if (masterkey_log)
 		if (logger_reopen(masterkey_log) == -1)
 			rv = -1;
-	if (content_pcap_log)
-		if (logger_reopen(content_pcap_log) == -1)
+	for (unsigned int i = 0; i < content_pcap_nlogs; i++)
+		if (logger_reopen(content_pcap_log[i]) == -1)
 			rv = -1;
-	if (content_file_log)
-		if (logger_reopen(content_file_log) == -1)
+	for (unsigned int i = 0; i < content_file_nlogs; i++)
+		if (logger_reopen(content_file_log[i]) == -1)
 			rv = -1;
 	if (connect_log)
 		if (logger_reopen(connect_log) == -1)
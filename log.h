@@ -39,6 +39,25 @@ void log_err_mode(int);
 #define LOG_ERR_MODE_STDERR 0
 #define LOG_ERR_MODE_SYSLOG 1
 
+/*
+ * Per call site rate limit state of the error log.  Messages of a call site
+ * logged with log_err_rl_printf() are suppressed for LOG_ERR_RATELIMIT_SECS
+ * seconds after each message written; the next one written tells how many
+ * were suppressed.
+ */
+typedef struct log_ratelimit {
+	long long next;
+	unsigned long suppressed;
+} log_ratelimit_t;
+#define LOG_ERR_RATELIMIT_SECS 5
+int log_err_ratelimited(log_ratelimit_t *, const char *, ...)
+    PRINTF(2,3) NONNULL(1,2);
+#define log_err_rl_printf(...) \
+        do { \
+                static log_ratelimit_t log_rl_; \
+                log_err_ratelimited(&log_rl_, __VA_ARGS__); \
+        } while (0)
+
 int log_dbg_printf(const char *, ...) PRINTF(1,2);
 int log_dbg_print_free(char *);
 int log_dbg_write_free(void *, size_t);
@@ -78,15 +97,26 @@ struct log_content_ctx {
 	struct log_content_file_ctx *file;
 	struct log_content_pcap_ctx *pcap;
 	struct log_content_mirror_ctx *mirror;
+	struct log_content_tap_ctx *tap;
+	struct log_content_stream_ctx *stream;
+	struct log_content_rec_ctx *rec;
+	unsigned int shard;
+	unsigned int live : 1;  /* bypass the flight recorder */
 };
-int log_content_open(log_content_ctx_t *, opts_t *,
+int log_content_open(log_content_ctx_t *, opts_t *, int,
                      const struct sockaddr *, socklen_t,
                      const struct sockaddr *, socklen_t,
                      char *, char *, char *, char *,
-                     char *, char *, char *) NONNULL(1,2,3) WUNRES;
+                     char *, char *, char *, char *,
+                     char *) NONNULL(1,2,4) WUNRES;
 int log_content_submit(log_content_ctx_t *, logbuf_t *, int)
                        NONNULL(1,2) WUNRES;
+int log_content_submit_body(log_content_ctx_t *, logbuf_t *, int,
+                            unsigned long) NONNULL(1,2) WUNRES;
+int log_content_truncate(log_content_ctx_t *, int) NONNULL(1) WUNRES;
 int log_content_close(log_content_ctx_t *, int) NONNULL(1) WUNRES;
+int log_content_over_budget(void) WUNRES;
+void log_content_recorder_trigger(void);
 int log_content_split_pathspec(const char *, char **,
                                char **) NONNULL(1,2,3) WUNRES;
 
@@ -97,6 +127,11 @@ void log_preinit_undo(void);
 int log_init(opts_t *, proxy_ctx_t *, int[3]) NONNULL(1,2) WUNRES;
 void log_fini(void);
 int log_reopen(void) WUNRES;
+void log_stats(void);
+void log_stats_check(void);
+int log_stats_get(size_t, const char **, logger_stats_t *) NONNULL(2,3);
+size_t log_pending(void) WUNRES;
+void log_discard(void);
 void log_exceptcb(void);
 
 #endif /* !LOG_H */
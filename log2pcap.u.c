@@ -0,0 +1,250 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * sslsplit-log2pcap:  convert a single-file content log (-L) to PCAP or
+ * pcapng, see logconv.c.  Regular uncompressed logs are mapped into memory
+ * and converted in place; gzip compressed logs and standard input are
+ * decompressed and converted in a sliding buffer.
+ */
+
+#include "logconv.h"
+#include "build.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <zlib.h>
+
+/* octets of mapped log converted at a time and then dropped from memory */
+#define LOG2PCAP_WINDOW         (64*1024*1024)
+/* octets of output collected per write */
+#define LOG2PCAP_BATCHSZ        (4*1024*1024)
+/* initial size of the sliding buffer for compressed logs */
+#define LOG2PCAP_BUFSZ          (1024*1024)
+
+static void
+log2pcap_usage(FILE *f, const char *argv0)
+{
+	fprintf(f,
+"Usage: %s [-nv] logfile pcapfile\n"
+"  -n          write pcapng instead of PCAP, one interface per connection\n"
+"  -v          print the number of records and connections converted\n"
+"  -h          print usage information\n"
+"logfile is a content log written with -L, optionally gzip compressed,\n"
+"or - for standard input.\n", argv0);
+}
+
+/*
+ * Convert the regular uncompressed log open on fd of size sz through a
+ * read-only mapping, dropping converted parts from memory and the page cache
+ * as the conversion progresses.
+ */
+static int
+log2pcap_mmap(logconv_t *conv, int fd, size_t sz)
+{
+	unsigned char *map;
+	size_t off = 0, dropped = 0, win = LOG2PCAP_WINDOW, len, end;
+	size_t pgmask = (size_t)sysconf(_SC_PAGESIZE) - 1;
+	ssize_t n;
+	int rv = 0;
+
+	map = mmap(NULL, sz, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+	madvise(map, sz, MADV_SEQUENTIAL);
+	while (off < sz) {
+		len = sz - off < win ? sz - off : win;
+		if ((n = logconv_parse(conv, map + off, len)) == -1) {
+			rv = -1;
+			break;
+		}
+		if (n == 0) {
+			if (len == sz - off) {
+				fprintf(stderr, "Ignoring incomplete record "
+				                "at end of log\n");
+				break;
+			}
+			/* record larger than window */
+			win *= 2;
+			continue;
+		}
+		off += n;
+		win = LOG2PCAP_WINDOW;
+		end = off & ~pgmask;
+		if (end - dropped >= LOG2PCAP_WINDOW) {
+			madvise(map + dropped, end - dropped, MADV_DONTNEED);
+			posix_fadvise(fd, dropped, end - dropped,
+			              POSIX_FADV_DONTNEED);
+			dropped = end;
+		}
+	}
+	munmap(map, sz);
+	return rv;
+}
+
+/*
+ * Convert the log open on fd, compressed or not, through a sliding buffer
+ * which grows to hold the largest record.
+ */
+static int
+log2pcap_stream(logconv_t *conv, int fd)
+{
+	unsigned char *buf, *p;
+	size_t bufsz = LOG2PCAP_BUFSZ, len = 0;
+	ssize_t n;
+	gzFile gz;
+	int rv = -1;
+
+	if (!(gz = gzdopen(fd, "rb")))
+		return -1;
+	gzbuffer(gz, 256*1024);
+	if (!(buf = malloc(bufsz)))
+		goto out;
+	for (;;) {
+		if (len == bufsz) {
+			if (!(p = realloc(buf, bufsz * 2)))
+				goto out;
+			buf = p;
+			bufsz *= 2;
+		}
+		n = gzread(gz, buf + len, bufsz - len);
+		if (n == -1)
+			goto out;
+		if (n == 0)
+			break;
+		len += n;
+		if ((n = logconv_parse(conv, buf, len)) == -1)
+			goto out;
+		memmove(buf, buf + n, len - n);
+		len -= n;
+	}
+	if (len > 0)
+		fprintf(stderr, "Ignoring incomplete record at end of log\n");
+	rv = 0;
+out:
+	free(buf);
+	gzclose(gz);
+	return rv;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *argv0 = argv[0];
+	unsigned char magic[2];
+	logconv_t *conv;
+	struct stat st;
+	int pcapng = 0, verbose = 0;
+	int infd, outfd, ch, rv;
+
+	while ((ch = getopt(argc, argv, "nvhV")) != -1) {
+		switch (ch) {
+		case 'n':
+			pcapng = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'h':
+			log2pcap_usage(stdout, argv0);
+			exit(EXIT_SUCCESS);
+		case 'V':
+			printf("%s-log2pcap %s\n", build_pkgname,
+			       build_version);
+			exit(EXIT_SUCCESS);
+		default:
+			log2pcap_usage(stderr, argv0);
+			exit(EXIT_FAILURE);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 2) {
+		log2pcap_usage(stderr, argv0);
+		exit(EXIT_FAILURE);
+	}
+
+	if (!strcmp(argv[0], "-")) {
+		infd = STDIN_FILENO;
+	} else if ((infd = open(argv[0], O_RDONLY)) == -1) {
+		fprintf(stderr, "%s: Failed to open '%s': %s (%i)\n",
+		        argv0, argv[0], strerror(errno), errno);
+		exit(EXIT_FAILURE);
+	}
+	outfd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0644);
+	if (outfd == -1) {
+		fprintf(stderr, "%s: Failed to open '%s': %s (%i)\n",
+		        argv0, argv[1], strerror(errno), errno);
+		exit(EXIT_FAILURE);
+	}
+	if (!(conv = logconv_new(outfd, pcapng, LOG2PCAP_BATCHSZ))) {
+		fprintf(stderr, "%s: Failed to set up conversion\n", argv0);
+		exit(EXIT_FAILURE);
+	}
+
+	if (fstat(infd, &st) == -1) {
+		fprintf(stderr, "%s: Failed to stat '%s': %s (%i)\n",
+		        argv0, argv[0], strerror(errno), errno);
+		exit(EXIT_FAILURE);
+	}
+	if (S_ISREG(st.st_mode) && st.st_size > 0 &&
+	    !(pread(infd, magic, sizeof(magic), 0) == sizeof(magic) &&
+	      magic[0] == 0x1f && magic[1] == 0x8b)) {
+		rv = log2pcap_mmap(conv, infd, st.st_size);
+	} else {
+		rv = log2pcap_stream(conv, infd);
+	}
+	if (rv == -1 && errno != EINVAL) {
+		fprintf(stderr, "%s: Failed to read '%s': %s (%i)\n",
+		        argv0, argv[0], strerror(errno), errno);
+	}
+	if (logconv_finish(conv) == -1) {
+		fprintf(stderr, "%s: Failed to write '%s': %s (%i)\n",
+		        argv0, argv[1], strerror(errno), errno);
+		rv = -1;
+	}
+	if (verbose) {
+		fprintf(stderr, "Converted %llu records of %llu connections\n",
+		        (unsigned long long)logconv_records(conv),
+		        (unsigned long long)logconv_conns(conv));
+	}
+	logconv_free(conv);
+	if (close(outfd) == -1)
+		rv = -1;
+	return rv == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* vim: set noet ft=c: */
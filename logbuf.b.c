@@ -0,0 +1,167 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bench.h"
+
+#include "logbuf.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <event2/buffer.h>
+
+#define LOGBUF_BENCH_SIZE 1500
+#define LOGBUF_BENCH_CHAIN 8
+
+static unsigned char data[LOGBUF_BENCH_SIZE];
+
+static void
+logbuf_bench_oom(logbuf_t *lb)
+{
+	if (!lb) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void
+logbuf_bench_new_copy(UNUSED void *arg, size_t n)
+{
+	logbuf_t *lb;
+
+	while (n--) {
+		lb = logbuf_new_copy(data, sizeof(data), NULL);
+		logbuf_bench_oom(lb);
+		logbuf_free(lb);
+	}
+}
+
+static void
+logbuf_bench_new_printf(UNUSED void *arg, size_t n)
+{
+	logbuf_t *lb;
+
+	while (n--) {
+		lb = logbuf_new_printf(NULL, "%s: %s\r\n",
+		                       "Host", "daniel.roe.ch");
+		logbuf_bench_oom(lb);
+		logbuf_free(lb);
+	}
+}
+
+static logbuf_t *
+logbuf_bench_chain(void)
+{
+	logbuf_t *lb = NULL;
+	int i;
+
+	for (i = 0; i < LOGBUF_BENCH_CHAIN; i++) {
+		lb = logbuf_new_copy(data, sizeof(data), lb);
+		logbuf_bench_oom(lb);
+	}
+	return lb;
+}
+
+static void
+logbuf_bench_make_contiguous(UNUSED void *arg, size_t n)
+{
+	logbuf_t *lb;
+
+	while (n--) {
+		lb = logbuf_make_contiguous(logbuf_bench_chain());
+		logbuf_bench_oom(lb);
+		logbuf_free(lb);
+	}
+}
+
+static void
+logbuf_bench_new_deepcopy(void *arg, size_t n)
+{
+	logbuf_t *lb;
+
+	while (n--) {
+		lb = logbuf_new_deepcopy(arg, 1);
+		logbuf_bench_oom(lb);
+		logbuf_free(lb);
+	}
+}
+
+static void
+logbuf_bench_new_shared(void *arg, size_t n)
+{
+	logbuf_t *lb;
+
+	while (n--) {
+		lb = logbuf_new_shared(arg);
+		logbuf_bench_oom(lb);
+		logbuf_free(lb);
+	}
+}
+
+static void
+logbuf_bench_new_evbuf(UNUSED void *arg, size_t n)
+{
+	struct evbuffer *evbuf;
+	logbuf_t *lb;
+
+	while (n--) {
+		if (!(evbuf = evbuffer_new()) ||
+		    evbuffer_add(evbuf, data, sizeof(data)) == -1) {
+			fprintf(stderr, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		lb = logbuf_new_evbuf(evbuf, NULL);
+		logbuf_bench_oom(lb);
+		logbuf_free(lb);
+	}
+}
+
+void
+logbuf_bench(void)
+{
+	logbuf_t *chain, *single;
+
+	memset(data, 'x', sizeof(data));
+	chain = logbuf_bench_chain();
+	single = logbuf_new_copy(data, sizeof(data), NULL);
+	logbuf_bench_oom(single);
+
+	bench_run("LogbufNewCopy", 1, logbuf_bench_new_copy, NULL);
+	bench_run("LogbufNewPrintf", 1, logbuf_bench_new_printf, NULL);
+	bench_run("LogbufMakeContiguous", 1,
+	          logbuf_bench_make_contiguous, NULL);
+	bench_run("LogbufNewDeepcopy", 1, logbuf_bench_new_deepcopy, chain);
+	bench_run("LogbufNewShared", 1, logbuf_bench_new_shared, single);
+	bench_run("LogbufNewEvbuf", 1, logbuf_bench_new_evbuf, NULL);
+
+	logbuf_free(single);
+	logbuf_free(chain);
+}
+
+/* vim: set noet ft=c: */
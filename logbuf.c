@@ -33,12 +33,36 @@
 #include <unistd.h>
 #include <string.h>
 
+#include <event2/buffer.h>
+
 /*
  * Dynamic log buffer with zero-copy chaining, generic void * file handle
  * and ctl for status control flags.
- * Logbuf always owns the internal allocated buffer.
+ * Logbuf always owns the internal allocated buffer, possibly shared with
+ * other logbufs created using logbuf_new_shared().  Shared buffers are
+ * immutable and freed together with the last logbuf referencing them.
+ * Instead of the internal buffer, the data can be held in an evbuffer
+ * created with locking enabled, typically referencing the chains of data
+ * forwarded on a connection; it is only copied out when written.
  */
 
+/*
+ * Release the internal buffer of lb.
+ */
+static void
+logbuf_free_buf(logbuf_t *lb)
+{
+	if (lb->refs) {
+		if (__atomic_sub_fetch(lb->refs, 1, __ATOMIC_ACQ_REL) > 0)
+			return;
+		free(lb->refs);
+	}
+	if (lb->buf)
+		free(lb->buf);
+	if (lb->evbuf)
+		evbuffer_free(lb->evbuf);
+}
+
 /*
  * Create new logbuf from provided, pre-allocated buffer, set fd and next.
  * The provided buffer will be freed by logbuf_free() if non-NULL, and by
@@ -65,6 +89,8 @@ logbuf_new(void *buf, size_t sz, logbuf_t *next)
 		lb->ctl = 0;
 		lb->next = NULL;
 	}
+	lb->refs = NULL;
+	lb->evbuf = NULL;
 	return lb;
 }
 
@@ -92,6 +118,8 @@ logbuf_new_alloc(size_t sz, logbuf_t *next)
 		lb->ctl = 0;
 		lb->next = NULL;
 	}
+	lb->refs = NULL;
+	lb->evbuf = NULL;
 	return lb;
 }
 
@@ -120,6 +148,8 @@ logbuf_new_copy(const void *buf, size_t sz, logbuf_t *next)
 		lb->ctl = 0;
 		lb->next = NULL;
 	}
+	lb->refs = NULL;
+	lb->evbuf = NULL;
 	return lb;
 }
 
@@ -150,6 +180,8 @@ logbuf_new_printf(logbuf_t *next, const char *fmt, ...)
 		lb->ctl = 0;
 		lb->next = NULL;
 	}
+	lb->refs = NULL;
+	lb->evbuf = NULL;
 	return lb;
 }
 
@@ -174,14 +206,15 @@ logbuf_new_deepcopy(logbuf_t *lb, int combine)
 		lbnew->ctl = lb->ctl;
 		p = lbnew->buf;
 		while (lb) {
-			memcpy(p, lb->buf, lb->sz);
+			logbuf_copyout(lb, p);
 			p += lb->sz;
 			lb = lb->next;
 		}
 	} else {
-		lbnew = logbuf_new_copy(lb->buf, lb->sz, NULL);
+		lbnew = logbuf_new_alloc(lb->sz, NULL);
 		if (!lbnew)
 			return NULL;
+		logbuf_copyout(lb, lbnew->buf);
 		lbnew->fh = lb->fh;
 		lbnew->ctl = lb->ctl;
 		lbnew->next = logbuf_new_deepcopy(lb->next, 0);
@@ -189,6 +222,65 @@ logbuf_new_deepcopy(logbuf_t *lb, int combine)
 	return lbnew;
 }
 
+/*
+ * Create new logbuf sharing the internal buffer of lb without copying it,
+ * with fh and ctl copied from lb and without chained buffers.  Lb must not
+ * be chained and its buffer must not be modified afterwards.
+ */
+logbuf_t *
+logbuf_new_shared(logbuf_t *lb)
+{
+	logbuf_t *lbnew;
+
+	if (!lb->refs) {
+		if (!(lb->refs = malloc(sizeof(unsigned int))))
+			return NULL;
+		*lb->refs = 1;
+	}
+	if (!(lbnew = malloc(sizeof(logbuf_t))))
+		return NULL;
+	__atomic_add_fetch(lb->refs, 1, __ATOMIC_RELAXED);
+	lbnew->buf = lb->buf;
+	lbnew->sz = lb->sz;
+	lbnew->fh = lb->fh;
+	lbnew->ctl = lb->ctl;
+	lbnew->next = NULL;
+	lbnew->refs = lb->refs;
+	lbnew->evbuf = lb->evbuf;
+	return lbnew;
+}
+
+/*
+ * Create new logbuf holding the data in evbuf, set next.  Takes ownership
+ * of evbuf, which is freed by logbuf_free() and by logbuf_new_evbuf() in
+ * case it fails returning NULL.  Evbuf must have locking enabled if its
+ * chains are referenced from other evbuffers.
+ */
+logbuf_t *
+logbuf_new_evbuf(struct evbuffer *evbuf, logbuf_t *next)
+{
+	logbuf_t *lb;
+
+	if (!(lb = logbuf_new(NULL, evbuffer_get_length(evbuf), next))) {
+		evbuffer_free(evbuf);
+		return NULL;
+	}
+	lb->evbuf = evbuf;
+	return lb;
+}
+
+/*
+ * Copy the sz octets of data of lb, not including chained buffers, to dst.
+ */
+void
+logbuf_copyout(logbuf_t *lb, void *dst)
+{
+	if (lb->evbuf)
+		evbuffer_copyout(lb->evbuf, dst, lb->sz);
+	else if (lb->sz > 0)
+		memcpy(dst, lb->buf, lb->sz);
+}
+
 logbuf_t *
 logbuf_make_contiguous(logbuf_t *lb) {
 	unsigned char *p;
@@ -198,14 +290,24 @@ logbuf_make_contiguous(logbuf_t *lb) {
 		return NULL;
 	if (!lb->next)
 		return lb;
-	p = realloc(lb->buf, logbuf_size(lb));
-	if (!p)
-		return NULL;
+	if (lb->refs || lb->evbuf) {
+		/* shared or external data cannot be resized in place */
+		if (!(p = malloc(logbuf_size(lb))))
+			return NULL;
+		logbuf_copyout(lb, p);
+		logbuf_free_buf(lb);
+		lb->refs = NULL;
+		lb->evbuf = NULL;
+	} else {
+		p = realloc(lb->buf, logbuf_size(lb));
+		if (!p)
+			return NULL;
+	}
 	lb->buf = p;
 	lbtmp = lb;
 	p += lbtmp->sz;
 	while ((lbtmp = lbtmp->next)) {
-		memcpy(p, lbtmp->buf, lbtmp->sz);
+		logbuf_copyout(lbtmp, p);
 		lb->sz += lbtmp->sz;
 		p += lbtmp->sz;
 	}
@@ -238,10 +340,21 @@ ssize_t
 logbuf_write_free(logbuf_t *lb, writefunc_t writefunc)
 {
 	ssize_t rv1, rv2 = 0;
-	rv1 = writefunc(lb->fh, lb->ctl, lb->buf, lb->sz);
-	if (lb->buf) {
-		free(lb->buf);
+	unsigned char *p;
+
+	if (lb->evbuf) {
+		/* copy out of the evbuffer in the writing thread */
+		if ((p = malloc(lb->sz ? lb->sz : 1))) {
+			logbuf_copyout(lb, p);
+			rv1 = writefunc(lb->fh, lb->ctl, p, lb->sz);
+			free(p);
+		} else {
+			rv1 = -1;
+		}
+	} else {
+		rv1 = writefunc(lb->fh, lb->ctl, lb->buf, lb->sz);
 	}
+	logbuf_free_buf(lb);
 	if (lb->next) {
 		if (rv1 == -1) {
 			logbuf_free(lb->next);
@@ -263,9 +376,7 @@ logbuf_write_free(logbuf_t *lb, writefunc_t writefunc)
 void
 logbuf_free(logbuf_t *lb)
 {
-	if (lb->buf) {
-		free(lb->buf);
-	}
+	logbuf_free_buf(lb);
 	if (lb->next) {
 		logbuf_free(lb->next);
 	}
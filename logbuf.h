@@ -34,12 +34,16 @@
 #include <stdlib.h>
 #include <unistd.h>
 
+struct evbuffer;
+
 typedef struct logbuf {
 	unsigned char *buf;
 	ssize_t sz;
 	void *fh;
 	unsigned long ctl;
 	struct logbuf *next;
+	unsigned int *refs;     /* shared buffer refcount, NULL if not shared */
+	struct evbuffer *evbuf; /* data in evbuffer instead of buf, or NULL */
 } logbuf_t;
 
 typedef ssize_t (*writefunc_t)(void *, unsigned long, const void *, size_t);
@@ -49,6 +53,9 @@ logbuf_t * logbuf_new_alloc(size_t, logbuf_t *) MALLOC;
 logbuf_t * logbuf_new_copy(const void *, size_t, logbuf_t *) MALLOC;
 logbuf_t * logbuf_new_printf(logbuf_t *, const char *, ...) MALLOC PRINTF(2,3);
 logbuf_t * logbuf_new_deepcopy(logbuf_t *, int) MALLOC;
+logbuf_t * logbuf_new_shared(logbuf_t *) NONNULL(1) MALLOC;
+logbuf_t * logbuf_new_evbuf(struct evbuffer *, logbuf_t *) NONNULL(1) MALLOC;
+void logbuf_copyout(logbuf_t *, void *) NONNULL(1,2);
 logbuf_t * logbuf_make_contiguous(logbuf_t *) WUNRES;
 ssize_t logbuf_size(logbuf_t *) NONNULL(1) WUNRES;
 ssize_t logbuf_write_free(logbuf_t *, writefunc_t) NONNULL(1);
@@ -64,6 +71,13 @@ void logbuf_free(logbuf_t *) NONNULL(1);
 #define LBFLAG_CLOSE    (1 << 2)        /* logger */
 #define LBFLAG_IS_REQ   (1 << 3)        /* pcap/mirror content log */
 #define LBFLAG_IS_RESP  (1 << 4)        /* pcap/mirror content log */
+#define LBFLAG_INFLATE  (1 << 5)        /* file content log */
+#define LBFLAG_CHUNKED  (1 << 6)        /* file content log */
+#define LBFLAG_NEWBODY  (1 << 7)        /* file content log */
+#define LBFLAG_TRUNC    (1 << 8)        /* file content log */
+#define LBFLAG_WEBSOCKET (1 << 9)       /* file content log */
+#define LBFLAG_DECODE   (LBFLAG_INFLATE|LBFLAG_CHUNKED|LBFLAG_NEWBODY|\
+                         LBFLAG_WEBSOCKET)
 
 #endif /* !LOGBUF_H */
 
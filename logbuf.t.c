@@ -48,6 +48,28 @@ START_TEST(logbuf_make_contiguous_01)
 }
 END_TEST
 
+START_TEST(logbuf_new_shared_01)
+{
+	logbuf_t *lb, *lb2, *lb3;
+
+	lb = logbuf_new_copy("123456789", 9, NULL);
+	lb->ctl = 1;
+	lb2 = logbuf_new_shared(lb);
+	fail_unless(!!lb2, "logbuf_new_shared failed");
+	lb3 = logbuf_new_shared(lb2);
+	fail_unless(!!lb3, "logbuf_new_shared failed");
+	fail_unless(lb2->buf == lb->buf && lb3->buf == lb->buf,
+	            "buffer not shared");
+	fail_unless(lb3->sz == 9 && lb3->ctl == 1, "metadata not copied");
+	fail_unless(*lb->refs == 3, "wrong refcount");
+	logbuf_free(lb);
+	fail_unless(*lb2->refs == 2, "wrong refcount after free");
+	fail_unless(!memcmp(lb2->buf, "123456789", 9), "buffer freed early");
+	logbuf_free(lb3);
+	logbuf_free(lb2);
+}
+END_TEST
+
 Suite *
 logbuf_suite(void)
 {
@@ -58,6 +80,7 @@ logbuf_suite(void)
 
 	tc = tcase_create("");
 	tcase_add_test(tc, logbuf_make_contiguous_01);
+	tcase_add_test(tc, logbuf_new_shared_01);
 	suite_add_tcase(s, tc);
 
 	return s;
@@ -0,0 +1,533 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "logcas.h"
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <openssl/evp.h>
+
+/*
+ * Content-addressed chunk store for per-connection content logs.
+ *
+ * The logged octets of each connection are split into chunks at positions
+ * defined by their content, using a gear rolling hash over the last 64
+ * octets with normalized chunking: no cut before LOGCAS_MINSZ octets, a
+ * harder cut condition before LOGCAS_AVGSZ and an easier one after it, and
+ * a forced cut at LOGCAS_MAXSZ.  Inserting or removing octets therefore only
+ * changes the chunks around the edit, and the same object served to many
+ * clients yields the same chunks past the first one, which also carries the
+ * varying response header.  Pending octets are cut as well when the
+ * direction changes and when the connection is closed.
+ *
+ * Each chunk is identified by its SHA-256 digest.  Chunks seen for the first
+ * time are appended to the pack file of the writer's shard, named after the
+ * pack ID (the unix time of its creation) and the shard:
+ *
+ * <packid>-<shard>.pack  Chunk payload, concatenated; rotated at
+ *                        LOGCAS_PACKSZ octets.
+ *
+ * Instead of the octets, the per-connection log receives a manifest: the
+ * line "SSLsplit dedup 1", followed by records in the order of the logged
+ * data, either a reference to a stored chunk or an inline chunk:
+ *
+ * @<sha256> <packid>-<shard> <offset> <size>\n
+ * =<size>\n<size octets>
+ *
+ * Chunks shorter than LOGCAS_INLINE octets are always written inline, since
+ * a reference would not be shorter.  Concatenating the chunks in manifest
+ * order reproduces the logged data exactly.  Payload is written to the pack
+ * before the reference, so a reader never sees a reference to missing data.
+ *
+ * The index of stored chunks is shared by all shards and kept in memory
+ * only, as LOGCAS_BUCKETS buckets of LOGCAS_WAYS entries under a mutex,
+ * replacing the oldest entry of a full bucket.  A chunk evicted from the
+ * index, or stored before a restart, is stored again when seen next.  Packs
+ * must therefore only be removed together with all manifests referring to
+ * them.
+ */
+
+#define LOGCAS_MINSZ    (2*1024)
+#define LOGCAS_AVGSZ    (8*1024)
+#define LOGCAS_MAXSZ    (64*1024)
+#define LOGCAS_INLINE   256
+#define LOGCAS_MASK_S   0xfffe000000000000ULL   /* 15 bits */
+#define LOGCAS_MASK_L   0xffe0000000000000ULL   /* 11 bits */
+#define LOGCAS_PACKSZ   (1024ULL*1024*1024)
+#define LOGCAS_BUCKETS  (1U << 16)
+#define LOGCAS_WAYS     4
+#define LOGCAS_KEYSZ    16
+#define LOGCAS_MAGIC    "SSLsplit dedup 1\n"
+
+typedef struct logcas_ent {
+	unsigned char key[LOGCAS_KEYSZ];        /* digest prefix */
+	uint32_t packid;
+	uint32_t shard;
+	uint64_t off;
+	uint32_t sz;                            /* 0 if unused */
+} logcas_ent_t;
+
+typedef struct logcas_bucket {
+	logcas_ent_t ent[LOGCAS_WAYS];
+	unsigned int next;                      /* way to replace next */
+} logcas_bucket_t;
+
+typedef struct logcas_pack {
+	int fd;
+	uint32_t id;
+	uint64_t sz;
+} logcas_pack_t;
+
+struct logcas {
+	char *dir;
+	logcas_open_func_t openfn;
+	unsigned int nshards;
+	logcas_pack_t *packs;                   /* used by shard writers */
+	pthread_mutex_t mutex;                  /* protects buckets */
+	logcas_bucket_t *buckets;
+	/* statistics, only modified using atomic operations */
+	logcas_stats_t stats;
+};
+
+static uint64_t logcas_gear[256];
+static int logcas_gear_ready = 0;
+
+/*
+ * Fill the gear table with fixed pseudo-random values (splitmix64), such
+ * that chunk boundaries are the same across restarts.
+ */
+static void
+logcas_gear_init(void)
+{
+	uint64_t x = 0;
+
+	if (logcas_gear_ready)
+		return;
+	for (int i = 0; i < 256; i++) {
+		uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		logcas_gear[i] = z ^ (z >> 31);
+	}
+	logcas_gear_ready = 1;
+}
+
+/*
+ * Create a content-addressed store in directory *dir* for *nshards* writer
+ * threads.  Pack files are opened lazily on first write using *openfn*,
+ * which is passed the full path and returns a writable fd positioned
+ * anywhere.  Must be called before any writer thread is started.
+ */
+logcas_t *
+logcas_new(const char *dir, unsigned int nshards, logcas_open_func_t openfn)
+{
+	logcas_t *cas;
+
+	logcas_gear_init();
+	cas = malloc(sizeof(logcas_t));
+	if (!cas)
+		return NULL;
+	memset(cas, 0, sizeof(logcas_t));
+	cas->dir = strdup(dir);
+	cas->packs = calloc(nshards, sizeof(logcas_pack_t));
+	cas->buckets = calloc(LOGCAS_BUCKETS, sizeof(logcas_bucket_t));
+	if (!cas->dir || !cas->packs || !cas->buckets)
+		goto errout;
+	for (unsigned int i = 0; i < nshards; i++)
+		cas->packs[i].fd = -1;
+	cas->nshards = nshards;
+	cas->openfn = openfn;
+	if (pthread_mutex_init(&cas->mutex, NULL))
+		goto errout;
+	return cas;
+errout:
+	free(cas->buckets);
+	free(cas->packs);
+	free(cas->dir);
+	free(cas);
+	return NULL;
+}
+
+void
+logcas_free(logcas_t *cas)
+{
+	for (unsigned int i = 0; i < cas->nshards; i++) {
+		if (cas->packs[i].fd != -1)
+			close(cas->packs[i].fd);
+	}
+	pthread_mutex_destroy(&cas->mutex);
+	free(cas->buckets);
+	free(cas->packs);
+	free(cas->dir);
+	free(cas);
+}
+
+/*
+ * Fill in a snapshot of the statistics of the store.
+ */
+void
+logcas_stats(logcas_t *cas, logcas_stats_t *stats)
+{
+	stats->stored_chunks = __atomic_load_n(&cas->stats.stored_chunks,
+	                                       __ATOMIC_RELAXED);
+	stats->stored_bytes = __atomic_load_n(&cas->stats.stored_bytes,
+	                                      __ATOMIC_RELAXED);
+	stats->dedup_chunks = __atomic_load_n(&cas->stats.dedup_chunks,
+	                                      __ATOMIC_RELAXED);
+	stats->dedup_bytes = __atomic_load_n(&cas->stats.dedup_bytes,
+	                                     __ATOMIC_RELAXED);
+	stats->inline_bytes = __atomic_load_n(&cas->stats.inline_bytes,
+	                                      __ATOMIC_RELAXED);
+}
+
+static int
+logcas_writeall(int fd, const void *buf, size_t sz)
+{
+	const unsigned char *p = buf;
+	ssize_t n;
+
+	while (sz > 0) {
+		n = write(fd, p, sz);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		sz -= n;
+	}
+	return 0;
+}
+
+static int
+logcas_out(logcas_out_func_t out, void *arg, const void *buf, size_t sz)
+{
+	return out(arg, buf, sz) == (ssize_t)sz ? 0 : -1;
+}
+
+/*
+ * Open a new pack for *pack*.  If a pack with the same ID exists, for
+ * instance after a quick restart, it is appended to.
+ */
+static int
+logcas_pack_open(logcas_t *cas, logcas_pack_t *pack, unsigned int shard)
+{
+	uint32_t id;
+	off_t sz;
+	char *fn;
+
+	if (pack->fd != -1) {
+		close(pack->fd);
+		pack->fd = -1;
+	}
+	id = (uint32_t)time(NULL);
+	if (id <= pack->id)
+		id = pack->id + 1;
+	if (asprintf(&fn, "%s/%u-%u.pack", cas->dir, id, shard) < 0)
+		return -1;
+	pack->fd = cas->openfn(fn);
+	free(fn);
+	if (pack->fd == -1)
+		return -1;
+	if ((sz = lseek(pack->fd, 0, SEEK_END)) == -1) {
+		close(pack->fd);
+		pack->fd = -1;
+		return -1;
+	}
+	pack->id = id;
+	pack->sz = sz;
+	return 0;
+}
+
+/*
+ * Append a chunk to the pack of *shard*, filling in its location in *ent*.
+ */
+static int
+logcas_pack_append(logcas_t *cas, unsigned int shard,
+                   const unsigned char *buf, size_t sz, logcas_ent_t *ent)
+{
+	logcas_pack_t *pack = &cas->packs[shard];
+	off_t off;
+
+	if (pack->fd == -1 ||
+	    (pack->sz > 0 && pack->sz + sz > LOGCAS_PACKSZ)) {
+		if (logcas_pack_open(cas, pack, shard) == -1)
+			return -1;
+	}
+	if (logcas_writeall(pack->fd, buf, sz) == -1) {
+		/* resync the offset in case of a partial write */
+		if ((off = lseek(pack->fd, 0, SEEK_END)) != -1)
+			pack->sz = off;
+		return -1;
+	}
+	ent->packid = pack->id;
+	ent->shard = shard;
+	ent->off = pack->sz;
+	ent->sz = sz;
+	pack->sz += sz;
+	return 0;
+}
+
+static logcas_bucket_t *
+logcas_bucket(logcas_t *cas, const unsigned char *md)
+{
+	uint32_t h = (uint32_t)md[0] | (uint32_t)md[1] << 8 |
+	             (uint32_t)md[2] << 16 | (uint32_t)md[3] << 24;
+
+	return &cas->buckets[h & (LOGCAS_BUCKETS - 1)];
+}
+
+/*
+ * Look up the chunk with digest *md* in the index.
+ * Returns 1 and fills in *ent* if found, 0 otherwise.
+ */
+static int
+logcas_lookup(logcas_t *cas, const unsigned char *md, logcas_ent_t *ent)
+{
+	logcas_bucket_t *b = logcas_bucket(cas, md);
+	int found = 0;
+
+	pthread_mutex_lock(&cas->mutex);
+	for (int i = 0; i < LOGCAS_WAYS; i++) {
+		if (b->ent[i].sz &&
+		    !memcmp(b->ent[i].key, md, LOGCAS_KEYSZ)) {
+			*ent = b->ent[i];
+			found = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&cas->mutex);
+	return found;
+}
+
+static void
+logcas_insert(logcas_t *cas, const logcas_ent_t *ent)
+{
+	logcas_bucket_t *b = logcas_bucket(cas, ent->key);
+
+	pthread_mutex_lock(&cas->mutex);
+	b->ent[b->next] = *ent;
+	b->next = (b->next + 1) % LOGCAS_WAYS;
+	pthread_mutex_unlock(&cas->mutex);
+}
+
+static int
+logcas_inline(logcas_conn_t *conn, const unsigned char *buf, size_t sz,
+              logcas_out_func_t out, void *arg)
+{
+	char hdr[32];
+	int len;
+
+	len = snprintf(hdr, sizeof(hdr), "=%zu\n", sz);
+	if (logcas_out(out, arg, hdr, len) == -1 ||
+	    logcas_out(out, arg, buf, sz) == -1)
+		return -1;
+	__atomic_add_fetch(&conn->cas->stats.inline_bytes, sz,
+	                   __ATOMIC_RELAXED);
+	return 0;
+}
+
+/*
+ * Write a chunk of the connection to the manifest, storing it first unless
+ * it is already in the store.  If storing it fails, the chunk is written
+ * inline, such that no data is lost, and -1 is returned.
+ */
+static int
+logcas_chunk(logcas_conn_t *conn, const unsigned char *buf, size_t sz,
+             logcas_out_func_t out, void *arg)
+{
+	static const char hex[] = "0123456789abcdef";
+	unsigned char md[EVP_MAX_MD_SIZE];
+	char line[160], *p;
+	unsigned int mdsz;
+	logcas_ent_t ent;
+	int len;
+
+	if (!conn->started) {
+		if (logcas_out(out, arg, LOGCAS_MAGIC,
+		               sizeof(LOGCAS_MAGIC) - 1) == -1)
+			return -1;
+		conn->started = 1;
+	}
+	if (sz < LOGCAS_INLINE)
+		return logcas_inline(conn, buf, sz, out, arg);
+
+	if (!EVP_Digest(buf, sz, md, &mdsz, EVP_sha256(), NULL))
+		goto fallback;
+	if (logcas_lookup(conn->cas, md, &ent)) {
+		__atomic_add_fetch(&conn->cas->stats.dedup_chunks, 1,
+		                   __ATOMIC_RELAXED);
+		__atomic_add_fetch(&conn->cas->stats.dedup_bytes, sz,
+		                   __ATOMIC_RELAXED);
+	} else {
+		if (logcas_pack_append(conn->cas, conn->shard, buf, sz,
+		                       &ent) == -1)
+			goto fallback;
+		memcpy(ent.key, md, LOGCAS_KEYSZ);
+		logcas_insert(conn->cas, &ent);
+		__atomic_add_fetch(&conn->cas->stats.stored_chunks, 1,
+		                   __ATOMIC_RELAXED);
+		__atomic_add_fetch(&conn->cas->stats.stored_bytes, sz,
+		                   __ATOMIC_RELAXED);
+	}
+
+	p = line;
+	*p++ = '@';
+	for (unsigned int i = 0; i < mdsz; i++) {
+		*p++ = hex[md[i] >> 4];
+		*p++ = hex[md[i] & 0xf];
+	}
+	len = snprintf(p, sizeof(line) - (p - line), " %u-%u %llu %u\n",
+	               ent.packid, ent.shard, (unsigned long long)ent.off,
+	               ent.sz);
+	return logcas_out(out, arg, line, (p - line) + len);
+fallback:
+	/* keep the data at the cost of writing it inline */
+	logcas_inline(conn, buf, sz, out, arg);
+	return -1;
+}
+
+/*
+ * Initialize the chunking state of a connection logged through *cas* by the
+ * writer thread of *shard*.
+ */
+void
+logcas_conn_init(logcas_conn_t *conn, logcas_t *cas, unsigned int shard)
+{
+	memset(conn, 0, sizeof(logcas_conn_t));
+	conn->cas = cas;
+	conn->shard = shard % cas->nshards;
+}
+
+void
+logcas_conn_free(logcas_conn_t *conn)
+{
+	if (conn->buf) {
+		free(conn->buf);
+		conn->buf = NULL;
+	}
+	conn->len = conn->sz = 0;
+}
+
+/*
+ * Make room for *n* more pending octets, growing the buffer up to
+ * LOGCAS_MAXSZ octets.
+ */
+static int
+logcas_reserve(logcas_conn_t *conn, size_t n)
+{
+	unsigned char *p;
+	size_t sz;
+
+	if (conn->len + n <= conn->sz)
+		return 0;
+	sz = conn->sz ? conn->sz * 2 : 4096;
+	while (sz < conn->len + n)
+		sz *= 2;
+	if (sz > LOGCAS_MAXSZ)
+		sz = LOGCAS_MAXSZ;
+	p = realloc(conn->buf, sz);
+	if (!p)
+		return -1;
+	conn->buf = p;
+	conn->sz = sz;
+	return 0;
+}
+
+/*
+ * Log *sz* octets from *buf* of the direction given by *request*, writing
+ * the manifest records of all chunks completed to *out*.
+ * Returns 0 on success, -1 on errors.
+ */
+int
+logcas_write(logcas_conn_t *conn, int request, const void *buf, size_t sz,
+             logcas_out_func_t out, void *arg)
+{
+	const unsigned char *p = buf;
+	int rv = 0;
+
+	if (conn->len > 0 && !!request != conn->request &&
+	    logcas_flush(conn, out, arg) == -1)
+		rv = -1;
+	conn->request = !!request;
+
+	while (sz > 0) {
+		uint64_t h = conn->hash;
+		size_t n = 0, len = conn->len;
+		int cut = 0;
+
+		while (n < sz) {
+			h = (h << 1) + logcas_gear[p[n++]];
+			len++;
+			if (len >= LOGCAS_MAXSZ ||
+			    (len >= LOGCAS_MINSZ &&
+			     !(h & (len < LOGCAS_AVGSZ ? LOGCAS_MASK_S
+			                               : LOGCAS_MASK_L)))) {
+				cut = 1;
+				break;
+			}
+		}
+		if (logcas_reserve(conn, n) == -1)
+			return -1;
+		memcpy(conn->buf + conn->len, p, n);
+		conn->len += n;
+		conn->hash = h;
+		p += n;
+		sz -= n;
+		if (cut && logcas_flush(conn, out, arg) == -1)
+			rv = -1;
+	}
+	return rv;
+}
+
+/*
+ * Cut the pending octets of the connection into a final chunk, for
+ * instance before closing its log.
+ * Returns 0 on success, -1 on errors.
+ */
+int
+logcas_flush(logcas_conn_t *conn, logcas_out_func_t out, void *arg)
+{
+	int rv;
+
+	if (conn->len == 0)
+		return 0;
+	rv = logcas_chunk(conn, conn->buf, conn->len, out, arg);
+	conn->len = 0;
+	conn->hash = 0;
+	return rv;
+}
+
+/* vim: set noet ft=c: */
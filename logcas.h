@@ -0,0 +1,79 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LOGCAS_H
+#define LOGCAS_H
+
+#include "attrib.h"
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef struct logcas logcas_t;
+typedef int (*logcas_open_func_t)(const char *);
+typedef ssize_t (*logcas_out_func_t)(void *, const void *, size_t);
+
+/*
+ * Chunking state of a connection logged through a content-addressed store.
+ * Only used by the writer thread of its shard.
+ */
+typedef struct logcas_conn {
+	logcas_t *cas;
+	unsigned int shard;
+	int request;            /* direction of the pending octets */
+	int started;            /* manifest header written */
+	uint64_t hash;          /* rolling hash of the pending octets */
+	unsigned char *buf;     /* pending octets of the current chunk */
+	size_t len;
+	size_t sz;
+} logcas_conn_t;
+
+typedef struct logcas_stats {
+	unsigned long long stored_chunks;
+	unsigned long long stored_bytes;
+	unsigned long long dedup_chunks;
+	unsigned long long dedup_bytes;
+	unsigned long long inline_bytes;
+} logcas_stats_t;
+
+logcas_t * logcas_new(const char *, unsigned int, logcas_open_func_t)
+           NONNULL(1,3) MALLOC;
+void logcas_free(logcas_t *) NONNULL(1);
+void logcas_stats(logcas_t *, logcas_stats_t *) NONNULL(1,2);
+void logcas_conn_init(logcas_conn_t *, logcas_t *, unsigned int)
+     NONNULL(1,2);
+void logcas_conn_free(logcas_conn_t *) NONNULL(1);
+int logcas_write(logcas_conn_t *, int, const void *, size_t,
+                 logcas_out_func_t, void *) NONNULL(1,5) WUNRES;
+int logcas_flush(logcas_conn_t *, logcas_out_func_t, void *)
+    NONNULL(1,2) WUNRES;
+
+#endif /* !LOGCAS_H */
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,350 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "logcas.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <check.h>
+
+#define MAGIC "SSLsplit dedup 1\n"
+
+static char template[] = "/tmp/sslsplit.test.XXXXXX";
+static char *basedir;
+
+static void
+logcas_setup(void)
+{
+	basedir = strdup(template);
+	if (!mkdtemp(basedir)) {
+		perror("mkdtemp");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void
+logcas_teardown(void)
+{
+	struct dirent *de;
+	DIR *d;
+
+	d = opendir(basedir);
+	if (d) {
+		while ((de = readdir(d))) {
+			if (de->d_name[0] != '.')
+				unlinkat(dirfd(d), de->d_name, 0);
+		}
+		closedir(d);
+	}
+	rmdir(basedir);
+	free(basedir);
+}
+
+static int
+logcas_t_open(const char *fn)
+{
+	return open(fn, O_RDWR|O_CREAT, 0600);
+}
+
+typedef struct logcas_t_buf {
+	unsigned char *buf;
+	size_t sz;
+} logcas_t_buf_t;
+
+static logcas_t_buf_t *
+logcas_t_buf_new(void)
+{
+	return calloc(1, sizeof(logcas_t_buf_t));
+}
+
+static void
+logcas_t_buf_free(logcas_t_buf_t *m)
+{
+	free(m->buf);
+	free(m);
+}
+
+static ssize_t
+logcas_t_out(void *arg, const void *buf, size_t sz)
+{
+	logcas_t_buf_t *m = arg;
+	unsigned char *p;
+
+	p = realloc(m->buf, m->sz + sz);
+	if (!p)
+		return -1;
+	memcpy(p + m->sz, buf, sz);
+	m->buf = p;
+	m->sz += sz;
+	return sz;
+}
+
+/*
+ * Fill buf with pseudo-random octets derived from seed.
+ */
+static void
+logcas_t_fill(unsigned char *buf, size_t sz, uint32_t seed)
+{
+	for (size_t i = 0; i < sz; i++) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = seed >> 16;
+	}
+}
+
+/*
+ * Reassemble the data of manifest m into out, reading referenced chunks
+ * from the pack files.  Returns the number of octets, -1 on error.
+ * Counts the records in *nrefs and *ninline.
+ */
+static ssize_t
+logcas_t_restore(logcas_t_buf_t *m, unsigned char *out, size_t outsz,
+                 int *nrefs, int *ninline)
+{
+	const char *p = (const char *)m->buf;
+	const char *end = p + m->sz;
+	size_t len = 0;
+
+	*nrefs = *ninline = 0;
+	if (m->sz < strlen(MAGIC) || memcmp(p, MAGIC, strlen(MAGIC)))
+		return -1;
+	p += strlen(MAGIC);
+	while (p < end) {
+		unsigned long long off;
+		unsigned int packid, shard, sz;
+		char md[65], *fn;
+		const char *nl;
+		int fd;
+
+		nl = memchr(p, '\n', end - p);
+		if (!nl)
+			return -1;
+		if (*p == '=') {
+			sz = strtoul(p + 1, NULL, 10);
+			p = nl + 1;
+			if (p + sz > end || len + sz > outsz)
+				return -1;
+			memcpy(out + len, p, sz);
+			p += sz;
+			(*ninline)++;
+		} else if (*p == '@') {
+			if (sscanf(p, "@%64s %u-%u %llu %u", md, &packid,
+			           &shard, &off, &sz) != 5 ||
+			    strlen(md) != 64 || len + sz > outsz)
+				return -1;
+			if (asprintf(&fn, "%s/%u-%u.pack", basedir, packid,
+			             shard) < 0)
+				return -1;
+			fd = open(fn, O_RDONLY);
+			free(fn);
+			if (fd == -1)
+				return -1;
+			if (pread(fd, out + len, sz, off) != (ssize_t)sz) {
+				close(fd);
+				return -1;
+			}
+			close(fd);
+			p = nl + 1;
+			(*nrefs)++;
+		} else {
+			return -1;
+		}
+		len += sz;
+	}
+	return len;
+}
+
+static size_t
+logcas_t_packbytes(void)
+{
+	struct dirent *de;
+	size_t sz = 0;
+	struct stat st;
+	DIR *d;
+
+	d = opendir(basedir);
+	fail_unless(!!d, "opendir failed");
+	while ((de = readdir(d))) {
+		if (!strstr(de->d_name, ".pack"))
+			continue;
+		fail_unless(fstatat(dirfd(d), de->d_name, &st, 0) == 0,
+		            "stat failed");
+		sz += st.st_size;
+	}
+	closedir(d);
+	return sz;
+}
+
+START_TEST(logcas_01)
+{
+	unsigned char in[300000], out[300000];
+	int nrefs, ninline;
+	logcas_conn_t c;
+	logcas_t *cas;
+	logcas_t_buf_t *m;
+	ssize_t n;
+
+	logcas_t_fill(in, sizeof(in), 1);
+	cas = logcas_new(basedir, 1, logcas_t_open);
+	fail_unless(!!cas, "new failed");
+	m = logcas_t_buf_new();
+	fail_unless(!!m, "buffer failed");
+	logcas_conn_init(&c, cas, 0);
+	/* odd write sizes must not affect the result */
+	for (size_t off = 0; off < sizeof(in); off += 777) {
+		size_t sz = sizeof(in) - off < 777 ? sizeof(in) - off : 777;
+		fail_unless(logcas_write(&c, 0, in + off, sz,
+		                         logcas_t_out, m) == 0,
+		            "write failed");
+	}
+	fail_unless(logcas_flush(&c, logcas_t_out, m) == 0, "flush failed");
+	logcas_conn_free(&c);
+	logcas_free(cas);
+
+	n = logcas_t_restore(m, out, sizeof(out), &nrefs, &ninline);
+	fail_unless(n == (ssize_t)sizeof(in), "wrong size %zd", n);
+	fail_unless(!memcmp(in, out, sizeof(in)), "wrong data");
+	fail_unless(nrefs >= 300000 / (64*1024), "too few chunks");
+	fail_unless(nrefs <= 300000 / (2*1024), "too many chunks");
+	fail_unless(logcas_t_packbytes() + ninline * 256 >= sizeof(in),
+	            "pack too small");
+	logcas_t_buf_free(m);
+}
+END_TEST
+
+START_TEST(logcas_02)
+{
+	unsigned char obj[200000], in[200500], out[200500];
+	logcas_stats_t st;
+	int nrefs, ninline;
+	logcas_conn_t c;
+	logcas_t *cas;
+	logcas_t_buf_t *m;
+	ssize_t n;
+
+	/* the same object behind different headers, on different shards */
+	logcas_t_fill(obj, sizeof(obj), 2);
+	cas = logcas_new(basedir, 2, logcas_t_open);
+	fail_unless(!!cas, "new failed");
+	for (int i = 0; i < 2; i++) {
+		size_t hdrsz = 300 + i * 200;
+
+		logcas_t_fill(in, hdrsz, 100 + i);
+		memcpy(in + hdrsz, obj, sizeof(obj));
+		m = logcas_t_buf_new();
+		fail_unless(!!m, "buffer failed");
+		logcas_conn_init(&c, cas, i);
+		fail_unless(logcas_write(&c, 0, in, hdrsz + sizeof(obj),
+		                         logcas_t_out, m) == 0,
+		            "write failed");
+		fail_unless(logcas_flush(&c, logcas_t_out, m) == 0,
+		            "flush failed");
+		logcas_conn_free(&c);
+		n = logcas_t_restore(m, out, sizeof(out), &nrefs, &ninline);
+		fail_unless(n == (ssize_t)(hdrsz + sizeof(obj)),
+		            "wrong size");
+		fail_unless(!memcmp(in, out, n), "wrong data");
+		logcas_t_buf_free(m);
+	}
+	logcas_stats(cas, &st);
+	logcas_free(cas);
+	fail_unless(st.dedup_bytes > sizeof(obj) - 64*1024,
+	            "object not deduplicated: %llu", st.dedup_bytes);
+	fail_unless(st.stored_bytes < sizeof(obj) + 2*64*1024,
+	            "object stored twice");
+	fail_unless(logcas_t_packbytes() == st.stored_bytes,
+	            "pack size mismatch");
+}
+END_TEST
+
+START_TEST(logcas_03)
+{
+	unsigned char in[3000], out[6100];
+	int nrefs, ninline;
+	logcas_conn_t c;
+	logcas_t *cas;
+	logcas_t_buf_t *m;
+	ssize_t n;
+
+	/* a change of direction cuts a chunk, short chunks stay inline */
+	logcas_t_fill(in, sizeof(in), 3);
+	cas = logcas_new(basedir, 1, logcas_t_open);
+	fail_unless(!!cas, "new failed");
+	m = logcas_t_buf_new();
+	fail_unless(!!m, "buffer failed");
+	logcas_conn_init(&c, cas, 0);
+	fail_unless(logcas_write(&c, 1, in, 1000, logcas_t_out, m) == 0,
+	            "write failed");
+	fail_unless(logcas_write(&c, 0, in, sizeof(in),
+	                         logcas_t_out, m) == 0, "write failed");
+	fail_unless(logcas_write(&c, 1, "GET", 3, logcas_t_out, m) == 0,
+	            "write failed");
+	fail_unless(logcas_flush(&c, logcas_t_out, m) == 0, "flush failed");
+	logcas_conn_free(&c);
+	logcas_free(cas);
+
+	n = logcas_t_restore(m, out, sizeof(out), &nrefs, &ninline);
+	fail_unless(n == 1000 + sizeof(in) + 3, "wrong size");
+	fail_unless(!memcmp(out, in, 1000), "wrong request");
+	fail_unless(!memcmp(out + 1000, in, sizeof(in)), "wrong response");
+	fail_unless(!memcmp(out + 1000 + sizeof(in), "GET", 3),
+	            "wrong request");
+	fail_unless(nrefs == 2, "wrong number of references");
+	fail_unless(ninline == 1, "wrong number of inline chunks");
+	fail_unless(m->sz > 7 && !memcmp(m->buf + m->sz - 7, "\n=3\nGET", 7),
+	            "short chunk not inline");
+	logcas_t_buf_free(m);
+}
+END_TEST
+
+Suite *
+logcas_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("logcas");
+
+	tc = tcase_create("logcas");
+	tcase_add_checked_fixture(tc, logcas_setup, logcas_teardown);
+	tcase_add_test(tc, logcas_01);
+	tcase_add_test(tc, logcas_02);
+	tcase_add_test(tc, logcas_03);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,477 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "logconv.h"
+
+#include "logpkt.h"
+#include "log.h"
+#include "khash.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/*
+ * Offline conversion of single-file content logs (-L) to PCAP or pcapng,
+ * the native counterpart of extra/log2pcap.py.
+ *
+ * Each record of the content log consists of a header line followed by the
+ * logged octets, if any:
+ *
+ *   2015-09-27 14:55:41 UTC [192.0.2.1]:56721 -> [192.0.2.2]:443 (37):
+ *   2015-09-27 14:55:41 UTC [192.0.2.2]:443 -> [192.0.2.1]:56721 (EOF)
+ *   2015-09-27 14:55:41 UTC [192.0.2.1]:56721 -> [192.0.2.2]:443 (TRUNCATED)
+ *
+ * Records are parsed straight from the caller's buffer, typically a read-only
+ * mapping of the log, and turned into packets by the same logpkt.c code that
+ * writes PCAP logs at runtime, including the emulated TCP handshakes and
+ * sequence numbers.  Connections are identified by their pair of endpoints;
+ * the endpoint sending the first record is taken to be the client.  Packets
+ * carry the second-resolution timestamp of their record.  The records of all
+ * connections are collected in a large batch buffer, such that the output is
+ * written in few large writes.
+ */
+
+#define LOGCONV_MAXHDRSZ        512
+#define LOGCONV_DATA            0
+#define LOGCONV_EOF             1
+#define LOGCONV_TRUNC           2
+
+typedef struct logconv_conn {
+	char *key;              /* canonical endpoint pair, map key */
+	char *src;              /* endpoint which sent the first record */
+	logpkt_ctx_t pkt;
+} logconv_conn_t;
+
+KHASH_INIT(connmap_t, char*, logconv_conn_t*, 1, kh_str_hash_func,
+           kh_str_hash_equal)
+
+struct logconv {
+	int fd;
+	logpkt_batch_t *batch;
+	logpkt_pcapng_t ng;
+	int pcapng;
+	khash_t(connmap_t) *conns;
+	struct timeval tv;      /* timestamp of current record */
+	char tmstr[20];         /* last parsed date and time */
+	uint64_t off;           /* log offset of next record */
+	uint64_t records;
+	uint64_t nconns;
+};
+
+typedef struct logconv_hdr {
+	time_t sec;
+	char *src;
+	char *dst;
+	struct sockaddr_storage srcaddr;
+	struct sockaddr_storage dstaddr;
+	socklen_t srcaddrlen;
+	socklen_t dstaddrlen;
+	int type;
+	size_t size;
+} logconv_hdr_t;
+
+static uint8_t logconv_src_ether[ETHER_ADDR_LEN] = {
+	0x02, 0x00, 0x00, 0x11, 0x11, 0x11};
+static uint8_t logconv_dst_ether[ETHER_ADDR_LEN] = {
+	0x02, 0x00, 0x00, 0x22, 0x22, 0x22};
+
+/*
+ * Create a converter writing PCAP, or pcapng if pcapng is non-zero, to the
+ * empty file open for reading and writing on fd, batching up to batchsz
+ * octets of output.
+ */
+logconv_t *
+logconv_new(int fd, int pcapng, size_t batchsz)
+{
+	logconv_t *conv;
+
+	if (!(conv = calloc(1, sizeof(logconv_t))))
+		return NULL;
+	conv->fd = fd;
+	conv->pcapng = pcapng;
+	if (!(conv->conns = kh_init(connmap_t)))
+		goto errout;
+	if (!(conv->batch = logpkt_batch_new(fd, batchsz)))
+		goto errout;
+	if (logpkt_pcap_open_fd(fd, NULL, pcapng ? &conv->ng : NULL) == -1)
+		goto errout;
+	return conv;
+
+errout:
+	logconv_free(conv);
+	return NULL;
+}
+
+static void
+logconv_conn_free(logconv_conn_t *conn)
+{
+	free(conn->key);
+	free(conn->src);
+	free(conn);
+}
+
+/*
+ * Free the converter and the state of all connections still open, without
+ * writing anything.
+ */
+void
+logconv_free(logconv_t *conv)
+{
+	if (conv->conns) {
+		for (khiter_t it = kh_begin(conv->conns);
+		     it != kh_end(conv->conns); it++) {
+			if (kh_exist(conv->conns, it))
+				logconv_conn_free(kh_val(conv->conns, it));
+		}
+		kh_destroy(connmap_t, conv->conns);
+	}
+	if (conv->batch)
+		logpkt_batch_free(conv->batch);
+	free(conv);
+}
+
+/*
+ * Parse the decimal number of exactly n digits at p.
+ */
+static int
+logconv_num(const char *p, int n)
+{
+	int v = 0;
+
+	for (int i = 0; i < n; i++) {
+		if (p[i] < '0' || p[i] > '9')
+			return -1;
+		v = v * 10 + (p[i] - '0');
+	}
+	return v;
+}
+
+/*
+ * Parse the "YYYY-MM-DD HH:MM:SS ZONE " timestamp at the start of p into
+ * conv->tv, reusing the previous result if unchanged.
+ * Returns a pointer past the timestamp, or NULL on syntax errors.
+ */
+static char *
+logconv_parse_time(logconv_t *conv, char *p, time_t *sec)
+{
+	struct tm tm;
+
+	if (strlen(p) < 20 || p[4] != '-' || p[7] != '-' || p[10] != ' ' ||
+	    p[13] != ':' || p[16] != ':' || p[19] != ' ')
+		return NULL;
+	if (memcmp(p, conv->tmstr, 19) != 0) {
+		memset(&tm, 0, sizeof(tm));
+		tm.tm_year = logconv_num(p, 4) - 1900;
+		tm.tm_mon = logconv_num(p + 5, 2) - 1;
+		tm.tm_mday = logconv_num(p + 8, 2);
+		tm.tm_hour = logconv_num(p + 11, 2);
+		tm.tm_min = logconv_num(p + 14, 2);
+		tm.tm_sec = logconv_num(p + 17, 2);
+		if (tm.tm_year < 0 || tm.tm_mon < 0 || tm.tm_mday < 0 ||
+		    tm.tm_hour < 0 || tm.tm_min < 0 || tm.tm_sec < 0)
+			return NULL;
+		conv->tv.tv_sec = timegm(&tm);
+		memcpy(conv->tmstr, p, 19);
+	}
+	*sec = conv->tv.tv_sec;
+	/* zone is always UTC, skip it */
+	p += 20;
+	if (!(p = strchr(p, ' ')))
+		return NULL;
+	return p + 1;
+}
+
+/*
+ * Parse the "[addr]:port" endpoint at p into addr and NUL-terminate it.
+ * Returns a pointer past the endpoint, or NULL on syntax errors.
+ */
+static char *
+logconv_parse_ep(char *p, struct sockaddr_storage *addr, socklen_t *addrlen)
+{
+	struct sockaddr_in *sin = (struct sockaddr_in *)addr;
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)addr;
+	char *end, *q;
+	unsigned long port;
+
+	if (*p != '[' || !(q = strchr(p, ']')) || q[1] != ':')
+		return NULL;
+	*q = '\0';
+	port = strtoul(q + 2, &end, 10);
+	if (end == q + 2 || port > 65535)
+		return NULL;
+	memset(addr, 0, sizeof(*addr));
+	if (inet_pton(AF_INET, p + 1, &sin->sin_addr) == 1) {
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(port);
+		*addrlen = sizeof(*sin);
+	} else if (inet_pton(AF_INET6, p + 1, &sin6->sin6_addr) == 1) {
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(port);
+		*addrlen = sizeof(*sin6);
+	} else {
+		return NULL;
+	}
+	*q = ']';
+	return end;
+}
+
+/*
+ * Parse the NUL-terminated header line into h.  The endpoints in h point
+ * into line.
+ * Returns -1 on syntax errors.
+ */
+static int
+logconv_parse_hdr(logconv_t *conv, char *line, logconv_hdr_t *h)
+{
+	char *p, *end;
+	unsigned long long sz;
+
+	if (!(p = logconv_parse_time(conv, line, &h->sec)))
+		return -1;
+	h->src = p;
+	if (!(p = logconv_parse_ep(p, &h->srcaddr, &h->srcaddrlen)))
+		return -1;
+	if (strncmp(p, " -> ", 4) != 0)
+		return -1;
+	*p = '\0';
+	h->dst = p + 4;
+	if (!(p = logconv_parse_ep(p + 4, &h->dstaddr, &h->dstaddrlen)))
+		return -1;
+	if (h->srcaddr.ss_family != h->dstaddr.ss_family)
+		return -1;
+	if (strncmp(p, " (", 2) != 0)
+		return -1;
+	*p = '\0';
+	p += 2;
+	h->size = 0;
+	if (!strcmp(p, "EOF)")) {
+		h->type = LOGCONV_EOF;
+	} else if (!strcmp(p, "TRUNCATED)")) {
+		h->type = LOGCONV_TRUNC;
+	} else {
+		h->type = LOGCONV_DATA;
+		errno = 0;
+		sz = strtoull(p, &end, 10);
+		if (end == p || errno || strcmp(end, "):") != 0)
+			return -1;
+		h->size = sz;
+	}
+	return 0;
+}
+
+/*
+ * Look up or create the connection of the record with header h.
+ * Returns NULL on memory allocation failure, or if the record is an EOF
+ * record of an unknown connection.
+ */
+static logconv_conn_t *
+logconv_conn(logconv_t *conv, logconv_hdr_t *h, khiter_t *itp)
+{
+	logconv_conn_t *conn;
+	char *key;
+	khiter_t it;
+	int ret;
+
+	if (strcmp(h->src, h->dst) < 0)
+		ret = asprintf(&key, "%s %s", h->src, h->dst);
+	else
+		ret = asprintf(&key, "%s %s", h->dst, h->src);
+	if (ret == -1)
+		return NULL;
+	it = kh_get(connmap_t, conv->conns, key);
+	if (it != kh_end(conv->conns)) {
+		free(key);
+		*itp = it;
+		return kh_val(conv->conns, it);
+	}
+	if (h->type == LOGCONV_EOF) {
+		free(key);
+		return NULL;
+	}
+
+	if (!(conn = calloc(1, sizeof(logconv_conn_t)))) {
+		free(key);
+		return NULL;
+	}
+	conn->key = key;
+	if (!(conn->src = strdup(h->src)))
+		goto errout;
+	logpkt_ctx_init(&conn->pkt, NULL, NULL, 0,
+	                logconv_src_ether, logconv_dst_ether,
+	                (struct sockaddr *)&h->srcaddr, h->srcaddrlen,
+	                (struct sockaddr *)&h->dstaddr, h->dstaddrlen);
+	conn->pkt.batch = conv->batch;
+	conn->pkt.tv = &conv->tv;
+	if (conv->pcapng)
+		logpkt_ctx_set_pcapng(&conn->pkt, &conv->ng, conn->key, NULL);
+	it = kh_put(connmap_t, conv->conns, conn->key, &ret);
+	if (ret == -1)
+		goto errout;
+	kh_val(conv->conns, it) = conn;
+	conv->nconns++;
+	*itp = it;
+	return conn;
+
+errout:
+	logconv_conn_free(conn);
+	return NULL;
+}
+
+/*
+ * Emit the packets for one record with header h and data.
+ */
+static int
+logconv_record(logconv_t *conv, logconv_hdr_t *h, const unsigned char *data)
+{
+	logconv_conn_t *conn;
+	khiter_t it;
+	int direction, rv;
+
+	if (!(conn = logconv_conn(conv, h, &it)))
+		return h->type == LOGCONV_EOF ? 0 : -1;
+	direction = strcmp(conn->src, h->src) ? LOGPKT_RESPONSE
+	                                      : LOGPKT_REQUEST;
+	switch (h->type) {
+	case LOGCONV_EOF:
+		rv = logpkt_write_close(&conn->pkt, conv->fd, direction);
+		kh_del(connmap_t, conv->conns, it);
+		logconv_conn_free(conn);
+		return rv;
+	case LOGCONV_TRUNC:
+		return 0;
+	default:
+		if (h->size == 0)
+			return 0;
+		return logpkt_write_payload(&conn->pkt, conv->fd, direction,
+		                            data, h->size);
+	}
+}
+
+/*
+ * Convert the complete records at the start of buf of size sz.
+ * Returns the number of octets consumed, which is less than sz if buf ends
+ * in an incomplete record, or -1 on error.
+ */
+ssize_t
+logconv_parse(logconv_t *conv, const unsigned char *buf, size_t sz)
+{
+	char line[LOGCONV_MAXHDRSZ];
+	const unsigned char *nl;
+	logconv_hdr_t h;
+	size_t off = 0, hdrsz, recsz;
+
+	while (off < sz) {
+		hdrsz = sz - off < sizeof(line) ? sz - off : sizeof(line);
+		if (!(nl = memchr(buf + off, '\n', hdrsz))) {
+			if (hdrsz == sizeof(line))
+				goto syntax;
+			break;
+		}
+		hdrsz = nl - (buf + off);
+		memcpy(line, buf + off, hdrsz);
+		line[hdrsz] = '\0';
+		if (logconv_parse_hdr(conv, line, &h) == -1)
+			goto syntax;
+		recsz = hdrsz + 1 + h.size;
+		if (recsz > sz - off)
+			break;
+		if (logconv_record(conv, &h, nl + 1) == -1)
+			return -1;
+		off += recsz;
+		conv->off += recsz;
+		conv->records++;
+	}
+	return off;
+
+syntax:
+	log_err_printf("Syntax error in content log record at offset "
+	               "%llu\n", (unsigned long long)conv->off);
+	errno = EINVAL;
+	return -1;
+}
+
+/*
+ * Close all connections left open at the end of the log with the timestamp
+ * of the last record and write all remaining output.
+ */
+int
+logconv_finish(logconv_t *conv)
+{
+	logconv_conn_t *conn;
+	int rv = 0;
+
+	for (khiter_t it = kh_begin(conv->conns);
+	     it != kh_end(conv->conns); it++) {
+		if (!kh_exist(conv->conns, it))
+			continue;
+		conn = kh_val(conv->conns, it);
+		if (logpkt_write_close(&conn->pkt, conv->fd,
+		                       LOGPKT_REQUEST) == -1)
+			rv = -1;
+		kh_del(connmap_t, conv->conns, it);
+		logconv_conn_free(conn);
+	}
+	if (logpkt_batch_flush(conv->batch) == -1)
+		rv = -1;
+	return rv;
+}
+
+/*
+ * Returns the log offset of the next record to be parsed.
+ */
+uint64_t
+logconv_offset(logconv_t *conv)
+{
+	return conv->off;
+}
+
+/*
+ * Returns the number of records converted.
+ */
+uint64_t
+logconv_records(logconv_t *conv)
+{
+	return conv->records;
+}
+
+/*
+ * Returns the number of connections seen.
+ */
+uint64_t
+logconv_conns(logconv_t *conv)
+{
+	return conv->nconns;
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,199 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "logconv.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <check.h>
+
+#define LOG1 \
+	"2015-09-27 14:55:41 UTC [192.0.2.1]:56721 -> [192.0.2.2]:443 (4):\n" \
+	"ping" \
+	"2015-09-27 14:55:42 UTC [192.0.2.2]:443 -> [192.0.2.1]:56721 (4):\n" \
+	"pong" \
+	"2015-09-27 14:55:42 UTC [2001:db8::1]:1234 -> [2001:db8::2]:80 " \
+	"(TRUNCATED)\n" \
+	"2015-09-27 14:55:43 UTC [192.0.2.2]:443 -> [192.0.2.1]:56721 (EOF)\n"
+
+/* 24 octets PCAP header, SYN handshake, data+ACK twice, FIN handshake */
+#define LOG1_PCAPSZ (24 + (16 + 54) * 10 + 8)
+
+static char template[] = "/tmp/sslsplit.test.XXXXXX";
+static char *basedir;
+static char *pcapfile;
+static int fd;
+
+static void
+logconv_setup(void)
+{
+	basedir = strdup(template);
+	if (!mkdtemp(basedir)) {
+		perror("mkdtemp");
+		exit(EXIT_FAILURE);
+	}
+	if (asprintf(&pcapfile, "%s/out.pcap", basedir) == -1) {
+		perror("asprintf");
+		exit(EXIT_FAILURE);
+	}
+	fd = open(pcapfile, O_RDWR|O_CREAT|O_TRUNC, 0600);
+	if (fd == -1) {
+		perror("open");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void
+logconv_teardown(void)
+{
+	close(fd);
+	unlink(pcapfile);
+	rmdir(basedir);
+	free(pcapfile);
+	free(basedir);
+}
+
+static off_t
+logconv_filesize(void)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) == -1)
+		return -1;
+	return st.st_size;
+}
+
+START_TEST(logconv_01)
+{
+	logconv_t *conv;
+	ssize_t n;
+
+	conv = logconv_new(fd, 0, 0);
+	fail_unless(!!conv, "new failed");
+	n = logconv_parse(conv, (const unsigned char *)LOG1, strlen(LOG1));
+	fail_unless(n == (ssize_t)strlen(LOG1), "did not consume log");
+	fail_unless(logconv_records(conv) == 4, "wrong number of records");
+	fail_unless(logconv_conns(conv) == 2, "wrong number of conns");
+	fail_unless(logconv_finish(conv) == 0, "finish failed");
+	logconv_free(conv);
+	/* the truncated IPv6 connection is closed with 6 packets of 74 */
+	fail_unless(logconv_filesize() == LOG1_PCAPSZ + (16 + 74) * 6,
+	            "wrong pcap size %lld", (long long)logconv_filesize());
+}
+END_TEST
+
+START_TEST(logconv_02)
+{
+	logconv_t *conv;
+	size_t sz = strlen(LOG1);
+	ssize_t n;
+
+	conv = logconv_new(fd, 0, 0);
+	fail_unless(!!conv, "new failed");
+	/* cut in the middle of the data of the first record */
+	n = logconv_parse(conv, (const unsigned char *)LOG1, 68);
+	fail_unless(n == 0, "consumed incomplete record");
+	/* cut in the middle of the header of the second record */
+	n = logconv_parse(conv, (const unsigned char *)LOG1, 100);
+	fail_unless(n == 70, "did not consume first record only");
+	n = logconv_parse(conv, (const unsigned char *)LOG1 + n, sz - n);
+	fail_unless(n == (ssize_t)sz - 70, "did not consume rest");
+	fail_unless(logconv_offset(conv) == sz, "wrong offset");
+	fail_unless(logconv_records(conv) == 4, "wrong number of records");
+	fail_unless(logconv_finish(conv) == 0, "finish failed");
+	logconv_free(conv);
+}
+END_TEST
+
+START_TEST(logconv_03)
+{
+	static const char *bad[] = {
+		"2015-09-27 14:55:41 UTC [192.0.2.1]:56721 <- "
+		"[192.0.2.2]:443 (4):\nping",
+		"2015-09-27 14:55:41 UTC [192.0.2.1]:56721 -> "
+		"[192.0.2.2]:443 (4)\nping",
+		"2015-09-27 14:55:41 UTC [192.0.2.1]:56721 -> "
+		"[2001:db8::2]:443 (4):\nping",
+		"2015-09-27 14:55:41 UTC [example.org]:56721 -> "
+		"[192.0.2.2]:443 (4):\nping",
+		"2015-09-27T14:55:41 UTC [192.0.2.1]:56721 -> "
+		"[192.0.2.2]:443 (4):\nping",
+	};
+	logconv_t *conv;
+
+	for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+		conv = logconv_new(fd, 0, 0);
+		fail_unless(!!conv, "new failed");
+		fail_unless(logconv_parse(conv, (const unsigned char *)bad[i],
+		                          strlen(bad[i])) == -1,
+		            "accepted bad record %zu", i);
+		logconv_free(conv);
+	}
+}
+END_TEST
+
+START_TEST(logconv_04)
+{
+	logconv_t *conv;
+	ssize_t n;
+
+	conv = logconv_new(fd, 1, 0);
+	fail_unless(!!conv, "new failed");
+	n = logconv_parse(conv, (const unsigned char *)LOG1, strlen(LOG1));
+	fail_unless(n == (ssize_t)strlen(LOG1), "did not consume log");
+	fail_unless(logconv_finish(conv) == 0, "finish failed");
+	logconv_free(conv);
+	fail_unless(logconv_filesize() > LOG1_PCAPSZ, "pcapng too small");
+}
+END_TEST
+
+Suite *
+logconv_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("logconv");
+
+	tc = tcase_create("logconv");
+	tcase_add_checked_fixture(tc, logconv_setup, logconv_teardown);
+	tcase_add_test(tc, logconv_01);
+	tcase_add_test(tc, logconv_02);
+	tcase_add_test(tc, logconv_03);
+	tcase_add_test(tc, logconv_04);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,455 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "logdec.h"
+
+#include <string.h>
+
+#include <zlib.h>
+
+/*
+ * Streaming decoder for HTTP message bodies in the content log.
+ * Removes chunked transfer coding and inflates gzip or zlib content coding
+ * from a copy of the body as it passes through the logger thread; the
+ * forwarded data is not affected.  If the body cannot be decoded, the
+ * remaining octets are passed through undecoded so that nothing is lost
+ * from the log.
+ *
+ * WebSocket streams are decoded to the payload of their data frames,
+ * unmasked and, for messages compressed with permessage-deflate
+ * (RFC 7692), inflated; control frames are skipped.
+ */
+
+#define LOGDEC_CHUNK_SIZE      0
+#define LOGDEC_CHUNK_DATA      1
+#define LOGDEC_CHUNK_DATACRLF  2
+#define LOGDEC_CHUNK_TRAILER   3
+#define LOGDEC_CHUNK_DONE      4
+#define LOGDEC_WS_HEADER       5
+#define LOGDEC_WS_PAYLOAD      6
+
+/*
+ * Bounds on inflating content-coded data against decompression bombs: the
+ * output of a single call, and, beyond that many octets, the ratio of output
+ * to input of the whole body.  Exceeding either passes the rest of the body
+ * through undecoded.
+ */
+#define LOGDEC_INFLATE_MAXCALL  (16 * 1024 * 1024)
+#define LOGDEC_INFLATE_MAXRATIO 256
+
+struct logdec {
+	z_stream zs;
+	unsigned long long left;
+	unsigned int flags;
+	int state;
+	unsigned int failed : 1;        /* pass through undecoded */
+	unsigned int eos : 1;           /* end of compressed stream */
+	char line[24];
+	size_t linelen;
+	unsigned char hdr[14];          /* WebSocket frame header */
+	size_t hdrlen;
+	size_t maskoff;                 /* offset of mask key in hdr or 0 */
+	size_t maskidx;                 /* payload octets unmasked */
+	unsigned int fin : 1;           /* final frame of message */
+	unsigned int data : 1;          /* data frame, not control frame */
+	unsigned int compressed : 1;    /* message is permessage-deflate */
+};
+
+typedef struct logdec_out {
+	unsigned char *buf;
+	size_t sz;
+	size_t len;
+} logdec_out_t;
+
+/*
+ * Create a new decoder for a single message body.
+ * Returns NULL on out of memory condition.
+ */
+logdec_t *
+logdec_new(unsigned int flags)
+{
+	logdec_t *dec;
+
+	dec = malloc(sizeof(logdec_t));
+	if (!dec)
+		return NULL;
+	memset(dec, 0, sizeof(logdec_t));
+	dec->flags = flags;
+	dec->state = (flags & LOGDEC_WEBSOCKET) ? LOGDEC_WS_HEADER
+	                                        : LOGDEC_CHUNK_SIZE;
+	if (flags & LOGDEC_INFLATE) {
+		/* window bits 15 + 32: auto-detect gzip or zlib header */
+		if (inflateInit2(&dec->zs, 15 + 32) != Z_OK) {
+			free(dec);
+			return NULL;
+		}
+	}
+	return dec;
+}
+
+void
+logdec_free(logdec_t *dec)
+{
+	if (dec->flags & LOGDEC_INFLATE)
+		inflateEnd(&dec->zs);
+	free(dec);
+}
+
+/*
+ * Ensure that at least need octets are available at the end of out.
+ * Returns -1 on out of memory condition, 0 on success.
+ */
+static int
+logdec_out_reserve(logdec_out_t *out, size_t need)
+{
+	unsigned char *buf;
+	size_t sz;
+
+	if (out->sz - out->len >= need)
+		return 0;
+	sz = out->sz ? out->sz : 1024;
+	while (sz - out->len < need)
+		sz *= 2;
+	buf = realloc(out->buf, sz);
+	if (!buf)
+		return -1;
+	out->buf = buf;
+	out->sz = sz;
+	return 0;
+}
+
+static int
+logdec_out_append(logdec_out_t *out, const unsigned char *buf, size_t sz)
+{
+	if (logdec_out_reserve(out, sz) == -1)
+		return -1;
+	memcpy(out->buf + out->len, buf, sz);
+	out->len += sz;
+	return 0;
+}
+
+/*
+ * Return 1 if inflating must stop after callout octets of output in the
+ * current call, 0 otherwise; see LOGDEC_INFLATE_MAXCALL.
+ */
+static int
+logdec_inflate_over(logdec_t *dec, size_t callout)
+{
+	return callout >= LOGDEC_INFLATE_MAXCALL ||
+	       (dec->zs.total_out > LOGDEC_INFLATE_MAXCALL &&
+	        dec->zs.total_out / LOGDEC_INFLATE_MAXRATIO >
+	        dec->zs.total_in);
+}
+
+/*
+ * Inflate sz octets of content-coded data from buf into out.
+ * Returns -1 on out of memory condition, 0 otherwise.
+ */
+static int
+logdec_inflate(logdec_t *dec, const unsigned char *buf, size_t sz,
+               logdec_out_t *out)
+{
+	size_t avail, start = out->len;
+	int rv;
+
+	if (dec->failed || !(dec->flags & LOGDEC_INFLATE))
+		return logdec_out_append(out, buf, sz);
+	if (dec->eos)
+		return 0;
+
+	dec->zs.next_in = (Bytef *)buf;
+	dec->zs.avail_in = sz;
+	do {
+		if (logdec_inflate_over(dec, out->len - start)) {
+			dec->failed = 1;
+			return logdec_out_append(out, dec->zs.next_in,
+			                         dec->zs.avail_in);
+		}
+		if (logdec_out_reserve(out, sz < 1024 ? 4096 : 4 * sz) == -1)
+			return -1;
+		avail = out->sz - out->len;
+		if (avail > LOGDEC_INFLATE_MAXCALL - (out->len - start))
+			avail = LOGDEC_INFLATE_MAXCALL - (out->len - start);
+		dec->zs.next_out = out->buf + out->len;
+		dec->zs.avail_out = avail;
+		rv = inflate(&dec->zs, Z_NO_FLUSH);
+		out->len += avail - dec->zs.avail_out;
+		if (rv == Z_STREAM_END) {
+			dec->eos = 1;
+			break;
+		}
+		if (rv == Z_MEM_ERROR)
+			return -1;
+		if (rv == Z_BUF_ERROR)
+			break;
+		if (rv != Z_OK) {
+			dec->failed = 1;
+			if (dec->zs.total_out == 0)
+				return logdec_out_append(out, buf, sz);
+			return logdec_out_append(out, dec->zs.next_in,
+			                         dec->zs.avail_in);
+		}
+	} while (dec->zs.avail_in > 0 || dec->zs.avail_out == 0);
+	return 0;
+}
+
+/*
+ * Accumulate a line in the chunked transfer coding, ignoring CR and any
+ * characters beyond the line buffer size.  Returns 1 if the line is
+ * complete, 0 if more octets are needed.
+ */
+static int
+logdec_line(logdec_t *dec, unsigned char c)
+{
+	if (c == '\n')
+		return 1;
+	if (c != '\r' && dec->linelen < sizeof(dec->line) - 1)
+		dec->line[dec->linelen++] = c;
+	return 0;
+}
+
+/*
+ * Return the length of the WebSocket frame header starting with the len
+ * octets at hdr, as far as known from them.
+ */
+static size_t
+logdec_ws_hdrlen(const unsigned char *hdr, size_t len)
+{
+	size_t need = 2;
+
+	if (len < 2)
+		return need;
+	if ((hdr[1] & 0x7f) == 126)
+		need += 2;
+	else if ((hdr[1] & 0x7f) == 127)
+		need += 8;
+	if (hdr[1] & 0x80)
+		need += 4;
+	return need;
+}
+
+/*
+ * Start a frame with the complete header in dec->hdr.  The first frame of a
+ * compressed message sets up the raw inflate stream shared by all compressed
+ * messages of the connection direction.
+ */
+static void
+logdec_ws_frame(logdec_t *dec)
+{
+	unsigned int opcode = dec->hdr[0] & 0x0f;
+	size_t i, n;
+
+	dec->fin = !!(dec->hdr[0] & 0x80);
+	dec->data = !(opcode & 0x08);
+	if (opcode == 1 || opcode == 2)
+		dec->compressed = !!(dec->hdr[0] & 0x40);
+	if (dec->data && dec->compressed && !(dec->flags & LOGDEC_INFLATE)) {
+		if (inflateInit2(&dec->zs, -15) == Z_OK)
+			dec->flags |= LOGDEC_INFLATE;
+		else
+			dec->failed = 1;
+	}
+	n = dec->hdr[1] & 0x7f;
+	i = 2;
+	if (n == 126 || n == 127) {
+		dec->left = 0;
+		for (n = (n == 126) ? 2 : 8; n > 0; n--)
+			dec->left = (dec->left << 8) | dec->hdr[i++];
+	} else {
+		dec->left = n;
+	}
+	dec->maskoff = (dec->hdr[1] & 0x80) ? i : 0;
+	dec->maskidx = 0;
+}
+
+/*
+ * Finish the current frame; at the end of a compressed message, flush the
+ * inflate stream with the empty stored block removed by the sender.
+ */
+static int
+logdec_ws_frame_end(logdec_t *dec, logdec_out_t *out)
+{
+	static const unsigned char tail[] = {0x00, 0x00, 0xff, 0xff};
+
+	dec->state = LOGDEC_WS_HEADER;
+	dec->hdrlen = 0;
+	if (!dec->data || !dec->fin || !dec->compressed)
+		return 0;
+	dec->compressed = 0;
+	if (dec->failed)
+		return 0;
+	if (logdec_inflate(dec, tail, sizeof(tail), out) == -1)
+		return -1;
+	if (dec->eos) {
+		/* sender ended the deflate stream with a final block */
+		inflateReset(&dec->zs);
+		dec->eos = 0;
+	}
+	return 0;
+}
+
+/*
+ * Decode sz octets of a WebSocket stream from buf into out.
+ * Returns -1 on out of memory condition, 0 otherwise.
+ */
+static int
+logdec_websocket(logdec_t *dec, const unsigned char *buf, size_t sz,
+                 logdec_out_t *out)
+{
+	unsigned char tmp[1024];
+	const unsigned char *mask;
+	size_t i = 0, n;
+
+	while (i < sz) {
+		if (dec->state == LOGDEC_WS_HEADER) {
+			dec->hdr[dec->hdrlen++] = buf[i++];
+			if (dec->hdrlen < logdec_ws_hdrlen(dec->hdr,
+			                                   dec->hdrlen))
+				continue;
+			logdec_ws_frame(dec);
+			dec->state = LOGDEC_WS_PAYLOAD;
+			if (!dec->left && logdec_ws_frame_end(dec, out) == -1)
+				return -1;
+			continue;
+		}
+		n = sz - i;
+		if (n > dec->left)
+			n = dec->left;
+		if (n > sizeof(tmp))
+			n = sizeof(tmp);
+		if (dec->data) {
+			memcpy(tmp, buf + i, n);
+			if (dec->maskoff) {
+				mask = dec->hdr + dec->maskoff;
+				for (size_t j = 0; j < n; j++)
+					tmp[j] ^= mask[(dec->maskidx + j) & 3];
+				dec->maskidx += n;
+			}
+			if (dec->compressed
+			    ? logdec_inflate(dec, tmp, n, out) == -1
+			    : logdec_out_append(out, tmp, n) == -1)
+				return -1;
+		}
+		i += n;
+		dec->left -= n;
+		if (!dec->left && logdec_ws_frame_end(dec, out) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Decode sz octets of message body from buf.
+ * On success, *out is set to a newly allocated buffer containing *outsz
+ * octets of decoded data, or NULL if no decoded data is available yet.
+ * Returns -1 on out of memory condition, 0 on success.
+ */
+int
+logdec_decode(logdec_t *dec, const unsigned char *buf, size_t sz,
+              unsigned char **out, size_t *outsz)
+{
+	logdec_out_t o;
+	unsigned long long chunksz;
+	char *end;
+	size_t i, n;
+
+	memset(&o, 0, sizeof(o));
+	if (dec->flags & LOGDEC_WEBSOCKET) {
+		if (logdec_websocket(dec, buf, sz, &o) == -1)
+			goto errout;
+		goto out;
+	}
+	if (!(dec->flags & LOGDEC_CHUNKED) || dec->failed) {
+		if (logdec_inflate(dec, buf, sz, &o) == -1)
+			goto errout;
+		goto out;
+	}
+
+	for (i = 0; i < sz; ) {
+		switch (dec->state) {
+		case LOGDEC_CHUNK_SIZE:
+			if (!logdec_line(dec, buf[i++]))
+				break;
+			dec->line[dec->linelen] = '\0';
+			dec->linelen = 0;
+			chunksz = strtoull(dec->line, &end, 16);
+			if (end == dec->line) {
+				/* not chunked after all */
+				dec->failed = 1;
+				if (logdec_out_append(&o, buf + i, sz - i) == -1)
+					goto errout;
+				goto out;
+			}
+			dec->left = chunksz;
+			dec->state = chunksz ? LOGDEC_CHUNK_DATA
+			                     : LOGDEC_CHUNK_TRAILER;
+			break;
+		case LOGDEC_CHUNK_DATA:
+			n = sz - i;
+			if (n > dec->left)
+				n = dec->left;
+			if (logdec_inflate(dec, buf + i, n, &o) == -1)
+				goto errout;
+			i += n;
+			dec->left -= n;
+			if (!dec->left)
+				dec->state = LOGDEC_CHUNK_DATACRLF;
+			break;
+		case LOGDEC_CHUNK_DATACRLF:
+			if (buf[i++] == '\n')
+				dec->state = LOGDEC_CHUNK_SIZE;
+			break;
+		case LOGDEC_CHUNK_TRAILER:
+			if (!logdec_line(dec, buf[i++]))
+				break;
+			if (!dec->linelen)
+				dec->state = LOGDEC_CHUNK_DONE;
+			dec->linelen = 0;
+			break;
+		case LOGDEC_CHUNK_DONE:
+		default:
+			i = sz;
+			break;
+		}
+	}
+
+out:
+	if (!o.len && o.buf) {
+		free(o.buf);
+		o.buf = NULL;
+	}
+	*out = o.buf;
+	*outsz = o.len;
+	return 0;
+errout:
+	if (o.buf)
+		free(o.buf);
+	return -1;
+}
+
+/* vim: set noet ft=c: */
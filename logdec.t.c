@@ -0,0 +1,338 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "logdec.h"
+
+#include <string.h>
+#include <stdio.h>
+
+#include <zlib.h>
+
+#include <check.h>
+
+static const char plain[] =
+	"<html><body>Lorem ipsum dolor sit amet, lorem ipsum dolor sit amet."
+	"</body></html>\n";
+
+/*
+ * Compress plain into buf using gzip (wbits 31) or zlib (wbits 15) format.
+ */
+static size_t
+logdec_compress(unsigned char *buf, size_t sz, int wbits)
+{
+	z_stream zs;
+
+	memset(&zs, 0, sizeof(zs));
+	fail_unless(deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+	                         wbits, 8, Z_DEFAULT_STRATEGY) == Z_OK,
+	            "deflateInit2 failed");
+	zs.next_in = (Bytef *)plain;
+	zs.avail_in = sizeof(plain) - 1;
+	zs.next_out = buf;
+	zs.avail_out = sz;
+	fail_unless(deflate(&zs, Z_FINISH) == Z_STREAM_END, "deflate failed");
+	deflateEnd(&zs);
+	return sz - zs.avail_out;
+}
+
+/*
+ * Feed sz octets from buf to dec in pieces of at most step octets and
+ * accumulate the decoded output in out.
+ */
+static size_t
+logdec_feed(logdec_t *dec, const unsigned char *buf, size_t sz, size_t step,
+            unsigned char *out, size_t outsz)
+{
+	unsigned char *decbuf;
+	size_t decsz, len = 0, n;
+
+	while (sz > 0) {
+		n = sz < step ? sz : step;
+		fail_unless(logdec_decode(dec, buf, n, &decbuf, &decsz) == 0,
+		            "logdec_decode failed");
+		if (decsz > 0) {
+			fail_unless(len + decsz <= outsz, "output too long");
+			memcpy(out + len, decbuf, decsz);
+			len += decsz;
+			free(decbuf);
+		} else {
+			fail_unless(!decbuf, "empty buffer not NULL");
+		}
+		buf += n;
+		sz -= n;
+	}
+	return len;
+}
+
+START_TEST(logdec_decode_01)
+{
+	unsigned char z[512], out[512];
+	logdec_t *dec;
+	size_t zsz, sz;
+
+	zsz = logdec_compress(z, sizeof(z), 31);
+	dec = logdec_new(LOGDEC_INFLATE);
+	fail_unless(!!dec, "logdec_new failed");
+	sz = logdec_feed(dec, z, zsz, zsz, out, sizeof(out));
+	fail_unless(sz == sizeof(plain) - 1, "wrong length");
+	fail_unless(!memcmp(out, plain, sz), "wrong content");
+	logdec_free(dec);
+}
+END_TEST
+
+START_TEST(logdec_decode_02)
+{
+	unsigned char z[512], chunked[1024], out[512];
+	logdec_t *dec;
+	size_t zsz, csz, sz, half;
+
+	zsz = logdec_compress(z, sizeof(z), 15);
+	half = zsz / 2;
+	csz = snprintf((char *)chunked, sizeof(chunked), "%zx;ext=1\r\n", half);
+	memcpy(chunked + csz, z, half);
+	csz += half;
+	csz += snprintf((char *)chunked + csz, sizeof(chunked) - csz,
+	                "\r\n%zx\r\n", zsz - half);
+	memcpy(chunked + csz, z + half, zsz - half);
+	csz += zsz - half;
+	csz += snprintf((char *)chunked + csz, sizeof(chunked) - csz,
+	                "\r\n0\r\nX-Trailer: 1\r\n\r\n");
+
+	dec = logdec_new(LOGDEC_INFLATE|LOGDEC_CHUNKED);
+	fail_unless(!!dec, "logdec_new failed");
+	sz = logdec_feed(dec, chunked, csz, 1, out, sizeof(out));
+	fail_unless(sz == sizeof(plain) - 1, "wrong length");
+	fail_unless(!memcmp(out, plain, sz), "wrong content");
+	logdec_free(dec);
+}
+END_TEST
+
+START_TEST(logdec_decode_03)
+{
+	static const unsigned char garbage[] = "not compressed at all";
+	unsigned char out[512];
+	logdec_t *dec;
+	size_t sz;
+
+	dec = logdec_new(LOGDEC_INFLATE);
+	fail_unless(!!dec, "logdec_new failed");
+	sz = logdec_feed(dec, garbage, sizeof(garbage) - 1, 4,
+	                 out, sizeof(out));
+	fail_unless(sz == sizeof(garbage) - 1, "wrong length");
+	fail_unless(!memcmp(out, garbage, sz), "wrong content");
+	logdec_free(dec);
+}
+END_TEST
+
+/*
+ * Append a WebSocket frame with opcode and payload to buf at *len, masked
+ * if mask is set.
+ */
+static void
+logdec_ws_append(unsigned char *buf, size_t *len, unsigned int hdr0,
+                 const unsigned char *payload, size_t sz, int mask)
+{
+	static const unsigned char key[4] = {0x12, 0x34, 0x56, 0x78};
+	unsigned char *p = buf + *len;
+
+	*p++ = hdr0;
+	if (sz < 126) {
+		*p++ = (mask ? 0x80 : 0) | sz;
+	} else {
+		*p++ = (mask ? 0x80 : 0) | 126;
+		*p++ = sz >> 8;
+		*p++ = sz & 0xff;
+	}
+	if (mask) {
+		memcpy(p, key, 4);
+		p += 4;
+	}
+	for (size_t i = 0; i < sz; i++)
+		*p++ = payload[i] ^ (mask ? key[i & 3] : 0);
+	*len = p - buf;
+}
+
+START_TEST(logdec_decode_04)
+{
+	unsigned char ws[512], out[512];
+	logdec_t *dec;
+	size_t wssz = 0, half = 40, sz;
+
+	/* fragmented masked text message with a ping in between */
+	logdec_ws_append(ws, &wssz, 0x01, (const unsigned char *)plain,
+	                 half, 1);
+	logdec_ws_append(ws, &wssz, 0x89, (const unsigned char *)"ping", 4, 1);
+	logdec_ws_append(ws, &wssz, 0x80, (const unsigned char *)plain + half,
+	                 sizeof(plain) - 1 - half, 1);
+
+	dec = logdec_new(LOGDEC_WEBSOCKET);
+	fail_unless(!!dec, "logdec_new failed");
+	sz = logdec_feed(dec, ws, wssz, 1, out, sizeof(out));
+	fail_unless(sz == sizeof(plain) - 1, "wrong length");
+	fail_unless(!memcmp(out, plain, sz), "wrong content");
+	logdec_free(dec);
+}
+END_TEST
+
+START_TEST(logdec_decode_05)
+{
+	unsigned char z[512], ws[1024], out[1024];
+	logdec_t *dec;
+	z_stream zs;
+	size_t wssz = 0, zsz, sz;
+
+	/* two permessage-deflate messages sharing the compression context */
+	memset(&zs, 0, sizeof(zs));
+	fail_unless(deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+	                         -15, 8, Z_DEFAULT_STRATEGY) == Z_OK,
+	            "deflateInit2 failed");
+	for (int i = 0; i < 2; i++) {
+		zs.next_in = (Bytef *)plain;
+		zs.avail_in = sizeof(plain) - 1;
+		zs.next_out = z;
+		zs.avail_out = sizeof(z);
+		fail_unless(deflate(&zs, Z_SYNC_FLUSH) == Z_OK,
+		            "deflate failed");
+		zsz = sizeof(z) - zs.avail_out - 4;
+		logdec_ws_append(ws, &wssz, 0xc1, z, zsz, 0);
+	}
+	deflateEnd(&zs);
+
+	dec = logdec_new(LOGDEC_WEBSOCKET);
+	fail_unless(!!dec, "logdec_new failed");
+	sz = logdec_feed(dec, ws, wssz, 7, out, sizeof(out));
+	fail_unless(sz == 2 * (sizeof(plain) - 1), "wrong length");
+	fail_unless(!memcmp(out, plain, sizeof(plain) - 1) &&
+	            !memcmp(out + sizeof(plain) - 1, plain, sizeof(plain) - 1),
+	            "wrong content");
+	logdec_free(dec);
+}
+END_TEST
+
+/*
+ * Compress 20 MiB of zeros in gzip format, which inflates beyond the bounds
+ * of the decoder.  Returns the compressed data, sets *zsz to its size.
+ */
+#define LOGDEC_BOMBSZ   (20 * 1024 * 1024)
+#define LOGDEC_MAXCALL  (16 * 1024 * 1024)
+static unsigned char *
+logdec_bomb(size_t *zsz)
+{
+	unsigned char *zeros, *z;
+	z_stream zs;
+
+	zeros = calloc(1, LOGDEC_BOMBSZ);
+	z = malloc(LOGDEC_BOMBSZ / 64);
+	fail_unless(zeros && z, "out of memory");
+	memset(&zs, 0, sizeof(zs));
+	fail_unless(deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED,
+	                         31, 8, Z_DEFAULT_STRATEGY) == Z_OK,
+	            "deflateInit2 failed");
+	zs.next_in = zeros;
+	zs.avail_in = LOGDEC_BOMBSZ;
+	zs.next_out = z;
+	zs.avail_out = LOGDEC_BOMBSZ / 64;
+	fail_unless(deflate(&zs, Z_FINISH) == Z_STREAM_END, "deflate failed");
+	deflateEnd(&zs);
+	free(zeros);
+	*zsz = LOGDEC_BOMBSZ / 64 - zs.avail_out;
+	return z;
+}
+
+START_TEST(logdec_decode_06)
+{
+	unsigned char *z, *decbuf;
+	logdec_t *dec;
+	size_t zsz, decsz;
+
+	/* output of a single call is bounded */
+	z = logdec_bomb(&zsz);
+	dec = logdec_new(LOGDEC_INFLATE);
+	fail_unless(!!dec, "logdec_new failed");
+	fail_unless(logdec_decode(dec, z, zsz, &decbuf, &decsz) == 0,
+	            "logdec_decode failed");
+	fail_unless(decsz >= LOGDEC_MAXCALL && decsz < LOGDEC_MAXCALL + zsz,
+	            "output not bounded");
+	free(decbuf);
+	/* the rest of the body is passed through undecoded */
+	fail_unless(logdec_decode(dec, z, 16, &decbuf, &decsz) == 0,
+	            "logdec_decode failed");
+	fail_unless(decsz == 16 && !memcmp(decbuf, z, 16), "not raw");
+	free(decbuf);
+	logdec_free(dec);
+	free(z);
+}
+END_TEST
+
+START_TEST(logdec_decode_07)
+{
+	unsigned char *z, *decbuf;
+	logdec_t *dec;
+	size_t zsz, decsz, len = 0;
+
+	/* expansion ratio of the body is bounded across calls */
+	z = logdec_bomb(&zsz);
+	dec = logdec_new(LOGDEC_INFLATE);
+	fail_unless(!!dec, "logdec_new failed");
+	for (size_t off = 0; off < zsz; off += 256) {
+		fail_unless(logdec_decode(dec, z + off,
+		                          zsz - off < 256 ? zsz - off : 256,
+		                          &decbuf, &decsz) == 0,
+		            "logdec_decode failed");
+		free(decbuf);
+		len += decsz;
+	}
+	fail_unless(len > LOGDEC_MAXCALL && len < LOGDEC_BOMBSZ,
+	            "output not bounded");
+	logdec_free(dec);
+	free(z);
+}
+END_TEST
+
+Suite *
+logdec_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("logdec");
+
+	tc = tcase_create("logdec_decode");
+	tcase_add_test(tc, logdec_decode_01);
+	tcase_add_test(tc, logdec_decode_02);
+	tcase_add_test(tc, logdec_decode_03);
+	tcase_add_test(tc, logdec_decode_04);
+	tcase_add_test(tc, logdec_decode_05);
+	tcase_add_test(tc, logdec_decode_06);
+	tcase_add_test(tc, logdec_decode_07);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
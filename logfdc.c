@@ -0,0 +1,172 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "logfdc.h"
+#include "log.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+/*
+ * File descriptor cache for per-connection log files.
+ *
+ * With per-connection content and pcap logs, every connection would keep its
+ * log file open for its whole lifetime, tying the number of open files to the
+ * number of concurrent connections.  Instead, each writer thread keeps at
+ * most a configured number of log files open.  When the limit is exceeded,
+ * the least recently written file is closed, finishing its compressed member
+ * first, and reopened for appending on its next write.
+ *
+ * A logfdc_t is used exclusively by the writer thread owning it.
+ */
+
+static void
+logfdc_unlink(logfdc_t *c, logfdc_ent_t *ent)
+{
+	if (ent->prev)
+		ent->prev->next = ent->next;
+	else
+		c->head = ent->next;
+	if (ent->next)
+		ent->next->prev = ent->prev;
+	else
+		c->tail = ent->prev;
+	ent->prev = ent->next = NULL;
+	c->n--;
+}
+
+static void
+logfdc_link(logfdc_t *c, logfdc_ent_t *ent)
+{
+	ent->prev = NULL;
+	ent->next = c->head;
+	if (c->head)
+		c->head->prev = ent;
+	else
+		c->tail = ent;
+	c->head = ent;
+	c->n++;
+}
+
+/*
+ * Close least recently written files until the limit is met.  Data pending
+ * in compressed streams is finished before closing.
+ */
+static void
+logfdc_evict(logfdc_t *c)
+{
+	logfdc_ent_t *ent;
+
+	if (!c->max)
+		return;
+	while (c->n > c->max) {
+		ent = c->tail;
+		logfdc_unlink(c, ent);
+		if (*ent->z && logz_finish(*ent->z) == -1) {
+			log_err_rl_printf("Failed to finish compressed log "
+			                  "file '%s': %s (%i)\n", ent->fn,
+			                  strerror(errno), errno);
+		}
+		close(*ent->fd);
+		*ent->fd = -1;
+	}
+}
+
+void
+logfdc_init(logfdc_t *c, size_t max, logfdc_open_func_t openfn)
+{
+	c->head = c->tail = NULL;
+	c->n = 0;
+	c->max = max;
+	c->openfn = openfn;
+}
+
+/*
+ * Add a newly opened log file with fd *fd, compressed stream *z, which may
+ * be NULL, and file name fn to the cache, possibly closing other files.
+ * Does nothing if *fd is -1.
+ */
+void
+logfdc_add(logfdc_t *c, logfdc_ent_t *ent, int *fd, logz_t **z,
+           const char *fn)
+{
+	ent->fd = fd;
+	ent->z = z;
+	ent->fn = fn;
+	ent->prev = ent->next = NULL;
+	if (*fd == -1)
+		return;
+	logfdc_link(c, ent);
+	logfdc_evict(c);
+}
+
+/*
+ * Mark the log file as most recently written, reopening it at its end if it
+ * has been closed.  Returns 0 if *ent->fd is open, -1 on errors.
+ */
+int
+logfdc_use(logfdc_t *c, logfdc_ent_t *ent)
+{
+	int fd;
+
+	if (*ent->fd == -1) {
+		if ((fd = c->openfn(ent->fn)) == -1)
+			return -1;
+		if (lseek(fd, 0, SEEK_END) == -1) {
+			int e = errno;
+			close(fd);
+			errno = e;
+			return -1;
+		}
+		*ent->fd = fd;
+		if (*ent->z)
+			logz_setfd(*ent->z, fd);
+		logfdc_link(c, ent);
+		logfdc_evict(c);
+		return 0;
+	}
+	if (c->head != ent) {
+		logfdc_unlink(c, ent);
+		logfdc_link(c, ent);
+	}
+	return 0;
+}
+
+/*
+ * Remove the log file from the cache before closing it.  Does not close the
+ * fd, which is -1 if the file has been closed by the cache.
+ */
+void
+logfdc_remove(logfdc_t *c, logfdc_ent_t *ent)
+{
+	if (ent->fd && *ent->fd != -1)
+		logfdc_unlink(c, ent);
+}
+
+/* vim: set noet ft=c: */
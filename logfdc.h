@@ -0,0 +1,72 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LOGFDC_H
+#define LOGFDC_H
+
+#include "attrib.h"
+#include "logz.h"
+
+#include <stddef.h>
+
+typedef int (*logfdc_open_func_t)(const char *);
+
+/*
+ * Per-connection log file in a logfdc_t.  The fd and the compressed stream
+ * writing to it, if any, are owned by the log file context; the entry points
+ * to them.  An entry is linked into the cache while its fd is open.
+ */
+typedef struct logfdc_ent {
+	int *fd;
+	logz_t **z;
+	const char *fn;
+	struct logfdc_ent *prev;
+	struct logfdc_ent *next;
+} logfdc_ent_t;
+
+/*
+ * Bounded set of open per-connection log files of a writer thread, from most
+ * to least recently written.  A limit of 0 means unbounded.
+ */
+typedef struct logfdc {
+	logfdc_ent_t *head;
+	logfdc_ent_t *tail;
+	size_t n;
+	size_t max;
+	logfdc_open_func_t openfn;
+} logfdc_t;
+
+void logfdc_init(logfdc_t *, size_t, logfdc_open_func_t) NONNULL(1,3);
+void logfdc_add(logfdc_t *, logfdc_ent_t *, int *, logz_t **, const char *)
+     NONNULL(1,2,3,4,5);
+int logfdc_use(logfdc_t *, logfdc_ent_t *) NONNULL(1,2) WUNRES;
+void logfdc_remove(logfdc_t *, logfdc_ent_t *) NONNULL(1,2);
+
+#endif /* !LOGFDC_H */
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,215 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "logfdc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <check.h>
+
+#define NFILES 3
+
+static char template[] = "/tmp/sslsplit.test.XXXXXX";
+static char *fn[NFILES];
+static int fd[NFILES];
+static logz_t *z[NFILES];
+static logfdc_ent_t ent[NFILES];
+static int opens;
+
+static void
+logfdc_setup(void)
+{
+	for (int i = 0; i < NFILES; i++) {
+		fn[i] = strdup(template);
+		fd[i] = mkstemp(fn[i]);
+		if (fd[i] == -1) {
+			perror("mkstemp");
+			exit(EXIT_FAILURE);
+		}
+		z[i] = NULL;
+	}
+	opens = 0;
+}
+
+static void
+logfdc_teardown(void)
+{
+	for (int i = 0; i < NFILES; i++) {
+		if (fd[i] != -1)
+			close(fd[i]);
+		unlink(fn[i]);
+		free(fn[i]);
+	}
+}
+
+static int
+logfdc_t_open(const char *path)
+{
+	opens++;
+	return open(path, O_RDWR);
+}
+
+static off_t
+logfdc_t_size(int i)
+{
+	int tmpfd;
+	off_t sz;
+
+	tmpfd = open(fn[i], O_RDONLY);
+	if (tmpfd == -1)
+		return -1;
+	sz = lseek(tmpfd, 0, SEEK_END);
+	close(tmpfd);
+	return sz;
+}
+
+START_TEST(logfdc_01)
+{
+	logfdc_t c;
+
+	logfdc_init(&c, 2, logfdc_t_open);
+	for (int i = 0; i < NFILES; i++)
+		logfdc_add(&c, &ent[i], &fd[i], &z[i], fn[i]);
+	fail_unless(c.n == 2, "wrong number of open files");
+	fail_unless(fd[0] == -1, "least recently added file not closed");
+	fail_unless(fd[1] != -1 && fd[2] != -1, "recent files closed");
+
+	fail_unless(logfdc_use(&c, &ent[1]) == 0, "use failed");
+	fail_unless(opens == 0, "open file reopened");
+	fail_unless(logfdc_use(&c, &ent[0]) == 0, "reopen failed");
+	fail_unless(opens == 1, "closed file not reopened");
+	fail_unless(fd[0] != -1, "reopened file not open");
+	fail_unless(fd[2] == -1, "least recently used file not closed");
+	fail_unless(fd[1] != -1, "recently used file closed");
+	fail_unless(c.n == 2, "wrong number of open files");
+
+	for (int i = 0; i < NFILES; i++)
+		logfdc_remove(&c, &ent[i]);
+	fail_unless(c.n == 0 && !c.head && !c.tail, "cache not empty");
+}
+END_TEST
+
+START_TEST(logfdc_02)
+{
+	logfdc_t c;
+
+	logfdc_init(&c, 1, logfdc_t_open);
+	logfdc_add(&c, &ent[0], &fd[0], &z[0], fn[0]);
+	fail_unless(write(fd[0], "foo", 3) == 3, "write failed");
+	logfdc_add(&c, &ent[1], &fd[1], &z[1], fn[1]);
+	fail_unless(fd[0] == -1, "file not closed");
+
+	fail_unless(logfdc_use(&c, &ent[0]) == 0, "reopen failed");
+	fail_unless(write(fd[0], "bar", 3) == 3, "write failed");
+	fail_unless(logfdc_t_size(0) == 6, "reopened file not appended to");
+	logfdc_remove(&c, &ent[0]);
+	logfdc_remove(&c, &ent[1]);
+}
+END_TEST
+
+START_TEST(logfdc_03)
+{
+	logfdc_t c;
+
+	logfdc_init(&c, 1, logfdc_t_open);
+	z[0] = logz_new(fd[0], NULL);
+	fail_unless(!!z[0], "logz_new failed");
+	logfdc_add(&c, &ent[0], &fd[0], &z[0], fn[0]);
+	fail_unless(logz_write(z[0], "foo", 3) == 3, "write failed");
+	fail_unless(logfdc_t_size(0) == 0, "data written before evict");
+	logfdc_add(&c, &ent[1], &fd[1], &z[1], fn[1]);
+	fail_unless(fd[0] == -1, "file not closed");
+	fail_unless(logfdc_t_size(0) > 0, "pending member not finished");
+
+	fail_unless(logfdc_use(&c, &ent[0]) == 0, "reopen failed");
+	fail_unless(logz_write(z[0], "bar", 3) == 3, "write failed");
+	logfdc_remove(&c, &ent[0]);
+	logz_free(z[0]);
+	fail_unless(logfdc_t_size(0) > 20, "second member not written");
+	logfdc_remove(&c, &ent[1]);
+}
+END_TEST
+
+START_TEST(logfdc_04)
+{
+	logfdc_t c;
+
+	logfdc_init(&c, 0, logfdc_t_open);
+	for (int i = 0; i < NFILES; i++)
+		logfdc_add(&c, &ent[i], &fd[i], &z[i], fn[i]);
+	fail_unless(c.n == NFILES, "unbounded cache closed files");
+	for (int i = 0; i < NFILES; i++)
+		fail_unless(fd[i] != -1, "unbounded cache closed file");
+	for (int i = 0; i < NFILES; i++)
+		logfdc_remove(&c, &ent[i]);
+	fail_unless(c.n == 0, "cache not empty");
+}
+END_TEST
+
+START_TEST(logfdc_05)
+{
+	logfdc_t c;
+
+	logfdc_init(&c, 1, logfdc_t_open);
+	logfdc_add(&c, &ent[0], &fd[0], &z[0], fn[0]);
+	logfdc_add(&c, &ent[1], &fd[1], &z[1], fn[1]);
+	unlink(fn[0]);
+	fail_unless(logfdc_use(&c, &ent[0]) == -1, "reopen did not fail");
+	fail_unless(fd[0] == -1, "fd set on failure");
+	fail_unless(fd[1] != -1, "file closed on failure");
+	logfdc_remove(&c, &ent[0]);
+	logfdc_remove(&c, &ent[1]);
+	fail_unless(c.n == 0, "cache not empty");
+}
+END_TEST
+
+Suite *
+logfdc_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("logfdc");
+
+	tc = tcase_create("logfdc");
+	tcase_add_checked_fixture(tc, logfdc_setup, logfdc_teardown);
+	tcase_add_test(tc, logfdc_01);
+	tcase_add_test(tc, logfdc_02);
+	tcase_add_test(tc, logfdc_03);
+	tcase_add_test(tc, logfdc_04);
+	tcase_add_test(tc, logfdc_05);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
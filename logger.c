@@ -30,6 +30,7 @@
 
 #include "thrqueue.h"
 #include "logbuf.h"
+#include "usdt.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -39,10 +40,39 @@
 /*
  * Logger for multithreaded environments.  Disk writes are executed in a
  * writer thread.  Logging threads submit buffers to be logged by adding
- * them to the thrqueue.  Logging threads may block on the pthread mutex
- * of the thrqueue, but not on disk writes.
+ * them to the thrqueue.  Logging threads do not block on disk writes.
+ *
+ * If the queue is full because the writer thread cannot keep up, the
+ * overflow policy of the logger determines what happens: the logging thread
+ * blocks until there is room in the queue (LOGGER_OVERFLOW_BLOCK), the
+ * buffer is dropped (LOGGER_OVERFLOW_DROPNEWEST), the writer thread drops
+ * queued buffers until the queue is half empty (LOGGER_OVERFLOW_DROPOLDEST),
+ * or the buffer is appended to an unlinked overflow file, from which the
+ * writer thread reads it back once the queue is empty
+ * (LOGGER_OVERFLOW_SPILL).  While the overflow file is in use, all buffers
+ * go through it, such that ordering is preserved.  Open, close and reopen
+ * events are never dropped.
+ *
+ * In addition to the item count bound of the queue, the octets of log data
+ * held in the queue are accounted for.  The logger does not act on its
+ * memory budget itself; logging threads query logger_over_budget() and
+ * throttle their data sources while it is exceeded.
+ *
+ * Loggers with a writev callback have consecutive queued log buffers for
+ * the same file handle written in batches of up to LOGGER_IOV_MAX segments,
+ * in order to reduce the number of system calls under load.
+ *
+ * Loggers with a flush callback call it before taking each log buffer off
+ * the queue and when the time it returned has passed, also while idle, so
+ * that data buffered by the write callbacks reaches the file in bounded time.
+ *
+ * Once logger_discard() was called, the writer thread drops all log buffers
+ * except for open, close and reopen events, such that stopping the logger
+ * takes bounded time even with a long queue.
  */
 
+#define LOGGER_IOV_MAX 64
+
 struct logger {
 	pthread_t thr;
 	logger_reopen_func_t reopen;
@@ -50,14 +80,47 @@ struct logger {
 	logger_close_func_t close;
 	logger_prep_func_t prep;
 	logger_write_func_t write;
+	logger_writev_func_t writev;
 	logger_except_func_t except;
+	logger_flush_func_t flush;
+	void *flusharg;
 	thrqueue_t *queue;
+	int overflow;
+	int shedding;   /* only used by the writer thread */
+	int discard;    /* modified using atomic operations */
+	/* overflow file; spillrd is only used by the writer thread,
+	 * spillwr and spilling are protected by spillmutex */
+	int spillfd;
+	pthread_mutex_t spillmutex;
+	off_t spillrd;
+	off_t spillwr;
+	int spilling;
+	/* octets of log data in queue, modified using atomic operations */
+	size_t membudget;
+	size_t memused;
+	/* statistics, only modified using atomic operations */
+	unsigned long long dropped_bufs;
+	unsigned long long dropped_bytes;
+	unsigned long long spilled_bufs;
+	unsigned long long spilled_bytes;
 };
 
+/*
+ * Header of a log buffer in the overflow file, followed by sz octets.
+ */
+typedef struct logger_spillhdr {
+	void *fh;
+	unsigned long ctl;
+	size_t sz;
+} logger_spillhdr_t;
+
+#define LBFLAG_CONTROL (LBFLAG_REOPEN|LBFLAG_OPEN|LBFLAG_CLOSE)
+
 static void
 logger_clear(logger_t *logger)
 {
 	memset(logger, 0, sizeof(logger_t));
+	logger->spillfd = -1;
 }
 
 /*
@@ -105,9 +168,467 @@ logger_free(logger_t *logger) {
 	if (logger->queue) {
 		thrqueue_free(logger->queue);
 	}
+	if (logger->spillfd != -1) {
+		close(logger->spillfd);
+		pthread_mutex_destroy(&logger->spillmutex);
+	}
 	free(logger);
 }
 
+/*
+ * Set the overflow policy of logger.  For LOGGER_OVERFLOW_SPILL, an
+ * overflow file is created in spilldir and unlinked immediately.  Must be
+ * called before logger_start().
+ * Returns 0 on success, -1 on failure.
+ */
+int
+logger_set_overflow(logger_t *logger, int policy, const char *spilldir)
+{
+	char *fn;
+
+	if (policy == LOGGER_OVERFLOW_SPILL && logger->spillfd == -1) {
+		if (asprintf(&fn, "%s/sslsplit-spill.XXXXXX", spilldir) < 0)
+			return -1;
+		logger->spillfd = mkstemp(fn);
+		if (logger->spillfd == -1) {
+			free(fn);
+			return -1;
+		}
+		unlink(fn);
+		free(fn);
+		if (pthread_mutex_init(&logger->spillmutex, NULL)) {
+			close(logger->spillfd);
+			logger->spillfd = -1;
+			return -1;
+		}
+	}
+	logger->overflow = policy;
+	return 0;
+}
+
+/*
+ * Set a vectored write callback for writing batches of log buffers.  The
+ * callback is passed the segments of one or more consecutive log buffers
+ * with the same file handle and ctl, and must write all of them.  Must be
+ * called before logger_start().
+ */
+void
+logger_set_writev(logger_t *logger, logger_writev_func_t writevfunc)
+{
+	logger->writev = writevfunc;
+}
+
+/*
+ * Set a flush callback, which is passed arg and a force flag, writes out
+ * buffered data that is due and returns the number of milliseconds until
+ * more buffered data is due, or -1 if there is none.  The force flag is set
+ * when the writer thread terminates.  Must be called before logger_start().
+ */
+void
+logger_set_flush(logger_t *logger, logger_flush_func_t flushfunc, void *arg)
+{
+	logger->flush = flushfunc;
+	logger->flusharg = arg;
+}
+
+/*
+ * Set the memory budget of logger in octets of queued log data; 0 means
+ * unlimited.
+ */
+void
+logger_set_membudget(logger_t *logger, size_t membudget)
+{
+	logger->membudget = membudget;
+}
+
+/*
+ * Returns 1 if the log data queued exceeds the memory budget of logger,
+ * 0 otherwise.  May be called from any thread.
+ */
+int
+logger_over_budget(logger_t *logger)
+{
+	return logger->membudget &&
+	       __atomic_load_n(&logger->memused, __ATOMIC_RELAXED) >
+	       logger->membudget;
+}
+
+/*
+ * Fill in a snapshot of the statistics of logger.
+ */
+void
+logger_stats(logger_t *logger, logger_stats_t *stats)
+{
+	memset(stats, 0, sizeof(logger_stats_t));
+	if (logger->queue) {
+		stats->depth = thrqueue_depth(logger->queue);
+		stats->size = thrqueue_size(logger->queue);
+	}
+	stats->bytes = __atomic_load_n(&logger->memused, __ATOMIC_RELAXED);
+	stats->budget = logger->membudget;
+	stats->dropped_bufs = __atomic_load_n(&logger->dropped_bufs,
+	                                      __ATOMIC_RELAXED);
+	stats->dropped_bytes = __atomic_load_n(&logger->dropped_bytes,
+	                                       __ATOMIC_RELAXED);
+	stats->spilled_bufs = __atomic_load_n(&logger->spilled_bufs,
+	                                      __ATOMIC_RELAXED);
+	stats->spilled_bytes = __atomic_load_n(&logger->spilled_bytes,
+	                                       __ATOMIC_RELAXED);
+	if (logger->spillfd != -1) {
+		pthread_mutex_lock(&logger->spillmutex);
+		stats->spill_pending = logger->spillwr -
+		                       __atomic_load_n(&logger->spillrd,
+		                                       __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&logger->spillmutex);
+	}
+}
+
+/*
+ * Drop a log buffer and account for it.
+ */
+static void
+logger_drop(logger_t *logger, logbuf_t *lb)
+{
+	__atomic_add_fetch(&logger->dropped_bufs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&logger->dropped_bytes, logbuf_size(lb),
+	                   __ATOMIC_RELAXED);
+	logbuf_free(lb);
+}
+
+/*
+ * Append log buffer lb to the overflow file.  Unless force is set, only
+ * does so if the overflow file is currently in use.
+ * Returns 1 if the overflow file is not in use and lb was not consumed,
+ * 0 if lb was appended or dropped.
+ */
+static int
+logger_spill(logger_t *logger, logbuf_t *lb, int force)
+{
+	logger_spillhdr_t hdr;
+	logbuf_t *next;
+	unsigned char *buf;
+	ssize_t n;
+	off_t off;
+
+	pthread_mutex_lock(&logger->spillmutex);
+	if (!force && !logger->spilling) {
+		pthread_mutex_unlock(&logger->spillmutex);
+		return 1;
+	}
+	off = logger->spillwr;
+	for (next = lb; next; next = next->next) {
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.fh = lb->fh;
+		hdr.ctl = next->ctl;
+		hdr.sz = (next->buf || next->evbuf) ? next->sz : 0;
+		if (pwrite(logger->spillfd, &hdr, sizeof(hdr), off) !=
+		    (ssize_t)sizeof(hdr))
+			goto drop;
+		off += sizeof(hdr);
+		if (hdr.sz == 0)
+			continue;
+		if (next->evbuf) {
+			if (!(buf = malloc(hdr.sz)))
+				goto drop;
+			logbuf_copyout(next, buf);
+			n = pwrite(logger->spillfd, buf, hdr.sz, off);
+			free(buf);
+		} else {
+			n = pwrite(logger->spillfd, next->buf, hdr.sz, off);
+		}
+		if (n != (ssize_t)hdr.sz)
+			goto drop;
+		off += hdr.sz;
+	}
+	logger->spillwr = off;
+	__atomic_store_n(&logger->spilling, 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&logger->spilled_bufs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&logger->spilled_bytes, logbuf_size(lb),
+	                   __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&logger->spillmutex);
+	logbuf_free(lb);
+	return 0;
+
+drop:
+	/* overflow file not writable; data appended beyond spillwr is
+	 * overwritten by the next attempt */
+	pthread_mutex_unlock(&logger->spillmutex);
+	logger_drop(logger, lb);
+	return 0;
+}
+
+/*
+ * Read the next log buffer from the overflow file.  Only called from the
+ * writer thread.  Returns NULL and stops using the overflow file if there
+ * are no more log buffers in it.
+ */
+static logbuf_t *
+logger_unspill(logger_t *logger)
+{
+	logger_spillhdr_t hdr;
+	unsigned char *buf = NULL;
+	logbuf_t *lb;
+	off_t rd, wr;
+
+	pthread_mutex_lock(&logger->spillmutex);
+	rd = logger->spillrd;
+	wr = logger->spillwr;
+	if (rd == wr) {
+		if (logger->spilling) {
+			__atomic_store_n(&logger->spilling, 0,
+			                 __ATOMIC_RELEASE);
+			__atomic_store_n(&logger->spillrd, 0,
+			                 __ATOMIC_RELAXED);
+			logger->spillwr = 0;
+			if (ftruncate(logger->spillfd, 0) == -1) {
+				/* reused from the start regardless */
+			}
+		}
+		pthread_mutex_unlock(&logger->spillmutex);
+		return NULL;
+	}
+	pthread_mutex_unlock(&logger->spillmutex);
+
+	/* octets before spillwr are not modified by producers */
+	if (pread(logger->spillfd, &hdr, sizeof(hdr), rd) !=
+	    (ssize_t)sizeof(hdr))
+		goto errout;
+	rd += sizeof(hdr);
+	if (hdr.sz > 0) {
+		if (!(buf = malloc(hdr.sz)))
+			goto errout;
+		if (pread(logger->spillfd, buf, hdr.sz, rd) != (ssize_t)hdr.sz)
+			goto errout;
+		rd += hdr.sz;
+	}
+	__atomic_store_n(&logger->spillrd, rd, __ATOMIC_RELAXED);
+	if (!(lb = logbuf_new(buf, hdr.sz, NULL)))
+		return NULL;
+	lb->fh = hdr.fh;
+	lb->ctl = hdr.ctl;
+	return lb;
+
+errout:
+	/* skip the unreadable remainder of the overflow file */
+	if (buf)
+		free(buf);
+	pthread_mutex_lock(&logger->spillmutex);
+	__atomic_add_fetch(&logger->dropped_bytes,
+	                   logger->spillwr - logger->spillrd,
+	                   __ATOMIC_RELAXED);
+	__atomic_store_n(&logger->spillrd, logger->spillwr, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&logger->spillmutex);
+	return NULL;
+}
+
+/*
+ * Add a log buffer to the queue according to the overflow policy.
+ * Buffer guaranteed to be freed after logging completes or on failure.
+ * Returns -1 on error, 0 on success, including dropped buffers.
+ */
+static int
+logger_enqueue(logger_t *logger, logbuf_t *lb)
+{
+	size_t sz;
+
+	if (logger->overflow == LOGGER_OVERFLOW_SPILL &&
+	    __atomic_load_n(&logger->spilling, __ATOMIC_ACQUIRE)) {
+		if (logger_spill(logger, lb, 0) == 0)
+			return 0;
+	}
+	/* account before enqueueing, lb may be freed right after */
+	sz = logbuf_size(lb);
+	USDT_PROBE3(log__enqueue, logger, lb, sz);
+	__atomic_add_fetch(&logger->memused, sz, __ATOMIC_RELAXED);
+	if (thrqueue_enqueue_nb(logger->queue, lb))
+		return 0;
+	__atomic_sub_fetch(&logger->memused, sz, __ATOMIC_RELAXED);
+	switch (logger->overflow) {
+	case LOGGER_OVERFLOW_SPILL:
+		return logger_spill(logger, lb, 1);
+	case LOGGER_OVERFLOW_DROPNEWEST:
+	case LOGGER_OVERFLOW_DROPOLDEST:
+		if (!logbuf_ctl_isset(lb, LBFLAG_CONTROL)) {
+			logger_drop(logger, lb);
+			return 0;
+		}
+		/* control events are never dropped */
+		/* FALLTHROUGH */
+	case LOGGER_OVERFLOW_BLOCK:
+	default:
+		__atomic_add_fetch(&logger->memused, sz, __ATOMIC_RELAXED);
+		if (thrqueue_enqueue(logger->queue, lb))
+			return 0;
+		__atomic_sub_fetch(&logger->memused, sz, __ATOMIC_RELAXED);
+		logbuf_free(lb);
+		return -1;
+	}
+}
+
+/*
+ * Account for a log buffer taken off the queue.
+ */
+static logbuf_t *
+logger_dequeued(logger_t *logger, logbuf_t *lb)
+{
+	if (lb) {
+		__atomic_sub_fetch(&logger->memused, logbuf_size(lb),
+		                   __ATOMIC_RELAXED);
+		USDT_PROBE2(log__dequeue, logger, lb);
+	}
+	return lb;
+}
+
+/*
+ * Get the next log buffer to write, from the queue or the overflow file.
+ * Returns NULL if no log buffer is available right now.
+ */
+static logbuf_t *
+logger_dequeue_nb(logger_t *logger)
+{
+	logbuf_t *lb;
+
+	/* queued buffers are older than those in the overflow file, and
+	 * producers only start spilling while the queue is full, so the
+	 * writer never sleeps on pending spilled data */
+	if ((lb = thrqueue_dequeue_nb(logger->queue)))
+		return logger_dequeued(logger, lb);
+	if (logger->overflow == LOGGER_OVERFLOW_SPILL)
+		return logger_unspill(logger);
+	return NULL;
+}
+
+/*
+ * Get the next log buffer to write, from the queue or the overflow file.
+ * Blocks until a log buffer is available.
+ */
+static logbuf_t *
+logger_dequeue(logger_t *logger)
+{
+	logbuf_t *lb;
+
+	if ((lb = logger_dequeue_nb(logger)))
+		return lb;
+	return logger_dequeued(logger, thrqueue_dequeue(logger->queue));
+}
+
+/*
+ * Get the next log buffer to write, calling the flush callback while waiting
+ * for it if the logger has one.  Blocks until a log buffer is available.
+ */
+static logbuf_t *
+logger_dequeue_flush(logger_t *logger)
+{
+	logbuf_t *lb;
+	int ms, timedout;
+
+	if (!logger->flush)
+		return logger_dequeue(logger);
+	for (;;) {
+		ms = logger->flush(logger->flusharg, 0);
+		if ((lb = logger_dequeue_nb(logger)))
+			return lb;
+		if (ms < 0)
+			return logger_dequeue(logger);
+		timedout = 0;
+		lb = thrqueue_dequeue_timed(logger->queue, ms, &timedout);
+		if (lb || !timedout)
+			return logger_dequeued(logger, lb);
+	}
+}
+
+/*
+ * Drop dequeued log buffers after logger_discard(), and with
+ * LOGGER_OVERFLOW_DROPOLDEST while the queue is between 3/4 full and half
+ * empty.
+ * Returns 1 if lb was dropped, 0 otherwise.
+ */
+static int
+logger_shed(logger_t *logger, logbuf_t *lb)
+{
+	size_t depth, size;
+
+	if (__atomic_load_n(&logger->discard, __ATOMIC_RELAXED) &&
+	    !logbuf_ctl_isset(lb, LBFLAG_CONTROL)) {
+		logger_drop(logger, lb);
+		return 1;
+	}
+	if (logger->overflow != LOGGER_OVERFLOW_DROPOLDEST)
+		return 0;
+	depth = thrqueue_depth(logger->queue);
+	size = thrqueue_size(logger->queue);
+	if (depth >= size - size / 4)
+		logger->shedding = 1;
+	else if (depth <= size / 2)
+		logger->shedding = 0;
+	if (!logger->shedding || logbuf_ctl_isset(lb, LBFLAG_CONTROL))
+		return 0;
+	logger_drop(logger, lb);
+	return 1;
+}
+
+/*
+ * Returns the number of segments of lb if it can be written as part of a
+ * batch, 0 otherwise.
+ */
+static int
+logger_batchable(logbuf_t *lb)
+{
+	int n = 0;
+
+	if (logbuf_ctl_isset(lb, LBFLAG_CONTROL))
+		return 0;
+	for (; lb; lb = lb->next) {
+		if (lb->evbuf)
+			return 0;
+		n++;
+	}
+	return n <= LOGGER_IOV_MAX ? n : 0;
+}
+
+/*
+ * Write lb together with as many of the following queued log buffers for
+ * the same file handle as are available and fit into one batch, using the
+ * writev callback.  Frees all written log buffers.  *pending is set to the
+ * first dequeued log buffer that did not fit into the batch, if any.
+ * Returns -1 on errors, the number of octets written otherwise.
+ */
+static ssize_t
+logger_write_batch(logger_t *logger, logbuf_t *lb, logbuf_t **pending)
+{
+	struct iovec iov[LOGGER_IOV_MAX];
+	logbuf_t *batch[LOGGER_IOV_MAX];
+	logbuf_t *next, *seg;
+	int nbatch = 0, niov = 0, n;
+	ssize_t rv;
+
+	*pending = NULL;
+	next = lb;
+	do {
+		n = logger_batchable(next);
+		if (nbatch > 0 && (!n || niov + n > LOGGER_IOV_MAX ||
+		                   next->fh != lb->fh ||
+		                   next->ctl != lb->ctl)) {
+			*pending = next;
+			break;
+		}
+		for (seg = next; seg; seg = seg->next) {
+			iov[niov].iov_base = seg->buf;
+			iov[niov].iov_len = seg->sz;
+			niov++;
+		}
+		batch[nbatch++] = next;
+		do {
+			next = logger_dequeue_nb(logger);
+		} while (next && logger_shed(logger, next));
+	} while (next);
+
+	rv = logger->writev(lb->fh, lb->ctl, iov, niov);
+	for (int i = 0; i < nbatch; i++)
+		logbuf_free(batch[i]);
+	return rv;
+}
+
 /*
  * Submit a buffer to be logged by the logger thread.
  * Calls the prep callback from within the calling tread before submission.
@@ -129,12 +650,7 @@ logger_submit(logger_t *logger, void *fh, unsigned long prepflags,
 	 * with an actual log buffer, stop here. */
 	if (!lb)
 		return 0;
-	if (thrqueue_enqueue(logger->queue, lb)) {
-		return 0;
-	} else {
-		logbuf_free(lb);
-		return -1;
-	}
+	return logger_enqueue(logger, lb);
 }
 
 /*
@@ -151,7 +667,7 @@ logger_reopen(logger_t *logger)
 	if (!(lb = logbuf_new(NULL, 0, NULL)))
 		return -1;
 	logbuf_ctl_set(lb, LBFLAG_REOPEN);
-	return thrqueue_enqueue(logger->queue, lb) ? 0 : -1;
+	return logger_enqueue(logger, lb);
 }
 
 /*
@@ -172,7 +688,7 @@ logger_open(logger_t *logger, void *fh)
 		return -1;
 	lb->fh = fh;
 	logbuf_ctl_set(lb, LBFLAG_OPEN);
-	return thrqueue_enqueue(logger->queue, lb) ? 0 : -1;
+	return logger_enqueue(logger, lb);
 }
 
 /*
@@ -193,7 +709,7 @@ logger_close(logger_t *logger, void *fh, unsigned long ctl)
 	lb->fh = fh;
 	lb->ctl = ctl;
 	logbuf_ctl_set(lb, LBFLAG_CLOSE);
-	return thrqueue_enqueue(logger->queue, lb) ? 0 : -1;
+	return logger_enqueue(logger, lb);
 }
 
 /*
@@ -203,10 +719,13 @@ static void *
 logger_thread(void *arg)
 {
 	logger_t *logger = arg;
-	logbuf_t *lb;
+	logbuf_t *lb, *pending = NULL;
 	int e = 0;
 
-	while ((lb = thrqueue_dequeue(logger->queue))) {
+	while ((lb = pending ? pending : logger_dequeue_flush(logger))) {
+		pending = NULL;
+		if (logger_shed(logger, lb))
+			continue;
 		if (logbuf_ctl_isset(lb, LBFLAG_REOPEN)) {
 			if (logger->reopen() != 0)
 				e = 1;
@@ -218,6 +737,9 @@ logger_thread(void *arg)
 		} else if (logbuf_ctl_isset(lb, LBFLAG_CLOSE)) {
 			logger->close(lb->fh, lb->ctl);
 			logbuf_free(lb);
+		} else if (logger->writev && logger_batchable(lb)) {
+			if (logger_write_batch(logger, lb, &pending) < 0)
+				e = 1;
 		} else {
 			if (logbuf_write_free(lb, logger->write) < 0)
 				e = 1;
@@ -228,6 +750,8 @@ logger_thread(void *arg)
 		}
 	}
 
+	if (logger->flush)
+		logger->flush(logger->flusharg, 1);
 	return NULL;
 }
 
@@ -241,7 +765,7 @@ logger_start(logger_t *logger) {
 	if (logger->queue) {
 		thrqueue_free(logger->queue);
 	}
-	logger->queue = thrqueue_new(1024);
+	logger->queue = thrqueue_new_mpsc(1024);
 
 	rv = pthread_create(&logger->thr, NULL, logger_thread, logger);
 	if (rv)
@@ -260,6 +784,16 @@ logger_leave(logger_t *logger) {
 	sched_yield();
 }
 
+/*
+ * Make the logger's write thread drop all pending and future write
+ * requests instead of writing them.  Used for bounding the time it takes
+ * to stop the logger.
+ */
+void
+logger_discard(logger_t *logger) {
+	__atomic_store_n(&logger->discard, 1, __ATOMIC_RELAXED);
+}
+
 /*
  * Wait for the logger to exit.
  */
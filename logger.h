@@ -34,23 +34,52 @@
 
 #include <unistd.h>
 #include <pthread.h>
+#include <sys/uio.h>
 
 typedef int (*logger_reopen_func_t)(void);
 typedef int (*logger_open_func_t)(void *);
 typedef void (*logger_close_func_t)(void *, unsigned long);
 typedef ssize_t (*logger_write_func_t)(void *, unsigned long,
                                        const void *, size_t);
+typedef ssize_t (*logger_writev_func_t)(void *, unsigned long,
+                                        const struct iovec *, int);
 typedef logbuf_t * (*logger_prep_func_t)(void *, unsigned long, logbuf_t *);
 typedef void (*logger_except_func_t)(void);
+typedef int (*logger_flush_func_t)(void *, int);
 typedef struct logger logger_t;
 
+/* overflow policies for full logger queues */
+#define LOGGER_OVERFLOW_BLOCK           0       /* block caller (default) */
+#define LOGGER_OVERFLOW_DROPNEWEST      1       /* drop submitted buffer */
+#define LOGGER_OVERFLOW_DROPOLDEST      2       /* drop queued buffers */
+#define LOGGER_OVERFLOW_SPILL           3       /* spill to overflow file */
+
+typedef struct logger_stats {
+	size_t depth;                   /* buffers currently queued */
+	size_t size;                    /* queue capacity */
+	size_t bytes;                   /* octets of log data queued */
+	size_t budget;                  /* memory budget, 0 if unlimited */
+	unsigned long long dropped_bufs;
+	unsigned long long dropped_bytes;
+	unsigned long long spilled_bufs;
+	unsigned long long spilled_bytes;
+	unsigned long long spill_pending; /* octets in overflow file */
+} logger_stats_t;
+
 logger_t * logger_new(logger_reopen_func_t, logger_open_func_t,
                       logger_close_func_t, logger_write_func_t,
                       logger_prep_func_t, logger_except_func_t)
                       NONNULL(4,6) MALLOC;
 void logger_free(logger_t *) NONNULL(1);
+int logger_set_overflow(logger_t *, int, const char *) NONNULL(1,3) WUNRES;
+void logger_set_writev(logger_t *, logger_writev_func_t) NONNULL(1,2);
+void logger_set_membudget(logger_t *, size_t) NONNULL(1);
+void logger_set_flush(logger_t *, logger_flush_func_t, void *) NONNULL(1,2);
+int logger_over_budget(logger_t *) NONNULL(1) WUNRES;
+void logger_stats(logger_t *, logger_stats_t *) NONNULL(1,2);
 int logger_start(logger_t *) NONNULL(1) WUNRES;
 void logger_leave(logger_t *) NONNULL(1);
+void logger_discard(logger_t *) NONNULL(1);
 int logger_join(logger_t *) NONNULL(1);
 int logger_stop(logger_t *) NONNULL(1) WUNRES;
 int logger_reopen(logger_t *) NONNULL(1) WUNRES;
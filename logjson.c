@@ -0,0 +1,243 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "logjson.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Minimal JSON lines formatter for machine-readable logs.
+ *
+ * Fields are appended to a reusable buffer with their values escaped in
+ * place, without any per-field allocation.  String values are escaped such
+ * that the output is always valid JSON: quotes, backslashes, control
+ * characters and all octets outside of printable ASCII are written as
+ * escape sequences, such that octets above 0x7f map to U+0080 to U+00FF.
+ * NULL strings are written as null.  Allocation failures are latched and
+ * reported by logjson_end().
+ */
+
+logjson_t *
+logjson_new(size_t sz)
+{
+	logjson_t *js;
+
+	if (!(js = malloc(sizeof(logjson_t))))
+		return NULL;
+	memset(js, 0, sizeof(logjson_t));
+	if (!(js->buf = malloc(sz))) {
+		free(js);
+		return NULL;
+	}
+	js->sz = sz;
+	return js;
+}
+
+void
+logjson_free(logjson_t *js)
+{
+	free(js->buf);
+	free(js);
+}
+
+/*
+ * Ensure room for n more octets.  Returns 0 on success, -1 on failure.
+ */
+static int
+logjson_reserve(logjson_t *js, size_t n)
+{
+	size_t sz;
+	char *buf;
+
+	if (js->enomem)
+		return -1;
+	if (js->len + n <= js->sz)
+		return 0;
+	for (sz = js->sz ? js->sz : 64; sz < js->len + n; sz *= 2);
+	if (!(buf = realloc(js->buf, sz))) {
+		js->enomem = 1;
+		return -1;
+	}
+	js->buf = buf;
+	js->sz = sz;
+	return 0;
+}
+
+static void
+logjson_raw(logjson_t *js, const char *s, size_t n)
+{
+	if (logjson_reserve(js, n) == -1)
+		return;
+	memcpy(js->buf + js->len, s, n);
+	js->len += n;
+}
+
+/*
+ * Append the separator and the key of the next field.
+ */
+static void
+logjson_key(logjson_t *js, const char *key)
+{
+	size_t n = strlen(key);
+
+	if (logjson_reserve(js, n + 4) == -1)
+		return;
+	if (js->nfields++ > 0)
+		js->buf[js->len++] = ',';
+	js->buf[js->len++] = '"';
+	memcpy(js->buf + js->len, key, n);
+	js->len += n;
+	js->buf[js->len++] = '"';
+	js->buf[js->len++] = ':';
+}
+
+void
+logjson_begin(logjson_t *js)
+{
+	js->len = 0;
+	js->nfields = 0;
+	js->enomem = 0;
+	logjson_raw(js, "{", 1);
+}
+
+void
+logjson_str(logjson_t *js, const char *key, const char *val)
+{
+	static const char hex[] = "0123456789abcdef";
+	const unsigned char *p;
+	size_t n;
+	char *q;
+
+	logjson_key(js, key);
+	if (!val) {
+		logjson_raw(js, "null", 4);
+		return;
+	}
+	/* worst case is six octets per input octet, plus quotes */
+	n = strlen(val);
+	if (logjson_reserve(js, 6 * n + 2) == -1)
+		return;
+	q = js->buf + js->len;
+	*q++ = '"';
+	for (p = (const unsigned char *)val; *p; p++) {
+		if (*p == '"' || *p == '\\') {
+			*q++ = '\\';
+			*q++ = *p;
+		} else if (*p >= 0x20 && *p < 0x7f) {
+			*q++ = *p;
+		} else if (*p == '\n') {
+			*q++ = '\\';
+			*q++ = 'n';
+		} else if (*p == '\r') {
+			*q++ = '\\';
+			*q++ = 'r';
+		} else if (*p == '\t') {
+			*q++ = '\\';
+			*q++ = 't';
+		} else {
+			memcpy(q, "\\u00", 4);
+			q[4] = hex[*p >> 4];
+			q[5] = hex[*p & 0xf];
+			q += 6;
+		}
+	}
+	*q++ = '"';
+	js->len = q - js->buf;
+}
+
+void
+logjson_int(logjson_t *js, const char *key, long long val)
+{
+	char num[24];
+	int n;
+
+	logjson_key(js, key);
+	n = snprintf(num, sizeof(num), "%lld", val);
+	logjson_raw(js, num, n);
+}
+
+void
+logjson_bool(logjson_t *js, const char *key, int val)
+{
+	logjson_key(js, key);
+	if (val)
+		logjson_raw(js, "true", 4);
+	else
+		logjson_raw(js, "false", 5);
+}
+
+void
+logjson_array_begin(logjson_t *js, const char *key)
+{
+	logjson_key(js, key);
+	logjson_raw(js, "[", 1);
+	js->nfields = 0;
+}
+
+/*
+ * Append an array element; val is written as null unless valid is set.
+ */
+void
+logjson_array_int(logjson_t *js, long long val, int valid)
+{
+	char num[24];
+	int n;
+
+	if (js->nfields++ > 0)
+		logjson_raw(js, ",", 1);
+	if (!valid) {
+		logjson_raw(js, "null", 4);
+		return;
+	}
+	n = snprintf(num, sizeof(num), "%lld", val);
+	logjson_raw(js, num, n);
+}
+
+void
+logjson_array_end(logjson_t *js)
+{
+	logjson_raw(js, "]", 1);
+	/* arrays are never the first field of an object */
+	js->nfields = 1;
+}
+
+/*
+ * Terminate the object and the line.  The line is in js->buf, js->len
+ * octets long, and not NUL-terminated.
+ * Returns 0 on success, -1 if memory allocation failed.
+ */
+int
+logjson_end(logjson_t *js)
+{
+	logjson_raw(js, "}\n", 2);
+	return js->enomem ? -1 : 0;
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,61 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LOGJSON_H
+#define LOGJSON_H
+
+#include "attrib.h"
+
+#include <stddef.h>
+
+/*
+ * Buffer for formatting one JSON object per line.  Reused for every line,
+ * it only grows if a line does not fit.
+ */
+typedef struct logjson {
+	char *buf;
+	size_t sz;
+	size_t len;
+	unsigned int nfields;
+	unsigned int enomem : 1;
+} logjson_t;
+
+logjson_t * logjson_new(size_t) MALLOC;
+void logjson_free(logjson_t *) NONNULL(1);
+void logjson_begin(logjson_t *) NONNULL(1);
+void logjson_str(logjson_t *, const char *, const char *) NONNULL(1,2);
+void logjson_int(logjson_t *, const char *, long long) NONNULL(1,2);
+void logjson_bool(logjson_t *, const char *, int) NONNULL(1,2);
+void logjson_array_begin(logjson_t *, const char *) NONNULL(1,2);
+void logjson_array_int(logjson_t *, long long, int) NONNULL(1);
+void logjson_array_end(logjson_t *) NONNULL(1);
+int logjson_end(logjson_t *) NONNULL(1) WUNRES;
+
+#endif /* !LOGJSON_H */
+
+/* vim: set noet ft=c: */
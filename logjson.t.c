@@ -0,0 +1,135 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "logjson.h"
+
+#include <string.h>
+
+#include <check.h>
+
+#define LOGJSON_IS(js, s) \
+	((js)->len == strlen(s) && !memcmp((js)->buf, (s), (js)->len))
+
+START_TEST(logjson_01)
+{
+	logjson_t *js;
+
+	js = logjson_new(64);
+	fail_unless(!!js, "logjson_new failed");
+	logjson_begin(js);
+	logjson_int(js, "v", 1);
+	logjson_str(js, "s", "a b");
+	logjson_str(js, "n", NULL);
+	logjson_bool(js, "t", 1);
+	logjson_int(js, "neg", -42);
+	fail_unless(logjson_end(js) == 0, "logjson_end failed");
+	fail_unless(LOGJSON_IS(js, "{\"v\":1,\"s\":\"a b\",\"n\":null,"
+	                           "\"t\":true,\"neg\":-42}\n"),
+	            "wrong output");
+	logjson_free(js);
+}
+END_TEST
+
+START_TEST(logjson_02)
+{
+	logjson_t *js;
+
+	js = logjson_new(64);
+	fail_unless(!!js, "logjson_new failed");
+	logjson_begin(js);
+	logjson_str(js, "s", "\"q\\\r\n\t\x01\x7f\xc3\xa4");
+	fail_unless(logjson_end(js) == 0, "logjson_end failed");
+	fail_unless(LOGJSON_IS(js, "{\"s\":\"\\\"q\\\\\\r\\n\\t\\u0001"
+	                           "\\u007f\\u00c3\\u00a4\"}\n"),
+	            "wrong escaping");
+	logjson_free(js);
+}
+END_TEST
+
+START_TEST(logjson_03)
+{
+	logjson_t *js;
+
+	js = logjson_new(64);
+	fail_unless(!!js, "logjson_new failed");
+	logjson_begin(js);
+	logjson_array_begin(js, "a");
+	logjson_array_int(js, 1, 1);
+	logjson_array_int(js, 0, 0);
+	logjson_array_int(js, 3, 1);
+	logjson_array_end(js);
+	logjson_bool(js, "f", 0);
+	fail_unless(logjson_end(js) == 0, "logjson_end failed");
+	fail_unless(LOGJSON_IS(js, "{\"a\":[1,null,3],\"f\":false}\n"),
+	            "wrong array output");
+	/* buffer is reused */
+	logjson_begin(js);
+	fail_unless(logjson_end(js) == 0, "logjson_end failed");
+	fail_unless(LOGJSON_IS(js, "{}\n"), "buffer not reset");
+	logjson_free(js);
+}
+END_TEST
+
+START_TEST(logjson_04)
+{
+	logjson_t *js;
+	char val[1000];
+
+	memset(val, 'x', sizeof(val) - 1);
+	val[sizeof(val) - 1] = '\0';
+	js = logjson_new(16);
+	fail_unless(!!js, "logjson_new failed");
+	logjson_begin(js);
+	logjson_str(js, "x", val);
+	fail_unless(logjson_end(js) == 0, "logjson_end failed");
+	fail_unless(js->len == sizeof(val) - 1 + 9, "wrong length");
+	fail_unless(js->sz >= js->len, "buffer did not grow");
+	fail_unless(!memcmp(js->buf + js->len - 4, "x\"}\n", 4), "wrong tail");
+	logjson_free(js);
+}
+END_TEST
+
+Suite *
+logjson_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("logjson");
+
+	tc = tcase_create("logjson");
+	tcase_add_test(tc, logjson_01);
+	tcase_add_test(tc, logjson_02);
+	tcase_add_test(tc, logjson_03);
+	tcase_add_test(tc, logjson_04);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
@@ -44,6 +44,11 @@
 
 #ifndef WITHOUT_MIRROR
 #include <pcap.h>
+#ifdef __linux__
+#include <net/if.h>
+#include <netpacket/packet.h>
+#define HAVE_LOGPKT_TX
+#endif /* __linux__ */
 #endif /* !WITHOUT_MIRROR */
 
 typedef struct __attribute__((packed)) {
@@ -65,6 +70,53 @@ typedef struct __attribute__((packed)) {
 
 #define PCAP_MAGIC      0xa1b2c3d4
 
+/*
+ * pcapng blocks, see draft-ietf-opsawg-pcapng.  Blocks are written in host
+ * byte order, indicated by the byte-order magic of the section header.
+ * Timestamps use the default resolution of microseconds.
+ */
+typedef struct __attribute__((packed)) {
+	uint32_t type;          /* PCAPNG_SHB */
+	uint32_t len;           /* total block length */
+	uint32_t bom;           /* byte-order magic */
+	uint16_t version_major;
+	uint16_t version_minor;
+	int64_t  section_len;   /* -1 for unspecified */
+} pcapng_shb_t;
+
+typedef struct __attribute__((packed)) {
+	uint32_t type;          /* PCAPNG_IDB */
+	uint32_t len;           /* total block length */
+	uint16_t linktype;
+	uint16_t reserved;
+	uint32_t snaplen;
+} pcapng_idb_t;
+
+typedef struct __attribute__((packed)) {
+	uint32_t type;          /* PCAPNG_EPB */
+	uint32_t len;           /* total block length */
+	uint32_t ifid;          /* interface ID */
+	uint32_t ts_high;       /* timestamp upper 32 bits */
+	uint32_t ts_low;        /* timestamp lower 32 bits */
+	uint32_t caplen;        /* captured packet length */
+	uint32_t origlen;       /* original packet length */
+} pcapng_epb_t;
+
+typedef struct __attribute__((packed)) {
+	uint16_t code;
+	uint16_t len;
+} pcapng_opt_t;
+
+#define PCAPNG_SHB      0x0a0d0d0a
+#define PCAPNG_IDB      0x00000001
+#define PCAPNG_EPB      0x00000006
+#define PCAPNG_BOM      0x1a2b3c4d
+#define PCAPNG_OPT_END          0
+#define PCAPNG_OPT_COMMENT      1
+#define PCAPNG_OPT_IF_DESC      3
+#define PCAPNG_OPTSZ_MAX        1024    /* truncate longer option values */
+#define PCAPNG_PAD(X)   (((X) + 3) & ~(size_t)3)
+
 typedef struct __attribute__((packed)) {
 	uint8_t  dst_mac[ETHER_ADDR_LEN];
 	uint8_t  src_mac[ETHER_ADDR_LEN];
@@ -178,6 +230,63 @@ typedef struct __attribute__((packed)) {
 		(C) = ~(C); \
 	}
 
+/*
+ * PCAP records are collected in a userspace buffer of PCAPBUF_SIZE octets
+ * and written to the file descriptor with a single write() per call to
+ * logpkt_write_payload() or logpkt_write_close(), or whenever the buffer is
+ * full.  All records written by one call share the same timestamp.  Nothing
+ * remains buffered between calls, so there is nothing to flush on close or
+ * reopen, and records of different connections logging to the same file do
+ * not interleave within a call.  If the context has a compressed stream,
+ * records are written through it instead.  For pcapng, the buffer collects
+ * Enhanced Packet Blocks, preceded by the connection's Interface Description
+ * Block on its first call in each section.
+ *
+ * Offline converters writing many small calls to a single file can instead
+ * collect the records of all calls in a larger batch buffer owned by the
+ * caller, which is only written when full or when flushed explicitly.
+ */
+#define PCAPBUF_SIZE    (64*1024)
+
+struct logpkt_batch {
+	int fd;
+	size_t len;
+	size_t sz;
+	uint8_t buf[];
+};
+
+typedef struct {
+	int fd;
+	logz_t *z;
+	logpkt_batch_t *batch;
+	logpkt_pcapng_t *ng;
+	uint32_t ifid;
+	struct timeval tv;
+	size_t len;
+	uint8_t buf[PCAPBUF_SIZE];
+} logpkt_pcapbuf_t;
+
+/*
+ * Batched transmission of mirrored frames.  Frames are built including all
+ * checksums into a set of TX_BATCH frame buffers and handed to the kernel
+ * with a single sendmmsg() on an AF_PACKET socket bound to the mirror
+ * interface, once per call to logpkt_write_payload() or logpkt_write_close(),
+ * or whenever all frame buffers are in use.  Where unavailable, frames are
+ * sent one at a time using libnet_write().
+ */
+#define TX_BATCH        64
+
+struct logpkt_tx {
+	int fd;
+	size_t framesz;
+	unsigned int n;
+#ifdef HAVE_LOGPKT_TX
+	struct mmsghdr msgs[TX_BATCH];
+	struct iovec iov[TX_BATCH];
+#endif /* HAVE_LOGPKT_TX */
+	uint8_t *frames;
+};
+
 /* Socket address typecasting shorthand notations. */
 #define CSA(X)          ((const struct sockaddr *)(X))
 #define CSIN(X)         ((const struct sockaddr_in *)(X))
@@ -190,7 +299,7 @@ typedef struct __attribute__((packed)) {
  * Returns 0 on success and -1 on failure.
  */
 static int
-logpkt_write_global_pcap_hdr(int fd)
+logpkt_write_global_pcap_hdr(int fd, logz_t *z)
 {
 	pcap_file_hdr_t hdr;
 
@@ -200,9 +309,40 @@ logpkt_write_global_pcap_hdr(int fd)
 	hdr.version_minor = 4;
 	hdr.snaplen = MAX_PKTSZ;
 	hdr.network = 1;
+	if (z)
+		return logz_write(z, &hdr, sizeof(hdr)) == -1 ? -1 : 0;
 	return write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ? -1 : 0;
 }
 
+/*
+ * Start a new pcapng section by writing a Section Header Block to file
+ * descriptor *fd* positioned at the end of the file.  Interfaces described in
+ * previous sections are invalidated.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int
+logpkt_write_pcapng_shb(int fd, logz_t *z, logpkt_pcapng_t *ng)
+{
+	struct __attribute__((packed)) {
+		pcapng_shb_t shb;
+		uint32_t len;
+	} blk;
+
+	memset(&blk, 0, sizeof(blk));
+	blk.shb.type = PCAPNG_SHB;
+	blk.shb.len = blk.len = sizeof(blk);
+	blk.shb.bom = PCAPNG_BOM;
+	blk.shb.version_major = 1;
+	blk.shb.version_minor = 0;
+	blk.shb.section_len = -1;
+	ng->section++;
+	ng->nifs = 0;
+	if (z)
+		return logz_write(z, &blk, sizeof(blk)) == -1 ? -1 : 0;
+	return write(fd, &blk, sizeof(blk)) != sizeof(blk) ? -1 : 0;
+}
+
 /*
  * Called on a file descriptor open for reading and writing.
  * If the fd points to an empty file, a pcap header is added and 0 is returned.
@@ -213,18 +353,54 @@ logpkt_write_global_pcap_hdr(int fd)
  * On a return value of 0, the caller can continue to write PCAP records to the
  * file descriptor.  On error, -1 is returned and the file descriptor is in an
  * undefined but still open state.
+ * If *z* is not NULL, the file is compressed using z; existing gzip files are
+ * assumed to contain a PCAP stream and appended to.
+ * If *ng* is not NULL, the same applies to pcapng instead of PCAP, except
+ * that a new section is started when appending to an existing file.
  */
 int
-logpkt_pcap_open_fd(int fd) {
+logpkt_pcap_open_fd(int fd, logz_t *z, logpkt_pcapng_t *ng) {
 	pcap_file_hdr_t hdr;
 	off_t sz;
 	ssize_t n;
+	int rv;
+
+	if (ng) {
+		sz = lseek(fd, 0, SEEK_END);
+		if (sz == -1)
+			return -1;
+		if (sz > 0 && z)
+			rv = logz_isgzip(fd);
+		else if (sz > 0)
+			rv = pread(fd, &hdr.magic_number,
+			           sizeof(hdr.magic_number), 0) ==
+			     sizeof(hdr.magic_number) &&
+			     hdr.magic_number == PCAPNG_SHB;
+		else
+			rv = 1;
+		if (rv == -1)
+			return -1;
+		if (!rv && ftruncate(fd, 0) == -1)
+			return -1;
+		if (lseek(fd, 0, SEEK_END) == -1)
+			return -1;
+		return logpkt_write_pcapng_shb(fd, z, ng);
+	}
 
 	sz = lseek(fd, 0, SEEK_END);
 	if (sz == -1)
 		return -1;
 
-	if (sz > 0) {
+	if (z && sz > 0) {
+		if ((rv = logz_isgzip(fd)) == -1)
+			return -1;
+		if (rv)
+			return 0;
+		if (lseek(fd, 0, SEEK_SET) == -1)
+			return -1;
+		if (ftruncate(fd, 0) == -1)
+			return -1;
+	} else if (sz > 0) {
 		if (lseek(fd, 0, SEEK_SET) == -1)
 			return -1;
 		n = read(fd, &hdr, sizeof(pcap_file_hdr_t));
@@ -238,31 +414,156 @@ logpkt_pcap_open_fd(int fd) {
 			return -1;
 	}
 
-	return logpkt_write_global_pcap_hdr(fd);
+	return logpkt_write_global_pcap_hdr(fd, z);
+}
+
+/*
+ * Create a batched transmitter for mirroring to interface *ifname* with MTU
+ * *mtu*.  Must be called with sufficient privileges to open a packet socket.
+ * Returns NULL with errno set if batched transmission is not supported on
+ * this platform or on errors.
+ */
+logpkt_tx_t *
+logpkt_tx_new(UNUSED const char *ifname, UNUSED size_t mtu)
+{
+#ifdef HAVE_LOGPKT_TX
+	logpkt_tx_t *tx;
+	struct sockaddr_ll sll;
+
+	tx = malloc(sizeof(logpkt_tx_t));
+	if (!tx)
+		return NULL;
+	memset(tx, 0, sizeof(logpkt_tx_t));
+	tx->framesz = mtu + sizeof(ether_hdr_t);
+	tx->frames = malloc(TX_BATCH * tx->framesz);
+	if (!tx->frames)
+		goto errout1;
+
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = 0; /* transmit only */
+	sll.sll_ifindex = if_nametoindex(ifname);
+	if (!sll.sll_ifindex)
+		goto errout2;
+	tx->fd = socket(AF_PACKET, SOCK_RAW, 0);
+	if (tx->fd == -1)
+		goto errout2;
+	if (bind(tx->fd, (struct sockaddr *)&sll, sizeof(sll)) == -1)
+		goto errout3;
+
+	for (int i = 0; i < TX_BATCH; i++) {
+		tx->iov[i].iov_base = tx->frames + i * tx->framesz;
+		tx->msgs[i].msg_hdr.msg_iov = &tx->iov[i];
+		tx->msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	return tx;
+
+errout3:
+	close(tx->fd);
+errout2:
+	free(tx->frames);
+errout1:
+	free(tx);
+	return NULL;
+#else /* !HAVE_LOGPKT_TX */
+	errno = ENOTSUP;
+	return NULL;
+#endif /* !HAVE_LOGPKT_TX */
+}
+
+void
+logpkt_tx_free(logpkt_tx_t *tx)
+{
+	close(tx->fd);
+	free(tx->frames);
+	free(tx);
+}
+
+#ifdef HAVE_LOGPKT_TX
+/*
+ * Hand all queued frames to the kernel.  Frames that could not be sent are
+ * dropped.  Returns -1 on errors, 0 on success.
+ */
+static int
+logpkt_tx_flush(logpkt_tx_t *tx)
+{
+	unsigned int off = 0;
+	int n;
+
+	while (off < tx->n) {
+		n = sendmmsg(tx->fd, tx->msgs + off, tx->n - off, 0);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1) {
+			log_err_printf("Error writing %u packets: %s\n",
+			               tx->n - off, strerror(errno));
+			tx->n = 0;
+			return -1;
+		}
+		off += n;
+	}
+	tx->n = 0;
+	return 0;
+}
+
+/*
+ * Return the next free frame buffer, flushing queued frames first if all
+ * frame buffers are in use.
+ */
+static uint8_t *
+logpkt_tx_frame(logpkt_tx_t *tx)
+{
+	if (tx->n == TX_BATCH && logpkt_tx_flush(tx) == -1)
+		return NULL;
+	return tx->iov[tx->n].iov_base;
+}
+
+/*
+ * Queue the frame of *sz* octets just built into the buffer returned by
+ * logpkt_tx_frame().
+ */
+static void
+logpkt_tx_queue(logpkt_tx_t *tx, size_t sz)
+{
+	tx->iov[tx->n].iov_len = sz;
+	tx->n++;
 }
+#endif /* HAVE_LOGPKT_TX */
 
 /*
  * Initialize the per-connection packet crafting context.  For mirroring,
- * *libnet* must be an initialized libnet instance and *mtu* must be the
- * target interface MTU greater than 0.  For PCAP writing, *libnet* must be
+ * *libnet* must be an initialized libnet instance, *tx* a batched
+ * transmitter for the same interface or NULL, and *mtu* must be the target
+ * interface MTU greater than 0.  For PCAP writing, *libnet* and *tx* must be
  * NULL and *mtu* must be 0.  The ether and sockaddr addresses are used as the
  * layer 2 and layer 3 addresses respectively.  For mirroring, the ethers must
  * match the actual link layer addresses to be used when sending traffic, not
  * some emulated addresses.
  */
 void
-logpkt_ctx_init(logpkt_ctx_t *ctx, libnet_t *libnet, size_t mtu,
+logpkt_ctx_init(logpkt_ctx_t *ctx, libnet_t *libnet, logpkt_tx_t *tx,
+                size_t mtu,
                 const uint8_t *src_ether, const uint8_t *dst_ether,
                 const struct sockaddr *src_addr, socklen_t src_addr_len,
                 const struct sockaddr *dst_addr, socklen_t dst_addr_len)
 {
 	ctx->libnet = libnet;
+	ctx->tx = tx;
 	memcpy(ctx->src_ether, src_ether, ETHER_ADDR_LEN);
 	memcpy(ctx->dst_ether, dst_ether, ETHER_ADDR_LEN);
 	memcpy(&ctx->src_addr, src_addr, src_addr_len);
 	memcpy(&ctx->dst_addr, dst_addr, dst_addr_len);
 	ctx->src_seq = 0;
 	ctx->dst_seq = 0;
+	ctx->z = NULL;
+	ctx->ng = NULL;
+	ctx->ng_section = 0;
+	ctx->ng_ifid = 0;
+	ctx->ng_desc = NULL;
+	ctx->ng_comment = NULL;
+	ctx->batch = NULL;
+	ctx->tv = NULL;
+	ctx->noacks = 0;
 	if (mtu) {
 		ctx->mss = mtu - sizeof(tcp_hdr_t)
 		               - (dst_addr->sa_family == AF_INET
@@ -274,40 +575,261 @@ logpkt_ctx_init(logpkt_ctx_t *ctx, libnet_t *libnet, size_t mtu,
 }
 
 /*
- * Write the layer 2 frame contained in *pkt* to file descriptor *fd* already
- * open for writing.  First writes a PCAP record header, then the actual frame.
+ * Make a PCAP writing context write pcapng blocks to a file with per-file
+ * state *ng* instead.  The connection will be described by an interface with
+ * description *desc* and comment *comment*, both optional, which must remain
+ * valid for the lifetime of the context.
+ */
+void
+logpkt_ctx_set_pcapng(logpkt_ctx_t *ctx, logpkt_pcapng_t *ng,
+                      const char *desc, const char *comment)
+{
+	ctx->ng = ng;
+	ctx->ng_section = 0;
+	ctx->ng_desc = desc;
+	ctx->ng_comment = comment;
+}
+
+/*
+ * Initialize the PCAP record buffer *pb* for writing to file descriptor *fd*
+ * already open for writing, through the compressed stream and in the file
+ * format of *ctx*, capturing the timestamp for all its records.
+ */
+static void
+logpkt_pcapbuf_init(logpkt_pcapbuf_t *pb, int fd, logpkt_ctx_t *ctx)
+{
+	pb->fd = fd;
+	pb->z = ctx->z;
+	pb->ng = ctx->ng;
+	pb->ifid = ctx->ng_ifid;
+	pb->batch = ctx->batch;
+	pb->len = 0;
+	if (ctx->tv)
+		pb->tv = *ctx->tv;
+	else
+		gettimeofday(&pb->tv, NULL);
+}
+
+/*
+ * Write sz octets from buf to fd, retrying on short writes.
  */
 static int
-logpkt_pcap_write(const uint8_t *pkt, size_t pktsz, int fd)
+logpkt_writeall(int fd, const uint8_t *buf, size_t sz)
 {
-	pcap_rec_hdr_t rec_hdr;
-	struct timeval tv;
+	size_t off = 0;
+	ssize_t n;
 
-	gettimeofday(&tv, NULL);
-	rec_hdr.ts_sec = tv.tv_sec;
-	rec_hdr.ts_usec = tv.tv_usec;
-	rec_hdr.orig_len = rec_hdr.incl_len = pktsz;
+	while (off < sz) {
+		n = write(fd, buf + off, sz - off);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1) {
+			log_err_printf("Error writing pcap records: %s\n",
+			               strerror(errno));
+			return -1;
+		}
+		off += n;
+	}
+	return 0;
+}
 
-	if (write(fd, &rec_hdr, sizeof(rec_hdr)) != sizeof(rec_hdr)) {
-		log_err_printf("Error writing pcap record hdr: %s\n",
-		               strerror(errno));
-		return -1;
+/*
+ * Create a batch buffer of sz octets collecting PCAP records for file
+ * descriptor fd across calls to logpkt_write_payload() and
+ * logpkt_write_close() of all contexts using it.  Records are written in
+ * the order of the calls.  Must be flushed by the caller when done.
+ */
+logpkt_batch_t *
+logpkt_batch_new(int fd, size_t sz)
+{
+	logpkt_batch_t *batch;
+
+	if (sz < PCAPBUF_SIZE)
+		sz = PCAPBUF_SIZE;
+	if (!(batch = malloc(sizeof(logpkt_batch_t) + sz)))
+		return NULL;
+	batch->fd = fd;
+	batch->len = 0;
+	batch->sz = sz;
+	return batch;
+}
+
+/*
+ * Write all records collected in the batch buffer to its file descriptor.
+ */
+int
+logpkt_batch_flush(logpkt_batch_t *batch)
+{
+	int rv;
+
+	rv = logpkt_writeall(batch->fd, batch->buf, batch->len);
+	batch->len = 0;
+	return rv;
+}
+
+void
+logpkt_batch_free(logpkt_batch_t *batch)
+{
+	free(batch);
+}
+
+/*
+ * Write all buffered PCAP records to the file descriptor.
+ */
+static int
+logpkt_pcapbuf_flush(logpkt_pcapbuf_t *pb)
+{
+	int rv;
+
+	if (pb->batch) {
+		logpkt_batch_t *batch = pb->batch;
+
+		if (batch->len + pb->len > batch->sz &&
+		    logpkt_batch_flush(batch) == -1) {
+			pb->len = 0;
+			return -1;
+		}
+		memcpy(batch->buf + batch->len, pb->buf, pb->len);
+		batch->len += pb->len;
+		pb->len = 0;
+		return 0;
 	}
-	if (write(fd, pkt, pktsz) != (ssize_t)pktsz) {
-		log_err_printf("Error writing pcap record: %s\n",
-		               strerror(errno));
-		return -1;
+	if (pb->z && pb->len > 0) {
+		ssize_t n;
+
+		n = logz_write(pb->z, pb->buf, pb->len);
+		pb->len = 0;
+		if (n == -1) {
+			log_err_printf("Error writing pcap records: %s\n",
+			               strerror(errno));
+			return -1;
+		}
+		return 0;
+	}
+	rv = logpkt_writeall(pb->fd, pb->buf, pb->len);
+	pb->len = 0;
+	return rv;
+}
+
+/*
+ * Append an option to the pcapng block being built at *p*, truncating *val*
+ * to PCAPNG_OPTSZ_MAX octets.  Returns the number of octets appended.
+ */
+static size_t
+logpkt_pcapng_opt(uint8_t *p, uint16_t code, const char *val)
+{
+	pcapng_opt_t opt;
+	size_t sz;
+
+	sz = val ? strlen(val) : 0;
+	if (sz > PCAPNG_OPTSZ_MAX)
+		sz = PCAPNG_OPTSZ_MAX;
+	opt.code = code;
+	opt.len = sz;
+	memcpy(p, &opt, sizeof(opt));
+	memset(p + sizeof(opt), 0, PCAPNG_PAD(sz));
+	if (sz)
+		memcpy(p + sizeof(opt), val, sz);
+	return sizeof(opt) + PCAPNG_PAD(sz);
+}
+
+/*
+ * Append an Interface Description Block describing the connection of *ctx*
+ * to the record buffer, and assign the interface ID to subsequent blocks.
+ * Called at most once per section and connection on a buffer that is empty.
+ */
+static void
+logpkt_pcapbuf_add_idb(logpkt_pcapbuf_t *pb, logpkt_ctx_t *ctx)
+{
+	pcapng_idb_t idb;
+	uint8_t *p = pb->buf + pb->len;
+	uint32_t len;
+
+	p += sizeof(idb);
+	if (ctx->ng_desc)
+		p += logpkt_pcapng_opt(p, PCAPNG_OPT_IF_DESC, ctx->ng_desc);
+	if (ctx->ng_comment)
+		p += logpkt_pcapng_opt(p, PCAPNG_OPT_COMMENT, ctx->ng_comment);
+	p += logpkt_pcapng_opt(p, PCAPNG_OPT_END, NULL);
+	len = (p - (pb->buf + pb->len)) + sizeof(len);
+	memcpy(p, &len, sizeof(len));
+
+	idb.type = PCAPNG_IDB;
+	idb.len = len;
+	idb.linktype = 1;
+	idb.reserved = 0;
+	idb.snaplen = MAX_PKTSZ;
+	memcpy(pb->buf + pb->len, &idb, sizeof(idb));
+	pb->len += len;
+
+	ctx->ng_section = ctx->ng->section;
+	ctx->ng_ifid = pb->ifid = ctx->ng->nifs++;
+}
+
+/*
+ * Append the layer 2 frame contained in *pkt* as an Enhanced Packet Block to
+ * the record buffer, flushing it first if it is full.
+ */
+static int
+logpkt_pcapbuf_add_epb(logpkt_pcapbuf_t *pb, const uint8_t *pkt, size_t pktsz)
+{
+	pcapng_epb_t epb;
+	uint64_t ts;
+	uint32_t len;
+
+	len = sizeof(epb) + PCAPNG_PAD(pktsz) + sizeof(len);
+	if (pb->len + len > sizeof(pb->buf)) {
+		if (logpkt_pcapbuf_flush(pb) == -1)
+			return -1;
 	}
+	ts = (uint64_t)pb->tv.tv_sec * 1000000 + pb->tv.tv_usec;
+	epb.type = PCAPNG_EPB;
+	epb.len = len;
+	epb.ifid = pb->ifid;
+	epb.ts_high = ts >> 32;
+	epb.ts_low = ts & 0xffffffff;
+	epb.caplen = epb.origlen = pktsz;
+	memcpy(pb->buf + pb->len, &epb, sizeof(epb));
+	memcpy(pb->buf + pb->len + sizeof(epb), pkt, pktsz);
+	memset(pb->buf + pb->len + sizeof(epb) + pktsz, 0,
+	       PCAPNG_PAD(pktsz) - pktsz);
+	memcpy(pb->buf + pb->len + len - sizeof(len), &len, sizeof(len));
+	pb->len += len;
+	return 0;
+}
+
+/*
+ * Append the layer 2 frame contained in *pkt* as a PCAP record to the record
+ * buffer, flushing it first if it is full.
+ */
+static int
+logpkt_pcapbuf_add(logpkt_pcapbuf_t *pb, const uint8_t *pkt, size_t pktsz)
+{
+	pcap_rec_hdr_t rec_hdr;
+
+	if (pb->ng)
+		return logpkt_pcapbuf_add_epb(pb, pkt, pktsz);
+	if (pb->len + sizeof(rec_hdr) + pktsz > sizeof(pb->buf)) {
+		if (logpkt_pcapbuf_flush(pb) == -1)
+			return -1;
+	}
+	rec_hdr.ts_sec = pb->tv.tv_sec;
+	rec_hdr.ts_usec = pb->tv.tv_usec;
+	rec_hdr.orig_len = rec_hdr.incl_len = pktsz;
+	memcpy(pb->buf + pb->len, &rec_hdr, sizeof(rec_hdr));
+	memcpy(pb->buf + pb->len + sizeof(rec_hdr), pkt, pktsz);
+	pb->len += sizeof(rec_hdr) + pktsz;
 	return 0;
 }
 
 /*
  * Build a frame from the given layer 2, layer 3 and layer 4 parameters plus
  * payload, write the resulting bytes into buffer pointed to by *pkt*, and fix
- * the checksums on all layers.  The receiving buffer must be at least
- * MAX_PKTSZ bytes large and payload must be a maximum of MSS_IP4 or MSS_IP6
- * respectively.  Layer 2 is Ethernet II, layer 3 is IPv4 or IPv6 depending on
- * the address family of *dst_addr*, and layer 4 is TCP.
+ * the checksums on all layers.  For PCAP writing, the receiving buffer must
+ * be at least MAX_PKTSZ bytes large and payload must be a maximum of MSS_IP4
+ * or MSS_IP6 respectively; for mirroring, the limits follow from the
+ * interface MTU instead.  Layer 2 is Ethernet II, layer 3 is IPv4 or IPv6
+ * depending on the address family of *dst_addr*, and layer 4 is TCP.
  *
  * This function is stateless.  For header fields that cannot be directly
  * derived from the arguments, default values will be used.
@@ -488,8 +1010,8 @@ logpkt_mirror_build(libnet_t *libnet,
 #endif /* !WITHOUT_MIRROR */
 
 /*
- * Write a single packet to either PCAP (*fd* != -1) or a network interface
- * (*fd* == -1).  Caller must ensure that *ctx* was initialized accordingly.
+ * Write a single packet to either PCAP (*pb* != NULL) or a network interface
+ * (*pb* == NULL).  Caller must ensure that *ctx* was initialized accordingly.
  * The packet will be in direction *direction*, use TCP flags *flags*, and
  * transmit a payload *payload*.  TCP sequence and acknowledgement numbers as
  * well as source and destination identifiers are taken from *ctx*.
@@ -498,13 +1020,15 @@ logpkt_mirror_build(libnet_t *libnet,
  * selected (interface in mirroring mode, MTU value in PCAP writing mode).
  */
 static int
-logpkt_write_packet(logpkt_ctx_t *ctx, int fd, int direction, char flags,
-                    const uint8_t *payload, size_t payloadlen)
+logpkt_write_packet(logpkt_ctx_t *ctx, logpkt_pcapbuf_t *pb, int direction,
+                    char flags, const uint8_t *payload, size_t payloadlen)
 {
 	int rv;
 
-	if (fd != -1) {
+	if (pb) {
 		uint8_t buf[MAX_PKTSZ];
+		if (ctx->noacks && flags == TH_ACK && !payloadlen)
+			return 0;
 		size_t sz;
 		if (direction == LOGPKT_REQUEST) {
 			sz = logpkt_pcap_build(buf,
@@ -523,7 +1047,7 @@ logpkt_write_packet(logpkt_ctx_t *ctx, int fd, int direction, char flags,
 			                       ctx->dst_seq, ctx->src_seq,
 			                       payload, payloadlen);
 		}
-		rv = logpkt_pcap_write(buf, sz, fd);
+		rv = logpkt_pcapbuf_add(pb, buf, sz);
 		if (rv == -1) {
 			log_err_printf("Error writing packet to PCAP file\n");
 			return -1;
@@ -533,6 +1057,37 @@ logpkt_write_packet(logpkt_ctx_t *ctx, int fd, int direction, char flags,
 		/* Source and destination ether are determined by the actual
 		 * local MAC address and target MAC address for mirroring the
 		 * packets to; use them as-is for both directions. */
+#ifdef HAVE_LOGPKT_TX
+		if (ctx->tx) {
+			uint8_t *buf;
+			size_t sz;
+			if (!(buf = logpkt_tx_frame(ctx->tx)))
+				return -1;
+			if (direction == LOGPKT_REQUEST) {
+				sz = logpkt_pcap_build(buf,
+				                       ctx->src_ether,
+				                       ctx->dst_ether,
+				                       CSA(&ctx->src_addr),
+				                       CSA(&ctx->dst_addr),
+				                       flags,
+				                       ctx->src_seq,
+				                       ctx->dst_seq,
+				                       payload, payloadlen);
+			} else {
+				sz = logpkt_pcap_build(buf,
+				                       ctx->src_ether,
+				                       ctx->dst_ether,
+				                       CSA(&ctx->dst_addr),
+				                       CSA(&ctx->src_addr),
+				                       flags,
+				                       ctx->dst_seq,
+				                       ctx->src_seq,
+				                       payload, payloadlen);
+			}
+			logpkt_tx_queue(ctx->tx, sz);
+			return 0;
+		}
+#endif /* HAVE_LOGPKT_TX */
 		if (direction == LOGPKT_REQUEST) {
 			rv = logpkt_mirror_build(ctx->libnet,
 			                         ctx->src_ether, ctx->dst_ether,
@@ -571,44 +1126,39 @@ logpkt_write_packet(logpkt_ctx_t *ctx, int fd, int direction, char flags,
  * Emulate the initial SYN handshake.
  */
 static int
-logpkt_write_syn_handshake(logpkt_ctx_t *ctx, int fd)
+logpkt_write_syn_handshake(logpkt_ctx_t *ctx, logpkt_pcapbuf_t *pb)
 {
 	ctx->src_seq = sys_rand32();
-	if (logpkt_write_packet(ctx, fd, LOGPKT_REQUEST,
+	if (logpkt_write_packet(ctx, pb, LOGPKT_REQUEST,
 	                        TH_SYN, NULL, 0) == -1)
 		return -1;
 	ctx->src_seq += 1;
 	ctx->dst_seq = sys_rand32();
-	if (logpkt_write_packet(ctx, fd, LOGPKT_RESPONSE,
+	if (logpkt_write_packet(ctx, pb, LOGPKT_RESPONSE,
 	                        TH_SYN|TH_ACK, NULL, 0) == -1)
 		return -1;
 	ctx->dst_seq += 1;
-	if (logpkt_write_packet(ctx, fd, LOGPKT_REQUEST,
+	if (logpkt_write_packet(ctx, pb, LOGPKT_REQUEST,
 	                        TH_ACK, NULL, 0) == -1)
 		return -1;
 	return 0;
 }
 
-/*
- * Emulate the necessary packets to write a single payload segment.  If
- * necessary, a SYN handshake will automatically be generated before emitting
- * the packet carrying the payload plus a matching ACK.
- */
-int
-logpkt_write_payload(logpkt_ctx_t *ctx, int fd, int direction,
-                     const uint8_t *payload, size_t payloadlen)
+static int
+logpkt_emit_payload(logpkt_ctx_t *ctx, logpkt_pcapbuf_t *pb, int direction,
+                    const uint8_t *payload, size_t payloadlen)
 {
 	int other_direction = (direction == LOGPKT_REQUEST) ? LOGPKT_RESPONSE
 	                                                    : LOGPKT_REQUEST;
 
 	if (ctx->src_seq == 0) {
-		if (logpkt_write_syn_handshake(ctx, fd) == -1)
+		if (logpkt_write_syn_handshake(ctx, pb) == -1)
 			return -1;
 	}
 
 	while (payloadlen > 0) {
 		size_t n = payloadlen > ctx->mss ? ctx->mss : payloadlen;
-		if (logpkt_write_packet(ctx, fd, direction,
+		if (logpkt_write_packet(ctx, pb, direction,
 		                        TH_PUSH|TH_ACK, payload, n) == -1) {
 			log_err_printf("Warning: Failed to write to pcap log"
 			               ": %s\n", strerror(errno));
@@ -623,7 +1173,7 @@ logpkt_write_payload(logpkt_ctx_t *ctx, int fd, int direction,
 		payloadlen -= n;
 	}
 
-	if (logpkt_write_packet(ctx, fd, other_direction,
+	if (logpkt_write_packet(ctx, pb, other_direction,
 	                        TH_ACK, NULL, 0) == -1) {
 		log_err_printf("Warning: Failed to write to pcap log: %s\n",
 		               strerror(errno));
@@ -632,21 +1182,18 @@ logpkt_write_payload(logpkt_ctx_t *ctx, int fd, int direction,
 	return 0;
 }
 
-/*
- * Emulate a connection close, emitting a FIN handshake in the correct
- * direction.  Does not close the file descriptor.
- */
-int
-logpkt_write_close(logpkt_ctx_t *ctx, int fd, int direction) {
+static int
+logpkt_emit_close(logpkt_ctx_t *ctx, logpkt_pcapbuf_t *pb, int direction)
+{
 	int other_direction = (direction == LOGPKT_REQUEST) ? LOGPKT_RESPONSE
 	                                                    : LOGPKT_REQUEST;
 
 	if (ctx->src_seq == 0) {
-		if (logpkt_write_syn_handshake(ctx, fd) == -1)
+		if (logpkt_write_syn_handshake(ctx, pb) == -1)
 			return -1;
 	}
 
-	if (logpkt_write_packet(ctx, fd, direction,
+	if (logpkt_write_packet(ctx, pb, direction,
 	                        TH_FIN|TH_ACK, NULL, 0) == -1) {
 		log_err_printf("Warning: Failed to write packet\n");
 		return -1;
@@ -657,7 +1204,7 @@ logpkt_write_close(logpkt_ctx_t *ctx, int fd, int direction) {
 		ctx->dst_seq += 1;
 	}
 
-	if (logpkt_write_packet(ctx, fd, other_direction,
+	if (logpkt_write_packet(ctx, pb, other_direction,
 	                        TH_FIN|TH_ACK, NULL, 0) == -1) {
 		log_err_printf("Warning: Failed to write packet\n");
 		return -1;
@@ -668,7 +1215,7 @@ logpkt_write_close(logpkt_ctx_t *ctx, int fd, int direction) {
 		ctx->dst_seq += 1;
 	}
 
-	if (logpkt_write_packet(ctx, fd, direction,
+	if (logpkt_write_packet(ctx, pb, direction,
 	                        TH_ACK, NULL, 0) == -1) {
 		log_err_printf("Warning: Failed to write packet\n");
 		return -1;
@@ -677,6 +1224,61 @@ logpkt_write_close(logpkt_ctx_t *ctx, int fd, int direction) {
 	return 0;
 }
 
+/*
+ * Emulate the necessary packets to write a single payload segment.  If
+ * necessary, a SYN handshake will automatically be generated before emitting
+ * the packet carrying the payload plus a matching ACK.  When writing to a
+ * file with noacks set, packets carrying only an ACK are omitted.
+ */
+int
+logpkt_write_payload(logpkt_ctx_t *ctx, int fd, int direction,
+                     const uint8_t *payload, size_t payloadlen)
+{
+	logpkt_pcapbuf_t pcapbuf, *pb = NULL;
+	int rv;
+
+	if (fd != -1) {
+		pb = &pcapbuf;
+		logpkt_pcapbuf_init(pb, fd, ctx);
+		if (ctx->ng && ctx->ng_section != ctx->ng->section)
+			logpkt_pcapbuf_add_idb(pb, ctx);
+	}
+	rv = logpkt_emit_payload(ctx, pb, direction, payload, payloadlen);
+	if (pb && logpkt_pcapbuf_flush(pb) == -1)
+		rv = -1;
+#ifdef HAVE_LOGPKT_TX
+	if (!pb && ctx->tx && logpkt_tx_flush(ctx->tx) == -1)
+		rv = -1;
+#endif /* HAVE_LOGPKT_TX */
+	return rv;
+}
+
+/*
+ * Emulate a connection close, emitting a FIN handshake in the correct
+ * direction.  Does not close the file descriptor.
+ */
+int
+logpkt_write_close(logpkt_ctx_t *ctx, int fd, int direction)
+{
+	logpkt_pcapbuf_t pcapbuf, *pb = NULL;
+	int rv;
+
+	if (fd != -1) {
+		pb = &pcapbuf;
+		logpkt_pcapbuf_init(pb, fd, ctx);
+		if (ctx->ng && ctx->ng_section != ctx->ng->section)
+			logpkt_pcapbuf_add_idb(pb, ctx);
+	}
+	rv = logpkt_emit_close(ctx, pb, direction);
+	if (pb && logpkt_pcapbuf_flush(pb) == -1)
+		rv = -1;
+#ifdef HAVE_LOGPKT_TX
+	if (!pb && ctx->tx && logpkt_tx_flush(ctx->tx) == -1)
+		rv = -1;
+#endif /* HAVE_LOGPKT_TX */
+	return rv;
+}
+
 #ifndef WITHOUT_MIRROR
 typedef struct {
 	uint32_t ip;
@@ -719,25 +1321,76 @@ logpkt_recv_arp_reply(uint8_t *user,
 	ctx->result = 0;
 }
 
+/*
+ * Capture handle for receiving ARP replies on an interface, opened while
+ * still privileged such that mirror targets can be probed again after
+ * dropping privileges.
+ */
+struct logpkt_arp {
+	pcap_t *pcap;
+};
+
+logpkt_arp_t *
+logpkt_arp_new(const char *ifname)
+{
+	char errbuf[PCAP_ERRBUF_SIZE];
+	struct bpf_program bp;
+	logpkt_arp_t *arp;
+
+	arp = malloc(sizeof(logpkt_arp_t));
+	if (!arp)
+		return NULL;
+	arp->pcap = pcap_open_live(ifname, 100, 0, 10, errbuf);
+	if (arp->pcap == NULL) {
+		log_err_printf("Error in pcap_open_live(): %s\n", errbuf);
+		goto errout;
+	}
+	if (pcap_compile(arp->pcap, &bp, "arp", 0, -1) == -1) {
+		log_err_printf("Error in pcap_compile(): %s\n",
+		               pcap_geterr(arp->pcap));
+		goto errout2;
+	}
+	if (pcap_setfilter(arp->pcap, &bp) == -1) {
+		log_err_printf("Error in pcap_setfilter(): %s\n",
+		               pcap_geterr(arp->pcap));
+		pcap_freecode(&bp);
+		goto errout2;
+	}
+	pcap_freecode(&bp);
+	return arp;
+
+errout2:
+	pcap_close(arp->pcap);
+errout:
+	free(arp);
+	return NULL;
+}
+
+void
+logpkt_arp_free(logpkt_arp_t *arp)
+{
+	pcap_close(arp->pcap);
+	free(arp);
+}
+
 /*
  * Look up the appropriate source and destination ethernet addresses for
- * mirroring packets to dst_ip_s on interface dst_if_s.
+ * mirroring packets to dst_ip_s, sending up to tries ARP requests one second
+ * apart on the interface of libnet and receiving replies on arp.
  * Only IPv4 mirror targets are supported.
+ * Returns -1 if the target did not reply, 0 on success.
  */
 int
-logpkt_ether_lookup(libnet_t *libnet,
+logpkt_ether_lookup(libnet_t *libnet, logpkt_arp_t *arp,
                     uint8_t *src_ether, uint8_t *dst_ether,
-                    const char *dst_ip_s, const char *dst_if_s)
+                    const char *dst_ip_s, int tries)
 {
-	char errbuf[PCAP_ERRBUF_SIZE];
 	uint8_t broadcast_ether[ETHER_ADDR_LEN] = {
 		0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
 	uint8_t zero_ether[ETHER_ADDR_LEN] = {
 		0x0, 0x0, 0x0, 0x0, 0x0, 0x0};
 	struct libnet_ether_addr *src_ether_addr;
 	uint32_t src_ip;
-	struct bpf_program bp;
-	int count = 50;
 	logpkt_recv_arp_reply_ctx_t ctx;
 
 	if (sys_get_af(dst_ip_s) != AF_INET) {
@@ -786,32 +1439,15 @@ logpkt_ether_lookup(libnet_t *libnet,
 		goto out;
 	}
 
-	pcap_t *pcap = pcap_open_live(dst_if_s, 100, 0, 10, errbuf);
-	if (pcap == NULL) {
-		log_err_printf("Error in pcap_open_live(): %s\n", errbuf);
-		goto out;
-	}
-
-	if (pcap_compile(pcap, &bp, "arp", 0, -1) == -1) {
-		log_err_printf("Error in pcap_compile(): %s\n",
-		               pcap_geterr(pcap));
-		goto out2;
-	}
-	if (pcap_setfilter(pcap, &bp) == -1) {
-		log_err_printf("Error in pcap_setfilter(): %s\n",
-		               pcap_geterr(pcap));
-		goto out3;
-	}
-
 	do {
 		if (libnet_write(libnet) != -1) {
 			/* Limit # of packets to process, so we can loop to
 			 * send arp requests on busy networks. */
-			if (pcap_dispatch(pcap, 1000,
+			if (pcap_dispatch(arp->pcap, 1000,
 			                  (pcap_handler)logpkt_recv_arp_reply,
 			                  (u_char*)&ctx) < 0) {
 				log_err_printf("Error in pcap_dispatch(): %s\n",
-				               pcap_geterr(pcap));
+				               pcap_geterr(arp->pcap));
 				break;
 			}
 		} else {
@@ -819,21 +1455,19 @@ logpkt_ether_lookup(libnet_t *libnet,
 			               libnet_geterror(libnet));
 			break;
 		}
+		if (ctx.result == 0)
+			break;
 		sleep(1);
-	} while (ctx.result == -1 && --count > 0);
+	} while (--tries > 0);
 
 	if (ctx.result == 0) {
 		memcpy(dst_ether, &ctx.ether, ETHER_ADDR_LEN);
-		log_dbg_printf("Mirror target is up: "
-		               "%02x:%02x:%02x:%02x:%02x:%02x\n",
+		log_dbg_printf("Mirror target %s is up: "
+		               "%02x:%02x:%02x:%02x:%02x:%02x\n", dst_ip_s,
 		               dst_ether[0], dst_ether[1], dst_ether[2],
 		               dst_ether[3], dst_ether[4], dst_ether[5]);
 	}
 
-out3:
-	pcap_freecode(&bp);
-out2:
-	pcap_close(pcap);
 out:
 	libnet_clear_packet(libnet);
 	return ctx.result;
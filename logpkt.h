@@ -30,10 +30,12 @@
 #define LOGPKT_H
 
 #include "attrib.h"
+#include "logz.h"
 
 #include <sys/socket.h>
 #include <stdint.h>
 #include <time.h>
+#include <sys/time.h>
 
 #ifndef WITHOUT_MIRROR
 #include <libnet.h>
@@ -42,8 +44,23 @@
 #define ETHER_ADDR_LEN 6
 #endif /* WITHOUT_MIRROR */
 
+typedef struct logpkt_tx logpkt_tx_t;
+typedef struct logpkt_batch logpkt_batch_t;
+typedef struct logpkt_arp logpkt_arp_t;
+
+/*
+ * Per-file state of a pcapng log file, shared by all connections writing to
+ * the file.  Each connection is described by its own interface within the
+ * current section.
+ */
+typedef struct {
+	uint32_t section;       /* sections started, 0 before the first */
+	uint32_t nifs;          /* interfaces described in current section */
+} logpkt_pcapng_t;
+
 typedef struct {
 	libnet_t *libnet;
+	logpkt_tx_t *tx;
 	uint8_t src_ether[ETHER_ADDR_LEN];
 	uint8_t dst_ether[ETHER_ADDR_LEN];
 	struct sockaddr_storage src_addr;
@@ -51,20 +68,38 @@ typedef struct {
 	uint32_t src_seq;
 	uint32_t dst_seq;
 	size_t mss;
+	logz_t *z;              /* compress PCAP records written to fd */
+	logpkt_pcapng_t *ng;    /* write pcapng blocks instead of PCAP */
+	uint32_t ng_section;    /* section in which ng_ifid was assigned */
+	uint32_t ng_ifid;       /* interface ID of this connection */
+	const char *ng_desc;    /* interface description, not owned */
+	const char *ng_comment; /* interface comment, not owned */
+	logpkt_batch_t *batch;  /* collect records across calls, or NULL */
+	const struct timeval *tv; /* timestamp of records, NULL for now */
+	unsigned int noacks : 1; /* omit pure ACKs when writing to a file */
 } logpkt_ctx_t;
 
 #define LOGPKT_REQUEST  0
 #define LOGPKT_RESPONSE 1
 
-int logpkt_pcap_open_fd(int fd) WUNRES;
-void logpkt_ctx_init(logpkt_ctx_t *, libnet_t *, size_t,
+int logpkt_pcap_open_fd(int, logz_t *, logpkt_pcapng_t *) WUNRES;
+logpkt_tx_t *logpkt_tx_new(const char *, size_t) MALLOC;
+logpkt_batch_t *logpkt_batch_new(int, size_t) MALLOC;
+int logpkt_batch_flush(logpkt_batch_t *) NONNULL(1) WUNRES;
+void logpkt_batch_free(logpkt_batch_t *) NONNULL(1);
+void logpkt_tx_free(logpkt_tx_t *);
+void logpkt_ctx_init(logpkt_ctx_t *, libnet_t *, logpkt_tx_t *, size_t,
                      const uint8_t *, const uint8_t *,
                      const struct sockaddr *, socklen_t,
                      const struct sockaddr *, socklen_t);
+void logpkt_ctx_set_pcapng(logpkt_ctx_t *, logpkt_pcapng_t *,
+                           const char *, const char *) NONNULL(1,2);
 int logpkt_write_payload(logpkt_ctx_t *, int, int,
                          const unsigned char *, size_t) WUNRES;
 int logpkt_write_close(logpkt_ctx_t *, int, int);
-int logpkt_ether_lookup(libnet_t *, uint8_t *, uint8_t *,
-                        const char *, const char *) WUNRES;
+logpkt_arp_t *logpkt_arp_new(const char *) NONNULL(1) MALLOC;
+void logpkt_arp_free(logpkt_arp_t *) NONNULL(1);
+int logpkt_ether_lookup(libnet_t *, logpkt_arp_t *, uint8_t *, uint8_t *,
+                        const char *, int) NONNULL(1,2,3,4,5) WUNRES;
 
 #endif /* !LOGPKT_H */
@@ -0,0 +1,305 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "logroll.h"
+
+#include "khash.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Connect log rollup.
+ *
+ * Instead of writing one connect log line per connection, connections are
+ * counted per (proto, name, destination, outcome) together with the octets
+ * they transferred, and each aggregate is written as one line per flush
+ * interval.  Every worker thread counts into its own table, which is only
+ * locked against the flusher.  Merging swaps the table for an empty one
+ * under the lock and folds the entries into the merged table afterwards,
+ * such that workers never wait for the merge or for formatting.
+ */
+
+#define LOGROLL_FIELDSZ	255
+#define LOGROLL_KEYSZ	(LOGROLL_NFIELDS * (LOGROLL_FIELDSZ + 1))
+#define LOGROLL_LINESZ	(LOGROLL_KEYSZ + 128)
+
+typedef struct logroll_ent {
+	unsigned long long conns;
+	unsigned long long srcbytes;
+	unsigned long long dstbytes;
+	char *field[LOGROLL_NFIELDS];
+	char key[];
+} logroll_ent_t;
+
+KHASH_INIT(logrollmap_t, char*, logroll_ent_t*, 1, kh_str_hash_func,
+           kh_str_hash_equal)
+
+struct logroll {
+	pthread_mutex_t mutex;
+	khash_t(logrollmap_t) *map;
+};
+
+logroll_t *
+logroll_new(void)
+{
+	logroll_t *lr;
+
+	if (!(lr = malloc(sizeof(logroll_t))))
+		return NULL;
+	if (!(lr->map = kh_init(logrollmap_t))) {
+		free(lr);
+		return NULL;
+	}
+	if (pthread_mutex_init(&lr->mutex, NULL)) {
+		kh_destroy(logrollmap_t, lr->map);
+		free(lr);
+		return NULL;
+	}
+	return lr;
+}
+
+static void
+logroll_map_free(khash_t(logrollmap_t) *map)
+{
+	for (khiter_t it = kh_begin(map); it != kh_end(map); it++) {
+		if (kh_exist(map, it))
+			free(kh_val(map, it));
+	}
+	kh_destroy(logrollmap_t, map);
+}
+
+void
+logroll_free(logroll_t *lr)
+{
+	logroll_map_free(lr->map);
+	pthread_mutex_destroy(&lr->mutex);
+	free(lr);
+}
+
+/*
+ * Number of aggregates currently held.
+ */
+size_t
+logroll_size(logroll_t *lr)
+{
+	size_t n;
+
+	pthread_mutex_lock(&lr->mutex);
+	n = kh_size(lr->map);
+	pthread_mutex_unlock(&lr->mutex);
+	return n;
+}
+
+/*
+ * Insert ent, or add its counters to the aggregate with the same key and
+ * free it.  Must be called with the mutex held.  Returns 0 on success, -1
+ * on allocation failure, in which case ent was freed.
+ */
+static int
+logroll_put(logroll_t *lr, logroll_ent_t *ent)
+{
+	logroll_ent_t *cur;
+	khiter_t it;
+	int ret;
+
+	it = kh_put(logrollmap_t, lr->map, ent->key, &ret);
+	if (ret == -1) {
+		free(ent);
+		return -1;
+	}
+	if (ret == 0) {
+		cur = kh_val(lr->map, it);
+		cur->conns += ent->conns;
+		cur->srcbytes += ent->srcbytes;
+		cur->dstbytes += ent->dstbytes;
+		free(ent);
+		return 0;
+	}
+	kh_val(lr->map, it) = ent;
+	return 0;
+}
+
+/*
+ * Count one connection with the given key fields, which are truncated to
+ * LOGROLL_FIELDSZ octets; NULL fields are counted as dash.  Returns 0 on
+ * success, -1 on allocation failure.
+ */
+int
+logroll_add(logroll_t *lr, const char **field, unsigned long long srcbytes,
+            unsigned long long dstbytes)
+{
+	char key[LOGROLL_KEYSZ];
+	size_t len[LOGROLL_NFIELDS];
+	size_t n = 0;
+	logroll_ent_t *ent;
+	khiter_t it;
+	char *p;
+	int rv = 0;
+
+	for (int i = 0; i < LOGROLL_NFIELDS; i++) {
+		const char *s = field[i] ? field[i] : "-";
+		len[i] = strnlen(s, LOGROLL_FIELDSZ);
+		memcpy(key + n, s, len[i]);
+		n += len[i];
+		key[n++] = i < LOGROLL_NFIELDS - 1 ? '\x1f' : '\0';
+	}
+
+	pthread_mutex_lock(&lr->mutex);
+	it = kh_get(logrollmap_t, lr->map, key);
+	if (it != kh_end(lr->map)) {
+		ent = kh_val(lr->map, it);
+		ent->conns++;
+		ent->srcbytes += srcbytes;
+		ent->dstbytes += dstbytes;
+		goto out;
+	}
+	/* key, then each field NUL-terminated on its own */
+	if (!(ent = malloc(sizeof(logroll_ent_t) + 2 * n))) {
+		rv = -1;
+		goto out;
+	}
+	ent->conns = 1;
+	ent->srcbytes = srcbytes;
+	ent->dstbytes = dstbytes;
+	memcpy(ent->key, key, n);
+	p = ent->key + n;
+	for (int i = 0; i < LOGROLL_NFIELDS; i++) {
+		ent->field[i] = p;
+		memcpy(p, field[i] ? field[i] : "-", len[i]);
+		p += len[i];
+		*p++ = '\0';
+	}
+	rv = logroll_put(lr, ent);
+out:
+	pthread_mutex_unlock(&lr->mutex);
+	return rv;
+}
+
+/*
+ * Move all aggregates of src into dst, leaving src empty.  src is only
+ * locked for swapping its table.  Returns 0 on success, -1 if aggregates
+ * were lost due to allocation failure.
+ */
+int
+logroll_merge(logroll_t *dst, logroll_t *src)
+{
+	khash_t(logrollmap_t) *map, *fresh;
+	int rv = 0;
+
+	if (!(fresh = kh_init(logrollmap_t)))
+		return -1;
+	pthread_mutex_lock(&src->mutex);
+	map = src->map;
+	src->map = fresh;
+	pthread_mutex_unlock(&src->mutex);
+
+	pthread_mutex_lock(&dst->mutex);
+	for (khiter_t it = kh_begin(map); it != kh_end(map); it++) {
+		if (!kh_exist(map, it))
+			continue;
+		if (logroll_put(dst, kh_val(map, it)) == -1)
+			rv = -1;
+	}
+	pthread_mutex_unlock(&dst->mutex);
+	kh_destroy(logrollmap_t, map);
+	return rv;
+}
+
+static const char *
+logroll_nulldash(const char *s)
+{
+	return strcmp(s, "-") ? s : NULL;
+}
+
+/*
+ * Write every aggregate as one connect log line through cb and empty the
+ * table.  With js, lines are JSON objects of kind "rollup" stamped with ts
+ * in microseconds since the epoch, otherwise text lines in the order of
+ * the key fields.  period is the flush interval in seconds.  Returns 0 on
+ * success, -1 if lines were lost to allocation failure.
+ */
+int
+logroll_flush(logroll_t *lr, logjson_t *js, long long ts,
+              unsigned int period, logroll_line_cb_t cb, void *arg)
+{
+	char line[LOGROLL_LINESZ];
+	logroll_ent_t *ent;
+	int rv = 0;
+	int n;
+
+	pthread_mutex_lock(&lr->mutex);
+	for (khiter_t it = kh_begin(lr->map); it != kh_end(lr->map); it++) {
+		if (!kh_exist(lr->map, it))
+			continue;
+		ent = kh_val(lr->map, it);
+		if (js) {
+			logjson_begin(js);
+			logjson_int(js, "v", 1);
+			logjson_int(js, "ts", ts);
+			logjson_str(js, "kind", "rollup");
+			logjson_str(js, "proto", ent->field[LOGROLL_PROTO]);
+			logjson_str(js, "name", logroll_nulldash(
+			                        ent->field[LOGROLL_NAME]));
+			logjson_str(js, "dst", logroll_nulldash(
+			                       ent->field[LOGROLL_DST]));
+			logjson_int(js, "dport",
+			            atoi(ent->field[LOGROLL_DPORT]));
+			logjson_str(js, "outcome", ent->field[LOGROLL_OUTCOME]);
+			logjson_int(js, "conns", ent->conns);
+			logjson_int(js, "srcbytes", ent->srcbytes);
+			logjson_int(js, "dstbytes", ent->dstbytes);
+			logjson_int(js, "period", period);
+			if (logjson_end(js) == -1) {
+				rv = -1;
+			} else {
+				cb(js->buf, js->len, arg);
+			}
+		} else {
+			n = snprintf(line, sizeof(line), "rollup %s %s %s %s %s "
+			             "conns:%llu bytes:%llu:%llu period:%u\n",
+			             ent->field[LOGROLL_PROTO],
+			             ent->field[LOGROLL_NAME],
+			             ent->field[LOGROLL_DST],
+			             ent->field[LOGROLL_DPORT],
+			             ent->field[LOGROLL_OUTCOME],
+			             ent->conns, ent->srcbytes, ent->dstbytes,
+			             period);
+			if (n > 0 && (size_t)n < sizeof(line))
+				cb(line, n, arg);
+		}
+		free(ent);
+	}
+	kh_clear(logrollmap_t, lr->map);
+	pthread_mutex_unlock(&lr->mutex);
+	return rv;
+}
+
+/* vim: set noet ft=c: */
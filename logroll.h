@@ -0,0 +1,61 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LOGROLL_H
+#define LOGROLL_H
+
+#include "attrib.h"
+#include "logjson.h"
+
+#include <stddef.h>
+
+/*
+ * Key fields of connect log rollup aggregates.
+ */
+#define LOGROLL_PROTO	0	/* connection kind as in the connect log */
+#define LOGROLL_NAME	1	/* SNI or HTTP Host, or dash */
+#define LOGROLL_DST	2	/* destination address */
+#define LOGROLL_DPORT	3	/* destination port */
+#define LOGROLL_OUTCOME	4	/* ok, fail, sslerr or timeout */
+#define LOGROLL_NFIELDS	5
+
+typedef struct logroll logroll_t;
+typedef void (*logroll_line_cb_t)(const char *, size_t, void *);
+
+logroll_t * logroll_new(void) MALLOC;
+void logroll_free(logroll_t *) NONNULL(1);
+size_t logroll_size(logroll_t *) NONNULL(1) WUNRES;
+int logroll_add(logroll_t *, const char **, unsigned long long,
+                unsigned long long) NONNULL(1,2) WUNRES;
+int logroll_merge(logroll_t *, logroll_t *) NONNULL(1,2) WUNRES;
+int logroll_flush(logroll_t *, logjson_t *, long long, unsigned int,
+                  logroll_line_cb_t, void *) NONNULL(1,5) WUNRES;
+
+#endif /* !LOGROLL_H */
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,183 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "logroll.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <check.h>
+
+typedef struct {
+	char buf[4096];
+	size_t len;
+	int lines;
+} logroll_out_t;
+
+static void
+logroll_collect(const char *line, size_t len, void *arg)
+{
+	logroll_out_t *out = arg;
+
+	if (out->len + len < sizeof(out->buf)) {
+		memcpy(out->buf + out->len, line, len);
+		out->len += len;
+		out->buf[out->len] = '\0';
+	}
+	out->lines++;
+}
+
+START_TEST(logroll_01)
+{
+	const char *a[] = {"ssl", "example.org", "192.0.2.1", "443", "ok"};
+	const char *b[] = {"ssl", "example.org", "192.0.2.1", "443", "sslerr"};
+	logroll_out_t out = {.len = 0, .lines = 0};
+	logroll_t *lr;
+
+	lr = logroll_new();
+	fail_unless(!!lr, "logroll_new failed");
+	fail_unless(logroll_add(lr, a, 10, 100) == 0, "add failed");
+	fail_unless(logroll_add(lr, a, 5, 50) == 0, "add failed");
+	fail_unless(logroll_add(lr, b, 1, 0) == 0, "add failed");
+	fail_unless(logroll_size(lr) == 2, "wrong size");
+	fail_unless(logroll_flush(lr, NULL, 0, 60, logroll_collect, &out) == 0,
+	            "flush failed");
+	fail_unless(out.lines == 2, "wrong number of lines");
+	fail_unless(!!strstr(out.buf, "rollup ssl example.org 192.0.2.1 443 "
+	                              "ok conns:2 bytes:15:150 period:60\n"),
+	            "missing ok aggregate");
+	fail_unless(!!strstr(out.buf, "rollup ssl example.org 192.0.2.1 443 "
+	                              "sslerr conns:1 bytes:1:0 period:60\n"),
+	            "missing sslerr aggregate");
+	fail_unless(logroll_size(lr) == 0, "not empty after flush");
+	logroll_free(lr);
+}
+END_TEST
+
+START_TEST(logroll_02)
+{
+	const char *a[] = {"tcp", NULL, "192.0.2.1", "80", "ok"};
+	const char *b[] = {"tcp", NULL, "192.0.2.2", "80", "fail"};
+	logroll_out_t out = {.len = 0, .lines = 0};
+	logroll_t *dst, *src;
+
+	dst = logroll_new();
+	src = logroll_new();
+	fail_unless(dst && src, "logroll_new failed");
+	fail_unless(logroll_add(dst, a, 1, 2) == 0, "add failed");
+	fail_unless(logroll_add(src, a, 3, 4) == 0, "add failed");
+	fail_unless(logroll_add(src, b, 0, 0) == 0, "add failed");
+	fail_unless(logroll_merge(dst, src) == 0, "merge failed");
+	fail_unless(logroll_size(src) == 0, "src not empty");
+	fail_unless(logroll_size(dst) == 2, "wrong dst size");
+	fail_unless(logroll_add(src, b, 0, 0) == 0, "add after merge failed");
+	fail_unless(logroll_merge(dst, src) == 0, "merge failed");
+	fail_unless(logroll_flush(dst, NULL, 0, 1, logroll_collect, &out) == 0,
+	            "flush failed");
+	fail_unless(!!strstr(out.buf, "rollup tcp - 192.0.2.1 80 ok "
+	                              "conns:2 bytes:4:6 period:1\n"),
+	            "wrong merged aggregate");
+	fail_unless(!!strstr(out.buf, "rollup tcp - 192.0.2.2 80 fail "
+	                              "conns:2 bytes:0:0 period:1\n"),
+	            "wrong moved aggregate");
+	logroll_free(src);
+	logroll_free(dst);
+}
+END_TEST
+
+START_TEST(logroll_03)
+{
+	const char *a[] = {"http", NULL, "192.0.2.1", "8080", "timeout"};
+	logroll_out_t out = {.len = 0, .lines = 0};
+	logjson_t *js;
+	logroll_t *lr;
+
+	lr = logroll_new();
+	js = logjson_new(64);
+	fail_unless(lr && js, "allocation failed");
+	fail_unless(logroll_add(lr, a, 7, 8) == 0, "add failed");
+	fail_unless(logroll_flush(lr, js, 1000000, 30, logroll_collect,
+	                          &out) == 0, "flush failed");
+	fail_unless(out.lines == 1, "wrong number of lines");
+	fail_unless(!strcmp(out.buf, "{\"v\":1,\"ts\":1000000,"
+	                             "\"kind\":\"rollup\",\"proto\":\"http\","
+	                             "\"name\":null,\"dst\":\"192.0.2.1\","
+	                             "\"dport\":8080,\"outcome\":\"timeout\","
+	                             "\"conns\":1,\"srcbytes\":7,"
+	                             "\"dstbytes\":8,\"period\":30}\n"),
+	            "wrong JSON line");
+	logjson_free(js);
+	logroll_free(lr);
+}
+END_TEST
+
+START_TEST(logroll_04)
+{
+	char name[1024];
+	const char *a[] = {"https", name, "192.0.2.1", "443", "ok"};
+	logroll_out_t out = {.len = 0, .lines = 0};
+	logroll_t *lr;
+
+	memset(name, 'a', sizeof(name) - 1);
+	name[sizeof(name) - 1] = '\0';
+	lr = logroll_new();
+	fail_unless(!!lr, "logroll_new failed");
+	fail_unless(logroll_add(lr, a, 0, 0) == 0, "add failed");
+	name[600] = 'b';
+	fail_unless(logroll_add(lr, a, 0, 0) == 0, "add failed");
+	fail_unless(logroll_size(lr) == 1, "long names not truncated");
+	fail_unless(logroll_flush(lr, NULL, 0, 60, logroll_collect, &out) == 0,
+	            "flush failed");
+	fail_unless(!!strstr(out.buf, "aaa 192.0.2.1 443 ok conns:2 "),
+	            "wrong aggregate");
+	fail_unless(out.len == strlen("rollup https  192.0.2.1 443 ok conns:2 "
+	                              "bytes:0:0 period:60\n") + 255,
+	            "wrong line length");
+	logroll_free(lr);
+}
+END_TEST
+
+Suite *
+logroll_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("logroll");
+
+	tc = tcase_create("logroll");
+	tcase_add_test(tc, logroll_01);
+	tcase_add_test(tc, logroll_02);
+	tcase_add_test(tc, logroll_03);
+	tcase_add_test(tc, logroll_04);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
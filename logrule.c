@@ -0,0 +1,573 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "logrule.h"
+
+#include "khash.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+
+/*
+ * Content log rules decide once per connection whether and how much of its
+ * content is logged.  Each rule consists of an action and any number of
+ * criteria, all of which have to match; the first matching rule wins, and
+ * connections matching no rule are logged in full:
+ *
+ *   ACTION [sni=NAMES] [host=NAMES] [src=NETS] [dst=NETS] [port=PORTS]
+ *
+ * ACTION is one of full, headers, none or first:SIZE; NAMES, NETS and PORTS
+ * are comma-separated lists of host names, "*.domain" wildcards matching
+ * names at any depth below domain or "*" matching any name, of addresses
+ * with optional prefix length, and of destination ports or port ranges.
+ *
+ * Rules are compiled into bit sets indexed by rule number: a hash table per
+ * name criterion maps each pattern to the set of rules containing it, so
+ * matching a name costs one lookup per label instead of one comparison per
+ * pattern, and the remaining address and port criteria are only evaluated
+ * for candidate rules in rule order until the first one matches.
+ */
+
+KHASH_INIT(cstrmaskmap_t, char*, uint64_t, 1, kh_str_hash_func,
+           kh_str_hash_equal)
+
+#define LOGRULE_NAMESZ  256
+
+typedef struct {
+	int af;
+	unsigned int prefixlen;
+	uint8_t addr[16];
+} logrule_net_t;
+
+typedef struct {
+	uint16_t lo;
+	uint16_t hi;
+} logrule_ports_t;
+
+typedef struct {
+	int action;
+	size_t limit;
+	logrule_net_t *src;
+	size_t nsrc;
+	logrule_net_t *dst;
+	size_t ndst;
+	logrule_ports_t *ports;
+	size_t nports;
+} logrule_rule_t;
+
+typedef struct {
+	khash_t(cstrmaskmap_t) *map;
+	uint64_t none;          /* rules without this criterion */
+	uint64_t any;           /* rules matching any name */
+} logrule_names_t;
+
+struct logrule {
+	logrule_rule_t rules[LOGRULE_MAX];
+	unsigned int n;
+	logrule_names_t sni;
+	logrule_names_t host;
+};
+
+logrule_t *
+logrule_new(void)
+{
+	logrule_t *lr;
+
+	if (!(lr = malloc(sizeof(logrule_t))))
+		return NULL;
+	memset(lr, 0, sizeof(logrule_t));
+	if (!(lr->sni.map = kh_init(cstrmaskmap_t)))
+		goto errout;
+	if (!(lr->host.map = kh_init(cstrmaskmap_t)))
+		goto errout;
+	return lr;
+
+errout:
+	if (lr->sni.map)
+		kh_destroy(cstrmaskmap_t, lr->sni.map);
+	free(lr);
+	return NULL;
+}
+
+static void
+logrule_names_free(logrule_names_t *names)
+{
+	for (khiter_t it = kh_begin(names->map); it != kh_end(names->map);
+	     it++) {
+		if (kh_exist(names->map, it))
+			free(kh_key(names->map, it));
+	}
+	kh_destroy(cstrmaskmap_t, names->map);
+}
+
+void
+logrule_free(logrule_t *lr)
+{
+	for (unsigned int i = 0; i < lr->n; i++) {
+		free(lr->rules[i].src);
+		free(lr->rules[i].dst);
+		free(lr->rules[i].ports);
+	}
+	logrule_names_free(&lr->sni);
+	logrule_names_free(&lr->host);
+	free(lr);
+}
+
+unsigned int
+logrule_count(logrule_t *lr)
+{
+	return lr->n;
+}
+
+/*
+ * Copy name of sz octets into buf in lower case, without trailing dot.
+ * Returns the length of the copy, or 0 if the name is empty or too long.
+ */
+static size_t
+logrule_name_lower(char *buf, const char *name, size_t sz)
+{
+	if (sz > 0 && name[sz - 1] == '.')
+		sz--;
+	if (sz == 0 || sz >= LOGRULE_NAMESZ)
+		return 0;
+	for (size_t i = 0; i < sz; i++)
+		buf[i] = tolower((unsigned char)name[i]);
+	buf[sz] = '\0';
+	return sz;
+}
+
+static int
+logrule_add_name(logrule_names_t *names, uint64_t bit,
+                 const char *pat, size_t sz)
+{
+	char buf[LOGRULE_NAMESZ];
+	khiter_t it;
+	char *key;
+	int ret;
+
+	if (sz == 1 && pat[0] == '*') {
+		names->any |= bit;
+		return 0;
+	}
+	if (!(sz = logrule_name_lower(buf, pat, sz)))
+		return -1;
+	/* only a leading "*." label is supported as wildcard */
+	if (strchr(buf + 1, '*') ||
+	    (buf[0] == '*' && (sz < 3 || buf[1] != '.')))
+		return -1;
+	it = kh_get(cstrmaskmap_t, names->map, buf);
+	if (it == kh_end(names->map)) {
+		if (!(key = strdup(buf)))
+			return -1;
+		it = kh_put(cstrmaskmap_t, names->map, key, &ret);
+		if (ret == -1) {
+			free(key);
+			return -1;
+		}
+		kh_val(names->map, it) = 0;
+	}
+	kh_val(names->map, it) |= bit;
+	return 0;
+}
+
+/*
+ * Remove the rule with bit from all patterns, after failing to add it.
+ */
+static void
+logrule_names_clear(logrule_names_t *names, uint64_t bit)
+{
+	for (khiter_t it = kh_begin(names->map); it != kh_end(names->map);
+	     it++) {
+		if (kh_exist(names->map, it))
+			kh_val(names->map, it) &= ~bit;
+	}
+	names->any &= ~bit;
+}
+
+static int
+logrule_parse_net(logrule_net_t *net, const char *s, size_t sz)
+{
+	char buf[INET6_ADDRSTRLEN + 4];
+	char *slash, *end;
+	unsigned long len;
+
+	if (sz == 0 || sz >= sizeof(buf))
+		return -1;
+	memcpy(buf, s, sz);
+	buf[sz] = '\0';
+	if ((slash = strchr(buf, '/')))
+		*slash = '\0';
+	memset(net, 0, sizeof(logrule_net_t));
+	if (inet_pton(AF_INET, buf, net->addr) == 1) {
+		net->af = AF_INET;
+		net->prefixlen = 32;
+	} else if (inet_pton(AF_INET6, buf, net->addr) == 1) {
+		net->af = AF_INET6;
+		net->prefixlen = 128;
+	} else {
+		return -1;
+	}
+	if (slash) {
+		len = strtoul(slash + 1, &end, 10);
+		if (slash[1] == '\0' || *end != '\0' || len > net->prefixlen)
+			return -1;
+		net->prefixlen = len;
+	}
+	return 0;
+}
+
+static int
+logrule_parse_ports(logrule_ports_t *ports, const char *s, size_t sz)
+{
+	char buf[16];
+	char *end;
+	unsigned long lo, hi;
+
+	if (sz == 0 || sz >= sizeof(buf))
+		return -1;
+	memcpy(buf, s, sz);
+	buf[sz] = '\0';
+	lo = hi = strtoul(buf, &end, 10);
+	if (end == buf)
+		return -1;
+	if (*end == '-') {
+		s = end + 1;
+		hi = strtoul(s, &end, 10);
+		if (end == s)
+			return -1;
+	}
+	if (*end != '\0' || lo == 0 || lo > hi || hi > 65535)
+		return -1;
+	ports->lo = lo;
+	ports->hi = hi;
+	return 0;
+}
+
+/*
+ * Parse a size with optional k, M or G suffix.
+ */
+static int
+logrule_parse_size(size_t *sz, const char *s)
+{
+	unsigned long long n;
+	char *end;
+
+	n = strtoull(s, &end, 10);
+	if (end == s)
+		return -1;
+	switch (*end) {
+	case 'k':
+		n <<= 10;
+		end++;
+		break;
+	case 'M':
+		n <<= 20;
+		end++;
+		break;
+	case 'G':
+		n <<= 30;
+		end++;
+		break;
+	}
+	if (*end != '\0' && *end != ' ' && *end != '\t')
+		return -1;
+	*sz = n;
+	return 0;
+}
+
+/*
+ * Append the rule in s to the rule set.
+ * Returns 0 on success, -1 with errno set to EINVAL on syntax errors or too
+ * many rules, or to ENOMEM when out of memory.
+ */
+int
+logrule_add(logrule_t *lr, const char *s)
+{
+	logrule_rule_t *rule;
+	const char *tok, *val, *sep;
+	size_t toksz, valsz, sz, n;
+	uint64_t bit;
+	int sni = 0, host = 0;
+
+	if (lr->n == LOGRULE_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	rule = &lr->rules[lr->n];
+	memset(rule, 0, sizeof(logrule_rule_t));
+	bit = (uint64_t)1 << lr->n;
+
+	s += strspn(s, " \t");
+	toksz = strcspn(s, " \t");
+	if (toksz == 4 && !strncmp(s, "full", 4)) {
+		rule->action = LOGRULE_FULL;
+	} else if (toksz == 7 && !strncmp(s, "headers", 7)) {
+		rule->action = LOGRULE_HEADERS;
+	} else if (toksz == 4 && !strncmp(s, "none", 4)) {
+		rule->action = LOGRULE_NONE;
+	} else if (toksz > 6 && !strncmp(s, "first:", 6)) {
+		rule->action = LOGRULE_FIRST;
+		if (logrule_parse_size(&rule->limit, s + 6) == -1)
+			goto einval;
+	} else {
+		goto einval;
+	}
+
+	for (tok = s + toksz;; tok += toksz) {
+		tok += strspn(tok, " \t");
+		if (!(toksz = strcspn(tok, " \t")))
+			break;
+		if (!(sep = memchr(tok, '=', toksz)))
+			goto einval;
+		val = sep + 1;
+		valsz = toksz - (val - tok);
+		if (valsz == 0)
+			goto einval;
+		for (; valsz > 0; val += sz + 1, valsz -= sz + 1) {
+			sz = strcspn(val, ",");
+			if (sz > valsz)
+				sz = valsz;
+			if (sep - tok == 3 && !strncmp(tok, "sni", 3)) {
+				if (logrule_add_name(&lr->sni, bit,
+				                     val, sz) == -1)
+					goto errout;
+				sni = 1;
+			} else if (sep - tok == 4 && !strncmp(tok, "host", 4)) {
+				if (logrule_add_name(&lr->host, bit,
+				                     val, sz) == -1)
+					goto errout;
+				host = 1;
+			} else if (sep - tok == 3 && (!strncmp(tok, "src", 3) ||
+			                              !strncmp(tok, "dst", 3))) {
+				logrule_net_t **nets = tok[0] == 's' ?
+				                       &rule->src : &rule->dst;
+				size_t *nnets = tok[0] == 's' ?
+				                &rule->nsrc : &rule->ndst;
+				void *p;
+				n = *nnets + 1;
+				if (!(p = realloc(*nets,
+				                  n * sizeof(logrule_net_t))))
+					goto enomem;
+				*nets = p;
+				if (logrule_parse_net(&(*nets)[n - 1],
+				                      val, sz) == -1)
+					goto einval;
+				*nnets = n;
+			} else if (sep - tok == 4 && !strncmp(tok, "port", 4)) {
+				void *p;
+				n = rule->nports + 1;
+				if (!(p = realloc(rule->ports,
+				                  n * sizeof(logrule_ports_t))))
+					goto enomem;
+				rule->ports = p;
+				if (logrule_parse_ports(&rule->ports[n - 1],
+				                        val, sz) == -1)
+					goto einval;
+				rule->nports = n;
+			} else {
+				goto einval;
+			}
+			if (sz == valsz)
+				break;
+		}
+	}
+
+	if (!sni)
+		lr->sni.none |= bit;
+	if (!host)
+		lr->host.none |= bit;
+	lr->n++;
+	return 0;
+
+enomem:
+	errno = ENOMEM;
+	goto free;
+einval:
+	errno = EINVAL;
+	goto free;
+errout:
+	if (errno != ENOMEM)
+		errno = EINVAL;
+free:
+	logrule_names_clear(&lr->sni, bit);
+	logrule_names_clear(&lr->host, bit);
+	free(rule->src);
+	free(rule->dst);
+	free(rule->ports);
+	memset(rule, 0, sizeof(logrule_rule_t));
+	return -1;
+}
+
+/*
+ * Returns the set of rules whose name criterion matches name of sz octets,
+ * looking up name and all of its wildcarded forms.
+ */
+static uint64_t
+logrule_match_name(logrule_names_t *names, const char *name, size_t sz)
+{
+	char buf[LOGRULE_NAMESZ];
+	uint64_t m;
+	khiter_t it;
+	char c;
+
+	if (!(sz = logrule_name_lower(buf, name, sz)))
+		return 0;
+	m = names->any;
+	if (kh_size(names->map) == 0)
+		return m;
+	it = kh_get(cstrmaskmap_t, names->map, buf);
+	if (it != kh_end(names->map))
+		m |= kh_val(names->map, it);
+	for (size_t i = 1; i < sz; i++) {
+		if (buf[i] != '.')
+			continue;
+		c = buf[i - 1];
+		buf[i - 1] = '*';
+		it = kh_get(cstrmaskmap_t, names->map, buf + i - 1);
+		if (it != kh_end(names->map))
+			m |= kh_val(names->map, it);
+		buf[i - 1] = c;
+	}
+	return m;
+}
+
+static int
+logrule_match_nets(const logrule_net_t *nets, size_t nnets,
+                   const struct sockaddr *sa)
+{
+	const uint8_t *addr;
+	unsigned int bytes, bits;
+
+	if (!sa)
+		return 0;
+	if (sa->sa_family == AF_INET)
+		addr = (const uint8_t *)
+		       &((const struct sockaddr_in *)sa)->sin_addr;
+	else if (sa->sa_family == AF_INET6)
+		addr = (const uint8_t *)
+		       &((const struct sockaddr_in6 *)sa)->sin6_addr;
+	else
+		return 0;
+	for (size_t i = 0; i < nnets; i++) {
+		if (nets[i].af != sa->sa_family)
+			continue;
+		bytes = nets[i].prefixlen / 8;
+		bits = nets[i].prefixlen % 8;
+		if (memcmp(nets[i].addr, addr, bytes))
+			continue;
+		if (bits && ((nets[i].addr[bytes] ^ addr[bytes]) &
+		             (0xff << (8 - bits))))
+			continue;
+		return 1;
+	}
+	return 0;
+}
+
+static int
+logrule_match_ports(const logrule_ports_t *ports, size_t nports,
+                    const struct sockaddr *sa)
+{
+	uint16_t port;
+
+	if (!sa)
+		return 0;
+	if (sa->sa_family == AF_INET)
+		port = ntohs(((const struct sockaddr_in *)sa)->sin_port);
+	else if (sa->sa_family == AF_INET6)
+		port = ntohs(((const struct sockaddr_in6 *)sa)->sin6_port);
+	else
+		return 0;
+	for (size_t i = 0; i < nports; i++) {
+		if (port >= ports[i].lo && port <= ports[i].hi)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Find the first rule matching the connection described by c.  Returns the
+ * action of the rule and sets *limit for LOGRULE_FIRST, returns LOGRULE_FULL
+ * if no rule matches, or LOGRULE_PENDING if the first rule which may match
+ * has a host criterion and c->host is still pending.
+ */
+int
+logrule_match(logrule_t *lr, const logrule_conn_t *c, size_t *limit)
+{
+	logrule_rule_t *rule;
+	uint64_t cand, bit;
+	size_t sz;
+
+	if (lr->n == 0)
+		return LOGRULE_FULL;
+	cand = lr->n == 64 ? ~(uint64_t)0 : ((uint64_t)1 << lr->n) - 1;
+	cand &= lr->sni.none |
+	        (c->sni ? logrule_match_name(&lr->sni, c->sni,
+	                                     strlen(c->sni)) : 0);
+	if (c->host) {
+		/* strip port, unless IPv6 address literal */
+		sz = c->host[0] == '[' ? strlen(c->host)
+		                       : strcspn(c->host, ":");
+		cand &= lr->host.none |
+		        logrule_match_name(&lr->host, c->host, sz);
+	} else if (!c->host_pending) {
+		cand &= lr->host.none;
+	}
+
+	for (unsigned int i = 0; i < lr->n && cand; i++) {
+		bit = (uint64_t)1 << i;
+		if (!(cand & bit))
+			continue;
+		cand &= ~bit;
+		rule = &lr->rules[i];
+		if (rule->nsrc &&
+		    !logrule_match_nets(rule->src, rule->nsrc, c->srcaddr))
+			continue;
+		if (rule->ndst &&
+		    !logrule_match_nets(rule->dst, rule->ndst, c->dstaddr))
+			continue;
+		if (rule->nports &&
+		    !logrule_match_ports(rule->ports, rule->nports,
+		                         c->dstaddr))
+			continue;
+		if (!c->host && !(lr->host.none & bit))
+			return LOGRULE_PENDING;
+		*limit = rule->limit;
+		return rule->action;
+	}
+	return LOGRULE_FULL;
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,70 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LOGRULE_H
+#define LOGRULE_H
+
+#include "attrib.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stddef.h>
+
+typedef struct logrule logrule_t;
+
+/* content log actions */
+#define LOGRULE_PENDING (-1)    /* outcome depends on the HTTP Host */
+#define LOGRULE_FULL    0       /* log all content */
+#define LOGRULE_HEADERS 1       /* log HTTP headers only */
+#define LOGRULE_FIRST   2       /* log the first octets per direction */
+#define LOGRULE_NONE    3       /* log nothing */
+
+#define LOGRULE_MAX     64      /* maximum number of rules */
+
+/*
+ * Connection properties rules are matched against.  Fields not known are
+ * NULL; host_pending is set if host may still become known.
+ */
+typedef struct {
+	const struct sockaddr *srcaddr;
+	const struct sockaddr *dstaddr;
+	const char *sni;
+	const char *host;
+	int host_pending;
+} logrule_conn_t;
+
+logrule_t * logrule_new(void) MALLOC;
+void logrule_free(logrule_t *) NONNULL(1);
+int logrule_add(logrule_t *, const char *) NONNULL(1,2) WUNRES;
+int logrule_match(logrule_t *, const logrule_conn_t *, size_t *)
+     NONNULL(1,2,3) WUNRES;
+unsigned int logrule_count(logrule_t *) NONNULL(1) WUNRES;
+
+#endif /* !LOGRULE_H */
+
+/* vim: set noet ft=c: */
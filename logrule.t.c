@@ -0,0 +1,212 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "logrule.h"
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <string.h>
+
+#include <check.h>
+
+static struct sockaddr_in src4, dst4;
+static struct sockaddr_in6 dst6;
+
+static void
+logrule_setup(void)
+{
+	memset(&src4, 0, sizeof(src4));
+	src4.sin_family = AF_INET;
+	inet_pton(AF_INET, "192.168.1.10", &src4.sin_addr);
+	src4.sin_port = htons(50000);
+	memset(&dst4, 0, sizeof(dst4));
+	dst4.sin_family = AF_INET;
+	inet_pton(AF_INET, "10.1.2.3", &dst4.sin_addr);
+	dst4.sin_port = htons(443);
+	memset(&dst6, 0, sizeof(dst6));
+	dst6.sin6_family = AF_INET6;
+	inet_pton(AF_INET6, "2001:db8::1", &dst6.sin6_addr);
+	dst6.sin6_port = htons(8080);
+}
+
+static void
+logrule_teardown(void)
+{
+}
+
+static int
+logrule_t_match(logrule_t *lr, const char *sni, const char *host,
+                int pending, const void *dst, size_t *limit)
+{
+	logrule_conn_t c;
+
+	c.srcaddr = (const struct sockaddr *)&src4;
+	c.dstaddr = dst;
+	c.sni = sni;
+	c.host = host;
+	c.host_pending = pending;
+	return logrule_match(lr, &c, limit);
+}
+
+START_TEST(logrule_01)
+{
+	logrule_t *lr;
+	size_t limit = 0;
+
+	lr = logrule_new();
+	fail_unless(!!lr, "logrule_new failed");
+	fail_unless(logrule_t_match(lr, "a.example.com", NULL, 0,
+	                            &dst4, &limit) == LOGRULE_FULL,
+	            "empty rule set did not log full");
+	fail_unless(logrule_add(lr, "none sni=*.googlevideo.com,ytimg.com")
+	            == 0, "add failed");
+	fail_unless(logrule_add(lr, "first:64k dst=10.0.0.0/8") == 0,
+	            "add failed");
+	fail_unless(logrule_count(lr) == 2, "wrong count");
+
+	fail_unless(logrule_t_match(lr, "r3.SN-X.googlevideo.com.", NULL, 0,
+	                            &dst4, &limit) == LOGRULE_NONE,
+	            "deep wildcard did not match");
+	fail_unless(logrule_t_match(lr, "ytimg.com", NULL, 0,
+	                            &dst4, &limit) == LOGRULE_NONE,
+	            "exact name did not match");
+	fail_unless(logrule_t_match(lr, "googlevideo.com", NULL, 0,
+	                            &dst4, &limit) == LOGRULE_FIRST,
+	            "wildcard matched its domain");
+	fail_unless(limit == 64 * 1024, "wrong limit");
+	fail_unless(logrule_t_match(lr, NULL, NULL, 0,
+	                            &dst6, &limit) == LOGRULE_FULL,
+	            "unmatched connection not logged in full");
+	logrule_free(lr);
+}
+END_TEST
+
+START_TEST(logrule_02)
+{
+	logrule_t *lr;
+	size_t limit;
+
+	lr = logrule_new();
+	fail_unless(!!lr, "logrule_new failed");
+	fail_unless(logrule_add(lr, "headers port=8000-8999 "
+	                            "dst=2001:db8::/32") == 0, "add failed");
+	fail_unless(logrule_add(lr, "none src=192.168.1.0/25 port=443") == 0,
+	            "add failed");
+	fail_unless(logrule_t_match(lr, NULL, NULL, 0,
+	                            &dst6, &limit) == LOGRULE_HEADERS,
+	            "v6 net and port range did not match");
+	fail_unless(logrule_t_match(lr, NULL, NULL, 0,
+	                            &dst4, &limit) == LOGRULE_NONE,
+	            "src net and port did not match");
+	src4.sin_addr.s_addr = htonl(ntohl(src4.sin_addr.s_addr) + 200);
+	fail_unless(logrule_t_match(lr, NULL, NULL, 0,
+	                            &dst4, &limit) == LOGRULE_FULL,
+	            "src outside prefix matched");
+	logrule_free(lr);
+}
+END_TEST
+
+START_TEST(logrule_03)
+{
+	logrule_t *lr;
+	size_t limit;
+
+	lr = logrule_new();
+	fail_unless(!!lr, "logrule_new failed");
+	fail_unless(logrule_add(lr, "none host=video.example.com") == 0,
+	            "add failed");
+	fail_unless(logrule_add(lr, "headers dst=10.1.2.3") == 0,
+	            "add failed");
+	fail_unless(logrule_t_match(lr, NULL, NULL, 1,
+	                            &dst4, &limit) == LOGRULE_PENDING,
+	            "host rule did not defer");
+	fail_unless(logrule_t_match(lr, NULL, NULL, 0,
+	                            &dst4, &limit) == LOGRULE_HEADERS,
+	            "final decision without host wrong");
+	fail_unless(logrule_t_match(lr, NULL, "Video.Example.com:8080", 0,
+	                            &dst4, &limit) == LOGRULE_NONE,
+	            "host with port did not match");
+	fail_unless(logrule_t_match(lr, NULL, "www.example.com", 0,
+	                            &dst4, &limit) == LOGRULE_HEADERS,
+	            "other host matched");
+	logrule_free(lr);
+}
+END_TEST
+
+START_TEST(logrule_04)
+{
+	logrule_t *lr;
+	size_t limit;
+
+	lr = logrule_new();
+	fail_unless(!!lr, "logrule_new failed");
+	fail_unless(logrule_add(lr, "some") == -1, "bad action accepted");
+	fail_unless(logrule_add(lr, "none sni=a.*.com") == -1,
+	            "inner wildcard accepted");
+	fail_unless(logrule_add(lr, "none sni=x.com port=0") == -1,
+	            "port 0 accepted");
+	fail_unless(errno == EINVAL, "wrong errno");
+	fail_unless(logrule_add(lr, "none dst=10.0.0.0/33") == -1,
+	            "bad prefix accepted");
+	fail_unless(logrule_add(lr, "none foo=bar") == -1,
+	            "bad criterion accepted");
+	fail_unless(logrule_count(lr) == 0, "failed rules counted");
+	/* patterns of failed rules must not leak into later rules */
+	fail_unless(logrule_add(lr, "first:1 dst=10.9.9.9") == 0,
+	            "add failed");
+	fail_unless(logrule_t_match(lr, "x.com", NULL, 0,
+	                            &dst4, &limit) == LOGRULE_FULL,
+	            "pattern of failed rule matched");
+	for (int i = 1; i < LOGRULE_MAX; i++)
+		fail_unless(logrule_add(lr, "full") == 0, "add failed");
+	fail_unless(logrule_add(lr, "full") == -1, "too many rules");
+	logrule_free(lr);
+}
+END_TEST
+
+Suite *
+logrule_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("logrule");
+
+	tc = tcase_create("logrule");
+	tcase_add_checked_fixture(tc, logrule_setup, logrule_teardown);
+	tcase_add_test(tc, logrule_01);
+	tcase_add_test(tc, logrule_02);
+	tcase_add_test(tc, logrule_03);
+	tcase_add_test(tc, logrule_04);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,402 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "logseg.h"
+
+#include <sys/time.h>
+#include <sys/types.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+
+/*
+ * Segment store for content logs.
+ *
+ * Instead of one file per connection, the chunks of all connections handled
+ * by a writer are appended to large segment files which are rotated when they
+ * reach the configured size.  Each segment consists of three files named after
+ * the segment ID (the unix time of its creation) and the writer's shard:
+ *
+ * <segid>-<shard>.seg   Chunk payload of all connections, concatenated.
+ * <segid>-<shard>.idx   Fixed-size little-endian chunk records:
+ *                       u64 connection ID, u64 usec timestamp, u64 offset
+ *                       into the .seg file, u32 size, u32 flags, u32 segid
+ *                       and u32 record index of the connection's previous
+ *                       chunk record (0/0 for the first chunk).
+ * <segid>-<shard>.conn  One text line per connection closed in the segment:
+ *                       id shard opened closed lastseg lastrec nchunks
+ *                       bytes srchost srcport dsthost dstport sni
+ *
+ * Readers locate a connection through the .conn files and follow the chain of
+ * chunk records backwards from lastseg/lastrec, which extracts a connection
+ * in O(chunks) without scanning the payload.  Payload is written before its
+ * chunk record, so a reader never sees a record referring to missing data.
+ * Connections that were still open when sslsplit terminated can be recovered
+ * by scanning the .idx files for their connection ID.
+ *
+ * Segment files can be preallocated, written back and synced to disk as they
+ * grow according to a logsync policy, see logsync.c.
+ *
+ * A logseg_t is used exclusively by the writer thread of its shard.
+ */
+
+struct logseg {
+	char *dir;
+	unsigned int shard;
+	size_t segsz;
+	logseg_open_func_t openfn;
+	uint32_t segid;
+	uint32_t nrecs;
+	uint64_t datasz;
+	int datafd;
+	int idxfd;
+	int connfd;
+	const logsync_policy_t *policy; /* NULL unless set */
+	logsync_t datasync;
+	logsync_t idxsync;
+	logsync_t connsync;
+	int syncerr;            /* errno of failure to sync a closed file */
+};
+
+static uint64_t logseg_nextid = 0;
+
+static uint64_t
+logseg_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void
+logseg_put32(unsigned char *p, uint32_t v)
+{
+	for (int i = 0; i < 4; i++)
+		p[i] = (v >> (8 * i)) & 0xff;
+}
+
+static void
+logseg_put64(unsigned char *p, uint64_t v)
+{
+	for (int i = 0; i < 8; i++)
+		p[i] = (v >> (8 * i)) & 0xff;
+}
+
+static int
+logseg_writeall(int fd, const void *buf, size_t sz)
+{
+	const unsigned char *p = buf;
+	ssize_t n;
+
+	while (sz > 0) {
+		n = write(fd, p, sz);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		sz -= n;
+	}
+	return 0;
+}
+
+/*
+ * Create a segment store for shard *shard* in directory *dir*, rotating
+ * segments when they would exceed *segsz* octets.  Files are opened lazily
+ * on first write using *openfn*, which is passed the full path and returns a
+ * writable fd positioned anywhere.
+ */
+logseg_t *
+logseg_new(const char *dir, unsigned int shard, size_t segsz,
+           logseg_open_func_t openfn)
+{
+	logseg_t *seg;
+	uint64_t zero = 0;
+
+	seg = malloc(sizeof(logseg_t));
+	if (!seg)
+		return NULL;
+	memset(seg, 0, sizeof(logseg_t));
+	seg->dir = strdup(dir);
+	if (!seg->dir) {
+		free(seg);
+		return NULL;
+	}
+	seg->shard = shard;
+	seg->segsz = segsz;
+	seg->openfn = openfn;
+	seg->datafd = seg->idxfd = seg->connfd = -1;
+
+	/* seed connection IDs with the startup time so that they are unique
+	 * across restarts appending to the same segments */
+	__atomic_compare_exchange_n(&logseg_nextid, &zero, logseg_now(), 0,
+	                            __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	return seg;
+}
+
+/*
+ * Apply logsync *policy* to the segment files opened from now on.
+ */
+void
+logseg_set_sync(logseg_t *seg, const logsync_policy_t *policy)
+{
+	seg->policy = logsync_policy_isset(policy) ? policy : NULL;
+}
+
+static void
+logseg_closefile(logseg_t *seg, int *fd, logsync_t *ls)
+{
+	if (*fd == -1)
+		return;
+	if (seg->policy && logsync_close(ls) == -1)
+		seg->syncerr = errno;
+	close(*fd);
+	*fd = -1;
+}
+
+static void
+logseg_close_segment(logseg_t *seg)
+{
+	logseg_closefile(seg, &seg->datafd, &seg->datasync);
+	logseg_closefile(seg, &seg->idxfd, &seg->idxsync);
+	logseg_closefile(seg, &seg->connfd, &seg->connsync);
+}
+
+void
+logseg_free(logseg_t *seg)
+{
+	logseg_close_segment(seg);
+	free(seg->dir);
+	free(seg);
+}
+
+static int
+logseg_openfile(logseg_t *seg, uint32_t segid, const char *ext, off_t *sz,
+                logsync_t *ls)
+{
+	char *fn;
+	int fd;
+
+	if (asprintf(&fn, "%s/%u-%u.%s", seg->dir, segid, seg->shard, ext) < 0)
+		return -1;
+	fd = seg->openfn(fn);
+	free(fn);
+	if (fd == -1)
+		return -1;
+	*sz = lseek(fd, 0, SEEK_END);
+	if (*sz == -1) {
+		close(fd);
+		return -1;
+	}
+	if (seg->policy)
+		logsync_init(ls, seg->policy, fd, *sz);
+	return fd;
+}
+
+/*
+ * Open a new segment.  If a segment with the same ID exists, for instance
+ * after a quick restart, it is appended to; a partially written trailing
+ * chunk record is discarded.
+ */
+static int
+logseg_open_segment(logseg_t *seg)
+{
+	uint32_t segid;
+	off_t sz;
+
+	logseg_close_segment(seg);
+	segid = (uint32_t)time(NULL);
+	if (segid <= seg->segid)
+		segid = seg->segid + 1;
+
+	if ((seg->datafd = logseg_openfile(seg, segid, "seg", &sz,
+	                                      &seg->datasync)) == -1)
+		goto errout;
+	seg->datasz = sz;
+	if ((seg->idxfd = logseg_openfile(seg, segid, "idx", &sz,
+	                                     &seg->idxsync)) == -1)
+		goto errout;
+	if (sz % LOGSEG_RECSZ) {
+		sz -= sz % LOGSEG_RECSZ;
+		if (ftruncate(seg->idxfd, sz) == -1 ||
+		    lseek(seg->idxfd, sz, SEEK_SET) == -1)
+			goto errout;
+		if (seg->policy)
+			logsync_init(&seg->idxsync, seg->policy,
+			             seg->idxfd, sz);
+	}
+	seg->nrecs = sz / LOGSEG_RECSZ;
+	if ((seg->connfd = logseg_openfile(seg, segid, "conn", &sz,
+	                                      &seg->connsync)) == -1)
+		goto errout;
+	seg->segid = segid;
+	return 0;
+
+errout:
+	logseg_close_segment(seg);
+	return -1;
+}
+
+/*
+ * Initialize the state of a new connection.  Host and port strings are
+ * expected not to contain whitespace; sni may be NULL.
+ * Called from connection handling threads.
+ */
+int
+logseg_conn_init(logseg_conn_t *conn, const char *srchost, const char *srcport,
+                 const char *dsthost, const char *dstport, const char *sni)
+{
+	memset(conn, 0, sizeof(logseg_conn_t));
+	if (asprintf(&conn->meta, "%s %s %s %s %s", srchost, srcport,
+	             dsthost, dstport, sni && *sni ? sni : "-") < 0) {
+		conn->meta = NULL;
+		return -1;
+	}
+	if (sni && *sni) {
+		/* keep the line format intact for any SNI sent by clients */
+		for (unsigned char *p = (unsigned char *)conn->meta +
+		                        strlen(conn->meta) - strlen(sni);
+		     *p; p++) {
+			if (*p <= ' ' || *p >= 0x7f)
+				*p = '_';
+		}
+	}
+	conn->id = __atomic_fetch_add(&logseg_nextid, 1, __ATOMIC_RELAXED);
+	conn->opened = logseg_now();
+	return 0;
+}
+
+void
+logseg_conn_free(logseg_conn_t *conn)
+{
+	if (conn->meta) {
+		free(conn->meta);
+		conn->meta = NULL;
+	}
+}
+
+/*
+ * Report a failure to sync a file of a previous segment to disk once.
+ */
+static int
+logseg_syncerr(logseg_t *seg)
+{
+	if (!seg->syncerr)
+		return 0;
+	errno = seg->syncerr;
+	seg->syncerr = 0;
+	return -1;
+}
+
+/*
+ * Append a chunk of sz octets from buf to the segment store, rotating the
+ * segment if it would exceed the configured size.
+ * Returns 0 on success, -1 on errors, including failures to sync data to disk
+ * according to the logsync policy.
+ */
+int
+logseg_write(logseg_t *seg, logseg_conn_t *conn, unsigned int flags,
+             const void *buf, size_t sz)
+{
+	unsigned char rec[LOGSEG_RECSZ];
+	off_t off;
+
+	if (seg->datafd == -1 ||
+	    (seg->datasz > 0 && seg->datasz + sz > seg->segsz)) {
+		if (logseg_open_segment(seg) == -1)
+			return -1;
+	}
+
+	if (sz > 0 && logseg_writeall(seg->datafd, buf, sz) == -1) {
+		/* resync the offset in case of a partial write */
+		if ((off = lseek(seg->datafd, 0, SEEK_END)) != -1)
+			seg->datasz = off;
+		return -1;
+	}
+
+	logseg_put64(rec, conn->id);
+	logseg_put64(rec + 8, logseg_now());
+	logseg_put64(rec + 16, seg->datasz);
+	logseg_put32(rec + 24, sz);
+	logseg_put32(rec + 28, flags);
+	logseg_put32(rec + 32, conn->lastseg);
+	logseg_put32(rec + 36, conn->lastrec);
+	seg->datasz += sz;
+	if (logseg_writeall(seg->idxfd, rec, sizeof(rec)) == -1) {
+		/* force a new segment, discarding any partial record */
+		logseg_close_segment(seg);
+		return -1;
+	}
+
+	conn->lastseg = seg->segid;
+	conn->lastrec = seg->nrecs++;
+	conn->nchunks++;
+	conn->bytes += sz;
+	if (seg->policy &&
+	    (logsync_wrote(&seg->datasync, sz) == -1 ||
+	     logsync_wrote(&seg->idxsync, sizeof(rec)) == -1))
+		return -1;
+	return logseg_syncerr(seg);
+}
+
+/*
+ * Log the end of a connection: append an EOF chunk record with *flags* and
+ * the connection's line to the .conn file of the current segment.
+ * Returns 0 on success, -1 on errors.
+ */
+int
+logseg_close(logseg_t *seg, logseg_conn_t *conn, unsigned int flags)
+{
+	char *line;
+	int len, rv;
+
+	if (logseg_write(seg, conn, flags | LOGSEG_EOF, NULL, 0) == -1)
+		return -1;
+	len = asprintf(&line, "%llu %u %llu %llu %u %u %llu %llu %s\n",
+	               (unsigned long long)conn->id, seg->shard,
+	               (unsigned long long)conn->opened,
+	               (unsigned long long)logseg_now(),
+	               conn->lastseg, conn->lastrec,
+	               (unsigned long long)conn->nchunks,
+	               (unsigned long long)conn->bytes,
+	               conn->meta ? conn->meta : "- - - - -");
+	if (len < 0)
+		return -1;
+	rv = logseg_writeall(seg->connfd, line, len);
+	free(line);
+	if (rv == 0 && seg->policy &&
+	    logsync_wrote(&seg->connsync, len) == -1)
+		rv = -1;
+	return rv;
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,78 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LOGSEG_H
+#define LOGSEG_H
+
+#include "attrib.h"
+#include "logsync.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef struct logseg logseg_t;
+typedef int (*logseg_open_func_t)(const char *);
+
+/* size of a chunk record in the .idx files */
+#define LOGSEG_RECSZ    40
+
+/* chunk record flags */
+#define LOGSEG_REQUEST  1
+#define LOGSEG_EOF      2
+#define LOGSEG_TRUNC    4       /* later octets not logged */
+
+/*
+ * State of a connection logged to a segment store.  Initialized by the
+ * connection handling thread, then only used by the writer of the store.
+ */
+typedef struct logseg_conn {
+	uint64_t id;
+	uint64_t opened;        /* usec since the epoch */
+	uint32_t lastseg;       /* segment of last chunk record, 0 if none */
+	uint32_t lastrec;       /* index of last chunk record in lastseg */
+	uint64_t nchunks;
+	uint64_t bytes;
+	char *meta;             /* addresses and SNI */
+} logseg_conn_t;
+
+logseg_t * logseg_new(const char *, unsigned int, size_t,
+                      logseg_open_func_t) NONNULL(1,4) MALLOC;
+void logseg_free(logseg_t *) NONNULL(1);
+void logseg_set_sync(logseg_t *, const logsync_policy_t *) NONNULL(1,2);
+int logseg_conn_init(logseg_conn_t *, const char *, const char *,
+                     const char *, const char *, const char *)
+                     NONNULL(1,2,3,4,5) WUNRES;
+void logseg_conn_free(logseg_conn_t *) NONNULL(1);
+int logseg_write(logseg_t *, logseg_conn_t *, unsigned int,
+                 const void *, size_t) NONNULL(1,2) WUNRES;
+int logseg_close(logseg_t *, logseg_conn_t *, unsigned int)
+                 NONNULL(1,2) WUNRES;
+
+#endif /* !LOGSEG_H */
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,387 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "logseg.h"
+
+#include <sys/types.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <check.h>
+
+static char template[] = "/tmp/sslsplit.test.XXXXXX";
+static char *basedir;
+
+static void
+logseg_setup(void)
+{
+	basedir = strdup(template);
+	if (!mkdtemp(basedir)) {
+		perror("mkdtemp");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void
+logseg_teardown(void)
+{
+	struct dirent *de;
+	DIR *d;
+
+	d = opendir(basedir);
+	if (d) {
+		while ((de = readdir(d))) {
+			if (de->d_name[0] != '.')
+				unlinkat(dirfd(d), de->d_name, 0);
+		}
+		closedir(d);
+	}
+	rmdir(basedir);
+	free(basedir);
+}
+
+static int
+logseg_t_open(const char *fn)
+{
+	return open(fn, O_RDWR|O_CREAT, 0600);
+}
+
+static uint64_t
+logseg_t_get(const unsigned char *p, int n)
+{
+	uint64_t v = 0;
+
+	for (int i = n - 1; i >= 0; i--)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+/*
+ * Find the line of connection id in any .conn file of the store.
+ */
+static int
+logseg_t_conn(uint64_t id, unsigned int *lastseg, unsigned int *lastrec,
+              unsigned long long *nchunks, char *meta, size_t metasz)
+{
+	unsigned long long cid, opened, closed, bytes;
+	unsigned int shard;
+	struct dirent *de;
+	char line[512], *fn;
+	int found = 0, n;
+	FILE *f;
+	DIR *d;
+
+	d = opendir(basedir);
+	fail_unless(!!d, "opendir failed");
+	while (!found && (de = readdir(d))) {
+		if (!strstr(de->d_name, ".conn"))
+			continue;
+		fail_unless(asprintf(&fn, "%s/%s", basedir, de->d_name) > 0,
+		            "asprintf failed");
+		f = fopen(fn, "r");
+		free(fn);
+		fail_unless(!!f, "fopen failed");
+		while (fgets(line, sizeof(line), f)) {
+			fail_unless(sscanf(line, "%llu %u %llu %llu %u %u "
+			                   "%llu %llu %n", &cid, &shard,
+			                   &opened, &closed, lastseg, lastrec,
+			                   nchunks, &bytes, &n) == 8,
+			            "malformed conn line");
+			if (cid != id)
+				continue;
+			fail_unless(closed >= opened, "closed before opened");
+			snprintf(meta, metasz, "%s", line + n);
+			found = 1;
+			break;
+		}
+		fclose(f);
+	}
+	closedir(d);
+	return found ? 0 : -1;
+}
+
+/*
+ * Extract connection id by following its chain of chunk records backwards,
+ * the way a reader would.  Returns the number of payload octets.
+ */
+static size_t
+logseg_t_extract(uint64_t id, unsigned int shard, unsigned char *out,
+                 size_t outsz, unsigned int *nflags, unsigned int *flags)
+{
+	unsigned char rec[LOGSEG_RECSZ];
+	unsigned int seg, idx, size, n = 0;
+	unsigned long long nchunks;
+	char meta[256], *fn;
+	size_t len = 0;
+	int fd;
+
+	fail_unless(logseg_t_conn(id, &seg, &idx, &nchunks,
+	                          meta, sizeof(meta)) == 0,
+	            "connection not found");
+	while (seg) {
+		fail_unless(asprintf(&fn, "%s/%u-%u.idx",
+		                     basedir, seg, shard) > 0,
+		            "asprintf failed");
+		fd = open(fn, O_RDONLY);
+		free(fn);
+		fail_unless(fd != -1, "open idx failed");
+		fail_unless(pread(fd, rec, sizeof(rec),
+		                  (off_t)idx * LOGSEG_RECSZ) == sizeof(rec),
+		            "short idx read");
+		close(fd);
+		fail_unless(logseg_t_get(rec, 8) == id, "wrong connection id");
+		size = logseg_t_get(rec + 24, 4);
+		flags[n++] = logseg_t_get(rec + 28, 4);
+		fail_unless(len + size <= outsz, "output too long");
+		/* chunks are visited last to first */
+		memmove(out + size, out, len);
+		if (size > 0) {
+			fail_unless(asprintf(&fn, "%s/%u-%u.seg",
+			                     basedir, seg, shard) > 0,
+			            "asprintf failed");
+			fd = open(fn, O_RDONLY);
+			free(fn);
+			fail_unless(fd != -1, "open seg failed");
+			fail_unless(pread(fd, out, size,
+			                  logseg_t_get(rec + 16, 8)) ==
+			            (ssize_t)size, "short seg read");
+			close(fd);
+		}
+		len += size;
+		seg = logseg_t_get(rec + 32, 4);
+		idx = logseg_t_get(rec + 36, 4);
+	}
+	fail_unless(n == nchunks, "wrong number of chunks");
+	/* flags were collected last to first */
+	for (unsigned int i = 0; i < n / 2; i++) {
+		unsigned int tmp = flags[i];
+		flags[i] = flags[n - 1 - i];
+		flags[n - 1 - i] = tmp;
+	}
+	*nflags = n;
+	return len;
+}
+
+START_TEST(logseg_01)
+{
+	logseg_conn_t c1, c2;
+	unsigned char out[64];
+	unsigned int flags[8], nflags;
+	logseg_t *seg;
+	size_t sz;
+
+	seg = logseg_new(basedir, 3, 1024, logseg_t_open);
+	fail_unless(!!seg, "new failed");
+	fail_unless(logseg_conn_init(&c1, "192.0.2.1", "1234",
+	                             "192.0.2.2", "443",
+	                             "www.example.org") == 0,
+	            "conn_init failed");
+	fail_unless(logseg_conn_init(&c2, "2001:db8::1", "5678",
+	                             "2001:db8::2", "80", NULL) == 0,
+	            "conn_init failed");
+	fail_unless(c1.id != c2.id, "connection ids not unique");
+	fail_unless(logseg_write(seg, &c1, LOGSEG_REQUEST,
+	                         "GET / HTTP/1.1\r\n", 16) == 0,
+	            "write failed");
+	fail_unless(logseg_write(seg, &c2, LOGSEG_REQUEST, "hello", 5) == 0,
+	            "write failed");
+	fail_unless(logseg_write(seg, &c1, 0, "HTTP/1.1 200 OK\r\n", 17) == 0,
+	            "write failed");
+	fail_unless(logseg_write(seg, &c2, 0, "world", 5) == 0,
+	            "write failed");
+	fail_unless(logseg_close(seg, &c2, 0) == 0, "close failed");
+	fail_unless(logseg_close(seg, &c1, LOGSEG_REQUEST) == 0,
+	            "close failed");
+	logseg_conn_free(&c1);
+	logseg_conn_free(&c2);
+	logseg_free(seg);
+
+	sz = logseg_t_extract(c1.id, 3, out, sizeof(out), &nflags, flags);
+	fail_unless(sz == 33, "wrong size");
+	fail_unless(!memcmp(out, "GET / HTTP/1.1\r\nHTTP/1.1 200 OK\r\n", 33),
+	            "wrong payload");
+	fail_unless(nflags == 3, "wrong number of chunks");
+	fail_unless(flags[0] == LOGSEG_REQUEST, "wrong flags 0");
+	fail_unless(flags[1] == 0, "wrong flags 1");
+	fail_unless(flags[2] == (LOGSEG_REQUEST|LOGSEG_EOF), "wrong flags 2");
+
+	sz = logseg_t_extract(c2.id, 3, out, sizeof(out), &nflags, flags);
+	fail_unless(sz == 10, "wrong size");
+	fail_unless(!memcmp(out, "helloworld", 10), "wrong payload");
+	fail_unless(nflags == 3, "wrong number of chunks");
+	fail_unless(flags[2] == LOGSEG_EOF, "wrong flags 2");
+}
+END_TEST
+
+START_TEST(logseg_02)
+{
+	logseg_conn_t c1, c2;
+	unsigned char out[64];
+	unsigned int flags[16], nflags;
+	struct dirent *de;
+	logseg_t *seg;
+	size_t sz;
+	int nsegs = 0;
+	DIR *d;
+
+	/* segments hold at most 8 octets, forcing rotation */
+	seg = logseg_new(basedir, 0, 8, logseg_t_open);
+	fail_unless(!!seg, "new failed");
+	fail_unless(logseg_conn_init(&c1, "192.0.2.1", "1234",
+	                             "192.0.2.2", "443", NULL) == 0,
+	            "conn_init failed");
+	fail_unless(logseg_conn_init(&c2, "192.0.2.3", "1234",
+	                             "192.0.2.2", "443", NULL) == 0,
+	            "conn_init failed");
+	fail_unless(logseg_write(seg, &c1, 0, "abcdef", 6) == 0,
+	            "write failed");
+	fail_unless(logseg_write(seg, &c2, 0, "123", 3) == 0,
+	            "write failed");
+	fail_unless(logseg_write(seg, &c1, 0, "ghijklmnopqr", 12) == 0,
+	            "write failed");
+	fail_unless(logseg_write(seg, &c2, 0, "45", 2) == 0,
+	            "write failed");
+	fail_unless(logseg_write(seg, &c1, 0, "st", 2) == 0,
+	            "write failed");
+	fail_unless(logseg_close(seg, &c1, 0) == 0, "close failed");
+	fail_unless(logseg_close(seg, &c2, 0) == 0, "close failed");
+	logseg_conn_free(&c1);
+	logseg_conn_free(&c2);
+	logseg_free(seg);
+
+	d = opendir(basedir);
+	fail_unless(!!d, "opendir failed");
+	while ((de = readdir(d))) {
+		if (strstr(de->d_name, ".seg"))
+			nsegs++;
+	}
+	closedir(d);
+	fail_unless(nsegs == 4, "wrong number of segments");
+
+	sz = logseg_t_extract(c1.id, 0, out, sizeof(out), &nflags, flags);
+	fail_unless(sz == 20, "wrong size");
+	fail_unless(!memcmp(out, "abcdefghijklmnopqrst", 20),
+	            "wrong payload");
+	fail_unless(nflags == 4, "wrong number of chunks");
+	sz = logseg_t_extract(c2.id, 0, out, sizeof(out), &nflags, flags);
+	fail_unless(sz == 5, "wrong size");
+	fail_unless(!memcmp(out, "12345", 5), "wrong payload");
+}
+END_TEST
+
+START_TEST(logseg_03)
+{
+	logseg_conn_t c;
+	logseg_t *seg;
+	unsigned long long nchunks;
+	unsigned int lastseg, lastrec;
+	char meta[256];
+
+	seg = logseg_new(basedir, 0, 1024, logseg_t_open);
+	fail_unless(!!seg, "new failed");
+	fail_unless(logseg_conn_init(&c, "192.0.2.1", "1234",
+	                             "192.0.2.2", "443",
+	                             "evil host\n.example") == 0,
+	            "conn_init failed");
+	fail_unless(logseg_close(seg, &c, 0) == 0, "close failed");
+	logseg_conn_free(&c);
+	logseg_free(seg);
+
+	fail_unless(logseg_t_conn(c.id, &lastseg, &lastrec, &nchunks,
+	                          meta, sizeof(meta)) == 0,
+	            "connection not found");
+	fail_unless(nchunks == 1, "wrong number of chunks");
+	fail_unless(lastrec == 0, "wrong record");
+	fail_unless(!strcmp(meta, "192.0.2.1 1234 192.0.2.2 443 "
+	                          "evil_host_.example\n"),
+	            "SNI not sanitized");
+}
+END_TEST
+
+START_TEST(logseg_04)
+{
+	logseg_conn_t c;
+	logseg_t *seg;
+	unsigned char out[64];
+	unsigned int flags[8], nflags;
+	char *fn;
+	int fd;
+
+	/* a truncated trailing record is discarded when appending */
+	seg = logseg_new(basedir, 0, 1024, logseg_t_open);
+	fail_unless(!!seg, "new failed");
+	fail_unless(logseg_conn_init(&c, "192.0.2.1", "1234",
+	                             "192.0.2.2", "443", NULL) == 0,
+	            "conn_init failed");
+	fail_unless(logseg_write(seg, &c, 0, "abc", 3) == 0, "write failed");
+	fail_unless(asprintf(&fn, "%s/%u-0.idx", basedir, c.lastseg) > 0,
+	            "asprintf failed");
+	fd = open(fn, O_WRONLY|O_APPEND);
+	free(fn);
+	fail_unless(fd != -1, "open failed");
+	fail_unless(write(fd, "junk", 4) == 4, "write failed");
+	close(fd);
+	logseg_free(seg);
+
+	seg = logseg_new(basedir, 0, 1024, logseg_t_open);
+	fail_unless(!!seg, "new failed");
+	fail_unless(logseg_write(seg, &c, 0, "def", 3) == 0, "write failed");
+	fail_unless(logseg_close(seg, &c, 0) == 0, "close failed");
+	logseg_conn_free(&c);
+	logseg_free(seg);
+
+	fail_unless(logseg_t_extract(c.id, 0, out, sizeof(out),
+	                             &nflags, flags) == 6, "wrong size");
+	fail_unless(!memcmp(out, "abcdef", 6), "wrong payload");
+}
+END_TEST
+
+Suite *
+logseg_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("logseg");
+
+	tc = tcase_create("logseg");
+	tcase_add_checked_fixture(tc, logseg_setup, logseg_teardown);
+	tcase_add_test(tc, logseg_01);
+	tcase_add_test(tc, logseg_02);
+	tcase_add_test(tc, logseg_03);
+	tcase_add_test(tc, logseg_04);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
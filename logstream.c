@@ -0,0 +1,515 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "logstream.h"
+
+#include "sys.h"
+#include "log.h"
+
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+
+/*
+ * Network streaming export of content logs.
+ *
+ * Plaintext chunks of all connections are sent as frames over a single TCP
+ * or Unix domain socket connection to a collector.  The single producer,
+ * the writer thread of the stream log, only appends frames to a bounded
+ * buffer; a sender thread owned by the stream takes all frames accumulated
+ * so far and sends them with a single blocking write, such that frames are
+ * batched naturally whenever the collector or the network is slower than
+ * the producer.  If the collector is unreachable, the sender reconnects
+ * every LOGSTREAM_RETRY seconds while frames accumulate; frames that do not
+ * fit into the buffer and frames lost with a failed connection are dropped
+ * and reported by a LOGSTREAM_DROP frame in front of the next frame that
+ * fits.  The producer therefore never waits for the network.
+ *
+ * Each frame starts with a header of LOGSTREAM_HDRSZ octets:  u32 length of
+ * the remainder of the frame following this field, u8 type, u8 flags, u16
+ * reserved, u64 connection ID and u64 usec timestamp, followed by the
+ * payload.  Each connection to the collector starts with a LOGSTREAM_HELLO
+ * frame carrying the u32 LOGSTREAM_VERSION.  LOGSTREAM_OPEN frames carry
+ * "srchost srcport dsthost dstport sni", LOGSTREAM_DATA frames a chunk of
+ * plaintext, LOGSTREAM_CLOSE frames no payload and LOGSTREAM_DROP frames
+ * the u64 number of frames dropped since the last report.  LOGSTREAM_REQUEST
+ * in the flags marks data sent and connections closed by the client.  After
+ * a reconnect, collectors can receive frames of connections opened before.
+ */
+
+#define LOGSTREAM_MINSZ         (64*1024)
+#define LOGSTREAM_RETRY         1       /* seconds between connect attempts */
+#define LOGSTREAM_TIMEOUT       5       /* seconds for connect and send */
+
+struct logstream {
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	int fd;                 /* owned by the sender thread */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t thr;
+	int running;
+	int stopping;
+	unsigned char *fill;    /* frames appended by the producer */
+	size_t filllen;
+	size_t fillnfr;
+	unsigned char *spare;   /* buffer to swap in for fill */
+	size_t cap;             /* capacity of each buffer */
+	size_t maxdata;         /* maximum payload per frame */
+	uint64_t dropped;       /* frames dropped, not yet reported */
+	uint64_t dropped_total;
+};
+
+static uint64_t
+logstream_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void
+logstream_put32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void
+logstream_put64(unsigned char *p, uint64_t v)
+{
+	logstream_put32(p, v >> 32);
+	logstream_put32(p + 4, v);
+}
+
+/*
+ * Parse dest, either the path of a Unix domain socket starting with a slash
+ * or a host:port or [host]:port address.  Returns -1 on errors, 0 on success.
+ */
+static int
+logstream_parse(logstream_t *stream, const char *dest)
+{
+	struct sockaddr_un *sun = (struct sockaddr_un *)&stream->addr;
+	char *host, *port;
+	size_t sz;
+
+	if (dest[0] == '/') {
+		sz = strlen(dest);
+		if (sz >= sizeof(sun->sun_path)) {
+			log_err_printf("Content stream socket path too long: "
+			               "%s\n", dest);
+			return -1;
+		}
+		sun->sun_family = AF_UNIX;
+		memcpy(sun->sun_path, dest, sz + 1);
+		stream->addrlen = sizeof(struct sockaddr_un);
+		return 0;
+	}
+
+	if (!(host = strdup(dest)))
+		return -1;
+	if (!(port = strrchr(host, ':')) || port == host || port[1] == '\0') {
+		log_err_printf("Invalid content stream destination '%s', "
+		               "use host:port or /path\n", dest);
+		goto errout;
+	}
+	*port++ = '\0';
+	sz = strlen(host);
+	if (host[0] == '[' && sz > 2 && host[sz - 1] == ']') {
+		host[sz - 1] = '\0';
+		memmove(host, host + 1, sz - 1);
+	}
+	if (sys_sockaddr_parse(&stream->addr, &stream->addrlen,
+	                       host, port, AF_UNSPEC, 0) == -1)
+		goto errout;
+	free(host);
+	return 0;
+
+errout:
+	free(host);
+	return -1;
+}
+
+/*
+ * Create a content stream to the collector at dest, see logstream_parse(),
+ * buffering at most bufsz octets of frames.  Addresses are resolved
+ * immediately, such that no name resolution is needed after dropping
+ * privileges.  Does not start the sender thread yet.
+ * Returns NULL and sets errno on errors.
+ */
+logstream_t *
+logstream_new(const char *dest, size_t bufsz)
+{
+	logstream_t *stream;
+
+	if (bufsz / 2 < LOGSTREAM_MINSZ) {
+		errno = EINVAL;
+		return NULL;
+	}
+	stream = malloc(sizeof(logstream_t));
+	if (!stream)
+		return NULL;
+	memset(stream, 0, sizeof(logstream_t));
+	stream->fd = -1;
+	stream->cap = bufsz / 2;
+	stream->maxdata = stream->cap / 4 - LOGSTREAM_HDRSZ;
+	if (logstream_parse(stream, dest) == -1) {
+		errno = EINVAL;
+		goto errout;
+	}
+	if (!(stream->fill = malloc(stream->cap)) ||
+	    !(stream->spare = malloc(stream->cap)))
+		goto errout;
+	if (pthread_mutex_init(&stream->mutex, NULL))
+		goto errout;
+	if (pthread_cond_init(&stream->cond, NULL)) {
+		pthread_mutex_destroy(&stream->mutex);
+		goto errout;
+	}
+	return stream;
+
+errout:
+	if (stream->fill)
+		free(stream->fill);
+	if (stream->spare)
+		free(stream->spare);
+	free(stream);
+	return NULL;
+}
+
+/*
+ * Send all of buf.  Returns -1 on errors and timeouts, 0 on success.
+ */
+static int
+logstream_send(int fd, const unsigned char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+#ifdef MSG_NOSIGNAL
+		n = send(fd, buf, len, MSG_NOSIGNAL);
+#else /* !MSG_NOSIGNAL */
+		n = send(fd, buf, len, 0);
+#endif /* !MSG_NOSIGNAL */
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Connect to the collector and send the LOGSTREAM_HELLO frame, waiting at
+ * most LOGSTREAM_TIMEOUT seconds for each.  Called on the sender thread.
+ * Returns -1 if the collector is unavailable, 0 if connected.
+ */
+static int
+logstream_connect(logstream_t *stream)
+{
+	struct timeval tv = {LOGSTREAM_TIMEOUT, 0};
+	unsigned char hello[LOGSTREAM_HDRSZ + 4];
+	struct pollfd pfd;
+	int fd, flags, err;
+	socklen_t errsz = sizeof(err);
+
+	if ((fd = socket(stream->addr.ss_family, SOCK_STREAM, 0)) == -1)
+		goto errout;
+	if ((flags = fcntl(fd, F_GETFL)) == -1 ||
+	    fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+		goto errout;
+	if (connect(fd, (struct sockaddr *)&stream->addr,
+	            stream->addrlen) == -1) {
+		if (errno != EINPROGRESS)
+			goto errout;
+		pfd.fd = fd;
+		pfd.events = POLLOUT;
+		if (poll(&pfd, 1, LOGSTREAM_TIMEOUT * 1000) != 1)
+			goto errout;
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errsz) == -1 ||
+		    err != 0)
+			goto errout;
+	}
+	if (fcntl(fd, F_SETFL, flags) == -1 ||
+	    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == -1)
+		goto errout;
+#ifdef SO_NOSIGPIPE
+	flags = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE,
+	               &flags, sizeof(flags)) == -1)
+		goto errout;
+#endif /* SO_NOSIGPIPE */
+
+	memset(hello, 0, sizeof(hello));
+	logstream_put32(hello, sizeof(hello) - 4);
+	hello[4] = LOGSTREAM_HELLO;
+	logstream_put64(hello + 16, logstream_now());
+	logstream_put32(hello + LOGSTREAM_HDRSZ, LOGSTREAM_VERSION);
+	if (logstream_send(fd, hello, sizeof(hello)) == -1)
+		goto errout;
+	stream->fd = fd;
+	log_dbg_printf("Content stream connected\n");
+	return 0;
+
+errout:
+	if (fd != -1)
+		close(fd);
+	return -1;
+}
+
+/*
+ * Sender thread, sending all frames accumulated since the last send at
+ * once and reconnecting as needed.  On shutdown, sends the remaining frames
+ * unless the collector is unavailable.
+ */
+static void *
+logstream_thread(void *arg)
+{
+	logstream_t *stream = arg;
+	struct timespec deadline;
+	unsigned char *buf;
+	size_t len, nfr;
+	int rv;
+
+	pthread_mutex_lock(&stream->mutex);
+	for (;;) {
+		while (!stream->stopping && stream->filllen == 0)
+			pthread_cond_wait(&stream->cond, &stream->mutex);
+		if (stream->filllen == 0)
+			break;
+		if (stream->fd == -1) {
+			pthread_mutex_unlock(&stream->mutex);
+			rv = logstream_connect(stream);
+			pthread_mutex_lock(&stream->mutex);
+			if (rv == -1) {
+				if (stream->stopping)
+					break;
+				clock_gettime(CLOCK_REALTIME, &deadline);
+				deadline.tv_sec += LOGSTREAM_RETRY;
+				while (!stream->stopping &&
+				       pthread_cond_timedwait(&stream->cond,
+				                              &stream->mutex,
+				                              &deadline)
+				       != ETIMEDOUT);
+				continue;
+			}
+		}
+		buf = stream->fill;
+		len = stream->filllen;
+		nfr = stream->fillnfr;
+		stream->fill = stream->spare;
+		stream->filllen = 0;
+		stream->fillnfr = 0;
+		pthread_mutex_unlock(&stream->mutex);
+		rv = logstream_send(stream->fd, buf, len);
+		if (rv == -1) {
+			log_dbg_printf("Content stream disconnected: %s\n",
+			               strerror(errno));
+			close(stream->fd);
+			stream->fd = -1;
+		}
+		pthread_mutex_lock(&stream->mutex);
+		stream->spare = buf;
+		if (rv == -1) {
+			stream->dropped += nfr;
+			stream->dropped_total += nfr;
+		}
+	}
+	pthread_mutex_unlock(&stream->mutex);
+	return NULL;
+}
+
+/*
+ * Start the sender thread.  Returns -1 on errors, 0 on success.
+ */
+int
+logstream_start(logstream_t *stream)
+{
+	if (pthread_create(&stream->thr, NULL, logstream_thread, stream))
+		return -1;
+	stream->running = 1;
+	return 0;
+}
+
+/*
+ * Stop the sender thread after sending the remaining frames, and free the
+ * stream.
+ */
+void
+logstream_free(logstream_t *stream)
+{
+	if (stream->running) {
+		pthread_mutex_lock(&stream->mutex);
+		stream->stopping = 1;
+		pthread_cond_signal(&stream->cond);
+		pthread_mutex_unlock(&stream->mutex);
+		pthread_join(stream->thr, NULL);
+	}
+	if (stream->fd != -1)
+		close(stream->fd);
+	pthread_cond_destroy(&stream->cond);
+	pthread_mutex_destroy(&stream->mutex);
+	free(stream->fill);
+	free(stream->spare);
+	free(stream);
+}
+
+/*
+ * Append a frame to the fill buffer.  Must be called with the mutex held.
+ */
+static void
+logstream_frame(logstream_t *stream, uint64_t id, unsigned int type,
+                unsigned int flags, uint64_t usec, const void *buf, size_t sz)
+{
+	unsigned char *p = stream->fill + stream->filllen;
+
+	logstream_put32(p, LOGSTREAM_HDRSZ - 4 + sz);
+	p[4] = type;
+	p[5] = flags;
+	p[6] = 0;
+	p[7] = 0;
+	logstream_put64(p + 8, id);
+	logstream_put64(p + 16, usec);
+	if (sz > 0)
+		memcpy(p + LOGSTREAM_HDRSZ, buf, sz);
+	stream->filllen += LOGSTREAM_HDRSZ + sz;
+	stream->fillnfr++;
+}
+
+/*
+ * Queue a frame for sending, preceded by a LOGSTREAM_DROP frame if frames
+ * were dropped before, or drop it if the buffer is full.
+ */
+static void
+logstream_emit(logstream_t *stream, uint64_t id, unsigned int type,
+               unsigned int flags, uint64_t usec, const void *buf, size_t sz)
+{
+	unsigned char cnt[8];
+	size_t need = LOGSTREAM_HDRSZ + sz;
+
+	pthread_mutex_lock(&stream->mutex);
+	if (stream->dropped)
+		need += LOGSTREAM_HDRSZ + sizeof(cnt);
+	if (stream->filllen + need > stream->cap) {
+		stream->dropped++;
+		stream->dropped_total++;
+		pthread_mutex_unlock(&stream->mutex);
+		return;
+	}
+	if (stream->filllen == 0)
+		pthread_cond_signal(&stream->cond);
+	if (stream->dropped) {
+		logstream_put64(cnt, stream->dropped);
+		logstream_frame(stream, 0, LOGSTREAM_DROP, 0, usec,
+		                cnt, sizeof(cnt));
+		stream->dropped = 0;
+	}
+	logstream_frame(stream, id, type, flags, usec, buf, sz);
+	pthread_mutex_unlock(&stream->mutex);
+}
+
+/*
+ * The following functions must only be called by the single producer.
+ */
+
+/*
+ * Queue the LOGSTREAM_OPEN frame of conn.
+ */
+void
+logstream_open(logstream_t *stream, logtap_conn_t *conn)
+{
+	size_t sz = conn->meta ? strlen(conn->meta) : 0;
+
+	if (sz > stream->maxdata)
+		sz = stream->maxdata;
+	logstream_emit(stream, conn->id, LOGSTREAM_OPEN, 0, logstream_now(),
+	               conn->meta, sz);
+}
+
+/*
+ * Queue sz octets of plaintext from buf.  Chunks larger than a quarter of
+ * the buffer are split into several LOGSTREAM_DATA frames.
+ */
+void
+logstream_write(logstream_t *stream, logtap_conn_t *conn, unsigned int flags,
+                const void *buf, size_t sz)
+{
+	const unsigned char *p = buf;
+	uint64_t usec = logstream_now();
+	size_t n;
+
+	while (sz > 0) {
+		n = sz < stream->maxdata ? sz : stream->maxdata;
+		logstream_emit(stream, conn->id, LOGSTREAM_DATA, flags, usec,
+		               p, n);
+		p += n;
+		sz -= n;
+	}
+}
+
+/*
+ * Queue the LOGSTREAM_CLOSE frame of conn.
+ */
+void
+logstream_close(logstream_t *stream, logtap_conn_t *conn, unsigned int flags)
+{
+	logstream_emit(stream, conn->id, LOGSTREAM_CLOSE, flags,
+	               logstream_now(), NULL, 0);
+}
+
+/*
+ * Total number of frames dropped so far.
+ */
+uint64_t
+logstream_dropped(logstream_t *stream)
+{
+	uint64_t n;
+
+	pthread_mutex_lock(&stream->mutex);
+	n = stream->dropped_total;
+	pthread_mutex_unlock(&stream->mutex);
+	return n;
+}
+
+/* vim: set noet ft=c: */
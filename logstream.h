@@ -0,0 +1,69 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LOGSTREAM_H
+#define LOGSTREAM_H
+
+#include "attrib.h"
+#include "logtap.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef struct logstream logstream_t;
+
+/*
+ * Framing of the stream, see logstream.c.  All fields are in network byte
+ * order.
+ */
+#define LOGSTREAM_VERSION       1
+#define LOGSTREAM_HDRSZ         24      /* size of a frame header */
+
+/* frame types */
+#define LOGSTREAM_HELLO         0       /* first frame of each connection */
+#define LOGSTREAM_OPEN          1       /* addresses and SNI */
+#define LOGSTREAM_DATA          2       /* plaintext chunk */
+#define LOGSTREAM_CLOSE         3
+#define LOGSTREAM_DROP          4       /* u64 number of frames dropped */
+
+/* frame flags */
+#define LOGSTREAM_REQUEST       1       /* from client, closed by client */
+
+logstream_t * logstream_new(const char *, size_t) NONNULL(1) MALLOC;
+int logstream_start(logstream_t *) NONNULL(1) WUNRES;
+void logstream_free(logstream_t *) NONNULL(1);
+void logstream_open(logstream_t *, logtap_conn_t *) NONNULL(1,2);
+void logstream_write(logstream_t *, logtap_conn_t *, unsigned int,
+                     const void *, size_t) NONNULL(1,2);
+void logstream_close(logstream_t *, logtap_conn_t *, unsigned int)
+                     NONNULL(1,2);
+uint64_t logstream_dropped(logstream_t *) NONNULL(1) WUNRES;
+
+#endif /* !LOGSTREAM_H */
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,244 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "logstream.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <check.h>
+
+static char template[] = "/tmp/sslsplit.test.XXXXXX";
+static char *basedir;
+static char *fn;
+static int lfd;
+
+static void
+logstream_setup(void)
+{
+	struct sockaddr_un sun;
+
+	basedir = strdup(template);
+	if (!mkdtemp(basedir)) {
+		perror("mkdtemp");
+		exit(EXIT_FAILURE);
+	}
+	if (asprintf(&fn, "%s/sock", basedir) < 0) {
+		perror("asprintf");
+		exit(EXIT_FAILURE);
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, fn, sizeof(sun.sun_path) - 1);
+	if ((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+	    bind(lfd, (struct sockaddr *)&sun, sizeof(sun)) == -1 ||
+	    listen(lfd, 1) == -1) {
+		perror("socket");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void
+logstream_teardown(void)
+{
+	close(lfd);
+	unlink(fn);
+	rmdir(basedir);
+	free(fn);
+	free(basedir);
+}
+
+static uint64_t
+logstream_t_get(const unsigned char *p, size_t sz)
+{
+	uint64_t v = 0;
+
+	for (size_t i = 0; i < sz; i++)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+/*
+ * Read one frame from fd into buf, returning the payload size, or -1 on EOF.
+ */
+static ssize_t
+logstream_t_frame(int fd, unsigned char *buf, size_t bufsz)
+{
+	size_t len, got = 0;
+	ssize_t n;
+
+	while (got < 4) {
+		n = read(fd, buf + got, 4 - got);
+		if (n <= 0)
+			return -1;
+		got += n;
+	}
+	len = logstream_t_get(buf, 4) + 4;
+	fail_unless(len >= LOGSTREAM_HDRSZ && len <= bufsz, "frame size");
+	while (got < len) {
+		n = read(fd, buf + got, len - got);
+		fail_unless(n > 0, "truncated frame");
+		got += n;
+	}
+	return len - LOGSTREAM_HDRSZ;
+}
+
+START_TEST(logstream_01)
+{
+	unsigned char buf[256];
+	logstream_t *stream;
+	logtap_conn_t conn;
+	ssize_t sz;
+	int fd;
+
+	stream = logstream_new(fn, 1024*1024);
+	fail_unless(!!stream, "logstream_new failed");
+	fail_unless(logstream_start(stream) == 0, "logstream_start failed");
+	fail_unless(logtap_conn_init(&conn, "192.0.2.1", "1234",
+	                             "198.51.100.1", "443",
+	                             "www.example.org") == 0,
+	            "logtap_conn_init failed");
+	logstream_open(stream, &conn);
+	logstream_write(stream, &conn, LOGSTREAM_REQUEST, "GET /", 5);
+	logstream_write(stream, &conn, 0, "HTTP/1.1 200", 12);
+	logstream_close(stream, &conn, 0);
+	logtap_conn_free(&conn);
+	logstream_free(stream);
+
+	fd = accept(lfd, NULL, NULL);
+	fail_unless(fd != -1, "accept failed");
+	sz = logstream_t_frame(fd, buf, sizeof(buf));
+	fail_unless(sz == 4, "hello size");
+	fail_unless(buf[4] == LOGSTREAM_HELLO, "hello type");
+	fail_unless(logstream_t_get(buf + LOGSTREAM_HDRSZ, 4) ==
+	            LOGSTREAM_VERSION, "hello version");
+	sz = logstream_t_frame(fd, buf, sizeof(buf));
+	fail_unless(buf[4] == LOGSTREAM_OPEN, "open type");
+	fail_unless(logstream_t_get(buf + 8, 8) == conn.id, "open id");
+	fail_unless(sz == 47 && !memcmp(buf + LOGSTREAM_HDRSZ,
+	            "192.0.2.1 1234 198.51.100.1 443 www.example.org", sz),
+	            "open meta");
+	sz = logstream_t_frame(fd, buf, sizeof(buf));
+	fail_unless(buf[4] == LOGSTREAM_DATA && buf[5] == LOGSTREAM_REQUEST,
+	            "request type or flags");
+	fail_unless(sz == 5 && !memcmp(buf + LOGSTREAM_HDRSZ, "GET /", 5),
+	            "request payload");
+	sz = logstream_t_frame(fd, buf, sizeof(buf));
+	fail_unless(buf[4] == LOGSTREAM_DATA && buf[5] == 0,
+	            "response type or flags");
+	fail_unless(sz == 12 && !memcmp(buf + LOGSTREAM_HDRSZ,
+	                                "HTTP/1.1 200", 12),
+	            "response payload");
+	sz = logstream_t_frame(fd, buf, sizeof(buf));
+	fail_unless(sz == 0 && buf[4] == LOGSTREAM_CLOSE, "close");
+	fail_unless(logstream_t_get(buf + 8, 8) == conn.id, "close id");
+	fail_unless(logstream_t_frame(fd, buf, sizeof(buf)) == -1, "no EOF");
+	close(fd);
+}
+END_TEST
+
+START_TEST(logstream_02)
+{
+	static unsigned char chunk[200000];
+	static unsigned char buf[65536];
+	logstream_t *stream;
+	logtap_conn_t conn;
+	uint64_t dropped, frames = 0;
+	ssize_t sz;
+	int fd;
+
+	stream = logstream_new(fn, 128*1024);
+	fail_unless(!!stream, "logstream_new failed");
+	fail_unless(logtap_conn_init(&conn, "192.0.2.1", "1234",
+	                             "198.51.100.1", "443", NULL) == 0,
+	            "logtap_conn_init failed");
+	/* fills the buffer while nothing is sending */
+	logstream_write(stream, &conn, 0, chunk, sizeof(chunk));
+	dropped = logstream_dropped(stream);
+	fail_unless(dropped > 0, "nothing dropped");
+	fail_unless(logstream_start(stream) == 0, "logstream_start failed");
+	fd = accept(lfd, NULL, NULL);
+	fail_unless(fd != -1, "accept failed");
+	sz = logstream_t_frame(fd, buf, sizeof(buf));
+	fail_unless(sz == 4 && buf[4] == LOGSTREAM_HELLO, "hello");
+	for (;;) {
+		sz = logstream_t_frame(fd, buf, sizeof(buf));
+		fail_unless(sz > 0 && buf[4] == LOGSTREAM_DATA, "data");
+		if (++frames + dropped == (sizeof(chunk) +
+		                           (sz - 1)) / (size_t)sz)
+			break;
+	}
+	/* the buffer is drained now, the next frame reports the drops */
+	logstream_close(stream, &conn, LOGSTREAM_REQUEST);
+	logtap_conn_free(&conn);
+	logstream_free(stream);
+	sz = logstream_t_frame(fd, buf, sizeof(buf));
+	fail_unless(sz == 8 && buf[4] == LOGSTREAM_DROP, "drop");
+	fail_unless(logstream_t_get(buf + LOGSTREAM_HDRSZ, 8) == dropped,
+	            "drop count");
+	sz = logstream_t_frame(fd, buf, sizeof(buf));
+	fail_unless(sz == 0 && buf[4] == LOGSTREAM_CLOSE &&
+	            buf[5] == LOGSTREAM_REQUEST, "close");
+	close(fd);
+}
+END_TEST
+
+START_TEST(logstream_03)
+{
+	fail_unless(!logstream_new(fn, 1024), "tiny buffer accepted");
+	fail_unless(!logstream_new("localhost", 1024*1024),
+	            "missing port accepted");
+	fail_unless(!logstream_new("localhost:", 1024*1024),
+	            "empty port accepted");
+}
+END_TEST
+
+Suite *
+logstream_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("logstream");
+
+	tc = tcase_create("logstream");
+	tcase_add_checked_fixture(tc, logstream_setup, logstream_teardown);
+	tcase_add_test(tc, logstream_01);
+	tcase_add_test(tc, logstream_02);
+	tcase_add_test(tc, logstream_03);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,196 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "logsync.h"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#ifdef __APPLE__
+#define fdatasync fsync
+#endif /* __APPLE__ */
+
+/*
+ * Disk layout and write-back of large, sequentially written log files such
+ * as the single-file content and pcap logs and the segment store.
+ *
+ * Preallocation reserves space in large extents ahead of the write offset
+ * without changing the file size, so the file system allocates contiguous
+ * blocks and updates its metadata once per extent instead of on every write,
+ * while readers and appending after a restart still see the real size.  Space
+ * preallocated beyond the end of the data is released when the file is
+ * closed.
+ *
+ * Dropping the page cache starts write-back of every LOGSYNC_WBSZ octets
+ * as soon as they are written, waits for the write-back of the preceding
+ * range and evicts it from the page cache.  This keeps multi-GB logs from
+ * filling the page cache with dirty pages that are never read again, without
+ * the alignment constraints of O_DIRECT on buffers, offsets and sizes.
+ *
+ * Optional fdatasync after a number of octets and before closing bounds the
+ * amount of data lost on power failure.
+ *
+ * Preallocation and write-back are advisory; if the platform or file system
+ * does not support them, they are silently skipped.  Only fdatasync errors
+ * are reported to the caller.
+ */
+
+#define LOGSYNC_WBSZ    (8*1024*1024)
+
+int
+logsync_policy_isset(const logsync_policy_t *policy)
+{
+	return policy->prealloc || policy->fsyncsz || policy->fsync_close ||
+	       policy->dropcache;
+}
+
+/*
+ * Start tracking fd, with end octets of data already in the file.
+ */
+void
+logsync_init(logsync_t *ls, const logsync_policy_t *policy, int fd,
+             off_t end)
+{
+	ls->policy = policy;
+	ls->fd = fd;
+	ls->end = end;
+	ls->alloc = policy->prealloc ? end : -1;
+	ls->synced = ls->wb = ls->dropped = end;
+}
+
+static void
+logsync_prealloc(logsync_t *ls)
+{
+#ifdef FALLOC_FL_KEEP_SIZE
+	off_t ext = ls->policy->prealloc;
+	off_t alloc;
+
+	/* end of the extent following the one containing the write offset */
+	alloc = (ls->end / ext + 2) * ext;
+	if (fallocate(ls->fd, FALLOC_FL_KEEP_SIZE, ls->alloc,
+	              alloc - ls->alloc) == -1) {
+		ls->alloc = -1;
+		return;
+	}
+	ls->alloc = alloc;
+#else /* !FALLOC_FL_KEEP_SIZE */
+	ls->alloc = -1;
+#endif /* !FALLOC_FL_KEEP_SIZE */
+}
+
+/*
+ * Drop the pages of the range written back before from the page cache and
+ * start write-back of the range written since.
+ */
+static void
+logsync_writebehind(logsync_t *ls)
+{
+#ifdef SYNC_FILE_RANGE_WRITE
+	if (sync_file_range(ls->fd, ls->wb, ls->end - ls->wb,
+	                    SYNC_FILE_RANGE_WRITE) == -1)
+		return;
+	if (ls->wb > ls->dropped &&
+	    sync_file_range(ls->fd, ls->dropped, ls->wb - ls->dropped,
+	                    SYNC_FILE_RANGE_WAIT_BEFORE |
+	                    SYNC_FILE_RANGE_WRITE |
+	                    SYNC_FILE_RANGE_WAIT_AFTER) == -1)
+		return;
+#else /* !SYNC_FILE_RANGE_WRITE */
+	if (fdatasync(ls->fd) == -1)
+		return;
+#endif /* !SYNC_FILE_RANGE_WRITE */
+#ifdef POSIX_FADV_DONTNEED
+	if (ls->wb > ls->dropped)
+		posix_fadvise(ls->fd, ls->dropped, ls->wb - ls->dropped,
+		              POSIX_FADV_DONTNEED);
+#endif /* POSIX_FADV_DONTNEED */
+	ls->dropped = ls->wb;
+	ls->wb = ls->end;
+}
+
+/*
+ * Account for sz octets appended to the file.
+ * Returns 0 on success, -1 if writing the data to disk failed.
+ */
+int
+logsync_wrote(logsync_t *ls, size_t sz)
+{
+	const logsync_policy_t *policy = ls->policy;
+
+	ls->end += sz;
+	if (ls->alloc != -1 && ls->end + (off_t)policy->prealloc > ls->alloc)
+		logsync_prealloc(ls);
+	if (policy->dropcache && ls->end - ls->wb >= LOGSYNC_WBSZ)
+		logsync_writebehind(ls);
+	if (policy->fsyncsz &&
+	    ls->end - ls->synced >= (off_t)policy->fsyncsz) {
+		if (fdatasync(ls->fd) == -1)
+			return -1;
+		ls->synced = ls->end;
+	}
+	return 0;
+}
+
+/*
+ * Release preallocated space beyond the end of the data, write the data to
+ * disk if configured and drop it from the page cache, before the caller
+ * closes the fd.
+ * Returns 0 on success, -1 if writing the data to disk failed.
+ */
+int
+logsync_close(logsync_t *ls)
+{
+	const logsync_policy_t *policy = ls->policy;
+	struct stat st;
+	int rv = 0;
+
+	/* truncating to the current size frees blocks beyond the end */
+	if (ls->alloc > ls->end && fstat(ls->fd, &st) == 0 &&
+	    ftruncate(ls->fd, st.st_size) == -1) {
+		/* advisory like the preallocation itself */
+	}
+	ls->alloc = -1;
+	if ((policy->fsync_close || policy->dropcache) &&
+	    ls->end > ls->synced) {
+		if (fdatasync(ls->fd) == -1)
+			rv = -1;
+		else
+			ls->synced = ls->end;
+	}
+#ifdef POSIX_FADV_DONTNEED
+	if (policy->dropcache && ls->end > ls->dropped)
+		posix_fadvise(ls->fd, ls->dropped, ls->end - ls->dropped,
+		              POSIX_FADV_DONTNEED);
+#endif /* POSIX_FADV_DONTNEED */
+	ls->dropped = ls->wb = ls->end;
+	return rv;
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,69 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LOGSYNC_H
+#define LOGSYNC_H
+
+#include "attrib.h"
+
+#include <sys/types.h>
+#include <stddef.h>
+
+/*
+ * How large sequentially written log files are laid out on and flushed to
+ * disk, shared by all files the policy applies to.
+ */
+typedef struct logsync_policy {
+	size_t prealloc;        /* preallocation extent, 0 to disable */
+	size_t fsyncsz;         /* fdatasync after this many octets, 0: never */
+	unsigned int fsync_close : 1;   /* fdatasync before closing */
+	unsigned int dropcache : 1;     /* write behind, drop written pages */
+} logsync_policy_t;
+
+/*
+ * Disk state of a log file being appended to by a single writer thread.
+ */
+typedef struct logsync {
+	const logsync_policy_t *policy;
+	int fd;
+	off_t end;              /* end of data written */
+	off_t alloc;            /* end of preallocated space, -1 if disabled */
+	off_t synced;           /* end of data written to disk */
+	off_t wb;               /* end of data submitted for write-behind */
+	off_t dropped;          /* end of data dropped from the page cache */
+} logsync_t;
+
+int logsync_policy_isset(const logsync_policy_t *) NONNULL(1) WUNRES;
+void logsync_init(logsync_t *, const logsync_policy_t *, int, off_t)
+     NONNULL(1,2);
+int logsync_wrote(logsync_t *, size_t) NONNULL(1) WUNRES;
+int logsync_close(logsync_t *) NONNULL(1) WUNRES;
+
+#endif /* !LOGSYNC_H */
+
+/* vim: set noet ft=c: */
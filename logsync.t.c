@@ -0,0 +1,177 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "logsync.h"
+
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <check.h>
+
+static char template[] = "/tmp/sslsplit.test.XXXXXX";
+static char *fn;
+static int fd;
+
+static void
+logsync_setup(void)
+{
+	fn = strdup(template);
+	fd = mkstemp(fn);
+	if (fd == -1) {
+		perror("mkstemp");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void
+logsync_teardown(void)
+{
+	close(fd);
+	unlink(fn);
+	free(fn);
+}
+
+static int
+logsync_t_write(logsync_t *ls, size_t sz)
+{
+	static char buf[65536];
+
+	while (sz > 0) {
+		size_t n = sz < sizeof(buf) ? sz : sizeof(buf);
+		if (write(fd, buf, n) != (ssize_t)n)
+			return -1;
+		if (logsync_wrote(ls, n) == -1)
+			return -1;
+		sz -= n;
+	}
+	return 0;
+}
+
+START_TEST(logsync_01)
+{
+	logsync_policy_t policy;
+	logsync_t ls;
+	struct stat st;
+
+	memset(&policy, 0, sizeof(policy));
+	fail_unless(!logsync_policy_isset(&policy), "empty policy set");
+	policy.prealloc = 1024*1024;
+	fail_unless(logsync_policy_isset(&policy), "policy not set");
+
+	logsync_init(&ls, &policy, fd, 0);
+	fail_unless(logsync_t_write(&ls, 1000) == 0, "write failed");
+	fail_unless(ls.end == 1000, "wrong end");
+	fail_unless(fstat(fd, &st) == 0, "stat failed");
+	fail_unless(st.st_size == 1000, "preallocation changed size");
+	if (ls.alloc == -1)
+		return; /* not supported by the file system */
+	fail_unless(ls.alloc >= ls.end + (off_t)policy.prealloc,
+	            "not preallocated ahead");
+	fail_unless(st.st_blocks * 512 >= (blkcnt_t)policy.prealloc,
+	            "space not allocated");
+
+	fail_unless(logsync_t_write(&ls, 1024*1024) == 0, "write failed");
+	fail_unless(ls.alloc >= ls.end + (off_t)policy.prealloc,
+	            "not preallocated ahead after growing");
+
+	fail_unless(logsync_close(&ls) == 0, "close failed");
+	fail_unless(fstat(fd, &st) == 0, "stat failed");
+	fail_unless(st.st_size == 1000 + 1024*1024, "wrong size after close");
+	fail_unless(st.st_blocks * 512 < 2 * 1024*1024 + 65536,
+	            "preallocated space not released");
+}
+END_TEST
+
+START_TEST(logsync_02)
+{
+	logsync_policy_t policy;
+	logsync_t ls;
+
+	memset(&policy, 0, sizeof(policy));
+	policy.fsyncsz = 4096;
+	logsync_init(&ls, &policy, fd, 100);
+	fail_unless(ls.alloc == -1, "preallocation enabled");
+	fail_unless(logsync_t_write(&ls, 4000) == 0, "write failed");
+	fail_unless(ls.synced == 100, "synced too early");
+	fail_unless(logsync_t_write(&ls, 100) == 0, "write failed");
+	fail_unless(ls.synced == 4200, "not synced");
+	fail_unless(logsync_t_write(&ls, 10) == 0, "write failed");
+	fail_unless(logsync_close(&ls) == 0, "close failed");
+	fail_unless(ls.synced == 4200, "synced on close without policy");
+
+	policy.fsync_close = 1;
+	fail_unless(logsync_t_write(&ls, 10) == 0, "write failed");
+	fail_unless(logsync_close(&ls) == 0, "close failed");
+	fail_unless(ls.synced == 4220, "not synced on close");
+}
+END_TEST
+
+START_TEST(logsync_03)
+{
+	logsync_policy_t policy;
+	logsync_t ls;
+
+	memset(&policy, 0, sizeof(policy));
+	policy.dropcache = 1;
+	logsync_init(&ls, &policy, fd, 0);
+	fail_unless(logsync_t_write(&ls, 4*1024*1024) == 0, "write failed");
+	fail_unless(ls.wb == 0 && ls.dropped == 0, "written back too early");
+	fail_unless(logsync_t_write(&ls, 6*1024*1024) == 0, "write failed");
+	fail_unless(ls.wb == 8*1024*1024, "not written back");
+	fail_unless(ls.dropped == 0, "dropped too early");
+	fail_unless(logsync_t_write(&ls, 8*1024*1024) == 0, "write failed");
+	fail_unless(ls.wb == 16*1024*1024, "not written back");
+	fail_unless(ls.dropped == 8*1024*1024, "not dropped");
+	fail_unless(logsync_close(&ls) == 0, "close failed");
+	fail_unless(ls.dropped == ls.end && ls.synced == ls.end,
+	            "not dropped on close");
+}
+END_TEST
+
+Suite *
+logsync_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("logsync");
+
+	tc = tcase_create("logsync");
+	tcase_add_checked_fixture(tc, logsync_setup, logsync_teardown);
+	tcase_add_test(tc, logsync_01);
+	tcase_add_test(tc, logsync_02);
+	tcase_add_test(tc, logsync_03);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
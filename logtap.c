@@ -0,0 +1,319 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "logtap.h"
+
+#include "defaults.h"
+
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+/*
+ * Shared memory content tap.
+ *
+ * Plaintext chunks of all connections are written as records into a ring
+ * in a file, typically on a tmpfs such as /dev/shm, which local consumers
+ * such as an IDS map read-only.  The tap has a single producer, the writer
+ * thread of the tap log; consumers never write to the mapping, such that any
+ * number of them can follow the ring independently.  When the ring is full,
+ * the producer overwrites the oldest records instead of waiting for slow
+ * consumers; consumers detect and skip overwritten records.
+ *
+ * The file consists of a header of LOGTAP_HDRSZ octets followed by the data
+ * area.  The header holds the u32 magic LOGTAP_MAGIC and u32 version at
+ * offset 0, the u64 size of the data area (a power of two) at
+ * LOGTAP_OFF_SIZE, and two u64 positions on separate cache lines:  head at
+ * LOGTAP_OFF_HEAD is the position after the last complete record, tail at
+ * LOGTAP_OFF_TAIL is the position of the oldest record not yet overwritten.
+ * Positions increase monotonically; a record at position pos is located at
+ * offset pos % size into the data area.
+ *
+ * Each record starts with a header of LOGTAP_RECSZ octets:  u32 length of the
+ * record including header and padding (a multiple of 8), u16 type, u16 flags,
+ * u64 connection ID, u64 usec timestamp and u32 payload size, followed by the
+ * payload.  Records never wrap around the end of the data area; LOGTAP_PAD
+ * records, of which only length and type are valid and which can be as short
+ * as 8 octets, fill the space up to the end instead.  LOGTAP_OPEN records
+ * carry "srchost srcport dsthost dstport sni" as payload, LOGTAP_DATA records
+ * a chunk of plaintext, LOGTAP_CLOSE records no payload.  LOGTAP_REQUEST in
+ * the flags marks data sent and connections closed by the client.
+ *
+ * A consumer starts at pos = tail or pos = head, then repeatedly loads head
+ * with acquire semantics and processes the records from pos up to head in
+ * place:  after reading a record, it issues an acquire fence and loads tail;
+ * if tail is beyond pos, the record was overwritten while being read and the
+ * consumer continues at tail, having lost the records in between.  The ring
+ * file is recreated on startup; consumers remap it when its inode changes.
+ */
+
+struct logtap {
+	unsigned char *map;
+	size_t mapsz;
+	unsigned char *data;
+	uint64_t size;
+	uint64_t head;
+	uint64_t tail;
+	size_t maxdata;
+};
+
+#define LOGTAP_MINSZ    (64*1024)
+#define LOGTAP_U64(tap, off)    ((uint64_t *)((tap)->map + (off)))
+
+static uint64_t logtap_nextid = 0;
+
+static uint64_t
+logtap_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/*
+ * Create the ring file at *path* with a data area of *size* octets, rounded
+ * down to a power of two, replacing any existing file.
+ * Returns NULL and sets errno on errors.
+ */
+logtap_t *
+logtap_new(const char *path, size_t size)
+{
+	logtap_t *tap;
+	uint64_t sz;
+	int fd, tmp;
+
+	if (size < LOGTAP_MINSZ) {
+		errno = EINVAL;
+		return NULL;
+	}
+	sz = LOGTAP_MINSZ;
+	while (sz <= size / 2)
+		sz *= 2;
+
+	tap = malloc(sizeof(logtap_t));
+	if (!tap)
+		return NULL;
+	memset(tap, 0, sizeof(logtap_t));
+	tap->size = sz;
+	tap->mapsz = LOGTAP_HDRSZ + sz;
+	tap->maxdata = sz / 4 - LOGTAP_RECSZ;
+
+	/* consumers of a previous instance keep their mapping of the old
+	 * file instead of seeing it truncated underneath them */
+	if (unlink(path) == -1 && errno != ENOENT)
+		goto errout;
+	fd = open(path, O_RDWR|O_CREAT|O_EXCL, DFLT_FILEMODE);
+	if (fd == -1)
+		goto errout;
+	if (ftruncate(fd, tap->mapsz) == -1) {
+		tmp = errno;
+		close(fd);
+		errno = tmp;
+		goto errout;
+	}
+	tap->map = mmap(NULL, tap->mapsz, PROT_READ|PROT_WRITE,
+	                MAP_SHARED, fd, 0);
+	tmp = errno;
+	close(fd);
+	if (tap->map == MAP_FAILED) {
+		errno = tmp;
+		goto errout;
+	}
+	tap->data = tap->map + LOGTAP_HDRSZ;
+
+	/* the file is zero-filled, i.e. head and tail are 0 */
+	*LOGTAP_U64(tap, LOGTAP_OFF_SIZE) = sz;
+	*(uint32_t *)(tap->map + 4) = LOGTAP_VERSION;
+	__atomic_store_n((uint32_t *)tap->map, LOGTAP_MAGIC, __ATOMIC_RELEASE);
+	return tap;
+
+errout:
+	free(tap);
+	return NULL;
+}
+
+void
+logtap_free(logtap_t *tap)
+{
+	munmap(tap->map, tap->mapsz);
+	free(tap);
+}
+
+/*
+ * Prepare the connection metadata for the LOGTAP_OPEN record and allocate a
+ * connection ID, unique within the process.
+ * Returns 0 on success, -1 on memory allocation failure.
+ */
+int
+logtap_conn_init(logtap_conn_t *conn, const char *srchost, const char *srcport,
+                 const char *dsthost, const char *dstport, const char *sni)
+{
+	memset(conn, 0, sizeof(logtap_conn_t));
+	if (asprintf(&conn->meta, "%s %s %s %s %s", srchost, srcport,
+	             dsthost, dstport, sni && *sni ? sni : "-") < 0) {
+		conn->meta = NULL;
+		return -1;
+	}
+	if (sni && *sni) {
+		/* keep the field format intact for any SNI sent by clients */
+		for (unsigned char *p = (unsigned char *)conn->meta +
+		                        strlen(conn->meta) - strlen(sni);
+		     *p; p++) {
+			if (*p <= ' ' || *p >= 0x7f)
+				*p = '_';
+		}
+	}
+	conn->id = __atomic_fetch_add(&logtap_nextid, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+void
+logtap_conn_free(logtap_conn_t *conn)
+{
+	if (conn->meta) {
+		free(conn->meta);
+		conn->meta = NULL;
+	}
+}
+
+/*
+ * Make room for len octets at head by advancing tail past the oldest
+ * records, and publish the new tail before they are overwritten.
+ */
+static void
+logtap_reserve(logtap_t *tap, uint64_t len)
+{
+	uint64_t tail = tap->tail;
+
+	while (tap->head + len - tail > tap->size)
+		tail += *(uint32_t *)(tap->data + (tail & (tap->size - 1)));
+	if (tail != tap->tail) {
+		tap->tail = tail;
+		__atomic_store_n(LOGTAP_U64(tap, LOGTAP_OFF_TAIL), tail,
+		                 __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+}
+
+static void
+logtap_emit(logtap_t *tap, uint64_t id, unsigned int type,
+            unsigned int flags, uint64_t usec, const void *buf, size_t sz)
+{
+	uint64_t len = (LOGTAP_RECSZ + sz + 7) & ~(uint64_t)7;
+	uint64_t pos = tap->head & (tap->size - 1);
+	unsigned char *p;
+
+	if (pos + len > tap->size) {
+		logtap_reserve(tap, tap->size - pos);
+		p = tap->data + pos;
+		*(uint32_t *)p = tap->size - pos;
+		*(uint16_t *)(p + 4) = LOGTAP_PAD;
+		tap->head += tap->size - pos;
+		__atomic_store_n(LOGTAP_U64(tap, LOGTAP_OFF_HEAD), tap->head,
+		                 __ATOMIC_RELEASE);
+		pos = 0;
+	}
+	logtap_reserve(tap, len);
+	p = tap->data + pos;
+	*(uint32_t *)p = len;
+	*(uint16_t *)(p + 4) = type;
+	*(uint16_t *)(p + 6) = flags;
+	*(uint64_t *)(p + 8) = id;
+	*(uint64_t *)(p + 16) = usec;
+	*(uint32_t *)(p + 24) = sz;
+	*(uint32_t *)(p + 28) = 0;
+	if (sz > 0)
+		memcpy(p + LOGTAP_RECSZ, buf, sz);
+	tap->head += len;
+	__atomic_store_n(LOGTAP_U64(tap, LOGTAP_OFF_HEAD), tap->head,
+	                 __ATOMIC_RELEASE);
+}
+
+/*
+ * The following functions must only be called by the single producer.
+ */
+
+/*
+ * Write the LOGTAP_OPEN record of conn to the ring.
+ * Returns 0 on success, -1 on errors.
+ */
+int
+logtap_open(logtap_t *tap, logtap_conn_t *conn)
+{
+	size_t sz = conn->meta ? strlen(conn->meta) : 0;
+
+	if (sz > tap->maxdata) {
+		errno = EINVAL;
+		return -1;
+	}
+	logtap_emit(tap, conn->id, LOGTAP_OPEN, 0, logtap_now(),
+	            conn->meta, sz);
+	return 0;
+}
+
+/*
+ * Write sz octets of plaintext from buf to the ring.  Chunks larger than a
+ * quarter of the ring are split into several LOGTAP_DATA records.
+ * Returns 0 on success, -1 on errors.
+ */
+int
+logtap_write(logtap_t *tap, logtap_conn_t *conn, unsigned int flags,
+             const void *buf, size_t sz)
+{
+	const unsigned char *p = buf;
+	uint64_t usec = logtap_now();
+	size_t n;
+
+	while (sz > 0) {
+		n = sz < tap->maxdata ? sz : tap->maxdata;
+		logtap_emit(tap, conn->id, LOGTAP_DATA, flags, usec, p, n);
+		p += n;
+		sz -= n;
+	}
+	return 0;
+}
+
+/*
+ * Write the LOGTAP_CLOSE record of conn to the ring.
+ * Returns 0 on success, -1 on errors.
+ */
+int
+logtap_close(logtap_t *tap, logtap_conn_t *conn, unsigned int flags)
+{
+	logtap_emit(tap, conn->id, LOGTAP_CLOSE, flags, logtap_now(),
+	            NULL, 0);
+	return 0;
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,83 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LOGTAP_H
+#define LOGTAP_H
+
+#include "attrib.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef struct logtap logtap_t;
+
+/*
+ * State of a connection logged to the tap.  Initialized by the connection
+ * handling thread, then only used by the producer.
+ */
+typedef struct logtap_conn {
+	uint64_t id;
+	char *meta;             /* addresses and SNI */
+} logtap_conn_t;
+
+/*
+ * Layout of the shared memory ring, see logtap.c.  All fields are in host
+ * byte order.
+ */
+#define LOGTAP_MAGIC    0x50415453      /* "STAP" */
+#define LOGTAP_VERSION  1
+#define LOGTAP_HDRSZ    4096            /* data area starts here */
+#define LOGTAP_OFF_SIZE 8               /* u64 size of data area */
+#define LOGTAP_OFF_HEAD 64              /* u64 end of last record */
+#define LOGTAP_OFF_TAIL 128             /* u64 start of oldest record */
+#define LOGTAP_RECSZ    32              /* size of a record header */
+
+/* record types */
+#define LOGTAP_PAD      0               /* skip to start of data area */
+#define LOGTAP_OPEN     1               /* addresses and SNI */
+#define LOGTAP_DATA     2               /* plaintext chunk */
+#define LOGTAP_CLOSE    3
+
+/* record flags */
+#define LOGTAP_REQUEST  1               /* from client, closed by client */
+
+logtap_t * logtap_new(const char *, size_t) NONNULL(1) MALLOC;
+void logtap_free(logtap_t *) NONNULL(1);
+int logtap_conn_init(logtap_conn_t *, const char *, const char *,
+                     const char *, const char *, const char *)
+                     NONNULL(1,2,3,4,5) WUNRES;
+void logtap_conn_free(logtap_conn_t *) NONNULL(1);
+int logtap_open(logtap_t *, logtap_conn_t *) NONNULL(1,2) WUNRES;
+int logtap_write(logtap_t *, logtap_conn_t *, unsigned int,
+                 const void *, size_t) NONNULL(1,2) WUNRES;
+int logtap_close(logtap_t *, logtap_conn_t *, unsigned int)
+                 NONNULL(1,2) WUNRES;
+
+#endif /* !LOGTAP_H */
+
+/* vim: set noet ft=c: */
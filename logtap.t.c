@@ -0,0 +1,285 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "logtap.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <check.h>
+
+static char template[] = "/tmp/sslsplit.test.XXXXXX";
+static char *basedir;
+static char *fn;
+
+static void
+logtap_setup(void)
+{
+	basedir = strdup(template);
+	if (!mkdtemp(basedir)) {
+		perror("mkdtemp");
+		exit(EXIT_FAILURE);
+	}
+	if (asprintf(&fn, "%s/tap", basedir) < 0) {
+		perror("asprintf");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void
+logtap_teardown(void)
+{
+	unlink(fn);
+	free(fn);
+	rmdir(basedir);
+	free(basedir);
+}
+
+/*
+ * Read-only consumer as described in logtap.c.
+ */
+typedef struct {
+	const unsigned char *map;
+	size_t mapsz;
+	uint64_t size;
+	uint64_t pos;
+	uint64_t lost;
+} logtap_t_reader_t;
+
+static void
+logtap_t_map(logtap_t_reader_t *r)
+{
+	struct stat st;
+	int fd;
+
+	memset(r, 0, sizeof(*r));
+	fd = open(fn, O_RDONLY);
+	fail_unless(fd != -1, "open failed");
+	fail_unless(fstat(fd, &st) == 0, "fstat failed");
+	r->mapsz = st.st_size;
+	r->map = mmap(NULL, r->mapsz, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	fail_unless(r->map != MAP_FAILED, "mmap failed");
+	fail_unless(*(const uint32_t *)r->map == LOGTAP_MAGIC, "magic");
+	fail_unless(*(const uint32_t *)(r->map + 4) == LOGTAP_VERSION,
+	            "version");
+	r->size = *(const uint64_t *)(r->map + LOGTAP_OFF_SIZE);
+	fail_unless(r->mapsz == LOGTAP_HDRSZ + r->size, "size");
+	r->pos = __atomic_load_n((const uint64_t *)(r->map + LOGTAP_OFF_TAIL),
+	                         __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Return the next non-pad record or NULL if there is none.
+ */
+static const unsigned char *
+logtap_t_next(logtap_t_reader_t *r)
+{
+	const unsigned char *rec;
+	uint64_t head, tail;
+
+	for (;;) {
+		head = __atomic_load_n((const uint64_t *)
+		                       (r->map + LOGTAP_OFF_HEAD),
+		                       __ATOMIC_ACQUIRE);
+		if (r->pos == head)
+			return NULL;
+		rec = r->map + LOGTAP_HDRSZ + (r->pos & (r->size - 1));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		tail = __atomic_load_n((const uint64_t *)
+		                       (r->map + LOGTAP_OFF_TAIL),
+		                       __ATOMIC_ACQUIRE);
+		if (tail > r->pos) {
+			r->lost += tail - r->pos;
+			r->pos = tail;
+			continue;
+		}
+		r->pos += *(const uint32_t *)rec;
+		if (*(const uint16_t *)(rec + 4) != LOGTAP_PAD)
+			return rec;
+	}
+}
+
+#define REC_TYPE(rec)   (*(const uint16_t *)((rec) + 4))
+#define REC_FLAGS(rec)  (*(const uint16_t *)((rec) + 6))
+#define REC_ID(rec)     (*(const uint64_t *)((rec) + 8))
+#define REC_SZ(rec)     (*(const uint32_t *)((rec) + 24))
+#define REC_DATA(rec)   ((const char *)(rec) + LOGTAP_RECSZ)
+
+START_TEST(logtap_01)
+{
+	logtap_t_reader_t r;
+	logtap_conn_t conn;
+	const unsigned char *rec;
+	logtap_t *tap;
+
+	tap = logtap_new(fn, 100000);
+	fail_unless(!!tap, "logtap_new failed");
+	logtap_t_map(&r);
+	fail_unless(r.size == 65536, "size not rounded to power of two");
+	fail_unless(!logtap_t_next(&r), "records in new ring");
+
+	fail_unless(logtap_conn_init(&conn, "127.0.0.1", "1234", "10.0.0.1",
+	                             "443", "a b\x01.example") == 0,
+	            "logtap_conn_init failed");
+	fail_unless(logtap_open(tap, &conn) == 0, "logtap_open failed");
+	fail_unless(logtap_write(tap, &conn, LOGTAP_REQUEST,
+	                         "GET / HTTP/1.1\r\n", 16) == 0,
+	            "logtap_write failed");
+	fail_unless(logtap_write(tap, &conn, 0, "HTTP/1.1 200", 12) == 0,
+	            "logtap_write failed");
+	fail_unless(logtap_close(tap, &conn, LOGTAP_REQUEST) == 0,
+	            "logtap_close failed");
+
+	rec = logtap_t_next(&r);
+	fail_unless(rec && REC_TYPE(rec) == LOGTAP_OPEN, "no open record");
+	fail_unless(REC_ID(rec) == conn.id, "wrong id");
+	fail_unless(REC_SZ(rec) == strlen(conn.meta) &&
+	            !memcmp(REC_DATA(rec), "127.0.0.1 1234 10.0.0.1 443 "
+	                    "a_b_.example", REC_SZ(rec)), "wrong meta");
+	rec = logtap_t_next(&r);
+	fail_unless(rec && REC_TYPE(rec) == LOGTAP_DATA, "no request");
+	fail_unless(REC_FLAGS(rec) == LOGTAP_REQUEST, "wrong flags");
+	fail_unless(REC_SZ(rec) == 16 &&
+	            !memcmp(REC_DATA(rec), "GET / HTTP/1.1\r\n", 16),
+	            "wrong request data");
+	rec = logtap_t_next(&r);
+	fail_unless(rec && REC_TYPE(rec) == LOGTAP_DATA, "no response");
+	fail_unless(REC_FLAGS(rec) == 0, "wrong flags");
+	fail_unless(REC_SZ(rec) == 12, "wrong response size");
+	rec = logtap_t_next(&r);
+	fail_unless(rec && REC_TYPE(rec) == LOGTAP_CLOSE, "no close record");
+	fail_unless(REC_FLAGS(rec) == LOGTAP_REQUEST, "wrong flags");
+	fail_unless(!logtap_t_next(&r), "extra record");
+	fail_unless(r.lost == 0, "lost records");
+
+	logtap_conn_free(&conn);
+	munmap((void *)r.map, r.mapsz);
+	logtap_free(tap);
+}
+END_TEST
+
+START_TEST(logtap_02)
+{
+	logtap_t_reader_t r;
+	logtap_conn_t conn;
+	const unsigned char *rec;
+	unsigned char buf[1000];
+	uint64_t seen = 0, last = 0;
+	logtap_t *tap;
+
+	tap = logtap_new(fn, 65536);
+	fail_unless(!!tap, "logtap_new failed");
+	fail_unless(logtap_conn_init(&conn, "::1", "1", "::1", "2", NULL) == 0,
+	            "logtap_conn_init failed");
+
+	/* overwrite the ring several times; records carry a sequence number */
+	for (uint64_t i = 1; i <= 1000; i++) {
+		memset(buf, 0, sizeof(buf));
+		memcpy(buf, &i, sizeof(i));
+		fail_unless(logtap_write(tap, &conn, 0, buf,
+		                         100 + (i * 37) % 900) == 0,
+		            "logtap_write failed");
+	}
+	/* a reader starting at tail sees a contiguous run up to the last */
+	logtap_t_map(&r);
+	fail_unless(r.pos > 0, "tail did not advance");
+	while ((rec = logtap_t_next(&r))) {
+		uint64_t i;
+
+		fail_unless(REC_TYPE(rec) == LOGTAP_DATA, "wrong type");
+		memcpy(&i, REC_DATA(rec), sizeof(i));
+		fail_unless(!last || i == last + 1, "records not contiguous");
+		fail_unless(REC_SZ(rec) == 100 + (i * 37) % 900, "wrong size");
+		last = i;
+		seen++;
+	}
+	fail_unless(last == 1000, "last record missing");
+	fail_unless(seen > 10, "too few records retained");
+
+	/* chunks larger than a quarter of the ring are split */
+	{
+		static unsigned char big[40000];
+
+		memset(big, 'x', sizeof(big));
+		fail_unless(logtap_write(tap, &conn, 0, big, sizeof(big)) == 0,
+		            "logtap_write failed");
+		seen = 0;
+		while ((rec = logtap_t_next(&r))) {
+			fail_unless(REC_SZ(rec) <= 65536 / 4, "record too big");
+			seen += REC_SZ(rec);
+		}
+		fail_unless(seen == sizeof(big), "split data lost");
+	}
+
+	logtap_conn_free(&conn);
+	munmap((void *)r.map, r.mapsz);
+	logtap_free(tap);
+}
+END_TEST
+
+START_TEST(logtap_03)
+{
+	logtap_t *tap;
+
+	fail_unless(!logtap_new(fn, 1024), "tiny ring created");
+	tap = logtap_new(fn, 65536);
+	fail_unless(!!tap, "logtap_new failed");
+	logtap_free(tap);
+	/* recreating replaces the file */
+	tap = logtap_new(fn, 65536);
+	fail_unless(!!tap, "logtap_new failed to replace file");
+	logtap_free(tap);
+}
+END_TEST
+
+Suite *
+logtap_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("logtap");
+
+	tc = tcase_create("logtap");
+	tcase_add_checked_fixture(tc, logtap_setup, logtap_teardown);
+	tcase_add_test(tc, logtap_01);
+	tcase_add_test(tc, logtap_02);
+	tcase_add_test(tc, logtap_03);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,302 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "logz.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include <zlib.h>
+
+/*
+ * Streaming gzip compression of log files in the logger threads.
+ *
+ * Log data is compressed into a sequence of independent gzip members.  A
+ * member is finished, making all data written so far decompressible, when
+ * the log file is closed or reopened, and by logz_flush_due() once its first
+ * octets have been pending for the configured flush interval.  Since gzip
+ * readers treat concatenated members as one stream, gzip -dc and zcat read
+ * the whole file, also while it is being written to; after a crash, only the
+ * unfinished trailing member is lost.  Members appended after a restart
+ * continue the same stream.
+ *
+ * Compression favours speed over ratio; a logz_t is used exclusively by the
+ * writer thread owning its list.
+ */
+
+#define LOGZ_BUFSZ      (64*1024)
+#define LOGZ_LEVEL      Z_BEST_SPEED
+
+struct logz {
+	z_stream zs;
+	int fd;
+	int pending;            /* octets consumed since last finished member */
+	unsigned long long since;       /* ms of first pending octets */
+	logz_list_t *list;
+	logz_t *prev;
+	logz_t *next;
+	unsigned char buf[LOGZ_BUFSZ];
+};
+
+static unsigned long long
+logz_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Create a compressed stream writing to fd.  If list is not NULL, the stream
+ * is linked into it while it has pending data, for logz_flush_due().
+ */
+logz_t *
+logz_new(int fd, logz_list_t *list)
+{
+	logz_t *z;
+
+	z = malloc(sizeof(logz_t));
+	if (!z)
+		return NULL;
+	memset(z, 0, offsetof(logz_t, buf));
+	/* window bits 15 + 16 for gzip framing */
+	if (deflateInit2(&z->zs, LOGZ_LEVEL, Z_DEFLATED, 15 + 16, 8,
+	                 Z_DEFAULT_STRATEGY) != Z_OK) {
+		free(z);
+		errno = ENOMEM;
+		return NULL;
+	}
+	z->fd = fd;
+	z->list = list;
+	z->zs.next_out = z->buf;
+	z->zs.avail_out = LOGZ_BUFSZ;
+	return z;
+}
+
+static void
+logz_unlink(logz_t *z)
+{
+	if (!z->list)
+		return;
+	if (z->prev)
+		z->prev->next = z->next;
+	else if (z->list->head == z)
+		z->list->head = z->next;
+	else
+		return;
+	if (z->next)
+		z->next->prev = z->prev;
+	else
+		z->list->tail = z->prev;
+	z->prev = z->next = NULL;
+}
+
+/*
+ * Write all compressed octets in the output buffer to the file.
+ */
+static int
+logz_drain(logz_t *z)
+{
+	unsigned char *p = z->buf;
+	size_t sz = LOGZ_BUFSZ - z->zs.avail_out;
+	ssize_t n;
+
+	while (sz > 0) {
+		n = write(z->fd, p, sz);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			z->zs.next_out = z->buf;
+			z->zs.avail_out = LOGZ_BUFSZ;
+			return -1;
+		}
+		p += n;
+		sz -= n;
+	}
+	z->zs.next_out = z->buf;
+	z->zs.avail_out = LOGZ_BUFSZ;
+	return 0;
+}
+
+static int
+logz_finish_member(logz_t *z)
+{
+	int rv;
+
+	if (!z->pending)
+		return 0;
+	z->pending = 0;
+	logz_unlink(z);
+	z->zs.next_in = NULL;
+	z->zs.avail_in = 0;
+	do {
+		rv = deflate(&z->zs, Z_FINISH);
+		if (rv == Z_STREAM_ERROR)
+			goto errout;
+		if (z->zs.avail_out == 0 || rv == Z_STREAM_END) {
+			if (logz_drain(z) == -1)
+				goto errout;
+		}
+	} while (rv != Z_STREAM_END);
+	deflateReset(&z->zs);
+	return 0;
+
+errout:
+	deflateReset(&z->zs);
+	return -1;
+}
+
+/*
+ * Finish the current gzip member, if any data is pending, and write it out.
+ * Returns 0 on success, -1 on errors.
+ */
+int
+logz_finish(logz_t *z)
+{
+	return logz_finish_member(z);
+}
+
+/*
+ * Finish the current member and free the stream.  Does not close the fd.
+ */
+void
+logz_free(logz_t *z)
+{
+	logz_finish_member(z);
+	logz_unlink(z);
+	deflateEnd(&z->zs);
+	free(z);
+}
+
+/*
+ * Switch the stream to a new fd, e.g. after reopening the log file.  Pending
+ * data must have been finished before closing the old fd.
+ */
+void
+logz_setfd(logz_t *z, int fd)
+{
+	z->fd = fd;
+}
+
+/*
+ * Compress sz octets from buf into the current member.
+ * Returns sz on success, -1 on errors.
+ */
+ssize_t
+logz_write(logz_t *z, const void *buf, size_t sz)
+{
+	if (sz == 0)
+		return 0;
+	if (!z->pending) {
+		z->pending = 1;
+		z->since = logz_now();
+		if (z->list) {
+			z->prev = z->list->tail;
+			if (z->list->tail)
+				z->list->tail->next = z;
+			else
+				z->list->head = z;
+			z->list->tail = z;
+		}
+	}
+	z->zs.next_in = (unsigned char *)buf;
+	z->zs.avail_in = sz;
+	while (z->zs.avail_in > 0) {
+		if (deflate(&z->zs, Z_NO_FLUSH) == Z_STREAM_ERROR)
+			return -1;
+		if (z->zs.avail_out == 0 && logz_drain(z) == -1)
+			return -1;
+	}
+	return sz;
+}
+
+ssize_t
+logz_writev(logz_t *z, const struct iovec *iov, int iovcnt)
+{
+	ssize_t sz = 0;
+
+	for (int i = 0; i < iovcnt; i++) {
+		if (logz_write(z, iov[i].iov_base, iov[i].iov_len) == -1)
+			return -1;
+		sz += iov[i].iov_len;
+	}
+	return sz;
+}
+
+/*
+ * Finish the members of all streams in list whose data has been pending for
+ * at least interval milliseconds, or of all streams if force is set.
+ * Returns the number of milliseconds until the next stream is due, or -1 if
+ * no data is pending.
+ */
+int
+logz_flush_due(logz_list_t *list, unsigned int interval, int force)
+{
+	unsigned long long now, due;
+	logz_t *z;
+
+	if (!list->head)
+		return -1;
+	now = logz_now();
+	while ((z = list->head)) {
+		due = z->since + interval;
+		if (!force && due > now)
+			return due - now;
+		/* errors are reported by the next write to the stream */
+		logz_finish_member(z);
+		logz_unlink(z);
+	}
+	return -1;
+}
+
+/*
+ * Returns 1 if the file open on fd is empty or starts with gzip magic,
+ * 0 otherwise and -1 on errors.  The file position is left at the end.
+ */
+int
+logz_isgzip(int fd)
+{
+	unsigned char magic[2];
+	off_t sz;
+
+	sz = lseek(fd, 0, SEEK_END);
+	if (sz == -1)
+		return -1;
+	if (sz == 0)
+		return 1;
+	if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic))
+		return sz < (off_t)sizeof(magic) ? 0 : -1;
+	return magic[0] == 0x1f && magic[1] == 0x8b;
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,59 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LOGZ_H
+#define LOGZ_H
+
+#include "attrib.h"
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+typedef struct logz logz_t;
+
+/*
+ * List of compressed log streams with pending data, in the order in which
+ * they received their first unflushed octets.
+ */
+typedef struct logz_list {
+	logz_t *head;
+	logz_t *tail;
+} logz_list_t;
+
+logz_t * logz_new(int, logz_list_t *) MALLOC;
+void logz_free(logz_t *) NONNULL(1);
+void logz_setfd(logz_t *, int) NONNULL(1);
+ssize_t logz_write(logz_t *, const void *, size_t) NONNULL(1) WUNRES;
+ssize_t logz_writev(logz_t *, const struct iovec *, int) NONNULL(1,2) WUNRES;
+int logz_finish(logz_t *) NONNULL(1) WUNRES;
+int logz_flush_due(logz_list_t *, unsigned int, int) NONNULL(1);
+int logz_isgzip(int) WUNRES;
+
+#endif /* !LOGZ_H */
+
+/* vim: set noet ft=c: */
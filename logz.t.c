@@ -0,0 +1,202 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "logz.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include <check.h>
+
+static char template[] = "/tmp/sslsplit.test.XXXXXX";
+static char *fn;
+static int fd;
+
+static void
+logz_setup(void)
+{
+	fn = strdup(template);
+	fd = mkstemp(fn);
+	if (fd == -1) {
+		perror("mkstemp");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void
+logz_teardown(void)
+{
+	close(fd);
+	unlink(fn);
+	free(fn);
+}
+
+/*
+ * Decompress all gzip members in the file into buf.  Returns the number of
+ * octets decompressed, or -1 on errors or trailing garbage.
+ */
+static ssize_t
+logz_t_inflate(unsigned char *buf, size_t bufsz)
+{
+	unsigned char in[4096];
+	z_stream zs;
+	ssize_t n;
+	off_t off = 0;
+	int rv = Z_OK;
+
+	memset(&zs, 0, sizeof(zs));
+	/* window bits 15 + 32 for automatic gzip header detection */
+	if (inflateInit2(&zs, 15 + 32) != Z_OK)
+		return -1;
+	zs.next_out = buf;
+	zs.avail_out = bufsz;
+	while ((n = pread(fd, in, sizeof(in), off)) > 0) {
+		off += n;
+		zs.next_in = in;
+		zs.avail_in = n;
+		while (zs.avail_in > 0) {
+			rv = inflate(&zs, Z_NO_FLUSH);
+			if (rv == Z_STREAM_END) {
+				inflateReset(&zs);
+			} else if (rv != Z_OK) {
+				inflateEnd(&zs);
+				return -1;
+			}
+		}
+	}
+	inflateEnd(&zs);
+	if (rv != Z_STREAM_END)
+		return -1;
+	return bufsz - zs.avail_out;
+}
+
+START_TEST(logz_01)
+{
+	unsigned char out[64];
+	logz_t *z;
+
+	z = logz_new(fd, NULL);
+	fail_unless(!!z, "logz_new failed");
+	fail_unless(logz_write(z, "foo", 3) == 3, "write failed");
+	fail_unless(logz_finish(z) == 0, "finish failed");
+	fail_unless(logz_finish(z) == 0, "empty finish failed");
+	fail_unless(logz_write(z, "bar", 3) == 3, "write failed");
+	logz_free(z);
+
+	fail_unless(logz_t_inflate(out, sizeof(out)) == 6, "wrong size");
+	fail_unless(!memcmp(out, "foobar", 6), "wrong content");
+}
+END_TEST
+
+START_TEST(logz_02)
+{
+	unsigned char in[200000], out[200000];
+	struct iovec iov[2];
+	logz_t *z;
+
+	for (size_t i = 0; i < sizeof(in); i++)
+		in[i] = (unsigned char)(i * 7 + i / 13);
+	iov[0].iov_base = in;
+	iov[0].iov_len = 1000;
+	iov[1].iov_base = in + 1000;
+	iov[1].iov_len = sizeof(in) - 1000;
+
+	z = logz_new(fd, NULL);
+	fail_unless(!!z, "logz_new failed");
+	fail_unless(logz_writev(z, iov, 2) == sizeof(in), "writev failed");
+	logz_free(z);
+
+	fail_unless(logz_t_inflate(out, sizeof(out)) == sizeof(in),
+	            "wrong size");
+	fail_unless(!memcmp(out, in, sizeof(in)), "wrong content");
+}
+END_TEST
+
+START_TEST(logz_03)
+{
+	logz_list_t list = {NULL, NULL};
+	logz_t *z1, *z2;
+
+	z1 = logz_new(fd, &list);
+	z2 = logz_new(fd, &list);
+	fail_unless(z1 && z2, "logz_new failed");
+	fail_unless(logz_flush_due(&list, 0, 0) == -1, "pending on empty");
+
+	fail_unless(logz_write(z2, "a", 1) == 1, "write failed");
+	fail_unless(logz_write(z1, "b", 1) == 1, "write failed");
+	fail_unless(list.head == z2 && list.tail == z1, "wrong order");
+	fail_unless(logz_flush_due(&list, 60000, 0) > 0, "not pending");
+	fail_unless(list.head == z2, "flushed early");
+
+	fail_unless(logz_finish(z2) == 0, "finish failed");
+	fail_unless(list.head == z1 && list.tail == z1, "not unlinked");
+	fail_unless(logz_flush_due(&list, 60000, 1) == -1, "force failed");
+	fail_unless(!list.head && !list.tail, "list not empty");
+
+	fail_unless(logz_write(z1, "c", 1) == 1, "write failed");
+	fail_unless(logz_flush_due(&list, 0, 0) == -1, "due not flushed");
+	fail_unless(!list.head, "list not empty");
+	logz_free(z1);
+	logz_free(z2);
+}
+END_TEST
+
+START_TEST(logz_04)
+{
+	fail_unless(logz_isgzip(fd) == 1, "empty file not accepted");
+	fail_unless(write(fd, "\x1f\x8b", 2) == 2, "write failed");
+	fail_unless(logz_isgzip(fd) == 1, "gzip file not accepted");
+	fail_unless(pwrite(fd, "PK", 2, 0) == 2, "write failed");
+	fail_unless(logz_isgzip(fd) == 0, "non-gzip file accepted");
+}
+END_TEST
+
+Suite *
+logz_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("logz");
+
+	tc = tcase_create("logz");
+	tcase_add_checked_fixture(tc, logz_setup, logz_teardown);
+	tcase_add_test(tc, logz_01);
+	tcase_add_test(tc, logz_02);
+	tcase_add_test(tc, logz_03);
+	tcase_add_test(tc, logz_04);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,308 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Microbenchmarks for the hot paths of the proxy core.  The output uses the
+ * format of Go benchmarks, such that results of different releases can be
+ * compared using benchstat or similar tools:
+ *
+ *   ./sslsplit.bench >old.txt; ...; ./sslsplit.bench >new.txt
+ *   benchstat old.txt new.txt
+ */
+
+#include "bench.h"
+
+#include "build.h"
+#include "ssl.h"
+#include "sys.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/utsname.h>
+
+#include <event2/event.h>
+
+static double bench_time = 1.0;
+static int bench_threads;
+static char **bench_patterns;
+static int bench_npatterns;
+
+typedef struct bench_thr {
+	pthread_t thr;
+	bench_func_t fn;
+	void *arg;
+	size_t n;
+} bench_thr_t;
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *
+bench_thr(void *arg)
+{
+	bench_thr_t *bt = arg;
+
+	bt->fn(bt->arg, bt->n);
+	return NULL;
+}
+
+/*
+ * Run fn for n iterations in total, spread across nthreads threads.
+ * Returns the elapsed wall time in seconds.
+ */
+static double
+bench_run_n(int nthreads, bench_func_t fn, void *arg, size_t n)
+{
+	bench_thr_t *bt;
+	double start;
+	int i;
+
+	if (nthreads <= 1) {
+		start = bench_now();
+		fn(arg, n);
+		return bench_now() - start;
+	}
+
+	if (!(bt = calloc(nthreads, sizeof(bench_thr_t)))) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < nthreads; i++) {
+		bt[i].fn = fn;
+		bt[i].arg = arg;
+		bt[i].n = n / nthreads + (i < (int)(n % nthreads) ? 1 : 0);
+	}
+	start = bench_now();
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&bt[i].thr, NULL, bench_thr, &bt[i])) {
+			fprintf(stderr, "Failed to create thread\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(bt[i].thr, NULL);
+	}
+	start = bench_now() - start;
+	free(bt);
+	return start;
+}
+
+/*
+ * Run fn for n iterations on the calling thread, one iteration per call, and
+ * store the longest time a single call took in *max.
+ * Returns the elapsed wall time in seconds.
+ */
+static double
+bench_run_n_worst(bench_func_t fn, void *arg, size_t n, double *max)
+{
+	double start, last, now;
+
+	*max = 0;
+	start = last = bench_now();
+	while (n--) {
+		fn(arg, 1);
+		now = bench_now();
+		if (now - last > *max)
+			*max = now - last;
+		last = now;
+	}
+	return last - start;
+}
+
+/*
+ * Number of threads to use for concurrent benchmarks.
+ */
+int
+bench_nthreads(void)
+{
+	return bench_threads;
+}
+
+/*
+ * Run a benchmark and print the result.  The number of iterations is
+ * increased until a run takes at least the benchmark time, using the same
+ * heuristic as the Go testing package.  With worst set, the benchmark runs on
+ * a single thread and the result includes the longest iteration of the
+ * final run.
+ */
+static void
+bench_run_internal(const char *name, int nthreads, bench_func_t fn, void *arg,
+                   int worst)
+{
+	char fullname[256];
+	double elapsed, max = 0;
+	size_t n, goal;
+	int i;
+
+	snprintf(fullname, sizeof(fullname), "Benchmark%s-%d",
+	         name, nthreads);
+	if (bench_npatterns > 0) {
+		for (i = 0; i < bench_npatterns; i++) {
+			if (strstr(fullname, bench_patterns[i]))
+				break;
+		}
+		if (i == bench_npatterns)
+			return;
+	}
+
+	n = 1;
+	elapsed = worst ? bench_run_n_worst(fn, arg, n, &max)
+	                : bench_run_n(nthreads, fn, arg, n);
+	while (elapsed < bench_time && n < 1000000000) {
+		if (elapsed > 0)
+			goal = (size_t)(bench_time * n / elapsed * 1.2);
+		else
+			goal = n * 100;
+		if (goal > n * 100)
+			goal = n * 100;
+		if (goal <= n)
+			goal = n + 1;
+		n = goal;
+		elapsed = worst ? bench_run_n_worst(fn, arg, n, &max)
+		                : bench_run_n(nthreads, fn, arg, n);
+	}
+	if (worst)
+		printf("%s\t%10zu\t%12.1f ns/op\t%12.1f max-ns/op\n",
+		       fullname, n, elapsed * 1e9 / n, max * 1e9);
+	else
+		printf("%s\t%10zu\t%12.1f ns/op\n",
+		       fullname, n, elapsed * 1e9 / n);
+	fflush(stdout);
+}
+
+void
+bench_run(const char *name, int nthreads, bench_func_t fn, void *arg)
+{
+	bench_run_internal(name, nthreads, fn, arg, 0);
+}
+
+/*
+ * Run a benchmark of the worst case input of a parser on attacker controlled
+ * data.  Since such input is handled on the worker thread of the connection,
+ * the longest single iteration is reported next to the average, to keep the
+ * tail latency it adds to other connections on the same thread bounded.
+ */
+void
+bench_run_worst(const char *name, bench_func_t fn, void *arg)
+{
+	bench_run_internal(name, 1, fn, arg, 1);
+}
+
+static void
+bench_usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-t seconds] [-j threads] [pattern ...]\n"
+	                " -t seconds  minimum run time per benchmark "
+	                "(default: 1)\n"
+	                " -j threads  threads for concurrent benchmarks "
+	                "(default: 4)\n"
+	                " pattern     only run benchmarks whose name "
+	                "contains pattern\n", argv0);
+}
+
+void ssl_bench(void);
+void cachemgr_bench(void);
+void thrqueue_bench(void);
+void logbuf_bench(void);
+void base64_bench(void);
+void url_bench(void);
+void pxyconn_bench(void);
+
+int
+main(int argc, char *argv[])
+{
+	struct utsname u;
+	char *end;
+	int ch;
+
+	bench_threads = 4;
+	while ((ch = getopt(argc, argv, "t:j:h")) != -1) {
+		switch (ch) {
+			case 't':
+				bench_time = strtod(optarg, &end);
+				if (*end != '\0' || bench_time <= 0) {
+					bench_usage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'j':
+				bench_threads = strtol(optarg, &end, 10);
+				if (*end != '\0' || bench_threads < 1) {
+					bench_usage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'h':
+				bench_usage(argv[0]);
+				exit(EXIT_SUCCESS);
+			default:
+				bench_usage(argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+	bench_patterns = argv + optind;
+	bench_npatterns = argc - optind;
+
+	if (ssl_init() == -1) {
+		fprintf(stderr, "Failed to initialize OpenSSL\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (uname(&u) == 0) {
+		printf("os: %s\n", u.sysname);
+		printf("arch: %s\n", u.machine);
+	}
+	printf("pkg: %s\n", build_pkgname);
+	printf("version: %s\n", build_version);
+	printf("openssl: %s\n", SSLeay_version(SSLEAY_VERSION));
+	printf("libevent: %s\n", event_get_version());
+	printf("cpu: %u cores\n", sys_get_cpu_cores());
+
+	ssl_bench();
+	cachemgr_bench();
+	thrqueue_bench();
+	logbuf_bench();
+	base64_bench();
+	url_bench();
+	pxyconn_bench();
+
+	ssl_fini();
+	return EXIT_SUCCESS;
+}
+
+/* vim: set noet ft=c: */
@@ -37,17 +37,25 @@
 #include "ssl.h"
 #include "nat.h"
 #include "proc.h"
+#include "iouring.h"
 #include "cachemgr.h"
+#include "sslticket.h"
 #include "sys.h"
 #include "log.h"
 #include "build.h"
 #include "defaults.h"
+#include "mempool.h"
+#include "stats.h"
+#include "inspect.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <signal.h>
 #include <string.h>
+#include <errno.h>
+#include <setjmp.h>
+#include <pthread.h>
 
 #ifndef __BSD__
 #include <getopt.h>
@@ -225,7 +233,7 @@ main_usage(void)
 "              see option -F for pathspec format\n"
 #ifndef WITHOUT_MIRROR
 "  -I if       mirror packets to interface\n"
-"  -T addr     mirror packets to target address (used with -I)\n"
+"  -T addrs    mirror packets to target address(es) (used with -I)\n"
 #define OPT_I "I:"
 #define OPT_T "T:"
 #else /* WITHOUT_MIRROR */
@@ -268,65 +276,176 @@ main_usage(void)
 }
 
 /*
- * Callback to load a cert/chain/key combo from a single PEM file for -t.
- * A return value of -1 indicates a fatal error to the file walker.
+ * State for loading all cert/chain/key combos from the PEM files in the -t
+ * directory.  The files are parsed in parallel by a pool of threads, each
+ * claiming the next unparsed file; the results are then inserted into the
+ * target cert match table by the main thread in directory order.
  */
-static int
-main_load_leafcert(const char *filename, void *arg)
-{
-	opts_t *opts = arg;
+typedef struct main_leafcert {
+	char *filename;
 	cert_t *cert;
 	char **names;
+} main_leafcert_t;
+
+typedef struct main_leafcerts {
+	main_leafcert_t *files;
+	size_t count;
+	size_t size;
+	size_t next;
+} main_leafcerts_t;
+
+/*
+ * Callback to collect the name of a single PEM file for -t.
+ */
+static int
+main_collect_leafcert(const char *filename, void *arg)
+{
+	main_leafcerts_t *lc = arg;
+
+	if (lc->count == lc->size) {
+		size_t size = lc->size ? lc->size * 2 : 64;
+		main_leafcert_t *files;
 
-	cert = opts_load_cert_chain_key(filename);
-	if (!cert)
+		files = realloc(lc->files, size * sizeof(main_leafcert_t));
+		if (!files)
+			return -1;
+		lc->files = files;
+		lc->size = size;
+	}
+	if (!(lc->files[lc->count].filename = strdup(filename)))
 		return -1;
+	lc->files[lc->count].cert = NULL;
+	lc->files[lc->count].names = NULL;
+	lc->count++;
+	return 0;
+}
 
-	if (OPTS_DEBUG(opts)) {
-		log_dbg_printf("Targets for '%s':", filename);
+/*
+ * Worker thread parsing PEM files for -t until none are left.
+ */
+static void *
+main_parse_leafcerts(void *arg)
+{
+	main_leafcerts_t *lc = arg;
+	main_leafcert_t *f;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&lc->next, 1,
+	                               __ATOMIC_RELAXED)) < lc->count) {
+		f = &lc->files[i];
+		if (!(f->cert = opts_load_cert_chain_key(f->filename)))
+			continue;
+		f->names = ssl_x509_names(f->cert->crt);
 	}
-	names = ssl_x509_names(cert->crt);
-	for (char **p = names; *p; p++) {
-		/* be deliberately vulnerable to NULL prefix attacks */
-		char *sep;
-		if ((sep = strchr(*p, '!'))) {
-			*sep = '\0';
+	return NULL;
+}
+
+/*
+ * Load the cert/chain/key combos from all PEM files in dirname for -t into
+ * the read-only target cert match table.
+ * Returns -1 on error, 0 on success.
+ */
+static int
+main_load_leafcerts(opts_t *opts, const char *dirname)
+{
+	main_leafcerts_t lc;
+	pthread_t *thrs;
+	size_t nthrs, started;
+	int rv = -1;
+
+	memset(&lc, 0, sizeof(lc));
+	if (sys_dir_eachfile(dirname, main_collect_leafcert, &lc) == -1)
+		goto out;
+
+	nthrs = sys_get_cpu_cores();
+	if (nthrs > lc.count)
+		nthrs = lc.count;
+	if (nthrs < 1)
+		nthrs = 1;
+	if (!(thrs = malloc(nthrs * sizeof(pthread_t))))
+		goto out;
+	/* the calling thread parses alongside the workers */
+	for (started = 0; started + 1 < nthrs; started++) {
+		if (pthread_create(&thrs[started], NULL,
+		                   main_parse_leafcerts, &lc))
+			break;
+	}
+	main_parse_leafcerts(&lc);
+	for (size_t i = 0; i < started; i++) {
+		pthread_join(thrs[i], NULL);
+	}
+	free(thrs);
+
+	if (!cachemgr_tgmatch && !(cachemgr_tgmatch = certmatch_new()))
+		goto out;
+	rv = 0;
+	for (size_t i = 0; i < lc.count; i++) {
+		main_leafcert_t *f = &lc.files[i];
+
+		if (!f->cert || !f->names) {
+			rv = -1;
+			continue;
 		}
 		if (OPTS_DEBUG(opts)) {
-			log_dbg_printf(" '%s'", *p);
+			log_dbg_printf("Targets for '%s':", f->filename);
+		}
+		for (char **p = f->names; *p; p++) {
+			/* be deliberately vulnerable to NULL prefix attacks */
+			char *sep;
+			if ((sep = strchr(*p, '!'))) {
+				*sep = '\0';
+			}
+			if (OPTS_DEBUG(opts)) {
+				log_dbg_printf(" '%s'", *p);
+			}
+			if (certmatch_add(cachemgr_tgmatch, *p, f->cert) == -1)
+				rv = -1;
+		}
+		if (OPTS_DEBUG(opts)) {
+			log_dbg_printf("\n");
 		}
-		cachemgr_tgcrt_set(*p, cert);
-		free(*p);
 	}
-	if (OPTS_DEBUG(opts)) {
-		log_dbg_printf("\n");
+out:
+	for (size_t i = 0; i < lc.count; i++) {
+		main_leafcert_t *f = &lc.files[i];
+
+		if (f->names) {
+			for (char **p = f->names; *p; p++) {
+				free(*p);
+			}
+			free(f->names);
+		}
+		if (f->cert)
+			cert_free(f->cert);
+		free(f->filename);
 	}
-	free(names);
-	cert_free(cert);
-	return 0;
+	free(lc.files);
+	return rv;
 }
 
 /*
- * Main entry point.
+ * Parse the command line, including any configuration files, into the fresh
+ * opts_t opts and check it for consistency.  Fails on any error, see
+ * opts_fail().  Also used for reloading the configuration, see main_reload().
  */
-int
-main(int argc, char *argv[])
+static void
+main_opts_load(opts_t *opts, int argc, char *argv[])
 {
-	const char *argv0;
+	const char *argv0 = argv[0];
 	int ch;
-	opts_t *opts;
-	char *natengine;
-	int pidfd = -1;
-	int rv = EXIT_FAILURE;
 
-	argv0 = argv[0];
-	opts = opts_new();
+	/* getopt(3) only rescans argv from the beginning after a reset */
+#ifdef __GLIBC__
+	optind = 0;
+#else /* !__GLIBC__ */
+	optind = 1;
+	optreset = 1;
+#endif /* !__GLIBC__ */
+
 	if (nat_getdefaultname()) {
-		natengine = strdup(nat_getdefaultname());
-		if (!natengine)
+		opts->natengine = strdup(nat_getdefaultname());
+		if (!opts->natengine)
 			oom_die(argv0);
-	} else {
-		natengine = NULL;
 	}
 
 	while ((ch = getopt(argc, argv,
@@ -340,16 +459,16 @@ main(int argc, char *argv[])
 				opts->conffile = strdup(optarg);
 				if (!opts->conffile)
 					oom_die(argv0);
-				if (load_conffile(opts, argv0, &natengine) == -1) {
-					exit(EXIT_FAILURE);
+				if (load_conffile(opts, argv0) == -1) {
+					opts_fail();
 				}
 #ifdef DEBUG_OPTS
 				log_dbg_printf("Conf file: %s\n", opts->conffile);
 #endif /* DEBUG_OPTS */
 				break;
 			case 'o':
-				if (opts_set_option(opts, argv0, optarg, &natengine) == -1) {
-					exit(EXIT_FAILURE);
+				if (opts_set_option(opts, argv0, optarg) == -1) {
+					opts_fail();
 				}
 				break;
 			case 'c':
@@ -415,10 +534,10 @@ main(int argc, char *argv[])
 				break;
 #endif /* !OPENSSL_NO_ENGINE */
 			case 'e':
-				if (natengine)
-					free(natengine);
-				natengine = strdup(optarg);
-				if (!natengine)
+				if (opts->natengine)
+					free(opts->natengine);
+				opts->natengine = strdup(optarg);
+				if (!opts->natengine)
 					oom_die(argv0);
 				break;
 			case 'E':
@@ -493,35 +612,35 @@ main(int argc, char *argv[])
 				main_usage();
 				exit(EXIT_SUCCESS);
 			case '?':
-				exit(EXIT_FAILURE);
+				opts_fail();
 			default:
 				main_usage();
-				exit(EXIT_FAILURE);
+				opts_fail();
 		}
 	}
 	argc -= optind;
 	argv += optind;
-	proxyspec_parse(&argc, &argv, natengine, &opts->spec);
+	proxyspec_parse(&argc, &argv, opts->natengine, &opts->spec);
 
 	/* usage checks before defaults */
 	if (opts->detach && OPTS_DEBUG(opts)) {
 		fprintf(stderr, "%s: -d and -D are mutually exclusive.\n",
 		                argv0);
-		exit(EXIT_FAILURE);
+		opts_fail();
 	}
 #ifndef WITHOUT_MIRROR
 	if (opts->mirrortarget && !opts->mirrorif) {
 		fprintf(stderr, "%s: -T depends on -I.\n", argv0);
-		exit(EXIT_FAILURE);
+		opts_fail();
 	}
 	if (opts->mirrorif && !opts->mirrortarget) {
 		fprintf(stderr, "%s: -I depends on -T.\n", argv0);
-		exit(EXIT_FAILURE);
+		opts_fail();
 	}
 #endif /* !WITHOUT_MIRROR */
 	if (!opts->spec) {
 		fprintf(stderr, "%s: no proxyspec specified.\n", argv0);
-		exit(EXIT_FAILURE);
+		opts_fail();
 	}
 	for (proxyspec_t *spec = opts->spec; spec; spec = spec->next) {
 		if (spec->connect_addrlen || spec->sni_port)
@@ -531,55 +650,223 @@ main(int argc, char *argv[])
 			                "on this platform.\n"
 			                "Only static addr and SNI proxyspecs "
 			                "supported.\n", argv0);
-			exit(EXIT_FAILURE);
+			opts_fail();
 		}
 		if (spec->listen_addr.ss_family == AF_INET6 &&
 		    !nat_ipv6ready(spec->natengine)) {
 			fprintf(stderr, "%s: IPv6 not supported by '%s'\n",
 			                argv0, spec->natengine);
-			exit(EXIT_FAILURE);
+			opts_fail();
 		}
 		spec->natlookup = nat_getlookupcb(spec->natengine);
 		spec->natsocket = nat_getsocketcb(spec->natengine);
+		spec->natforget = nat_getforgetcb(spec->natengine);
 	}
 	if (opts_has_ssl_spec(opts)) {
-		if (ssl_init() == -1) {
-			fprintf(stderr, "%s: failed to initialize OpenSSL.\n",
-			                argv0);
-			exit(EXIT_FAILURE);
-		}
-#ifndef OPENSSL_NO_ENGINE
-		if (opts->openssl_engine &&
-		    ssl_engine(opts->openssl_engine) == -1) {
-			fprintf(stderr, "%s: failed to enable OpenSSL engine"
-			                " %s.\n", argv0, opts->openssl_engine);
-			exit(EXIT_FAILURE);
-		}
-#endif /* !OPENSSL_NO_ENGINE */
 		if (opts->cacrt && !opts->cakey) {
 			fprintf(stderr, "%s: no CA key specified (-k).\n",
 			                argv0);
-			exit(EXIT_FAILURE);
+			opts_fail();
 		}
 		if (opts->cakey && !opts->cacrt) {
 			fprintf(stderr, "%s: no CA cert specified (-c).\n",
 			                argv0);
-			exit(EXIT_FAILURE);
+			opts_fail();
 		}
 		if (opts->cakey && opts->cacrt &&
 		    (X509_check_private_key(opts->cacrt, opts->cakey) != 1)) {
 			fprintf(stderr, "%s: CA cert does not match key.\n",
 			                argv0);
 			ERR_print_errors_fp(stderr);
-			exit(EXIT_FAILURE);
+			opts_fail();
+		}
+		if (opts->eccacrt && !opts->eccakey) {
+			fprintf(stderr, "%s: no ECDSA CA key specified.\n",
+			                argv0);
+			opts_fail();
+		}
+		if (opts->eccakey && !opts->eccacrt) {
+			fprintf(stderr, "%s: no ECDSA CA cert specified.\n",
+			                argv0);
+			opts_fail();
+		}
+		if (opts->eccakey &&
+		    EVP_PKEY_base_id(opts->eccakey) != EVP_PKEY_EC) {
+			fprintf(stderr, "%s: ECDSA CA key is not an EC key.\n",
+			                argv0);
+			opts_fail();
+		}
+		if (opts->eccakey && opts->eccacrt &&
+		    (X509_check_private_key(opts->eccacrt,
+		                            opts->eccakey) != 1)) {
+			fprintf(stderr, "%s: ECDSA CA cert does not match "
+			                "key.\n", argv0);
+			ERR_print_errors_fp(stderr);
+			opts_fail();
+		}
+		if (opts->eccakey && !opts->cakey) {
+			fprintf(stderr, "%s: ECDSA CA requires an RSA CA "
+			                "(-c/-k) for fallback.\n", argv0);
+			opts_fail();
 		}
 		if (!opts->cakey &&
 		    !opts->leafcertdir &&
 		    !opts->defaultleafcert) {
 			fprintf(stderr, "%s: at least one of -c/-k, -t or -A "
 			                "must be specified\n", argv0);
+			opts_fail();
+		}
+	}
+	if (opts->natengine) {
+		free(opts->natengine);
+		opts->natengine = NULL;
+	}
+
+	if (opts->contentlog_match &&
+	    acmatch_compile(opts->contentlog_match) == -1) {
+		fprintf(stderr, "%s: failed to compile content log trigger "
+		                "patterns: %s\n", argv0, strerror(errno));
+		opts_fail();
+	}
+
+	if (opts->bypass && bypass_compile(opts->bypass) == -1) {
+		fprintf(stderr, "%s: failed to compile bypass list: %s\n",
+		        argv0, strerror(errno));
+		opts_fail();
+	}
+
+	/* dynamic defaults */
+	if (!opts->ciphers) {
+		opts->ciphers = strdup(DFLT_CIPHERS);
+		if (!opts->ciphers)
+			oom_die(argv0);
+	}
+	if (opts->chacha_prio && !opts->ciphers_chacha)
+		opts->ciphers_chacha = ssl_ciphers_chacha_first(opts->ciphers);
+	/* entry limits not set follow ForgedCertCacheMaxEntries */
+	if (opts->sslctx_maxentries == OPTS_MAXENTRIES_FKCRT)
+		opts->sslctx_maxentries = opts->fkcrt_maxentries;
+	if (opts->vrfy_maxentries == OPTS_MAXENTRIES_FKCRT)
+		opts->vrfy_maxentries = opts->fkcrt_maxentries;
+	if (opts->sni_maxentries == OPTS_MAXENTRIES_FKCRT)
+		opts->sni_maxentries = opts->fkcrt_maxentries;
+	if (opts->pass_maxentries == OPTS_MAXENTRIES_FKCRT)
+		opts->pass_maxentries = opts->fkcrt_maxentries;
+	if (opts->ocsp_maxentries == OPTS_MAXENTRIES_FKCRT)
+		opts->ocsp_maxentries = opts->fkcrt_maxentries;
+}
+
+/*
+ * Command line for reloading the configuration on SIGHUP.
+ */
+static int main_argc;
+static char **main_argv;
+
+/*
+ * Reload callback for the proxy, called on the reload thread of the proxy.
+ * Configuration errors are caught instead of exiting, see opts_fail_catch().
+ * Configuration, certificate and key files are read with the privileges and
+ * root directory of the process after dropping privileges.
+ * Returns the new configuration, or NULL on error.
+ */
+static opts_t *
+main_reload(void)
+{
+	opts_t *opts;
+	jmp_buf env;
+
+	opts = opts_new();
+	if (setjmp(env)) {
+		opts_fail_catch(NULL);
+		opts_free(opts);
+		log_err_printf("Invalid configuration\n");
+		return NULL;
+	}
+	opts_fail_catch(&env);
+	main_opts_load(opts, main_argc, main_argv);
+	opts_fail_catch(NULL);
+	return opts;
+}
+
+/*
+ * Main entry point.
+ */
+int
+main(int argc, char *argv[])
+{
+	const char *argv0;
+	opts_t *opts;
+	int pidfd = -1;
+	int rv = EXIT_FAILURE;
+
+	/* before anything allocates memory through libevent or OpenSSL */
+	mempool_preinit();
+
+	argv0 = argv[0];
+	main_argc = argc;
+	main_argv = argv;
+	opts = opts_new();
+	main_opts_load(opts, argc, argv);
+	mempool_enable(opts->mempool);
+	if (mempool_huge_enable(opts->huge_pages) == -1) {
+		fprintf(stderr, "%s: failed to enable huge pages: %s (%i)\n",
+		                argv0, strerror(errno), errno);
+		exit(EXIT_FAILURE);
+	}
+	if (opts_has_ssl_spec(opts)) {
+		if (ssl_init() == -1) {
+			fprintf(stderr, "%s: failed to initialize OpenSSL.\n",
+			                argv0);
+			exit(EXIT_FAILURE);
+		}
+#ifndef OPENSSL_NO_ENGINE
+		if (opts->openssl_engine &&
+		    ssl_engine(opts->openssl_engine) == -1) {
+			fprintf(stderr, "%s: failed to enable OpenSSL engine"
+			                " %s.\n", argv0, opts->openssl_engine);
 			exit(EXIT_FAILURE);
 		}
+#endif /* !OPENSSL_NO_ENGINE */
+#ifndef SSL_MODE_ASYNC
+		if (opts->openssl_async) {
+			fprintf(stderr, "%s: OpenSSL lacks async job "
+			                "support.\n", argv0);
+			exit(EXIT_FAILURE);
+		}
+#endif /* !SSL_MODE_ASYNC */
+#ifndef HAVE_KTLS
+		if (opts->openssl_ktls) {
+			fprintf(stderr, "%s: OpenSSL lacks kernel TLS "
+			                "support.\n", argv0);
+			exit(EXIT_FAILURE);
+		}
+#endif /* !HAVE_KTLS */
+#ifndef HAVE_EARLYDATA
+		if (opts->earlydata) {
+			fprintf(stderr, "%s: OpenSSL lacks early data "
+			                "support.\n", argv0);
+			exit(EXIT_FAILURE);
+		}
+#endif /* !HAVE_EARLYDATA */
+#ifndef HAVE_LIBCTX
+		if (opts->worker_libctx) {
+			fprintf(stderr, "%s: OpenSSL lacks library context "
+			                "support.\n", argv0);
+			exit(EXIT_FAILURE);
+		}
+#endif /* !HAVE_LIBCTX */
+#ifndef HAVE_TCP_FASTOPEN
+		if (opts->tcp_fastopen) {
+			fprintf(stderr, "%s: TCP Fast Open not supported on "
+			                "this platform.\n", argv0);
+			exit(EXIT_FAILURE);
+		}
+#endif /* !HAVE_TCP_FASTOPEN */
+	}
+	if (opts->iouring && !iouring_available()) {
+		fprintf(stderr, "%s: io_uring not supported on this "
+		                "platform or kernel.\n", argv0);
+		exit(EXIT_FAILURE);
 	}
 #ifdef __APPLE__
 	if (opts->dropuser && !!strcmp(opts->dropuser, "root") &&
@@ -602,11 +889,6 @@ main(int argc, char *argv[])
 	}
 
 	/* dynamic defaults */
-	if (!opts->ciphers) {
-		opts->ciphers = strdup(DFLT_CIPHERS);
-		if (!opts->ciphers)
-			oom_die(argv0);
-	}
 	if (!opts->dropuser && !geteuid() && !getuid() &&
 	    sys_isuser(DFLT_DROPUSER)) {
 #ifdef __APPLE__
@@ -637,6 +919,22 @@ main(int argc, char *argv[])
 		fprintf(stderr, "%s: -m depends on -u\n", argv0);
 		exit(EXIT_FAILURE);
 	}
+	if (opts->contentlog_dedupdir &&
+	    !opts->contentlog_isdir && !opts->contentlog_isspec) {
+		fprintf(stderr, "%s: ContentLogDedupDir depends on -S or -F\n",
+		        argv0);
+		exit(EXIT_FAILURE);
+	}
+	if (opts->http_upstream_pool && !opts->http_keepalive) {
+		fprintf(stderr, "%s: HTTPUpstreamPool depends on "
+		                "HTTPKeepAlive\n", argv0);
+		exit(EXIT_FAILURE);
+	}
+	if (opts->http_cache_size && !opts->http_keepalive) {
+		fprintf(stderr, "%s: HTTPCacheSize depends on "
+		                "HTTPKeepAlive\n", argv0);
+		exit(EXIT_FAILURE);
+	}
 
 	/* Warn about options that require per-connection privileged operations
 	 * to be executed through privsep, but only if dropuser is set and is
@@ -682,20 +980,95 @@ main(int argc, char *argv[])
 		main_version();
 	}
 
+	/* per-certificate leaf keys are neither persisted nor written out */
+	if (opts->leafkey_pool && (opts->certgendir || opts->fkcrtstore)) {
+		fprintf(stderr, "%s: LeafKeyPool cannot be used with -w, -W "
+		                "or ForgedCertStore\n", argv0);
+		exit(EXIT_FAILURE);
+	}
+	if (opts->certgen_warmup && !opts->certgendir) {
+		fprintf(stderr, "%s: GenCertsCacheWarmup requires -w or -W\n",
+		                argv0);
+		exit(EXIT_FAILURE);
+	}
+
+	if (opts->reuseport_steer) {
+#ifndef HAVE_REUSEPORT_CBPF
+		fprintf(stderr, "%s: ReusePortCPUSteering not supported on "
+		                "this platform.\n", argv0);
+		exit(EXIT_FAILURE);
+#endif /* !HAVE_REUSEPORT_CBPF */
+		if (!opts->reuseport) {
+			fprintf(stderr, "%s: ReusePortCPUSteering requires "
+			                "ReusePortListeners\n", argv0);
+			exit(EXIT_FAILURE);
+		}
+		/* worker processes would share the SO_REUSEPORT groups */
+		if (opts->worker_procs > 1) {
+			fprintf(stderr, "%s: ReusePortCPUSteering cannot be "
+			                "used with WorkerProcesses\n", argv0);
+			exit(EXIT_FAILURE);
+		}
+		if (!opts_has_pinned_threads(opts)) {
+			fprintf(stderr, "%s: Warning: ReusePortCPUSteering "
+			                "without WorkerCPUs has no effect\n",
+			                argv0);
+		}
+	}
+
+	/* listeners are handed over by the single child process only */
+	if (opts->worker_procs > 1 && opts->upgrade_socket) {
+		fprintf(stderr, "%s: WorkerProcesses cannot be used with "
+		                "UpgradeSocket\n", argv0);
+		exit(EXIT_FAILURE);
+	}
+
 	/* generate leaf key */
 	if (opts_has_ssl_spec(opts) && opts->cakey && !opts->leafkey) {
-		opts->leafkey = ssl_key_genrsa(DFLT_LEAFKEY_RSABITS);
+#ifndef OPENSSL_NO_EC
+		if (opts->leafkey_ec)
+			opts->leafkey = ssl_key_genec(DFLT_CURVE);
+		else
+#endif /* !OPENSSL_NO_EC */
+			opts->leafkey = ssl_key_genrsa(DFLT_LEAFKEY_RSABITS);
 		if (!opts->leafkey) {
-			fprintf(stderr, "%s: error generating RSA key:\n",
+			fprintf(stderr, "%s: error generating %s key:\n",
+			                argv0, opts->leafkey_ec ? "EC" : "RSA");
+			ERR_print_errors_fp(stderr);
+			exit(EXIT_FAILURE);
+		}
+		if (OPTS_DEBUG(opts)) {
+			if (opts->leafkey_ec) {
+				log_dbg_printf("Generated %s EC key for leaf "
+				               "certs.\n", DFLT_CURVE);
+			} else {
+				log_dbg_printf("Generated %i bit RSA key for "
+				               "leaf certs.\n",
+				               DFLT_LEAFKEY_RSABITS);
+			}
+		}
+	}
+#ifndef OPENSSL_NO_EC
+	if (opts_has_ssl_spec(opts) && opts->eccakey && !opts->ecleafkey) {
+		opts->ecleafkey = ssl_key_genec(DFLT_CURVE);
+		if (!opts->ecleafkey) {
+			fprintf(stderr, "%s: error generating EC key:\n",
 			                argv0);
 			ERR_print_errors_fp(stderr);
 			exit(EXIT_FAILURE);
 		}
 		if (OPTS_DEBUG(opts)) {
-			log_dbg_printf("Generated %i bit RSA key for leaf "
-			               "certs.\n", DFLT_LEAFKEY_RSABITS);
+			log_dbg_printf("Generated %s EC key for ECDSA leaf "
+			               "certs.\n", DFLT_CURVE);
 		}
 	}
+#endif /* !OPENSSL_NO_EC */
+	if (opts_fktmpl_setup(opts) == -1) {
+		fprintf(stderr, "%s: error setting up forging templates:\n",
+		                argv0);
+		ERR_print_errors_fp(stderr);
+		exit(EXIT_FAILURE);
+	}
 	if (opts->certgendir && opts->leafkey) {
 		char *keyid, *keyfn;
 		int prv;
@@ -760,6 +1133,11 @@ main(int argc, char *argv[])
 		} else {
 			log_dbg_printf("No CA loaded.\n");
 		}
+		if (opts->eccacrt) {
+			char *subj = ssl_x509_subject(opts->eccacrt);
+			log_dbg_printf("Loaded ECDSA CA: '%s'\n", subj);
+			free(subj);
+		}
 		log_dbg_printf("SSL/TLS leaf certificates taken from:\n");
 		if (opts->leafcertdir) {
 			log_dbg_printf("- Matching PEM file in %s\n",
@@ -780,10 +1158,55 @@ main(int argc, char *argv[])
 	 * Initialize as much as possible before daemon() in order to be
 	 * able to provide direct feedback to the user when failing.
 	 */
+	if (stats_init(opts->spec ? opts->spec->idx + 1 : 0) == -1 ||
+	    stats_cpu_init(opts->stats_cputop) == -1 ||
+	    stats_tcp_init(opts->stats_tcptop) == -1) {
+		fprintf(stderr, "%s: failed to init stats.\n", argv0);
+		exit(EXIT_FAILURE);
+	}
+	if (opts->stats_lockprof)
+		stats_lockprof_enable();
+	if (opts->stats_perf && stats_perf_enable() == -1) {
+		fprintf(stderr, "%s: performance counters not available: "
+		        "%s (%i)\n", argv0, strerror(errno), errno);
+		exit(EXIT_FAILURE);
+	}
+	for (proxyspec_t *spec = opts->spec; spec; spec = spec->next) {
+		char *specstr = proxyspec_str(spec);
+		if (!specstr || stats_set_spec(spec->idx, specstr) == -1) {
+			fprintf(stderr, "%s: failed to init stats.\n", argv0);
+			exit(EXIT_FAILURE);
+		}
+		free(specstr);
+	}
 	if (cachemgr_preinit() == -1) {
 		fprintf(stderr, "%s: failed to preinit cachemgr.\n", argv0);
 		exit(EXIT_FAILURE);
 	}
+	cache_set_limits(cachemgr_fkcrt, opts->fkcrt_maxentries,
+	                 opts->fkcrt_maxbytes);
+	cache_set_limits(cachemgr_sslctx, opts->sslctx_maxentries, 0);
+	cache_set_limits(cachemgr_vrfy, opts->vrfy_maxentries, 0);
+	cache_set_limits(cachemgr_sni, opts->sni_maxentries, 0);
+	cache_set_limits(cachemgr_pass, opts->pass_maxentries, 0);
+	cache_set_limits(cachemgr_ocsp, opts->ocsp_maxentries, 0);
+	cache_set_limits(cachemgr_ssess, opts->ssess_maxentries,
+	                 opts->ssess_maxbytes);
+	cache_set_limits(cachemgr_dsess, opts->dsess_maxentries,
+	                 opts->dsess_maxbytes);
+	cache_set_limits(cachemgr_dns, opts->dns_maxentries, 0);
+	cache_set_limits(cachemgr_http, 0, opts->http_cache_size);
+	if (opts->cache_presize) {
+		cache_presize(cachemgr_fkcrt, opts->fkcrt_maxentries);
+		cache_presize(cachemgr_sslctx, opts->sslctx_maxentries);
+		cache_presize(cachemgr_vrfy, opts->vrfy_maxentries);
+		cache_presize(cachemgr_sni, opts->sni_maxentries);
+		cache_presize(cachemgr_pass, opts->pass_maxentries);
+		cache_presize(cachemgr_ocsp, opts->ocsp_maxentries);
+		cache_presize(cachemgr_ssess, opts->ssess_maxentries);
+		cache_presize(cachemgr_dsess, opts->dsess_maxentries);
+		cache_presize(cachemgr_dns, opts->dns_maxentries);
+	}
 	if (log_preinit(opts) == -1) {
 		fprintf(stderr, "%s: failed to preinit logging.\n", argv0);
 		exit(EXIT_FAILURE);
@@ -794,15 +1217,143 @@ main(int argc, char *argv[])
 	}
 
 	/* Load certs before dropping privs but after cachemgr_preinit() */
-	if (opts->leafcertdir) {
-		if (sys_dir_eachfile(opts->leafcertdir,
-		                     main_load_leafcert, opts) == -1) {
+	if (opts->leafcertdir && opts->leafcertdir_lazy) {
+		char *dir;
+		int rv;
+
+		/* certs are loaded on demand after chroot(2) and detaching */
+		if (opts->jaildir) {
+			fprintf(stderr, "%s: LeafCertDirLazy cannot be used "
+			                "with -j\n", argv0);
+			exit(EXIT_FAILURE);
+		}
+		if (!(dir = realpath(opts->leafcertdir, NULL))) {
+			fprintf(stderr, "%s: Failed to realpath '%s': %s (%i)\n",
+			                argv0, opts->leafcertdir,
+			                strerror(errno), errno);
+			exit(EXIT_FAILURE);
+		}
+		free(opts->leafcertdir);
+		opts->leafcertdir = dir;
+		if (!(cachemgr_tgidx = certindex_new())) {
+			fprintf(stderr, "%s: out of memory\n", argv0);
+			exit(EXIT_FAILURE);
+		}
+		rv = 1;
+		if (opts->leafcertdir_index) {
+			rv = certindex_load(cachemgr_tgidx,
+			                    opts->leafcertdir_index);
+		}
+		if (rv == 1) {
+			rv = certindex_scan(cachemgr_tgidx, opts->leafcertdir);
+			if (rv == 0 && opts->leafcertdir_index &&
+			    certindex_save(cachemgr_tgidx,
+			                   opts->leafcertdir_index) == -1) {
+				log_err_printf("Warning: failed to save "
+				               "certificate index to %s\n",
+				               opts->leafcertdir_index);
+			}
+		}
+		if (rv == -1) {
+			fprintf(stderr, "%s: failed to index certs from %s\n",
+			                argv0, opts->leafcertdir);
+			exit(EXIT_FAILURE);
+		}
+		cache_set_limits(cachemgr_tgcrt, opts->tgcrt_maxentries, 0);
+		if (opts->cache_presize)
+			cache_presize(cachemgr_tgcrt, opts->tgcrt_maxentries);
+		if (OPTS_DEBUG(opts)) {
+			log_dbg_printf("Indexed %zu names in %zu certificate "
+			               "files from %s\n",
+			               certindex_entries(cachemgr_tgidx),
+			               certindex_files(cachemgr_tgidx),
+			               opts->leafcertdir);
+		}
+	} else if (opts->leafcertdir) {
+		if (main_load_leafcerts(opts, opts->leafcertdir) == -1) {
 			fprintf(stderr, "%s: failed to load certs from %s\n",
 			                argv0, opts->leafcertdir);
 			exit(EXIT_FAILURE);
 		}
 	}
 
+	/* Open forged cert store before dropping privs and detaching */
+	if (opts->fkcrtstore && opts->cakey && opts->leafkey) {
+		cachemgr_fkstore = certstore_open(opts->fkcrtstore,
+		                                  opts->cacrt, opts->leafkey,
+		                                  opts->leafcrlurl);
+		if (!cachemgr_fkstore) {
+			fprintf(stderr, "%s: failed to open forged cert store "
+			                "%s\n", argv0, opts->fkcrtstore);
+			exit(EXIT_FAILURE);
+		}
+		if (OPTS_DEBUG(opts)) {
+			log_dbg_printf("Loaded %zu forged certificates from "
+			               "%s\n", certstore_entries(cachemgr_fkstore),
+			               opts->fkcrtstore);
+		}
+	}
+
+	/* Open gendir for warming up the forged cert cache before chroot */
+	if (opts->certgen_warmup && opts->cakey && opts->leafkey) {
+		if (cachemgr_fkcrt_warm_open(opts->certgendir) == -1) {
+			fprintf(stderr, "%s: failed to open %s: %s (%i)\n",
+			                argv0, opts->certgendir,
+			                strerror(errno), errno);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* Restore session caches before dropping privs and forking */
+	if (opts->sessstore) {
+		ssize_t n;
+
+		cachemgr_sessstore = sessstore_open(opts->sessstore);
+		if (!cachemgr_sessstore) {
+			fprintf(stderr, "%s: failed to open session store "
+			                "%s\n", argv0, opts->sessstore);
+			exit(EXIT_FAILURE);
+		}
+		if ((n = cachemgr_sess_load()) == -1) {
+			fprintf(stderr, "%s: failed to load session store "
+			                "%s\n", argv0, opts->sessstore);
+			exit(EXIT_FAILURE);
+		}
+		if (OPTS_DEBUG(opts)) {
+			log_dbg_printf("Restored %zi SSL sessions from %s\n",
+			               n, opts->sessstore);
+		}
+	}
+
+	/* Load or generate session ticket keys before dropping privs */
+	if (opts->sslticket && sslticket_init(opts->ticketkeyfile) == -1) {
+		fprintf(stderr, "%s: failed to set up session ticket keys\n",
+		                argv0);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Set up caches and ticket keys shared by all worker processes */
+	if (opts->worker_procs > 1) {
+		if (cachemgr_share(opts->shcache_size) == -1) {
+			fprintf(stderr, "%s: failed to set up shared caches of "
+			                "%zu bytes\n", argv0, opts->shcache_size);
+			exit(EXIT_FAILURE);
+		}
+		if (opts->sslticket && sslticket_share() == -1) {
+			fprintf(stderr, "%s: failed to share session ticket "
+			                "keys\n", argv0);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* Resolve remote cache servers before dropping privileges */
+	if (opts->rcache_servers &&
+	    cachemgr_remote(opts->rcache_servers, opts->rcache_timeout) == -1) {
+		fprintf(stderr, "%s: failed to set up remote cache servers "
+		                "'%s'\n", argv0, opts->rcache_servers);
+		exit(EXIT_FAILURE);
+	}
+
 	/* Detach from tty; from this point on, only canonicalized absolute
 	 * paths should be used (-j, -F, -S). */
 	if (opts->detach) {
@@ -825,10 +1376,11 @@ main(int argc, char *argv[])
 	}
 
 	/* Fork into parent monitor process and (potentially unprivileged)
-	 * child process doing the actual work.  We request 6 privsep client
-	 * sockets: five logger threads, and the child process main thread,
-	 * which will become the main proxy thread.  First slot is main thread,
-	 * remaining slots are passed down to log subsystem. */
+	 * child process doing the actual work, or WorkerProcesses of them.
+	 * We request 6 privsep client sockets per child: five logger threads,
+	 * and the child process main thread, which will become the main proxy
+	 * thread.  First slot is main thread, remaining slots are passed down
+	 * to log subsystem. */
 	int clisock[6];
 	if (privsep_fork(opts, clisock,
 	                 sizeof(clisock)/sizeof(clisock[0]), &rv) != 0) {
@@ -846,12 +1398,21 @@ main(int argc, char *argv[])
 		close(pidfd);
 
 	/* Initialize proxy before dropping privs */
-	proxy_ctx_t *proxy = proxy_new(opts, clisock[0]);
+	proxy_ctx_t *proxy = proxy_new(opts, clisock[0], main_reload);
 	if (!proxy) {
 		log_err_printf("Failed to initialize proxy.\n");
 		exit(EXIT_FAILURE);
 	}
 
+	/* Load inspection plugins before dropping privs and chroot */
+	for (int i = 0; i < opts->inspect_count; i++) {
+		if (inspect_load(opts->inspect[i]) == -1) {
+			log_err_printf("Failed to load inspection plugin "
+			               "'%s'\n", opts->inspect[i]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
 	/* Drop privs, chroot */
 	if (sys_privdrop(opts->dropuser, opts->dropgroup,
 	                 opts->jaildir) == -1) {
@@ -878,6 +1439,12 @@ main(int argc, char *argv[])
 		log_err_printf("Failed to init cache manager.\n");
 		goto out_cachemgr_failed;
 	}
+	if (opts->certgen_warmup && opts->cakey && opts->leafkey &&
+	    cachemgr_fkcrt_warm(opts->cacrt, opts->leafkey, opts->eccacrt,
+	                        opts->ecleafkey) == -1) {
+		log_err_printf("Failed to start forged cert cache warmup.\n");
+		goto out_nat_failed;
+	}
 	if (nat_init() == -1) {
 		log_err_printf("Failed to init NAT state table lookup.\n");
 		goto out_nat_failed;
@@ -901,9 +1468,22 @@ main(int argc, char *argv[])
 		}
 	}
 	proxy_free(proxy);
+	inspect_fini();
+	/* worker processes share one file, only the first one saves */
+	if (opts->sessstore && privsep_worker() == 0) {
+		ssize_t n = cachemgr_sess_save();
+		if (n != -1 && OPTS_DEBUG(opts)) {
+			log_dbg_printf("Saved %zi SSL sessions to %s\n",
+			               n, opts->sessstore);
+		}
+	}
 	nat_fini();
+#ifdef HAVE_LOCAL_PROCINFO
+	proc_fini();
+#endif /* HAVE_LOCAL_PROCINFO */
 out_nat_failed:
 	cachemgr_fini();
+	sslticket_fini();
 out_cachemgr_failed:
 	log_fini();
 out_sslreinit_failed:
@@ -911,8 +1491,7 @@ out_log_failed:
 out_parent:
 	opts_free(opts);
 	ssl_fini();
-	if (natengine)
-		free(natengine);
+	stats_fini();
 	return rv;
 }
 
@@ -67,20 +67,63 @@ main_suite(void)
 
 Suite * opts_suite(void);
 Suite * dynbuf_suite(void);
+Suite * arena_suite(void);
 Suite * logbuf_suite(void);
+Suite * logdec_suite(void);
+Suite * logrule_suite(void);
+Suite * logjson_suite(void);
+Suite * logseg_suite(void);
+Suite * logcas_suite(void);
+Suite * logtap_suite(void);
+Suite * logstream_suite(void);
+Suite * logz_suite(void);
+Suite * logfdc_suite(void);
+Suite * logsync_suite(void);
+Suite * logconv_suite(void);
+Suite * logroll_suite(void);
+Suite * inspect_suite(void);
+Suite * acmatch_suite(void);
+Suite * bypass_suite(void);
+Suite * mempool_suite(void);
+Suite * thrqueue_suite(void);
+Suite * stats_suite(void);
 Suite * cert_suite(void);
 Suite * cachemgr_suite(void);
 Suite * cachefkcrt_suite(void);
+Suite * cachesslctx_suite(void);
+Suite * cachevrfy_suite(void);
+Suite * sslticket_suite(void);
 Suite * cachetgcrt_suite(void);
 Suite * cachedsess_suite(void);
 Suite * cachessess_suite(void);
+Suite * cachedns_suite(void);
+Suite * cachesni_suite(void);
+Suite * cachepass_suite(void);
+Suite * cacheocsp_suite(void);
+Suite * cachehttp_suite(void);
+Suite * certstore_suite(void);
+Suite * sessstore_suite(void);
+Suite * certindex_suite(void);
+Suite * certmatch_suite(void);
 Suite * ssl_suite(void);
 Suite * sys_suite(void);
 Suite * base64_suite(void);
 Suite * url_suite(void);
+Suite * httphdr_suite(void);
 Suite * util_suite(void);
 Suite * pxythrmgr_suite(void);
+Suite * pxyforge_suite(void);
+Suite * keypool_suite(void);
+Suite * pxyconnpool_suite(void);
+Suite * pxyhttppool_suite(void);
+Suite * shmcache_suite(void);
+Suite * rcache_suite(void);
 Suite * defaults_suite(void);
+Suite * proc_suite(void);
+Suite * iouring_suite(void);
+Suite * tmwheel_suite(void);
+Suite * admit_suite(void);
+Suite * srcpool_suite(void);
 
 int
 main(UNUSED int argc, UNUSED char *argv[])
@@ -92,20 +135,63 @@ main(UNUSED int argc, UNUSED char *argv[])
 	srunner_add_suite(sr, main_suite());
 	srunner_add_suite(sr, opts_suite());
 	srunner_add_suite(sr, dynbuf_suite());
+	srunner_add_suite(sr, arena_suite());
 	srunner_add_suite(sr, logbuf_suite());
+	srunner_add_suite(sr, logdec_suite());
+	srunner_add_suite(sr, logrule_suite());
+	srunner_add_suite(sr, logjson_suite());
+	srunner_add_suite(sr, logseg_suite());
+	srunner_add_suite(sr, logcas_suite());
+	srunner_add_suite(sr, logtap_suite());
+	srunner_add_suite(sr, logstream_suite());
+	srunner_add_suite(sr, logz_suite());
+	srunner_add_suite(sr, logfdc_suite());
+	srunner_add_suite(sr, logsync_suite());
+	srunner_add_suite(sr, logconv_suite());
+	srunner_add_suite(sr, logroll_suite());
+	srunner_add_suite(sr, inspect_suite());
+	srunner_add_suite(sr, acmatch_suite());
+	srunner_add_suite(sr, bypass_suite());
+	srunner_add_suite(sr, mempool_suite());
+	srunner_add_suite(sr, thrqueue_suite());
+	srunner_add_suite(sr, stats_suite());
 	srunner_add_suite(sr, cert_suite());
 	srunner_add_suite(sr, cachemgr_suite());
 	srunner_add_suite(sr, cachefkcrt_suite());
+	srunner_add_suite(sr, cachesslctx_suite());
+	srunner_add_suite(sr, cachevrfy_suite());
+	srunner_add_suite(sr, sslticket_suite());
 	srunner_add_suite(sr, cachetgcrt_suite());
 	srunner_add_suite(sr, cachedsess_suite());
 	srunner_add_suite(sr, cachessess_suite());
+	srunner_add_suite(sr, cachedns_suite());
+	srunner_add_suite(sr, cachesni_suite());
+	srunner_add_suite(sr, cachepass_suite());
+	srunner_add_suite(sr, cacheocsp_suite());
+	srunner_add_suite(sr, cachehttp_suite());
+	srunner_add_suite(sr, certstore_suite());
+	srunner_add_suite(sr, sessstore_suite());
+	srunner_add_suite(sr, certindex_suite());
+	srunner_add_suite(sr, certmatch_suite());
 	srunner_add_suite(sr, ssl_suite());
 	srunner_add_suite(sr, sys_suite());
 	srunner_add_suite(sr, base64_suite());
 	srunner_add_suite(sr, url_suite());
+	srunner_add_suite(sr, httphdr_suite());
 	srunner_add_suite(sr, util_suite());
 	srunner_add_suite(sr, pxythrmgr_suite());
+	srunner_add_suite(sr, pxyforge_suite());
+	srunner_add_suite(sr, keypool_suite());
+	srunner_add_suite(sr, pxyconnpool_suite());
+	srunner_add_suite(sr, pxyhttppool_suite());
+	srunner_add_suite(sr, shmcache_suite());
+	srunner_add_suite(sr, rcache_suite());
 	srunner_add_suite(sr, defaults_suite());
+	srunner_add_suite(sr, proc_suite());
+	srunner_add_suite(sr, iouring_suite());
+	srunner_add_suite(sr, tmwheel_suite());
+	srunner_add_suite(sr, admit_suite());
+	srunner_add_suite(sr, srcpool_suite());
 	srunner_run_all(sr, CK_NORMAL);
 	nfail = srunner_ntests_failed(sr);
 	srunner_free(sr);
@@ -0,0 +1,708 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "mempool.h"
+
+#include <sys/mman.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#define HAVE_MALLOC_USABLE_SIZE
+#elif defined(__FreeBSD__)
+#include <malloc_np.h>
+#define HAVE_MALLOC_USABLE_SIZE
+#endif /* __FreeBSD__ */
+
+#include <event2/event.h>
+
+#include <openssl/crypto.h>
+
+/*
+ * Per-thread caches of freed memory blocks in the size classes used by
+ * libevent evbuffer chains and OpenSSL record buffers, installed as memory
+ * allocation functions of libevent and OpenSSL.  Connection handling threads
+ * allocate and free these blocks at a high rate; serving them from a cache
+ * local to the thread avoids contention on the system allocator.
+ *
+ * Blocks are plain system malloc() blocks of the size of their class, and
+ * the class of a block is looked up from its usable size when it is freed.
+ * Blocks can therefore be freed on any thread, and memory handed out by
+ * libevent or OpenSSL to callers who free() it themselves, or the other way
+ * round, is not a problem.  Every cache holds at most MEMPOOL_CACHE_BYTES
+ * per size class; excess blocks go back to the system allocator.
+ *
+ * The usable size of the blocks handed out to libevent and OpenSSL and of the
+ * blocks held in the caches is accounted for in per-thread counters, which
+ * only make sense as a sum over all threads, since blocks are often freed on
+ * a different thread than they were allocated on.  The sums are approximate:
+ * blocks freed by callers using free() are never subtracted, and blocks from
+ * malloc() freed using mempool_free() are subtracted without ever having
+ * been added.  Counter blocks of terminated threads are kept, such that the
+ * sums stay balanced.
+ */
+
+#define MEMPOOL_CACHE_BYTES	(1024*1024)
+
+static const size_t mempool_class_sz[] = {
+	256, 512, 1024, 2048, 4096, 8192, 16384,
+	20480 /* TLS record plus overhead */
+};
+#define MEMPOOL_NCLASSES \
+	(sizeof(mempool_class_sz) / sizeof(mempool_class_sz[0]))
+
+typedef struct mempool_block {
+	struct mempool_block *next;
+} mempool_block_t;
+
+typedef struct mempool_cache {
+	mempool_block_t *head[MEMPOOL_NCLASSES];
+	size_t count[MEMPOOL_NCLASSES];
+} mempool_cache_t;
+
+typedef struct mempool_acct {
+	long long bytes[MEMPOOL_NACCTS];
+	struct mempool_acct *next;
+} mempool_acct_t;
+
+static int mempool_enabled = 0;
+static pthread_key_t mempool_key;
+static mempool_acct_t *mempool_accts = NULL;
+
+#ifdef HAVE_MALLOC_USABLE_SIZE
+static int mempool_have_acct = 0;
+static pthread_key_t mempool_acct_key;
+
+/*
+ * Add sz octets to the counter acct of the calling thread.  New counter
+ * blocks are pushed onto the list without locking; if one cannot be
+ * allocated, the update is lost.
+ */
+static void
+mempool_acct(int acct, long long sz)
+{
+	mempool_acct_t *a;
+
+	if (acct < 0 || !__atomic_load_n(&mempool_have_acct, __ATOMIC_ACQUIRE))
+		return;
+	if (!(a = pthread_getspecific(mempool_acct_key))) {
+		if (!(a = calloc(1, sizeof(mempool_acct_t))))
+			return;
+		if (pthread_setspecific(mempool_acct_key, a) != 0) {
+			free(a);
+			return;
+		}
+		a->next = __atomic_load_n(&mempool_accts, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&mempool_accts, &a->next, a,
+		                                    0, __ATOMIC_RELEASE,
+		                                    __ATOMIC_RELAXED));
+	}
+	__atomic_store_n(&a->bytes[acct], a->bytes[acct] + sz,
+	                 __ATOMIC_RELAXED);
+}
+
+static void
+mempool_cache_free(void *arg)
+{
+	mempool_cache_t *cache = arg;
+	mempool_block_t *block;
+
+	for (size_t i = 0; i < MEMPOOL_NCLASSES; i++) {
+		while ((block = cache->head[i])) {
+			cache->head[i] = block->next;
+			mempool_acct(MEMPOOL_CACHED,
+			             -(long long)malloc_usable_size(block));
+			free(block);
+		}
+	}
+	free(cache);
+}
+
+static mempool_cache_t *
+mempool_cache(void)
+{
+	mempool_cache_t *cache;
+
+	cache = pthread_getspecific(mempool_key);
+	if (!cache) {
+		cache = calloc(1, sizeof(mempool_cache_t));
+		if (!cache)
+			return NULL;
+		if (pthread_setspecific(mempool_key, cache) != 0) {
+			free(cache);
+			return NULL;
+		}
+	}
+	return cache;
+}
+
+/*
+ * Return the index of the smallest size class holding sz octets, or
+ * MEMPOOL_NCLASSES if sz is too large for any class.
+ */
+static size_t
+mempool_class_for_alloc(size_t sz)
+{
+	size_t i;
+
+	for (i = 0; i < MEMPOOL_NCLASSES; i++) {
+		if (sz <= mempool_class_sz[i])
+			break;
+	}
+	return i;
+}
+
+/*
+ * Return the index of the size class a block of usable size sz can be cached
+ * in, or MEMPOOL_NCLASSES if it cannot be cached.  Blocks much larger than
+ * the largest class are not cached in order not to waste memory.
+ */
+static size_t
+mempool_class_for_free(size_t sz)
+{
+	size_t i;
+
+	if (sz < mempool_class_sz[0] ||
+	    sz >= 2 * mempool_class_sz[MEMPOOL_NCLASSES - 1])
+		return MEMPOOL_NCLASSES;
+	for (i = MEMPOOL_NCLASSES - 1; sz < mempool_class_sz[i]; i--);
+	return i;
+}
+#endif /* HAVE_MALLOC_USABLE_SIZE */
+
+#ifdef HAVE_MALLOC_USABLE_SIZE
+/*
+ * Allocate sz octets and account them to acct, or to no counter if acct is
+ * negative.
+ */
+static void *
+mempool_malloc_acct(size_t sz, int acct)
+{
+	mempool_cache_t *cache;
+	mempool_block_t *block;
+	size_t i;
+	void *p;
+
+	if (!mempool_enabled ||
+	    (i = mempool_class_for_alloc(sz)) == MEMPOOL_NCLASSES) {
+		p = malloc(sz);
+	} else if ((cache = mempool_cache()) && (block = cache->head[i])) {
+		cache->head[i] = block->next;
+		cache->count[i]--;
+		mempool_acct(MEMPOOL_CACHED,
+		             -(long long)malloc_usable_size(block));
+		p = block;
+	} else {
+		p = malloc(mempool_class_sz[i]);
+	}
+	if (p)
+		mempool_acct(acct, malloc_usable_size(p));
+	return p;
+}
+
+static void *
+mempool_realloc_acct(void *ptr, size_t sz, int acct)
+{
+	size_t oldsz;
+	void *p;
+
+	if (!ptr)
+		return mempool_malloc_acct(sz, acct);
+	oldsz = malloc_usable_size(ptr);
+	if ((p = realloc(ptr, sz)))
+		mempool_acct(acct, (long long)malloc_usable_size(p) - oldsz);
+	return p;
+}
+
+static void
+mempool_free_acct(void *ptr, int acct)
+{
+	mempool_cache_t *cache;
+	mempool_block_t *block = ptr;
+	size_t i, sz;
+
+	if (!ptr)
+		return;
+	sz = malloc_usable_size(ptr);
+	mempool_acct(acct, -(long long)sz);
+	if (!mempool_enabled ||
+	    (i = mempool_class_for_free(sz)) == MEMPOOL_NCLASSES ||
+	    !(cache = mempool_cache()) ||
+	    (cache->count[i] + 1) * mempool_class_sz[i] >
+	    MEMPOOL_CACHE_BYTES) {
+		free(ptr);
+		return;
+	}
+	block->next = cache->head[i];
+	cache->head[i] = block;
+	cache->count[i]++;
+	mempool_acct(MEMPOOL_CACHED, sz);
+}
+#endif /* HAVE_MALLOC_USABLE_SIZE */
+
+void *
+mempool_malloc(size_t sz)
+{
+#ifdef HAVE_MALLOC_USABLE_SIZE
+	return mempool_malloc_acct(sz, -1);
+#else /* !HAVE_MALLOC_USABLE_SIZE */
+	return malloc(sz);
+#endif /* !HAVE_MALLOC_USABLE_SIZE */
+}
+
+void *
+mempool_realloc(void *ptr, size_t sz)
+{
+#ifdef HAVE_MALLOC_USABLE_SIZE
+	return mempool_realloc_acct(ptr, sz, -1);
+#else /* !HAVE_MALLOC_USABLE_SIZE */
+	return realloc(ptr, sz);
+#endif /* !HAVE_MALLOC_USABLE_SIZE */
+}
+
+void
+mempool_free(void *ptr)
+{
+#ifdef HAVE_MALLOC_USABLE_SIZE
+	mempool_free_acct(ptr, -1);
+#else /* !HAVE_MALLOC_USABLE_SIZE */
+	free(ptr);
+#endif /* !HAVE_MALLOC_USABLE_SIZE */
+}
+
+#ifdef HAVE_MALLOC_USABLE_SIZE
+#ifndef EVENT__DISABLE_MM_REPLACEMENT
+static void *
+mempool_event_malloc(size_t sz)
+{
+	return mempool_malloc_acct(sz, MEMPOOL_EVENT);
+}
+
+static void *
+mempool_event_realloc(void *ptr, size_t sz)
+{
+	return mempool_realloc_acct(ptr, sz, MEMPOOL_EVENT);
+}
+
+static void
+mempool_event_free(void *ptr)
+{
+	mempool_free_acct(ptr, MEMPOOL_EVENT);
+}
+#endif /* !EVENT__DISABLE_MM_REPLACEMENT */
+
+#if (OPENSSL_VERSION_NUMBER >= 0x10100000L)
+static void *
+mempool_crypto_malloc(size_t sz, UNUSED const char *file, UNUSED int line)
+{
+	return mempool_malloc_acct(sz, MEMPOOL_CRYPTO);
+}
+
+static void *
+mempool_crypto_realloc(void *ptr, size_t sz,
+                       UNUSED const char *file, UNUSED int line)
+{
+	return mempool_realloc_acct(ptr, sz, MEMPOOL_CRYPTO);
+}
+
+static void
+mempool_crypto_free(void *ptr, UNUSED const char *file, UNUSED int line)
+{
+	mempool_free_acct(ptr, MEMPOOL_CRYPTO);
+}
+#endif /* OPENSSL_VERSION_NUMBER >= 0x10100000L */
+#endif /* HAVE_MALLOC_USABLE_SIZE */
+
+/*
+ * Allocator for the long-lived objects of the caches and the connection
+ * context pools, which can grow to gigabytes and are accessed randomly by
+ * hash lookups, such that TLB misses become noticeable.  Without huge pages
+ * enabled, it is a thin wrapper around the system allocator.
+ *
+ * With huge pages, memory is mapped in MEMPOOL_HUGE_SZ sized and aligned
+ * regions, backed by transparent huge pages using madvise(MADV_HUGEPAGE) or
+ * by reserved huge pages using MAP_HUGETLB.  If no reserved huge pages are
+ * left, regions fall back to transparent huge pages.  Each region starts
+ * with a header and serves objects of a single power of two size class up
+ * to MEMPOOL_HUGE_MAXOBJ octets; freed objects are kept on a free list per
+ * size class and never returned to the system.  Larger objects get a
+ * mapping of their own, rounded up to a multiple of MEMPOOL_HUGE_SZ, with
+ * the header at its start.  The header of an object is found by masking its
+ * address.
+ */
+
+#define MEMPOOL_HUGE_SZ		(2*1024*1024)
+#define MEMPOOL_HUGE_HDRSZ	64
+#define MEMPOOL_HUGE_MINOBJ	16
+#define MEMPOOL_HUGE_NCLASSES	14
+#define MEMPOOL_HUGE_MAXOBJ \
+	(MEMPOOL_HUGE_MINOBJ << (MEMPOOL_HUGE_NCLASSES - 1))
+
+typedef struct mempool_huge_hdr {
+	size_t objsz;		/* size class of a region, 0 if large */
+	size_t mapsz;		/* size of the mapping */
+} mempool_huge_hdr_t;
+
+typedef struct mempool_huge_class {
+	pthread_mutex_t mutex;
+	mempool_block_t *head;
+	char *next;		/* unused space in the current region */
+	char *end;
+} mempool_huge_class_t;
+
+static int mempool_huge_mode = MEMPOOL_HUGE_NONE;
+static mempool_huge_class_t mempool_huge_class[MEMPOOL_HUGE_NCLASSES];
+static size_t mempool_huge_mapped = 0;
+
+#if defined(MAP_HUGETLB) && defined(MAP_HUGE_2MB)
+#define MEMPOOL_HUGE_TLB	(MAP_HUGETLB|MAP_HUGE_2MB)
+#elif defined(MAP_HUGETLB)
+#define MEMPOOL_HUGE_TLB	MAP_HUGETLB
+#endif
+
+#define MEMPOOL_HUGE_HDR(p) \
+	((mempool_huge_hdr_t *)((uintptr_t)(p) & ~(uintptr_t)(MEMPOOL_HUGE_SZ-1)))
+
+/*
+ * Map sz octets, a multiple of MEMPOOL_HUGE_SZ, aligned to MEMPOOL_HUGE_SZ
+ * and backed by huge pages as configured.  Flags is MAP_PRIVATE or
+ * MAP_SHARED.  Returns NULL on failure.
+ */
+static void *
+mempool_huge_map(size_t sz, int flags)
+{
+	char *base, *p;
+	size_t head;
+
+#ifdef MEMPOOL_HUGE_TLB
+	/* huge page mappings are aligned to the huge page size */
+	if (mempool_huge_mode == MEMPOOL_HUGE_EXPLICIT &&
+	    (p = mmap(NULL, sz, PROT_READ|PROT_WRITE,
+	              flags|MAP_ANON|MEMPOOL_HUGE_TLB, -1, 0)) != MAP_FAILED) {
+		__atomic_add_fetch(&mempool_huge_mapped, sz, __ATOMIC_RELAXED);
+		return p;
+	}
+#endif /* MEMPOOL_HUGE_TLB */
+	base = mmap(NULL, sz + MEMPOOL_HUGE_SZ, PROT_READ|PROT_WRITE,
+	            flags|MAP_ANON, -1, 0);
+	if (base == MAP_FAILED)
+		return NULL;
+	head = (MEMPOOL_HUGE_SZ - (uintptr_t)base % MEMPOOL_HUGE_SZ) %
+	       MEMPOOL_HUGE_SZ;
+	p = base + head;
+	if (head > 0)
+		munmap(base, head);
+	munmap(p + sz, MEMPOOL_HUGE_SZ - head);
+#ifdef MADV_HUGEPAGE
+	(void)madvise(p, sz, MADV_HUGEPAGE);
+#endif /* MADV_HUGEPAGE */
+	__atomic_add_fetch(&mempool_huge_mapped, sz, __ATOMIC_RELAXED);
+	return p;
+}
+
+static void
+mempool_huge_unmap(void *p, size_t sz)
+{
+	munmap(p, sz);
+	__atomic_sub_fetch(&mempool_huge_mapped, sz, __ATOMIC_RELAXED);
+}
+
+static size_t
+mempool_huge_roundup(size_t sz)
+{
+	return (sz + MEMPOOL_HUGE_SZ - 1) & ~(size_t)(MEMPOOL_HUGE_SZ - 1);
+}
+
+/*
+ * Select whether the allocations of mempool_huge_malloc() and friends are
+ * backed by huge pages, one of MEMPOOL_HUGE_*.  Must be called before any
+ * allocation is made.  For MEMPOOL_HUGE_EXPLICIT, at least one reserved huge
+ * page must be available.
+ * Returns 0 on success, -1 on error with errno set.
+ */
+int
+mempool_huge_enable(int mode)
+{
+	if (mode == MEMPOOL_HUGE_NONE) {
+		mempool_huge_mode = mode;
+		return 0;
+	}
+#ifndef MADV_HUGEPAGE
+	if (mode == MEMPOOL_HUGE_THP) {
+		errno = ENOTSUP;
+		return -1;
+	}
+#endif /* !MADV_HUGEPAGE */
+	if (mode == MEMPOOL_HUGE_EXPLICIT) {
+#ifdef MEMPOOL_HUGE_TLB
+		void *p;
+
+		p = mmap(NULL, MEMPOOL_HUGE_SZ, PROT_READ|PROT_WRITE,
+		         MAP_PRIVATE|MAP_ANON|MEMPOOL_HUGE_TLB, -1, 0);
+		if (p == MAP_FAILED)
+			return -1;
+		munmap(p, MEMPOOL_HUGE_SZ);
+#else /* !MEMPOOL_HUGE_TLB */
+		errno = ENOTSUP;
+		return -1;
+#endif /* !MEMPOOL_HUGE_TLB */
+	}
+	for (int i = 0; i < MEMPOOL_HUGE_NCLASSES; i++) {
+		if (pthread_mutex_init(&mempool_huge_class[i].mutex,
+		                       NULL) != 0) {
+			while (--i >= 0)
+				pthread_mutex_destroy(
+				        &mempool_huge_class[i].mutex);
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+	mempool_huge_mode = mode;
+	return 0;
+}
+
+void *
+mempool_huge_malloc(size_t sz)
+{
+	mempool_huge_class_t *c;
+	mempool_huge_hdr_t *hdr;
+	mempool_block_t *block;
+	size_t objsz;
+	int i;
+
+	if (mempool_huge_mode == MEMPOOL_HUGE_NONE)
+		return malloc(sz);
+
+	if (sz > MEMPOOL_HUGE_MAXOBJ) {
+		if (sz > SIZE_MAX - MEMPOOL_HUGE_HDRSZ - 2 * MEMPOOL_HUGE_SZ) {
+			errno = ENOMEM;
+			return NULL;
+		}
+		objsz = mempool_huge_roundup(sz + MEMPOOL_HUGE_HDRSZ);
+		if (!(hdr = mempool_huge_map(objsz, MAP_PRIVATE)))
+			return NULL;
+		hdr->objsz = 0;
+		hdr->mapsz = objsz;
+		return (char *)hdr + MEMPOOL_HUGE_HDRSZ;
+	}
+
+	for (i = 0, objsz = MEMPOOL_HUGE_MINOBJ; objsz < sz; i++, objsz <<= 1);
+	c = &mempool_huge_class[i];
+	pthread_mutex_lock(&c->mutex);
+	if ((block = c->head)) {
+		c->head = block->next;
+	} else {
+		if (c->end - c->next < (ptrdiff_t)objsz) {
+			if (!(hdr = mempool_huge_map(MEMPOOL_HUGE_SZ,
+			                             MAP_PRIVATE))) {
+				pthread_mutex_unlock(&c->mutex);
+				return NULL;
+			}
+			hdr->objsz = objsz;
+			hdr->mapsz = MEMPOOL_HUGE_SZ;
+			c->next = (char *)hdr + MEMPOOL_HUGE_HDRSZ;
+			c->end = (char *)hdr + MEMPOOL_HUGE_SZ;
+		}
+		block = (mempool_block_t *)c->next;
+		c->next += objsz;
+	}
+	pthread_mutex_unlock(&c->mutex);
+	return block;
+}
+
+void *
+mempool_huge_calloc(size_t n, size_t sz)
+{
+	void *p;
+
+	if (mempool_huge_mode == MEMPOOL_HUGE_NONE)
+		return calloc(n, sz);
+	if (sz && n > SIZE_MAX / sz) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	if ((p = mempool_huge_malloc(n * sz)))
+		memset(p, 0, n * sz);
+	return p;
+}
+
+void *
+mempool_huge_realloc(void *ptr, size_t sz)
+{
+	mempool_huge_hdr_t *hdr;
+	size_t oldsz;
+	void *p;
+
+	if (mempool_huge_mode == MEMPOOL_HUGE_NONE)
+		return realloc(ptr, sz);
+	if (!ptr)
+		return mempool_huge_malloc(sz);
+	hdr = MEMPOOL_HUGE_HDR(ptr);
+	oldsz = hdr->objsz ? hdr->objsz : hdr->mapsz - MEMPOOL_HUGE_HDRSZ;
+	if (sz <= oldsz)
+		return ptr;
+	if (!(p = mempool_huge_malloc(sz)))
+		return NULL;
+	memcpy(p, ptr, oldsz);
+	mempool_huge_free(ptr);
+	return p;
+}
+
+void
+mempool_huge_free(void *ptr)
+{
+	mempool_huge_class_t *c;
+	mempool_huge_hdr_t *hdr;
+	mempool_block_t *block = ptr;
+	int i;
+
+	if (mempool_huge_mode == MEMPOOL_HUGE_NONE) {
+		free(ptr);
+		return;
+	}
+	if (!ptr)
+		return;
+	hdr = MEMPOOL_HUGE_HDR(ptr);
+	if (!hdr->objsz) {
+		mempool_huge_unmap(hdr, hdr->mapsz);
+		return;
+	}
+	for (i = 0; (MEMPOOL_HUGE_MINOBJ << i) < (int)hdr->objsz; i++);
+	c = &mempool_huge_class[i];
+	pthread_mutex_lock(&c->mutex);
+	block->next = c->head;
+	c->head = block;
+	pthread_mutex_unlock(&c->mutex);
+}
+
+/*
+ * Map sz octets of anonymous memory shared with child processes, backed by
+ * huge pages as selected by mempool_huge_enable().  The memory is zeroed.
+ * Returns NULL on failure.
+ */
+void *
+mempool_huge_map_shared(size_t sz)
+{
+	void *p;
+
+	if (mempool_huge_mode != MEMPOOL_HUGE_NONE)
+		return mempool_huge_map(mempool_huge_roundup(sz), MAP_SHARED);
+	p = mmap(NULL, sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANON, -1, 0);
+	return p == MAP_FAILED ? NULL : p;
+}
+
+/*
+ * Unmap memory of sz octets mapped by mempool_huge_map_shared(sz).
+ */
+void
+mempool_huge_unmap_shared(void *p, size_t sz)
+{
+	if (mempool_huge_mode != MEMPOOL_HUGE_NONE)
+		mempool_huge_unmap(p, mempool_huge_roundup(sz));
+	else
+		munmap(p, sz);
+}
+
+/*
+ * Return the number of octets mapped for huge page backed allocations,
+ * including free objects and unused space in regions.
+ */
+size_t
+mempool_huge_bytes(void)
+{
+	return __atomic_load_n(&mempool_huge_mapped, __ATOMIC_RELAXED);
+}
+
+/*
+ * Install the allocation functions into libevent and OpenSSL.  Must be called
+ * before any other libevent or OpenSSL function, because memory allocated
+ * before cannot be accounted for.  The caches are not used until enabled
+ * using mempool_enable(), such that this can be done before the
+ * configuration is known.
+ */
+void
+mempool_preinit(void)
+{
+#ifdef HAVE_MALLOC_USABLE_SIZE
+	if (pthread_key_create(&mempool_acct_key, NULL) == 0)
+		__atomic_store_n(&mempool_have_acct, 1, __ATOMIC_RELEASE);
+#ifndef EVENT__DISABLE_MM_REPLACEMENT
+	event_set_mem_functions(mempool_event_malloc, mempool_event_realloc,
+	                        mempool_event_free);
+#endif /* !EVENT__DISABLE_MM_REPLACEMENT */
+#if (OPENSSL_VERSION_NUMBER >= 0x10100000L)
+	CRYPTO_set_mem_functions(mempool_crypto_malloc, mempool_crypto_realloc,
+	                         mempool_crypto_free);
+#endif /* OPENSSL_VERSION_NUMBER >= 0x10100000L */
+#endif /* HAVE_MALLOC_USABLE_SIZE */
+}
+
+/*
+ * Enable or disable the per-thread caches.  Must be called before any
+ * threads are started.
+ */
+void
+mempool_enable(int enable)
+{
+#ifdef HAVE_MALLOC_USABLE_SIZE
+	static int have_key = 0;
+
+	if (enable && !have_key) {
+		if (pthread_key_create(&mempool_key, mempool_cache_free) != 0)
+			return;
+		have_key = 1;
+	}
+	mempool_enabled = !!enable;
+#else /* !HAVE_MALLOC_USABLE_SIZE */
+	(void)enable;
+#endif /* !HAVE_MALLOC_USABLE_SIZE */
+}
+
+/*
+ * Return the approximate number of octets currently allocated by libevent
+ * (MEMPOOL_EVENT) or OpenSSL (MEMPOOL_CRYPTO), or held in the per-thread
+ * caches (MEMPOOL_CACHED), summed over all threads.  Returns 0 if memory
+ * cannot be accounted for on this platform.
+ */
+size_t
+mempool_bytes(int acct)
+{
+	long long n = 0;
+
+	for (mempool_acct_t *a = __atomic_load_n(&mempool_accts,
+	                                         __ATOMIC_ACQUIRE);
+	     a; a = a->next)
+		n += __atomic_load_n(&a->bytes[acct], __ATOMIC_RELAXED);
+	return n > 0 ? (size_t)n : 0;
+}
+
+/* vim: set noet ft=c: */
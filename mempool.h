@@ -0,0 +1,65 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MEMPOOL_H
+#define MEMPOOL_H
+
+#include "attrib.h"
+
+#include <stdlib.h>
+
+#define MEMPOOL_EVENT		0	/* allocated by libevent */
+#define MEMPOOL_CRYPTO		1	/* allocated by OpenSSL */
+#define MEMPOOL_CACHED		2	/* held in the per-thread caches */
+#define MEMPOOL_NACCTS		3
+
+void mempool_preinit(void);
+void mempool_enable(int);
+
+void * mempool_malloc(size_t) MALLOC;
+void * mempool_realloc(void *, size_t);
+void mempool_free(void *);
+
+size_t mempool_bytes(int) WUNRES;
+
+#define MEMPOOL_HUGE_NONE	0	/* system malloc */
+#define MEMPOOL_HUGE_THP	1	/* transparent huge pages */
+#define MEMPOOL_HUGE_EXPLICIT	2	/* reserved huge pages, MAP_HUGETLB */
+
+int mempool_huge_enable(int) WUNRES;
+void * mempool_huge_malloc(size_t) MALLOC;
+void * mempool_huge_calloc(size_t, size_t) MALLOC;
+void * mempool_huge_realloc(void *, size_t);
+void mempool_huge_free(void *);
+void * mempool_huge_map_shared(size_t) MALLOC;
+void mempool_huge_unmap_shared(void *, size_t);
+size_t mempool_huge_bytes(void) WUNRES;
+
+#endif /* !MEMPOOL_H */
+
+/* vim: set noet ft=c: */
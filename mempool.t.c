@@ -0,0 +1,277 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "mempool.h"
+
+#include <string.h>
+#include <stdint.h>
+
+#include <event2/buffer.h>
+
+#include <check.h>
+
+static void
+mempool_setup(void)
+{
+	mempool_enable(1);
+}
+
+/*
+ * Tests run in a forked child, so installing the allocation functions
+ * after libevent and OpenSSL have been used is harmless.
+ */
+static void
+mempool_bytes_setup(void)
+{
+	mempool_preinit();
+	mempool_enable(1);
+}
+
+static void
+mempool_teardown(void)
+{
+	mempool_enable(0);
+}
+
+#ifdef __linux__
+static void
+mempool_huge_setup(void)
+{
+	ck_assert_int_eq(mempool_huge_enable(MEMPOOL_HUGE_THP), 0);
+}
+#endif /* __linux__ */
+
+START_TEST(mempool_malloc_01)
+{
+	void *p, *q;
+
+	p = mempool_malloc(1000);
+	fail_unless(!!p, "malloc failed");
+	mempool_free(p);
+	q = mempool_malloc(900);
+	fail_unless(q == p, "block of same class not reused");
+	mempool_free(q);
+}
+END_TEST
+
+START_TEST(mempool_malloc_02)
+{
+	void *p, *q;
+
+	p = mempool_malloc(1000);
+	fail_unless(!!p, "malloc failed");
+	mempool_free(p);
+	q = mempool_malloc(3000);
+	fail_unless(q != p, "block of smaller class reused");
+	mempool_free(q);
+}
+END_TEST
+
+START_TEST(mempool_free_01)
+{
+	void *p, *q;
+
+	p = malloc(3000);
+	fail_unless(!!p, "malloc failed");
+	mempool_free(p);
+	q = mempool_malloc(2048);
+	fail_unless(q == p, "system malloc block not reused");
+	free(q);
+}
+END_TEST
+
+START_TEST(mempool_realloc_01)
+{
+	unsigned char *p;
+
+	p = mempool_malloc(300);
+	fail_unless(!!p, "malloc failed");
+	memset(p, 'x', 300);
+	p = mempool_realloc(p, 10000);
+	fail_unless(!!p, "realloc failed");
+	fail_unless(p[0] == 'x' && p[299] == 'x', "content lost");
+	mempool_free(p);
+	p = mempool_realloc(NULL, 100);
+	fail_unless(!!p, "realloc from NULL failed");
+	mempool_free(p);
+}
+END_TEST
+
+START_TEST(mempool_bytes_01)
+{
+	struct evbuffer *buf;
+	char data[1000];
+	size_t before;
+
+	before = mempool_bytes(MEMPOOL_EVENT);
+	buf = evbuffer_new();
+	fail_unless(!!buf, "evbuffer_new failed");
+	memset(data, 'x', sizeof(data));
+	for (int i = 0; i < 100; i++)
+		evbuffer_add(buf, data, sizeof(data));
+	fail_unless(mempool_bytes(MEMPOOL_EVENT) >= before + 100000,
+	            "evbuffer memory not accounted for");
+	evbuffer_free(buf);
+	fail_unless(mempool_bytes(MEMPOOL_EVENT) == before,
+	            "evbuffer memory not released");
+}
+END_TEST
+
+START_TEST(mempool_bytes_02)
+{
+	void *p;
+	size_t before;
+
+	before = mempool_bytes(MEMPOOL_CACHED);
+	p = mempool_malloc(1000);
+	fail_unless(!!p, "malloc failed");
+	mempool_free(p);
+	fail_unless(mempool_bytes(MEMPOOL_CACHED) >= before + 1000,
+	            "cached block not accounted for");
+	p = mempool_malloc(1000);
+	fail_unless(mempool_bytes(MEMPOOL_CACHED) == before,
+	            "reused block still accounted for as cached");
+	mempool_free(p);
+}
+END_TEST
+
+#ifdef __linux__
+START_TEST(mempool_huge_malloc_01)
+{
+	void *p, *q;
+
+	p = mempool_huge_malloc(40);
+	fail_unless(!!p, "malloc failed");
+	fail_unless((uintptr_t)p % 16 == 0, "not aligned");
+	fail_unless(mempool_huge_bytes() == 2*1024*1024, "no region mapped");
+	q = mempool_huge_malloc(60);
+	fail_unless(q == (char *)p + 64, "not allocated from same region");
+	mempool_huge_free(p);
+	p = mempool_huge_malloc(33);
+	fail_unless(p == (char *)q - 64, "freed object of class not reused");
+	mempool_huge_free(p);
+	mempool_huge_free(q);
+	fail_unless(mempool_huge_bytes() == 2*1024*1024, "region unmapped");
+}
+END_TEST
+
+START_TEST(mempool_huge_malloc_02)
+{
+	unsigned char *p;
+
+	p = mempool_huge_malloc(3*1024*1024);
+	fail_unless(!!p, "malloc failed");
+	fail_unless(mempool_huge_bytes() == 4*1024*1024,
+	            "large object not mapped by itself");
+	memset(p, 'x', 3*1024*1024);
+	mempool_huge_free(p);
+	fail_unless(mempool_huge_bytes() == 0, "large object not unmapped");
+}
+END_TEST
+
+START_TEST(mempool_huge_realloc_01)
+{
+	unsigned char *p;
+
+	p = mempool_huge_calloc(100, 3);
+	fail_unless(!!p, "calloc failed");
+	for (int i = 0; i < 300; i++)
+		fail_unless(p[i] == 0, "not zeroed");
+	memset(p, 'x', 300);
+	fail_unless(mempool_huge_realloc(p, 500) == p, "not kept in class");
+	p = mempool_huge_realloc(p, 200000);
+	fail_unless(!!p, "realloc failed");
+	fail_unless(p[0] == 'x' && p[299] == 'x', "content lost");
+	mempool_huge_free(p);
+	fail_unless(mempool_huge_bytes() == 2*1024*1024,
+	            "large object not unmapped");
+}
+END_TEST
+
+START_TEST(mempool_huge_map_shared_01)
+{
+	unsigned char *p;
+
+	p = mempool_huge_map_shared(3000000);
+	fail_unless(!!p, "map failed");
+	fail_unless((uintptr_t)p % (2*1024*1024) == 0, "not aligned");
+	fail_unless(p[0] == 0 && p[2999999] == 0, "not zeroed");
+	memset(p, 'x', 3000000);
+	mempool_huge_unmap_shared(p, 3000000);
+	fail_unless(mempool_huge_bytes() == 0, "not unmapped");
+}
+END_TEST
+#endif /* __linux__ */
+
+Suite *
+mempool_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("mempool");
+
+#if defined(__GLIBC__) || defined(__FreeBSD__)
+	/* blocks are only cached where malloc_usable_size() is available */
+	tc = tcase_create("mempool_malloc");
+	tcase_add_checked_fixture(tc, mempool_setup, mempool_teardown);
+	tcase_add_test(tc, mempool_malloc_01);
+	tcase_add_test(tc, mempool_malloc_02);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("mempool_free");
+	tcase_add_checked_fixture(tc, mempool_setup, mempool_teardown);
+	tcase_add_test(tc, mempool_free_01);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("mempool_bytes");
+	tcase_add_checked_fixture(tc, mempool_bytes_setup, mempool_teardown);
+	tcase_add_test(tc, mempool_bytes_01);
+	tcase_add_test(tc, mempool_bytes_02);
+	suite_add_tcase(s, tc);
+#endif /* __GLIBC__ || __FreeBSD__ */
+
+	tc = tcase_create("mempool_realloc");
+	tcase_add_checked_fixture(tc, mempool_setup, mempool_teardown);
+	tcase_add_test(tc, mempool_realloc_01);
+	suite_add_tcase(s, tc);
+
+#ifdef __linux__
+	tc = tcase_create("mempool_huge");
+	tcase_add_checked_fixture(tc, mempool_huge_setup, NULL);
+	tcase_add_test(tc, mempool_huge_malloc_01);
+	tcase_add_test(tc, mempool_huge_malloc_02);
+	tcase_add_test(tc, mempool_huge_realloc_01);
+	tcase_add_test(tc, mempool_huge_map_shared_01);
+	suite_add_tcase(s, tc);
+#endif /* __linux__ */
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
@@ -51,6 +51,12 @@
 #undef PRIVATE
 #endif /* __APPLE__ */
 #include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "sys.h"
+#include "util.h"
+#include "khash.h"
 #endif /* HAVE_PF */
 
 #ifdef HAVE_IPFILTER
@@ -84,13 +90,65 @@
  */
 
 #ifdef HAVE_PF
-static int nat_pf_fd = -1;
+/*
+ * DIOCNATLOOK ioctls on a single shared /dev/pf descriptor serialize all
+ * worker threads.  Open a small pool of descriptors while still privileged
+ * and hand them out to threads round-robin on first use.  Lookup results
+ * are cached by client address until the connection is closed, such that
+ * repeated lookups for a connection do not hit the kernel.
+ */
+#define NAT_PF_MAXFDS		16
+#define NAT_PF_CACHE_MAX	65536
+
+typedef struct nat_pf_key {
+	uint8_t af;
+	uint8_t pad;
+	uint16_t sport;                 /* client port, network order */
+	uint8_t saddr[16];              /* client address */
+} nat_pf_key_t;
+
+typedef struct nat_pf_ent {
+	uint8_t daddr[16];              /* our address */
+	uint8_t rdaddr[16];             /* original destination address */
+	uint16_t dport;
+	uint16_t rdport;
+} nat_pf_ent_t;
+
+static inline khint_t
+nat_pf_key_hash(nat_pf_key_t key)
+{
+	return (khint_t)util_hash(&key, sizeof(key));
+}
+
+#define nat_pf_key_equal(a, b) (!memcmp(&(a), &(b), sizeof(nat_pf_key_t)))
+
+KHASH_INIT(natpf_t, nat_pf_key_t, nat_pf_ent_t, 1, nat_pf_key_hash,
+           nat_pf_key_equal)
+
+static int nat_pf_fdv[NAT_PF_MAXFDS];
+static unsigned int nat_pf_nfds = 0;
+static unsigned int nat_pf_nextfd = 0;
+static pthread_key_t nat_pf_fdkey;
+static int nat_pf_have_fdkey = 0;
+static khash_t(natpf_t) *nat_pf_cache = NULL;
+static pthread_mutex_t nat_pf_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static int
 nat_pf_preinit(void)
 {
-	nat_pf_fd = open("/dev/pf", O_RDONLY);
-	if (nat_pf_fd < 0) {
+	unsigned int n;
+
+	n = sys_get_cpu_cores();
+	if (n < 1)
+		n = 1;
+	if (n > NAT_PF_MAXFDS)
+		n = NAT_PF_MAXFDS;
+	for (nat_pf_nfds = 0; nat_pf_nfds < n; nat_pf_nfds++) {
+		nat_pf_fdv[nat_pf_nfds] = open("/dev/pf", O_RDONLY);
+		if (nat_pf_fdv[nat_pf_nfds] < 0)
+			break;
+	}
+	if (nat_pf_nfds == 0) {
 		log_err_printf("Error opening '/dev/pf': %s\n",
 		               strerror(errno));
 		return -1;
@@ -103,10 +161,20 @@ nat_pf_init(void)
 {
 	int rv;
 
-	rv = fcntl(nat_pf_fd, F_SETFD, fcntl(nat_pf_fd, F_GETFD) | FD_CLOEXEC);
-	if (rv == -1) {
-		log_err_printf("Error setting FD_CLOEXEC on '/dev/pf': %s\n",
-		               strerror(errno));
+	for (unsigned int i = 0; i < nat_pf_nfds; i++) {
+		rv = fcntl(nat_pf_fdv[i], F_SETFD,
+		           fcntl(nat_pf_fdv[i], F_GETFD) | FD_CLOEXEC);
+		if (rv == -1) {
+			log_err_printf("Error setting FD_CLOEXEC on "
+			               "'/dev/pf': %s\n", strerror(errno));
+			return -1;
+		}
+	}
+	if (pthread_key_create(&nat_pf_fdkey, NULL) == 0)
+		nat_pf_have_fdkey = 1;
+	nat_pf_cache = kh_init(natpf_t);
+	if (!nat_pf_cache) {
+		log_err_printf("Error allocating NAT lookup cache\n");
 		return -1;
 	}
 	return 0;
@@ -115,7 +183,116 @@ nat_pf_init(void)
 static void
 nat_pf_fini(void)
 {
-	close(nat_pf_fd);
+	for (unsigned int i = 0; i < nat_pf_nfds; i++)
+		close(nat_pf_fdv[i]);
+	nat_pf_nfds = 0;
+	if (nat_pf_have_fdkey) {
+		pthread_key_delete(nat_pf_fdkey);
+		nat_pf_have_fdkey = 0;
+	}
+	if (nat_pf_cache) {
+		kh_destroy(natpf_t, nat_pf_cache);
+		nat_pf_cache = NULL;
+	}
+}
+
+/*
+ * Return the /dev/pf descriptor assigned to the calling thread.
+ */
+static int
+nat_pf_getfd(void)
+{
+	uintptr_t idx;
+
+	if (!nat_pf_have_fdkey)
+		return nat_pf_fdv[0];
+	idx = (uintptr_t)pthread_getspecific(nat_pf_fdkey);
+	if (!idx) {
+		/* store index + 1 to tell unassigned threads apart */
+		idx = __atomic_fetch_add(&nat_pf_nextfd, 1,
+		                         __ATOMIC_RELAXED) % nat_pf_nfds + 1;
+		pthread_setspecific(nat_pf_fdkey, (void *)idx);
+	}
+	return nat_pf_fdv[idx - 1];
+}
+
+static void
+nat_pf_key_set(nat_pf_key_t *key, const struct sockaddr *src_addr)
+{
+	memset(key, 0, sizeof(nat_pf_key_t));
+	key->af = src_addr->sa_family;
+	if (key->af == AF_INET) {
+		const struct sockaddr_in *sai =
+			(const struct sockaddr_in *)src_addr;
+		memcpy(key->saddr, &sai->sin_addr, 4);
+		key->sport = sai->sin_port;
+	} else {
+		const struct sockaddr_in6 *sai =
+			(const struct sockaddr_in6 *)src_addr;
+		memcpy(key->saddr, &sai->sin6_addr, 16);
+		key->sport = sai->sin6_port;
+	}
+}
+
+/*
+ * Look up the cached original destination of the connection from the client
+ * in key to our address daddr and port dport.
+ * Returns 1 and sets ent if found, 0 otherwise.
+ */
+static int
+nat_pf_cache_get(const nat_pf_key_t *key, const uint8_t *daddr,
+                 uint16_t dport, nat_pf_ent_t *ent)
+{
+	khiter_t k;
+	int found = 0;
+
+	pthread_mutex_lock(&nat_pf_cache_mutex);
+	k = kh_get(natpf_t, nat_pf_cache, *key);
+	if (k != kh_end(nat_pf_cache)) {
+		*ent = kh_val(nat_pf_cache, k);
+		found = ent->dport == dport && !memcmp(ent->daddr, daddr, 16);
+	}
+	pthread_mutex_unlock(&nat_pf_cache_mutex);
+	return found;
+}
+
+static void
+nat_pf_cache_put(const nat_pf_key_t *key, const nat_pf_ent_t *ent)
+{
+	khiter_t k;
+	int ret;
+
+	pthread_mutex_lock(&nat_pf_cache_mutex);
+	k = kh_get(natpf_t, nat_pf_cache, *key);
+	if (k == kh_end(nat_pf_cache) &&
+	    kh_size(nat_pf_cache) < NAT_PF_CACHE_MAX) {
+		k = kh_put(natpf_t, nat_pf_cache, *key, &ret);
+		if (ret == -1)
+			k = kh_end(nat_pf_cache);
+	}
+	if (k != kh_end(nat_pf_cache))
+		kh_val(nat_pf_cache, k) = *ent;
+	pthread_mutex_unlock(&nat_pf_cache_mutex);
+}
+
+/*
+ * Invalidate the cached lookup for the connection from src_addr; called when
+ * the connection is closed.
+ */
+static void
+nat_pf_forget_cb(struct sockaddr *src_addr, UNUSED socklen_t src_addrlen)
+{
+	nat_pf_key_t key;
+	khiter_t k;
+
+	if (!nat_pf_cache)
+		return;
+	nat_pf_key_set(&key, src_addr);
+	pthread_mutex_lock(&nat_pf_cache_mutex);
+	k = kh_get(natpf_t, nat_pf_cache, key);
+	if (k != kh_end(nat_pf_cache))
+		kh_del(natpf_t, nat_pf_cache, k);
+	pthread_mutex_unlock(&nat_pf_cache_mutex);
 }
 
 static int
@@ -135,6 +312,8 @@ nat_pf_lookup_cb(struct sockaddr *dst_addr, socklen_t *dst_addrlen,
 	struct sockaddr_storage our_addr;
 	socklen_t our_addrlen;
 	struct pfioc_natlook nl;
+	nat_pf_key_t key;
+	nat_pf_ent_t ent;
 
 	our_addrlen = sizeof(struct sockaddr_storage);
 	if (getsockname(s, (struct sockaddr *)&our_addr, &our_addrlen) == -1) {
@@ -164,12 +343,24 @@ nat_pf_lookup_cb(struct sockaddr *dst_addr, socklen_t *dst_addrlen,
 	nl.proto = IPPROTO_TCP;
 	nl.direction = PF_OUT;
 
-	if (ioctl(nat_pf_fd, DIOCNATLOOK, &nl)) {
-		if (errno != ENOENT) {
-			log_err_printf("Error from ioctl(DIOCNATLOOK): %s\n",
-			               strerror(errno));
+	nat_pf_key_set(&key, src_addr);
+	if (nat_pf_cache_get(&key, (uint8_t *)&nl.daddr, nl.dport, &ent)) {
+		memcpy(&nl.rdaddr, ent.rdaddr, 16);
+		nl.rdport = ent.rdport;
+	} else {
+		if (ioctl(nat_pf_getfd(), DIOCNATLOOK, &nl)) {
+			if (errno != ENOENT) {
+				log_err_printf("Error from "
+				               "ioctl(DIOCNATLOOK): %s\n",
+				               strerror(errno));
+			}
+			return -1;
 		}
-		return -1;
+		memcpy(ent.daddr, &nl.daddr, 16);
+		memcpy(ent.rdaddr, &nl.rdaddr, 16);
+		ent.dport = nl.dport;
+		ent.rdport = nl.rdport;
+		nat_pf_cache_put(&key, &ent);
 	}
 
 	if ((nl.dport == nl.rdport) &&
@@ -392,7 +583,10 @@ nat_iptransparent_socket_cb(evutil_socket_t s)
 #if defined(HAVE_IPFW) || (defined(HAVE_NETFILTER) && defined(IP_TRANSPARENT))
 /*
  * Generic getsockname based implementation.  This assumes that getsockname,
- * by kernel magic, gives us the original destination.
+ * by kernel magic, gives us the original destination.  Used for ipfw and
+ * for Linux TPROXY, where it replaces the conntrack lookup behind the
+ * SO_ORIGINAL_DST getsockopt of the netfilter engine; the peer address is
+ * already known from accept().
  */
 static int
 nat_getsockname_lookup_cb(struct sockaddr *dst_addr, socklen_t *dst_addrlen,
@@ -426,6 +620,7 @@ struct engine {
 	nat_fini_cb_t finicb;
 	nat_lookup_cb_t lookupcb;
 	nat_socket_cb_t socketcb;
+	nat_forget_cb_t forgetcb;
 };
 
 struct engine engines[] = {
@@ -433,21 +628,21 @@ struct engine engines[] = {
 	{
 		"pf", 1, 0,
 		nat_pf_preinit, nat_pf_init, nat_pf_fini,
-		nat_pf_lookup_cb, NULL
+		nat_pf_lookup_cb, NULL, nat_pf_forget_cb
 	},
 #endif /* HAVE_PF */
 #ifdef HAVE_IPFW
 	{
 		"ipfw", 1, 0,
 		NULL, NULL, NULL,
-		nat_getsockname_lookup_cb, NULL
+		nat_getsockname_lookup_cb, NULL, NULL
 	},
 #endif /* HAVE_IPFW */
 #ifdef HAVE_IPFILTER
 	{
 		"ipfilter", 0, 0,
 		nat_ipfilter_preinit, nat_ipfilter_init, nat_ipfilter_fini,
-		nat_ipfilter_lookup_cb, NULL
+		nat_ipfilter_lookup_cb, NULL, NULL
 	},
 #endif /* HAVE_IPFILTER */
 #ifdef HAVE_NETFILTER
@@ -458,20 +653,20 @@ struct engine engines[] = {
 		"netfilter", 0, 0,
 #endif /* !IP6T_SO_ORIGINAL_DST */
 		NULL, NULL, NULL,
-		nat_netfilter_lookup_cb, NULL
+		nat_netfilter_lookup_cb, NULL, NULL
 	},
 #ifdef IP_TRANSPARENT
 	{
 		"tproxy", 1, 0,
 		NULL, NULL, NULL,
-		nat_getsockname_lookup_cb, nat_iptransparent_socket_cb
+		nat_getsockname_lookup_cb, nat_iptransparent_socket_cb, NULL
 	},
 #endif /* IP_TRANSPARENT */
 #endif /* HAVE_NETFILTER */
 	{
 		NULL, 0, 0,
 		NULL, NULL, NULL,
-		NULL, NULL
+		NULL, NULL, NULL
 	}
 };
 
@@ -553,6 +748,19 @@ nat_getsocketcb(const char *name)
 	return engines[nat_index(name)].socketcb;
 }
 
+/*
+ * Returns the callback of the named NAT engine to be called when a connection
+ * looked up using its lookup callback is closed, or NULL if not needed.
+ * NULL refers to the default NAT engine.
+ */
+nat_forget_cb_t
+nat_getforgetcb(const char *name)
+{
+	if (!name)
+		name = engines[0].name;
+	return engines[nat_index(name)].forgetcb;
+}
+
 /*
  * Returns 1 if name is a NAT engine which supports IPv6.
  * NULL refers to the default NAT engine.
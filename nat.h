@@ -39,11 +39,13 @@
 typedef int (*nat_lookup_cb_t)(struct sockaddr *, socklen_t *, evutil_socket_t,
                                struct sockaddr *, socklen_t);
 typedef int (*nat_socket_cb_t)(evutil_socket_t);
+typedef void (*nat_forget_cb_t)(struct sockaddr *, socklen_t);
 
 int nat_exist(const char *) WUNRES;
 int nat_used(const char *) WUNRES;
 nat_lookup_cb_t nat_getlookupcb(const char *) WUNRES;
 nat_socket_cb_t nat_getsocketcb(const char *) WUNRES;
+nat_forget_cb_t nat_getforgetcb(const char *) WUNRES;
 int nat_ipv6ready(const char *) WUNRES;
 
 const char *nat_getdefaultname(void) WUNRES;
@@ -30,26 +30,82 @@
 
 #include "sys.h"
 #include "log.h"
+#include "defaults.h"
+#include "mempool.h"
+#include "pxyhttppool.h"
 
 #include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <ctype.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <pthread.h>
 
 #ifndef OPENSSL_NO_DH
 #include <openssl/dh.h>
 #endif /* !OPENSSL_NO_DH */
 #include <openssl/x509.h>
 
+/*
+ * Per-thread jump buffer for catching configuration errors, see
+ * opts_fail_catch().
+ */
+static pthread_key_t opts_fail_key;
+static pthread_once_t opts_fail_once = PTHREAD_ONCE_INIT;
+
+static void
+opts_fail_key_create(void)
+{
+	if (pthread_key_create(&opts_fail_key, NULL) != 0)
+		abort();
+}
+
+/*
+ * Make configuration errors on the calling thread longjmp(3) to env instead
+ * of exiting, or exit again if env is NULL.  Used for parsing the
+ * configuration for reloading while the proxy keeps running.  Parsers keep
+ * everything they allocate reachable from the opts_t for opts_free(), or
+ * catch errors themselves to release it and fail again to the previous env.
+ * Returns the previous env.
+ */
+jmp_buf *
+opts_fail_catch(jmp_buf *env)
+{
+	jmp_buf *prev;
+
+	pthread_once(&opts_fail_once, opts_fail_key_create);
+	prev = pthread_getspecific(opts_fail_key);
+	(void)pthread_setspecific(opts_fail_key, env);
+	return prev;
+}
+
+/*
+ * Handle a configuration error after the error message has been printed.
+ * Exits with failure status code, unless caught by opts_fail_catch().
+ * Does not return.
+ */
+void NORET
+opts_fail(void)
+{
+	jmp_buf *env;
+
+	pthread_once(&opts_fail_once, opts_fail_key_create);
+	if ((env = pthread_getspecific(opts_fail_key)))
+		longjmp(*env, 1);
+	exit(EXIT_FAILURE);
+}
+
 /*
  * Handle out of memory conditions in early stages of main().
- * Print error message and exit with failure status code.
+ * Print error message and fail, see opts_fail().
  * Does not return.
  */
 void NORET
 oom_die(const char *argv0)
 {
 	fprintf(stderr, "%s: out of memory\n", argv0);
-	exit(EXIT_FAILURE);
+	opts_fail();
 }
 
 /*
@@ -91,9 +147,46 @@ opts_new(void)
 	memset(opts, 0, sizeof(opts_t));
 
 	opts->sslcomp = 1;
+	opts->certcomp = 1;
 	opts->cachain = sk_X509_new_null();
+	opts->eccachain = sk_X509_new_null();
 	opts->sslmethod = SSLv23_method;
 	opts->allow_wrong_host = 1;
+	opts->thrsel = THRSEL_P2C;
+	opts->forge_threads = DFLT_FORGE_THREADS;
+	opts->ticket_rotate = DFLT_TICKET_ROTATE;
+	opts->pass_ttl = DFLT_PASS_TTL;
+	opts->log_membudget = DFLT_LOG_MEMBUDGET;
+	opts->outbuf_membudget = DFLT_OUTBUF_MEMBUDGET;
+	opts->worker_procs = 1;
+	opts->shcache_size = DFLT_SHCACHE_SIZE;
+	opts->rcache_timeout = DFLT_RCACHE_TIMEOUT;
+	opts->content_log_threads = 1;
+	opts->contentlog_segsz = DFLT_CONTENTLOG_SEGSZ;
+	opts->http_cache_maxobj = DFLT_HTTP_CACHE_MAXOBJ;
+	opts->sslctx_maxentries = OPTS_MAXENTRIES_FKCRT;
+	opts->vrfy_maxentries = OPTS_MAXENTRIES_FKCRT;
+	opts->sni_maxentries = OPTS_MAXENTRIES_FKCRT;
+	opts->pass_maxentries = OPTS_MAXENTRIES_FKCRT;
+	opts->ocsp_maxentries = OPTS_MAXENTRIES_FKCRT;
+	opts->contenttap_sz = DFLT_CONTENTTAP_SZ;
+	opts->contentstream_sz = DFLT_CONTENTSTREAM_SZ;
+	opts->contentlog_rec_total = DFLT_CONTENTLOG_REC_TOTAL;
+#ifndef WITHOUT_MIRROR
+	opts->mirror_chk_interval = DFLT_MIRROR_CHK_INTERVAL;
+#endif /* !WITHOUT_MIRROR */
+	opts->log_flush_interval = DFLT_LOG_FLUSH_INTERVAL;
+	opts->splice = 1;
+	opts->mempool = 1;
+	opts->chacha_prio = 1;
+	opts->tcp_deferaccept = 1;
+	opts->timeout[OPTS_TIMEOUT_CONNECT] = DFLT_CONNECT_TIMEOUT;
+	opts->timeout[OPTS_TIMEOUT_HANDSHAKE] = DFLT_HANDSHAKE_TIMEOUT;
+	opts->timeout[OPTS_TIMEOUT_HEADER] = DFLT_HEADER_TIMEOUT;
+	opts->timeout[OPTS_TIMEOUT_IDLE] = DFLT_IDLE_TIMEOUT;
+	opts->timeout[OPTS_TIMEOUT_DORMANT] = DFLT_DORMANT_TIMEOUT;
+	opts->timeout[OPTS_TIMEOUT_HELLO] = DFLT_HELLO_TIMEOUT;
+	opts->refs = 1;
 
 	return opts;
 }
@@ -117,9 +210,28 @@ opts_free(opts_t *opts)
 	if (opts->leafkey) {
 		EVP_PKEY_free(opts->leafkey);
 	}
+	if (opts->eccacrt) {
+		X509_free(opts->eccacrt);
+	}
+	if (opts->eccakey) {
+		EVP_PKEY_free(opts->eccakey);
+	}
+	sk_X509_pop_free(opts->eccachain, X509_free);
+	if (opts->ecleafkey) {
+		EVP_PKEY_free(opts->ecleafkey);
+	}
+	if (opts->fktmpl) {
+		ssl_x509_tmpl_free(opts->fktmpl);
+	}
+	if (opts->ecfktmpl) {
+		ssl_x509_tmpl_free(opts->ecfktmpl);
+	}
 	if (opts->leafcertdir) {
 		free(opts->leafcertdir);
 	}
+	if (opts->leafcertdir_index) {
+		free(opts->leafcertdir_index);
+	}
 	if (opts->defaultleafcert) {
 		cert_free(opts->defaultleafcert);
 	}
@@ -142,11 +254,26 @@ opts_free(opts_t *opts)
 	if (opts->ciphers) {
 		free(opts->ciphers);
 	}
+	if (opts->ciphers_chacha) {
+		free(opts->ciphers_chacha);
+	}
 #ifndef OPENSSL_NO_ENGINE
 	if (opts->openssl_engine) {
 		free(opts->openssl_engine);
 	}
 #endif /* !OPENSSL_NO_ENGINE */
+	if (opts->contentlog_rules) {
+		logrule_free(opts->contentlog_rules);
+	}
+	if (opts->bypass) {
+		bypass_free(opts->bypass);
+	}
+	if (opts->contentlog_match) {
+		acmatch_free(opts->contentlog_match);
+	}
+	if (opts->contentlog_triggers) {
+		logrule_free(opts->contentlog_triggers);
+	}
 	if (opts->dropuser) {
 		free(opts->dropuser);
 	}
@@ -159,12 +286,36 @@ opts_free(opts_t *opts)
 	if (opts->pidfile) {
 		free(opts->pidfile);
 	}
+	if (opts->stats_socket) {
+		free(opts->stats_socket);
+	}
+	if (opts->upgrade_socket) {
+		free(opts->upgrade_socket);
+	}
+	if (opts->rcache_servers) {
+		free(opts->rcache_servers);
+	}
+	if (opts->fkcrtstore) {
+		free(opts->fkcrtstore);
+	}
+	if (opts->sessstore) {
+		free(opts->sessstore);
+	}
+	if (opts->ticketkeyfile) {
+		free(opts->ticketkeyfile);
+	}
+	if (opts->log_spilldir) {
+		free(opts->log_spilldir);
+	}
 	if (opts->connectlog) {
 		free(opts->connectlog);
 	}
 	if (opts->conffile) {
 		free(opts->conffile);
 	}
+	if (opts->natengine) {
+		free(opts->natengine);
+	}
 	if (opts->contentlog) {
 		free(opts->contentlog);
 	}
@@ -174,6 +325,9 @@ opts_free(opts_t *opts)
 	if (opts->contentlog_basedir) {
 		free(opts->contentlog_basedir);
 	}
+	if (opts->contentlog_dedupdir) {
+		free(opts->contentlog_dedupdir);
+	}
 	if (opts->masterkeylog) {
 		free(opts->masterkeylog);
 	}
@@ -183,6 +337,15 @@ opts_free(opts_t *opts)
 	if (opts->pcaplog_basedir) {
 		free(opts->pcaplog_basedir);
 	}
+	if (opts->contenttap) {
+		free(opts->contenttap);
+	}
+	if (opts->contentstream) {
+		free(opts->contentstream);
+	}
+	for (int i = 0; i < opts->inspect_count; i++) {
+		free(opts->inspect[i]);
+	}
 #ifndef WITHOUT_MIRROR
 	if (opts->mirrorif) {
 		free(opts->mirrorif);
@@ -191,10 +354,366 @@ opts_free(opts_t *opts)
 		free(opts->mirrortarget);
 	}
 #endif /* !WITHOUT_MIRROR */
+	if (opts->worker_cpus) {
+		free(opts->worker_cpus);
+	}
+	for (int i = 0; i < opts->workerpool_count; i++) {
+		free(opts->workerpool[i].name);
+		if (opts->workerpool[i].cpus)
+			free(opts->workerpool[i].cpus);
+	}
 	memset(opts, 0, sizeof(opts_t));
 	free(opts);
 }
 
+/*
+ * Take a reference to opts.  The creator of opts holds the initial reference
+ * and releases it with opts_unref(), or with opts_free() once all other
+ * references are known to be gone.  Thread-safe.
+ */
+opts_t *
+opts_ref(opts_t *opts)
+{
+	__atomic_add_fetch(&opts->refs, 1, __ATOMIC_RELAXED);
+	return opts;
+}
+
+/*
+ * Release a reference to opts, freeing it when the last one is gone.
+ * Thread-safe.
+ */
+void
+opts_unref(opts_t *opts)
+{
+	if (__atomic_sub_fetch(&opts->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		opts_free(opts);
+}
+
+/*
+ * Settings that only take effect at startup keep the value of the running
+ * configuration on reload; a warning is logged if the new value differs.
+ */
+#define OPTS_KEEP_VAL(f, name) \
+	do { \
+		if (opts->f != oldopts->f) { \
+			log_err_printf("Warning: %s cannot be changed by " \
+			               "reloading; keeping previous value\n", \
+			               (name)); \
+			opts->f = oldopts->f; \
+		} \
+	} while (0)
+#define OPTS_KEEP_STR(f, name) \
+	do { \
+		if (opts_keep_str(&opts->f, oldopts->f, (name)) == -1) \
+			return -1; \
+	} while (0)
+
+static int
+opts_keep_str(char **dst, const char *src, const char *name)
+{
+	if (!*dst && !src)
+		return 0;
+	if (*dst && src && !strcmp(*dst, src))
+		return 0;
+	if (name) {
+		log_err_printf("Warning: %s cannot be changed by reloading; "
+		               "keeping previous value\n", name);
+	}
+	if (*dst)
+		free(*dst);
+	*dst = NULL;
+	if (src && !(*dst = strdup(src)))
+		return -1;
+	return 0;
+}
+
+/*
+ * Return 1 if opts and oldopts define the same worker pools, 0 otherwise.
+ */
+static int
+opts_workerpool_equal(opts_t *opts, opts_t *oldopts)
+{
+	if (opts->workerpool_count != oldopts->workerpool_count)
+		return 0;
+	for (int i = 0; i < opts->workerpool_count; i++) {
+		opts_workerpool_t *wp = &opts->workerpool[i];
+		opts_workerpool_t *oldwp = &oldopts->workerpool[i];
+
+		if (strcmp(wp->name, oldwp->name) ||
+		    wp->threads != oldwp->threads ||
+		    wp->cpus_count != oldwp->cpus_count ||
+		    (wp->cpus_count && memcmp(wp->cpus, oldwp->cpus,
+		                              wp->cpus_count * sizeof(int))))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Replace the worker pools of opts with copies of those of oldopts.
+ * Returns 0 on success, -1 on memory allocation failure.
+ */
+static int
+opts_workerpool_copy(opts_t *opts, opts_t *oldopts)
+{
+	for (int i = 0; i < opts->workerpool_count; i++) {
+		free(opts->workerpool[i].name);
+		if (opts->workerpool[i].cpus)
+			free(opts->workerpool[i].cpus);
+	}
+	memset(opts->workerpool, 0, sizeof(opts->workerpool));
+	opts->workerpool_count = 0;
+	for (int i = 0; i < oldopts->workerpool_count; i++) {
+		opts_workerpool_t *wp = &opts->workerpool[i];
+		opts_workerpool_t *oldwp = &oldopts->workerpool[i];
+
+		if (!(wp->name = strdup(oldwp->name)))
+			return -1;
+		opts->workerpool_count++;
+		wp->threads = oldwp->threads;
+		if (oldwp->cpus_count) {
+			size_t sz = oldwp->cpus_count * sizeof(int);
+			if (!(wp->cpus = malloc(sz)))
+				return -1;
+			memcpy(wp->cpus, oldwp->cpus, sz);
+			wp->cpus_count = oldwp->cpus_count;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Prepare opts, freshly parsed on reload, for replacing the running
+ * configuration oldopts.  Settings that only take effect at startup, such as
+ * logging, privileges, threads, listener socket options and cache sizes, are
+ * reset to the values in oldopts.  Listening sockets cannot be reopened after
+ * dropping privileges, so the proxyspecs must listen on the same addresses
+ * in the same order; everything else about them may change.  The leaf keys
+ * are inherited from oldopts unless specified explicitly, such that forged
+ * certificates stay valid across reloads.
+ * Returns 0 on success, -1 if opts cannot replace oldopts.
+ */
+int
+opts_reload(opts_t *opts, opts_t *oldopts)
+{
+	proxyspec_t *spec, *oldspec;
+
+	for (spec = opts->spec, oldspec = oldopts->spec;
+	     spec && oldspec;
+	     spec = spec->next, oldspec = oldspec->next) {
+		if (spec->listen_addrlen != oldspec->listen_addrlen ||
+		    memcmp(&spec->listen_addr, &oldspec->listen_addr,
+		           spec->listen_addrlen)) {
+			break;
+		}
+	}
+	if (spec || oldspec) {
+		log_err_printf("Proxyspec listen addresses cannot be changed "
+		               "by reloading\n");
+		return -1;
+	}
+
+	OPTS_KEEP_STR(dropuser, NULL);
+	OPTS_KEEP_STR(dropgroup, NULL);
+	OPTS_KEEP_STR(jaildir, "Chroot");
+	OPTS_KEEP_STR(pidfile, "PidFile");
+	OPTS_KEEP_STR(connectlog, "ConnectLog");
+	OPTS_KEEP_STR(contentlog, "ContentLog");
+	OPTS_KEEP_STR(contentlog_basedir, NULL);
+	OPTS_KEEP_VAL(contentlog_isdir, "ContentLogDir");
+	OPTS_KEEP_VAL(contentlog_isspec, "ContentLogPathSpec");
+	OPTS_KEEP_VAL(contentlog_isseg, "ContentLogSegmentDir");
+	OPTS_KEEP_VAL(contentlog_segsz, "ContentLogSegmentSize");
+	OPTS_KEEP_STR(contentlog_dedupdir, "ContentLogDedupDir");
+	OPTS_KEEP_VAL(contentlog_rec_sz, "ContentLogRecorder");
+	OPTS_KEEP_VAL(contentlog_rec_total, "ContentLogRecorderTotal");
+	OPTS_KEEP_STR(masterkeylog, "MasterKeyLog");
+	OPTS_KEEP_STR(pcaplog, "PcapLog");
+	OPTS_KEEP_STR(pcaplog_basedir, NULL);
+	OPTS_KEEP_VAL(pcaplog_isdir, "PcapLogDir");
+	OPTS_KEEP_VAL(pcaplog_isspec, "PcapLogPathSpec");
+	OPTS_KEEP_VAL(pcaplog_ng, "PcapLogFormat");
+	OPTS_KEEP_VAL(connectlog_json, "ConnectLogFormat");
+	OPTS_KEEP_VAL(connectlog_rollup, "ConnectLogRollup");
+	OPTS_KEEP_STR(contenttap, "ContentTap");
+	OPTS_KEEP_VAL(contenttap_sz, "ContentTapSize");
+	OPTS_KEEP_STR(contentstream, "ContentStream");
+	OPTS_KEEP_VAL(contentstream_sz, "ContentStreamBuffer");
+	for (int i = 0; i < INSPECT_MAXPLUGINS; i++)
+		OPTS_KEEP_STR(inspect[i], "InspectPlugin");
+	opts->inspect_count = oldopts->inspect_count;
+#ifndef WITHOUT_MIRROR
+	OPTS_KEEP_STR(mirrorif, "MirrorIf");
+	OPTS_KEEP_STR(mirrortarget, "MirrorTarget");
+	OPTS_KEEP_VAL(mirror_chk_interval, "MirrorCheckInterval");
+#endif /* !WITHOUT_MIRROR */
+	OPTS_KEEP_STR(certgendir, "WriteGenCertsDir");
+	OPTS_KEEP_VAL(certgen_writeall, "WriteAllCertsDir");
+	OPTS_KEEP_VAL(certgen_warmup, "GenCertsCacheWarmup");
+	OPTS_KEEP_STR(leafcertdir, "LeafCertDir");
+	OPTS_KEEP_STR(leafcertdir_index, "LeafCertDirIndex");
+	OPTS_KEEP_VAL(leafcertdir_lazy, "LeafCertDirLazy");
+	OPTS_KEEP_STR(fkcrtstore, "ForgedCertCacheFile");
+	OPTS_KEEP_STR(sessstore, "SessionCacheFile");
+	OPTS_KEEP_VAL(sessstore_interval, "SessionCacheSaveInterval");
+	OPTS_KEEP_STR(stats_socket, "StatsSocket");
+	OPTS_KEEP_STR(upgrade_socket, "UpgradeSocket");
+	OPTS_KEEP_VAL(drain_timeout, "DrainTimeout");
+	OPTS_KEEP_STR(ticketkeyfile, "SessionTicketKeyFile");
+	OPTS_KEEP_STR(log_spilldir, "LogSpillDir");
+#ifndef OPENSSL_NO_ENGINE
+	OPTS_KEEP_STR(openssl_engine, "OpenSSLEngine");
+#endif /* !OPENSSL_NO_ENGINE */
+	OPTS_KEEP_VAL(detach, "Daemon");
+	OPTS_KEEP_VAL(mempool, "ThreadMemPool");
+	OPTS_KEEP_VAL(huge_pages, "HugePages");
+	OPTS_KEEP_VAL(reuseport, "ReusePortListeners");
+	OPTS_KEEP_VAL(reuseport_steer, "ReusePortCPUSteering");
+	OPTS_KEEP_VAL(tcp_fastopen, "TCPFastOpen");
+	OPTS_KEEP_VAL(tcp_deferaccept, "TCPDeferAccept");
+	OPTS_KEEP_VAL(sslticket, "SessionTickets");
+	OPTS_KEEP_VAL(ticket_rotate, "SessionTicketKeyRotate");
+	OPTS_KEEP_VAL(log_membudget, "LogQueueMaxBytes");
+	OPTS_KEEP_VAL(outbuf_membudget, "OutbufMaxBytes");
+	OPTS_KEEP_VAL(content_log_threads, "ContentLogThreads");
+	OPTS_KEEP_VAL(contentlog_maxfiles, "ContentLogMaxOpenFiles");
+	OPTS_KEEP_VAL(log_compress, "LogCompression");
+	OPTS_KEEP_VAL(log_flush_interval, "LogFlushInterval");
+	OPTS_KEEP_VAL(log_prealloc, "LogPreallocate");
+	OPTS_KEEP_VAL(log_fsyncsz, "LogFsync");
+	OPTS_KEEP_VAL(log_fsync_close, "LogFsync");
+	OPTS_KEEP_VAL(log_dropcache, "LogDropCache");
+	OPTS_KEEP_VAL(thrsel, "ThreadSelection");
+	OPTS_KEEP_VAL(rebalance_interval, "RebalanceInterval");
+	OPTS_KEEP_VAL(worker_threads, "WorkerThreads");
+	OPTS_KEEP_VAL(worker_procs, "WorkerProcesses");
+	OPTS_KEEP_VAL(shcache_size, "SharedCacheSize");
+	OPTS_KEEP_STR(rcache_servers, "RemoteCache");
+	OPTS_KEEP_VAL(rcache_timeout, "RemoteCacheTimeout");
+	OPTS_KEEP_VAL(forge_threads, "ForgeThreads");
+	OPTS_KEEP_VAL(forge_steal, "ForgeStealing");
+	OPTS_KEEP_VAL(worker_libctx, "WorkerLibCtx");
+	OPTS_KEEP_VAL(preforge_hosts, "PreforgeHosts");
+	OPTS_KEEP_VAL(leafkey_ec, "LeafKeyType");
+	OPTS_KEEP_VAL(leafkey_pool, "LeafKeyPool");
+	OPTS_KEEP_VAL(preconnect, "PreconnectPool");
+	OPTS_KEEP_VAL(http_upstream_pool, "HTTPUpstreamPool");
+	OPTS_KEEP_VAL(http_cache_size, "HTTPCacheSize");
+	OPTS_KEEP_VAL(http_cache_maxobj, "HTTPCacheMaxObjectSize");
+	OPTS_KEEP_VAL(stats_cputop, "StatsCPUTop");
+	OPTS_KEEP_VAL(stats_tcptop, "StatsTCPInfoTop");
+	OPTS_KEEP_VAL(stats_lockprof, "StatsLockProfiling");
+	OPTS_KEEP_VAL(stats_perf, "StatsPerfCounters");
+	OPTS_KEEP_VAL(fkcrt_maxentries, "ForgedCertCacheMaxEntries");
+	OPTS_KEEP_VAL(fkcrt_maxbytes, "ForgedCertCacheMaxBytes");
+	OPTS_KEEP_VAL(tgcrt_maxentries, "LeafCertDirCacheMaxEntries");
+	OPTS_KEEP_VAL(ssess_maxentries, "SrcSessionCacheMaxEntries");
+	OPTS_KEEP_VAL(ssess_maxbytes, "SrcSessionCacheMaxBytes");
+	OPTS_KEEP_VAL(dsess_maxentries, "DstSessionCacheMaxEntries");
+	OPTS_KEEP_VAL(dsess_maxbytes, "DstSessionCacheMaxBytes");
+	OPTS_KEEP_VAL(dns_maxentries, "DNSCacheMaxEntries");
+	OPTS_KEEP_VAL(sslctx_maxentries, "SSLCtxCacheMaxEntries");
+	OPTS_KEEP_VAL(vrfy_maxentries, "VerifyCacheMaxEntries");
+	OPTS_KEEP_VAL(sni_maxentries, "SNICacheMaxEntries");
+	OPTS_KEEP_VAL(pass_maxentries, "PassthroughCacheMaxEntries");
+	OPTS_KEEP_VAL(ocsp_maxentries, "OCSPCacheMaxEntries");
+	OPTS_KEEP_VAL(cache_presize, "CachePresize");
+	if (memcmp(opts->log_overflow, oldopts->log_overflow,
+	           sizeof(opts->log_overflow))) {
+		log_err_printf("Warning: LogOverflow cannot be changed by "
+		               "reloading; keeping previous value\n");
+		memcpy(opts->log_overflow, oldopts->log_overflow,
+		       sizeof(opts->log_overflow));
+	}
+	if (opts->worker_cpus_count != oldopts->worker_cpus_count ||
+	    (opts->worker_cpus_count &&
+	     memcmp(opts->worker_cpus, oldopts->worker_cpus,
+	            opts->worker_cpus_count * sizeof(int)))) {
+		log_err_printf("Warning: WorkerCPUs cannot be changed by "
+		               "reloading; keeping previous value\n");
+		if (opts->worker_cpus)
+			free(opts->worker_cpus);
+		opts->worker_cpus = NULL;
+		opts->worker_cpus_count = 0;
+		if (oldopts->worker_cpus_count) {
+			size_t sz = oldopts->worker_cpus_count * sizeof(int);
+			if (!(opts->worker_cpus = malloc(sz)))
+				return -1;
+			memcpy(opts->worker_cpus, oldopts->worker_cpus, sz);
+			opts->worker_cpus_count = oldopts->worker_cpus_count;
+		}
+	}
+	if (!opts_workerpool_equal(opts, oldopts)) {
+		log_err_printf("Warning: WorkerPool cannot be changed by "
+		               "reloading; keeping previous value\n");
+		if (opts_workerpool_copy(opts, oldopts) == -1)
+			return -1;
+	}
+	for (spec = opts->spec, oldspec = oldopts->spec;
+	     spec && oldspec;
+	     spec = spec->next, oldspec = oldspec->next) {
+		if (opts_keep_str(&spec->workerpool, oldspec->workerpool,
+		                  "Proxyspec worker pool") == -1 ||
+		    opts_keep_str(&spec->fwdpool, oldspec->fwdpool,
+		                  "Proxyspec forwarding pool") == -1)
+			return -1;
+		spec->wpool = oldspec->wpool;
+		spec->fwpool = oldspec->fwpool;
+	}
+
+	if (!opts->leafkey && oldopts->leafkey) {
+		ssl_key_refcount_inc(oldopts->leafkey);
+		opts->leafkey = oldopts->leafkey;
+	}
+	if (!opts->ecleafkey && oldopts->ecleafkey) {
+		ssl_key_refcount_inc(oldopts->ecleafkey);
+		opts->ecleafkey = oldopts->ecleafkey;
+	}
+	if (opts_has_ssl_spec(opts) &&
+	    ((opts->cakey && !opts->leafkey) ||
+	     (opts->eccakey && !opts->ecleafkey))) {
+		log_err_printf("A CA cannot be added by reloading without "
+		               "also specifying its leaf key\n");
+		return -1;
+	}
+	if (opts_fktmpl_setup(opts) == -1) {
+		log_err_printf("Error setting up forging templates\n");
+		return -1;
+	}
+	opts->fkcrt_epoch = oldopts->fkcrt_epoch;
+	/* cached SSL_CTXs carry the SSL/TLS settings of the configuration
+	 * they were created for, which may have changed */
+	opts->sslctx_gen = oldopts->sslctx_gen + 1;
+	return 0;
+}
+
+/*
+ * Build the forging templates for the CA and leaf key pairs, once the leaf
+ * keys are loaded or generated.
+ * Returns 0 on success, -1 on failure.
+ */
+int
+opts_fktmpl_setup(opts_t *opts)
+{
+	if (opts->cacrt && opts->cakey && opts->leafkey && !opts->fktmpl) {
+		opts->fktmpl = ssl_x509_tmpl_new(opts->cacrt, opts->cakey,
+		                                 opts->leafkey,
+		                                 opts->leafcrlurl);
+		if (!opts->fktmpl)
+			return -1;
+	}
+	if (opts->eccacrt && opts->eccakey && opts->ecleafkey &&
+	    !opts->ecfktmpl) {
+		opts->ecfktmpl = ssl_x509_tmpl_new(opts->eccacrt,
+		                                   opts->eccakey,
+		                                   opts->ecleafkey,
+		                                   opts->leafcrlurl);
+		if (!opts->ecfktmpl)
+			return -1;
+	}
+	return 0;
+}
+
 /*
  * Return 1 if opts_t contains a proxyspec that (eventually) uses SSL/TLS,
  * 0 otherwise.  When 0, it is safe to assume that no SSL/TLS operations
@@ -231,6 +750,22 @@ opts_has_dns_spec(opts_t *opts)
 	return 0;
 }
 
+/*
+ * Return 1 if opts_t pins any connection handling threads to CPUs, with
+ * WorkerCPUs or the CPUs of a WorkerPool, 0 otherwise.
+ */
+int
+opts_has_pinned_threads(opts_t *opts)
+{
+	if (opts->worker_cpus_count > 0)
+		return 1;
+	for (int i = 0; i < opts->workerpool_count; i++) {
+		if (opts->workerpool[i].cpus_count > 0)
+			return 1;
+	}
+	return 0;
+}
+
 /*
  * Dump the SSL/TLS protocol related configuration to the debug log.
  */
@@ -294,6 +829,267 @@ opts_proto_dbg_dump(opts_t *opts)
 /*
  * Parse proxyspecs using a simple state machine.
  */
+static const char *opts_timeout_names[OPTS_TIMEOUT_MAX] = {
+	"connect", "handshake", "header", "idle", "dormant", "hello"
+};
+
+/*
+ * Parse a timeout in seconds from the first len characters of value.
+ * Returns the timeout, or -1 if it is invalid.
+ */
+static int
+opts_parse_timeout(const char *value, size_t len)
+{
+	long n = 0;
+
+	if (len == 0 || len > 6)
+		return -1;
+	for (size_t i = 0; i < len; i++) {
+		if (value[i] < '0' || value[i] > '9')
+			return -1;
+		n = n * 10 + (value[i] - '0');
+	}
+	return n > MAX_TIMEOUT ? -1 : n;
+}
+
+/*
+ * Parse a byte count with optional k, M or G suffix from the first len
+ * characters of value.  Returns the count, or -1 if it is invalid.
+ */
+static long long
+opts_parse_bytes(const char *value, size_t len)
+{
+	long long n = 0;
+	int shift = 0;
+
+	if (len > 0) {
+		switch (value[len - 1]) {
+		case 'G':
+			shift = 30;
+			len--;
+			break;
+		case 'M':
+			shift = 20;
+			len--;
+			break;
+		case 'k':
+			shift = 10;
+			len--;
+			break;
+		default:
+			break;
+		}
+	}
+	if (len == 0 || len > 12)
+		return -1;
+	for (size_t i = 0; i < len; i++) {
+		if (value[i] < '0' || value[i] > '9')
+			return -1;
+		n = n * 10 + (value[i] - '0');
+	}
+	return n << shift;
+}
+
+/*
+ * Parse an admission limit from the first len characters of value.
+ * Returns the limit, or -1 if it is invalid.
+ */
+static long
+opts_parse_limit(const char *value, size_t len)
+{
+	long n = 0;
+
+	if (len == 0 || len > 9)
+		return -1;
+	for (size_t i = 0; i < len; i++) {
+		if (value[i] < '0' || value[i] > '9')
+			return -1;
+		n = n * 10 + (value[i] - '0');
+	}
+	return n;
+}
+
+/*
+ * Parse the per-proxyspec admission limits in arg, a comma separated list
+ * of kind:number pairs, as in conns:1000,rate:100.
+ * Calls exit() on failure.
+ */
+static void
+proxyspec_parse_limit(proxyspec_t *spec, const char *arg)
+{
+	const char *p, *sep, *end;
+	unsigned int *limit;
+	long n;
+
+	for (p = arg; *p; p = *end ? end + 1 : end) {
+		end = strchr(p, ',');
+		if (!end)
+			end = p + strlen(p);
+		sep = memchr(p, ':', end - p);
+		if (!sep)
+			goto errout;
+		if (sep - p == 5 && !strncmp(p, "conns", 5)) {
+			limit = &spec->admit.conns;
+		} else if (sep - p == 4 && !strncmp(p, "rate", 4)) {
+			limit = &spec->admit.rate;
+		} else {
+			fprintf(stderr, "Unknown limit '%.*s', use "
+			                "conns|rate\n", (int)(sep - p), p);
+			opts_fail();
+		}
+		n = opts_parse_limit(sep + 1, end - sep - 1);
+		if (n == -1) {
+			fprintf(stderr, "Invalid limit '%.*s'\n",
+			                (int)(end - sep - 1), sep + 1);
+			opts_fail();
+		}
+		*limit = n;
+	}
+	return;
+
+errout:
+	fprintf(stderr, "Invalid proxyspec limit '%s', use "
+	                "kind:number[,kind:number...]\n", arg);
+	opts_fail();
+}
+
+/*
+ * Parse the per-proxyspec timeouts in arg, a comma separated list of
+ * kind:seconds pairs, as in connect:5,idle:300.
+ * Calls exit() on failure.
+ */
+static void
+proxyspec_parse_timeout(proxyspec_t *spec, const char *arg)
+{
+	const char *p, *sep, *end;
+	size_t len;
+	int kind;
+
+	for (p = arg; *p; p = *end ? end + 1 : end) {
+		end = strchr(p, ',');
+		if (!end)
+			end = p + strlen(p);
+		sep = memchr(p, ':', end - p);
+		if (!sep)
+			goto errout;
+		len = sep - p;
+		for (kind = 0; kind < OPTS_TIMEOUT_MAX; kind++) {
+			if (strlen(opts_timeout_names[kind]) == len &&
+			    !strncmp(p, opts_timeout_names[kind], len))
+				break;
+		}
+		if (kind == OPTS_TIMEOUT_MAX) {
+			fprintf(stderr, "Unknown timeout '%.*s', use "
+			                "connect|handshake|header|idle|dormant|"
+			                "hello\n",
+			                (int)len, p);
+			opts_fail();
+		}
+		spec->timeout[kind] = opts_parse_timeout(sep + 1,
+		                                         end - sep - 1);
+		if (spec->timeout[kind] == -1) {
+			fprintf(stderr, "Invalid %s timeout '%.*s', use "
+			                "0-%d seconds\n",
+			                opts_timeout_names[kind],
+			                (int)(end - sep - 1), sep + 1,
+			                MAX_TIMEOUT);
+			opts_fail();
+		}
+	}
+	return;
+
+errout:
+	fprintf(stderr, "Invalid proxyspec timeout '%s', use "
+	                "kind:seconds[,kind:seconds...]\n", arg);
+	opts_fail();
+}
+
+/*
+ * Parse the argument of a proxyspec shape token, a comma separated list of
+ * rate:bytes and burst:bytes pairs.
+ * Calls exit() on failure.
+ */
+static void
+proxyspec_parse_shape(proxyspec_t *spec, const char *arg)
+{
+	const char *p, *sep, *end;
+	long long *shape;
+	long long n;
+
+	for (p = arg; *p; p = *end ? end + 1 : end) {
+		end = strchr(p, ',');
+		if (!end)
+			end = p + strlen(p);
+		sep = memchr(p, ':', end - p);
+		if (!sep)
+			goto errout;
+		if (sep - p == 4 && !strncmp(p, "rate", 4)) {
+			shape = &spec->shape_rate;
+		} else if (sep - p == 5 && !strncmp(p, "burst", 5)) {
+			shape = &spec->shape_burst;
+		} else {
+			fprintf(stderr, "Unknown shape '%.*s', use "
+			                "rate|burst\n", (int)(sep - p), p);
+			opts_fail();
+		}
+		n = opts_parse_bytes(sep + 1, end - sep - 1);
+		if (n == -1) {
+			fprintf(stderr, "Invalid shape '%.*s'\n",
+			                (int)(end - sep - 1), sep + 1);
+			opts_fail();
+		}
+		*shape = n;
+	}
+	return;
+
+errout:
+	fprintf(stderr, "Invalid proxyspec shape '%s', use "
+	                "kind:bytes[,kind:bytes...]\n", arg);
+	opts_fail();
+}
+
+/*
+ * Parse the argument of a proxyspec source token, a comma separated list of
+ * IPv4 and IPv6 addresses.
+ * Calls exit() on failure.
+ */
+static void
+proxyspec_parse_source(proxyspec_t *spec, const char *arg)
+{
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	char *buf, *p, *end;
+
+	if (!spec->srcpool && !(spec->srcpool = srcpool_new()))
+		goto oom;
+	if (!(buf = strdup(arg)))
+		goto oom;
+	for (p = buf; p; p = end) {
+		end = strchr(p, ',');
+		if (end)
+			*end++ = '\0';
+		if (sys_sockaddr_parse(&addr, &addrlen, p, "0",
+		                       sys_get_af(p), 0) == -1)
+			goto errout;
+		if (srcpool_add(spec->srcpool, (struct sockaddr *)&addr,
+		                addrlen) == -1) {
+			fprintf(stderr, "Too many source addresses, at most "
+			                "%i per proxyspec\n", SRCPOOL_MAX);
+			goto errout;
+		}
+	}
+	free(buf);
+	return;
+
+errout:
+	free(buf);
+	opts_fail();
+
+oom:
+	fprintf(stderr, "Out of memory\n");
+	opts_fail();
+}
+
 void
 proxyspec_parse(int *argc, char **argv[], const char *natengine,
                 proxyspec_t **opts_spec)
@@ -307,16 +1103,49 @@ proxyspec_parse(int *argc, char **argv[], const char *natengine,
 		switch (state) {
 			default:
 			case 0:
+				/* [ timeout | limit | shape | pool | source |
+				 *   fwdpool ]
+				 * of the previous proxyspec */
+				if (spec && !strcmp(**argv, "timeout")) {
+					state = 6;
+					break;
+				}
+				if (spec && !strcmp(**argv, "limit")) {
+					state = 7;
+					break;
+				}
+				if (spec && !strcmp(**argv, "shape")) {
+					state = 8;
+					break;
+				}
+				if (spec && !strcmp(**argv, "pool")) {
+					state = 9;
+					break;
+				}
+				if (spec && !strcmp(**argv, "source")) {
+					state = 10;
+					break;
+				}
+				if (spec && !strcmp(**argv, "fwdpool")) {
+					state = 11;
+					break;
+				}
 				/* tcp | ssl | http | https | autossl */
 				spec = malloc(sizeof(proxyspec_t));
 				memset(spec, 0, sizeof(proxyspec_t));
 				spec->next = *opts_spec;
+				spec->idx = spec->next ? spec->next->idx + 1 : 0;
 				*opts_spec = spec;
 
 				/* Defaults */
 				spec->ssl = 0;
 				spec->http = 0;
 				spec->upgrade = 0;
+				for (int i = 0; i < OPTS_TIMEOUT_MAX; i++)
+					spec->timeout[i] = -1;
+				spec->shape_rate = -1;
+				spec->fwpool = -1;
+				spec->shape_burst = -1;
 				if (!strcmp(**argv, "tcp")) {
 					/* use defaults */
 				} else
@@ -335,7 +1164,7 @@ proxyspec_parse(int *argc, char **argv[], const char *natengine,
 				} else {
 					fprintf(stderr, "Unknown connection "
 					                "type '%s'\n", **argv);
-					exit(EXIT_FAILURE);
+					opts_fail();
 				}
 				state++;
 				break;
@@ -352,7 +1181,7 @@ proxyspec_parse(int *argc, char **argv[], const char *natengine,
 				                        sys_get_af(addr),
 				                        EVUTIL_AI_PASSIVE);
 				if (af == -1) {
-					exit(EXIT_FAILURE);
+					opts_fail();
 				}
 				if (natengine) {
 					spec->natengine = strdup(natengine);
@@ -360,7 +1189,7 @@ proxyspec_parse(int *argc, char **argv[], const char *natengine,
 						fprintf(stderr,
 						        "Out of memory"
 						        "\n");
-						exit(EXIT_FAILURE);
+						opts_fail();
 					}
 				} else {
 					spec->natengine = NULL;
@@ -378,6 +1207,30 @@ proxyspec_parse(int *argc, char **argv[], const char *natengine,
 					(*argv)--; (*argc)++; /* rewind */
 					state = 0;
 				} else
+				if (!strcmp(**argv, "timeout")) {
+					/* implicit default natengine */
+					state = 6;
+				} else
+				if (!strcmp(**argv, "limit")) {
+					/* implicit default natengine */
+					state = 7;
+				} else
+				if (!strcmp(**argv, "shape")) {
+					/* implicit default natengine */
+					state = 8;
+				} else
+				if (!strcmp(**argv, "pool")) {
+					/* implicit default natengine */
+					state = 9;
+				} else
+				if (!strcmp(**argv, "source")) {
+					/* implicit default natengine */
+					state = 10;
+				} else
+				if (!strcmp(**argv, "fwdpool")) {
+					/* implicit default natengine */
+					state = 11;
+				} else
 				if (!strcmp(**argv, "sni")) {
 					free(spec->natengine);
 					spec->natengine = NULL;
@@ -387,7 +1240,7 @@ proxyspec_parse(int *argc, char **argv[], const char *natengine,
 						        "only works for ssl "
 						        "and https proxyspecs"
 						        "\n");
-						exit(EXIT_FAILURE);
+						opts_fail();
 					}
 					state = 5;
 				} else
@@ -399,7 +1252,7 @@ proxyspec_parse(int *argc, char **argv[], const char *natengine,
 						fprintf(stderr,
 						        "Out of memory"
 						        "\n");
-						exit(EXIT_FAILURE);
+						opts_fail();
 					}
 					state = 0;
 				} else {
@@ -416,7 +1269,7 @@ proxyspec_parse(int *argc, char **argv[], const char *natengine,
 				                        &spec->connect_addrlen,
 				                        addr, **argv, af, 0);
 				if (af == -1) {
-					exit(EXIT_FAILURE);
+					opts_fail();
 				}
 				state = 0;
 				break;
@@ -426,22 +1279,62 @@ proxyspec_parse(int *argc, char **argv[], const char *natengine,
 				if (!spec->sni_port) {
 					fprintf(stderr, "Invalid port '%s'\n",
 					                **argv);
-					exit(EXIT_FAILURE);
+					opts_fail();
 				}
 				spec->dns = 1;
 				state = 0;
 				break;
-		}
-		(*argv)++;
-	}
-	if (state != 0 && state != 3) {
-		fprintf(stderr, "Incomplete proxyspec!\n");
-		exit(EXIT_FAILURE);
-	}
-}
-
-/*
- * Clear and free a proxy spec.
+			case 6:
+				/* kind:seconds[,kind:seconds...] */
+				proxyspec_parse_timeout(spec, **argv);
+				state = 0;
+				break;
+			case 7:
+				/* kind:number[,kind:number...] */
+				proxyspec_parse_limit(spec, **argv);
+				state = 0;
+				break;
+			case 8:
+				/* kind:bytes[,kind:bytes...] */
+				proxyspec_parse_shape(spec, **argv);
+				state = 0;
+				break;
+			case 9:
+				/* worker pool name */
+				free(spec->workerpool);
+				spec->workerpool = strdup(**argv);
+				if (!spec->workerpool) {
+					fprintf(stderr, "Out of memory\n");
+					opts_fail();
+				}
+				state = 0;
+				break;
+			case 10:
+				/* addr[,addr...] */
+				proxyspec_parse_source(spec, **argv);
+				state = 0;
+				break;
+			case 11:
+				/* forwarding worker pool name */
+				free(spec->fwdpool);
+				spec->fwdpool = strdup(**argv);
+				if (!spec->fwdpool) {
+					fprintf(stderr, "Out of memory\n");
+					opts_fail();
+				}
+				state = 0;
+				break;
+		}
+		(*argv)++;
+	}
+	if (state != 0 && state != 3) {
+		fprintf(stderr, "Incomplete proxyspec!\n");
+		opts_fail();
+	}
+}
+
+/*
+ * Clear and free a proxy spec.
  */
 void
 proxyspec_free(proxyspec_t *spec)
@@ -450,6 +1343,14 @@ proxyspec_free(proxyspec_t *spec)
 		proxyspec_t *next = spec->next;
 		if (spec->natengine)
 			free(spec->natengine);
+		if (spec->workerpool)
+			free(spec->workerpool);
+		if (spec->fwdpool)
+			free(spec->fwdpool);
+		if (spec->srcpool)
+			srcpool_free(spec->srcpool);
+		if (spec->dstsslctx)
+			SSL_CTX_free(spec->dstsslctx);
 		memset(spec, 0, sizeof(proxyspec_t));
 		free(spec);
 		spec = next;
@@ -516,7 +1417,7 @@ opts_set_cacrt(opts_t *opts, const char *argv0, const char *optarg)
 		} else {
 			ERR_print_errors_fp(stderr);
 		}
-		exit(EXIT_FAILURE);
+		opts_fail();
 	}
 	ssl_x509_refcount_inc(opts->cacrt);
 	sk_X509_insert(opts->cachain, opts->cacrt, 0);
@@ -547,7 +1448,7 @@ opts_set_cakey(opts_t *opts, const char *argv0, const char *optarg)
 		} else {
 			ERR_print_errors_fp(stderr);
 		}
-		exit(EXIT_FAILURE);
+		opts_fail();
 	}
 	if (!opts->cacrt) {
 		opts->cacrt = ssl_x509_load(optarg);
@@ -577,7 +1478,7 @@ opts_set_cachain(opts_t *opts, const char *argv0, const char *optarg)
 		} else {
 			ERR_print_errors_fp(stderr);
 		}
-		exit(EXIT_FAILURE);
+		opts_fail();
 	}
 #ifdef DEBUG_OPTS
 	log_dbg_printf("CAChain: %s\n", optarg);
@@ -598,7 +1499,7 @@ opts_set_leafkey(opts_t *opts, const char *argv0, const char *optarg)
 		} else {
 			ERR_print_errors_fp(stderr);
 		}
-		exit(EXIT_FAILURE);
+		opts_fail();
 	}
 #ifndef OPENSSL_NO_DH
 	if (!opts->dh) {
@@ -610,6 +1511,89 @@ opts_set_leafkey(opts_t *opts, const char *argv0, const char *optarg)
 #endif /* DEBUG_OPTS */
 }
 
+void
+opts_set_eccacrt(opts_t *opts, const char *argv0, const char *optarg)
+{
+	if (opts->eccacrt) {
+		sk_X509_delete_ptr(opts->eccachain, opts->eccacrt);
+		X509_free(opts->eccacrt);
+		X509_free(opts->eccacrt);
+	}
+	opts->eccacrt = ssl_x509_load(optarg);
+	if (!opts->eccacrt) {
+		fprintf(stderr, "%s: error loading ECDSA CA cert from '%s':\n",
+		        argv0, optarg);
+		if (errno) {
+			fprintf(stderr, "%s\n", strerror(errno));
+		} else {
+			ERR_print_errors_fp(stderr);
+		}
+		opts_fail();
+	}
+	ssl_x509_refcount_inc(opts->eccacrt);
+	sk_X509_insert(opts->eccachain, opts->eccacrt, 0);
+	if (!opts->eccakey) {
+		opts->eccakey = ssl_key_load(optarg);
+	}
+#ifdef DEBUG_OPTS
+	log_dbg_printf("ECDSACACert: %s\n", optarg);
+#endif /* DEBUG_OPTS */
+}
+
+void
+opts_set_eccakey(opts_t *opts, const char *argv0, const char *optarg)
+{
+	if (opts->eccakey)
+		EVP_PKEY_free(opts->eccakey);
+	opts->eccakey = ssl_key_load(optarg);
+	if (!opts->eccakey) {
+		fprintf(stderr, "%s: error loading ECDSA CA key from '%s':\n",
+		        argv0, optarg);
+		if (errno) {
+			fprintf(stderr, "%s\n", strerror(errno));
+		} else {
+			ERR_print_errors_fp(stderr);
+		}
+		opts_fail();
+	}
+	if (!opts->eccacrt) {
+		opts->eccacrt = ssl_x509_load(optarg);
+		if (opts->eccacrt) {
+			ssl_x509_refcount_inc(opts->eccacrt);
+			sk_X509_insert(opts->eccachain, opts->eccacrt, 0);
+		}
+	}
+#ifdef DEBUG_OPTS
+	log_dbg_printf("ECDSACAKey: %s\n", optarg);
+#endif /* DEBUG_OPTS */
+}
+
+void
+opts_set_ecleafkey(opts_t *opts, const char *argv0, const char *optarg)
+{
+	if (opts->ecleafkey)
+		EVP_PKEY_free(opts->ecleafkey);
+	opts->ecleafkey = ssl_key_load(optarg);
+	if (!opts->ecleafkey) {
+		fprintf(stderr, "%s: error loading ECDSA leaf key from '%s':\n",
+		        argv0, optarg);
+		if (errno) {
+			fprintf(stderr, "%s\n", strerror(errno));
+		} else {
+			ERR_print_errors_fp(stderr);
+		}
+		opts_fail();
+	}
+	if (EVP_PKEY_base_id(opts->ecleafkey) != EVP_PKEY_EC) {
+		fprintf(stderr, "%s: ECDSA leaf key from '%s' is not an EC "
+		                "key\n", argv0, optarg);
+		opts_fail();
+	}
+#ifdef DEBUG_OPTS
+	log_dbg_printf("ECDSALeafKey: %s\n", optarg);
+#endif /* DEBUG_OPTS */
+}
+
 void
 opts_set_leafcrlurl(opts_t *opts, const char *optarg)
 {
@@ -627,7 +1611,7 @@ opts_set_leafcertdir(opts_t *opts, const char *argv0, const char *optarg)
 	if (!sys_isdir(optarg)) {
 		fprintf(stderr, "%s: '%s' is not a directory\n",
 		        argv0, optarg);
-		exit(EXIT_FAILURE);
+		opts_fail();
 	}
 	if (opts->leafcertdir)
 		free(opts->leafcertdir);
@@ -639,6 +1623,25 @@ opts_set_leafcertdir(opts_t *opts, const char *argv0, const char *optarg)
 #endif /* DEBUG_OPTS */
 }
 
+/*
+ * Set the index file for loading the certificates from the leafcertdir on
+ * first use; implies LeafCertDirLazy.
+ */
+void
+opts_set_leafcertdir_index(opts_t *opts, const char *argv0,
+                           const char *optarg)
+{
+	if (opts->leafcertdir_index)
+		free(opts->leafcertdir_index);
+	opts->leafcertdir_index = strdup(optarg);
+	if (!opts->leafcertdir_index)
+		oom_die(argv0);
+	opts->leafcertdir_lazy = 1;
+#ifdef DEBUG_OPTS
+	log_dbg_printf("LeafCertDirIndex: %s\n", opts->leafcertdir_index);
+#endif /* DEBUG_OPTS */
+}
+
 void
 opts_set_defaultleafcert(opts_t *opts, const char *argv0, const char *optarg)
 {
@@ -653,7 +1656,7 @@ opts_set_defaultleafcert(opts_t *opts, const char *argv0, const char *optarg)
 		} else {
 			ERR_print_errors_fp(stderr);
 		}
-		exit(EXIT_FAILURE);
+		opts_fail();
 	}
 #ifdef DEBUG_OPTS
 	log_dbg_printf("DefaultLeafCert: %s\n", optarg);
@@ -706,6 +1709,126 @@ opts_unset_deny_ocsp(opts_t *opts)
 	opts->deny_ocsp = 0;
 }
 
+static void
+opts_set_http_keepalive(opts_t *opts)
+{
+	opts->http_keepalive = 1;
+}
+
+static void
+opts_unset_http_keepalive(opts_t *opts)
+{
+	opts->http_keepalive = 0;
+}
+
+static void
+opts_set_mempool(opts_t *opts)
+{
+	opts->mempool = 1;
+}
+
+static void
+opts_unset_mempool(opts_t *opts)
+{
+	opts->mempool = 0;
+}
+
+static void
+opts_set_leafcertdir_lazy(opts_t *opts)
+{
+	opts->leafcertdir_lazy = 1;
+}
+
+static void
+opts_unset_leafcertdir_lazy(opts_t *opts)
+{
+	opts->leafcertdir_lazy = 0;
+}
+
+static void
+opts_set_certgen_warmup(opts_t *opts)
+{
+	opts->certgen_warmup = 1;
+}
+
+static void
+opts_unset_certgen_warmup(opts_t *opts)
+{
+	opts->certgen_warmup = 0;
+}
+
+static void
+opts_set_splice(opts_t *opts)
+{
+	opts->splice = 1;
+}
+
+static void
+opts_unset_splice(opts_t *opts)
+{
+	opts->splice = 0;
+}
+
+static void
+opts_set_iouring(opts_t *opts)
+{
+	opts->iouring = 1;
+}
+
+static void
+opts_unset_iouring(opts_t *opts)
+{
+	opts->iouring = 0;
+}
+
+static void
+opts_set_zerocopy(opts_t *opts)
+{
+	opts->zerocopy = 1;
+}
+
+static void
+opts_unset_zerocopy(opts_t *opts)
+{
+	opts->zerocopy = 0;
+}
+
+static void
+opts_set_http_compression(opts_t *opts)
+{
+	opts->http_compression = 1;
+}
+
+static void
+opts_unset_http_compression(opts_t *opts)
+{
+	opts->http_compression = 0;
+}
+
+static void
+opts_set_http_websocket(opts_t *opts)
+{
+	opts->http_websocket = 1;
+}
+
+static void
+opts_unset_http_websocket(opts_t *opts)
+{
+	opts->http_websocket = 0;
+}
+
+static void
+opts_set_http_websocket_frames(opts_t *opts)
+{
+	opts->http_websocket_frames = 1;
+}
+
+static void
+opts_unset_http_websocket_frames(opts_t *opts)
+{
+	opts->http_websocket_frames = 0;
+}
+
 void
 opts_set_passthrough(opts_t *opts)
 {
@@ -732,7 +1855,7 @@ opts_set_clientcrt(opts_t *opts, const char *argv0, const char *optarg)
 		} else {
 			ERR_print_errors_fp(stderr);
 		}
-		exit(EXIT_FAILURE);
+		opts_fail();
 	}
 #ifdef DEBUG_OPTS
 	log_dbg_printf("ClientCert: %s\n", optarg);
@@ -753,7 +1876,7 @@ opts_set_clientkey(opts_t *opts, const char *argv0, const char *optarg)
 		} else {
 			ERR_print_errors_fp(stderr);
 		}
-		exit(EXIT_FAILURE);
+		opts_fail();
 	}
 #ifdef DEBUG_OPTS
 	log_dbg_printf("ClientKey: %s\n", optarg);
@@ -775,7 +1898,7 @@ opts_set_dh(opts_t *opts, const char *argv0, const char *optarg)
 		} else {
 			ERR_print_errors_fp(stderr);
 		}
-		exit(EXIT_FAILURE);
+		opts_fail();
 	}
 #ifdef DEBUG_OPTS
 	log_dbg_printf("DHGroupParams: %s\n", optarg);
@@ -788,13 +1911,13 @@ void
 opts_set_ecdhcurve(opts_t *opts, const char *argv0, const char *optarg)
 {
 	EC_KEY *ec;
-	if (opts->ecdhcurve)
-		free(opts->ecdhcurve);
 	if (!(ec = ssl_ec_by_name(optarg))) {
 		fprintf(stderr, "%s: unknown curve '%s'\n", argv0, optarg);
-		exit(EXIT_FAILURE);
+		opts_fail();
 	}
 	EC_KEY_free(ec);
+	if (opts->ecdhcurve)
+		free(opts->ecdhcurve);
 	opts->ecdhcurve = strdup(optarg);
 	if (!opts->ecdhcurve)
 		oom_die(argv0);
@@ -857,7 +1980,7 @@ opts_force_proto(opts_t *opts, const char *argv0, const char *optarg)
 	if (opts->sslversion) {
 #endif /* OPENSSL_VERSION_NUMBER >= 0x10100000L */
 		fprintf(stderr, "%s: cannot use -r multiple times\n", argv0);
-		exit(EXIT_FAILURE);
+		opts_fail();
 	}
 
 #if (OPENSSL_VERSION_NUMBER < 0x10100000L) || defined(LIBRESSL_VERSION_NUMBER)
@@ -916,7 +2039,7 @@ opts_force_proto(opts_t *opts, const char *argv0, const char *optarg)
 	{
 		fprintf(stderr, "%s: Unsupported SSL/TLS protocol '%s'\n",
 		                argv0, optarg);
-		exit(EXIT_FAILURE);
+		opts_fail();
 	}
 #ifdef DEBUG_OPTS
 	log_dbg_printf("ForceSSLProto: %s\n", optarg);
@@ -958,7 +2081,7 @@ opts_disable_proto(opts_t *opts, const char *argv0, const char *optarg)
 	{
 		fprintf(stderr, "%s: Unsupported SSL/TLS protocol '%s'\n",
 		                argv0, optarg);
-		exit(EXIT_FAILURE);
+		opts_fail();
 	}
 #ifdef DEBUG_OPTS
 	log_dbg_printf("DisableSSLProto: %s\n", optarg);
@@ -971,7 +2094,7 @@ opts_set_user(opts_t *opts, const char *argv0, const char *optarg)
 	if (!sys_isuser(optarg)) {
 		fprintf(stderr, "%s: '%s' is not an existing user\n",
 		        argv0, optarg);
-		exit(EXIT_FAILURE);
+		opts_fail();
 	}
 	if (opts->dropuser)
 		free(opts->dropuser);
@@ -990,7 +2113,7 @@ opts_set_group(opts_t *opts, const char *argv0, const char *optarg)
 	if (!sys_isgroup(optarg)) {
 		fprintf(stderr, "%s: '%s' is not an existing group\n",
 		        argv0, optarg);
-		exit(EXIT_FAILURE);
+		opts_fail();
 	}
 	if (opts->dropgroup)
 		free(opts->dropgroup);
@@ -1007,7 +2130,7 @@ opts_set_jaildir(opts_t *opts, const char *argv0, const char *optarg)
 {
 	if (!sys_isdir(optarg)) {
 		fprintf(stderr, "%s: '%s' is not a directory\n", argv0, optarg);
-		exit(EXIT_FAILURE);
+		opts_fail();
 	}
 	if (opts->jaildir)
 		free(opts->jaildir);
@@ -1015,7 +2138,7 @@ opts_set_jaildir(opts_t *opts, const char *argv0, const char *optarg)
 	if (!opts->jaildir) {
 		fprintf(stderr, "%s: Failed to realpath '%s': %s (%i)\n",
 		        argv0, optarg, strerror(errno), errno);
-		exit(EXIT_FAILURE);
+		opts_fail();
 	}
 #ifdef DEBUG_OPTS
 	log_dbg_printf("Chroot: %s\n", opts->jaildir);
@@ -1035,6 +2158,151 @@ opts_set_pidfile(opts_t *opts, const char *argv0, const char *optarg)
 #endif /* DEBUG_OPTS */
 }
 
+void
+opts_set_stats_socket(opts_t *opts, const char *argv0, const char *optarg)
+{
+	if (opts->stats_socket)
+		free(opts->stats_socket);
+	opts->stats_socket = strdup(optarg);
+	if (!opts->stats_socket)
+		oom_die(argv0);
+#ifdef DEBUG_OPTS
+	log_dbg_printf("StatsSocket: %s\n", opts->stats_socket);
+#endif /* DEBUG_OPTS */
+}
+
+void
+opts_set_upgrade_socket(opts_t *opts, const char *argv0, const char *optarg)
+{
+	if (opts->upgrade_socket)
+		free(opts->upgrade_socket);
+	opts->upgrade_socket = strdup(optarg);
+	if (!opts->upgrade_socket)
+		oom_die(argv0);
+#ifdef DEBUG_OPTS
+	log_dbg_printf("UpgradeSocket: %s\n", opts->upgrade_socket);
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Set the time in seconds to wait for connections and then for the log
+ * queues to drain when shutting down; 0 exits immediately.
+ * Calls exit() on failure.
+ */
+void
+opts_set_drain_timeout(opts_t *opts, const char *argv0, const char *optarg)
+{
+	char *end;
+	long n;
+
+	n = strtol(optarg, &end, 10);
+	if (*optarg == '\0' || *end != '\0' || n < 0 || n > 3600) {
+		fprintf(stderr, "%s: Invalid drain timeout '%s', "
+		                "use 0-3600\n", argv0, optarg);
+		opts_fail();
+	}
+	opts->drain_timeout = n;
+#ifdef DEBUG_OPTS
+	log_dbg_printf("DrainTimeout: %u\n", opts->drain_timeout);
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Set the number of most expensive destinations in terms of CPU time to
+ * report; 0 disables CPU time accounting.  Calls exit() on failure.
+ */
+void
+opts_set_stats_cputop(opts_t *opts, const char *argv0, const char *optarg)
+{
+	char *end;
+	long n;
+
+	n = strtol(optarg, &end, 10);
+	if (*optarg == '\0' || *end != '\0' || n < 0 || n > 1000) {
+		fprintf(stderr, "%s: Invalid number of destinations '%s', "
+		                "use 0-1000\n", argv0, optarg);
+		opts_fail();
+	}
+	opts->stats_cputop = n;
+#ifdef DEBUG_OPTS
+	log_dbg_printf("StatsCPUTop: %u\n", opts->stats_cputop);
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Set the number of most frequent destinations to report TCP round trip
+ * times and retransmits for; 0 disables sampling TCP_INFO at close.  Calls
+ * exit() on failure.
+ */
+void
+opts_set_stats_tcptop(opts_t *opts, const char *argv0, const char *optarg)
+{
+	char *end;
+	long n;
+
+	n = strtol(optarg, &end, 10);
+	if (*optarg == '\0' || *end != '\0' || n < 0 || n > 1000) {
+		fprintf(stderr, "%s: Invalid number of destinations '%s', "
+		                "use 0-1000\n", argv0, optarg);
+		opts_fail();
+	}
+	opts->stats_tcptop = n;
+#ifdef DEBUG_OPTS
+	log_dbg_printf("StatsTCPInfoTop: %u\n", opts->stats_tcptop);
+#endif /* DEBUG_OPTS */
+}
+
+void
+opts_set_fkcrtstore(opts_t *opts, const char *argv0, const char *optarg)
+{
+	if (opts->fkcrtstore)
+		free(opts->fkcrtstore);
+	opts->fkcrtstore = strdup(optarg);
+	if (!opts->fkcrtstore)
+		oom_die(argv0);
+#ifdef DEBUG_OPTS
+	log_dbg_printf("ForgedCertCacheFile: %s\n", opts->fkcrtstore);
+#endif /* DEBUG_OPTS */
+}
+
+void
+opts_set_sessstore(opts_t *opts, const char *argv0, const char *optarg)
+{
+	if (opts->sessstore)
+		free(opts->sessstore);
+	opts->sessstore = strdup(optarg);
+	if (!opts->sessstore)
+		oom_die(argv0);
+#ifdef DEBUG_OPTS
+	log_dbg_printf("SessionCacheFile: %s\n", opts->sessstore);
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Set the interval in seconds at which the session caches are saved to
+ * SessionCacheFile; 0 only saves them on shutdown.
+ * Calls exit() on failure.
+ */
+void
+opts_set_sessstore_interval(opts_t *opts, const char *argv0,
+                            const char *optarg)
+{
+	char *end;
+	long n;
+
+	n = strtol(optarg, &end, 10);
+	if (*optarg == '\0' || *end != '\0' || n < 0 || n > 86400) {
+		fprintf(stderr, "%s: Invalid session cache save interval "
+		                "'%s', use 0-86400\n", argv0, optarg);
+		opts_fail();
+	}
+	opts->sessstore_interval = n;
+#ifdef DEBUG_OPTS
+	log_dbg_printf("SessionCacheSaveInterval: %u\n",
+	               opts->sessstore_interval);
+#endif /* DEBUG_OPTS */
+}
+
 void
 opts_set_connectlog(opts_t *opts, const char *argv0, const char *optarg)
 {
@@ -1044,7 +2312,7 @@ opts_set_connectlog(opts_t *opts, const char *argv0, const char *optarg)
 		if (errno == ENOENT) {
 			fprintf(stderr, "Directory part of '%s' does not "
 			                "exist\n", optarg);
-			exit(EXIT_FAILURE);
+			opts_fail();
 		} else {
 			fprintf(stderr, "Failed to realpath '%s': %s (%i)\n",
 			              optarg, strerror(errno), errno);
@@ -1056,35 +2324,107 @@ opts_set_connectlog(opts_t *opts, const char *argv0, const char *optarg)
 #endif /* DEBUG_OPTS */
 }
 
+/*
+ * Set the format of the connect log.
+ * Calls exit() on failure.
+ */
 void
-opts_set_contentlog(opts_t *opts, const char *argv0, const char *optarg)
+opts_set_connectlog_format(opts_t *opts, const char *argv0,
+                           const char *optarg)
 {
-	if (opts->contentlog)
-		free(opts->contentlog);
-	if (!(opts->contentlog = sys_realdir(optarg))) {
-		if (errno == ENOENT) {
-			fprintf(stderr, "Directory part of '%s' does not "
-			                "exist\n", optarg);
-			exit(EXIT_FAILURE);
-		} else {
-			fprintf(stderr, "Failed to realpath '%s': %s (%i)\n",
-			              optarg, strerror(errno), errno);
-			oom_die(argv0);
-		}
+	if (!strcmp(optarg, "json")) {
+		opts->connectlog_json = 1;
+	} else if (!strcmp(optarg, "text")) {
+		opts->connectlog_json = 0;
+	} else {
+		fprintf(stderr, "%s: Unknown connect log format '%s', "
+		                "use text|json\n", argv0, optarg);
+		opts_fail();
 	}
-	opts->contentlog_isdir = 0;
-	opts->contentlog_isspec = 0;
 #ifdef DEBUG_OPTS
-	log_dbg_printf("ContentLog: %s\n", opts->contentlog);
+	log_dbg_printf("ConnectLogFormat: %u\n", opts->connectlog_json);
 #endif /* DEBUG_OPTS */
 }
 
+/*
+ * Set the interval in seconds at which connect log rollup aggregates are
+ * written; 0 disables rollup and logs every connection.
+ * Calls exit() on failure.
+ */
 void
-opts_set_contentlogdir(opts_t *opts, const char *argv0, const char *optarg)
+opts_set_connectlog_rollup(opts_t *opts, const char *argv0,
+                           const char *optarg)
 {
-	if (!sys_isdir(optarg)) {
-		fprintf(stderr, "%s: '%s' is not a directory\n", argv0, optarg);
-		exit(EXIT_FAILURE);
+	char *end;
+	long n;
+
+	n = strtol(optarg, &end, 10);
+	if (*optarg == '\0' || *end != '\0' || n < 0 || n > 86400) {
+		fprintf(stderr, "%s: Invalid connect log rollup interval "
+		                "'%s', use 0-86400\n", argv0, optarg);
+		opts_fail();
+	}
+	opts->connectlog_rollup = n;
+#ifdef DEBUG_OPTS
+	log_dbg_printf("ConnectLogRollup: %u\n", opts->connectlog_rollup);
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Set the sampling rate of per-connection lines in rollup mode: one in n
+ * connections is still logged individually; 0 logs none.
+ * Calls exit() on failure.
+ */
+void
+opts_set_connectlog_sample(opts_t *opts, const char *argv0,
+                           const char *optarg)
+{
+	char *end;
+	long n;
+
+	n = strtol(optarg, &end, 10);
+	if (*optarg == '\0' || *end != '\0' || n < 0 || n > 1000000) {
+		fprintf(stderr, "%s: Invalid connect log sampling rate "
+		                "'%s', use 0-1000000\n", argv0, optarg);
+		opts_fail();
+	}
+	opts->connectlog_sample = n;
+#ifdef DEBUG_OPTS
+	log_dbg_printf("ConnectLogRollupSample: %u\n",
+	               opts->connectlog_sample);
+#endif /* DEBUG_OPTS */
+}
+
+void
+opts_set_contentlog(opts_t *opts, const char *argv0, const char *optarg)
+{
+	if (opts->contentlog)
+		free(opts->contentlog);
+	if (!(opts->contentlog = sys_realdir(optarg))) {
+		if (errno == ENOENT) {
+			fprintf(stderr, "Directory part of '%s' does not "
+			                "exist\n", optarg);
+			opts_fail();
+		} else {
+			fprintf(stderr, "Failed to realpath '%s': %s (%i)\n",
+			              optarg, strerror(errno), errno);
+			oom_die(argv0);
+		}
+	}
+	opts->contentlog_isdir = 0;
+	opts->contentlog_isspec = 0;
+	opts->contentlog_isseg = 0;
+#ifdef DEBUG_OPTS
+	log_dbg_printf("ContentLog: %s\n", opts->contentlog);
+#endif /* DEBUG_OPTS */
+}
+
+void
+opts_set_contentlogdir(opts_t *opts, const char *argv0, const char *optarg)
+{
+	if (!sys_isdir(optarg)) {
+		fprintf(stderr, "%s: '%s' is not a directory\n", argv0, optarg);
+		opts_fail();
 	}
 	if (opts->contentlog)
 		free(opts->contentlog);
@@ -1092,30 +2432,222 @@ opts_set_contentlogdir(opts_t *opts, const char *argv0, const char *optarg)
 	if (!opts->contentlog) {
 		fprintf(stderr, "%s: Failed to realpath '%s': %s (%i)\n",
 		        argv0, optarg, strerror(errno), errno);
-		exit(EXIT_FAILURE);
+		opts_fail();
 	}
 	opts->contentlog_isdir = 1;
 	opts->contentlog_isspec = 0;
+	opts->contentlog_isseg = 0;
 #ifdef DEBUG_OPTS
 	log_dbg_printf("ContentLogDir: %s\n", opts->contentlog);
 #endif /* DEBUG_OPTS */
 }
 
+/*
+ * Log the content of all connections to rotating segment files with an index
+ * in directory optarg, see logseg.c.
+ */
+void
+opts_set_contentlogsegdir(opts_t *opts, const char *argv0, const char *optarg)
+{
+	if (!sys_isdir(optarg)) {
+		fprintf(stderr, "%s: '%s' is not a directory\n", argv0, optarg);
+		opts_fail();
+	}
+	if (opts->contentlog)
+		free(opts->contentlog);
+	opts->contentlog = realpath(optarg, NULL);
+	if (!opts->contentlog) {
+		fprintf(stderr, "%s: Failed to realpath '%s': %s (%i)\n",
+		        argv0, optarg, strerror(errno), errno);
+		opts_fail();
+	}
+	opts->contentlog_isdir = 0;
+	opts->contentlog_isspec = 0;
+	opts->contentlog_isseg = 1;
+#ifdef DEBUG_OPTS
+	log_dbg_printf("ContentLogSegmentDir: %s\n", opts->contentlog);
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Store the content of per-connection content logs as deduplicated chunks in
+ * directory optarg, see logcas.c.
+ */
+void
+opts_set_contentlogdedupdir(opts_t *opts, const char *argv0,
+                            const char *optarg)
+{
+	if (!sys_isdir(optarg)) {
+		fprintf(stderr, "%s: '%s' is not a directory\n", argv0, optarg);
+		opts_fail();
+	}
+	if (opts->contentlog_dedupdir)
+		free(opts->contentlog_dedupdir);
+	opts->contentlog_dedupdir = realpath(optarg, NULL);
+	if (!opts->contentlog_dedupdir) {
+		fprintf(stderr, "%s: Failed to realpath '%s': %s (%i)\n",
+		        argv0, optarg, strerror(errno), errno);
+		opts_fail();
+	}
+#ifdef DEBUG_OPTS
+	log_dbg_printf("ContentLogDedupDir: %s\n", opts->contentlog_dedupdir);
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Append a content log rule, see logrule.c.
+ * Calls exit() on failure.
+ */
+void
+opts_set_contentlog_rule(opts_t *opts, const char *argv0, const char *optarg)
+{
+	if (!opts->contentlog_rules &&
+	    !(opts->contentlog_rules = logrule_new()))
+		oom_die(argv0);
+	if (logrule_add(opts->contentlog_rules, optarg) == -1) {
+		if (errno == ENOMEM)
+			oom_die(argv0);
+		fprintf(stderr, "%s: Invalid content log rule '%s' "
+		                "(max %i rules)\n", argv0, optarg, LOGRULE_MAX);
+		opts_fail();
+	}
+#ifdef DEBUG_OPTS
+	log_dbg_printf("ContentLogRule: %s\n", optarg);
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Append a flight recorder trigger, consisting of the criteria of a content
+ * log rule.  Triggers are stored as rules with action none, such that a
+ * connection matching any of them matches LOGRULE_NONE.
+ * Calls exit() on failure.
+ */
+void
+opts_set_contentlog_trigger(opts_t *opts, const char *argv0,
+                            const char *optarg)
+{
+	char *rule;
+
+	if (!opts->contentlog_triggers &&
+	    !(opts->contentlog_triggers = logrule_new()))
+		oom_die(argv0);
+	if (asprintf(&rule, "none %s", optarg) < 0)
+		oom_die(argv0);
+	if (!*optarg || logrule_add(opts->contentlog_triggers, rule) == -1) {
+		free(rule);
+		if (errno == ENOMEM)
+			oom_die(argv0);
+		fprintf(stderr, "%s: Invalid content log trigger '%s' "
+		                "(max %i triggers)\n", argv0, optarg,
+		                LOGRULE_MAX);
+		opts_fail();
+	}
+	free(rule);
+#ifdef DEBUG_OPTS
+	log_dbg_printf("ContentLogTrigger: %s\n", optarg);
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Decode the escapes \\, \r, \n, \t and \xHH in s into buf, which must be
+ * at least as large as s.  Returns the decoded length or -1 on error.
+ */
+static ssize_t
+opts_unescape(unsigned char *buf, const char *s)
+{
+	unsigned char *p = buf;
+	char hex[3] = {0};
+	char *end;
+
+	while (*s) {
+		if (*s != '\\') {
+			*p++ = *s++;
+			continue;
+		}
+		switch (*++s) {
+		case '\\':
+			*p++ = '\\';
+			break;
+		case 'r':
+			*p++ = '\r';
+			break;
+		case 'n':
+			*p++ = '\n';
+			break;
+		case 't':
+			*p++ = '\t';
+			break;
+		case 'x':
+			if (!isxdigit((unsigned char)s[1]) ||
+			    !isxdigit((unsigned char)s[2]))
+				return -1;
+			hex[0] = s[1];
+			hex[1] = s[2];
+			*p++ = strtoul(hex, &end, 16);
+			s += 2;
+			break;
+		default:
+			return -1;
+		}
+		s++;
+	}
+	return p - buf;
+}
+
+/*
+ * Add a flight recorder trigger pattern, which triggers the recorder when
+ * it occurs in the content of any connection.  The patterns are compiled
+ * by main_opts_load() once all options are parsed.
+ * Calls exit() on failure.
+ */
+void
+opts_set_contentlog_match(opts_t *opts, const char *argv0,
+                          const char *optarg)
+{
+	unsigned char *buf;
+	ssize_t sz;
+
+	if (!opts->contentlog_match &&
+	    !(opts->contentlog_match = acmatch_new()))
+		oom_die(argv0);
+	if (!(buf = malloc(strlen(optarg) + 1)))
+		oom_die(argv0);
+	if ((sz = opts_unescape(buf, optarg)) <= 0) {
+		fprintf(stderr, "%s: Invalid content log trigger pattern "
+		                "'%s'\n", argv0, optarg);
+		free(buf);
+		opts_fail();
+	}
+	if (acmatch_add(opts->contentlog_match, buf, sz,
+	                acmatch_patterns(opts->contentlog_match)) == -1) {
+		free(buf);
+		oom_die(argv0);
+	}
+	free(buf);
+#ifdef DEBUG_OPTS
+	log_dbg_printf("ContentLogTriggerMatch: %s\n", optarg);
+#endif /* DEBUG_OPTS */
+}
+
 static void
 opts_set_logbasedir(const char *argv0, const char *optarg,
                     char **basedir, char **log)
 {
 	char *lhs, *rhs, *p, *q;
 	size_t n;
-	if (*basedir)
+	if (*basedir) {
 		free(*basedir);
-	if (*log)
+		*basedir = NULL;
+	}
+	if (*log) {
 		free(*log);
+		*log = NULL;
+	}
 	if (log_content_split_pathspec(optarg, &lhs, &rhs) == -1) {
 		fprintf(stderr, "%s: Failed to split '%s' in lhs/rhs:"
 		                " %s (%i)\n", argv0, optarg,
 		                strerror(errno), errno);
-		exit(EXIT_FAILURE);
+		opts_fail();
 	}
 	/* eliminate %% from lhs */
 	for (p = q = lhs; *p; p++, q++) {
@@ -1129,13 +2661,13 @@ opts_set_logbasedir(const char *argv0, const char *optarg,
 	if (sys_mkpath(lhs, 0777) == -1) {
 		fprintf(stderr, "%s: Failed to create '%s': %s (%i)\n",
 		        argv0, lhs, strerror(errno), errno);
-		exit(EXIT_FAILURE);
+		goto errout;
 	}
 	*basedir = realpath(lhs, NULL);
 	if (!*basedir) {
 		fprintf(stderr, "%s: Failed to realpath '%s': %s (%i)\n",
 		        argv0, lhs, strerror(errno), errno);
-		exit(EXIT_FAILURE);
+		goto errout;
 	}
 	/* count '%' in basedir */
 	for (n = 0, p = *basedir;
@@ -1146,8 +2678,10 @@ opts_set_logbasedir(const char *argv0, const char *optarg,
 	}
 	free(lhs);
 	n += strlen(*basedir);
-	if (!(lhs = malloc(n + 1)))
+	if (!(lhs = malloc(n + 1))) {
+		free(rhs);
 		oom_die(argv0);
+	}
 	/* re-encoding % to %%, copying basedir to lhs */
 	for (p = *basedir, q = lhs;
 		 *p;
@@ -1158,10 +2692,20 @@ opts_set_logbasedir(const char *argv0, const char *optarg,
 	}
 	*q = '\0';
 	/* lhs contains encoded realpathed basedir */
-	if (asprintf(log, "%s/%s", lhs, rhs) < 0)
+	if (asprintf(log, "%s/%s", lhs, rhs) < 0) {
+		*log = NULL;
+		free(lhs);
+		free(rhs);
 		oom_die(argv0);
+	}
+	free(lhs);
+	free(rhs);
+	return;
+
+errout:
 	free(lhs);
 	free(rhs);
+	opts_fail();
 }
 
 void
@@ -1171,6 +2715,7 @@ opts_set_contentlogpathspec(opts_t *opts, const char *argv0, const char *optarg)
 	                    &opts->contentlog);
 	opts->contentlog_isdir = 0;
 	opts->contentlog_isspec = 1;
+	opts->contentlog_isseg = 0;
 #ifdef DEBUG_OPTS
 	log_dbg_printf("ContentLogPathSpec: basedir=%s, %s\n",
 	               opts->contentlog_basedir, opts->contentlog);
@@ -1200,7 +2745,7 @@ opts_set_masterkeylog(opts_t *opts, const char *argv0, const char *optarg)
 		if (errno == ENOENT) {
 			fprintf(stderr, "Directory part of '%s' does not "
 			                "exist\n", optarg);
-			exit(EXIT_FAILURE);
+			opts_fail();
 		} else {
 			fprintf(stderr, "Failed to realpath '%s': %s (%i)\n",
 			              optarg, strerror(errno), errno);
@@ -1221,7 +2766,7 @@ opts_set_pcaplog(opts_t *opts, const char *argv0, const char *optarg)
 		if (errno == ENOENT) {
 			fprintf(stderr, "Directory part of '%s' does not "
 			                "exist\n", optarg);
-			exit(EXIT_FAILURE);
+			opts_fail();
 		} else {
 			fprintf(stderr, "Failed to realpath '%s': %s (%i)\n",
 			              optarg, strerror(errno), errno);
@@ -1235,117 +2780,1327 @@ opts_set_pcaplog(opts_t *opts, const char *argv0, const char *optarg)
 #endif /* DEBUG_OPTS */
 }
 
-void
-opts_set_pcaplogdir(opts_t *opts, const char *argv0, const char *optarg)
+void
+opts_set_pcaplogdir(opts_t *opts, const char *argv0, const char *optarg)
+{
+	if (!sys_isdir(optarg)) {
+		fprintf(stderr, "%s: '%s' is not a directory\n", argv0, optarg);
+		opts_fail();
+	}
+	if (opts->pcaplog)
+		free(opts->pcaplog);
+	opts->pcaplog = realpath(optarg, NULL);
+	if (!opts->pcaplog) {
+		fprintf(stderr, "%s: Failed to realpath '%s': %s (%i)\n",
+		        argv0, optarg, strerror(errno), errno);
+		opts_fail();
+	}
+	opts->pcaplog_isdir = 1;
+	opts->pcaplog_isspec = 0;
+#ifdef DEBUG_OPTS
+	log_dbg_printf("PcapLogDir: %s\n", opts->pcaplog);
+#endif /* DEBUG_OPTS */
+}
+
+void
+opts_set_pcaplogpathspec(opts_t *opts, const char *argv0, const char *optarg)
+{
+	opts_set_logbasedir(argv0, optarg, &opts->pcaplog_basedir,
+	                    &opts->pcaplog);
+	opts->pcaplog_isdir = 0;
+	opts->pcaplog_isspec = 1;
+#ifdef DEBUG_OPTS
+	log_dbg_printf("PcapLogPathSpec: basedir=%s, %s\n",
+	               opts->pcaplog_basedir, opts->pcaplog);
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Set the file format of the pcap log.
+ * Calls exit() on failure.
+ */
+void
+opts_set_pcaplog_format(opts_t *opts, const char *argv0, const char *optarg)
+{
+	if (!strcmp(optarg, "pcapng")) {
+		opts->pcaplog_ng = 1;
+	} else if (!strcmp(optarg, "pcap")) {
+		opts->pcaplog_ng = 0;
+	} else {
+		fprintf(stderr, "%s: Unknown pcap log format '%s', "
+		                "use pcap|pcapng\n", argv0, optarg);
+		opts_fail();
+	}
+#ifdef DEBUG_OPTS
+	log_dbg_printf("PcapLogFormat: %u\n", opts->pcaplog_ng);
+#endif /* DEBUG_OPTS */
+}
+
+#ifndef WITHOUT_MIRROR
+void
+opts_set_mirrorif(opts_t *opts, const char *argv0, const char *optarg)
+{
+	if (opts->mirrorif)
+		free(opts->mirrorif);
+	opts->mirrorif = strdup(optarg);
+	if (!opts->mirrorif)
+		oom_die(argv0);
+#ifdef DEBUG_OPTS
+	log_dbg_printf("MirrorIf: %s\n", opts->mirrorif);
+#endif /* DEBUG_OPTS */
+}
+
+void
+opts_set_mirrortarget(opts_t *opts, const char *argv0, const char *optarg)
+{
+	if (opts->mirrortarget)
+		free(opts->mirrortarget);
+	opts->mirrortarget = strdup(optarg);
+	if (!opts->mirrortarget)
+		oom_die(argv0);
+#ifdef DEBUG_OPTS
+	log_dbg_printf("MirrorTarget: %s\n", opts->mirrortarget);
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Set the interval in seconds between health checks of mirror targets;
+ * 0 disables health checks.
+ * Calls exit() on failure.
+ */
+void
+opts_set_mirror_chk_interval(opts_t *opts, const char *argv0,
+                             const char *optarg)
+{
+	char *end;
+	long n;
+
+	n = strtol(optarg, &end, 10);
+	if (*optarg == '\0' || *end != '\0' || n < 0 || n > 3600) {
+		fprintf(stderr, "%s: Invalid mirror check interval '%s', "
+		                "use 0-3600\n", argv0, optarg);
+		opts_fail();
+	}
+	opts->mirror_chk_interval = n;
+#ifdef DEBUG_OPTS
+	log_dbg_printf("MirrorCheckInterval: %u\n",
+	               opts->mirror_chk_interval);
+#endif /* DEBUG_OPTS */
+}
+#endif /* !WITHOUT_MIRROR */
+
+/*
+ * Set the path of the shared memory content tap ring, see logtap.c.
+ */
+void
+opts_set_contenttap(opts_t *opts, const char *argv0, const char *optarg)
+{
+	if (opts->contenttap)
+		free(opts->contenttap);
+	opts->contenttap = strdup(optarg);
+	if (!opts->contenttap)
+		oom_die(argv0);
+#ifdef DEBUG_OPTS
+	log_dbg_printf("ContentTap: %s\n", opts->contenttap);
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Set the collector of the content stream, see logstream.c.
+ */
+void
+opts_set_contentstream(opts_t *opts, const char *argv0, const char *optarg)
+{
+	if (opts->contentstream)
+		free(opts->contentstream);
+	opts->contentstream = strdup(optarg);
+	if (!opts->contentstream)
+		oom_die(argv0);
+#ifdef DEBUG_OPTS
+	log_dbg_printf("ContentStream: %s\n", opts->contentstream);
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Add an inspection plugin to load at startup, see inspect.c.
+ */
+void
+opts_set_inspect(opts_t *opts, const char *argv0, const char *optarg)
+{
+	if (opts->inspect_count == INSPECT_MAXPLUGINS) {
+		fprintf(stderr, "%s: too many InspectPlugin, maximum is %i\n",
+		                argv0, INSPECT_MAXPLUGINS);
+		opts_fail();
+	}
+	opts->inspect[opts->inspect_count] = strdup(optarg);
+	if (!opts->inspect[opts->inspect_count])
+		oom_die(argv0);
+	opts->inspect_count++;
+#ifdef DEBUG_OPTS
+	log_dbg_printf("InspectPlugin: %s\n", optarg);
+#endif /* DEBUG_OPTS */
+}
+
+void
+opts_set_daemon(opts_t *opts)
+{
+	opts->detach = 1;
+}
+
+void
+opts_unset_daemon(opts_t *opts)
+{
+	opts->detach = 0;
+}
+
+void
+opts_set_debug(opts_t *opts)
+{
+	log_dbg_mode(LOG_DBG_MODE_ERRLOG);
+	opts->debug = 1;
+}
+
+void
+opts_unset_debug(opts_t *opts)
+{
+	log_dbg_mode(LOG_DBG_MODE_NONE);
+	opts->debug = 0;
+}
+
+static void
+opts_set_verify_peer(opts_t *opts)
+{
+	opts->verify_peer = 1;
+}
+
+static void
+opts_unset_verify_peer(opts_t *opts)
+{
+	opts->verify_peer = 0;
+}
+
+static void
+opts_set_allow_wrong_host(opts_t *opts)
+{
+	opts->allow_wrong_host = 1;
+}
+
+static void
+opts_unset_allow_wrong_host(opts_t *opts)
+{
+	opts->allow_wrong_host = 0;
+}
+
+/*
+ * Parse the connection handling thread selection policy in optarg.
+ * Calls exit() on failure.
+ */
+void
+opts_set_thrsel(opts_t *opts, const char *argv0, const char *optarg)
+{
+	if (!strcmp(optarg, "p2c")) {
+		opts->thrsel = THRSEL_P2C;
+	} else if (!strcmp(optarg, "leastloaded")) {
+		opts->thrsel = THRSEL_LEASTLOADED;
+	} else if (!strcmp(optarg, "roundrobin")) {
+		opts->thrsel = THRSEL_ROUNDROBIN;
+	} else if (!strcmp(optarg, "clienthash")) {
+		opts->thrsel = THRSEL_CLIENTHASH;
+	} else if (!strcmp(optarg, "snihash")) {
+		opts->thrsel = THRSEL_SNIHASH;
+	} else {
+		fprintf(stderr, "%s: Unknown thread selection policy '%s', "
+		                "use p2c|leastloaded|roundrobin|clienthash|"
+		                "snihash\n",
+		                argv0, optarg);
+		opts_fail();
+	}
+#ifdef DEBUG_OPTS
+	log_dbg_printf("ThreadSelection: %s\n", opts_thrsel_str(opts->thrsel));
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Set the interval in seconds at which established connections are moved
+ * from threads forwarding more than their share of octets; 0 disables.
+ * Calls exit() on failure.
+ */
+void
+opts_set_rebalance_interval(opts_t *opts, const char *argv0,
+                            const char *optarg)
+{
+	char *end;
+	long n;
+
+	n = strtol(optarg, &end, 10);
+	if (*optarg == '\0' || *end != '\0' || n < 0 || n > 3600) {
+		fprintf(stderr, "%s: Invalid rebalance interval '%s', "
+		                "use 0-3600\n", argv0, optarg);
+		opts_fail();
+	}
+	opts->rebalance_interval = n;
+#ifdef DEBUG_OPTS
+	log_dbg_printf("RebalanceInterval: %u\n", opts->rebalance_interval);
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Return the name of a connection handling thread selection policy.
+ */
+const char *
+opts_thrsel_str(int thrsel)
+{
+	switch (thrsel) {
+	case THRSEL_P2C:
+		return "p2c";
+	case THRSEL_LEASTLOADED:
+		return "leastloaded";
+	case THRSEL_ROUNDROBIN:
+		return "roundrobin";
+	case THRSEL_CLIENTHASH:
+		return "clienthash";
+	case THRSEL_SNIHASH:
+		return "snihash";
+	default:
+		return "unknown";
+	}
+}
+
+/*
+ * Set the number of connection handling threads.
+ * Calls exit() on failure.
+ */
+void
+opts_set_worker_threads(opts_t *opts, const char *argv0, const char *optarg)
+{
+	char *end;
+	long n;
+
+	n = strtol(optarg, &end, 10);
+	if (*optarg == '\0' || *end != '\0' || n < 1 || n > 1024) {
+		fprintf(stderr, "%s: Invalid number of worker threads '%s', "
+		                "use 1-1024\n", argv0, optarg);
+		opts_fail();
+	}
+	opts->worker_threads = n;
+#ifdef DEBUG_OPTS
+	log_dbg_printf("WorkerThreads: %d\n", opts->worker_threads);
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Set the number of worker processes sharing the listeners and caches.
+ * Calls exit() on failure.
+ */
+void
+opts_set_worker_procs(opts_t *opts, const char *argv0, const char *optarg)
+{
+	char *end;
+	long n;
+
+	n = strtol(optarg, &end, 10);
+	if (*optarg == '\0' || *end != '\0' || n < 1 || n > 64) {
+		fprintf(stderr, "%s: Invalid number of worker processes '%s', "
+		                "use 1-64\n", argv0, optarg);
+		opts_fail();
+	}
+	opts->worker_procs = n;
+#ifdef DEBUG_OPTS
+	log_dbg_printf("WorkerProcesses: %d\n", opts->worker_procs);
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Set the comma-separated list of memcached servers of the remote tier of
+ * the forged certificate and session caches.  The addresses are resolved
+ * when setting up the caches.  Calls exit() on failure.
+ */
+void
+opts_set_rcache_servers(opts_t *opts, const char *argv0, const char *optarg)
+{
+	if (opts->rcache_servers)
+		free(opts->rcache_servers);
+	opts->rcache_servers = strdup(optarg);
+	if (!opts->rcache_servers)
+		oom_die(argv0);
+#ifdef DEBUG_OPTS
+	log_dbg_printf("RemoteCache: %s\n", opts->rcache_servers);
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Set the timeout in milliseconds for network operations on the remote
+ * cache servers.  Calls exit() on failure.
+ */
+void
+opts_set_rcache_timeout(opts_t *opts, const char *argv0, const char *optarg)
+{
+	char *end;
+	long n;
+
+	n = strtol(optarg, &end, 10);
+	if (*optarg == '\0' || *end != '\0' || n < 1 || n > 10000) {
+		fprintf(stderr, "%s: Invalid remote cache timeout '%s', "
+		                "use 1-10000\n", argv0, optarg);
+		opts_fail();
+	}
+	opts->rcache_timeout = n;
+#ifdef DEBUG_OPTS
+	log_dbg_printf("RemoteCacheTimeout: %u\n", opts->rcache_timeout);
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Set the number of writer threads for per-connection content logs.
+ * Calls exit() on failure.
+ */
+void
+opts_set_content_log_threads(opts_t *opts, const char *argv0,
+                             const char *optarg)
+{
+	char *end;
+	long n;
+
+	n = strtol(optarg, &end, 10);
+	if (*optarg == '\0' || *end != '\0' || n < 1 ||
+	    n > MAX_CONTENT_LOG_THREADS) {
+		fprintf(stderr, "%s: Invalid number of content log threads "
+		                "'%s', use 1-%i\n", argv0, optarg,
+		                MAX_CONTENT_LOG_THREADS);
+		opts_fail();
+	}
+	opts->content_log_threads = n;
+#ifdef DEBUG_OPTS
+	log_dbg_printf("ContentLogThreads: %u\n", opts->content_log_threads);
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Set whether the caches and connection context pools are backed by huge
+ * pages, see mempool_huge_enable().
+ * Calls exit() on failure.
+ */
+void
+opts_set_huge_pages(opts_t *opts, const char *argv0, const char *optarg)
+{
+	if (!strcmp(optarg, "none")) {
+		opts->huge_pages = MEMPOOL_HUGE_NONE;
+	} else if (!strcmp(optarg, "thp")) {
+		opts->huge_pages = MEMPOOL_HUGE_THP;
+	} else if (!strcmp(optarg, "explicit")) {
+		opts->huge_pages = MEMPOOL_HUGE_EXPLICIT;
+	} else {
+		fprintf(stderr, "%s: Unknown huge pages mode '%s', "
+		                "use none|thp|explicit\n", argv0, optarg);
+		opts_fail();
+	}
+#ifdef DEBUG_OPTS
+	log_dbg_printf("HugePages: %u\n", opts->huge_pages);
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Set the compression of the content, pcap and connect logs.
+ * Calls exit() on failure.
+ */
+void
+opts_set_log_compress(opts_t *opts, const char *argv0, const char *optarg)
+{
+	if (!strcmp(optarg, "gzip")) {
+		opts->log_compress = 1;
+	} else if (!strcmp(optarg, "none")) {
+		opts->log_compress = 0;
+	} else {
+		fprintf(stderr, "%s: Unknown log compression '%s', "
+		                "use none|gzip\n", argv0, optarg);
+		opts_fail();
+	}
+#ifdef DEBUG_OPTS
+	log_dbg_printf("LogCompression: %u\n", opts->log_compress);
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Set the maximum time in milliseconds data stays buffered in the compressor
+ * of a compressed log.
+ * Calls exit() on failure.
+ */
+void
+opts_set_log_flush_interval(opts_t *opts, const char *argv0,
+                            const char *optarg)
+{
+	char *end;
+	long n;
+
+	n = strtol(optarg, &end, 10);
+	if (*optarg == '\0' || *end != '\0' || n < 0 || n > 3600000) {
+		fprintf(stderr, "%s: Invalid log flush interval '%s', "
+		                "use 0-3600000\n", argv0, optarg);
+		opts_fail();
+	}
+	opts->log_flush_interval = n;
+#ifdef DEBUG_OPTS
+	log_dbg_printf("LogFlushInterval: %u\n", opts->log_flush_interval);
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Set when the single-file content and pcap logs and the segment store are
+ * synced to disk: never, when closing or rotating a file, or additionally
+ * after every given amount of data.
+ * Calls exit() on failure.
+ */
+void
+opts_set_log_fsync(opts_t *opts, const char *argv0, const char *optarg)
+{
+	if (!strcmp(optarg, "none")) {
+		opts->log_fsync_close = 0;
+		opts->log_fsyncsz = 0;
+	} else if (!strcmp(optarg, "rotate")) {
+		opts->log_fsync_close = 1;
+		opts->log_fsyncsz = 0;
+	} else {
+		opts->log_fsyncsz = opts_parse_size(argv0, "LogFsync", optarg);
+		opts->log_fsync_close = !!opts->log_fsyncsz;
+	}
+#ifdef DEBUG_OPTS
+	log_dbg_printf("LogFsync: %u %zu\n", opts->log_fsync_close,
+	               opts->log_fsyncsz);
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Set the number of certificate forging threads; 0 forges synchronously on
+ * the connection handling threads.
+ * Calls exit() on failure.
+ */
+void
+opts_set_forge_threads(opts_t *opts, const char *argv0, const char *optarg)
+{
+	char *end;
+	long n;
+
+	n = strtol(optarg, &end, 10);
+	if (*optarg == '\0' || *end != '\0' || n < 0 || n > 1024) {
+		fprintf(stderr, "%s: Invalid number of forge threads '%s', "
+		                "use 0-1024\n", argv0, optarg);
+		opts_fail();
+	}
+	opts->forge_threads = n;
+#ifdef DEBUG_OPTS
+	log_dbg_printf("ForgeThreads: %d\n", opts->forge_threads);
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Set the number of established upstream connections to keep per thread and
+ * static proxyspec; 0 disables pre-connecting.
+ * Calls exit() on failure.
+ */
+void
+opts_set_preconnect(opts_t *opts, const char *argv0, const char *optarg)
+{
+	char *end;
+	long n;
+
+	n = strtol(optarg, &end, 10);
+	if (*optarg == '\0' || *end != '\0' || n < 0 || n > 1024) {
+		fprintf(stderr, "%s: Invalid pre-connect pool size '%s', "
+		                "use 0-1024\n", argv0, optarg);
+		opts_fail();
+	}
+	opts->preconnect = n;
+#ifdef DEBUG_OPTS
+	log_dbg_printf("PreconnectPool: %u\n", opts->preconnect);
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Set the number of idle persistent upstream connections of plain HTTP
+ * connections to keep per thread and destination; 0 disables pooling.
+ * Calls exit() on failure.
+ */
+void
+opts_set_http_upstream_pool(opts_t *opts, const char *argv0,
+                            const char *optarg)
+{
+	char *end;
+	long n;
+
+	n = strtol(optarg, &end, 10);
+	if (*optarg == '\0' || *end != '\0' || n < 0 ||
+	    n > PXY_HTTPPOOL_MAX) {
+		fprintf(stderr, "%s: Invalid HTTP upstream pool size '%s', "
+		                "use 0-%i\n", argv0, optarg,
+		                PXY_HTTPPOOL_MAX);
+		opts_fail();
+	}
+	opts->http_upstream_pool = n;
+#ifdef DEBUG_OPTS
+	log_dbg_printf("HTTPUpstreamPool: %u\n", opts->http_upstream_pool);
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Set the event loop lag in milliseconds above which new SSL connections are
+ * passed through instead of split; 0 disables overload passthrough.
+ * Calls exit() on failure.
+ */
+void
+opts_set_overload_lag(opts_t *opts, const char *argv0, const char *optarg)
+{
+	char *end;
+	long n;
+
+	n = strtol(optarg, &end, 10);
+	if (*optarg == '\0' || *end != '\0' || n < 0 || n > 60000) {
+		fprintf(stderr, "%s: Invalid overload lag '%s', "
+		                "use 0-60000\n", argv0, optarg);
+		opts_fail();
+	}
+	opts->overload_lag = n;
+#ifdef DEBUG_OPTS
+	log_dbg_printf("OverloadPassthrough: %u\n", opts->overload_lag);
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Set the time for which destinations that failed interception are passed
+ * through without another attempt.
+ * Calls exit() on failure.
+ */
+void
+opts_set_pass_ttl(opts_t *opts, const char *argv0, const char *optarg)
+{
+	char *end;
+	long n;
+
+	n = strtol(optarg, &end, 10);
+	if (*optarg == '\0' || *end != '\0' || n < 0 || n > 86400) {
+		fprintf(stderr, "%s: Invalid passthrough cache TTL '%s', "
+		                "use 0-86400\n", argv0, optarg);
+		opts_fail();
+	}
+	opts->pass_ttl = n;
+#ifdef DEBUG_OPTS
+	log_dbg_printf("PassthroughCacheTTL: %u\n", opts->pass_ttl);
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Add SSL/TLS bypass list entries, or if file is set, the entries from the
+ * file at optarg.  The list is compiled by main_opts_load() once all options
+ * are parsed.
+ * Calls exit() on failure.
+ */
+void
+opts_set_bypass(opts_t *opts, const char *argv0, const char *optarg,
+                int file)
+{
+	int rv;
+
+	if (!opts->bypass && !(opts->bypass = bypass_new()))
+		oom_die(argv0);
+	rv = file ? bypass_load(opts->bypass, optarg)
+	          : bypass_add(opts->bypass, optarg);
+	if (rv == -1) {
+		if (errno == ENOMEM)
+			oom_die(argv0);
+		if (file && errno != EINVAL) {
+			fprintf(stderr, "%s: Failed to read bypass list "
+			                "'%s': %s\n", argv0, optarg,
+			                strerror(errno));
+		} else {
+			fprintf(stderr, "%s: Invalid bypass list entry in "
+			                "'%s'\n", argv0, optarg);
+		}
+		opts_fail();
+	}
+#ifdef DEBUG_OPTS
+	log_dbg_printf("%s: %s\n", file ? "BypassFile" : "Bypass", optarg);
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Set the maximum number of connections accepted on a main event loop
+ * listener that are handed over to a connection handling thread as a batch;
+ * 0 or 1 disables batching.
+ * Calls exit() on failure.
+ */
+void
+opts_set_accept_batch(opts_t *opts, const char *argv0, const char *optarg)
+{
+	char *end;
+	long n;
+
+	n = strtol(optarg, &end, 10);
+	if (*optarg == '\0' || *end != '\0' || n < 0 || n > 1024) {
+		fprintf(stderr, "%s: Invalid accept batch size '%s', "
+		                "use 0-1024\n", argv0, optarg);
+		opts_fail();
+	}
+	opts->accept_batch = n;
+#ifdef DEBUG_OPTS
+	log_dbg_printf("AcceptBatch: %u\n", opts->accept_batch);
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Set the connection timeout kind, one of OPTS_TIMEOUT_*, in seconds;
+ * 0 disables the timeout.
+ * Calls exit() on failure.
+ */
+void
+opts_set_timeout(opts_t *opts, const char *argv0, int kind,
+                 const char *optarg)
+{
+	int n;
+
+	n = opts_parse_timeout(optarg, strlen(optarg));
+	if (n == -1) {
+		fprintf(stderr, "%s: Invalid %s timeout '%s', use 0-%d "
+		                "seconds\n", argv0, opts_timeout_names[kind],
+		                optarg, MAX_TIMEOUT);
+		opts_fail();
+	}
+	opts->timeout[kind] = n;
+#ifdef DEBUG_OPTS
+	log_dbg_printf("Timeout %s: %u\n", opts_timeout_names[kind],
+	               opts->timeout[kind]);
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Set the global admission limit kind, one of OPTS_ADMIT_*; 0 means no
+ * limit.
+ * Calls exit() on failure.
+ */
+void
+opts_set_admit_limit(opts_t *opts, const char *argv0, int kind,
+                     const char *optarg)
+{
+	static const char *names[] = {
+		"MaxConnections", "MaxHandshakeRate",
+		"MaxSourceConnections", "MaxSourceHandshakeRate"
+	};
+	unsigned int *limits[] = {
+		&opts->admit_global.conns, &opts->admit_global.rate,
+		&opts->admit_source.conns, &opts->admit_source.rate
+	};
+	long n;
+
+	n = opts_parse_limit(optarg, strlen(optarg));
+	if (n == -1) {
+		fprintf(stderr, "%s: Invalid %s '%s'\n", argv0, names[kind],
+		                optarg);
+		opts_fail();
+	}
+	*limits[kind] = n;
+#ifdef DEBUG_OPTS
+	log_dbg_printf("%s: %u\n", names[kind], *limits[kind]);
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Set the maximum number of renegotiations per connection and side; 0 means
+ * no limit.
+ * Calls exit() on failure.
+ */
+void
+opts_set_max_reneg(opts_t *opts, const char *argv0, const char *optarg)
+{
+	long n;
+
+	n = opts_parse_limit(optarg, strlen(optarg));
+	if (n == -1) {
+		fprintf(stderr, "%s: Invalid MaxRenegotiations '%s'\n",
+		                argv0, optarg);
+		opts_fail();
+	}
+	opts->max_reneg = n;
+#ifdef DEBUG_OPTS
+	log_dbg_printf("MaxRenegotiations: %u\n", opts->max_reneg);
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Parse the action on connections over a renegotiation limit in optarg.
+ * Calls exit() on failure.
+ */
+void
+opts_set_reneg_action(opts_t *opts, const char *argv0, const char *optarg)
+{
+	if (!strcmp(optarg, "refuse")) {
+		opts->reneg_action = OPTS_RENEG_REFUSE;
+	} else if (!strcmp(optarg, "close")) {
+		opts->reneg_action = OPTS_RENEG_CLOSE;
+	} else if (!strcmp(optarg, "log")) {
+		opts->reneg_action = OPTS_RENEG_LOG;
+	} else {
+		fprintf(stderr, "%s: Unknown renegotiation action '%s', "
+		                "use refuse|close|log\n", argv0, optarg);
+		opts_fail();
+	}
+#ifdef DEBUG_OPTS
+	log_dbg_printf("RenegotiationAction: %s\n",
+	               opts_reneg_action_str(opts->reneg_action));
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Return the name of an action on renegotiation limits.
+ */
+const char *
+opts_reneg_action_str(int action)
+{
+	switch (action) {
+	case OPTS_RENEG_REFUSE:
+		return "refuse";
+	case OPTS_RENEG_CLOSE:
+		return "close";
+	case OPTS_RENEG_LOG:
+		return "log";
+	default:
+		return "unknown";
+	}
+}
+
+/*
+ * Return the name of a connection timeout kind.
+ */
+const char *
+opts_timeout_str(int kind)
+{
+	return opts_timeout_names[kind];
+}
+
+/*
+ * Set the number of frequently used certificates to track for pre-forging;
+ * 0 disables pre-forging.
+ * Calls exit() on failure.
+ */
+void
+opts_set_preforge_hosts(opts_t *opts, const char *argv0, const char *optarg)
+{
+	char *end;
+	long n;
+
+	n = strtol(optarg, &end, 10);
+	if (*optarg == '\0' || *end != '\0' || n < 0 || n > 65536) {
+		fprintf(stderr, "%s: Invalid number of pre-forge hosts '%s', "
+		                "use 0-65536\n", argv0, optarg);
+		opts_fail();
+	}
+	opts->preforge_hosts = n;
+#ifdef DEBUG_OPTS
+	log_dbg_printf("PreforgeHosts: %u\n", opts->preforge_hosts);
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Set the type of leaf keys generated at startup and for the leaf key pool.
+ * Calls exit() on failure.
+ */
+void
+opts_set_leafkey_type(opts_t *opts, const char *argv0, const char *optarg)
+{
+	if (!strcmp(optarg, "rsa")) {
+		opts->leafkey_ec = 0;
+#ifndef OPENSSL_NO_EC
+	} else if (!strcmp(optarg, "ec")) {
+		opts->leafkey_ec = 1;
+#endif /* !OPENSSL_NO_EC */
+	} else {
+		fprintf(stderr, "%s: Unknown leaf key type '%s', "
+		                "use rsa|ec\n", argv0, optarg);
+		opts_fail();
+	}
+#ifdef DEBUG_OPTS
+	log_dbg_printf("LeafKeyType: %s\n", opts->leafkey_ec ? "ec" : "rsa");
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Set the number of pre-generated leaf keys to keep ready, such that every
+ * forged certificate gets a key of its own; 0 shares a single leaf key.
+ * Calls exit() on failure.
+ */
+void
+opts_set_leafkey_pool(opts_t *opts, const char *argv0, const char *optarg)
+{
+	char *end;
+	long n;
+
+	n = strtol(optarg, &end, 10);
+	if (*optarg == '\0' || *end != '\0' || n < 0 || n > 65536) {
+		fprintf(stderr, "%s: Invalid leaf key pool size '%s', "
+		                "use 0-65536\n", argv0, optarg);
+		opts_fail();
+	}
+	opts->leafkey_pool = n;
+#ifdef DEBUG_OPTS
+	log_dbg_printf("LeafKeyPool: %u\n", opts->leafkey_pool);
+#endif /* DEBUG_OPTS */
+}
+
+void
+opts_set_ticketkeyfile(opts_t *opts, const char *argv0, const char *optarg)
+{
+	if (opts->ticketkeyfile)
+		free(opts->ticketkeyfile);
+	opts->ticketkeyfile = realpath(optarg, NULL);
+	if (!opts->ticketkeyfile) {
+		fprintf(stderr, "%s: Failed to realpath '%s': %s (%i)\n",
+		        argv0, optarg, strerror(errno), errno);
+		opts_fail();
+	}
+#ifdef DEBUG_OPTS
+	log_dbg_printf("SessionTicketKeyFile: %s\n", opts->ticketkeyfile);
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Parse a log overflow policy in optarg, optionally prefixed by the name of
+ * the log it applies to, as in content:spill.  Without prefix, the policy
+ * applies to all logs.
+ * Calls exit() on failure.
+ */
+void
+opts_set_log_overflow(opts_t *opts, const char *argv0, const char *optarg)
+{
+	static const char *names[OPTS_LOG_MAX] = {
+		"content", "pcap", "mirror", "connect", "masterkey", "cert",
+		"tap", "stream"
+	};
+	const char *policy;
+	size_t len;
+	int log, i, v;
+
+	policy = strchr(optarg, ':');
+	if (policy) {
+		len = policy - optarg;
+		policy++;
+		for (log = 0; log < OPTS_LOG_MAX; log++) {
+			if (strlen(names[log]) == len &&
+			    !strncmp(optarg, names[log], len))
+				break;
+		}
+		if (log == OPTS_LOG_MAX) {
+			fprintf(stderr, "%s: Unknown log '%.*s', use "
+			                "content|pcap|mirror|connect|"
+			                "masterkey|cert|tap|stream\n",
+			                argv0, (int)len, optarg);
+			opts_fail();
+		}
+	} else {
+		policy = optarg;
+		log = -1;
+	}
+
+	if (!strcmp(policy, "block")) {
+		v = LOGGER_OVERFLOW_BLOCK;
+	} else if (!strcmp(policy, "dropnewest")) {
+		v = LOGGER_OVERFLOW_DROPNEWEST;
+	} else if (!strcmp(policy, "dropoldest")) {
+		v = LOGGER_OVERFLOW_DROPOLDEST;
+	} else if (!strcmp(policy, "spill")) {
+		v = LOGGER_OVERFLOW_SPILL;
+	} else {
+		fprintf(stderr, "%s: Unknown log overflow policy '%s', "
+		                "use block|dropnewest|dropoldest|spill\n",
+		                argv0, policy);
+		opts_fail();
+	}
+
+	for (i = 0; i < OPTS_LOG_MAX; i++) {
+		if (log == -1 || log == i)
+			opts->log_overflow[i] = v;
+	}
+#ifdef DEBUG_OPTS
+	log_dbg_printf("LogOverflow: %s: %s\n",
+	               log == -1 ? "all" : names[log],
+	               opts_log_overflow_str(v));
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Return the name of a log overflow policy.
+ */
+const char *
+opts_log_overflow_str(int policy)
+{
+	switch (policy) {
+	case LOGGER_OVERFLOW_BLOCK:
+		return "block";
+	case LOGGER_OVERFLOW_DROPNEWEST:
+		return "dropnewest";
+	case LOGGER_OVERFLOW_DROPOLDEST:
+		return "dropoldest";
+	case LOGGER_OVERFLOW_SPILL:
+		return "spill";
+	default:
+		return "unknown";
+	}
+}
+
+/*
+ * Set the directory for log overflow files.
+ * Calls exit() on failure.
+ */
+void
+opts_set_log_spilldir(opts_t *opts, const char *argv0, const char *optarg)
+{
+	if (!sys_isdir(optarg)) {
+		fprintf(stderr, "%s: '%s' is not a directory\n",
+		        argv0, optarg);
+		opts_fail();
+	}
+	if (opts->log_spilldir)
+		free(opts->log_spilldir);
+	opts->log_spilldir = realpath(optarg, NULL);
+	if (!opts->log_spilldir) {
+		fprintf(stderr, "%s: Failed to realpath '%s': %s (%i)\n",
+		        argv0, optarg, strerror(errno), errno);
+		opts_fail();
+	}
+#ifdef DEBUG_OPTS
+	log_dbg_printf("LogSpillDir: %s\n", opts->log_spilldir);
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Set the session ticket key rotation interval in seconds; 0 disables
+ * rotation.
+ * Calls exit() on failure.
+ */
+void
+opts_set_ticket_rotate(opts_t *opts, const char *argv0, const char *optarg)
+{
+	char *end;
+	long n;
+
+	n = strtol(optarg, &end, 10);
+	if (*optarg == '\0' || *end != '\0' || n < 0 || n > 31536000) {
+		fprintf(stderr, "%s: Invalid session ticket key rotation "
+		                "interval '%s', use 0-31536000\n",
+		                argv0, optarg);
+		opts_fail();
+	}
+	opts->ticket_rotate = n;
+#ifdef DEBUG_OPTS
+	log_dbg_printf("SessionTicketKeyRotate: %u\n", opts->ticket_rotate);
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Parse a list of CPUs in optarg, such as "0-3,8,10-11", into a newly
+ * allocated array of CPUs stored in *cpus.
+ * Returns the number of CPUs, or -1 with *cpus set to NULL on invalid lists.
+ */
+static int
+opts_parse_cpus(const char *argv0, const char *optarg, int **cpus)
+{
+	const char *p = optarg;
+	char *end;
+	long lo, hi;
+	int *tmp;
+	int n = 0;
+
+	*cpus = NULL;
+	for (;;) {
+		lo = strtol(p, &end, 10);
+		if (end == p || lo < 0 || lo > 65535)
+			goto errout;
+		hi = lo;
+		if (*end == '-') {
+			p = end + 1;
+			hi = strtol(p, &end, 10);
+			if (end == p || hi < lo || hi > 65535)
+				goto errout;
+		}
+		if (hi - lo + 1 > 65536 - n)
+			goto errout;
+		tmp = realloc(*cpus, (n + hi - lo + 1) * sizeof(int));
+		if (!tmp) {
+			free(*cpus);
+			oom_die(argv0);
+		}
+		*cpus = tmp;
+		for (long cpu = lo; cpu <= hi; cpu++) {
+			(*cpus)[n++] = cpu;
+		}
+		if (*end == '\0')
+			break;
+		if (*end != ',')
+			goto errout;
+		p = end + 1;
+	}
+	return n;
+
+errout:
+	fprintf(stderr, "%s: Invalid CPU list '%s', use e.g. 0-3,8,10-11\n",
+	                argv0, optarg);
+	free(*cpus);
+	*cpus = NULL;
+	return -1;
+}
+
+/*
+ * Parse a list of CPUs in optarg, such as "0-3,8,10-11", into the list of
+ * CPUs to pin connection handling threads to.
+ * Calls exit() on failure.
+ */
+void
+opts_set_worker_cpus(opts_t *opts, const char *argv0, const char *optarg)
+{
+	int *cpus;
+	int n;
+
+	n = opts_parse_cpus(argv0, optarg, &cpus);
+	if (n == -1)
+		opts_fail();
+	if (opts->worker_cpus)
+		free(opts->worker_cpus);
+	opts->worker_cpus = cpus;
+	opts->worker_cpus_count = n;
+#ifdef DEBUG_OPTS
+	log_dbg_printf("WorkerCPUs: %s (%d CPUs)\n", optarg, n);
+#endif /* DEBUG_OPTS */
+}
+
+/*
+ * Define a named worker pool from optarg of the form "name threads [cpus]",
+ * for dedicating connection handling threads to the proxyspecs referring to
+ * it, optionally pinned to a list of CPUs in the same format as WorkerCPUs.
+ * Calls exit() on failure.
+ */
+void
+opts_set_workerpool(opts_t *opts, const char *argv0, const char *optarg)
+{
+	opts_workerpool_t *wp;
+	char *arg, *name, *threads, *cpus, *end, *last = NULL;
+	long n;
+
+	if (!(arg = strdup(optarg)))
+		oom_die(argv0);
+	name = strtok_r(arg, " \t", &last);
+	threads = name ? strtok_r(NULL, " \t", &last) : NULL;
+	cpus = threads ? strtok_r(NULL, " \t", &last) : NULL;
+	if (!threads || (cpus && strtok_r(NULL, " \t", &last))) {
+		fprintf(stderr, "%s: Invalid worker pool '%s', use "
+		                "name threads [cpus]\n", argv0, optarg);
+		goto errout;
+	}
+	for (int i = 0; i < opts->workerpool_count; i++) {
+		if (!strcmp(opts->workerpool[i].name, name)) {
+			fprintf(stderr, "%s: Duplicate worker pool '%s'\n",
+			                argv0, name);
+			goto errout;
+		}
+	}
+	if (opts->workerpool_count == OPTS_WORKERPOOL_MAX) {
+		fprintf(stderr, "%s: Too many worker pools (max %i)\n",
+		                argv0, OPTS_WORKERPOOL_MAX);
+		goto errout;
+	}
+	n = strtol(threads, &end, 10);
+	if (*end != '\0' || n < 1 || n > 1024) {
+		fprintf(stderr, "%s: Invalid number of worker pool threads "
+		                "'%s', use 1-1024\n", argv0, threads);
+		goto errout;
+	}
+	wp = &opts->workerpool[opts->workerpool_count];
+	wp->threads = n;
+	wp->cpus = NULL;
+	wp->cpus_count = 0;
+	if (cpus) {
+		wp->cpus_count = opts_parse_cpus(argv0, cpus, &wp->cpus);
+		if (wp->cpus_count == -1)
+			goto errout;
+	}
+	if (!(wp->name = strdup(name))) {
+		free(wp->cpus);
+		wp->cpus = NULL;
+		free(arg);
+		oom_die(argv0);
+	}
+	opts->workerpool_count++;
+	free(arg);
+#ifdef DEBUG_OPTS
+	log_dbg_printf("WorkerPool: %s\n", optarg);
+#endif /* DEBUG_OPTS */
+	return;
+
+errout:
+	free(arg);
+	opts_fail();
+}
+
+/*
+ * Parse a size in optarg, optionally followed by a k, M or G suffix for
+ * multiples of 1024.  Name is the option name for error messages.
+ * Calls exit() on failure.
+ */
+size_t
+opts_parse_size(const char *argv0, const char *name, const char *optarg)
+{
+	unsigned long long n;
+	char *end;
+
+	errno = 0;
+	n = strtoull(optarg, &end, 10);
+	if (end == optarg || errno || *optarg == '-')
+		goto errout;
+	switch (*end) {
+	case 'G':
+		if (n > SIZE_MAX / 1024)
+			goto errout;
+		n *= 1024;
+		/* fall through */
+	case 'M':
+		if (n > SIZE_MAX / 1024)
+			goto errout;
+		n *= 1024;
+		/* fall through */
+	case 'k':
+		if (n > SIZE_MAX / 1024)
+			goto errout;
+		n *= 1024;
+		end++;
+		break;
+	default:
+		break;
+	}
+	if (*end != '\0' || n > SIZE_MAX)
+		goto errout;
+#ifdef DEBUG_OPTS
+	log_dbg_printf("%s: %llu\n", name, n);
+#endif /* DEBUG_OPTS */
+	return n;
+
+errout:
+	fprintf(stderr, "%s: Invalid %s value '%s'\n", argv0, name, optarg);
+	opts_fail();
+}
+
+static void
+opts_set_reuseport(opts_t *opts)
+{
+	opts->reuseport = 1;
+}
+
+static void
+opts_unset_reuseport(opts_t *opts)
+{
+	opts->reuseport = 0;
+}
+
+static void
+opts_set_tcp_fastopen(opts_t *opts)
+{
+	opts->tcp_fastopen = 1;
+}
+
+static void
+opts_unset_tcp_fastopen(opts_t *opts)
+{
+	opts->tcp_fastopen = 0;
+}
+
+static void
+opts_set_tcp_deferaccept(opts_t *opts)
+{
+	opts->tcp_deferaccept = 1;
+}
+
+static void
+opts_unset_tcp_deferaccept(opts_t *opts)
+{
+	opts->tcp_deferaccept = 0;
+}
+
+static void
+opts_set_sslticket(opts_t *opts)
 {
-	if (!sys_isdir(optarg)) {
-		fprintf(stderr, "%s: '%s' is not a directory\n", argv0, optarg);
-		exit(EXIT_FAILURE);
-	}
-	if (opts->pcaplog)
-		free(opts->pcaplog);
-	opts->pcaplog = realpath(optarg, NULL);
-	if (!opts->pcaplog) {
-		fprintf(stderr, "%s: Failed to realpath '%s': %s (%i)\n",
-		        argv0, optarg, strerror(errno), errno);
-		exit(EXIT_FAILURE);
-	}
-	opts->pcaplog_isdir = 1;
-	opts->pcaplog_isspec = 0;
-#ifdef DEBUG_OPTS
-	log_dbg_printf("PcapLogDir: %s\n", opts->pcaplog);
-#endif /* DEBUG_OPTS */
+	opts->sslticket = 1;
 }
 
-void
-opts_set_pcaplogpathspec(opts_t *opts, const char *argv0, const char *optarg)
+static void
+opts_unset_sslticket(opts_t *opts)
 {
-	opts_set_logbasedir(argv0, optarg, &opts->pcaplog_basedir,
-	                    &opts->pcaplog);
-	opts->pcaplog_isdir = 0;
-	opts->pcaplog_isspec = 1;
-#ifdef DEBUG_OPTS
-	log_dbg_printf("PcapLogPathSpec: basedir=%s, %s\n",
-	               opts->pcaplog_basedir, opts->pcaplog);
-#endif /* DEBUG_OPTS */
+	opts->sslticket = 0;
 }
 
-#ifndef WITHOUT_MIRROR
-void
-opts_set_mirrorif(opts_t *opts, const char *argv0, const char *optarg)
+static void
+opts_set_connectlog_timings(opts_t *opts)
 {
-	if (opts->mirrorif)
-		free(opts->mirrorif);
-	opts->mirrorif = strdup(optarg);
-	if (!opts->mirrorif)
-		oom_die(argv0);
-#ifdef DEBUG_OPTS
-	log_dbg_printf("MirrorIf: %s\n", opts->mirrorif);
-#endif /* DEBUG_OPTS */
+	opts->connectlog_timings = 1;
 }
 
-void
-opts_set_mirrortarget(opts_t *opts, const char *argv0, const char *optarg)
+static void
+opts_unset_connectlog_timings(opts_t *opts)
 {
-	if (opts->mirrortarget)
-		free(opts->mirrortarget);
-	opts->mirrortarget = strdup(optarg);
-	if (!opts->mirrortarget)
-		oom_die(argv0);
-#ifdef DEBUG_OPTS
-	log_dbg_printf("MirrorTarget: %s\n", opts->mirrortarget);
-#endif /* DEBUG_OPTS */
+	opts->connectlog_timings = 0;
 }
-#endif /* !WITHOUT_MIRROR */
 
-void
-opts_set_daemon(opts_t *opts)
+static void
+opts_set_connectlog_tcpinfo(opts_t *opts)
 {
-	opts->detach = 1;
+	opts->connectlog_tcpinfo = 1;
 }
 
-void
-opts_unset_daemon(opts_t *opts)
+static void
+opts_unset_connectlog_tcpinfo(opts_t *opts)
 {
-	opts->detach = 0;
+	opts->connectlog_tcpinfo = 0;
 }
 
-void
-opts_set_debug(opts_t *opts)
+static void
+opts_set_pcaplog_noacks(opts_t *opts)
 {
-	log_dbg_mode(LOG_DBG_MODE_ERRLOG);
-	opts->debug = 1;
+	opts->pcaplog_noacks = 1;
 }
 
-void
-opts_unset_debug(opts_t *opts)
+static void
+opts_unset_pcaplog_noacks(opts_t *opts)
 {
-	log_dbg_mode(LOG_DBG_MODE_NONE);
-	opts->debug = 0;
+	opts->pcaplog_noacks = 0;
 }
 
 static void
-opts_set_verify_peer(opts_t *opts)
+opts_set_openssl_async(opts_t *opts)
 {
-	opts->verify_peer = 1;
+	opts->openssl_async = 1;
 }
 
 static void
-opts_unset_verify_peer(opts_t *opts)
+opts_unset_openssl_async(opts_t *opts)
 {
-	opts->verify_peer = 0;
+	opts->openssl_async = 0;
 }
 
 static void
-opts_set_allow_wrong_host(opts_t *opts)
+opts_set_openssl_ktls(opts_t *opts)
 {
-	opts->allow_wrong_host = 1;
+	opts->openssl_ktls = 1;
 }
 
 static void
-opts_unset_allow_wrong_host(opts_t *opts)
+opts_unset_openssl_ktls(opts_t *opts)
 {
-	opts->allow_wrong_host = 0;
+	opts->openssl_ktls = 0;
+}
+
+static void
+opts_set_certcomp(opts_t *opts)
+{
+	opts->certcomp = 1;
+}
+
+static void
+opts_unset_certcomp(opts_t *opts)
+{
+	opts->certcomp = 0;
 }
 
 static int
@@ -1364,7 +4119,7 @@ check_value_yesno(const char *value, const char *name, int line_num)
 
 static int
 set_option(opts_t *opts, const char *argv0,
-           const char *name, char *value, char **natengine, int line_num)
+           const char *name, char *value, int line_num)
 {
 	int yes;
 	int retval = -1;
@@ -1382,18 +4137,51 @@ set_option(opts_t *opts, const char *argv0,
 	} else if (!strcmp(name, "LeafCerts") ||        /* compat <= 0.5.4 */
 	           !strcmp(name, "LeafKey")) {
 		opts_set_leafkey(opts, argv0, value);
+	} else if (!strcmp(name, "ECDSACACert")) {
+		opts_set_eccacrt(opts, argv0, value);
+	} else if (!strcmp(name, "ECDSACAKey")) {
+		opts_set_eccakey(opts, argv0, value);
+	} else if (!strcmp(name, "ECDSALeafKey")) {
+		opts_set_ecleafkey(opts, argv0, value);
 	} else if (!strcmp(name, "CRL") ||              /* compat <= 0.5.4 */
 	           !strcmp(name, "LeafCRLURL")) {
 		opts_set_leafcrlurl(opts, value);
 	} else if (!strcmp(name, "TargetCertDir") ||    /* compat <= 0.5.4 */
 	           !strcmp(name, "LeafCertDir")) {
 		opts_set_leafcertdir(opts, argv0, value);
+	} else if (!strcmp(name, "LeafCertDirLazy")) {
+		yes = check_value_yesno(value, "LeafCertDirLazy", line_num);
+		if (yes == -1) {
+			goto leave;
+		}
+		yes ? opts_set_leafcertdir_lazy(opts)
+		    : opts_unset_leafcertdir_lazy(opts);
+#ifdef DEBUG_OPTS
+		log_dbg_printf("LeafCertDirLazy: %u\n",
+		               opts->leafcertdir_lazy);
+#endif /* DEBUG_OPTS */
+	} else if (!strcmp(name, "LeafCertDirIndex")) {
+		opts_set_leafcertdir_index(opts, argv0, value);
+	} else if (!strcmp(name, "LeafCertDirCacheMaxEntries")) {
+		opts->tgcrt_maxentries = opts_parse_size(argv0, name, value);
 	} else if (!strcmp(name, "DefaultLeafCert")) {
 		opts_set_defaultleafcert(opts, argv0, value);
 	} else if (!strcmp(name, "WriteGenCertsDir")) {
 		opts_set_certgendir_writegencerts(opts, argv0, value);
 	} else if (!strcmp(name, "WriteAllCertsDir")) {
 		opts_set_certgendir_writeall(opts, argv0, value);
+	} else if (!strcmp(name, "GenCertsCacheWarmup")) {
+		yes = check_value_yesno(value, "GenCertsCacheWarmup",
+		                        line_num);
+		if (yes == -1) {
+			goto leave;
+		}
+		yes ? opts_set_certgen_warmup(opts)
+		    : opts_unset_certgen_warmup(opts);
+#ifdef DEBUG_OPTS
+		log_dbg_printf("GenCertsCacheWarmup: %u\n",
+		               opts->certgen_warmup);
+#endif /* DEBUG_OPTS */
 	} else if (!strcmp(name, "DenyOCSP")) {
 		yes = check_value_yesno(value, "DenyOCSP", line_num);
 		if (yes == -1) {
@@ -1402,6 +4190,74 @@ set_option(opts_t *opts, const char *argv0,
 		yes ? opts_set_deny_ocsp(opts) : opts_unset_deny_ocsp(opts);
 #ifdef DEBUG_OPTS
 		log_dbg_printf("DenyOCSP: %u\n", opts->deny_ocsp);
+#endif /* DEBUG_OPTS */
+	} else if (!strcmp(name, "HTTPKeepAlive")) {
+		yes = check_value_yesno(value, "HTTPKeepAlive", line_num);
+		if (yes == -1) {
+			goto leave;
+		}
+		yes ? opts_set_http_keepalive(opts) :
+		      opts_unset_http_keepalive(opts);
+#ifdef DEBUG_OPTS
+		log_dbg_printf("HTTPKeepAlive: %u\n", opts->http_keepalive);
+#endif /* DEBUG_OPTS */
+	} else if (!strcmp(name, "SpliceForward")) {
+		yes = check_value_yesno(value, "SpliceForward", line_num);
+		if (yes == -1) {
+			goto leave;
+		}
+		yes ? opts_set_splice(opts) : opts_unset_splice(opts);
+#ifdef DEBUG_OPTS
+		log_dbg_printf("SpliceForward: %u\n", opts->splice);
+#endif /* DEBUG_OPTS */
+	} else if (!strcmp(name, "IOUringForward")) {
+		yes = check_value_yesno(value, "IOUringForward", line_num);
+		if (yes == -1) {
+			goto leave;
+		}
+		yes ? opts_set_iouring(opts) : opts_unset_iouring(opts);
+#ifdef DEBUG_OPTS
+		log_dbg_printf("IOUringForward: %u\n", opts->iouring);
+#endif /* DEBUG_OPTS */
+	} else if (!strcmp(name, "ZeroCopyForward")) {
+		yes = check_value_yesno(value, "ZeroCopyForward", line_num);
+		if (yes == -1) {
+			goto leave;
+		}
+		yes ? opts_set_zerocopy(opts) : opts_unset_zerocopy(opts);
+#ifdef DEBUG_OPTS
+		log_dbg_printf("ZeroCopyForward: %u\n", opts->zerocopy);
+#endif /* DEBUG_OPTS */
+	} else if (!strcmp(name, "HTTPCompression")) {
+		yes = check_value_yesno(value, "HTTPCompression", line_num);
+		if (yes == -1) {
+			goto leave;
+		}
+		yes ? opts_set_http_compression(opts) :
+		      opts_unset_http_compression(opts);
+#ifdef DEBUG_OPTS
+		log_dbg_printf("HTTPCompression: %u\n", opts->http_compression);
+#endif /* DEBUG_OPTS */
+	} else if (!strcmp(name, "HTTPWebSocket")) {
+		yes = check_value_yesno(value, "HTTPWebSocket", line_num);
+		if (yes == -1) {
+			goto leave;
+		}
+		yes ? opts_set_http_websocket(opts) :
+		      opts_unset_http_websocket(opts);
+#ifdef DEBUG_OPTS
+		log_dbg_printf("HTTPWebSocket: %u\n", opts->http_websocket);
+#endif /* DEBUG_OPTS */
+	} else if (!strcmp(name, "HTTPWebSocketFrames")) {
+		yes = check_value_yesno(value, "HTTPWebSocketFrames", line_num);
+		if (yes == -1) {
+			goto leave;
+		}
+		yes ? opts_set_http_websocket_frames(opts) :
+		      opts_unset_http_websocket_frames(opts);
+#ifdef DEBUG_OPTS
+		log_dbg_printf("HTTPWebSocketFrames: %u\n",
+		               opts->http_websocket_frames);
 #endif /* DEBUG_OPTS */
 	} else if (!strcmp(name, "Passthrough")) {
 		yes = check_value_yesno(value, "Passthrough", line_num);
@@ -1441,14 +4297,43 @@ set_option(opts_t *opts, const char *argv0,
 	} else if (!strcmp(name, "OpenSSLEngine")) {
 		opts_set_openssl_engine(opts, argv0, value);
 #endif /* !OPENSSL_NO_ENGINE */
+	} else if (!strcmp(name, "OpenSSLAsync")) {
+		yes = check_value_yesno(value, "OpenSSLAsync", line_num);
+		if (yes == -1) {
+			goto leave;
+		}
+		yes ? opts_set_openssl_async(opts) :
+		      opts_unset_openssl_async(opts);
+#ifdef DEBUG_OPTS
+		log_dbg_printf("OpenSSLAsync: %u\n", opts->openssl_async);
+#endif /* DEBUG_OPTS */
+	} else if (!strcmp(name, "OpenSSLKTLS")) {
+		yes = check_value_yesno(value, "OpenSSLKTLS", line_num);
+		if (yes == -1) {
+			goto leave;
+		}
+		yes ? opts_set_openssl_ktls(opts) :
+		      opts_unset_openssl_ktls(opts);
+#ifdef DEBUG_OPTS
+		log_dbg_printf("OpenSSLKTLS: %u\n", opts->openssl_ktls);
+#endif /* DEBUG_OPTS */
+	} else if (!strcmp(name, "CertCompression")) {
+		yes = check_value_yesno(value, "CertCompression", line_num);
+		if (yes == -1) {
+			goto leave;
+		}
+		yes ? opts_set_certcomp(opts) : opts_unset_certcomp(opts);
+#ifdef DEBUG_OPTS
+		log_dbg_printf("CertCompression: %u\n", opts->certcomp);
+#endif /* DEBUG_OPTS */
 	} else if (!strcmp(name, "NATEngine")) {
-		if (*natengine)
-			free(*natengine);
-		*natengine = strdup(value);
-		if (!*natengine)
+		if (opts->natengine)
+			free(opts->natengine);
+		opts->natengine = strdup(value);
+		if (!opts->natengine)
 			goto leave;
 #ifdef DEBUG_OPTS
-		log_dbg_printf("NATEngine: %s\n", *natengine);
+		log_dbg_printf("NATEngine: %s\n", opts->natengine);
 #endif /* DEBUG_OPTS */
 	} else if (!strcmp(name, "User")) {
 		opts_set_user(opts, argv0, value);
@@ -1460,12 +4345,62 @@ set_option(opts_t *opts, const char *argv0,
 		opts_set_pidfile(opts, argv0, value);
 	} else if (!strcmp(name, "ConnectLog")) {
 		opts_set_connectlog(opts, argv0, value);
+	} else if (!strcmp(name, "ConnectLogFormat")) {
+		opts_set_connectlog_format(opts, argv0, value);
+	} else if (!strcmp(name, "ConnectLogRollup")) {
+		opts_set_connectlog_rollup(opts, argv0, value);
+	} else if (!strcmp(name, "ConnectLogRollupSample")) {
+		opts_set_connectlog_sample(opts, argv0, value);
+	} else if (!strcmp(name, "ConnectLogTimings")) {
+		yes = check_value_yesno(value, "ConnectLogTimings", line_num);
+		if (yes == -1) {
+			goto leave;
+		}
+		yes ? opts_set_connectlog_timings(opts)
+		    : opts_unset_connectlog_timings(opts);
+#ifdef DEBUG_OPTS
+		log_dbg_printf("ConnectLogTimings: %u\n",
+		               opts->connectlog_timings);
+#endif /* DEBUG_OPTS */
+	} else if (!strcmp(name, "ConnectLogTCPInfo")) {
+		yes = check_value_yesno(value, "ConnectLogTCPInfo", line_num);
+		if (yes == -1) {
+			goto leave;
+		}
+		yes ? opts_set_connectlog_tcpinfo(opts)
+		    : opts_unset_connectlog_tcpinfo(opts);
+#ifdef DEBUG_OPTS
+		log_dbg_printf("ConnectLogTCPInfo: %u\n",
+		               opts->connectlog_tcpinfo);
+#endif /* DEBUG_OPTS */
 	} else if (!strcmp(name, "ContentLog")) {
 		opts_set_contentlog(opts, argv0, value);
 	} else if (!strcmp(name, "ContentLogDir")) {
 		opts_set_contentlogdir(opts, argv0, value);
 	} else if (!strcmp(name, "ContentLogPathSpec")) {
 		opts_set_contentlogpathspec(opts, argv0, value);
+	} else if (!strcmp(name, "ContentLogSegmentDir")) {
+		opts_set_contentlogsegdir(opts, argv0, value);
+	} else if (!strcmp(name, "ContentLogSegmentSize")) {
+		opts->contentlog_segsz = opts_parse_size(argv0, name, value);
+	} else if (!strcmp(name, "ContentLogDedupDir")) {
+		opts_set_contentlogdedupdir(opts, argv0, value);
+	} else if (!strcmp(name, "ContentLogRule")) {
+		opts_set_contentlog_rule(opts, argv0, value);
+	} else if (!strcmp(name, "ContentLogLimit")) {
+		opts->contentlog_limit = opts_parse_size(argv0, name, value);
+	} else if (!strcmp(name, "ContentLogMaxOpenFiles")) {
+		opts->contentlog_maxfiles = opts_parse_size(argv0, name,
+		                                            value);
+	} else if (!strcmp(name, "ContentLogRecorder")) {
+		opts->contentlog_rec_sz = opts_parse_size(argv0, name, value);
+	} else if (!strcmp(name, "ContentLogRecorderTotal")) {
+		opts->contentlog_rec_total = opts_parse_size(argv0, name,
+		                                             value);
+	} else if (!strcmp(name, "ContentLogTrigger")) {
+		opts_set_contentlog_trigger(opts, argv0, value);
+	} else if (!strcmp(name, "ContentLogTriggerMatch")) {
+		opts_set_contentlog_match(opts, argv0, value);
 #ifdef HAVE_LOCAL_PROCINFO
 	} else if (!strcmp(name, "LogProcInfo")) {
 		yes = check_value_yesno(value, "LogProcInfo", line_num);
@@ -1485,12 +4420,36 @@ set_option(opts_t *opts, const char *argv0,
 		opts_set_pcaplogdir(opts, argv0, value);
 	} else if (!strcmp(name, "PcapLogPathSpec")) {
 		opts_set_pcaplogpathspec(opts, argv0, value);
+	} else if (!strcmp(name, "PcapLogFormat")) {
+		opts_set_pcaplog_format(opts, argv0, value);
+	} else if (!strcmp(name, "PcapLogOmitAcks")) {
+		yes = check_value_yesno(value, "PcapLogOmitAcks", line_num);
+		if (yes == -1) {
+			goto leave;
+		}
+		yes ? opts_set_pcaplog_noacks(opts)
+		    : opts_unset_pcaplog_noacks(opts);
+#ifdef DEBUG_OPTS
+		log_dbg_printf("PcapLogOmitAcks: %u\n", opts->pcaplog_noacks);
+#endif /* DEBUG_OPTS */
 #ifndef WITHOUT_MIRROR
 	} else if (!strcmp(name, "MirrorIf")) {
 		opts_set_mirrorif(opts, argv0, value);
 	} else if (!strcmp(name, "MirrorTarget")) {
 		opts_set_mirrortarget(opts, argv0, value);
+	} else if (!strcmp(name, "MirrorCheckInterval")) {
+		opts_set_mirror_chk_interval(opts, argv0, value);
 #endif /* !WITHOUT_MIRROR */
+	} else if (!strcmp(name, "ContentTap")) {
+		opts_set_contenttap(opts, argv0, value);
+	} else if (!strcmp(name, "ContentTapSize")) {
+		opts->contenttap_sz = opts_parse_size(argv0, name, value);
+	} else if (!strcmp(name, "ContentStream")) {
+		opts_set_contentstream(opts, argv0, value);
+	} else if (!strcmp(name, "ContentStreamBuffer")) {
+		opts->contentstream_sz = opts_parse_size(argv0, name, value);
+	} else if (!strcmp(name, "InspectPlugin")) {
+		opts_set_inspect(opts, argv0, value);
 	} else if (!strcmp(name, "Daemon")) {
 		yes = check_value_yesno(value, "Daemon", line_num);
 		if (yes == -1) {
@@ -1511,8 +4470,8 @@ set_option(opts_t *opts, const char *argv0,
 #endif /* DEBUG_OPTS */
 	} else if (!strcmp(name, "ProxySpec")) {
 		/* Use MAX_TOKEN instead of computing the actual number of tokens in value */
-		char **argv = malloc(sizeof(char *) * MAX_TOKEN);
-		char **save_argv = argv;
+		char *tokens[MAX_TOKEN];
+		char **argv = tokens;
 		int argc = 0;
 		char *p, *last = NULL;
 
@@ -1527,8 +4486,7 @@ set_option(opts_t *opts, const char *argv0,
 			}
 		}
 
-		proxyspec_parse(&argc, &argv, *natengine, &opts->spec);
-		free(save_argv);
+		proxyspec_parse(&argc, &argv, opts->natengine, &opts->spec);
 	} else if (!strcmp(name, "VerifyPeer")) {
 		yes = check_value_yesno(value, "VerifyPeer", line_num);
 		if (yes == -1) {
@@ -1548,6 +4506,297 @@ set_option(opts_t *opts, const char *argv0,
 #ifdef DEBUG_OPTS
 		log_dbg_printf("AddSNIToCertificate: %u\n",
 		               opts->allow_wrong_host);
+#endif /* DEBUG_OPTS */
+	} else if (!strcmp(name, "ReusePortListeners")) {
+		yes = check_value_yesno(value, "ReusePortListeners", line_num);
+		if (yes == -1) {
+			goto leave;
+		}
+		yes ? opts_set_reuseport(opts) : opts_unset_reuseport(opts);
+#ifdef DEBUG_OPTS
+		log_dbg_printf("ReusePortListeners: %u\n", opts->reuseport);
+#endif /* DEBUG_OPTS */
+	} else if (!strcmp(name, "ReusePortCPUSteering")) {
+		yes = check_value_yesno(value, "ReusePortCPUSteering",
+		                        line_num);
+		if (yes == -1) {
+			goto leave;
+		}
+		opts->reuseport_steer = yes;
+#ifdef DEBUG_OPTS
+		log_dbg_printf("ReusePortCPUSteering: %u\n",
+		               opts->reuseport_steer);
+#endif /* DEBUG_OPTS */
+	} else if (!strcmp(name, "TCPFastOpen")) {
+		yes = check_value_yesno(value, "TCPFastOpen", line_num);
+		if (yes == -1) {
+			goto leave;
+		}
+		yes ? opts_set_tcp_fastopen(opts)
+		    : opts_unset_tcp_fastopen(opts);
+#ifdef DEBUG_OPTS
+		log_dbg_printf("TCPFastOpen: %u\n", opts->tcp_fastopen);
+#endif /* DEBUG_OPTS */
+	} else if (!strcmp(name, "TCPDeferAccept")) {
+		yes = check_value_yesno(value, "TCPDeferAccept", line_num);
+		if (yes == -1) {
+			goto leave;
+		}
+		yes ? opts_set_tcp_deferaccept(opts)
+		    : opts_unset_tcp_deferaccept(opts);
+#ifdef DEBUG_OPTS
+		log_dbg_printf("TCPDeferAccept: %u\n", opts->tcp_deferaccept);
+#endif /* DEBUG_OPTS */
+	} else if (!strcmp(name, "ThreadMemPool")) {
+		yes = check_value_yesno(value, "ThreadMemPool", line_num);
+		if (yes == -1) {
+			goto leave;
+		}
+		yes ? opts_set_mempool(opts) : opts_unset_mempool(opts);
+#ifdef DEBUG_OPTS
+		log_dbg_printf("ThreadMemPool: %u\n", opts->mempool);
+#endif /* DEBUG_OPTS */
+	} else if (!strcmp(name, "HugePages")) {
+		opts_set_huge_pages(opts, argv0, value);
+	} else if (!strcmp(name, "LogOverflow")) {
+		opts_set_log_overflow(opts, argv0, value);
+	} else if (!strcmp(name, "LogSpillDir")) {
+		opts_set_log_spilldir(opts, argv0, value);
+	} else if (!strcmp(name, "LogQueueMaxBytes")) {
+		opts->log_membudget = opts_parse_size(argv0, name, value);
+	} else if (!strcmp(name, "OutbufMaxBytes")) {
+		opts->outbuf_membudget = opts_parse_size(argv0, name, value);
+	} else if (!strcmp(name, "ContentLogThreads")) {
+		opts_set_content_log_threads(opts, argv0, value);
+	} else if (!strcmp(name, "LogCompression")) {
+		opts_set_log_compress(opts, argv0, value);
+	} else if (!strcmp(name, "LogFlushInterval")) {
+		opts_set_log_flush_interval(opts, argv0, value);
+	} else if (!strcmp(name, "LogPreallocate")) {
+		opts->log_prealloc = opts_parse_size(argv0, name, value);
+	} else if (!strcmp(name, "LogFsync")) {
+		opts_set_log_fsync(opts, argv0, value);
+	} else if (!strcmp(name, "LogDropCache")) {
+		yes = check_value_yesno(value, "LogDropCache", line_num);
+		if (yes == -1) {
+			goto leave;
+		}
+		opts->log_dropcache = yes;
+#ifdef DEBUG_OPTS
+		log_dbg_printf("LogDropCache: %u\n", opts->log_dropcache);
+#endif /* DEBUG_OPTS */
+	} else if (!strcmp(name, "ThreadSelection")) {
+		opts_set_thrsel(opts, argv0, value);
+	} else if (!strcmp(name, "RebalanceInterval")) {
+		opts_set_rebalance_interval(opts, argv0, value);
+	} else if (!strcmp(name, "WorkerThreads")) {
+		opts_set_worker_threads(opts, argv0, value);
+	} else if (!strcmp(name, "WorkerProcesses")) {
+		opts_set_worker_procs(opts, argv0, value);
+	} else if (!strcmp(name, "WorkerPool")) {
+		opts_set_workerpool(opts, argv0, value);
+	} else if (!strcmp(name, "SharedCacheSize")) {
+		opts->shcache_size = opts_parse_size(argv0, name, value);
+	} else if (!strcmp(name, "RemoteCache")) {
+		opts_set_rcache_servers(opts, argv0, value);
+	} else if (!strcmp(name, "RemoteCacheTimeout")) {
+		opts_set_rcache_timeout(opts, argv0, value);
+	} else if (!strcmp(name, "ForgeThreads")) {
+		opts_set_forge_threads(opts, argv0, value);
+	} else if (!strcmp(name, "PreforgeHosts")) {
+		opts_set_preforge_hosts(opts, argv0, value);
+	} else if (!strcmp(name, "LeafKeyType")) {
+		opts_set_leafkey_type(opts, argv0, value);
+	} else if (!strcmp(name, "LeafKeyPool")) {
+		opts_set_leafkey_pool(opts, argv0, value);
+	} else if (!strcmp(name, "PreconnectPool")) {
+		opts_set_preconnect(opts, argv0, value);
+	} else if (!strcmp(name, "HTTPUpstreamPool")) {
+		opts_set_http_upstream_pool(opts, argv0, value);
+	} else if (!strcmp(name, "HTTPCacheSize")) {
+		opts->http_cache_size = opts_parse_size(argv0, name, value);
+	} else if (!strcmp(name, "HTTPCacheMaxObjectSize")) {
+		opts->http_cache_maxobj = opts_parse_size(argv0, name, value);
+	} else if (!strcmp(name, "OverloadPassthrough")) {
+		opts_set_overload_lag(opts, argv0, value);
+	} else if (!strcmp(name, "PassthroughCacheTTL")) {
+		opts_set_pass_ttl(opts, argv0, value);
+	} else if (!strcmp(name, "Bypass")) {
+		opts_set_bypass(opts, argv0, value, 0);
+	} else if (!strcmp(name, "BypassFile")) {
+		opts_set_bypass(opts, argv0, value, 1);
+	} else if (!strcmp(name, "AcceptBatch")) {
+		opts_set_accept_batch(opts, argv0, value);
+	} else if (!strcmp(name, "ClientReadAhead")) {
+		opts->readahead = opts_parse_size(argv0, name, value);
+	} else if (!strcmp(name, "EarlyData")) {
+		opts->earlydata = opts_parse_size(argv0, name, value);
+	} else if (!strcmp(name, "ConnectTimeout")) {
+		opts_set_timeout(opts, argv0, OPTS_TIMEOUT_CONNECT, value);
+	} else if (!strcmp(name, "HandshakeTimeout")) {
+		opts_set_timeout(opts, argv0, OPTS_TIMEOUT_HANDSHAKE, value);
+	} else if (!strcmp(name, "HeaderTimeout")) {
+		opts_set_timeout(opts, argv0, OPTS_TIMEOUT_HEADER, value);
+	} else if (!strcmp(name, "IdleTimeout")) {
+		opts_set_timeout(opts, argv0, OPTS_TIMEOUT_IDLE, value);
+	} else if (!strcmp(name, "DormantTimeout")) {
+		opts_set_timeout(opts, argv0, OPTS_TIMEOUT_DORMANT, value);
+	} else if (!strcmp(name, "HelloTimeout")) {
+		opts_set_timeout(opts, argv0, OPTS_TIMEOUT_HELLO, value);
+	} else if (!strcmp(name, "MaxConnections")) {
+		opts_set_admit_limit(opts, argv0, OPTS_ADMIT_CONNS, value);
+	} else if (!strcmp(name, "MaxHandshakeRate")) {
+		opts_set_admit_limit(opts, argv0, OPTS_ADMIT_RATE, value);
+	} else if (!strcmp(name, "MaxSourceConnections")) {
+		opts_set_admit_limit(opts, argv0, OPTS_ADMIT_SRC_CONNS, value);
+	} else if (!strcmp(name, "MaxSourceHandshakeRate")) {
+		opts_set_admit_limit(opts, argv0, OPTS_ADMIT_SRC_RATE, value);
+	} else if (!strcmp(name, "MaxRenegotiations")) {
+		opts_set_max_reneg(opts, argv0, value);
+	} else if (!strcmp(name, "RenegotiationAction")) {
+		opts_set_reneg_action(opts, argv0, value);
+	} else if (!strcmp(name, "LimitPassthrough")) {
+		yes = check_value_yesno(value, "LimitPassthrough", line_num);
+		if (yes == -1) {
+			goto leave;
+		}
+		opts->limit_passthrough = yes;
+#ifdef DEBUG_OPTS
+		log_dbg_printf("LimitPassthrough: %u\n",
+		               opts->limit_passthrough);
+#endif /* DEBUG_OPTS */
+	} else if (!strcmp(name, "ShapeRate")) {
+		opts->shape_rate = opts_parse_size(argv0, name, value);
+	} else if (!strcmp(name, "ShapeBurst")) {
+		opts->shape_burst = opts_parse_size(argv0, name, value);
+	} else if (!strcmp(name, "WorkerCPUs")) {
+		opts_set_worker_cpus(opts, argv0, value);
+	} else if (!strcmp(name, "ForgedCertCacheMaxEntries")) {
+		opts->fkcrt_maxentries = opts_parse_size(argv0, name, value);
+	} else if (!strcmp(name, "ForgedCertCacheMaxBytes")) {
+		opts->fkcrt_maxbytes = opts_parse_size(argv0, name, value);
+	} else if (!strcmp(name, "StatsSocket")) {
+		opts_set_stats_socket(opts, argv0, value);
+	} else if (!strcmp(name, "UpgradeSocket")) {
+		opts_set_upgrade_socket(opts, argv0, value);
+	} else if (!strcmp(name, "DrainTimeout")) {
+		opts_set_drain_timeout(opts, argv0, value);
+	} else if (!strcmp(name, "StatsCPUTop")) {
+		opts_set_stats_cputop(opts, argv0, value);
+	} else if (!strcmp(name, "StatsTCPInfoTop")) {
+		opts_set_stats_tcptop(opts, argv0, value);
+	} else if (!strcmp(name, "StatsLockProfiling")) {
+		yes = check_value_yesno(value, "StatsLockProfiling", line_num);
+		if (yes == -1) {
+			goto leave;
+		}
+		opts->stats_lockprof = yes;
+#ifdef DEBUG_OPTS
+		log_dbg_printf("StatsLockProfiling: %u\n",
+		               opts->stats_lockprof);
+#endif /* DEBUG_OPTS */
+	} else if (!strcmp(name, "StatsPerfCounters")) {
+		yes = check_value_yesno(value, "StatsPerfCounters", line_num);
+		if (yes == -1) {
+			goto leave;
+		}
+		opts->stats_perf = yes;
+#ifdef DEBUG_OPTS
+		log_dbg_printf("StatsPerfCounters: %u\n", opts->stats_perf);
+#endif /* DEBUG_OPTS */
+	} else if (!strcmp(name, "ForgedCertCacheFile")) {
+		opts_set_fkcrtstore(opts, argv0, value);
+	} else if (!strcmp(name, "SessionCacheFile")) {
+		opts_set_sessstore(opts, argv0, value);
+	} else if (!strcmp(name, "SessionCacheSaveInterval")) {
+		opts_set_sessstore_interval(opts, argv0, value);
+	} else if (!strcmp(name, "SessionTickets")) {
+		yes = check_value_yesno(value, "SessionTickets", line_num);
+		if (yes == -1) {
+			goto leave;
+		}
+		yes ? opts_set_sslticket(opts) : opts_unset_sslticket(opts);
+#ifdef DEBUG_OPTS
+		log_dbg_printf("SessionTickets: %u\n", opts->sslticket);
+#endif /* DEBUG_OPTS */
+	} else if (!strcmp(name, "SessionTicketKeyFile")) {
+		opts_set_ticketkeyfile(opts, argv0, value);
+	} else if (!strcmp(name, "SessionTicketKeyRotate")) {
+		opts_set_ticket_rotate(opts, argv0, value);
+	} else if (!strcmp(name, "SrcSessionCacheMaxEntries")) {
+		opts->ssess_maxentries = opts_parse_size(argv0, name, value);
+	} else if (!strcmp(name, "SrcSessionCacheMaxBytes")) {
+		opts->ssess_maxbytes = opts_parse_size(argv0, name, value);
+	} else if (!strcmp(name, "DstSessionCacheMaxEntries")) {
+		opts->dsess_maxentries = opts_parse_size(argv0, name, value);
+	} else if (!strcmp(name, "DstSessionCacheMaxBytes")) {
+		opts->dsess_maxbytes = opts_parse_size(argv0, name, value);
+	} else if (!strcmp(name, "DNSCacheMaxEntries")) {
+		opts->dns_maxentries = opts_parse_size(argv0, name, value);
+	} else if (!strcmp(name, "SSLCtxCacheMaxEntries")) {
+		opts->sslctx_maxentries = opts_parse_size(argv0, name, value);
+	} else if (!strcmp(name, "VerifyCacheMaxEntries")) {
+		opts->vrfy_maxentries = opts_parse_size(argv0, name, value);
+	} else if (!strcmp(name, "SNICacheMaxEntries")) {
+		opts->sni_maxentries = opts_parse_size(argv0, name, value);
+	} else if (!strcmp(name, "PassthroughCacheMaxEntries")) {
+		opts->pass_maxentries = opts_parse_size(argv0, name, value);
+	} else if (!strcmp(name, "OCSPCacheMaxEntries")) {
+		opts->ocsp_maxentries = opts_parse_size(argv0, name, value);
+	} else if (!strcmp(name, "CachePresize")) {
+		yes = check_value_yesno(value, "CachePresize", line_num);
+		if (yes == -1) {
+			goto leave;
+		}
+		opts->cache_presize = yes;
+#ifdef DEBUG_OPTS
+		log_dbg_printf("CachePresize: %u\n", opts->cache_presize);
+#endif /* DEBUG_OPTS */
+	} else if (!strcmp(name, "SpeculativeHandshake")) {
+		yes = check_value_yesno(value, "SpeculativeHandshake",
+		                        line_num);
+		if (yes == -1) {
+			goto leave;
+		}
+		opts->speculate = yes;
+#ifdef DEBUG_OPTS
+		log_dbg_printf("SpeculativeHandshake: %u\n", opts->speculate);
+#endif /* DEBUG_OPTS */
+	} else if (!strcmp(name, "ForgeStealing")) {
+		yes = check_value_yesno(value, "ForgeStealing", line_num);
+		if (yes == -1) {
+			goto leave;
+		}
+		opts->forge_steal = yes;
+#ifdef DEBUG_OPTS
+		log_dbg_printf("ForgeStealing: %u\n", opts->forge_steal);
+#endif /* DEBUG_OPTS */
+	} else if (!strcmp(name, "WorkerLibCtx")) {
+		yes = check_value_yesno(value, "WorkerLibCtx", line_num);
+		if (yes == -1) {
+			goto leave;
+		}
+		opts->worker_libctx = yes;
+#ifdef DEBUG_OPTS
+		log_dbg_printf("WorkerLibCtx: %u\n", opts->worker_libctx);
+#endif /* DEBUG_OPTS */
+	} else if (!strcmp(name, "OCSPStapling")) {
+		yes = check_value_yesno(value, "OCSPStapling", line_num);
+		if (yes == -1) {
+			goto leave;
+		}
+		opts->ocsp_staple = yes;
+#ifdef DEBUG_OPTS
+		log_dbg_printf("OCSPStapling: %u\n", opts->ocsp_staple);
+#endif /* DEBUG_OPTS */
+	} else if (!strcmp(name, "PrioritizeChaCha")) {
+		yes = check_value_yesno(value, "PrioritizeChaCha", line_num);
+		if (yes == -1) {
+			goto leave;
+		}
+		opts->chacha_prio = yes;
+#ifdef DEBUG_OPTS
+		log_dbg_printf("PrioritizeChaCha: %u\n", opts->chacha_prio);
 #endif /* DEBUG_OPTS */
 	} else {
 		fprintf(stderr, "Error in conf: Unknown option "
@@ -1628,13 +4877,28 @@ leave:
 	return retval;
 }
 
+/*
+ * Parse a single name=value option from the command line into opts.
+ * Returns 0 on success, -1 on invalid syntax; fails on invalid options,
+ * see opts_fail().
+ */
 int
-opts_set_option(opts_t *opts, const char *argv0, const char *optarg,
-                char **natengine)
+opts_set_option(opts_t *opts, const char *argv0, const char *optarg)
 {
 	char *name, *value;
 	int retval = -1;
-	char *line = strdup(optarg);
+	char *line;
+	jmp_buf env;
+	jmp_buf *volatile outer;
+
+	if (!(line = strdup(optarg)))
+		oom_die(argv0);
+	if (setjmp(env)) {
+		opts_fail_catch(outer);
+		free(line);
+		opts_fail();
+	}
+	outer = opts_fail_catch(&env);
 
 	/* White spaces possible before option name,
 	 * if the command line option is passed between the quotes */
@@ -1644,21 +4908,31 @@ opts_set_option(opts_t *opts, const char *argv0, const char *optarg,
 	retval = get_name_value(&name, &value, '=');
 	if (retval == 0) {
 		/* Line number param is for conf file, pass 0 for command line options */
-		retval = set_option(opts, argv0, name, value, natengine, 0);
+		retval = set_option(opts, argv0, name, value, 0);
 	}
 
-	if (line)
-		free(line);
+	opts_fail_catch(outer);
+	free(line);
 	return retval;
 }
 
+/*
+ * Parse the configuration file opts->conffile into opts.
+ * Returns 0 on success, -1 on errors opening or reading the file and on
+ * invalid syntax; fails on invalid options, see opts_fail().  The file is
+ * closed in either case.
+ */
 int
-load_conffile(opts_t *opts, const char *argv0, char **natengine)
+load_conffile(opts_t *opts, const char *argv0)
 {
 	int retval, line_num;
-	char *line, *name, *value;
+	char *volatile line;
+	char *buf, *name, *value;
 	size_t line_len;
+	ssize_t rv;
 	FILE *f;
+	jmp_buf env;
+	jmp_buf *volatile outer;
 	
 	f = fopen(opts->conffile, "r");
 	if (!f) {
@@ -1667,10 +4941,22 @@ load_conffile(opts_t *opts, const char *argv0, char **natengine)
 	}
 
 	line = NULL;
+	if (setjmp(env)) {
+		opts_fail_catch(outer);
+		fclose(f);
+		free(line);
+		opts_fail();
+	}
+	outer = opts_fail_catch(&env);
+
 	line_num = 0;
 	retval = -1;
 	while (!feof(f)) {
-		if (getline(&line, &line_len, f) == -1) {
+		/* getline(3) needs a non-volatile pointer to update */
+		buf = line;
+		rv = getline(&buf, &line_len, f);
+		line = buf;
+		if (rv == -1) {
 			break;
 		}
 		if (line == NULL) {
@@ -1690,7 +4976,7 @@ load_conffile(opts_t *opts, const char *argv0, char **natengine)
 
 		retval = get_name_value(&name, &value, ' ');
 		if (retval == 0) {
-			retval = set_option(opts, argv0, name, value, natengine, line_num);
+			retval = set_option(opts, argv0, name, value, line_num);
 		}
 
 		if (retval == -1) {
@@ -1701,6 +4987,7 @@ load_conffile(opts_t *opts, const char *argv0, char **natengine)
 	}
 
 leave:
+	opts_fail_catch(outer);
 	fclose(f);
 	if (line)
 		free(line);
@@ -33,8 +33,40 @@
 #include "nat.h"
 #include "ssl.h"
 #include "cert.h"
+#include "logger.h"
+#include "logrule.h"
+#include "bypass.h"
+#include "inspect.h"
+#include "acmatch.h"
+#include "admit.h"
+#include "srcpool.h"
 #include "attrib.h"
 
+#include <setjmp.h>
+
+/* connection timeouts, index into timeout */
+#define OPTS_TIMEOUT_CONNECT	0
+#define OPTS_TIMEOUT_HANDSHAKE	1
+#define OPTS_TIMEOUT_HEADER	2
+#define OPTS_TIMEOUT_IDLE	3
+#define OPTS_TIMEOUT_DORMANT	4
+#define OPTS_TIMEOUT_HELLO	5
+#define OPTS_TIMEOUT_MAX	6
+
+/* global admission limits, for opts_set_admit_limit() */
+#define OPTS_ADMIT_CONNS	0
+#define OPTS_ADMIT_RATE		1
+#define OPTS_ADMIT_SRC_CONNS	2
+#define OPTS_ADMIT_SRC_RATE	3
+
+/* cache entry limit not set, following ForgedCertCacheMaxEntries */
+#define OPTS_MAXENTRIES_FKCRT	((size_t)-1)
+
+/* actions on connections over a renegotiation limit */
+#define OPTS_RENEG_REFUSE	0	/* refuse renegotiations (default) */
+#define OPTS_RENEG_CLOSE	1	/* close the connection */
+#define OPTS_RENEG_LOG		2	/* only flag in the connect log */
+
 typedef struct proxyspec {
 	unsigned int ssl : 1;
 	unsigned int http : 1;
@@ -43,7 +75,8 @@ typedef struct proxyspec {
 	struct sockaddr_storage listen_addr;
 	socklen_t listen_addrlen;
 	/* connect_addr and connect_addrlen are set: static mode;
-	 * natlookup is set: NAT mode; natsocket /may/ be set too;
+	 * natlookup is set: NAT mode; natsocket and natforget /may/ be set
+	 * too;
 	 * sni_port is set, in which case we use SNI lookups */
 	struct sockaddr_storage connect_addr;
 	socklen_t connect_addrlen;
@@ -51,9 +84,67 @@ typedef struct proxyspec {
 	char *natengine;
 	nat_lookup_cb_t natlookup;
 	nat_socket_cb_t natsocket;
+	nat_forget_cb_t natforget;
+	/* shared SSL_CTX for connections to the original destination;
+	 * set up by proxy_new() for ssl and autossl proxyspecs */
+	SSL_CTX *dstsslctx;
+	/* header fields the HTTP header filter needs to look at, as
+	 * HTTPHDR_BIT() masks; set up by proxy_new() for http proxyspecs */
+	unsigned int httpreqhdrs;
+	unsigned int httpresphdrs;
+	/* timeouts in seconds overriding the global ones, or -1 */
+	int timeout[OPTS_TIMEOUT_MAX];
+	/* admission limits and counters of this proxyspec */
+	admit_limits_t admit;
+	admit_ctr_t admit_ctr;
+	/* traffic shaping in octets per second and burst octets overriding
+	 * the global ShapeRate and ShapeBurst, or -1 */
+	long long shape_rate;
+	long long shape_burst;
+	/* name of the worker pool to handle connections on, or NULL for the
+	 * default pool; resolved to the pool index by proxy_new() */
+	char *workerpool;
+	int wpool;
+	/* name of the worker pool to hand established connections off to for
+	 * forwarding, or NULL to keep them on the handshake thread; resolved
+	 * to the pool index by proxy_new(), -1 if unset */
+	char *fwdpool;
+	int fwpool;
+	/* source addresses to bind upstream connections to, or NULL */
+	srcpool_t *srcpool;
+	/* index for the per-proxyspec stats, counting from the last parsed */
+	int idx;
 	struct proxyspec *next;
 } proxyspec_t;
 
+/* named pools of connection handling threads in addition to the default */
+#define OPTS_WORKERPOOL_MAX	8
+
+typedef struct opts_workerpool {
+	char *name;
+	int threads;
+	int *cpus;
+	int cpus_count;
+} opts_workerpool_t;
+
+/* connection handling thread selection policies */
+#define THRSEL_P2C		0	/* power of two choices (default) */
+#define THRSEL_LEASTLOADED	1	/* least loaded of all threads */
+#define THRSEL_ROUNDROBIN	2	/* round robin */
+#define THRSEL_CLIENTHASH	3	/* hash of client IP address */
+#define THRSEL_SNIHASH		4	/* hash of SNI, after peeking */
+
+/* logs with configurable overflow policy, index into log_overflow */
+#define OPTS_LOG_CONTENT	0
+#define OPTS_LOG_PCAP		1
+#define OPTS_LOG_MIRROR		2
+#define OPTS_LOG_CONNECT	3
+#define OPTS_LOG_MASTERKEY	4
+#define OPTS_LOG_CERT		5
+#define OPTS_LOG_TAP		6
+#define OPTS_LOG_STREAM		7
+#define OPTS_LOG_MAX		8
+
 typedef struct opts {
 	unsigned int debug : 1;
 	unsigned int detach : 1;
@@ -75,35 +166,69 @@ typedef struct opts {
 #endif /* HAVE_TLSV12 */
 	unsigned int passthrough : 1;
 	unsigned int deny_ocsp : 1;
+	unsigned int http_keepalive : 1;
+	unsigned int http_compression : 1;
+	unsigned int http_websocket : 1;
+	unsigned int http_websocket_frames : 1;
+	unsigned int splice : 1;
+	unsigned int iouring : 1;
+	unsigned int zerocopy : 1;
+	unsigned int mempool : 1;
+	unsigned int huge_pages : 2;
 	unsigned int contentlog_isdir : 1;
 	unsigned int contentlog_isspec : 1;
+	unsigned int contentlog_isseg : 1;
 	unsigned int pcaplog_isdir : 1;
 	unsigned int pcaplog_isspec : 1;
+	unsigned int pcaplog_ng : 1;
+	unsigned int pcaplog_noacks : 1;
 #ifdef HAVE_LOCAL_PROCINFO
 	unsigned int lprocinfo : 1;
 #endif /* HAVE_LOCAL_PROCINFO */
 	unsigned int certgen_writeall : 1;
+	unsigned int certgen_warmup : 1;
+	unsigned int leafcertdir_lazy : 1;
+	unsigned int leafkey_ec : 1;
+	unsigned int cache_presize : 1;
 #ifndef OPENSSL_NO_ENGINE
 	char *openssl_engine;
 #endif /* !OPENSSL_NO_ENGINE */
 	char *ciphers;
+	char *ciphers_chacha;
 	char *certgendir;
 	char *leafcertdir;
+	char *leafcertdir_index;
 	char *leafcrlurl;
 	char *dropuser;
 	char *dropgroup;
 	char *jaildir;
 	char *pidfile;
+	char *fkcrtstore;
+	char *sessstore;
+	unsigned int sessstore_interval;
+	char *stats_socket;
+	char *upgrade_socket;
+	unsigned int drain_timeout;
+	char *rcache_servers;
 	char *conffile;
+	char *natengine; /* default NAT engine while parsing proxyspecs */
 	char *connectlog;
 	char *contentlog;
 	char *contentlog_basedir; /* static part of logspec for privsep srv */
+	char *contentlog_dedupdir;
 	char *masterkeylog;
 	char *pcaplog;
 	char *pcaplog_basedir; /* static part of pcap logspec for privsep srv */
+	char *contenttap;
+	size_t contenttap_sz;
+	char *contentstream;
+	char *inspect[INSPECT_MAXPLUGINS];
+	int inspect_count;
+	size_t contentstream_sz;
 #ifndef WITHOUT_MIRROR
 	char *mirrorif;
 	char *mirrortarget;
+	unsigned int mirror_chk_interval;
 #endif /* !WITHOUT_MIRROR */
 	CONST_SSL_METHOD *(*sslmethod)(void);
 #if (OPENSSL_VERSION_NUMBER >= 0x10100000L) && !defined(LIBRESSL_VERSION_NUMBER)
@@ -113,6 +238,13 @@ typedef struct opts {
 	EVP_PKEY *cakey;
 	STACK_OF(X509) *cachain;
 	EVP_PKEY *leafkey;
+	X509 *eccacrt;
+	EVP_PKEY *eccakey;
+	STACK_OF(X509) *eccachain;
+	EVP_PKEY *ecleafkey;
+	/* forging templates for the CA and leaf key pairs above */
+	ssl_x509_tmpl_t *fktmpl;
+	ssl_x509_tmpl_t *ecfktmpl;
 	cert_t *defaultleafcert;
 	X509 *clientcrt;
 	EVP_PKEY *clientkey;
@@ -125,15 +257,115 @@ typedef struct opts {
 	proxyspec_t *spec;
 	unsigned int verify_peer: 1;
 	unsigned int allow_wrong_host: 1;
+	unsigned int reuseport: 1;
+	unsigned int reuseport_steer: 1;
+	unsigned int tcp_fastopen: 1;
+	unsigned int tcp_deferaccept: 1;
+	unsigned int sslticket: 1;
+	unsigned int openssl_async : 1;
+	unsigned int openssl_ktls : 1;
+	unsigned int certcomp : 1;
+	unsigned int connectlog_timings : 1;
+	unsigned int connectlog_tcpinfo : 1;
+	unsigned int connectlog_json : 1;
+	unsigned int connectlog_rollup;
+	unsigned int connectlog_sample;
+	char *ticketkeyfile;
+	unsigned int ticket_rotate;
+	int log_overflow[OPTS_LOG_MAX];
+	char *log_spilldir;
+	size_t log_membudget;
+	size_t outbuf_membudget;
+	unsigned int content_log_threads;
+	unsigned int log_compress : 1;
+	unsigned int log_flush_interval;
+	size_t log_prealloc;
+	size_t log_fsyncsz;
+	unsigned int log_fsync_close : 1;
+	unsigned int log_dropcache : 1;
+	size_t contentlog_segsz;
+	logrule_t *contentlog_rules;
+	size_t contentlog_limit;
+	size_t contentlog_maxfiles;
+	size_t contentlog_rec_sz;
+	size_t contentlog_rec_total;
+	logrule_t *contentlog_triggers;
+	acmatch_t *contentlog_match;
+	int thrsel;
+	unsigned int rebalance_interval;
+	int worker_threads;
+	int worker_procs;
+	size_t shcache_size;
+	unsigned int rcache_timeout;
+	int forge_threads;
+	unsigned int preforge_hosts;
+	unsigned int leafkey_pool;
+	unsigned int preconnect;
+	unsigned int http_upstream_pool;
+	size_t http_cache_size;
+	size_t http_cache_maxobj;
+	unsigned int overload_lag;
+	unsigned int pass_ttl;
+	bypass_t *bypass;
+	unsigned int accept_batch;
+	unsigned int timeout[OPTS_TIMEOUT_MAX];
+	admit_limits_t admit_global;
+	admit_limits_t admit_source;
+	unsigned int max_reneg;
+	int reneg_action;
+	unsigned int limit_passthrough : 1;
+	unsigned int speculate : 1;
+	unsigned int ocsp_staple : 1;
+	unsigned int chacha_prio : 1;
+	unsigned int forge_steal : 1;
+	unsigned int worker_libctx : 1;
+	size_t shape_rate;
+	size_t shape_burst;
+	size_t readahead;
+	size_t earlydata;
+	unsigned int stats_cputop;
+	unsigned int stats_tcptop;
+	unsigned int stats_lockprof : 1;
+	unsigned int stats_perf : 1;
+	int *worker_cpus;
+	int worker_cpus_count;
+	opts_workerpool_t workerpool[OPTS_WORKERPOOL_MAX];
+	int workerpool_count;
+	size_t fkcrt_maxentries;
+	size_t tgcrt_maxentries;
+	size_t fkcrt_maxbytes;
+	size_t ssess_maxentries;
+	size_t ssess_maxbytes;
+	size_t dsess_maxentries;
+	size_t dsess_maxbytes;
+	size_t dns_maxentries;
+	size_t sslctx_maxentries;
+	size_t vrfy_maxentries;
+	size_t sni_maxentries;
+	size_t pass_maxentries;
+	size_t ocsp_maxentries;
+	/* generation of the forged certificate cache, see opts_reload() */
+	unsigned int fkcrt_epoch;
+	/* generation of the SSL_CTX cache, see opts_reload() */
+	unsigned int sslctx_gen;
+	/* reference count, see opts_ref() */
+	unsigned int refs;
 } opts_t;
 
 void NORET oom_die(const char *) NONNULL(1);
+void NORET opts_fail(void);
+jmp_buf *opts_fail_catch(jmp_buf *);
 cert_t *opts_load_cert_chain_key(const char *) NONNULL(1);
 
 opts_t *opts_new(void) MALLOC;
 void opts_free(opts_t *) NONNULL(1);
+opts_t *opts_ref(opts_t *) NONNULL(1);
+void opts_unref(opts_t *) NONNULL(1);
+int opts_reload(opts_t *, opts_t *) NONNULL(1,2) WUNRES;
 int opts_has_ssl_spec(opts_t *) NONNULL(1) WUNRES;
+int opts_fktmpl_setup(opts_t *) NONNULL(1) WUNRES;
 int opts_has_dns_spec(opts_t *) NONNULL(1) WUNRES;
+int opts_has_pinned_threads(opts_t *) NONNULL(1) WUNRES;
 void opts_proto_dbg_dump(opts_t *) NONNULL(1);
 #define OPTS_DEBUG(opts) unlikely((opts)->debug)
 
@@ -145,8 +377,13 @@ void opts_set_cacrt(opts_t *, const char *, const char *) NONNULL(1,2,3);
 void opts_set_cakey(opts_t *, const char *, const char *) NONNULL(1,2,3);
 void opts_set_cachain(opts_t *, const char *, const char *) NONNULL(1,2,3);
 void opts_set_leafkey(opts_t *, const char *, const char *) NONNULL(1,2,3);
+void opts_set_eccacrt(opts_t *, const char *, const char *) NONNULL(1,2,3);
+void opts_set_eccakey(opts_t *, const char *, const char *) NONNULL(1,2,3);
+void opts_set_ecleafkey(opts_t *, const char *, const char *) NONNULL(1,2,3);
 void opts_set_leafcrlurl(opts_t *, const char *) NONNULL(1,2);
 void opts_set_leafcertdir(opts_t *, const char *, const char *) NONNULL(1,2,3);
+void opts_set_leafcertdir_index(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
 void opts_set_defaultleafcert(opts_t *, const char *, const char *)
      NONNULL(1,2,3);
 void opts_set_certgendir_writeall(opts_t *, const char *, const char *)
@@ -173,12 +410,46 @@ void opts_set_user(opts_t *, const char *, const char *) NONNULL(1,2,3);
 void opts_set_group(opts_t *, const char *, const char *) NONNULL(1,2,3);
 void opts_set_jaildir(opts_t *, const char *, const char *) NONNULL(1,2,3);
 void opts_set_pidfile(opts_t *, const char *, const char *) NONNULL(1,2,3);
+void opts_set_stats_socket(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+void opts_set_upgrade_socket(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+void opts_set_drain_timeout(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+void opts_set_stats_cputop(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+void opts_set_stats_tcptop(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+void opts_set_fkcrtstore(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+void opts_set_sessstore(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+void opts_set_sessstore_interval(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
 void opts_set_connectlog(opts_t *, const char *, const char *) NONNULL(1,2,3);
 void opts_set_contentlog(opts_t *, const char *, const char *) NONNULL(1,2,3);
 void opts_set_contentlogdir(opts_t *, const char *, const char *)
      NONNULL(1,2,3);
 void opts_set_contentlogpathspec(opts_t *, const char *, const char *)
      NONNULL(1,2,3);
+void opts_set_contentlogsegdir(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+void opts_set_contentlogdedupdir(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+void opts_set_contentlog_rule(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+void opts_set_contentlog_trigger(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+void opts_set_contentlog_match(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+void opts_set_huge_pages(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+void opts_set_log_compress(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+void opts_set_log_flush_interval(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+void opts_set_log_fsync(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
 #ifdef HAVE_LOCAL_PROCINFO
 void opts_set_lprocinfo(opts_t *) NONNULL(1);
 #endif /* HAVE_LOCAL_PROCINFO */
@@ -188,16 +459,88 @@ void opts_set_pcaplogdir(opts_t *, const char *, const char *)
      NONNULL(1,2,3);
 void opts_set_pcaplogpathspec(opts_t *, const char *, const char *)
      NONNULL(1,2,3);
+void opts_set_pcaplog_format(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+void opts_set_connectlog_format(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+void opts_set_connectlog_rollup(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+void opts_set_connectlog_sample(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
 #ifndef WITHOUT_MIRROR
 void opts_set_mirrorif(opts_t *, const char *, const char *) NONNULL(1,2,3);
 void opts_set_mirrortarget(opts_t *, const char *, const char *) NONNULL(1,2,3);
+void opts_set_mirror_chk_interval(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
 #endif /* !WITHOUT_MIRROR */
+void opts_set_contenttap(opts_t *, const char *, const char *) NONNULL(1,2,3);
+void opts_set_inspect(opts_t *, const char *, const char *) NONNULL(1,2,3);
+void opts_set_contentstream(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+void opts_set_thrsel(opts_t *, const char *, const char *) NONNULL(1,2,3);
+void opts_set_rebalance_interval(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+void opts_set_content_log_threads(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+void opts_set_worker_threads(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+void opts_set_worker_procs(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+void opts_set_rcache_servers(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+void opts_set_rcache_timeout(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+void opts_set_workerpool(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+void opts_set_worker_cpus(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+void opts_set_forge_threads(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+void opts_set_http_upstream_pool(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+void opts_set_preconnect(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+void opts_set_overload_lag(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+void opts_set_pass_ttl(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+void opts_set_bypass(opts_t *, const char *, const char *, int)
+     NONNULL(1,2,3);
+void opts_set_preforge_hosts(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+void opts_set_accept_batch(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+void opts_set_timeout(opts_t *, const char *, int, const char *)
+     NONNULL(1,2,4);
+const char * opts_timeout_str(int) WUNRES;
+void opts_set_admit_limit(opts_t *, const char *, int, const char *)
+     NONNULL(1,2,4);
+void opts_set_max_reneg(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+void opts_set_reneg_action(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+const char * opts_reneg_action_str(int) WUNRES;
+void opts_set_leafkey_type(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+void opts_set_leafkey_pool(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+void opts_set_ticketkeyfile(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+void opts_set_ticket_rotate(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+void opts_set_log_overflow(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+void opts_set_log_spilldir(opts_t *, const char *, const char *)
+     NONNULL(1,2,3);
+const char * opts_thrsel_str(int) WUNRES;
+const char * opts_log_overflow_str(int) WUNRES;
+size_t opts_parse_size(const char *, const char *, const char *)
+       NONNULL(1,2,3) WUNRES;
 void opts_set_daemon(opts_t *) NONNULL(1);
 void opts_set_debug(opts_t *) NONNULL(1);
-int opts_set_option(opts_t *, const char *, const char *, char **)
-    NONNULL(1,2,3);
+int opts_set_option(opts_t *, const char *, const char *) NONNULL(1,2,3);
 
-int load_conffile(opts_t *, const char *, char **) NONNULL(1,2);
+int load_conffile(opts_t *, const char *) NONNULL(1,2);
 #endif /* !OPTS_H */
 
 /* vim: set noet ft=c: */
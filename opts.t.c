@@ -28,16 +28,24 @@
 
 #include "attrib.h"
 #include "opts.h"
+#include "defaults.h"
 
 #include <check.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 
+#define LEAFKEY "extra/pki/server.key"
+
 static char *argv01[] = {
 	"https", "127.0.0.1", "10443", "127.0.0.2", "443"
 };
+static char *argv01b[] = {
+	"tcp", "127.0.0.1", "10444", "127.0.0.2", "443"
+};
 #ifndef TRAVIS
 static char *argv02[] = {
 	"https", "::1", "10443", "::2", "443"
@@ -89,6 +97,48 @@ static char *argv14[] = {
 	"https", "127.0.0.1", "10443",
 	"autossl", "127.0.0.1", "10025", "127.0.0.2", "25"
 };
+static char *argv15[] = {
+	"tcp", "127.0.0.1", "10080", "127.0.0.2", "80",
+	"timeout", "idle:300,connect:5,dormant:30",
+	"http", "127.0.0.1", "10081", "127.0.0.2", "81"
+};
+static char *argv16[] = {
+	"tcp", "127.0.0.1", "10080", "127.0.0.2", "80",
+	"timeout", "linger:5"
+};
+static char *argv17[] = {
+	"ssl", "127.0.0.1", "10443", "127.0.0.2", "443",
+	"limit", "conns:1000,rate:50", "timeout", "handshake:5,hello:2"
+};
+static char *argv18[] = {
+	"ssl", "127.0.0.1", "10443", "127.0.0.2", "443",
+	"limit", "conns:-1"
+};
+static char *argv19[] = {
+	"tcp", "127.0.0.1", "10080", "127.0.0.2", "80",
+	"shape", "rate:512k,burst:2M", "tcp", "127.0.0.1", "10081"
+};
+static char *argv20[] = {
+	"tcp", "127.0.0.1", "10080", "127.0.0.2", "80",
+	"shape", "rate:fast"
+};
+static char *argv21[] = {
+	"tcp", "127.0.0.1", "10080", "127.0.0.2", "80",
+	"pool", "isolated", "tcp", "127.0.0.1", "10081"
+};
+static char *argv22[] = {
+	"tcp", "127.0.0.1", "10080", "127.0.0.2", "80",
+	"source", "127.0.0.3,::1,127.0.0.4", "tcp", "127.0.0.1", "10081"
+};
+static char *argv23[] = {
+	"tcp", "127.0.0.1", "10080", "127.0.0.2", "80",
+	"source", "127.0.0.3,nonexistent.invalid"
+};
+static char *argv24[] = {
+	"ssl", "127.0.0.1", "10443", "127.0.0.2", "443",
+	"pool", "handshake", "fwdpool", "bulk",
+	"tcp", "127.0.0.1", "10081"
+};
 
 #ifdef __linux__
 #define NATENGINE "netfilter"
@@ -518,6 +568,177 @@ START_TEST(proxyspec_parse_18)
 }
 END_TEST
 
+START_TEST(proxyspec_parse_19)
+{
+	proxyspec_t *spec = NULL;
+	int argc = 12;
+	char **argv = argv15;
+
+	proxyspec_parse(&argc, &argv, NATENGINE, &spec);
+	fail_unless(!!spec, "failed to parse spec");
+	fail_unless(spec->http, "not HTTP");
+	for (int i = 0; i < OPTS_TIMEOUT_MAX; i++)
+		fail_unless(spec->timeout[i] == -1, "timeout set");
+	fail_unless(!!spec->next, "next is not set");
+	fail_unless(!spec->next->http, "HTTP");
+	fail_unless(spec->next->connect_addrlen == sizeof(struct sockaddr_in),
+	            "not IPv4 connect addr");
+	fail_unless(spec->next->timeout[OPTS_TIMEOUT_IDLE] == 300,
+	            "idle timeout not set");
+	fail_unless(spec->next->timeout[OPTS_TIMEOUT_CONNECT] == 5,
+	            "connect timeout not set");
+	fail_unless(spec->next->timeout[OPTS_TIMEOUT_HANDSHAKE] == -1,
+	            "handshake timeout set");
+	fail_unless(spec->next->timeout[OPTS_TIMEOUT_HEADER] == -1,
+	            "header timeout set");
+	fail_unless(spec->next->timeout[OPTS_TIMEOUT_DORMANT] == 30,
+	            "dormant timeout not set");
+	proxyspec_free(spec);
+}
+END_TEST
+
+START_TEST(proxyspec_parse_20)
+{
+	proxyspec_t *spec = NULL;
+	int argc = 7;
+	char **argv = argv16;
+
+	proxyspec_parse(&argc, &argv, NATENGINE, &spec);
+	if (spec)
+		proxyspec_free(spec);
+}
+END_TEST
+
+START_TEST(proxyspec_parse_21)
+{
+	proxyspec_t *spec = NULL;
+	int argc = 9;
+	char **argv = argv17;
+
+	proxyspec_parse(&argc, &argv, NATENGINE, &spec);
+	fail_unless(!!spec, "failed to parse spec");
+	fail_unless(spec->ssl, "not SSL");
+	fail_unless(spec->admit.conns == 1000, "conns limit not set");
+	fail_unless(spec->admit.rate == 50, "rate limit not set");
+	fail_unless(spec->timeout[OPTS_TIMEOUT_HANDSHAKE] == 5,
+	            "handshake timeout not set");
+	fail_unless(spec->timeout[OPTS_TIMEOUT_HELLO] == 2,
+	            "hello timeout not set");
+	fail_unless(!spec->next, "next is set");
+	proxyspec_free(spec);
+}
+END_TEST
+
+START_TEST(proxyspec_parse_22)
+{
+	proxyspec_t *spec = NULL;
+	int argc = 7;
+	char **argv = argv18;
+
+	proxyspec_parse(&argc, &argv, NATENGINE, &spec);
+	if (spec)
+		proxyspec_free(spec);
+}
+END_TEST
+
+START_TEST(proxyspec_parse_23)
+{
+	proxyspec_t *spec = NULL;
+	int argc = 10;
+	char **argv = argv19;
+
+	proxyspec_parse(&argc, &argv, NATENGINE, &spec);
+	fail_unless(!!spec, "failed to parse spec");
+	fail_unless(spec->shape_rate == -1, "shape rate set on 2nd spec");
+	fail_unless(spec->shape_burst == -1, "shape burst set on 2nd spec");
+	fail_unless(!!spec->next, "next is not set");
+	fail_unless(spec->next->shape_rate == 512 * 1024,
+	            "shape rate not set");
+	fail_unless(spec->next->shape_burst == 2 * 1024 * 1024,
+	            "shape burst not set");
+	proxyspec_free(spec);
+}
+END_TEST
+
+START_TEST(proxyspec_parse_24)
+{
+	proxyspec_t *spec = NULL;
+	int argc = 7;
+	char **argv = argv20;
+
+	proxyspec_parse(&argc, &argv, NATENGINE, &spec);
+	if (spec)
+		proxyspec_free(spec);
+}
+END_TEST
+
+START_TEST(proxyspec_parse_25)
+{
+	proxyspec_t *spec = NULL;
+	int argc = 10;
+	char **argv = argv21;
+
+	proxyspec_parse(&argc, &argv, NATENGINE, &spec);
+	fail_unless(!!spec, "failed to parse spec");
+	fail_unless(!spec->workerpool, "worker pool set on 2nd spec");
+	fail_unless(!!spec->next, "next is not set");
+	fail_unless(spec->next->workerpool &&
+	            !strcmp(spec->next->workerpool, "isolated"),
+	            "worker pool not set");
+	proxyspec_free(spec);
+}
+END_TEST
+
+START_TEST(proxyspec_parse_26)
+{
+	proxyspec_t *spec = NULL;
+	int argc = 10;
+	char **argv = argv22;
+
+	proxyspec_parse(&argc, &argv, NATENGINE, &spec);
+	fail_unless(!!spec, "failed to parse spec");
+	fail_unless(!spec->srcpool, "source pool set on 2nd spec");
+	fail_unless(!!spec->next, "next is not set");
+	fail_unless(spec->next->srcpool &&
+	            srcpool_size(spec->next->srcpool) == 3,
+	            "source pool not set");
+	proxyspec_free(spec);
+}
+END_TEST
+
+START_TEST(proxyspec_parse_27)
+{
+	proxyspec_t *spec = NULL;
+	int argc = 7;
+	char **argv = argv23;
+
+	proxyspec_parse(&argc, &argv, NATENGINE, &spec);
+	if (spec)
+		proxyspec_free(spec);
+}
+END_TEST
+
+START_TEST(proxyspec_parse_28)
+{
+	proxyspec_t *spec = NULL;
+	int argc = 12;
+	char **argv = argv24;
+
+	proxyspec_parse(&argc, &argv, NATENGINE, &spec);
+	fail_unless(!!spec, "failed to parse spec");
+	fail_unless(!spec->fwdpool, "forwarding pool set on 2nd spec");
+	fail_unless(spec->fwpool == -1, "forwarding pool index set");
+	fail_unless(!!spec->next, "next is not set");
+	fail_unless(spec->next->workerpool &&
+	            !strcmp(spec->next->workerpool, "handshake"),
+	            "worker pool not set");
+	fail_unless(spec->next->fwdpool &&
+	            !strcmp(spec->next->fwdpool, "bulk"),
+	            "forwarding pool not set");
+	proxyspec_free(spec);
+}
+END_TEST
+
 START_TEST(opts_debug_01)
 {
 	opts_t *opts;
@@ -533,6 +754,509 @@ START_TEST(opts_debug_01)
 }
 END_TEST
 
+START_TEST(opts_set_worker_cpus_01)
+{
+	opts_t *opts;
+
+	opts = opts_new();
+	opts_set_worker_cpus(opts, "sslsplit", "0-3,8,10-11");
+	fail_unless(opts->worker_cpus_count == 7, "wrong count");
+	fail_unless(opts->worker_cpus[0] == 0, "wrong cpu 0");
+	fail_unless(opts->worker_cpus[3] == 3, "wrong cpu 3");
+	fail_unless(opts->worker_cpus[4] == 8, "wrong cpu 4");
+	fail_unless(opts->worker_cpus[5] == 10, "wrong cpu 5");
+	fail_unless(opts->worker_cpus[6] == 11, "wrong cpu 6");
+	opts_set_worker_cpus(opts, "sslsplit", "5");
+	fail_unless(opts->worker_cpus_count == 1, "wrong count after reset");
+	fail_unless(opts->worker_cpus[0] == 5, "wrong cpu after reset");
+	opts_free(opts);
+}
+END_TEST
+
+START_TEST(opts_set_worker_cpus_02)
+{
+	opts_t *opts;
+
+	opts = opts_new();
+	opts_set_worker_cpus(opts, "sslsplit", "3-1");
+	opts_free(opts);
+}
+END_TEST
+
+START_TEST(opts_set_workerpool_01)
+{
+	opts_t *opts;
+
+	opts = opts_new();
+	opts_set_workerpool(opts, "sslsplit", "isolated 2 4-5,7");
+	opts_set_workerpool(opts, "sslsplit", "other 3");
+	fail_unless(opts->workerpool_count == 2, "wrong pool count");
+	fail_unless(!strcmp(opts->workerpool[0].name, "isolated"),
+	            "wrong name");
+	fail_unless(opts->workerpool[0].threads == 2, "wrong threads");
+	fail_unless(opts->workerpool[0].cpus_count == 3, "wrong cpu count");
+	fail_unless(opts->workerpool[0].cpus[2] == 7, "wrong cpu");
+	fail_unless(opts->workerpool[1].threads == 3, "wrong threads 2");
+	fail_unless(!opts->workerpool[1].cpus, "cpus set");
+	opts_free(opts);
+}
+END_TEST
+
+START_TEST(opts_set_workerpool_02)
+{
+	opts_t *opts;
+
+	opts = opts_new();
+	opts_set_workerpool(opts, "sslsplit", "isolated 2");
+	opts_set_workerpool(opts, "sslsplit", "isolated 3");
+	opts_free(opts);
+}
+END_TEST
+
+START_TEST(opts_parse_size_01)
+{
+	fail_unless(opts_parse_size("sslsplit", "Test", "0") == 0, "0");
+	fail_unless(opts_parse_size("sslsplit", "Test", "123") == 123, "123");
+	fail_unless(opts_parse_size("sslsplit", "Test", "2k") == 2048, "2k");
+	fail_unless(opts_parse_size("sslsplit", "Test", "3M") == 3145728,
+	            "3M");
+}
+END_TEST
+
+START_TEST(opts_parse_size_02)
+{
+	size_t sz;
+
+	sz = opts_parse_size("sslsplit", "Test", "12x");
+	fail_unless(sz == 0, "unreachable");
+}
+END_TEST
+
+START_TEST(opts_parse_size_03)
+{
+	size_t sz;
+
+	/* 2^84, wraps around to 0 if not checked before multiplying */
+	sz = opts_parse_size("sslsplit", "Test", "18014398509481984G");
+	fail_unless(sz == 0, "unreachable");
+}
+END_TEST
+
+START_TEST(opts_fail_catch_01)
+{
+	jmp_buf env;
+
+	if (setjmp(env)) {
+		opts_fail_catch(NULL);
+		return;
+	}
+	opts_fail_catch(&env);
+	fail_unless(!opts_parse_size("sslsplit", "Test", "12x"),
+	            "error not caught");
+	fail_unless(0, "error not caught");
+}
+END_TEST
+
+static int
+opts_t_count_fds(void)
+{
+	int n = 0;
+
+	for (int fd = 0; fd < 1024; fd++) {
+		if (fcntl(fd, F_GETFD) != -1)
+			n++;
+	}
+	return n;
+}
+
+/*
+ * Load the configuration file at path into a fresh opts_t the way reloading
+ * does.  Returns -1 if a configuration error was caught, 0 otherwise.
+ */
+static int
+opts_t_reload(const char *path)
+{
+	opts_t *opts;
+	jmp_buf env;
+
+	opts = opts_new();
+	opts->conffile = strdup(path);
+	if (setjmp(env)) {
+		fail_unless(opts_fail_catch(NULL) == &env,
+		            "catch not restored");
+		opts_free(opts);
+		return -1;
+	}
+	opts_fail_catch(&env);
+	fail_unless(load_conffile(opts, "sslsplit") == 0, "load failed");
+	opts_fail_catch(NULL);
+	opts_free(opts);
+	return 0;
+}
+
+START_TEST(opts_fail_catch_02)
+{
+	char path[] = "/tmp/sslsplit.test.XXXXXX";
+	FILE *f;
+	int fd, fds;
+
+	fd = mkstemp(path);
+	fail_unless(fd != -1, "mkstemp failed");
+	f = fdopen(fd, "w");
+	fprintf(f, "# invalid\nNATEngine test\nWorkerPool a 2 0-1\n"
+	           "WorkerPool b 2 1-0\n");
+	fclose(f);
+
+	fds = opts_t_count_fds();
+	for (int i = 0; i < 10; i++) {
+		fail_unless(opts_t_reload(path) == -1, "error not caught");
+	}
+	fail_unless(opts_t_count_fds() == fds, "leaked file descriptors");
+	unlink(path);
+}
+END_TEST
+
+START_TEST(opts_set_worker_threads_01)
+{
+	opts_t *opts;
+
+	opts = opts_new();
+	opts_set_worker_threads(opts, "sslsplit", "0");
+	opts_free(opts);
+}
+END_TEST
+
+START_TEST(opts_set_forge_threads_01)
+{
+	opts_t *opts;
+
+	opts = opts_new();
+	fail_unless(opts->forge_threads == DFLT_FORGE_THREADS,
+	            "wrong default");
+	opts_set_forge_threads(opts, "sslsplit", "0");
+	fail_unless(opts->forge_threads == 0, "not disabled");
+	opts_set_forge_threads(opts, "sslsplit", "8");
+	fail_unless(opts->forge_threads == 8, "wrong number of threads");
+	opts_free(opts);
+}
+END_TEST
+
+START_TEST(opts_set_content_log_threads_01)
+{
+	opts_t *opts;
+
+	opts = opts_new();
+	fail_unless(opts->content_log_threads == 1,
+	            "wrong default content log threads");
+	opts_set_content_log_threads(opts, "sslsplit", "8");
+	fail_unless(opts->content_log_threads == 8,
+	            "wrong content log threads");
+	opts_free(opts);
+}
+END_TEST
+
+START_TEST(opts_set_content_log_threads_02)
+{
+	opts_t *opts;
+
+	opts = opts_new();
+	opts_set_content_log_threads(opts, "sslsplit", "65");
+	opts_free(opts);
+}
+END_TEST
+
+START_TEST(opts_set_preforge_hosts_01)
+{
+	opts_t *opts;
+
+	opts = opts_new();
+	opts_set_preforge_hosts(opts, "sslsplit", "100k");
+	opts_free(opts);
+}
+END_TEST
+
+START_TEST(opts_set_forge_threads_02)
+{
+	opts_t *opts;
+
+	opts = opts_new();
+	opts_set_forge_threads(opts, "sslsplit", "-1");
+	opts_free(opts);
+}
+END_TEST
+
+START_TEST(opts_set_ticket_rotate_01)
+{
+	opts_t *opts;
+
+	opts = opts_new();
+	fail_unless(opts->ticket_rotate == DFLT_TICKET_ROTATE,
+	            "wrong default");
+	opts_set_ticket_rotate(opts, "sslsplit", "600");
+	fail_unless(opts->ticket_rotate == 600, "interval not set");
+	opts_set_ticket_rotate(opts, "sslsplit", "0");
+	fail_unless(opts->ticket_rotate == 0, "interval not disabled");
+	opts_free(opts);
+}
+END_TEST
+
+START_TEST(opts_set_ticket_rotate_02)
+{
+	opts_t *opts;
+
+	opts = opts_new();
+	opts_set_ticket_rotate(opts, "sslsplit", "1h");
+	opts_free(opts);
+}
+END_TEST
+
+START_TEST(opts_set_overload_lag_01)
+{
+	opts_t *opts;
+
+	opts = opts_new();
+	fail_unless(opts->overload_lag == 0, "wrong default");
+	opts_set_overload_lag(opts, "sslsplit", "250");
+	fail_unless(opts->overload_lag == 250, "lag not set");
+	opts_free(opts);
+}
+END_TEST
+
+START_TEST(opts_set_overload_lag_02)
+{
+	opts_t *opts;
+
+	opts = opts_new();
+	opts_set_overload_lag(opts, "sslsplit", "250ms");
+	opts_free(opts);
+}
+END_TEST
+
+START_TEST(opts_set_accept_batch_01)
+{
+	opts_t *opts;
+
+	opts = opts_new();
+	fail_unless(opts->accept_batch == 0, "wrong default");
+	opts_set_accept_batch(opts, "sslsplit", "64");
+	fail_unless(opts->accept_batch == 64, "batch size not set");
+	opts_free(opts);
+}
+END_TEST
+
+START_TEST(opts_set_accept_batch_02)
+{
+	opts_t *opts;
+
+	opts = opts_new();
+	opts_set_accept_batch(opts, "sslsplit", "4096");
+	opts_free(opts);
+}
+END_TEST
+
+START_TEST(opts_set_timeout_01)
+{
+	opts_t *opts;
+
+	opts = opts_new();
+	fail_unless(opts->timeout[OPTS_TIMEOUT_CONNECT] ==
+	            DFLT_CONNECT_TIMEOUT, "wrong connect default");
+	fail_unless(opts->timeout[OPTS_TIMEOUT_IDLE] == DFLT_IDLE_TIMEOUT,
+	            "wrong idle default");
+	opts_set_timeout(opts, "sslsplit", OPTS_TIMEOUT_IDLE, "600");
+	fail_unless(opts->timeout[OPTS_TIMEOUT_IDLE] == 600,
+	            "idle timeout not set");
+	opts_set_timeout(opts, "sslsplit", OPTS_TIMEOUT_HEADER, "0");
+	fail_unless(opts->timeout[OPTS_TIMEOUT_HEADER] == 0,
+	            "header timeout not disabled");
+	fail_unless(opts->timeout[OPTS_TIMEOUT_DORMANT] ==
+	            DFLT_DORMANT_TIMEOUT, "wrong dormant default");
+	opts_set_timeout(opts, "sslsplit", OPTS_TIMEOUT_DORMANT, "30");
+	fail_unless(opts->timeout[OPTS_TIMEOUT_DORMANT] == 30,
+	            "dormant timeout not set");
+	fail_unless(opts->timeout[OPTS_TIMEOUT_HELLO] == DFLT_HELLO_TIMEOUT,
+	            "wrong hello default");
+	opts_free(opts);
+}
+END_TEST
+
+START_TEST(opts_set_timeout_02)
+{
+	opts_t *opts;
+
+	opts = opts_new();
+	opts_set_timeout(opts, "sslsplit", OPTS_TIMEOUT_CONNECT, "30s");
+	opts_free(opts);
+}
+END_TEST
+
+START_TEST(opts_set_admit_limit_01)
+{
+	opts_t *opts;
+
+	opts = opts_new();
+	fail_unless(!admit_limited(&opts->admit_global), "global limited");
+	fail_unless(!admit_limited(&opts->admit_source), "source limited");
+	opts_set_admit_limit(opts, "sslsplit", OPTS_ADMIT_CONNS, "10000");
+	opts_set_admit_limit(opts, "sslsplit", OPTS_ADMIT_SRC_RATE, "20");
+	fail_unless(opts->admit_global.conns == 10000, "conns not set");
+	fail_unless(opts->admit_global.rate == 0, "rate set");
+	fail_unless(opts->admit_source.conns == 0, "source conns set");
+	fail_unless(opts->admit_source.rate == 20, "source rate not set");
+	opts_free(opts);
+}
+END_TEST
+
+START_TEST(opts_set_admit_limit_02)
+{
+	opts_t *opts;
+
+	opts = opts_new();
+	opts_set_admit_limit(opts, "sslsplit", OPTS_ADMIT_RATE, "many");
+	opts_free(opts);
+}
+END_TEST
+
+START_TEST(opts_set_reneg_01)
+{
+	opts_t *opts;
+
+	opts = opts_new();
+	fail_unless(opts->max_reneg == 0, "limited by default");
+	fail_unless(opts->reneg_action == OPTS_RENEG_REFUSE,
+	            "wrong default action");
+	opts_set_max_reneg(opts, "sslsplit", "3");
+	opts_set_reneg_action(opts, "sslsplit", "close");
+	fail_unless(opts->max_reneg == 3, "limit not set");
+	fail_unless(opts->reneg_action == OPTS_RENEG_CLOSE,
+	            "action not set");
+	fail_unless(!strcmp(opts_reneg_action_str(opts->reneg_action),
+	                    "close"), "wrong action name");
+	opts_free(opts);
+}
+END_TEST
+
+START_TEST(opts_set_reneg_02)
+{
+	opts_t *opts;
+
+	opts = opts_new();
+	opts_set_reneg_action(opts, "sslsplit", "ignore");
+	opts_free(opts);
+}
+END_TEST
+
+START_TEST(opts_set_log_overflow_01)
+{
+	opts_t *opts;
+
+	opts = opts_new();
+	fail_unless(opts->log_overflow[OPTS_LOG_CONTENT] ==
+	            LOGGER_OVERFLOW_BLOCK, "wrong default");
+	opts_set_log_overflow(opts, "sslsplit", "dropnewest");
+	for (int i = 0; i < OPTS_LOG_MAX; i++)
+		fail_unless(opts->log_overflow[i] ==
+		            LOGGER_OVERFLOW_DROPNEWEST, "policy not set");
+	opts_set_log_overflow(opts, "sslsplit", "content:spill");
+	fail_unless(opts->log_overflow[OPTS_LOG_CONTENT] ==
+	            LOGGER_OVERFLOW_SPILL, "content policy not set");
+	fail_unless(opts->log_overflow[OPTS_LOG_CONNECT] ==
+	            LOGGER_OVERFLOW_DROPNEWEST, "connect policy changed");
+	opts_set_log_overflow(opts, "sslsplit", "cert:dropoldest");
+	fail_unless(opts->log_overflow[OPTS_LOG_CERT] ==
+	            LOGGER_OVERFLOW_DROPOLDEST, "cert policy not set");
+	opts_free(opts);
+}
+END_TEST
+
+START_TEST(opts_set_log_overflow_02)
+{
+	opts_t *opts;
+
+	opts = opts_new();
+	opts_set_log_overflow(opts, "sslsplit", "contentlog:spill");
+	opts_free(opts);
+}
+END_TEST
+
+START_TEST(opts_set_log_overflow_03)
+{
+	opts_t *opts;
+
+	opts = opts_new();
+	opts_set_log_overflow(opts, "sslsplit", "content:discard");
+	opts_free(opts);
+}
+END_TEST
+
+START_TEST(opts_reload_01)
+{
+	opts_t *oldopts, *opts;
+	int argc;
+	char **argv;
+
+	oldopts = opts_new();
+	argc = 5;
+	argv = argv04;
+	proxyspec_parse(&argc, &argv, NATENGINE, &oldopts->spec);
+	oldopts->worker_threads = 4;
+	oldopts->connectlog = strdup("connect.log");
+	oldopts->leafkey = ssl_key_load(LEAFKEY);
+	oldopts->fkcrt_epoch = 3;
+	fail_unless(oldopts->spec && oldopts->connectlog && oldopts->leafkey,
+	            "setup failed");
+
+	/* same listen address, everything else differs */
+	opts = opts_new();
+	argc = 5;
+	argv = argv05;
+	proxyspec_parse(&argc, &argv, NATENGINE, &opts->spec);
+	opts->worker_threads = 8;
+	opts_set_passthrough(opts);
+	fail_unless(opts_reload(opts, oldopts) == 0, "reload failed");
+	fail_unless(!opts->spec->ssl, "proxyspec not reloaded");
+	fail_unless(opts->passthrough, "Passthrough not reloaded");
+	fail_unless(opts->worker_threads == 4, "WorkerThreads changed");
+	fail_unless(opts->connectlog &&
+	            !strcmp(opts->connectlog, "connect.log") &&
+	            opts->connectlog != oldopts->connectlog,
+	            "ConnectLog not kept");
+	fail_unless(opts->leafkey == oldopts->leafkey, "leaf key not kept");
+	fail_unless(opts->fkcrt_epoch == 3, "epoch not kept");
+	fail_unless(opts->sslctx_gen == oldopts->sslctx_gen + 1,
+	            "SSL_CTX generation not advanced");
+	opts_free(opts);
+	opts_free(oldopts);
+}
+END_TEST
+
+START_TEST(opts_reload_02)
+{
+	opts_t *oldopts, *opts;
+	int argc;
+	char **argv;
+
+	oldopts = opts_new();
+	argc = 5;
+	argv = argv05;
+	proxyspec_parse(&argc, &argv, NATENGINE, &oldopts->spec);
+
+	/* listen addresses cannot change */
+	opts = opts_new();
+	argc = 5;
+	argv = argv01b;
+	proxyspec_parse(&argc, &argv, NATENGINE, &opts->spec);
+	fail_unless(opts_reload(opts, oldopts) == -1, "reload succeeded");
+	opts_free(opts);
+
+	/* neither can the number of proxyspecs */
+	opts = opts_new();
+	fail_unless(opts_reload(opts, oldopts) == -1, "reload succeeded");
+	opts_free(opts);
+	opts_free(oldopts);
+}
+END_TEST
+
 Suite *
 opts_suite(void)
 {
@@ -571,6 +1295,103 @@ opts_suite(void)
 	tcase_add_exit_test(tc, proxyspec_parse_17, EXIT_FAILURE);
 #endif /* !DOCKER */
 	tcase_add_test(tc, proxyspec_parse_18);
+	tcase_add_test(tc, proxyspec_parse_19);
+#ifndef DOCKER
+	tcase_add_exit_test(tc, proxyspec_parse_20, EXIT_FAILURE);
+#endif /* !DOCKER */
+	tcase_add_test(tc, proxyspec_parse_21);
+#ifndef DOCKER
+	tcase_add_exit_test(tc, proxyspec_parse_22, EXIT_FAILURE);
+#endif /* !DOCKER */
+	tcase_add_test(tc, proxyspec_parse_23);
+#ifndef DOCKER
+	tcase_add_exit_test(tc, proxyspec_parse_24, EXIT_FAILURE);
+#endif /* !DOCKER */
+	tcase_add_test(tc, proxyspec_parse_25);
+	tcase_add_test(tc, proxyspec_parse_26);
+#ifndef DOCKER
+	tcase_add_exit_test(tc, proxyspec_parse_27, EXIT_FAILURE);
+#endif /* !DOCKER */
+	tcase_add_test(tc, proxyspec_parse_28);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("opts_set_worker");
+	tcase_add_test(tc, opts_set_worker_cpus_01);
+	tcase_add_test(tc, opts_set_workerpool_01);
+#ifndef DOCKER
+	tcase_add_exit_test(tc, opts_set_worker_cpus_02, EXIT_FAILURE);
+	tcase_add_exit_test(tc, opts_set_worker_threads_01, EXIT_FAILURE);
+	tcase_add_exit_test(tc, opts_set_workerpool_02, EXIT_FAILURE);
+	tcase_add_test(tc, opts_set_forge_threads_01);
+	tcase_add_exit_test(tc, opts_set_forge_threads_02, EXIT_FAILURE);
+	tcase_add_exit_test(tc, opts_set_preforge_hosts_01, EXIT_FAILURE);
+	tcase_add_test(tc, opts_set_content_log_threads_01);
+	tcase_add_exit_test(tc, opts_set_content_log_threads_02,
+	                    EXIT_FAILURE);
+#endif /* !DOCKER */
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("opts_set_ticket");
+	tcase_add_test(tc, opts_set_ticket_rotate_01);
+#ifndef DOCKER
+	tcase_add_exit_test(tc, opts_set_ticket_rotate_02, EXIT_FAILURE);
+#endif /* !DOCKER */
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("opts_set_overload_lag");
+	tcase_add_test(tc, opts_set_overload_lag_01);
+#ifndef DOCKER
+	tcase_add_exit_test(tc, opts_set_overload_lag_02, EXIT_FAILURE);
+#endif /* !DOCKER */
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("opts_set_accept_batch");
+	tcase_add_test(tc, opts_set_accept_batch_01);
+#ifndef DOCKER
+	tcase_add_exit_test(tc, opts_set_accept_batch_02, EXIT_FAILURE);
+#endif /* !DOCKER */
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("opts_set_timeout");
+	tcase_add_test(tc, opts_set_timeout_01);
+#ifndef DOCKER
+	tcase_add_exit_test(tc, opts_set_timeout_02, EXIT_FAILURE);
+#endif /* !DOCKER */
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("opts_set_admit_limit");
+	tcase_add_test(tc, opts_set_admit_limit_01);
+#ifndef DOCKER
+	tcase_add_exit_test(tc, opts_set_admit_limit_02, EXIT_FAILURE);
+	tcase_add_test(tc, opts_set_reneg_01);
+	tcase_add_exit_test(tc, opts_set_reneg_02, EXIT_FAILURE);
+#endif /* !DOCKER */
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("opts_set_log_overflow");
+	tcase_add_test(tc, opts_set_log_overflow_01);
+#ifndef DOCKER
+	tcase_add_exit_test(tc, opts_set_log_overflow_02, EXIT_FAILURE);
+	tcase_add_exit_test(tc, opts_set_log_overflow_03, EXIT_FAILURE);
+#endif /* !DOCKER */
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("opts_parse_size");
+	tcase_add_test(tc, opts_parse_size_01);
+#ifndef DOCKER
+	tcase_add_exit_test(tc, opts_parse_size_02, EXIT_FAILURE);
+	tcase_add_exit_test(tc, opts_parse_size_03, EXIT_FAILURE);
+#endif /* !DOCKER */
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("opts_fail_catch");
+	tcase_add_test(tc, opts_fail_catch_01);
+	tcase_add_test(tc, opts_fail_catch_02);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("opts_reload");
+	tcase_add_test(tc, opts_reload_01);
+	tcase_add_test(tc, opts_reload_02);
 	suite_add_tcase(s, tc);
 
 	tc = tcase_create("opts_debug");
@@ -578,7 +1399,7 @@ opts_suite(void)
 	suite_add_tcase(s, tc);
 
 #ifdef DOCKER
-	fprintf(stderr, "opts: 6 tests omitted because building in docker\n");
+	fprintf(stderr, "opts: 13 tests omitted because building in docker\n");
 #endif
 #ifdef TRAVIS
 	fprintf(stderr, "opts: 3 tests omitted because building in travis\n");
@@ -0,0 +1,191 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "perfctr.h"
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+#endif /* __linux__ */
+
+/*
+ * Hardware performance counters of the calling thread, using perf_event_open
+ * on Linux.  All counters are opened as one group led by the task clock, so
+ * that a single read returns a consistent snapshot of all of them, and so
+ * that they are scheduled onto the PMU together.  Counters the CPU or the
+ * kernel does not provide, as is common in virtual machines, are left out
+ * of the group and read as zero.
+ *
+ * If kernel.perf_event_paranoid does not allow counting kernel events, the
+ * hardware counters fall back to counting user space only, and context
+ * switches, which only ever happen in the kernel, are not counted at all.
+ *
+ * The counters keep counting after the thread exits, and can be read from
+ * any thread of the process.
+ */
+
+struct perfctr {
+	int fd;			/* group leader */
+	int nslots;
+	int slot[PERFCTR_N];	/* counter of each value in the group read */
+	int member[PERFCTR_N];
+};
+
+#ifdef __linux__
+static const struct {
+	uint32_t type;
+	uint64_t config;
+	int kernel;		/* only meaningful when counting the kernel */
+} perfctr_event[PERFCTR_N] = {
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, 0},
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, 0},
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, 0},
+	{PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, 1},
+	{PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, 0},
+};
+
+/*
+ * Open counter i for the calling thread in the group led by group, or as a
+ * new group leader if group is -1.  Returns the file descriptor, or -1 with
+ * errno set.
+ */
+static int
+perfctr_open_event(int i, int group)
+{
+	struct perf_event_attr attr;
+	int fd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = perfctr_event[i].type;
+	attr.config = perfctr_event[i].config;
+	attr.read_format = PERF_FORMAT_GROUP;
+	attr.exclude_hv = 1;
+	fd = syscall(SYS_perf_event_open, &attr, 0, -1, group,
+	             PERF_FLAG_FD_CLOEXEC);
+	if (fd == -1 && (errno == EACCES || errno == EPERM) &&
+	    !perfctr_event[i].kernel) {
+		attr.exclude_kernel = 1;
+		fd = syscall(SYS_perf_event_open, &attr, 0, -1, group,
+		             PERF_FLAG_FD_CLOEXEC);
+	}
+	return fd;
+}
+#endif /* __linux__ */
+
+/*
+ * Start counting on the calling thread.
+ * Returns NULL with errno set if performance counters are not available,
+ * with ENOTSUP on platforms other than Linux.
+ */
+perfctr_t *
+perfctr_open(void)
+{
+#ifdef __linux__
+	perfctr_t *pc;
+	int fd;
+
+	if (!(pc = malloc(sizeof(perfctr_t))))
+		return NULL;
+	memset(pc, 0, sizeof(perfctr_t));
+	for (int i = 0; i < PERFCTR_N; i++)
+		pc->member[i] = -1;
+	if ((pc->fd = perfctr_open_event(PERFCTR_TASK_CLOCK, -1)) == -1) {
+		free(pc);
+		return NULL;
+	}
+	pc->slot[pc->nslots++] = PERFCTR_TASK_CLOCK;
+	pc->member[PERFCTR_TASK_CLOCK] = pc->fd;
+	for (int i = 0; i < PERFCTR_N; i++) {
+		if (i == PERFCTR_TASK_CLOCK)
+			continue;
+		if ((fd = perfctr_open_event(i, pc->fd)) == -1)
+			continue;
+		pc->slot[pc->nslots++] = i;
+		pc->member[i] = fd;
+	}
+	return pc;
+#else /* !__linux__ */
+	errno = ENOTSUP;
+	return NULL;
+#endif /* !__linux__ */
+}
+
+/*
+ * Returns 1 if counter i is counted, 0 if not.
+ */
+int
+perfctr_avail(perfctr_t *pc, int i)
+{
+	return pc->member[i] != -1;
+}
+
+/*
+ * Read all counters into v, which must have room for PERFCTR_N values.
+ * Counters which are not available read as zero.
+ * Returns 0 on success, -1 on failure.
+ */
+int
+perfctr_read(perfctr_t *pc, unsigned long long *v)
+{
+	uint64_t buf[1 + PERFCTR_N];
+	ssize_t n;
+
+	n = read(pc->fd, buf, sizeof(buf));
+	if (n < (ssize_t)sizeof(uint64_t) ||
+	    n < (ssize_t)((1 + buf[0]) * sizeof(uint64_t)) ||
+	    buf[0] != (uint64_t)pc->nslots)
+		return -1;
+	memset(v, 0, PERFCTR_N * sizeof(unsigned long long));
+	for (int i = 0; i < pc->nslots; i++)
+		v[pc->slot[i]] = buf[1 + i];
+	return 0;
+}
+
+/*
+ * Stop counting and release all resources.
+ */
+void
+perfctr_close(perfctr_t *pc)
+{
+	for (int i = 0; i < PERFCTR_N; i++) {
+		if (pc->member[i] != -1)
+			close(pc->member[i]);
+	}
+	free(pc);
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,54 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PERFCTR_H
+#define PERFCTR_H
+
+#include "attrib.h"
+
+/*
+ * Counters collected per thread.  PERFCTR_TASK_CLOCK is the time the thread
+ * was running, in nanoseconds.
+ */
+#define PERFCTR_CYCLES		0
+#define PERFCTR_INSTRUCTIONS	1
+#define PERFCTR_CACHE_MISSES	2
+#define PERFCTR_CTX_SWITCHES	3
+#define PERFCTR_TASK_CLOCK	4
+#define PERFCTR_N		5
+
+typedef struct perfctr perfctr_t;
+
+perfctr_t * perfctr_open(void) MALLOC WUNRES;
+int perfctr_avail(perfctr_t *, int) NONNULL(1) WUNRES;
+int perfctr_read(perfctr_t *, unsigned long long *) NONNULL(1,2) WUNRES;
+void perfctr_close(perfctr_t *) NONNULL(1);
+
+#endif /* !PERFCTR_H */
+
+/* vim: set noet ft=c: */
@@ -33,9 +33,12 @@
 #include "log.h"
 #include "attrib.h"
 #include "defaults.h"
+#include "usdt.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <sys/select.h>
 #include <sys/wait.h>
 #include <netinet/in.h>
@@ -47,6 +50,10 @@
 #include <errno.h>
 #include <libgen.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <event2/event.h>
 
 
 /*
@@ -56,15 +63,25 @@
  * used, namely only those that are initialized before forking.
  */
 
+/*
+ * Messages start with a command or response byte followed by a request ID,
+ * which the server echoes in its answer.  Requests carry their argument
+ * after the header, answers an errno value for PRIVSEP_ANS_SYS_ERR.
+ */
+#define PRIVSEP_HDR_SIZE	(1+sizeof(uint32_t))
 /* maximal message sizes */
 #define PRIVSEP_MAX_REQ_SIZE	512	/* arbitrary limit */
-#define PRIVSEP_MAX_ANS_SIZE	(1+sizeof(int))
+#define PRIVSEP_MAX_ANS_SIZE	(PRIVSEP_HDR_SIZE+sizeof(int))
 /* command byte */
 #define PRIVSEP_REQ_CLOSE	0	/* closing command socket */
 #define PRIVSEP_REQ_OPENFILE	1	/* open content log file */
 #define PRIVSEP_REQ_OPENFILE_P	2	/* open content log file w/mkpath */
 #define PRIVSEP_REQ_OPENSOCK	3	/* open socket and pass fd */
 #define PRIVSEP_REQ_CERTFILE	4	/* open cert file in certgendir */
+#define PRIVSEP_REQ_OPENSOCK_R	5	/* open socket w/reuseport, pass fd */
+#define PRIVSEP_REQ_OPENDIR	6	/* open content log directory */
+#define PRIVSEP_REQ_OPENSTATS	7	/* open stats socket and pass fd */
+#define PRIVSEP_REQ_OPENUPGRADE	8	/* open upgrade socket and pass fd */
 
 /* response byte */
 #define PRIVSEP_ANS_SUCCESS	0	/* success */
@@ -81,6 +98,7 @@
  * In the current implementation, for consistency, we still fork normally, but
  * will not actually send any privsep requests to the parent process. */
 static int privsep_fastpath;
+static int privsep_worker_idx;
 
 /* communication with signal handler */
 static volatile sig_atomic_t received_sighup;
@@ -89,6 +107,8 @@ static volatile sig_atomic_t received_sigquit;
 static volatile sig_atomic_t received_sigterm;
 static volatile sig_atomic_t received_sigchld;
 static volatile sig_atomic_t received_sigusr1;
+static volatile sig_atomic_t received_sigusr2;
+static volatile sig_atomic_t received_sigurg;
 /* write end of pipe used for unblocking select */
 static volatile sig_atomic_t selfpipe_wrfd;
 
@@ -122,6 +142,12 @@ privsep_server_signal_handler(int sig)
 	case SIGUSR1:
 		received_sigusr1 = 1;
 		break;
+	case SIGUSR2:
+		received_sigusr2 = 1;
+		break;
+	case SIGURG:
+		received_sigurg = 1;
+		break;
 	}
 	if (selfpipe_wrfd != -1) {
 		ssize_t n;
@@ -156,6 +182,10 @@ privsep_server_openfile_verify(opts_t *opts, const char *fn, UNUSED int mkpath)
 			               : opts->contentlog) == fn)
 				break;
 		}
+		if (opts->contentlog_dedupdir) {
+			if (strstr(fn, opts->contentlog_dedupdir) == fn)
+				break;
+		}
 		if (opts->pcaplog) {
 			if (strstr(fn, opts->pcaplog_isspec
 			               ? opts->pcaplog_basedir
@@ -185,7 +215,9 @@ privsep_server_openfile(const char *fn, int mkpath)
 {
 	int fd, tmp;
 
-	if (mkpath) {
+	/* only create missing directories if opening the file fails */
+	fd = open(fn, O_RDWR|O_CREAT, DFLT_FILEMODE);
+	if (fd == -1 && mkpath && errno == ENOENT) {
 		char *filedir, *fn2;
 
 		fn2 = strdup(fn);
@@ -214,9 +246,8 @@ privsep_server_openfile(const char *fn, int mkpath)
 			return -1;
 		}
 		free(fn2);
+		fd = open(fn, O_RDWR|O_CREAT, DFLT_FILEMODE);
 	}
-
-	fd = open(fn, O_RDWR|O_CREAT, DFLT_FILEMODE);
 	if (fd == -1) {
 		tmp = errno;
 		log_err_printf("Failed to open '%s': %s (%i)\n",
@@ -247,7 +278,7 @@ privsep_server_opensock_verify(opts_t *opts, void *arg)
 }
 
 static int WUNRES
-privsep_server_opensock(const proxyspec_t *spec)
+privsep_server_opensock(const proxyspec_t *spec, int reuseport)
 {
 	evutil_socket_t fd;
 	int on = 1;
@@ -285,6 +316,24 @@ privsep_server_opensock(const proxyspec_t *spec)
 		return -1;
 	}
 
+	if (reuseport) {
+#ifdef SO_REUSEPORT
+		rv = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT,
+		                (void*)&on, sizeof(on));
+		if (rv == -1) {
+			log_err_printf("Error from setsockopt(SO_REUSEPORT): "
+			               "%s (%i)\n", strerror(errno), errno);
+			evutil_closesocket(fd);
+			return -1;
+		}
+#else /* !SO_REUSEPORT */
+		log_err_printf("SO_REUSEPORT not supported on this platform\n");
+		evutil_closesocket(fd);
+		errno = ENOTSUP;
+		return -1;
+#endif /* !SO_REUSEPORT */
+	}
+
 	if (spec->natsocket && (spec->natsocket(fd) == -1)) {
 		log_err_printf("Error from spec->natsocket()\n");
 		evutil_closesocket(fd);
@@ -302,6 +351,133 @@ privsep_server_opensock(const proxyspec_t *spec)
 	return fd;
 }
 
+/*
+ * Create and bind a Unix domain socket at path.  A stale socket left behind
+ * by a previous instance is removed first.  If shared is set, the socket is
+ * made accessible to the user and group privileges are dropped to, such that
+ * a scraper can be given access through group membership; otherwise it is
+ * only accessible to the user sslsplit was started as.
+ */
+static int WUNRES
+privsep_server_openunix(opts_t *opts, const char *path, int shared)
+{
+	struct sockaddr_un sun;
+	struct stat st;
+	mode_t mask;
+	uid_t uid = (uid_t)-1;
+	gid_t gid = (gid_t)-1;
+	int fd, rv, tmp;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		log_err_printf("Socket path too long: %s\n", path);
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
+		log_err_printf("Error from socket(): %s (%i)\n",
+		               strerror(errno), errno);
+		return -1;
+	}
+	if (evutil_make_socket_nonblocking(fd) == -1) {
+		tmp = errno;
+		log_err_printf("Error making socket nonblocking: %s (%i)\n",
+		               strerror(errno), errno);
+		close(fd);
+		errno = tmp;
+		return -1;
+	}
+	mask = umask(shared ? 0117 : 0177);
+	rv = bind(fd, (struct sockaddr *)&sun, sizeof(sun));
+	tmp = errno;
+	umask(mask);
+	if (rv == -1) {
+		log_err_printf("Error from bind('%s'): %s (%i)\n",
+		               path, strerror(tmp), tmp);
+		close(fd);
+		errno = tmp;
+		return -1;
+	}
+	if (!shared)
+		return fd;
+	if (opts->dropuser && sys_uid(opts->dropuser, &uid) == -1)
+		uid = (uid_t)-1;
+	if (opts->dropgroup && sys_gid(opts->dropgroup, &gid) == -1)
+		gid = (gid_t)-1;
+	if ((uid != (uid_t)-1 || gid != (gid_t)-1) &&
+	    chown(path, uid, gid) == -1) {
+		log_err_printf("Warning: Failed to chown socket '%s': "
+		               "%s (%i)\n", path, strerror(errno), errno);
+	}
+	return fd;
+}
+
+/*
+ * Create and bind the stats socket of worker process worker, accessible to
+ * the dropped privileges, or the upgrade socket, only accessible to the
+ * privileged user, since it hands out the listener sockets.  Worker
+ * processes other than the first append their index to the stats socket
+ * path.
+ */
+static int WUNRES
+privsep_server_openstats(opts_t *opts, int worker)
+{
+	char path[strlen(opts->stats_socket) + 16];
+
+	if (worker == 0)
+		return privsep_server_openunix(opts, opts->stats_socket, 1);
+	snprintf(path, sizeof(path), "%s.%d", opts->stats_socket, worker);
+	return privsep_server_openunix(opts, path, 1);
+}
+
+static int WUNRES
+privsep_server_openupgrade(opts_t *opts)
+{
+	return privsep_server_openunix(opts, opts->upgrade_socket, 0);
+}
+
+static int WUNRES
+privsep_server_opendir_verify(opts_t *opts, const char *dn)
+{
+	/* Must be the directory of a per-connection or segmented content
+	 * log, or of the chunk store of a deduplicated content log. */
+	if (opts->contentlog_isdir && !strcmp(dn, opts->contentlog))
+		return 0;
+	if (opts->contentlog_isspec && !strcmp(dn, opts->contentlog_basedir))
+		return 0;
+	if (opts->contentlog_isseg && !strcmp(dn, opts->contentlog))
+		return 0;
+	if (opts->contentlog_dedupdir &&
+	    !strcmp(dn, opts->contentlog_dedupdir))
+		return 0;
+	if (opts->pcaplog_isdir && !strcmp(dn, opts->pcaplog))
+		return 0;
+	if (opts->pcaplog_isspec && !strcmp(dn, opts->pcaplog_basedir))
+		return 0;
+	return -1;
+}
+
+static int WUNRES
+privsep_server_opendir(const char *dn)
+{
+	int fd;
+
+	fd = open(dn, O_RDONLY|O_DIRECTORY);
+	if (fd == -1) {
+		log_err_printf("Failed to open directory '%s': %s (%i)\n",
+		               dn, strerror(errno), errno);
+		return -1;
+	}
+	return fd;
+}
+
 static int WUNRES
 privsep_server_certfile_verify(opts_t *opts, const char *fn)
 {
@@ -327,16 +503,249 @@ privsep_server_certfile(const char *fn)
 }
 
 /*
- * Handle a single request on a readable server socket.
- * Returns 0 on success, 1 on EOF and -1 on error.
+ * Send answer code for request id, with errno err for PRIVSEP_ANS_SYS_ERR
+ * and file descriptor fd unless -1.
+ * Returns -1 on failure, 0 on success.
  */
 static int WUNRES
-privsep_server_handle_req(opts_t *opts, int srvsock)
+privsep_server_answer(int srvsock, uint32_t id, char code, int err, int fd)
 {
-	char req[PRIVSEP_MAX_REQ_SIZE];
 	char ans[PRIVSEP_MAX_ANS_SIZE];
+
+	ans[0] = code;
+	memcpy(ans + 1, &id, sizeof(id));
+	memcpy(ans + PRIVSEP_HDR_SIZE, &err, sizeof(err));
+	if (sys_sendmsgfd(srvsock, ans, sizeof(ans), fd) == -1) {
+		log_err_printf("Sending message failed: %s (%i)\n",
+		               strerror(errno), errno);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Copy the file name argument of a request into fn.
+ * Returns NULL if the argument is empty.
+ */
+static char *
+privsep_server_fn(const char *arg, size_t argsz, char *fn)
+{
+	if (argsz < 1)
+		return NULL;
+	memcpy(fn, arg, argsz);
+	fn[argsz] = '\0';
+	return fn;
+}
+
+/*
+ * Perform the filesystem operation of request cmd on the verified path fn.
+ * May block for a long time on slow or network filesystems.
+ * Returns the file descriptor, or -1 with errno set.
+ */
+static int WUNRES
+privsep_server_fsop(char cmd, const char *fn)
+{
+	switch (cmd) {
+	case PRIVSEP_REQ_OPENFILE_P:
+		return privsep_server_openfile(fn, 1);
+	case PRIVSEP_REQ_OPENFILE:
+		return privsep_server_openfile(fn, 0);
+	case PRIVSEP_REQ_CERTFILE:
+		return privsep_server_certfile(fn);
+	case PRIVSEP_REQ_OPENDIR:
+		return privsep_server_opendir(fn);
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+}
+
+/*
+ * Perform the filesystem operation of request id and answer it.
+ * Returns -1 on failure, 0 on success.
+ */
+static int WUNRES
+privsep_server_fsop_answer(int srvsock, uint32_t id, char cmd, const char *fn)
+{
+	int fd, err, rv;
+
+	fd = privsep_server_fsop(cmd, fn);
+	err = (fd == -1) ? errno : 0;
+	rv = privsep_server_answer(srvsock, id, (fd == -1) ?
+	                           PRIVSEP_ANS_SYS_ERR : PRIVSEP_ANS_SUCCESS,
+	                           err, fd);
+	if (fd != -1)
+		close(fd);
+	return rv;
+}
+
+/*
+ * Pool of threads performing the filesystem operations of verified requests,
+ * such that an open(2) blocking on a slow filesystem for one log file does
+ * not hold up the requests of all other client threads and processes.  The
+ * main loop receives, verifies and queues requests; the threads answer them
+ * directly on the server socket the request came in on, out of order.  This
+ * is safe since the server sockets are datagram sockets and the clients
+ * match answers to requests by request ID.  All other requests are cheap and
+ * handled by the main loop itself.
+ */
+#define PRIVSEP_SERVER_THREADS	4
+
+typedef struct privsep_server_job {
+	struct privsep_server_job *next;
+	int srvsock;
+	uint32_t id;
+	char cmd;
+	char fn[];
+} privsep_server_job_t;
+
+typedef struct privsep_server_pool {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	privsep_server_job_t *head;
+	privsep_server_job_t **tail;
+	int quit;
+	size_t nthr;
+	pthread_t thr[PRIVSEP_SERVER_THREADS];
+} privsep_server_pool_t;
+
+static privsep_server_pool_t privsep_server_pool = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void *
+privsep_server_thread(UNUSED void *arg)
+{
+	privsep_server_pool_t *pool = &privsep_server_pool;
+	privsep_server_job_t *job;
+
+	pthread_mutex_lock(&pool->mutex);
+	for (;;) {
+		while (!pool->head && !pool->quit)
+			pthread_cond_wait(&pool->cond, &pool->mutex);
+		if (pool->quit)
+			break;
+		job = pool->head;
+		pool->head = job->next;
+		if (!pool->head)
+			pool->tail = &pool->head;
+		pthread_mutex_unlock(&pool->mutex);
+		if (privsep_server_fsop_answer(job->srvsock, job->id,
+		                               job->cmd, job->fn) == -1) {
+			log_err_printf("Failed to answer privsep req "
+			               "on srvsock %i\n", job->srvsock);
+		}
+		free(job);
+		pthread_mutex_lock(&pool->mutex);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return NULL;
+}
+
+/*
+ * Start the threads of the pool with all signals blocked, leaving signal
+ * handling to the main loop.  If no thread can be started, the main loop
+ * performs the filesystem operations itself.
+ */
+static void
+privsep_server_pool_start(void)
+{
+	privsep_server_pool_t *pool = &privsep_server_pool;
+	sigset_t all, old;
+
+	pool->head = NULL;
+	pool->tail = &pool->head;
+	pool->quit = 0;
+	pool->nthr = 0;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	while (pool->nthr < PRIVSEP_SERVER_THREADS) {
+		if (pthread_create(&pool->thr[pool->nthr], NULL,
+		                   privsep_server_thread, NULL) != 0) {
+			log_err_printf("Failed to start privsep server "
+			               "thread, continuing with %zu\n",
+			               pool->nthr);
+			break;
+		}
+		pool->nthr++;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * Stop the threads of the pool, waiting for the operations in progress to
+ * complete, and drop requests not started yet.
+ */
+static void
+privsep_server_pool_stop(void)
+{
+	privsep_server_pool_t *pool = &privsep_server_pool;
+	privsep_server_job_t *job;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+	for (size_t i = 0; i < pool->nthr; i++)
+		pthread_join(pool->thr[i], NULL);
+	pool->nthr = 0;
+	while ((job = pool->head)) {
+		pool->head = job->next;
+		free(job);
+	}
+	pool->tail = &pool->head;
+}
+
+/*
+ * Queue the filesystem operation of verified request id for the pool, or
+ * perform it right away if there is no pool.
+ * Returns -1 on failure, 0 on success.
+ */
+static int WUNRES
+privsep_server_fsop_submit(int srvsock, uint32_t id, char cmd, const char *fn)
+{
+	privsep_server_pool_t *pool = &privsep_server_pool;
+	privsep_server_job_t *job;
+	size_t sz = strlen(fn) + 1;
+
+	if (!pool->nthr || !(job = malloc(sizeof(*job) + sz)))
+		return privsep_server_fsop_answer(srvsock, id, cmd, fn);
+	job->next = NULL;
+	job->srvsock = srvsock;
+	job->id = id;
+	job->cmd = cmd;
+	memcpy(job->fn, fn, sz);
+	pthread_mutex_lock(&pool->mutex);
+	*pool->tail = job;
+	pool->tail = &job->next;
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+	return 0;
+}
+
+/*
+ * Handle a single request on a readable server socket of worker process
+ * worker.  Filesystem operations are handed to the pool once verified and
+ * answered from there.  Returns 0 on success, 1 on EOF and -1 on error.
+ */
+static int WUNRES
+privsep_server_handle_req(opts_t *opts, int srvsock, int worker)
+{
+	char req[PRIVSEP_MAX_REQ_SIZE];
+	char fnbuf[PRIVSEP_MAX_REQ_SIZE];
+	char code = PRIVSEP_ANS_SUCCESS;
+	const char *arg;
+	size_t argsz;
+	uint32_t id;
 	ssize_t n;
+	char *fn;
 	int mkpath = 0;
+	int reuseport = 0;
+	int fsop = 0;
+	int fd = -1;
+	int err = 0;
+	int rv;
 
 	if ((n = sys_recvmsgfd(srvsock, req, sizeof(req),
 	                       NULL)) == -1) {
@@ -354,192 +763,113 @@ privsep_server_handle_req(opts_t *opts, int srvsock)
 	}
 	log_dbg_printf("Received privsep req type %02x sz %zd on srvsock %i\n",
 	               req[0], n, srvsock);
-	switch (req[0]) {
-	case PRIVSEP_REQ_CLOSE: {
+	USDT_PROBE2(privsep__request, req[0], (long)n);
+	if (req[0] == PRIVSEP_REQ_CLOSE) {
 		/* client indicates EOF through close message */
 		return 1;
 	}
+	if (n < (ssize_t)PRIVSEP_HDR_SIZE) {
+		return privsep_server_answer(srvsock, 0, PRIVSEP_ANS_INVALID,
+		                             0, -1);
+	}
+	memcpy(&id, req + 1, sizeof(id));
+	arg = req + PRIVSEP_HDR_SIZE;
+	argsz = n - PRIVSEP_HDR_SIZE;
+
+	switch (req[0]) {
 	case PRIVSEP_REQ_OPENFILE_P:
 		mkpath = 1;
 		/* fall through */
-	case PRIVSEP_REQ_OPENFILE: {
-		char *fn;
-		int fd;
-
-		if (n < 2) {
-			ans[0] = PRIVSEP_ANS_INVALID;
-			if (sys_sendmsgfd(srvsock, ans, 1, -1) == -1) {
-				log_err_printf("Sending message failed: %s (%i"
-				               ")\n", strerror(errno), errno);
-				return -1;
-			}
-		}
-		if (!(fn = malloc(n))) {
-			ans[0] = PRIVSEP_ANS_SYS_ERR;
-			*((int*)&ans[1]) = errno;
-			if (sys_sendmsgfd(srvsock, ans, 1 + sizeof(int),
-			                  -1) == -1) {
-				log_err_printf("Sending message failed: %s (%i"
-				               ")\n", strerror(errno), errno);
-				return -1;
-			}
-			return 0;
-		}
-		memcpy(fn, req + 1, n - 1);
-		fn[n - 1] = '\0';
-		if (privsep_server_openfile_verify(opts, fn, mkpath) == -1) {
-			free(fn);
-			ans[0] = PRIVSEP_ANS_DENIED;
-			if (sys_sendmsgfd(srvsock, ans, 1, -1) == -1) {
-				log_err_printf("Sending message failed: %s (%i"
-				               ")\n", strerror(errno), errno);
-				return -1;
-			}
-			return 0;
-		}
-		if ((fd = privsep_server_openfile(fn, mkpath)) == -1) {
-			free(fn);
-			ans[0] = PRIVSEP_ANS_SYS_ERR;
-			*((int*)&ans[1]) = errno;
-			if (sys_sendmsgfd(srvsock, ans, 1 + sizeof(int),
-			                  -1) == -1) {
-				log_err_printf("Sending message failed: %s (%i"
-				               ")\n", strerror(errno), errno);
-				return -1;
-			}
-			return 0;
+	case PRIVSEP_REQ_OPENFILE:
+		if (!(fn = privsep_server_fn(arg, argsz, fnbuf))) {
+			code = PRIVSEP_ANS_INVALID;
+		} else if (privsep_server_openfile_verify(opts, fn,
+		                                          mkpath) == -1) {
+			code = PRIVSEP_ANS_DENIED;
 		} else {
-			free(fn);
-			ans[0] = PRIVSEP_ANS_SUCCESS;
-			if (sys_sendmsgfd(srvsock, ans, 1, fd) == -1) {
-				close(fd);
-				log_err_printf("Sending message failed: %s (%i"
-				               ")\n", strerror(errno), errno);
-				return -1;
-			}
-			close(fd);
-			return 0;
+			fsop = 1;
 		}
-		/* not reached */
 		break;
-	}
+	case PRIVSEP_REQ_OPENSOCK_R:
+		reuseport = 1;
+		/* fall through */
 	case PRIVSEP_REQ_OPENSOCK: {
-		proxyspec_t *arg;
-		int s;
-
-		if (n != sizeof(char) + sizeof(arg)) {
-			ans[0] = PRIVSEP_ANS_INVALID;
-			if (sys_sendmsgfd(srvsock, ans, 1, -1) == -1) {
-				log_err_printf("Sending message failed: %s (%i"
-				               ")\n", strerror(errno), errno);
-				return -1;
-			}
-			return 0;
-		}
-		arg = *(proxyspec_t**)(&req[1]);
-		if (privsep_server_opensock_verify(opts, arg) == -1) {
-			ans[0] = PRIVSEP_ANS_DENIED;
-			if (sys_sendmsgfd(srvsock, ans, 1, -1) == -1) {
-				log_err_printf("Sending message failed: %s (%i"
-				               ")\n", strerror(errno), errno);
-				return -1;
-			}
-			return 0;
+		proxyspec_t *spec;
+
+		if (argsz != sizeof(spec)) {
+			code = PRIVSEP_ANS_INVALID;
+			break;
 		}
-		if ((s = privsep_server_opensock(arg)) == -1) {
-			ans[0] = PRIVSEP_ANS_SYS_ERR;
-			*((int*)&ans[1]) = errno;
-			if (sys_sendmsgfd(srvsock, ans, 1 + sizeof(int),
-			                  -1) == -1) {
-				log_err_printf("Sending message failed: %s (%i"
-				               ")\n", strerror(errno), errno);
-				return -1;
-			}
-			return 0;
+		memcpy(&spec, arg, sizeof(spec));
+		if (privsep_server_opensock_verify(opts, spec) == -1) {
+			code = PRIVSEP_ANS_DENIED;
 		} else {
-			ans[0] = PRIVSEP_ANS_SUCCESS;
-			if (sys_sendmsgfd(srvsock, ans, 1, s) == -1) {
-				evutil_closesocket(s);
-				log_err_printf("Sending message failed: %s (%i"
-				               ")\n", strerror(errno), errno);
-				return -1;
-			}
-			evutil_closesocket(s);
-			return 0;
+			fd = privsep_server_opensock(spec, reuseport);
 		}
-		/* not reached */
 		break;
 	}
-	case PRIVSEP_REQ_CERTFILE: {
-		char *fn;
-		int fd;
-
-		if (n < 2) {
-			ans[0] = PRIVSEP_ANS_INVALID;
-			if (sys_sendmsgfd(srvsock, ans, 1, -1) == -1) {
-				log_err_printf("Sending message failed: %s (%i"
-				               ")\n", strerror(errno), errno);
-				return -1;
-			}
-		}
-		if (!(fn = malloc(n))) {
-			ans[0] = PRIVSEP_ANS_SYS_ERR;
-			*((int*)&ans[1]) = errno;
-			if (sys_sendmsgfd(srvsock, ans, 1 + sizeof(int),
-			                  -1) == -1) {
-				log_err_printf("Sending message failed: %s (%i"
-				               ")\n", strerror(errno), errno);
-				return -1;
-			}
-			return 0;
+	case PRIVSEP_REQ_CERTFILE:
+		if (!(fn = privsep_server_fn(arg, argsz, fnbuf))) {
+			code = PRIVSEP_ANS_INVALID;
+		} else if (privsep_server_certfile_verify(opts, fn) == -1) {
+			code = PRIVSEP_ANS_DENIED;
+		} else {
+			fsop = 1;
 		}
-		memcpy(fn, req + 1, n - 1);
-		fn[n - 1] = '\0';
-		if (privsep_server_certfile_verify(opts, fn) == -1) {
-			free(fn);
-			ans[0] = PRIVSEP_ANS_DENIED;
-			if (sys_sendmsgfd(srvsock, ans, 1, -1) == -1) {
-				log_err_printf("Sending message failed: %s (%i"
-				               ")\n", strerror(errno), errno);
-				return -1;
-			}
-			return 0;
+		break;
+	case PRIVSEP_REQ_OPENDIR:
+		if (!(fn = privsep_server_fn(arg, argsz, fnbuf))) {
+			code = PRIVSEP_ANS_INVALID;
+		} else if (privsep_server_opendir_verify(opts, fn) == -1) {
+			code = PRIVSEP_ANS_DENIED;
+		} else {
+			fsop = 1;
 		}
-		if ((fd = privsep_server_certfile(fn)) == -1) {
-			free(fn);
-			ans[0] = PRIVSEP_ANS_SYS_ERR;
-			*((int*)&ans[1]) = errno;
-			if (sys_sendmsgfd(srvsock, ans, 1 + sizeof(int),
-			                  -1) == -1) {
-				log_err_printf("Sending message failed: %s (%i"
-				               ")\n", strerror(errno), errno);
-				return -1;
-			}
-			return 0;
+		break;
+	case PRIVSEP_REQ_OPENSTATS:
+	case PRIVSEP_REQ_OPENUPGRADE: {
+		int upgrade = req[0] == PRIVSEP_REQ_OPENUPGRADE;
+
+		if (!(upgrade ? opts->upgrade_socket : opts->stats_socket)) {
+			code = PRIVSEP_ANS_DENIED;
 		} else {
-			free(fn);
-			ans[0] = PRIVSEP_ANS_SUCCESS;
-			if (sys_sendmsgfd(srvsock, ans, 1, fd) == -1) {
-				close(fd);
-				log_err_printf("Sending message failed: %s (%i"
-				               ")\n", strerror(errno), errno);
-				return -1;
-			}
-			close(fd);
-			return 0;
+			fd = upgrade ? privsep_server_openupgrade(opts) :
+			               privsep_server_openstats(opts, worker);
 		}
-		/* not reached */
 		break;
 	}
 	default:
-		ans[0] = PRIVSEP_ANS_UNK_CMD;
-		if (sys_sendmsgfd(srvsock, ans, 1, -1) == -1) {
-			log_err_printf("Sending message failed: %s (%i"
-			               ")\n", strerror(errno), errno);
-			return -1;
+		code = PRIVSEP_ANS_UNK_CMD;
+		break;
+	}
+	if (fsop)
+		return privsep_server_fsop_submit(srvsock, id, req[0], fn);
+	if (code == PRIVSEP_ANS_SUCCESS && fd == -1) {
+		code = PRIVSEP_ANS_SYS_ERR;
+		err = errno;
+	}
+
+	rv = privsep_server_answer(srvsock, id, code, err, fd);
+	if (fd != -1)
+		close(fd);
+	return rv;
+}
+
+/*
+ * Send signal sig to all nchild child processes in childpid[].
+ */
+static void
+privsep_server_kill(pid_t childpid[], size_t nchild, int sig)
+{
+	for (size_t i = 0; i < nchild; i++) {
+		if (childpid[i] == -1)
+			continue;
+		if (kill(childpid[i], sig) == -1) {
+			log_err_printf("kill(%i,%i) failed: %s (%i)\n",
+			               childpid[i], sig,
+			               strerror(errno), errno);
 		}
 	}
-	return 0;
 }
 
 /*
@@ -547,26 +877,30 @@ privsep_server_handle_req(opts_t *opts, int srvsock)
  *
  * sigpipe is the self-pipe trick pipe used for communicating signals to
  * the main event loop and break out of select() without race conditions.
- * srvsock[] is a dynamic array of connected privsep server sockets to serve.
+ * srvsock[] is a dynamic array of connected privsep server sockets to serve,
+ * with an equal number of consecutive sockets per child process.
  * Caller is responsible for freeing memory after returning, if necessary.
- * childpid is the pid of the child process to forward signals to.
+ * childpid[] are the pids of the nchild child processes to forward signals
+ * to.
  *
  * Returns 0 on a successful clean exit and -1 on errors.
  */
 static int
 privsep_server(opts_t *opts, int sigpipe, int srvsock[], size_t nsrvsock,
-               pid_t childpid)
+               pid_t childpid[], size_t nchild)
 {
 	int srveof[nsrvsock];
 	size_t i = 0;
+	int rv = 0;
 
 	for (i = 0; i < nsrvsock; i++) {
 		srveof[i] = 0;
 	}
+	privsep_server_pool_start();
 
 	for (;;) {
 		fd_set readfds;
-		int maxfd, rv;
+		int maxfd;
 
 #ifdef DEBUG_PRIVSEP_SERVER
 		log_dbg_printf("privsep_server select()\n");
@@ -589,7 +923,7 @@ privsep_server(opts_t *opts, int sigpipe, int srvsock[], size_t nsrvsock,
 		if (rv == -1) {
 			log_err_printf("select() failed: %s (%i)\n",
 			               strerror(errno), errno);
-			return -1;
+			goto out;
 		}
 #ifdef DEBUG_PRIVSEP_SERVER
 		log_dbg_printf("privsep_server woke up (2)\n");
@@ -605,56 +939,39 @@ privsep_server(opts_t *opts, int sigpipe, int srvsock[], size_t nsrvsock,
 				log_err_printf("read(sigpipe) failed:"
 				               " %s (%i)\n",
 				               strerror(errno), errno);
-				return -1;
+				rv = -1;
+				goto out;
 			}
 			if (received_sigquit) {
-				if (kill(childpid, SIGQUIT) == -1) {
-					log_err_printf("kill(%i,SIGQUIT) "
-					               "failed: %s (%i)\n",
-					               childpid,
-					               strerror(errno), errno);
-				}
+				privsep_server_kill(childpid, nchild, SIGQUIT);
 				received_sigquit = 0;
 			}
 			if (received_sigterm) {
-				if (kill(childpid, SIGTERM) == -1) {
-					log_err_printf("kill(%i,SIGTERM) "
-					               "failed: %s (%i)\n",
-					               childpid,
-					               strerror(errno), errno);
-				}
+				privsep_server_kill(childpid, nchild, SIGTERM);
 				received_sigterm = 0;
 			}
 			if (received_sighup) {
-				if (kill(childpid, SIGHUP) == -1) {
-					log_err_printf("kill(%i,SIGHUP) "
-					               "failed: %s (%i)\n",
-					               childpid,
-					               strerror(errno), errno);
-				}
+				privsep_server_kill(childpid, nchild, SIGHUP);
 				received_sighup = 0;
 			}
 			if (received_sigusr1) {
-				if (kill(childpid, SIGUSR1) == -1) {
-					log_err_printf("kill(%i,SIGUSR1) "
-					               "failed: %s (%i)\n",
-					               childpid,
-					               strerror(errno), errno);
-				}
+				privsep_server_kill(childpid, nchild, SIGUSR1);
 				received_sigusr1 = 0;
 			}
+			if (received_sigusr2) {
+				privsep_server_kill(childpid, nchild, SIGUSR2);
+				received_sigusr2 = 0;
+			}
+			if (received_sigurg) {
+				privsep_server_kill(childpid, nchild, SIGURG);
+				received_sigurg = 0;
+			}
 			if (received_sigint) {
 				/* if we don't detach from the TTY, the
 				 * child process receives SIGINT directly */
 				if (opts->detach) {
-					if (kill(childpid, SIGINT) == -1) {
-						log_err_printf("kill(%i,SIGINT"
-						               ") failed: "
-						               "%s (%i)\n",
-						               childpid,
-						               strerror(errno),
-						               errno);
-					}
+					privsep_server_kill(childpid, nchild,
+					                    SIGINT);
 				}
 				received_sigint = 0;
 			}
@@ -671,14 +988,14 @@ privsep_server(opts_t *opts, int sigpipe, int srvsock[], size_t nsrvsock,
 
 		for (i = 0; i < nsrvsock; i++) {
 			if (FD_ISSET(srvsock[i], &readfds)) {
-				int rv = privsep_server_handle_req(opts,
-				                                   srvsock[i]);
+				rv = privsep_server_handle_req(opts,
+				         srvsock[i], i / (nsrvsock / nchild));
 				if (rv == -1) {
 					log_err_printf("Failed to handle "
 					               "privsep req "
 					               "on srvsock %i\n",
 					               srvsock[i]);
-					return -1;
+					goto out;
 				}
 				if (rv == 1) {
 #ifdef DEBUG_PRIVSEP_SERVER
@@ -695,158 +1012,500 @@ privsep_server(opts_t *opts, int sigpipe, int srvsock[], size_t nsrvsock,
 		 * The only way out of here is receiving SIGCHLD.
 		 */
 	}
+	rv = 0;
 
-	return 0;
+out:
+	privsep_server_pool_stop();
+	return rv;
 }
 
-int
-privsep_client_openfile(int clisock, const char *fn, int mkpath)
-{
-	char ans[PRIVSEP_MAX_ANS_SIZE];
-	char req[1 + strlen(fn)];
-	int fd = -1;
-	ssize_t n;
+/*
+ * Client side.  Each client socket has a table of pending requests, keyed by
+ * request ID, such that several threads can have requests in flight on the
+ * same socket at once.  Answers are received by whichever thread currently
+ * acts as the reader: one of the threads waiting synchronously for an answer,
+ * or the read event of a pending asynchronous request on its event base.
+ * The reader hands answers to other requests over to their waiting threads,
+ * or schedules the completion callbacks of asynchronous requests on their
+ * respective event bases using event_base_once().
+ *
+ * An asynchronous request may be cancelled from its event base until its
+ * completion callback has run; a file descriptor received for a cancelled
+ * request is closed.  Requests are always freed by this code.  Completion
+ * callbacks must be able to run, i.e. the event bases must still exist, until
+ * the client socket is closed.
+ */
 
-	if (privsep_fastpath)
-		return privsep_server_openfile(fn, mkpath);
+#define PRIVSEP_MAX_CLIENTS	16
 
-	req[0] = mkpath ? PRIVSEP_REQ_OPENFILE_P : PRIVSEP_REQ_OPENFILE;
-	memcpy(req + 1, fn, sizeof(req) - 1);
+typedef struct privsep_client privsep_client_t;
 
-	if (sys_sendmsgfd(clisock, req, sizeof(req), -1) == -1) {
-		return -1;
-	}
+struct privsep_req {
+	privsep_client_t *cli;
+	uint32_t id;
+	int done;
+	char code;
+	int err;
+	int fd;
+	/* asynchronous requests only */
+	struct event_base *evbase;
+	struct event *ev;
+	privsep_client_cb_t cb;
+	void *arg;
+	privsep_req_t *next;
+};
+
+struct privsep_client {
+	int sock;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	uint32_t nextid;
+	int reading;                    /* 1 while a thread is receiving */
+	privsep_req_t *pending;
+};
+
+static privsep_client_t *privsep_clients[PRIVSEP_MAX_CLIENTS];
+static pthread_mutex_t privsep_clients_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-	if ((n = sys_recvmsgfd(clisock, ans, sizeof(ans), &fd)) == -1) {
-		return -1;
+/*
+ * Return the client state for clisock, creating it on first use.
+ */
+static privsep_client_t *
+privsep_client_get(int clisock)
+{
+	privsep_client_t *cli = NULL;
+	int i, slot = -1;
+
+	pthread_mutex_lock(&privsep_clients_mutex);
+	for (i = 0; i < PRIVSEP_MAX_CLIENTS; i++) {
+		if (privsep_clients[i] && privsep_clients[i]->sock == clisock) {
+			cli = privsep_clients[i];
+			goto out;
+		}
+		if (!privsep_clients[i] && slot == -1)
+			slot = i;
 	}
-
-	if (n < 1) {
-		errno = EINVAL;
-		return -1;
+	if (slot == -1 || !(cli = malloc(sizeof(privsep_client_t)))) {
+		errno = ENOMEM;
+		goto out;
 	}
+	memset(cli, 0, sizeof(privsep_client_t));
+	cli->sock = clisock;
+	pthread_mutex_init(&cli->mutex, NULL);
+	pthread_cond_init(&cli->cond, NULL);
+	privsep_clients[slot] = cli;
+out:
+	pthread_mutex_unlock(&privsep_clients_mutex);
+	return cli;
+}
 
-	switch (ans[0]) {
+/*
+ * Map the answer of a completed request to a file descriptor and errno.
+ */
+static int
+privsep_client_result(privsep_req_t *req, int *err)
+{
+	switch (req->code) {
 	case PRIVSEP_ANS_SUCCESS:
-		break;
-	case PRIVSEP_ANS_DENIED:
-		errno = EACCES;
-		return -1;
-	case PRIVSEP_ANS_SYS_ERR:
-		if (n < (ssize_t)(1 + sizeof(int))) {
-			errno = EINVAL;
+		if (req->fd == -1) {
+			*err = EINVAL;
 			return -1;
 		}
-		errno = *((int*)&ans[1]);
-		return -1;
+		*err = 0;
+		return req->fd;
+	case PRIVSEP_ANS_DENIED:
+		*err = EACCES;
+		break;
+	case PRIVSEP_ANS_SYS_ERR:
+		*err = req->err;
+		break;
 	case PRIVSEP_ANS_UNK_CMD:
 	case PRIVSEP_ANS_INVALID:
 	default:
-		errno = EINVAL;
-		return -1;
+		*err = EINVAL;
+		break;
+	}
+	if (req->fd != -1) {
+		close(req->fd);
+		req->fd = -1;
 	}
+	return -1;
+}
 
-	return fd;
+/*
+ * Completion callback of asynchronous requests, runs on their event base.
+ */
+static void
+privsep_client_done_cb(UNUSED evutil_socket_t fd, UNUSED short what,
+                       void *arg)
+{
+	privsep_req_t *req = arg;
+	int rfd, err;
+
+	if (req->ev)
+		event_free(req->ev);
+	rfd = privsep_client_result(req, &err);
+	if (req->cb) {
+		req->cb(rfd, err, req->arg);
+	} else if (rfd != -1) {
+		close(rfd);
+	}
+	free(req);
 }
 
-int
-privsep_client_opensock(int clisock, const proxyspec_t *spec)
+/*
+ * Mark req as completed with code, err and fd.  Called with the client
+ * mutex held, after removing req from the pending requests.
+ */
+static void
+privsep_client_complete(privsep_req_t *req, char code, int err, int fd)
+{
+	req->code = code;
+	req->err = err;
+	req->fd = fd;
+	req->done = 1;
+	if (req->evbase && event_base_once(req->evbase, -1, EV_TIMEOUT,
+	                                   privsep_client_done_cb, req,
+	                                   NULL) == -1) {
+		log_err_printf("Failed to schedule privsep completion\n");
+		if (fd != -1)
+			close(fd);
+		/* leaks req, which may still be referenced by its event */
+	}
+}
+
+/*
+ * Receive one answer and hand it to its request.  If block is zero, returns
+ * 0 without blocking if no answer is available.
+ * Returns 1 if an answer was received, 0 if none was available, and -1 on
+ * errors, in which case all pending requests fail.
+ */
+static int
+privsep_client_recv(privsep_client_t *cli, int block)
 {
 	char ans[PRIVSEP_MAX_ANS_SIZE];
-	char req[1 + sizeof(spec)];
+	privsep_req_t **preq, *req;
+	uint32_t id;
 	int fd = -1;
+	int err = 0;
 	ssize_t n;
 
-	if (privsep_fastpath)
-		return privsep_server_opensock(spec);
-
-	req[0] = PRIVSEP_REQ_OPENSOCK;
-	*((const proxyspec_t **)&req[1]) = spec;
-
-	if (sys_sendmsgfd(clisock, req, sizeof(req), -1) == -1) {
+	n = block ? sys_recvmsgfd(cli->sock, ans, sizeof(ans), &fd) :
+	            sys_recvmsgfd_nb(cli->sock, ans, sizeof(ans), &fd);
+	if (n == -1 && !block && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return 0;
+	if (n < (ssize_t)PRIVSEP_MAX_ANS_SIZE) {
+		err = n == -1 ? errno : EINVAL;
+		if (fd != -1)
+			close(fd);
+		pthread_mutex_lock(&cli->mutex);
+		while ((req = cli->pending)) {
+			cli->pending = req->next;
+			privsep_client_complete(req, PRIVSEP_ANS_SYS_ERR,
+			                        err, -1);
+		}
+		pthread_cond_broadcast(&cli->cond);
+		pthread_mutex_unlock(&cli->mutex);
 		return -1;
 	}
+	memcpy(&id, ans + 1, sizeof(id));
+	memcpy(&err, ans + PRIVSEP_HDR_SIZE, sizeof(err));
 
-	if ((n = sys_recvmsgfd(clisock, ans, sizeof(ans), &fd)) == -1) {
-		return -1;
+	pthread_mutex_lock(&cli->mutex);
+	for (preq = &cli->pending; *preq; preq = &(*preq)->next) {
+		if ((*preq)->id == id)
+			break;
+	}
+	if ((req = *preq)) {
+		*preq = req->next;
+		privsep_client_complete(req, ans[0], err, fd);
+		pthread_cond_broadcast(&cli->cond);
+	} else {
+		log_err_printf("Privsep answer for unknown request %u\n", id);
+		if (fd != -1)
+			close(fd);
+	}
+	pthread_mutex_unlock(&cli->mutex);
+	return 1;
+}
+
+/*
+ * Read event of pending asynchronous requests; receives all available
+ * answers unless another thread is currently the reader.
+ */
+static void
+privsep_client_readcb(UNUSED evutil_socket_t fd, UNUSED short what,
+                      void *arg)
+{
+	privsep_client_t *cli = ((privsep_req_t *)arg)->cli;
+
+	pthread_mutex_lock(&cli->mutex);
+	if (cli->reading) {
+		pthread_mutex_unlock(&cli->mutex);
+		return;
 	}
+	cli->reading = 1;
+	pthread_mutex_unlock(&cli->mutex);
+
+	while (privsep_client_recv(cli, 0) == 1);
+
+	pthread_mutex_lock(&cli->mutex);
+	cli->reading = 0;
+	pthread_cond_broadcast(&cli->cond);
+	pthread_mutex_unlock(&cli->mutex);
+}
 
-	if (n < 1) {
+/*
+ * Send request cmd with argument arg of size argsz on clisock.  If evbase is
+ * NULL, waits for the answer and returns the file descriptor received, or -1
+ * with errno set.  Otherwise returns 0 and sets *preq to the request, whose
+ * completion callback cb will be called on evbase, or -1 with errno set.
+ */
+static int
+privsep_client_request(int clisock, char cmd, const void *arg, size_t argsz,
+                       struct event_base *evbase, privsep_client_cb_t cb,
+                       void *cbarg, privsep_req_t **preq)
+{
+	char buf[PRIVSEP_MAX_REQ_SIZE];
+	privsep_client_t *cli;
+	privsep_req_t *req, **p;
+	int fd, err;
+
+	if (argsz >= PRIVSEP_MAX_REQ_SIZE - PRIVSEP_HDR_SIZE) {
 		errno = EINVAL;
 		return -1;
 	}
-
-	switch (ans[0]) {
-	case PRIVSEP_ANS_SUCCESS:
-		break;
-	case PRIVSEP_ANS_DENIED:
-		errno = EACCES;
+	if (!(cli = privsep_client_get(clisock)))
 		return -1;
-	case PRIVSEP_ANS_SYS_ERR:
-		if (n < (ssize_t)(1 + sizeof(int))) {
-			errno = EINVAL;
+	if (!(req = malloc(sizeof(privsep_req_t))))
+		return -1;
+	memset(req, 0, sizeof(privsep_req_t));
+	req->cli = cli;
+	req->fd = -1;
+	if (evbase) {
+		req->evbase = evbase;
+		req->cb = cb;
+		req->arg = cbarg;
+		req->ev = event_new(evbase, clisock, EV_READ|EV_PERSIST,
+		                    privsep_client_readcb, req);
+		if (!req->ev) {
+			free(req);
 			return -1;
 		}
-		errno = *((int*)&ans[1]);
-		return -1;
-	case PRIVSEP_ANS_UNK_CMD:
-	case PRIVSEP_ANS_INVALID:
-	default:
-		errno = EINVAL;
+	}
+
+	pthread_mutex_lock(&cli->mutex);
+	req->id = cli->nextid++;
+	req->next = cli->pending;
+	cli->pending = req;
+	pthread_mutex_unlock(&cli->mutex);
+
+	buf[0] = cmd;
+	memcpy(buf + 1, &req->id, sizeof(req->id));
+	if (argsz > 0)
+		memcpy(buf + PRIVSEP_HDR_SIZE, arg, argsz);
+	if (sys_sendmsgfd(clisock, buf, PRIVSEP_HDR_SIZE + argsz,
+	                  -1) == -1) {
+		err = errno;
+		pthread_mutex_lock(&cli->mutex);
+		for (p = &cli->pending; *p; p = &(*p)->next) {
+			if (*p == req) {
+				*p = req->next;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&cli->mutex);
+		if (req->ev)
+			event_free(req->ev);
+		free(req);
+		errno = err;
 		return -1;
 	}
 
+	if (evbase) {
+		/* the answer may already have been received by another
+		 * thread, in which case the completion is scheduled and
+		 * frees the event along with the request */
+		event_add(req->ev, NULL);
+		*preq = req;
+		return 0;
+	}
+
+	pthread_mutex_lock(&cli->mutex);
+	while (!req->done) {
+		if (cli->reading) {
+			pthread_cond_wait(&cli->cond, &cli->mutex);
+			continue;
+		}
+		cli->reading = 1;
+		pthread_mutex_unlock(&cli->mutex);
+		privsep_client_recv(cli, 1);
+		pthread_mutex_lock(&cli->mutex);
+		cli->reading = 0;
+		pthread_cond_broadcast(&cli->cond);
+	}
+	pthread_mutex_unlock(&cli->mutex);
+
+	fd = privsep_client_result(req, &err);
+	free(req);
+	errno = err;
 	return fd;
 }
 
 int
-privsep_client_certfile(int clisock, const char *fn)
+privsep_client_openfile(int clisock, const char *fn, int mkpath)
 {
-	char ans[PRIVSEP_MAX_ANS_SIZE];
-	char req[1 + strlen(fn)];
-	int fd = -1;
-	ssize_t n;
+	if (privsep_fastpath)
+		return privsep_server_openfile(fn, mkpath);
+
+	return privsep_client_request(clisock, mkpath ?
+	                              PRIVSEP_REQ_OPENFILE_P :
+	                              PRIVSEP_REQ_OPENFILE,
+	                              fn, strlen(fn), NULL, NULL, NULL, NULL);
+}
 
+int
+privsep_client_opensock(int clisock, const proxyspec_t *spec, int reuseport)
+{
+	if (privsep_fastpath)
+		return privsep_server_opensock(spec, reuseport);
+
+	return privsep_client_request(clisock, reuseport ?
+	                              PRIVSEP_REQ_OPENSOCK_R :
+	                              PRIVSEP_REQ_OPENSOCK,
+	                              &spec, sizeof(spec),
+	                              NULL, NULL, NULL, NULL);
+}
+
+int
+privsep_client_certfile(int clisock, const char *fn)
+{
 	if (privsep_fastpath)
 		return privsep_server_certfile(fn);
 
-	req[0] = PRIVSEP_REQ_CERTFILE;
-	memcpy(req + 1, fn, sizeof(req) - 1);
+	return privsep_client_request(clisock, PRIVSEP_REQ_CERTFILE,
+	                              fn, strlen(fn), NULL, NULL, NULL, NULL);
+}
 
-	if (sys_sendmsgfd(clisock, req, sizeof(req), -1) == -1) {
-		return -1;
-	}
+int
+privsep_client_opendir(int clisock, const char *fn)
+{
+	if (privsep_fastpath)
+		return privsep_server_opendir(fn);
 
-	if ((n = sys_recvmsgfd(clisock, ans, sizeof(ans), &fd)) == -1) {
-		return -1;
-	}
+	return privsep_client_request(clisock, PRIVSEP_REQ_OPENDIR,
+	                              fn, strlen(fn), NULL, NULL, NULL, NULL);
+}
 
-	if (n < 1) {
-		errno = EINVAL;
-		return -1;
+static int
+privsep_client_openunix(int clisock, opts_t *opts, int upgrade)
+{
+	if (privsep_fastpath)
+		return upgrade ? privsep_server_openupgrade(opts) :
+		                 privsep_server_openstats(opts,
+		                                          privsep_worker_idx);
+
+	return privsep_client_request(clisock, upgrade ?
+	                              PRIVSEP_REQ_OPENUPGRADE :
+	                              PRIVSEP_REQ_OPENSTATS,
+	                              NULL, 0, NULL, NULL, NULL, NULL);
+}
+
+/*
+ * Asynchronous variants: submit the request and return immediately; cb is
+ * called on evbase with the file descriptor, or -1 and an errno value.
+ * Returns the request, or NULL with errno set if it could not be submitted.
+ * With the privsep fast path, the file is opened immediately and only the
+ * callback is deferred.
+ */
+static privsep_req_t *
+privsep_client_async(int clisock, char cmd, const void *arg, size_t argsz,
+                     int fastfd, struct event_base *evbase,
+                     privsep_client_cb_t cb, void *cbarg)
+{
+	privsep_req_t *req;
+	int err = errno;
+
+	if (privsep_fastpath) {
+		if (!(req = malloc(sizeof(privsep_req_t))))
+			return NULL;
+		memset(req, 0, sizeof(privsep_req_t));
+		req->evbase = evbase;
+		req->cb = cb;
+		req->arg = cbarg;
+		privsep_client_complete(req, fastfd == -1 ?
+		                        PRIVSEP_ANS_SYS_ERR :
+		                        PRIVSEP_ANS_SUCCESS, err, fastfd);
+		return req;
 	}
+	if (privsep_client_request(clisock, cmd, arg, argsz,
+	                           evbase, cb, cbarg, &req) == -1)
+		return NULL;
+	return req;
+}
 
-	switch (ans[0]) {
-	case PRIVSEP_ANS_SUCCESS:
-		break;
-	case PRIVSEP_ANS_DENIED:
-		errno = EACCES;
-		return -1;
-	case PRIVSEP_ANS_SYS_ERR:
-		if (n < (ssize_t)(1 + sizeof(int))) {
-			errno = EINVAL;
-			return -1;
-		}
-		errno = *((int*)&ans[1]);
-		return -1;
-	case PRIVSEP_ANS_UNK_CMD:
-	case PRIVSEP_ANS_INVALID:
-	default:
-		errno = EINVAL;
-		return -1;
+privsep_req_t *
+privsep_client_openfile_async(int clisock, struct event_base *evbase,
+                              const char *fn, int mkpath,
+                              privsep_client_cb_t cb, void *arg)
+{
+	return privsep_client_async(clisock, mkpath ? PRIVSEP_REQ_OPENFILE_P :
+	                                              PRIVSEP_REQ_OPENFILE,
+	                            fn, strlen(fn), privsep_fastpath ?
+	                            privsep_server_openfile(fn, mkpath) : -1,
+	                            evbase, cb, arg);
+}
+
+privsep_req_t *
+privsep_client_opensock_async(int clisock, struct event_base *evbase,
+                              const proxyspec_t *spec, int reuseport,
+                              privsep_client_cb_t cb, void *arg)
+{
+	return privsep_client_async(clisock, reuseport ?
+	                            PRIVSEP_REQ_OPENSOCK_R :
+	                            PRIVSEP_REQ_OPENSOCK,
+	                            &spec, sizeof(spec), privsep_fastpath ?
+	                            privsep_server_opensock(spec,
+	                                                    reuseport) : -1,
+	                            evbase, cb, arg);
+}
+
+privsep_req_t *
+privsep_client_certfile_async(int clisock, struct event_base *evbase,
+                              const char *fn,
+                              privsep_client_cb_t cb, void *arg)
+{
+	return privsep_client_async(clisock, PRIVSEP_REQ_CERTFILE,
+	                            fn, strlen(fn), privsep_fastpath ?
+	                            privsep_server_certfile(fn) : -1,
+	                            evbase, cb, arg);
+}
+
+/*
+ * Cancel an asynchronous request; its callback will not be invoked.  Must be
+ * called from the event base the request was submitted from, before its
+ * callback was invoked.
+ */
+void
+privsep_client_cancel(privsep_req_t *req)
+{
+	req->cb = NULL;
+	if (req->ev) {
+		event_free(req->ev);
+		req->ev = NULL;
 	}
+}
 
-	return fd;
+int
+privsep_client_openstats(int clisock, opts_t *opts)
+{
+	return privsep_client_openunix(clisock, opts, 0);
+}
+
+int
+privsep_client_openupgrade(int clisock, opts_t *opts)
+{
+	return privsep_client_openunix(clisock, opts, 1);
 }
 
 int
@@ -854,6 +1513,17 @@ privsep_client_close(int clisock)
 {
 	char req[1];
 
+	pthread_mutex_lock(&privsep_clients_mutex);
+	for (int i = 0; i < PRIVSEP_MAX_CLIENTS; i++) {
+		if (privsep_clients[i] && privsep_clients[i]->sock == clisock) {
+			pthread_cond_destroy(&privsep_clients[i]->cond);
+			pthread_mutex_destroy(&privsep_clients[i]->mutex);
+			free(privsep_clients[i]);
+			privsep_clients[i] = NULL;
+		}
+	}
+	pthread_mutex_unlock(&privsep_clients_mutex);
+
 	req[0] = PRIVSEP_REQ_CLOSE;
 
 	if (sys_sendmsgfd(clisock, req, sizeof(req), -1) == -1) {
@@ -865,20 +1535,108 @@ privsep_client_close(int clisock)
 	return 0;
 }
 
+/*
+ * Returns the index of the worker process the caller is running in, 0 if
+ * there is only one worker process.
+ */
+int
+privsep_worker(void)
+{
+	return privsep_worker_idx;
+}
+
+/*
+ * Log the exit status of child process pid and return the exit status to use
+ * for the parent process.
+ */
+static int
+privsep_fork_status(pid_t pid, int status)
+{
+	if (WIFEXITED(status)) {
+		if (WEXITSTATUS(status) != 0) {
+			log_err_printf("Child pid %lld exited with status %d\n",
+			               (long long)pid, WEXITSTATUS(status));
+		} else {
+			log_dbg_printf("Child pid %lld exited with status %d\n",
+			               (long long)pid, WEXITSTATUS(status));
+		}
+		return WEXITSTATUS(status);
+	} else if (WIFSIGNALED(status)) {
+		log_err_printf("Child pid %lld killed by signal %d\n",
+		               (long long)pid, WTERMSIG(status));
+		return 128 + WTERMSIG(status);
+	}
+	/* can only happen with WUNTRACED option or active tracing */
+	log_err_printf("Child pid %lld neither exited nor killed\n",
+	               (long long)pid);
+	return EXIT_FAILURE;
+}
+
+/*
+ * Wait for all nchild child processes in childpid[].  If there is more than
+ * one, the others are terminated as soon as the first one exits, since they
+ * can only be restarted as a group.
+ * Returns the exit status to use for the parent process, derived from the
+ * first child process to exit.
+ */
+static int
+privsep_fork_wait(pid_t childpid[], size_t nchild)
+{
+	size_t alive = nchild;
+	int status, rv = EXIT_FAILURE;
+	pid_t wpid;
+
+	while (alive > 0) {
+		wpid = wait(&status);
+		if (wpid == -1) {
+			if (errno == EINTR)
+				continue;
+			log_err_printf("wait() failed: %s (%i)\n",
+			               strerror(errno), errno);
+			break;
+		}
+		size_t i;
+		for (i = 0; i < nchild && childpid[i] != wpid; i++);
+		if (i == nchild) {
+			/* should never happen, warn if it does anyway */
+			log_err_printf("Unexpected child pid %lld from "
+			               "wait(2)\n", (long long)wpid);
+			continue;
+		}
+		childpid[i] = -1;
+		if (alive-- == nchild) {
+			rv = privsep_fork_status(wpid, status);
+			if (alive > 0) {
+				log_err_printf("Terminating remaining %zu "
+				               "worker processes\n", alive);
+				privsep_server_kill(childpid, nchild, SIGTERM);
+			}
+		} else {
+			(void)privsep_fork_status(wpid, status);
+		}
+	}
+	return rv;
+}
+
 /*
  * Fork and set up privilege separated monitor process.
  * Returns -1 on error before forking, 1 as parent, or 0 as child.
  * The array of clisock's will get filled with nclisock privsep client
  * sockets only for the child; on error and in the parent process it
  * will not be touched.
+ * With opts->worker_procs > 1, that many child processes are forked, each
+ * with its own set of privsep client sockets; privsep_worker() returns the
+ * index of the child process.
  */
 int
 privsep_fork(opts_t *opts, int clisock[], size_t nclisock, int *parent_rv)
 {
 	int selfpipev[2]; /* self-pipe trick: signal handler -> select */
 	int chldpipev[2]; /* el cheapo interprocess sync early after fork */
-	int sockcliv[nclisock][2];
-	pid_t pid;
+	size_t nchild = opts->worker_procs > 1 ? opts->worker_procs : 1;
+	size_t nsock = nclisock * nchild;
+	int sockcliv[nsock][2];
+	pid_t pid[nchild];
 
 	if (!opts->dropuser) {
 		log_dbg_printf("Privsep fastpath enabled\n");
@@ -893,6 +1651,8 @@ privsep_fork(opts_t *opts, int clisock[], size_t nclisock, int *parent_rv)
 	received_sigint = 0;
 	received_sigchld = 0;
 	received_sigusr1 = 0;
+	received_sigusr2 = 0;
+	received_sigurg = 0;
 
 	if (pipe(selfpipev) == -1) {
 		log_err_printf("Failed to create self-pipe: %s (%i)\n",
@@ -910,7 +1670,7 @@ privsep_fork(opts_t *opts, int clisock[], size_t nclisock, int *parent_rv)
 	log_dbg_printf("Created chld-pipe [r=%i,w=%i]\n",
 	               chldpipev[0], chldpipev[1]);
 
-	for (size_t i = 0; i < nclisock; i++) {
+	for (size_t i = 0; i < nsock; i++) {
 		if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sockcliv[i]) == -1) {
 			log_err_printf("Failed to create socket pair %zu: "
 			               "%s (%i)\n", i, strerror(errno), errno);
@@ -921,42 +1681,53 @@ privsep_fork(opts_t *opts, int clisock[], size_t nclisock, int *parent_rv)
 	}
 
 	log_dbg_printf("Privsep parent pid %i\n", getpid());
-	pid = fork();
-	if (pid == -1) {
-		log_err_printf("Failed to fork: %s (%i)\n",
-		               strerror(errno), errno);
-		close(selfpipev[0]);
-		close(selfpipev[1]);
-		close(chldpipev[0]);
-		close(chldpipev[1]);
-		for (size_t i = 0; i < nclisock; i++) {
-			close(sockcliv[i][0]);
-			close(sockcliv[i][1]);
+	for (size_t w = 0; w < nchild; w++) {
+		pid[w] = fork();
+		if (pid[w] == -1) {
+			log_err_printf("Failed to fork: %s (%i)\n",
+			               strerror(errno), errno);
+			/* children forked so far are still blocked on the
+			 * chld-pipe with default signal dispositions */
+			privsep_server_kill(pid, w, SIGKILL);
+			for (size_t i = 0; i < w; i++)
+				waitpid(pid[i], NULL, 0);
+			close(selfpipev[0]);
+			close(selfpipev[1]);
+			close(chldpipev[0]);
+			close(chldpipev[1]);
+			for (size_t i = 0; i < nsock; i++) {
+				close(sockcliv[i][0]);
+				close(sockcliv[i][1]);
+			}
+			return -1;
+		} else if (pid[w] == 0) {
+			/* child */
+			close(selfpipev[0]);
+			close(selfpipev[1]);
+			for (size_t i = 0; i < nsock; i++) {
+				close(sockcliv[i][0]);
+				if (i / nclisock != w)
+					close(sockcliv[i][1]);
+			}
+			/* wait until parent has installed signal handlers,
+			 * intentionally ignoring errors */
+			char buf[1];
+			ssize_t n;
+			close(chldpipev[1]);
+			do {
+				n = read(chldpipev[0], buf, sizeof(buf));
+			} while (n == -1 && errno == EINTR);
+			close(chldpipev[0]);
+			log_dbg_printf("Privsep child pid %i\n", getpid());
+			privsep_worker_idx = w;
+			/* return the privsep client sockets */
+			for (size_t i = 0; i < nclisock; i++)
+				clisock[i] = sockcliv[w * nclisock + i][1];
+			return 0;
 		}
-		return -1;
-	} else if (pid == 0) {
-		/* child */
-		close(selfpipev[0]);
-		close(selfpipev[1]);
-		for (size_t i = 0; i < nclisock; i++)
-			close(sockcliv[i][0]);
-		/* wait until parent has installed signal handlers,
-		 * intentionally ignoring errors */
-		char buf[1];
-		ssize_t n;
-		close(chldpipev[1]);
-		do {
-			n = read(chldpipev[0], buf, sizeof(buf));
-		} while (n == -1 && errno == EINTR);
-		close(chldpipev[0]);
-		log_dbg_printf("Privsep child pid %i\n", getpid());
-		/* return the privsep client sockets */
-		for (size_t i = 0; i < nclisock; i++)
-			clisock[i] = sockcliv[i][1];
-		return 0;
 	}
 	/* parent */
-	for (size_t i = 0; i < nclisock; i++)
+	for (size_t i = 0; i < nsock; i++)
 		close(sockcliv[i][1]);
 	selfpipe_wrfd = selfpipev[1];
 
@@ -994,20 +1765,31 @@ privsep_fork(opts_t *opts, int clisock[], size_t nclisock, int *parent_rv)
 		               strerror(errno), errno);
 		return -1;
 	}
+	if (signal(SIGUSR2, privsep_server_signal_handler) == SIG_ERR) {
+		log_err_printf("Failed to install SIGUSR2 handler: %s (%i)\n",
+		               strerror(errno), errno);
+		return -1;
+	}
+	if (signal(SIGURG, privsep_server_signal_handler) == SIG_ERR) {
+		log_err_printf("Failed to install SIGURG handler: %s (%i)\n",
+		               strerror(errno), errno);
+		return -1;
+	}
 	if (signal(SIGCHLD, privsep_server_signal_handler) == SIG_ERR) {
 		log_err_printf("Failed to install SIGCHLD handler: %s (%i)\n",
 		               strerror(errno), errno);
 		return -1;
 	}
 
-	/* unblock the child */
+	/* unblock the children */
 	close(chldpipev[0]);
 	close(chldpipev[1]);
 
-	int socksrv[nclisock];
-	for (size_t i = 0; i < nclisock; i++)
+	int socksrv[nsock];
+	for (size_t i = 0; i < nsock; i++)
 		socksrv[i] = sockcliv[i][0];
-	if (privsep_server(opts, selfpipev[0], socksrv, nclisock, pid) == -1) {
+	if (privsep_server(opts, selfpipev[0], socksrv, nsock,
+	                   pid, nchild) == -1) {
 		log_err_printf("Privsep server failed: %s (%i)\n",
 		               strerror(errno), errno);
 		/* fall through */
@@ -1016,38 +1798,13 @@ privsep_fork(opts_t *opts, int clisock[], size_t nclisock, int *parent_rv)
 	log_dbg_printf("privsep_server exited\n");
 #endif /* DEBUG_PRIVSEP_SERVER */
 
-	for (size_t i = 0; i < nclisock; i++)
+	for (size_t i = 0; i < nsock; i++)
 		close(sockcliv[i][0]);
 	selfpipe_wrfd = -1; /* tell signal handler not to write anymore */
 	close(selfpipev[0]);
 	close(selfpipev[1]);
 
-	int status;
-	pid_t wpid;
-	wpid = wait(&status);
-	if (wpid != pid) {
-		/* should never happen, warn if it does anyway */
-		log_err_printf("Child pid %lld != expected %lld from wait(2)\n",
-		               (long long)wpid, (long long)pid);
-	}
-	if (WIFEXITED(status)) {
-		if (WEXITSTATUS(status) != 0) {
-			log_err_printf("Child pid %lld exited with status %d\n",
-			               (long long)wpid, WEXITSTATUS(status));
-		} else {
-			log_dbg_printf("Child pid %lld exited with status %d\n",
-			               (long long)wpid, WEXITSTATUS(status));
-		}
-		*parent_rv = WEXITSTATUS(status);
-	} else if (WIFSIGNALED(status)) {
-		log_err_printf("Child pid %lld killed by signal %d\n",
-		               (long long)wpid, WTERMSIG(status));
-		*parent_rv = 128 + WTERMSIG(status);
-	} else {
-		/* can only happen with WUNTRACED option or active tracing */
-		log_err_printf("Child pid %lld neither exited nor killed\n",
-		               (long long)wpid);
-	}
+	*parent_rv = privsep_fork_wait(pid, nchild);
 
 	return 1;
 }
@@ -32,13 +32,36 @@
 #include "attrib.h"
 #include "opts.h"
 
+#include <event2/event.h>
+
 int privsep_fork(opts_t *, int[], size_t, int *);
+int privsep_worker(void) WUNRES;
 
 int privsep_client_openfile(int, const char *, int);
-int privsep_client_opensock(int, const proxyspec_t *spec);
+int privsep_client_opensock(int, const proxyspec_t *spec, int);
 int privsep_client_certfile(int, const char *);
+int privsep_client_opendir(int, const char *);
+int privsep_client_openstats(int, opts_t *);
+int privsep_client_openupgrade(int, opts_t *);
 int privsep_client_close(int);
 
+typedef struct privsep_req privsep_req_t;
+typedef void (*privsep_client_cb_t)(int, int, void *);
+
+privsep_req_t * privsep_client_openfile_async(int, struct event_base *,
+                                              const char *, int,
+                                              privsep_client_cb_t, void *)
+                                              NONNULL(2,3,5) WUNRES;
+privsep_req_t * privsep_client_opensock_async(int, struct event_base *,
+                                              const proxyspec_t *, int,
+                                              privsep_client_cb_t, void *)
+                                              NONNULL(2,3,5) WUNRES;
+privsep_req_t * privsep_client_certfile_async(int, struct event_base *,
+                                              const char *,
+                                              privsep_client_cb_t, void *)
+                                              NONNULL(2,3,4) WUNRES;
+void privsep_client_cancel(privsep_req_t *) NONNULL(1);
+
 #endif /* !PRIVSEP_H */
 
 /* vim: set noet ft=c: */
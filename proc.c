@@ -46,25 +46,331 @@
 #include "proc.h"
 
 #include "log.h"
+#include "util.h"
 #include "attrib.h"
+#include "khash.h"
 
+#include <netinet/in.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
 
 #ifdef HAVE_DARWIN_LIBPROC
 #include <libproc.h>
 #endif /* HAVE_DARWIN_LIBPROC */
 
+#ifdef __linux__
+#include <sys/stat.h>
+#include <netinet/tcp.h>
+#include <linux/netlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#endif /* __linux__ */
+
+#ifdef HAVE_LOCAL_PROCINFO
+#include "sys.h"
+#include "thrqueue.h"
+#endif /* HAVE_LOCAL_PROCINFO */
+
 
 /*
  * Local process lookup.
+ *
+ * Enumerating all sockets of all processes is expensive on every platform,
+ * so instead of searching for each new connection's socket, a platform scan
+ * fills an index from local socket address to PID.  Lookups hitting the
+ * index are served from it as long as the last scan is recent; misses
+ * trigger a rescan unless a scan was started after the lookup, which lets
+ * concurrent lookups share one scan.  Each scan updates the index in place
+ * and sweeps entries of sockets that disappeared.
+ *
+ * Process information is cached by PID and validated against the process
+ * start time, so that a reused PID is not attributed the old executable.
+ */
+
+/* maximum age of the last scan in microseconds for index hits to be used */
+#define PROC_INDEX_MAXAGE       1000000
+/* maximum number of cached process information entries */
+#define PROC_INFO_MAX           4096
+
+typedef struct proc_sockkey {
+	unsigned char family;
+	unsigned char pad;
+	uint16_t port;
+	unsigned char addr[16];
+} proc_sockkey_t;
+
+typedef struct proc_sockent {
+	pid_t pid;
+	unsigned long gen;
+} proc_sockent_t;
+
+typedef struct proc_infoent {
+	unsigned long long start;
+	char *path;
+	uid_t uid;
+	gid_t gid;
+} proc_infoent_t;
+
+#define proc_sockkey_hash(k) util_hash(&(k), sizeof(proc_sockkey_t))
+#define proc_sockkey_equal(a, b) \
+	(!memcmp(&(a), &(b), sizeof(proc_sockkey_t)))
+
+KHASH_INIT(sockmap_t, proc_sockkey_t, proc_sockent_t, 1, proc_sockkey_hash,
+           proc_sockkey_equal)
+KHASH_INIT(infomap_t, khint32_t, proc_infoent_t, 1, kh_int_hash_func,
+           kh_int_hash_equal)
+
+struct proc_index {
+	const proc_ops_t *ops;
+	pthread_mutex_t mutex;
+	khash_t(sockmap_t) *socks;
+	unsigned long gen;
+	long long scanned;      /* usec at which the last scan started */
+	unsigned long scans;
+	pthread_mutex_t infomutex;
+	khash_t(infomap_t) *infos;
+};
+
+static long long
+proc_now(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		return 0;
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Fill key from addr.  Returns 0 on success, -1 for other address families.
  */
+static int
+proc_sockkey_set(proc_sockkey_t *key, const struct sockaddr *addr)
+{
+	memset(key, 0, sizeof(*key));
+	key->family = addr->sa_family;
+	if (addr->sa_family == AF_INET) {
+		const struct sockaddr_in *sai = (const void *)addr;
+		key->port = sai->sin_port;
+		memcpy(key->addr, &sai->sin_addr, 4);
+	} else if (addr->sa_family == AF_INET6) {
+		const struct sockaddr_in6 *sai = (const void *)addr;
+		key->port = sai->sin6_port;
+		memcpy(key->addr, &sai->sin6_addr, 16);
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+proc_index_t *
+proc_index_new(const proc_ops_t *ops)
+{
+	proc_index_t *idx;
+
+	if (!(idx = malloc(sizeof(proc_index_t))))
+		return NULL;
+	memset(idx, 0, sizeof(proc_index_t));
+	idx->ops = ops;
+	if (!(idx->socks = kh_init(sockmap_t))) {
+		free(idx);
+		return NULL;
+	}
+	if (!(idx->infos = kh_init(infomap_t))) {
+		kh_destroy(sockmap_t, idx->socks);
+		free(idx);
+		return NULL;
+	}
+	idx->scanned = -PROC_INDEX_MAXAGE - 1;
+	pthread_mutex_init(&idx->mutex, NULL);
+	pthread_mutex_init(&idx->infomutex, NULL);
+	return idx;
+}
+
+static void
+proc_index_info_clear(proc_index_t *idx)
+{
+	for (khiter_t k = kh_begin(idx->infos); k != kh_end(idx->infos); k++) {
+		if (kh_exist(idx->infos, k) && kh_val(idx->infos, k).path)
+			free(kh_val(idx->infos, k).path);
+	}
+	kh_clear(infomap_t, idx->infos);
+}
+
+void
+proc_index_free(proc_index_t *idx)
+{
+	proc_index_info_clear(idx);
+	kh_destroy(infomap_t, idx->infos);
+	kh_destroy(sockmap_t, idx->socks);
+	pthread_mutex_destroy(&idx->infomutex);
+	pthread_mutex_destroy(&idx->mutex);
+	free(idx);
+}
+
+/*
+ * Add or update the socket with local address addr owned by pid.  Called by
+ * the scan function, with the index locked.  Sockets of other address
+ * families are ignored.
+ * Returns 0 on success, -1 on memory allocation failure.
+ */
+int
+proc_index_add(proc_index_t *idx, const struct sockaddr *addr, pid_t pid)
+{
+	proc_sockkey_t key;
+	khiter_t k;
+	int ret;
+
+	if (proc_sockkey_set(&key, addr) == -1)
+		return 0;
+	k = kh_put(sockmap_t, idx->socks, key, &ret);
+	if (ret == -1)
+		return -1;
+	kh_val(idx->socks, k).pid = pid;
+	kh_val(idx->socks, k).gen = idx->gen;
+	return 0;
+}
+
+/*
+ * Scan all sockets and sweep the entries of sockets not seen by the scan.
+ * A failed scan leaves the index as it was.
+ */
+static int
+proc_index_scan(proc_index_t *idx)
+{
+	idx->scanned = proc_now();
+	idx->scans++;
+	idx->gen++;
+	if (idx->ops->scan(idx) == -1)
+		return -1;
+	for (khiter_t k = kh_begin(idx->socks); k != kh_end(idx->socks); k++) {
+		if (kh_exist(idx->socks, k) &&
+		    kh_val(idx->socks, k).gen != idx->gen)
+			kh_del(sockmap_t, idx->socks, k);
+	}
+	return 0;
+}
+
+/*
+ * Look up the PID of the process owning the local socket addr, for a lookup
+ * requested at time now.
+ */
+static int
+proc_index_lookup(proc_index_t *idx, pid_t *result,
+                  const struct sockaddr *addr, long long now)
+{
+	proc_sockkey_t key;
+	khiter_t k;
+	int rv = 0;
+
+	*result = -1;
+	if (proc_sockkey_set(&key, addr) == -1)
+		return 0;
+	pthread_mutex_lock(&idx->mutex);
+	if (now - idx->scanned > PROC_INDEX_MAXAGE) {
+		if ((rv = proc_index_scan(idx)) == -1)
+			goto out;
+	}
+	k = kh_get(sockmap_t, idx->socks, key);
+	if (k == kh_end(idx->socks) && idx->scanned < now) {
+		/* the socket may be newer than the last scan */
+		if ((rv = proc_index_scan(idx)) == -1)
+			goto out;
+		k = kh_get(sockmap_t, idx->socks, key);
+	}
+	if (k != kh_end(idx->socks))
+		*result = kh_val(idx->socks, k).pid;
+out:
+	pthread_mutex_unlock(&idx->mutex);
+	return rv;
+}
+
+/*
+ * Look up the PID of the process owning the local socket addr.
+ * Thread-safe.  Returns 0 on success, with *result set to -1 if no process
+ * owns the socket, and -1 on failure.
+ */
+int
+proc_index_pid_for_addr(proc_index_t *idx, pid_t *result,
+                        const struct sockaddr *addr)
+{
+	return proc_index_lookup(idx, result, addr, proc_now());
+}
+
+/*
+ * Fetch executable path, uid and gid of process pid, from the cache if the
+ * process has the same start time as when it was cached.  Thread-safe.
+ * Caller must free the returned path, which may be NULL.
+ * Returns 0 on success, -1 on failure.
+ */
+int
+proc_index_get_info(proc_index_t *idx, pid_t pid, char **path,
+                    uid_t *uid, gid_t *gid)
+{
+	unsigned long long start;
+	proc_infoent_t *ent;
+	khiter_t k;
+	int ret;
+
+	if (idx->ops->starttime(pid, &start) == -1)
+		return idx->ops->info(pid, path, uid, gid);
+
+	pthread_mutex_lock(&idx->infomutex);
+	k = kh_get(infomap_t, idx->infos, pid);
+	if (k != kh_end(idx->infos) && kh_val(idx->infos, k).start == start) {
+		ent = &kh_val(idx->infos, k);
+		*path = ent->path ? strdup(ent->path) : NULL;
+		*uid = ent->uid;
+		*gid = ent->gid;
+		pthread_mutex_unlock(&idx->infomutex);
+		return 0;
+	}
+	pthread_mutex_unlock(&idx->infomutex);
+
+	if (idx->ops->info(pid, path, uid, gid) == -1)
+		return -1;
+
+	pthread_mutex_lock(&idx->infomutex);
+	if (kh_size(idx->infos) >= PROC_INFO_MAX)
+		proc_index_info_clear(idx);
+	k = kh_put(infomap_t, idx->infos, pid, &ret);
+	if (ret != -1) {
+		ent = &kh_val(idx->infos, k);
+		if (ret == 0 && ent->path)
+			free(ent->path);
+		ent->start = start;
+		ent->path = *path ? strdup(*path) : NULL;
+		ent->uid = *uid;
+		ent->gid = *gid;
+	}
+	pthread_mutex_unlock(&idx->infomutex);
+	return 0;
+}
+
+/*
+ * Number of scans done so far, for testing.
+ */
+unsigned long
+proc_index_scans(proc_index_t *idx)
+{
+	return idx->scans;
+}
 
 
 #ifdef __FreeBSD__
 
+KHASH_INIT(sopid_t, uint64_t, pid_t, 1, kh_int64_hash_func,
+           kh_int64_hash_equal)
+
 /*
  * Get the list of open files from the kernel and do basic consistency checks.
  * If successful, returns 0, and *pxfiles will receive a pointer to the
@@ -166,13 +472,11 @@ proc_freebsd_gettcppcblist(struct xinpgen **pxig, struct xinpgen **pexig)
 	return 0;
 }
 
-int
-proc_freebsd_pid_for_addr(pid_t *result, struct sockaddr *src_addr,
-                          UNUSED socklen_t src_addrlen)
+static int
+proc_freebsd_scan(proc_index_t *idx)
 {
 	struct xfile *xfiles;
 	int nxfiles;
-	struct xfile *xf;
 
 	struct xinpgen *xig, *exig, *txig;
 	struct xtcpcb *xtp;
@@ -182,24 +486,40 @@ proc_freebsd_pid_for_addr(pid_t *result, struct sockaddr *src_addr,
 	struct inpcb *inp;
 #endif
 	struct xsocket *so;
+	khash_t(sopid_t) *sopids;
+	khiter_t k;
+	int ret;
 
 	if (proc_freebsd_getfiles(&xfiles, &nxfiles) == -1) {
 		return -1;
 	}
 
-	if (proc_freebsd_gettcppcblist(&xig, &exig) == -1) {
+	/* index socket file descriptors by kernel socket address;
+	 * there can be several processes sharing a connected socket file
+	 * descriptor, in which case the last one wins */
+	if (!(sopids = kh_init(sopid_t))) {
 		free(xfiles);
 		return -1;
 	}
+	for (int i = 0; i < nxfiles; ++i) {
+		if (xfiles[i].xf_type != DTYPE_SOCKET)
+			continue;
+		k = kh_put(sopid_t, sopids, (uintptr_t)xfiles[i].xf_data, &ret);
+		if (ret == -1)
+			goto errout1;
+		kh_val(sopids, k) = xfiles[i].xf_pid;
+	}
+
+	if (proc_freebsd_gettcppcblist(&xig, &exig) == -1) {
+		goto errout1;
+	}
 
 	for (txig = (struct xinpgen *)(void *)((char *)xig + xig->xig_len);
 	     txig < exig;
 	     txig = (struct xinpgen *)(void *)((char *)txig + txig->xig_len)) {
 		xtp = (struct xtcpcb *)txig;
 		if (xtp->xt_len != sizeof *xtp) {
-			free(xfiles);
-			free(xig);
-			return -1;
+			goto errout2;
 		}
 		inp = &xtp->xt_inp;
 #if __FreeBSD_version >= 1200026
@@ -212,60 +532,69 @@ proc_freebsd_pid_for_addr(pid_t *result, struct sockaddr *src_addr,
 			/* we are only interested in connected sockets */
 			continue;
 
-		if ((inp->inp_vflag & INP_IPV4) &&
-		    (src_addr->sa_family == AF_INET)) {
-			struct sockaddr_in *src_sai =
-					(struct sockaddr_in *)src_addr;
-
-			if (src_sai->sin_addr.s_addr != inp->inp_laddr.s_addr) {
-				continue;
-			}
-
-			if (src_sai->sin_port != inp->inp_lport) {
-				continue;
-			}
-		} else if ((inp->inp_vflag & INP_IPV6) &&
-		          (src_addr->sa_family == AF_INET6)) {
-			struct sockaddr_in6 *src_sai =
-					(struct sockaddr_in6 *)src_addr;
-
-			if (memcmp(src_sai->sin6_addr.s6_addr, inp->in6p_laddr.s6_addr, 16) != 0) {
-				continue;
-			}
-
-			if (src_sai->sin6_port != inp->inp_lport) {
-				continue;
-			}
-		} else {
-			/* other address family */
+		k = kh_get(sopid_t, sopids, (uintptr_t)so->xso_so);
+		if (k == kh_end(sopids))
 			continue;
-		}
 
-		/* valid match */
-
-		/* only do this if we have a match */
-		xf = NULL;
-		for (int i = 0; i < nxfiles; ++i) {
-			if (so->xso_so == xfiles[i].xf_data) {
-				/* there can be several processes sharing a
-				 * connected socket file descriptor */
-				xf = &xfiles[i];
-			}
+		if (inp->inp_vflag & INP_IPV4) {
+			struct sockaddr_in sai;
+
+			memset(&sai, 0, sizeof(sai));
+			sai.sin_family = AF_INET;
+			sai.sin_addr.s_addr = inp->inp_laddr.s_addr;
+			sai.sin_port = inp->inp_lport;
+			if (proc_index_add(idx, (struct sockaddr *)&sai,
+			                   kh_val(sopids, k)) == -1)
+				goto errout2;
+		} else if (inp->inp_vflag & INP_IPV6) {
+			struct sockaddr_in6 sai;
+
+			memset(&sai, 0, sizeof(sai));
+			sai.sin6_family = AF_INET6;
+			memcpy(sai.sin6_addr.s6_addr,
+			       inp->in6p_laddr.s6_addr, 16);
+			sai.sin6_port = inp->inp_lport;
+			if (proc_index_add(idx, (struct sockaddr *)&sai,
+			                   kh_val(sopids, k)) == -1)
+				goto errout2;
 		}
-		if (!xf)
-			continue;
-		*result = xf->xf_pid;
-		break;
 	}
 
+	kh_destroy(sopid_t, sopids);
 	free(xfiles);
 	free(xig);
 	return 0;
+
+errout2:
+	free(xig);
+errout1:
+	kh_destroy(sopid_t, sopids);
+	free(xfiles);
+	return -1;
 }
 
-int
+static int
+proc_freebsd_starttime(pid_t pid, unsigned long long *start)
+{
+	struct kinfo_proc proc;
+	size_t len;
+	int mib[4];
+
+	mib[0] = CTL_KERN;
+	mib[1] = KERN_PROC;
+	mib[2] = KERN_PROC_PID;
+	mib[3] = (int)pid;
+	len = sizeof proc;
+	if (sysctl(mib, 4, &proc, &len, NULL, 0) == -1 || len == 0)
+		return -1;
+	*start = (unsigned long long)proc.ki_start.tv_sec * 1000000 +
+	         proc.ki_start.tv_usec;
+	return 0;
+}
+
+static int
 proc_freebsd_get_info(pid_t pid, char **path, uid_t *uid, gid_t *gid) {
-	static struct kinfo_proc proc;
+	struct kinfo_proc proc;
 	size_t len;
 	int mib[4];
 	char buf[PATH_MAX];
@@ -307,23 +636,24 @@ proc_freebsd_get_info(pid_t pid, char **path, uid_t *uid, gid_t *gid) {
 	return 0;
 }
 
+static const proc_ops_t proc_local_ops = {
+	proc_freebsd_scan,
+	proc_freebsd_starttime,
+	proc_freebsd_get_info
+};
+
 #endif /* __FreeBSD__ */
 
 
 #ifdef HAVE_DARWIN_LIBPROC
 
-int
-proc_darwin_pid_for_addr(pid_t *result, struct sockaddr *src_addr,
-                         UNUSED socklen_t src_addrlen)
+static int
+proc_darwin_scan(proc_index_t *idx)
 {
 	pid_t *pids = NULL;
 	struct proc_fdinfo *fds = NULL;
 	int ret = -1;
 
-	/* default result if no pid matches */
-	*result = -1;
-
-	/* iterate over all pids to find a matching socket */
 	int pid_count = proc_listallpids(NULL, 0);
 	if (pid_count <= 0)
 		goto errout1;
@@ -356,10 +686,11 @@ proc_darwin_pid_for_addr(pid_t *result, struct sockaddr *src_addr,
 		fd_count = proc_pidinfo(pid, PROC_PIDLISTFDS, 0, fds,
 		                        sizeof(fds[0]) * fd_count);
 
-		/* look for a matching socket file descriptor */
+		/* add all TCP socket file descriptors */
 		for (int j = 0; j < fd_count; j++) {
 			struct proc_fdinfo *fd = &fds[j];
 			struct socket_fdinfo sinfo;
+			struct in_sockinfo *ini;
 
 			if (fd->proc_fdtype != PROX_FDTYPE_SOCKET) {
 				continue;
@@ -378,42 +709,33 @@ proc_darwin_pid_for_addr(pid_t *result, struct sockaddr *src_addr,
 				continue;
 			}
 
-			uint16_t sock_lport = sinfo.psi.soi_proto.pri_tcp.tcpsi_ini.insi_lport;
-			if (sinfo.psi.soi_family == AF_INET &&
-			    src_addr->sa_family == AF_INET) {
-				struct sockaddr_in *src_sai = (struct sockaddr_in *)src_addr;
-
-				if (src_sai->sin_addr.s_addr != sinfo.psi.soi_proto.pri_tcp.tcpsi_ini.insi_laddr.ina_46.i46a_addr4.s_addr) {
-					continue;
-				}
-
-				if (src_sai->sin_port != sock_lport) {
-					continue;
-				}
-			} else if (sinfo.psi.soi_family == AF_INET6 &&
-			           src_addr->sa_family == AF_INET6) {
-				struct sockaddr_in6 *src_sai = (struct sockaddr_in6 *)src_addr;
-
-				if (memcmp(src_sai->sin6_addr.s6_addr, sinfo.psi.soi_proto.pri_tcp.tcpsi_ini.insi_laddr.ina_6.s6_addr, 16) != 0) {
-					continue;
-				}
-
-				if (src_sai->sin6_port != sock_lport) {
-					continue;
-				}
-			} else {
-				/* other address family */
-				continue;
+			ini = &sinfo.psi.soi_proto.pri_tcp.tcpsi_ini;
+			if (sinfo.psi.soi_family == AF_INET) {
+				struct sockaddr_in sai;
+
+				memset(&sai, 0, sizeof(sai));
+				sai.sin_family = AF_INET;
+				sai.sin_addr = ini->insi_laddr.ina_46.i46a_addr4;
+				sai.sin_port = ini->insi_lport;
+				if (proc_index_add(idx, (struct sockaddr *)&sai,
+				                   pid) == -1)
+					goto errout3;
+			} else if (sinfo.psi.soi_family == AF_INET6) {
+				struct sockaddr_in6 sai;
+
+				memset(&sai, 0, sizeof(sai));
+				sai.sin6_family = AF_INET6;
+				sai.sin6_addr = ini->insi_laddr.ina_6;
+				sai.sin6_port = ini->insi_lport;
+				if (proc_index_add(idx, (struct sockaddr *)&sai,
+				                   pid) == -1)
+					goto errout3;
 			}
-
-			/* valid match */
-			*result = pid;
-			goto success;
 		}
 	}
 
-success:
 	ret = 0;
+errout3:
 	free(fds);
 errout2:
 	free(pids);
@@ -421,13 +743,27 @@ errout1:
 	return ret;
 }
 
+static int
+proc_darwin_starttime(pid_t pid, unsigned long long *start)
+{
+	struct proc_bsdinfo bsd_info;
+
+	if (proc_pidinfo(pid, PROC_PIDTBSDINFO, 0, &bsd_info,
+	                 sizeof(bsd_info)) <= 0) {
+		return -1;
+	}
+	*start = (unsigned long long)bsd_info.pbi_start_tvsec * 1000000 +
+	         bsd_info.pbi_start_tvusec;
+	return 0;
+}
+
 /*
  * Fetch process info for the given pid.
  * On success, returns 0 and fills in path, uid, and gid.
  * Caller must free returned path string.
  * Returns -1 on failure, or if unsupported on this platform.
  */
-int
+static int
 proc_darwin_get_info(pid_t pid, char **path, uid_t *uid, gid_t *gid) {
 	/* fetch process structure */
 	struct proc_bsdinfo bsd_info;
@@ -454,8 +790,558 @@ proc_darwin_get_info(pid_t pid, char **path, uid_t *uid, gid_t *gid) {
 	return 0;
 }
 
+static const proc_ops_t proc_local_ops = {
+	proc_darwin_scan,
+	proc_darwin_starttime,
+	proc_darwin_get_info
+};
+
 #endif /* HAVE_DARWIN_LIBPROC */
 
+
+#ifdef __linux__
+
+/*
+ * One NETLINK_SOCK_DIAG dump per address family lists all connected TCP
+ * sockets with their local address and inode.  Socket inodes are mapped to
+ * PIDs using an index of the socket file descriptors in /proc/<pid>/fd, which
+ * is only rebuilt if a dump contains a socket inode not in the index, at most
+ * once per scan.  Inodes not found while rebuilding, such as those of
+ * orphaned sockets, are remembered as unowned until the next rebuild.
+ * Only called with the socket index locked.
+ */
+
+#define PROC_LINUX_TCPF ((1 << TCP_ESTABLISHED) | (1 << TCP_SYN_SENT) | \
+                         (1 << TCP_SYN_RECV) | (1 << TCP_FIN_WAIT1) | \
+                         (1 << TCP_FIN_WAIT2) | (1 << TCP_CLOSE_WAIT) | \
+                         (1 << TCP_LAST_ACK) | (1 << TCP_CLOSING))
+
+KHASH_INIT(inomap_t, uint64_t, pid_t, 1, kh_int64_hash_func,
+           kh_int64_hash_equal)
+
+typedef struct proc_linux_sock {
+	struct sockaddr_storage addr;
+	uint64_t ino;
+} proc_linux_sock_t;
+
+typedef struct proc_linux_socks {
+	proc_linux_sock_t *socks;
+	size_t n;
+	size_t sz;
+} proc_linux_socks_t;
+
+static khash_t(inomap_t) *proc_linux_inos = NULL;
+
+/*
+ * Rebuild the inode to PID index from the file descriptors of all processes.
+ * Processes whose file descriptors cannot be read are skipped.
+ */
+static int
+proc_linux_inos_rebuild(khash_t(inomap_t) *inos)
+{
+	DIR *procdir, *fddir;
+	struct dirent *de, *fde;
+	char buf[64];
+	khiter_t k;
+	int fd, ret;
+
+	kh_clear(inomap_t, inos);
+	if (!(procdir = opendir("/proc")))
+		return -1;
+	while ((de = readdir(procdir))) {
+		char *end;
+		long pid;
+
+		pid = strtol(de->d_name, &end, 10);
+		if (de->d_name[0] < '1' || de->d_name[0] > '9' || *end)
+			continue;
+		snprintf(buf, sizeof(buf), "%ld/fd", pid);
+		fd = openat(dirfd(procdir), buf,
+		            O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd == -1) {
+			/* process exited or not permitted */
+			continue;
+		}
+		if (!(fddir = fdopendir(fd))) {
+			close(fd);
+			continue;
+		}
+		while ((fde = readdir(fddir))) {
+			ssize_t n;
+
+			if (fde->d_name[0] == '.')
+				continue;
+			n = readlinkat(fd, fde->d_name, buf, sizeof(buf) - 1);
+			if (n < 10 || memcmp(buf, "socket:[", 8))
+				continue;
+			buf[n] = '\0';
+			k = kh_put(inomap_t, inos, strtoull(buf + 8, NULL, 10),
+			           &ret);
+			if (ret == -1) {
+				closedir(fddir);
+				closedir(procdir);
+				return -1;
+			}
+			kh_val(inos, k) = (pid_t)pid;
+		}
+		closedir(fddir);
+	}
+	closedir(procdir);
+	return 0;
+}
+
+/*
+ * Append a socket from a sock_diag message to socks.  Sockets without inode
+ * are not owned by any process.  IPv4-mapped IPv6 addresses are added as
+ * IPv4, since that is how the proxy sees the client.
+ */
+static int
+proc_linux_socks_add(proc_linux_socks_t *socks, struct inet_diag_msg *dm)
+{
+	proc_linux_sock_t *sock;
+
+	if (!dm->idiag_inode)
+		return 0;
+	if (socks->n == socks->sz) {
+		size_t sz = socks->sz ? socks->sz * 2 : 256;
+		void *p = realloc(socks->socks, sz * sizeof(proc_linux_sock_t));
+		if (!p)
+			return -1;
+		socks->socks = p;
+		socks->sz = sz;
+	}
+	sock = &socks->socks[socks->n];
+	memset(sock, 0, sizeof(proc_linux_sock_t));
+	sock->ino = dm->idiag_inode;
+	if (dm->idiag_family == AF_INET ||
+	    IN6_IS_ADDR_V4MAPPED((struct in6_addr *)dm->id.idiag_src)) {
+		struct sockaddr_in *sai = (struct sockaddr_in *)&sock->addr;
+		sai->sin_family = AF_INET;
+		sai->sin_port = dm->id.idiag_sport;
+		memcpy(&sai->sin_addr, dm->idiag_family == AF_INET ?
+		       &dm->id.idiag_src[0] : &dm->id.idiag_src[3], 4);
+	} else {
+		struct sockaddr_in6 *sai = (struct sockaddr_in6 *)&sock->addr;
+		sai->sin6_family = AF_INET6;
+		sai->sin6_port = dm->id.idiag_sport;
+		memcpy(&sai->sin6_addr, dm->id.idiag_src, 16);
+	}
+	socks->n++;
+	return 0;
+}
+
+/*
+ * Dump all connected TCP sockets of address family family.
+ */
+static int
+proc_linux_dump(int fd, int family, proc_linux_socks_t *socks)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct inet_diag_req_v2 req;
+	} msg;
+	struct sockaddr_nl nladdr;
+	uint32_t buf[4096];
+	struct nlmsghdr *h;
+	ssize_t n;
+	int len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.nlh.nlmsg_len = sizeof(msg);
+	msg.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+	msg.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	msg.req.sdiag_family = family;
+	msg.req.sdiag_protocol = IPPROTO_TCP;
+	msg.req.idiag_states = PROC_LINUX_TCPF;
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+	if (sendto(fd, &msg, sizeof(msg), 0, (struct sockaddr *)&nladdr,
+	           sizeof(nladdr)) == -1)
+		return -1;
+
+	for (;;) {
+		n = recv(fd, buf, sizeof(buf), 0);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		len = (int)n;
+		for (h = (struct nlmsghdr *)buf; NLMSG_OK(h, len);
+		     h = NLMSG_NEXT(h, len)) {
+			if (h->nlmsg_type == NLMSG_DONE)
+				return 0;
+			if (h->nlmsg_type == NLMSG_ERROR)
+				return -1;
+			if (h->nlmsg_type != SOCK_DIAG_BY_FAMILY ||
+			    h->nlmsg_len < NLMSG_LENGTH(
+			                   sizeof(struct inet_diag_msg)))
+				continue;
+			if (proc_linux_socks_add(socks, NLMSG_DATA(h)) == -1)
+				return -1;
+		}
+	}
+}
+
+static int
+proc_linux_scan(proc_index_t *idx)
+{
+	proc_linux_socks_t socks;
+	khiter_t k;
+	int fd, ret, rv = -1;
+
+	if (!proc_linux_inos && !(proc_linux_inos = kh_init(inomap_t)))
+		return -1;
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+	if (fd == -1)
+		return -1;
+	memset(&socks, 0, sizeof(socks));
+	if (proc_linux_dump(fd, AF_INET, &socks) == -1 ||
+	    proc_linux_dump(fd, AF_INET6, &socks) == -1)
+		goto out;
+
+	for (size_t i = 0; i < socks.n; i++) {
+		k = kh_get(inomap_t, proc_linux_inos, socks.socks[i].ino);
+		if (k == kh_end(proc_linux_inos)) {
+			if (proc_linux_inos_rebuild(proc_linux_inos) == -1)
+				goto out;
+			break;
+		}
+	}
+
+	for (size_t i = 0; i < socks.n; i++) {
+		k = kh_put(inomap_t, proc_linux_inos, socks.socks[i].ino, &ret);
+		if (ret == -1)
+			goto out;
+		if (ret != 0) {
+			/* not found in rebuilt index */
+			kh_val(proc_linux_inos, k) = -1;
+			continue;
+		}
+		if (kh_val(proc_linux_inos, k) == -1)
+			continue;
+		if (proc_index_add(idx, (struct sockaddr *)&socks.socks[i].addr,
+		                   kh_val(proc_linux_inos, k)) == -1)
+			goto out;
+	}
+	rv = 0;
+out:
+	free(socks.socks);
+	close(fd);
+	return rv;
+}
+
+/*
+ * Start time of process pid in clock ticks since boot, which is the 22nd
+ * field of /proc/<pid>/stat.
+ */
+static int
+proc_linux_starttime(pid_t pid, unsigned long long *start)
+{
+	char buf[1024];
+	char *p;
+	ssize_t n;
+	int fd;
+
+	snprintf(buf, sizeof(buf), "/proc/%ld/stat", (long)pid);
+	if ((fd = open(buf, O_RDONLY | O_CLOEXEC)) == -1)
+		return -1;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return -1;
+	buf[n] = '\0';
+	/* the command name in the 2nd field may contain spaces */
+	if (!(p = strrchr(buf, ')')))
+		return -1;
+	for (int i = 0; i < 20; i++) {
+		if (!(p = strchr(p + 1, ' ')))
+			return -1;
+	}
+	*start = strtoull(p + 1, NULL, 10);
+	return 0;
+}
+
+/*
+ * Fetch process info for the given pid.  The owner of /proc/<pid> is the
+ * effective uid and gid of the process.  If the executable path cannot be
+ * read, the command name is used instead.
+ */
+static int
+proc_linux_get_info(pid_t pid, char **path, uid_t *uid, gid_t *gid)
+{
+	char buf[PATH_MAX];
+	char fn[32];
+	struct stat st;
+	ssize_t n;
+	int fd;
+
+	snprintf(fn, sizeof(fn), "/proc/%ld", (long)pid);
+	if (stat(fn, &st) == -1)
+		return -1;
+	*uid = st.st_uid;
+	*gid = st.st_gid;
+
+	*path = NULL;
+	snprintf(fn, sizeof(fn), "/proc/%ld/exe", (long)pid);
+	n = readlink(fn, buf, sizeof(buf) - 1);
+	if (n <= 0) {
+		snprintf(fn, sizeof(fn), "/proc/%ld/comm", (long)pid);
+		if ((fd = open(fn, O_RDONLY | O_CLOEXEC)) == -1)
+			return 0;
+		n = read(fd, buf, sizeof(buf) - 1);
+		close(fd);
+		if (n > 0 && buf[n - 1] == '\n')
+			n--;
+	}
+	if (n > 0) {
+		buf[n] = '\0';
+		*path = strdup(buf);
+	}
+	return 0;
+}
+
+static const proc_ops_t proc_local_ops = {
+	proc_linux_scan,
+	proc_linux_starttime,
+	proc_linux_get_info
+};
+
+#endif /* __linux__ */
+
+#ifdef HAVE_LOCAL_PROCINFO
+
+static proc_index_t *proc_local_index = NULL;
+static pthread_once_t proc_local_once = PTHREAD_ONCE_INIT;
+
+static void
+proc_local_init(void)
+{
+	proc_local_index = proc_index_new(&proc_local_ops);
+}
+
+/*
+ * Look up the PID of the local process owning the socket with local address
+ * src_addr.  Sets *result to -1 if no matching socket was found.
+ * Returns 0 on success, -1 on failure.
+ */
+int
+proc_pid_for_addr(pid_t *result, struct sockaddr *src_addr,
+                  UNUSED socklen_t src_addrlen)
+{
+	pthread_once(&proc_local_once, proc_local_init);
+	if (!proc_local_index) {
+		*result = -1;
+		return -1;
+	}
+	return proc_index_pid_for_addr(proc_local_index, result, src_addr);
+}
+
+/*
+ * Fetch process info for the given pid.
+ * On success, returns 0 and fills in path, uid, and gid.
+ * Caller must free returned path string.
+ * Returns -1 on failure.
+ */
+int
+proc_get_info(pid_t pid, char **path, uid_t *uid, gid_t *gid)
+{
+	pthread_once(&proc_local_once, proc_local_init);
+	if (!proc_local_index)
+		return -1;
+	return proc_index_get_info(proc_local_index, pid, path, uid, gid);
+}
+
+/*
+ * Release the socket index and process info cache.
+ */
+void
+proc_fini(void)
+{
+	if (proc_local_index) {
+		proc_index_free(proc_local_index);
+		proc_local_index = NULL;
+	}
+#ifdef __linux__
+	if (proc_linux_inos) {
+		kh_destroy(inomap_t, proc_linux_inos);
+		proc_linux_inos = NULL;
+	}
+#endif /* __linux__ */
+}
+
+/*
+ * Asynchronous lookups: a single lookup thread serves the lookups submitted
+ * by the connection handling threads, such that scanning sockets and
+ * processes and resolving user and group names never blocks an event base.
+ * One thread is enough since concurrent lookups share scans anyway; each
+ * lookup counts as requested at submission time, such that a single rescan
+ * serves all misses queued before it started.  The completion callback is
+ * scheduled on the event base of the submitting thread using
+ * event_base_once().  A job may be cancelled from the submitting thread
+ * until its completion callback has run; the job is always freed here.
+ */
+
+#define PROC_LOOKUP_QUEUE_SIZE 1024
+
+struct proc_lookup {
+	struct event_base *evbase;
+	struct sockaddr_storage addr;
+	long long reqtime;
+	proc_lookup_cb_t cb;
+	void *arg;
+	proc_info_t info;
+};
+
+static thrqueue_t *proc_lookup_queue = NULL;
+static pthread_t proc_lookup_thr;
+static int proc_lookup_stopping = 0;
+
+static void
+proc_lookup_free(proc_lookup_t *job)
+{
+	if (job->info.path)
+		free(job->info.path);
+	if (job->info.user)
+		free(job->info.user);
+	if (job->info.group)
+		free(job->info.group);
+	free(job);
+}
+
+/*
+ * Completion callback, runs on the event base of the submitting thread.
+ */
+static void
+proc_lookup_done_cb(UNUSED evutil_socket_t fd, UNUSED short what, void *arg)
+{
+	proc_lookup_t *job = arg;
+
+	if (job->cb)
+		job->cb(&job->info, job->arg);
+	proc_lookup_free(job);
+}
+
+static void
+proc_lookup_do(proc_lookup_t *job)
+{
+	proc_info_t *info = &job->info;
+
+	pthread_once(&proc_local_once, proc_local_init);
+	if (!proc_local_index ||
+	    proc_index_lookup(proc_local_index, &info->pid,
+	                      (struct sockaddr *)&job->addr,
+	                      job->reqtime) == -1 ||
+	    info->pid == -1)
+		return;
+	if (proc_index_get_info(proc_local_index, info->pid, &info->path,
+	                        &info->uid, &info->gid) == -1)
+		return;
+	info->user = sys_user_str(info->uid);
+	info->group = sys_group_str(info->gid);
+}
+
+static void *
+proc_lookup_thread(UNUSED void *arg)
+{
+	proc_lookup_t *job;
+
+	while ((job = thrqueue_dequeue(proc_lookup_queue))) {
+		if (__atomic_load_n(&proc_lookup_stopping, __ATOMIC_ACQUIRE)) {
+			proc_lookup_free(job);
+			continue;
+		}
+		proc_lookup_do(job);
+		if (event_base_once(job->evbase, -1, EV_TIMEOUT,
+		                    proc_lookup_done_cb, job, NULL) == -1) {
+			log_err_printf("Failed to schedule process lookup "
+			               "completion\n");
+			proc_lookup_free(job);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Start the lookup thread.  Must be called after forking.
+ * Returns -1 on failure, 0 on success.
+ */
+int
+proc_lookup_run(void)
+{
+	if (!(proc_lookup_queue = thrqueue_new(PROC_LOOKUP_QUEUE_SIZE)))
+		return -1;
+	if (pthread_create(&proc_lookup_thr, NULL, proc_lookup_thread, NULL)) {
+		thrqueue_free(proc_lookup_queue);
+		proc_lookup_queue = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Stop the lookup thread, discarding queued jobs without invoking their
+ * callbacks.  Must be called while the event bases that jobs were submitted
+ * from still exist.
+ */
+void
+proc_lookup_stop(void)
+{
+	proc_lookup_t *job;
+
+	if (!proc_lookup_queue)
+		return;
+	__atomic_store_n(&proc_lookup_stopping, 1, __ATOMIC_RELEASE);
+	thrqueue_unblock_dequeue(proc_lookup_queue);
+	pthread_join(proc_lookup_thr, NULL);
+	while ((job = thrqueue_dequeue_nb(proc_lookup_queue)))
+		proc_lookup_free(job);
+	thrqueue_free(proc_lookup_queue);
+	proc_lookup_queue = NULL;
+}
+
+/*
+ * Submit a lookup of the local process owning the socket with local address
+ * addr.  When done, cb is called on evbase with the result and arg.
+ * Returns the job, or NULL if the lookup thread is not running or the job
+ * could not be queued, in which case the caller should look up the process
+ * synchronously instead.
+ */
+proc_lookup_t *
+proc_lookup_submit(struct event_base *evbase, const struct sockaddr *addr,
+                   socklen_t addrlen, proc_lookup_cb_t cb, void *arg)
+{
+	proc_lookup_t *job;
+
+	if (!proc_lookup_queue || addrlen > sizeof(struct sockaddr_storage))
+		return NULL;
+	if (!(job = malloc(sizeof(proc_lookup_t))))
+		return NULL;
+	memset(job, 0, sizeof(proc_lookup_t));
+	job->evbase = evbase;
+	memcpy(&job->addr, addr, addrlen);
+	job->reqtime = proc_now();
+	job->cb = cb;
+	job->arg = arg;
+	job->info.pid = -1;
+	if (!thrqueue_enqueue_nb(proc_lookup_queue, job)) {
+		free(job);
+		return NULL;
+	}
+	return job;
+}
+
+/*
+ * Cancel a job; its callback will not be invoked.  Must be called from the
+ * event base the job was submitted from, before its callback was invoked.
+ */
+void
+proc_lookup_cancel(proc_lookup_t *job)
+{
+	job->cb = NULL;
+}
+
+#endif /* HAVE_LOCAL_PROCINFO */
+
 /* vim: set noet ft=c: */
 
 
@@ -35,30 +35,74 @@
 #include <sys/socket.h>
 
 #include <event2/util.h>
+#include <event2/event.h>
 
-#if defined(HAVE_DARWIN_LIBPROC) || defined(__FreeBSD__)
+#if defined(HAVE_DARWIN_LIBPROC) || defined(__FreeBSD__) || defined(__linux__)
 #define HAVE_LOCAL_PROCINFO
 #endif
 
+/*
+ * Index from local TCP socket address to owning process, filled by a
+ * platform specific scan of all sockets, and cache of process information
+ * keyed by PID and process start time.
+ */
+typedef struct proc_index proc_index_t;
+typedef struct proc_ops {
+	/* call proc_index_add() for all connected TCP sockets */
+	int (*scan)(proc_index_t *);
+	/* process start time in any unit, to detect PID reuse */
+	int (*starttime)(pid_t, unsigned long long *);
+	/* executable path (allocated), uid and gid of a process */
+	int (*info)(pid_t, char **, uid_t *, gid_t *);
+} proc_ops_t;
+
+proc_index_t * proc_index_new(const proc_ops_t *) NONNULL(1) MALLOC;
+void proc_index_free(proc_index_t *) NONNULL(1);
+int proc_index_add(proc_index_t *, const struct sockaddr *, pid_t)
+    NONNULL(1,2) WUNRES;
+int proc_index_pid_for_addr(proc_index_t *, pid_t *, const struct sockaddr *)
+    NONNULL(1,2,3) WUNRES;
+int proc_index_get_info(proc_index_t *, pid_t, char **, uid_t *, gid_t *)
+    NONNULL(1,3,4,5) WUNRES;
+unsigned long proc_index_scans(proc_index_t *) NONNULL(1) WUNRES;
+
+#ifdef HAVE_LOCAL_PROCINFO
 #ifdef HAVE_DARWIN_LIBPROC
-#ifndef LOCAL_PROCINFO_STR
 #define LOCAL_PROCINFO_STR "Darwin libproc"
-#define proc_pid_for_addr(a,b,c)	proc_darwin_pid_for_addr(a,b,c)
-#define proc_get_info(a,b,c,d)		proc_darwin_get_info(a,b,c,d)
-#endif /* LOCAL_PROCINFO_STR */
-int proc_darwin_pid_for_addr(pid_t *, struct sockaddr *, socklen_t) WUNRES NONNULL(1,2);
-int proc_darwin_get_info(pid_t, char **, uid_t *, gid_t *) WUNRES NONNULL(2,3,4);
-#endif /* HAVE_DARWIN_LIBPROC */
-
-#ifdef __FreeBSD__
-#ifndef LOCAL_PROCINFO_STR
+#elif defined(__FreeBSD__)
 #define LOCAL_PROCINFO_STR "FreeBSD sysctl"
-#define proc_pid_for_addr(a,b,c)	proc_freebsd_pid_for_addr(a,b,c)
-#define proc_get_info(a,b,c,d)		proc_freebsd_get_info(a,b,c,d)
-#endif /* LOCAL_PROCINFO_STR */
-int proc_freebsd_pid_for_addr(pid_t *, struct sockaddr *, socklen_t) WUNRES NONNULL(1,2);
-int proc_freebsd_get_info(pid_t, char **, uid_t *, gid_t *) WUNRES NONNULL(2,3,4);
-#endif /* __FreeBSD__ */
+#else /* __linux__ */
+#define LOCAL_PROCINFO_STR "Linux sock_diag"
+#endif /* __linux__ */
+int proc_pid_for_addr(pid_t *, struct sockaddr *, socklen_t) WUNRES NONNULL(1,2);
+int proc_get_info(pid_t, char **, uid_t *, gid_t *) WUNRES NONNULL(2,3,4);
+void proc_fini(void);
+
+/*
+ * Result of an asynchronous lookup; pid is -1 if no local process owns the
+ * socket.  The completion callback may take ownership of the strings by
+ * setting them to NULL, the others are freed after the callback returns.
+ */
+typedef struct proc_info {
+	pid_t pid;
+	uid_t uid;
+	gid_t gid;
+	char *path;
+	char *user;
+	char *group;
+} proc_info_t;
+
+typedef struct proc_lookup proc_lookup_t;
+typedef void (*proc_lookup_cb_t)(proc_info_t *, void *);
+
+int proc_lookup_run(void) WUNRES;
+void proc_lookup_stop(void);
+proc_lookup_t * proc_lookup_submit(struct event_base *,
+                                   const struct sockaddr *, socklen_t,
+                                   proc_lookup_cb_t, void *)
+                                   NONNULL(1,2,4) WUNRES;
+void proc_lookup_cancel(proc_lookup_t *) NONNULL(1);
+#endif /* HAVE_LOCAL_PROCINFO */
 
 #endif /* !PROC_H */
 
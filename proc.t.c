@@ -0,0 +1,249 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "proc.h"
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <check.h>
+
+/*
+ * Fake platform: a table of sockets owned by processes, and per process
+ * start time and path.
+ */
+#define FAKE_SOCKS 8
+static struct sockaddr_in fake_addr[FAKE_SOCKS];
+static pid_t fake_pid[FAKE_SOCKS];
+static int fake_nsocks;
+static unsigned long long fake_start;
+static const char *fake_path;
+static int fake_infocalls;
+
+static int
+fake_scan(proc_index_t *idx)
+{
+	for (int i = 0; i < fake_nsocks; i++) {
+		if (proc_index_add(idx, (struct sockaddr *)&fake_addr[i],
+		                   fake_pid[i]) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+static int
+fake_starttime(UNUSED pid_t pid, unsigned long long *start)
+{
+	*start = fake_start;
+	return 0;
+}
+
+static int
+fake_info(UNUSED pid_t pid, char **path, uid_t *uid, gid_t *gid)
+{
+	fake_infocalls++;
+	*path = strdup(fake_path);
+	*uid = 1000;
+	*gid = 100;
+	return 0;
+}
+
+static const proc_ops_t fake_ops = {
+	fake_scan,
+	fake_starttime,
+	fake_info
+};
+
+static void
+fake_add(const char *ip, unsigned short port, pid_t pid)
+{
+	struct sockaddr_in *sai = &fake_addr[fake_nsocks];
+
+	memset(sai, 0, sizeof(*sai));
+	sai->sin_family = AF_INET;
+	inet_pton(AF_INET, ip, &sai->sin_addr);
+	sai->sin_port = htons(port);
+	fake_pid[fake_nsocks++] = pid;
+}
+
+static void
+proc_setup(void)
+{
+	fake_nsocks = 0;
+	fake_start = 1;
+	fake_path = "/usr/bin/curl";
+	fake_infocalls = 0;
+}
+
+static void
+proc_teardown(void)
+{
+}
+
+START_TEST(proc_index_01)
+{
+	proc_index_t *idx;
+	pid_t pid;
+
+	fake_add("127.0.0.1", 40000, 100);
+	fake_add("127.0.0.1", 40001, 200);
+	idx = proc_index_new(&fake_ops);
+	fail_unless(!!idx, "proc_index_new failed");
+	fail_unless(proc_index_pid_for_addr(idx, &pid,
+	            (struct sockaddr *)&fake_addr[1]) == 0, "lookup failed");
+	fail_unless(pid == 200, "wrong pid");
+	fail_unless(proc_index_scans(idx) == 1, "not scanned once");
+	fail_unless(proc_index_pid_for_addr(idx, &pid,
+	            (struct sockaddr *)&fake_addr[0]) == 0, "lookup failed");
+	fail_unless(pid == 100, "wrong pid");
+	fail_unless(proc_index_scans(idx) == 1, "hit caused a rescan");
+	proc_index_free(idx);
+}
+END_TEST
+
+START_TEST(proc_index_02)
+{
+	proc_index_t *idx;
+	struct sockaddr_in6 sai;
+	pid_t pid;
+
+	idx = proc_index_new(&fake_ops);
+	fail_unless(!!idx, "proc_index_new failed");
+	/* first lookup scans, the new socket is found by a rescan */
+	fake_add("127.0.0.1", 40000, 100);
+	fail_unless(proc_index_pid_for_addr(idx, &pid,
+	            (struct sockaddr *)&fake_addr[0]) == 0, "lookup failed");
+	fail_unless(pid == 100, "wrong pid");
+	fake_add("127.0.0.1", 40001, 200);
+	fail_unless(proc_index_pid_for_addr(idx, &pid,
+	            (struct sockaddr *)&fake_addr[1]) == 0, "lookup failed");
+	fail_unless(pid == 200, "new socket not found");
+	fail_unless(proc_index_scans(idx) == 2, "miss did not rescan");
+	/* unknown address family is a miss without scanning */
+	memset(&sai, 0, sizeof(sai));
+	sai.sin6_family = AF_UNIX;
+	fail_unless(proc_index_pid_for_addr(idx, &pid,
+	            (struct sockaddr *)&sai) == 0, "lookup failed");
+	fail_unless(pid == -1, "found unknown address family");
+	fail_unless(proc_index_scans(idx) == 2, "unknown family rescanned");
+	/* same port on IPv6 is a different socket */
+	memset(&sai, 0, sizeof(sai));
+	sai.sin6_family = AF_INET6;
+	sai.sin6_port = htons(40000);
+	fail_unless(proc_index_pid_for_addr(idx, &pid,
+	            (struct sockaddr *)&sai) == 0, "lookup failed");
+	fail_unless(pid == -1, "found IPv6 socket");
+	proc_index_free(idx);
+}
+END_TEST
+
+START_TEST(proc_index_03)
+{
+	proc_index_t *idx;
+	struct sockaddr_in sai;
+	pid_t pid;
+
+	fake_add("127.0.0.1", 40000, 100);
+	fake_add("127.0.0.1", 40001, 200);
+	idx = proc_index_new(&fake_ops);
+	fail_unless(!!idx, "proc_index_new failed");
+	fail_unless(proc_index_pid_for_addr(idx, &pid,
+	            (struct sockaddr *)&fake_addr[0]) == 0, "lookup failed");
+	fail_unless(pid == 100, "wrong pid");
+	/* socket 40000 closed, a new process now owns 40002 */
+	fake_addr[0] = fake_addr[1];
+	fake_pid[0] = fake_pid[1];
+	fake_nsocks = 1;
+	fake_add("127.0.0.1", 40002, 300);
+	fail_unless(proc_index_pid_for_addr(idx, &pid,
+	            (struct sockaddr *)&fake_addr[1]) == 0, "lookup failed");
+	fail_unless(pid == 300, "wrong pid");
+	fail_unless(proc_index_scans(idx) == 2, "miss did not rescan");
+	/* the closed socket was swept by the rescan */
+	sai = fake_addr[1];
+	sai.sin_port = htons(40000);
+	fail_unless(proc_index_pid_for_addr(idx, &pid,
+	            (struct sockaddr *)&sai) == 0, "lookup failed");
+	fail_unless(pid == -1, "stale entry not swept");
+	proc_index_free(idx);
+}
+END_TEST
+
+START_TEST(proc_index_04)
+{
+	proc_index_t *idx;
+	char *path;
+	uid_t uid;
+	gid_t gid;
+
+	idx = proc_index_new(&fake_ops);
+	fail_unless(!!idx, "proc_index_new failed");
+	fail_unless(proc_index_get_info(idx, 100, &path, &uid, &gid) == 0,
+	            "get_info failed");
+	fail_unless(!strcmp(path, "/usr/bin/curl"), "wrong path");
+	fail_unless(uid == 1000 && gid == 100, "wrong uid/gid");
+	free(path);
+	fail_unless(proc_index_get_info(idx, 100, &path, &uid, &gid) == 0,
+	            "get_info failed");
+	fail_unless(!strcmp(path, "/usr/bin/curl"), "wrong cached path");
+	fail_unless(fake_infocalls == 1, "info not cached");
+	free(path);
+	/* pid reused by another process */
+	fake_start = 2;
+	fake_path = "/usr/bin/wget";
+	fail_unless(proc_index_get_info(idx, 100, &path, &uid, &gid) == 0,
+	            "get_info failed");
+	fail_unless(!strcmp(path, "/usr/bin/wget"), "stale path returned");
+	fail_unless(fake_infocalls == 2, "info not refetched");
+	free(path);
+	proc_index_free(idx);
+}
+END_TEST
+
+Suite *
+proc_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("proc");
+
+	tc = tcase_create("proc_index");
+	tcase_add_checked_fixture(tc, proc_setup, proc_teardown);
+	tcase_add_test(tc, proc_index_01);
+	tcase_add_test(tc, proc_index_02);
+	tcase_add_test(tc, proc_index_03);
+	tcase_add_test(tc, proc_index_04);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
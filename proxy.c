@@ -31,19 +31,27 @@
 #include "privsep.h"
 #include "pxythrmgr.h"
 #include "pxyconn.h"
+#include "pxyforge.h"
 #include "cachemgr.h"
+#include "sslticket.h"
+#include "ssl.h"
 #include "opts.h"
 #include "log.h"
+#include "stats.h"
+#include "sys.h"
 #include "attrib.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include <event2/event.h>
 #include <event2/listener.h>
@@ -57,145 +65,1652 @@
  * Proxy engine, built around libevent 2.x.
  */
 
-static int signals[] = { SIGTERM, SIGQUIT, SIGHUP, SIGINT, SIGPIPE, SIGUSR1 };
+/*
+ * Incremental garbage collection runs every PROXY_GC_INTERVAL seconds and
+ * scans at most PROXY_GC_BUDGET hash buckets per cache each time.
+ */
+#define PROXY_GC_INTERVAL	1
+#define PROXY_GC_BUDGET		16384
+
+/*
+ * With PreforgeHosts, every PROXY_PREFORGE_INTERVAL seconds, frequently used
+ * forged certificates expiring within PROXY_PREFORGE_WINDOW seconds are
+ * forged again in the background.
+ */
+#define PROXY_PREFORGE_INTERVAL	60
+#define PROXY_PREFORGE_WINDOW	(7*24*60*60)
+
+/*
+ * Every PROXY_LOGSTATS_INTERVAL seconds, logs with a lossy overflow policy
+ * are checked for newly dropped log buffers.
+ */
+#define PROXY_LOGSTATS_INTERVAL	10
+
+/*
+ * Clients of the stats socket have PROXY_STATS_TIMEOUT seconds to send
+ * their request; requests larger than PROXY_STATS_MAXREQ are refused.
+ */
+#define PROXY_STATS_TIMEOUT	1
+#define PROXY_STATS_MAXREQ	4096
+
+/*
+ * Stats socket command for the table of active connections, sent as a line
+ * by itself or as the path of an HTTP GET request.
+ */
+#define PROXY_STATS_CMD		"connections"
+#define PROXY_STATS_CMDSZ	(sizeof(PROXY_STATS_CMD) - 1)
+
+/*
+ * With ThreadSelection snihash, clients of SSL proxyspecs have
+ * PROXY_PEEK_TIMEOUT seconds to send their ClientHello before the thread is
+ * chosen without knowing the SNI.  At most PROXY_PEEK_MAX connections per
+ * listener wait for their ClientHello at the same time, and at most
+ * PROXY_PEEK_MAXSZ octets are read from each before handing it over.
+ */
+#define PROXY_PEEK_TIMEOUT	1
+#define PROXY_PEEK_MAX		1024
+#define PROXY_PEEK_MAXSZ	(16*1024)
+
+/*
+ * Listener handover for binary upgrades over UpgradeSocket.  A starting
+ * instance connects to the upgrade socket of the running instance and sends
+ * PROXY_UPGRADE_GET repeatedly; each is answered with a proxy_upgrade_msg_t
+ * carrying one listener socket and the listen address of its proxyspec, and
+ * the last one with PROXY_UPGRADE_END.  Once the new instance is accepting
+ * connections on the sockets it took over, it sends PROXY_UPGRADE_DONE, upon
+ * which the running instance stops accepting and exits as soon as its
+ * established connections have drained, checked every PROXY_DRAIN_INTERVAL
+ * seconds.  If the new instance goes away before, the running instance just
+ * carries on.  The new instance waits at most PROXY_UPGRADE_TIMEOUT seconds
+ * for each answer.
+ */
+#define PROXY_UPGRADE_GET	'G'
+#define PROXY_UPGRADE_DONE	'D'
+#define PROXY_UPGRADE_SOCK	'S'
+#define PROXY_UPGRADE_END	'E'
+#define PROXY_UPGRADE_TIMEOUT	10
+#define PROXY_DRAIN_INTERVAL	1
+
+/*
+ * Shutdown drain on SIGTERM and SIGINT, see DrainTimeout.  The proxy stops
+ * accepting connections, drops those still waiting for their ClientHello,
+ * and waits up to drain_timeout seconds for the open connections to close,
+ * then up to another drain_timeout seconds for the log writer threads to
+ * empty their queues, checked every PROXY_SHUTDOWN_INTERVAL milliseconds.
+ * Log data still queued after that is discarded, so that log_fini() returns
+ * in bounded time.  A second signal exits right away.
+ */
+#define PROXY_SHUTDOWN_INTERVAL	100
+
+typedef struct {
+	unsigned char type;
+	unsigned char reuseport;
+	socklen_t addrlen;
+	struct sockaddr_storage addr;
+} proxy_upgrade_msg_t;
+
+/* listener socket taken over from the previous instance */
+typedef struct {
+	evutil_socket_t fd;
+	int reuseport;
+	socklen_t addrlen;
+	struct sockaddr_storage addr;
+} proxy_inherited_t;
+
+static int signals[] = { SIGTERM, SIGQUIT, SIGHUP, SIGINT, SIGPIPE, SIGUSR1,
+                         SIGUSR2, SIGURG };
 
 struct proxy_ctx {
 	pxy_thrmgr_ctx_t *thrmgr;
 	struct event_base *evbase;
 	struct event *sev[sizeof(signals)/sizeof(int)];
 	struct event *gcev;
+	struct event *logstatsev;
+	struct event *preforgeev;
+	struct event *ticketev;
+	struct event *sessev;
+	struct event *rollupev;
+	struct event *rebalanceev;
+	struct evconnlistener *statsevcl;
+	struct evconnlistener *upgradeevcl;
+	struct event *upgradeev;
+	struct event *drainev;
 	struct proxy_listener_ctx *lctx;
+	/* draining on shutdown */
+	int drainsig;
+	int drainphase;
+	long long draindeadline;
 	opts_t *opts;
+	proxy_reload_cb_t reloadcb;
+	/* reloading on a separate thread, see proxy_reload_start() */
+	struct event *reloadev;
+	pthread_t reloadthr;
+	int reloading;
+	opts_t *reloadopts;
 	int loopbreak_reason;
+	/* handing over listeners to a new instance */
+	size_t upgradeidx;
+	/* taking over listeners from the previous instance */
+	evutil_socket_t upgradesock;
+	proxy_inherited_t *inherited;
+	size_t ninherited;
 };
 
 
 /*
- * Listener context.
+ * Listener context.
+ * Listeners with thridx -1 accept on the main event base and distribute the
+ * connections to the connection handling threads.  Listeners with a thridx
+ * of 0 or greater are SO_REUSEPORT listeners owned by connection handling
+ * thread thridx; their evconnlistener is only created on the thread's event
+ * base once the thread manager is running, until then only fd is set.
+ * Each listener holds a reference to the configuration it accepts
+ * connections for, which changes on reload, see proxy_listener_swap().
+ */
+/*
+ * Batch of connections accepted on a main event loop listener, handed over
+ * to a connection handling thread as a whole.
+ */
+typedef struct proxy_accept {
+	evutil_socket_t fd;
+	int addrlen;
+	struct sockaddr_storage addr;
+} proxy_accept_t;
+
+typedef struct proxy_accept_batch {
+	pxy_thrmgr_ctx_t *thrmgr;
+	int thridx;
+	proxyspec_t *spec;
+	opts_t *opts;
+	size_t size;
+	size_t n;
+	proxy_accept_t conn[];
+} proxy_accept_batch_t;
+
+typedef struct proxy_peek proxy_peek_t;
+
+typedef struct proxy_listener_ctx {
+	pxy_thrmgr_ctx_t *thrmgr;
+	int thridx;
+	evutil_socket_t fd;
+	proxyspec_t *spec;
+	opts_t *opts;
+	struct event_base *evbase;
+	struct evconnlistener *evcl;
+	proxy_accept_batch_t *batch;
+	struct event *batchev;
+	proxy_peek_t *peeks;            /* connections waiting for the SNI */
+	size_t npeeks;
+	struct proxy_listener_ctx *next;
+} proxy_listener_ctx_t;
+
+/*
+ * Connection accepted with ThreadSelection snihash, waiting on the listener
+ * event base for the ClientHello, from which the SNI is parsed in order to
+ * choose the connection handling thread.  The octets read are handed over
+ * to the connection along with the socket.
+ */
+struct proxy_peek {
+	proxy_listener_ctx_t *plc;      /* NULL once handed over */
+	pxy_thrmgr_ctx_t *thrmgr;
+	int thridx;
+	proxyspec_t *spec;
+	opts_t *opts;
+	struct event *ev;
+	evutil_socket_t fd;
+	int addrlen;
+	struct sockaddr_storage addr;
+	unsigned char *buf;
+	size_t len;
+	size_t sz;
+	proxy_peek_t *prev;
+	proxy_peek_t *next;
+};
+
+static proxy_accept_batch_t *
+proxy_accept_batch_new(pxy_thrmgr_ctx_t *thrmgr, proxyspec_t *spec,
+                       opts_t *opts, size_t size) MALLOC;
+static proxy_accept_batch_t *
+proxy_accept_batch_new(pxy_thrmgr_ctx_t *thrmgr, proxyspec_t *spec,
+                       opts_t *opts, size_t size)
+{
+	proxy_accept_batch_t *batch;
+
+	batch = malloc(sizeof(proxy_accept_batch_t) +
+	               size * sizeof(proxy_accept_t));
+	if (!batch)
+		return NULL;
+	batch->thrmgr = thrmgr;
+	batch->thridx = -1;
+	batch->spec = spec;
+	batch->opts = opts_ref(opts);
+	batch->size = size;
+	batch->n = 0;
+	return batch;
+}
+
+/*
+ * Free a batch, closing the sockets of connections not set up yet.
+ */
+static void
+proxy_accept_batch_free(proxy_accept_batch_t *batch) NONNULL(1);
+static void
+proxy_accept_batch_free(proxy_accept_batch_t *batch)
+{
+	for (size_t i = 0; i < batch->n; i++) {
+		evutil_closesocket(batch->conn[i].fd);
+	}
+	opts_unref(batch->opts);
+	free(batch);
+}
+
+static void
+proxy_accept_batch_add(proxy_accept_batch_t *batch, evutil_socket_t fd,
+                       const struct sockaddr *addr, int addrlen) NONNULL(1,3);
+static void
+proxy_accept_batch_add(proxy_accept_batch_t *batch, evutil_socket_t fd,
+                       const struct sockaddr *addr, int addrlen)
+{
+	proxy_accept_t *conn = &batch->conn[batch->n++];
+
+	conn->fd = fd;
+	conn->addrlen = addrlen;
+	memcpy(&conn->addr, addr, addrlen);
+}
+
+/*
+ * Set up all connections of a batch on the connection handling thread the
+ * batch was handed over to.
+ */
+static void
+proxy_accept_batch_cb(UNUSED evutil_socket_t fd, UNUSED short what, void *arg)
+{
+	proxy_accept_batch_t *batch = arg;
+
+	for (size_t i = 0; i < batch->n; i++) {
+		proxy_accept_t *conn = &batch->conn[i];
+
+		pxy_conn_setup(conn->fd, (struct sockaddr *)&conn->addr,
+		               conn->addrlen, batch->thrmgr, batch->thridx,
+		               batch->spec, batch->opts);
+	}
+	batch->n = 0;
+	proxy_accept_batch_free(batch);
+}
+
+/*
+ * Hand a batch over to connection handling thread thridx with a single
+ * cross-thread wakeup.  If that fails, set up the connections from the
+ * calling thread, as for unbatched connections.
+ */
+static void
+proxy_accept_batch_dispatch(proxy_accept_batch_t *batch, int thridx)
+{
+	batch->thridx = thridx;
+	if (event_base_once(pxy_thrmgr_get_evbase(batch->thrmgr, thridx), -1,
+	                    EV_TIMEOUT, proxy_accept_batch_cb, batch,
+	                    NULL) == -1) {
+		proxy_accept_batch_cb(-1, 0, batch);
+	}
+}
+
+/*
+ * Hand the pending batch of a listener over to the connection handling
+ * threads.  The thread is selected once per batch, except for the clienthash
+ * policy, where connections are grouped by the thread their client address
+ * hashes to.
+ */
+static void
+proxy_listener_flush(proxy_listener_ctx_t *plc) NONNULL(1);
+static void
+proxy_listener_flush(proxy_listener_ctx_t *plc)
+{
+	proxy_accept_batch_t *batch = plc->batch;
+	proxy_accept_batch_t **sub;
+	int num_thr;
+
+	if (!batch)
+		return;
+	plc->batch = NULL;
+
+	if (batch->opts->thrsel != THRSEL_CLIENTHASH || batch->n == 1) {
+		proxy_accept_batch_dispatch(batch, pxy_thrmgr_select(
+		        batch->thrmgr, batch->spec->wpool,
+		        (struct sockaddr *)&batch->conn[0].addr));
+		return;
+	}
+
+	num_thr = pxy_thrmgr_num_thr(batch->thrmgr);
+	sub = calloc(num_thr, sizeof(proxy_accept_batch_t *));
+	if (!sub)
+		goto errout;
+	for (size_t i = 0; i < batch->n; i++) {
+		proxy_accept_t *conn = &batch->conn[i];
+		int thridx;
+
+		thridx = pxy_thrmgr_select(batch->thrmgr, batch->spec->wpool,
+		                           (struct sockaddr *)&conn->addr);
+		if (!sub[thridx]) {
+			sub[thridx] = proxy_accept_batch_new(batch->thrmgr,
+			                                     batch->spec,
+			                                     batch->opts,
+			                                     batch->n - i);
+			if (!sub[thridx]) {
+				/* fall back to setting up unbatched */
+				pxy_conn_setup(conn->fd,
+				               (struct sockaddr *)&conn->addr,
+				               conn->addrlen, batch->thrmgr,
+				               thridx, batch->spec,
+				               batch->opts);
+				continue;
+			}
+		}
+		proxy_accept_batch_add(sub[thridx], conn->fd,
+		                       (struct sockaddr *)&conn->addr,
+		                       conn->addrlen);
+	}
+	batch->n = 0;
+	for (int thridx = 0; thridx < num_thr; thridx++) {
+		if (sub[thridx])
+			proxy_accept_batch_dispatch(sub[thridx], thridx);
+	}
+	free(sub);
+	proxy_accept_batch_free(batch);
+	return;
+
+errout:
+	proxy_accept_batch_cb(-1, 0, batch);
+}
+
+/*
+ * Flush the pending batch once the evconnlistener has drained all pending
+ * connections of the current wakeup.
+ */
+static void
+proxy_listener_flushcb(UNUSED evutil_socket_t fd, UNUSED short what,
+                       void *arg)
+{
+	proxy_listener_flush(arg);
+}
+
+/*
+ * Unlink a peek from its listener and free its event.
+ */
+static void
+proxy_peek_unlink(proxy_peek_t *peek) NONNULL(1);
+static void
+proxy_peek_unlink(proxy_peek_t *peek)
+{
+	proxy_listener_ctx_t *plc = peek->plc;
+
+	if (peek->prev)
+		peek->prev->next = peek->next;
+	else
+		plc->peeks = peek->next;
+	if (peek->next)
+		peek->next->prev = peek->prev;
+	plc->npeeks--;
+	peek->plc = NULL;
+	event_free(peek->ev);
+	peek->ev = NULL;
+}
+
+/*
+ * Free a peek and close its socket.
+ */
+static void
+proxy_peek_free(proxy_peek_t *peek) NONNULL(1);
+static void
+proxy_peek_free(proxy_peek_t *peek)
+{
+	if (peek->plc)
+		proxy_peek_unlink(peek);
+	evutil_closesocket(peek->fd);
+	free(peek->buf);
+	free(peek);
+}
+
+/*
+ * Set up a connection on the thread chosen for it, handing over the octets
+ * read from it so far.
+ */
+static void
+proxy_peek_setup_cb(UNUSED evutil_socket_t fd, UNUSED short what, void *arg)
+{
+	proxy_peek_t *peek = arg;
+
+	pxy_conn_setup_peeked(peek->fd, (struct sockaddr *)&peek->addr,
+	                      peek->addrlen, peek->thrmgr, peek->thridx,
+	                      peek->spec, peek->opts,
+	                      peek->buf, peek->len, peek->sz);
+	opts_unref(peek->opts);
+	free(peek);
+}
+
+/*
+ * Read from a connection waiting for its ClientHello.  Once the ClientHello
+ * is complete, cannot be one, or did not arrive in time, choose the thread by
+ * the SNI, if any, and set up the connection with the octets read so far.
+ */
+static void
+proxy_peek_cb(evutil_socket_t fd, short what, void *arg)
+{
+	proxy_peek_t *peek = arg;
+	proxy_listener_ctx_t *plc = peek->plc;
+	unsigned char *record = NULL;
+	size_t recordsz;
+	const unsigned char *chello;
+	char *sni = NULL;
+	ssize_t n;
+	int thridx;
+
+	if (what & EV_READ) {
+		if (peek->len == peek->sz) {
+			size_t sz = peek->sz ? peek->sz * 2 : 1024;
+			unsigned char *p = realloc(peek->buf, sz);
+			if (!p)
+				goto done;
+			peek->buf = p;
+			peek->sz = sz;
+		}
+		n = recv(fd, peek->buf + peek->len, peek->sz - peek->len, 0);
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+		                errno == EINTR))
+			return;
+		if (n <= 0) {
+			/* closed or failed before sending a ClientHello */
+			proxy_peek_free(peek);
+			return;
+		}
+		peek->len += n;
+		if (ssl_tls_clienthello_reassemble(peek->buf, peek->len,
+		                                   &record, &recordsz) == 1 &&
+		    peek->len < PROXY_PEEK_MAXSZ)
+			return;
+		if (record) {
+			/* sni is only set if a ClientHello was found */
+			if (ssl_tls_clienthello_parse(record, recordsz, 0,
+			                              &chello, &sni,
+			                              NULL) != 0)
+				sni = NULL;
+			free(record);
+		}
+	}
+
+done:
+	thridx = pxy_thrmgr_select_sni(plc->thrmgr, plc->spec->wpool, sni);
+	if (OPTS_DEBUG(plc->opts)) {
+		log_dbg_printf("SNI affinity: [%s] thread %d\n",
+		               sni ? sni : "n/a", thridx);
+	}
+	free(sni);
+	peek->thrmgr = plc->thrmgr;
+	peek->thridx = thridx;
+	peek->spec = plc->spec;
+	peek->opts = opts_ref(plc->opts);
+	proxy_peek_unlink(peek);
+	if (event_base_once(pxy_thrmgr_get_evbase(peek->thrmgr, thridx), -1,
+	                    EV_TIMEOUT, proxy_peek_setup_cb, peek,
+	                    NULL) == -1) {
+		proxy_peek_setup_cb(-1, 0, peek);
+	}
+}
+
+/*
+ * Wait for the ClientHello of a new connection on the listener event base,
+ * then hand the connection over to the thread its SNI maps to.
+ * Returns -1 if the connection should be set up right away instead.
+ */
+static int
+proxy_peek_new(proxy_listener_ctx_t *plc, evutil_socket_t fd,
+               const struct sockaddr *addr, int addrlen) NONNULL(1,3);
+static int
+proxy_peek_new(proxy_listener_ctx_t *plc, evutil_socket_t fd,
+               const struct sockaddr *addr, int addrlen)
+{
+	struct timeval tv = {PROXY_PEEK_TIMEOUT, 0};
+	proxy_peek_t *peek;
+
+	if (plc->npeeks >= PROXY_PEEK_MAX)
+		return -1;
+	peek = malloc(sizeof(proxy_peek_t));
+	if (!peek)
+		return -1;
+	memset(peek, 0, sizeof(proxy_peek_t));
+	peek->ev = event_new(plc->evbase, fd, EV_READ|EV_PERSIST,
+	                     proxy_peek_cb, peek);
+	if (!peek->ev || event_add(peek->ev, &tv) == -1) {
+		if (peek->ev)
+			event_free(peek->ev);
+		free(peek);
+		return -1;
+	}
+	peek->plc = plc;
+	peek->fd = fd;
+	peek->addrlen = addrlen;
+	memcpy(&peek->addr, addr, addrlen);
+	peek->next = plc->peeks;
+	if (peek->next)
+		peek->next->prev = peek;
+	plc->peeks = peek;
+	plc->npeeks++;
+	return 0;
+}
+
+static proxy_listener_ctx_t *
+proxy_listener_ctx_new(struct event_base *evbase, pxy_thrmgr_ctx_t *thrmgr,
+                       int thridx, proxyspec_t *spec, opts_t *opts) MALLOC;
+static proxy_listener_ctx_t *
+proxy_listener_ctx_new(struct event_base *evbase, pxy_thrmgr_ctx_t *thrmgr,
+                       int thridx, proxyspec_t *spec, opts_t *opts)
+{
+	proxy_listener_ctx_t *ctx = malloc(sizeof(proxy_listener_ctx_t));
+	if (!ctx)
+		return NULL;
+	memset(ctx, 0, sizeof(proxy_listener_ctx_t));
+	ctx->evbase = evbase;
+	ctx->thrmgr = thrmgr;
+	ctx->thridx = thridx;
+	ctx->fd = -1;
+	ctx->spec = spec;
+	ctx->opts = opts_ref(opts);
+	return ctx;
+}
+
+static void
+proxy_listener_ctx_free(proxy_listener_ctx_t *ctx) NONNULL(1);
+static void
+proxy_listener_ctx_free(proxy_listener_ctx_t *ctx)
+{
+	if (ctx->evcl) {
+		evconnlistener_free(ctx->evcl);
+	} else if (ctx->fd != -1) {
+		evutil_closesocket(ctx->fd);
+	}
+	if (ctx->batch) {
+		proxy_accept_batch_free(ctx->batch);
+	}
+	if (ctx->batchev) {
+		event_free(ctx->batchev);
+	}
+	while (ctx->peeks) {
+		proxy_peek_free(ctx->peeks);
+	}
+	if (ctx->next) {
+		proxy_listener_ctx_free(ctx->next);
+	}
+	opts_unref(ctx->opts);
+	free(ctx);
+}
+
+/*
+ * Callback for accept events on the socket listener bufferevent.
+ */
+static void
+proxy_listener_acceptcb(UNUSED struct evconnlistener *listener,
+                        evutil_socket_t fd,
+                        struct sockaddr *peeraddr, int peeraddrlen,
+                        void *arg)
+{
+	proxy_listener_ctx_t *cfg = arg;
+
+#ifndef OPENSSL_NO_TLSEXT
+	/* choose the thread once the SNI is known; not for per-thread
+	 * listeners, which set up connections on their own thread */
+	if (cfg->opts->thrsel == THRSEL_SNIHASH && cfg->thridx == -1 &&
+	    cfg->spec->ssl && !cfg->spec->upgrade &&
+	    proxy_peek_new(cfg, fd, peeraddr, peeraddrlen) == 0)
+		return;
+#endif /* !OPENSSL_NO_TLSEXT */
+
+	if (!cfg->batchev) {
+		pxy_conn_setup(fd, peeraddr, peeraddrlen, cfg->thrmgr,
+		               cfg->thridx, cfg->spec, cfg->opts);
+		return;
+	}
+
+	if (!cfg->batch) {
+		/* batching may have been disabled by a configuration reload */
+		cfg->batch = proxy_accept_batch_new(cfg->thrmgr, cfg->spec,
+		                                    cfg->opts,
+		                                    cfg->opts->accept_batch > 1 ?
+		                                    cfg->opts->accept_batch : 1);
+		if (!cfg->batch) {
+			pxy_conn_setup(fd, peeraddr, peeraddrlen, cfg->thrmgr,
+			               cfg->thridx, cfg->spec, cfg->opts);
+			return;
+		}
+		/* runs after the evconnlistener has drained the backlog */
+		event_active(cfg->batchev, EV_TIMEOUT, 0);
+	}
+	proxy_accept_batch_add(cfg->batch, fd, peeraddr, peeraddrlen);
+	if (cfg->batch->n == cfg->batch->size)
+		proxy_listener_flush(cfg);
+}
+
+/*
+ * Callback for error events on the socket listener bufferevent.
+ * Always breaks the main event loop, also for per-thread listeners.
+ */
+static void
+proxy_listener_errorcb(UNUSED struct evconnlistener *listener, void *arg)
+{
+	proxy_listener_ctx_t *cfg = arg;
+	int err = EVUTIL_SOCKET_ERROR();
+	log_err_printf("Error %d on listener: %s\n", err,
+	               evutil_socket_error_to_string(err));
+	event_base_loopbreak(cfg->evbase);
+}
+
+/*
+ * Stats socket connection has been served or failed; close it.
+ */
+static void
+proxy_stats_closecb(struct bufferevent *bev, UNUSED short events,
+                    UNUSED void *arg)
+{
+	bufferevent_free(bev);
+}
+
+static void
+proxy_stats_writecb(struct bufferevent *bev, UNUSED void *arg)
+{
+	if (evbuffer_get_length(bufferevent_get_output(bev)) == 0)
+		bufferevent_free(bev);
+}
+
+/*
+ * Write the current stats to a stats socket client and close the connection
+ * once written.  HTTP requests get a minimal HTTP/1.0 response, any other
+ * client gets the bare exposition text.
+ */
+static void
+proxy_stats_reply(struct bufferevent *bev, int http)
+{
+	struct evbuffer *outbuf = bufferevent_get_output(bev);
+
+	bufferevent_disable(bev, EV_READ);
+	bufferevent_setcb(bev, NULL, proxy_stats_writecb,
+	                  proxy_stats_closecb, NULL);
+	if (http) {
+		evbuffer_add_printf(outbuf, "HTTP/1.0 200 OK\r\n"
+		                    "Content-Type: text/plain; version=0.0.4\r\n"
+		                    "Connection: close\r\n\r\n");
+	}
+	if (stats_prometheus(outbuf) == -1) {
+		log_err_printf("Error rendering stats\n");
+		bufferevent_free(bev);
+		return;
+	}
+	bufferevent_enable(bev, EV_WRITE);
+}
+
+/*
+ * The connection table is complete; write it to the stats socket client and
+ * close the connection once written.
+ */
+static void
+proxy_stats_conns_cb(struct evbuffer *buf, void *arg)
+{
+	struct bufferevent *bev = arg;
+
+	if (!buf) {
+		log_err_printf("Error collecting connections\n");
+		bufferevent_free(bev);
+		return;
+	}
+	bufferevent_setcb(bev, NULL, proxy_stats_writecb,
+	                  proxy_stats_closecb, NULL);
+	evbuffer_add_buffer(bufferevent_get_output(bev), buf);
+	bufferevent_enable(bev, EV_WRITE);
+}
+
+/*
+ * Write the table of active connections to a stats socket client.  The
+ * table is collected from the connection handling threads asynchronously;
+ * until then, the bufferevent has no callbacks.
+ */
+static void
+proxy_stats_conns(proxy_ctx_t *ctx, struct bufferevent *bev, int http)
+{
+	bufferevent_disable(bev, EV_READ);
+	bufferevent_setcb(bev, NULL, NULL, NULL, NULL);
+	if (http) {
+		evbuffer_add_printf(bufferevent_get_output(bev),
+		                    "HTTP/1.0 200 OK\r\n"
+		                    "Content-Type: text/plain\r\n"
+		                    "Connection: close\r\n\r\n");
+	}
+	if (pxy_conn_table(ctx->thrmgr, ctx->evbase, proxy_stats_conns_cb,
+	                   bev) == -1) {
+		log_err_printf("Error collecting connections\n");
+		bufferevent_free(bev);
+	}
+}
+
+/*
+ * Stats socket request data.  A plain "connections" line requests the table
+ * of active connections.  Otherwise, wait for the end of the HTTP request
+ * header; the request is not interpreted beyond the method and whether the
+ * path is /connections.
+ */
+static void
+proxy_stats_readcb(struct bufferevent *bev, void *arg)
+{
+	struct evbuffer *inbuf = bufferevent_get_input(bev);
+	struct evbuffer_ptr ptr;
+	unsigned char *req;
+	size_t len;
+
+	ptr = evbuffer_search(inbuf, "\n", 1, NULL);
+	if (ptr.pos != -1 && (size_t)ptr.pos <= PROXY_STATS_CMDSZ + 1) {
+		len = ptr.pos;
+		req = evbuffer_pullup(inbuf, len);
+		if (len > 0 && req[len - 1] == '\r')
+			len--;
+		if (len == PROXY_STATS_CMDSZ &&
+		    !memcmp(req, PROXY_STATS_CMD, PROXY_STATS_CMDSZ)) {
+			proxy_stats_conns(arg, bev, 0);
+			return;
+		}
+	}
+	ptr = evbuffer_search(inbuf, "\r\n\r\n", 4, NULL);
+	if (ptr.pos == -1) {
+		if (evbuffer_get_length(inbuf) > PROXY_STATS_MAXREQ)
+			bufferevent_free(bev);
+		return;
+	}
+	len = evbuffer_get_length(inbuf);
+	req = evbuffer_pullup(inbuf, -1);
+	if (req && len > 5 + PROXY_STATS_CMDSZ &&
+	    !memcmp(req, "GET /" PROXY_STATS_CMD, 5 + PROXY_STATS_CMDSZ) &&
+	    (req[5 + PROXY_STATS_CMDSZ] == ' ' ||
+	     req[5 + PROXY_STATS_CMDSZ] == '?')) {
+		proxy_stats_conns(arg, bev, 1);
+		return;
+	}
+	proxy_stats_reply(bev, req && !memcmp(req, "GET ", 4));
+}
+
+/*
+ * Clients that close their end or do not send a request in time get the
+ * bare exposition text, making it possible to read the stats using a plain
+ * socket client.
+ */
+static void
+proxy_stats_eventcb(struct bufferevent *bev, short events, UNUSED void *arg)
+{
+	if (events & (BEV_EVENT_EOF|BEV_EVENT_TIMEOUT)) {
+		proxy_stats_reply(bev, 0);
+		return;
+	}
+	bufferevent_free(bev);
+}
+
+/*
+ * Callback for accept events on the stats socket listener.
+ */
+static void
+proxy_stats_acceptcb(UNUSED struct evconnlistener *listener,
+                     evutil_socket_t fd,
+                     UNUSED struct sockaddr *peeraddr,
+                     UNUSED int peeraddrlen, void *arg)
+{
+	proxy_ctx_t *ctx = arg;
+	struct bufferevent *bev;
+	struct timeval tv = {PROXY_STATS_TIMEOUT, 0};
+
+	bev = bufferevent_socket_new(ctx->evbase, fd, BEV_OPT_CLOSE_ON_FREE);
+	if (!bev) {
+		log_err_printf("Error creating stats bufferevent\n");
+		evutil_closesocket(fd);
+		return;
+	}
+	bufferevent_setcb(bev, proxy_stats_readcb, NULL,
+	                  proxy_stats_eventcb, ctx);
+	bufferevent_set_timeouts(bev, &tv, &tv);
+	bufferevent_enable(bev, EV_READ);
+}
+
+/*
+ * Dump the current stats in exposition format to the debug log.
+ */
+static void
+proxy_stats_debug(void)
+{
+	struct evbuffer *buf;
+	size_t sz;
+	char *s;
+
+	if (!(buf = evbuffer_new()))
+		return;
+	if (stats_prometheus(buf) == 0) {
+		sz = evbuffer_get_length(buf);
+		if ((s = malloc(sz + 1))) {
+			evbuffer_remove(buf, s, sz);
+			s[sz] = '\0';
+			log_dbg_print_free(s);
+		}
+	}
+	evbuffer_free(buf);
+}
+
+/*
+ * Dump a description of an evbase to debugging code.
+ */
+static void
+proxy_debug_base(const struct event_base *ev_base)
+{
+	log_dbg_printf("Using libevent backend '%s'\n",
+	               event_base_get_method(ev_base));
+
+	enum event_method_feature f;
+	f = event_base_get_features(ev_base);
+	log_dbg_printf("Event base supports: edge %s, O(1) %s, anyfd %s\n",
+	               ((f & EV_FEATURE_ET) ? "yes" : "no"),
+	               ((f & EV_FEATURE_O1) ? "yes" : "no"),
+	               ((f & EV_FEATURE_FDS) ? "yes" : "no"));
+}
+
+/*
+ * Set up the upstream SSL_CTX shared by all proxyspecs that need one, and
+ * the header fields to parse for http proxyspecs.  The client certificate
+ * and key are the same for all proxyspecs, so they are only loaded into
+ * a single SSL_CTX.
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+proxy_dstsslctx_new(opts_t *opts)
+{
+	SSL_CTX *sslctx = NULL;
+
+	for (proxyspec_t *spec = opts->spec; spec; spec = spec->next) {
+		if (spec->http)
+			pxy_http_hdrs_setup(spec, opts);
+		if ((!spec->ssl && !spec->upgrade) || spec->dstsslctx)
+			continue;
+		if (sslctx) {
+			ssl_ctx_refcount_inc(sslctx);
+		} else if (!(sslctx = pxy_dstsslctx_new(opts))) {
+			log_err_printf("Error setting up upstream SSL "
+			               "context\n");
+			return -1;
+		}
+		spec->dstsslctx = sslctx;
+	}
+	return 0;
+}
+
+/*
+ * Set the TCP options configured for listener sockets on fd.  These do not
+ * require privileges, so they are set here rather than in the privsep parent.
+ * Failure is not fatal; the listener works without them.
+ */
+#ifdef TCP_DEFER_ACCEPT
+#define MAYBE_UNUSED 
+#else /* !TCP_DEFER_ACCEPT */
+#define MAYBE_UNUSED UNUSED
+#endif /* !TCP_DEFER_ACCEPT */
+static void
+proxy_listener_setsockopt(MAYBE_UNUSED evutil_socket_t fd,
+                          MAYBE_UNUSED proxyspec_t *spec,
+                          MAYBE_UNUSED opts_t *opts)
+#undef MAYBE_UNUSED
+{
+#ifdef HAVE_TCP_FASTOPEN
+	if (opts->tcp_fastopen) {
+		int qlen = 1024;
+		if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN,
+		               (void*)&qlen, sizeof(qlen)) == -1) {
+			log_err_printf("Warning: Error from setsockopt("
+			               "TCP_FASTOPEN): %s (%i)\n",
+			               strerror(errno), errno);
+		}
+	}
+#endif /* HAVE_TCP_FASTOPEN */
+#ifdef TCP_DEFER_ACCEPT
+	/* only for protocols where the client sends first */
+	if (opts->tcp_deferaccept && (spec->ssl || spec->http)) {
+		int secs = 10;
+		if (setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+		               (void*)&secs, sizeof(secs)) == -1) {
+			log_err_printf("Warning: Error from setsockopt("
+			               "TCP_DEFER_ACCEPT): %s (%i)\n",
+			               strerror(errno), errno);
+		}
+	}
+#endif /* TCP_DEFER_ACCEPT */
+}
+
+/*
+ * Connect to the upgrade socket at path of a running instance and take over
+ * all of its listener sockets, see PROXY_UPGRADE_GET.  The connection stays
+ * open until proxy_upgrade_done().
+ * Returns the number of sockets taken over, 0 if no instance is running, or
+ * -1 on error with errno set.
+ */
+static int
+proxy_upgrade_fetch(proxy_ctx_t *ctx, const char *path)
+{
+	struct sockaddr_un sun;
+	struct timeval tv = {PROXY_UPGRADE_TIMEOUT, 0};
+	proxy_upgrade_msg_t msg;
+	proxy_inherited_t *p;
+	unsigned char req = PROXY_UPGRADE_GET;
+	evutil_socket_t s, fd;
+	ssize_t n;
+	int tmp;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return -1;
+	if (connect(s, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		tmp = errno;
+		close(s);
+		if (tmp == ENOENT || tmp == ECONNREFUSED)
+			return 0;
+		errno = tmp;
+		return -1;
+	}
+	if (setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (void*)&tv,
+	               sizeof(tv)) == -1)
+		goto errout;
+	for (;;) {
+		if (sys_sendmsgfd(s, &req, sizeof(req), -1) == -1)
+			goto errout;
+		fd = -1;
+		if ((n = sys_recvmsgfd(s, &msg, sizeof(msg), &fd)) == -1)
+			goto errout;
+		if (n == (ssize_t)sizeof(msg) && fd == -1 &&
+		    msg.type == PROXY_UPGRADE_END)
+			break;
+		if (n != (ssize_t)sizeof(msg) || fd == -1 ||
+		    msg.type != PROXY_UPGRADE_SOCK ||
+		    msg.addrlen > sizeof(msg.addr)) {
+			if (fd != -1)
+				evutil_closesocket(fd);
+			errno = n == 0 ? ECONNRESET : EINVAL;
+			goto errout;
+		}
+		p = realloc(ctx->inherited,
+		            (ctx->ninherited + 1) * sizeof(proxy_inherited_t));
+		if (!p) {
+			evutil_closesocket(fd);
+			goto errout;
+		}
+		ctx->inherited = p;
+		p = &ctx->inherited[ctx->ninherited++];
+		p->fd = fd;
+		p->reuseport = msg.reuseport;
+		p->addrlen = msg.addrlen;
+		memcpy(&p->addr, &msg.addr, sizeof(p->addr));
+	}
+	ctx->upgradesock = s;
+	return ctx->ninherited;
+
+errout:
+	tmp = errno;
+	close(s);
+	errno = tmp;
+	return -1;
+}
+
+/*
+ * Return a listener socket taken over from the previous instance matching
+ * spec, or -1 if there is none.  SO_REUSEPORT and regular listener sockets
+ * are never mixed.
+ */
+static evutil_socket_t
+proxy_upgrade_take(proxy_ctx_t *ctx, proxyspec_t *spec, int reuseport)
+{
+	evutil_socket_t fd;
+
+	for (size_t i = 0; i < ctx->ninherited; i++) {
+		proxy_inherited_t *p = &ctx->inherited[i];
+
+		if (p->fd == -1 || !p->reuseport != !reuseport ||
+		    p->addrlen != spec->listen_addrlen ||
+		    memcmp(&p->addr, &spec->listen_addr, p->addrlen))
+			continue;
+		fd = p->fd;
+		p->fd = -1;
+		return fd;
+	}
+	return -1;
+}
+
+/*
+ * Close the listener sockets taken over from the previous instance that were
+ * not used by any proxyspec, for instance because of fewer worker threads.
+ * Connections already queued on them are lost.
+ */
+static void
+proxy_upgrade_release(proxy_ctx_t *ctx)
+{
+	size_t unused = 0;
+
+	for (size_t i = 0; i < ctx->ninherited; i++) {
+		if (ctx->inherited[i].fd != -1) {
+			evutil_closesocket(ctx->inherited[i].fd);
+			unused++;
+		}
+	}
+	if (unused) {
+		log_err_printf("Warning: Closed %zu unused listener sockets "
+		               "of previous instance\n", unused);
+	}
+	free(ctx->inherited);
+	ctx->inherited = NULL;
+	ctx->ninherited = 0;
+}
+
+/*
+ * Tell the previous instance that we are accepting connections now.
+ */
+static void
+proxy_upgrade_done(proxy_ctx_t *ctx)
+{
+	unsigned char req = PROXY_UPGRADE_DONE;
+
+	if (sys_sendmsgfd(ctx->upgradesock, &req, sizeof(req), -1) == -1) {
+		log_err_printf("Warning: Failed to notify previous instance: "
+		               "%s (%i)\n", strerror(errno), errno);
+	} else {
+		log_dbg_printf("Took over listeners from previous instance\n");
+	}
+	close(ctx->upgradesock);
+	ctx->upgradesock = -1;
+}
+
+/*
+ * Set up the listener for a single proxyspec and add it to the main event
+ * base.  If thridx is 0 or greater, open a SO_REUSEPORT socket for
+ * connection handling thread thridx instead, and defer creating the
+ * evconnlistener to proxy_listener_start().  Listener sockets taken over
+ * from a previous instance are used instead of opening new ones if possible.
+ * Returns the proxy_listener_ctx_t pointer if successful, NULL otherwise.
+ */
+static proxy_listener_ctx_t *
+proxy_listener_setup(proxy_ctx_t *ctx, int thridx, proxyspec_t *spec,
+                     int clisock)
+{
+	struct event_base *evbase = ctx->evbase;
+	opts_t *opts = ctx->opts;
+	proxy_listener_ctx_t *plc;
+	int fd;
+
+	if ((fd = proxy_upgrade_take(ctx, spec, thridx >= 0)) == -1 &&
+	    (fd = privsep_client_opensock(clisock, spec, thridx >= 0 ||
+	                                  opts->worker_procs > 1)) == -1) {
+		log_err_printf("Error opening socket: %s (%i)\n",
+		               strerror(errno), errno);
+		return NULL;
+	}
+	proxy_listener_setsockopt(fd, spec, opts);
+
+	plc = proxy_listener_ctx_new(evbase, ctx->thrmgr, thridx, spec, opts);
+	if (!plc) {
+		log_err_printf("Error creating listener context\n");
+		evutil_closesocket(fd);
+		return NULL;
+	}
+
+	if (thridx >= 0) {
+		plc->fd = fd;
+		return plc;
+	}
+
+	plc->evcl = evconnlistener_new(evbase, proxy_listener_acceptcb,
+	                               plc, LEV_OPT_CLOSE_ON_FREE, 1024, fd);
+	if (!plc->evcl) {
+		log_err_printf("Error creating evconnlistener: %s\n",
+		               strerror(errno));
+		proxy_listener_ctx_free(plc);
+		evutil_closesocket(fd);
+		return NULL;
+	}
+	evconnlistener_set_error_cb(plc->evcl, proxy_listener_errorcb);
+	/* with pinned threads, always set up connections on the thread
+	 * handling them, such that their state is local to its NUMA node */
+	if (opts->accept_batch > 1 || opts_has_pinned_threads(opts)) {
+		plc->batchev = event_new(evbase, -1, 0,
+		                         proxy_listener_flushcb, plc);
+		if (!plc->batchev) {
+			log_err_printf("Error creating accept batch event\n");
+			proxy_listener_ctx_free(plc);
+			return NULL;
+		}
+	}
+	return plc;
+}
+
+/*
+ * Create the evconnlisteners of all per-thread listeners on the event bases
+ * of their connection handling threads.  Must be called after the thread
+ * manager is running.
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+proxy_listener_start(proxy_listener_ctx_t *plc)
+{
+	for (; plc; plc = plc->next) {
+		if (plc->thridx < 0 || plc->evcl)
+			continue;
+		plc->evcl = evconnlistener_new(
+		            pxy_thrmgr_get_evbase(plc->thrmgr, plc->thridx),
+		            proxy_listener_acceptcb, plc,
+		            LEV_OPT_CLOSE_ON_FREE|LEV_OPT_THREADSAFE,
+		            1024, plc->fd);
+		if (!plc->evcl) {
+			log_err_printf("Error creating evconnlistener: %s\n",
+			               strerror(errno));
+			return -1;
+		}
+		evconnlistener_set_error_cb(plc->evcl, proxy_listener_errorcb);
+	}
+	return 0;
+}
+
+/*
+ * Steer new connections on the per-thread listeners of each proxyspec to the
+ * listener of the connection handling thread pinned to the CPU that received
+ * the packets of the connection, see ReusePortCPUSteering.  Listeners join
+ * their SO_REUSEPORT group in the order proxy_listener_start() started them
+ * in, which is the index the BPF program returns for them.
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+proxy_listener_steer(proxy_listener_ctx_t *lctx)
+{
+	for (proxy_listener_ctx_t *plc = lctx; plc; plc = plc->next) {
+		proxy_listener_ctx_t *p;
+		int *cpus, n = 0;
+
+		if (plc->thridx < 0)
+			continue;
+		for (p = lctx; p != plc; p = p->next) {
+			if (p->thridx >= 0 && p->spec == plc->spec)
+				break;
+		}
+		if (p != plc)
+			continue;
+		for (p = plc; p; p = p->next) {
+			if (p->thridx >= 0 && p->spec == plc->spec)
+				n++;
+		}
+		if (!(cpus = malloc(n * sizeof(int))))
+			return -1;
+		n = 0;
+		for (p = plc; p; p = p->next) {
+			if (p->thridx >= 0 && p->spec == plc->spec)
+				cpus[n++] = pxy_thrmgr_get_cpu(p->thrmgr,
+				                               p->thridx);
+		}
+		if (sys_reuseport_steer(evconnlistener_get_fd(plc->evcl),
+		                        cpus, n) == -1) {
+			log_err_printf("Error from setsockopt("
+			               "SO_ATTACH_REUSEPORT_CBPF): %s (%i)\n",
+			               strerror(errno), errno);
+			free(cpus);
+			return -1;
+		}
+		free(cpus);
+	}
+	return 0;
+}
+
+typedef struct {
+	proxy_listener_ctx_t *plc;
+	proxyspec_t *spec;
+	opts_t *opts;
+} proxy_listener_swap_t;
+
+/*
+ * Switch a listener over to spec of reloaded configuration opts, taking over
+ * the caller's reference to opts.  Must run on the event base the listener
+ * accepts on, such that no accept callback can use the previous
+ * configuration concurrently.  Connections accepted earlier keep their own
+ * reference to the previous configuration until they are closed.
+ */
+static void
+proxy_listener_swap(proxy_listener_ctx_t *plc, proxyspec_t *spec,
+                    opts_t *opts)
+{
+	opts_t *oldopts = plc->opts;
+
+	plc->spec = spec;
+	plc->opts = opts;
+	opts_unref(oldopts);
+}
+
+static void
+proxy_listener_swap_cb(UNUSED evutil_socket_t fd, UNUSED short what,
+                       void *arg)
+{
+	proxy_listener_swap_t *swap = arg;
+
+	proxy_listener_swap(swap->plc, swap->spec, swap->opts);
+	free(swap);
+}
+
+/*
+ * Exit once all connections have been closed after handing over the
+ * listeners to a new instance.
+ */
+static void
+proxy_drain_cb(UNUSED evutil_socket_t fd, UNUSED short what, void *arg)
+{
+	proxy_ctx_t *ctx = arg;
+
+	if (pxy_thrmgr_load(ctx->thrmgr) == 0) {
+		log_dbg_printf("Drained all connections\n");
+		proxy_loopbreak(ctx, 0);
+	}
+}
+
+/*
+ * Stop accepting connections after the listeners have been handed over to a
+ * new instance.  The listener sockets are shared with the new instance, so
+ * connections queued on them are accepted there.
+ */
+static void
+proxy_drain(proxy_ctx_t *ctx)
+{
+	struct timeval drain_delay = {PROXY_DRAIN_INTERVAL, 0};
+
+	for (proxy_listener_ctx_t *plc = ctx->lctx; plc; plc = plc->next) {
+		if (plc->evcl)
+			evconnlistener_disable(plc->evcl);
+	}
+	if (ctx->upgradeevcl) {
+		evconnlistener_free(ctx->upgradeevcl);
+		ctx->upgradeevcl = NULL;
+	}
+	log_dbg_printf("Handed over listeners to new instance; draining %zu "
+	               "connections\n", pxy_thrmgr_load(ctx->thrmgr));
+	ctx->drainev = event_new(ctx->evbase, -1, EV_PERSIST,
+	                         proxy_drain_cb, ctx);
+	if (!ctx->drainev) {
+		proxy_loopbreak(ctx, 0);
+		return;
+	}
+	evtimer_add(ctx->drainev, &drain_delay);
+}
+
+/*
+ * Advance the shutdown drain once the connections have closed or the log
+ * queues are empty, or the time for the current phase is up.
+ */
+static void
+proxy_shutdown_cb(UNUSED evutil_socket_t fd, UNUSED short what, void *arg)
+{
+	proxy_ctx_t *ctx = arg;
+	long long now = stats_usec();
+	size_t n;
+
+	if (ctx->drainphase == STATS_DRAIN_CONNS) {
+		n = pxy_thrmgr_load(ctx->thrmgr);
+		if (n > 0 && now < ctx->draindeadline)
+			return;
+		if (n > 0) {
+			log_err_printf("Drain timeout, closing %zu "
+			               "connections\n", n);
+		} else {
+			log_dbg_printf("Drained all connections\n");
+		}
+		ctx->drainphase = STATS_DRAIN_LOGS;
+		ctx->draindeadline = now +
+		                     ctx->opts->drain_timeout * 1000000LL;
+		stats_drain(ctx->drainphase, ctx->draindeadline);
+	}
+
+	n = log_pending();
+	if (n > 0 && now < ctx->draindeadline)
+		return;
+	if (n > 0) {
+		log_err_printf("Drain timeout, discarding %zu queued log "
+		               "buffers\n", n);
+		log_discard();
+	}
+	proxy_loopbreak(ctx, ctx->drainsig);
+}
+
+/*
+ * Shut down on signal sig, draining connections and log queues first if
+ * DrainTimeout is set.  Exits right away if already draining, including
+ * after handing over the listeners to a new instance.
  */
-typedef struct proxy_listener_ctx {
-	pxy_thrmgr_ctx_t *thrmgr;
-	proxyspec_t *spec;
-	opts_t *opts;
-	struct evconnlistener *evcl;
-	struct proxy_listener_ctx *next;
-} proxy_listener_ctx_t;
-
-static proxy_listener_ctx_t *
-proxy_listener_ctx_new(pxy_thrmgr_ctx_t *thrmgr, proxyspec_t *spec,
-                       opts_t *opts) MALLOC;
-static proxy_listener_ctx_t *
-proxy_listener_ctx_new(pxy_thrmgr_ctx_t *thrmgr, proxyspec_t *spec,
-                       opts_t *opts)
+static void
+proxy_shutdown(proxy_ctx_t *ctx, int sig)
 {
-	proxy_listener_ctx_t *ctx = malloc(sizeof(proxy_listener_ctx_t));
-	if (!ctx)
-		return NULL;
-	memset(ctx, 0, sizeof(proxy_listener_ctx_t));
-	ctx->thrmgr = thrmgr;
-	ctx->spec = spec;
-	ctx->opts = opts;
-	return ctx;
+	struct timeval tv = {0, PROXY_SHUTDOWN_INTERVAL * 1000};
+
+	if (!ctx->opts->drain_timeout || ctx->drainev) {
+		proxy_loopbreak(ctx, sig);
+		return;
+	}
+
+	for (proxy_listener_ctx_t *plc = ctx->lctx; plc; plc = plc->next) {
+		if (plc->evcl)
+			evconnlistener_disable(plc->evcl);
+		while (plc->peeks)
+			proxy_peek_free(plc->peeks);
+	}
+	if (ctx->upgradeevcl) {
+		evconnlistener_free(ctx->upgradeevcl);
+		ctx->upgradeevcl = NULL;
+	}
+	ctx->drainsig = sig;
+	ctx->drainphase = STATS_DRAIN_CONNS;
+	ctx->draindeadline = stats_usec() +
+	                     ctx->opts->drain_timeout * 1000000LL;
+	stats_drain(ctx->drainphase, ctx->draindeadline);
+	log_dbg_printf("Stopped accepting; draining %zu connections for up "
+	               "to %u seconds\n", pxy_thrmgr_load(ctx->thrmgr),
+	               ctx->opts->drain_timeout);
+	ctx->drainev = event_new(ctx->evbase, -1, EV_PERSIST,
+	                         proxy_shutdown_cb, ctx);
+	if (!ctx->drainev) {
+		proxy_loopbreak(ctx, sig);
+		return;
+	}
+	evtimer_add(ctx->drainev, &tv);
 }
 
 static void
-proxy_listener_ctx_free(proxy_listener_ctx_t *ctx) NONNULL(1);
+proxy_upgrade_close(proxy_ctx_t *ctx)
+{
+	evutil_socket_t fd = event_get_fd(ctx->upgradeev);
+
+	event_free(ctx->upgradeev);
+	ctx->upgradeev = NULL;
+	evutil_closesocket(fd);
+}
+
+/*
+ * Upgrade socket request from a new instance, see PROXY_UPGRADE_GET.
+ */
 static void
-proxy_listener_ctx_free(proxy_listener_ctx_t *ctx)
+proxy_upgrade_readcb(evutil_socket_t fd, UNUSED short what, void *arg)
 {
-	if (ctx->evcl) {
-		evconnlistener_free(ctx->evcl);
+	proxy_ctx_t *ctx = arg;
+	proxy_listener_ctx_t *plc;
+	proxy_upgrade_msg_t msg;
+	evutil_socket_t lfd = -1;
+	unsigned char req;
+	ssize_t n;
+	size_t i;
+
+	n = sys_recvmsgfd(fd, &req, sizeof(req), NULL);
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return;
+	if (n != 1) {
+		log_err_printf("Warning: Upgrade aborted by new instance; "
+		               "keeping listeners\n");
+		proxy_upgrade_close(ctx);
+		return;
 	}
-	if (ctx->next) {
-		proxy_listener_ctx_free(ctx->next);
+
+	switch (req) {
+	case PROXY_UPGRADE_GET:
+		memset(&msg, 0, sizeof(msg));
+		for (plc = ctx->lctx, i = 0; plc && i < ctx->upgradeidx;
+		     plc = plc->next, i++);
+		ctx->upgradeidx++;
+		if (plc) {
+			msg.type = PROXY_UPGRADE_SOCK;
+			msg.reuseport = plc->thridx >= 0;
+			msg.addrlen = plc->spec->listen_addrlen;
+			memcpy(&msg.addr, &plc->spec->listen_addr,
+			       msg.addrlen);
+			lfd = plc->evcl ? evconnlistener_get_fd(plc->evcl)
+			                : plc->fd;
+		} else {
+			msg.type = PROXY_UPGRADE_END;
+		}
+		if (sys_sendmsgfd(fd, &msg, sizeof(msg), lfd) == -1) {
+			log_err_printf("Error sending listener socket: "
+			               "%s (%i)\n", strerror(errno), errno);
+			proxy_upgrade_close(ctx);
+		}
+		break;
+	case PROXY_UPGRADE_DONE:
+		proxy_upgrade_close(ctx);
+		proxy_drain(ctx);
+		break;
+	default:
+		log_err_printf("Invalid upgrade request %02x\n", req);
+		proxy_upgrade_close(ctx);
+		break;
 	}
-	free(ctx);
 }
 
 /*
- * Callback for accept events on the socket listener bufferevent.
+ * Callback for accept events on the upgrade socket listener.  Only one new
+ * instance is served at a time.
  */
 static void
-proxy_listener_acceptcb(UNUSED struct evconnlistener *listener,
-                        evutil_socket_t fd,
-                        struct sockaddr *peeraddr, int peeraddrlen,
-                        void *arg)
+proxy_upgrade_acceptcb(UNUSED struct evconnlistener *listener,
+                       evutil_socket_t fd,
+                       UNUSED struct sockaddr *peeraddr,
+                       UNUSED int peeraddrlen, void *arg)
 {
-	proxy_listener_ctx_t *cfg = arg;
+	proxy_ctx_t *ctx = arg;
 
-	pxy_conn_setup(fd, peeraddr, peeraddrlen, cfg->thrmgr,
-	               cfg->spec, cfg->opts);
+	if (ctx->upgradeev) {
+		log_err_printf("Warning: Refusing concurrent upgrade\n");
+		evutil_closesocket(fd);
+		return;
+	}
+	ctx->upgradeev = event_new(ctx->evbase, fd, EV_READ|EV_PERSIST,
+	                           proxy_upgrade_readcb, ctx);
+	if (!ctx->upgradeev) {
+		log_err_printf("Error creating upgrade event\n");
+		evutil_closesocket(fd);
+		return;
+	}
+	ctx->upgradeidx = 0;
+	event_add(ctx->upgradeev, NULL);
+	log_dbg_printf("Handing over listeners to new instance\n");
 }
 
 /*
- * Callback for error events on the socket listener bufferevent.
+ * Return 1 if forged certificates of oldopts are not valid for opts, i.e. if
+ * the CA or the leaf keys differ, 0 otherwise.
  */
-static void
-proxy_listener_errorcb(struct evconnlistener *listener, UNUSED void *ctx)
+static int
+proxy_ca_changed(opts_t *opts, opts_t *oldopts)
 {
-	struct event_base *evbase = evconnlistener_get_base(listener);
-	int err = EVUTIL_SOCKET_ERROR();
-	log_err_printf("Error %d on listener: %s\n", err,
-	               evutil_socket_error_to_string(err));
-	event_base_loopbreak(evbase);
+	if (!!opts->cacrt != !!oldopts->cacrt ||
+	    (opts->cacrt && X509_cmp(opts->cacrt, oldopts->cacrt)))
+		return 1;
+	if (!!opts->cakey != !!oldopts->cakey ||
+	    (opts->cakey && EVP_PKEY_eq(opts->cakey, oldopts->cakey) != 1))
+		return 1;
+	if (!!opts->leafkey != !!oldopts->leafkey ||
+	    (opts->leafkey &&
+	     EVP_PKEY_eq(opts->leafkey, oldopts->leafkey) != 1))
+		return 1;
+	if (!!opts->eccacrt != !!oldopts->eccacrt ||
+	    (opts->eccacrt && X509_cmp(opts->eccacrt, oldopts->eccacrt)))
+		return 1;
+	if (!!opts->eccakey != !!oldopts->eccakey ||
+	    (opts->eccakey &&
+	     EVP_PKEY_eq(opts->eccakey, oldopts->eccakey) != 1))
+		return 1;
+	if (!!opts->ecleafkey != !!oldopts->ecleafkey ||
+	    (opts->ecleafkey &&
+	     EVP_PKEY_eq(opts->ecleafkey, oldopts->ecleafkey) != 1))
+		return 1;
+	if (!!opts->leafcrlurl != !!oldopts->leafcrlurl ||
+	    (opts->leafcrlurl && strcmp(opts->leafcrlurl, oldopts->leafcrlurl)))
+		return 1;
+	return 0;
 }
 
 /*
- * Dump a description of an evbase to debugging code.
+ * Return 1 if dst sessions established with the client certificate and key of
+ * oldopts must not be resumed with opts, 0 otherwise.
  */
-static void
-proxy_debug_base(const struct event_base *ev_base)
+static int
+proxy_clientid_changed(opts_t *opts, opts_t *oldopts)
 {
-	log_dbg_printf("Using libevent backend '%s'\n",
-	               event_base_get_method(ev_base));
-
-	enum event_method_feature f;
-	f = event_base_get_features(ev_base);
-	log_dbg_printf("Event base supports: edge %s, O(1) %s, anyfd %s\n",
-	               ((f & EV_FEATURE_ET) ? "yes" : "no"),
-	               ((f & EV_FEATURE_O1) ? "yes" : "no"),
-	               ((f & EV_FEATURE_FDS) ? "yes" : "no"));
+	if (!!opts->clientcrt != !!oldopts->clientcrt ||
+	    (opts->clientcrt && X509_cmp(opts->clientcrt, oldopts->clientcrt)))
+		return 1;
+	if (!!opts->clientkey != !!oldopts->clientkey ||
+	    (opts->clientkey &&
+	     EVP_PKEY_eq(opts->clientkey, oldopts->clientkey) != 1))
+		return 1;
+	return 0;
 }
 
 /*
- * Set up the listener for a single proxyspec and add it to evbase.
- * Returns the proxy_listener_ctx_t pointer if successful, NULL otherwise.
+ * Switch all listeners over to the configuration opts, freshly parsed by the
+ * reload callback, or NULL if parsing failed.  New connections use the new
+ * configuration, while established connections drain on the configuration
+ * they were accepted with.  All caches are retained, except that forged
+ * certificates and the server-side state derived from them are flushed if
+ * the CA or the leaf keys have changed, SSL_CTXs are flushed in any case,
+ * and dst sessions are flushed if the client certificate or key have
+ * changed.
+ * On any error, the running configuration stays in effect.
  */
-static proxy_listener_ctx_t *
-proxy_listener_setup(struct event_base *evbase, pxy_thrmgr_ctx_t *thrmgr,
-                     proxyspec_t *spec, opts_t *opts, int clisock)
+static void
+proxy_reload(proxy_ctx_t *ctx, opts_t *opts)
 {
-	proxy_listener_ctx_t *plc;
-	int fd;
+	opts_t *oldopts = ctx->opts;
+	pxy_forge_ctx_t *forge;
+	int flush;
 
-	if ((fd = privsep_client_opensock(clisock, spec)) == -1) {
-		log_err_printf("Error opening socket: %s (%i)\n",
-		               strerror(errno), errno);
-		return NULL;
+	if (!opts)
+		goto errout;
+	if (opts_reload(opts, oldopts) == -1)
+		goto errout_free;
+	flush = proxy_ca_changed(opts, oldopts);
+	if (flush && cachemgr_fkstore) {
+		log_err_printf("CA and leaf keys cannot be changed by "
+		               "reloading with ForgedCertCacheFile\n");
+		goto errout_free;
 	}
+	if (proxy_dstsslctx_new(opts) == -1)
+		goto errout_free;
 
-	plc = proxy_listener_ctx_new(thrmgr, spec, opts);
-	if (!plc) {
-		log_err_printf("Error creating listener context\n");
-		evutil_closesocket(fd);
-		return NULL;
+	if (flush)
+		opts->fkcrt_epoch = cachemgr_fkcrt_flush();
+	else
+		cachemgr_sslctx_flush();
+	if (proxy_clientid_changed(opts, oldopts))
+		cachemgr_dsess_flush();
+	for (proxy_listener_ctx_t *plc = ctx->lctx; plc; plc = plc->next) {
+		proxyspec_t *spec = opts->spec, *oldspec = oldopts->spec;
+		proxy_listener_swap_t *swap;
+
+		/* opts_reload() ensures both lists are of equal length */
+		while (oldspec != plc->spec) {
+			oldspec = oldspec->next;
+			spec = spec->next;
+		}
+		if (plc->thridx < 0) {
+			proxy_listener_swap(plc, spec, opts_ref(opts));
+			continue;
+		}
+		if (!(swap = malloc(sizeof(proxy_listener_swap_t)))) {
+			log_err_printf("Error allocating memory\n");
+			continue;
+		}
+		swap->plc = plc;
+		swap->spec = spec;
+		swap->opts = opts_ref(opts);
+		if (event_base_once(pxy_thrmgr_get_evbase(ctx->thrmgr,
+		                                          plc->thridx),
+		                    -1, EV_TIMEOUT, proxy_listener_swap_cb,
+		                    swap, NULL) == -1) {
+			log_err_printf("Warning: Failed to reload listener on "
+			               "thread %d\n", plc->thridx);
+			opts_unref(swap->opts);
+			free(swap);
+		}
 	}
+	if ((forge = pxy_thrmgr_get_forge(ctx->thrmgr)))
+		pxy_forge_set_opts(forge, opts);
+	ctx->opts = opts;
+	opts_unref(oldopts);
+	log_dbg_printf("Reloaded configuration%s\n",
+	               flush ? "; flushed forged certificates" : "");
+	return;
 
-	plc->evcl = evconnlistener_new(evbase, proxy_listener_acceptcb,
-	                               plc, LEV_OPT_CLOSE_ON_FREE, 1024, fd);
-	if (!plc->evcl) {
-		log_err_printf("Error creating evconnlistener: %s\n",
-		               strerror(errno));
-		proxy_listener_ctx_free(plc);
-		evutil_closesocket(fd);
-		return NULL;
+errout_free:
+	opts_free(opts);
+errout:
+	log_err_printf("Failed to reload configuration; keeping the running "
+	               "configuration\n");
+}
+
+/*
+ * Reload thread: parse the configuration and hand it over to
+ * proxy_reload_cb() on the main event loop.
+ */
+static void *
+proxy_reload_thr(void *arg)
+{
+	proxy_ctx_t *ctx = arg;
+
+	ctx->reloadopts = ctx->reloadcb();
+	event_active(ctx->reloadev, EV_TIMEOUT, 0);
+	return NULL;
+}
+
+/*
+ * Reload completion callback on the main event loop.
+ */
+static void
+proxy_reload_cb(UNUSED evutil_socket_t fd, UNUSED short what, void *arg)
+{
+	proxy_ctx_t *ctx = arg;
+	opts_t *opts = ctx->reloadopts;
+
+	pthread_join(ctx->reloadthr, NULL);
+	ctx->reloadopts = NULL;
+	ctx->reloading = 0;
+	proxy_reload(ctx, opts);
+}
+
+/*
+ * Start reloading the configuration.  Parsing it and loading the files it
+ * refers to happens on a separate thread, such that the event loop keeps
+ * accepting connections meanwhile.  A reload requested while another one is
+ * still in progress is ignored.
+ */
+static void
+proxy_reload_start(proxy_ctx_t *ctx)
+{
+	int rv;
+
+	if (ctx->reloading) {
+		log_err_printf("Reload already in progress; ignoring\n");
+		return;
 	}
-	evconnlistener_set_error_cb(plc->evcl, proxy_listener_errorcb);
-	return plc;
+	log_dbg_printf("Reloading configuration\n");
+	rv = pthread_create(&ctx->reloadthr, NULL, proxy_reload_thr, ctx);
+	if (rv) {
+		log_err_printf("Failed to start reload thread: %s (%i)\n",
+		               strerror(rv), rv);
+		return;
+	}
+	ctx->reloading = 1;
 }
 
 /*
- * Signal handler for SIGTERM, SIGQUIT, SIGINT, SIGHUP, SIGPIPE and SIGUSR1.
+ * Signal handler for SIGTERM, SIGQUIT, SIGINT, SIGHUP, SIGPIPE, SIGUSR1,
+ * SIGUSR2 and SIGURG.
  */
 static void
 proxy_signal_cb(evutil_socket_t fd, UNUSED short what, void *arg)
@@ -207,12 +1722,19 @@ proxy_signal_cb(evutil_socket_t fd, UNUSED short what, void *arg)
 	}
 
 	switch(fd) {
-	case SIGTERM:
-	case SIGQUIT:
-	case SIGINT:
 	case SIGHUP:
+		if (ctx->reloadcb) {
+			proxy_reload_start(ctx);
+			break;
+		}
+		/* FALLTHROUGH */
+	case SIGQUIT:
 		proxy_loopbreak(ctx, fd);
 		break;
+	case SIGTERM:
+	case SIGINT:
+		proxy_shutdown(ctx, fd);
+		break;
 	case SIGUSR1:
 		if (log_reopen() == -1) {
 			log_err_printf("Warning: Failed to reopen logs\n");
@@ -220,6 +1742,16 @@ proxy_signal_cb(evutil_socket_t fd, UNUSED short what, void *arg)
 			log_dbg_printf("Reopened log files\n");
 		}
 		break;
+	case SIGUSR2:
+		log_stats();
+		stats_log();
+		if (OPTS_DEBUG(ctx->opts)) {
+			proxy_stats_debug();
+		}
+		break;
+	case SIGURG:
+		log_content_recorder_trigger();
+		break;
 	case SIGPIPE:
 		log_err_printf("Warning: Received SIGPIPE; ignoring.\n");
 		break;
@@ -230,29 +1762,127 @@ proxy_signal_cb(evutil_socket_t fd, UNUSED short what, void *arg)
 }
 
 /*
- * Garbage collection handler.
+ * Garbage collection handler.  Garbage collection is incremental, each tick
+ * scans a bounded part of the caches, such that a full pass over large
+ * caches is spread over many ticks.
+ */
+static void
+proxy_gc_cb(UNUSED evutil_socket_t fd, UNUSED short what, UNUSED void *arg)
+{
+	cachemgr_gc_step(PROXY_GC_BUDGET);
+}
+
+/*
+ * Log overflow check handler.
+ */
+static void
+proxy_logstats_cb(UNUSED evutil_socket_t fd, UNUSED short what,
+                  UNUSED void *arg)
+{
+	log_stats_check();
+}
+
+/*
+ * Write one connect log rollup line to the same destinations as the
+ * per-connection lines.
+ */
+static void
+proxy_rollup_line(const char *line, size_t len, void *arg)
+{
+	proxy_ctx_t *ctx = arg;
+
+	if (!ctx->opts->detach) {
+		log_err_printf("%.*s", (int)len, line);
+	}
+	if (ctx->opts->connectlog) {
+		if (log_connect_write(line, len) == -1) {
+			log_err_rl_printf("Warning: Connection logging "
+			                  "failed\n");
+		}
+	}
+}
+
+/*
+ * Connect log rollup handler.
+ */
+static void
+proxy_rollup_cb(UNUSED evutil_socket_t fd, UNUSED short what, void *arg)
+{
+	proxy_ctx_t *ctx = arg;
+
+	if (pxy_thrmgr_rollup_flush(ctx->thrmgr, proxy_rollup_line,
+	                            ctx) == -1) {
+		log_err_rl_printf("Warning: Connect log rollup aggregates "
+		                  "lost\n");
+	}
+}
+
+/*
+ * Rebalancing handler for RebalanceInterval.
+ */
+static void
+proxy_rebalance_cb(UNUSED evutil_socket_t fd, UNUSED short what, void *arg)
+{
+	proxy_ctx_t *ctx = arg;
+
+	pxy_conn_rebalance(ctx->thrmgr, ctx->opts->rebalance_interval);
+}
+
+/*
+ * Session ticket key rotation handler.
+ */
+static void
+proxy_ticket_cb(UNUSED evutil_socket_t fd, UNUSED short what, void *arg)
+{
+	proxy_ctx_t *ctx = arg;
+
+	if (sslticket_rotate() == -1) {
+		log_err_printf("Warning: Failed to rotate session ticket "
+		               "keys; keeping previous keys\n");
+	} else if (OPTS_DEBUG(ctx->opts)) {
+		log_dbg_printf("Rotated session ticket keys\n");
+	}
+}
+
+/*
+ * Session cache snapshot handler.
  */
 static void
-proxy_gc_cb(UNUSED evutil_socket_t fd, UNUSED short what, void *arg)
+proxy_sess_cb(UNUSED evutil_socket_t fd, UNUSED short what, void *arg)
 {
 	proxy_ctx_t *ctx = arg;
+	ssize_t n;
 
-	if (OPTS_DEBUG(ctx->opts))
-		log_dbg_printf("Garbage collecting caches started.\n");
+	if ((n = cachemgr_sess_save()) == -1) {
+		log_err_printf("Warning: Failed to save session caches\n");
+	} else if (OPTS_DEBUG(ctx->opts)) {
+		log_dbg_printf("Saved %zi SSL sessions\n", n);
+	}
+}
 
-	cachemgr_gc();
+/*
+ * Pre-forging handler.
+ */
+static void
+proxy_preforge_cb(UNUSED evutil_socket_t fd, UNUSED short what, void *arg)
+{
+	proxy_ctx_t *ctx = arg;
+	pxy_forge_ctx_t *forge = pxy_thrmgr_get_forge(ctx->thrmgr);
 
-	if (OPTS_DEBUG(ctx->opts))
-		log_dbg_printf("Garbage collecting caches done.\n");
+	if (forge)
+		pxy_forge_prewarm(forge, ctx->evbase, PROXY_PREFORGE_WINDOW);
 }
 
 /*
  * Set up the core event loop.
  * Socket clisock is the privsep client socket used for binding to ports.
+ * If reloadcb is given, SIGHUP reloads the configuration returned by it
+ * instead of terminating; reloadcb is called on a separate thread and
+ * returns NULL if it failed.
  * Returns ctx on success, or NULL on error.
  */
 proxy_ctx_t *
-proxy_new(opts_t *opts, int clisock)
+proxy_new(opts_t *opts, int clisock, proxy_reload_cb_t reloadcb)
 {
 	proxy_listener_ctx_t *head;
 	proxy_ctx_t *ctx;
@@ -275,7 +1905,9 @@ proxy_new(opts_t *opts, int clisock)
 	}
 	memset(ctx, 0, sizeof(proxy_ctx_t));
 
-	ctx->opts = opts;
+	ctx->opts = opts_ref(opts);
+	ctx->reloadcb = reloadcb;
+	ctx->upgradesock = -1;
 	ctx->evbase = event_base_new();
 	if (!ctx->evbase) {
 		log_err_printf("Error getting event base\n");
@@ -318,14 +1950,57 @@ proxy_new(opts_t *opts, int clisock)
 	}
 
 	head = ctx->lctx = NULL;
+	if (proxy_dstsslctx_new(opts) == -1)
+		goto leave2;
+	if (opts->upgrade_socket &&
+	    (rc = proxy_upgrade_fetch(ctx, opts->upgrade_socket)) != 0) {
+		if (rc == -1) {
+			log_err_printf("Error taking over listeners from "
+			               "'%s': %s (%i)\n", opts->upgrade_socket,
+			               strerror(errno), errno);
+			goto leave2;
+		}
+		log_dbg_printf("Taking over %i listener sockets from previous "
+		               "instance\n", rc);
+	}
 	for (proxyspec_t *spec = opts->spec; spec; spec = spec->next) {
-		head = proxy_listener_setup(ctx->evbase, ctx->thrmgr,
-		                            spec, opts, clisock);
-		if (!head)
+		int first, num_thr;
+
+		spec->wpool = pxy_thrmgr_wpool_find(ctx->thrmgr,
+		                                    spec->workerpool);
+		if (spec->wpool == -1) {
+			log_err_printf("Unknown worker pool '%s'\n",
+			               spec->workerpool);
 			goto leave2;
-		head->next = ctx->lctx;
-		ctx->lctx = head;
+		}
+		if (spec->fwdpool) {
+			spec->fwpool = pxy_thrmgr_wpool_find(ctx->thrmgr,
+			                                     spec->fwdpool);
+			if (spec->fwpool == -1) {
+				log_err_printf("Unknown worker pool '%s'\n",
+				               spec->fwdpool);
+				goto leave2;
+			}
+		}
+		if (!opts->reuseport) {
+			head = proxy_listener_setup(ctx, -1, spec, clisock);
+			if (!head)
+				goto leave2;
+			head->next = ctx->lctx;
+			ctx->lctx = head;
+			continue;
+		}
+		num_thr = pxy_thrmgr_wpool_range(ctx->thrmgr, spec->wpool,
+		                                 &first);
+		for (int i = first; i < first + num_thr; i++) {
+			head = proxy_listener_setup(ctx, i, spec, clisock);
+			if (!head)
+				goto leave2;
+			head->next = ctx->lctx;
+			ctx->lctx = head;
+		}
 	}
+	proxy_upgrade_release(ctx);
 
 	for (size_t i = 0; i < (sizeof(signals) / sizeof(int)); i++) {
 		ctx->sev[i] = evsignal_new(ctx->evbase, signals[i],
@@ -335,16 +2010,141 @@ proxy_new(opts_t *opts, int clisock)
 		evsignal_add(ctx->sev[i], NULL);
 	}
 
-	struct timeval gc_delay = {60, 0};
+	struct timeval gc_delay = {PROXY_GC_INTERVAL, 0};
 	ctx->gcev = event_new(ctx->evbase, -1, EV_PERSIST, proxy_gc_cb, ctx);
 	if (!ctx->gcev)
 		goto leave4;
 	evtimer_add(ctx->gcev, &gc_delay);
 
+	struct timeval logstats_delay = {PROXY_LOGSTATS_INTERVAL, 0};
+	ctx->logstatsev = event_new(ctx->evbase, -1, EV_PERSIST,
+	                            proxy_logstats_cb, ctx);
+	if (!ctx->logstatsev)
+		goto leave4;
+	evtimer_add(ctx->logstatsev, &logstats_delay);
+
+	if (opts->preforge_hosts && opts->forge_threads) {
+		struct timeval preforge_delay = {PROXY_PREFORGE_INTERVAL, 0};
+		ctx->preforgeev = event_new(ctx->evbase, -1, EV_PERSIST,
+		                            proxy_preforge_cb, ctx);
+		if (!ctx->preforgeev)
+			goto leave4;
+		evtimer_add(ctx->preforgeev, &preforge_delay);
+	}
+
+	/* worker processes share the keys, only the first one rotates */
+	if (opts->sslticket && opts->ticket_rotate && privsep_worker() == 0) {
+		struct timeval ticket_delay = {opts->ticket_rotate, 0};
+		ctx->ticketev = event_new(ctx->evbase, -1, EV_PERSIST,
+		                          proxy_ticket_cb, ctx);
+		if (!ctx->ticketev)
+			goto leave4;
+		evtimer_add(ctx->ticketev, &ticket_delay);
+	}
+
+	/* worker processes share one session store, only the first saves */
+	if (opts->sessstore && opts->sessstore_interval &&
+	    privsep_worker() == 0) {
+		struct timeval sess_delay = {opts->sessstore_interval, 0};
+		ctx->sessev = event_new(ctx->evbase, -1, EV_PERSIST,
+		                        proxy_sess_cb, ctx);
+		if (!ctx->sessev)
+			goto leave4;
+		evtimer_add(ctx->sessev, &sess_delay);
+	}
+
+	if (opts->connectlog_rollup) {
+		struct timeval rollup_delay = {opts->connectlog_rollup, 0};
+		ctx->rollupev = event_new(ctx->evbase, -1, EV_PERSIST,
+		                          proxy_rollup_cb, ctx);
+		if (!ctx->rollupev)
+			goto leave4;
+		evtimer_add(ctx->rollupev, &rollup_delay);
+	}
+
+	if (opts->rebalance_interval) {
+		struct timeval rebalance_delay = {opts->rebalance_interval, 0};
+		ctx->rebalanceev = event_new(ctx->evbase, -1, EV_PERSIST,
+		                             proxy_rebalance_cb, ctx);
+		if (!ctx->rebalanceev)
+			goto leave4;
+		evtimer_add(ctx->rebalanceev, &rebalance_delay);
+	}
+
+	if (reloadcb) {
+		ctx->reloadev = event_new(ctx->evbase, -1, 0,
+		                          proxy_reload_cb, ctx);
+		if (!ctx->reloadev)
+			goto leave4;
+	}
+
+	if (opts->stats_socket) {
+		evutil_socket_t fd = privsep_client_openstats(clisock, opts);
+		if (fd == -1) {
+			log_err_printf("Error opening stats socket '%s': "
+			               "%s (%i)\n", opts->stats_socket,
+			               strerror(errno), errno);
+			goto leave4;
+		}
+		ctx->statsevcl = evconnlistener_new(ctx->evbase,
+		                                    proxy_stats_acceptcb, ctx,
+		                                    LEV_OPT_CLOSE_ON_FREE, 16,
+		                                    fd);
+		if (!ctx->statsevcl) {
+			log_err_printf("Error creating stats listener\n");
+			evutil_closesocket(fd);
+			goto leave4;
+		}
+	}
+
+	if (opts->upgrade_socket) {
+		evutil_socket_t fd = privsep_client_openupgrade(clisock, opts);
+		if (fd == -1) {
+			log_err_printf("Error opening upgrade socket '%s': "
+			               "%s (%i)\n", opts->upgrade_socket,
+			               strerror(errno), errno);
+			goto leave4;
+		}
+		ctx->upgradeevcl = evconnlistener_new(ctx->evbase,
+		                                      proxy_upgrade_acceptcb,
+		                                      ctx,
+		                                      LEV_OPT_CLOSE_ON_FREE, 4,
+		                                      fd);
+		if (!ctx->upgradeevcl) {
+			log_err_printf("Error creating upgrade listener\n");
+			evutil_closesocket(fd);
+			goto leave4;
+		}
+	}
+
 	privsep_client_close(clisock);
 	return ctx;
 
 leave4:
+	if (ctx->statsevcl) {
+		evconnlistener_free(ctx->statsevcl);
+	}
+	if (ctx->reloadev) {
+		event_free(ctx->reloadev);
+	}
+	if (ctx->rebalanceev) {
+		event_free(ctx->rebalanceev);
+	}
+	if (ctx->rollupev) {
+		event_free(ctx->rollupev);
+	}
+	if (ctx->sessev) {
+		event_free(ctx->sessev);
+	}
+	if (ctx->ticketev) {
+		event_free(ctx->ticketev);
+	}
+	if (ctx->preforgeev) {
+		event_free(ctx->preforgeev);
+	}
+	if (ctx->logstatsev) {
+		event_free(ctx->logstatsev);
+	}
 	if (ctx->gcev) {
 		event_free(ctx->gcev);
 	}
@@ -359,10 +2159,15 @@ leave2:
 	if (ctx->lctx) {
 		proxy_listener_ctx_free(ctx->lctx);
 	}
+	proxy_upgrade_release(ctx);
+	if (ctx->upgradesock != -1) {
+		close(ctx->upgradesock);
+	}
 	pxy_thrmgr_free(ctx->thrmgr);
 leave1b:
 	event_base_free(ctx->evbase);
 leave1:
+	opts_unref(ctx->opts);
 	free(ctx);
 leave0:
 	return NULL;
@@ -388,6 +2193,18 @@ proxy_run(proxy_ctx_t *ctx)
 		log_err_printf("Failed to start thread manager\n");
 		return -1;
 	}
+	if (proxy_listener_start(ctx->lctx) == -1) {
+		log_err_printf("Failed to start per-thread listeners\n");
+		return -1;
+	}
+	if (ctx->opts->reuseport_steer &&
+	    proxy_listener_steer(ctx->lctx) == -1) {
+		log_err_printf("Failed to steer per-thread listeners\n");
+		return -1;
+	}
+	if (ctx->upgradesock != -1) {
+		proxy_upgrade_done(ctx);
+	}
 	if (OPTS_DEBUG(ctx->opts)) {
 		log_dbg_printf("Starting main event loop.\n");
 	}
@@ -416,6 +2233,50 @@ proxy_loopbreak(proxy_ctx_t *ctx, int reason)
 void
 proxy_free(proxy_ctx_t *ctx)
 {
+	if (ctx->drainev) {
+		event_free(ctx->drainev);
+	}
+	if (ctx->upgradeev) {
+		proxy_upgrade_close(ctx);
+	}
+	if (ctx->upgradeevcl) {
+		evconnlistener_free(ctx->upgradeevcl);
+	}
+	if (ctx->upgradesock != -1) {
+		close(ctx->upgradesock);
+	}
+	if (ctx->statsevcl) {
+		evconnlistener_free(ctx->statsevcl);
+	}
+	if (ctx->reloading) {
+		/* the reload thread activates reloadev when done */
+		pthread_join(ctx->reloadthr, NULL);
+		if (ctx->reloadopts)
+			opts_free(ctx->reloadopts);
+	}
+	if (ctx->reloadev) {
+		event_free(ctx->reloadev);
+	}
+	if (ctx->rebalanceev) {
+		event_free(ctx->rebalanceev);
+	}
+	if (ctx->rollupev) {
+		event_free(ctx->rollupev);
+		/* write what was counted since the last interval */
+		proxy_rollup_cb(-1, 0, ctx);
+	}
+	if (ctx->sessev) {
+		event_free(ctx->sessev);
+	}
+	if (ctx->ticketev) {
+		event_free(ctx->ticketev);
+	}
+	if (ctx->preforgeev) {
+		event_free(ctx->preforgeev);
+	}
+	if (ctx->logstatsev) {
+		event_free(ctx->logstatsev);
+	}
 	if (ctx->gcev) {
 		event_free(ctx->gcev);
 	}
@@ -433,6 +2294,7 @@ proxy_free(proxy_ctx_t *ctx)
 	if (ctx->evbase) {
 		event_base_free(ctx->evbase);
 	}
+	opts_unref(ctx->opts);
 	free(ctx);
 }
 
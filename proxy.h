@@ -33,8 +33,9 @@
 #include "attrib.h"
 
 typedef struct proxy_ctx proxy_ctx_t;
+typedef opts_t * (*proxy_reload_cb_t)(void);
 
-proxy_ctx_t * proxy_new(opts_t *, int) NONNULL(1) MALLOC;
+proxy_ctx_t * proxy_new(opts_t *, int, proxy_reload_cb_t) NONNULL(1) MALLOC;
 int proxy_run(proxy_ctx_t *) NONNULL(1);
 void proxy_loopbreak(proxy_ctx_t *, int) NONNULL(1);
 void proxy_free(proxy_ctx_t *) NONNULL(1);
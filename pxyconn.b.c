@@ -0,0 +1,490 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The HTTP header filters and the SSL object setup are internal to the
+ * connection handling code, so the benchmark is compiled together with it
+ * instead of linking pxyconn.o.
+ */
+#include "pxyconn.c"
+
+#include "bench.h"
+
+#define BENCHCACRT "extra/pki/rsa.crt"
+#define BENCHCAKEY "extra/pki/rsa.key"
+#define BENCHPEM "extra/pki/server.pem"
+#define BENCHSNI "daniel.roe.ch"
+
+static const char reqhdr[] =
+	"GET /assets/app.js?v=3 HTTP/1.1\r\n"
+	"Host: daniel.roe.ch\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:130.0) "
+	"Gecko/20100101 Firefox/130.0\r\n"
+	"Accept: */*\r\n"
+	"Accept-Language: en-US,en;q=0.5\r\n"
+	"Accept-Encoding: gzip, deflate, br, zstd\r\n"
+	"Referer: https://daniel.roe.ch/\r\n"
+	"Connection: keep-alive\r\n"
+	"Cookie: session=0123456789abcdef0123456789abcdef\r\n"
+	"Sec-Fetch-Dest: script\r\n"
+	"Sec-Fetch-Mode: no-cors\r\n"
+	"Sec-Fetch-Site: same-origin\r\n"
+	"\r\n";
+
+static const char resphdr[] =
+	"HTTP/1.1 200 OK\r\n"
+	"Server: nginx\r\n"
+	"Date: Wed, 14 Oct 2026 12:00:00 GMT\r\n"
+	"Content-Type: application/javascript\r\n"
+	"Content-Length: 48213\r\n"
+	"Last-Modified: Mon, 12 Oct 2026 08:00:00 GMT\r\n"
+	"Connection: keep-alive\r\n"
+	"ETag: \"6708f2a0-bc55\"\r\n"
+	"Strict-Transport-Security: max-age=31536000\r\n"
+	"Cache-Control: max-age=86400\r\n"
+	"Accept-Ranges: bytes\r\n"
+	"\r\n";
+
+typedef struct pxyconn_bench {
+	pxy_conn_ctx_t *ctx;
+	proxyspec_t spec;
+	struct event_base *evbase;
+	struct evbuffer *inbuf;
+	struct evbuffer *outbuf;
+	int req;
+	char *hdr;                      /* with the worst case benchmarks */
+	size_t hdrsz;
+	size_t chainsz;
+} pxyconn_bench_t;
+
+static void
+pxyconn_bench_http_hdr_filter(void *arg, size_t n)
+{
+	pxyconn_bench_t *b = arg;
+
+	while (n--) {
+		if (b->req)
+			evbuffer_add(b->inbuf, reqhdr, sizeof(reqhdr) - 1);
+		else
+			evbuffer_add(b->inbuf, resphdr, sizeof(resphdr) - 1);
+		pxy_http_hdr_filter(b->ctx, b->inbuf, b->outbuf, b->req);
+		if (b->ctx->enomem ||
+		    !(b->req ? b->ctx->seen_req_header
+		             : b->ctx->seen_resp_header)) {
+			fprintf(stderr, "pxy_http_hdr_filter() failed\n");
+			exit(EXIT_FAILURE);
+		}
+		evbuffer_drain(b->outbuf, evbuffer_get_length(b->outbuf));
+		pxy_http_reset(b->ctx, b->req);
+	}
+}
+
+/*
+ * Handshakes of intercepted connections over memory BIO pairs, without
+ * sockets or event loops: the dst SSL from pxy_dstssl_create() handshakes
+ * with a synthetic origin server using the test server certificate, then
+ * the src SSL from pxy_srcssl_create(), with the SSL_CTX from
+ * pxy_srcsslctx_create() or the cache, handshakes with a client sending SNI.
+ * One iteration is one connection with both handshakes, in one of three
+ * modes:  full handshakes forging a new certificate for every connection,
+ * full handshakes with the forged certificate and its SSL_CTX cached, and
+ * handshakes resuming the sessions on both legs.
+ */
+#define PXYCONN_BENCH_FULL      0
+#define PXYCONN_BENCH_CACHED    1
+#define PXYCONN_BENCH_RESUMED   2
+
+typedef struct pxyconn_bench_hs {
+	int mode;
+	opts_t *opts;
+	proxyspec_t spec;
+	pxy_thrmgr_ctx_t *thrmgr;
+	SSL_CTX *originctx;
+	SSL_CTX *clientctx;
+	pthread_mutex_t mutex;
+	SSL_SESSION *clientsess;        /* with PXYCONN_BENCH_RESUMED */
+} pxyconn_bench_hs_t;
+
+static void
+pxyconn_bench_hs_die(const char *what)
+{
+	fprintf(stderr, "%s failed\n", what);
+	ERR_print_errors_fp(stderr);
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * Drive the handshake between SSL client c and SSL server s connected by a
+ * BIO pair to completion, then let the client process the session tickets
+ * which the server sends after the handshake with TLS 1.3.
+ */
+static void
+pxyconn_bench_hs_pump(SSL *c, SSL *s, const char *what)
+{
+	unsigned char buf[1];
+	int cdone = 0, sdone = 0, rv;
+
+	for (int i = 0; !cdone || !sdone; i++) {
+		if (i == 100)
+			pxyconn_bench_hs_die(what);
+		if (!cdone) {
+			rv = SSL_do_handshake(c);
+			if (rv == 1)
+				cdone = 1;
+			else if (SSL_get_error(c, rv) != SSL_ERROR_WANT_READ)
+				pxyconn_bench_hs_die(what);
+		}
+		if (!sdone) {
+			rv = SSL_do_handshake(s);
+			if (rv == 1)
+				sdone = 1;
+			else if (SSL_get_error(s, rv) != SSL_ERROR_WANT_READ)
+				pxyconn_bench_hs_die(what);
+		}
+	}
+	if (SSL_read(c, buf, sizeof(buf)) > 0)
+		pxyconn_bench_hs_die(what);
+}
+
+static void
+pxyconn_bench_hs_pair(SSL *c, SSL *s)
+{
+	BIO *cbio, *sbio;
+
+	if (BIO_new_bio_pair(&cbio, 0, &sbio, 0) != 1)
+		pxyconn_bench_hs_die("BIO_new_bio_pair()");
+	SSL_set_bio(c, cbio, cbio);
+	SSL_set_bio(s, sbio, sbio);
+	SSL_set_connect_state(c);
+	SSL_set_accept_state(s);
+}
+
+static void
+pxyconn_bench_handshake(void *arg, size_t n)
+{
+	pxyconn_bench_hs_t *b = arg;
+	struct sockaddr_in *sin;
+	SSL_SESSION *sess;
+	pxy_conn_ctx_t *ctx;
+	SSL *origin, *client;
+
+	while (n--) {
+		if (!(ctx = calloc(1, sizeof(pxy_conn_ctx_t))) ||
+		    !(ctx->sni = strdup(BENCHSNI))) {
+			fprintf(stderr, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		ctx->spec = &b->spec;
+		ctx->opts = b->opts;
+		ctx->thrmgr = b->thrmgr;
+		ctx->fd = ctx->stepfd = ctx->srcslot = -1;
+		for (int i = 0; i < STATS_NPHASES; i++)
+			ctx->phase[i] = -1;
+		sin = (struct sockaddr_in *)&ctx->dstaddr;
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(443);
+		sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		ctx->dstaddrlen = sizeof(struct sockaddr_in);
+
+		if (b->mode != PXYCONN_BENCH_RESUMED) {
+			cachemgr_dsess_del((struct sockaddr *)&ctx->dstaddr,
+			                   ctx->dstaddrlen, ctx->sni);
+		}
+		if (!(ctx->dst.ssl = pxy_dstssl_create(ctx)) ||
+		    !(origin = SSL_new(b->originctx)))
+			pxyconn_bench_hs_die("pxy_dstssl_create()");
+		pxyconn_bench_hs_pair(ctx->dst.ssl, origin);
+		pxyconn_bench_hs_pump(ctx->dst.ssl, origin, "dst handshake");
+
+		if (b->mode == PXYCONN_BENCH_FULL) {
+			X509 *crt = SSL_get_peer_certificate(ctx->dst.ssl);
+
+			if (!crt)
+				pxyconn_bench_hs_die("SSL_get_peer_"
+				                     "certificate()");
+			cachemgr_fkcrt_del(crt);
+			X509_free(crt);
+		}
+		if (!(ctx->src.ssl = pxy_srcssl_create(ctx, ctx->dst.ssl)) ||
+		    !(client = SSL_new(b->clientctx)))
+			pxyconn_bench_hs_die("pxy_srcssl_create()");
+		SSL_set_tlsext_host_name(client, BENCHSNI);
+		if (b->mode == PXYCONN_BENCH_RESUMED) {
+			pthread_mutex_lock(&b->mutex);
+			if (b->clientsess)
+				SSL_set_session(client, b->clientsess);
+			pthread_mutex_unlock(&b->mutex);
+		}
+		pxyconn_bench_hs_pair(client, ctx->src.ssl);
+		pxyconn_bench_hs_pump(client, ctx->src.ssl, "src handshake");
+		if (b->mode == PXYCONN_BENCH_RESUMED) {
+			/* TLS 1.3 tickets are single use, keep the newest */
+			if (!(sess = SSL_get1_session(client)))
+				pxyconn_bench_hs_die("SSL_get1_session()");
+			pthread_mutex_lock(&b->mutex);
+			if (b->clientsess)
+				SSL_SESSION_free(b->clientsess);
+			b->clientsess = sess;
+			pthread_mutex_unlock(&b->mutex);
+		}
+
+		/* SSL_free() before SSL_shutdown() invalidates the session */
+		SSL_shutdown(client);
+		SSL_shutdown(ctx->src.ssl);
+		SSL_shutdown(ctx->dst.ssl);
+		SSL_shutdown(origin);
+		SSL_free(client);
+		SSL_free(ctx->src.ssl);
+		if (pxy_dstssl_recycle(ctx, ctx->dst.ssl) == -1)
+			SSL_free(ctx->dst.ssl);
+		SSL_free(origin);
+		if (ctx->origcrt)
+			X509_free(ctx->origcrt);
+		free(ctx->sni);
+		free(ctx);
+	}
+}
+
+/*
+ * Run the handshake benchmark in the given mode, after two connections to
+ * warm up the certificate, SSL_CTX and session caches.
+ */
+static void
+pxyconn_bench_hs_run(pxyconn_bench_hs_t *b, const char *name, int mode)
+{
+	b->mode = mode;
+	pxyconn_bench_handshake(b, 2);
+	bench_run(name, 1, pxyconn_bench_handshake, b);
+	if (bench_nthreads() > 1)
+		bench_run(name, bench_nthreads(), pxyconn_bench_handshake, b);
+}
+
+static void
+pxyconn_bench_hs_setup(pxyconn_bench_hs_t *b, int maxver)
+{
+	cert_t *cert;
+
+	memset(b, 0, sizeof(pxyconn_bench_hs_t));
+	pthread_mutex_init(&b->mutex, NULL);
+	if (!(b->opts = opts_new()))
+		pxyconn_bench_hs_die("opts_new()");
+	/* no connect log, synchronous forging, no verification */
+	b->opts->detach = 1;
+	b->opts->forge_threads = 0;
+	b->opts->worker_threads = 1;
+	b->opts->cacrt = ssl_x509_load(BENCHCACRT);
+	b->opts->cakey = ssl_key_load(BENCHCAKEY);
+	b->opts->leafkey = ssl_key_genrsa(2048);
+	if (!b->opts->cacrt || !b->opts->cakey || !b->opts->leafkey)
+		pxyconn_bench_hs_die("Loading " BENCHCACRT " or " BENCHCAKEY);
+	b->spec.ssl = 1;
+	b->spec.fwpool = -1;
+	if (!(b->spec.dstsslctx = pxy_dstsslctx_new(b->opts)))
+		pxyconn_bench_hs_die("pxy_dstsslctx_new()");
+	if (!(b->thrmgr = pxy_thrmgr_new(b->opts)) ||
+	    pxy_thrmgr_run(b->thrmgr) == -1)
+		pxyconn_bench_hs_die("pxy_thrmgr_run()");
+
+	if (!(cert = cert_new_load(BENCHPEM)))
+		pxyconn_bench_hs_die("Loading " BENCHPEM);
+	if (!(b->originctx = SSL_CTX_new(SSLv23_server_method())) ||
+	    SSL_CTX_use_certificate(b->originctx, cert->crt) != 1 ||
+	    SSL_CTX_use_PrivateKey(b->originctx, cert->key) != 1)
+		pxyconn_bench_hs_die("Origin SSL_CTX setup");
+	cert_free(cert);
+	if (!(b->clientctx = SSL_CTX_new(SSLv23_client_method())))
+		pxyconn_bench_hs_die("Client SSL_CTX setup");
+#if (OPENSSL_VERSION_NUMBER >= 0x10100000L) && !defined(LIBRESSL_VERSION_NUMBER)
+	if (maxver) {
+		SSL_CTX_set_max_proto_version(b->originctx, maxver);
+		SSL_CTX_set_max_proto_version(b->clientctx, maxver);
+	}
+#endif /* OPENSSL_VERSION_NUMBER >= 0x10100000L */
+}
+
+static void
+pxyconn_bench_hs_teardown(pxyconn_bench_hs_t *b)
+{
+	if (b->clientsess)
+		SSL_SESSION_free(b->clientsess);
+	SSL_CTX_free(b->clientctx);
+	SSL_CTX_free(b->originctx);
+	pxy_thrmgr_free(b->thrmgr);
+	SSL_CTX_free(b->spec.dstsslctx);
+	opts_free(b->opts);
+	pthread_mutex_destroy(&b->mutex);
+}
+
+static void
+pxyconn_bench_hs(void)
+{
+	static const struct {
+		const char *name;
+		int maxver;
+	} vers[] = {
+		{"", 0},
+#ifdef TLS1_2_VERSION
+		{"TLS12", TLS1_2_VERSION},
+#endif /* TLS1_2_VERSION */
+	};
+	pxyconn_bench_hs_t b;
+	char name[64];
+
+	if (cachemgr_preinit() == -1) {
+		fprintf(stderr, "Failed to initialize caches\n");
+		exit(EXIT_FAILURE);
+	}
+	for (size_t i = 0; i < sizeof(vers) / sizeof(vers[0]); i++) {
+		pxyconn_bench_hs_setup(&b, vers[i].maxver);
+		snprintf(name, sizeof(name), "HandshakeFull%s", vers[i].name);
+		pxyconn_bench_hs_run(&b, name, PXYCONN_BENCH_FULL);
+		snprintf(name, sizeof(name), "HandshakeCachedForge%s",
+		         vers[i].name);
+		pxyconn_bench_hs_run(&b, name, PXYCONN_BENCH_CACHED);
+		snprintf(name, sizeof(name), "HandshakeResumed%s",
+		         vers[i].name);
+		pxyconn_bench_hs_run(&b, name, PXYCONN_BENCH_RESUMED);
+		pxyconn_bench_hs_teardown(&b);
+	}
+	cachemgr_fini();
+}
+
+/*
+ * Adversarial request headers of thousands of lines, each either passed on
+ * or removed by the filter, added to the input buffer in one chain or in
+ * chains of 64 octets, such that every other line spans chains and needs to
+ * be located by searching the buffer.
+ */
+#define PXYCONN_BENCH_HDRLINES 4096
+
+static void
+pxyconn_bench_http_hdr_filter_worst(void *arg, size_t n)
+{
+	pxyconn_bench_t *b = arg;
+
+	while (n--) {
+		for (size_t off = 0; off < b->hdrsz; off += b->chainsz) {
+			evbuffer_add_reference(b->inbuf, b->hdr + off,
+			                       b->hdrsz - off < b->chainsz ?
+			                       b->hdrsz - off : b->chainsz,
+			                       NULL, NULL);
+		}
+		pxy_http_hdr_filter(b->ctx, b->inbuf, b->outbuf, 1);
+		if (b->ctx->enomem || !b->ctx->seen_req_header ||
+		    evbuffer_get_length(b->inbuf) > 0) {
+			fprintf(stderr, "pxy_http_hdr_filter() failed\n");
+			exit(EXIT_FAILURE);
+		}
+		evbuffer_drain(b->outbuf, evbuffer_get_length(b->outbuf));
+		pxy_http_reset(b->ctx, 1);
+	}
+}
+
+static void
+pxyconn_bench_http_hdr_worst(pxyconn_bench_t *b, const char *line)
+{
+	static const char reqline[] = "GET / HTTP/1.1\r\n";
+	size_t linesz = strlen(line), off;
+
+	b->hdrsz = sizeof(reqline) - 1 + PXYCONN_BENCH_HDRLINES * linesz + 2;
+	if (!(b->hdr = malloc(b->hdrsz))) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(b->hdr, reqline, sizeof(reqline) - 1);
+	off = sizeof(reqline) - 1;
+	for (size_t i = 0; i < PXYCONN_BENCH_HDRLINES; i++) {
+		memcpy(b->hdr + off, line, linesz);
+		off += linesz;
+	}
+	memcpy(b->hdr + off, "\r\n", 2);
+}
+
+void
+pxyconn_bench(void)
+{
+	pxyconn_bench_t b;
+
+	if (!(b.ctx = calloc(1, sizeof(pxy_conn_ctx_t))) ||
+	    !(b.ctx->opts = opts_new()) ||
+	    !(b.evbase = event_base_new()) ||
+	    !(b.ctx->wheel = tmwheel_new(b.evbase, 100)) ||
+	    !(b.inbuf = evbuffer_new()) ||
+	    !(b.outbuf = evbuffer_new())) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	/* no connect log */
+	b.ctx->opts->detach = 1;
+	memset(&b.spec, 0, sizeof(b.spec));
+	b.spec.http = 1;
+	pxy_http_hdrs_setup(&b.spec, b.ctx->opts);
+	b.ctx->spec = &b.spec;
+	tmwheel_timer_init(&b.ctx->timer, pxy_conn_timeout_cb, b.ctx);
+
+	b.req = 1;
+	bench_run("HTTPReqHdrFilter", 1, pxyconn_bench_http_hdr_filter, &b);
+	b.req = 0;
+	bench_run("HTTPRespHdrFilter", 1, pxyconn_bench_http_hdr_filter, &b);
+
+	pxyconn_bench_http_hdr_worst(&b, "X-Padding: 0123456789abcdef\r\n");
+	b.chainsz = b.hdrsz;
+	bench_run_worst("HTTPReqHdrFilterLinesWorst",
+	                pxyconn_bench_http_hdr_filter_worst, &b);
+	b.chainsz = 64;
+	bench_run_worst("HTTPReqHdrFilterChainsWorst",
+	                pxyconn_bench_http_hdr_filter_worst, &b);
+	free(b.hdr);
+	pxyconn_bench_http_hdr_worst(&b, "Accept-Encoding: gzip\r\n");
+	b.chainsz = b.hdrsz;
+	bench_run_worst("HTTPReqHdrFilterRemovedWorst",
+	                pxyconn_bench_http_hdr_filter_worst, &b);
+	free(b.hdr);
+
+	b.ctx->opts->http_keepalive = 1;
+	pxy_http_hdrs_setup(&b.spec, b.ctx->opts);
+	b.req = 1;
+	bench_run("HTTPReqHdrFilterKeepalive", 1,
+	          pxyconn_bench_http_hdr_filter, &b);
+	b.req = 0;
+	bench_run("HTTPRespHdrFilterKeepalive", 1,
+	          pxyconn_bench_http_hdr_filter, &b);
+
+	evbuffer_free(b.outbuf);
+	evbuffer_free(b.inbuf);
+	tmwheel_free(b.ctx->wheel);
+	event_base_free(b.evbase);
+	arena_free(&b.ctx->http_reqarena);
+	arena_free(&b.ctx->http_resparena);
+	opts_free(b.ctx->opts);
+	free(b.ctx);
+
+	pxyconn_bench_hs();
+}
+
+/* vim: set noet ft=c: */
@@ -30,20 +30,36 @@
 
 #include "cachemgr.h"
 #include "ssl.h"
+#include "sslticket.h"
 #include "opts.h"
 #include "sys.h"
 #include "util.h"
 #include "base64.h"
 #include "url.h"
+#include "httphdr.h"
 #include "log.h"
 #include "attrib.h"
 #include "proc.h"
+#include "arena.h"
+#include "mempool.h"
+#include "stats.h"
+#include "usdt.h"
+#include "inspect.h"
 
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/errqueue.h>
+#endif /* __linux__ */
 
 #include <event2/event.h>
 #include <event2/listener.h>
@@ -74,10 +90,57 @@ bufferevent_openssl_set_allow_dirty_shutdown(UNUSED struct bufferevent *bev,
 
 
 /*
- * Maximum size of data to buffer per connection direction before
- * temporarily stopping to read data from the other end.
+ * Size of data to buffer per connection direction before temporarily
+ * stopping to read data from the other end.  Each direction starts out with
+ * OUTBUF_LIMIT and adapts its limit within OUTBUF_LIMIT_MIN and
+ * OUTBUF_LIMIT_MAX to the rate at which its output buffer drains, such that
+ * about OUTBUF_DRAIN_USEC worth of data is buffered.
  */
-#define OUTBUF_LIMIT	(128*1024)
+#define OUTBUF_LIMIT		(128*1024)
+#define OUTBUF_LIMIT_MIN	(16*1024)
+#define OUTBUF_LIMIT_MAX	(16*1024*1024)
+#define OUTBUF_DRAIN_USEC	100000
+
+/*
+ * Interval in microseconds at which connections throttled because a content
+ * logger exceeds its memory budget check whether they can resume reading.
+ */
+#define LOG_THROTTLE_DELAY	10000
+
+/*
+ * On Linux, connections which are neither split nor logged are forwarded
+ * from socket to socket using splice(2) through a pipe per direction, such
+ * that the data does not have to be copied through userspace evbuffers.
+ * SPLICE_CHUNK is the maximum number of octets moved per call and
+ * SPLICE_ROUNDS the number of calls per event before yielding to other
+ * connections on the same thread.
+ */
+#ifdef __linux__
+#define HAVE_SPLICE
+#define SPLICE_CHUNK	(64*1024)
+#define SPLICE_ROUNDS	16
+#endif /* __linux__ */
+
+/*
+ * On Linux, ZeroCopyForward sends the octets forwarded to plain TCP sockets
+ * using MSG_ZEROCOPY once at least ZEROCOPY_MIN octets are pending, such that
+ * the kernel transmits them from the evbuffer chains instead of copying them.
+ * The chains sent stay pinned until the kernel reports the send complete on
+ * the error queue of the socket; up to ZEROCOPY_MAXSENDS sends of at most
+ * ZEROCOPY_IOV chains each are in flight per socket.  While the socket cannot
+ * be waited on for completions, they are polled for every ZEROCOPY_POLL_USEC.
+ * A socket closed with sends in flight is shut down for writing and kept open
+ * for up to ZEROCOPY_LINGER_SEC until they complete.
+ */
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && \
+    defined(SO_EE_ORIGIN_ZEROCOPY)
+#define HAVE_ZEROCOPY
+#define ZEROCOPY_MIN		(16*1024)
+#define ZEROCOPY_MAXSENDS	64
+#define ZEROCOPY_IOV		64
+#define ZEROCOPY_POLL_USEC	1000
+#define ZEROCOPY_LINGER_SEC	30
+#endif /* __linux__ && SO_ZEROCOPY && MSG_ZEROCOPY && SO_EE_ORIGIN_ZEROCOPY */
 
 /*
  * Print helper for logging code.
@@ -100,12 +163,82 @@ static unsigned long ssl_session_context = 0x31415926;
  */
 
 /* single dst or src socket bufferevent descriptor */
+#ifdef HAVE_ZEROCOPY
+/* MSG_ZEROCOPY sends of a plain TCP socket; outlives its connection while
+ * lingering for the completion of sends in flight after close */
+typedef struct pxy_zc {
+	struct event_base *evbase;
+	struct pxy_conn_desc *desc;     /* NULL once lingering */
+	evutil_socket_t fd;
+	struct evbuffer *pinned;  /* octets of sends not completed yet */
+	struct event *ev;         /* completions on fd, or poll timer */
+	uint32_t head;                  /* id of the oldest send in flight */
+	uint32_t next;                        /* id of the next send */
+	size_t len[ZEROCOPY_MAXSENDS];        /* octets pinned per send */
+	unsigned char done[ZEROCOPY_MAXSENDS];  /* completed out of order */
+	unsigned int polls;                 /* polls left while lingering */
+	unsigned int copied : 1;  /* 1 once the kernel copied a send anyway */
+	unsigned int polling : 1;         /* 1 while ev is the poll timer */
+} pxy_zc_t;
+#endif /* HAVE_ZEROCOPY */
+
 typedef struct pxy_conn_desc {
 	struct bufferevent *bev;
 	SSL *ssl;
 	unsigned int closed : 1;
+	unsigned int log_throttled : 1;  /* 1 if reading paused for logger */
+	unsigned int zc_off : 1;     /* 1 if MSG_ZEROCOPY is not available */
+	unsigned int hsdone : 1;    /* 1 once the SSL handshake completed */
+	unsigned int reneg;                 /* SSL renegotiations started */
+	size_t outbuf_limit;              /* current output buffer limit */
+	size_t outbuf_paused;   /* outbuf length when other end was paused */
+	struct timeval paused_tv;     /* time when other end was paused */
+#ifdef HAVE_ZEROCOPY
+	pxy_zc_t *zc;                  /* set once sent using MSG_ZEROCOPY */
+#endif /* HAVE_ZEROCOPY */
 } pxy_conn_desc_t;
 
+/* connection setup steps run from the event loop by pxy_conn_step() */
+#define PXY_STEP_RESOLVE        1  /* resolve SNI to the dst address */
+#define PXY_STEP_CONNECT        2  /* NAT lookup and dst connect */
+#define PXY_STEP_DSTSSL         3  /* create dst SSL and bufferevent */
+#define PXY_STEP_ABORT          4  /* close over a renegotiation limit */
+#define PXY_STEP_HANDOFF        5  /* move to the forwarding pool */
+
+/* HTTP message body framing state, used for keep-alive */
+#define PXY_HTTP_BODY_HDR       0  /* header not complete yet */
+#define PXY_HTTP_BODY_LENGTH    1  /* left octets of Content-Length body */
+#define PXY_HTTP_BODY_CHUNKSIZE 2  /* waiting for chunk-size line */
+#define PXY_HTTP_BODY_CHUNKDATA 3  /* left octets of chunk data and CRLF */
+#define PXY_HTTP_BODY_TRAILER   4  /* waiting for trailer lines */
+#define PXY_HTTP_BODY_EOF       5  /* body delimited by connection close */
+#define PXY_HTTP_BODY_DONE      6  /* message complete */
+typedef struct pxy_http_body {
+	unsigned long long left;
+	unsigned int state : 3;
+	unsigned int chunked : 1;   /* 1 if Transfer-Encoding: chunked */
+	unsigned int length : 1;     /* 1 if Content-Length: was seen */
+	unsigned int te : 1;         /* 1 if Transfer-Encoding: was seen */
+	unsigned int invalid : 1;    /* 1 if Content-Length: is unusable */
+} pxy_http_body_t;
+
+/* HTTP response cache state of the current request and its response */
+typedef struct pxy_http_cache {
+	struct evbuffer *buf;        /* response octets captured so far */
+	size_t hdrsz;                /* octets of the header in buf */
+	unsigned long long maxage;   /* freshness lifetime of the response */
+	unsigned long long age;      /* Age of the response */
+	char *etag;                  /* ETag, from http_resparena */
+	char *inm;                   /* If-None-Match, from http_reqarena */
+	unsigned int capture : 1;  /* 1 if the response is to be stored */
+	unsigned int noreuse : 1;  /* 1 if request must not be served */
+	unsigned int nostore : 1;  /* 1 if request must not be stored */
+	unsigned int auth : 1;       /* 1 if request has Authorization */
+	unsigned int uncacheable : 1;  /* 1 if response must not be stored */
+	unsigned int fresh : 1;      /* 1 if maxage is set */
+	unsigned int smaxage : 1;    /* 1 if maxage is from s-maxage */
+} pxy_http_cache_t;
+
 #ifdef HAVE_LOCAL_PROCINFO
 /* local process data - filled in iff pid != -1 */
 typedef struct pxy_conn_lproc_desc {
@@ -113,6 +246,11 @@ typedef struct pxy_conn_lproc_desc {
 	uid_t uid;
 	gid_t gid;
 
+	/* pending asynchronous lookup */
+	proc_lookup_t *job;
+	unsigned int done : 1;   /* 1 once the async lookup has finished */
+	unsigned int waiting : 1; /* 1 while dst connect waits for lookup */
+
 	/* derived log strings */
 	char *exec_path;
 	char *user;
@@ -120,6 +258,44 @@ typedef struct pxy_conn_lproc_desc {
 } pxy_conn_lproc_desc_t;
 #endif /* HAVE_LOCAL_PROCINFO */
 
+#ifdef HAVE_SPLICE
+/* one direction of a connection forwarded using splice(2) */
+typedef struct pxy_splice_dir {
+	struct pxy_conn_ctx *ctx;
+	evutil_socket_t from;
+	evutil_socket_t to;
+	int pipefd[2];
+	size_t inpipe;            /* octets in pipe not yet written to dest */
+	struct event *rdev;
+	struct event *wrev;
+	unsigned int eof : 1;        /* 1 once EOF was read from the source */
+	unsigned int is_requestor : 1;      /* 1 for direction from src */
+} pxy_splice_dir_t;
+#endif /* HAVE_SPLICE */
+
+#ifdef HAVE_IOURING
+/* one direction of a connection forwarded using io_uring */
+typedef struct pxy_uring_dir {
+	iouring_op_t op;
+	struct pxy_uring_conn *uc;
+	evutil_socket_t from;
+	evutil_socket_t to;
+	int buf;                  /* pool buffer index, -1 if none */
+	size_t len;               /* octets received into buf */
+	size_t off;               /* octets of those already sent */
+	unsigned int busy : 1;        /* 1 while an operation is in flight */
+	unsigned int is_requestor : 1;      /* 1 for direction from src */
+} pxy_uring_dir_t;
+
+/* a connection forwarded using io_uring; outlives its connection context
+ * until no more operations are in flight on its sockets and buffers */
+typedef struct pxy_uring_conn {
+	struct pxy_conn_ctx *ctx;       /* NULL once detached */
+	iouring_t *ring;
+	pxy_uring_dir_t dir[2];
+} pxy_uring_conn_t;
+#endif /* HAVE_IOURING */
+
 /* actual proxy connection state consisting of two connection descriptors,
  * connection-wide state and the specs and options */
 typedef struct pxy_conn_ctx {
@@ -129,40 +305,122 @@ typedef struct pxy_conn_ctx {
 
 	/* status flags */
 	unsigned int connected : 1;       /* 0 until both ends are connected */
+	unsigned int setup_done : 1;      /* 0 while pending in thrmgr */
 	unsigned int enomem : 1;                       /* 1 if out of memory */
+	unsigned int dormant : 1;   /* 1 once compacted while idle, until rx */
+	unsigned int established : 1;  /* 1 once both ends are set up */
+	unsigned int fastpath : 1;  /* 1 once specialised readcbs are set */
 	/* ssl */
-	unsigned int sni_peek_retries : 6;       /* max 64 SNI parse retries */
 	unsigned int immutable_cert : 1;  /* 1 if the cert cannot be changed */
 	unsigned int generated_cert : 1;     /* 1 if we generated a new cert */
 	unsigned int passthrough : 1;      /* 1 if SSL passthrough is active */
+	unsigned int forging : 1;    /* 1 while forging cert asynchronously */
+	unsigned int forged_async : 1;  /* 1 once async forging has finished */
+	unsigned int ecdsa : 1;        /* 1 if serving ECDSA forged certs */
+	unsigned int accepting : 1;  /* 1 while driving src handshake async */
+	unsigned int early : 1;         /* 1 while reading src early data */
+	unsigned int speculative : 1;  /* 1 if src handshake started early */
+	unsigned int spec_connected : 1;  /* 1 if it completed before dst */
+	/* tcp read-ahead */
+	unsigned int readahead : 1;  /* 1 if src is read before dst connects */
+	unsigned int readahead_eof : 1;    /* 1 if src EOF came before that */
 	/* http */
 	unsigned int seen_req_header : 1; /* 0 until request header complete */
 	unsigned int seen_resp_header : 1;  /* 0 until response hdr complete */
 	unsigned int sent_http_conn_close : 1;   /* 0 until Conn: close sent */
 	unsigned int ocsp_denied : 1;                /* 1 if OCSP was denied */
+	unsigned int http_raw : 1;   /* 1 if keep-alive tracking was given up */
+	unsigned int http_ws_upgrade : 1;  /* 1 if request asks for WebSocket */
+	unsigned int http_ws_conn : 1;  /* 1 if Connection: upgrade withheld */
+	unsigned int http_ws : 1;          /* 1 once switched to WebSocket */
+	unsigned int http_idle : 1;      /* 1 while no request is in flight */
+	unsigned int http_close : 1;  /* 1 if dst is not persistent anymore */
 	/* autossl */
 	unsigned int clienthello_search : 1;       /* 1 if waiting for hello */
 	unsigned int clienthello_found : 1;      /* 1 if conn upgrade to SSL */
+	/* splice */
+	unsigned int splice_pending : 1;   /* 1 if waiting for bufs to drain */
+	/* tcp fast open */
+	unsigned int fastopen : 1;     /* 1 while ev waits for TFO connect */
+	/* stats */
+	unsigned int dst_tcp : 1;     /* 1 once upstream TCP connect is done */
+	unsigned int ttfb : 1;   /* 1 while waiting for first server octet */
+	unsigned int fkcrt_hit : 1;   /* 1 if forged cert was found in cache */
+	/* content log rules */
+	unsigned int log_off : 1;        /* 1 if content logging is disabled */
+	unsigned int log_pending : 1;  /* 1 while rule waits for HTTP Host */
+	unsigned int log_hdronly : 1;     /* 1 if only HTTP headers are logged */
+	unsigned int log_trunc : 2;   /* (1 << req) once octets were dropped */
+	unsigned int log_trunc_done : 2; /* (1 << req) once marker submitted */
+	unsigned int log_matched : 1;  /* 1 once a trigger pattern matched */
+	unsigned int log_match_hit : 1;  /* 1 until that triggered recorder */
+	/* inspection plugins */
+	unsigned int inspect_drop : 1;  /* 1 once a plugin dropped the conn */
+	unsigned int eof_flush : 1;  /* 1 while EOF handler passes data on */
+	/* connect log rollup */
+	unsigned int log_sampled : 1;  /* 1 if logged as individual lines */
+	unsigned int sslerr : 1;        /* 1 if closed on an SSL/TLS error */
+	unsigned int timedout : 1;           /* 1 if closed after a timeout */
+	/* renegotiation limits */
+	unsigned int reneg_limited : 1;  /* 1 once over a renegotiation limit */
+	unsigned int reneg_close : 1;      /* 1 once scheduled for closing */
+	unsigned int connect_logged : 1; /* 1 once connect log line written */
+	/* snihash thread selection */
+	unsigned int chpeeked : 1;  /* 1 until chbuf read by listener parsed */
+	/* staged worker pools */
+	unsigned int handoff : 1;  /* 1 until moved to the forwarding pool */
+	unsigned int handoff_tries : 3;    /* attempts to move the connection */
+
+	/* http keep-alive message boundaries */
+	pxy_http_body_t http_reqbody;
+	pxy_http_body_t http_respbody;
+
+	/* http response cache */
+	pxy_http_cache_t http_cache;
+
+	/* LBFLAG_DECODE bits for logging the current response body */
+	unsigned long http_resp_decode;
 
 	/* server name indicated by client in SNI TLS extension */
 	char *sni;
 
-	/* log strings from socket */
-	char *srchost_str;
-	char *srcport_str;
-	char *dsthost_str;
-	char *dstport_str;
+	/* summary of the ClientHello, zeroed if none was peeked at; the
+	 * offsets into the ClientHello are stale once it was passed on */
+	ssl_chello_t hello;
+
+	/* ALPN protocol name list offered by client, in wire format */
+	unsigned char *alpn;
+	size_t alpnlen;
 
-	/* log strings from HTTP request */
+	/* ClientHello octets read from src fd, not yet passed on */
+	unsigned char *chbuf;
+	size_t chlen;
+	size_t chsz;
+
+	/* autossl: src octets held back as truncated ClientHello candidate,
+	 * and src octets needed before reparsing it */
+	size_t chhold;
+	size_t chneed;
+
+	/* log strings from socket, formatted on first use, empty before */
+	char srchost_buf[INET6_ADDRSTRLEN];
+	char srcport_buf[6];
+	char dsthost_buf[INET6_ADDRSTRLEN];
+	char dstport_buf[6];
+	arena_t arena;
+
+	/* log strings from HTTP request, allocated from http_reqarena */
 	char *http_method;
 	char *http_uri;
 	char *http_host;
 	char *http_content_type;
+	arena_t http_reqarena;
 
-	/* log strings from HTTP response */
+	/* log strings from HTTP response, allocated from http_resparena */
 	char *http_status_code;
 	char *http_status_text;
 	char *http_content_length;
+	arena_t http_resparena;
 
 	/* log strings related to SSL */
 	char *ssl_names;
@@ -176,11 +434,62 @@ typedef struct pxy_conn_ctx {
 
 	/* content log context */
 	log_content_ctx_t logctx;
-
-	/* store fd and fd event while connected is 0 */
+	/* inspection plugin context, set up on the first octets forwarded */
+	inspect_ctx_t *inspect;
+	/* octets left to log from dst (0) and src (1) under the content log
+	 * limit and rule, and request header octets held while log_pending
+	 * is set */
+	size_t log_left[2];
+	logbuf_t *log_held;
+	/* scan state of dst (0) and src (1) for ContentLogTriggerMatch */
+	acmatch_state_t log_match[2];
+
+	/* store fd and fd event while connected is 0 or accepting is 1 */
 	evutil_socket_t fd;
 	struct event *ev;
 
+	/* src early data held back until the src handshake completes */
+	struct evbuffer *earlybuf;
+
+	/* next connection setup step scheduled on ev by pxy_conn_step(),
+	 * with the connected dst socket and the dst session to resume
+	 * handed over to the dst SSL step */
+	int step;
+	evutil_socket_t stepfd;
+	const char *stephow;
+	SSL_SESSION *dstsess;
+
+	/* timer resuming reading while content loggers are over budget */
+	struct event *logthrottleev;
+
+	/* connect, handshake, header or idle timeout on the thread's wheel,
+	 * and wheel time of the last octets received for the idle timeout */
+	tmwheel_t *wheel;
+	tmwheel_timer_t timer;
+	int timeout;
+	unsigned long long activity;
+
+	/* pending SNI lookup and connect racing, cancelled on timeout */
+	struct pxy_dns_waiter *dnswait;
+	struct pxy_race *race;
+
+	/* admission counters the connection is counted in, if any */
+	admit_t *admit;
+	admit_ctr_t *admit_src;
+
+	/* slot of the source address from the proxyspec's source pool dst is
+	 * bound to, or -1 */
+	int srcslot;
+
+#ifdef HAVE_SPLICE
+	/* src to dst and dst to src directions once forwarded using splice */
+	pxy_splice_dir_t *splice;
+#endif /* HAVE_SPLICE */
+#ifdef HAVE_IOURING
+	/* set once forwarded using io_uring */
+	pxy_uring_conn_t *uring;
+#endif /* HAVE_IOURING */
+
 	/* original source and destination address, family and certificate */
 	struct sockaddr_storage srcaddr;
 	socklen_t srcaddrlen;
@@ -189,6 +498,29 @@ typedef struct pxy_conn_ctx {
 	int af;
 	X509 *origcrt;
 
+	/* pending asynchronous forging job and its result */
+	pxy_forge_job_t *forgejob;
+	X509 *forgedcrt;
+
+	/* time of accepting the connection, for the setup latency stats */
+	long long setup_usec;
+	/* end of the previous connection phase, for the phase latency stats */
+	long long phase_usec;
+	/* phase latencies in microseconds or -1, and octets received from
+	 * src and dst, for the connect log */
+	long long phase[STATS_NPHASES];
+	unsigned long long srcbytes;
+	unsigned long long dstbytes;
+	/* srcbytes + dstbytes as of the last RebalanceInterval round */
+	unsigned long long rebal_bytes;
+	/* thread CPU time spent on the connection, with StatsCPUTop */
+	long long cpu_usec;
+	/* TCP_INFO of dst right after the TCP connect, ConnectLogTCPInfo */
+	sys_tcpinfo_t tcpi_connect;
+
+	/* link in the registry of active connections of the thread */
+	pxy_thr_link_t link;
+
 	/* references to event base and configuration */
 	struct event_base *evbase;
 	struct evdns_base *dnsbase;
@@ -200,29 +532,621 @@ typedef struct pxy_conn_ctx {
 
 #define WANT_CONNECT_LOG(ctx)	((ctx)->opts->connectlog||!(ctx)->opts->detach)
 #ifndef WITHOUT_MIRROR
-#define WANT_CONTENT_LOG(ctx)	(((ctx)->opts->contentlog||(ctx)->opts->pcaplog||(ctx)->opts->mirrorif)&&!(ctx)->passthrough)
+#define WANT_CONTENT_LOG(ctx)	(((ctx)->opts->contentlog|| \
+				  (ctx)->opts->pcaplog|| \
+				  (ctx)->opts->mirrorif|| \
+				  (ctx)->opts->contenttap|| \
+				  (ctx)->opts->contentstream)&& \
+				 !(ctx)->passthrough&&!(ctx)->log_off)
 #else /* WITHOUT_MIRROR */
-#define WANT_CONTENT_LOG(ctx)	(((ctx)->opts->contentlog||(ctx)->opts->pcaplog)&&!(ctx)->passthrough)
+#define WANT_CONTENT_LOG(ctx)	(((ctx)->opts->contentlog|| \
+				  (ctx)->opts->pcaplog|| \
+				  (ctx)->opts->contenttap|| \
+				  (ctx)->opts->contentstream)&& \
+				 !(ctx)->passthrough&&!(ctx)->log_off)
 #endif /* WITHOUT_MIRROR */
+#define WANT_INSPECT(ctx)	(inspect_count()&&!(ctx)->passthrough)
+#define WANT_CHACHA_DST(ctx)	((ctx)->hello.chacha&&(ctx)->opts->ciphers_chacha)
+#define WANT_CPU_ACCOUNTING(ctx)	((ctx)->opts->stats_cputop||stats_perf)
+#define WANT_RENEG_LIMITS(ctx)	((ctx)->opts->max_reneg||(ctx)->admit)
+#define WANT_HTTP_CACHE(ctx)	((ctx)->opts->http_cache_size&&!(ctx)->spec->ssl)
+#define WANT_CONTENT_MATCH(ctx)	((ctx)->opts->contentlog_match&& \
+				 (ctx)->opts->contentlog_rec_sz&& \
+				 !(ctx)->log_matched&&WANT_CONTENT_LOG(ctx))
+
+/* TLS 1.3 default cipher suites with ChaCha20-Poly1305 first */
+#define PXY_TLS13_CHACHA_FIRST	"TLS_CHACHA20_POLY1305_SHA256:" \
+				"TLS_AES_256_GCM_SHA384:" \
+				"TLS_AES_128_GCM_SHA256"
+
+#ifdef HAVE_SPLICE
+static void
+pxy_splice_free(pxy_splice_dir_t *sp)
+{
+	int i, j;
+
+	for (i = 0; i < 2; i++) {
+		if (sp[i].rdev)
+			event_free(sp[i].rdev);
+		if (sp[i].wrev)
+			event_free(sp[i].wrev);
+		for (j = 0; j < 2; j++) {
+			if (sp[i].pipefd[j] != -1)
+				close(sp[i].pipefd[j]);
+		}
+	}
+	free(sp);
+}
+#endif /* HAVE_SPLICE */
+
+#ifdef HAVE_IOURING
+/*
+ * Free a detached io_uring connection once no operation is in flight
+ * anymore, closing its sockets.
+ */
+static void
+pxy_uring_finish(pxy_uring_conn_t *uc)
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (uc->dir[i].busy)
+			return;
+	}
+	for (i = 0; i < 2; i++) {
+		if (uc->dir[i].buf != -1)
+			iouring_buf_put(uc->ring, uc->dir[i].buf);
+	}
+	evutil_closesocket(uc->dir[0].from);
+	evutil_closesocket(uc->dir[0].to);
+	free(uc);
+}
+
+/*
+ * Detach an io_uring connection from its connection context and shut its
+ * sockets down, which completes the operations in flight; cancel them in
+ * case they do not notice.  The sockets are closed once all of them have
+ * completed.
+ */
+static void
+pxy_uring_detach(pxy_uring_conn_t *uc)
+{
+	int i;
+
+	uc->ctx = NULL;
+	shutdown(uc->dir[0].from, SHUT_RDWR);
+	shutdown(uc->dir[0].to, SHUT_RDWR);
+	for (i = 0; i < 2; i++) {
+		if (uc->dir[i].busy &&
+		    iouring_cancel(uc->ring, &uc->dir[i].op) == -1) {
+			log_dbg_printf("Error cancelling io_uring operation: "
+			               "%s (%i)\n", strerror(errno), errno);
+		}
+	}
+	pxy_uring_finish(uc);
+}
+#endif /* HAVE_IOURING */
+
+#ifdef HAVE_ZEROCOPY
+static void pxy_zc_cb(evutil_socket_t, short, void *);
+
+/*
+ * Set up MSG_ZEROCOPY sends on the plain TCP socket of desc.
+ * Returns NULL if the socket does not support them or on memory allocation
+ * failure.
+ */
+static pxy_zc_t *
+pxy_zc_new(pxy_conn_ctx_t *ctx, pxy_conn_desc_t *desc)
+{
+	evutil_socket_t fd = bufferevent_getfd(desc->bev);
+	pxy_zc_t *zc;
+	int one = 1;
+
+	if (fd == -1 ||
+	    setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == -1)
+		return NULL;
+	if (!(zc = calloc(1, sizeof(pxy_zc_t))))
+		return NULL;
+	zc->evbase = ctx->evbase;
+	zc->desc = desc;
+	zc->fd = fd;
+	if (!(zc->pinned = evbuffer_new()))
+		goto errout;
+	zc->ev = event_new(ctx->evbase, fd, EV_READ|EV_PERSIST, pxy_zc_cb, zc);
+	if (!zc->ev)
+		goto errout;
+	(void)event_priority_set(zc->ev, PXY_PRIO_ESTAB);
+	if (OPTS_DEBUG(ctx->opts)) {
+		log_dbg_printf("Sending to fd %i using MSG_ZEROCOPY\n", fd);
+	}
+	return zc;
+
+errout:
+	if (zc->pinned)
+		evbuffer_free(zc->pinned);
+	free(zc);
+	return NULL;
+}
+
+/*
+ * Wait for completions to be queued on the socket, or poll for them.
+ * Completions wake up the event loop as readable events, but so does data
+ * to read; while the bufferevent does not read the data, waiting on the
+ * socket would wake up the event loop over and over.
+ */
+static void
+pxy_zc_arm(pxy_zc_t *zc, int poll)
+{
+	struct timeval tv = {0, ZEROCOPY_POLL_USEC};
+
+	if (poll != zc->polling) {
+		event_del(zc->ev);
+		event_assign(zc->ev, zc->evbase, poll ? -1 : zc->fd,
+		             poll ? 0 : EV_READ|EV_PERSIST, pxy_zc_cb, zc);
+		(void)event_priority_set(zc->ev, PXY_PRIO_ESTAB);
+		zc->polling = poll;
+	}
+	if (poll || !event_pending(zc->ev, EV_READ, NULL))
+		event_add(zc->ev, poll ? &tv : NULL);
+}
+
+/*
+ * Process the completions queued on the error queue of the socket and
+ * release the pinned octets of completed sends, oldest first.
+ * Returns the number of completions processed, -1 on error.
+ */
+static int
+pxy_zc_drain(pxy_zc_t *zc)
+{
+	union {
+		char buf[CMSG_SPACE(sizeof(struct sock_extended_err) +
+		                    sizeof(struct sockaddr_in6))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct sock_extended_err *ee;
+	uint32_t id;
+	int n = 0;
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		if (recvmsg(zc->fd, &msg, MSG_ERRQUEUE) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -1;
+		}
+		for (cm = CMSG_FIRSTHDR(&msg); cm;
+		     cm = CMSG_NXTHDR(&msg, cm)) {
+			if (!(cm->cmsg_level == SOL_IP &&
+			      cm->cmsg_type == IP_RECVERR) &&
+			    !(cm->cmsg_level == SOL_IPV6 &&
+			      cm->cmsg_type == IPV6_RECVERR))
+				continue;
+			ee = (struct sock_extended_err *)CMSG_DATA(cm);
+			if (ee->ee_errno != 0 ||
+			    ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			/* sends ee_info to ee_data completed */
+			for (id = ee->ee_info;
+			     id - zc->head < zc->next - zc->head; id++) {
+				zc->done[id % ZEROCOPY_MAXSENDS] = 1;
+				if (id == ee->ee_data)
+					break;
+			}
+			if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				zc->copied = 1;
+			n++;
+		}
+	}
+	while (zc->head != zc->next &&
+	       zc->done[zc->head % ZEROCOPY_MAXSENDS]) {
+		zc->done[zc->head % ZEROCOPY_MAXSENDS] = 0;
+		evbuffer_drain(zc->pinned,
+		               zc->len[zc->head % ZEROCOPY_MAXSENDS]);
+		zc->head++;
+	}
+	return n;
+}
+
+static void
+pxy_zc_release_cb(UNUSED evutil_socket_t fd, UNUSED short what, void *arg)
+{
+	evbuffer_free(arg);
+}
+
+/*
+ * Free zc.  If sends are still in flight, the socket is reset, which makes
+ * the kernel drop them, and the pinned octets are only released a second
+ * later, after the network device has surely stopped transmitting from them.
+ */
+static void
+pxy_zc_free(pxy_zc_t *zc)
+{
+	struct linger lg = {1, 0};
+	struct timeval tv = {1, 0};
+
+	event_free(zc->ev);
+	if (zc->head != zc->next) {
+		if (zc->fd != -1)
+			setsockopt(zc->fd, SOL_SOCKET, SO_LINGER,
+			           &lg, sizeof(lg));
+		if (event_base_once(zc->evbase, -1, EV_TIMEOUT,
+		                    pxy_zc_release_cb, zc->pinned, &tv) == -1)
+			evbuffer_free(zc->pinned);
+	} else {
+		evbuffer_free(zc->pinned);
+	}
+	if (zc->fd != -1 && !zc->desc)
+		evutil_closesocket(zc->fd);
+	free(zc);
+}
+
+static void
+pxy_zc_cb(UNUSED evutil_socket_t fd, UNUSED short what, void *arg)
+{
+	pxy_zc_t *zc = arg;
+	int n;
+
+	n = pxy_zc_drain(zc);
+	if (!zc->desc) {
+		/* lingering after close */
+		if (n == -1 || zc->head == zc->next || --zc->polls == 0) {
+			pxy_zc_free(zc);
+			return;
+		}
+		pxy_zc_arm(zc, 1);
+		return;
+	}
+	if (n == -1 || zc->head == zc->next) {
+		event_del(zc->ev);
+		return;
+	}
+	pxy_zc_arm(zc, (n == 0 || zc->polling) &&
+	               !(bufferevent_get_enabled(zc->desc->bev) & EV_READ));
+}
+
+/*
+ * Detach zc from its socket fd, which is about to be closed, or already
+ * closed if fd is -1.  Returns fd if the socket can be closed right away, or
+ * -1 if zc took it over to wait for the sends in flight to complete, after
+ * shutting it down for writing.
+ */
+static evutil_socket_t
+pxy_zc_close(pxy_zc_t *zc, evutil_socket_t fd)
+{
+	if (fd == -1)
+		zc->fd = -1;
+	else if (zc->head != zc->next)
+		pxy_zc_drain(zc);
+	if (fd == -1 || zc->head == zc->next) {
+		pxy_zc_free(zc);
+		return fd;
+	}
+	zc->desc = NULL;
+	shutdown(fd, SHUT_WR);
+	zc->polls = ZEROCOPY_LINGER_SEC * (1000000 / ZEROCOPY_POLL_USEC);
+	pxy_zc_arm(zc, 1);
+	return -1;
+}
+
+/*
+ * Send the octets at the start of outbuf, the output buffer of the plain TCP
+ * socket of desc, using MSG_ZEROCOPY.  The chains sent are moved from outbuf
+ * to the pinned buffer as a whole, such that nothing is added to them while
+ * the kernel may still read from them; the rest of a partially sent chain is
+ * copied back to outbuf.  Whatever is not sent is left to the bufferevent.
+ */
+static void
+pxy_zc_send(pxy_conn_ctx_t *ctx, pxy_conn_desc_t *desc,
+            struct evbuffer *outbuf)
+{
+	struct evbuffer_iovec vec[ZEROCOPY_IOV];
+	struct iovec iov[ZEROCOPY_IOV];
+	struct msghdr msg;
+	pxy_zc_t *zc = desc->zc;
+	size_t len;
+	ssize_t n;
+	int nvec, i;
+
+	if (!zc) {
+		if (!(zc = desc->zc = pxy_zc_new(ctx, desc))) {
+			desc->zc_off = 1;
+			return;
+		}
+	}
+	if (zc->head != zc->next)
+		pxy_zc_drain(zc);
+	if (zc->copied) {
+		/* the route does not support it, e.g. loopback */
+		if (OPTS_DEBUG(ctx->opts)) {
+			log_dbg_printf("Kernel copied MSG_ZEROCOPY send on fd "
+			               "%i, sending normally\n", zc->fd);
+		}
+		desc->zc_off = 1;
+		return;
+	}
+	if (zc->next - zc->head == ZEROCOPY_MAXSENDS)
+		return;
+
+	nvec = evbuffer_peek(outbuf, -1, NULL, vec, ZEROCOPY_IOV);
+	if (nvec > ZEROCOPY_IOV)
+		nvec = ZEROCOPY_IOV;
+	for (i = 0; i < nvec; i++) {
+		iov[i].iov_base = vec[i].iov_base;
+		iov[i].iov_len = vec[i].iov_len;
+	}
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = nvec;
+	n = sendmsg(zc->fd, &msg, MSG_ZEROCOPY|MSG_DONTWAIT|MSG_NOSIGNAL);
+	if (n <= 0) {
+		/* EAGAIN, or ENOBUFS over the socket's optmem limit;
+		 * errors are left to the bufferevent to report */
+		return;
+	}
+
+	/* the bufferevent keeps the start of outbuf frozen but while
+	 * writing from it, as do we here */
+	for (len = 0, i = 0; len < (size_t)n; i++)
+		len += vec[i].iov_len;
+	evbuffer_unfreeze(outbuf, 1);
+	evbuffer_remove_buffer(outbuf, zc->pinned, len);
+	if (len > (size_t)n) {
+		if (evbuffer_prepend(outbuf, (char *)vec[i - 1].iov_base +
+		                             vec[i - 1].iov_len - (len - n),
+		                     len - n) == -1)
+			ctx->enomem = 1;
+	}
+	evbuffer_freeze(outbuf, 1);
+	zc->len[zc->next % ZEROCOPY_MAXSENDS] = len;
+	zc->next++;
+	if (!event_pending(zc->ev, EV_READ|EV_TIMEOUT, NULL))
+		pxy_zc_arm(zc, !(bufferevent_get_enabled(desc->bev) & EV_READ));
+}
+#endif /* HAVE_ZEROCOPY */
+
+/*
+ * Sum of the output buffer limits of all connection directions, in octets.
+ */
+static size_t pxy_outbuf_total = 0;
+
+/*
+ * Set the output buffer limit of desc and account for it in the total.
+ */
+static void
+pxy_outbuf_setlimit(pxy_conn_desc_t *desc, size_t limit)
+{
+	if (limit > desc->outbuf_limit) {
+		__atomic_add_fetch(&pxy_outbuf_total,
+		                   limit - desc->outbuf_limit,
+		                   __ATOMIC_RELAXED);
+	} else {
+		__atomic_sub_fetch(&pxy_outbuf_total,
+		                   desc->outbuf_limit - limit,
+		                   __ATOMIC_RELAXED);
+	}
+	desc->outbuf_limit = limit;
+}
+
+/*
+ * CPU time accounting with StatsCPUTop.  The thread CPU time is read on entry
+ * and exit of the libevent callbacks and in the OpenSSL info callbacks, and
+ * the time elapsed since the previous reading on the same thread is charged
+ * to the connection being handled.  Reading on entry attributes the work
+ * libevent and OpenSSL did for a connection before invoking the callback,
+ * such as decrypting records, to that connection; the info callbacks break
+ * up handshakes making progress without any callback to us.  Since a
+ * connection context can be freed from within a callback, the connection
+ * being charged is tracked per thread and cleared when it is freed.
+ *
+ * With StatsPerfCounters, the performance counters are read at the same
+ * points and charged to the phase of the connection being handled instead:
+ * handshake until the connection is set up, forwarding after, and content
+ * logging while submitting data to the content log.
+ */
+typedef struct pxy_cpu {
+	pxy_conn_ctx_t *cur;    /* connection charged until callback exit */
+	long long mark;         /* thread CPU time of the last reading */
+	unsigned long long perf[PERFCTR_N]; /* counters at the last reading */
+	int logging;            /* charging content logging */
+} pxy_cpu_t;
+
+static pthread_key_t pxy_cpu_key;
+static pthread_once_t pxy_cpu_once = PTHREAD_ONCE_INIT;
+static int pxy_cpu_have_key = 0;
+
+static void
+pxy_cpu_key_create(void)
+{
+	if (pthread_key_create(&pxy_cpu_key, free) == 0)
+		pxy_cpu_have_key = 1;
+}
+
+static pxy_cpu_t *
+pxy_cpu_get(void)
+{
+	pxy_cpu_t *cpu;
+
+	pthread_once(&pxy_cpu_once, pxy_cpu_key_create);
+	if (!pxy_cpu_have_key)
+		return NULL;
+	if ((cpu = pthread_getspecific(pxy_cpu_key)))
+		return cpu;
+	if (!(cpu = calloc(1, sizeof(pxy_cpu_t))))
+		return NULL;
+	if (pthread_setspecific(pxy_cpu_key, cpu) != 0) {
+		free(cpu);
+		return NULL;
+	}
+	return cpu;
+}
+
+static void
+pxy_cpu_charge(pxy_cpu_t *cpu, pxy_conn_ctx_t *ctx)
+{
+	long long now;
+
+	if (ctx->opts->stats_cputop) {
+		now = stats_cpu_usec();
+		if (cpu->mark)
+			ctx->cpu_usec += now - cpu->mark;
+		cpu->mark = now;
+	}
+	if (stats_perf) {
+		stats_perf_charge(cpu->perf,
+		                  cpu->logging ? STATS_PERF_LOG :
+		                  ctx->setup_done ? STATS_PERF_FORWARD :
+		                                    STATS_PERF_HANDSHAKE);
+	}
+}
+
+/*
+ * Start charging CPU time to ctx.  Returns the state to pass to
+ * pxy_cpu_leave(), or NULL if CPU time is not accounted for or if called
+ * from within another callback, which keeps charging its connection.
+ */
+static pxy_cpu_t *
+pxy_cpu_enter(pxy_conn_ctx_t *ctx)
+{
+	pxy_cpu_t *cpu;
+
+	if (!WANT_CPU_ACCOUNTING(ctx) || !(cpu = pxy_cpu_get()))
+		return NULL;
+	if (cpu->cur) {
+		pxy_cpu_charge(cpu, cpu->cur);
+		return NULL;
+	}
+	pxy_cpu_charge(cpu, ctx);
+	cpu->cur = ctx;
+	return cpu;
+}
+
+static void
+pxy_cpu_leave(pxy_cpu_t *cpu)
+{
+	if (cpu && cpu->cur) {
+		pxy_cpu_charge(cpu, cpu->cur);
+		cpu->cur = NULL;
+		cpu->logging = 0;
+	}
+}
+
+/*
+ * Charge the performance counters of ctx to content logging from now on if
+ * logging is 1, or back to the phase of ctx if logging is 0.  Only effective
+ * within a callback charging ctx.
+ */
+static void
+pxy_cpu_logging(pxy_conn_ctx_t *ctx, int logging)
+{
+	pxy_cpu_t *cpu;
+
+	if (!stats_perf || !(cpu = pxy_cpu_get()) || cpu->cur != ctx)
+		return;
+	pxy_cpu_charge(cpu, ctx);
+	cpu->logging = logging;
+}
+
+/*
+ * Format the original destination of a connection as [host]:port into dst,
+ * or as dash if not known, for accounting stats to it.
+ */
+static void
+pxy_conn_dststr(pxy_conn_ctx_t *ctx, char *dst, size_t sz)
+{
+	char host[INET6_ADDRSTRLEN], serv[6];
+
+	if (!ctx->dstaddrlen ||
+	    sys_sockaddr_ntop((struct sockaddr *)&ctx->dstaddr,
+	                      ctx->dstaddrlen, host, sizeof(host),
+	                      serv, sizeof(serv)) == -1)
+		snprintf(dst, sz, "-");
+	else
+		snprintf(dst, sz, "[%s]:%s", host, serv);
+}
+
+/*
+ * Charge the remaining CPU time to a connection being freed and, with
+ * StatsCPUTop, account it to its destination.
+ */
+static void
+pxy_cpu_done(pxy_conn_ctx_t *ctx)
+{
+	char dst[INET6_ADDRSTRLEN + 9];
+	pxy_cpu_t *cpu;
+
+	if ((cpu = pxy_cpu_get()) && cpu->cur == ctx) {
+		pxy_cpu_charge(cpu, ctx);
+		cpu->cur = NULL;
+		cpu->logging = 0;
+	}
+	if (!ctx->opts->stats_cputop)
+		return;
+	pxy_conn_dststr(ctx, dst, sizeof(dst));
+	stats_cpu(ctx->sni, dst, ctx->cpu_usec);
+}
+
+static void pxy_conn_timeout_cb(tmwheel_timer_t *) NONNULL(1);
+static void pxy_conn_idle_arm(pxy_conn_ctx_t *, unsigned long long)
+            NONNULL(1);
 
 static pxy_conn_ctx_t *
 pxy_conn_ctx_new(proxyspec_t *spec, opts_t *opts,
-                 pxy_thrmgr_ctx_t *thrmgr, evutil_socket_t fd)
-                 MALLOC NONNULL(1,2,3);
+                 pxy_thrmgr_ctx_t *thrmgr, int thridx, evutil_socket_t fd,
+                 const struct sockaddr *peeraddr)
+                 MALLOC NONNULL(1,2,3,6);
 static pxy_conn_ctx_t *
 pxy_conn_ctx_new(proxyspec_t *spec, opts_t *opts,
-                 pxy_thrmgr_ctx_t *thrmgr, evutil_socket_t fd)
+                 pxy_thrmgr_ctx_t *thrmgr, int thridx, evutil_socket_t fd,
+                 const struct sockaddr *peeraddr)
 {
-	pxy_conn_ctx_t *ctx = malloc(sizeof(pxy_conn_ctx_t));
-	if (!ctx)
+	pxy_conn_ctx_t *ctx;
+	struct event_base *evbase;
+	struct evdns_base *dnsbase;
+
+	/* attach first in order to reuse a context freed on that thread */
+	if (thridx >= 0) {
+		thridx = pxy_thrmgr_attach_thr(thrmgr, thridx,
+		                               &evbase, &dnsbase);
+	} else {
+		thridx = pxy_thrmgr_attach(thrmgr, spec->wpool, peeraddr,
+		                           &evbase, &dnsbase);
+	}
+	ctx = pxy_thrmgr_pool_get(thrmgr, thridx);
+	if (!ctx && (ctx = mempool_huge_malloc(sizeof(pxy_conn_ctx_t))))
+		stats_add(STATS_CONN_MEM, sizeof(pxy_conn_ctx_t));
+	if (!ctx) {
+		pxy_thrmgr_setup_done(thrmgr, thridx);
+		pxy_thrmgr_detach(thrmgr, thridx);
 		return NULL;
+	}
 	memset(ctx, 0, sizeof(pxy_conn_ctx_t));
 	ctx->spec = spec;
-	ctx->opts = opts;
+	ctx->opts = opts_ref(opts);
 	ctx->clienthello_search = spec->upgrade;
+	ctx->http_idle = 1;
+	ctx->handoff = spec->fwpool != -1 && spec->fwpool != spec->wpool;
 	ctx->fd = fd;
-	ctx->thridx = pxy_thrmgr_attach(thrmgr, &ctx->evbase, &ctx->dnsbase);
+	ctx->stepfd = -1;
+	ctx->srcslot = -1;
+	ctx->thridx = thridx;
+	ctx->evbase = evbase;
+	ctx->dnsbase = dnsbase;
 	ctx->thrmgr = thrmgr;
+	ctx->wheel = pxy_thrmgr_get_wheel(thrmgr, thridx);
+	tmwheel_timer_init(&ctx->timer, pxy_conn_timeout_cb, ctx);
+	pxy_outbuf_setlimit(&ctx->src, OUTBUF_LIMIT);
+	pxy_outbuf_setlimit(&ctx->dst, OUTBUF_LIMIT);
+	ctx->log_left[0] = ctx->log_left[1] = opts->contentlog_limit ?
+	                                      opts->contentlog_limit : SIZE_MAX;
+	ctx->log_sampled = !opts->connectlog_rollup ||
+	                   (opts->connectlog_sample &&
+	                    sys_rand32() % opts->connectlog_sample == 0);
 #ifdef HAVE_LOCAL_PROCINFO
 	ctx->lproc.pid = -1;
 #endif /* HAVE_LOCAL_PROCINFO */
@@ -232,9 +1156,24 @@ pxy_conn_ctx_new(proxyspec_t *spec, opts_t *opts,
 		               (void*)ctx);
 	}
 #endif /* DEBUG_PROXY */
+	ctx->setup_usec = ctx->phase_usec = stats_usec();
+	for (int i = 0; i < STATS_NPHASES; i++)
+		ctx->phase[i] = -1;
+	ctx->tcpi_connect.rtt = ctx->tcpi_connect.rttvar = -1;
+	ctx->tcpi_connect.retrans = ctx->tcpi_connect.cwnd = -1;
+	ctx->tcpi_connect.rate = -1;
+	stats_inc(STATS_CONN_ACCEPTED);
+	stats_inc(STATS_CONN_ACTIVE);
+	pxy_thrmgr_conn_register(thrmgr, thridx, &ctx->link, ctx);
+	USDT_PROBE3(conn__accept, ctx, fd, thridx);
 	return ctx;
 }
 
+static void pxy_log_content_resolve(pxy_conn_ctx_t *) NONNULL(1);
+static void pxy_log_connect_rollup(pxy_conn_ctx_t *) NONNULL(1);
+static void pxy_forward(pxy_conn_ctx_t *, struct evbuffer *,
+                        struct evbuffer *, size_t, int) NONNULL(1,2,3);
+
 static void NONNULL(1)
 pxy_conn_ctx_free(pxy_conn_ctx_t *ctx, int by_requestor)
 {
@@ -244,45 +1183,42 @@ pxy_conn_ctx_free(pxy_conn_ctx_t *ctx, int by_requestor)
 		                (void*)ctx);
 	}
 #endif /* DEBUG_PROXY */
+	USDT_PROBE1(conn__close, ctx);
+	pxy_thrmgr_conn_unregister(ctx->thrmgr, ctx->thridx, &ctx->link);
+	tmwheel_del(ctx->wheel, &ctx->timer);
+	if (WANT_CPU_ACCOUNTING(ctx))
+		pxy_cpu_done(ctx);
+	if (ctx->log_pending)
+		pxy_log_content_resolve(ctx);
+	if (ctx->opts->connectlog_rollup)
+		pxy_log_connect_rollup(ctx);
 	if (WANT_CONTENT_LOG(ctx)) {
 		if (log_content_close(&ctx->logctx, by_requestor) == -1) {
-			log_err_printf("Warning: Content log close failed\n");
+			log_err_rl_printf("Warning: Content log close "
+			                  "failed\n");
 		}
 	}
+	if (ctx->spec->natforget && ctx->srcaddrlen > 0)
+		ctx->spec->natforget((struct sockaddr *)&ctx->srcaddr,
+		                     ctx->srcaddrlen);
+	if (!ctx->setup_done)
+		pxy_thrmgr_setup_done(ctx->thrmgr, ctx->thridx);
 	pxy_thrmgr_detach(ctx->thrmgr, ctx->thridx);
-	if (ctx->srchost_str) {
-		free(ctx->srchost_str);
-	}
-	if (ctx->srcport_str) {
-		free(ctx->srcport_str);
-	}
-	if (ctx->dsthost_str) {
-		free(ctx->dsthost_str);
-	}
-	if (ctx->dstport_str) {
-		free(ctx->dstport_str);
-	}
-	if (ctx->http_method) {
-		free(ctx->http_method);
-	}
-	if (ctx->http_uri) {
-		free(ctx->http_uri);
-	}
-	if (ctx->http_host) {
-		free(ctx->http_host);
-	}
-	if (ctx->http_content_type) {
-		free(ctx->http_content_type);
-	}
-	if (ctx->http_status_code) {
-		free(ctx->http_status_code);
-	}
-	if (ctx->http_status_text) {
-		free(ctx->http_status_text);
-	}
-	if (ctx->http_content_length) {
-		free(ctx->http_content_length);
-	}
+	if (ctx->admit) {
+		admit_leave(admit_global(ctx->admit));
+		admit_leave(&ctx->spec->admit_ctr);
+		admit_leave(ctx->admit_src);
+	}
+	if (ctx->srcslot != -1)
+		srcpool_release(ctx->spec->srcpool, ctx->srcslot);
+	stats_dec(STATS_CONN_ACTIVE);
+	pxy_outbuf_setlimit(&ctx->src, 0);
+	pxy_outbuf_setlimit(&ctx->dst, 0);
+	arena_free(&ctx->arena);
+	arena_free(&ctx->http_reqarena);
+	arena_free(&ctx->http_resparena);
+	if (ctx->http_cache.buf)
+		evbuffer_free(ctx->http_cache.buf);
 	if (ctx->ssl_names) {
 		free(ctx->ssl_names);
 	}
@@ -302,46 +1238,298 @@ pxy_conn_ctx_free(pxy_conn_ctx_t *ctx, int by_requestor)
 	if (ctx->lproc.group) {
 		free(ctx->lproc.group);
 	}
+	if (ctx->lproc.job) {
+		proc_lookup_cancel(ctx->lproc.job);
+	}
 #endif /* HAVE_LOCAL_PROCINFO */
 	if (ctx->origcrt) {
 		X509_free(ctx->origcrt);
 	}
+	if (ctx->forgejob) {
+		pxy_forge_cancel(ctx->forgejob);
+	}
+	if (ctx->forgedcrt) {
+		X509_free(ctx->forgedcrt);
+	}
 	if (ctx->ev) {
 		event_free(ctx->ev);
 	}
+	if (ctx->earlybuf) {
+		evbuffer_free(ctx->earlybuf);
+	}
+	if (ctx->dstsess) {
+		SSL_SESSION_free(ctx->dstsess);
+	}
+	if (ctx->logthrottleev) {
+		event_free(ctx->logthrottleev);
+	}
+#ifdef HAVE_SPLICE
+	if (ctx->splice) {
+		pxy_splice_free(ctx->splice);
+	}
+#endif /* HAVE_SPLICE */
+#ifdef HAVE_ZEROCOPY
+	if (ctx->src.zc) {
+		(void)pxy_zc_close(ctx->src.zc, -1);
+	}
+	if (ctx->dst.zc) {
+		(void)pxy_zc_close(ctx->dst.zc, -1);
+	}
+#endif /* HAVE_ZEROCOPY */
+#ifdef HAVE_IOURING
+	if (ctx->uring) {
+		pxy_uring_detach(ctx->uring);
+	}
+#endif /* HAVE_IOURING */
 	if (ctx->sni) {
 		free(ctx->sni);
 	}
-	free(ctx);
+	if (ctx->alpn) {
+		free(ctx->alpn);
+	}
+	if (ctx->chbuf) {
+		free(ctx->chbuf);
+	}
+	if (ctx->inspect) {
+		inspect_conn_free(ctx->inspect);
+	}
+	opts_unref(ctx->opts);
+	if (pxy_thrmgr_pool_put(ctx->thrmgr, ctx->thridx, ctx) == -1) {
+		mempool_huge_free(ctx);
+		stats_add(STATS_CONN_MEM, -(long long)sizeof(pxy_conn_ctx_t));
+	}
 }
 
-
-/* forward declaration of libevent callbacks */
-static void pxy_bev_readcb(struct bufferevent *, void *);
-static void pxy_bev_writecb(struct bufferevent *, void *);
-static void pxy_bev_eventcb(struct bufferevent *, short, void *);
-static void pxy_fd_readcb(evutil_socket_t, short, void *);
-
-/* forward declaration of OpenSSL callbacks */
-#ifndef OPENSSL_NO_TLSEXT
-static int pxy_ossl_servername_cb(SSL *ssl, int *al, void *arg);
-#endif /* !OPENSSL_NO_TLSEXT */
-static int pxy_ossl_sessnew_cb(SSL *, SSL_SESSION *);
-static void pxy_ossl_sessremove_cb(SSL_CTX *, SSL_SESSION *);
-#if (OPENSSL_VERSION_NUMBER < 0x10100000L) || (defined(LIBRESSL_VERSION_NUMBER) && LIBRESSL_VERSION_NUMBER < 0x20800000L)
-static SSL_SESSION * pxy_ossl_sessget_cb(SSL *, unsigned char *, int, int *);
-#else /* OPENSSL_VERSION_NUMBER >= 0x10100000L */
-static SSL_SESSION * pxy_ossl_sessget_cb(SSL *, const unsigned char *, int,
-                                         int *);
-#endif /* OPENSSL_VERSION_NUMBER >= 0x10100000L */
-
 /*
- * Dump information on a certificate to the debug log.
+ * Connection phase phase has ended; record its latency.  Phases are strictly
+ * sequential, each starts where the previous one ended.
  */
 static void
-pxy_debug_crt(X509 *crt)
+pxy_conn_phase(pxy_conn_ctx_t *ctx, int phase)
 {
-	char *sj = ssl_x509_subject(crt);
+	long long now = stats_usec();
+
+	ctx->phase[phase] = now - ctx->phase_usec;
+	stats_phase(ctx->spec->idx, phase, ctx->phase[phase]);
+	ctx->phase_usec = now;
+}
+
+/*
+ * Sample TCP_INFO of the socket of connection end desc into ti.  All values
+ * are -1 if the socket is gone already or TCP_INFO is not available.
+ */
+static void
+pxy_conn_tcpinfo(pxy_conn_desc_t *desc, sys_tcpinfo_t *ti)
+{
+	struct bufferevent *ubev;
+	evutil_socket_t fd = -1;
+
+	if (desc->bev && !desc->closed) {
+		ubev = bufferevent_get_underlying(desc->bev);
+		fd = bufferevent_getfd(ubev ? ubev : desc->bev);
+	}
+	if (fd == -1 || sys_tcpinfo(fd, ti) == -1)
+		ti->rtt = ti->rttvar = ti->retrans = ti->cwnd = ti->rate = -1;
+}
+
+/*
+ * Count sz octets received from src if req, else from dst.
+ */
+static void
+pxy_conn_bytes(pxy_conn_ctx_t *ctx, int req, size_t sz)
+{
+	if (req) {
+		ctx->srcbytes += sz;
+	} else {
+		ctx->dstbytes += sz;
+	}
+	stats_add(req ? STATS_SRC_BYTES : STATS_DST_BYTES, sz);
+	ctx->activity = tmwheel_now(ctx->wheel);
+	if (ctx->dormant) {
+		ctx->dormant = 0;
+		if (ctx->timeout == OPTS_TIMEOUT_IDLE)
+			pxy_conn_idle_arm(ctx, 0);
+	}
+}
+
+/*
+ * Return the timeout of the given OPTS_TIMEOUT_* kind in seconds, from the
+ * proxyspec if set there, else from the global options.  0 means no timeout.
+ */
+static unsigned int
+pxy_conn_timeout_secs(pxy_conn_ctx_t *ctx, int kind)
+{
+	if (ctx->spec->timeout[kind] >= 0)
+		return ctx->spec->timeout[kind];
+	return ctx->opts->timeout[kind];
+}
+
+/*
+ * Arm the connection timer for the next deadline of an established
+ * connection which has been idle for idle milliseconds: compacting it once
+ * it turns dormant, or the idle timeout.  Disarms the timer if neither
+ * applies.
+ */
+static void
+pxy_conn_idle_arm(pxy_conn_ctx_t *ctx, unsigned long long idle)
+{
+	unsigned long long ms, dms;
+
+	ms = pxy_conn_timeout_secs(ctx, OPTS_TIMEOUT_IDLE) * 1000ULL;
+	dms = ctx->dormant ? 0 :
+	      pxy_conn_timeout_secs(ctx, OPTS_TIMEOUT_DORMANT) * 1000ULL;
+	if (dms && dms > idle && (!ms || dms < ms))
+		ms = dms;
+	if (!ms) {
+		tmwheel_del(ctx->wheel, &ctx->timer);
+		return;
+	}
+	tmwheel_add(ctx->wheel, &ctx->timer, ms > idle ? ms - idle : 0);
+}
+
+/*
+ * Return the traffic shaping rate of the connection in octets per second,
+ * from the proxyspec if set there, else from ShapeRate.  0 means unshaped.
+ */
+static size_t
+pxy_conn_shape_rate(pxy_conn_ctx_t *ctx)
+{
+	if (ctx->spec->shape_rate >= 0)
+		return ctx->spec->shape_rate;
+	return ctx->opts->shape_rate;
+}
+
+/*
+ * Return the traffic shaping burst of the connection in octets, defaulting
+ * to one second worth of the shaping rate.
+ */
+static size_t
+pxy_conn_shape_burst(pxy_conn_ctx_t *ctx)
+{
+	if (ctx->spec->shape_burst > 0)
+		return ctx->spec->shape_burst;
+	if (ctx->spec->shape_burst < 0 && ctx->opts->shape_burst)
+		return ctx->opts->shape_burst;
+	return pxy_conn_shape_rate(ctx);
+}
+
+/*
+ * Arm the connection timer for the timeout of the given OPTS_TIMEOUT_* kind,
+ * replacing the timeout armed before, if any.
+ */
+static void
+pxy_conn_timeout(pxy_conn_ctx_t *ctx, int kind)
+{
+	unsigned int secs = pxy_conn_timeout_secs(ctx, kind);
+
+	ctx->timeout = kind;
+	if (kind == OPTS_TIMEOUT_IDLE) {
+		ctx->activity = tmwheel_now(ctx->wheel);
+		pxy_conn_idle_arm(ctx, 0);
+		return;
+	}
+	if (!secs) {
+		tmwheel_del(ctx->wheel, &ctx->timer);
+		return;
+	}
+	tmwheel_add(ctx->wheel, &ctx->timer, secs * 1000ULL);
+}
+
+/*
+ * Format addr into the inline host and serv buffers of the connection
+ * context on first use, such that connections which never log their
+ * addresses never format them.
+ * Returns 0 if the buffers hold the printable address, -1 otherwise.
+ */
+static int
+pxy_conn_addrstr(struct sockaddr_storage *addr, socklen_t addrlen,
+                 char *host, char *serv)
+{
+	if (host[0])
+		return 0;
+	if (!addrlen || sys_sockaddr_ntop((struct sockaddr *)addr, addrlen,
+	                                  host, INET6_ADDRSTRLEN,
+	                                  serv, 6) == -1) {
+		host[0] = '\0';
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Printable host and port of the src and dst addresses, or NULL if unknown.
+ */
+static char *
+pxy_conn_srchost(pxy_conn_ctx_t *ctx)
+{
+	return pxy_conn_addrstr(&ctx->srcaddr, ctx->srcaddrlen,
+	                        ctx->srchost_buf, ctx->srcport_buf) == -1 ?
+	       NULL : ctx->srchost_buf;
+}
+
+static char *
+pxy_conn_srcport(pxy_conn_ctx_t *ctx)
+{
+	return pxy_conn_addrstr(&ctx->srcaddr, ctx->srcaddrlen,
+	                        ctx->srchost_buf, ctx->srcport_buf) == -1 ?
+	       NULL : ctx->srcport_buf;
+}
+
+static char *
+pxy_conn_dsthost(pxy_conn_ctx_t *ctx)
+{
+	return pxy_conn_addrstr(&ctx->dstaddr, ctx->dstaddrlen,
+	                        ctx->dsthost_buf, ctx->dstport_buf) == -1 ?
+	       NULL : ctx->dsthost_buf;
+}
+
+static char *
+pxy_conn_dstport(pxy_conn_ctx_t *ctx)
+{
+	return pxy_conn_addrstr(&ctx->dstaddr, ctx->dstaddrlen,
+	                        ctx->dsthost_buf, ctx->dstport_buf) == -1 ?
+	       NULL : ctx->dstport_buf;
+}
+
+/* forward declaration of libevent callbacks */
+static void pxy_bev_readcb(struct bufferevent *, void *);
+static void pxy_bev_writecb(struct bufferevent *, void *);
+static void pxy_bev_eventcb(struct bufferevent *, short, void *);
+static void pxy_fd_readcb(evutil_socket_t, short, void *);
+static void pxy_conn_abort(pxy_conn_ctx_t *) NONNULL(1);
+static int pxy_conn_step(pxy_conn_ctx_t *, int, int) NONNULL(1) WUNRES;
+static void pxy_conn_handoff(pxy_conn_ctx_t *) NONNULL(1);
+#ifdef HAVE_ZEROCOPY
+static void pxy_zc_forward(pxy_conn_ctx_t *, struct evbuffer *, int)
+            NONNULL(1,2);
+#endif /* HAVE_ZEROCOPY */
+
+/* forward declaration of OpenSSL callbacks */
+#ifndef OPENSSL_NO_TLSEXT
+static int pxy_ossl_servername_cb(SSL *ssl, int *al, void *arg);
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+static int pxy_ossl_alpn_select_cb(SSL *, const unsigned char **,
+                                   unsigned char *, const unsigned char *,
+                                   unsigned int, void *);
+#endif /* OPENSSL_VERSION_NUMBER >= 0x10002000L */
+static int pxy_ossl_status_cb(SSL *, void *);
+#endif /* !OPENSSL_NO_TLSEXT */
+static int pxy_ossl_sessnew_cb(SSL *, SSL_SESSION *);
+static void pxy_ossl_sessremove_cb(SSL_CTX *, SSL_SESSION *);
+#if (OPENSSL_VERSION_NUMBER < 0x10100000L) || (defined(LIBRESSL_VERSION_NUMBER) && LIBRESSL_VERSION_NUMBER < 0x20800000L)
+static SSL_SESSION * pxy_ossl_sessget_cb(SSL *, unsigned char *, int, int *);
+#else /* OPENSSL_VERSION_NUMBER >= 0x10100000L */
+static SSL_SESSION * pxy_ossl_sessget_cb(SSL *, const unsigned char *, int,
+                                         int *);
+#endif /* OPENSSL_VERSION_NUMBER >= 0x10100000L */
+
+/*
+ * Dump information on a certificate to the debug log.
+ */
+static void
+pxy_debug_crt(X509 *crt)
+{
+	char *sj = ssl_x509_subject(crt);
 	if (sj) {
 		log_dbg_printf("Subject DN: %s\n", sj);
 		free(sj);
@@ -368,15 +1556,275 @@ pxy_debug_crt(X509 *crt)
 #endif /* DEBUG_CERTIFICATE */
 }
 
+/*
+ * Append TCP_INFO sample ti as name:RTT:RTTVAR:RETRANS:CWND:RATE to the
+ * connect log details in buf, with unknown values as dash.  Returns the
+ * number of characters appended as snprintf() would.
+ */
+static int
+pxy_log_tcpinfo(char *buf, size_t sz, const char *name,
+                const sys_tcpinfo_t *ti)
+{
+	const long long v[] = {ti->rtt, ti->rttvar, ti->retrans, ti->cwnd,
+	                       ti->rate};
+	int n;
+
+	n = snprintf(buf, sz, " %s", name);
+	for (size_t i = 0; i < sizeof(v) / sizeof(v[0]) && n > 0 &&
+	                   (size_t)n < sz; i++) {
+		if (v[i] == -1) {
+			n += snprintf(buf + n, sz - n, ":-");
+		} else {
+			n += snprintf(buf + n, sz - n, ":%lld", v[i]);
+		}
+	}
+	return n;
+}
+
+/*
+ * Append the ConnectLogTimings details to buf: worker thread, phase
+ * latencies in microseconds in the order of the STATS_PHASE_* constants,
+ * octets received from src and dst so far, and whether the forged cert, the
+ * dst session and the src session were found in the cache.  Returns the
+ * number of characters appended as snprintf() would.
+ */
+static int
+pxy_log_timings(pxy_conn_ctx_t *ctx, char *buf, size_t sz)
+{
+	int n;
+
+	n = snprintf(buf, sz, " thr:%d phases", ctx->thridx);
+	for (int i = 0; i < STATS_NPHASES && n > 0 && (size_t)n < sz; i++) {
+		if (ctx->phase[i] == -1) {
+			n += snprintf(buf + n, sz - n, ":-");
+		} else {
+			n += snprintf(buf + n, sz - n, ":%lld", ctx->phase[i]);
+		}
+	}
+	if (n > 0 && (size_t)n < sz) {
+		n += snprintf(buf + n, sz - n,
+		              " bytes:%llu:%llu cache:%s:%s:%s",
+		              ctx->srcbytes, ctx->dstbytes,
+		              !ctx->generated_cert ? "-" :
+		              ctx->fkcrt_hit ? "hit" : "miss",
+		              !ctx->dst.ssl ? "-" :
+		              SSL_session_reused(ctx->dst.ssl) ? "hit" : "miss",
+		              !ctx->src.ssl ? "-" :
+		              SSL_session_reused(ctx->src.ssl) ? "hit" :
+		                                                 "miss");
+	}
+	return n;
+}
+
+/*
+ * Format the optional per-connection details of the connect log into buf:
+ * the ConnectLogTimings details, and with ConnectLogTCPInfo, TCP_INFO of dst
+ * right after the TCP connect and of src and dst at the time of logging.
+ * Fields not applicable or not known yet are logged as dash.
+ */
+static const char *
+pxy_log_connect_details(pxy_conn_ctx_t *ctx, char *buf, size_t sz)
+{
+	sys_tcpinfo_t ti;
+	int n = 0;
+
+	buf[0] = '\0';
+	if (ctx->opts->connectlog_timings)
+		n = pxy_log_timings(ctx, buf, sz);
+	if (!ctx->opts->connectlog_tcpinfo)
+		return buf;
+	if (n >= 0 && (size_t)n < sz)
+		n += pxy_log_tcpinfo(buf + n, sz - n, "tcpconn",
+		                     &ctx->tcpi_connect);
+	if (n > 0 && (size_t)n < sz) {
+		pxy_conn_tcpinfo(&ctx->src, &ti);
+		n += pxy_log_tcpinfo(buf + n, sz - n, "tcpsrc", &ti);
+	}
+	if (n > 0 && (size_t)n < sz) {
+		pxy_conn_tcpinfo(&ctx->dst, &ti);
+		pxy_log_tcpinfo(buf + n, sz - n, "tcpdst", &ti);
+	}
+	return buf;
+}
+
+/*
+ * Add TCP_INFO sample ti as array of RTT, RTTVAR, RETRANS, CWND and RATE
+ * under key to the JSON connect log line, with unknown values as null, or
+ * all null if ti is NULL.
+ */
+static void
+pxy_log_tcpinfo_json(logjson_t *js, const char *key, const sys_tcpinfo_t *ti)
+{
+	logjson_array_begin(js, key);
+	logjson_array_int(js, ti ? ti->rtt : 0, ti && ti->rtt != -1);
+	logjson_array_int(js, ti ? ti->rttvar : 0, ti && ti->rttvar != -1);
+	logjson_array_int(js, ti ? ti->retrans : 0, ti && ti->retrans != -1);
+	logjson_array_int(js, ti ? ti->cwnd : 0, ti && ti->cwnd != -1);
+	logjson_array_int(js, ti ? ti->rate : 0, ti && ti->rate != -1);
+	logjson_array_end(js);
+}
+
+/*
+ * Write the connect log line of a connection as a JSON object into the
+ * thread's preallocated formatting buffer.  All fields are always present,
+ * null if not applicable or not known, such that every line has the same
+ * schema; bump "v" when fields change meaning.  Ports, latencies and
+ * counters are numbers, everything else is a string as logged in the text
+ * format.
+ */
+static void
+pxy_log_connect_json(pxy_conn_ctx_t *ctx, const char *kind, int http)
+{
+	logjson_t *js = pxy_thrmgr_get_json(ctx->thrmgr, ctx->thridx);
+	int ssl = ctx->src.ssl && ctx->dst.ssl;
+	struct timespec ts;
+	sys_tcpinfo_t ti;
+
+	if (!js)
+		return;
+	if (clock_gettime(CLOCK_REALTIME, &ts) == -1)
+		ts.tv_sec = ts.tv_nsec = 0;
+	logjson_begin(js);
+	logjson_int(js, "v", 1);
+	logjson_int(js, "ts", (long long)ts.tv_sec * 1000000 +
+	                      ts.tv_nsec / 1000);
+	logjson_str(js, "kind", kind);
+	logjson_str(js, "src", pxy_conn_srchost(ctx));
+	logjson_int(js, "sport", pxy_conn_srcport(ctx) ?
+	                         atoi(pxy_conn_srcport(ctx)) : 0);
+	logjson_str(js, "dst", pxy_conn_dsthost(ctx));
+	logjson_int(js, "dport", pxy_conn_dstport(ctx) ?
+	                         atoi(pxy_conn_dstport(ctx)) : 0);
+	logjson_str(js, "host", http ? ctx->http_host : NULL);
+	logjson_str(js, "method", http ? ctx->http_method : NULL);
+	logjson_str(js, "uri", http ? ctx->http_uri : NULL);
+	logjson_str(js, "status", http ? ctx->http_status_code : NULL);
+	logjson_str(js, "clen", http ? ctx->http_content_length : NULL);
+	logjson_str(js, "sni", ssl ? ctx->sni : NULL);
+	logjson_str(js, "ja3", ssl && ctx->hello.ja3[0] ? ctx->hello.ja3 :
+	                       NULL);
+	logjson_str(js, "names", ssl ? ctx->ssl_names : NULL);
+	logjson_str(js, "sproto", ssl ? SSL_get_version(ctx->src.ssl) : NULL);
+	logjson_str(js, "scipher", ssl ? SSL_get_cipher(ctx->src.ssl) : NULL);
+	logjson_str(js, "dproto", ssl ? SSL_get_version(ctx->dst.ssl) : NULL);
+	logjson_str(js, "dcipher", ssl ? SSL_get_cipher(ctx->dst.ssl) : NULL);
+	logjson_str(js, "origcrt", ssl ? ctx->origcrtfpr : NULL);
+	logjson_str(js, "usedcrt", ssl ? ctx->usedcrtfpr : NULL);
+#ifdef HAVE_LOCAL_PROCINFO
+	if (ctx->opts->lprocinfo) {
+		logjson_int(js, "pid", ctx->lproc.pid);
+		logjson_str(js, "user", ctx->lproc.user);
+		logjson_str(js, "group", ctx->lproc.group);
+		logjson_str(js, "exec", ctx->lproc.exec_path);
+	} else
+#endif /* HAVE_LOCAL_PROCINFO */
+	{
+		logjson_str(js, "pid", NULL);
+		logjson_str(js, "user", NULL);
+		logjson_str(js, "group", NULL);
+		logjson_str(js, "exec", NULL);
+	}
+	logjson_bool(js, "ocsp_denied", ctx->ocsp_denied);
+	logjson_bool(js, "reneg_limited", ctx->reneg_limited);
+	logjson_int(js, "thr", ctx->thridx);
+	logjson_array_begin(js, "phases");
+	for (int i = 0; i < STATS_NPHASES; i++)
+		logjson_array_int(js, ctx->phase[i], ctx->phase[i] != -1);
+	logjson_array_end(js);
+	logjson_int(js, "srcbytes", ctx->srcbytes);
+	logjson_int(js, "dstbytes", ctx->dstbytes);
+	logjson_str(js, "fkcrt_cache", !ctx->generated_cert ? NULL :
+	                               ctx->fkcrt_hit ? "hit" : "miss");
+	logjson_str(js, "dst_cache", !ctx->dst.ssl ? NULL :
+	                             SSL_session_reused(ctx->dst.ssl) ?
+	                             "hit" : "miss");
+	logjson_str(js, "src_cache", !ctx->src.ssl ? NULL :
+	                             SSL_session_reused(ctx->src.ssl) ?
+	                             "hit" : "miss");
+	if (ctx->opts->connectlog_tcpinfo) {
+		pxy_log_tcpinfo_json(js, "tcp_connect", &ctx->tcpi_connect);
+		pxy_conn_tcpinfo(&ctx->src, &ti);
+		pxy_log_tcpinfo_json(js, "tcp_src", &ti);
+		pxy_conn_tcpinfo(&ctx->dst, &ti);
+		pxy_log_tcpinfo_json(js, "tcp_dst", &ti);
+	} else {
+		pxy_log_tcpinfo_json(js, "tcp_connect", NULL);
+		pxy_log_tcpinfo_json(js, "tcp_src", NULL);
+		pxy_log_tcpinfo_json(js, "tcp_dst", NULL);
+	}
+	if (logjson_end(js) == -1) {
+		ctx->enomem = 1;
+		return;
+	}
+	if (!ctx->opts->detach) {
+		log_err_printf("%.*s", (int)js->len, js->buf);
+	}
+	if (ctx->opts->connectlog) {
+		if (log_connect_write(js->buf, js->len) == -1) {
+			log_err_rl_printf("Warning: Connection logging "
+			                  "failed\n");
+		}
+	}
+}
+
+/*
+ * Count the closing connection into the connect log rollup aggregates of
+ * its thread, keyed by the kind logged in the connect log, the SNI or the
+ * HTTP Host, the destination and the outcome.
+ */
+static void
+pxy_log_connect_rollup(pxy_conn_ctx_t *ctx)
+{
+	logroll_t *lr = pxy_thrmgr_get_rollup(ctx->thrmgr, ctx->thridx);
+	const char *field[LOGROLL_NFIELDS];
+	int http = ctx->spec->http && !ctx->passthrough;
+
+	if (!lr)
+		return;
+	/* connections failing early have no SSL objects yet */
+	if (http) {
+		field[LOGROLL_PROTO] = ctx->spec->ssl ? "https" : "http";
+	} else if (ctx->passthrough) {
+		field[LOGROLL_PROTO] = "passthrough";
+	} else if (ctx->clienthello_found) {
+		field[LOGROLL_PROTO] = "upgrade";
+	} else {
+		field[LOGROLL_PROTO] = ctx->src.ssl || ctx->spec->ssl ?
+		                       "ssl" : "tcp";
+	}
+	field[LOGROLL_NAME] = ctx->sni ? ctx->sni :
+	                      http ? ctx->http_host : NULL;
+	field[LOGROLL_DST] = pxy_conn_dsthost(ctx);
+	field[LOGROLL_DPORT] = pxy_conn_dstport(ctx);
+	field[LOGROLL_OUTCOME] = ctx->timedout ? "timeout" :
+	                         ctx->sslerr ? "sslerr" :
+	                         ctx->connected ? "ok" : "fail";
+	if (logroll_add(lr, field, ctx->srcbytes, ctx->dstbytes) == -1) {
+		log_err_rl_printf("Warning: Connect log rollup failed\n");
+	}
+}
+
 static void
 pxy_log_connect_nonhttp(pxy_conn_ctx_t *ctx)
 {
+	char details[512];
 	char *msg;
 #ifdef HAVE_LOCAL_PROCINFO
 	char *lpi = NULL;
 #endif /* HAVE_LOCAL_PROCINFO */
 	int rv;
 
+	if (!ctx->log_sampled)
+		return;
+	ctx->connect_logged = 1;
+	if (ctx->opts->connectlog_json) {
+		pxy_log_connect_json(ctx, !ctx->src.ssl ?
+		                     (ctx->passthrough ? "passthrough" : "tcp") :
+		                     (ctx->clienthello_found ? "upgrade" : "ssl"),
+		                     0);
+		return;
+	}
+
 #ifdef HAVE_LOCAL_PROCINFO
 	if (ctx->opts->lprocinfo) {
 		rv = asprintf(&lpi, "lproc:%i:%s:%s:%s",
@@ -404,16 +1852,17 @@ pxy_log_connect_nonhttp(pxy_conn_ctx_t *ctx)
 #ifdef HAVE_LOCAL_PROCINFO
 		              " %s"
 #endif /* HAVE_LOCAL_PROCINFO */
-		              "\n",
+		              "%s\n",
 		              ctx->passthrough ? "passthrough" : "tcp",
-		              STRORDASH(ctx->srchost_str),
-		              STRORDASH(ctx->srcport_str),
-		              STRORDASH(ctx->dsthost_str),
-		              STRORDASH(ctx->dstport_str)
+		              STRORDASH(pxy_conn_srchost(ctx)),
+		              STRORDASH(pxy_conn_srcport(ctx)),
+		              STRORDASH(pxy_conn_dsthost(ctx)),
+		              STRORDASH(pxy_conn_dstport(ctx)),
 #ifdef HAVE_LOCAL_PROCINFO
-		              , lpi
+		              lpi,
 #endif /* HAVE_LOCAL_PROCINFO */
-		             );
+		              pxy_log_connect_details(ctx, details,
+		                                      sizeof(details)));
 	} else {
 		rv = asprintf(&msg, "%s %s %s %s %s "
 		              "sni:%s names:%s "
@@ -422,12 +1871,12 @@ pxy_log_connect_nonhttp(pxy_conn_ctx_t *ctx)
 #ifdef HAVE_LOCAL_PROCINFO
 		              " %s"
 #endif /* HAVE_LOCAL_PROCINFO */
-		              "\n",
+		              "%s%s\n",
 		              ctx->clienthello_found ? "upgrade" : "ssl",
-		              STRORDASH(ctx->srchost_str),
-		              STRORDASH(ctx->srcport_str),
-		              STRORDASH(ctx->dsthost_str),
-		              STRORDASH(ctx->dstport_str),
+		              STRORDASH(pxy_conn_srchost(ctx)),
+		              STRORDASH(pxy_conn_srcport(ctx)),
+		              STRORDASH(pxy_conn_dsthost(ctx)),
+		              STRORDASH(pxy_conn_dstport(ctx)),
 		              STRORDASH(ctx->sni),
 		              STRORDASH(ctx->ssl_names),
 		              SSL_get_version(ctx->src.ssl),
@@ -435,11 +1884,13 @@ pxy_log_connect_nonhttp(pxy_conn_ctx_t *ctx)
 		              SSL_get_version(ctx->dst.ssl),
 		              SSL_get_cipher(ctx->dst.ssl),
 		              STRORDASH(ctx->origcrtfpr),
-		              STRORDASH(ctx->usedcrtfpr)
+		              STRORDASH(ctx->usedcrtfpr),
 #ifdef HAVE_LOCAL_PROCINFO
-		              , lpi
+		              lpi,
 #endif /* HAVE_LOCAL_PROCINFO */
-		              );
+		              ctx->reneg_limited ? " reneg:limited" : "",
+		              pxy_log_connect_details(ctx, details,
+		                                      sizeof(details)));
 	}
 	if ((rv < 0) || !msg) {
 		ctx->enomem = 1;
@@ -451,7 +1902,8 @@ pxy_log_connect_nonhttp(pxy_conn_ctx_t *ctx)
 	if (ctx->opts->connectlog) {
 		if (log_connect_print_free(msg) == -1) {
 			free(msg);
-			log_err_printf("Warning: Connection logging failed\n");
+			log_err_rl_printf("Warning: Connection logging "
+			                  "failed\n");
 		}
 	} else {
 		free(msg);
@@ -465,9 +1917,48 @@ out:
 	return;
 }
 
+/*
+ * Flag a connection going over a renegotiation limit after its connect log
+ * line was already written with a separate reneg line.
+ */
+static void
+pxy_log_connect_reneg(pxy_conn_ctx_t *ctx)
+{
+	char *msg;
+
+	if (!ctx->connect_logged)
+		return;
+	if (ctx->opts->connectlog_json) {
+		pxy_log_connect_json(ctx, "reneg", 0);
+		return;
+	}
+	if (asprintf(&msg, "reneg %s %s %s %s action:%s\n",
+	             STRORDASH(pxy_conn_srchost(ctx)),
+	             STRORDASH(pxy_conn_srcport(ctx)),
+	             STRORDASH(pxy_conn_dsthost(ctx)),
+	             STRORDASH(pxy_conn_dstport(ctx)),
+	             opts_reneg_action_str(ctx->opts->reneg_action)) < 0) {
+		ctx->enomem = 1;
+		return;
+	}
+	if (!ctx->opts->detach) {
+		log_err_printf("%s", msg);
+	}
+	if (ctx->opts->connectlog) {
+		if (log_connect_print_free(msg) == -1) {
+			free(msg);
+			log_err_rl_printf("Warning: Connection logging "
+			                  "failed\n");
+		}
+	} else {
+		free(msg);
+	}
+}
+
 static void
 pxy_log_connect_http(pxy_conn_ctx_t *ctx)
 {
+	char details[512];
 	char *msg;
 #ifdef HAVE_LOCAL_PROCINFO
 	char *lpi = NULL;
@@ -482,6 +1973,14 @@ pxy_log_connect_http(pxy_conn_ctx_t *ctx)
 	}
 #endif
 
+	if (!ctx->log_sampled)
+		return;
+	ctx->connect_logged = 1;
+	if (ctx->opts->connectlog_json) {
+		pxy_log_connect_json(ctx, ctx->spec->ssl ? "https" : "http", 1);
+		return;
+	}
+
 #ifdef HAVE_LOCAL_PROCINFO
 	if (ctx->opts->lprocinfo) {
 		rv = asprintf(&lpi, "lproc:%i:%s:%s:%s",
@@ -509,11 +2008,11 @@ pxy_log_connect_http(pxy_conn_ctx_t *ctx)
 #ifdef HAVE_LOCAL_PROCINFO
 		              " %s"
 #endif /* HAVE_LOCAL_PROCINFO */
-		              "%s\n",
-		              STRORDASH(ctx->srchost_str),
-		              STRORDASH(ctx->srcport_str),
-		              STRORDASH(ctx->dsthost_str),
-		              STRORDASH(ctx->dstport_str),
+		              "%s%s\n",
+		              STRORDASH(pxy_conn_srchost(ctx)),
+		              STRORDASH(pxy_conn_srcport(ctx)),
+		              STRORDASH(pxy_conn_dsthost(ctx)),
+		              STRORDASH(pxy_conn_dstport(ctx)),
 		              STRORDASH(ctx->http_host),
 		              STRORDASH(ctx->http_method),
 		              STRORDASH(ctx->http_uri),
@@ -522,7 +2021,9 @@ pxy_log_connect_http(pxy_conn_ctx_t *ctx)
 #ifdef HAVE_LOCAL_PROCINFO
 		              lpi,
 #endif /* HAVE_LOCAL_PROCINFO */
-		              ctx->ocsp_denied ? " ocsp:denied" : "");
+		              ctx->ocsp_denied ? " ocsp:denied" : "",
+		              pxy_log_connect_details(ctx, details,
+		                                      sizeof(details)));
 	} else {
 		rv = asprintf(&msg, "https %s %s %s %s %s %s %s %s %s "
 		              "sni:%s names:%s "
@@ -531,11 +2032,11 @@ pxy_log_connect_http(pxy_conn_ctx_t *ctx)
 #ifdef HAVE_LOCAL_PROCINFO
 		              " %s"
 #endif /* HAVE_LOCAL_PROCINFO */
-		              "%s\n",
-		              STRORDASH(ctx->srchost_str),
-		              STRORDASH(ctx->srcport_str),
-		              STRORDASH(ctx->dsthost_str),
-		              STRORDASH(ctx->dstport_str),
+		              "%s%s%s\n",
+		              STRORDASH(pxy_conn_srchost(ctx)),
+		              STRORDASH(pxy_conn_srcport(ctx)),
+		              STRORDASH(pxy_conn_dsthost(ctx)),
+		              STRORDASH(pxy_conn_dstport(ctx)),
 		              STRORDASH(ctx->http_host),
 		              STRORDASH(ctx->http_method),
 		              STRORDASH(ctx->http_uri),
@@ -552,7 +2053,10 @@ pxy_log_connect_http(pxy_conn_ctx_t *ctx)
 #ifdef HAVE_LOCAL_PROCINFO
 		              lpi,
 #endif /* HAVE_LOCAL_PROCINFO */
-		              ctx->ocsp_denied ? " ocsp:denied" : "");
+		              ctx->ocsp_denied ? " ocsp:denied" : "",
+		              ctx->reneg_limited ? " reneg:limited" : "",
+		              pxy_log_connect_details(ctx, details,
+		                                      sizeof(details)));
 	}
 	if ((rv < 0 ) || !msg) {
 		ctx->enomem = 1;
@@ -564,7 +2068,8 @@ pxy_log_connect_http(pxy_conn_ctx_t *ctx)
 	if (ctx->opts->connectlog) {
 		if (log_connect_print_free(msg) == -1) {
 			free(msg);
-			log_err_printf("Warning: Connection logging failed\n");
+			log_err_rl_printf("Warning: Connection logging "
+			                  "failed\n");
 		}
 	} else {
 		free(msg);
@@ -583,7 +2088,7 @@ out:
  * OpenSSL increments the refcount before calling the callback and will
  * decrement it again if we return 0.  Returning 1 will make OpenSSL skip
  * the refcount decrementing.  In other words, return 0 if we did not
- * keep a pointer to the object (which we never do here).
+ * keep a pointer to the object (the cache takes its own reference).
  */
 #ifdef HAVE_SSLV2
 #define MAYBE_UNUSED 
@@ -613,6 +2118,7 @@ pxy_ossl_sessnew_cb(MAYBE_UNUSED SSL *ssl, SSL_SESSION *sess)
 #endif /* HAVE_SSLV2 */
 	if (sess) {
 		cachemgr_ssess_set(sess);
+		cachemgr_ssess_share(sess);
 	}
 	return 0;
 }
@@ -635,6 +2141,7 @@ pxy_ossl_sessremove_cb(UNUSED SSL_CTX *sslctx, SSL_SESSION *sess)
 #endif /* DEBUG_SESSION_CACHE */
 	if (sess) {
 		cachemgr_ssess_del(sess);
+		cachemgr_ssess_unshare(sess);
 	}
 }
 
@@ -658,6 +2165,8 @@ pxy_ossl_sessget_cb(UNUSED SSL *ssl, const unsigned char *id, int idlen,
 
 	*copy = 0; /* SSL should not increment reference count of session */
 	sess = cachemgr_ssess_get(id, idlen);
+	if (!sess)
+		sess = cachemgr_ssess_shared_get(id, idlen);
 
 #ifdef DEBUG_SESSION_CACHE
 	if (sess) {
@@ -669,11 +2178,76 @@ pxy_ossl_sessget_cb(UNUSED SSL *ssl, const unsigned char *id, int idlen,
 	return sess;
 }
 
+#ifdef HAVE_EARLYDATA
+/*
+ * Called by OpenSSL to decide whether to accept early data from a client
+ * resuming a src session.  OpenSSL's own replay protection only works with
+ * its internal session cache, therefore early data is accepted only by the
+ * one connection taking the session out of the session cache.
+ */
+static int
+pxy_ossl_allow_early_data_cb(SSL *ssl, UNUSED void *arg)
+{
+	SSL_SESSION *sess = SSL_get_session(ssl);
+
+	return sess && cachemgr_ssess_take(sess);
+}
+#endif /* HAVE_EARLYDATA */
+
+/*
+ * Called by OpenSSL instead of X509_verify_cert() to verify the certificate
+ * chain presented by the original destination server.  Successful results
+ * are cached, keyed by the presented chain, until the first certificate in
+ * the verified chain expires; cache hits skip chain building and signature
+ * checks entirely.  The trust settings are the same for all connections,
+ * hence the cached result is valid for all of them.
+ */
+static int
+pxy_ossl_verify_cb(X509_STORE_CTX *store, void *arg)
+{
+	opts_t *opts = arg;
+	STACK_OF(X509) *chain;
+	time_t *expiry, exp, t;
+	X509 *crt;
+	int rv;
+
+	crt = X509_STORE_CTX_get0_cert(store);
+	if (!crt)
+		return X509_verify_cert(store);
+	expiry = cachemgr_vrfy_get(crt, X509_STORE_CTX_get0_untrusted(store));
+	if (expiry) {
+		free(expiry);
+		if (OPTS_DEBUG(opts)) {
+			log_dbg_printf("Verify cache: HIT\n");
+		}
+		return 1;
+	}
+	if (OPTS_DEBUG(opts)) {
+		log_dbg_printf("Verify cache: MISS\n");
+	}
+
+	rv = X509_verify_cert(store);
+	if (rv != 1)
+		return rv;
+	chain = X509_STORE_CTX_get0_chain(store);
+	exp = ssl_x509_expiry(crt);
+	for (int i = 0; chain && i < sk_X509_num(chain); i++) {
+		t = ssl_x509_expiry(sk_X509_value(chain, i));
+		if (t < exp)
+			exp = t;
+	}
+	if (exp > time(NULL)) {
+		cachemgr_vrfy_set(crt, X509_STORE_CTX_get0_untrusted(store),
+		                  exp);
+	}
+	return rv;
+}
+
 /*
  * Set SSL_CTX options that are the same for incoming and outgoing SSL_CTX.
  */
 static void
-pxy_sslctx_setoptions(SSL_CTX *sslctx, pxy_conn_ctx_t *ctx)
+pxy_sslctx_setoptions(SSL_CTX *sslctx, opts_t *opts)
 {
 	SSL_CTX_set_options(sslctx, SSL_OP_ALL);
 #ifdef SSL_OP_TLS_ROLLBACK_BUG
@@ -688,10 +2262,15 @@ pxy_sslctx_setoptions(SSL_CTX *sslctx, pxy_conn_ctx_t *ctx)
 #ifdef SSL_OP_NO_TICKET
 	SSL_CTX_set_options(sslctx, SSL_OP_NO_TICKET);
 #endif /* SSL_OP_NO_TICKET */
+#ifdef HAVE_KTLS
+	if (opts->openssl_ktls) {
+		SSL_CTX_set_options(sslctx, SSL_OP_ENABLE_KTLS);
+	}
+#endif /* HAVE_KTLS */
 
 #ifdef SSL_OP_NO_SSLv2
 #ifdef HAVE_SSLV2
-	if (ctx->opts->no_ssl2) {
+	if (opts->no_ssl2) {
 #endif /* HAVE_SSLV2 */
 		SSL_CTX_set_options(sslctx, SSL_OP_NO_SSLv2);
 #ifdef HAVE_SSLV2
@@ -699,33 +2278,33 @@ pxy_sslctx_setoptions(SSL_CTX *sslctx, pxy_conn_ctx_t *ctx)
 #endif /* HAVE_SSLV2 */
 #endif /* !SSL_OP_NO_SSLv2 */
 #ifdef HAVE_SSLV3
-	if (ctx->opts->no_ssl3) {
+	if (opts->no_ssl3) {
 		SSL_CTX_set_options(sslctx, SSL_OP_NO_SSLv3);
 	}
 #endif /* HAVE_SSLV3 */
 #ifdef HAVE_TLSV10
-	if (ctx->opts->no_tls10) {
+	if (opts->no_tls10) {
 		SSL_CTX_set_options(sslctx, SSL_OP_NO_TLSv1);
 	}
 #endif /* HAVE_TLSV10 */
 #ifdef HAVE_TLSV11
-	if (ctx->opts->no_tls11) {
+	if (opts->no_tls11) {
 		SSL_CTX_set_options(sslctx, SSL_OP_NO_TLSv1_1);
 	}
 #endif /* HAVE_TLSV11 */
 #ifdef HAVE_TLSV12
-	if (ctx->opts->no_tls12) {
+	if (opts->no_tls12) {
 		SSL_CTX_set_options(sslctx, SSL_OP_NO_TLSv1_2);
 	}
 #endif /* HAVE_TLSV12 */
 
 #ifdef SSL_OP_NO_COMPRESSION
-	if (!ctx->opts->sslcomp) {
+	if (!opts->sslcomp) {
 		SSL_CTX_set_options(sslctx, SSL_OP_NO_COMPRESSION);
 	}
 #endif /* SSL_OP_NO_COMPRESSION */
 
-	SSL_CTX_set_cipher_list(sslctx, ctx->opts->ciphers);
+	SSL_CTX_set_cipher_list(sslctx, opts->ciphers);
 
 #if (OPENSSL_VERSION_NUMBER >= 0x10100000L) && !defined(LIBRESSL_VERSION_NUMBER)
 	/*
@@ -742,6 +2321,35 @@ pxy_sslctx_setoptions(SSL_CTX *sslctx, pxy_conn_ctx_t *ctx)
 #endif /* OPENSSL_VERSION_NUMBER >= 0x10100000L */
 }
 
+/*
+ * Create an SSL_CTX for the configured protocol method from the OpenSSL
+ * library context of the connection's thread, which has its own with
+ * WorkerLibCtx, or from the default one.
+ */
+static SSL_CTX *
+pxy_sslctx_new(pxy_conn_ctx_t *ctx)
+{
+#ifdef HAVE_LIBCTX
+	OSSL_LIB_CTX *libctx;
+
+	if ((libctx = pxy_thrmgr_get_libctx(ctx->thrmgr, ctx->thridx)))
+		return SSL_CTX_new_ex(libctx, NULL, ctx->opts->sslmethod());
+#endif /* HAVE_LIBCTX */
+	return SSL_CTX_new(ctx->opts->sslmethod());
+}
+
+/*
+ * SSL_CTX cache domain of the connection: SSL_CTXs created from a thread's
+ * own library context must only be used on that thread, and SSL_CTXs created
+ * before a reload must not be used with the reloaded configuration.
+ */
+static unsigned int
+pxy_sslctx_dom(pxy_conn_ctx_t *ctx)
+{
+	return (ctx->opts->sslctx_gen << 16) |
+	       (ctx->opts->worker_libctx ? (unsigned int)ctx->thridx + 1 : 0);
+}
+
 /*
  * Create and set up a new SSL_CTX instance for terminating SSL.
  * Set up all the necessary callbacks, the certificate, the cert chain and key.
@@ -750,13 +2358,13 @@ static SSL_CTX *
 pxy_srcsslctx_create(pxy_conn_ctx_t *ctx, X509 *crt, STACK_OF(X509) *chain,
                      EVP_PKEY *key)
 {
-	SSL_CTX *sslctx = SSL_CTX_new(ctx->opts->sslmethod());
+	SSL_CTX *sslctx = pxy_sslctx_new(ctx);
 	if (!sslctx) {
 		ctx->enomem = 1;
 		return NULL;
 	}
 
-	pxy_sslctx_setoptions(sslctx, ctx);
+	pxy_sslctx_setoptions(sslctx, ctx->opts);
 
 #if (OPENSSL_VERSION_NUMBER >= 0x10100000L) && !defined(LIBRESSL_VERSION_NUMBER)
 	if (ctx->opts->sslversion) {
@@ -779,7 +2387,13 @@ pxy_srcsslctx_create(pxy_conn_ctx_t *ctx, X509 *crt, STACK_OF(X509) *chain,
 #endif /* USE_SSL_SESSION_ID_CONTEXT */
 #ifndef OPENSSL_NO_TLSEXT
 	SSL_CTX_set_tlsext_servername_callback(sslctx, pxy_ossl_servername_cb);
-	SSL_CTX_set_tlsext_servername_arg(sslctx, ctx);
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+	SSL_CTX_set_alpn_select_cb(sslctx, pxy_ossl_alpn_select_cb, NULL);
+#endif /* OPENSSL_VERSION_NUMBER >= 0x10002000L */
+	SSL_CTX_set_tlsext_status_cb(sslctx, pxy_ossl_status_cb);
+	if (ctx->opts->sslticket) {
+		sslticket_sslctx_setup(sslctx);
+	}
 #endif /* !OPENSSL_NO_TLSEXT */
 #ifndef OPENSSL_NO_DH
 	if (ctx->opts->dh) {
@@ -793,7 +2407,10 @@ pxy_srcsslctx_create(pxy_conn_ctx_t *ctx, X509 *crt, STACK_OF(X509) *chain,
 		EC_KEY *ecdh = ssl_ec_by_name(ctx->opts->ecdhcurve);
 		SSL_CTX_set_tmp_ecdh(sslctx, ecdh);
 		EC_KEY_free(ecdh);
-	} else {
+	} else if (!ctx->opts->earlydata) {
+		/* with early data, OpenSSL's default groups are kept, since
+		 * a key share for any other group than this curve results in
+		 * a HelloRetryRequest, which rejects the early data */
 		EC_KEY *ecdh = ssl_ec_by_name(NULL);
 		SSL_CTX_set_tmp_ecdh(sslctx, ecdh);
 		EC_KEY_free(ecdh);
@@ -814,6 +2431,37 @@ pxy_srcsslctx_create(pxy_conn_ctx_t *ctx, X509 *crt, STACK_OF(X509) *chain,
 		ssl_x509_refcount_inc(c); /* next call consumes a reference */
 		SSL_CTX_add_extra_chain_cert(sslctx, c);
 	}
+#ifdef HAVE_CERTCOMP
+	if (ctx->opts->certcomp) {
+		int algs[] = {TLSEXT_comp_cert_brotli, TLSEXT_comp_cert_zlib};
+
+		/* compress the chain once here instead of in every handshake;
+		 * the SSL_CTX is cached along with the forged certificate */
+		if (SSL_CTX_set1_cert_comp_preference(sslctx, algs,
+		        sizeof(algs) / sizeof(algs[0])) != 1 ||
+		    SSL_CTX_compress_certs(sslctx, 0) != 1) {
+			log_dbg_printf("compressing src server certificate "
+			               "chain failed\n");
+		}
+	} else {
+		SSL_CTX_set_options(sslctx,
+		                    SSL_OP_NO_TX_CERTIFICATE_COMPRESSION);
+	}
+#endif /* HAVE_CERTCOMP */
+#ifdef HAVE_EARLYDATA
+	if (ctx->opts->earlydata && !ctx->opts->sslticket) {
+		/* offered with the session tickets; stateless tickets could
+		 * be replayed, see pxy_ossl_allow_early_data_cb() */
+		uint32_t max = ctx->opts->earlydata > UINT32_MAX ?
+		               UINT32_MAX : ctx->opts->earlydata;
+		SSL_CTX_set_options(sslctx, SSL_OP_NO_ANTI_REPLAY);
+		SSL_CTX_set_allow_early_data_cb(sslctx,
+		                                pxy_ossl_allow_early_data_cb,
+		                                NULL);
+		SSL_CTX_set_max_early_data(sslctx, max);
+		SSL_CTX_set_recv_max_early_data(sslctx, max);
+	}
+#endif /* HAVE_EARLYDATA */
 
 #ifdef DEBUG_SESSION_CACHE
 	if (OPTS_DEBUG(ctx->opts)) {
@@ -837,11 +2485,41 @@ pxy_srcsslctx_create(pxy_conn_ctx_t *ctx, X509 *crt, STACK_OF(X509) *chain,
 	return sslctx;
 }
 
-static int
-pxy_srccert_write_to_gendir(pxy_conn_ctx_t *ctx, X509 *crt, int is_orig)
+/*
+ * Look up a ready-to-use SSL_CTX for terminating SSL with certificate crt
+ * in the SSL_CTX cache, or create and cache a new one if there is none.
+ * The SSL_CTX is shared with other connections and must not be modified;
+ * connection state is attached to the SSL instance as application data.
+ * Returned SSL_CTX must be freed by the caller using SSL_CTX_free().
+ */
+static SSL_CTX *
+pxy_srcsslctx_get(pxy_conn_ctx_t *ctx, X509 *crt, STACK_OF(X509) *chain,
+                  EVP_PKEY *key)
 {
-	char *fn;
-	int rv;
+	SSL_CTX *sslctx;
+
+	sslctx = cachemgr_sslctx_get_in(crt, pxy_sslctx_dom(ctx));
+	if (sslctx) {
+		if (OPTS_DEBUG(ctx->opts)) {
+			log_dbg_printf("SSL_CTX cache: HIT\n");
+		}
+		return sslctx;
+	}
+	if (OPTS_DEBUG(ctx->opts)) {
+		log_dbg_printf("SSL_CTX cache: MISS\n");
+	}
+	sslctx = pxy_srcsslctx_create(ctx, crt, chain, key);
+	if (sslctx) {
+		cachemgr_sslctx_set_in(crt, pxy_sslctx_dom(ctx), sslctx);
+	}
+	return sslctx;
+}
+
+static int
+pxy_srccert_write_to_gendir(pxy_conn_ctx_t *ctx, X509 *crt, int is_orig)
+{
+	char *fn;
+	int rv;
 
 	if (!ctx->origcrtfpr)
 		return -1;
@@ -879,51 +2557,155 @@ pxy_srccert_write(pxy_conn_ctx_t *ctx)
 	}
 }
 
+/*
+ * CA and leaf key to forge certificates for this connection with, depending
+ * on whether the client indicated support for ECDSA.
+ */
+static X509 *
+pxy_srccert_cacrt(pxy_conn_ctx_t *ctx)
+{
+	return ctx->ecdsa ? ctx->opts->eccacrt : ctx->opts->cacrt;
+}
+
+static EVP_PKEY *
+pxy_srccert_leafkey(pxy_conn_ctx_t *ctx)
+{
+	return ctx->ecdsa ? ctx->opts->ecleafkey : ctx->opts->leafkey;
+}
+
+/*
+ * Return the private key for forged certificate crt: its own key if it was
+ * forged with a key from the leaf key pool, the shared leaf key otherwise.
+ */
+static EVP_PKEY *
+pxy_srccert_crtkey(pxy_conn_ctx_t *ctx, X509 *crt)
+{
+	EVP_PKEY *key;
+
+	if (!ctx->ecdsa && (key = ssl_x509_leafkey_get(crt)))
+		return key;
+	return pxy_srccert_leafkey(ctx);
+}
+
+/*
+ * Forge a certificate for crt signed by the CA in use, with sn as additional
+ * subjectAltName if non-NULL.  The certificate gets key if non-NULL, such as
+ * when re-forging a certificate, or otherwise a new key from the leaf key
+ * pool if there is one, or the shared leaf key.
+ */
+static X509 *
+pxy_srccert_forge(pxy_conn_ctx_t *ctx, X509 *crt, EVP_PKEY *key,
+                  const char *sn)
+{
+	keypool_t *keypool = pxy_thrmgr_get_keypool(ctx->thrmgr);
+	EVP_PKEY *poolkey = NULL;
+	X509 *newcrt;
+
+	if (!key && keypool && !ctx->ecdsa) {
+		if (!(key = poolkey = keypool_get(keypool)))
+			return NULL;
+	} else if (!key) {
+		key = pxy_srccert_leafkey(ctx);
+	}
+	newcrt = pxy_forge_crt(ctx->opts, crt, ctx->ecdsa, key, sn);
+	if (newcrt && key != pxy_srccert_leafkey(ctx) &&
+	    ssl_x509_leafkey_set(newcrt, key) == -1) {
+		X509_free(newcrt);
+		newcrt = NULL;
+	}
+	if (poolkey)
+		EVP_PKEY_free(poolkey);
+	return newcrt;
+}
+
+static STACK_OF(X509) *
+pxy_srccert_cachain(pxy_conn_ctx_t *ctx)
+{
+	return ctx->ecdsa ? ctx->opts->eccachain : ctx->opts->cachain;
+}
+
+/*
+ * Insert a newly forged certificate into the cache and the persistent store.
+ * ECDSA certificates are cached only.
+ */
+static void
+pxy_srccert_cache(pxy_conn_ctx_t *ctx, X509 *crt)
+{
+	cachemgr_fkcrt_insert(ctx->origcrt, crt, ctx->ecdsa,
+	                      ctx->opts->fkcrt_epoch);
+	if (ctx->ecdsa)
+		return;
+	if (cachemgr_fkstore &&
+	    certstore_put(cachemgr_fkstore, ctx->origcrt, crt) == -1) {
+		log_err_printf("Failed to append to certificate store\n");
+	}
+}
+
+/*
+ * Completion callback for asynchronous forging, called on the event base of
+ * the connection.  The forging thread has already cached the certificate.
+ * Resumes setting up the connection where the dst connect event handler left
+ * off when it submitted the forging job.
+ */
+static void
+pxy_srccert_forged_handler(X509 *crt, void *arg)
+{
+	pxy_conn_ctx_t *ctx = arg;
+
+	ctx->forgejob = NULL;
+	ctx->forging = 0;
+	ctx->forged_async = 1;
+	ctx->forgedcrt = crt;
+
+	bufferevent_enable(ctx->dst.bev, EV_READ|EV_WRITE);
+	if (ctx->src.bev) {
+		bufferevent_enable(ctx->src.bev, EV_READ|EV_WRITE);
+	}
+#if LIBEVENT_VERSION_NUMBER >= 0x02010200
+	/* deliver data that arrived from the server while forging */
+	if (evbuffer_get_length(bufferevent_get_input(ctx->dst.bev))) {
+		bufferevent_trigger(ctx->dst.bev, EV_READ,
+		                    BEV_TRIG_DEFER_CALLBACKS);
+	}
+#endif /* LIBEVENT_VERSION_NUMBER >= 0x02010200 */
+	pxy_bev_eventcb(ctx->dst.bev, BEV_EVENT_CONNECTED, ctx);
+}
+
+static void
+pxy_srccert_forged_cb(X509 *crt, void *arg)
+{
+	pxy_cpu_t *cpu = pxy_cpu_enter(arg);
+
+	pxy_srccert_forged_handler(crt, arg);
+	pxy_cpu_leave(cpu);
+}
+
 static cert_t *
 pxy_srccert_create(pxy_conn_ctx_t *ctx)
 {
+	const ssl_x509_memo_t *memo;
 	cert_t *cert = NULL;
 
 	if (ctx->opts->leafcertdir) {
 		if (ctx->sni) {
-			cert = cachemgr_tgcrt_get(ctx->sni);
-			if (!cert) {
-				char *wildcarded;
-				wildcarded = ssl_wildcardify(ctx->sni);
-				if (!wildcarded) {
-					ctx->enomem = 1;
-					return NULL;
-				}
-				cert = cachemgr_tgcrt_get(wildcarded);
-				free(wildcarded);
-			}
+			cert = cachemgr_tgcrt_match(ctx->sni);
 			if (cert && OPTS_DEBUG(ctx->opts)) {
 				log_dbg_printf("Target cert by SNI\n");
 			}
 		} else if (ctx->origcrt) {
 			char **names = ssl_x509_names(ctx->origcrt);
+			if (!names) {
+				ctx->enomem = 1;
+				return NULL;
+			}
 			for (char **p = names; *p; p++) {
 				if (!cert) {
-					cert = cachemgr_tgcrt_get(*p);
-				}
-				if (!cert) {
-					char *wildcarded;
-					wildcarded = ssl_wildcardify(*p);
-					if (!wildcarded) {
-						ctx->enomem = 1;
-					} else {
-						/* increases ref count */
-						cert = cachemgr_tgcrt_get(
-						       wildcarded);
-						free(wildcarded);
-					}
+					/* increases ref count */
+					cert = cachemgr_tgcrt_match(*p);
 				}
 				free(*p);
 			}
 			free(names);
-			if (ctx->enomem) {
-				return NULL;
-			}
 			if (cert && OPTS_DEBUG(ctx->opts)) {
 				log_dbg_printf("Target cert by origcrt\n");
 			}
@@ -946,36 +2728,97 @@ pxy_srccert_create(pxy_conn_ctx_t *ctx)
 	if (!cert && ctx->origcrt && ctx->opts->leafkey) {
 		cert = cert_new();
 
-		cert->crt = cachemgr_fkcrt_get(ctx->origcrt);
-		if (cert->crt) {
+		if (ctx->forged_async) {
+			/* resuming after asynchronous forging */
+			cert->crt = ctx->forgedcrt;
+			ctx->forgedcrt = NULL;
+		} else if (cachemgr_fkcrt_current(ctx->opts->fkcrt_epoch) &&
+		           (cert->crt = ctx->ecdsa ?
+		                        cachemgr_fkcrt_get_ec(ctx->origcrt) :
+		                        cachemgr_fkcrt_get(ctx->origcrt))) {
+			ctx->fkcrt_hit = 1;
 			if (OPTS_DEBUG(ctx->opts)) {
-				log_dbg_printf("Certificate cache: HIT\n");
+				log_dbg_printf("Certificate cache: HIT%s\n",
+				               ctx->ecdsa ? " (ECDSA)" : "");
 			}
 		} else {
 			if (OPTS_DEBUG(ctx->opts)) {
-				log_dbg_printf("Certificate cache: MISS\n");
-			}
-			cert->crt = ssl_x509_forge(ctx->opts->cacrt,
-			                           ctx->opts->cakey,
-			                           ctx->origcrt,
-			                           ctx->opts->leafkey,
-			                           NULL,
-			                           ctx->opts->leafcrlurl);
-			cachemgr_fkcrt_set(ctx->origcrt, cert->crt);
-		}
-		cert_set_key(cert, ctx->opts->leafkey);
-		cert_set_chain(cert, ctx->opts->cachain);
+				log_dbg_printf("Certificate cache: MISS%s\n",
+				               ctx->ecdsa ? " (ECDSA)" : "");
+			}
+			if (ctx->speculative) {
+				/* only predict cached certificates */
+				cert_free(cert);
+				return NULL;
+			}
+			if (cachemgr_shfkcrt && pxy_srccert_cacrt(ctx) &&
+			    pxy_srccert_leafkey(ctx)) {
+				cert->crt = cachemgr_fkcrt_shared_get(
+				            ctx->origcrt, ctx->ecdsa,
+				            pxy_srccert_cacrt(ctx),
+				            pxy_srccert_leafkey(ctx),
+				            ctx->opts->fkcrt_epoch);
+				if (cert->crt && OPTS_DEBUG(ctx->opts)) {
+					log_dbg_printf("Shared certificate "
+					               "cache: HIT\n");
+				}
+			}
+			if (!cert->crt && cachemgr_fkstore && !ctx->ecdsa) {
+				cert->crt = certstore_get(cachemgr_fkstore,
+				                          ctx->origcrt);
+				if (cert->crt && OPTS_DEBUG(ctx->opts)) {
+					log_dbg_printf("Certificate store: "
+					               "HIT\n");
+				}
+				if (cert->crt) {
+					cachemgr_fkcrt_insert(
+					        ctx->origcrt, cert->crt, 0,
+					        ctx->opts->fkcrt_epoch);
+				}
+			}
+			if (!cert->crt && pxy_thrmgr_get_forge(ctx->thrmgr)) {
+				ctx->forgejob = pxy_forge_submit(
+				                pxy_thrmgr_get_forge(ctx->thrmgr),
+				                ctx->opts, ctx->evbase, ctx->origcrt,
+				                ctx->ecdsa,
+				                pxy_srccert_forged_cb, ctx);
+				if (ctx->forgejob) {
+					ctx->forging = 1;
+					cert_free(cert);
+					return NULL;
+				}
+			}
+			if (!cert->crt) {
+				cert->crt = pxy_srccert_forge(ctx, ctx->origcrt,
+				                              NULL, NULL);
+				if (cert->crt)
+					pxy_srccert_cache(ctx, cert->crt);
+			}
+		}
+		if (cert->crt && pxy_thrmgr_get_forge(ctx->thrmgr)) {
+			pxy_forge_track(pxy_thrmgr_get_forge(ctx->thrmgr),
+			                ctx->origcrt, cert->crt, ctx->ecdsa);
+		}
+		cert_set_key(cert, cert->crt ? pxy_srccert_crtkey(ctx, cert->crt)
+		                             : pxy_srccert_leafkey(ctx));
+		cert_set_chain(cert, pxy_srccert_cachain(ctx));
 		ctx->generated_cert = 1;
 	}
 
-	if ((WANT_CONNECT_LOG(ctx) || ctx->opts->certgendir) && ctx->origcrt) {
-		ctx->origcrtfpr = ssl_x509_fingerprint(ctx->origcrt, 0);
+	/* forged certificates carry memoised fingerprints, see cachefkcrt.c */
+	memo = (cert && cert->crt && ctx->generated_cert) ?
+	       ssl_x509_memo_get(cert->crt) : NULL;
+	if ((WANT_CONNECT_LOG(ctx) || ctx->opts->certgendir ||
+	     (ctx->opts->pcaplog && ctx->opts->pcaplog_ng)) && ctx->origcrt) {
+		ctx->origcrtfpr = memo ? strdup(memo->origfprstr) :
+		                  ssl_x509_fingerprint(ctx->origcrt, 0);
 		if (!ctx->origcrtfpr)
 			ctx->enomem = 1;
 	}
 	if ((WANT_CONNECT_LOG(ctx) || ctx->opts->certgen_writeall) &&
 	    cert && cert->crt) {
-		ctx->usedcrtfpr = ssl_x509_fingerprint(cert->crt, 0);
+		ctx->usedcrtfpr = memo ? strdup(memo->fprstr) :
+		                  ssl_x509_fingerprint(cert->crt, 0);
 		if (!ctx->usedcrtfpr)
 			ctx->enomem = 1;
 	}
@@ -983,6 +2826,142 @@ pxy_srccert_create(pxy_conn_ctx_t *ctx)
 	return cert;
 }
 
+/*
+ * Hand the ClientHello octets already read from the src fd to OpenSSL by
+ * reading them through a prefix BIO on top of the socket BIO.
+ * Returns -1 on failure, 0 on success.
+ */
+static int
+pxy_srcssl_setbio(pxy_conn_ctx_t *ctx, SSL *ssl)
+{
+	BIO *sbio, *bio;
+
+	sbio = BIO_new_socket(ctx->fd, BIO_NOCLOSE);
+	if (!sbio)
+		return -1;
+	bio = ssl_bio_prefix_new(sbio, ctx->chbuf, ctx->chlen);
+	if (!bio) {
+		BIO_free(sbio);
+		return -1;
+	}
+	ctx->chbuf = NULL;
+	ctx->chlen = ctx->chsz = 0;
+	SSL_set_bio(ssl, bio, bio);
+	return 0;
+}
+
+/*
+ * The connection went over a renegotiation limit on SSL object ssl; take
+ * the configured action.  The connection cannot be freed from within OpenSSL
+ * callbacks, so closing it is left to the event loop.
+ */
+static void
+pxy_conn_reneg_over(pxy_conn_ctx_t *ctx, SSL *ssl)
+{
+	if (!ctx->reneg_limited) {
+		ctx->reneg_limited = 1;
+		stats_inc(STATS_SSL_RENEG);
+		if (OPTS_DEBUG(ctx->opts)) {
+			log_dbg_printf("Connection from [%s]:%s over "
+			               "renegotiation limit (%s)\n",
+			               STRORDASH(pxy_conn_srchost(ctx)),
+			               STRORDASH(pxy_conn_srcport(ctx)),
+			               opts_reneg_action_str(
+			               ctx->opts->reneg_action));
+		}
+		pxy_log_connect_reneg(ctx);
+	}
+	switch (ctx->opts->reneg_action) {
+	case OPTS_RENEG_LOG:
+		break;
+	case OPTS_RENEG_REFUSE:
+#ifdef SSL_OP_NO_RENEGOTIATION
+		SSL_set_options(ssl, SSL_OP_NO_RENEGOTIATION);
+		break;
+#endif /* SSL_OP_NO_RENEGOTIATION */
+		/* FALLTHROUGH */
+	case OPTS_RENEG_CLOSE:
+		if (ctx->reneg_close)
+			break;
+		ctx->reneg_close = 1;
+		if (pxy_conn_step(ctx, PXY_STEP_ABORT, PXY_PRIO_ESTAB) == -1)
+			ctx->enomem = 1;
+		break;
+	}
+}
+
+/*
+ * Count renegotiations on the src or dst SSL object of the connection from
+ * its info callback and enforce MaxRenegotiations on them.  Renegotiations
+ * started by the client also count towards the handshake rate admission
+ * limits.  Renegotiations refused by OpenSSL with a no_renegotiation alert
+ * once the limit is reached count as going over the limit; OpenSSL 3 refuses
+ * client initiated renegotiation by default, which does not.
+ */
+static void
+pxy_conn_reneg(pxy_conn_ctx_t *ctx, pxy_conn_desc_t *this, SSL *ssl,
+               int where, int ret)
+{
+	unsigned int max = ctx->opts->max_reneg;
+	unsigned int now;
+	int over;
+
+	if (where & SSL_CB_HANDSHAKE_DONE) {
+		this->hsdone = 1;
+		return;
+	}
+	if ((where & SSL_CB_WRITE_ALERT) &&
+	    (ret & 0xff) == SSL_AD_NO_RENEGOTIATION &&
+	    max && this->reneg >= max) {
+		pxy_conn_reneg_over(ctx, ssl);
+		return;
+	}
+	if (!(where & SSL_CB_HANDSHAKE_START) || !this->hsdone)
+		return;
+#ifdef TLS1_3_VERSION
+	/* no renegotiation in TLS 1.3 */
+	if (SSL_version(ssl) == TLS1_3_VERSION)
+		return;
+#endif /* TLS1_3_VERSION */
+	this->reneg++;
+	over = max && this->reneg > max;
+	if (this == &ctx->src && ctx->admit) {
+		now = time(NULL);
+		over |= admit_handshake(admit_global(ctx->admit),
+		                        &ctx->opts->admit_global, now);
+		over |= admit_handshake(&ctx->spec->admit_ctr,
+		                        &ctx->spec->admit, now);
+		over |= admit_handshake(ctx->admit_src,
+		                        &ctx->opts->admit_source, now);
+	}
+	if (over) {
+		pxy_conn_reneg_over(ctx, ssl);
+#ifdef SSL_OP_NO_RENEGOTIATION
+	} else if (max && this->reneg == max &&
+	           ctx->opts->reneg_action != OPTS_RENEG_LOG) {
+		/* refuse the next one before it costs a handshake */
+		SSL_set_options(ssl, SSL_OP_NO_RENEGOTIATION);
+#endif /* SSL_OP_NO_RENEGOTIATION */
+	}
+}
+
+/*
+ * Break up the src handshake for CPU time accounting and enforce the
+ * renegotiation limits.
+ */
+static void
+pxy_srcssl_info_cb(const SSL *ssl, int where, int ret)
+{
+	pxy_conn_ctx_t *ctx = SSL_get_app_data(ssl);
+
+	if (!ctx)
+		return;
+	if (WANT_CPU_ACCOUNTING(ctx))
+		pxy_cpu_leave(pxy_cpu_enter(ctx));
+	if (WANT_RENEG_LIMITS(ctx))
+		pxy_conn_reneg(ctx, &ctx->src, (SSL *)ssl, where, ret);
+}
+
 /*
  * Create new SSL context for the incoming connection, based on the original
  * destination SSL certificate.
@@ -993,18 +2972,20 @@ pxy_srcssl_create(pxy_conn_ctx_t *ctx, SSL *origssl)
 {
 	cert_t *cert;
 
-	cachemgr_dsess_set((struct sockaddr*)&ctx->dstaddr,
-	                   ctx->dstaddrlen, ctx->sni,
-	                   SSL_get0_session(origssl));
-
-	ctx->origcrt = SSL_get_peer_certificate(origssl);
+	if (!ctx->forged_async && !ctx->speculative) {
+		ctx->origcrt = SSL_get_peer_certificate(origssl);
+		if (ctx->origcrt && ctx->sni && ctx->opts->speculate)
+			cachemgr_sni_set(ctx->sni, ctx->origcrt);
 
-	if (OPTS_DEBUG(ctx->opts)) {
-		if (ctx->origcrt) {
-			log_dbg_printf("===> Original server certificate:\n");
-			pxy_debug_crt(ctx->origcrt);
-		} else {
-			log_dbg_printf("===> Original server has no cert!\n");
+		if (OPTS_DEBUG(ctx->opts)) {
+			if (ctx->origcrt) {
+				log_dbg_printf("===> Original server "
+				               "certificate:\n");
+				pxy_debug_crt(ctx->origcrt);
+			} else {
+				log_dbg_printf("===> Original server has no "
+				               "cert!\n");
+			}
 		}
 	}
 
@@ -1018,15 +2999,20 @@ pxy_srcssl_create(pxy_conn_ctx_t *ctx, SSL *origssl)
 	}
 
 	if (WANT_CONNECT_LOG(ctx)) {
-		ctx->ssl_names = ssl_x509_names_to_str(ctx->origcrt ?
+		const ssl_x509_memo_t *memo = NULL;
+
+		if (ctx->generated_cert && cert->crt)
+			memo = ssl_x509_memo_get(cert->crt);
+		ctx->ssl_names = memo ? strdup(memo->orignames) :
+		                 ssl_x509_names_to_str(ctx->origcrt ?
 		                                       ctx->origcrt :
 		                                       cert->crt);
 		if (!ctx->ssl_names)
 			ctx->enomem = 1;
 	}
 
-	SSL_CTX *sslctx = pxy_srcsslctx_create(ctx, cert->crt, cert->chain,
-	                                       cert->key);
+	SSL_CTX *sslctx = pxy_srcsslctx_get(ctx, cert->crt, cert->chain,
+	                                    cert->key);
 	cert_free(cert);
 	if (!sslctx)
 		return NULL;
@@ -1036,10 +3022,18 @@ pxy_srcssl_create(pxy_conn_ctx_t *ctx, SSL *origssl)
 		ctx->enomem = 1;
 		return NULL;
 	}
+	SSL_set_app_data(ssl, ctx);
+	if (WANT_CPU_ACCOUNTING(ctx) || WANT_RENEG_LIMITS(ctx))
+		SSL_set_info_callback(ssl, pxy_srcssl_info_cb);
 #ifdef SSL_MODE_RELEASE_BUFFERS
 	/* lower memory footprint for idle connections */
 	SSL_set_mode(ssl, SSL_get_mode(ssl) | SSL_MODE_RELEASE_BUFFERS);
 #endif /* SSL_MODE_RELEASE_BUFFERS */
+	if (ctx->chbuf && pxy_srcssl_setbio(ctx, ssl) == -1) {
+		SSL_free(ssl);
+		ctx->enomem = 1;
+		return NULL;
+	}
 	return ssl;
 }
 
@@ -1054,9 +3048,9 @@ pxy_srcssl_create(pxy_conn_ctx_t *ctx, SSL *origssl)
  * indicate to it.
  */
 static int
-pxy_ossl_servername_cb(SSL *ssl, UNUSED int *al, void *arg)
+pxy_ossl_servername_cb(SSL *ssl, UNUSED int *al, UNUSED void *arg)
 {
-	pxy_conn_ctx_t *ctx = arg;
+	pxy_conn_ctx_t *ctx = SSL_get_app_data(ssl);
 	const char *sn;
 	X509 *sslcrt;
 
@@ -1104,14 +3098,13 @@ pxy_ossl_servername_cb(SSL *ssl, UNUSED int *al, void *arg)
 			log_dbg_printf("Certificate cache: UPDATE "
 			               "(SNI mismatch)\n");
 		}
-		newcrt = ssl_x509_forge(ctx->opts->cacrt, ctx->opts->cakey,
-		                        sslcrt, ctx->opts->leafkey,
-		                        sn, ctx->opts->leafcrlurl);
+		newcrt = pxy_srccert_forge(ctx, sslcrt,
+		                           pxy_srccert_crtkey(ctx, sslcrt), sn);
 		if (!newcrt) {
 			ctx->enomem = 1;
 			return SSL_TLSEXT_ERR_NOACK;
 		}
-		cachemgr_fkcrt_set(ctx->origcrt, newcrt);
+		pxy_srccert_cache(ctx, newcrt);
 		ctx->generated_cert = 1;
 		if (OPTS_DEBUG(ctx->opts)) {
 			log_dbg_printf("===> Updated forged server "
@@ -1137,9 +3130,9 @@ pxy_ossl_servername_cb(SSL *ssl, UNUSED int *al, void *arg)
 			}
 		}
 
-		newsslctx = pxy_srcsslctx_create(ctx, newcrt,
-		                                 ctx->opts->cachain,
-		                                 ctx->opts->leafkey);
+		newsslctx = pxy_srcsslctx_get(ctx, newcrt,
+		                              pxy_srccert_cachain(ctx),
+		                              pxy_srccert_crtkey(ctx, newcrt));
 		if (!newsslctx) {
 			X509_free(newcrt);
 			return SSL_TLSEXT_ERR_NOACK;
@@ -1154,105 +3147,383 @@ pxy_ossl_servername_cb(SSL *ssl, UNUSED int *al, void *arg)
 
 	return SSL_TLSEXT_ERR_OK;
 }
+
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+/*
+ * OpenSSL ALPN callback, called when OpenSSL receives an ALPN TLS extension
+ * in the ClientHello of the client.  The client's offer was passed on to the
+ * server, so select whatever protocol the server selected, which lets the
+ * client and server use HTTP/2 through the proxy.  If the server did not
+ * select a protocol, do not select one either.
+ */
+static int
+pxy_ossl_alpn_select_cb(SSL *ssl, const unsigned char **out,
+                        unsigned char *outlen, const unsigned char *in,
+                        unsigned int inlen, UNUSED void *arg)
+{
+	pxy_conn_ctx_t *ctx = SSL_get_app_data(ssl);
+	const unsigned char *proto, *p;
+	unsigned int protolen;
+
+	if (!ctx->dst.ssl)
+		return SSL_TLSEXT_ERR_NOACK;
+	SSL_get0_alpn_selected(ctx->dst.ssl, &proto, &protolen);
+	if (!protolen)
+		return SSL_TLSEXT_ERR_NOACK;
+	p = ssl_alpn_find(in, inlen, proto, protolen);
+	if (!p)
+		return SSL_TLSEXT_ERR_NOACK;
+	if (OPTS_DEBUG(ctx->opts)) {
+		log_dbg_printf("ALPN: [%.*s]\n", (int)protolen, proto);
+	}
+	*out = p + 1;
+	*outlen = p[0];
+	return SSL_TLSEXT_ERR_OK;
+}
+#endif /* OPENSSL_VERSION_NUMBER >= 0x10002000L */
+
+/*
+ * OpenSSL certificate status callback, called when the client requested a
+ * stapled OCSP response.  With OCSPStapling, staple the cached response for
+ * the forged certificate.  Missing responses and responses due for renewal
+ * are signed by the forging threads in the background, or right away if
+ * there are none, such that a missing response does not delay the handshake.
+ */
+static int
+pxy_ossl_status_cb(SSL *ssl, UNUSED void *arg)
+{
+	pxy_conn_ctx_t *ctx = SSL_get_app_data(ssl);
+	pxy_forge_ctx_t *forge;
+	cacheocsp_val_t *val;
+	unsigned char *der;
+	X509 *crt;
+
+	if (!ctx || !ctx->opts->ocsp_staple || !ctx->generated_cert ||
+	    !(crt = SSL_get_certificate(ssl)))
+		return SSL_TLSEXT_ERR_NOACK;
+	val = cachemgr_ocsp_get(crt);
+	if (!val || val->refresh <= time(NULL)) {
+		forge = pxy_thrmgr_get_forge(ctx->thrmgr);
+		if ((!forge || pxy_forge_staple_submit(forge, ctx->opts, crt,
+		                                       ctx->ecdsa) == -1) &&
+		    !val && pxy_forge_staple(ctx->opts, crt, ctx->ecdsa) == 0) {
+			val = cachemgr_ocsp_get(crt);
+		}
+	}
+	if (!val)
+		return SSL_TLSEXT_ERR_NOACK;
+	/* OpenSSL takes ownership of der */
+	if (!(der = OPENSSL_malloc(val->sz))) {
+		free(val);
+		return SSL_TLSEXT_ERR_NOACK;
+	}
+	memcpy(der, val->der, val->sz);
+	SSL_set_tlsext_status_ocsp_resp(ssl, der, val->sz);
+	if (OPTS_DEBUG(ctx->opts)) {
+		log_dbg_printf("Stapled OCSP response (%zu bytes)\n", val->sz);
+	}
+	free(val);
+	return SSL_TLSEXT_ERR_OK;
+}
 #endif /* !OPENSSL_NO_TLSEXT */
 
 /*
- * Create new SSL context for outgoing connections to the original destination.
- * If hostname sni is provided, use it for Server Name Indication.
+ * Called by OpenSSL when a new dst session was established or, with TLS 1.3,
+ * when a session ticket arrived from the server after the handshake.  We
+ * cache every one of them, so that later connections to the same server can
+ * resume.  Returns 0 as the cache takes its own reference.
  */
-static SSL *
-pxy_dstssl_create(pxy_conn_ctx_t *ctx)
+static int
+pxy_ossl_dstsessnew_cb(SSL *ssl, SSL_SESSION *sess)
 {
-	SSL_CTX *sslctx;
-	SSL *ssl;
-	SSL_SESSION *sess;
+	pxy_conn_ctx_t *ctx = SSL_get_app_data(ssl);
 
-	sslctx = SSL_CTX_new(ctx->opts->sslmethod());
-	if (!sslctx) {
-		ctx->enomem = 1;
+#ifdef DEBUG_SESSION_CACHE
+	log_dbg_printf("===> OpenSSL new dst session callback:\n");
+	log_dbg_print_free(ssl_session_to_str(sess));
+#endif /* DEBUG_SESSION_CACHE */
+	if (!ctx)
+		return 0;
+	cachemgr_dsess_set((struct sockaddr *)&ctx->dstaddr, ctx->dstaddrlen,
+	                   ctx->sni, sess);
+	cachemgr_dsess_share((struct sockaddr *)&ctx->dstaddr, ctx->dstaddrlen,
+	                     ctx->sni, sess);
+	return 0;
+}
+
+/*
+ * Set up sslctx for outgoing connections to the original destination,
+ * including the client certificate and key if configured.
+ * Returns sslctx, or NULL after freeing it on failure or if it is NULL.
+ */
+static SSL_CTX *
+pxy_dstsslctx_setup(SSL_CTX *sslctx, opts_t *opts)
+{
+	if (!sslctx)
 		return NULL;
-	}
 
-	pxy_sslctx_setoptions(sslctx, ctx);
+	pxy_sslctx_setoptions(sslctx, opts);
 
 #if (OPENSSL_VERSION_NUMBER >= 0x10100000L) && !defined(LIBRESSL_VERSION_NUMBER)
-	if (ctx->opts->sslversion) {
-		if (SSL_CTX_set_min_proto_version(sslctx, ctx->opts->sslversion) == 0 ||
-			SSL_CTX_set_max_proto_version(sslctx, ctx->opts->sslversion) == 0) {
+	if (opts->sslversion) {
+		if (SSL_CTX_set_min_proto_version(sslctx, opts->sslversion) == 0 ||
+			SSL_CTX_set_max_proto_version(sslctx, opts->sslversion) == 0) {
 			SSL_CTX_free(sslctx);
 			return NULL;
 		}
 	}
 #endif /* OPENSSL_VERSION_NUMBER >= 0x10100000L */
 
-	if (ctx->opts->verify_peer) {
+	if (opts->verify_peer) {
 		SSL_CTX_set_verify(sslctx, SSL_VERIFY_PEER, NULL);
+		SSL_CTX_set_cert_verify_callback(sslctx, pxy_ossl_verify_cb,
+		                                 opts);
 		SSL_CTX_set_default_verify_paths(sslctx);
 	} else {
 		SSL_CTX_set_verify(sslctx, SSL_VERIFY_NONE, NULL);
 	}
 
-	if (ctx->opts->clientcrt &&
-	    (SSL_CTX_use_certificate(sslctx, ctx->opts->clientcrt) != 1)) {
+	/* sessions are cached in cachemgr_dsess, see pxy_dstssl_create() */
+	SSL_CTX_set_session_cache_mode(sslctx, SSL_SESS_CACHE_CLIENT |
+	                                       SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(sslctx, pxy_ossl_dstsessnew_cb);
+
+	if (opts->clientcrt &&
+	    (SSL_CTX_use_certificate(sslctx, opts->clientcrt) != 1)) {
 		log_dbg_printf("loading dst client certificate failed\n");
 		SSL_CTX_free(sslctx);
 		return NULL;
 	}
-	if (ctx->opts->clientkey &&
-	    (SSL_CTX_use_PrivateKey(sslctx, ctx->opts->clientkey) != 1)) {
+	if (opts->clientkey &&
+	    (SSL_CTX_use_PrivateKey(sslctx, opts->clientkey) != 1)) {
 		log_dbg_printf("loading dst client key failed\n");
 		SSL_CTX_free(sslctx);
 		return NULL;
 	}
 
-	ssl = SSL_new(sslctx);
-	SSL_CTX_free(sslctx); /* SSL_new() increments refcount */
-	if (!ssl) {
-		ctx->enomem = 1;
-		return NULL;
-	}
-#ifndef OPENSSL_NO_TLSEXT
-	if (ctx->sni) {
-		SSL_set_tlsext_host_name(ssl, ctx->sni);
-	}
-#endif /* !OPENSSL_NO_TLSEXT */
+	return sslctx;
+}
 
-#ifdef SSL_MODE_RELEASE_BUFFERS
-	/* lower memory footprint for idle connections */
-	SSL_set_mode(ssl, SSL_get_mode(ssl) | SSL_MODE_RELEASE_BUFFERS);
-#endif /* SSL_MODE_RELEASE_BUFFERS */
+/*
+ * Create and set up a new SSL_CTX for outgoing connections to the original
+ * destination.  Called once per configuration at startup and reload; the
+ * SSL_CTX is shared by all connections of all proxyspecs and must not be
+ * modified afterwards.
+ * Returned SSL_CTX must be freed by the caller using SSL_CTX_free().
+ */
+SSL_CTX *
+pxy_dstsslctx_new(opts_t *opts)
+{
+	return pxy_dstsslctx_setup(SSL_CTX_new(opts->sslmethod()), opts);
+}
 
-	/* session resuming based on remote endpoint address and port */
-	sess = cachemgr_dsess_get((struct sockaddr *)&ctx->dstaddr,
-	                          ctx->dstaddrlen, ctx->sni);
-	if (sess) {
-		if (OPTS_DEBUG(ctx->opts)) {
-			log_dbg_printf("Attempt reuse dst SSL session\n");
-		}
-		SSL_set_session(ssl, sess); /* increments sess refcount */
-		SSL_SESSION_free(sess);
-	}
+/*
+ * Return the SSL_CTX for outgoing connections of ctx: the one shared by all
+ * proxyspecs, or with WorkerLibCtx, the one of the connection's thread,
+ * created from the thread's library context on first use for the current
+ * configuration.
+ */
+static SSL_CTX *
+pxy_dstsslctx_get(pxy_conn_ctx_t *ctx)
+{
+#ifdef HAVE_LIBCTX
+	SSL_CTX *sslctx;
 
-	return ssl;
+	if (!ctx->opts->worker_libctx)
+		return ctx->spec->dstsslctx;
+	sslctx = pxy_thrmgr_get_dstsslctx(ctx->thrmgr, ctx->thridx,
+	                                  ctx->opts);
+	if (sslctx)
+		return sslctx;
+	sslctx = pxy_dstsslctx_setup(pxy_sslctx_new(ctx), ctx->opts);
+	if (!sslctx)
+		return NULL;
+	pxy_thrmgr_set_dstsslctx(ctx->thrmgr, ctx->thridx, ctx->opts,
+	                         sslctx);
+	return sslctx;
+#else /* !HAVE_LIBCTX */
+	return ctx->spec->dstsslctx;
+#endif /* !HAVE_LIBCTX */
 }
 
 /*
- * Free bufferenvent and close underlying socket properly.
- * For OpenSSL bufferevents, this will shutdown the SSL connection.
+ * The upstream TLS handshake starts once the TCP connect has completed,
+ * which ends the upstream connect phase.  Also enforces the renegotiation
+ * limits on renegotiations requested by the server.
  */
 static void
-bufferevent_free_and_close_fd(struct bufferevent *bev, pxy_conn_ctx_t *ctx)
+pxy_dstssl_info_cb(const SSL *ssl, int where, int ret)
 {
-	struct bufferevent *ubev;
-	evutil_socket_t fd;
-	SSL *ssl;
+	pxy_conn_ctx_t *ctx;
 
-#ifdef DEBUG_PROXY
-	if (OPTS_DEBUG(ctx->opts)) {
-		log_dbg_printf("            %p free_and_close_fd\n",
-		               (void*)bev);
+	ctx = SSL_get_app_data(ssl);
+	if (ctx && WANT_CPU_ACCOUNTING(ctx))
+		pxy_cpu_leave(pxy_cpu_enter(ctx));
+	if (ctx && WANT_RENEG_LIMITS(ctx))
+		pxy_conn_reneg(ctx, &ctx->dst, (SSL *)ssl, where, ret);
+	if (!(where & SSL_CB_HANDSHAKE_START))
+		return;
+	if (ctx && !ctx->dst_tcp) {
+		ctx->dst_tcp = 1;
+		pxy_conn_phase(ctx, STATS_PHASE_CONNECT);
+		if (ctx->opts->connectlog_tcpinfo)
+			pxy_conn_tcpinfo(&ctx->dst, &ctx->tcpi_connect);
 	}
-#endif /* DEBUG_PROXY */
+}
+
+/*
+ * Look up a dst SSL session to resume for the remote endpoint address, port
+ * and SNI.  Sessions taken from the cache may be single-use, so the caller
+ * owns the returned reference.
+ */
+static SSL_SESSION *
+pxy_dstsess_get(pxy_conn_ctx_t *ctx)
+{
+	SSL_SESSION *sess;
+
+	sess = cachemgr_dsess_get((struct sockaddr *)&ctx->dstaddr,
+	                          ctx->dstaddrlen, ctx->sni);
+	if (!sess) {
+		sess = cachemgr_dsess_shared_get(
+		       (struct sockaddr *)&ctx->dstaddr,
+		       ctx->dstaddrlen, ctx->sni);
+	}
+	return sess;
+}
+
+/*
+ * Create new SSL instance for outgoing connections to the original destination.
+ * If hostname sni is provided, use it for Server Name Indication.
+ */
+static SSL *
+pxy_dstssl_create(pxy_conn_ctx_t *ctx)
+{
+	SSL_CTX *sslctx;
+	SSL *ssl;
+	SSL_SESSION *sess;
+
+	if (!(sslctx = pxy_dstsslctx_get(ctx))) {
+		ctx->enomem = 1;
+		return NULL;
+	}
+	ssl = pxy_thrmgr_sslpool_get(ctx->thrmgr, ctx->thridx, sslctx);
+	if (!ssl)
+		ssl = SSL_new(sslctx);
+	if (!ssl) {
+		ctx->enomem = 1;
+		return NULL;
+	}
+	SSL_set_app_data(ssl, ctx);
+	SSL_set_info_callback(ssl, pxy_dstssl_info_cb);
+#ifndef OPENSSL_NO_TLSEXT
+	if (ctx->sni) {
+		SSL_set_tlsext_host_name(ssl, ctx->sni);
+	}
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+	if (ctx->alpn) {
+		SSL_set_alpn_protos(ssl, ctx->alpn, ctx->alpnlen);
+	}
+#endif /* OPENSSL_VERSION_NUMBER >= 0x10002000L */
+#endif /* !OPENSSL_NO_TLSEXT */
+
+#ifdef SSL_MODE_RELEASE_BUFFERS
+	/* lower memory footprint for idle connections */
+	SSL_set_mode(ssl, SSL_get_mode(ssl) | SSL_MODE_RELEASE_BUFFERS);
+#endif /* SSL_MODE_RELEASE_BUFFERS */
+
+	/* prefer the same bulk cipher as the client on both legs */
+	if (WANT_CHACHA_DST(ctx)) {
+		SSL_set_cipher_list(ssl, ctx->opts->ciphers_chacha);
+#ifdef TLS1_3_VERSION
+		SSL_set_ciphersuites(ssl, PXY_TLS13_CHACHA_FIRST);
+#endif /* TLS1_3_VERSION */
+	}
+
+	/* session resuming based on remote endpoint address and port */
+	if (ctx->dstsess) {
+		sess = ctx->dstsess;
+		ctx->dstsess = NULL;
+	} else {
+		sess = pxy_dstsess_get(ctx);
+	}
+	if (sess) {
+		if (OPTS_DEBUG(ctx->opts)) {
+			log_dbg_printf("Attempt reuse dst SSL session\n");
+		}
+		SSL_set_session(ssl, sess); /* increments sess refcount */
+		SSL_SESSION_free(sess);
+	}
+
+	return ssl;
+}
+
+/*
+ * Reset an outgoing SSL instance after its connection has been shut down and
+ * return it to the SSL pool of the connection handling thread, such that the
+ * next connection of the thread does not need to SSL_new() one.  Drops the
+ * BIOs, the session and all per-connection settings.
+ * Returns 0 if the pool took ownership of ssl, -1 if the caller needs to free
+ * it instead.
+ */
+static int
+pxy_dstssl_recycle(pxy_conn_ctx_t *ctx, SSL *ssl)
+{
+	/* per-connection cipher order is not reset by SSL_clear() */
+	if (WANT_CHACHA_DST(ctx))
+		return -1;
+	SSL_set_bio(ssl, NULL, NULL);
+	if (!SSL_clear(ssl))
+		return -1;
+	/* SSL_clear() keeps a good session for the same peer */
+	SSL_set_session(ssl, NULL);
+	SSL_set_app_data(ssl, NULL);
+	SSL_set_info_callback(ssl, NULL);
+#ifndef OPENSSL_NO_TLSEXT
+	SSL_set_tlsext_host_name(ssl, NULL);
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+	SSL_set_alpn_protos(ssl, NULL, 0);
+#endif /* OPENSSL_VERSION_NUMBER >= 0x10002000L */
+#endif /* !OPENSSL_NO_TLSEXT */
+	return pxy_thrmgr_sslpool_put(ctx->thrmgr, ctx->thridx, ssl);
+}
+
+/*
+ * Account a TCP_INFO sample of socket fd of leg of a connection being closed
+ * to its destination, with StatsTCPInfoTop.
+ */
+static void
+pxy_conn_tcpinfo_stats(pxy_conn_ctx_t *ctx, int leg, evutil_socket_t fd)
+{
+	char dst[INET6_ADDRSTRLEN + 9];
+	sys_tcpinfo_t ti;
+
+	if (sys_tcpinfo(fd, &ti) == -1)
+		return;
+	pxy_conn_dststr(ctx, dst, sizeof(dst));
+	stats_tcp(dst, leg, ti.rtt, ti.retrans);
+}
+
+/*
+ * Free bufferenvent and close underlying socket properly.
+ * For OpenSSL bufferevents, this will shutdown the SSL connection.
+ */
+static void
+bufferevent_free_and_close_fd(struct bufferevent *bev, pxy_conn_ctx_t *ctx)
+{
+	struct bufferevent *ubev;
+	evutil_socket_t fd;
+	SSL *ssl;
+#ifdef HAVE_ZEROCOPY
+	pxy_conn_desc_t *desc;
+	pxy_zc_t *zc = NULL;
+#endif /* HAVE_ZEROCOPY */
+
+#ifdef DEBUG_PROXY
+	if (OPTS_DEBUG(ctx->opts)) {
+		log_dbg_printf("            %p free_and_close_fd\n",
+		               (void*)bev);
+	}
+#endif /* DEBUG_PROXY */
 
 	ubev = bufferevent_get_underlying(bev);
 	ssl = bufferevent_openssl_get_ssl(bev); /* does not inc refc */
@@ -1262,6 +3533,18 @@ bufferevent_free_and_close_fd(struct bufferevent *bev, pxy_conn_ctx_t *ctx)
 	} else {
 		fd = bufferevent_getfd(bev);
 	}
+	if (ctx->opts->stats_tcptop && fd >= 0 &&
+	    (bev == ctx->src.bev || bev == ctx->dst.bev))
+		pxy_conn_tcpinfo_stats(ctx, bev == ctx->src.bev ?
+		                            STATS_LEG_SRC : STATS_LEG_DST, fd);
+#ifdef HAVE_ZEROCOPY
+	desc = (bev == ctx->src.bev) ? &ctx->src :
+	       (bev == ctx->dst.bev) ? &ctx->dst : NULL;
+	if (desc) {
+		zc = desc->zc;
+		desc->zc = NULL;
+	}
+#endif /* HAVE_ZEROCOPY */
 	bufferevent_setcb(bev, NULL, NULL, NULL, NULL);
 
 	if (ssl) {
@@ -1278,8 +3561,9 @@ bufferevent_free_and_close_fd(struct bufferevent *bev, pxy_conn_ctx_t *ctx)
 		 * is not ready for writing, in which case this hack will lead
 		 * to an unclean shutdown and lost session on the other end.
 		 *
-		 * Note that in the case of autossl, the SSL object operates on
-		 * a BIO wrapper around the underlying bufferevent.
+		 * Note that if autossl had to stack the dst SSL bufferevent on
+		 * the plain one, the SSL object operates on a BIO wrapper
+		 * around the underlying bufferevent.
 		 */
 		SSL_set_shutdown(ssl, SSL_RECEIVED_SHUTDOWN);
 		SSL_shutdown(ssl);
@@ -1299,8 +3583,13 @@ bufferevent_free_and_close_fd(struct bufferevent *bev, pxy_conn_ctx_t *ctx)
 			log_dbg_print_free(ssl_ssl_state_to_str(ssl));
 			log_dbg_printf("\n");
 		}
-		SSL_free(ssl);
+		if (ssl != ctx->dst.ssl || pxy_dstssl_recycle(ctx, ssl) == -1)
+			SSL_free(ssl);
 	}
+#ifdef HAVE_ZEROCOPY
+	if (zc)
+		fd = pxy_zc_close(zc, fd);
+#endif /* HAVE_ZEROCOPY */
 	/* bufferevent_getfd() returns -1 if no file descriptor is associated
 	 * with the bufferevent */
 	if (fd >= 0)
@@ -1312,25 +3601,41 @@ bufferevent_free_and_close_fd(struct bufferevent *bev, pxy_conn_ctx_t *ctx)
  * optionally with or without SSL.  Sets all callbacks, enables read
  * and write events, but does not call bufferevent_socket_connect().
  *
- * For dst connections, pass -1 as fd.  Pass a pointer to an initialized
- * SSL struct as ssl if the connection should use SSL.
+ * For dst connections, pass -1 as fd, or a connected socket taken from the
+ * pre-connect pool.  Pass a pointer to an initialized SSL struct as ssl if the
+ * connection should use SSL.
+ *
+ * The bufferevents are created thread-safe, because connections are set up
+ * from the listener thread while the event base belongs to a worker thread;
+ * without locking, the worker can handle the write event of a connecting
+ * socket before libevent has marked the bufferevent as connecting, which
+ * loses the connect event and stalls the connection.
+ *
+ * With traffic shaping, the bufferevent joins the rate limit group of the
+ * proxyspec on the connection's thread, so that all connections of the
+ * proxyspec on that thread share the rate in each direction.
+ *
+ * The SSL connection is in the given state, BUFFEREVENT_SSL_OPEN for an SSL
+ * connection already set up.
  *
  * Returns pointer to initialized bufferevent structure, as returned
  * by bufferevent_socket_new() or bufferevent_openssl_socket_new().
  */
 static struct bufferevent *
-pxy_bufferevent_setup(pxy_conn_ctx_t *ctx, evutil_socket_t fd, SSL *ssl)
+pxy_bufferevent_setup_state(pxy_conn_ctx_t *ctx, evutil_socket_t fd,
+                            SSL *ssl, enum bufferevent_ssl_state state)
 {
+	struct bufferevent_rate_limit_group *group;
 	struct bufferevent *bev;
+	size_t rate;
 
 	if (ssl) {
 		bev = bufferevent_openssl_socket_new(ctx->evbase, fd, ssl,
-				((fd == -1) ? BUFFEREVENT_SSL_CONNECTING
-				           : BUFFEREVENT_SSL_ACCEPTING),
-				BEV_OPT_DEFER_CALLBACKS);
+				state,
+				BEV_OPT_DEFER_CALLBACKS|BEV_OPT_THREADSAFE);
 	} else {
 		bev = bufferevent_socket_new(ctx->evbase, fd,
-				BEV_OPT_DEFER_CALLBACKS);
+				BEV_OPT_DEFER_CALLBACKS|BEV_OPT_THREADSAFE);
 	}
 	if (!bev) {
 		log_err_printf("Error creating bufferevent socket\n");
@@ -1339,6 +3644,19 @@ pxy_bufferevent_setup(pxy_conn_ctx_t *ctx, evutil_socket_t fd, SSL *ssl)
 	if (ssl) {
 		bufferevent_openssl_set_allow_dirty_shutdown(bev, 1);
 	}
+	rate = pxy_conn_shape_rate(ctx);
+	if (rate) {
+		group = pxy_thrmgr_get_shape(ctx->thrmgr, ctx->thridx,
+		                             ctx->spec->idx, rate,
+		                             pxy_conn_shape_burst(ctx));
+		if (!group ||
+		    bufferevent_add_to_rate_limit_group(bev, group) == -1) {
+			log_err_printf("Error adding bufferevent to rate "
+			               "limit group\n");
+			bufferevent_free(bev);
+			return NULL;
+		}
+	}
 	bufferevent_setcb(bev, pxy_bev_readcb, pxy_bev_writecb,
 	                  pxy_bev_eventcb, ctx);
 	bufferevent_enable(bev, EV_READ|EV_WRITE);
@@ -1352,32 +3670,130 @@ pxy_bufferevent_setup(pxy_conn_ctx_t *ctx, evutil_socket_t fd, SSL *ssl)
 }
 
 /*
- * Filter a single line of HTTP request headers.
+ * Set up a bufferevent for a src or dst connection being set up; see
+ * pxy_bufferevent_setup_state().
+ */
+static struct bufferevent *
+pxy_bufferevent_setup(pxy_conn_ctx_t *ctx, evutil_socket_t fd, SSL *ssl)
+{
+	return pxy_bufferevent_setup_state(ctx, fd, ssl,
+	                                   (fd != ctx->fd) ?
+	                                   BUFFEREVENT_SSL_CONNECTING :
+	                                   BUFFEREVENT_SSL_ACCEPTING);
+}
+
+/*
+ * Work out once per http proxyspec which request and response header fields
+ * the header filters need to look at, given the options in effect.  Fields
+ * which are rewritten or removed are always needed; fields which are only
+ * parsed for logging or message framing are needed only if the respective
+ * feature is enabled.  All other lines are forwarded without further parsing.
+ */
+void
+pxy_http_hdrs_setup(proxyspec_t *spec, opts_t *opts)
+{
+	int connectlog = opts->connectlog || !opts->detach;
+
+	spec->httpreqhdrs = HTTPHDR_BIT(HTTPHDR_CONNECTION) |
+	                    HTTPHDR_BIT(HTTPHDR_UPGRADE) |
+	                    HTTPHDR_BIT(HTTPHDR_ACCEPT_ENCODING);
+	if (!opts->http_keepalive)
+		spec->httpreqhdrs |= HTTPHDR_BIT(HTTPHDR_KEEP_ALIVE);
+	if (connectlog)
+		spec->httpreqhdrs |= HTTPHDR_BIT(HTTPHDR_HOST);
+	if (opts->deny_ocsp)
+		spec->httpreqhdrs |= HTTPHDR_BIT(HTTPHDR_CONTENT_TYPE);
+	if (opts->http_keepalive)
+		spec->httpreqhdrs |= HTTPHDR_BIT(HTTPHDR_CONTENT_LENGTH) |
+		                     HTTPHDR_BIT(HTTPHDR_TRANSFER_ENCODING);
+
+	spec->httpresphdrs = HTTPHDR_BIT(HTTPHDR_PUBLIC_KEY_PINS) |
+	                     HTTPHDR_BIT(HTTPHDR_PUBLIC_KEY_PINS_REPORT_ONLY) |
+	                     HTTPHDR_BIT(HTTPHDR_STRICT_TRANSPORT_SECURITY) |
+	                     HTTPHDR_BIT(HTTPHDR_EXPECT_CT) |
+	                     HTTPHDR_BIT(HTTPHDR_ALTERNATE_PROTOCOL) |
+	                     HTTPHDR_BIT(HTTPHDR_UPGRADE);
+	if (connectlog)
+		spec->httpresphdrs |= HTTPHDR_BIT(HTTPHDR_CONTENT_LENGTH);
+	if (opts->http_keepalive || opts->http_compression)
+		spec->httpresphdrs |= HTTPHDR_BIT(HTTPHDR_CONTENT_LENGTH) |
+		                      HTTPHDR_BIT(HTTPHDR_TRANSFER_ENCODING);
+	if (opts->http_compression)
+		spec->httpresphdrs |= HTTPHDR_BIT(HTTPHDR_CONTENT_ENCODING);
+	if (opts->http_keepalive && opts->http_upstream_pool)
+		spec->httpresphdrs |= HTTPHDR_BIT(HTTPHDR_CONNECTION);
+	if (opts->http_keepalive && opts->http_cache_size && !spec->ssl) {
+		spec->httpreqhdrs |= HTTPHDR_BIT(HTTPHDR_HOST) |
+		                     HTTPHDR_BIT(HTTPHDR_AUTHORIZATION) |
+		                     HTTPHDR_BIT(HTTPHDR_CACHE_CONTROL) |
+		                     HTTPHDR_BIT(HTTPHDR_PRAGMA) |
+		                     HTTPHDR_BIT(HTTPHDR_RANGE) |
+		                     HTTPHDR_BIT(HTTPHDR_IF_NONE_MATCH);
+		spec->httpresphdrs |= HTTPHDR_BIT(HTTPHDR_CACHE_CONTROL) |
+		                      HTTPHDR_BIT(HTTPHDR_ETAG) |
+		                      HTTPHDR_BIT(HTTPHDR_AGE) |
+		                      HTTPHDR_BIT(HTTPHDR_VARY) |
+		                      HTTPHDR_BIT(HTTPHDR_SET_COOKIE);
+	}
+}
+
+/*
+ * Record the message framing indicated by a Content-Length or
+ * Transfer-Encoding header field for keep-alive.  A Content-Length that
+ * does not parse, or that conflicts with an earlier one, marks the framing
+ * invalid; chunked only counts as the final transfer coding.
+ */
+static void
+pxy_http_body_hdrline(pxy_http_body_t *body, httphdr_name_t name,
+                      const char *value, size_t valuesz)
+{
+	unsigned long long left;
+
+	if (name == HTTPHDR_CONTENT_LENGTH) {
+		if (httphdr_length(value, valuesz, &left) == -1 ||
+		    (body->length && left != body->left))
+			body->invalid = 1;
+		else
+			body->left = left;
+		body->length = 1;
+	} else if (name == HTTPHDR_TRANSFER_ENCODING) {
+		body->te = 1;
+		body->chunked = httphdr_last_token(value, valuesz, "chunked");
+	}
+}
+
+/*
+ * Filter a single line of HTTP request headers of sz bytes at line,
+ * excluding the line terminator.  The line is not NUL terminated.
  * Also fills in some context fields for logging.
  *
  * Returns NULL if the current line should be deleted from the request.
- * Returns a newly allocated string if the current line should be replaced.
+ * Returns a static string if the current line should be replaced.
  * Returns `line' if the line should be kept.
  */
-static char *
-pxy_http_reqhdr_filter_line(const char *line, pxy_conn_ctx_t *ctx)
+static const char *
+pxy_http_reqhdr_filter_line(const char *line, size_t sz,
+                            pxy_conn_ctx_t *ctx)
 {
 	/* parse information for connect log */
 	if (!ctx->http_method) {
 		/* first line */
-		char *space1, *space2;
-
-		space1 = strchr(line, ' ');
-		space2 = space1 ? strchr(space1 + 1, ' ') : NULL;
+		const char *space1, *space2;
+
+		space1 = memchr(line, ' ', sz);
+		space2 = space1 ? memchr(space1 + 1, ' ',
+		                         sz - (space1 + 1 - line)) : NULL;
+		/* only HTTP/1.1 is persistent by default */
+		if (!space2 || sz - (space2 + 1 - line) != 8 ||
+		    memcmp(space2 + 1, "HTTP/1.1", 8))
+			ctx->http_close = 1;
 		if (!space1) {
 			/* not HTTP */
 			ctx->seen_req_header = 1;
 		} else {
-			ctx->http_method = malloc(space1 - line + 1);
-			if (ctx->http_method) {
-				memcpy(ctx->http_method, line, space1 - line);
-				ctx->http_method[space1 - line] = '\0';
-			} else {
+			ctx->http_method = arena_strndup(&ctx->http_reqarena,
+			                                 line, space1 - line);
+			if (!ctx->http_method) {
 				ctx->enomem = 1;
 				return NULL;
 			}
@@ -1385,81 +3801,170 @@ pxy_http_reqhdr_filter_line(const char *line, pxy_conn_ctx_t *ctx)
 			if (!space2) {
 				/* HTTP/0.9 */
 				ctx->seen_req_header = 1;
-				space2 = space1 + strlen(space1);
+				space2 = line + sz;
 			}
-			ctx->http_uri = malloc(space2 - space1 + 1);
-			if (ctx->http_uri) {
-				memcpy(ctx->http_uri, space1, space2 - space1);
-				ctx->http_uri[space2 - space1] = '\0';
-			} else {
+			ctx->http_uri = arena_strndup(&ctx->http_reqarena,
+			                              space1, space2 - space1);
+			if (!ctx->http_uri) {
 				ctx->enomem = 1;
 				return NULL;
 			}
 		}
+	} else if (sz == 0) {
+		/* end of header */
+		ctx->seen_req_header = 1;
+		if (ctx->http_ws_upgrade && ctx->http_ws_conn)
+			return "Connection: Upgrade\r\n";
+		if (!ctx->sent_http_conn_close &&
+		    !ctx->opts->http_keepalive)
+			return "Connection: close\r\n";
+		if (ctx->http_ws_conn)
+			return "Connection: keep-alive\r\n";
 	} else {
 		/* not first line */
-		char *newhdr;
-
-		if (!ctx->http_host && !strncasecmp(line, "Host:", 5)) {
-			ctx->http_host = strdup(util_skipws(line + 5));
+		const char *value;
+		size_t valuesz;
+		httphdr_name_t name;
+
+		name = httphdr_parse(line, sz, &value, &valuesz);
+		if (!(ctx->spec->httpreqhdrs & HTTPHDR_BIT(name)))
+			return line;
+		if (ctx->opts->http_keepalive) {
+			pxy_http_body_hdrline(&ctx->http_reqbody, name,
+			                      value, valuesz);
+		}
+		switch (name) {
+		case HTTPHDR_HOST:
+			if (ctx->http_host)
+				break;
+			ctx->http_host = arena_strndup(&ctx->http_reqarena,
+			                               value, valuesz);
 			if (!ctx->http_host) {
 				ctx->enomem = 1;
 				return NULL;
 			}
-		} else if (!strncasecmp(line, "Content-Type:", 13)) {
-			ctx->http_content_type = strdup(util_skipws(line + 13));
+			break;
+		case HTTPHDR_CONTENT_TYPE:
+			ctx->http_content_type = arena_strndup(
+			                         &ctx->http_reqarena,
+			                         value, valuesz);
 			if (!ctx->http_content_type) {
 				ctx->enomem = 1;
 				return NULL;
 			}
-		/* Override Connection: keepalive and Connection: upgrade */
-		} else if (!strncasecmp(line, "Connection:", 11)) {
+			break;
+		/* Override Connection: keepalive and Connection: upgrade,
+		 * or only the latter in keep-alive mode; with WebSockets
+		 * enabled, Connection: upgrade is withheld until the end of
+		 * the header shows whether a WebSocket was asked for */
+		case HTTPHDR_CONNECTION:
+			if (ctx->opts->http_websocket &&
+			    httphdr_has_token(value, valuesz, "upgrade")) {
+				ctx->http_ws_conn = 1;
+				return NULL;
+			}
 			ctx->sent_http_conn_close = 1;
-			if (!(newhdr = strdup("Connection: close"))) {
+			if (!ctx->opts->http_keepalive)
+				return "Connection: close";
+			if (httphdr_has_token(value, valuesz, "close"))
+				ctx->http_close = 1;
+			if (!httphdr_has_token(value, valuesz, "upgrade"))
+				return line;
+			return "Connection: keep-alive";
+		/* Pass compression through if enabled, restricted to
+		 * the encodings the content log is able to decode;
+		 * suppress unsupported encodings otherwise */
+		case HTTPHDR_ACCEPT_ENCODING: {
+			int gzip, deflate;
+
+			if (!ctx->opts->http_compression)
+				return NULL;
+			if (!WANT_CONTENT_LOG(ctx))
+				return line;
+			gzip = httphdr_has_token(value, valuesz, "gzip");
+			deflate = httphdr_has_token(value, valuesz, "deflate");
+			if (!gzip && !deflate)
+				return NULL;
+			return !deflate ? "Accept-Encoding: gzip" :
+			       !gzip ? "Accept-Encoding: deflate" :
+			       "Accept-Encoding: gzip, deflate";
+		}
+		/* Suppress upgrading to SSL/TLS, HTTP/2 and, unless
+		 * enabled, WebSockets, and keep-alive unless enabled */
+		case HTTPHDR_UPGRADE:
+			if (!ctx->opts->http_websocket ||
+			    !httphdr_has_token(value, valuesz, "websocket"))
+				return NULL;
+			ctx->http_ws_upgrade = 1;
+			return "Upgrade: websocket";
+		case HTTPHDR_KEEP_ALIVE:
+			if (!ctx->opts->http_keepalive)
+				return NULL;
+			break;
+		/* only looked at for the response cache */
+		case HTTPHDR_AUTHORIZATION:
+			ctx->http_cache.auth = 1;
+			break;
+		case HTTPHDR_CACHE_CONTROL: {
+			unsigned long long n;
+
+			if (httphdr_has_token(value, valuesz, "no-store"))
+				ctx->http_cache.nostore = 1;
+			if (httphdr_has_token(value, valuesz, "no-cache") ||
+			    (httphdr_token_ull(value, valuesz, "max-age",
+			                       &n) == 0 && n == 0))
+				ctx->http_cache.noreuse = 1;
+			break;
+		}
+		case HTTPHDR_PRAGMA:
+			if (httphdr_has_token(value, valuesz, "no-cache"))
+				ctx->http_cache.noreuse = 1;
+			break;
+		case HTTPHDR_RANGE:
+			ctx->http_cache.noreuse = 1;
+			ctx->http_cache.nostore = 1;
+			break;
+		case HTTPHDR_IF_NONE_MATCH:
+			if (ctx->http_cache.inm)
+				break;
+			ctx->http_cache.inm = arena_strndup(
+			                      &ctx->http_reqarena,
+			                      value, valuesz);
+			if (!ctx->http_cache.inm) {
 				ctx->enomem = 1;
 				return NULL;
 			}
-			return newhdr;
-		/* Suppress upgrading to SSL/TLS, WebSockets or HTTP/2,
-		 * unsupported encodings, and keep-alive */
-		} else if (!strncasecmp(line, "Upgrade:", 8) ||
-		           !strncasecmp(line, "Accept-Encoding:", 16) ||
-		           !strncasecmp(line, "Keep-Alive:", 11)) {
-			return NULL;
-		} else if (line[0] == '\0') {
-			ctx->seen_req_header = 1;
-			if (!ctx->sent_http_conn_close) {
-				newhdr = strdup("Connection: close\r\n");
-				if (!newhdr) {
-					ctx->enomem = 1;
-					return NULL;
-				}
-				return newhdr;
-			}
+			break;
+		default:
+			break;
 		}
 	}
 
-	return (char*)line;
+	return line;
 }
 
 /*
- * Filter a single line of HTTP response headers.
+ * Filter a single line of HTTP response headers of sz bytes at line,
+ * excluding the line terminator.  The line is not NUL terminated.
  *
  * Returns NULL if the current line should be deleted from the response.
- * Returns a newly allocated string if the current line should be replaced.
  * Returns `line' if the line should be kept.
  */
-static char *
-pxy_http_resphdr_filter_line(const char *line, pxy_conn_ctx_t *ctx)
+static const char *
+pxy_http_resphdr_filter_line(const char *line, size_t sz,
+                             pxy_conn_ctx_t *ctx)
 {
 	/* parse information for connect log */
 	if (!ctx->http_status_code) {
 		/* first line */
-		char *space1, *space2;
-
-		space1 = strchr(line, ' ');
-		space2 = space1 ? strchr(space1 + 1, ' ') : NULL;
-		if (!space1 || !!strncmp(line, "HTTP", 4)) {
+		const char *space1, *space2;
+
+		space1 = memchr(line, ' ', sz);
+		space2 = space1 ? memchr(space1 + 1, ' ',
+		                         sz - (space1 + 1 - line)) : NULL;
+		if (sz < 8 || memcmp(line, "HTTP/1.1", 8))
+			ctx->http_close = 1;
+		if (!space1 || sz < 4 || !!strncmp(line, "HTTP", 4)) {
 			/* not HTTP or HTTP/0.9 */
 			ctx->seen_resp_header = 1;
 		} else {
@@ -1467,62 +3972,146 @@ pxy_http_resphdr_filter_line(const char *line, pxy_conn_ctx_t *ctx)
 
 			if (space2) {
 				len_code = space2 - space1 - 1;
-				len_text = strlen(space2 + 1);
+				len_text = sz - (space2 + 1 - line);
 			} else {
-				len_code = strlen(space1 + 1);
+				len_code = sz - (space1 + 1 - line);
 				len_text = 0;
 			}
-			ctx->http_status_code = malloc(len_code + 1);
-			ctx->http_status_text = malloc(len_text + 1);
+			ctx->http_status_code = arena_strndup(
+			                        &ctx->http_resparena,
+			                        space1 + 1, len_code);
+			ctx->http_status_text = arena_strndup(
+			                        &ctx->http_resparena,
+			                        space2 ? space2 + 1 : "",
+			                        len_text);
 			if (!ctx->http_status_code || !ctx->http_status_text) {
 				ctx->enomem = 1;
 				return NULL;
 			}
-			memcpy(ctx->http_status_code, space1 + 1, len_code);
-			ctx->http_status_code[len_code] = '\0';
-			if (space2) {
-				memcpy(ctx->http_status_text,
-				       space2 + 1, len_text);
-			}
-			ctx->http_status_text[len_text] = '\0';
 		}
+	} else if (sz == 0) {
+		/* end of header */
+		ctx->seen_resp_header = 1;
 	} else {
 		/* not first line */
-		if (!ctx->http_content_length &&
-		    !strncasecmp(line, "Content-Length:", 15)) {
-			ctx->http_content_length =
-				strdup(util_skipws(line + 15));
+		const char *value;
+		size_t valuesz;
+		httphdr_name_t name;
+
+		name = httphdr_parse(line, sz, &value, &valuesz);
+		if (!(ctx->spec->httpresphdrs & HTTPHDR_BIT(name)))
+			return line;
+		if (ctx->opts->http_keepalive ||
+		    ctx->opts->http_compression) {
+			pxy_http_body_hdrline(&ctx->http_respbody, name,
+			                      value, valuesz);
+		}
+		switch (name) {
+		/* Upgrade header
+		 * remove to prevent upgrading to HTTPS in unhandled ways,
+		 * and more importantly, HTTP/2; keep it on responses to
+		 * WebSocket upgrade requests let through */
+		case HTTPHDR_UPGRADE:
+			if (ctx->http_ws_upgrade)
+				break;
+			return NULL;
+		/* only looked at for the upstream keep-alive pool */
+		case HTTPHDR_CONNECTION:
+			if (httphdr_has_token(value, valuesz, "close"))
+				ctx->http_close = 1;
+			break;
+		case HTTPHDR_CONTENT_LENGTH:
+			if (ctx->http_content_length)
+				break;
+			ctx->http_content_length = arena_strndup(
+			                           &ctx->http_resparena,
+			                           value, valuesz);
 			if (!ctx->http_content_length) {
 				ctx->enomem = 1;
 				return NULL;
 			}
-		} else if (
-		    /* HPKP: Public Key Pinning Extension for HTTP
-		     * (draft-ietf-websec-key-pinning)
-		     * remove to prevent public key pinning */
-		    !strncasecmp(line, "Public-Key-Pins:", 16) ||
-		    !strncasecmp(line, "Public-Key-Pins-Report-Only:", 28) ||
-		    /* HSTS: HTTP Strict Transport Security (RFC 6797)
-		     * remove to allow users to accept bad certs */
-		    !strncasecmp(line, "Strict-Transport-Security:", 26) ||
-		    /* Expect-CT: Expect Certificate Transparency
-		     * (draft-ietf-httpbis-expect-ct-latest)
-		     * remove to prevent failed CT log lookups */
-		    !strncasecmp(line, "Expect-CT:", 10) ||
-		    /* Alternate Protocol
-		     * remove to prevent switching to QUIC, SPDY et al */
-		    !strncasecmp(line, "Alternate-Protocol:", 19) ||
-		    /* Upgrade header
-		     * remove to prevent upgrading to HTTPS in unhandled ways,
-		     * and more importantly, WebSockets and HTTP/2 */
-		    !strncasecmp(line, "Upgrade:", 8)) {
+			break;
+		case HTTPHDR_CONTENT_ENCODING:
+			if (!ctx->opts->http_compression)
+				break;
+			/* a single coding the content log can decode */
+			if (httphdr_equals(value, valuesz, "gzip") ||
+			    httphdr_equals(value, valuesz, "x-gzip") ||
+			    httphdr_equals(value, valuesz, "deflate"))
+				ctx->http_resp_decode = LBFLAG_INFLATE;
+			else
+				ctx->http_resp_decode = 0;
+			break;
+		/* HPKP: Public Key Pinning Extension for HTTP
+		 * (draft-ietf-websec-key-pinning)
+		 * remove to prevent public key pinning */
+		case HTTPHDR_PUBLIC_KEY_PINS:
+		case HTTPHDR_PUBLIC_KEY_PINS_REPORT_ONLY:
+		/* HSTS: HTTP Strict Transport Security (RFC 6797)
+		 * remove to allow users to accept bad certs */
+		case HTTPHDR_STRICT_TRANSPORT_SECURITY:
+		/* Expect-CT: Expect Certificate Transparency
+		 * (draft-ietf-httpbis-expect-ct-latest)
+		 * remove to prevent failed CT log lookups */
+		case HTTPHDR_EXPECT_CT:
+		/* Alternate Protocol
+		 * remove to prevent switching to QUIC, SPDY et al */
+		case HTTPHDR_ALTERNATE_PROTOCOL:
 			return NULL;
-		} else if (line[0] == '\0') {
-			ctx->seen_resp_header = 1;
+		/* only looked at for the response cache */
+		case HTTPHDR_CACHE_CONTROL: {
+			unsigned long long n;
+
+			if (httphdr_has_token(value, valuesz, "no-store") ||
+			    httphdr_has_token(value, valuesz, "no-cache") ||
+			    httphdr_has_token(value, valuesz, "private"))
+				ctx->http_cache.uncacheable = 1;
+			if (httphdr_token_ull(value, valuesz, "s-maxage",
+			                      &n) == 0) {
+				ctx->http_cache.maxage = n;
+				ctx->http_cache.fresh = 1;
+				ctx->http_cache.smaxage = 1;
+			} else if (!ctx->http_cache.smaxage &&
+			           httphdr_token_ull(value, valuesz, "max-age",
+			                             &n) == 0) {
+				ctx->http_cache.maxage = n;
+				ctx->http_cache.fresh = 1;
+			}
+			break;
+		}
+		case HTTPHDR_AGE:
+			if (httphdr_to_ull(value, valuesz,
+			                   &ctx->http_cache.age) == -1)
+				ctx->http_cache.uncacheable = 1;
+			break;
+		case HTTPHDR_ETAG:
+			if (ctx->http_cache.etag)
+				break;
+			ctx->http_cache.etag = arena_strndup(
+			                       &ctx->http_resparena,
+			                       value, valuesz);
+			if (!ctx->http_cache.etag) {
+				ctx->enomem = 1;
+				return NULL;
+			}
+			break;
+		/* requests are sent without Accept-Encoding unless
+		 * compression is enabled, all other variants are not
+		 * told apart by the cache key */
+		case HTTPHDR_VARY:
+			if (ctx->opts->http_compression ||
+			    !httphdr_equals(value, valuesz, "Accept-Encoding"))
+				ctx->http_cache.uncacheable = 1;
+			break;
+		case HTTPHDR_SET_COOKIE:
+			ctx->http_cache.uncacheable = 1;
+			break;
+		default:
+			break;
 		}
 	}
 
-	return (char*)line;
+	return line;
 }
 
 /*
@@ -1623,8 +4212,9 @@ deny:
 				if (log_content_submit(&ctx->logctx, lb,
 				                       1/*req*/) == -1) {
 					logbuf_free(lb);
-					log_err_printf("Warning: Content log "
-					               "submission failed\n");
+					log_err_rl_printf("Warning: Content "
+					                  "log submission "
+					                  "failed\n");
 				}
 			}
 		}
@@ -1642,80 +4232,266 @@ deny:
 			if (log_content_submit(&ctx->logctx, lb,
 			                       0/*resp*/) == -1) {
 				logbuf_free(lb);
-				log_err_printf("Warning: Content log "
-				               "submission failed\n");
+				log_err_rl_printf("Warning: Content log "
+				                  "submission failed\n");
 			}
 		}
 	}
 }
 
 /*
- * Peek into pending data to see if it is an SSL/TLS ClientHello, and if so,
- * upgrade the connection from plain TCP to SSL/TLS.
+ * Upper bound on the octets held back from forwarding while waiting for the
+ * rest of a truncated ClientHello candidate in autossl mode; one maximum
+ * size TLS record including its header.
+ */
+#define PXY_AUTOSSL_HOLDSZ (5 + 16384)
+
+/*
+ * Return the number of octets required to decide whether the truncated
+ * ClientHello candidate of sz octets at buf is a ClientHello, or 0 if the
+ * candidate exceeds PXY_AUTOSSL_HOLDSZ and can be ruled out.
+ */
+static size_t
+pxy_conn_autossl_need(const unsigned char *buf, size_t sz)
+{
+	size_t need;
+
+	if (buf[0] == 0x16) {
+		need = (sz < 5) ? 5 : 5 + ((buf[3] << 8) | buf[4]);
+	} else {
+		need = (sz < 2) ? 2 : 2 + buf[1];
+	}
+	if (need <= sz)
+		need = sz + 1;
+	return (need > PXY_AUTOSSL_HOLDSZ) ? 0 : need;
+}
+
+/*
+ * Replace the plain dst bufferevent of an autossl connection by an SSL
+ * bufferevent on the same socket, such that the upgraded connection is
+ * forwarded like on an SSL proxyspec.  What the server sent in plain text is
+ * passed on to src, and what was forwarded to the server in plain text ahead
+ * of the ClientHello is written out first.  Should the socket not take all of
+ * it right away, the SSL bufferevent is stacked as a filter on top of the
+ * plain one instead, which keeps the order of the octets.
+ * Returns -1 on failure, 0 on success.
+ */
+static int
+pxy_conn_autossl_dstbev(pxy_conn_ctx_t *ctx)
+{
+	struct bufferevent *bev = ctx->dst.bev;
+	struct evbuffer *outbuf = bufferevent_get_output(bev);
+	evutil_socket_t fd = bufferevent_getfd(bev);
+
+	while (evbuffer_get_length(outbuf) > 0 &&
+	       evbuffer_write(outbuf, fd) > 0);
+	if (evbuffer_get_length(outbuf) > 0) {
+		ctx->dst.bev = bufferevent_openssl_filter_new(
+		               ctx->evbase, bev, ctx->dst.ssl,
+		               BUFFEREVENT_SSL_CONNECTING,
+		               BEV_OPT_DEFER_CALLBACKS);
+		if (!ctx->dst.bev) {
+			ctx->dst.bev = bev;
+			return -1;
+		}
+		bufferevent_openssl_set_allow_dirty_shutdown(ctx->dst.bev, 1);
+		bufferevent_setcb(ctx->dst.bev, pxy_bev_readcb,
+		                  pxy_bev_writecb, pxy_bev_eventcb, ctx);
+		bufferevent_enable(ctx->dst.bev, EV_READ|EV_WRITE);
+		return 0;
+	}
+	if (evbuffer_add_buffer(bufferevent_get_output(ctx->src.bev),
+	                        bufferevent_get_input(bev)) == -1) {
+		ctx->enomem = 1;
+		return -1;
+	}
+	bufferevent_setcb(bev, NULL, NULL, NULL, NULL);
+	bufferevent_free(bev);
+	ctx->dst.bev = pxy_bufferevent_setup(ctx, fd, ctx->dst.ssl);
+	if (!ctx->dst.bev) {
+		/* no dst left to tear down, see pxy_conn_terminate_free() */
+		SSL_free(ctx->dst.ssl);
+		ctx->dst.ssl = NULL;
+		evutil_closesocket(fd);
+		ctx->enomem = 1;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Complete the upgrade of an autossl connection once dst has connected over
+ * SSL/TLS: replace the plain src bufferevent by an SSL bufferevent on the
+ * same socket, handing the octets src read so far, starting with the
+ * ClientHello, to the SSL object through a prefix BIO.  As for dst, what is
+ * left to be written to src in plain text is written out first, or the SSL
+ * bufferevent is stacked on the plain one if the socket does not take it.
+ * Returns -1 on failure, 0 on success.
+ */
+static int
+pxy_conn_autossl_srcbev(pxy_conn_ctx_t *ctx)
+{
+	struct bufferevent *bev = ctx->src.bev;
+	struct evbuffer *inbuf = bufferevent_get_input(bev);
+	struct evbuffer *outbuf = bufferevent_get_output(bev);
+	size_t len = evbuffer_get_length(inbuf);
+
+	if (OPTS_DEBUG(ctx->opts)) {
+		log_dbg_printf("Completing autossl upgrade\n");
+	}
+	while (evbuffer_get_length(outbuf) > 0 &&
+	       evbuffer_write(outbuf, ctx->fd) > 0);
+	if (evbuffer_get_length(outbuf) > 0) {
+		bufferevent_enable(bev, EV_READ);
+		ctx->src.bev = bufferevent_openssl_filter_new(
+		               ctx->evbase, bev, ctx->src.ssl,
+		               BUFFEREVENT_SSL_ACCEPTING,
+		               BEV_OPT_DEFER_CALLBACKS);
+		if (!ctx->src.bev) {
+			ctx->src.bev = bev;
+			return -1;
+		}
+		bufferevent_openssl_set_allow_dirty_shutdown(ctx->src.bev, 1);
+		bufferevent_setcb(ctx->src.bev, pxy_bev_readcb,
+		                  pxy_bev_writecb, pxy_bev_eventcb, ctx);
+		bufferevent_enable(ctx->src.bev, EV_READ|EV_WRITE);
+		return 0;
+	}
+	ctx->chbuf = malloc(len ? len : 1);
+	if (!ctx->chbuf ||
+	    evbuffer_remove(inbuf, ctx->chbuf, len) != (int)len) {
+		ctx->enomem = 1;
+		return -1;
+	}
+	ctx->chlen = ctx->chsz = len;
+	bufferevent_setcb(bev, NULL, NULL, NULL, NULL);
+	bufferevent_free(bev);
+	ctx->src.bev = NULL;
+	if (pxy_srcssl_setbio(ctx, ctx->src.ssl) == -1)
+		return -1;
+	ctx->src.bev = pxy_bufferevent_setup(ctx, ctx->fd, ctx->src.ssl);
+	return ctx->src.bev ? 0 : -1;
+}
+
+/*
+ * Scan pending src data for the start of an SSL/TLS ClientHello, and if one
+ * is found, upgrade the connection from plain TCP to SSL/TLS.
+ *
+ * Octets preceding a candidate are forwarded in plain text as soon as the
+ * candidate is found, and octets without a candidate are scanned once and
+ * left for the caller to forward, so no octet is scanned twice across read
+ * callbacks.  A truncated candidate is held back from forwarding
+ * (ctx->chhold) until ctx->chneed octets are available, then reparsed; the
+ * caller must not forward held octets.
  *
  * Return 1 if ClientHello was found and connection was upgraded to SSL/TLS,
  * 0 otherwise.
  *
  * WARNING: This is experimental code and will need to be improved.
- *
- * TODO - enable search and skip bytes before ClientHello in case it does not
- *        start at offset 0 (i.e. chello > vec_out[0].iov_base)
- * TODO - peek into more than just the current segment
- * TODO - add retry mechanism for short truncated ClientHello, possibly generic
  */
 int
 pxy_conn_autossl_peek_and_upgrade(pxy_conn_ctx_t *ctx)
 {
 	struct evbuffer *inbuf;
-	struct evbuffer_iovec vec_out[1];
-	const unsigned char *chello;
+	struct evbuffer_ptr ptr;
+	struct evbuffer_iovec vec;
+	const unsigned char *chello, *p;
+	unsigned char *buf;
+	size_t len, off, sz, need, i;
+
+	inbuf = bufferevent_get_input(ctx->src.bev);
+	len = evbuffer_get_length(inbuf);
+	if (ctx->chhold && len < ctx->chneed) {
+		ctx->chhold = len;
+		return 0;
+	}
 	if (OPTS_DEBUG(ctx->opts)) {
 		log_dbg_printf("Checking for a client hello\n");
 	}
-	/* peek the buffer */
-	inbuf = bufferevent_get_input(ctx->src.bev);
-	if (evbuffer_peek(inbuf, 1024, 0, vec_out, 1)) {
-		if (ssl_tls_clienthello_parse(vec_out[0].iov_base,
-		                              vec_out[0].iov_len,
-		                              0, &chello, &ctx->sni) == 0) {
-			if (OPTS_DEBUG(ctx->opts)) {
-				log_dbg_printf("Peek found ClientHello\n");
-			}
-			ctx->dst.ssl = pxy_dstssl_create(ctx);
-			if (!ctx->dst.ssl) {
-				log_err_printf("Error creating SSL for "
-				               "upgrade\n");
-				return 0;
-			}
-			ctx->dst.bev = bufferevent_openssl_filter_new(
-			               ctx->evbase, ctx->dst.bev, ctx->dst.ssl,
-			               BUFFEREVENT_SSL_CONNECTING,
-			               BEV_OPT_DEFER_CALLBACKS);
-			if (!ctx->dst.bev) {
-				return 0;
-			}
-			bufferevent_openssl_set_allow_dirty_shutdown(
-			                                      ctx->dst.bev, 1);
-			bufferevent_setcb(ctx->dst.bev, pxy_bev_readcb,
-			                  pxy_bev_writecb, pxy_bev_eventcb,
-			                  ctx);
-			bufferevent_enable(ctx->dst.bev, EV_READ|EV_WRITE);
-			if (OPTS_DEBUG(ctx->opts)) {
-				log_err_printf("Replaced dst bufferevent, new "
-				               "one is %p\n",
-				               (void*)ctx->dst.bev);
+	off = 0;
+	ctx->chhold = 0;
+	ctx->chneed = 0;
+	while (off < len) {
+		/* find next candidate first octet at or after off */
+		if (evbuffer_ptr_set(inbuf, &ptr, off, EVBUFFER_PTR_SET) == -1)
+			break;
+		p = NULL;
+		while (!p && evbuffer_peek(inbuf, -1, &ptr, &vec, 1) > 0 &&
+		       vec.iov_len > 0) {
+			buf = vec.iov_base;
+			for (i = 0; i < vec.iov_len; i++) {
+				if (buf[i] == 0x16 || buf[i] == 0x80) {
+					p = buf + i;
+					break;
+				}
 			}
-			ctx->clienthello_search = 0;
-			ctx->clienthello_found = 1;
-			return 1;
-		} else {
+			off += i;
+			if (p)
+				break;
+			if (evbuffer_ptr_set(inbuf, &ptr, vec.iov_len,
+			                     EVBUFFER_PTR_ADD) == -1)
+				break;
+		}
+		if (!p)
+			break;
+
+		/* pass on the octets before the candidate, then parse it */
+		if (off > 0) {
+			pxy_forward(ctx, inbuf, bufferevent_get_output(
+			            ctx->dst.bev), off, 1);
+			len -= off;
+			off = 0;
+		}
+		sz = len;
+		if (sz > PXY_AUTOSSL_HOLDSZ)
+			sz = PXY_AUTOSSL_HOLDSZ;
+		if (!(buf = evbuffer_pullup(inbuf, sz))) {
+			ctx->enomem = 1;
+			return 0;
+		}
+		chello = NULL;
+		if (ssl_tls_clienthello_summary(buf, sz, 0, &chello,
+		                                &ctx->sni, &ctx->hello) == 0)
+			goto found;
+		if (chello && (need = pxy_conn_autossl_need(buf, sz))) {
 			if (OPTS_DEBUG(ctx->opts)) {
-				log_dbg_printf("Peek found no ClientHello\n");
+				log_dbg_printf("Holding back %zu octets of "
+				               "truncated ClientHello\n", len);
 			}
+			ctx->chhold = len;
+			ctx->chneed = need;
 			return 0;
 		}
+		off = 1;
+	}
+	if (OPTS_DEBUG(ctx->opts)) {
+		log_dbg_printf("Peek found no ClientHello\n");
 	}
 	return 0;
+
+found:
+	ctx->ecdsa = ctx->hello.ecdsa && ctx->opts->eccakey;
+	if (OPTS_DEBUG(ctx->opts)) {
+		log_dbg_printf("Peek found ClientHello\n");
+	}
+	ctx->dst.ssl = pxy_dstssl_create(ctx);
+	if (!ctx->dst.ssl) {
+		log_err_printf("Error creating SSL for upgrade\n");
+		return 0;
+	}
+	if (pxy_conn_autossl_dstbev(ctx) == -1) {
+		return 0;
+	}
+	/* leave the rest of the handshake in the socket for the src SSL
+	 * bufferevent, see pxy_conn_autossl_srcbev() */
+	bufferevent_disable(ctx->src.bev, EV_READ);
+	if (OPTS_DEBUG(ctx->opts)) {
+		log_err_printf("Replaced dst bufferevent, new one is %p\n",
+		               (void*)ctx->dst.bev);
+	}
+	ctx->clienthello_search = 0;
+	ctx->clienthello_found = 1;
+	return 1;
 }
 
 static void
@@ -1735,700 +4511,4446 @@ pxy_conn_terminate_free(pxy_conn_ctx_t *ctx, int is_requestor)
 }
 
 /*
- * Callback for read events on the up- and downstream connection bufferevents.
- * Called when there is data ready in the input evbuffer.
+ * Return 1 if the response header parsed is an interim 1xx response other
+ * than 101 Switching Protocols, which is followed by the final response.
  */
-static void
-pxy_bev_readcb(struct bufferevent *bev, void *arg)
+static int
+pxy_http_resp_is_interim(pxy_conn_ctx_t *ctx)
 {
-	pxy_conn_ctx_t *ctx = arg;
-	pxy_conn_desc_t *other = (bev==ctx->src.bev) ? &ctx->dst : &ctx->src;
+	return ctx->opts->http_keepalive && ctx->http_status_code &&
+	       ctx->http_status_code[0] == '1' &&
+	       !!strcmp(ctx->http_status_code, "101");
+}
 
-#ifdef DEBUG_PROXY
-	if (OPTS_DEBUG(ctx->opts)) {
-		log_dbg_printf("%p %p %s readcb\n", arg, (void*)bev,
-		               (bev == ctx->src.bev) ? "src" : "dst");
+/*
+ * Return 1 if the response to the current request has no message body.
+ */
+static int
+pxy_http_resp_is_bodyless(pxy_conn_ctx_t *ctx)
+{
+	if (ctx->http_method && !strcasecmp(ctx->http_method, "HEAD"))
+		return 1;
+	if (!ctx->http_status_code)
+		return 0;
+	return ctx->http_status_code[0] == '1' ||
+	       !strcmp(ctx->http_status_code, "204") ||
+	       !strcmp(ctx->http_status_code, "304");
+}
+
+/*
+ * Open the content log of the connection.
+ * Returns -1 with errno set on failure, 0 on success.
+ */
+static int
+pxy_log_content_open(pxy_conn_ctx_t *ctx)
+{
+	if (!pxy_conn_srchost(ctx) || !pxy_conn_dsthost(ctx)) {
+		errno = EINVAL;
+		return -1;
 	}
-#endif /* DEBUG_PROXY */
+	return log_content_open(&ctx->logctx, ctx->opts, ctx->thridx,
+	                        (struct sockaddr *)&ctx->srcaddr,
+	                        ctx->srcaddrlen,
+	                        (struct sockaddr *)&ctx->dstaddr,
+	                        ctx->dstaddrlen,
+	                        pxy_conn_srchost(ctx), pxy_conn_srcport(ctx),
+	                        pxy_conn_dsthost(ctx), pxy_conn_dstport(ctx),
+#ifdef HAVE_LOCAL_PROCINFO
+	                        ctx->lproc.exec_path,
+	                        ctx->lproc.user,
+	                        ctx->lproc.group,
+#else /* HAVE_LOCAL_PROCINFO */
+	                        NULL, NULL, NULL,
+#endif /* HAVE_LOCAL_PROCINFO */
+	                        ctx->sni, ctx->origcrtfpr);
+}
 
-	if (!ctx->connected) {
-		log_err_printf("readcb called when other end not connected - "
-		               "aborting.\n");
-		log_exceptcb();
+/*
+ * Decide how much of the connection's content to log by matching it against
+ * the content log rules.  Unless final is set, the decision is deferred on
+ * HTTP connections while it depends on the Host of the first request, by
+ * setting ctx->log_pending.  A connection matching a flight recorder trigger
+ * is logged directly and flushes the content recorded so far.
+ */
+static void
+pxy_log_content_rule(pxy_conn_ctx_t *ctx, int final)
+{
+	logrule_conn_t c;
+	size_t limit = 0, left;
+
+	left = ctx->opts->contentlog_limit ? ctx->opts->contentlog_limit
+	                                   : SIZE_MAX;
+
+	c.srcaddr = (struct sockaddr *)&ctx->srcaddr;
+	c.dstaddr = (struct sockaddr *)&ctx->dstaddr;
+	c.sni = ctx->sni;
+	c.host = ctx->http_host;
+	c.host_pending = !final && ctx->spec->http;
+	ctx->log_pending = 0;
+	if (ctx->opts->contentlog_triggers && !ctx->logctx.live) {
+		/* trigger rules match with action none */
+		switch (logrule_match(ctx->opts->contentlog_triggers, &c,
+		                      &limit)) {
+		case LOGRULE_PENDING:
+			ctx->log_pending = 1;
+			break;
+		case LOGRULE_NONE:
+			/* log this connection directly, flush the others */
+			ctx->logctx.live = 1;
+			log_content_recorder_trigger();
+			break;
+		default:
+			break;
+		}
+		limit = 0;
+	}
+	if (!ctx->opts->contentlog_rules) {
+		ctx->log_left[0] = ctx->log_left[1] = left;
 		return;
 	}
+	switch (logrule_match(ctx->opts->contentlog_rules, &c, &limit)) {
+	case LOGRULE_PENDING:
+		ctx->log_pending = 1;
+		break;
+	case LOGRULE_HEADERS:
+		if (ctx->spec->http)
+			ctx->log_hdronly = 1;
+		else
+			ctx->log_off = 1;
+		break;
+	case LOGRULE_FIRST:
+		if (limit < left)
+			left = limit;
+		break;
+	case LOGRULE_NONE:
+		ctx->log_off = 1;
+		break;
+	default:
+		break;
+	}
+	ctx->log_left[0] = ctx->log_left[1] = left;
+}
 
-	if (ctx->clienthello_search) {
-		if (pxy_conn_autossl_peek_and_upgrade(ctx)) {
-			return;
-		}
+/*
+ * Return how many of sz octets read from src (req is 1) or dst (req is 0)
+ * are to be logged under the connection's content log limit and rule, and
+ * account for them.  Once the quota is spent, no more log buffers are
+ * allocated for that direction.
+ */
+static size_t
+pxy_log_content_quota(pxy_conn_ctx_t *ctx, int req, size_t sz)
+{
+	if (!WANT_CONTENT_LOG(ctx))
+		return 0;
+	if (sz > ctx->log_left[req]) {
+		sz = ctx->log_left[req];
+		ctx->log_trunc |= 1 << req;
 	}
+	ctx->log_left[req] -= sz;
+	return sz;
+}
 
-	struct evbuffer *inbuf = bufferevent_get_input(bev);
-	if (other->closed) {
-		log_dbg_printf("Warning: Drained %zu bytes (conn closed)\n",
-		               evbuffer_get_length(inbuf));
-		evbuffer_drain(inbuf, evbuffer_get_length(inbuf));
+/*
+ * Submit the truncation marker to the content log after the last octets
+ * logged from src (req is 1) or dst (req is 0), once octets were dropped.
+ */
+static void
+pxy_log_content_trunc(pxy_conn_ctx_t *ctx, int req)
+{
+	if (!(ctx->log_trunc & ~ctx->log_trunc_done & (1 << req)) ||
+	    ctx->log_pending || !WANT_CONTENT_LOG(ctx))
 		return;
+	ctx->log_trunc_done |= 1 << req;
+	if (log_content_truncate(&ctx->logctx, req) == -1) {
+		log_err_rl_printf("Warning: Content log "
+		                  "submission failed\n");
 	}
+}
 
-	struct evbuffer *outbuf = bufferevent_get_output(other->bev);
-
-	/* request header munging */
-	if (ctx->spec->http && !ctx->seen_req_header && (bev == ctx->src.bev)
-	    && !ctx->passthrough) {
-		logbuf_t *lb = NULL, *tail = NULL;
-		char *line;
-		while ((line = evbuffer_readln(inbuf, NULL,
-		                               EVBUFFER_EOL_CRLF))) {
-			char *replace;
-			if (WANT_CONTENT_LOG(ctx)) {
-				logbuf_t *tmp;
-				tmp = logbuf_new_printf(NULL, "%s\r\n", line);
-				if (tail) {
-					if (tmp) {
-						tail->next = tmp;
-						tail = tail->next;
-					}
-				} else {
-					lb = tail = tmp;
-				}
-			}
-			replace = pxy_http_reqhdr_filter_line(line, ctx);
-			if (replace == line) {
-				evbuffer_add_printf(outbuf, "%s\r\n", line);
-			} else if (replace) {
-				evbuffer_add_printf(outbuf, "%s\r\n", replace);
-				free(replace);
-			}
-			free(line);
-			if (ctx->seen_req_header) {
-				/* request header complete */
-				if (ctx->opts->deny_ocsp) {
-					pxy_ocsp_deny(ctx);
-				}
-				break;
-			}
+/*
+ * Take the final content log rule decision for a connection waiting for the
+ * HTTP Host, open its content log if wanted and submit the held request
+ * header octets, as far as the rule allows.
+ */
+static void
+pxy_log_content_resolve(pxy_conn_ctx_t *ctx)
+{
+	logbuf_t *lb = ctx->log_held, *p;
+	size_t left;
+
+	ctx->log_held = NULL;
+	ctx->log_trunc = 0;
+	pxy_log_content_rule(ctx, 1);
+	if (WANT_CONTENT_LOG(ctx) && pxy_log_content_open(ctx) == -1) {
+		if (errno == ENOMEM)
+			ctx->enomem = 1;
+		log_err_rl_printf("Warning: Content log open failed\n");
+		ctx->log_off = 1;
+	}
+	if (!lb)
+		return;
+	left = ctx->log_left[1];
+	for (p = lb; p && left > 0; p = p->next) {
+		if ((size_t)p->sz > left) {
+			p->sz = left;
+			ctx->log_trunc |= 1 << 1;
 		}
-		if (lb && WANT_CONTENT_LOG(ctx)) {
-			if (log_content_submit(&ctx->logctx, lb,
-			                       1/*req*/) == -1) {
-				logbuf_free(lb);
-				log_err_printf("Warning: Content log "
-				               "submission failed\n");
-			}
+		left -= p->sz;
+		if (left == 0 && p->next) {
+			logbuf_free(p->next);
+			p->next = NULL;
+			ctx->log_trunc |= 1 << 1;
 		}
-		if (!ctx->seen_req_header)
+	}
+	if (!pxy_log_content_quota(ctx, 1, ctx->log_left[1] - left)) {
+		logbuf_free(lb);
+		return;
+	}
+	if (log_content_submit(&ctx->logctx, lb, 1) == -1) {
+		logbuf_free(lb);
+		log_err_rl_printf("Warning: Content log "
+		                  "submission failed\n");
+	}
+	pxy_log_content_trunc(ctx, 1);
+}
+
+/*
+ * Submit octets read from src (req is 1) or dst (req is 0) to the content
+ * log, flagging compressed response bodies and WebSocket frames for
+ * decoding.
+ */
+static void
+pxy_log_content_submit(pxy_conn_ctx_t *ctx, logbuf_t *lb, int req)
+{
+	int rv;
+
+	if (ctx->http_ws && ctx->opts->http_websocket_frames) {
+		rv = log_content_submit_body(&ctx->logctx, lb, req,
+		                             LBFLAG_WEBSOCKET);
+	} else if (!req && ctx->http_resp_decode) {
+		rv = log_content_submit_body(&ctx->logctx, lb, req,
+		                             ctx->http_resp_decode);
+		ctx->http_resp_decode &= ~LBFLAG_NEWBODY;
+	} else {
+		rv = log_content_submit(&ctx->logctx, lb, req);
+	}
+	if (rv == -1) {
+		logbuf_free(lb);
+		log_err_rl_printf("Warning: Content log "
+		                  "submission failed\n");
+	}
+}
+
+static int
+pxy_log_content_match_cb(unsigned int id, void *arg)
+{
+	*(unsigned int *)arg = id;
+	return 1;
+}
+
+/*
+ * Scan the first sz octets of inbuf from src (req is 1) or dst (req is 0)
+ * for the ContentLogTriggerMatch patterns, in place in the chains of inbuf
+ * and continuing the scan state of the direction.  On the first match,
+ * sets ctx->log_match_hit for pxy_log_content_matched() to trigger the
+ * flight recorder once the octets were submitted to the content log.
+ */
+#define PXY_MATCH_IOVMAX 16
+static void
+pxy_log_content_match(pxy_conn_ctx_t *ctx, struct evbuffer *inbuf,
+                      size_t sz, int req)
+{
+	struct evbuffer_iovec vec[PXY_MATCH_IOVMAX];
+	struct iovec iov[PXY_MATCH_IOVMAX];
+	struct evbuffer_ptr ptr;
+	unsigned int id;
+	size_t len;
+	int n;
+
+	if (evbuffer_ptr_set(inbuf, &ptr, 0, EVBUFFER_PTR_SET) == -1)
+		return;
+	while (sz > 0) {
+		n = evbuffer_peek(inbuf, sz, &ptr, vec, PXY_MATCH_IOVMAX);
+		if (n <= 0)
 			return;
-	} else
-	/* response header munging */
-	if (ctx->spec->http && !ctx->seen_resp_header && (bev == ctx->dst.bev)
-	    && !ctx->passthrough) {
-		logbuf_t *lb = NULL, *tail = NULL;
-		char *line;
-		while ((line = evbuffer_readln(inbuf, NULL,
-		                               EVBUFFER_EOL_CRLF))) {
-			char *replace;
-			if (WANT_CONTENT_LOG(ctx)) {
-				logbuf_t *tmp;
-				tmp = logbuf_new_printf(NULL, "%s\r\n", line);
-				if (tail) {
-					if (tmp) {
-						tail->next = tmp;
-						tail = tail->next;
-					}
-				} else {
-					lb = tail = tmp;
-				}
-			}
-			replace = pxy_http_resphdr_filter_line(line, ctx);
-			if (replace == line) {
-				evbuffer_add_printf(outbuf, "%s\r\n", line);
-			} else if (replace) {
-				evbuffer_add_printf(outbuf, "%s\r\n", replace);
-				free(replace);
-			}
-			free(line);
-			if (ctx->seen_resp_header) {
-				/* response header complete: log connection */
-				if (WANT_CONNECT_LOG(ctx)) {
-					pxy_log_connect_http(ctx);
-				}
-				break;
-			}
+		if (n > PXY_MATCH_IOVMAX)
+			n = PXY_MATCH_IOVMAX;
+		len = 0;
+		for (int i = 0; i < n; i++) {
+			iov[i].iov_base = vec[i].iov_base;
+			iov[i].iov_len = vec[i].iov_len;
+			if (iov[i].iov_len > sz - len)
+				iov[i].iov_len = sz - len;
+			len += iov[i].iov_len;
 		}
-		if (lb && WANT_CONTENT_LOG(ctx)) {
-			if (log_content_submit(&ctx->logctx, lb,
-			                       0/*resp*/) == -1) {
-				logbuf_free(lb);
-				log_err_printf("Warning: Content log "
-				               "submission failed\n");
+		if (acmatch_scan_iov(ctx->opts->contentlog_match,
+		                     &ctx->log_match[req], iov, n,
+		                     pxy_log_content_match_cb, &id)) {
+			if (OPTS_DEBUG(ctx->opts)) {
+				log_dbg_printf("Content log trigger pattern "
+				               "%u matched\n", id);
 			}
+			ctx->log_matched = 1;
+			ctx->log_match_hit = 1;
+			return;
 		}
-		if (!ctx->seen_resp_header)
+		sz -= len;
+		if (sz > 0 && evbuffer_ptr_set(inbuf, &ptr, len,
+		                               EVBUFFER_PTR_ADD) == -1)
 			return;
 	}
+}
 
-	/* out of memory condition? */
-	if (ctx->enomem) {
-		pxy_conn_terminate_free(ctx, (bev == ctx->src.bev));
+/*
+ * Trigger the flight recorder if a trigger pattern matched in the octets
+ * submitted to the content log last.
+ */
+static void
+pxy_log_content_matched(pxy_conn_ctx_t *ctx)
+{
+	if (!ctx->log_match_hit)
 		return;
+	ctx->log_match_hit = 0;
+	log_content_recorder_trigger();
+}
+
+/*
+ * Pass the first sz octets of inbuf, as received from the client (req is 1)
+ * or server (req is 0), to the inspection plugins before they are moved on.
+ * Returns 1 if the octets may be forwarded, 0 if a plugin dropped the
+ * connection, in which case nothing is forwarded anymore.
+ */
+static int
+pxy_inspect(pxy_conn_ctx_t *ctx, struct evbuffer *inbuf, size_t sz, int req)
+{
+	if (ctx->inspect_drop)
+		return 0;
+	if (!ctx->inspect) {
+		const char *proto;
+
+		if (ctx->spec->http)
+			proto = ctx->src.ssl ? "https" : "http";
+		else
+			proto = ctx->src.ssl ? "ssl" : "tcp";
+		ctx->inspect = inspect_conn_new(proto,
+		                          (struct sockaddr *)&ctx->srcaddr,
+		                          ctx->srcaddrlen,
+		                          (struct sockaddr *)&ctx->dstaddr,
+		                          ctx->dstaddrlen, ctx->sni,
+		                          ctx->thridx);
+		if (!ctx->inspect) {
+			ctx->enomem = 1;
+			ctx->inspect_drop = 1;
+			return 0;
+		}
+	}
+	if (inspect_conn_data(ctx->inspect, inbuf, sz, req) != INSPECT_PASS) {
+		ctx->inspect_drop = 1;
+		return 0;
 	}
+	return 1;
+}
 
-	/* no data left after parsing headers? */
-	if (evbuffer_get_length(inbuf) == 0)
-		return;
+/*
+ * Terminate the connection from the read callback on bev if an inspection
+ * plugin dropped it, unless the EOF handler is passing on pending data and
+ * closes the connection itself.  Returns 1 if ctx was freed, 0 otherwise.
+ */
+static int
+pxy_inspect_terminate(pxy_conn_ctx_t *ctx, struct bufferevent *bev)
+{
+	if (!ctx->inspect_drop || ctx->eof_flush)
+		return 0;
+	pxy_conn_terminate_free(ctx, (bev == ctx->src.bev));
+	return 1;
+}
 
-	if (WANT_CONTENT_LOG(ctx)) {
-		logbuf_t *lb;
-		lb = logbuf_new_alloc(evbuffer_get_length(inbuf), NULL);
-		if (lb && (evbuffer_copyout(inbuf, lb->buf, lb->sz) != -1)) {
-			if (log_content_submit(&ctx->logctx, lb,
-			                       (bev == ctx->src.bev)) == -1) {
-				logbuf_free(lb);
-				log_err_printf("Warning: Content log "
-				               "submission failed\n");
-			}
+/*
+ * Move sz octets of unmodified header lines from inbuf to outbuf, or drain
+ * them from inbuf if outbuf is NULL, appending a copy of them to the content
+ * log chain at *tail.
+ */
+static void
+pxy_http_hdr_consume(pxy_conn_ctx_t *ctx, struct evbuffer *inbuf,
+                     struct evbuffer *outbuf, size_t sz, int req,
+                     logbuf_t **lb, logbuf_t **tail)
+{
+	logbuf_t *tmp;
+	size_t n;
+
+	if (sz == 0)
+		return;
+	pxy_conn_bytes(ctx, req, sz);
+	if (WANT_INSPECT(ctx) && !pxy_inspect(ctx, inbuf, sz, req)) {
+		evbuffer_drain(inbuf, sz);
+		return;
+	}
+	if (WANT_CONTENT_MATCH(ctx))
+		pxy_log_content_match(ctx, inbuf, sz, req);
+	n = pxy_log_content_quota(ctx, req, sz);
+	if (n > 0 && (tmp = logbuf_new_alloc(n, NULL))) {
+		if (evbuffer_copyout(inbuf, tmp->buf, n) == -1) {
+			logbuf_free(tmp);
+		} else if (*tail) {
+			(*tail)->next = tmp;
+			*tail = tmp;
+		} else {
+			*lb = *tail = tmp;
 		}
 	}
-	evbuffer_add_buffer(outbuf, inbuf);
-	if (evbuffer_get_length(outbuf) >= OUTBUF_LIMIT) {
-		/* temporarily disable data source;
-		 * set an appropriate watermark. */
-		bufferevent_setwatermark(other->bev, EV_WRITE,
-				OUTBUF_LIMIT/2, OUTBUF_LIMIT);
-		bufferevent_disable(bev, EV_READ);
+	if (outbuf) {
+		evbuffer_remove_buffer(inbuf, outbuf, sz);
+	} else {
+		evbuffer_drain(inbuf, sz);
 	}
 }
 
 /*
- * Callback for write events on the up- and downstream connection bufferevents.
- * Called when either all data from the output evbuffer has been written,
- * or if the outbuf is only half full again after having been full.
+ * Filter the HTTP request (req is 1) or response (req is 0) header lines
+ * available in inbuf into outbuf and submit them to the content log.
+ * Lines are found by scanning the contiguous chains of inbuf and parsed in
+ * place; only lines spanning chains are copied.  Runs of unmodified lines
+ * are moved to outbuf as a whole and only modified lines are rewritten.
+ * Sets ctx->seen_req_header or ctx->seen_resp_header once the header is
+ * complete.
  */
 static void
-pxy_bev_writecb(struct bufferevent *bev, void *arg)
+pxy_http_hdr_filter(pxy_conn_ctx_t *ctx, struct evbuffer *inbuf,
+                    struct evbuffer *outbuf, int req)
 {
-	pxy_conn_ctx_t *ctx = arg;
-	pxy_conn_desc_t *other = (bev==ctx->src.bev) ? &ctx->dst : &ctx->src;
-
-#ifdef DEBUG_PROXY
-	if (OPTS_DEBUG(ctx->opts)) {
-		log_dbg_printf("%p %p %s writecb\n", arg, (void*)bev,
-		               (bev == ctx->src.bev) ? "src" : "dst");
+	logbuf_t *lb = NULL, *tail = NULL;
+	struct evbuffer_ptr pos, eol;
+	struct evbuffer_iovec vec;
+	size_t off = 0, segsz = 0, sz, eollen;
+	const char *seg = NULL, *nl, *line, *replace;
+	char *copy;
+
+	if (!req && ctx->log_pending)
+		pxy_log_content_resolve(ctx);
+	for (;;) {
+		/* seg and segsz cover the rest of the chain at off */
+		if (segsz == 0) {
+			if (evbuffer_ptr_set(inbuf, &pos, off,
+			                     EVBUFFER_PTR_SET) == -1 ||
+			    evbuffer_peek(inbuf, -1, &pos, &vec, 1) < 1)
+				break;
+			seg = vec.iov_base;
+			segsz = vec.iov_len;
+		}
+		copy = NULL;
+		if ((nl = memchr(seg, '\n', segsz))) {
+			line = seg;
+			sz = nl - seg;
+			eollen = 1;
+			if (sz > 0 && line[sz - 1] == '\r') {
+				sz--;
+				eollen++;
+			}
+			seg = nl + 1;
+			segsz -= sz + eollen;
+		} else {
+			/* line spans chains */
+			segsz = 0;
+			if (evbuffer_ptr_set(inbuf, &pos, off,
+			                     EVBUFFER_PTR_SET) == -1)
+				break;
+			eol = evbuffer_search_eol(inbuf, &pos, &eollen,
+			                          EVBUFFER_EOL_CRLF);
+			if (eol.pos == -1)
+				break;
+			sz = eol.pos - off;
+			if (sz == 0) {
+				line = "";
+			} else if ((copy = malloc(sz))) {
+				evbuffer_copyout_from(inbuf, &pos, copy, sz);
+				line = copy;
+			} else {
+				ctx->enomem = 1;
+				break;
+			}
+		}
+		replace = req ? pxy_http_reqhdr_filter_line(line, sz, ctx)
+		              : pxy_http_resphdr_filter_line(line, sz, ctx);
+		if (replace == line) {
+			off += sz + eollen;
+		} else {
+			pxy_http_hdr_consume(ctx, inbuf, outbuf, off, req,
+			                     &lb, &tail);
+			pxy_http_hdr_consume(ctx, inbuf, NULL, sz + eollen,
+			                     req, &lb, &tail);
+			off = segsz = 0;
+			if (replace) {
+				evbuffer_add(outbuf, replace, strlen(replace));
+				evbuffer_add(outbuf, "\r\n", 2);
+			}
+		}
+		if (copy)
+			free(copy);
+		if (ctx->enomem ||
+		    (req ? ctx->seen_req_header : ctx->seen_resp_header))
+			break;
+	}
+	pxy_http_hdr_consume(ctx, inbuf, outbuf, off, req, &lb, &tail);
+	if (ctx->log_pending) {
+		/* hold request header octets until the Host is known */
+		if (lb) {
+			for (tail = ctx->log_held; tail && tail->next;
+			     tail = tail->next);
+			if (tail)
+				tail->next = lb;
+			else
+				ctx->log_held = lb;
+			lb = NULL;
+		}
+		if (ctx->seen_req_header)
+			pxy_log_content_resolve(ctx);
+	}
+	if (lb && WANT_CONTENT_LOG(ctx)) {
+		if (log_content_submit(&ctx->logctx, lb, req) == -1) {
+			logbuf_free(lb);
+			log_err_rl_printf("Warning: Content log "
+			                  "submission failed\n");
+		}
 	}
-#endif /* DEBUG_PROXY */
+	pxy_log_content_trunc(ctx, req);
+	pxy_log_content_matched(ctx);
+	if (req && ctx->seen_req_header) {
+		/* request header complete */
+		if (ctx->opts->deny_ocsp) {
+			pxy_ocsp_deny(ctx);
+		}
+		if (ctx->timeout == OPTS_TIMEOUT_HEADER)
+			pxy_conn_timeout(ctx, OPTS_TIMEOUT_IDLE);
+	}
+	if (!req && ctx->seen_resp_header) {
+		/* response header complete: log connection */
+		if (WANT_CONNECT_LOG(ctx) &&
+		    !pxy_http_resp_is_interim(ctx)) {
+			pxy_log_connect_http(ctx);
+		}
+		if (ctx->http_ws_upgrade && ctx->http_status_code &&
+		    !strcmp(ctx->http_status_code, "101")) {
+			/* WebSocket: from here on forwarded as is */
+			ctx->http_ws = 1;
+		}
+		if (pxy_http_resp_is_bodyless(ctx)) {
+			ctx->http_resp_decode = 0;
+		} else if (ctx->http_resp_decode) {
+			ctx->http_resp_decode |= LBFLAG_NEWBODY;
+			if (ctx->http_respbody.chunked)
+				ctx->http_resp_decode |= LBFLAG_CHUNKED;
+		}
+	}
+}
 
-	if (other->closed) {
-		struct evbuffer *outbuf = bufferevent_get_output(bev);
-		if (evbuffer_get_length(outbuf) == 0) {
-			/* finished writing and other end is closed;
-			 * close this end too and clean up memory */
-			bufferevent_free_and_close_fd(bev, ctx);
-			pxy_conn_ctx_free(ctx, (bev == ctx->dst.bev));
+/*
+ * Move sz octets from inbuf to outbuf and submit them to the content log.
+ * The octets are moved into a separate evbuffer, which is handed to the
+ * content log, and added to outbuf by reference, such that the forwarding
+ * thread does not copy the logged octets.  The separate evbuffer has its own
+ * lock, since the chains are released by both the logger thread and the
+ * forwarding thread.  Falls back to copying if outbuf cannot reference the
+ * chains.
+ */
+static void
+pxy_forward_logged(pxy_conn_ctx_t *ctx, struct evbuffer *inbuf,
+                   struct evbuffer *outbuf, size_t sz, int req)
+{
+	struct evbuffer *logbuf;
+	logbuf_t *lb;
+
+	if (!(logbuf = evbuffer_new()))
+		goto copy;
+	if (evbuffer_enable_locking(logbuf, NULL) == -1) {
+		evbuffer_free(logbuf);
+		goto copy;
+	}
+	evbuffer_remove_buffer(inbuf, logbuf, sz);
+	if (evbuffer_add_buffer_reference(outbuf, logbuf) == -1) {
+		lb = logbuf_new_alloc(evbuffer_get_length(logbuf), NULL);
+		if (lb && (evbuffer_copyout(logbuf, lb->buf, lb->sz) != -1)) {
+			pxy_log_content_submit(ctx, lb, req);
+		} else if (lb) {
+			logbuf_free(lb);
 		}
+		evbuffer_add_buffer(outbuf, logbuf);
+		evbuffer_free(logbuf);
 		return;
 	}
+	if ((lb = logbuf_new_evbuf(logbuf, NULL)))
+		pxy_log_content_submit(ctx, lb, req);
+	return;
 
-	if (other->bev && !(bufferevent_get_enabled(other->bev) & EV_READ)) {
-		/* data source temporarily disabled;
-		 * re-enable and reset watermark to 0. */
-		bufferevent_setwatermark(bev, EV_WRITE, 0, 0);
-		bufferevent_enable(other->bev, EV_READ);
+copy:
+	lb = logbuf_new_alloc(sz, NULL);
+	if (lb && (evbuffer_copyout(inbuf, lb->buf, lb->sz) != -1)) {
+		pxy_log_content_submit(ctx, lb, req);
+	} else if (lb) {
+		logbuf_free(lb);
 	}
+	evbuffer_remove_buffer(inbuf, outbuf, sz);
 }
 
 /*
- * Callback for meta events on the up- and downstream connection bufferevents.
- * Called when EOF has been reached, a connection has been made, and on errors.
+ * Move sz octets from inbuf to outbuf, submitting as many of them to the
+ * content log as the connection's content log rule allows.
  */
 static void
-pxy_bev_eventcb(struct bufferevent *bev, short events, void *arg)
+pxy_forward(pxy_conn_ctx_t *ctx, struct evbuffer *inbuf,
+            struct evbuffer *outbuf, size_t sz, int req)
 {
-	pxy_conn_ctx_t *ctx = arg;
-	pxy_conn_desc_t *this = (bev==ctx->src.bev) ? &ctx->src : &ctx->dst;
-	pxy_conn_desc_t *other = (bev==ctx->src.bev) ? &ctx->dst : &ctx->src;
-	int is_requestor = (bev == ctx->src.bev);
+	size_t n;
 
-#ifdef DEBUG_PROXY
-	if (OPTS_DEBUG(ctx->opts)) {
-		log_dbg_printf("%p %p eventcb %s %s%s%s%s\n", arg, (void*)bev,
-		               (bev == ctx->src.bev) ? "src" : "dst",
-		               events & BEV_EVENT_CONNECTED ? "connected" : "",
-		               events & BEV_EVENT_ERROR ? "error" : "",
-		               events & BEV_EVENT_TIMEOUT ? "timeout" : "",
-		               events & BEV_EVENT_EOF ? "eof" : "");
+	pxy_conn_bytes(ctx, req, sz);
+	if (WANT_INSPECT(ctx) && !pxy_inspect(ctx, inbuf, sz, req)) {
+		evbuffer_drain(inbuf, sz);
+		return;
 	}
-#endif /* DEBUG_PROXY */
-
-	if (events & BEV_EVENT_CONNECTED) {
-		if (bev != ctx->dst.bev) {
-#ifdef DEBUG_PROXY
-			if (OPTS_DEBUG(ctx->opts)) {
-				log_dbg_printf("src buffer event connected: "
-				               "ignoring event\n");
-			}
-#endif /* DEBUG_PROXY */
-			goto connected;
-		}
+	if (ctx->log_pending)
+		pxy_log_content_resolve(ctx);
+	if (WANT_CONTENT_MATCH(ctx))
+		pxy_log_content_match(ctx, inbuf, sz, req);
+	n = ctx->log_hdronly ? 0 : pxy_log_content_quota(ctx, req, sz);
+	if (n > 0) {
+		pxy_cpu_logging(ctx, 1);
+		pxy_forward_logged(ctx, inbuf, outbuf, n, req);
+		pxy_cpu_logging(ctx, 0);
+	}
+	if (sz > n) {
+		evbuffer_remove_buffer(inbuf, outbuf, sz - n);
+		pxy_log_content_trunc(ctx, req);
+	}
+	pxy_log_content_matched(ctx);
+#ifdef HAVE_ZEROCOPY
+	pxy_zc_forward(ctx, outbuf, req);
+#endif /* HAVE_ZEROCOPY */
+}
 
-		/* dst has connected */
-		ctx->connected = 1;
+/*
+ * Determine the framing of the message body after the header is complete.
+ * Requests without Content-Length or Transfer-Encoding have no body, while
+ * such responses are delimited by the server closing the connection.
+ * Returns -1 if the framing is invalid, conflicting or unsupported, that is
+ * an unusable Content-Length, both Content-Length and Transfer-Encoding, or
+ * a request whose final transfer coding is not chunked (RFC 7230 section
+ * 3.3.3); the caller must then stop tracking message boundaries.
+ */
+static int
+pxy_http_body_start(pxy_http_body_t *body, int bodyless, int req)
+{
+	if (bodyless) {
+		body->state = PXY_HTTP_BODY_DONE;
+	} else if (body->invalid || (body->te && body->length) ||
+	           (req && body->te && !body->chunked)) {
+		return -1;
+	} else if (body->chunked) {
+		body->state = PXY_HTTP_BODY_CHUNKSIZE;
+	} else if (body->length) {
+		body->state = body->left ? PXY_HTTP_BODY_LENGTH
+		                         : PXY_HTTP_BODY_DONE;
+	} else if (req && !body->te) {
+		body->state = PXY_HTTP_BODY_DONE;
+	} else {
+		body->state = PXY_HTTP_BODY_EOF;
+	}
+	return 0;
+}
 
-		/* wrap client-side socket in an eventbuffer */
-		if ((ctx->spec->ssl || ctx->clienthello_found) &&
-		    !ctx->passthrough) {
-			ctx->src.ssl = pxy_srcssl_create(ctx, this->ssl);
+/*
+ * Forward the body octets of the current HTTP message from inbuf to outbuf.
+ * Returns 1 if the message is complete, 0 if more octets are needed, and
+ * -1 if the message framing could not be parsed.
+ */
+#define PXY_HTTP_LINE_MAXSZ 4096
+static int
+pxy_http_body_forward(pxy_conn_ctx_t *ctx, pxy_http_body_t *body,
+                      struct evbuffer *inbuf, struct evbuffer *outbuf,
+                      int req)
+{
+	struct evbuffer_ptr eol;
+	size_t eollen, sz;
+	char line[32];
+	char *end;
+
+	for (;;) {
+		sz = evbuffer_get_length(inbuf);
+		switch (body->state) {
+		case PXY_HTTP_BODY_DONE:
+			return 1;
+		case PXY_HTTP_BODY_EOF:
+			if (sz > 0)
+				pxy_forward(ctx, inbuf, outbuf, sz, req);
+			return 0;
+		case PXY_HTTP_BODY_LENGTH:
+		case PXY_HTTP_BODY_CHUNKDATA:
+			if (sz == 0)
+				return 0;
+			if (sz > body->left)
+				sz = body->left;
+			pxy_forward(ctx, inbuf, outbuf, sz, req);
+			body->left -= sz;
+			if (body->left > 0)
+				return 0;
+			body->state = (body->state == PXY_HTTP_BODY_LENGTH) ?
+			              PXY_HTTP_BODY_DONE :
+			              PXY_HTTP_BODY_CHUNKSIZE;
+			break;
+		case PXY_HTTP_BODY_CHUNKSIZE:
+		case PXY_HTTP_BODY_TRAILER:
+			eol = evbuffer_search_eol(inbuf, NULL, &eollen,
+			                          EVBUFFER_EOL_CRLF);
+			if (eol.pos == -1)
+				return (sz > PXY_HTTP_LINE_MAXSZ) ? -1 : 0;
+			if (body->state == PXY_HTTP_BODY_CHUNKSIZE) {
+				memset(line, 0, sizeof(line));
+				evbuffer_copyout(inbuf, line,
+				                 ((size_t)eol.pos < sizeof(line)) ?
+				                 (size_t)eol.pos :
+				                 sizeof(line) - 1);
+				body->left = strtoull(line, &end, 16);
+				if (end == line || body->left > UINT32_MAX)
+					return -1;
+				if (body->left > 0) {
+					/* chunk data is followed by CRLF */
+					body->left += 2;
+					body->state = PXY_HTTP_BODY_CHUNKDATA;
+				} else {
+					body->state = PXY_HTTP_BODY_TRAILER;
+				}
+			} else if (eol.pos == 0) {
+				body->state = PXY_HTTP_BODY_DONE;
+			}
+			pxy_forward(ctx, inbuf, outbuf,
+			                 eol.pos + eollen, req);
+			break;
+		default:
+			return -1;
+		}
+	}
+}
+
+/*
+ * Forget the state of the current response, or the current request and its
+ * response if req is non-zero, in order to parse the next message on a
+ * persistent connection.
+ */
+static void
+pxy_http_reset(pxy_conn_ctx_t *ctx, int req)
+{
+	if (req) {
+		ctx->http_method = NULL;
+		ctx->http_uri = NULL;
+		ctx->http_host = NULL;
+		ctx->http_content_type = NULL;
+		arena_reset(&ctx->http_reqarena);
+		memset(&ctx->http_reqbody, 0, sizeof(pxy_http_body_t));
+		ctx->seen_req_header = 0;
+		ctx->sent_http_conn_close = 0;
+		ctx->http_ws_upgrade = 0;
+		ctx->http_ws_conn = 0;
+		ctx->http_cache.inm = NULL;
+		ctx->http_cache.noreuse = 0;
+		ctx->http_cache.nostore = 0;
+		ctx->http_cache.auth = 0;
+	}
+	if (ctx->http_cache.buf) {
+		evbuffer_free(ctx->http_cache.buf);
+		ctx->http_cache.buf = NULL;
+	}
+	ctx->http_cache.capture = 0;
+	ctx->http_cache.hdrsz = 0;
+	ctx->http_cache.maxage = 0;
+	ctx->http_cache.age = 0;
+	ctx->http_cache.etag = NULL;
+	ctx->http_cache.uncacheable = 0;
+	ctx->http_cache.fresh = 0;
+	ctx->http_cache.smaxage = 0;
+	ctx->http_status_code = NULL;
+	ctx->http_status_text = NULL;
+	ctx->http_content_length = NULL;
+	arena_reset(&ctx->http_resparena);
+	memset(&ctx->http_respbody, 0, sizeof(pxy_http_body_t));
+	ctx->http_resp_decode = 0;
+	ctx->seen_resp_header = 0;
+}
+
+/*
+ * Upper bound on the octets of a GET request header held back from the
+ * server until it is complete, in order to look it up in the response cache.
+ */
+#define PXY_HTTP_CACHE_HDRMAXSZ 16384
+
+/*
+ * Format the destination address of ctx into buf of sz octets, as part of
+ * the key into the HTTP response cache.  Returns -1 if it is unavailable.
+ */
+static int
+pxy_http_cache_dst(pxy_conn_ctx_t *ctx, char *buf, size_t sz)
+{
+	const char *host = pxy_conn_dsthost(ctx);
+	const char *port = pxy_conn_dstport(ctx);
+
+	if (!host || !port)
+		return -1;
+	snprintf(buf, sz, "[%s]:%s", host, port);
+	return 0;
+}
+
+/*
+ * Return 1 if the response to the current request may be taken from or
+ * stored in the HTTP response cache, 0 if not.  Only bodyless HTTP/1.1 GET
+ * requests without Authorization or Range qualify.
+ */
+static int
+pxy_http_cache_req_ok(pxy_conn_ctx_t *ctx)
+{
+	return ctx->http_method && !strcmp(ctx->http_method, "GET") &&
+	       ctx->http_uri && ctx->http_host && !ctx->http_close &&
+	       !ctx->http_cache.auth && !ctx->http_cache.nostore &&
+	       ctx->http_reqbody.state == PXY_HTTP_BODY_DONE;
+}
+
+/*
+ * Return 1 if the response header just parsed allows storing the response
+ * in the HTTP response cache, 0 if not.
+ */
+static int
+pxy_http_cache_resp_ok(pxy_conn_ctx_t *ctx)
+{
+	return ctx->http_status_code &&
+	       !strcmp(ctx->http_status_code, "200") && !ctx->http_close &&
+	       !ctx->http_cache.uncacheable && ctx->http_cache.fresh &&
+	       ctx->http_cache.maxage > ctx->http_cache.age;
+}
+
+/*
+ * Stop capturing the current response for the HTTP response cache.
+ */
+static void
+pxy_http_cache_abort(pxy_conn_ctx_t *ctx)
+{
+	if (ctx->http_cache.buf) {
+		evbuffer_free(ctx->http_cache.buf);
+		ctx->http_cache.buf = NULL;
+	}
+	ctx->http_cache.capture = 0;
+}
+
+/*
+ * Append the octets added to outbuf beyond offset *off to the response
+ * captured for the HTTP response cache and advance *off past them.  Gives up
+ * on capturing if the response exceeds HTTPCacheMaxObjectSize.  Relies on
+ * the socket bufferevent not writing out its output buffer before the event
+ * loop runs again.
+ */
+static void
+pxy_http_cache_capture(pxy_conn_ctx_t *ctx, struct evbuffer *outbuf,
+                       size_t *off)
+{
+	struct evbuffer_ptr pos;
+	struct evbuffer_iovec vec;
+	size_t sz = evbuffer_get_length(outbuf);
+	size_t left, n;
+
+	if (sz < *off)
+		goto abort;
+	left = sz - *off;
+	if (left == 0)
+		return;
+	if (!ctx->http_cache.buf &&
+	    !(ctx->http_cache.buf = evbuffer_new()))
+		goto abort;
+	if (evbuffer_get_length(ctx->http_cache.buf) + left >
+	    ctx->opts->http_cache_maxobj)
+		goto abort;
+	if (evbuffer_ptr_set(outbuf, &pos, *off, EVBUFFER_PTR_SET) == -1)
+		goto abort;
+	while (left > 0) {
+		if (evbuffer_peek(outbuf, -1, &pos, &vec, 1) < 1)
+			goto abort;
+		n = (vec.iov_len < left) ? vec.iov_len : left;
+		if (evbuffer_add(ctx->http_cache.buf, vec.iov_base, n) == -1)
+			goto abort;
+		left -= n;
+		if (left > 0 &&
+		    evbuffer_ptr_set(outbuf, &pos, n, EVBUFFER_PTR_ADD) == -1)
+			goto abort;
+	}
+	*off = sz;
+	return;
+
+abort:
+	pxy_http_cache_abort(ctx);
+}
+
+/*
+ * Store the completely captured response in the HTTP response cache.  The
+ * Age header field and the empty line ending the header are left out, since
+ * they are appended when serving the response from the cache.
+ */
+static void
+pxy_http_cache_store(pxy_conn_ctx_t *ctx, struct evbuffer *outbuf,
+                     size_t off)
+{
+	cachehttp_val_t *val;
+	char dst[INET6_ADDRSTRLEN + 9];
+	unsigned char *data, *nl;
+	const char *value;
+	size_t sz, etagsz, rd, wr, linesz, len, valuesz;
+	time_t now;
+
+	pxy_http_cache_capture(ctx, outbuf, &off);
+	if (!ctx->http_cache.capture || !ctx->http_cache.buf ||
+	    pxy_http_cache_dst(ctx, dst, sizeof(dst)) == -1)
+		goto out;
+	sz = evbuffer_get_length(ctx->http_cache.buf);
+	etagsz = ctx->http_cache.etag ? strlen(ctx->http_cache.etag) : 0;
+	if (ctx->http_cache.hdrsz > sz ||
+	    !(val = cachehttp_val_new(sz, etagsz)))
+		goto out;
+	data = val->data;
+	evbuffer_remove(ctx->http_cache.buf, data, sz);
+	for (rd = wr = 0; rd < ctx->http_cache.hdrsz; rd += linesz) {
+		nl = memchr(data + rd, '\n', ctx->http_cache.hdrsz - rd);
+		linesz = nl ? (size_t)(nl + 1 - (data + rd))
+		            : ctx->http_cache.hdrsz - rd;
+		len = linesz - (nl ? 1 : 0);
+		if (len > 0 && data[rd + len - 1] == '\r')
+			len--;
+		if (len == 0 || (rd > 0 &&
+		    httphdr_parse((char *)data + rd, len, &value,
+		                  &valuesz) == HTTPHDR_AGE))
+			continue;
+		memmove(data + wr, data + rd, linesz);
+		wr += linesz;
+	}
+	memmove(data + wr, data + ctx->http_cache.hdrsz,
+	        sz - ctx->http_cache.hdrsz);
+	val->sz = wr + sz - ctx->http_cache.hdrsz;
+	val->hdrsz = wr;
+	if (etagsz)
+		memcpy(data + val->sz, ctx->http_cache.etag, etagsz);
+	now = time(NULL);
+	val->stored = now;
+	val->age = ctx->http_cache.age;
+	val->expiry = now + (time_t)(ctx->http_cache.maxage -
+	                             ctx->http_cache.age);
+	cachemgr_http_set(dst, ctx->http_host, ctx->http_uri, val);
+	cachehttp_val_free(val);
+out:
+	pxy_http_cache_abort(ctx);
+}
+
+/*
+ * Return 1 if the If-None-Match field value inm matches the stored entity
+ * tag of etagsz octets at etag using weak comparison, 0 if not.
+ */
+static int
+pxy_http_cache_etag_match(const char *inm, const unsigned char *etag,
+                          size_t etagsz)
+{
+	size_t sz;
+
+	if (etagsz > 2 && !memcmp(etag, "W/", 2)) {
+		etag += 2;
+		etagsz -= 2;
+	}
+	for (;;) {
+		inm += strspn(inm, " \t,");
+		if (*inm == '\0')
+			return 0;
+		if (*inm == '*')
+			return 1;
+		if (!strncmp(inm, "W/", 2))
+			inm += 2;
+		sz = strcspn(inm, ",");
+		if (sz == etagsz && !memcmp(inm, etag, sz))
+			return 1;
+		inm += sz;
+	}
+}
+
+/*
+ * Release the reference to a cached response held by an evbuffer chain.
+ */
+static void
+pxy_http_cache_unref(UNUSED const void *data, UNUSED size_t datalen,
+                     void *extra)
+{
+	cachehttp_val_free(extra);
+}
+
+/*
+ * Add sz octets of the cached response val at data to buf by reference,
+ * holding another reference to val until the octets are released.
+ * Returns -1 on out of memory condition.
+ */
+static int
+pxy_http_cache_addref(struct evbuffer *buf, cachehttp_val_t *val,
+                      const unsigned char *data, size_t sz)
+{
+	if (sz == 0)
+		return 0;
+	if (evbuffer_add_reference(buf, data, sz, pxy_http_cache_unref,
+	                           cachehttp_mkval(val)) == -1) {
+		cachehttp_val_free(val);
+		return -1;
+	}
+	return 0;
+}
+
+static void pxy_http_keepalive_forward(pxy_conn_ctx_t *,
+                                       struct bufferevent *,
+                                       struct evbuffer *, struct evbuffer *);
+
+/*
+ * Answer the current request with the cached response val instead of the
+ * server, taking over the reference to val.  The response passes through the
+ * same header filtering and logging as a response read from the server.
+ * Conditional requests matching the entity tag are answered with 304.
+ */
+static void
+pxy_http_cache_serve(pxy_conn_ctx_t *ctx, cachehttp_val_t *val)
+{
+	struct evbuffer *resp;
+	unsigned long long age;
+	time_t now = time(NULL);
+	int rv;
+
+	age = val->age + ((now > val->stored) ? now - val->stored : 0);
+	if (!(resp = evbuffer_new())) {
+		ctx->enomem = 1;
+		cachehttp_val_free(val);
+		return;
+	}
+	if (ctx->http_cache.inm && val->etagsz > 0 &&
+	    pxy_http_cache_etag_match(ctx->http_cache.inm,
+	                              val->data + val->sz, val->etagsz)) {
+		rv = evbuffer_add_printf(resp, "HTTP/1.1 304 Not Modified\r\n"
+		                         "ETag: %.*s\r\nAge: %llu\r\n\r\n",
+		                         (int)val->etagsz,
+		                         val->data + val->sz, age);
+	} else {
+		rv = pxy_http_cache_addref(resp, val, val->data, val->hdrsz);
+		if (rv != -1)
+			rv = evbuffer_add_printf(resp, "Age: %llu\r\n\r\n",
+			                         age);
+		if (rv != -1)
+			rv = pxy_http_cache_addref(resp, val,
+			                           val->data + val->hdrsz,
+			                           val->sz - val->hdrsz);
+	}
+	cachehttp_val_free(val);
+	if (rv == -1) {
+		ctx->enomem = 1;
+		evbuffer_free(resp);
+		return;
+	}
+	pxy_http_keepalive_forward(ctx, ctx->dst.bev, resp,
+	                           bufferevent_get_output(ctx->src.bev));
+	evbuffer_free(resp);
+}
+
+/*
+ * Look up a GET request at the start of inbuf in the HTTP response cache
+ * once its header is complete, and answer it from the cache on a hit instead
+ * of forwarding it.  Until then, the header is held back in inbuf, such that
+ * no part of it reaches the server on a hit.  On a miss, the filtered header
+ * is forwarded to outbuf and the response is marked for capturing.
+ * Returns 1 if the caller has to wait for more octets or the request was
+ * answered, 0 if the request is to be forwarded, with the header filtered
+ * already if ctx->seen_req_header is set.
+ */
+static int
+pxy_http_cache_request(pxy_conn_ctx_t *ctx, struct evbuffer *inbuf,
+                       struct evbuffer *outbuf)
+{
+	struct evbuffer *hdr;
+	struct evbuffer_ptr eol;
+	cachehttp_val_t *val;
+	char dst[INET6_ADDRSTRLEN + 9];
+	char buf[8];
+	size_t sz = evbuffer_get_length(inbuf), eollen;
+
+	/* only GET requests with an HTTP/1.1 request line are held back */
+	evbuffer_copyout(inbuf, buf, (sz < 4) ? sz : 4);
+	if (memcmp(buf, "GET ", (sz < 4) ? sz : 4))
+		return 0;
+	eol = evbuffer_search_eol(inbuf, NULL, &eollen, EVBUFFER_EOL_CRLF);
+	if (eol.pos == -1)
+		return (sz <= PXY_HTTP_CACHE_HDRMAXSZ);
+	if (eol.pos < 8 || evbuffer_ptr_set(inbuf, &eol, eol.pos - 8,
+	                                    EVBUFFER_PTR_SET) == -1 ||
+	    evbuffer_copyout_from(inbuf, &eol, buf, 8) != 8 ||
+	    memcmp(buf, "HTTP/1.1", 8))
+		return 0;
+	if (evbuffer_search(inbuf, "\r\n\r\n", 4, NULL).pos == -1 &&
+	    evbuffer_search(inbuf, "\n\n", 2, NULL).pos == -1)
+		return (sz <= PXY_HTTP_CACHE_HDRMAXSZ);
+
+	if (!(hdr = evbuffer_new())) {
+		ctx->enomem = 1;
+		return 1;
+	}
+	pxy_http_hdr_filter(ctx, inbuf, hdr, 1);
+	if (ctx->enomem || ctx->ocsp_denied) {
+		evbuffer_free(hdr);
+		return 1;
+	}
+	if (ctx->seen_req_header) {
+		if (pxy_http_body_start(&ctx->http_reqbody, 0, 1) == -1)
+			ctx->http_raw = 1;
+		else if (pxy_http_cache_req_ok(ctx) &&
+		    pxy_http_cache_dst(ctx, dst, sizeof(dst)) != -1) {
+			if (!ctx->http_cache.noreuse &&
+			    (val = cachemgr_http_get(dst, ctx->http_host,
+			                             ctx->http_uri))) {
+				evbuffer_free(hdr);
+				pxy_http_cache_serve(ctx, val);
+				return 1;
+			}
+			ctx->http_cache.capture = 1;
+		}
+	}
+	evbuffer_add_buffer(outbuf, hdr);
+	evbuffer_free(hdr);
+	return 0;
+}
+
+/*
+ * Forward data in keep-alive mode, where the boundaries of requests and
+ * responses are tracked in order to filter and log the headers of every
+ * message on a persistent connection.  Pipelined requests are held back in
+ * the src input buffer until the response to the previous request has been
+ * forwarded.  If the message framing cannot be followed, ctx->http_raw is
+ * set and the remaining data is forwarded as is.
+ */
+static void
+pxy_http_keepalive_forward(pxy_conn_ctx_t *ctx, struct bufferevent *bev,
+                           struct evbuffer *inbuf, struct evbuffer *outbuf)
+{
+	int req = (bev == ctx->src.bev);
+	pxy_http_body_t *body = req ? &ctx->http_reqbody : &ctx->http_respbody;
+	struct evbuffer *srcinbuf;
+	size_t capoff = 0;
+
+	if (req && evbuffer_get_length(inbuf) > 0)
+		ctx->http_idle = 0;
+	if (!req && ctx->http_cache.capture)
+		capoff = evbuffer_get_length(outbuf);
+	while (!ctx->http_raw && !ctx->enomem) {
+		if (req ? !ctx->seen_req_header : !ctx->seen_resp_header) {
+			if (evbuffer_get_length(inbuf) == 0)
+				goto out;
+			if (req && !ctx->http_method && WANT_HTTP_CACHE(ctx)) {
+				if (pxy_http_cache_request(ctx, inbuf, outbuf))
+					return;
+				if (ctx->seen_req_header)
+					continue;
+			}
+			pxy_http_hdr_filter(ctx, inbuf, outbuf, req);
+			if (ctx->enomem || ctx->ocsp_denied)
+				goto out;
+			if (req ? !ctx->seen_req_header
+			        : !ctx->seen_resp_header)
+				goto out;
+			if (!req && ctx->http_cache.capture) {
+				pxy_http_cache_capture(ctx, outbuf, &capoff);
+				ctx->http_cache.hdrsz = ctx->http_cache.buf ?
+				        evbuffer_get_length(ctx->http_cache.buf) : 0;
+				if (!pxy_http_cache_resp_ok(ctx))
+					pxy_http_cache_abort(ctx);
+			}
+			if (!req && (!ctx->http_status_code ||
+			    !strcmp(ctx->http_status_code, "101") ||
+			    (ctx->http_method &&
+			     !strcasecmp(ctx->http_method, "CONNECT")))) {
+				/* not HTTP/1.x, or switching protocols;
+				 * resume octets the client sent early */
+				ctx->http_raw = 1;
+				srcinbuf = bufferevent_get_input(ctx->src.bev);
+				if (evbuffer_get_length(srcinbuf) > 0) {
+					bufferevent_enable(ctx->src.bev,
+					                   EV_READ);
+					bufferevent_trigger(ctx->src.bev,
+					        EV_READ, BEV_TRIG_DEFER_CALLBACKS);
+				}
+				break;
+			}
+			if (pxy_http_body_start(body, !req &&
+			                        pxy_http_resp_is_bodyless(ctx),
+			                        req) == -1) {
+				/* cannot tell where the message ends */
+				ctx->http_raw = 1;
+				continue;
+			}
+		}
+		switch (pxy_http_body_forward(ctx, body, inbuf, outbuf, req)) {
+		case -1:
+			ctx->http_raw = 1;
+			continue;
+		case 0:
+			goto out;
+		default:
+			break;
+		}
+		if (req) {
+			/* hold back pipelined requests until the response
+			 * has been forwarded */
+			if (evbuffer_get_length(inbuf) > 0)
+				bufferevent_disable(bev, EV_READ);
+			return;
+		}
+		if (pxy_http_resp_is_interim(ctx)) {
+			pxy_http_reset(ctx, 0);
+			continue;
+		}
+		if (ctx->http_reqbody.state != PXY_HTTP_BODY_DONE) {
+			/* early response while request body is still being
+			 * sent; give up on tracking message boundaries */
+			ctx->http_raw = 1;
+			break;
+		}
+		if (ctx->http_cache.capture)
+			pxy_http_cache_store(ctx, outbuf, capoff);
+		pxy_http_reset(ctx, 1);
+		srcinbuf = bufferevent_get_input(ctx->src.bev);
+		ctx->http_idle = (evbuffer_get_length(srcinbuf) == 0);
+		if (evbuffer_get_length(srcinbuf) > 0) {
+			bufferevent_enable(ctx->src.bev, EV_READ);
+			bufferevent_trigger(ctx->src.bev, EV_READ,
+			                    BEV_TRIG_DEFER_CALLBACKS);
+		}
+	}
+	if (ctx->http_raw && evbuffer_get_length(inbuf) > 0) {
+		pxy_forward(ctx, inbuf, outbuf,
+		                 evbuffer_get_length(inbuf), req);
+	}
+out:
+	if (!req && ctx->http_cache.capture) {
+		if (ctx->http_raw || ctx->enomem)
+			pxy_http_cache_abort(ctx);
+		else
+			pxy_http_cache_capture(ctx, outbuf, &capoff);
+	}
+}
+
+/*
+ * Adapt the output buffer limit of desc after its output buffer has drained
+ * down to len octets since the other end was paused.  The new limit is the
+ * amount of data drained per OUTBUF_DRAIN_USEC, changing by at most a factor
+ * of two per step.  While the limits of all connections exceed the memory
+ * budget, limits are halved instead of adapted, and never grow beyond it.
+ */
+static void
+pxy_outbuf_adapt(pxy_conn_ctx_t *ctx, pxy_conn_desc_t *desc, size_t len)
+{
+	struct timeval now, tv;
+	unsigned long long usec, drained, limit;
+	size_t budget = ctx->opts->outbuf_membudget;
+	size_t total;
+
+	if (!desc->outbuf_paused)
+		return;
+	event_base_gettimeofday_cached(ctx->evbase, &now);
+	evutil_timersub(&now, &desc->paused_tv, &tv);
+	usec = (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+	if (usec == 0)
+		usec = 1;
+	drained = desc->outbuf_paused > len ? desc->outbuf_paused - len : 0;
+	desc->outbuf_paused = 0;
+
+	limit = drained * OUTBUF_DRAIN_USEC / usec;
+	if (limit > desc->outbuf_limit * 2)
+		limit = desc->outbuf_limit * 2;
+	if (limit < desc->outbuf_limit / 2)
+		limit = desc->outbuf_limit / 2;
+	if (budget) {
+		total = __atomic_load_n(&pxy_outbuf_total, __ATOMIC_RELAXED);
+		if (total > budget) {
+			limit = desc->outbuf_limit / 2;
+		} else if (limit > desc->outbuf_limit &&
+		           total + (limit - desc->outbuf_limit) > budget) {
+			limit = desc->outbuf_limit;
+		}
+	}
+	if (limit > OUTBUF_LIMIT_MAX)
+		limit = OUTBUF_LIMIT_MAX;
+	if (limit < OUTBUF_LIMIT_MIN)
+		limit = OUTBUF_LIMIT_MIN;
+	pxy_outbuf_setlimit(desc, limit);
+}
+
+/*
+ * Timer callback resuming reading on connection ends throttled because a
+ * content logger exceeded its memory budget.  Ends whose other end still has
+ * a full output buffer are resumed by pxy_bev_writecb() instead.
+ */
+static void
+pxy_log_throttle_cb(UNUSED evutil_socket_t fd, UNUSED short what, void *arg)
+{
+	pxy_conn_ctx_t *ctx = arg;
+	struct timeval delay = {0, LOG_THROTTLE_DELAY};
+	pxy_conn_desc_t *descs[2] = {&ctx->src, &ctx->dst};
+	pxy_conn_desc_t *other;
+
+	if (log_content_over_budget()) {
+		evtimer_add(ctx->logthrottleev, &delay);
+		return;
+	}
+	for (int i = 0; i < 2; i++) {
+		other = (descs[i] == &ctx->src) ? &ctx->dst : &ctx->src;
+		if (!descs[i]->log_throttled)
+			continue;
+		descs[i]->log_throttled = 0;
+		if (!descs[i]->bev || descs[i]->closed || !other->bev)
+			continue;
+		if (evbuffer_get_length(bufferevent_get_output(other->bev)) <
+		    other->outbuf_limit)
+			bufferevent_enable(descs[i]->bev, EV_READ);
+	}
+}
+
+/*
+ * Temporarily stop reading from bev because a content logger exceeds its
+ * memory budget.
+ */
+static void
+pxy_log_throttle(pxy_conn_ctx_t *ctx, struct bufferevent *bev)
+{
+	struct timeval delay = {0, LOG_THROTTLE_DELAY};
+	pxy_conn_desc_t *this = (bev==ctx->src.bev) ? &ctx->src : &ctx->dst;
+
+	if (!ctx->logthrottleev) {
+		ctx->logthrottleev = evtimer_new(ctx->evbase,
+		                                 pxy_log_throttle_cb, ctx);
+		if (!ctx->logthrottleev)
+			return;
+	}
+	bufferevent_disable(bev, EV_READ);
+	this->log_throttled = 1;
+	if (!evtimer_pending(ctx->logthrottleev, NULL))
+		evtimer_add(ctx->logthrottleev, &delay);
+}
+
+/*
+ * Free the bufferevents of a connection whose sockets are handed over to
+ * splice(2), io_uring or another thread.  The bufferevents were created
+ * without BEV_OPT_CLOSE_ON_FREE, so the sockets stay open and the SSL objects
+ * are not freed.
+ */
+static void
+pxy_bev_release(pxy_conn_ctx_t *ctx)
+{
+	bufferevent_setcb(ctx->src.bev, NULL, NULL, NULL, NULL);
+	bufferevent_free(ctx->src.bev);
+	ctx->src.bev = NULL;
+	bufferevent_setcb(ctx->dst.bev, NULL, NULL, NULL, NULL);
+	bufferevent_free(ctx->dst.bev);
+	ctx->dst.bev = NULL;
+}
+
+#ifdef HAVE_SPLICE
+/*
+ * Return 1 if the connection can be forwarded using splice(2) or io_uring,
+ * i.e. if the data is passed through as is without being looked at and is
+ * not subject to traffic shaping, 0 otherwise.
+ */
+static int
+pxy_splice_eligible(pxy_conn_ctx_t *ctx)
+{
+	return (ctx->opts->splice || ctx->opts->iouring) &&
+	       !ctx->src.ssl && !ctx->dst.ssl &&
+	       !ctx->clienthello_search && !ctx->clienthello_found &&
+	       (!ctx->spec->http || ctx->passthrough) &&
+	       !pxy_conn_shape_rate(ctx) &&
+	       !WANT_CONTENT_LOG(ctx) && !WANT_INSPECT(ctx);
+}
+
+/*
+ * Move the data of one direction of a spliced connection from the source
+ * socket through the pipe to the destination socket.  Reading from the
+ * source is suspended while the pipe cannot be written out to the
+ * destination.  Returns 1 once EOF was read from the source and everything
+ * was written, -1 on error and 0 otherwise.
+ */
+static int
+pxy_splice_move(pxy_splice_dir_t *d)
+{
+	ssize_t n;
+	int i;
+
+	for (i = 0; i < SPLICE_ROUNDS; i++) {
+		if (d->inpipe > 0) {
+			n = splice(d->pipefd[0], NULL, d->to, NULL, d->inpipe,
+			           SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+			if (n == -1) {
+				if (errno == EINTR)
+					continue;
+				if (errno != EAGAIN)
+					return -1;
+				event_del(d->rdev);
+				event_add(d->wrev, NULL);
+				return 0;
+			}
+			d->inpipe -= n;
+			continue;
+		}
+		if (d->eof)
+			return 1;
+		n = splice(d->from, NULL, d->pipefd[1], NULL, SPLICE_CHUNK,
+		           SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				return -1;
+			event_del(d->wrev);
+			event_add(d->rdev, NULL);
+			return 0;
+		}
+		if (n == 0) {
+			d->eof = 1;
+			continue;
+		}
+		d->inpipe += n;
+		pxy_conn_bytes(d->ctx, d->is_requestor, n);
+		if (!d->is_requestor && d->ctx->ttfb) {
+			d->ctx->ttfb = 0;
+			pxy_conn_phase(d->ctx, STATS_PHASE_TTFB);
+		}
+	}
+	/* more to do; the persistent events fire again */
+	return 0;
+}
+
+/*
+ * Close both ends of a spliced connection and clean up.
+ */
+static void
+pxy_splice_close(pxy_conn_ctx_t *ctx, int by_requestor)
+{
+	evutil_socket_t srcfd = ctx->splice[0].from;
+	evutil_socket_t dstfd = ctx->splice[0].to;
+
+	if (OPTS_DEBUG(ctx->opts)) {
+		log_dbg_printf("TCP disconnected to [%s]:%s\n",
+		               STRORDASH(pxy_conn_dsthost(ctx)),
+		               STRORDASH(pxy_conn_dstport(ctx)));
+		log_dbg_printf("TCP disconnected from [%s]:%s\n",
+		               pxy_conn_srchost(ctx), pxy_conn_srcport(ctx));
+	}
+
+	if (ctx->opts->stats_tcptop) {
+		pxy_conn_tcpinfo_stats(ctx, STATS_LEG_SRC, srcfd);
+		pxy_conn_tcpinfo_stats(ctx, STATS_LEG_DST, dstfd);
+	}
+	pxy_splice_free(ctx->splice);
+	ctx->splice = NULL;
+	evutil_closesocket(dstfd);
+	evutil_closesocket(srcfd);
+	pxy_conn_ctx_free(ctx, by_requestor);
+}
+
+/*
+ * Callback for read events on the source and write events on the destination
+ * socket of one direction of a spliced connection.
+ */
+static void
+pxy_splice_handler(UNUSED evutil_socket_t fd, UNUSED short what,
+                   void *arg)
+{
+	pxy_splice_dir_t *d = arg;
+	pxy_conn_ctx_t *ctx = d->ctx;
+	int rv;
+
+	rv = pxy_splice_move(d);
+	if (rv == 0)
+		return;
+	if (rv == -1) {
+		log_err_rl_printf("Error splicing from %s to %s: %i:%s\n",
+		                  d->is_requestor ? "src" : "dst",
+		                  d->is_requestor ? "dst" : "src",
+		                  errno, strerror(errno));
+	}
+	pxy_splice_close(ctx, d->is_requestor);
+}
+
+static void
+pxy_splice_cb(evutil_socket_t fd, short what, void *arg)
+{
+	pxy_cpu_t *cpu = pxy_cpu_enter(((pxy_splice_dir_t *)arg)->ctx);
+
+	pxy_splice_handler(fd, what, arg);
+	pxy_cpu_leave(cpu);
+}
+
+#ifdef HAVE_IOURING
+/*
+ * Submit the next operation of one direction of an io_uring connection:
+ * send what is left in the buffer, or receive into it once it is empty.
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+pxy_uring_next(pxy_uring_dir_t *d)
+{
+	iouring_t *ring = d->uc->ring;
+	int rv;
+
+	if (d->off < d->len) {
+		rv = iouring_send(ring, &d->op, d->to, d->buf, d->off,
+		                  d->len - d->off);
+	} else {
+		d->len = d->off = 0;
+		rv = iouring_recv(ring, &d->op, d->from, d->buf, 0,
+		                  iouring_buf_size(ring));
+	}
+	if (rv == 0)
+		d->busy = 1;
+	return rv;
+}
+
+/*
+ * Close both ends of a connection forwarded using io_uring and clean up.
+ */
+static void
+pxy_uring_close(pxy_uring_conn_t *uc, int by_requestor)
+{
+	pxy_conn_ctx_t *ctx = uc->ctx;
+
+	if (OPTS_DEBUG(ctx->opts)) {
+		log_dbg_printf("TCP disconnected to [%s]:%s\n",
+		               STRORDASH(pxy_conn_dsthost(ctx)),
+		               STRORDASH(pxy_conn_dstport(ctx)));
+		log_dbg_printf("TCP disconnected from [%s]:%s\n",
+		               pxy_conn_srchost(ctx), pxy_conn_srcport(ctx));
+	}
+
+	if (ctx->opts->stats_tcptop) {
+		pxy_conn_tcpinfo_stats(ctx, STATS_LEG_SRC, uc->dir[0].from);
+		pxy_conn_tcpinfo_stats(ctx, STATS_LEG_DST, uc->dir[0].to);
+	}
+	ctx->uring = NULL;
+	pxy_uring_detach(uc);
+	pxy_conn_ctx_free(ctx, by_requestor);
+}
+
+/*
+ * Completion of a receive or send of one direction of an io_uring
+ * connection.  As with splice, the connection is closed on EOF in either
+ * direction.
+ */
+static void
+pxy_uring_handler(pxy_uring_dir_t *d, int res)
+{
+	pxy_uring_conn_t *uc = d->uc;
+	pxy_conn_ctx_t *ctx = uc->ctx;
+
+	d->busy = 0;
+	if (!ctx) {
+		pxy_uring_finish(uc);
+		return;
+	}
+	if (res == -EINTR || res == -EAGAIN)
+		goto next;
+	if (res < 0) {
+		log_err_rl_printf("Error forwarding from %s to %s: %i:%s\n",
+		                  d->is_requestor ? "src" : "dst",
+		                  d->is_requestor ? "dst" : "src",
+		                  -res, strerror(-res));
+		goto closeout;
+	}
+	if (d->len == 0) {
+		if (res == 0)
+			goto closeout;
+		d->len = res;
+		pxy_conn_bytes(ctx, d->is_requestor, res);
+		if (!d->is_requestor && ctx->ttfb) {
+			ctx->ttfb = 0;
+			pxy_conn_phase(ctx, STATS_PHASE_TTFB);
+		}
+	} else {
+		d->off += res;
+	}
+next:
+	if (pxy_uring_next(d) == -1) {
+		log_err_rl_printf("Error submitting io_uring operation: "
+		                  "%s (%i)\n", strerror(errno), errno);
+		goto closeout;
+	}
+	return;
+
+closeout:
+	pxy_uring_close(uc, d->is_requestor);
+}
+
+static void
+pxy_uring_cb(iouring_op_t *op, int res)
+{
+	pxy_uring_dir_t *d = op->arg;
+	pxy_cpu_t *cpu = d->uc->ctx ? pxy_cpu_enter(d->uc->ctx) : NULL;
+
+	pxy_uring_handler(d, res);
+	pxy_cpu_leave(cpu);
+}
+
+/*
+ * Hand forwarding of a connected plain TCP connection over from the
+ * bufferevents to the io_uring of the connection handling thread.  Must
+ * only be called while nothing is buffered in any of the evbuffers.  If the
+ * thread has no io_uring or no free buffers, the connection is not handed
+ * over.
+ * Returns 1 if the connection was handed over, 0 otherwise.
+ */
+static int
+pxy_uring_start(pxy_conn_ctx_t *ctx)
+{
+	iouring_t *ring = pxy_thrmgr_get_uring(ctx->thrmgr, ctx->thridx);
+	pxy_uring_conn_t *uc;
+	unsigned char *mem;
+	int i;
+
+	if (!ring)
+		return 0;
+	uc = malloc(sizeof(pxy_uring_conn_t));
+	if (!uc)
+		return 0;
+	memset(uc, 0, sizeof(pxy_uring_conn_t));
+	uc->ctx = ctx;
+	uc->ring = ring;
+	uc->dir[0].from = uc->dir[1].to = bufferevent_getfd(ctx->src.bev);
+	uc->dir[0].to = uc->dir[1].from = bufferevent_getfd(ctx->dst.bev);
+	uc->dir[0].is_requestor = 1;
+	for (i = 0; i < 2; i++) {
+		uc->dir[i].uc = uc;
+		uc->dir[i].op.cb = pxy_uring_cb;
+		uc->dir[i].op.arg = &uc->dir[i];
+		uc->dir[i].buf = iouring_buf_get(ring, &mem);
+	}
+	if (uc->dir[0].buf == -1 || uc->dir[1].buf == -1) {
+		for (i = 0; i < 2; i++) {
+			if (uc->dir[i].buf != -1)
+				iouring_buf_put(ring, uc->dir[i].buf);
+		}
+		free(uc);
+		return 0;
+	}
+
+	pxy_bev_release(ctx);
+	ctx->uring = uc;
+	if (OPTS_DEBUG(ctx->opts)) {
+		log_dbg_printf("Forwarding using io_uring\n");
+	}
+	for (i = 0; i < 2; i++) {
+		if (pxy_uring_next(&uc->dir[i]) == -1) {
+			log_err_rl_printf("Error submitting io_uring "
+			                  "operation: %s (%i)\n",
+			                  strerror(errno), errno);
+			pxy_uring_close(uc, 1);
+			break;
+		}
+	}
+	return 1;
+}
+#endif /* HAVE_IOURING */
+
+/*
+ * Hand forwarding of a connected plain TCP connection over from the
+ * bufferevents to splice(2), or to io_uring if IOUringForward is set.  This
+ * is only possible while nothing is buffered in any of the evbuffers;
+ * otherwise the handover is retried from the writecb after the output
+ * buffers have drained.  If the pipes or events cannot be created, the
+ * connection stays on the bufferevents.
+ * Returns 1 if the connection was handed over, 0 otherwise.
+ */
+static int
+pxy_splice_start(pxy_conn_ctx_t *ctx)
+{
+	pxy_splice_dir_t *sp;
+	int i;
+
+	if (evbuffer_get_length(bufferevent_get_input(ctx->src.bev)) ||
+	    evbuffer_get_length(bufferevent_get_output(ctx->src.bev)) ||
+	    evbuffer_get_length(bufferevent_get_input(ctx->dst.bev)) ||
+	    evbuffer_get_length(bufferevent_get_output(ctx->dst.bev))) {
+		ctx->splice_pending = 1;
+		return 0;
+	}
+	ctx->splice_pending = 0;
+#ifdef HAVE_ZEROCOPY
+	/* sockets with MSG_ZEROCOPY sends stay on the bufferevents */
+	if (ctx->src.zc || ctx->dst.zc)
+		return 0;
+#endif /* HAVE_ZEROCOPY */
+
+#ifdef HAVE_IOURING
+	if (ctx->opts->iouring && pxy_uring_start(ctx))
+		return 1;
+#endif /* HAVE_IOURING */
+	if (!ctx->opts->splice)
+		return 0;
+
+	sp = malloc(2 * sizeof(pxy_splice_dir_t));
+	if (!sp)
+		return 0;
+	memset(sp, 0, 2 * sizeof(pxy_splice_dir_t));
+	sp[0].from = sp[1].to = bufferevent_getfd(ctx->src.bev);
+	sp[0].to = sp[1].from = bufferevent_getfd(ctx->dst.bev);
+	sp[0].is_requestor = 1;
+	for (i = 0; i < 2; i++) {
+		sp[i].ctx = ctx;
+		sp[i].pipefd[0] = sp[i].pipefd[1] = -1;
+	}
+	for (i = 0; i < 2; i++) {
+		if (pipe2(sp[i].pipefd, O_NONBLOCK|O_CLOEXEC) == -1) {
+			log_dbg_printf("Error creating splice pipe: %s "
+			               "(%i)\n", strerror(errno), errno);
+			goto errout;
+		}
+		sp[i].rdev = event_new(ctx->evbase, sp[i].from,
+		                       EV_READ|EV_PERSIST, pxy_splice_cb,
+		                       &sp[i]);
+		sp[i].wrev = event_new(ctx->evbase, sp[i].to,
+		                       EV_WRITE|EV_PERSIST, pxy_splice_cb,
+		                       &sp[i]);
+		if (!sp[i].rdev || !sp[i].wrev)
+			goto errout;
+		(void)event_priority_set(sp[i].rdev, PXY_PRIO_ESTAB);
+		(void)event_priority_set(sp[i].wrev, PXY_PRIO_ESTAB);
+	}
+
+	pxy_bev_release(ctx);
+	ctx->splice = sp;
+	for (i = 0; i < 2; i++) {
+		event_add(sp[i].rdev, NULL);
+	}
+	if (OPTS_DEBUG(ctx->opts)) {
+		log_dbg_printf("Forwarding using splice\n");
+	}
+	return 1;
+
+errout:
+	pxy_splice_free(sp);
+	return 0;
+}
+#endif /* HAVE_SPLICE */
+
+#ifdef HAVE_ZEROCOPY
+/*
+ * Send what was forwarded to outbuf using MSG_ZEROCOPY if ZeroCopyForward is
+ * set, outbuf is the output buffer of a plain TCP socket and enough octets
+ * are pending.  Connections forwarded using splice(2) or io_uring and shaped
+ * connections are left alone.
+ */
+static void
+pxy_zc_forward(pxy_conn_ctx_t *ctx, struct evbuffer *outbuf, int req)
+{
+	pxy_conn_desc_t *to = req ? &ctx->dst : &ctx->src;
+
+	if (!ctx->opts->zerocopy || !ctx->connected || to->closed ||
+	    to->ssl || to->zc_off || !to->bev ||
+	    outbuf != bufferevent_get_output(to->bev) ||
+	    evbuffer_get_length(outbuf) < ZEROCOPY_MIN ||
+	    bufferevent_get_underlying(to->bev) ||
+	    pxy_conn_shape_rate(ctx) || pxy_splice_eligible(ctx))
+		return;
+	pxy_zc_send(ctx, to, outbuf);
+}
+#endif /* HAVE_ZEROCOPY */
+
+/*
+ * Temporarily stop reading from bev while the output buffer of the other end
+ * is full; pxy_bev_writecb() resumes reading once it has drained.
+ */
+static void
+pxy_bev_flowctl(pxy_conn_ctx_t *ctx, struct bufferevent *bev,
+                pxy_conn_desc_t *other, struct evbuffer *outbuf)
+{
+	if (evbuffer_get_length(outbuf) >= other->outbuf_limit) {
+		/* temporarily disable data source;
+		 * set an appropriate watermark. */
+		bufferevent_setwatermark(other->bev, EV_WRITE,
+				other->outbuf_limit/2, other->outbuf_limit);
+		bufferevent_disable(bev, EV_READ);
+		other->outbuf_paused = evbuffer_get_length(outbuf);
+		event_base_gettimeofday_cached(ctx->evbase, &other->paused_tv);
+	}
+}
+
+/*
+ * Read handler of established connections which neither log content nor
+ * pass it to inspection plugins: move everything read to the other end.
+ */
+static void
+pxy_bev_read_raw_handler(struct bufferevent *bev, pxy_conn_ctx_t *ctx)
+{
+	int req = (bev == ctx->src.bev);
+	pxy_conn_desc_t *other = req ? &ctx->dst : &ctx->src;
+	struct evbuffer *inbuf = bufferevent_get_input(bev);
+	struct evbuffer *outbuf;
+
+	if (other->closed) {
+		log_dbg_printf("Warning: Drained %zu bytes (conn closed)\n",
+		               evbuffer_get_length(inbuf));
+		evbuffer_drain(inbuf, evbuffer_get_length(inbuf));
+		return;
+	}
+	outbuf = bufferevent_get_output(other->bev);
+	pxy_conn_bytes(ctx, req, evbuffer_get_length(inbuf));
+	evbuffer_add_buffer(outbuf, inbuf);
+#ifdef HAVE_ZEROCOPY
+	pxy_zc_forward(ctx, outbuf, req);
+#endif /* HAVE_ZEROCOPY */
+	pxy_bev_flowctl(ctx, bev, other, outbuf);
+}
+
+static void
+pxy_bev_readcb_raw(struct bufferevent *bev, void *arg)
+{
+	pxy_cpu_t *cpu = pxy_cpu_enter(arg);
+
+	pxy_bev_read_raw_handler(bev, arg);
+	pxy_cpu_leave(cpu);
+}
+
+/*
+ * Read handler of established connections whose content is logged, matched
+ * against content log triggers or inspected, but no longer needs any of the
+ * setup, autossl or HTTP header processing of pxy_bev_read_handler().
+ */
+static void
+pxy_bev_read_logged_handler(struct bufferevent *bev, pxy_conn_ctx_t *ctx)
+{
+	int req = (bev == ctx->src.bev);
+	pxy_conn_desc_t *other = req ? &ctx->dst : &ctx->src;
+	struct evbuffer *inbuf = bufferevent_get_input(bev);
+	struct evbuffer *outbuf;
+
+	if (other->closed) {
+		log_dbg_printf("Warning: Drained %zu bytes (conn closed)\n",
+		               evbuffer_get_length(inbuf));
+		evbuffer_drain(inbuf, evbuffer_get_length(inbuf));
+		return;
+	}
+	if (pxy_inspect_terminate(ctx, bev))
+		return;
+	outbuf = bufferevent_get_output(other->bev);
+	pxy_forward(ctx, inbuf, outbuf, evbuffer_get_length(inbuf), req);
+	if (pxy_inspect_terminate(ctx, bev))
+		return;
+	pxy_bev_flowctl(ctx, bev, other, outbuf);
+	if (WANT_CONTENT_LOG(ctx) && log_content_over_budget()) {
+		pxy_log_throttle(ctx, bev);
+	}
+}
+
+static void
+pxy_bev_readcb_logged(struct bufferevent *bev, void *arg)
+{
+	pxy_cpu_t *cpu = pxy_cpu_enter(arg);
+
+	pxy_bev_read_logged_handler(bev, arg);
+	pxy_cpu_leave(cpu);
+}
+
+/*
+ * Once a connection is past all phases which pxy_bev_read_handler() has to
+ * check for on every read (setup, autossl ClientHello search, time to first
+ * byte, HTTP header processing and content log rules waiting for the Host
+ * header), switch both bufferevents to the read callback specialised for
+ * what is left: plain forwarding, or forwarding with content logging and
+ * inspection.  None of the conditions checked here can become true again
+ * later.  pxy_bev_read_handler() handles all states, so direct calls to
+ * pxy_bev_readcb() on EOF remain correct.
+ */
+static void
+pxy_bev_specialise(pxy_conn_ctx_t *ctx)
+{
+	bufferevent_data_cb readcb;
+
+	if (ctx->fastpath || !ctx->established || ctx->ttfb ||
+	    ctx->clienthello_search || ctx->chhold || ctx->log_pending ||
+	    !ctx->src.bev || !ctx->dst.bev ||
+	    ctx->src.closed || ctx->dst.closed)
+		return;
+	if (ctx->spec->http && !ctx->passthrough &&
+	    ((ctx->opts->http_keepalive && !ctx->http_raw) ||
+	     !ctx->seen_req_header || !ctx->seen_resp_header))
+		return;
+	if (WANT_CONTENT_LOG(ctx) || WANT_INSPECT(ctx) || ctx->log_match_hit)
+		readcb = pxy_bev_readcb_logged;
+	else
+		readcb = pxy_bev_readcb_raw;
+	bufferevent_setcb(ctx->src.bev, readcb, pxy_bev_writecb,
+	                  pxy_bev_eventcb, ctx);
+	bufferevent_setcb(ctx->dst.bev, readcb, pxy_bev_writecb,
+	                  pxy_bev_eventcb, ctx);
+	ctx->fastpath = 1;
+#ifdef DEBUG_PROXY
+	if (OPTS_DEBUG(ctx->opts)) {
+		log_dbg_printf("%p switched to %s read callbacks\n",
+		               (void*)ctx, readcb == pxy_bev_readcb_raw ?
+		               "raw" : "logged");
+	}
+#endif /* DEBUG_PROXY */
+	/* hand off to the forwarding pool unless a step is pending */
+	if (ctx->handoff && !(ctx->ev && event_pending(ctx->ev,
+	                      EV_READ|EV_WRITE|EV_TIMEOUT, NULL))) {
+		if (pxy_conn_step(ctx, PXY_STEP_HANDOFF, PXY_PRIO_ESTAB) == -1)
+			ctx->enomem = 1;
+	}
+}
+
+/*
+ * Callback for read events on the up- and downstream connection bufferevents.
+ * Called when there is data ready in the input evbuffer.
+ */
+static void
+pxy_bev_read_handler(struct bufferevent *bev, void *arg)
+{
+	pxy_conn_ctx_t *ctx = arg;
+	pxy_conn_desc_t *other = (bev==ctx->src.bev) ? &ctx->dst : &ctx->src;
+
+#ifdef DEBUG_PROXY
+	if (OPTS_DEBUG(ctx->opts)) {
+		log_dbg_printf("%p %p %s readcb\n", arg, (void*)bev,
+		               (bev == ctx->src.bev) ? "src" : "dst");
+	}
+#endif /* DEBUG_PROXY */
+
+	if (ctx->forging) {
+		/* picked up when forging completes */
+		return;
+	}
+
+	if (!ctx->connected) {
+		if (ctx->speculative) {
+			/* resumed by pxy_conn_speculate_resume() */
+			bufferevent_disable(bev, EV_READ);
+			return;
+		}
+		if (ctx->readahead) {
+			/* buffered until pxy_conn_readahead_resume(); stop
+			 * reading once ClientReadAhead octets are in */
+			if (evbuffer_get_length(bufferevent_get_input(bev)) >=
+			    ctx->opts->readahead)
+				bufferevent_disable(bev, EV_READ);
+			return;
+		}
+		log_err_printf("readcb called when other end not connected - "
+		               "aborting.\n");
+		log_exceptcb();
+		return;
+	}
+
+	if (ctx->ttfb && bev == ctx->dst.bev) {
+		ctx->ttfb = 0;
+		pxy_conn_phase(ctx, STATS_PHASE_TTFB);
+	}
+
+	if (ctx->clienthello_search && bev == ctx->src.bev) {
+		if (pxy_conn_autossl_peek_and_upgrade(ctx)) {
+			return;
+		}
+		if (ctx->enomem) {
+			pxy_conn_terminate_free(ctx, 1);
+			return;
+		}
+	}
+
+	struct evbuffer *inbuf = bufferevent_get_input(bev);
+	size_t hold = (bev == ctx->src.bev) ? ctx->chhold : 0;
+	if (other->closed) {
+		log_dbg_printf("Warning: Drained %zu bytes (conn closed)\n",
+		               evbuffer_get_length(inbuf));
+		evbuffer_drain(inbuf, evbuffer_get_length(inbuf));
+		return;
+	}
+
+	struct evbuffer *outbuf = bufferevent_get_output(other->bev);
+
+	if (ctx->spec->http && ctx->opts->http_keepalive &&
+	    !ctx->http_raw && !ctx->passthrough) {
+		pxy_http_keepalive_forward(ctx, bev, inbuf, outbuf);
+		if (ctx->enomem) {
+			pxy_conn_terminate_free(ctx, (bev == ctx->src.bev));
+			return;
+		}
+		if (ctx->ocsp_denied)
+			return;
+		goto flowctl;
+	}
+
+	/* request header munging */
+	if (ctx->spec->http && !ctx->seen_req_header && (bev == ctx->src.bev)
+	    && !ctx->passthrough) {
+		pxy_http_hdr_filter(ctx, inbuf, outbuf, 1);
+		if (!ctx->seen_req_header) {
+			pxy_inspect_terminate(ctx, bev);
+			return;
+		}
+	} else
+	/* response header munging */
+	if (ctx->spec->http && !ctx->seen_resp_header && (bev == ctx->dst.bev)
+	    && !ctx->passthrough) {
+		pxy_http_hdr_filter(ctx, inbuf, outbuf, 0);
+		if (!ctx->seen_resp_header) {
+			pxy_inspect_terminate(ctx, bev);
+			return;
+		}
+	}
+
+	/* out of memory condition? */
+	if (ctx->enomem) {
+		pxy_conn_terminate_free(ctx, (bev == ctx->src.bev));
+		return;
+	}
+	if (pxy_inspect_terminate(ctx, bev))
+		return;
+
+	/* no data left after parsing headers or held back by autossl? */
+	if (evbuffer_get_length(inbuf) <= hold)
+		return;
+
+	pxy_forward(ctx, inbuf, outbuf, evbuffer_get_length(inbuf) - hold,
+	            (bev == ctx->src.bev));
+
+flowctl:
+	if (pxy_inspect_terminate(ctx, bev))
+		return;
+	pxy_bev_flowctl(ctx, bev, other, outbuf);
+	if (WANT_CONTENT_LOG(ctx) && log_content_over_budget()) {
+		pxy_log_throttle(ctx, bev);
+	}
+	pxy_bev_specialise(ctx);
+}
+
+static void
+pxy_bev_readcb(struct bufferevent *bev, void *arg)
+{
+	pxy_cpu_t *cpu = pxy_cpu_enter(arg);
+
+	pxy_bev_read_handler(bev, arg);
+	pxy_cpu_leave(cpu);
+}
+
+/*
+ * Callback for write events on the up- and downstream connection bufferevents.
+ * Called when either all data from the output evbuffer has been written,
+ * or if the outbuf is only half full again after having been full.
+ */
+static void
+pxy_bev_write_handler(struct bufferevent *bev, void *arg)
+{
+	pxy_conn_ctx_t *ctx = arg;
+	pxy_conn_desc_t *other = (bev==ctx->src.bev) ? &ctx->dst : &ctx->src;
+
+#ifdef DEBUG_PROXY
+	if (OPTS_DEBUG(ctx->opts)) {
+		log_dbg_printf("%p %p %s writecb\n", arg, (void*)bev,
+		               (bev == ctx->src.bev) ? "src" : "dst");
+	}
+#endif /* DEBUG_PROXY */
+
+	if (ctx->forging) {
+		return;
+	}
+
+	if (other->closed) {
+		struct evbuffer *outbuf = bufferevent_get_output(bev);
+		if (evbuffer_get_length(outbuf) == 0) {
+			/* finished writing and other end is closed;
+			 * close this end too and clean up memory */
+			bufferevent_free_and_close_fd(bev, ctx);
+			pxy_conn_ctx_free(ctx, (bev == ctx->dst.bev));
+		}
+		return;
+	}
+
+#ifdef HAVE_SPLICE
+	if (ctx->splice_pending && pxy_splice_start(ctx)) {
+		return;
+	}
+#endif /* HAVE_SPLICE */
+
+	if (other->bev && !other->log_throttled &&
+	    !(bufferevent_get_enabled(other->bev) & EV_READ)) {
+		/* data source temporarily disabled;
+		 * re-enable and reset watermark to 0. */
+		pxy_outbuf_adapt(ctx, (bev == ctx->src.bev) ? &ctx->src
+		                                           : &ctx->dst,
+		                 evbuffer_get_length(
+		                 bufferevent_get_output(bev)));
+		bufferevent_setwatermark(bev, EV_WRITE, 0, 0);
+		bufferevent_enable(other->bev, EV_READ);
+	}
+}
+
+static void
+pxy_bev_writecb(struct bufferevent *bev, void *arg)
+{
+	pxy_cpu_t *cpu = pxy_cpu_enter(arg);
+
+	pxy_bev_write_handler(bev, arg);
+	pxy_cpu_leave(cpu);
+}
+
+#ifdef SSL_MODE_ASYNC
+#define PXY_ASYNC_MAXFDS 4
+
+/*
+ * Tear down a connection whose src handshake failed while accepting.
+ */
+static void
+pxy_srcssl_accept_fail(pxy_conn_ctx_t *ctx)
+{
+	unsigned long sslerr;
+
+	while ((sslerr = ERR_get_error())) {
+		log_dbg_printf("Error from src SSL handshake: %lu:%i:%s\n",
+		               sslerr, ERR_GET_REASON(sslerr),
+		               ERR_reason_error_string(sslerr));
+	}
+	ctx->accepting = 0;
+	SSL_free(ctx->src.ssl);
+	ctx->src.ssl = NULL;
+	evutil_closesocket(ctx->fd);
+	bufferevent_free_and_close_fd(ctx->dst.bev, ctx);
+	ctx->dst.bev = NULL;
+	pxy_conn_ctx_free(ctx, 1);
+}
+
+/*
+ * The src handshake completed; hand the connection over to a bufferevent in
+ * open state and resume as if it had been accepted by the bufferevent.
+ */
+static void
+pxy_srcssl_accept_done(pxy_conn_ctx_t *ctx)
+{
+	ctx->accepting = 0;
+	SSL_clear_mode(ctx->src.ssl, SSL_MODE_ASYNC);
+	ctx->src.bev = bufferevent_openssl_socket_new(ctx->evbase, ctx->fd,
+	                                              ctx->src.ssl,
+	                                              BUFFEREVENT_SSL_OPEN,
+	                                              BEV_OPT_DEFER_CALLBACKS);
+	if (!ctx->src.bev) {
+		log_err_printf("Error creating bufferevent socket\n");
+		pxy_srcssl_accept_fail(ctx);
+		return;
+	}
+	bufferevent_openssl_set_allow_dirty_shutdown(ctx->src.bev, 1);
+	bufferevent_setcb(ctx->src.bev, pxy_bev_readcb, pxy_bev_writecb,
+	                  pxy_bev_eventcb, ctx);
+	/* the final priority is set before queueing any deferred callback;
+	 * dst got its own when it connected */
+	(void)bufferevent_priority_set(ctx->src.bev, PXY_PRIO_ESTAB);
+	bufferevent_enable(ctx->src.bev, EV_READ|EV_WRITE);
+	bufferevent_enable(ctx->dst.bev, EV_READ|EV_WRITE);
+#if LIBEVENT_VERSION_NUMBER >= 0x02010200
+	/* deliver data that arrived from the server during the handshake */
+	if (evbuffer_get_length(bufferevent_get_input(ctx->dst.bev))) {
+		bufferevent_trigger(ctx->dst.bev, EV_READ,
+		                    BEV_TRIG_DEFER_CALLBACKS);
+	}
+#ifdef HAVE_EARLYDATA
+	/* deliver early data held back during the handshake */
+	if (ctx->earlybuf) {
+		if (evbuffer_get_length(ctx->earlybuf)) {
+			evbuffer_add_buffer(
+			        bufferevent_get_input(ctx->src.bev),
+			        ctx->earlybuf);
+			bufferevent_trigger(ctx->src.bev, EV_READ,
+			                    BEV_TRIG_DEFER_CALLBACKS);
+		}
+		evbuffer_free(ctx->earlybuf);
+		ctx->earlybuf = NULL;
+	}
+#endif /* HAVE_EARLYDATA */
+#endif /* LIBEVENT_VERSION_NUMBER >= 0x02010200 */
+	pxy_bev_eventcb(ctx->src.bev, BEV_EVENT_CONNECTED, ctx);
+}
+
+#ifdef HAVE_EARLYDATA
+/*
+ * Return 1 if the request header at the start of buf is complete and uses
+ * an idempotent method, 0 otherwise.
+ */
+static int
+pxy_http_early_safe(struct evbuffer *buf)
+{
+	struct evbuffer_ptr end;
+	char method[16];
+	const char *space;
+	ev_ssize_t n;
+
+	end = evbuffer_search(buf, "\r\n\r\n", 4, NULL);
+	if (end.pos == -1)
+		return 0;
+	n = evbuffer_copyout(buf, method, sizeof(method));
+	if (n <= 0 || !(space = memchr(method, ' ', n)))
+		return 0;
+	return httphdr_method_idempotent(method, space - method);
+}
+
+/*
+ * Forward the early data read so far to dst before the src handshake has
+ * completed, as far as that is safe.  An attacker can replay early data,
+ * so with HTTP parsing enabled, only the header of a first request with an
+ * idempotent method is forwarded; anything else stays in ctx->earlybuf until
+ * the handshake has completed and is then handled by pxy_bev_readcb().
+ */
+static void
+pxy_srcssl_early_forward(pxy_conn_ctx_t *ctx)
+{
+	struct evbuffer *outbuf = bufferevent_get_output(ctx->dst.bev);
+	size_t sz = evbuffer_get_length(outbuf);
+
+	if (ctx->spec->http) {
+		if (ctx->seen_req_header || ctx->opts->http_keepalive ||
+		    ctx->opts->deny_ocsp ||
+		    !pxy_http_early_safe(ctx->earlybuf))
+			return;
+		pxy_http_hdr_filter(ctx, ctx->earlybuf, outbuf, 1);
+		if (ctx->enomem)
+			return;
+	} else {
+		pxy_forward(ctx, ctx->earlybuf, outbuf,
+		            evbuffer_get_length(ctx->earlybuf), 1);
+	}
+	if (OPTS_DEBUG(ctx->opts)) {
+		log_dbg_printf("Forwarding %zu octets of early data\n",
+		               evbuffer_get_length(outbuf) - sz);
+	}
+	bufferevent_enable(ctx->dst.bev, EV_WRITE);
+}
+
+/*
+ * Read the early data sent by the client along with its ClientHello into
+ * ctx->earlybuf and forward what can be forwarded right away.  Clears
+ * ctx->early once there is no more early data to read.  Returns the last
+ * SSL_read_early_data() return value.
+ */
+static int
+pxy_srcssl_early_read(pxy_conn_ctx_t *ctx)
+{
+	char buf[4096];
+	size_t sz, total = 0;
+	int rv;
+
+	while ((rv = SSL_read_early_data(ctx->src.ssl, buf, sizeof(buf),
+	                                 &sz)) ==
+	       SSL_READ_EARLY_DATA_SUCCESS) {
+		if (!ctx->earlybuf && !(ctx->earlybuf = evbuffer_new())) {
+			ctx->enomem = 1;
+			return SSL_READ_EARLY_DATA_ERROR;
+		}
+		if (evbuffer_add(ctx->earlybuf, buf, sz) == -1) {
+			ctx->enomem = 1;
+			return SSL_READ_EARLY_DATA_ERROR;
+		}
+		total += sz;
+	}
+	if (rv == SSL_READ_EARLY_DATA_FINISH)
+		ctx->early = 0;
+	if (total > 0)
+		pxy_srcssl_early_forward(ctx);
+	return rv;
+}
+#endif /* HAVE_EARLYDATA */
+
+static void pxy_srcssl_accept_cb(evutil_socket_t, short, void *);
+
+/*
+ * Drive the src handshake with SSL_MODE_ASYNC enabled or early data accepted.
+ * bufferevent_openssl does not handle SSL_ERROR_WANT_ASYNC and does not read
+ * early data, so the handshake is run manually until it completes.  When an
+ * engine pauses the handshake on a private key operation, we wait for the
+ * engine's wait fd instead of blocking the thread, which allows each thread
+ * to keep many engine operations in flight.
+ */
+static void
+pxy_srcssl_accept_handler(UNUSED evutil_socket_t fd, UNUSED short what,
+                          void *arg)
+{
+	pxy_conn_ctx_t *ctx = arg;
+	OSSL_ASYNC_FD fds[PXY_ASYNC_MAXFDS];
+	struct timeval retry_delay = {0, 1000};
+	evutil_socket_t waitfd = ctx->fd;
+	short waitev;
+	size_t numfds;
+	int rv;
+
+	if (ctx->ev) {
+		event_free(ctx->ev);
+		ctx->ev = NULL;
+	}
+
+	ERR_clear_error();
+#ifdef HAVE_EARLYDATA
+	if (ctx->early) {
+		rv = pxy_srcssl_early_read(ctx);
+		if (ctx->enomem || ctx->inspect_drop) {
+			pxy_srcssl_accept_fail(ctx);
+			return;
+		}
+	}
+	if (!ctx->early)
+#endif /* HAVE_EARLYDATA */
+	rv = SSL_do_handshake(ctx->src.ssl);
+	if (rv == 1) {
+		pxy_srcssl_accept_done(ctx);
+		return;
+	}
+	switch (SSL_get_error(ctx->src.ssl, rv)) {
+	case SSL_ERROR_WANT_READ:
+		waitev = EV_READ;
+		break;
+	case SSL_ERROR_WANT_WRITE:
+		waitev = EV_WRITE;
+		break;
+	case SSL_ERROR_WANT_ASYNC:
+		/* an engine typically uses a single wait fd per thread */
+		if (!SSL_get_all_async_fds(ctx->src.ssl, NULL, &numfds) ||
+		    numfds < 1 || numfds > PXY_ASYNC_MAXFDS ||
+		    !SSL_get_all_async_fds(ctx->src.ssl, fds, &numfds)) {
+			pxy_srcssl_accept_fail(ctx);
+			return;
+		}
+		waitfd = fds[0];
+		waitev = EV_READ;
+		break;
+	case SSL_ERROR_WANT_ASYNC_JOB:
+		/* async job pool exhausted, retry shortly */
+		waitfd = -1;
+		waitev = 0;
+		break;
+	default:
+		pxy_srcssl_accept_fail(ctx);
+		return;
+	}
+
+	ctx->ev = event_new(ctx->evbase, waitfd, waitev,
+	                    pxy_srcssl_accept_cb, ctx);
+	if (!ctx->ev) {
+		log_err_printf("Error creating handshake event, "
+		               "aborting connection\n");
+		pxy_srcssl_accept_fail(ctx);
+		return;
+	}
+	event_add(ctx->ev, (waitfd == -1) ? &retry_delay : NULL);
+}
+
+static void
+pxy_srcssl_accept_cb(evutil_socket_t fd, short what, void *arg)
+{
+	pxy_cpu_t *cpu = pxy_cpu_enter(arg);
+
+	pxy_srcssl_accept_handler(fd, what, arg);
+	pxy_cpu_leave(cpu);
+}
+
+/*
+ * Start driving the src handshake asynchronously.  The dst bufferevent is
+ * disabled until the handshake completes, except for writing early data.
+ * Returns -1 on failure, 0 on success.
+ */
+static int
+pxy_srcssl_accept(pxy_conn_ctx_t *ctx)
+{
+	if (!SSL_get_rbio(ctx->src.ssl) && !SSL_set_fd(ctx->src.ssl, ctx->fd))
+		return -1;
+	SSL_set_accept_state(ctx->src.ssl);
+	if (ctx->opts->openssl_async)
+		SSL_set_mode(ctx->src.ssl, SSL_MODE_ASYNC);
+#if defined(HAVE_EARLYDATA) && LIBEVENT_VERSION_NUMBER >= 0x02010200
+	/* without bufferevent_trigger(), early data is left to OpenSSL,
+	 * which rejects it */
+	ctx->early = !!ctx->opts->earlydata;
+#endif /* HAVE_EARLYDATA && LIBEVENT_VERSION_NUMBER >= 0x02010200 */
+	/* the ClientHello has usually been read from the fd already */
+	ctx->ev = event_new(ctx->evbase, ctx->fd, EV_READ,
+	                    pxy_srcssl_accept_cb, ctx);
+	if (!ctx->ev)
+		return -1;
+	event_active(ctx->ev, EV_READ, 0);
+	ctx->accepting = 1;
+	bufferevent_disable(ctx->dst.bev, EV_READ|EV_WRITE);
+	return 0;
+}
+#endif /* SSL_MODE_ASYNC */
+
+/*
+ * Interception of the destination failed for reason, a CACHEPASS_* value;
+ * remember it such that the next connections to it are passed through right
+ * away, see pxy_conn_connect().
+ */
+static void
+pxy_conn_pass_remember(pxy_conn_ctx_t *ctx, int reason)
+{
+	cachepass_val_t val;
+
+	if (!ctx->opts->passthrough || !ctx->opts->pass_ttl ||
+	    !ctx->dstaddrlen)
+		return;
+	val.expiry = time(NULL) + ctx->opts->pass_ttl;
+	val.reason = reason;
+	cachemgr_pass_set((struct sockaddr *)&ctx->dstaddr, ctx->dstaddrlen,
+	                  ctx->sni, &val);
+	if (OPTS_DEBUG(ctx->opts)) {
+		log_dbg_printf("Passing through for %us: %s\n",
+		               ctx->opts->pass_ttl,
+		               cachepass_reason_str(reason));
+	}
+}
+
+#if !defined(OPENSSL_NO_TLSEXT) && LIBEVENT_VERSION_NUMBER >= 0x02010200
+/*
+ * Speculative handshakes: if the forged certificate for the server
+ * certificate last seen for the SNI hostname is cached, the src SSL is
+ * created from it before connecting to dst, and both handshakes run in
+ * parallel.  Reading from src is deferred until dst has connected and the
+ * actual server certificate turned out to be the predicted one.  No ALPN
+ * protocol can be selected for src before dst has selected one, therefore
+ * ALPN is not offered to dst.  If no certificate can be predicted, the
+ * handshakes are done sequentially as usual.
+ */
+static void
+pxy_conn_speculate(pxy_conn_ctx_t *ctx)
+{
+#ifdef SSL_MODE_ASYNC
+	if (ctx->opts->openssl_async || ctx->opts->earlydata)
+		return;
+#endif /* SSL_MODE_ASYNC */
+	if (!(ctx->origcrt = cachemgr_sni_get(ctx->sni)))
+		return;
+	ctx->speculative = 1;
+	ctx->src.ssl = pxy_srcssl_create(ctx, NULL);
+	if (!ctx->src.ssl) {
+		ctx->speculative = 0;
+		ctx->immutable_cert = 0;
+		ctx->generated_cert = 0;
+		ctx->fkcrt_hit = 0;
+		X509_free(ctx->origcrt);
+		ctx->origcrt = NULL;
+		free(ctx->ssl_names);
+		ctx->ssl_names = NULL;
+		free(ctx->origcrtfpr);
+		ctx->origcrtfpr = NULL;
+		free(ctx->usedcrtfpr);
+		ctx->usedcrtfpr = NULL;
+		return;
+	}
+	if (OPTS_DEBUG(ctx->opts)) {
+		log_dbg_printf("Speculative src handshake for [%s]\n",
+		               ctx->sni);
+	}
+	if (ctx->alpn) {
+		free(ctx->alpn);
+		ctx->alpn = NULL;
+		ctx->alpnlen = 0;
+	}
+}
+
+/*
+ * Compare the certificate presented by dst to the predicted one.  On
+ * mismatch, the prediction is corrected for the next connection.
+ * Returns -1 on mismatch, 0 if the prediction held.
+ */
+static int
+pxy_conn_speculate_verify(pxy_conn_ctx_t *ctx, SSL *origssl)
+{
+	X509 *crt;
+	int rv = 0;
+
+	crt = SSL_get_peer_certificate(origssl);
+	if (!crt) {
+		cachemgr_sni_del(ctx->sni);
+		return -1;
+	}
+	if (X509_cmp(crt, ctx->origcrt)) {
+		cachemgr_sni_set(ctx->sni, crt);
+		rv = -1;
+	}
+	X509_free(crt);
+	return rv;
+}
+
+/*
+ * Dst has connected and the prediction held; deliver the src events and
+ * data held back while waiting for dst.
+ */
+static void
+pxy_conn_speculate_resume(pxy_conn_ctx_t *ctx)
+{
+	bufferevent_enable(ctx->src.bev, EV_READ|EV_WRITE);
+	if (ctx->spec_connected) {
+		ctx->spec_connected = 0;
+		bufferevent_trigger_event(ctx->src.bev, BEV_EVENT_CONNECTED,
+		                          BEV_TRIG_DEFER_CALLBACKS);
+	}
+	if (evbuffer_get_length(bufferevent_get_input(ctx->src.bev))) {
+		bufferevent_trigger(ctx->src.bev, EV_READ,
+		                    BEV_TRIG_DEFER_CALLBACKS);
+	}
+}
+#endif /* !OPENSSL_NO_TLSEXT && LIBEVENT_VERSION_NUMBER >= 0x02010200 */
+
+#if LIBEVENT_VERSION_NUMBER >= 0x02010200
+/*
+ * Forward what was read ahead from src while dst was connecting, and the
+ * EOF from src if it came before dst connected, now that it has.
+ */
+static void
+pxy_conn_readahead_resume(pxy_conn_ctx_t *ctx)
+{
+	bufferevent_setwatermark(ctx->src.bev, EV_READ, 0, 0);
+	if (ctx->readahead_eof) {
+		bufferevent_enable(ctx->src.bev, EV_WRITE);
+	} else {
+		bufferevent_enable(ctx->src.bev, EV_READ|EV_WRITE);
+	}
+	if (evbuffer_get_length(bufferevent_get_input(ctx->src.bev))) {
+		bufferevent_trigger(ctx->src.bev, EV_READ,
+		                    BEV_TRIG_DEFER_CALLBACKS);
+	}
+	if (ctx->readahead_eof) {
+		bufferevent_trigger_event(ctx->src.bev,
+		                          BEV_EVENT_READING|BEV_EVENT_EOF,
+		                          BEV_TRIG_DEFER_CALLBACKS);
+	}
+}
+#endif /* LIBEVENT_VERSION_NUMBER >= 0x02010200 */
+
+/*
+ * Hand the dst socket of a plain HTTP connection over to the upstream
+ * keep-alive pool of the thread when the client goes away between two
+ * requests, provided that neither end asked to close the connection.  The
+ * dst bufferevent is left without a socket and is still to be freed by the
+ * caller.
+ */
+static void
+pxy_http_upstream_keep(pxy_conn_ctx_t *ctx)
+{
+	struct bufferevent *bev = ctx->dst.bev;
+	evutil_socket_t fd;
+
+	if (!ctx->opts->http_upstream_pool || !ctx->spec->http ||
+	    ctx->spec->srcpool || ctx->passthrough || ctx->dst.ssl ||
+	    ctx->http_raw || !ctx->http_idle || ctx->http_close ||
+	    ctx->dst.closed || !bev)
+		return;
+#ifdef HAVE_ZEROCOPY
+	if (ctx->dst.zc)
+		return;
+#endif /* HAVE_ZEROCOPY */
+	if (evbuffer_get_length(bufferevent_get_input(bev)) > 0 ||
+	    evbuffer_get_length(bufferevent_get_output(bev)) > 0)
+		return;
+	fd = bufferevent_getfd(bev);
+	if (fd == -1)
+		return;
+	bufferevent_disable(bev, EV_READ|EV_WRITE);
+	if (bufferevent_setfd(bev, -1) == -1)
+		return;
+	if (pxy_thrmgr_httppool_put(ctx->thrmgr, ctx->thridx,
+	                            (struct sockaddr *)&ctx->dstaddr,
+	                            ctx->dstaddrlen, fd) == -1) {
+		evutil_closesocket(fd);
+		return;
+	}
+	if (OPTS_DEBUG(ctx->opts)) {
+		log_dbg_printf("Pooled upstream connection to [%s]:%s\n",
+		               STRORDASH(pxy_conn_dsthost(ctx)),
+		               STRORDASH(pxy_conn_dstport(ctx)));
+	}
+}
+
+/*
+ * Callback for meta events on the up- and downstream connection bufferevents.
+ * Called when EOF has been reached, a connection has been made, and on errors.
+ */
+static void
+pxy_bev_event_handler(struct bufferevent *bev, short events, void *arg)
+{
+	pxy_conn_ctx_t *ctx = arg;
+	pxy_conn_desc_t *this = (bev==ctx->src.bev) ? &ctx->src : &ctx->dst;
+	pxy_conn_desc_t *other = (bev==ctx->src.bev) ? &ctx->dst : &ctx->src;
+	int is_requestor = (bev == ctx->src.bev);
+
+#ifdef DEBUG_PROXY
+	if (OPTS_DEBUG(ctx->opts)) {
+		log_dbg_printf("%p %p eventcb %s %s%s%s%s\n", arg, (void*)bev,
+		               (bev == ctx->src.bev) ? "src" : "dst",
+		               events & BEV_EVENT_CONNECTED ? "connected" : "",
+		               events & BEV_EVENT_ERROR ? "error" : "",
+		               events & BEV_EVENT_TIMEOUT ? "timeout" : "",
+		               events & BEV_EVENT_EOF ? "eof" : "");
+	}
+#endif /* DEBUG_PROXY */
+
+	if (ctx->forging) {
+		/* error or EOF while forging; handle as not yet connected */
+		pxy_forge_cancel(ctx->forgejob);
+		ctx->forgejob = NULL;
+		ctx->forging = 0;
+	}
+#ifdef HAVE_LOCAL_PROCINFO
+	if (ctx->lproc.waiting) {
+		/* error or EOF while looking up local process */
+		proc_lookup_cancel(ctx->lproc.job);
+		ctx->lproc.job = NULL;
+		ctx->lproc.waiting = 0;
+	}
+#endif /* HAVE_LOCAL_PROCINFO */
+
+	if (events & BEV_EVENT_CONNECTED) {
+		if (bev != ctx->dst.bev) {
+#ifdef DEBUG_PROXY
+			if (OPTS_DEBUG(ctx->opts)) {
+				log_dbg_printf("src buffer event connected: "
+				               "ignoring event\n");
+			}
+#endif /* DEBUG_PROXY */
+			if (ctx->speculative && !ctx->connected) {
+				/* resumed by pxy_conn_speculate_resume() */
+				ctx->spec_connected = 1;
+				bufferevent_disable(bev, EV_READ);
+				return;
+			}
+			goto connected;
+		}
+		/* dst is done with its handshake; its priority is set here
+		 * from its own callback, as changing the priority of a
+		 * bufferevent with a queued deferred callback corrupts the
+		 * active queues of the event base.  When resumed after
+		 * forging or process lookup, the priority is left as is. */
+		(void)bufferevent_priority_set(bev, PXY_PRIO_ESTAB);
+
+#ifdef HAVE_LOCAL_PROCINFO
+		if (ctx->lproc.job) {
+			/* resumed by pxy_lproc_cb() */
+			ctx->lproc.waiting = 1;
+			bufferevent_disable(bev, EV_READ|EV_WRITE);
+			if (ctx->src.bev) {
+				bufferevent_disable(ctx->src.bev,
+				                    EV_READ|EV_WRITE);
+			}
+			return;
+		}
+#endif /* HAVE_LOCAL_PROCINFO */
+
+		/* dst has connected */
+		ctx->connected = 1;
+		if (!ctx->forged_async) {
+			pxy_conn_phase(ctx, this->ssl ? STATS_PHASE_DSTSSL
+			                              : STATS_PHASE_CONNECT);
+		}
+		if (!this->ssl && ctx->opts->connectlog_tcpinfo)
+			pxy_conn_tcpinfo(this, &ctx->tcpi_connect);
+		if ((ctx->spec->ssl || ctx->clienthello_found) &&
+		    !ctx->passthrough)
+			pxy_conn_timeout(ctx, OPTS_TIMEOUT_HANDSHAKE);
+
+		/* wrap client-side socket in an eventbuffer */
+#if !defined(OPENSSL_NO_TLSEXT) && LIBEVENT_VERSION_NUMBER >= 0x02010200
+		if (ctx->speculative) {
+			if (pxy_conn_speculate_verify(ctx, this->ssl) == -1) {
+				stats_inc(STATS_SSL_MISPREDICT);
+				if (OPTS_DEBUG(ctx->opts)) {
+					log_dbg_printf("Server certificate "
+					               "mispredicted; "
+					               "resetting\n");
+				}
+				pxy_conn_abort(ctx);
+				return;
+			}
+		} else
+#endif /* !OPENSSL_NO_TLSEXT && LIBEVENT_VERSION_NUMBER >= 0x02010200 */
+		if ((ctx->spec->ssl || ctx->clienthello_found) &&
+		    !ctx->passthrough) {
+			ctx->src.ssl = pxy_srcssl_create(ctx, this->ssl);
+			if (!ctx->src.ssl && ctx->forging) {
+				/* resumed by pxy_srccert_forged_cb() */
+				ctx->connected = 0;
+				bufferevent_disable(bev, EV_READ|EV_WRITE);
+				if (ctx->src.bev) {
+					bufferevent_disable(ctx->src.bev,
+					                    EV_READ|EV_WRITE);
+				}
+				return;
+			}
 			if (!ctx->src.ssl) {
 				bufferevent_free_and_close_fd(bev, ctx);
 				ctx->dst.bev = NULL;
 				ctx->dst.ssl = NULL;
-				if (ctx->opts->passthrough && !ctx->enomem) {
-					ctx->passthrough = 1;
-					ctx->connected = 0;
-					log_dbg_printf("No cert found; "
-					               "falling back "
-					               "to passthrough\n");
-					pxy_fd_readcb(ctx->fd, 0, ctx);
-					return;
-				}
-				evutil_closesocket(ctx->fd);
-				pxy_conn_ctx_free(ctx, 1);
+				if (ctx->opts->passthrough && !ctx->enomem) {
+					pxy_conn_pass_remember(ctx,
+					        CACHEPASS_NOCERT);
+					ctx->passthrough = 1;
+					stats_inc(STATS_SSL_PASSTHROUGH);
+					ctx->connected = 0;
+					log_dbg_printf("No cert found; "
+					               "falling back "
+					               "to passthrough\n");
+					pxy_fd_readcb(ctx->fd, 0, ctx);
+					return;
+				}
+				evutil_closesocket(ctx->fd);
+				pxy_conn_ctx_free(ctx, 1);
+				return;
+			}
+			pxy_conn_phase(ctx, STATS_PHASE_CERT);
+		}
+#if !defined(OPENSSL_NO_TLSEXT) && LIBEVENT_VERSION_NUMBER >= 0x02010200
+		if (ctx->speculative) {
+			pxy_conn_speculate_resume(ctx);
+		} else
+#endif /* !OPENSSL_NO_TLSEXT && LIBEVENT_VERSION_NUMBER >= 0x02010200 */
+#if LIBEVENT_VERSION_NUMBER >= 0x02010200
+		if (ctx->readahead) {
+			pxy_conn_readahead_resume(ctx);
+		} else
+#endif /* LIBEVENT_VERSION_NUMBER >= 0x02010200 */
+		if (ctx->clienthello_found) {
+			if (pxy_conn_autossl_srcbev(ctx) == -1) {
+				log_err_printf("Error completing autossl "
+				               "upgrade\n");
+			}
+#ifdef SSL_MODE_ASYNC
+		} else if (ctx->src.ssl && (ctx->opts->openssl_async ||
+		                            ctx->opts->earlydata)) {
+			/* src.bev is set up once the handshake completes */
+			if (pxy_srcssl_accept(ctx) == -1) {
+				log_err_printf("Error starting async SSL "
+				               "handshake\n");
+			}
+#endif /* SSL_MODE_ASYNC */
+		} else {
+			ctx->src.bev = pxy_bufferevent_setup(ctx, ctx->fd,
+			                                     ctx->src.ssl);
+		}
+		if (!ctx->src.bev && !ctx->accepting) {
+			if (ctx->src.ssl) {
+				SSL_free(ctx->src.ssl);
+				ctx->src.ssl = NULL;
+			}
+			bufferevent_free_and_close_fd(bev, ctx);
+			evutil_closesocket(ctx->fd);
+			pxy_conn_ctx_free(ctx, 1);
+			return;
+		}
+
+#ifdef HAVE_LOCAL_PROCINFO
+		/* prepare logging, part 2; addresses are formatted on use */
+		if ((WANT_CONNECT_LOG(ctx) || WANT_CONTENT_LOG(ctx)) &&
+		    ctx->opts->lprocinfo && !ctx->lproc.done) {
+			/* fetch process info synchronously */
+			if (proc_pid_for_addr(&ctx->lproc.pid,
+			        (struct sockaddr*)&ctx->srcaddr,
+			        ctx->srcaddrlen) == 0 &&
+			    ctx->lproc.pid != -1 &&
+			    proc_get_info(ctx->lproc.pid,
+			                  &ctx->lproc.exec_path,
+			                  &ctx->lproc.uid,
+			                  &ctx->lproc.gid) == 0) {
+				/* fetch user/group names */
+				ctx->lproc.user = sys_user_str(ctx->lproc.uid);
+				ctx->lproc.group = sys_group_str(
+				                   ctx->lproc.gid);
+				if (!ctx->lproc.user || !ctx->lproc.group) {
+					ctx->enomem = 1;
+					pxy_conn_terminate_free(ctx, 1);
+					return;
+				}
+			}
+		}
+#endif /* HAVE_LOCAL_PROCINFO */
+		if (WANT_CONTENT_LOG(ctx) && (ctx->opts->contentlog_rules ||
+		                              ctx->opts->contentlog_triggers))
+			pxy_log_content_rule(ctx, 0);
+		if (WANT_CONTENT_LOG(ctx) && !ctx->log_pending) {
+			if (pxy_log_content_open(ctx) == -1) {
+				if (errno == ENOMEM)
+					ctx->enomem = 1;
+				pxy_conn_terminate_free(ctx, 1);
+				return;
+			}
+		}
+
+connected:
+		if (!this->ssl || (bev == ctx->src.bev)) {
+			long long usec = stats_usec() - ctx->setup_usec;
+
+			stats_observe(STATS_HIST_SETUP, usec);
+			USDT_PROBE2(conn__connected, ctx, usec);
+			if (!ctx->setup_done) {
+				pxy_thrmgr_setup_done(ctx->thrmgr,
+				                      ctx->thridx);
+				ctx->setup_done = 1;
+			}
+			if (this->ssl)
+				pxy_conn_phase(ctx, STATS_PHASE_SRCSSL);
+			ctx->ttfb = 1;
+			ctx->established = 1;
+			/* handshakes are done, forward ahead of new
+			 * connections; src is either the bufferevent whose
+			 * callback is running, or a plain one without queued
+			 * deferred callbacks, or already at this priority */
+			if (ctx->src.bev)
+				(void)bufferevent_priority_set(ctx->src.bev,
+				                               PXY_PRIO_ESTAB);
+			pxy_conn_timeout(ctx, ctx->spec->http &&
+			                      !ctx->passthrough &&
+			                      !ctx->seen_req_header ?
+			                      OPTS_TIMEOUT_HEADER :
+			                      OPTS_TIMEOUT_IDLE);
+		}
+
+		/* log connection if we don't analyze any headers */
+		if ((!this->ssl || (bev == ctx->src.bev)) &&
+		    (!ctx->spec->http || ctx->passthrough) &&
+		    WANT_CONNECT_LOG(ctx)) {
+			pxy_log_connect_nonhttp(ctx);
+		}
+
+		if (this->ssl) {
+			if (bev == ctx->src.bev)
+				stats_inc(STATS_SSL_SPLIT);
+
+			/* write SSL certificates to gendir */
+			if ((bev == ctx->src.bev) && ctx->opts->certgendir) {
+				pxy_srccert_write(ctx);
+			}
+
+			/* log master key */
+			if (ctx->opts->masterkeylog) {
+				char keystr[SSL_MASTERKEY_STRSZ];
+				size_t n;
+				n = ssl_ssl_masterkey_to_buf(this->ssl,
+				                             keystr);
+				if (n > 0 &&
+				    log_masterkey_write(keystr, n) == -1) {
+					if (errno == ENOMEM)
+						ctx->enomem = 1;
+					pxy_conn_terminate_free(ctx, 1);
+					return;
+				}
+			}
+		}
+
+		if (OPTS_DEBUG(ctx->opts)) {
+			if (this->ssl) {
+				char *keystr;
+				/* for SSL, we get two connect events */
+				log_dbg_printf("SSL connected %s [%s]:%s"
+				               " %s %s\n",
+				               bev == ctx->dst.bev ?
+				               "to" : "from",
+				               bev == ctx->dst.bev ?
+				               pxy_conn_dsthost(ctx) :
+				               pxy_conn_srchost(ctx),
+				               bev == ctx->dst.bev ?
+				               pxy_conn_dstport(ctx) :
+				               pxy_conn_srcport(ctx),
+				               SSL_get_version(this->ssl),
+				               SSL_get_cipher(this->ssl));
+				keystr = ssl_ssl_masterkey_to_str(this->ssl);
+				if (keystr) {
+					log_dbg_print_free(keystr);
+				}
+#ifdef HAVE_KTLS
+				if (ctx->opts->openssl_ktls) {
+					log_dbg_printf("Kernel TLS send %s "
+					               "recv %s\n",
+					               BIO_get_ktls_send(
+					               SSL_get_wbio(this->ssl)) ?
+					               "yes" : "no",
+					               BIO_get_ktls_recv(
+					               SSL_get_rbio(this->ssl)) ?
+					               "yes" : "no");
+				}
+#endif /* HAVE_KTLS */
+			} else {
+				/* for TCP, we get only a dst connect event,
+				 * since src was already connected from the
+				 * beginning; mirror SSL debug output anyway
+				 * in order not to confuse anyone who might be
+				 * looking closely at the output */
+				log_dbg_printf("TCP connected to [%s]:%s\n",
+				               pxy_conn_dsthost(ctx),
+				               pxy_conn_dstport(ctx));
+				log_dbg_printf("TCP connected from [%s]:%s\n",
+				               pxy_conn_srchost(ctx),
+				               pxy_conn_srcport(ctx));
+			}
+		}
+
+#ifdef HAVE_SPLICE
+		if (ctx->connected && ctx->src.bev && ctx->dst.bev &&
+		    pxy_splice_eligible(ctx)) {
+			pxy_splice_start(ctx);
+		}
+#endif /* HAVE_SPLICE */
+		return;
+	}
+
+#ifdef HAVE_EARLYDATA
+	if (ctx->accepting) {
+		/* dst failed while early data was written to it */
+		pxy_srcssl_accept_fail(ctx);
+		return;
+	}
+#endif /* HAVE_EARLYDATA */
+
+	if (events & BEV_EVENT_ERROR) {
+		unsigned long sslerr;
+		int have_sslerr = 0;
+
+		/* Can happen for socket errs, ssl errs;
+		 * may happen for unclean ssl socket shutdowns. */
+		sslerr = bufferevent_get_openssl_error(bev);
+		if (sslerr)
+			have_sslerr = 1;
+		if (!errno && !sslerr) {
+#if LIBEVENT_VERSION_NUMBER >= 0x02010000
+			/* We have disabled notification for unclean shutdowns
+			 * so this should not happen; log a warning. */
+			log_err_printf("Warning: Spurious error from "
+			               "bufferevent (errno=0,sslerr=0)\n");
+#else /* LIBEVENT_VERSION_NUMBER < 0x02010000 */
+			/* Older versions of libevent will report these. */
+			if (OPTS_DEBUG(ctx->opts)) {
+				log_dbg_printf("Unclean SSL shutdown.\n");
+			}
+#endif /* LIBEVENT_VERSION_NUMBER < 0x02010000 */
+		} else if (ERR_GET_REASON(sslerr) ==
+		           SSL_R_SSLV3_ALERT_HANDSHAKE_FAILURE) {
+			/* these can happen due to client cert auth,
+			 * only log error if debugging is activated */
+			log_dbg_printf("Error from %s bufferevent: "
+			               "%i:%s %lu:%i:%s:%i:%s:%i:%s\n",
+			               (bev == ctx->src.bev) ? "src" : "dst",
+			               errno,
+			               errno ? strerror(errno) : "-",
+			               sslerr,
+			               ERR_GET_REASON(sslerr),
+			               sslerr ?
+			               ERR_reason_error_string(sslerr) : "-",
+			               ERR_GET_LIB(sslerr),
+			               sslerr ?
+			               ERR_lib_error_string(sslerr) : "-",
+			               ERR_GET_FUNC(sslerr),
+			               sslerr ?
+			               ERR_func_error_string(sslerr) : "-");
+			while ((sslerr = bufferevent_get_openssl_error(bev))) {
+				log_dbg_printf("Additional SSL error: "
+				               "%lu:%i:%s:%i:%s:%i:%s\n",
+				               sslerr,
+				               ERR_GET_REASON(sslerr),
+				               ERR_reason_error_string(sslerr),
+				               ERR_GET_LIB(sslerr),
+				               ERR_lib_error_string(sslerr),
+				               ERR_GET_FUNC(sslerr),
+				               ERR_func_error_string(sslerr));
+			}
+		} else {
+			/* real errors */
+			log_err_rl_printf("Error from %s bufferevent: "
+			                  "%i:%s %lu:%i:%s:%i:%s:%i:%s\n",
+			                  (bev == ctx->src.bev) ? "src" : "dst",
+			                  errno,
+			                  errno ? strerror(errno) : "-",
+			                  sslerr,
+			                  ERR_GET_REASON(sslerr),
+			                  sslerr ?
+			                  ERR_reason_error_string(sslerr) : "-",
+			                  ERR_GET_LIB(sslerr),
+			                  sslerr ?
+			                  ERR_lib_error_string(sslerr) : "-",
+			                  ERR_GET_FUNC(sslerr),
+			                  sslerr ?
+			                  ERR_func_error_string(sslerr) : "-");
+			while ((sslerr = bufferevent_get_openssl_error(bev))) {
+				log_err_printf("Additional SSL error: "
+				               "%lu:%i:%s:%i:%s:%i:%s\n",
+				               sslerr,
+				               ERR_GET_REASON(sslerr),
+				               ERR_reason_error_string(sslerr),
+				               ERR_GET_LIB(sslerr),
+				               ERR_lib_error_string(sslerr),
+				               ERR_GET_FUNC(sslerr),
+				               ERR_func_error_string(sslerr));
+			}
+		}
+
+		if ((ctx->speculative || ctx->readahead) &&
+		    !ctx->connected) {
+			/* either handshake failed before dst connected */
+			if (bev == ctx->dst.bev && have_sslerr)
+				pxy_conn_pass_remember(ctx, CACHEPASS_DSTSSL);
+			if (have_sslerr) {
+				stats_inc(STATS_SSL_ERROR);
+				ctx->sslerr = 1;
+			}
+			pxy_conn_abort(ctx);
+			return;
+		}
+		if (!ctx->connected) {
+			/* the callout to the original destination failed,
+			 * e.g. because it asked for client cert auth, so
+			 * close the accepted socket and clean up */
+			if (bev == ctx->dst.bev && ctx->dst.ssl &&
+			    ctx->opts->passthrough && have_sslerr) {
+				/* ssl callout failed, fall back to plain
+				 * TCP passthrough of SSL connection */
+				pxy_conn_pass_remember(ctx, CACHEPASS_DSTSSL);
+				bufferevent_free_and_close_fd(bev, ctx);
+				ctx->dst.bev = NULL;
+				ctx->dst.ssl = NULL;
+				ctx->passthrough = 1;
+				stats_inc(STATS_SSL_PASSTHROUGH);
+				log_dbg_printf("SSL dst connection failed; fal"
+				               "ling back to passthrough\n");
+				pxy_fd_readcb(ctx->fd, 0, ctx);
 				return;
 			}
+			evutil_closesocket(ctx->fd);
+			other->closed = 1;
+		} else if (bev == ctx->src.bev && this->ssl && have_sslerr &&
+		           !SSL_is_init_finished(this->ssl)) {
+			/* the client rejected the forged certificate */
+			pxy_conn_pass_remember(ctx, CACHEPASS_SRCSSL);
+		} else if (bev == ctx->dst.bev && this->ssl && have_sslerr &&
+		           !ctx->dstbytes) {
+			/* with TLS 1.3, the server rejects the missing client
+			 * certificate only after the handshake */
+			pxy_conn_pass_remember(ctx, CACHEPASS_DSTSSL);
 		}
-		if (ctx->clienthello_found) {
+		if (ctx->connected && !other->closed) {
+			/* if the other end is still open and doesn't have data
+			 * to send, close it, otherwise its writecb will close
+			 * it after writing what's left in the output buffer */
+			struct evbuffer *outbuf;
+			outbuf = bufferevent_get_output(other->bev);
+			if (evbuffer_get_length(outbuf) == 0) {
+				if (bev == ctx->src.bev)
+					pxy_http_upstream_keep(ctx);
+				bufferevent_free_and_close_fd(other->bev, ctx);
+				other->bev = NULL;
+				other->closed = 1;
+			}
+		}
+		if (have_sslerr) {
+			stats_inc(STATS_SSL_ERROR);
+			/* errors on closing established connections are not
+			 * failures for the connect log rollup */
+			if (!ctx->established)
+				ctx->sslerr = 1;
+		}
+		goto leave;
+	}
+
+	if (events & BEV_EVENT_EOF) {
+#ifdef DEBUG_PROXY
+		if (OPTS_DEBUG(ctx->opts)) {
+			log_dbg_printf("evbuffer size at EOF: "
+			               "i:%zu o:%zu i:%zu o:%zu\n",
+			                evbuffer_get_length(
+			                    bufferevent_get_input(bev)),
+			                evbuffer_get_length(
+			                    bufferevent_get_output(bev)),
+							other->closed ? 0 :
+			                    evbuffer_get_length(
+			                    bufferevent_get_input(other->bev)),
+							other->closed ? 0 :
+			                    evbuffer_get_length(
+			                    bufferevent_get_output(other->bev))
+			                );
+		}
+#endif /* DEBUG_PROXY */
+		if (ctx->readahead && !ctx->connected &&
+		    bev == ctx->src.bev) {
+			/* passed on by pxy_conn_readahead_resume() */
+			ctx->readahead_eof = 1;
+			bufferevent_disable(bev, EV_READ);
+			return;
+		}
+		if ((ctx->speculative || ctx->readahead) &&
+		    !ctx->connected) {
+			pxy_conn_abort(ctx);
+			return;
+		}
+		if (!ctx->connected) {
+			log_dbg_printf("EOF on outbound connection before "
+			               "connection establishment\n");
+			evutil_closesocket(ctx->fd);
+			other->closed = 1;
+		} else if (!other->closed) {
+			/* if there is data pending in the closed connection,
+			 * handle it here, otherwise it will be lost; this
+			 * includes a truncated ClientHello held back. */
+			if (bev == ctx->src.bev) {
+				ctx->clienthello_search = 0;
+				ctx->chhold = 0;
+			}
+			if (evbuffer_get_length(bufferevent_get_input(bev))) {
+				ctx->eof_flush = 1;
+				pxy_bev_readcb(bev, ctx);
+				ctx->eof_flush = 0;
+			}
+			/* if the other end is still open and doesn't
+			 * have data to send, close it, otherwise its
+			 * writecb will close it after writing what's
+			 * left in the output buffer. */
+			if (evbuffer_get_length(
+			    bufferevent_get_output(other->bev)) == 0) {
+				if (bev == ctx->src.bev)
+					pxy_http_upstream_keep(ctx);
+				bufferevent_free_and_close_fd(other->bev, ctx);
+				other->bev = NULL;
+				other->closed = 1;
+			}
+		}
+		goto leave;
+	}
+
+	log_err_printf("Unknown bufferevent 0x%02X\n", (int)events);
+	return;
+
+leave:
+	/* we only get a single disconnect event here for both connections */
+	if (OPTS_DEBUG(ctx->opts)) {
+		log_dbg_printf("%s disconnected to [%s]:%s\n",
+		               this->ssl ? "SSL" : "TCP",
+		               STRORDASH(pxy_conn_dsthost(ctx)),
+		               STRORDASH(pxy_conn_dstport(ctx)));
+		log_dbg_printf("%s disconnected from [%s]:%s\n",
+		               this->ssl ? "SSL" : "TCP",
+		               pxy_conn_srchost(ctx), pxy_conn_srcport(ctx));
+	}
+
+	this->closed = 1;
+	bufferevent_free_and_close_fd(bev, ctx);
+	this->bev = NULL;
+	if (other->closed) {
+		pxy_conn_ctx_free(ctx, is_requestor);
+	}
+}
+
+static void
+pxy_bev_eventcb(struct bufferevent *bev, short events, void *arg)
+{
+	pxy_cpu_t *cpu = pxy_cpu_enter(arg);
+
+	pxy_bev_event_handler(bev, events, arg);
+	pxy_cpu_leave(cpu);
+}
+
+#ifdef HAVE_LOCAL_PROCINFO
+/*
+ * Completion callback for the asynchronous local process lookup submitted
+ * by pxy_conn_setup(), called on the event base of the connection.  If the
+ * dst connect event handler is waiting for the result, resumes it.
+ */
+static void
+pxy_lproc_handler(proc_info_t *info, void *arg)
+{
+	pxy_conn_ctx_t *ctx = arg;
+
+	ctx->lproc.job = NULL;
+	ctx->lproc.done = 1;
+	ctx->lproc.pid = info->pid;
+	ctx->lproc.uid = info->uid;
+	ctx->lproc.gid = info->gid;
+	ctx->lproc.exec_path = info->path;
+	ctx->lproc.user = info->user;
+	ctx->lproc.group = info->group;
+	info->path = info->user = info->group = NULL;
+
+	if (ctx->lproc.waiting) {
+		ctx->lproc.waiting = 0;
+		bufferevent_enable(ctx->dst.bev, EV_READ|EV_WRITE);
+		if (ctx->src.bev) {
+			bufferevent_enable(ctx->src.bev, EV_READ|EV_WRITE);
+		}
+		pxy_bev_event_handler(ctx->dst.bev, BEV_EVENT_CONNECTED, ctx);
+	}
+}
+
+static void
+pxy_lproc_cb(proc_info_t *info, void *arg)
+{
+	pxy_cpu_t *cpu = pxy_cpu_enter(arg);
+
+	pxy_lproc_handler(info, arg);
+	pxy_cpu_leave(cpu);
+}
+#endif /* HAVE_LOCAL_PROCINFO */
+
+/*
+ * Set up the dst bufferevent and start connecting it to ctx->dstaddr.
+ * If dstfd is not -1, it is a socket already connected to ctx->dstaddr, taken
+ * from the pre-connect pool or connected using TCP Fast Open, and how is
+ * a note on where it came from for the debug log.
+ */
+/*
+ * Bind the unconnected socket fd to the least used source address for
+ * ctx->dstaddr from the source pool of the proxyspec, releasing the one of
+ * any previous connect attempt.  Returns 0 on success, including when the
+ * pool has no address of the family of ctx->dstaddr, -1 on failure.
+ */
+static int
+pxy_conn_bind_src(pxy_conn_ctx_t *ctx, evutil_socket_t fd)
+{
+	srcpool_t *pool = ctx->spec->srcpool;
+
+	if (ctx->srcslot != -1)
+		srcpool_release(pool, ctx->srcslot);
+	ctx->srcslot = srcpool_acquire(pool, (struct sockaddr *)&ctx->dstaddr);
+	if (ctx->srcslot == -1)
+		return 0;
+	if (srcpool_bind(pool, ctx->srcslot, fd) == -1) {
+		log_err_rl_printf("Error binding to source address: %s\n",
+		                  strerror(errno));
+		srcpool_release(pool, ctx->srcslot);
+		ctx->srcslot = -1;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Create a socket for connecting to ctx->dstaddr from a source address of the
+ * source pool of the proxyspec.  Returns the socket, or -1 on failure, in
+ * which case the connect goes out from the default source address.
+ */
+static evutil_socket_t
+pxy_conn_src_socket(pxy_conn_ctx_t *ctx)
+{
+	evutil_socket_t fd;
+
+	fd = socket(ctx->dstaddr.ss_family, SOCK_STREAM, IPPROTO_TCP);
+	if (fd == -1)
+		return -1;
+	if (evutil_make_socket_nonblocking(fd) == -1 ||
+	    evutil_make_socket_closeonexec(fd) == -1 ||
+	    pxy_conn_bind_src(ctx, fd) == -1) {
+		evutil_closesocket(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void
+pxy_conn_setup_dst(pxy_conn_ctx_t *ctx, evutil_socket_t dstfd,
+                   const char *how)
+{
+	evutil_socket_t fd = dstfd;
+
+	/* create server-side socket and eventbuffer */
+	if (ctx->spec->ssl && !ctx->passthrough) {
+#if !defined(OPENSSL_NO_TLSEXT) && LIBEVENT_VERSION_NUMBER >= 0x02010200
+		/* before dst SSL, which must not offer ALPN if speculating */
+		if (ctx->opts->speculate && ctx->sni)
+			pxy_conn_speculate(ctx);
+#endif /* !OPENSSL_NO_TLSEXT && LIBEVENT_VERSION_NUMBER >= 0x02010200 */
+		ctx->dst.ssl = pxy_dstssl_create(ctx);
+		if (!ctx->dst.ssl) {
+			log_err_printf("Error creating SSL\n");
+			if (ctx->src.ssl) {
+				SSL_free(ctx->src.ssl);
+				ctx->src.ssl = NULL;
+			}
+			if (dstfd != -1)
+				evutil_closesocket(dstfd);
+			evutil_closesocket(ctx->fd);
+			pxy_conn_ctx_free(ctx, 1);
+			return;
+		}
+	}
+	/* bufferevent_socket_connect() connects an unconnected socket set on
+	 * the bufferevent instead of creating one */
+	if (dstfd == -1 && ctx->spec->srcpool)
+		fd = pxy_conn_src_socket(ctx);
+	ctx->dst.bev = pxy_bufferevent_setup(ctx, fd, ctx->dst.ssl);
+	if (!ctx->dst.bev) {
+		if (ctx->dst.ssl) {
+			SSL_free(ctx->dst.ssl);
+			ctx->dst.ssl = NULL;
+		}
+		if (ctx->src.ssl) {
+			SSL_free(ctx->src.ssl);
+			ctx->src.ssl = NULL;
+		}
+		if (fd != -1)
+			evutil_closesocket(fd);
+		evutil_closesocket(ctx->fd);
+		pxy_conn_ctx_free(ctx, 1);
+		return;
+	}
+	/* the full handshake yields to other connections until connected */
+	if (ctx->dst.ssl && !SSL_get_session(ctx->dst.ssl))
+		(void)bufferevent_priority_set(ctx->dst.bev, PXY_PRIO_LOW);
+
+	/* in passthrough mode, the ClientHello read from src is forwarded
+	 * as is once the dst connection is up */
+	if (ctx->passthrough && ctx->chbuf) {
+		if (bufferevent_write(ctx->dst.bev, ctx->chbuf,
+		                      ctx->chlen) == -1) {
+			bufferevent_free_and_close_fd(ctx->dst.bev, ctx);
+			ctx->dst.bev = NULL;
+			evutil_closesocket(ctx->fd);
+			pxy_conn_ctx_free(ctx, 1);
+			return;
+		}
+		free(ctx->chbuf);
+		ctx->chbuf = NULL;
+		ctx->chlen = ctx->chsz = 0;
+	}
+
+	if (OPTS_DEBUG(ctx->opts)) {
+		log_dbg_printf("Connecting to [%s]:%s%s\n",
+		               STRORDASH(pxy_conn_dsthost(ctx)),
+		               STRORDASH(pxy_conn_dstport(ctx)),
+		               dstfd != -1 ? how : "");
+	}
+
+	/* initiate connection */
+	if (dstfd == -1) {
+		bufferevent_socket_connect(ctx->dst.bev,
+		                           (struct sockaddr *)&ctx->dstaddr,
+		                           ctx->dstaddrlen);
+	}
+#if LIBEVENT_VERSION_NUMBER >= 0x02010200
+	else if (!ctx->dst.ssl) {
+		/* SSL bufferevents report connected after the handshake */
+		bufferevent_trigger_event(ctx->dst.bev, BEV_EVENT_CONNECTED,
+		                          BEV_TRIG_DEFER_CALLBACKS);
+	}
+#endif /* LIBEVENT_VERSION_NUMBER >= 0x02010200 */
+
+#if !defined(OPENSSL_NO_TLSEXT) && LIBEVENT_VERSION_NUMBER >= 0x02010200
+	/* start the src handshake in parallel */
+	if (ctx->speculative) {
+		ctx->src.bev = pxy_bufferevent_setup(ctx, ctx->fd,
+		                                     ctx->src.ssl);
+		if (!ctx->src.bev) {
+			pxy_conn_abort(ctx);
+			return;
+		}
+	}
+#endif /* !OPENSSL_NO_TLSEXT && LIBEVENT_VERSION_NUMBER >= 0x02010200 */
+
+#if LIBEVENT_VERSION_NUMBER >= 0x02010200
+	/* read what the client sends first while dst is connecting, up to
+	 * ClientReadAhead octets */
+	if (ctx->opts->readahead && !ctx->spec->ssl && !ctx->spec->upgrade &&
+	    !ctx->src.bev) {
+		ctx->src.bev = pxy_bufferevent_setup(ctx, ctx->fd, NULL);
+		if (!ctx->src.bev) {
+			pxy_conn_abort(ctx);
+			return;
+		}
+		ctx->readahead = 1;
+		/* the priority of a bufferevent must not change while one of
+		 * its deferred callbacks may be queued, so set the one of the
+		 * established connection right away */
+		(void)bufferevent_priority_set(ctx->src.bev, PXY_PRIO_ESTAB);
+		/* nothing to write to src before dst is connected */
+		bufferevent_disable(ctx->src.bev, EV_WRITE);
+		bufferevent_setwatermark(ctx->src.bev, EV_READ, 0,
+		                         ctx->opts->readahead);
+	}
+#endif /* LIBEVENT_VERSION_NUMBER >= 0x02010200 */
+}
+
+/*
+ * Hand dstfd and how over to pxy_conn_setup_dst().  For SSL, setting up the
+ * dst SSL starts the upstream handshake, which is by far the most expensive
+ * part of connection setup; it runs as a separate step, at low priority if
+ * there is no dst session to resume, such that accepting and resuming other
+ * connections on the thread does not queue behind full handshakes.
+ */
+static void
+pxy_conn_connect_dst(pxy_conn_ctx_t *ctx, evutil_socket_t dstfd,
+                     const char *how)
+{
+	if (!ctx->spec->ssl || ctx->passthrough) {
+		pxy_conn_setup_dst(ctx, dstfd, how);
+		return;
+	}
+
+	if (!ctx->dstsess)
+		ctx->dstsess = pxy_dstsess_get(ctx);
+	ctx->stepfd = dstfd;
+	ctx->stephow = how;
+	if (pxy_conn_step(ctx, PXY_STEP_DSTSSL, ctx->dstsess ?
+	                  PXY_PRIO_DEFAULT : PXY_PRIO_LOW) == -1) {
+		log_err_printf("Error scheduling dst SSL setup\n");
+		pxy_conn_abort(ctx);
+	}
+}
+
+#if defined(HAVE_TCP_FASTOPEN) && LIBEVENT_VERSION_NUMBER >= 0x02010200
+/*
+ * The TCP Fast Open connect without a cached cookie has completed.  If it
+ * failed, connect again without Fast Open, so that the error is handled and
+ * logged the same way as for any other failed connect.
+ */
+static void
+pxy_conn_fastopen_cb(evutil_socket_t fd, UNUSED short what, void *arg)
+{
+	pxy_conn_ctx_t *ctx = arg;
+	socklen_t errlen;
+	int err = 0;
+
+	event_free(ctx->ev);
+	ctx->ev = NULL;
+	ctx->fastopen = 0;
+	errlen = sizeof(err);
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, (void *)&err, &errlen) == -1)
+		err = errno;
+	if (err) {
+		evutil_closesocket(fd);
+		pxy_conn_connect_dst(ctx, -1, NULL);
+		return;
+	}
+	pxy_conn_connect_dst(ctx, fd, " (TCP Fast Open)");
+}
+
+/*
+ * Connect a new socket to ctx->dstaddr with TCP_FASTOPEN_CONNECT.  If the
+ * kernel has a Fast Open cookie for the server, connect() returns right away
+ * and the SYN is sent along with the first data written, e.g. the TLS
+ * ClientHello; otherwise the connect proceeds as usual.
+ * Returns the socket and sets *connecting if the connect is still in
+ * progress, or returns -1 on failure.
+ */
+static evutil_socket_t
+pxy_conn_fastopen_socket(pxy_conn_ctx_t *ctx, int *connecting)
+{
+	evutil_socket_t fd;
+	int on = 1;
+
+	fd = socket(ctx->dstaddr.ss_family, SOCK_STREAM, IPPROTO_TCP);
+	if (fd == -1)
+		return -1;
+	if (evutil_make_socket_nonblocking(fd) == -1 ||
+	    evutil_make_socket_closeonexec(fd) == -1 ||
+	    setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT,
+	               (void*)&on, sizeof(on)) == -1)
+		goto errout;
+	if (ctx->spec->srcpool && pxy_conn_bind_src(ctx, fd) == -1)
+		goto errout;
+	*connecting = 0;
+	if (connect(fd, (struct sockaddr *)&ctx->dstaddr,
+	            ctx->dstaddrlen) == -1) {
+		if (errno != EINPROGRESS)
+			goto errout;
+		*connecting = 1;
+	}
+	return fd;
+
+errout:
+	evutil_closesocket(fd);
+	return -1;
+}
+#endif /* HAVE_TCP_FASTOPEN && LIBEVENT_VERSION_NUMBER >= 0x02010200 */
+
+/*
+ * Complete the connection.  This gets called after finding out where to
+ * connect to.
+ */
+static void
+pxy_conn_connect(pxy_conn_ctx_t *ctx)
+{
+	evutil_socket_t dstfd = -1;
+
+	if (!ctx->dstaddrlen) {
+		log_err_printf("No target address; aborting connection\n");
+		evutil_closesocket(ctx->fd);
+		pxy_conn_ctx_free(ctx, 1);
+		return;
+	}
+
+	/* skip interception of destinations known to fail */
+	if (ctx->spec->ssl && !ctx->passthrough && ctx->opts->passthrough &&
+	    ctx->opts->pass_ttl) {
+		cachepass_val_t *pass;
+
+		pass = cachemgr_pass_get((struct sockaddr *)&ctx->dstaddr,
+		                         ctx->dstaddrlen, ctx->sni);
+		if (pass) {
+			ctx->passthrough = 1;
+			stats_inc(STATS_SSL_PASSTHROUGH);
 			if (OPTS_DEBUG(ctx->opts)) {
-				log_dbg_printf("Completing autossl upgrade\n");
-			}
-			ctx->src.bev = bufferevent_openssl_filter_new(
-			               ctx->evbase, ctx->src.bev, ctx->src.ssl,
-			               BUFFEREVENT_SSL_ACCEPTING,
-			               BEV_OPT_DEFER_CALLBACKS);
-			if (ctx->src.bev) {
-				bufferevent_openssl_set_allow_dirty_shutdown(
-				                              ctx->src.bev, 1);
-				bufferevent_setcb(ctx->src.bev,
-				                  pxy_bev_readcb,
-				                  pxy_bev_writecb,
-				                  pxy_bev_eventcb,
-				                  ctx);
-				bufferevent_enable(ctx->src.bev,
-				                   EV_READ|EV_WRITE);
+				log_dbg_printf("Interception failed recently "
+				               "(%s); passing through\n",
+				               cachepass_reason_str(
+				               pass->reason));
 			}
-		} else {
-			ctx->src.bev = pxy_bufferevent_setup(ctx, ctx->fd,
-			                                     ctx->src.ssl);
+			free(pass);
 		}
-		if (!ctx->src.bev) {
-			if (ctx->src.ssl) {
-				SSL_free(ctx->src.ssl);
-				ctx->src.ssl = NULL;
-			}
-			bufferevent_free_and_close_fd(bev, ctx);
-			evutil_closesocket(ctx->fd);
-			pxy_conn_ctx_free(ctx, 1);
+	}
+
+#if LIBEVENT_VERSION_NUMBER >= 0x02010200
+	/* plain HTTP can reuse an idle persistent upstream connection */
+	if (ctx->opts->http_upstream_pool > 0 && ctx->spec->http &&
+	    !ctx->spec->ssl && !ctx->spec->srcpool && !ctx->passthrough) {
+		dstfd = pxy_thrmgr_httppool_get(ctx->thrmgr, ctx->thridx,
+		                                (struct sockaddr *)
+		                                &ctx->dstaddr,
+		                                ctx->dstaddrlen);
+		if (dstfd != -1) {
+			pxy_conn_connect_dst(ctx, dstfd, " (keep-alive)");
 			return;
 		}
-
-		/* prepare logging, part 2 */
-		if (WANT_CONNECT_LOG(ctx) || WANT_CONTENT_LOG(ctx)) {
-			if (ctx->dsthost_str) {
-				free(ctx->dsthost_str);
-				ctx->dsthost_str = NULL;
-			}
-			if (ctx->dstport_str) {
-				free(ctx->dstport_str);
-				ctx->dstport_str = NULL;
-			}
-			if (sys_sockaddr_str((struct sockaddr *)
-			                     &ctx->dstaddr, ctx->dstaddrlen,
-			                     &ctx->dsthost_str,
-			                     &ctx->dstport_str) != 0) {
-				ctx->enomem = 1;
-				pxy_conn_terminate_free(ctx, 1);
+	}
+	/* static forwarding can use an already established connection */
+	if (ctx->opts->preconnect > 0 && !ctx->spec->natlookup &&
+	    ctx->spec->connect_addrlen > 0 && !ctx->spec->srcpool) {
+		dstfd = pxy_thrmgr_connpool_get(ctx->thrmgr, ctx->thridx,
+		                                ctx->spec);
+		if (dstfd != -1) {
+			pxy_conn_connect_dst(ctx, dstfd, " (pre-connected)");
+			return;
+		}
+	}
+#ifdef HAVE_TCP_FASTOPEN
+	if (ctx->opts->tcp_fastopen) {
+		int connecting;
+
+		dstfd = pxy_conn_fastopen_socket(ctx, &connecting);
+		if (dstfd != -1 && connecting) {
+			/* in ctx->ev such that a timeout can cancel it */
+			ctx->ev = event_new(ctx->evbase, dstfd, EV_WRITE,
+			                    pxy_conn_fastopen_cb, ctx);
+			if (ctx->ev && event_add(ctx->ev, NULL) == 0) {
+				ctx->fastopen = 1;
 				return;
 			}
-
-#ifdef HAVE_LOCAL_PROCINFO
-			if (ctx->opts->lprocinfo) {
-				/* fetch process info */
-				if (proc_pid_for_addr(&ctx->lproc.pid,
-				        (struct sockaddr*)&ctx->srcaddr,
-				        ctx->srcaddrlen) == 0 &&
-				    ctx->lproc.pid != -1 &&
-				    proc_get_info(ctx->lproc.pid,
-				                  &ctx->lproc.exec_path,
-				                  &ctx->lproc.uid,
-				                  &ctx->lproc.gid) == 0) {
-					/* fetch user/group names */
-					ctx->lproc.user = sys_user_str(
-					                ctx->lproc.uid);
-					ctx->lproc.group = sys_group_str(
-					                ctx->lproc.gid);
-					if (!ctx->lproc.user ||
-					    !ctx->lproc.group) {
-						ctx->enomem = 1;
-						pxy_conn_terminate_free(ctx, 1);
-						return;
-					}
-				}
+			if (ctx->ev) {
+				event_free(ctx->ev);
+				ctx->ev = NULL;
 			}
-#endif /* HAVE_LOCAL_PROCINFO */
+			evutil_closesocket(dstfd);
+			dstfd = -1;
 		}
-		if (WANT_CONTENT_LOG(ctx)) {
-			if (log_content_open(&ctx->logctx, ctx->opts,
-			                     (struct sockaddr *)&ctx->srcaddr,
-			                     ctx->srcaddrlen,
-			                     (struct sockaddr *)&ctx->dstaddr,
-			                     ctx->dstaddrlen,
-			                     ctx->srchost_str, ctx->srcport_str,
-			                     ctx->dsthost_str, ctx->dstport_str,
-#ifdef HAVE_LOCAL_PROCINFO
-			                     ctx->lproc.exec_path,
-			                     ctx->lproc.user,
-			                     ctx->lproc.group
-#else /* HAVE_LOCAL_PROCINFO */
-			                     NULL, NULL, NULL
-#endif /* HAVE_LOCAL_PROCINFO */
-			                    ) == -1) {
-				if (errno == ENOMEM)
-					ctx->enomem = 1;
-				pxy_conn_terminate_free(ctx, 1);
-				return;
-			}
+		if (dstfd != -1) {
+			pxy_conn_connect_dst(ctx, dstfd, " (TCP Fast Open)");
+			return;
 		}
+	}
+#endif /* HAVE_TCP_FASTOPEN */
+#endif /* LIBEVENT_VERSION_NUMBER >= 0x02010200 */
+	pxy_conn_connect_dst(ctx, -1, NULL);
+}
 
-connected:
-		/* log connection if we don't analyze any headers */
-		if ((!this->ssl || (bev == ctx->src.bev)) &&
-		    (!ctx->spec->http || ctx->passthrough) &&
-		    WANT_CONNECT_LOG(ctx)) {
-			pxy_log_connect_nonhttp(ctx);
+#ifndef OPENSSL_NO_TLSEXT
+/*
+ * Copy resolved address i from dns to addr, using the port of the SNI
+ * proxyspec of ctx.
+ */
+static void
+pxy_sni_addr(pxy_conn_ctx_t *ctx, struct sockaddr_storage *addr,
+             socklen_t *addrlen, const cachedns_val_t *dns, int i)
+{
+	memcpy(addr, &dns->addr[i], dns->addrlen[i]);
+	*addrlen = dns->addrlen[i];
+	if (addr->ss_family == AF_INET6) {
+		((struct sockaddr_in6 *)addr)->sin6_port =
+		        htons(ctx->spec->sni_port);
+	} else {
+		((struct sockaddr_in *)addr)->sin_port =
+		        htons(ctx->spec->sni_port);
+	}
+}
+
+#if LIBEVENT_VERSION_NUMBER >= 0x02010200
+/*
+ * Connection racing across the addresses resolved for an SNI hostname, in the
+ * style of Happy Eyeballs (RFC 8305).  Connects to the addresses are started
+ * PXY_RACE_DELAY_MSEC apart, or as soon as the previous attempt failed, and
+ * the first socket that connects is used for the dst connection.  All other
+ * attempts are cancelled.
+ */
+#define PXY_RACE_MAX		8
+#define PXY_RACE_DELAY_MSEC	250
+
+typedef struct pxy_race {
+	pxy_conn_ctx_t *ctx;
+	struct event *timer;
+	struct sockaddr_storage addr[PXY_RACE_MAX];
+	socklen_t addrlen[PXY_RACE_MAX];
+	evutil_socket_t fd[PXY_RACE_MAX];
+	int srcslot[PXY_RACE_MAX];
+	struct event *ev[PXY_RACE_MAX];
+	int num;
+	int next;
+	int pending;
+} pxy_race_t;
+
+static void pxy_race_start(pxy_race_t *);
+
+/*
+ * Release the racing state, cancelling all connect attempts except the
+ * attempt with index keep, if keep is not -1.
+ */
+static void
+pxy_race_free(pxy_race_t *race, int keep)
+{
+	for (int i = 0; i < race->num; i++) {
+		if (race->ev[i])
+			event_free(race->ev[i]);
+		if (race->fd[i] != -1 && i != keep)
+			evutil_closesocket(race->fd[i]);
+		if (race->srcslot[i] != -1 && i != keep)
+			srcpool_release(race->ctx->spec->srcpool,
+			                race->srcslot[i]);
+	}
+	if (race->timer)
+		event_free(race->timer);
+	race->ctx->race = NULL;
+	free(race);
+}
+
+/*
+ * Attempt i has finished.  Use the socket if it connected, otherwise start
+ * the next attempt right away.  If all attempts failed, connect to the first
+ * address again without racing, such that the error is handled and logged the
+ * same way as for any other failed connect.
+ */
+static void
+pxy_race_done(pxy_race_t *race, int i, int err)
+{
+	pxy_conn_ctx_t *ctx = race->ctx;
+
+	if (!err) {
+		memcpy(&ctx->dstaddr, &race->addr[i], race->addrlen[i]);
+		ctx->dstaddrlen = race->addrlen[i];
+		ctx->srcslot = race->srcslot[i];
+		evutil_socket_t fd = race->fd[i];
+		pxy_race_free(race, i);
+		pxy_conn_connect_dst(ctx, fd, " (raced)");
+		return;
+	}
+
+	if (OPTS_DEBUG(ctx->opts)) {
+		log_dbg_printf("Connect attempt %i for '%s' failed: %s\n",
+		               i, ctx->sni, strerror(err));
+	}
+	if (race->ev[i]) {
+		event_free(race->ev[i]);
+		race->ev[i] = NULL;
+	}
+	if (race->fd[i] != -1)
+		evutil_closesocket(race->fd[i]);
+	race->fd[i] = -1;
+	if (race->srcslot[i] != -1)
+		srcpool_release(ctx->spec->srcpool, race->srcslot[i]);
+	race->srcslot[i] = -1;
+	race->pending--;
+	if (race->next < race->num) {
+		evtimer_del(race->timer);
+		pxy_race_start(race);
+	} else if (!race->pending) {
+		memcpy(&ctx->dstaddr, &race->addr[0], race->addrlen[0]);
+		ctx->dstaddrlen = race->addrlen[0];
+		pxy_race_free(race, -1);
+		pxy_conn_connect_dst(ctx, -1, NULL);
+	}
+}
+
+static void
+pxy_race_connect_cb(evutil_socket_t fd, UNUSED short what, void *arg)
+{
+	pxy_race_t *race = arg;
+	socklen_t errlen;
+	int err = 0;
+	int i;
+
+	for (i = 0; i < race->num && race->fd[i] != fd; i++);
+	errlen = sizeof(err);
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, (void *)&err, &errlen) == -1)
+		err = errno;
+	pxy_race_done(race, i, err);
+}
+
+static void
+pxy_race_timer_cb(UNUSED evutil_socket_t fd, UNUSED short what, void *arg)
+{
+	pxy_race_start(arg);
+}
+
+/*
+ * Start the next connect attempt and schedule the one after it.
+ */
+static void
+pxy_race_start(pxy_race_t *race)
+{
+	struct timeval tv = {0, PXY_RACE_DELAY_MSEC * 1000};
+	srcpool_t *pool = race->ctx->spec->srcpool;
+	int i = race->next++;
+	evutil_socket_t fd;
+
+	race->pending++;
+	fd = socket(race->addr[i].ss_family, SOCK_STREAM, IPPROTO_TCP);
+	race->fd[i] = fd;
+	if (fd == -1 ||
+	    evutil_make_socket_nonblocking(fd) == -1 ||
+	    evutil_make_socket_closeonexec(fd) == -1) {
+		pxy_race_done(race, i, errno);
+		return;
+	}
+	if (pool && (race->srcslot[i] = srcpool_acquire(pool,
+	             (struct sockaddr *)&race->addr[i])) != -1 &&
+	    srcpool_bind(pool, race->srcslot[i], fd) == -1) {
+		pxy_race_done(race, i, errno);
+		return;
+	}
+	if (connect(fd, (struct sockaddr *)&race->addr[i],
+	            race->addrlen[i]) == 0) {
+		pxy_race_done(race, i, 0);
+		return;
+	}
+	if (errno != EINPROGRESS) {
+		pxy_race_done(race, i, errno);
+		return;
+	}
+	race->ev[i] = event_new(race->ctx->evbase, fd, EV_WRITE,
+	                        pxy_race_connect_cb, race);
+	if (!race->ev[i] || event_add(race->ev[i], NULL) == -1) {
+		pxy_race_done(race, i, ENOMEM);
+		return;
+	}
+	if (race->next < race->num)
+		evtimer_add(race->timer, &tv);
+}
+
+/*
+ * Set up racing across the resolved addresses in dns, alternating between
+ * address families, starting with the family of the first address.
+ * Returns -1 on out of memory condition, 0 on success.
+ */
+static int
+pxy_race_new(pxy_conn_ctx_t *ctx, const cachedns_val_t *dns)
+{
+	pxy_race_t *race;
+	int q[2], f, i;
+
+	race = malloc(sizeof(pxy_race_t));
+	if (!race)
+		return -1;
+	memset(race, 0, sizeof(pxy_race_t));
+	race->ctx = ctx;
+	race->timer = evtimer_new(ctx->evbase, pxy_race_timer_cb, race);
+	if (!race->timer) {
+		free(race);
+		return -1;
+	}
+	ctx->race = race;
+	q[0] = 0;
+	for (q[1] = 0; q[1] < dns->num &&
+	     dns->addr[q[1]].ss_family == dns->addr[0].ss_family; q[1]++);
+	for (f = 0; race->num < PXY_RACE_MAX &&
+	     (q[0] < dns->num || q[1] < dns->num); f = !f) {
+		if ((i = q[f]) >= dns->num)
+			continue;
+		pxy_sni_addr(ctx, &race->addr[race->num],
+		             &race->addrlen[race->num], dns, i);
+		race->fd[race->num] = -1;
+		race->srcslot[race->num] = -1;
+		race->num++;
+		/* advance to the next address of the same family group */
+		for (i++; i < dns->num &&
+		     (dns->addr[i].ss_family == dns->addr[0].ss_family) != !f;
+		     i++);
+		q[f] = i;
+	}
+	pxy_race_start(race);
+	return 0;
+}
+#endif /* LIBEVENT_VERSION_NUMBER >= 0x02010200 */
+
+/*
+ * The SNI hostname has been resolved, either from the DNS cache or by a
+ * lookup.  If there is more than one address, race connects to them;
+ * otherwise fill the resolved address into the context and continue
+ * connecting.
+ */
+static void
+pxy_sni_resolved(pxy_conn_ctx_t *ctx, const cachedns_val_t *dns)
+{
+	pxy_conn_phase(ctx, STATS_PHASE_DNS);
+	if (dns->err || !dns->num) {
+		log_err_printf("Cannot resolve SNI hostname '%s': %s\n",
+		               ctx->sni, evutil_gai_strerror(dns->err ?
+		               dns->err : EVUTIL_EAI_NONAME));
+		evutil_closesocket(ctx->fd);
+		pxy_conn_ctx_free(ctx, 1);
+		return;
+	}
+
+#if LIBEVENT_VERSION_NUMBER >= 0x02010200
+	if (dns->num > 1) {
+		if (pxy_race_new(ctx, dns) == -1) {
+			log_err_printf("Error allocating memory\n");
+			evutil_closesocket(ctx->fd);
+			pxy_conn_ctx_free(ctx, 1);
 		}
+		return;
+	}
+#endif /* LIBEVENT_VERSION_NUMBER >= 0x02010200 */
+	pxy_sni_addr(ctx, &ctx->dstaddr, &ctx->dstaddrlen, dns, 0);
+	pxy_conn_connect(ctx);
+}
 
-		if (this->ssl) {
-			/* write SSL certificates to gendir */
-			if ((bev == ctx->src.bev) && ctx->opts->certgendir) {
-				pxy_srccert_write(ctx);
-			}
+/*
+ * Upper bounds on how long answers are cached: TTL of DNS answers, and fixed
+ * expiry of answers without TTL, i.e. from the hosts file or negative answers.
+ * Entries are prefetched during the last tenth of their lifetime.
+ */
+#define PXY_DNS_TTL_MAX		86400
+#define PXY_DNS_TTL_NOTTL	60
+#define PXY_DNS_TTL_NEGATIVE	30
 
-			/* log master key */
-			if (ctx->opts->masterkeylog) {
-				char *keystr;
-				keystr = ssl_ssl_masterkey_to_str(this->ssl);
-				if ((keystr == NULL) ||
-				    (log_masterkey_print_free(keystr) == -1)) {
-					if (errno == ENOMEM)
-						ctx->enomem = 1;
-					pxy_conn_terminate_free(ctx, 1);
-					return;
-				}
-			}
+/*
+ * Number of hash buckets of the table of ongoing SNI hostname lookups.
+ */
+#define PXY_DNS_BUCKETS		256
+
+/*
+ * Connection waiting for an ongoing SNI hostname lookup, notified on its own
+ * event base; ctx is NULL once the connection was torn down.
+ */
+typedef struct pxy_dns_waiter {
+	pxy_conn_ctx_t *ctx;
+	struct event_base *evbase;
+	cachedns_val_t dns;
+	struct pxy_dns_waiter *next;
+} pxy_dns_waiter_t;
+
+/*
+ * Ongoing SNI hostname lookup, issued on the DNS base of the thread that
+ * started it, and joined by all connections on any thread needing the same
+ * hostname and address family until it completes.  Prefetches start out
+ * without waiters.
+ */
+typedef struct pxy_dns_req {
+	struct event_base *evbase;
+	struct evdns_base *dnsbase;
+	pxy_dns_waiter_t *waiters;
+	struct pxy_dns_req *next;
+	unsigned int hash;
+	int af;
+	char host[];
+} pxy_dns_req_t;
+
+static pthread_mutex_t pxy_dns_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pxy_dns_req_t *pxy_dns_reqs[PXY_DNS_BUCKETS];
+
+static unsigned int
+pxy_dns_hash(int af, const char *host)
+{
+	unsigned int h = 2166136261U ^ (unsigned int)af;
+
+	while (*host) {
+		h ^= (unsigned char)*host++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/*
+ * Remove req from the table of ongoing lookups and return its waiters.
+ */
+static pxy_dns_waiter_t *
+pxy_dns_unlink(pxy_dns_req_t *req)
+{
+	pxy_dns_req_t **pp;
+	pxy_dns_waiter_t *waiters;
+
+	pthread_mutex_lock(&pxy_dns_mutex);
+	for (pp = &pxy_dns_reqs[req->hash % PXY_DNS_BUCKETS]; *pp;
+	     pp = &(*pp)->next) {
+		if (*pp == req) {
+			*pp = req->next;
+			break;
 		}
+	}
+	waiters = req->waiters;
+	req->waiters = NULL;
+	pthread_mutex_unlock(&pxy_dns_mutex);
+	return waiters;
+}
 
-		if (OPTS_DEBUG(ctx->opts)) {
-			if (this->ssl) {
-				char *keystr;
-				/* for SSL, we get two connect events */
-				log_dbg_printf("SSL connected %s [%s]:%s"
-				               " %s %s\n",
-				               bev == ctx->dst.bev ?
-				               "to" : "from",
-				               bev == ctx->dst.bev ?
-				               ctx->dsthost_str :
-				               ctx->srchost_str,
-				               bev == ctx->dst.bev ?
-				               ctx->dstport_str :
-				               ctx->srcport_str,
-				               SSL_get_version(this->ssl),
-				               SSL_get_cipher(this->ssl));
-				keystr = ssl_ssl_masterkey_to_str(this->ssl);
-				if (keystr) {
-					log_dbg_print_free(keystr);
-				}
+/*
+ * Hand the answer to a waiting connection, on the event base of that
+ * connection.
+ */
+static void
+pxy_dns_notify_cb(UNUSED evutil_socket_t fd, UNUSED short what, void *arg)
+{
+	pxy_dns_waiter_t *waiter = arg;
+
+	if (waiter->ctx) {
+		waiter->ctx->dnswait = NULL;
+		pxy_sni_resolved(waiter->ctx, &waiter->dns);
+	}
+	free(waiter);
+}
+
+/*
+ * Cache the answer to a lookup with the given TTL in seconds and hand it to
+ * all connections waiting for it.  Runs on the event base of req, waiters on
+ * other event bases are notified through event_base_once().
+ */
+static void
+pxy_dns_done(pxy_dns_req_t *req, cachedns_val_t *dns, int ttl)
+{
+	pxy_dns_waiter_t *waiter, *waiters;
+	time_t now = time(NULL);
+
+	if (ttl > PXY_DNS_TTL_MAX)
+		ttl = PXY_DNS_TTL_MAX;
+	if (ttl > 0) {
+		dns->expiry = now + ttl;
+		dns->refresh = dns->expiry - (ttl + 9) / 10;
+		cachemgr_dns_set(req->af, req->host, dns);
+	}
+	/* connections starting lookups from now on hit the cache */
+	waiters = pxy_dns_unlink(req);
+	while ((waiter = waiters)) {
+		waiters = waiter->next;
+		memcpy(&waiter->dns, dns, sizeof(cachedns_val_t));
+		if (waiter->evbase == req->evbase) {
+			pxy_dns_notify_cb(-1, 0, waiter);
+		} else if (event_base_once(waiter->evbase, -1, EV_TIMEOUT,
+		                           pxy_dns_notify_cb, waiter,
+		                           NULL) == -1) {
+			/* waiter stays owned by its connection until abort */
+			log_err_printf("Failed to schedule DNS lookup "
+			               "completion\n");
+		}
+	}
+	free(req);
+}
+
+/*
+ * The fallback lookup through evdns_getaddrinfo() has completed.  This also
+ * covers hostnames from the hosts file, which the DNS-only lookups do not
+ * consult.
+ */
+static void
+pxy_dns_gai_cb(int errcode, struct evutil_addrinfo *ai, void *arg)
+{
+	pxy_dns_req_t *req = arg;
+	struct evutil_addrinfo *p;
+	cachedns_val_t dns;
+
+	memset(&dns, 0, sizeof(dns));
+	if (errcode) {
+		dns.err = errcode;
+		pxy_dns_done(req, &dns, errcode == EVUTIL_EAI_NONAME ?
+		                        PXY_DNS_TTL_NEGATIVE : 0);
+		return;
+	}
+	for (p = ai; p && dns.num < CACHEDNS_MAXADDRS; p = p->ai_next) {
+		if (p->ai_addrlen > sizeof(struct sockaddr_storage))
+			continue;
+		memcpy(&dns.addr[dns.num], p->ai_addr, p->ai_addrlen);
+		dns.addrlen[dns.num] = p->ai_addrlen;
+		dns.num++;
+	}
+	evutil_freeaddrinfo(ai);
+	if (!dns.num)
+		dns.err = EVUTIL_EAI_NONAME;
+	pxy_dns_done(req, &dns, PXY_DNS_TTL_NOTTL);
+}
+
+/*
+ * The DNS lookup has completed.  Use the answer and its TTL if there is one,
+ * otherwise fall back to evdns_getaddrinfo().
+ */
+static void
+pxy_dns_resolve_cb(int result, char type, int count, int ttl,
+                   void *addresses, void *arg)
+{
+	pxy_dns_req_t *req = arg;
+	struct evutil_addrinfo hints;
+	cachedns_val_t dns;
+
+	if (result == DNS_ERR_NONE && count > 0 &&
+	    (type == DNS_IPv4_A || type == DNS_IPv6_AAAA)) {
+		memset(&dns, 0, sizeof(dns));
+		for (int i = 0; i < count && i < CACHEDNS_MAXADDRS; i++) {
+			if (type == DNS_IPv4_A) {
+				struct sockaddr_in *sin = (struct sockaddr_in *)
+				                          &dns.addr[i];
+				sin->sin_family = AF_INET;
+				memcpy(&sin->sin_addr,
+				       (struct in_addr *)addresses + i,
+				       sizeof(struct in_addr));
+				dns.addrlen[i] = sizeof(struct sockaddr_in);
 			} else {
-				/* for TCP, we get only a dst connect event,
-				 * since src was already connected from the
-				 * beginning; mirror SSL debug output anyway
-				 * in order not to confuse anyone who might be
-				 * looking closely at the output */
-				log_dbg_printf("TCP connected to [%s]:%s\n",
-				               ctx->dsthost_str,
-				               ctx->dstport_str);
-				log_dbg_printf("TCP connected from [%s]:%s\n",
-				               ctx->srchost_str,
-				               ctx->srcport_str);
+				struct sockaddr_in6 *sin6 =
+				        (struct sockaddr_in6 *)&dns.addr[i];
+				sin6->sin6_family = AF_INET6;
+				memcpy(&sin6->sin6_addr,
+				       (struct in6_addr *)addresses + i,
+				       sizeof(struct in6_addr));
+				dns.addrlen[i] = sizeof(struct sockaddr_in6);
 			}
+			dns.num++;
 		}
-
+		pxy_dns_done(req, &dns, ttl);
 		return;
 	}
-
-	if (events & BEV_EVENT_ERROR) {
-		unsigned long sslerr;
-		int have_sslerr = 0;
-
-		/* Can happen for socket errs, ssl errs;
-		 * may happen for unclean ssl socket shutdowns. */
-		sslerr = bufferevent_get_openssl_error(bev);
-		if (sslerr)
-			have_sslerr = 1;
-		if (!errno && !sslerr) {
-#if LIBEVENT_VERSION_NUMBER >= 0x02010000
-			/* We have disabled notification for unclean shutdowns
-			 * so this should not happen; log a warning. */
-			log_err_printf("Warning: Spurious error from "
-			               "bufferevent (errno=0,sslerr=0)\n");
-#else /* LIBEVENT_VERSION_NUMBER < 0x02010000 */
-			/* Older versions of libevent will report these. */
-			if (OPTS_DEBUG(ctx->opts)) {
-				log_dbg_printf("Unclean SSL shutdown.\n");
-			}
-#endif /* LIBEVENT_VERSION_NUMBER < 0x02010000 */
-		} else if (ERR_GET_REASON(sslerr) ==
-		           SSL_R_SSLV3_ALERT_HANDSHAKE_FAILURE) {
-			/* these can happen due to client cert auth,
-			 * only log error if debugging is activated */
-			log_dbg_printf("Error from %s bufferevent: "
-			               "%i:%s %lu:%i:%s:%i:%s:%i:%s\n",
-			               (bev == ctx->src.bev) ? "src" : "dst",
-			               errno,
-			               errno ? strerror(errno) : "-",
-			               sslerr,
-			               ERR_GET_REASON(sslerr),
-			               sslerr ?
-			               ERR_reason_error_string(sslerr) : "-",
-			               ERR_GET_LIB(sslerr),
-			               sslerr ?
-			               ERR_lib_error_string(sslerr) : "-",
-			               ERR_GET_FUNC(sslerr),
-			               sslerr ?
-			               ERR_func_error_string(sslerr) : "-");
-			while ((sslerr = bufferevent_get_openssl_error(bev))) {
-				log_dbg_printf("Additional SSL error: "
-				               "%lu:%i:%s:%i:%s:%i:%s\n",
-				               sslerr,
-				               ERR_GET_REASON(sslerr),
-				               ERR_reason_error_string(sslerr),
-				               ERR_GET_LIB(sslerr),
-				               ERR_lib_error_string(sslerr),
-				               ERR_GET_FUNC(sslerr),
-				               ERR_func_error_string(sslerr));
-			}
-		} else {
-			/* real errors */
-			log_err_printf("Error from %s bufferevent: "
-			               "%i:%s %lu:%i:%s:%i:%s:%i:%s\n",
-			               (bev == ctx->src.bev) ? "src" : "dst",
-			               errno,
-			               errno ? strerror(errno) : "-",
-			               sslerr,
-			               ERR_GET_REASON(sslerr),
-			               sslerr ?
-			               ERR_reason_error_string(sslerr) : "-",
-			               ERR_GET_LIB(sslerr),
-			               sslerr ?
-			               ERR_lib_error_string(sslerr) : "-",
-			               ERR_GET_FUNC(sslerr),
-			               sslerr ?
-			               ERR_func_error_string(sslerr) : "-");
-			while ((sslerr = bufferevent_get_openssl_error(bev))) {
-				log_err_printf("Additional SSL error: "
-				               "%lu:%i:%s:%i:%s:%i:%s\n",
-				               sslerr,
-				               ERR_GET_REASON(sslerr),
-				               ERR_reason_error_string(sslerr),
-				               ERR_GET_LIB(sslerr),
-				               ERR_lib_error_string(sslerr),
-				               ERR_GET_FUNC(sslerr),
-				               ERR_func_error_string(sslerr));
-			}
-		}
-
-		if (!ctx->connected) {
-			/* the callout to the original destination failed,
-			 * e.g. because it asked for client cert auth, so
-			 * close the accepted socket and clean up */
-			if (bev == ctx->dst.bev && ctx->dst.ssl &&
-			    ctx->opts->passthrough && have_sslerr) {
-				/* ssl callout failed, fall back to plain
-				 * TCP passthrough of SSL connection */
-				bufferevent_free_and_close_fd(bev, ctx);
-				ctx->dst.bev = NULL;
-				ctx->dst.ssl = NULL;
-				ctx->passthrough = 1;
-				log_dbg_printf("SSL dst connection failed; fal"
-				               "ling back to passthrough\n");
-				pxy_fd_readcb(ctx->fd, 0, ctx);
-				return;
-			}
-			evutil_closesocket(ctx->fd);
-			other->closed = 1;
-		} else if (!other->closed) {
-			/* if the other end is still open and doesn't have data
-			 * to send, close it, otherwise its writecb will close
-			 * it after writing what's left in the output buffer */
-			struct evbuffer *outbuf;
-			outbuf = bufferevent_get_output(other->bev);
-			if (evbuffer_get_length(outbuf) == 0) {
-				bufferevent_free_and_close_fd(other->bev, ctx);
-				other->bev = NULL;
-				other->closed = 1;
+	if (result == DNS_ERR_SHUTDOWN || result == DNS_ERR_CANCEL) {
+		/* shutting down; connections on this thread are torn down
+		 * with its base, those on other threads fail the lookup */
+		pxy_dns_waiter_t *waiter, *waiters = pxy_dns_unlink(req);
+
+		while ((waiter = waiters)) {
+			waiters = waiter->next;
+			if (waiter->evbase != req->evbase) {
+				memset(&waiter->dns, 0, sizeof(cachedns_val_t));
+				waiter->dns.err = EVUTIL_EAI_FAIL;
+				if (event_base_once(waiter->evbase, -1,
+				                    EV_TIMEOUT,
+				                    pxy_dns_notify_cb, waiter,
+				                    NULL) == -1) {
+					log_err_printf("Failed to schedule DNS "
+					               "lookup completion\n");
+				}
+				continue;
 			}
+			if (waiter->ctx)
+				waiter->ctx->dnswait = NULL;
+			free(waiter);
 		}
-		goto leave;
+		free(req);
+		return;
 	}
 
-	if (events & BEV_EVENT_EOF) {
-#ifdef DEBUG_PROXY
-		if (OPTS_DEBUG(ctx->opts)) {
-			log_dbg_printf("evbuffer size at EOF: "
-			               "i:%zu o:%zu i:%zu o:%zu\n",
-			                evbuffer_get_length(
-			                    bufferevent_get_input(bev)),
-			                evbuffer_get_length(
-			                    bufferevent_get_output(bev)),
-							other->closed ? 0 :
-			                    evbuffer_get_length(
-			                    bufferevent_get_input(other->bev)),
-							other->closed ? 0 :
-			                    evbuffer_get_length(
-			                    bufferevent_get_output(other->bev))
-			                );
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = req->af;
+	hints.ai_flags = EVUTIL_AI_ADDRCONFIG;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	evdns_getaddrinfo(req->dnsbase, req->host, NULL, &hints,
+	                  pxy_dns_gai_cb, req);
+}
+
+/*
+ * Look up host for ctx, or for prefetching into the cache if ctx is NULL.
+ * If a lookup for the same host and address family is already ongoing on
+ * any thread, ctx waits for that lookup instead of starting another one.
+ * Returns -1 on out of memory condition, 0 on success.
+ */
+static int
+pxy_dns_lookup(pxy_conn_ctx_t *ctx, struct event_base *evbase,
+               struct evdns_base *dnsbase, int af, const char *host)
+{
+	pxy_dns_req_t *req;
+	pxy_dns_waiter_t *waiter = NULL;
+	unsigned int hash;
+	size_t sz;
+
+	if (ctx) {
+		if (!(waiter = malloc(sizeof(pxy_dns_waiter_t))))
+			return -1;
+		waiter->ctx = ctx;
+		waiter->evbase = evbase;
+	}
+	hash = pxy_dns_hash(af, host);
+	pthread_mutex_lock(&pxy_dns_mutex);
+	for (req = pxy_dns_reqs[hash % PXY_DNS_BUCKETS]; req;
+	     req = req->next) {
+		if (req->hash == hash && req->af == af &&
+		    !strcmp(req->host, host))
+			break;
+	}
+	if (req) {
+		if (waiter) {
+			waiter->next = req->waiters;
+			req->waiters = waiter;
+			ctx->dnswait = waiter;
 		}
-#endif /* DEBUG_PROXY */
-		if (!ctx->connected) {
-			log_dbg_printf("EOF on outbound connection before "
-			               "connection establishment\n");
-			evutil_closesocket(ctx->fd);
-			other->closed = 1;
-		} else if (!other->closed) {
-			/* if there is data pending in the closed connection,
-			 * handle it here, otherwise it will be lost. */
-			if (evbuffer_get_length(bufferevent_get_input(bev))) {
-				pxy_bev_readcb(bev, ctx);
-			}
-			/* if the other end is still open and doesn't
-			 * have data to send, close it, otherwise its
-			 * writecb will close it after writing what's
-			 * left in the output buffer. */
-			if (evbuffer_get_length(
-			    bufferevent_get_output(other->bev)) == 0) {
-				bufferevent_free_and_close_fd(other->bev, ctx);
-				other->bev = NULL;
-				other->closed = 1;
-			}
+		pthread_mutex_unlock(&pxy_dns_mutex);
+		if (ctx && OPTS_DEBUG(ctx->opts))
+			log_dbg_printf("DNS lookup: joined ongoing lookup\n");
+		return 0;
+	}
+	sz = strlen(host) + 1;
+	if (!(req = malloc(sizeof(pxy_dns_req_t) + sz))) {
+		pthread_mutex_unlock(&pxy_dns_mutex);
+		free(waiter);
+		return -1;
+	}
+	req->evbase = evbase;
+	req->dnsbase = dnsbase;
+	req->waiters = waiter;
+	if (waiter)
+		waiter->next = NULL;
+	req->hash = hash;
+	req->af = af;
+	memcpy(req->host, host, sz);
+	req->next = pxy_dns_reqs[hash % PXY_DNS_BUCKETS];
+	pxy_dns_reqs[hash % PXY_DNS_BUCKETS] = req;
+	pthread_mutex_unlock(&pxy_dns_mutex);
+	if (!(af == AF_INET6 ?
+	      evdns_base_resolve_ipv6(dnsbase, host, DNS_QUERY_NO_SEARCH,
+	                              pxy_dns_resolve_cb, req) :
+	      evdns_base_resolve_ipv4(dnsbase, host, DNS_QUERY_NO_SEARCH,
+	                              pxy_dns_resolve_cb, req))) {
+		cachedns_val_t dns;
+
+		/* fail all connections that joined in the meantime */
+		memset(&dns, 0, sizeof(dns));
+		dns.err = EVUTIL_EAI_MEMORY;
+		if (waiter) {
+			/* reported by the caller instead */
+			waiter->ctx = NULL;
 		}
-		goto leave;
+		pxy_dns_done(req, &dns, 0);
+		return -1;
 	}
+	if (ctx)
+		ctx->dnswait = waiter;
+	return 0;
+}
 
-	log_err_printf("Unknown bufferevent 0x%02X\n", (int)events);
-	return;
+/*
+ * Resolve the SNI hostname of ctx, using the DNS cache shared across all
+ * connection handling threads.  Hits on entries close to expiry trigger
+ * a prefetch, such that frequently used hostnames never need to wait for
+ * a lookup.
+ */
+static void
+pxy_sni_resolve(pxy_conn_ctx_t *ctx)
+{
+	cachedns_val_t *dns;
 
-leave:
-	/* we only get a single disconnect event here for both connections */
+	dns = cachemgr_dns_get(ctx->af, ctx->sni);
 	if (OPTS_DEBUG(ctx->opts)) {
-		log_dbg_printf("%s disconnected to [%s]:%s\n",
-		               this->ssl ? "SSL" : "TCP",
-		               STRORDASH(ctx->dsthost_str),
-		               STRORDASH(ctx->dstport_str));
-		log_dbg_printf("%s disconnected from [%s]:%s\n",
-		               this->ssl ? "SSL" : "TCP",
-		               ctx->srchost_str, ctx->srcport_str);
+		log_dbg_printf("DNS cache: %s%s\n", dns ? "HIT" : "MISS",
+		               dns && dns->refresh <= time(NULL) ?
+		               " (prefetch)" : "");
+	}
+	if (!dns) {
+		if (pxy_dns_lookup(ctx, ctx->evbase, ctx->dnsbase, ctx->af,
+		                   ctx->sni) == -1) {
+			log_err_printf("Error allocating memory\n");
+			evutil_closesocket(ctx->fd);
+			pxy_conn_ctx_free(ctx, 1);
+		}
+		return;
 	}
-
-	this->closed = 1;
-	bufferevent_free_and_close_fd(bev, ctx);
-	this->bev = NULL;
-	if (other->closed) {
-		pxy_conn_ctx_free(ctx, is_requestor);
+	if (dns->refresh <= time(NULL)) {
+		/* prefetch once; concurrent hits may still prefetch twice */
+		time_t refresh = dns->refresh;
+		dns->refresh = dns->expiry;
+		cachemgr_dns_set(ctx->af, ctx->sni, dns);
+		dns->refresh = refresh;
+		if (pxy_dns_lookup(NULL, ctx->evbase, ctx->dnsbase, ctx->af,
+		                   ctx->sni) == -1) {
+			log_err_printf("Warning: Failed to prefetch '%s'\n",
+			               ctx->sni);
+		}
 	}
+	pxy_sni_resolved(ctx, dns);
+	free(dns);
 }
+#endif /* !OPENSSL_NO_TLSEXT */
 
 /*
- * Complete the connection.  This gets called after finding out where to
- * connect to.
+ * Tear down a connection in whatever state it is in, cancelling pending
+ * lookups and connects and closing all of its sockets.
  */
 static void
-pxy_conn_connect(pxy_conn_ctx_t *ctx)
+pxy_conn_abort(pxy_conn_ctx_t *ctx)
 {
-	if (!ctx->dstaddrlen) {
-		log_err_printf("No target address; aborting connection\n");
-		evutil_closesocket(ctx->fd);
-		pxy_conn_ctx_free(ctx, 1);
+	if (ctx->stepfd != -1) {
+		evutil_closesocket(ctx->stepfd);
+		ctx->stepfd = -1;
+	}
+#ifdef HAVE_SPLICE
+	if (ctx->splice) {
+		pxy_splice_close(ctx, 1);
+		return;
+	}
+#endif /* HAVE_SPLICE */
+#ifdef HAVE_IOURING
+	if (ctx->uring) {
+		pxy_uring_close(ctx->uring, 1);
 		return;
 	}
+#endif /* HAVE_IOURING */
+#ifndef OPENSSL_NO_TLSEXT
+	if (ctx->dnswait) {
+		/* the lookup completes without this connection */
+		ctx->dnswait->ctx = NULL;
+		ctx->dnswait = NULL;
+	}
+#if LIBEVENT_VERSION_NUMBER >= 0x02010200
+	if (ctx->race) {
+		pxy_race_free(ctx->race, -1);
+	}
+#endif /* LIBEVENT_VERSION_NUMBER >= 0x02010200 */
+#endif /* !OPENSSL_NO_TLSEXT */
+	if (ctx->fastopen) {
+		evutil_closesocket(event_get_fd(ctx->ev));
+		ctx->fastopen = 0;
+	}
+	if (ctx->dst.bev) {
+		bufferevent_free_and_close_fd(ctx->dst.bev, ctx);
+		ctx->dst.bev = NULL;
+	}
+	if (ctx->src.bev) {
+		bufferevent_free_and_close_fd(ctx->src.bev, ctx);
+		ctx->src.bev = NULL;
+	} else if (!ctx->src.closed) {
+		if (ctx->src.ssl) {
+			SSL_free(ctx->src.ssl);
+			ctx->src.ssl = NULL;
+		}
+		evutil_closesocket(ctx->fd);
+	}
+	pxy_conn_ctx_free(ctx, 1);
+}
 
-	/* create server-side socket and eventbuffer */
-	if (ctx->spec->ssl && !ctx->passthrough) {
-		ctx->dst.ssl = pxy_dstssl_create(ctx);
-		if (!ctx->dst.ssl) {
-			log_err_printf("Error creating SSL\n");
-			evutil_closesocket(ctx->fd);
-			pxy_conn_ctx_free(ctx, 1);
-			return;
+/*
+ * Release the memory an established connection only needs while octets are
+ * flowing or while it is being set up, once it has been idle for the
+ * dormant timeout.  The TLS record buffers are reallocated by OpenSSL on
+ * the next read or write; the evbuffers of the connection already release
+ * their chains when drained.  The SSL log strings are only released once
+ * the connect log line has been written for good, that is, unless HTTP
+ * responses are still to be logged.
+ */
+static void
+pxy_conn_compact(pxy_conn_ctx_t *ctx)
+{
+	ctx->dormant = 1;
+#if (OPENSSL_VERSION_NUMBER >= 0x10101000L) && !defined(LIBRESSL_VERSION_NUMBER)
+	if (ctx->src.ssl)
+		(void)SSL_free_buffers(ctx->src.ssl);
+	if (ctx->dst.ssl)
+		(void)SSL_free_buffers(ctx->dst.ssl);
+#endif /* OPENSSL_VERSION_NUMBER >= 0x10101000L */
+	if (!ctx->http_method && !ctx->http_status_code) {
+		arena_free(&ctx->http_reqarena);
+		arena_free(&ctx->http_resparena);
+	}
+	if (ctx->alpn) {
+		free(ctx->alpn);
+		ctx->alpn = NULL;
+	}
+	if (ctx->origcrt) {
+		X509_free(ctx->origcrt);
+		ctx->origcrt = NULL;
+	}
+	if (!ctx->spec->http || ctx->passthrough || ctx->http_ws) {
+		if (ctx->ssl_names) {
+			free(ctx->ssl_names);
+			ctx->ssl_names = NULL;
+		}
+		if (ctx->origcrtfpr) {
+			free(ctx->origcrtfpr);
+			ctx->origcrtfpr = NULL;
+		}
+		if (ctx->usedcrtfpr) {
+			free(ctx->usedcrtfpr);
+			ctx->usedcrtfpr = NULL;
 		}
 	}
-	ctx->dst.bev = pxy_bufferevent_setup(ctx, -1, ctx->dst.ssl);
-	if (!ctx->dst.bev) {
-		if (ctx->dst.ssl) {
-			SSL_free(ctx->dst.ssl);
-			ctx->dst.ssl = NULL;
+	if (OPTS_DEBUG(ctx->opts)) {
+		log_dbg_printf("Connection from [%s]:%s compacted while "
+		               "idle\n",
+		               STRORDASH(pxy_conn_srchost(ctx)),
+		               STRORDASH(pxy_conn_srcport(ctx)));
+	}
+}
+
+/*
+ * The connection timer has expired.  Idle timeouts are not rearmed on every
+ * octet received; instead, the timer is pushed back here by the time since
+ * the last activity, and the connection is only aborted if it was idle for
+ * the whole timeout.
+ */
+static void
+pxy_conn_timeout_cb(tmwheel_timer_t *timer)
+{
+	pxy_conn_ctx_t *ctx = timer->arg;
+	pxy_cpu_t *cpu = pxy_cpu_enter(ctx);
+
+	if (ctx->timeout == OPTS_TIMEOUT_IDLE) {
+		unsigned long long ms, dms, idle;
+
+		ms = pxy_conn_timeout_secs(ctx, OPTS_TIMEOUT_IDLE) * 1000ULL;
+		dms = pxy_conn_timeout_secs(ctx, OPTS_TIMEOUT_DORMANT) *
+		      1000ULL;
+		idle = tmwheel_now(ctx->wheel) - ctx->activity;
+		if (dms && idle >= dms && !ctx->dormant)
+			pxy_conn_compact(ctx);
+		if (!ms || idle < ms) {
+			pxy_conn_idle_arm(ctx, idle);
+			goto leave;
 		}
-		evutil_closesocket(ctx->fd);
-		pxy_conn_ctx_free(ctx, 1);
-		return;
 	}
+	if (OPTS_DEBUG(ctx->opts)) {
+		log_dbg_printf("Connection from [%s]:%s timed out (%s)\n",
+		               STRORDASH(pxy_conn_srchost(ctx)),
+		               STRORDASH(pxy_conn_srcport(ctx)),
+		               opts_timeout_str(ctx->timeout));
+	}
+	stats_inc(STATS_CONN_TIMEOUT);
+	ctx->timedout = 1;
+	pxy_conn_abort(ctx);
+leave:
+	pxy_cpu_leave(cpu);
+}
+
+#ifndef OPENSSL_NO_TLSEXT
+/*
+ * Remember the ALPN protocol name list of len octets at list offered in the
+ * ClientHello for offering them to the server.  The HTTP header filter of http
+ * proxyspecs only understands HTTP/1.x, so only the HTTP/1.x protocols are
+ * offered for those, keeping both sides on HTTP/1.1; other proxyspecs pass
+ * the data on as is, so the whole list is offered, including h2.
+ * Returns -1 on out of memory, 0 otherwise.
+ */
+static int
+pxy_conn_alpn_set(pxy_conn_ctx_t *ctx, const unsigned char *list, size_t len)
+{
+	static const char *http1[] = {"http/1.1", "http/1.0"};
+	const unsigned char *p;
 
-	if (OPTS_DEBUG(ctx->opts)) {
-		char *host, *port;
-		if (sys_sockaddr_str((struct sockaddr *)&ctx->dstaddr,
-		                     ctx->dstaddrlen, &host, &port) != 0) {
-			log_dbg_printf("Connecting to [?]:?\n");
-		} else {
-			log_dbg_printf("Connecting to [%s]:%s\n", host, port);
-			free(host);
-			free(port);
+	if (!(ctx->alpn = malloc(len)))
+		return -1;
+	if (!ctx->spec->http) {
+		memcpy(ctx->alpn, list, len);
+		ctx->alpnlen = len;
+		return 0;
+	}
+	for (size_t i = 0; i < sizeof(http1) / sizeof(http1[0]); i++) {
+		p = ssl_alpn_find(list, len, (const unsigned char *)http1[i],
+		                  strlen(http1[i]));
+		if (p) {
+			memcpy(ctx->alpn + ctx->alpnlen, p, 1 + p[0]);
+			ctx->alpnlen += 1 + p[0];
 		}
 	}
-
-	/* initiate connection */
-	bufferevent_socket_connect(ctx->dst.bev,
-	                           (struct sockaddr *)&ctx->dstaddr,
-	                           ctx->dstaddrlen);
+	if (!ctx->alpnlen) {
+		free(ctx->alpn);
+		ctx->alpn = NULL;
+	}
+	return 0;
 }
+#endif /* !OPENSSL_NO_TLSEXT */
 
-#ifndef OPENSSL_NO_TLSEXT
 /*
- * The SNI hostname has been resolved.  Fill the first resolved address into
- * the context and continue connecting.
+ * Run the connection setup step scheduled by pxy_conn_step().
  */
 static void
-pxy_sni_resolve_cb(int errcode, struct evutil_addrinfo *ai, void *arg)
+pxy_conn_step_cb(UNUSED evutil_socket_t fd, UNUSED short what, void *arg)
 {
 	pxy_conn_ctx_t *ctx = arg;
+	pxy_cpu_t *cpu = pxy_cpu_enter(ctx);
+	evutil_socket_t dstfd;
 
-	if (errcode) {
-		log_err_printf("Cannot resolve SNI hostname '%s': %s\n",
-		               ctx->sni, evutil_gai_strerror(errcode));
-		evutil_closesocket(ctx->fd);
-		pxy_conn_ctx_free(ctx, 1);
-		return;
-	}
+	event_free(ctx->ev);
+	ctx->ev = NULL;
+	switch (ctx->step) {
+#ifndef OPENSSL_NO_TLSEXT
+	case PXY_STEP_RESOLVE:
+		pxy_sni_resolve(ctx);
+		break;
+#endif /* !OPENSSL_NO_TLSEXT */
+	case PXY_STEP_CONNECT:
+		pxy_conn_connect(ctx);
+		break;
+	case PXY_STEP_DSTSSL:
+		dstfd = ctx->stepfd;
+		ctx->stepfd = -1;
+		pxy_conn_setup_dst(ctx, dstfd, ctx->stephow);
+		break;
+	case PXY_STEP_ABORT:
+		pxy_conn_abort(ctx);
+		break;
+	case PXY_STEP_HANDOFF:
+		pxy_conn_handoff(ctx);
+		break;
+	}
+	pxy_cpu_leave(cpu);
+}
 
-	memcpy(&ctx->dstaddr, ai->ai_addr, ai->ai_addrlen);
-	ctx->dstaddrlen = ai->ai_addrlen;
-	evutil_freeaddrinfo(ai);
-	pxy_conn_connect(ctx);
+/*
+ * Schedule connection setup step to run from the event loop at priority prio
+ * instead of running it right away, such that the steps of all connections
+ * on the thread are interleaved by priority rather than each connection
+ * running its setup to completion.  Uses ctx->ev, which must not be in use
+ * for anything else.
+ * Returns -1 on out of memory, 0 otherwise.
+ */
+static int
+pxy_conn_step(pxy_conn_ctx_t *ctx, int step, int prio)
+{
+	if (ctx->ev)
+		event_free(ctx->ev);
+	ctx->ev = event_new(ctx->evbase, -1, 0, pxy_conn_step_cb, ctx);
+	if (!ctx->ev)
+		return -1;
+	(void)event_priority_set(ctx->ev, prio);
+	ctx->step = step;
+	event_active(ctx->ev, EV_TIMEOUT, 0);
+	return 0;
+}
+
+/*
+ * Upper bound on the number of ClientHello octets buffered while waiting for
+ * the complete message; larger ClientHello messages are passed on without
+ * parsing SNI from them.
+ */
+#define PXY_CLIENTHELLO_MAXSZ (128*1024)
+
+#ifndef OPENSSL_NO_TLSEXT
+/*
+ * Returns 1 if the SNI or the destination address of the connection are on
+ * the bypass list, in which case the connection is passed through before
+ * any OpenSSL objects are created for it.  In SNI proxy mode, only the SNI
+ * is matched, as the destination address is not known yet.
+ */
+static int
+pxy_conn_bypassed(pxy_conn_ctx_t *ctx)
+{
+	const char *what;
+
+	if (ctx->sni && bypass_match_sni(ctx->opts->bypass, ctx->sni))
+		what = "SNI";
+	else if (ctx->dstaddrlen &&
+	         bypass_match_addr(ctx->opts->bypass,
+	                           (struct sockaddr *)&ctx->dstaddr,
+	                           ctx->dstaddrlen))
+		what = "Destination";
+	else
+		return 0;
+	if (OPTS_DEBUG(ctx->opts)) {
+		log_dbg_printf("%s on bypass list; passing through\n", what);
+	}
+	return 1;
 }
 #endif /* !OPENSSL_NO_TLSEXT */
 
 /*
  * The src fd is readable.  This is used to sneak-preview the SNI on SSL
- * connections.  If ctx->ev is NULL, it was called manually for a non-SSL
- * connection.  If ctx->passthrough is set, it was called a second time
- * after the first ssl callout failed because of client cert auth.
+ * connections.  The ClientHello is read incrementally on each read event
+ * until it is complete, and the octets read are later handed to OpenSSL or
+ * forwarded to dst in passthrough mode.  If ctx->ev is NULL, it was called
+ * manually for a non-SSL connection.  If ctx->passthrough is set, it was
+ * called a second time after the first ssl callout failed because of client
+ * cert auth.
  */
 #ifndef OPENSSL_NO_TLSEXT
 #define MAYBE_UNUSED 
@@ -2436,22 +8958,47 @@ pxy_sni_resolve_cb(int errcode, struct evutil_addrinfo *ai, void *arg)
 #define MAYBE_UNUSED UNUSED
 #endif /* OPENSSL_NO_TLSEXT */
 static void
-pxy_fd_readcb(MAYBE_UNUSED evutil_socket_t fd, UNUSED short what, void *arg)
+pxy_fd_read_handler(MAYBE_UNUSED evutil_socket_t fd, UNUSED short what,
+                    void *arg)
 #undef MAYBE_UNUSED
 {
 	pxy_conn_ctx_t *ctx = arg;
 
 #ifndef OPENSSL_NO_TLSEXT
-	/* for SSL, peek ClientHello and parse SNI from it */
+	/* for SSL, read ClientHello and parse SNI from it */
 	if (ctx->spec->ssl && !ctx->passthrough /*&& ctx->ev*/) {
-		unsigned char buf[1024];
-		ssize_t n;
+		unsigned char *record;
+		size_t recordsz;
 		const unsigned char *chello;
+		ssize_t n;
 		int rv;
 
-		n = recv(fd, buf, sizeof(buf), MSG_PEEK);
+		if (ctx->chpeeked) {
+			/* parse the octets read before thread selection */
+			ctx->chpeeked = 0;
+			goto reassemble;
+		}
+		if (ctx->chlen == ctx->chsz) {
+			size_t sz = ctx->chsz ? ctx->chsz * 2 : 1024;
+			unsigned char *p = realloc(ctx->chbuf, sz);
+			if (!p) {
+				log_err_printf("Error allocating memory\n");
+				evutil_closesocket(fd);
+				pxy_conn_ctx_free(ctx, 1);
+				return;
+			}
+			ctx->chbuf = p;
+			ctx->chsz = sz;
+		}
+		n = recv(fd, ctx->chbuf + ctx->chlen, ctx->chsz - ctx->chlen,
+		         0);
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+		                errno == EINTR)) {
+			event_add(ctx->ev, NULL);
+			return;
+		}
 		if (n == -1) {
-			log_err_printf("Error peeking on fd, aborting "
+			log_err_printf("Error reading from fd, aborting "
 			               "connection\n");
 			evutil_closesocket(fd);
 			pxy_conn_ctx_free(ctx, 1);
@@ -2463,69 +9010,93 @@ pxy_fd_readcb(MAYBE_UNUSED evutil_socket_t fd, UNUSED short what, void *arg)
 			pxy_conn_ctx_free(ctx, 1);
 			return;
 		}
-
-		rv = ssl_tls_clienthello_parse(buf, n, 0, &chello, &ctx->sni);
-		if ((rv == 1) && !chello) {
-			log_err_printf("Peeking did not yield a (truncated) "
-			               "ClientHello message, "
-			               "aborting connection\n");
-			evutil_closesocket(fd);
-			pxy_conn_ctx_free(ctx, 1);
+		ctx->chlen += n;
+reassemble:
+		rv = ssl_tls_clienthello_reassemble(ctx->chbuf, ctx->chlen,
+		                                    &record, &recordsz);
+		if (rv == 1 && ctx->chlen < PXY_CLIENTHELLO_MAXSZ) {
+			/* wait for the next read event */
+			event_add(ctx->ev, NULL);
 			return;
 		}
-		if (OPTS_DEBUG(ctx->opts)) {
-			log_dbg_printf("SNI peek: [%s] [%s]\n",
-			               ctx->sni ? ctx->sni : "n/a",
-			               ((rv == 1) && chello) ?
-			               "incomplete" : "complete");
-		}
-		if ((rv == 1) && chello && (ctx->sni_peek_retries++ < 50)) {
-			/* ssl_tls_clienthello_parse indicates that we
-			 * should retry later when we have more data, and we
-			 * haven't reached the maximum retry count yet.
-			 * Reschedule this event as timeout-only event in
-			 * order to prevent busy looping over the read event.
-			 * Because we only peeked at the pending bytes and
-			 * never actually read them, fd is still ready for
-			 * reading now.  We use 25 * 0.2 s = 5 s timeout. */
-			struct timeval retry_delay = {0, 100};
-
-			event_free(ctx->ev);
-			ctx->ev = event_new(ctx->evbase, fd, 0,
-			                    pxy_fd_readcb, ctx);
-			if (!ctx->ev) {
-				log_err_printf("Error creating retry "
-				               "event, aborting "
-				               "connection\n");
+		chello = NULL;
+		if (record) {
+			rv = ssl_tls_clienthello_summary(record, recordsz, 0,
+			                                 &chello, &ctx->sni,
+			                                 &ctx->hello);
+			ctx->ecdsa = ctx->hello.ecdsa && ctx->opts->eccakey;
+			/* looked up while connecting to the server */
+			if (rv == 0 && cachemgr_rcache && ctx->hello.sidlen)
+				cachemgr_ssess_prefetch(chello +
+				                        ctx->hello.sidoff,
+				                        ctx->hello.sidlen);
+			if (rv == 0 && ctx->hello.alpnlen &&
+			    pxy_conn_alpn_set(ctx, chello + ctx->hello.alpnoff,
+			                      ctx->hello.alpnlen) == -1) {
+				free(record);
+				log_err_printf("Error allocating memory\n");
 				evutil_closesocket(fd);
 				pxy_conn_ctx_free(ctx, 1);
 				return;
 			}
-			event_add(ctx->ev, &retry_delay);
+			free(record);
+		}
+		if (rv == -1 || (record && !chello)) {
+			log_err_printf("Reading did not yield a ClientHello "
+			               "message, aborting connection\n");
+			evutil_closesocket(fd);
+			pxy_conn_ctx_free(ctx, 1);
 			return;
 		}
+		if (OPTS_DEBUG(ctx->opts)) {
+			log_dbg_printf("SNI peek: [%s] [%s]\n",
+			               ctx->sni ? ctx->sni : "n/a",
+			               chello ? "complete" : "oversize");
+		}
+		pxy_conn_phase(ctx, STATS_PHASE_SNI);
+		pxy_conn_timeout(ctx, OPTS_TIMEOUT_CONNECT);
 		event_free(ctx->ev);
 		ctx->ev = NULL;
+
+		if (ctx->opts->bypass && pxy_conn_bypassed(ctx)) {
+			ctx->passthrough = 1;
+			stats_inc(STATS_SSL_PASSTHROUGH);
+		} else if (pxy_thrmgr_overloaded(ctx->thrmgr, ctx->thridx)) {
+			/* degrade to passthrough rather than time out */
+			ctx->passthrough = 1;
+			stats_inc(STATS_SSL_PASSTHROUGH);
+			if (OPTS_DEBUG(ctx->opts)) {
+				log_dbg_printf("Thread overloaded; "
+				               "passing through\n");
+			}
+		}
 	}
 
 	if (ctx->sni && !ctx->dstaddrlen && ctx->spec->sni_port) {
-		char sniport[6];
-		struct evutil_addrinfo hints;
-
-		memset(&hints, 0, sizeof(hints));
-		hints.ai_family = ctx->af;
-		hints.ai_flags = EVUTIL_AI_ADDRCONFIG;
-		hints.ai_socktype = SOCK_STREAM;
-		hints.ai_protocol = IPPROTO_TCP;
-
-		snprintf(sniport, sizeof(sniport), "%i", ctx->spec->sni_port);
-		evdns_getaddrinfo(ctx->dnsbase, ctx->sni, sniport, &hints,
-		                  pxy_sni_resolve_cb, ctx);
+		if (pxy_conn_step(ctx, PXY_STEP_RESOLVE,
+		                  PXY_PRIO_DEFAULT) == -1)
+			goto memout;
 		return;
 	}
 #endif /* !OPENSSL_NO_TLSEXT */
 
-	pxy_conn_connect(ctx);
+	if (pxy_conn_step(ctx, PXY_STEP_CONNECT, PXY_PRIO_DEFAULT) == -1)
+		goto memout;
+	return;
+
+memout:
+	log_err_printf("Error scheduling connection setup\n");
+	evutil_closesocket(ctx->fd);
+	pxy_conn_ctx_free(ctx, 1);
+}
+
+static void
+pxy_fd_readcb(evutil_socket_t fd, short what, void *arg)
+{
+	pxy_cpu_t *cpu = pxy_cpu_enter(arg);
+
+	pxy_fd_read_handler(fd, what, arg);
+	pxy_cpu_leave(cpu);
 }
 
 /*
@@ -2535,25 +9106,101 @@ pxy_fd_readcb(MAYBE_UNUSED evutil_socket_t fd, UNUSED short what, void *arg)
  * from the client is not being activated until we have a successful
  * connection to the server, because we need the server's certificate
  * in order to set up the SSL session to the client.
- * For consistency, plain TCP works the same way, even if we could
- * start reading from the client while waiting on the connection to
+ * Plain TCP works the same way, unless ClientReadAhead is set, in which
+ * case reading from the client starts while waiting on the connection to
  * the server to connect.
+ * If thridx is -1, the connection is attached to the least loaded thread,
+ * otherwise to thread thridx, which must be the thread calling this function.
  */
 void
 pxy_conn_setup(evutil_socket_t fd,
                struct sockaddr *peeraddr, int peeraddrlen,
-               pxy_thrmgr_ctx_t *thrmgr,
+               pxy_thrmgr_ctx_t *thrmgr, int thridx,
                proxyspec_t *spec, opts_t *opts)
+{
+	pxy_conn_setup_peeked(fd, peeraddr, peeraddrlen, thrmgr, thridx,
+	                      spec, opts, NULL, 0, 0);
+}
+
+/*
+ * Like pxy_conn_setup(), for SSL connections of which chlen octets of the
+ * ClientHello were already read from fd into chbuf of size chsz, in order to
+ * choose the thread by the SNI.  Takes ownership of chbuf, which may be NULL.
+ */
+void
+pxy_conn_setup_peeked(evutil_socket_t fd,
+                      struct sockaddr *peeraddr, int peeraddrlen,
+                      pxy_thrmgr_ctx_t *thrmgr, int thridx,
+                      proxyspec_t *spec, opts_t *opts,
+                      unsigned char *chbuf, size_t chlen, size_t chsz)
 {
 	pxy_conn_ctx_t *ctx;
+	admit_t *admit = NULL;
+	admit_ctr_t *src = NULL;
+	int handshake = spec->ssl;
+	int over = 0;
+	unsigned int now = 0;
+
+	/* admission control, before anything is allocated for the connection;
+	 * SSL connections over a limit can be passed through, which avoids
+	 * the handshakes and forging, unless the SNI is needed to connect */
+	if (admit_limited(&opts->admit_global) ||
+	    admit_limited(&opts->admit_source) ||
+	    admit_limited(&spec->admit)) {
+		admit = pxy_thrmgr_get_admit(thrmgr);
+		src = admit_source(admit, peeraddr);
+		now = time(NULL);
+		over = admit_over(admit_global(admit), &opts->admit_global,
+		                  handshake, now) ||
+		       admit_over(&spec->admit_ctr, &spec->admit,
+		                  handshake, now) ||
+		       admit_over(src, &opts->admit_source, handshake, now);
+		if (over) {
+			stats_inc(STATS_CONN_LIMITED);
+			if (!spec->ssl || spec->sni_port ||
+			    !opts->limit_passthrough) {
+				if (OPTS_DEBUG(opts)) {
+					log_dbg_printf("Connection over "
+					               "admission limit; "
+					               "rejecting\n");
+				}
+				evutil_closesocket(fd);
+				free(chbuf);
+				return;
+			}
+			handshake = 0;
+		}
+	}
 
 	/* create per connection pair state and attach to thread */
-	ctx = pxy_conn_ctx_new(spec, opts, thrmgr, fd);
+	ctx = pxy_conn_ctx_new(spec, opts, thrmgr, thridx, fd, peeraddr);
 	if (!ctx) {
 		log_err_printf("Error allocating memory\n");
 		evutil_closesocket(fd);
+		free(chbuf);
 		return;
 	}
+	if (chbuf) {
+		ctx->chbuf = chbuf;
+		ctx->chlen = chlen;
+		ctx->chsz = chsz;
+		ctx->chpeeked = 1;
+	}
+	if (admit) {
+		admit_enter(admit_global(admit), handshake, now);
+		admit_enter(&spec->admit_ctr, handshake, now);
+		admit_enter(src, handshake, now);
+		ctx->admit = admit;
+		ctx->admit_src = src;
+	}
+	if (over) {
+		ctx->passthrough = 1;
+		stats_inc(STATS_SSL_PASSTHROUGH);
+		if (OPTS_DEBUG(opts)) {
+			log_dbg_printf("Connection over admission limit; "
+			               "passing through\n");
+		}
+	}
 
 	ctx->af = peeraddr->sa_family;
 
@@ -2570,6 +9217,12 @@ pxy_conn_setup(evutil_socket_t fd,
 			pxy_conn_ctx_free(ctx, 1);
 			return;
 		}
+		if (spec->natforget) {
+			/* for invalidating the NAT lookup on close */
+			ctx->srcaddrlen = peeraddrlen;
+			memcpy(&ctx->srcaddr, peeraddr, ctx->srcaddrlen);
+		}
+		pxy_conn_phase(ctx, STATS_PHASE_NAT);
 	} else if (spec->connect_addrlen > 0) {
 		/* static forwarding */
 		ctx->dstaddrlen = spec->connect_addrlen;
@@ -2586,8 +9239,8 @@ pxy_conn_setup(evutil_socket_t fd,
 		}
 	}
 
-	/* prepare logging, part 1 */
-	if (opts->pcaplog
+	/* prepare logging, part 1; addresses are formatted on use */
+	if (WANT_CONNECT_LOG(ctx) || WANT_CONTENT_LOG(ctx) || opts->pcaplog
 #ifndef WITHOUT_MIRROR
 	    || opts->mirrorif
 #endif /* !WITHOUT_MIRROR */
@@ -2598,21 +9251,30 @@ pxy_conn_setup(evutil_socket_t fd,
 		ctx->srcaddrlen = peeraddrlen;
 		memcpy(&ctx->srcaddr, peeraddr, ctx->srcaddrlen);
 	}
-	if (WANT_CONNECT_LOG(ctx) || WANT_CONTENT_LOG(ctx)) {
-		if (sys_sockaddr_str(peeraddr, peeraddrlen,
-		                     &ctx->srchost_str,
-		                     &ctx->srcport_str) != 0)
-			goto memout;
+#ifdef HAVE_LOCAL_PROCINFO
+	if (opts->lprocinfo &&
+	    (WANT_CONNECT_LOG(ctx) || WANT_CONTENT_LOG(ctx))) {
+		/* look up while the dst connection is being set up */
+		ctx->lproc.job = proc_lookup_submit(ctx->evbase, peeraddr,
+		                                    peeraddrlen,
+		                                    pxy_lproc_cb, ctx);
 	}
-
+#endif /* HAVE_LOCAL_PROCINFO */
 	/* for SSL, defer dst connection setup to initial_readcb */
 	if (ctx->spec->ssl) {
 		ctx->ev = event_new(ctx->evbase, fd, EV_READ, pxy_fd_readcb,
 		                    ctx);
 		if (!ctx->ev)
 			goto memout;
-		event_add(ctx->ev, NULL);
+		(void)event_priority_set(ctx->ev, PXY_PRIO_HIGH);
+		/* bounds the time the ClientHello buffer is held */
+		pxy_conn_timeout(ctx, OPTS_TIMEOUT_HELLO);
+		if (ctx->chpeeked)
+			event_active(ctx->ev, EV_READ, 0);
+		else
+			event_add(ctx->ev, NULL);
 	} else {
+		pxy_conn_timeout(ctx, OPTS_TIMEOUT_CONNECT);
 		pxy_fd_readcb(fd, 0, ctx);
 	}
 	return;
@@ -2624,4 +9286,547 @@ memout:
 	return;
 }
 
+/*
+ * Rebalancing of established connections with RebalanceInterval.  Every
+ * interval, each connection handling thread sums up the octets forwarded by
+ * its connections since the previous round and publishes the rate.  A thread
+ * forwarding well above the mean of its worker pool then moves its busiest
+ * connections to the thread of the pool forwarding the least, up to half the
+ * difference between the two rates, skipping connections which alone carry
+ * more than what is left to move, since moving those would only shift the
+ * imbalance.  Only connections which are idle at that moment are moved:
+ * established and on the specialised read callbacks, with nothing buffered
+ * and no events pending other than the connection timer.  Connections
+ * using splice, io_uring, traffic shaping or inspection plugins, and autossl
+ * connections with the SSL bufferevent stacked on the plain one, stay where
+ * they are.
+ *
+ * A connection is moved by freeing its bufferevents, which neither close the
+ * sockets nor free the SSL objects, and creating new bufferevents for them on
+ * the event base of the target thread, from a callback on that thread.
+ * Octets arriving in between wait in the socket buffers.
+ */
+#define PXY_REBALANCE_MAX	16	/* candidates per thread and round */
+
+typedef struct pxy_rebalance_job {
+	pxy_thrmgr_ctx_t *thrmgr;
+	int thridx;
+	unsigned int interval;
+	unsigned long long total;
+	size_t ncand;
+	pxy_conn_ctx_t *cand[PXY_REBALANCE_MAX];
+	unsigned long long delta[PXY_REBALANCE_MAX];
+} pxy_rebalance_job_t;
+
+/*
+ * Return 1 if the connection can be moved to another thread right now, 0
+ * otherwise.
+ */
+static int
+pxy_conn_migratable(pxy_conn_ctx_t *ctx)
+{
+	pxy_conn_desc_t *descs[2] = {&ctx->src, &ctx->dst};
+
+	/* fastpath implies established, with both bevs and none closed */
+	if (!ctx->fastpath || ctx->src.closed || ctx->dst.closed ||
+	    ctx->timeout != OPTS_TIMEOUT_IDLE || ctx->earlybuf ||
+	    WANT_INSPECT(ctx) || pxy_conn_shape_rate(ctx))
+		return 0;
+	if (ctx->ev && event_pending(ctx->ev, EV_READ|EV_WRITE|EV_TIMEOUT,
+	                             NULL))
+		return 0;
+	if (ctx->logthrottleev && evtimer_pending(ctx->logthrottleev, NULL))
+		return 0;
+#ifdef HAVE_SPLICE
+	if (ctx->splice)
+		return 0;
+#endif /* HAVE_SPLICE */
+#ifdef HAVE_IOURING
+	if (ctx->uring)
+		return 0;
+#endif /* HAVE_IOURING */
+#ifdef HAVE_LOCAL_PROCINFO
+	if (ctx->lproc.job)
+		return 0;
+#endif /* HAVE_LOCAL_PROCINFO */
+#ifdef HAVE_ZEROCOPY
+	if ((ctx->src.zc && ctx->src.zc->head != ctx->src.zc->next) ||
+	    (ctx->dst.zc && ctx->dst.zc->head != ctx->dst.zc->next))
+		return 0;
+#endif /* HAVE_ZEROCOPY */
+	for (int i = 0; i < 2; i++) {
+		struct bufferevent *bev = descs[i]->bev;
+
+		if (descs[i]->log_throttled ||
+		    bufferevent_get_underlying(bev) ||
+		    bufferevent_get_enabled(bev) != (EV_READ|EV_WRITE) ||
+		    evbuffer_get_length(bufferevent_get_input(bev)) ||
+		    evbuffer_get_length(bufferevent_get_output(bev)) ||
+		    (descs[i]->ssl && SSL_pending(descs[i]->ssl)))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Second half of moving a connection, on the target thread: attach to the
+ * thread and create the bufferevents on its event base.  While the
+ * connection is in transit, ctx->stepfd holds the dst socket and
+ * ctx->activity the milliseconds the connection had been idle.
+ */
+static void
+pxy_conn_migrate_cb(UNUSED evutil_socket_t fd, UNUSED short what, void *arg)
+{
+	pxy_conn_ctx_t *ctx = arg;
+	pxy_cpu_t *cpu = pxy_cpu_enter(ctx);
+	unsigned long long idle = ctx->activity, now;
+
+	ctx->thridx = pxy_thrmgr_attach_thr(ctx->thrmgr, ctx->thridx,
+	                                    &ctx->evbase, &ctx->dnsbase);
+	pxy_thrmgr_setup_done(ctx->thrmgr, ctx->thridx);
+	ctx->wheel = pxy_thrmgr_get_wheel(ctx->thrmgr, ctx->thridx);
+	pxy_thrmgr_conn_register(ctx->thrmgr, ctx->thridx, &ctx->link, ctx);
+
+	ctx->src.bev = pxy_bufferevent_setup_state(ctx, ctx->fd, ctx->src.ssl,
+	                                           BUFFEREVENT_SSL_OPEN);
+	if (!ctx->src.bev)
+		goto errout;
+	ctx->dst.bev = pxy_bufferevent_setup_state(ctx, ctx->stepfd,
+	                                           ctx->dst.ssl,
+	                                           BUFFEREVENT_SSL_OPEN);
+	if (!ctx->dst.bev)
+		goto errout;
+	ctx->stepfd = -1;
+	(void)bufferevent_priority_set(ctx->src.bev, PXY_PRIO_ESTAB);
+	(void)bufferevent_priority_set(ctx->dst.bev, PXY_PRIO_ESTAB);
+	ctx->fastpath = 0;
+	pxy_bev_specialise(ctx);
+
+	/* arm first, which brings the wheel time of an idle wheel up to
+	 * date, then express the idle time in the time of the new wheel */
+	pxy_conn_idle_arm(ctx, idle);
+	now = tmwheel_now(ctx->wheel);
+	ctx->activity = now > idle ? now - idle : 0;
+	if (OPTS_DEBUG(ctx->opts)) {
+		log_dbg_printf("Connection from [%s]:%s moved to thread %d\n",
+		               STRORDASH(pxy_conn_srchost(ctx)),
+		               STRORDASH(pxy_conn_srcport(ctx)), ctx->thridx);
+	}
+	pxy_cpu_leave(cpu);
+	return;
+
+errout:
+	log_err_printf("Error moving connection to thread %d, aborting "
+	               "connection\n", ctx->thridx);
+	if (ctx->src.bev) {
+		bufferevent_free_and_close_fd(ctx->src.bev, ctx);
+		ctx->src.bev = NULL;
+	} else {
+		SSL_free(ctx->src.ssl);
+		evutil_closesocket(ctx->fd);
+	}
+	ctx->src.ssl = NULL;
+	if (ctx->dst.ssl)
+		SSL_free(ctx->dst.ssl);
+	ctx->dst.ssl = NULL;
+	evutil_closesocket(ctx->stepfd);
+	ctx->stepfd = -1;
+	pxy_conn_ctx_free(ctx, 1);
+	pxy_cpu_leave(cpu);
+}
+
+/*
+ * Move the connection to thread thridx, if it can be moved right now.  Must
+ * be called on the current thread of the connection.
+ * Returns 0 if the connection is being moved, -1 otherwise.
+ */
+static int
+pxy_conn_migrate(pxy_conn_ctx_t *ctx, int thridx)
+{
+	unsigned long long now;
+
+	if (!pxy_conn_migratable(ctx))
+		return -1;
+	/* events of the old event base not pending, see above */
+	if (ctx->ev) {
+		event_free(ctx->ev);
+		ctx->ev = NULL;
+	}
+	if (ctx->logthrottleev) {
+		event_free(ctx->logthrottleev);
+		ctx->logthrottleev = NULL;
+	}
+#ifdef HAVE_ZEROCOPY
+	/* no sends in flight, see above; set up again on the new thread */
+	if (ctx->src.zc) {
+		(void)pxy_zc_close(ctx->src.zc, -1);
+		ctx->src.zc = NULL;
+	}
+	if (ctx->dst.zc) {
+		(void)pxy_zc_close(ctx->dst.zc, -1);
+		ctx->dst.zc = NULL;
+	}
+#endif /* HAVE_ZEROCOPY */
+	tmwheel_del(ctx->wheel, &ctx->timer);
+	now = tmwheel_now(ctx->wheel);
+	ctx->activity = now > ctx->activity ? now - ctx->activity : 0;
+	ctx->stepfd = bufferevent_getfd(ctx->dst.bev);
+	pxy_bev_release(ctx);
+	pxy_thrmgr_conn_unregister(ctx->thrmgr, ctx->thridx, &ctx->link);
+	pxy_thrmgr_detach(ctx->thrmgr, ctx->thridx);
+	ctx->thridx = thridx;
+	stats_inc(STATS_CONN_MIGRATED);
+	if (event_base_once(pxy_thrmgr_get_evbase(ctx->thrmgr, thridx), -1,
+	                    EV_TIMEOUT, pxy_conn_migrate_cb, ctx,
+	                    NULL) == -1) {
+		/* the bufferevents are thread-safe, see above */
+		pxy_conn_migrate_cb(-1, 0, ctx);
+	}
+	return 0;
+}
+
+/*
+ * Staged worker pools with the fwdpool proxyspec option: connections are
+ * set up on a thread of the worker pool of the proxyspec, which does all the
+ * handshaking and certificate forging, and then handed off to a thread of
+ * the forwarding pool as soon as they are established and switched to the
+ * specialised read callbacks.  The handoff is a move as done by the
+ * rebalancing above and subject to the same conditions; connections which
+ * cannot be moved yet, typically because of data in flight, are retried
+ * with exponential backoff for up to PXY_HANDOFF_TRIES attempts and then
+ * stay on the handshake thread.
+ */
+#define PXY_HANDOFF_TRIES	7	/* fits ctx->handoff_tries */
+
+static void
+pxy_conn_handoff(pxy_conn_ctx_t *ctx)
+{
+	struct timeval tv;
+	int thridx;
+
+	thridx = pxy_thrmgr_select(ctx->thrmgr, ctx->spec->fwpool,
+	                           (struct sockaddr *)&ctx->srcaddr);
+	/* ctx belongs to the target thread as soon as the move started */
+	ctx->handoff = 0;
+	if (pxy_conn_migrate(ctx, thridx) == 0)
+		return;
+	if (++ctx->handoff_tries == PXY_HANDOFF_TRIES) {
+		if (OPTS_DEBUG(ctx->opts)) {
+			log_dbg_printf("Connection from [%s]:%s stays on "
+			               "thread %d\n",
+			               STRORDASH(pxy_conn_srchost(ctx)),
+			               STRORDASH(pxy_conn_srcport(ctx)),
+			               ctx->thridx);
+		}
+		return;
+	}
+	ctx->handoff = 1;
+	ctx->ev = evtimer_new(ctx->evbase, pxy_conn_step_cb, ctx);
+	if (!ctx->ev) {
+		ctx->enomem = 1;
+		return;
+	}
+	(void)event_priority_set(ctx->ev, PXY_PRIO_ESTAB);
+	ctx->step = PXY_STEP_HANDOFF;
+	tv.tv_sec = 0;
+	tv.tv_usec = 1000L << ctx->handoff_tries;
+	evtimer_add(ctx->ev, &tv);
+}
+
+/*
+ * Account the octets forwarded by a connection since the previous round and
+ * keep the busiest connections that can be moved as candidates, ordered by
+ * descending octets.  Called with the registry of the thread locked.
+ */
+static void
+pxy_conn_rebalance_scan(void *obj, void *arg)
+{
+	pxy_conn_ctx_t *ctx = obj;
+	pxy_rebalance_job_t *job = arg;
+	unsigned long long bytes, delta;
+	size_t i;
+
+	bytes = ctx->srcbytes + ctx->dstbytes;
+	delta = bytes - ctx->rebal_bytes;
+	ctx->rebal_bytes = bytes;
+	job->total += delta;
+	if (!delta || !pxy_conn_migratable(ctx))
+		return;
+	if (job->ncand == PXY_REBALANCE_MAX &&
+	    delta <= job->delta[PXY_REBALANCE_MAX - 1])
+		return;
+	if (job->ncand < PXY_REBALANCE_MAX)
+		job->ncand++;
+	for (i = job->ncand - 1; i > 0 && job->delta[i - 1] < delta; i--) {
+		job->cand[i] = job->cand[i - 1];
+		job->delta[i] = job->delta[i - 1];
+	}
+	job->cand[i] = ctx;
+	job->delta[i] = delta;
+}
+
+/*
+ * Rebalancing round of a single thread, on that thread.
+ */
+static void
+pxy_conn_rebalance_thr_cb(UNUSED evutil_socket_t fd, UNUSED short what,
+                          void *arg)
+{
+	pxy_rebalance_job_t *job = arg;
+	unsigned long long budget;
+	size_t excess;
+	int to;
+
+	/* candidates stay valid, connections are only freed on this thread */
+	pxy_thrmgr_conn_foreach(job->thrmgr, job->thridx,
+	                        pxy_conn_rebalance_scan, job);
+	pxy_thrmgr_set_rate(job->thrmgr, job->thridx,
+	                    job->total / job->interval);
+	to = pxy_thrmgr_rebalance_target(job->thrmgr, job->thridx, &excess);
+	budget = (unsigned long long)excess * job->interval;
+	for (size_t i = 0; to != -1 && i < job->ncand && budget > 0; i++) {
+		if (job->delta[i] > budget)
+			continue;
+		if (pxy_conn_migrate(job->cand[i], to) == 0)
+			budget -= job->delta[i];
+	}
+	free(job);
+}
+
+/*
+ * Run a rebalancing round for RebalanceInterval on all connection handling
+ * threads, interval seconds after the previous one.
+ */
+void
+pxy_conn_rebalance(pxy_thrmgr_ctx_t *thrmgr, unsigned int interval)
+{
+	pxy_rebalance_job_t *job;
+	int nthr = pxy_thrmgr_num_thr(thrmgr);
+
+	for (int i = 0; i < nthr; i++) {
+		if (!(job = malloc(sizeof(pxy_rebalance_job_t))))
+			return;
+		memset(job, 0, sizeof(pxy_rebalance_job_t));
+		job->thrmgr = thrmgr;
+		job->thridx = i;
+		job->interval = interval ? interval : 1;
+		if (event_base_once(pxy_thrmgr_get_evbase(thrmgr, i), -1,
+		                    EV_TIMEOUT, pxy_conn_rebalance_thr_cb, job,
+		                    NULL) == -1)
+			free(job);
+	}
+}
+
+/*
+ * Connection table for the stats socket.  Every connection handling thread
+ * formats the connections in its own registry on its own event loop, where
+ * the connection contexts are consistent, and the last thread to finish
+ * hands the table back to the event base of the requestor.  The event loops
+ * are never stopped or blocked beyond formatting their own connections.
+ */
+typedef struct pxy_conn_table {
+	struct event_base *evbase;
+	struct evbuffer **thr;          /* table rows per thread */
+	int nthr;
+	int pending;                    /* threads not done yet, plus one */
+	long long now;
+	void (*cb)(struct evbuffer *, void *);
+	void *arg;
+	struct pxy_conn_table_job {
+		struct pxy_conn_table *tab;
+		pxy_thrmgr_ctx_t *thrmgr;
+		int thridx;
+	} *job;
+} pxy_conn_table_t;
+
+/*
+ * Return a short description of the state of the connection.
+ */
+static const char *
+pxy_conn_state(pxy_conn_ctx_t *ctx)
+{
+	if (ctx->src.closed || ctx->dst.closed)
+		return "closing";
+	if (ctx->dnswait || ctx->step == PXY_STEP_RESOLVE)
+		return "resolving";
+	if (ctx->forging)
+		return "forging";
+	if (!ctx->connected)
+		return ctx->dst_tcp ? "handshake" : "connecting";
+	if (ctx->accepting)
+		return "handshake";
+	if (ctx->passthrough)
+		return "passthrough";
+	if (ctx->dormant)
+		return "dormant";
+	return "established";
+}
+
+/*
+ * Return the number of octets buffered for the connection and not yet
+ * forwarded, in either direction.
+ */
+static size_t
+pxy_conn_buffered(pxy_conn_ctx_t *ctx)
+{
+	struct bufferevent *bev[2] = {ctx->src.bev, ctx->dst.bev};
+	size_t sz = ctx->chlen;
+
+	for (int i = 0; i < 2; i++) {
+		if (!bev[i])
+			continue;
+		sz += evbuffer_get_length(bufferevent_get_input(bev[i]));
+		sz += evbuffer_get_length(bufferevent_get_output(bev[i]));
+	}
+	if (ctx->earlybuf)
+		sz += evbuffer_get_length(ctx->earlybuf);
+#ifdef HAVE_SPLICE
+	if (ctx->splice)
+		sz += ctx->splice[0].inpipe + ctx->splice[1].inpipe;
+#endif /* HAVE_SPLICE */
+#ifdef HAVE_IOURING
+	if (ctx->uring) {
+		for (int i = 0; i < 2; i++)
+			sz += ctx->uring->dir[i].len - ctx->uring->dir[i].off;
+	}
+#endif /* HAVE_IOURING */
+	return sz;
+}
+
+/*
+ * Append a table row for connection obj to the rows of its thread.
+ */
+static void
+pxy_conn_table_row(void *obj, void *arg)
+{
+	pxy_conn_ctx_t *ctx = obj;
+	struct pxy_conn_table_job *job = arg;
+	char src[INET6_ADDRSTRLEN + 9], dst[INET6_ADDRSTRLEN + 9];
+
+	if (pxy_conn_srchost(ctx))
+		snprintf(src, sizeof(src), "[%s]:%s", pxy_conn_srchost(ctx),
+		         pxy_conn_srcport(ctx));
+	else
+		strcpy(src, "-");
+	if (pxy_conn_dsthost(ctx))
+		snprintf(dst, sizeof(dst), "[%s]:%s", pxy_conn_dsthost(ctx),
+		         pxy_conn_dstport(ctx));
+	else
+		strcpy(dst, "-");
+	evbuffer_add_printf(job->tab->thr[job->thridx],
+	                    "%d %lld %s %s %s %s %llu %llu %zu\n",
+	                    ctx->thridx,
+	                    (job->tab->now - ctx->setup_usec) / 1000,
+	                    pxy_conn_state(ctx), src, dst,
+	                    ctx->sni ? ctx->sni : "-",
+	                    ctx->srcbytes, ctx->dstbytes,
+	                    pxy_conn_buffered(ctx));
+}
+
+/*
+ * All threads are done; hand the table over to the requestor.
+ */
+static void
+pxy_conn_table_done_cb(UNUSED evutil_socket_t fd, UNUSED short what,
+                       void *arg)
+{
+	pxy_conn_table_t *tab = arg;
+	struct evbuffer *buf;
+
+	if ((buf = evbuffer_new())) {
+		evbuffer_add_printf(buf, "# thread age_ms state src dst sni "
+		                         "src_bytes dst_bytes buffered\n");
+		for (int i = 0; i < tab->nthr; i++)
+			evbuffer_add_buffer(buf, tab->thr[i]);
+	}
+	tab->cb(buf, tab->arg);
+	if (buf)
+		evbuffer_free(buf);
+	for (int i = 0; i < tab->nthr; i++)
+		evbuffer_free(tab->thr[i]);
+	free(tab->thr);
+	free(tab->job);
+	free(tab);
+}
+
+static void
+pxy_conn_table_unref(pxy_conn_table_t *tab)
+{
+	if (__atomic_sub_fetch(&tab->pending, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+	if (event_base_once(tab->evbase, -1, EV_TIMEOUT,
+	                    pxy_conn_table_done_cb, tab, NULL) == -1) {
+		log_err_printf("Error handing over connection table\n");
+	}
+}
+
+/*
+ * Format the connections of one thread, on that thread.
+ */
+static void
+pxy_conn_table_thr_cb(UNUSED evutil_socket_t fd, UNUSED short what,
+                      void *arg)
+{
+	struct pxy_conn_table_job *job = arg;
+
+	pxy_thrmgr_conn_foreach(job->thrmgr, job->thridx,
+	                        pxy_conn_table_row, job);
+	pxy_conn_table_unref(job->tab);
+}
+
+/*
+ * Collect the active connections of all connection handling threads, one
+ * row per connection, and call cb with the table and arg on evbase once
+ * complete.  cb gets NULL on out of memory condition; the table is freed
+ * after cb returns.
+ * Returns 0 if cb will be called, -1 on failure.
+ */
+int
+pxy_conn_table(pxy_thrmgr_ctx_t *thrmgr, struct event_base *evbase,
+               void (*cb)(struct evbuffer *, void *), void *arg)
+{
+	pxy_conn_table_t *tab;
+
+	if (!(tab = malloc(sizeof(pxy_conn_table_t))))
+		return -1;
+	memset(tab, 0, sizeof(pxy_conn_table_t));
+	tab->evbase = evbase;
+	tab->nthr = pxy_thrmgr_num_thr(thrmgr);
+	tab->now = stats_usec();
+	tab->cb = cb;
+	tab->arg = arg;
+	if (!(tab->thr = calloc(tab->nthr, sizeof(struct evbuffer *))) ||
+	    !(tab->job = calloc(tab->nthr, sizeof(struct pxy_conn_table_job))))
+		goto errout;
+	for (int i = 0; i < tab->nthr; i++) {
+		if (!(tab->thr[i] = evbuffer_new()))
+			goto errout;
+	}
+	tab->pending = tab->nthr + 1;
+	for (int i = 0; i < tab->nthr; i++) {
+		tab->job[i].tab = tab;
+		tab->job[i].thrmgr = thrmgr;
+		tab->job[i].thridx = i;
+		if (event_base_once(pxy_thrmgr_get_evbase(thrmgr, i), -1,
+		                    EV_TIMEOUT, pxy_conn_table_thr_cb,
+		                    &tab->job[i], NULL) == -1) {
+			evbuffer_add_printf(tab->thr[i], "# thread %d "
+			                    "unavailable\n", i);
+			pxy_conn_table_unref(tab);
+		}
+	}
+	pxy_conn_table_unref(tab);
+	return 0;
+
+errout:
+	for (int i = 0; tab->thr && i < tab->nthr; i++) {
+		if (tab->thr[i])
+			evbuffer_free(tab->thr[i]);
+	}
+	free(tab->thr);
+	free(tab->job);
+	free(tab);
+	return -1;
+}
+
 /* vim: set noet ft=c: */
@@ -37,11 +37,21 @@
 #include <sys/socket.h>
 
 #include <event2/event.h>
+#include <event2/buffer.h>
 #include <event2/util.h>
 
 void pxy_conn_setup(evutil_socket_t, struct sockaddr *, int,
-                    pxy_thrmgr_ctx_t *, proxyspec_t *, opts_t *)
-                    NONNULL(2,4,5,6);
+                    pxy_thrmgr_ctx_t *, int, proxyspec_t *, opts_t *)
+                    NONNULL(2,4,6,7);
+void pxy_conn_setup_peeked(evutil_socket_t, struct sockaddr *, int,
+                           pxy_thrmgr_ctx_t *, int, proxyspec_t *, opts_t *,
+                           unsigned char *, size_t, size_t) NONNULL(2,4,6,7);
+SSL_CTX * pxy_dstsslctx_new(opts_t *) NONNULL(1) MALLOC;
+void pxy_http_hdrs_setup(proxyspec_t *, opts_t *) NONNULL(1,2);
+void pxy_conn_rebalance(pxy_thrmgr_ctx_t *, unsigned int) NONNULL(1);
+int pxy_conn_table(pxy_thrmgr_ctx_t *, struct event_base *,
+                   void (*)(struct evbuffer *, void *), void *)
+                   NONNULL(1,2,3) WUNRES;
 
 #endif /* !PXYCONN_H */
 
@@ -0,0 +1,351 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "pxyconnpool.h"
+
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <event2/event_struct.h>
+
+/*
+ * Upstream pre-connect pool: keeps a number of idle TCP connections to a
+ * static destination established ahead of time, so that new connections from
+ * clients can skip the connect round trip to the server.  One pool exists per
+ * static proxyspec and connection handling thread, and all its events run on
+ * the event base of that thread.
+ *
+ * Sockets are handed out by pxy_connpool_get(), which may be called from any
+ * thread and is protected by the pool mutex.  Taking a socket removes its
+ * event without waiting for a concurrently running callback; callbacks check
+ * the state of their slot under the mutex and ignore slots that have been
+ * taken in the meantime.  Slots are only ever refilled from the event loop
+ * of the owning thread.
+ *
+ * Idle connections are watched for readability; if the server closes one or
+ * sends data on it, or it has been idle for PXY_CONNPOOL_IDLE_TIMEOUT, it is
+ * replaced with a fresh connection.  If connecting fails, refilling backs off
+ * exponentially up to PXY_CONNPOOL_BACKOFF_MAX seconds.
+ */
+
+#define PXY_CONNPOOL_CONNECT_TIMEOUT	10
+#define PXY_CONNPOOL_IDLE_TIMEOUT	30
+#define PXY_CONNPOOL_BACKOFF_MAX	32
+
+#define PXY_CONNPOOL_FREE		0
+#define PXY_CONNPOOL_CONNECTING		1
+#define PXY_CONNPOOL_IDLE		2
+
+typedef struct pxy_connpool_ent {
+	pxy_connpool_t *pool;
+	struct event ev;
+	evutil_socket_t fd;
+	int state;
+} pxy_connpool_ent_t;
+
+struct pxy_connpool {
+	pthread_mutex_t mutex;
+	struct event_base *evbase;
+	struct event *refill_ev;
+	struct event *retry_ev;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	unsigned int backoff;
+	size_t size;
+	pxy_connpool_ent_t ent[];
+};
+
+static void pxy_connpool_ent_cb(evutil_socket_t, short, void *);
+
+/*
+ * Start a non-blocking connect on a free slot.  Must be called with the pool
+ * mutex held, from the owning thread.
+ * Returns -1 on failure, 0 on success.
+ */
+static int
+pxy_connpool_connect(pxy_connpool_t *pool, pxy_connpool_ent_t *ent)
+{
+	struct timeval tv = {PXY_CONNPOOL_CONNECT_TIMEOUT, 0};
+	evutil_socket_t fd;
+	int err;
+
+	fd = socket(pool->addr.ss_family, SOCK_STREAM, 0);
+	if (fd == -1)
+		return -1;
+	if (evutil_make_socket_nonblocking(fd) == -1 ||
+	    evutil_make_socket_closeonexec(fd) == -1)
+		goto errout;
+	if (connect(fd, (struct sockaddr *)&pool->addr, pool->addrlen) == -1) {
+		if (errno != EINPROGRESS)
+			goto errout;
+		ent->state = PXY_CONNPOOL_CONNECTING;
+		event_assign(&ent->ev, pool->evbase, fd, EV_WRITE,
+		             pxy_connpool_ent_cb, ent);
+	} else {
+		tv.tv_sec = PXY_CONNPOOL_IDLE_TIMEOUT;
+		ent->state = PXY_CONNPOOL_IDLE;
+		event_assign(&ent->ev, pool->evbase, fd, EV_READ,
+		             pxy_connpool_ent_cb, ent);
+	}
+	ent->fd = fd;
+	event_add(&ent->ev, &tv);
+	return 0;
+
+errout:
+	err = errno;
+	evutil_closesocket(fd);
+	errno = err;
+	return -1;
+}
+
+/*
+ * Back off refilling after a failed connect.  The backoff period is doubled
+ * and the error logged once per retry round, not once per failed slot.
+ * Must be called with the pool mutex held.
+ */
+static void
+pxy_connpool_backoff(pxy_connpool_t *pool, int err)
+{
+	struct timeval tv = {0, 0};
+
+	if (evtimer_pending(pool->retry_ev, NULL))
+		return;
+	log_err_printf("Error pre-connecting upstream: %s (%i)\n",
+	               strerror(err), err);
+	if (!pool->backoff) {
+		pool->backoff = 1;
+	} else if (pool->backoff < PXY_CONNPOOL_BACKOFF_MAX) {
+		pool->backoff *= 2;
+	}
+	tv.tv_sec = pool->backoff;
+	evtimer_add(pool->retry_ev, &tv);
+}
+
+/*
+ * Connect all free slots.  Must be called with the pool mutex held, from the
+ * owning thread.
+ */
+static void
+pxy_connpool_refill(pxy_connpool_t *pool)
+{
+	for (size_t i = 0; i < pool->size; i++) {
+		if (pool->ent[i].state != PXY_CONNPOOL_FREE)
+			continue;
+		if (pxy_connpool_connect(pool, &pool->ent[i]) == -1) {
+			pxy_connpool_backoff(pool, errno);
+			return;
+		}
+	}
+}
+
+/*
+ * Release the connection in a slot and mark the slot free.
+ * Must be called with the pool mutex held.
+ */
+static void
+pxy_connpool_ent_close(pxy_connpool_ent_t *ent)
+{
+	event_del(&ent->ev);
+	evutil_closesocket(ent->fd);
+	ent->fd = -1;
+	ent->state = PXY_CONNPOOL_FREE;
+}
+
+/*
+ * Connect completed, or an idle connection became readable or timed out.
+ */
+static void
+pxy_connpool_ent_cb(evutil_socket_t fd, short what, void *arg)
+{
+	pxy_connpool_ent_t *ent = arg;
+	pxy_connpool_t *pool = ent->pool;
+	struct timeval tv = {PXY_CONNPOOL_IDLE_TIMEOUT, 0};
+	socklen_t errlen;
+	int err;
+
+	pthread_mutex_lock(&pool->mutex);
+	if (ent->fd != fd || ent->state == PXY_CONNPOOL_FREE) {
+		/* taken by pxy_connpool_get() while we were waiting */
+		goto out;
+	}
+	if (ent->state == PXY_CONNPOOL_IDLE) {
+		/* closed by server, unexpected data or idle for too long */
+		pxy_connpool_ent_close(ent);
+		if (!pool->backoff)
+			pxy_connpool_refill(pool);
+		goto out;
+	}
+
+	/* connecting */
+	err = ETIMEDOUT;
+	errlen = sizeof(err);
+	if (!(what & EV_TIMEOUT) &&
+	    getsockopt(fd, SOL_SOCKET, SO_ERROR, (void *)&err, &errlen) == -1)
+		err = errno;
+	if (err) {
+		pxy_connpool_ent_close(ent);
+		pxy_connpool_backoff(pool, err);
+		goto out;
+	}
+	ent->state = PXY_CONNPOOL_IDLE;
+	event_assign(&ent->ev, pool->evbase, fd, EV_READ,
+	             pxy_connpool_ent_cb, ent);
+	event_add(&ent->ev, &tv);
+	if (pool->backoff) {
+		/* server is back, fill the remaining slots */
+		pool->backoff = 0;
+		evtimer_del(pool->retry_ev);
+		pxy_connpool_refill(pool);
+	}
+out:
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/*
+ * Refill event, activated by pxy_connpool_get() after taking a socket, and
+ * retry timer at the end of a backoff period.
+ */
+static void
+pxy_connpool_refill_cb(UNUSED evutil_socket_t fd, UNUSED short what,
+                       void *arg)
+{
+	pxy_connpool_t *pool = arg;
+
+	pthread_mutex_lock(&pool->mutex);
+	if (!pool->backoff)
+		pxy_connpool_refill(pool);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+static void
+pxy_connpool_retry_cb(UNUSED evutil_socket_t fd, UNUSED short what,
+                      void *arg)
+{
+	pxy_connpool_t *pool = arg;
+
+	pthread_mutex_lock(&pool->mutex);
+	pxy_connpool_refill(pool);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/*
+ * Create a pre-connect pool of size connections to addr on evbase and start
+ * connecting.  Must be called from the thread running evbase.
+ * Returns NULL on failure.
+ */
+pxy_connpool_t *
+pxy_connpool_new(struct event_base *evbase, const struct sockaddr *addr,
+                 socklen_t addrlen, size_t size)
+{
+	pxy_connpool_t *pool;
+
+	if (addrlen > sizeof(pool->addr))
+		return NULL;
+	pool = malloc(sizeof(pxy_connpool_t) +
+	              size * sizeof(pxy_connpool_ent_t));
+	if (!pool)
+		return NULL;
+	memset(pool, 0, sizeof(pxy_connpool_t) +
+	                size * sizeof(pxy_connpool_ent_t));
+	pool->refill_ev = event_new(evbase, -1, 0, pxy_connpool_refill_cb,
+	                            pool);
+	pool->retry_ev = evtimer_new(evbase, pxy_connpool_retry_cb, pool);
+	if (!pool->refill_ev || !pool->retry_ev) {
+		if (pool->refill_ev)
+			event_free(pool->refill_ev);
+		if (pool->retry_ev)
+			event_free(pool->retry_ev);
+		free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->mutex, NULL);
+	pool->evbase = evbase;
+	memcpy(&pool->addr, addr, addrlen);
+	pool->addrlen = addrlen;
+	pool->size = size;
+	for (size_t i = 0; i < size; i++) {
+		pool->ent[i].pool = pool;
+		pool->ent[i].fd = -1;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	pxy_connpool_refill(pool);
+	pthread_mutex_unlock(&pool->mutex);
+	return pool;
+}
+
+/*
+ * Close all pooled connections and free the pool.  The event loop of the
+ * owning thread must not be running anymore.
+ */
+void
+pxy_connpool_free(pxy_connpool_t *pool)
+{
+	for (size_t i = 0; i < pool->size; i++) {
+		if (pool->ent[i].state != PXY_CONNPOOL_FREE)
+			pxy_connpool_ent_close(&pool->ent[i]);
+	}
+	event_free(pool->refill_ev);
+	event_free(pool->retry_ev);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool);
+}
+
+/*
+ * Take an established connection out of the pool and trigger refilling the
+ * slot.  The caller owns the returned socket, which is non-blocking.
+ * Thread-safe.  Returns -1 if no established connection is available.
+ */
+evutil_socket_t
+pxy_connpool_get(pxy_connpool_t *pool)
+{
+	evutil_socket_t fd = -1;
+
+	pthread_mutex_lock(&pool->mutex);
+	for (size_t i = 0; i < pool->size; i++) {
+		pxy_connpool_ent_t *ent = &pool->ent[i];
+		if (ent->state != PXY_CONNPOOL_IDLE)
+			continue;
+		event_del_noblock(&ent->ev);
+		fd = ent->fd;
+		ent->fd = -1;
+		ent->state = PXY_CONNPOOL_FREE;
+		event_active(pool->refill_ev, EV_WRITE, 0);
+		break;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return fd;
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,168 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "pxyconnpool.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <check.h>
+
+#include <event2/thread.h>
+
+static struct event_base *evbase;
+static struct sockaddr_in addr;
+static evutil_socket_t lfd;
+
+static void
+pxyconnpool_setup(void)
+{
+	socklen_t addrlen = sizeof(addr);
+
+	evthread_use_pthreads();
+	evbase = event_base_new();
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (!evbase || lfd == -1)
+		exit(EXIT_FAILURE);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+	    listen(lfd, 16) == -1 ||
+	    getsockname(lfd, (struct sockaddr *)&addr, &addrlen) == -1)
+		exit(EXIT_FAILURE);
+}
+
+static void
+pxyconnpool_teardown(void)
+{
+	evutil_closesocket(lfd);
+	event_base_free(evbase);
+}
+
+/*
+ * Run the event loop until a connection can be taken from the pool, for at
+ * most about one second.
+ */
+static evutil_socket_t
+pxyconnpool_wait_get(pxy_connpool_t *pool)
+{
+	evutil_socket_t fd;
+
+	for (int i = 0; i < 100; i++) {
+		event_base_loop(evbase, EVLOOP_NONBLOCK);
+		if ((fd = pxy_connpool_get(pool)) != -1)
+			return fd;
+		usleep(10000);
+	}
+	return -1;
+}
+
+START_TEST(pxyconnpool_01)
+{
+	pxy_connpool_t *pool;
+	struct sockaddr_in peer;
+	socklen_t peerlen = sizeof(peer);
+	evutil_socket_t fd;
+
+	pool = pxy_connpool_new(evbase, (struct sockaddr *)&addr,
+	                        sizeof(addr), 1);
+	fail_unless(!!pool, "pool not created");
+	fd = pxyconnpool_wait_get(pool);
+	fail_unless(fd != -1, "no connection established");
+	fail_unless(getpeername(fd, (struct sockaddr *)&peer, &peerlen) == 0,
+	            "connection not connected");
+	fail_unless(peer.sin_port == addr.sin_port, "wrong destination");
+	fail_unless(pxy_connpool_get(pool) == -1, "slot handed out twice");
+	evutil_closesocket(fd);
+	pxy_connpool_free(pool);
+}
+END_TEST
+
+START_TEST(pxyconnpool_02)
+{
+	pxy_connpool_t *pool;
+	evutil_socket_t fd1, fd2;
+
+	pool = pxy_connpool_new(evbase, (struct sockaddr *)&addr,
+	                        sizeof(addr), 1);
+	fail_unless(!!pool, "pool not created");
+	fd1 = pxyconnpool_wait_get(pool);
+	fail_unless(fd1 != -1, "no connection established");
+	fd2 = pxyconnpool_wait_get(pool);
+	fail_unless(fd2 != -1, "slot not refilled");
+	fail_unless(fd1 != fd2, "same socket handed out twice");
+	evutil_closesocket(fd1);
+	evutil_closesocket(fd2);
+	pxy_connpool_free(pool);
+}
+END_TEST
+
+START_TEST(pxyconnpool_03)
+{
+	pxy_connpool_t *pool;
+	evutil_socket_t fd;
+
+	/* nothing listening on the port anymore */
+	evutil_closesocket(lfd);
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	pool = pxy_connpool_new(evbase, (struct sockaddr *)&addr,
+	                        sizeof(addr), 2);
+	fail_unless(!!pool, "pool not created");
+	for (int i = 0; i < 10; i++) {
+		event_base_loop(evbase, EVLOOP_NONBLOCK);
+		usleep(10000);
+	}
+	fd = pxy_connpool_get(pool);
+	fail_unless(fd == -1, "refused connection handed out");
+	pxy_connpool_free(pool);
+}
+END_TEST
+
+Suite *
+pxyconnpool_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("pxyconnpool");
+
+	tc = tcase_create("pxyconnpool");
+	tcase_add_checked_fixture(tc, pxyconnpool_setup, pxyconnpool_teardown);
+	tcase_add_test(tc, pxyconnpool_01);
+	tcase_add_test(tc, pxyconnpool_02);
+	tcase_add_test(tc, pxyconnpool_03);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,986 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "pxyforge.h"
+
+#include "cachemgr.h"
+#include "thrqueue.h"
+#include "ssl.h"
+#include "log.h"
+#include "khash.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+/*
+ * Certificate forging thread pool: takes forging of leaf certificates off
+ * the connection handling threads, so that a certificate cache miss does not
+ * block all other connections on the same event base for the duration of a
+ * signature operation.  Jobs are submitted from a connection handling thread
+ * and queued to ForgeThreads forging threads.  Once a certificate has been
+ * forged, the completion callback is scheduled on the event base of the
+ * submitting thread using event_base_once(), which requires libevent
+ * threading support to be enabled.
+ *
+ * Forges are single-flight: while a certificate for a given original server
+ * certificate is being forged, further jobs for the same certificate (by
+ * SHA-1 fingerprint) do not queue another forge but are added as waiters to
+ * the forge in flight, and all waiters are notified of the same result on
+ * their respective event bases.  The forged certificate is inserted into the
+ * forged certificate cache and the persistent store once per flight by the
+ * forging thread, before any waiter is notified.  The RSA and ECDSA variants
+ * of a certificate are forged in separate flights; only RSA certificates are
+ * persisted to the store.  With RemoteCache, each flight first looks up the
+ * certificate in the remote tier, blocking the forging thread instead of the
+ * connection handling threads while waiting for the remote servers.  With
+ * LeafKeyPool, RSA certificates are forged with a key of their own from the
+ * key pool, attached to the certificate.
+ *
+ * Each flight forges with the CA and leaf keys of the configuration it was
+ * submitted with, and holds a reference to it.  Configurations differing in
+ * CA or leaf keys after a reload carry different forged certificate cache
+ * epochs, which are part of the flight key, such that connections never join
+ * a flight forging for another CA.
+ *
+ * A job may be cancelled from the submitting thread until its completion
+ * callback has run; since both happen on the same event base, no locking is
+ * required.  The job is always freed by the pool.
+ *
+ * With PreforgeHosts, the pool also tracks the most frequently used forged
+ * certificates in a table of PreforgeHosts entries, and pxy_forge_prewarm()
+ * re-forges those that are about to expire, so that popular sites never hit
+ * the synchronous slow path.  Hit counts are halved on every pre-warm round
+ * such that the table follows recent traffic.  Uses are first counted in a
+ * small table private to the handshaking thread, which is merged into the
+ * shared table when it fills up and before every pre-warm round, such that
+ * handshakes do not contend on the shared table.  Once the shared table has
+ * grown an eighth beyond PreforgeHosts, the least used entries are evicted
+ * in one go.
+ *
+ * With OCSPStapling, the forging threads also sign the OCSP responses stapled
+ * to forged certificates: right after forging, and when a handshake finds the
+ * response missing or due for renewal, see pxy_forge_staple_submit().  Such
+ * staple flights have no waiters and are keyed by the forged certificate.
+ *
+ * With ForgeStealing, flights queued while all forging threads are busy are
+ * also offered to the connection handling threads: the thread manager is
+ * notified through the steal callback and lets idle connection handling
+ * threads run queued flights with pxy_forge_steal().  Waiters are notified
+ * on their own event bases as usual, regardless of which thread forged.
+ */
+
+#define PXY_FORGE_QUEUE_SIZE 1024
+
+typedef struct pxy_forge_flight pxy_forge_flight_t;
+
+/* a single submitter waiting for a forge */
+struct pxy_forge_job {
+	struct event_base *evbase;
+	X509 *crt;
+	pxy_forge_cb_t cb;
+	void *arg;
+	pxy_forge_job_t *next;
+};
+
+typedef struct {
+	unsigned char fpr[SSL_X509_FPRSZ];
+	int ecdsa;
+	unsigned int epoch;
+	int staple;
+} pxy_forge_fpr_t;
+
+/* a forge in flight, with all jobs waiting for it */
+struct pxy_forge_flight {
+	pxy_forge_fpr_t key;
+	opts_t *opts;
+	X509 *origcrt;          /* forged certificate for staple flights */
+	pxy_forge_job_t *waiters;
+};
+
+static inline khint_t
+kh_pxy_forge_fpr_hash_func(pxy_forge_fpr_t k)
+{
+	khint_t h;
+
+	/* assumes fpr is uniformly distributed */
+	memcpy(&h, k.fpr, sizeof(h));
+	return h;
+}
+
+#define kh_pxy_forge_fpr_hash_equal(a, b) \
+        (memcmp((a).fpr, (b).fpr, SSL_X509_FPRSZ) == 0 && \
+         (a).ecdsa == (b).ecdsa && (a).epoch == (b).epoch && \
+         (a).staple == (b).staple)
+
+KHASH_INIT(flightmap_t, pxy_forge_fpr_t, pxy_forge_flight_t *, 1,
+           kh_pxy_forge_fpr_hash_func, kh_pxy_forge_fpr_hash_equal)
+
+/* a frequently used certificate tracked for pre-warming */
+typedef struct pxy_forge_hot {
+	pxy_forge_fpr_t key;
+	X509 *origcrt;
+	time_t expiry;          /* notAfter of forged cert, 0 while re-forging */
+	unsigned int hits;
+} pxy_forge_hot_t;
+
+KHASH_INIT(hotmap_t, pxy_forge_fpr_t, pxy_forge_hot_t *, 1,
+           kh_pxy_forge_fpr_hash_func, kh_pxy_forge_fpr_hash_equal)
+
+/* uses of certificates counted by one thread since the last merge */
+#define PXY_FORGE_HOT_LOCAL 64
+typedef struct pxy_forge_use {
+	pxy_forge_fpr_t key;
+	X509 *origcrt;
+	time_t expiry;
+	unsigned int hits;
+} pxy_forge_use_t;
+
+typedef struct pxy_forge_local {
+	struct pxy_forge_local *next;
+	pthread_mutex_t mutex;  /* only contended while pre-warming */
+	size_t n;
+	pxy_forge_use_t use[PXY_FORGE_HOT_LOCAL];
+} pxy_forge_local_t;
+
+struct pxy_forge_ctx {
+	int num_thr;
+	int busy;
+	int stopping;
+	opts_t *opts;
+	keypool_t *keypool;
+	pthread_t *thr;
+	thrqueue_t *queue;
+	pthread_mutex_t mutex;
+	khash_t(flightmap_t) *flights;
+	pthread_mutex_t hotmutex;
+	khash_t(hotmap_t) *hot;
+	unsigned int maxhot;
+	pthread_key_t localkey;
+	pxy_forge_local_t *locals;  /* all threads, under hotmutex */
+	pxy_forge_steal_cb_t stealcb;
+	void *stealarg;
+};
+
+static void
+pxy_forge_job_free(pxy_forge_job_t *job)
+{
+	if (job->crt)
+		X509_free(job->crt);
+	free(job);
+}
+
+static void
+pxy_forge_flight_free(pxy_forge_flight_t *flight)
+{
+	pxy_forge_job_t *job;
+
+	while ((job = flight->waiters)) {
+		flight->waiters = job->next;
+		pxy_forge_job_free(job);
+	}
+	if (flight->opts)
+		opts_unref(flight->opts);
+	X509_free(flight->origcrt);
+	free(flight);
+}
+
+/*
+ * Completion callback, runs on the event base of the submitting thread.
+ */
+static void
+pxy_forge_done_cb(UNUSED evutil_socket_t fd, UNUSED short what, void *arg)
+{
+	pxy_forge_job_t *job = arg;
+
+	if (job->cb) {
+		job->cb(job->crt, job->arg);
+		job->crt = NULL;
+	}
+	pxy_forge_job_free(job);
+}
+
+/*
+ * Forge the certificate for a flight and notify all waiters.  Joining the
+ * flight is no longer possible once it has been removed from the map; jobs
+ * submitted after that start a new flight.
+ */
+static void
+pxy_forge_flight_run(pxy_forge_ctx_t *ctx, pxy_forge_flight_t *flight)
+{
+	opts_t *opts = flight->opts;
+	pxy_forge_job_t *job, *waiters;
+	khiter_t it;
+	X509 *crt;
+
+	if (flight->key.staple) {
+		pxy_forge_staple(opts, flight->origcrt, flight->key.ecdsa);
+		crt = NULL;
+		goto notify;
+	}
+	if (cachemgr_rcache) {
+		/* inserts into the local and shared tiers itself */
+		crt = flight->key.ecdsa ?
+		      cachemgr_fkcrt_remote_get(flight->origcrt, 1,
+		                                opts->eccacrt, opts->ecleafkey,
+		                                opts->fkcrt_epoch) :
+		      cachemgr_fkcrt_remote_get(flight->origcrt, 0,
+		                                opts->cacrt, opts->leafkey,
+		                                opts->fkcrt_epoch);
+		if (crt)
+			goto notify;
+	}
+	if (flight->key.ecdsa) {
+		crt = pxy_forge_crt(opts, flight->origcrt, 1, NULL, NULL);
+	} else if (ctx->keypool) {
+		EVP_PKEY *key;
+
+		if ((key = keypool_get(ctx->keypool))) {
+			crt = pxy_forge_crt(opts, flight->origcrt, 0, key,
+			                    NULL);
+			if (crt && ssl_x509_leafkey_set(crt, key) == -1) {
+				X509_free(crt);
+				crt = NULL;
+			}
+			EVP_PKEY_free(key);
+		} else {
+			crt = NULL;
+		}
+	} else {
+		crt = pxy_forge_crt(opts, flight->origcrt, 0, NULL, NULL);
+	}
+	if (crt) {
+		cachemgr_fkcrt_insert(flight->origcrt, crt, flight->key.ecdsa,
+		                      opts->fkcrt_epoch);
+	}
+	if (crt && !flight->key.ecdsa) {
+		if (cachemgr_fkstore &&
+		    certstore_put(cachemgr_fkstore, flight->origcrt,
+		                  crt) == -1) {
+			log_err_printf("Failed to append to certificate "
+			               "store\n");
+		}
+	}
+
+notify:
+	if (crt && opts->ocsp_staple)
+		pxy_forge_staple(opts, crt, flight->key.ecdsa);
+	pthread_mutex_lock(&ctx->mutex);
+	it = kh_get(flightmap_t, ctx->flights, flight->key);
+	if (it != kh_end(ctx->flights))
+		kh_del(flightmap_t, ctx->flights, it);
+	waiters = flight->waiters;
+	flight->waiters = NULL;
+	pthread_mutex_unlock(&ctx->mutex);
+
+	while ((job = waiters)) {
+		waiters = job->next;
+		if (crt) {
+			ssl_x509_refcount_inc(crt);
+			job->crt = crt;
+		}
+		if (event_base_once(job->evbase, -1, EV_TIMEOUT,
+		                    pxy_forge_done_cb, job, NULL) == -1) {
+			log_err_printf("Failed to schedule forged certificate "
+			               "completion\n");
+			pxy_forge_job_free(job);
+		}
+	}
+	if (crt)
+		X509_free(crt);
+	pxy_forge_flight_free(flight);
+}
+
+/*
+ * Thread entry point; forges certificates until the queue is unblocked.
+ */
+static void *
+pxy_forge_thr(void *arg)
+{
+	pxy_forge_ctx_t *ctx = arg;
+	pxy_forge_flight_t *flight;
+
+	while ((flight = thrqueue_dequeue(ctx->queue))) {
+		if (__atomic_load_n(&ctx->stopping, __ATOMIC_ACQUIRE)) {
+			/* freed with the flight map in pxy_forge_free() */
+			continue;
+		}
+		__atomic_add_fetch(&ctx->busy, 1, __ATOMIC_RELAXED);
+		pxy_forge_flight_run(ctx, flight);
+		__atomic_sub_fetch(&ctx->busy, 1, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+/*
+ * Notify the steal callback of a newly queued flight if all forging threads
+ * are busy, such that the flight would otherwise have to wait.
+ */
+static void
+pxy_forge_offer(pxy_forge_ctx_t *ctx)
+{
+	if (ctx->stealcb &&
+	    __atomic_load_n(&ctx->busy, __ATOMIC_RELAXED) >= ctx->num_thr)
+		ctx->stealcb(ctx->stealarg);
+}
+
+/*
+ * Create new forging thread pool but do not start any threads yet.
+ * Returns NULL on failure.
+ */
+pxy_forge_ctx_t *
+pxy_forge_new(opts_t *opts, keypool_t *keypool)
+{
+	pxy_forge_ctx_t *ctx;
+
+	if (!(ctx = malloc(sizeof(pxy_forge_ctx_t))))
+		return NULL;
+	memset(ctx, 0, sizeof(pxy_forge_ctx_t));
+	if (!(ctx->flights = kh_init(flightmap_t)))
+		goto out4;
+	if (!(ctx->hot = kh_init(hotmap_t)))
+		goto out3;
+	if (pthread_mutex_init(&ctx->mutex, NULL))
+		goto out2;
+	if (pthread_mutex_init(&ctx->hotmutex, NULL))
+		goto out1;
+	if (opts->preforge_hosts &&
+	    pthread_key_create(&ctx->localkey, NULL))
+		goto out0;
+	ctx->opts = opts_ref(opts);
+	ctx->keypool = keypool;
+	ctx->num_thr = opts->forge_threads;
+	ctx->maxhot = opts->preforge_hosts;
+	return ctx;
+
+out0:
+	pthread_mutex_destroy(&ctx->hotmutex);
+out1:
+	pthread_mutex_destroy(&ctx->mutex);
+out2:
+	kh_destroy(hotmap_t, ctx->hot);
+out3:
+	kh_destroy(flightmap_t, ctx->flights);
+out4:
+	free(ctx);
+	return NULL;
+}
+
+/*
+ * Start the forging threads.
+ * Returns -1 on failure, 0 on success.
+ */
+int
+pxy_forge_run(pxy_forge_ctx_t *ctx)
+{
+	int idx;
+
+	if (!(ctx->queue = thrqueue_new(PXY_FORGE_QUEUE_SIZE)))
+		return -1;
+	if (!(ctx->thr = malloc(ctx->num_thr * sizeof(pthread_t))))
+		goto leave;
+	for (idx = 0; idx < ctx->num_thr; idx++) {
+		if (pthread_create(&ctx->thr[idx], NULL, pxy_forge_thr, ctx))
+			goto leave_thr;
+	}
+	log_dbg_printf("Started %d certificate forging threads\n",
+	               ctx->num_thr);
+	return 0;
+
+leave_thr:
+	thrqueue_unblock_dequeue(ctx->queue);
+	while (--idx >= 0) {
+		pthread_join(ctx->thr[idx], NULL);
+	}
+	free(ctx->thr);
+	ctx->thr = NULL;
+leave:
+	thrqueue_free(ctx->queue);
+	ctx->queue = NULL;
+	return -1;
+}
+
+/*
+ * Stop all forging threads and free the pool.  Queued jobs are discarded
+ * without invoking their callbacks.  Must be called while the event bases
+ * that jobs were submitted from still exist.
+ */
+void
+pxy_forge_free(pxy_forge_ctx_t *ctx)
+{
+	if (ctx->thr) {
+		__atomic_store_n(&ctx->stopping, 1, __ATOMIC_RELEASE);
+		thrqueue_unblock_dequeue(ctx->queue);
+		for (int idx = 0; idx < ctx->num_thr; idx++) {
+			pthread_join(ctx->thr[idx], NULL);
+		}
+		free(ctx->thr);
+	}
+	if (ctx->queue) {
+		/* all queued flights are also in the flight map */
+		while (thrqueue_dequeue_nb(ctx->queue));
+		thrqueue_free(ctx->queue);
+	}
+	for (khiter_t it = kh_begin(ctx->flights);
+	     it != kh_end(ctx->flights); it++) {
+		if (kh_exist(ctx->flights, it))
+			pxy_forge_flight_free(kh_val(ctx->flights, it));
+	}
+	kh_destroy(flightmap_t, ctx->flights);
+	for (khiter_t it = kh_begin(ctx->hot); it != kh_end(ctx->hot); it++) {
+		if (kh_exist(ctx->hot, it)) {
+			X509_free(kh_val(ctx->hot, it)->origcrt);
+			free(kh_val(ctx->hot, it));
+		}
+	}
+	kh_destroy(hotmap_t, ctx->hot);
+	while (ctx->locals) {
+		pxy_forge_local_t *local = ctx->locals;
+
+		ctx->locals = local->next;
+		for (size_t i = 0; i < local->n; i++)
+			X509_free(local->use[i].origcrt);
+		pthread_mutex_destroy(&local->mutex);
+		free(local);
+	}
+	if (ctx->maxhot)
+		pthread_key_delete(ctx->localkey);
+	pthread_mutex_destroy(&ctx->hotmutex);
+	pthread_mutex_destroy(&ctx->mutex);
+	opts_unref(ctx->opts);
+	free(ctx);
+}
+
+/*
+ * Set the callback to notify when flights are queued while all forging
+ * threads are busy.  The callback is invoked on the submitting thread and
+ * should hand pxy_forge_steal() to an idle thread.  Must be called before
+ * any jobs are submitted.
+ */
+void
+pxy_forge_set_steal(pxy_forge_ctx_t *ctx, pxy_forge_steal_cb_t cb, void *arg)
+{
+	ctx->stealcb = cb;
+	ctx->stealarg = arg;
+}
+
+/*
+ * Run one queued flight on the calling thread instead of a forging thread.
+ * Returns 1 if a flight was run, 0 if the queue was empty.  Thread-safe.
+ */
+int
+pxy_forge_steal(pxy_forge_ctx_t *ctx)
+{
+	pxy_forge_flight_t *flight;
+
+	if (!ctx->queue || __atomic_load_n(&ctx->stopping, __ATOMIC_ACQUIRE))
+		return 0;
+	if (!(flight = thrqueue_dequeue_nb(ctx->queue)))
+		return 0;
+	pxy_forge_flight_run(ctx, flight);
+	return 1;
+}
+
+/*
+ * Replace the configuration used for pre-warming after a reload.  Must be
+ * called from the thread calling pxy_forge_prewarm().
+ */
+void
+pxy_forge_set_opts(pxy_forge_ctx_t *ctx, opts_t *opts)
+{
+	opts_ref(opts);
+	opts_unref(ctx->opts);
+	ctx->opts = opts;
+}
+
+/*
+ * Submit a job forging a certificate for origcrt, signed by the ECDSA CA of
+ * opts if ecdsa is non-zero and by its RSA CA otherwise.  When done, cb is
+ * called on evbase with the forged certificate and arg.  If a certificate
+ * for origcrt is already being forged with the same CA, the job waits for
+ * that forge instead.
+ * Returns the job, or NULL if the job could not be queued, in which case
+ * the caller should forge the certificate synchronously instead.
+ */
+pxy_forge_job_t *
+pxy_forge_submit(pxy_forge_ctx_t *ctx, opts_t *opts, struct event_base *evbase,
+                 X509 *origcrt, int ecdsa, pxy_forge_cb_t cb, void *arg)
+{
+	pxy_forge_flight_t *flight;
+	pxy_forge_job_t *job;
+	pxy_forge_fpr_t key;
+	khiter_t it;
+	int ret;
+
+	if (!ctx->queue)
+		return NULL;
+	memset(&key, 0, sizeof(key));
+	if (ssl_x509_fingerprint_sha1(origcrt, key.fpr) == -1)
+		return NULL;
+	key.ecdsa = !!ecdsa;
+	key.epoch = opts->fkcrt_epoch;
+	if (!(job = malloc(sizeof(pxy_forge_job_t))))
+		return NULL;
+	memset(job, 0, sizeof(pxy_forge_job_t));
+	job->evbase = evbase;
+	job->cb = cb;
+	job->arg = arg;
+
+	pthread_mutex_lock(&ctx->mutex);
+	it = kh_get(flightmap_t, ctx->flights, key);
+	if (it != kh_end(ctx->flights)) {
+		flight = kh_val(ctx->flights, it);
+		job->next = flight->waiters;
+		flight->waiters = job;
+		pthread_mutex_unlock(&ctx->mutex);
+		if (OPTS_DEBUG(opts)) {
+			log_dbg_printf("Certificate forge: joined in-flight "
+			               "forge\n");
+		}
+		return job;
+	}
+	if (!(flight = malloc(sizeof(pxy_forge_flight_t))))
+		goto errout;
+	memset(flight, 0, sizeof(pxy_forge_flight_t));
+	flight->key = key;
+	flight->opts = opts_ref(opts);
+	ssl_x509_refcount_inc(origcrt);
+	flight->origcrt = origcrt;
+	flight->waiters = job;
+	it = kh_put(flightmap_t, ctx->flights, key, &ret);
+	if (ret == -1) {
+		flight->waiters = NULL;
+		pxy_forge_flight_free(flight);
+		goto errout;
+	}
+	kh_val(ctx->flights, it) = flight;
+	if (!thrqueue_enqueue_nb(ctx->queue, flight)) {
+		kh_del(flightmap_t, ctx->flights, it);
+		flight->waiters = NULL;
+		pxy_forge_flight_free(flight);
+		goto errout;
+	}
+	pthread_mutex_unlock(&ctx->mutex);
+	pxy_forge_offer(ctx);
+	return job;
+
+errout:
+	pthread_mutex_unlock(&ctx->mutex);
+	free(job);
+	return NULL;
+}
+
+/*
+ * Cancel a job; its callback will not be invoked.  Must be called from the
+ * event base the job was submitted from, before its callback was invoked.
+ */
+void
+pxy_forge_cancel(pxy_forge_job_t *job)
+{
+	job->cb = NULL;
+}
+
+/*
+ * Return 1 if the forging queue is backlogged, 0 otherwise.  The queue counts
+ * as backlogged from three quarters full until it has drained to one quarter;
+ * was is the previous result for the caller, to provide hysteresis.
+ * Thread-safe.
+ */
+int
+pxy_forge_backlogged(pxy_forge_ctx_t *ctx, int was)
+{
+	size_t depth, sz;
+
+	if (!ctx->queue)
+		return 0;
+	depth = thrqueue_depth(ctx->queue);
+	sz = thrqueue_size(ctx->queue);
+	return was ? depth > sz / 4 : depth >= sz - sz / 4;
+}
+
+/*
+ * Return the table of uses private to the calling thread, creating it on
+ * first use.  Returns NULL on allocation failure.
+ */
+static pxy_forge_local_t *
+pxy_forge_local(pxy_forge_ctx_t *ctx)
+{
+	pxy_forge_local_t *local;
+
+	if ((local = pthread_getspecific(ctx->localkey)))
+		return local;
+	if (!(local = malloc(sizeof(pxy_forge_local_t))))
+		return NULL;
+	local->n = 0;
+	if (pthread_mutex_init(&local->mutex, NULL)) {
+		free(local);
+		return NULL;
+	}
+	if (pthread_setspecific(ctx->localkey, local)) {
+		pthread_mutex_destroy(&local->mutex);
+		free(local);
+		return NULL;
+	}
+	pthread_mutex_lock(&ctx->hotmutex);
+	local->next = ctx->locals;
+	ctx->locals = local;
+	pthread_mutex_unlock(&ctx->hotmutex);
+	return local;
+}
+
+static int
+pxy_forge_hot_cmp(const void *a, const void *b)
+{
+	unsigned int ha = (*(pxy_forge_hot_t * const *)a)->hits;
+	unsigned int hb = (*(pxy_forge_hot_t * const *)b)->hits;
+
+	return (ha > hb) - (ha < hb);
+}
+
+/*
+ * Evict the least used entries from the shared table down to maxhot entries,
+ * once it has grown an eighth beyond that.  Must hold hotmutex.
+ */
+static void
+pxy_forge_hot_trim(pxy_forge_ctx_t *ctx)
+{
+	pxy_forge_hot_t **hots;
+	size_t n = 0, evict;
+	khiter_t it;
+
+	if (kh_size(ctx->hot) <= ctx->maxhot + ctx->maxhot / 8)
+		return;
+	evict = kh_size(ctx->hot) - ctx->maxhot;
+	if (!(hots = malloc(kh_size(ctx->hot) * sizeof(pxy_forge_hot_t *))))
+		return;
+	for (it = kh_begin(ctx->hot); it != kh_end(ctx->hot); it++) {
+		if (kh_exist(ctx->hot, it))
+			hots[n++] = kh_val(ctx->hot, it);
+	}
+	qsort(hots, n, sizeof(pxy_forge_hot_t *), pxy_forge_hot_cmp);
+	for (size_t i = 0; i < evict; i++) {
+		it = kh_get(hotmap_t, ctx->hot, hots[i]->key);
+		kh_del(hotmap_t, ctx->hot, it);
+		X509_free(hots[i]->origcrt);
+		free(hots[i]);
+	}
+	free(hots);
+}
+
+/*
+ * Merge the uses counted in local into the shared table and empty local.
+ * Must hold the mutex of local, and must not hold hotmutex.
+ */
+static void
+pxy_forge_local_merge(pxy_forge_ctx_t *ctx, pxy_forge_local_t *local)
+{
+	pxy_forge_use_t *use;
+	pxy_forge_hot_t *hot;
+	khiter_t it;
+	int ret;
+
+	pthread_mutex_lock(&ctx->hotmutex);
+	for (size_t i = 0; i < local->n; i++) {
+		use = &local->use[i];
+		it = kh_get(hotmap_t, ctx->hot, use->key);
+		if (it != kh_end(ctx->hot)) {
+			hot = kh_val(ctx->hot, it);
+			hot->hits += use->hits;
+			hot->expiry = use->expiry;
+			X509_free(use->origcrt);
+			continue;
+		}
+		if (!(hot = malloc(sizeof(pxy_forge_hot_t)))) {
+			X509_free(use->origcrt);
+			continue;
+		}
+		it = kh_put(hotmap_t, ctx->hot, use->key, &ret);
+		if (ret == -1) {
+			X509_free(use->origcrt);
+			free(hot);
+			continue;
+		}
+		hot->key = use->key;
+		hot->origcrt = use->origcrt;
+		hot->hits = use->hits;
+		hot->expiry = use->expiry;
+		kh_val(ctx->hot, it) = hot;
+	}
+	local->n = 0;
+	pxy_forge_hot_trim(ctx);
+	pthread_mutex_unlock(&ctx->hotmutex);
+}
+
+/*
+ * Record a use of forged certificate fkcrt for original server certificate
+ * origcrt for pre-warming; ecdsa selects the variant as in pxy_forge_submit.
+ * The use is counted in a table private to the calling thread and becomes
+ * visible to pxy_forge_prewarm() on its next round.
+ * Does nothing unless PreforgeHosts is set.  Thread-safe.
+ */
+void
+pxy_forge_track(pxy_forge_ctx_t *ctx, X509 *origcrt, X509 *fkcrt, int ecdsa)
+{
+	pxy_forge_local_t *local;
+	pxy_forge_use_t *use;
+	pxy_forge_fpr_t key;
+	int days, secs;
+	size_t i;
+
+	if (!ctx->maxhot)
+		return;
+	memset(&key, 0, sizeof(key));
+	if (ssl_x509_fingerprint_sha1(origcrt, key.fpr) == -1)
+		return;
+	key.ecdsa = !!ecdsa;
+	if (!ASN1_TIME_diff(&days, &secs, NULL, X509_get_notAfter(fkcrt)))
+		return;
+	if (!(local = pxy_forge_local(ctx)))
+		return;
+
+	pthread_mutex_lock(&local->mutex);
+	for (i = 0; i < local->n; i++) {
+		if (kh_pxy_forge_fpr_hash_equal(local->use[i].key, key))
+			break;
+	}
+	if (i == PXY_FORGE_HOT_LOCAL) {
+		pxy_forge_local_merge(ctx, local);
+		i = 0;
+	}
+	use = &local->use[i];
+	if (i == local->n) {
+		ssl_x509_refcount_inc(origcrt);
+		use->key = key;
+		use->origcrt = origcrt;
+		use->hits = 0;
+		local->n++;
+	}
+	use->hits++;
+	use->expiry = time(NULL) + (time_t)days * 24 * 60 * 60 + secs;
+	pthread_mutex_unlock(&local->mutex);
+}
+
+static void
+pxy_forge_prewarm_cb(X509 *crt, UNUSED void *arg)
+{
+	/* already inserted into the cache by the forging thread */
+	if (crt)
+		X509_free(crt);
+}
+
+/*
+ * Re-forge all tracked certificates expiring within window seconds.  The
+ * completions are delivered to evbase, typically the main event base.
+ * Returns the number of certificates submitted for re-forging.
+ */
+int
+pxy_forge_prewarm(pxy_forge_ctx_t *ctx, struct event_base *evbase,
+                  time_t window)
+{
+	pxy_forge_local_t *local;
+	X509 **crts;
+	int *ecdsa;
+	time_t now;
+	int n = 0, submitted = 0;
+
+	if (!ctx->maxhot)
+		return 0;
+	now = time(NULL);
+
+	/* nodes are never removed from the list while ctx exists */
+	pthread_mutex_lock(&ctx->hotmutex);
+	local = ctx->locals;
+	pthread_mutex_unlock(&ctx->hotmutex);
+	for (; local; local = local->next) {
+		pthread_mutex_lock(&local->mutex);
+		pxy_forge_local_merge(ctx, local);
+		pthread_mutex_unlock(&local->mutex);
+	}
+
+	pthread_mutex_lock(&ctx->hotmutex);
+	if (!(crts = malloc((kh_size(ctx->hot) + 1) * sizeof(X509 *)))) {
+		pthread_mutex_unlock(&ctx->hotmutex);
+		return 0;
+	}
+	if (!(ecdsa = malloc((kh_size(ctx->hot) + 1) * sizeof(int)))) {
+		pthread_mutex_unlock(&ctx->hotmutex);
+		free(crts);
+		return 0;
+	}
+	for (khiter_t it = kh_begin(ctx->hot); it != kh_end(ctx->hot); it++) {
+		pxy_forge_hot_t *hot;
+
+		if (!kh_exist(ctx->hot, it))
+			continue;
+		hot = kh_val(ctx->hot, it);
+		hot->hits >>= 1;
+		if (hot->expiry && hot->expiry - now <= window) {
+			/* updated on next use of the re-forged cert */
+			hot->expiry = 0;
+			ssl_x509_refcount_inc(hot->origcrt);
+			ecdsa[n] = hot->key.ecdsa;
+			crts[n++] = hot->origcrt;
+		}
+	}
+	pthread_mutex_unlock(&ctx->hotmutex);
+
+	for (int i = 0; i < n; i++) {
+		if (pxy_forge_submit(ctx, ctx->opts, evbase, crts[i], ecdsa[i],
+		                     pxy_forge_prewarm_cb, NULL))
+			submitted++;
+		X509_free(crts[i]);
+	}
+	free(ecdsa);
+	free(crts);
+	if (submitted && OPTS_DEBUG(ctx->opts)) {
+		log_dbg_printf("Pre-forging %d certificates\n", submitted);
+	}
+	return submitted;
+}
+
+/*
+ * Forge a certificate for origcrt with the CA of opts selected by ecdsa as in
+ * pxy_forge_submit(), using the forging template of the CA if there is one.
+ * The certificate gets key, or the leaf key of the CA if key is NULL, and
+ * extraname as additional subjectAltName if non-NULL.  Thread-safe.
+ */
+X509 *
+pxy_forge_crt(opts_t *opts, X509 *origcrt, int ecdsa, EVP_PKEY *key,
+              const char *extraname)
+{
+	ssl_x509_tmpl_t *tmpl = ecdsa ? opts->ecfktmpl : opts->fktmpl;
+
+	if (tmpl)
+		return ssl_x509_forge_tmpl(tmpl, origcrt, key, extraname);
+	if (!key)
+		key = ecdsa ? opts->ecleafkey : opts->leafkey;
+	if (ecdsa)
+		return ssl_x509_forge(opts->eccacrt, opts->eccakey, origcrt,
+		                      key, extraname, opts->leafcrlurl);
+	return ssl_x509_forge(opts->cacrt, opts->cakey, origcrt, key,
+	                      extraname, opts->leafcrlurl);
+}
+
+/*
+ * Sign an OCSP response stating that forged certificate crt is good with the
+ * CA of opts that forged it, ecdsa selecting the CA as in pxy_forge_submit(),
+ * and insert it into the OCSP response cache.  Certificates not issued by that
+ * CA are not stapled.  Thread-safe.
+ * Returns -1 on failure, 0 on success.
+ */
+int
+pxy_forge_staple(opts_t *opts, X509 *crt, int ecdsa)
+{
+	X509 *cacrt = ecdsa ? opts->eccacrt : opts->cacrt;
+	EVP_PKEY *cakey = ecdsa ? opts->eccakey : opts->cakey;
+	cacheocsp_val_t *val;
+	unsigned char *der;
+	time_t now;
+	int sz;
+
+	if (!cacrt || !cakey || X509_check_issued(cacrt, crt) != X509_V_OK)
+		return -1;
+	now = time(NULL);
+	sz = ssl_ocsp_response_new(crt, cacrt, cakey,
+	                           PXY_FORGE_STAPLE_VALIDITY, &der);
+	if (sz == -1)
+		return -1;
+	if (!(val = malloc(sizeof(cacheocsp_val_t) + sz))) {
+		OPENSSL_free(der);
+		return -1;
+	}
+	val->refresh = now + PXY_FORGE_STAPLE_VALIDITY / 2;
+	val->expiry = now + PXY_FORGE_STAPLE_VALIDITY;
+	val->sz = sz;
+	memcpy(val->der, der, sz);
+	OPENSSL_free(der);
+	cachemgr_ocsp_set(crt, val);
+	free(val);
+	return 0;
+}
+
+/*
+ * Submit a job signing the OCSP response for forged certificate crt in the
+ * background, as in pxy_forge_staple().  Does nothing if a response for crt
+ * is already being signed.
+ * Returns -1 if the job could not be queued, 0 otherwise.
+ */
+int
+pxy_forge_staple_submit(pxy_forge_ctx_t *ctx, opts_t *opts, X509 *crt,
+                        int ecdsa)
+{
+	pxy_forge_flight_t *flight;
+	pxy_forge_fpr_t key;
+	khiter_t it;
+	int ret;
+
+	if (!ctx->queue)
+		return -1;
+	memset(&key, 0, sizeof(key));
+	if (ssl_x509_fingerprint_sha1(crt, key.fpr) == -1)
+		return -1;
+	key.ecdsa = !!ecdsa;
+	key.epoch = opts->fkcrt_epoch;
+	key.staple = 1;
+
+	pthread_mutex_lock(&ctx->mutex);
+	it = kh_get(flightmap_t, ctx->flights, key);
+	if (it != kh_end(ctx->flights)) {
+		pthread_mutex_unlock(&ctx->mutex);
+		return 0;
+	}
+	if (!(flight = malloc(sizeof(pxy_forge_flight_t))))
+		goto errout;
+	memset(flight, 0, sizeof(pxy_forge_flight_t));
+	flight->key = key;
+	flight->opts = opts_ref(opts);
+	ssl_x509_refcount_inc(crt);
+	flight->origcrt = crt;
+	it = kh_put(flightmap_t, ctx->flights, key, &ret);
+	if (ret == -1) {
+		pxy_forge_flight_free(flight);
+		goto errout;
+	}
+	kh_val(ctx->flights, it) = flight;
+	if (!thrqueue_enqueue_nb(ctx->queue, flight)) {
+		kh_del(flightmap_t, ctx->flights, it);
+		pxy_forge_flight_free(flight);
+		goto errout;
+	}
+	pthread_mutex_unlock(&ctx->mutex);
+	pxy_forge_offer(ctx);
+	return 0;
+
+errout:
+	pthread_mutex_unlock(&ctx->mutex);
+	return -1;
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,92 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PXYFORGE_H
+#define PXYFORGE_H
+
+#include "opts.h"
+#include "keypool.h"
+#include "attrib.h"
+
+#include <time.h>
+
+#include <event2/event.h>
+
+#include <openssl/x509.h>
+
+typedef struct pxy_forge_ctx pxy_forge_ctx_t;
+typedef struct pxy_forge_job pxy_forge_job_t;
+
+/*
+ * Completion callback, invoked on the event base the job was submitted from.
+ * The callback takes ownership of the reference to the forged certificate,
+ * which is NULL if forging failed.
+ */
+typedef void (*pxy_forge_cb_t)(X509 *, void *);
+
+/*
+ * Steal callback, invoked on the submitting thread when a flight was queued
+ * while all forging threads are busy.
+ */
+typedef void (*pxy_forge_steal_cb_t)(void *);
+
+pxy_forge_ctx_t * pxy_forge_new(opts_t *, keypool_t *) NONNULL(1) MALLOC;
+int pxy_forge_run(pxy_forge_ctx_t *) NONNULL(1) WUNRES;
+void pxy_forge_free(pxy_forge_ctx_t *) NONNULL(1);
+void pxy_forge_set_opts(pxy_forge_ctx_t *, opts_t *) NONNULL(1,2);
+void pxy_forge_set_steal(pxy_forge_ctx_t *, pxy_forge_steal_cb_t, void *)
+     NONNULL(1);
+int pxy_forge_steal(pxy_forge_ctx_t *) NONNULL(1);
+
+pxy_forge_job_t * pxy_forge_submit(pxy_forge_ctx_t *, opts_t *,
+                                   struct event_base *, X509 *, int,
+                                   pxy_forge_cb_t, void *)
+                                   NONNULL(1,2,3,4,6) WUNRES;
+void pxy_forge_cancel(pxy_forge_job_t *) NONNULL(1);
+int pxy_forge_backlogged(pxy_forge_ctx_t *, int) NONNULL(1) WUNRES;
+
+void pxy_forge_track(pxy_forge_ctx_t *, X509 *, X509 *, int)
+     NONNULL(1,2,3);
+int pxy_forge_prewarm(pxy_forge_ctx_t *, struct event_base *, time_t)
+    NONNULL(1,2);
+X509 * pxy_forge_crt(opts_t *, X509 *, int, EVP_PKEY *, const char *)
+       NONNULL(1,2) MALLOC;
+
+/*
+ * Validity of the OCSP responses stapled to forged certificates; responses
+ * are renewed once half of it has elapsed.
+ */
+#define PXY_FORGE_STAPLE_VALIDITY (4*24*60*60)
+
+int pxy_forge_staple(opts_t *, X509 *, int) NONNULL(1,2);
+int pxy_forge_staple_submit(pxy_forge_ctx_t *, opts_t *, X509 *, int)
+    NONNULL(1,2,3);
+
+#endif /* !PXYFORGE_H */
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,432 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "pxyforge.h"
+#include "ssl.h"
+#include "cachemgr.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <check.h>
+
+#include <event2/thread.h>
+
+#define CACERT "extra/pki/rsa.crt"
+#define CAKEY "extra/pki/rsa.key"
+#define TESTCERT "extra/pki/server.crt"
+#define TESTKEY "extra/pki/server.key"
+
+static opts_t *opts;
+static X509 *origcrt;
+static struct event_base *evbase;
+static int pending;
+
+typedef struct {
+	int called;
+	X509 *crt;
+} pxyforge_result_t;
+
+static void
+pxyforge_setup(void)
+{
+	/* as in proxy_new(); required for completing on another thread */
+	evthread_use_pthreads();
+	if ((ssl_init() == -1) || (cachemgr_preinit() == -1))
+		exit(EXIT_FAILURE);
+	opts = opts_new();
+	opts->cacrt = ssl_x509_load(CACERT);
+	opts->cakey = ssl_key_load(CAKEY);
+	opts->leafkey = ssl_key_load(TESTKEY);
+	origcrt = ssl_x509_load(TESTCERT);
+	evbase = event_base_new();
+	if (!opts->cacrt || !opts->cakey || !opts->leafkey || !origcrt ||
+	    !evbase)
+		exit(EXIT_FAILURE);
+}
+
+static void
+pxyforge_teardown(void)
+{
+	event_base_free(evbase);
+	X509_free(origcrt);
+	opts_free(opts);
+	cachemgr_fini();
+	ssl_fini();
+}
+
+static void
+pxyforge_done_cb(X509 *crt, void *arg)
+{
+	pxyforge_result_t *res = arg;
+
+	res->called++;
+	res->crt = crt;
+	if (--pending <= 0)
+		event_base_loopbreak(evbase);
+}
+
+static void
+pxyforge_timeout_cb(UNUSED evutil_socket_t fd, UNUSED short what,
+                    UNUSED void *arg)
+{
+	event_base_loopbreak(evbase);
+}
+
+START_TEST(pxyforge_01)
+{
+	pxy_forge_ctx_t *ctx;
+	pxy_forge_job_t *job;
+	pxyforge_result_t res = {0, NULL};
+	unsigned char fpr1[SSL_X509_FPRSZ], fpr2[SSL_X509_FPRSZ];
+	struct timeval tv = {10, 0};
+
+	ctx = pxy_forge_new(opts, NULL);
+	fail_unless(!!ctx, "no forge ctx");
+	fail_unless(pxy_forge_run(ctx) == 0, "run failed");
+	job = pxy_forge_submit(ctx, opts, evbase, origcrt, 0,
+	                       pxyforge_done_cb, &res);
+	fail_unless(!!job, "submit failed");
+	/* keep the loop from exiting before the completion is scheduled */
+	event_base_once(evbase, -1, EV_TIMEOUT, pxyforge_timeout_cb, NULL,
+	                &tv);
+	event_base_dispatch(evbase);
+	fail_unless(res.called == 1, "callback not called once");
+	fail_unless(!!res.crt, "no forged certificate");
+	fail_unless(X509_check_issued(opts->cacrt, res.crt) == X509_V_OK,
+	            "forged certificate not issued by CA");
+	ssl_x509_fingerprint_sha1(origcrt, fpr1);
+	ssl_x509_fingerprint_sha1(res.crt, fpr2);
+	fail_unless(memcmp(fpr1, fpr2, SSL_X509_FPRSZ) != 0,
+	            "original certificate returned");
+	fail_unless(cache_entries(cachemgr_fkcrt) == 1, "not cached");
+	X509_free(res.crt);
+	pxy_forge_free(ctx);
+}
+END_TEST
+
+START_TEST(pxyforge_02)
+{
+	pxy_forge_ctx_t *ctx;
+	pxy_forge_job_t *job;
+	pxyforge_result_t res = {0, NULL};
+	struct timeval tv = {2, 0};
+
+	ctx = pxy_forge_new(opts, NULL);
+	fail_unless(!!ctx, "no forge ctx");
+	fail_unless(pxy_forge_run(ctx) == 0, "run failed");
+	job = pxy_forge_submit(ctx, opts, evbase, origcrt, 0,
+	                       pxyforge_done_cb, &res);
+	fail_unless(!!job, "submit failed");
+	pxy_forge_cancel(job);
+	event_base_once(evbase, -1, EV_TIMEOUT, pxyforge_timeout_cb, NULL,
+	                &tv);
+	event_base_dispatch(evbase);
+	fail_unless(res.called == 0, "callback called for cancelled job");
+	pxy_forge_free(ctx);
+}
+END_TEST
+
+START_TEST(pxyforge_03)
+{
+	pxy_forge_ctx_t *ctx;
+	pxy_forge_job_t *job;
+	pxyforge_result_t res = {0, NULL};
+
+	/* not running: caller needs to fall back to forging synchronously */
+	ctx = pxy_forge_new(opts, NULL);
+	fail_unless(!!ctx, "no forge ctx");
+	job = pxy_forge_submit(ctx, opts, evbase, origcrt, 0,
+	                       pxyforge_done_cb, &res);
+	fail_unless(job == NULL, "submit succeeded without threads");
+	pxy_forge_free(ctx);
+}
+END_TEST
+
+START_TEST(pxyforge_04)
+{
+	pxy_forge_ctx_t *ctx;
+	pxy_forge_job_t *job1, *job2;
+	pxyforge_result_t res1 = {0, NULL}, res2 = {0, NULL};
+	struct timeval tv = {10, 0};
+
+	ctx = pxy_forge_new(opts, NULL);
+	fail_unless(!!ctx, "no forge ctx");
+	fail_unless(pxy_forge_run(ctx) == 0, "run failed");
+	pending = 2;
+	job1 = pxy_forge_submit(ctx, opts, evbase, origcrt, 0,
+	                       pxyforge_done_cb, &res1);
+	job2 = pxy_forge_submit(ctx, opts, evbase, origcrt, 0,
+	                       pxyforge_done_cb, &res2);
+	fail_unless(job1 && job2, "submit failed");
+	event_base_once(evbase, -1, EV_TIMEOUT, pxyforge_timeout_cb, NULL,
+	                &tv);
+	event_base_dispatch(evbase);
+	fail_unless(res1.called == 1 && res2.called == 1,
+	            "callbacks not called once each");
+	fail_unless(res1.crt && res2.crt, "no forged certificate");
+	fail_unless(res1.crt == res2.crt, "certificate forged twice");
+	X509_free(res1.crt);
+	X509_free(res2.crt);
+	pxy_forge_free(ctx);
+}
+END_TEST
+
+START_TEST(pxyforge_05)
+{
+	pxy_forge_ctx_t *ctx;
+	X509 *fkcrt;
+	struct timeval tv = {10, 0};
+
+	opts->preforge_hosts = 2;
+	ctx = pxy_forge_new(opts, NULL);
+	fail_unless(!!ctx, "no forge ctx");
+	fail_unless(pxy_forge_run(ctx) == 0, "run failed");
+	fkcrt = ssl_x509_forge(opts->cacrt, opts->cakey, origcrt,
+	                       opts->leafkey, NULL, NULL);
+	fail_unless(!!fkcrt, "forging failed");
+	fail_unless(pxy_forge_prewarm(ctx, evbase, 400*24*60*60) == 0,
+	            "pre-forged untracked certificate");
+	pxy_forge_track(ctx, origcrt, fkcrt, 0);
+	fail_unless(pxy_forge_prewarm(ctx, evbase, 0) == 0,
+	            "pre-forged certificate not about to expire");
+	fail_unless(pxy_forge_prewarm(ctx, evbase, 400*24*60*60) == 1,
+	            "expiring certificate not pre-forged");
+	fail_unless(pxy_forge_prewarm(ctx, evbase, 400*24*60*60) == 0,
+	            "pre-forged certificate twice");
+	event_base_once(evbase, -1, EV_TIMEOUT, pxyforge_timeout_cb, NULL,
+	                &tv);
+	while (cache_entries(cachemgr_fkcrt) == 0)
+		event_base_loop(evbase, EVLOOP_ONCE);
+	pxy_forge_track(ctx, origcrt, fkcrt, 0);
+	fail_unless(pxy_forge_prewarm(ctx, evbase, 400*24*60*60) == 1,
+	            "used certificate not tracked again");
+	X509_free(fkcrt);
+	pxy_forge_free(ctx);
+}
+END_TEST
+
+START_TEST(pxyforge_06)
+{
+	pxy_forge_ctx_t *ctx;
+	pxy_forge_job_t *job;
+	pxyforge_result_t res = {0, NULL};
+	struct timeval tv = {10, 0};
+	EVP_PKEY *k;
+	X509 *c;
+
+	/* EC key certified by the RSA CA stands in for an ECDSA CA */
+	opts->eccakey = ssl_key_genec(NULL);
+	opts->ecleafkey = ssl_key_genec(NULL);
+	fail_unless(opts->eccakey && opts->ecleafkey, "EC keygen failed");
+	opts->eccacrt = ssl_x509_forge(opts->cacrt, opts->cakey, opts->cacrt,
+	                               opts->eccakey, NULL, NULL);
+	fail_unless(!!opts->eccacrt, "forging ECDSA CA failed");
+	ctx = pxy_forge_new(opts, NULL);
+	fail_unless(!!ctx, "no forge ctx");
+	fail_unless(pxy_forge_run(ctx) == 0, "run failed");
+	job = pxy_forge_submit(ctx, opts, evbase, origcrt, 1,
+	                       pxyforge_done_cb, &res);
+	fail_unless(!!job, "submit failed");
+	event_base_once(evbase, -1, EV_TIMEOUT, pxyforge_timeout_cb, NULL,
+	                &tv);
+	event_base_dispatch(evbase);
+	fail_unless(res.called == 1, "callback not called once");
+	fail_unless(!!res.crt, "no forged certificate");
+	fail_unless(X509_verify(res.crt, opts->eccakey) == 1,
+	            "forged certificate not signed by ECDSA CA");
+	k = X509_get_pubkey(res.crt);
+	fail_unless(k && EVP_PKEY_base_id(k) == EVP_PKEY_EC,
+	            "forged certificate has no EC key");
+	EVP_PKEY_free(k);
+	c = cachemgr_fkcrt_get(origcrt);
+	fail_unless(c == NULL, "ECDSA certificate cached as RSA variant");
+	c = cachemgr_fkcrt_get_ec(origcrt);
+	fail_unless(c == res.crt, "ECDSA certificate not cached");
+	X509_free(c);
+	X509_free(res.crt);
+	pxy_forge_free(ctx);
+}
+END_TEST
+
+START_TEST(pxyforge_07)
+{
+	pxy_forge_ctx_t *ctx;
+	pxy_forge_job_t *job1, *job2;
+	pxyforge_result_t res1 = {0, NULL}, res2 = {0, NULL};
+	struct timeval tv = {10, 0};
+	opts_t *opts2;
+	X509 *c;
+
+	/* reloaded configuration with a new CA forges in a separate flight,
+	 * late forges of the previous configuration are not cached */
+	opts2 = opts_new();
+	opts2->cacrt = ssl_x509_load(CACERT);
+	opts2->cakey = ssl_key_load(CAKEY);
+	opts2->leafkey = ssl_key_load(TESTKEY);
+	fail_unless(opts2->cacrt && opts2->cakey && opts2->leafkey,
+	            "loading CA failed");
+	opts2->fkcrt_epoch = cachemgr_fkcrt_flush();
+	ctx = pxy_forge_new(opts, NULL);
+	fail_unless(!!ctx, "no forge ctx");
+	fail_unless(pxy_forge_run(ctx) == 0, "run failed");
+	pending = 2;
+	job1 = pxy_forge_submit(ctx, opts, evbase, origcrt, 0,
+	                        pxyforge_done_cb, &res1);
+	job2 = pxy_forge_submit(ctx, opts2, evbase, origcrt, 0,
+	                        pxyforge_done_cb, &res2);
+	fail_unless(job1 && job2, "submit failed");
+	opts_unref(opts2);
+	event_base_once(evbase, -1, EV_TIMEOUT, pxyforge_timeout_cb, NULL,
+	                &tv);
+	event_base_dispatch(evbase);
+	fail_unless(res1.called == 1 && res2.called == 1,
+	            "callbacks not called once each");
+	fail_unless(res1.crt && res2.crt, "no forged certificate");
+	fail_unless(res1.crt != res2.crt, "flight shared across epochs");
+	c = cachemgr_fkcrt_get(origcrt);
+	fail_unless(c == res2.crt, "not cached for current epoch");
+	X509_free(c);
+	X509_free(res1.crt);
+	X509_free(res2.crt);
+	pxy_forge_free(ctx);
+}
+END_TEST
+
+static void
+pxyforge_steal_cb(void *arg)
+{
+	(*(int *)arg)++;
+}
+
+START_TEST(pxyforge_08)
+{
+	pxy_forge_ctx_t *ctx;
+	pxy_forge_job_t *job;
+	pxyforge_result_t res = {0, NULL};
+	struct timeval tv = {10, 0};
+	int offered = 0;
+
+	/* no forging threads: every queued flight is up for stealing */
+	opts->forge_threads = 0;
+	ctx = pxy_forge_new(opts, NULL);
+	fail_unless(!!ctx, "no forge ctx");
+	pxy_forge_set_steal(ctx, pxyforge_steal_cb, &offered);
+	fail_unless(pxy_forge_run(ctx) == 0, "run failed");
+	fail_unless(pxy_forge_steal(ctx) == 0, "stole from empty queue");
+	job = pxy_forge_submit(ctx, opts, evbase, origcrt, 0,
+	                       pxyforge_done_cb, &res);
+	fail_unless(!!job, "submit failed");
+	fail_unless(offered == 1, "flight not offered for stealing");
+	fail_unless(pxy_forge_steal(ctx) == 1, "flight not stolen");
+	fail_unless(pxy_forge_steal(ctx) == 0, "flight stolen twice");
+	event_base_once(evbase, -1, EV_TIMEOUT, pxyforge_timeout_cb, NULL,
+	                &tv);
+	event_base_dispatch(evbase);
+	fail_unless(res.called == 1, "callback not called once");
+	fail_unless(!!res.crt, "no forged certificate");
+	X509_free(res.crt);
+	pxy_forge_free(ctx);
+}
+END_TEST
+
+typedef struct {
+	pxy_forge_ctx_t *ctx;
+	X509 *crt;
+} pxyforge_track_arg_t;
+
+static void *
+pxyforge_track_thr(void *arg)
+{
+	pxyforge_track_arg_t *t = arg;
+
+	for (int i = 0; i < 3; i++)
+		pxy_forge_track(t->ctx, origcrt, t->crt, 0);
+	return NULL;
+}
+
+START_TEST(pxyforge_09)
+{
+	pxyforge_track_arg_t t;
+	pthread_t thr;
+	X509 *crt1, *crt2;
+
+	/* uses counted on other threads are merged, and the least used
+	 * certificate is evicted once the table is too large */
+	opts->preforge_hosts = 2;
+	opts->forge_threads = 0;
+	t.ctx = pxy_forge_new(opts, NULL);
+	fail_unless(!!t.ctx, "no forge ctx");
+	fail_unless(pxy_forge_run(t.ctx) == 0, "run failed");
+	crt1 = ssl_x509_forge(opts->cacrt, opts->cakey, origcrt,
+	                      opts->leafkey, NULL, NULL);
+	crt2 = ssl_x509_forge(opts->cacrt, opts->cakey, origcrt,
+	                      opts->leafkey, NULL, NULL);
+	fail_unless(crt1 && crt2 && X509_cmp(crt1, crt2),
+	            "forging failed");
+	t.crt = crt1;
+	fail_unless(!pthread_create(&thr, NULL, pxyforge_track_thr, &t),
+	            "thread creation failed");
+	pthread_join(thr, NULL);
+	pxy_forge_track(t.ctx, crt1, crt1, 0);
+	pxy_forge_track(t.ctx, crt1, crt1, 0);
+	pxy_forge_track(t.ctx, crt2, crt2, 0);
+	fail_unless(pxy_forge_prewarm(t.ctx, evbase, 400*24*60*60) == 2,
+	            "table not trimmed to PreforgeHosts");
+	X509_free(crt1);
+	X509_free(crt2);
+	pxy_forge_free(t.ctx);
+}
+END_TEST
+
+Suite *
+pxyforge_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("pxyforge");
+
+	tc = tcase_create("pxyforge");
+	tcase_add_checked_fixture(tc, pxyforge_setup, pxyforge_teardown);
+	tcase_add_test(tc, pxyforge_01);
+	tcase_add_test(tc, pxyforge_02);
+	tcase_add_test(tc, pxyforge_03);
+	tcase_add_test(tc, pxyforge_04);
+	tcase_add_test(tc, pxyforge_05);
+	tcase_add_test(tc, pxyforge_06);
+	tcase_add_test(tc, pxyforge_07);
+	tcase_add_test(tc, pxyforge_08);
+	tcase_add_test(tc, pxyforge_09);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,328 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "pxyhttppool.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include <event2/event_struct.h>
+
+/*
+ * Upstream HTTP keep-alive pool: keeps idle persistent upstream connections
+ * of plain HTTP connections after their client has gone away, so that the
+ * next client connection to the same destination can send its requests over
+ * a warm connection instead of connecting anew.  One pool exists per
+ * connection handling thread, holding at most PXY_HTTPPOOL_MAX connections to
+ * any number of destinations and at most a configured number per destination.
+ * All its events run on the event base of that thread.
+ *
+ * Connections are only ever put into the pool from the event loop of the
+ * owning thread, but taken by pxy_httppool_get() from any thread; like the
+ * pre-connect pool, taking a connection removes its event without waiting for
+ * a concurrently running callback, which checks its slot under the mutex.
+ *
+ * Idle connections are watched for readability; if the server closes one or
+ * sends data on it, or it has been idle for PXY_HTTPPOOL_IDLE_TIMEOUT, it is
+ * closed.  The timeout is kept below the keep-alive timeout of common servers
+ * in order to make it unlikely that a request races the server closing the
+ * connection.  Connections are reused most recently pooled first; if the pool
+ * is full, the least recently pooled connection is closed.
+ */
+
+#define PXY_HTTPPOOL_IDLE_TIMEOUT	4
+#define PXY_HTTPPOOL_BUCKETS		64
+
+typedef struct pxy_httppool_ent {
+	pxy_httppool_t *pool;
+	struct pxy_httppool_ent *next;  /* bucket chain or free list */
+	struct event ev;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	evutil_socket_t fd;
+	unsigned int bucket;
+	unsigned long long seq;         /* 0 if the slot is free */
+} pxy_httppool_ent_t;
+
+struct pxy_httppool {
+	pthread_mutex_t mutex;
+	struct event_base *evbase;
+	size_t perdst;
+	size_t idle;
+	unsigned long long seq;
+	pxy_httppool_ent_t *free;
+	pxy_httppool_ent_t *bucket[PXY_HTTPPOOL_BUCKETS];
+	pxy_httppool_ent_t ent[PXY_HTTPPOOL_MAX];
+};
+
+/*
+ * Hash the address and port of a destination into a bucket index.
+ */
+static unsigned int
+pxy_httppool_hash(const struct sockaddr *addr, socklen_t addrlen)
+{
+	const unsigned char *p;
+	unsigned int h = 2166136261U;
+	size_t sz;
+
+	if (addr->sa_family == AF_INET) {
+		const struct sockaddr_in *sin = (const void *)addr;
+		h = (h ^ sin->sin_port) * 16777619U;
+		p = (const void *)&sin->sin_addr;
+		sz = sizeof(sin->sin_addr);
+	} else if (addr->sa_family == AF_INET6) {
+		const struct sockaddr_in6 *sin6 = (const void *)addr;
+		h = (h ^ sin6->sin6_port) * 16777619U;
+		p = (const void *)&sin6->sin6_addr;
+		sz = sizeof(sin6->sin6_addr);
+	} else {
+		p = (const void *)addr;
+		sz = addrlen;
+	}
+	for (size_t i = 0; i < sz; i++)
+		h = (h ^ p[i]) * 16777619U;
+	return h % PXY_HTTPPOOL_BUCKETS;
+}
+
+/*
+ * Return 1 if the slot holds a connection to addr, 0 otherwise.  Only family,
+ * address and port are compared, not padding or IPv6 flow information.
+ */
+static int
+pxy_httppool_match(pxy_httppool_ent_t *ent, const struct sockaddr *addr,
+                   socklen_t addrlen)
+{
+	const struct sockaddr *a = (struct sockaddr *)&ent->addr;
+
+	if (a->sa_family != addr->sa_family)
+		return 0;
+	if (addr->sa_family == AF_INET) {
+		const struct sockaddr_in *x = (const void *)a;
+		const struct sockaddr_in *y = (const void *)addr;
+		return x->sin_port == y->sin_port &&
+		       x->sin_addr.s_addr == y->sin_addr.s_addr;
+	}
+	if (addr->sa_family == AF_INET6) {
+		const struct sockaddr_in6 *x = (const void *)a;
+		const struct sockaddr_in6 *y = (const void *)addr;
+		return x->sin6_port == y->sin6_port &&
+		       x->sin6_scope_id == y->sin6_scope_id &&
+		       !memcmp(&x->sin6_addr, &y->sin6_addr,
+		               sizeof(x->sin6_addr));
+	}
+	return ent->addrlen == addrlen && !memcmp(a, addr, addrlen);
+}
+
+/*
+ * Unlink a slot from its bucket chain and put it on the free list.  The
+ * caller takes care of the event and the socket.  Must be called with the
+ * pool mutex held.
+ */
+static void
+pxy_httppool_unlink(pxy_httppool_t *pool, pxy_httppool_ent_t *ent)
+{
+	pxy_httppool_ent_t **pp;
+
+	for (pp = &pool->bucket[ent->bucket]; *pp != ent; pp = &(*pp)->next);
+	*pp = ent->next;
+	ent->fd = -1;
+	ent->seq = 0;
+	ent->next = pool->free;
+	pool->free = ent;
+	pool->idle--;
+}
+
+/*
+ * Close the connection in a slot and free the slot.  Must be called with the
+ * pool mutex held.
+ */
+static void
+pxy_httppool_ent_close(pxy_httppool_t *pool, pxy_httppool_ent_t *ent)
+{
+	event_del(&ent->ev);
+	evutil_closesocket(ent->fd);
+	pxy_httppool_unlink(pool, ent);
+}
+
+/*
+ * An idle connection became readable or timed out.
+ */
+static void
+pxy_httppool_ent_cb(evutil_socket_t fd, UNUSED short what, void *arg)
+{
+	pxy_httppool_ent_t *ent = arg;
+	pxy_httppool_t *pool = ent->pool;
+
+	pthread_mutex_lock(&pool->mutex);
+	/* ignore slots taken by pxy_httppool_get() while we were waiting */
+	if (ent->seq && ent->fd == fd)
+		pxy_httppool_ent_close(pool, ent);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/*
+ * Create an empty keep-alive pool on evbase, keeping at most perdst idle
+ * connections to each destination.
+ * Returns NULL on failure.
+ */
+pxy_httppool_t *
+pxy_httppool_new(struct event_base *evbase, size_t perdst)
+{
+	pxy_httppool_t *pool;
+
+	pool = malloc(sizeof(pxy_httppool_t));
+	if (!pool)
+		return NULL;
+	memset(pool, 0, sizeof(pxy_httppool_t));
+	pthread_mutex_init(&pool->mutex, NULL);
+	pool->evbase = evbase;
+	pool->perdst = perdst;
+	for (size_t i = PXY_HTTPPOOL_MAX; i > 0; i--) {
+		pool->ent[i - 1].pool = pool;
+		pool->ent[i - 1].fd = -1;
+		pool->ent[i - 1].next = pool->free;
+		pool->free = &pool->ent[i - 1];
+	}
+	return pool;
+}
+
+/*
+ * Close all pooled connections and free the pool.  The event loop of the
+ * owning thread must not be running anymore.
+ */
+void
+pxy_httppool_free(pxy_httppool_t *pool)
+{
+	for (size_t i = 0; i < PXY_HTTPPOOL_MAX; i++) {
+		if (pool->ent[i].seq)
+			pxy_httppool_ent_close(pool, &pool->ent[i]);
+	}
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool);
+}
+
+/*
+ * Put an idle persistent connection to addr into the pool.  Must be called
+ * from the event loop of the owning thread.  On success, the pool owns fd.
+ * Returns -1 if the destination already has the maximum number of idle
+ * connections or on failure, in which case the caller still owns fd, and 0
+ * on success.
+ */
+int
+pxy_httppool_put(pxy_httppool_t *pool, const struct sockaddr *addr,
+                 socklen_t addrlen, evutil_socket_t fd)
+{
+	struct timeval tv = {PXY_HTTPPOOL_IDLE_TIMEOUT, 0};
+	pxy_httppool_ent_t *ent, *oldest;
+	unsigned int bucket;
+	size_t n = 0;
+	int rv = -1;
+
+	if (addrlen > sizeof(ent->addr))
+		return -1;
+	bucket = pxy_httppool_hash(addr, addrlen);
+	pthread_mutex_lock(&pool->mutex);
+	for (ent = pool->bucket[bucket]; ent; ent = ent->next) {
+		if (pxy_httppool_match(ent, addr, addrlen))
+			n++;
+	}
+	if (n >= pool->perdst)
+		goto out;
+	if (!pool->free) {
+		oldest = &pool->ent[0];
+		for (size_t i = 1; i < PXY_HTTPPOOL_MAX; i++) {
+			if (pool->ent[i].seq < oldest->seq)
+				oldest = &pool->ent[i];
+		}
+		pxy_httppool_ent_close(pool, oldest);
+	}
+	ent = pool->free;
+	event_assign(&ent->ev, pool->evbase, fd, EV_READ,
+	             pxy_httppool_ent_cb, ent);
+	if (event_add(&ent->ev, &tv) == -1)
+		goto out;
+	pool->free = ent->next;
+	memcpy(&ent->addr, addr, addrlen);
+	ent->addrlen = addrlen;
+	ent->fd = fd;
+	ent->bucket = bucket;
+	ent->seq = ++pool->seq;
+	ent->next = pool->bucket[bucket];
+	pool->bucket[bucket] = ent;
+	pool->idle++;
+	rv = 0;
+out:
+	pthread_mutex_unlock(&pool->mutex);
+	return rv;
+}
+
+/*
+ * Take the most recently pooled idle connection to addr out of the pool.
+ * The caller owns the returned socket, which is non-blocking.  Thread-safe.
+ * Returns -1 if no idle connection to addr is available.
+ */
+evutil_socket_t
+pxy_httppool_get(pxy_httppool_t *pool, const struct sockaddr *addr,
+                 socklen_t addrlen)
+{
+	pxy_httppool_ent_t *ent, *best = NULL;
+	evutil_socket_t fd = -1;
+
+	pthread_mutex_lock(&pool->mutex);
+	for (ent = pool->bucket[pxy_httppool_hash(addr, addrlen)]; ent;
+	     ent = ent->next) {
+		if (pxy_httppool_match(ent, addr, addrlen) &&
+		    (!best || ent->seq > best->seq))
+			best = ent;
+	}
+	if (best) {
+		event_del_noblock(&best->ev);
+		fd = best->fd;
+		pxy_httppool_unlink(pool, best);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return fd;
+}
+
+/*
+ * Return the number of idle connections in the pool.  Thread-safe.
+ */
+size_t
+pxy_httppool_idle(pxy_httppool_t *pool)
+{
+	size_t idle;
+
+	pthread_mutex_lock(&pool->mutex);
+	idle = pool->idle;
+	pthread_mutex_unlock(&pool->mutex);
+	return idle;
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,54 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PXYHTTPPOOL_H
+#define PXYHTTPPOOL_H
+
+#include "attrib.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <event2/event.h>
+
+#define PXY_HTTPPOOL_MAX	256
+
+typedef struct pxy_httppool pxy_httppool_t;
+
+pxy_httppool_t * pxy_httppool_new(struct event_base *, size_t)
+                 NONNULL(1) MALLOC;
+void pxy_httppool_free(pxy_httppool_t *) NONNULL(1);
+int pxy_httppool_put(pxy_httppool_t *, const struct sockaddr *, socklen_t,
+                     evutil_socket_t) NONNULL(1,2) WUNRES;
+evutil_socket_t pxy_httppool_get(pxy_httppool_t *, const struct sockaddr *,
+                                 socklen_t) NONNULL(1,2) WUNRES;
+size_t pxy_httppool_idle(pxy_httppool_t *) NONNULL(1) WUNRES;
+
+#endif /* !PXYHTTPPOOL_H */
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,228 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "pxyhttppool.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <check.h>
+
+#include <event2/thread.h>
+
+static struct event_base *evbase;
+static struct sockaddr_in addr;
+static evutil_socket_t lfd;
+
+static void
+pxyhttppool_setup(void)
+{
+	socklen_t addrlen = sizeof(addr);
+
+	evthread_use_pthreads();
+	evbase = event_base_new();
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (!evbase || lfd == -1)
+		exit(EXIT_FAILURE);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+	    listen(lfd, 16) == -1 ||
+	    getsockname(lfd, (struct sockaddr *)&addr, &addrlen) == -1)
+		exit(EXIT_FAILURE);
+}
+
+static void
+pxyhttppool_teardown(void)
+{
+	evutil_closesocket(lfd);
+	event_base_free(evbase);
+}
+
+/*
+ * Connect a non-blocking socket to the listener and return it, along with
+ * the server end of the connection in *srvfd.
+ */
+static evutil_socket_t
+pxyhttppool_connect(evutil_socket_t *srvfd)
+{
+	evutil_socket_t fd;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd == -1 ||
+	    connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+	    evutil_make_socket_nonblocking(fd) == -1)
+		exit(EXIT_FAILURE);
+	*srvfd = accept(lfd, NULL, NULL);
+	if (*srvfd == -1)
+		exit(EXIT_FAILURE);
+	return fd;
+}
+
+START_TEST(pxyhttppool_01)
+{
+	pxy_httppool_t *pool;
+	struct sockaddr_in other;
+	evutil_socket_t fd1, fd2, srv1, srv2;
+
+	pool = pxy_httppool_new(evbase, 2);
+	fail_unless(!!pool, "pool not created");
+	fd1 = pxyhttppool_connect(&srv1);
+	fd2 = pxyhttppool_connect(&srv2);
+	fail_unless(pxy_httppool_put(pool, (struct sockaddr *)&addr,
+	                             sizeof(addr), fd1) == 0, "put 1 failed");
+	fail_unless(pxy_httppool_put(pool, (struct sockaddr *)&addr,
+	                             sizeof(addr), fd2) == 0, "put 2 failed");
+	fail_unless(pxy_httppool_idle(pool) == 2, "wrong idle count");
+	memcpy(&other, &addr, sizeof(other));
+	other.sin_port = htons(ntohs(addr.sin_port) + 1);
+	fail_unless(pxy_httppool_get(pool, (struct sockaddr *)&other,
+	                             sizeof(other)) == -1,
+	            "connection to other destination handed out");
+	fail_unless(pxy_httppool_get(pool, (struct sockaddr *)&addr,
+	                             sizeof(addr)) == fd2,
+	            "most recently pooled connection not handed out first");
+	fail_unless(pxy_httppool_get(pool, (struct sockaddr *)&addr,
+	                             sizeof(addr)) == fd1,
+	            "second connection not handed out");
+	fail_unless(pxy_httppool_get(pool, (struct sockaddr *)&addr,
+	                             sizeof(addr)) == -1,
+	            "connection handed out twice");
+	fail_unless(pxy_httppool_idle(pool) == 0, "wrong idle count");
+	evutil_closesocket(fd1);
+	evutil_closesocket(fd2);
+	evutil_closesocket(srv1);
+	evutil_closesocket(srv2);
+	pxy_httppool_free(pool);
+}
+END_TEST
+
+START_TEST(pxyhttppool_02)
+{
+	pxy_httppool_t *pool;
+	evutil_socket_t fd1, fd2, srv1, srv2;
+
+	pool = pxy_httppool_new(evbase, 1);
+	fail_unless(!!pool, "pool not created");
+	fd1 = pxyhttppool_connect(&srv1);
+	fd2 = pxyhttppool_connect(&srv2);
+	fail_unless(pxy_httppool_put(pool, (struct sockaddr *)&addr,
+	                             sizeof(addr), fd1) == 0, "put 1 failed");
+	fail_unless(pxy_httppool_put(pool, (struct sockaddr *)&addr,
+	                             sizeof(addr), fd2) == -1,
+	            "per-destination limit exceeded");
+	fail_unless(pxy_httppool_idle(pool) == 1, "wrong idle count");
+	evutil_closesocket(fd2);
+	evutil_closesocket(srv1);
+	evutil_closesocket(srv2);
+	pxy_httppool_free(pool);
+}
+END_TEST
+
+START_TEST(pxyhttppool_03)
+{
+	pxy_httppool_t *pool;
+	evutil_socket_t fd, srv;
+
+	pool = pxy_httppool_new(evbase, 1);
+	fail_unless(!!pool, "pool not created");
+	fd = pxyhttppool_connect(&srv);
+	fail_unless(pxy_httppool_put(pool, (struct sockaddr *)&addr,
+	                             sizeof(addr), fd) == 0, "put failed");
+	/* server closes the idle connection */
+	evutil_closesocket(srv);
+	for (int i = 0; i < 100 && pxy_httppool_idle(pool) > 0; i++) {
+		event_base_loop(evbase, EVLOOP_NONBLOCK);
+		usleep(10000);
+	}
+	fail_unless(pxy_httppool_idle(pool) == 0, "closed connection kept");
+	fail_unless(pxy_httppool_get(pool, (struct sockaddr *)&addr,
+	                             sizeof(addr)) == -1,
+	            "closed connection handed out");
+	pxy_httppool_free(pool);
+}
+END_TEST
+
+START_TEST(pxyhttppool_04)
+{
+	pxy_httppool_t *pool;
+	struct sockaddr_in dst;
+	evutil_socket_t fd[PXY_HTTPPOOL_MAX + 1], srv[PXY_HTTPPOOL_MAX + 1];
+
+	pool = pxy_httppool_new(evbase, 1);
+	fail_unless(!!pool, "pool not created");
+	memcpy(&dst, &addr, sizeof(dst));
+	for (int i = 0; i <= PXY_HTTPPOOL_MAX; i++) {
+		/* pretend each connection goes to another destination */
+		fd[i] = pxyhttppool_connect(&srv[i]);
+		dst.sin_port = htons(i + 1);
+		fail_unless(pxy_httppool_put(pool, (struct sockaddr *)&dst,
+		                             sizeof(dst), fd[i]) == 0,
+		            "put failed");
+	}
+	fail_unless(pxy_httppool_idle(pool) == PXY_HTTPPOOL_MAX,
+	            "pool exceeds its size");
+	dst.sin_port = htons(1);
+	fail_unless(pxy_httppool_get(pool, (struct sockaddr *)&dst,
+	                             sizeof(dst)) == -1,
+	            "least recently pooled connection not evicted");
+	dst.sin_port = htons(PXY_HTTPPOOL_MAX + 1);
+	fail_unless(pxy_httppool_get(pool, (struct sockaddr *)&dst,
+	                             sizeof(dst)) == fd[PXY_HTTPPOOL_MAX],
+	            "most recently pooled connection not kept");
+	evutil_closesocket(fd[PXY_HTTPPOOL_MAX]);
+	for (int i = 0; i <= PXY_HTTPPOOL_MAX; i++)
+		evutil_closesocket(srv[i]);
+	pxy_httppool_free(pool);
+}
+END_TEST
+
+Suite *
+pxyhttppool_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("pxyhttppool");
+
+	tc = tcase_create("pxyhttppool");
+	tcase_add_checked_fixture(tc, pxyhttppool_setup, pxyhttppool_teardown);
+	tcase_add_test(tc, pxyhttppool_01);
+	tcase_add_test(tc, pxyhttppool_02);
+	tcase_add_test(tc, pxyhttppool_03);
+	tcase_add_test(tc, pxyhttppool_04);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
@@ -28,67 +28,624 @@
 
 #include "pxythrmgr.h"
 
+#include "pxyforge.h"
+#include "proc.h"
+#include "keypool.h"
+#include "pxyconnpool.h"
+#include "pxyhttppool.h"
 #include "sys.h"
 #include "log.h"
+#include "mempool.h"
+#include "stats.h"
 
+#include <ctype.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
 #include <pthread.h>
+#include <netinet/in.h>
 
 /*
  * Proxy thread manager: manages the connection handling worker threads
  * and the per-thread resources (i.e. event bases).  The load is shared
- * across num_cpu * 2 connection handling threads, using the number of
- * currently assigned connections as the sole metric.
+ * across num_cpu * 2 connection handling threads (or as many as configured
+ * with WorkerThreads, optionally pinned to WorkerCPUs), using the number of
+ * currently assigned connections as the primary metric and the number of
+ * those still pending setup to break ties.  Which thread a new connection is
+ * attached to is decided by the selection policy configured with
+ * ThreadSelection: power of two random choices (p2c, the default), least
+ * loaded over all threads, round robin, or a hash of the client IP address.
  *
- * The attach and detach functions are thread-safe.
+ * Each thread measures the lag of its own event loop using a short recurring
+ * timer, which also keeps the event loop from exiting when it runs out of
+ * events.  A thread whose timer is overdue by more than PXY_THRMGR_LAG_STUCK
+ * is stuck, for instance in a synchronous forge or a blocking log enqueue,
+ * and is avoided by all selection policies for as long as other threads are
+ * available.  The lag samples are exported as a stats histogram.
+ *
+ * The attach and detach functions are thread-safe and wait-free; the
+ * per-thread load counters are only ever modified using atomic operations.
+ * The counters are read without synchronisation during thread selection,
+ * hence the selection may be based on slightly stale values.
+ *
+ * With ReusePortListeners, each thread additionally accepts connections on
+ * its own set of SO_REUSEPORT listener sockets; connections accepted that way
+ * are attached to the accepting thread using pxy_thrmgr_attach_thr().
+ *
+ * Each thread also keeps a small pool of freed connection context objects,
+ * which are handed out again to new connections attached to that thread.
+ * Since connections are not necessarily accepted on the thread they are
+ * attached to, the pool is protected by a mutex.
+ *
+ * With OverloadPassthrough, each thread additionally marks itself as
+ * overloaded while the smoothed lag exceeds the configured threshold or the
+ * forging queue is backlogged; new SSL connections on an overloaded thread
+ * are passed through instead of split.  Hysteresis keeps the state from
+ * flapping: the thread only leaves the overloaded state again once the lag
+ * has dropped below half of the threshold.
+ *
+ * With PreconnectPool, each thread keeps a pool of established upstream
+ * connections for each static proxyspec, indexed by the position of the
+ * proxyspec in the configuration.  The pools are created on the thread
+ * before it starts running its event loop.
+ *
+ * With ShapeRate or shape proxyspecs, each thread has a libevent rate limit
+ * group per shaped proxyspec, indexed like the pre-connect pools and created
+ * on the thread on first use.  The bufferevents of all connections of that
+ * proxyspec on the thread share the group's bandwidth.
+ *
+ * Unless ForgeThreads is 0, the thread manager also owns the certificate
+ * forging thread pool, which needs to be torn down after the connection
+ * handling threads have stopped but before their event bases are freed.
+ *
+ * With ForgeStealing, flights queued to the forging thread pool while all
+ * forging threads are busy are stolen by idle connection handling threads,
+ * that is threads without connections pending setup and with low event loop
+ * lag.  A stealing thread runs one flight per event loop iteration for as
+ * long as it stays idle and the queue is not empty, so that its own
+ * connections are not delayed by more than a single forge.
  */
 
+typedef struct pxy_thr_shape {
+	struct bufferevent_rate_limit_group *group;
+	size_t rate;
+	size_t burst;
+} pxy_thr_shape_t;
+
+/*
+ * Maximum number of reset outgoing SSL instances to keep per thread.
+ */
+#define PXY_THRMGR_SSLPOOL_MAX	32
+
 typedef struct pxy_thr_ctx {
 	pthread_t thr;
 	size_t load;
+	size_t pending;
 	struct event_base *evbase;
 	struct evdns_base *dnsbase;
 	int running;
+	int cpu;
+	int dns;
+	pthread_mutex_t pool_mutex;
+	void *pool;
+	pthread_mutex_t conns_mutex;
+	pxy_thr_link_t *conns;
+	size_t pool_len;
+	SSL *sslpool[PXY_THRMGR_SSLPOOL_MAX];
+	size_t sslpool_len;
+	size_t sslpool_next;
+	opts_t *opts;
+	pxy_connpool_t **connpool;
+	size_t connpool_len;
+	pxy_httppool_t *httppool;
+	int idx;
+	pxy_forge_ctx_t *forge;
+	struct event *lagev;
+	long long lagdue;
+	unsigned int lag;
+	int overloaded;
+	int stealing;
+	size_t rate;
+	logjson_t *json;
+	logroll_t *rollup;
+	tmwheel_t *wheel;
+	pthread_mutex_t shape_mutex;
+	pxy_thr_shape_t *shape;
+	size_t shape_len;
+#ifdef HAVE_IOURING
+	iouring_t *uring;
+#endif /* HAVE_IOURING */
+#ifdef HAVE_LIBCTX
+	/* own OpenSSL library context with WorkerLibCtx, and the upstream
+	 * SSL_CTX created from it for the configuration dstopts */
+	OSSL_LIB_CTX *libctx;
+	SSL_CTX *dstsslctx;
+	opts_t *dstopts;
+#endif /* HAVE_LIBCTX */
 } pxy_thr_ctx_t;
 
+/*
+ * Interval in milliseconds at which event loop lag is sampled.
+ */
+#define PXY_THRMGR_LAG_INTERVAL	50
+
+/*
+ * Lag in milliseconds above which a thread is considered stuck and not
+ * assigned new connections unless all threads are stuck.
+ */
+#define PXY_THRMGR_LAG_STUCK	100
+
+/*
+ * Lag in milliseconds below which a thread without connections pending setup
+ * is considered idle for ForgeStealing.
+ */
+#define PXY_THRMGR_STEAL_LAG	5
+
+/*
+ * Initial size of the per-thread buffer for formatting JSON connect log
+ * lines; grows if a line does not fit.
+ */
+#define PXY_THRMGR_JSON_SZ	4096
+
+/*
+ * Refill interval in milliseconds of the traffic shaping token buckets;
+ * short enough to keep bursts small, at the cost of more timer events.
+ */
+#define PXY_THRMGR_SHAPE_TICK	100
+
+/*
+ * Number of per-source admission counter buckets, as a power of two.
+ */
+#define PXY_THRMGR_ADMIT_BITS	14
+
+/*
+ * Resolution in milliseconds of the per-thread timing wheel driving the
+ * connection timeouts.
+ */
+#define PXY_THRMGR_WHEEL_TICK	100
+
+#ifdef HAVE_IOURING
+/*
+ * Size of the per-thread io_uring used with IOUringForward: submission queue
+ * entries, and number and size of the registered buffers.  Each connection
+ * forwarded through io_uring uses two buffers.
+ */
+#define PXY_THRMGR_URING_ENTRIES	1024
+#define PXY_THRMGR_URING_BUFS		512
+#define PXY_THRMGR_URING_BUFSZ		(16*1024)
+#endif /* HAVE_IOURING */
+
+/*
+ * Load imbalance tolerated by the snihash policy, in percent above the mean
+ * load of the worker pool, before a name spills over to its next thread.
+ */
+#define PXY_THRMGR_SNI_SLACK	25
+
+/*
+ * Forwarding rate in percent above the mean rate of the worker pool from
+ * which RebalanceInterval moves connections off a thread.
+ */
+#define PXY_THRMGR_REBALANCE_SLACK	25
+
+/*
+ * Maximum number of freed connection contexts to keep per thread.
+ */
+#define PXY_THRMGR_POOL_MAX	64
+
+/*
+ * Contiguous range of connection handling threads forming a worker pool.
+ * Pool 0 is the default pool, followed by the named pools of WorkerPool in
+ * the order they are configured.
+ */
+typedef struct pxy_thrmgr_wpool {
+	int first;
+	int num_thr;
+} pxy_thrmgr_wpool_t;
+
 struct pxy_thrmgr_ctx {
 	int num_thr;
+	int num_wpool;
+	pxy_thrmgr_wpool_t wpool[1 + OPTS_WORKERPOOL_MAX];
 	opts_t *opts;
 	pxy_thr_ctx_t **thr;
-	pthread_mutex_t mutex;
+	pxy_forge_ctx_t *forge;
+	keypool_t *keypool;
+	admit_t *admit;
+	unsigned int seq;
 };
 
+#define PXY_THRMGR_LOAD(ctx, idx) \
+	__atomic_load_n(&(ctx)->thr[(idx)]->load, __ATOMIC_RELAXED)
+#define PXY_THRMGR_PENDING(ctx, idx) \
+	__atomic_load_n(&(ctx)->thr[(idx)]->pending, __ATOMIC_RELAXED)
+
 /*
- * Dummy recurring timer event to prevent the event loops from exiting when
- * they run out of events.
+ * Release the objects in the connection context and SSL pools of a thread and
+ * the pool mutex.
  */
 static void
-pxy_thrmgr_timer_cb(UNUSED evutil_socket_t fd, UNUSED short what,
-                    UNUSED void *arg)
+pxy_thrmgr_pool_free(pxy_thr_ctx_t *thr)
 {
-	/* do nothing */
+	void *next;
+
+	while (thr->pool) {
+		next = *(void **)thr->pool;
+		mempool_huge_free(thr->pool);
+		thr->pool = next;
+	}
+	while (thr->sslpool_len > 0)
+		SSL_free(thr->sslpool[--thr->sslpool_len]);
+	pthread_mutex_destroy(&thr->pool_mutex);
+	pthread_mutex_destroy(&thr->conns_mutex);
+}
+
+/*
+ * Release the pre-connect pools of a thread.  Must be called after the
+ * thread has stopped, but before its event base is freed.
+ */
+/*
+ * Free the per-thread upstream SSL_CTX.  The library context itself is freed
+ * by ssl_fini(), as cached SSL_CTXs created from it may outlive the thread.
+ */
+static void
+pxy_thrmgr_dstsslctx_free(UNUSED pxy_thr_ctx_t *thr)
+{
+#ifdef HAVE_LIBCTX
+	if (thr->dstsslctx)
+		SSL_CTX_free(thr->dstsslctx);
+	if (thr->dstopts)
+		opts_unref(thr->dstopts);
+	thr->dstsslctx = NULL;
+	thr->dstopts = NULL;
+#endif /* HAVE_LIBCTX */
+}
+
+/*
+ * Close the connections of the pre-connect and keep-alive pools of a thread.
+ * Must be called after the thread has stopped.
+ */
+static void
+pxy_thrmgr_connpool_free(pxy_thr_ctx_t *thr)
+{
+	if (thr->httppool) {
+		pxy_httppool_free(thr->httppool);
+		thr->httppool = NULL;
+	}
+	if (!thr->connpool)
+		return;
+	for (size_t i = 0; i < thr->connpool_len; i++) {
+		if (thr->connpool[i])
+			pxy_connpool_free(thr->connpool[i]);
+	}
+	free(thr->connpool);
+	thr->connpool = NULL;
+}
+
+/*
+ * Release the rate limit groups of a thread.  Must be called after the
+ * thread has stopped, but before its event base is freed.  Groups still
+ * having connections cannot be freed and are left to process exit.
+ */
+static void
+pxy_thrmgr_shape_free(pxy_thr_ctx_t *thr)
+{
+	if (thr->shape && __atomic_load_n(&thr->load, __ATOMIC_RELAXED) == 0) {
+		for (size_t i = 0; i < thr->shape_len; i++) {
+			if (thr->shape[i].group)
+				bufferevent_rate_limit_group_free(
+				        thr->shape[i].group);
+		}
+	}
+	free(thr->shape);
+	thr->shape = NULL;
+	pthread_mutex_destroy(&thr->shape_mutex);
+}
+
+/*
+ * Create the pre-connect pools of a thread for all static proxyspecs.
+ * Must be called on the thread, after creating its event base.
+ * Returns -1 on failure, 0 on success.
+ */
+static int
+pxy_thrmgr_connpool_new(pxy_thr_ctx_t *thr)
+{
+	proxyspec_t *spec;
+	size_t i;
+
+	for (spec = thr->opts->spec; spec; spec = spec->next)
+		thr->connpool_len++;
+	thr->connpool = malloc(thr->connpool_len * sizeof(pxy_connpool_t *));
+	if (!thr->connpool)
+		return -1;
+	memset(thr->connpool, 0, thr->connpool_len * sizeof(pxy_connpool_t *));
+	for (spec = thr->opts->spec, i = 0; spec; spec = spec->next, i++) {
+		if (spec->natlookup || !spec->connect_addrlen)
+			continue;
+		thr->connpool[i] = pxy_connpool_new(thr->evbase,
+		                   (struct sockaddr *)&spec->connect_addr,
+		                   spec->connect_addrlen,
+		                   thr->opts->preconnect);
+		if (!thr->connpool[i])
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Arm the lag probe timer of a thread to fire PXY_THRMGR_LAG_INTERVAL
+ * milliseconds after now.
+ */
+static void
+pxy_thrmgr_lag_arm(pxy_thr_ctx_t *ctx, long long now)
+{
+	struct timeval tv = {0, PXY_THRMGR_LAG_INTERVAL * 1000};
+
+	__atomic_store_n(&ctx->lagdue, now + PXY_THRMGR_LAG_INTERVAL * 1000,
+	                 __ATOMIC_RELAXED);
+	evtimer_add(ctx->lagev, &tv);
+}
+
+/*
+ * Update the overload state of a thread for OverloadPassthrough.
+ */
+static void
+pxy_thrmgr_overload_update(pxy_thr_ctx_t *ctx)
+{
+	unsigned int maxlag = ctx->opts->overload_lag * 1000;
+	int was, overloaded;
+
+	was = ctx->overloaded;
+	if (was) {
+		overloaded = ctx->lag > maxlag / 2 ||
+		             (ctx->forge && pxy_forge_backlogged(ctx->forge, 1));
+	} else {
+		overloaded = ctx->lag > maxlag ||
+		             (ctx->forge && pxy_forge_backlogged(ctx->forge, 0));
+	}
+	if (overloaded != was) {
+		__atomic_store_n(&ctx->overloaded, overloaded,
+		                 __ATOMIC_RELAXED);
+		if (overloaded) {
+			log_err_printf("Warning: Thread %d overloaded (lag %ums); "
+			               "passing through new SSL connections\n",
+			               ctx->idx, ctx->lag / 1000);
+		} else {
+			log_err_printf("Thread %d no longer overloaded (lag "
+			               "%ums); splitting new SSL connections\n",
+			               ctx->idx, ctx->lag / 1000);
+		}
+	}
+}
+
+/*
+ * Lag probe timer; the time by which the timer fires late is a measure for
+ * how long callbacks on this event loop are made to wait.  Samples are
+ * recorded in the loop lag histogram and smoothed into ctx->lag, in
+ * microseconds, for OverloadPassthrough.
+ */
+static void
+pxy_thrmgr_lag_cb(UNUSED evutil_socket_t fd, UNUSED short what, void *arg)
+{
+	pxy_thr_ctx_t *ctx = arg;
+	long long now, sample;
+
+	now = stats_usec();
+	sample = now - ctx->lagdue;
+	if (sample < 0)
+		sample = 0;
+	stats_observe(STATS_HIST_LOOPLAG, sample);
+	if (sample > UINT_MAX)
+		sample = UINT_MAX;
+	__atomic_store_n(&ctx->lag, (unsigned int)((ctx->lag * 3ULL + sample) / 4),
+	                 __ATOMIC_RELAXED);
+	if (ctx->opts->overload_lag > 0)
+		pxy_thrmgr_overload_update(ctx);
+	pxy_thrmgr_lag_arm(ctx, now);
+}
+
+/*
+ * Pseudo-random number for thread selection, derived from a shared sequence
+ * counter using the splitmix32 finalizer.  Not suitable for anything else.
+ */
+static unsigned int
+pxy_thrmgr_rand(pxy_thrmgr_ctx_t *ctx)
+{
+	unsigned int x;
+
+	x = __atomic_fetch_add(&ctx->seq, 0x9e3779b9U, __ATOMIC_RELAXED);
+	x ^= x >> 16;
+	x *= 0x85ebca6bU;
+	x ^= x >> 13;
+	x *= 0xc2b2ae35U;
+	x ^= x >> 16;
+	return x;
+}
+
+/*
+ * Return 1 if thread ctx is idle enough to steal work from the forging
+ * thread pool, 0 otherwise.
+ */
+static int
+pxy_thrmgr_idle(pxy_thr_ctx_t *ctx)
+{
+	return __atomic_load_n(&ctx->running, __ATOMIC_ACQUIRE) == 1 &&
+	       __atomic_load_n(&ctx->pending, __ATOMIC_RELAXED) == 0 &&
+	       __atomic_load_n(&ctx->lag, __ATOMIC_RELAXED) <
+	       PXY_THRMGR_STEAL_LAG * 1000;
+}
+
+/*
+ * Run a queued flight of the forging thread pool on this thread, and keep
+ * coming back for more on the next event loop iteration while idle.
+ */
+static void
+pxy_thrmgr_steal_cb(UNUSED evutil_socket_t fd, UNUSED short what, void *arg)
+{
+	pxy_thr_ctx_t *ctx = arg;
+
+	if (pxy_thrmgr_idle(ctx) && pxy_forge_steal(ctx->forge)) {
+		stats_inc(STATS_FORGE_STOLEN);
+		if (event_base_once(ctx->evbase, -1, EV_TIMEOUT,
+		                    pxy_thrmgr_steal_cb, ctx, NULL) == 0)
+			return;
+	}
+	__atomic_store_n(&ctx->stealing, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Steal callback of the forging thread pool; hands the queued flight to an
+ * idle thread not already stealing, if there is one.
+ */
+static void
+pxy_thrmgr_steal(void *arg)
+{
+	pxy_thrmgr_ctx_t *ctx = arg;
+	int start;
+
+	start = pxy_thrmgr_rand(ctx) % (unsigned int)ctx->num_thr;
+	for (int i = 0; i < ctx->num_thr; i++) {
+		pxy_thr_ctx_t *thr = ctx->thr[(start + i) % ctx->num_thr];
+		int expected = 0;
+
+		if (!pxy_thrmgr_idle(thr) ||
+		    !__atomic_compare_exchange_n(&thr->stealing, &expected, 1,
+		                                 0, __ATOMIC_ACQUIRE,
+		                                 __ATOMIC_RELAXED))
+			continue;
+		if (event_base_once(thr->evbase, -1, EV_TIMEOUT,
+		                    pxy_thrmgr_steal_cb, thr, NULL) == -1) {
+			__atomic_store_n(&thr->stealing, 0, __ATOMIC_RELEASE);
+			continue;
+		}
+		return;
+	}
 }
 
 /*
  * Thread entry point; runs the event loop of the event base.
  * Does not exit until the libevent loop is broken explicitly.
+ * If a CPU is configured for the thread, the thread pins itself to that CPU
+ * before allocating its event bases, such that with the default first-touch
+ * memory policy of the OS, all per-thread libevent state ends up on the NUMA
+ * node of that CPU.
  */
 static void *
 pxy_thrmgr_thr(void *arg)
 {
 	pxy_thr_ctx_t *ctx = arg;
-	struct timeval timer_delay = {60, 0};
-	struct event *ev;
 
-	ev = event_new(ctx->evbase, -1, EV_PERSIST, pxy_thrmgr_timer_cb, NULL);
-	if (!ev)
-		return NULL;
-	evtimer_add(ev, &timer_delay);
-	ctx->running = 1;
+	if (ctx->cpu >= 0 && sys_thread_setcpu(ctx->cpu) == -1) {
+		log_err_printf("Warning: Failed to pin thread to CPU %d: "
+		               "%s (%i)\n", ctx->cpu, strerror(errno), errno);
+	}
+	stats_perf_worker(ctx->idx);
+	ctx->evbase = event_base_new();
+	if (!ctx->evbase) {
+		log_dbg_printf("Failed to create evbase\n");
+		goto errout;
+	}
+	if (event_base_priority_init(ctx->evbase, PXY_NPRIOS) == -1) {
+		log_dbg_printf("Failed to set up evbase priorities\n");
+		goto errout;
+	}
+	if (ctx->dns) {
+		/* only create dns base if we actually need it later */
+		ctx->dnsbase = evdns_base_new(ctx->evbase, 1);
+		if (!ctx->dnsbase) {
+			log_dbg_printf("Failed to create dnsbase\n");
+			goto errout;
+		}
+	}
+	if (ctx->opts->preconnect > 0 && pxy_thrmgr_connpool_new(ctx) == -1) {
+		log_dbg_printf("Failed to create pre-connect pools\n");
+		goto errout;
+	}
+	if (ctx->opts->http_upstream_pool > 0) {
+		ctx->httppool = pxy_httppool_new(ctx->evbase,
+		                                 ctx->opts->http_upstream_pool);
+		if (!ctx->httppool) {
+			log_dbg_printf("Failed to create HTTP upstream pool\n");
+			goto errout;
+		}
+	}
+	ctx->lagev = evtimer_new(ctx->evbase, pxy_thrmgr_lag_cb, ctx);
+	if (!ctx->lagev)
+		goto errout;
+	pxy_thrmgr_lag_arm(ctx, stats_usec());
+	ctx->wheel = tmwheel_new(ctx->evbase, PXY_THRMGR_WHEEL_TICK);
+	if (!ctx->wheel)
+		goto errout;
+#ifdef HAVE_IOURING
+	if (ctx->opts->iouring &&
+	    !(ctx->uring = iouring_new(ctx->evbase, PXY_THRMGR_URING_ENTRIES,
+	                               PXY_THRMGR_URING_BUFS,
+	                               PXY_THRMGR_URING_BUFSZ))) {
+		log_err_printf("Warning: Failed to set up io_uring, "
+		               "forwarding without it\n");
+	}
+#endif /* HAVE_IOURING */
+	__atomic_store_n(&ctx->running, 1, __ATOMIC_RELEASE);
 	event_base_dispatch(ctx->evbase);
-	event_free(ev);
+#ifdef HAVE_IOURING
+	if (ctx->uring)
+		iouring_free(ctx->uring);
+#endif /* HAVE_IOURING */
+	tmwheel_free(ctx->wheel);
+	event_free(ctx->lagev);
 
 	return NULL;
+
+errout:
+	__atomic_store_n(&ctx->running, -1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/*
+ * Order a list of n CPUs, such as WorkerCPUs, for assignment to threads.
+ * CPUs are grouped by NUMA node and then handed out interleaved across
+ * nodes, such that threads are spread evenly over all nodes even if there are
+ * fewer threads than CPUs.  CPUs with unknown node are treated as node 0.
+ * Returns a newly allocated array of n CPUs, or NULL.
+ */
+static int *
+pxy_thrmgr_cpumap(const int *cpus, int n)
+{
+	int *node, *map, *next;
+	int nodes = 1, i, j;
+
+	if (!(map = malloc(n * sizeof(int))))
+		return NULL;
+	if (!(node = malloc(n * sizeof(int)))) {
+		free(map);
+		return NULL;
+	}
+	for (i = 0; i < n; i++) {
+		node[i] = sys_get_cpu_node(cpus[i]);
+		if (node[i] < 0)
+			node[i] = 0;
+		if (node[i] + 1 > nodes)
+			nodes = node[i] + 1;
+	}
+	if (!(next = malloc(nodes * sizeof(int)))) {
+		free(node);
+		free(map);
+		return NULL;
+	}
+	/* next[k] is the position in the list to continue scanning node k */
+	memset(next, 0, nodes * sizeof(int));
+	for (i = 0, j = 0; i < n; j = (j + 1) % nodes) {
+		while (next[j] < n && node[next[j]] != j)
+			next[j]++;
+		if (next[j] < n) {
+			map[i++] = cpus[next[j]];
+			next[j]++;
+		}
+	}
+	free(next);
+	free(node);
+	return map;
 }
 
 /*
@@ -105,7 +662,37 @@ pxy_thrmgr_new(opts_t *opts)
 	memset(ctx, 0, sizeof(pxy_thrmgr_ctx_t));
 
 	ctx->opts = opts;
-	ctx->num_thr = 2 * sys_get_cpu_cores();
+	if (opts->worker_threads > 0) {
+		ctx->num_thr = opts->worker_threads;
+	} else {
+		ctx->num_thr = 2 * sys_get_cpu_cores();
+	}
+	ctx->wpool[0].num_thr = ctx->num_thr;
+	for (int i = 0; i < opts->workerpool_count; i++) {
+		ctx->wpool[i + 1].first = ctx->num_thr;
+		ctx->wpool[i + 1].num_thr = opts->workerpool[i].threads;
+		ctx->num_thr += opts->workerpool[i].threads;
+	}
+	ctx->num_wpool = 1 + opts->workerpool_count;
+	if (!(ctx->admit = admit_new(PXY_THRMGR_ADMIT_BITS))) {
+		free(ctx);
+		return NULL;
+	}
+	if (opts->leafkey_pool > 0 && opts->cakey &&
+	    !(ctx->keypool = keypool_new(opts->leafkey_pool,
+	                                 opts->leafkey_ec))) {
+		admit_free(ctx->admit);
+		free(ctx);
+		return NULL;
+	}
+	if (opts->forge_threads > 0 &&
+	    !(ctx->forge = pxy_forge_new(opts, ctx->keypool))) {
+		if (ctx->keypool)
+			keypool_free(ctx->keypool);
+		admit_free(ctx->admit);
+		free(ctx);
+		return NULL;
+	}
 	return ctx;
 }
 
@@ -118,15 +705,10 @@ pxy_thrmgr_new(opts_t *opts)
 int
 pxy_thrmgr_run(pxy_thrmgr_ctx_t *ctx)
 {
-	int idx = -1, dns = 0;
+	int idx = -1, dns = 0, running;
 
 	dns = opts_has_dns_spec(ctx->opts);
 
-	if (pthread_mutex_init(&ctx->mutex, NULL)) {
-		log_dbg_printf("Failed to initialize mutex\n");
-		goto leave;
-	}
-
 	if (!(ctx->thr = malloc(ctx->num_thr * sizeof(pxy_thr_ctx_t*)))) {
 		log_dbg_printf("Failed to allocate memory\n");
 		goto leave;
@@ -139,65 +721,139 @@ pxy_thrmgr_run(pxy_thrmgr_ctx_t *ctx)
 			goto leave;
 		}
 		memset(ctx->thr[idx], 0, sizeof(pxy_thr_ctx_t));
-		ctx->thr[idx]->evbase = event_base_new();
-		if (!ctx->thr[idx]->evbase) {
-			log_dbg_printf("Failed to create evbase %d\n", idx);
+		pthread_mutex_init(&ctx->thr[idx]->pool_mutex, NULL);
+		pthread_mutex_init(&ctx->thr[idx]->conns_mutex, NULL);
+		pthread_mutex_init(&ctx->thr[idx]->shape_mutex, NULL);
+		ctx->thr[idx]->cpu = -1;
+		ctx->thr[idx]->dns = dns;
+		ctx->thr[idx]->opts = ctx->opts;
+		ctx->thr[idx]->idx = idx;
+		ctx->thr[idx]->forge = ctx->forge;
+		ctx->thr[idx]->load = 0;
+		ctx->thr[idx]->running = 0;
+		if (ctx->opts->connectlog_json &&
+		    !(ctx->thr[idx]->json = logjson_new(PXY_THRMGR_JSON_SZ))) {
+			log_dbg_printf("Failed to allocate memory\n");
 			goto leave;
 		}
-		if (dns) {
-			/* only create dns base if we actually need it later */
-			ctx->thr[idx]->dnsbase = evdns_base_new(
-			                         ctx->thr[idx]->evbase, 1);
-			if (!ctx->thr[idx]->dnsbase) {
-				log_dbg_printf("Failed to create dnsbase %d\n",
-				               idx);
-				goto leave;
-			}
+		if (ctx->opts->connectlog_rollup &&
+		    !(ctx->thr[idx]->rollup = logroll_new())) {
+			log_dbg_printf("Failed to allocate memory\n");
+			goto leave;
 		}
-		ctx->thr[idx]->load = 0;
-		ctx->thr[idx]->running = 0;
+#ifdef HAVE_LIBCTX
+		if (ctx->opts->worker_libctx &&
+		    !(ctx->thr[idx]->libctx = ssl_libctx_new())) {
+			log_dbg_printf("Failed to create OpenSSL library "
+			               "context\n");
+			goto leave;
+		}
+#endif /* HAVE_LIBCTX */
 	}
 
-	log_dbg_printf("Initialized %d connection handling threads\n",
-	               ctx->num_thr);
+	for (int i = 0; i < ctx->num_wpool; i++) {
+		pxy_thrmgr_wpool_t *wpool = &ctx->wpool[i];
+		const int *cpus;
+		int ncpus, *cpumap;
+
+		if (i == 0) {
+			cpus = ctx->opts->worker_cpus;
+			ncpus = ctx->opts->worker_cpus_count;
+		} else {
+			cpus = ctx->opts->workerpool[i - 1].cpus;
+			ncpus = ctx->opts->workerpool[i - 1].cpus_count;
+		}
+		if (ncpus == 0)
+			continue;
+		if (!(cpumap = pxy_thrmgr_cpumap(cpus, ncpus))) {
+			log_dbg_printf("Failed to allocate memory\n");
+			idx = ctx->num_thr - 1;
+			goto leave;
+		}
+		for (int j = 0; j < wpool->num_thr; j++) {
+			ctx->thr[wpool->first + j]->cpu = cpumap[j % ncpus];
+		}
+		free(cpumap);
+	}
+
+	log_dbg_printf("Initialized %d connection handling threads in %d "
+	               "worker pools, selection policy %s\n", ctx->num_thr,
+	               ctx->num_wpool, opts_thrsel_str(ctx->opts->thrsel));
 
 	for (idx = 0; idx < ctx->num_thr; idx++) {
 		if (pthread_create(&ctx->thr[idx]->thr, NULL,
 		                   pxy_thrmgr_thr, ctx->thr[idx]))
 			goto leave_thr;
-		while (!ctx->thr[idx]->running) {
+		while (!(running = __atomic_load_n(&ctx->thr[idx]->running,
+		                                   __ATOMIC_ACQUIRE))) {
 			sched_yield();
 		}
+		if (running == -1) {
+			log_dbg_printf("Failed to start thread %d\n", idx);
+			pthread_join(ctx->thr[idx]->thr, NULL);
+			goto leave_thr;
+		}
+		if (ctx->thr[idx]->cpu >= 0) {
+			log_dbg_printf("Thread %d pinned to CPU %d\n",
+			               idx, ctx->thr[idx]->cpu);
+		}
 	}
 
 	log_dbg_printf("Started %d connection handling threads\n",
 	               ctx->num_thr);
 
+	if (ctx->keypool && keypool_run(ctx->keypool) == -1) {
+		log_dbg_printf("Failed to start key pool thread\n");
+		idx = ctx->num_thr;
+		goto leave_thr;
+	}
+
+	if (ctx->forge && ctx->opts->forge_steal)
+		pxy_forge_set_steal(ctx->forge, pxy_thrmgr_steal, ctx);
+	if (ctx->forge && pxy_forge_run(ctx->forge) == -1) {
+		log_dbg_printf("Failed to start forging threads\n");
+		idx = ctx->num_thr;
+		goto leave_thr;
+	}
+
+#ifdef HAVE_LOCAL_PROCINFO
+	if (ctx->opts->lprocinfo && proc_lookup_run() == -1) {
+		log_dbg_printf("Failed to start process lookup thread\n");
+		idx = ctx->num_thr;
+		goto leave_thr;
+	}
+#endif /* HAVE_LOCAL_PROCINFO */
+
 	return 0;
 
 leave_thr:
-	idx--;
-	while (idx >= 0) {
-		pthread_cancel(ctx->thr[idx]->thr);
-		pthread_join(ctx->thr[idx]->thr, NULL);
-		idx--;
+	for (int i = idx - 1; i >= 0; i--) {
+		event_base_loopbreak(ctx->thr[i]->evbase);
+		pthread_join(ctx->thr[i]->thr, NULL);
 	}
 	idx = ctx->num_thr - 1;
 
 leave:
 	while (idx >= 0) {
 		if (ctx->thr[idx]) {
+			pxy_thrmgr_connpool_free(ctx->thr[idx]);
+			pxy_thrmgr_shape_free(ctx->thr[idx]);
 			if (ctx->thr[idx]->dnsbase) {
 				evdns_base_free(ctx->thr[idx]->dnsbase, 0);
 			}
 			if (ctx->thr[idx]->evbase) {
 				event_base_free(ctx->thr[idx]->evbase);
 			}
+			pxy_thrmgr_pool_free(ctx->thr[idx]);
+			if (ctx->thr[idx]->json)
+				logjson_free(ctx->thr[idx]->json);
+			if (ctx->thr[idx]->rollup)
+				logroll_free(ctx->thr[idx]->rollup);
+			pxy_thrmgr_dstsslctx_free(ctx->thr[idx]);
 			free(ctx->thr[idx]);
 		}
 		idx--;
 	}
-	pthread_mutex_destroy(&ctx->mutex);
 	if (ctx->thr) {
 		free(ctx->thr);
 		ctx->thr = NULL;
@@ -211,7 +867,6 @@ leave:
 void
 pxy_thrmgr_free(pxy_thrmgr_ctx_t *ctx)
 {
-	pthread_mutex_destroy(&ctx->mutex);
 	if (ctx->thr) {
 		for (int idx = 0; idx < ctx->num_thr; idx++) {
 			event_base_loopbreak(ctx->thr[idx]->evbase);
@@ -220,53 +875,301 @@ pxy_thrmgr_free(pxy_thrmgr_ctx_t *ctx)
 		for (int idx = 0; idx < ctx->num_thr; idx++) {
 			pthread_join(ctx->thr[idx]->thr, NULL);
 		}
+		if (ctx->forge)
+			pxy_forge_free(ctx->forge);
+#ifdef HAVE_LOCAL_PROCINFO
+		proc_lookup_stop();
+#endif /* HAVE_LOCAL_PROCINFO */
 		for (int idx = 0; idx < ctx->num_thr; idx++) {
+			pxy_thrmgr_connpool_free(ctx->thr[idx]);
+			pxy_thrmgr_shape_free(ctx->thr[idx]);
 			if (ctx->thr[idx]->dnsbase) {
 				evdns_base_free(ctx->thr[idx]->dnsbase, 0);
 			}
 			if (ctx->thr[idx]->evbase) {
 				event_base_free(ctx->thr[idx]->evbase);
 			}
+			pxy_thrmgr_pool_free(ctx->thr[idx]);
+			if (ctx->thr[idx]->json)
+				logjson_free(ctx->thr[idx]->json);
+			if (ctx->thr[idx]->rollup)
+				logroll_free(ctx->thr[idx]->rollup);
+			pxy_thrmgr_dstsslctx_free(ctx->thr[idx]);
 			free(ctx->thr[idx]);
 		}
 		free(ctx->thr);
+	} else if (ctx->forge) {
+		pxy_forge_free(ctx->forge);
 	}
+	if (ctx->keypool)
+		keypool_free(ctx->keypool);
+	admit_free(ctx->admit);
 	free(ctx);
 }
 
 /*
- * Attach a new connection to a thread.  Chooses the thread with the fewest
- * currently active connections, returns the appropriate event bases.
- * Returns the index of the chosen thread (for passing to _detach later).
- * This function cannot fail.
+ * Hash the IP address of peeraddr, ignoring the port.
+ */
+static unsigned int
+pxy_thrmgr_hash_addr(const struct sockaddr *peeraddr)
+{
+	const unsigned char *p;
+	unsigned int h = 2166136261U;
+	size_t sz;
+
+	switch (peeraddr->sa_family) {
+	case AF_INET:
+		p = (const unsigned char *)
+		    &((const struct sockaddr_in *)peeraddr)->sin_addr;
+		sz = sizeof(struct in_addr);
+		break;
+	case AF_INET6:
+		p = (const unsigned char *)
+		    &((const struct sockaddr_in6 *)peeraddr)->sin6_addr;
+		sz = sizeof(struct in6_addr);
+		break;
+	default:
+		return 0;
+	}
+	for (size_t i = 0; i < sz; i++) {
+		h ^= p[i];
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/*
+ * Return 1 if thread idx is stuck, 0 otherwise.  A thread is stuck if its
+ * smoothed lag is above PXY_THRMGR_LAG_STUCK, or if its lag probe timer is
+ * overdue by more than that, which catches a thread blocked in a long
+ * running callback before the lag probe gets to run again.
+ */
+static int
+pxy_thrmgr_stuck(pxy_thrmgr_ctx_t *ctx, int idx, long long now)
+{
+	long long due;
+
+	if (__atomic_load_n(&ctx->thr[idx]->lag, __ATOMIC_RELAXED) >
+	    PXY_THRMGR_LAG_STUCK * 1000)
+		return 1;
+	due = __atomic_load_n(&ctx->thr[idx]->lagdue, __ATOMIC_RELAXED);
+	return due > 0 && now - due > PXY_THRMGR_LAG_STUCK * 1000;
+}
+
+/*
+ * Return 1 if thread b is a better choice for a new connection than thread
+ * a, 0 otherwise.
+ */
+static int
+pxy_thrmgr_better(pxy_thrmgr_ctx_t *ctx, int a, int b, long long now)
+{
+	int stucka, stuckb;
+	size_t loada, loadb;
+
+	stucka = pxy_thrmgr_stuck(ctx, a, now);
+	stuckb = pxy_thrmgr_stuck(ctx, b, now);
+	if (stucka != stuckb)
+		return stucka;
+	loada = PXY_THRMGR_LOAD(ctx, a);
+	loadb = PXY_THRMGR_LOAD(ctx, b);
+	if (loada != loadb)
+		return loadb < loada;
+	return PXY_THRMGR_PENDING(ctx, b) < PXY_THRMGR_PENDING(ctx, a);
+}
+
+/*
+ * Return thridx, or if thread thridx is stuck, the next thread of worker pool
+ * wpool that is not.  Returns thridx if all threads of the pool are stuck.
+ */
+static int
+pxy_thrmgr_unstuck(pxy_thrmgr_ctx_t *ctx, pxy_thrmgr_wpool_t *wpool,
+                   int thridx, long long now)
+{
+	for (int i = 0; i < wpool->num_thr; i++) {
+		int idx = wpool->first +
+		          (thridx - wpool->first + i) % wpool->num_thr;
+
+		if (!pxy_thrmgr_stuck(ctx, idx, now))
+			return idx;
+	}
+	return thridx;
+}
+
+/*
+ * Choose a thread of worker pool wpool for a new connection according to the
+ * configured policy, avoiding stuck threads.  Peeraddr is used for client IP
+ * hashing and may be NULL.  Does not attach anything to the chosen thread;
+ * callers hand the connection to pxy_thrmgr_attach_thr() eventually.
  */
 int
-pxy_thrmgr_attach(pxy_thrmgr_ctx_t *ctx, struct event_base **evbase,
-                  struct evdns_base **dnsbase)
+pxy_thrmgr_select(pxy_thrmgr_ctx_t *ctx, int wpoolidx,
+                  const struct sockaddr *peeraddr)
 {
-	int thridx;
-	size_t minload;
+	pxy_thrmgr_wpool_t *wpool = &ctx->wpool[wpoolidx];
+	long long now = stats_usec();
+	int thridx, idx;
 
-	thridx = 0;
-	pthread_mutex_lock(&ctx->mutex);
-	minload = ctx->thr[thridx]->load;
+	switch (ctx->opts->thrsel) {
+	case THRSEL_ROUNDROBIN:
+		thridx = wpool->first +
+		         __atomic_fetch_add(&ctx->seq, 1, __ATOMIC_RELAXED)
+		         % (unsigned int)wpool->num_thr;
+		return pxy_thrmgr_unstuck(ctx, wpool, thridx, now);
+	case THRSEL_CLIENTHASH:
+		if (peeraddr) {
+			thridx = wpool->first + pxy_thrmgr_hash_addr(peeraddr)
+			         % (unsigned int)wpool->num_thr;
+			return pxy_thrmgr_unstuck(ctx, wpool, thridx, now);
+		}
+		/* fall through */
+	case THRSEL_SNIHASH:
+		/* without a name, see pxy_thrmgr_select_sni() */
+	case THRSEL_P2C:
+		if (wpool->num_thr > 1) {
+			thridx = pxy_thrmgr_rand(ctx) % wpool->num_thr;
+			idx = pxy_thrmgr_rand(ctx) % (wpool->num_thr - 1);
+			if (idx >= thridx)
+				idx++;
+			thridx += wpool->first;
+			idx += wpool->first;
 #ifdef DEBUG_THREAD
-	log_dbg_printf("===> Proxy connection handler thread status:\n"
-	               "thr[%d]: %zu\n", thridx, minload);
+			log_dbg_printf("thr[%d]: %zu/%zu thr[%d]: %zu/%zu\n",
+			               thridx, PXY_THRMGR_LOAD(ctx, thridx),
+			               PXY_THRMGR_PENDING(ctx, thridx),
+			               idx, PXY_THRMGR_LOAD(ctx, idx),
+			               PXY_THRMGR_PENDING(ctx, idx));
 #endif /* DEBUG_THREAD */
-	for (int idx = 1; idx < ctx->num_thr; idx++) {
+			if (pxy_thrmgr_better(ctx, thridx, idx, now))
+				thridx = idx;
+			/* both candidates stuck */
+			if (pxy_thrmgr_stuck(ctx, thridx, now))
+				thridx = pxy_thrmgr_unstuck(ctx, wpool,
+				                            thridx, now);
+			return thridx;
+		}
+		return wpool->first;
+	case THRSEL_LEASTLOADED:
+	default:
+		thridx = wpool->first;
 #ifdef DEBUG_THREAD
-		log_dbg_printf("thr[%d]: %zu\n", idx, ctx->thr[idx]->load);
+		log_dbg_printf("===> Proxy connection handler thread status:\n"
+		               "thr[%d]: %zu/%zu\n", thridx,
+		               PXY_THRMGR_LOAD(ctx, thridx),
+		               PXY_THRMGR_PENDING(ctx, thridx));
 #endif /* DEBUG_THREAD */
-		if (minload > ctx->thr[idx]->load) {
-			minload = ctx->thr[idx]->load;
-			thridx = idx;
+		for (idx = wpool->first + 1;
+		     idx < wpool->first + wpool->num_thr; idx++) {
+#ifdef DEBUG_THREAD
+			log_dbg_printf("thr[%d]: %zu/%zu\n", idx,
+			               PXY_THRMGR_LOAD(ctx, idx),
+			               PXY_THRMGR_PENDING(ctx, idx));
+#endif /* DEBUG_THREAD */
+			if (pxy_thrmgr_better(ctx, thridx, idx, now))
+				thridx = idx;
 		}
+		return thridx;
 	}
+}
+
+/*
+ * Choose a thread of worker pool wpoolidx for a new connection to server name
+ * sni by rendezvous hashing:  every thread gets a score derived from the hash
+ * of the name and the thread index, and the thread with the highest score
+ * wins.  This keeps connections to the same site on the same thread, where
+ * its forged certificates, SSL contexts and sessions are cached, and only
+ * remaps the names of a thread if the number of threads changes.  To bound
+ * the load imbalance caused by popular names, threads loaded more than
+ * PXY_THRMGR_SNI_SLACK percent above the mean load of the pool are passed
+ * over in favour of the next highest score, as are stuck threads.  Falls
+ * back to pxy_thrmgr_select() if sni is NULL, if the policy is not snihash,
+ * or if no thread qualifies.
+ */
+int
+pxy_thrmgr_select_sni(pxy_thrmgr_ctx_t *ctx, int wpoolidx, const char *sni)
+{
+	pxy_thrmgr_wpool_t *wpool = &ctx->wpool[wpoolidx];
+	long long now;
+	unsigned int h = 2166136261U;
+	unsigned int score, best_score = 0;
+	size_t total = 0, limit;
+	int best = -1;
+
+	if (!sni || ctx->opts->thrsel != THRSEL_SNIHASH)
+		return pxy_thrmgr_select(ctx, wpoolidx, NULL);
+
+	for (const char *p = sni; *p; p++) {
+		h ^= (unsigned char)tolower((unsigned char)*p);
+		h *= 16777619U;
+	}
+	for (int idx = wpool->first; idx < wpool->first + wpool->num_thr;
+	     idx++)
+		total += PXY_THRMGR_LOAD(ctx, idx);
+	/* ceiling of the mean load including the new connection, plus slack;
+	 * always at least 1, such that an idle thread always qualifies */
+	limit = ((total + 1) * (100 + PXY_THRMGR_SNI_SLACK) +
+	         100 * wpool->num_thr - 1) / (100 * wpool->num_thr);
+
+	now = stats_usec();
+	for (int idx = wpool->first; idx < wpool->first + wpool->num_thr;
+	     idx++) {
+		/* splitmix32 finalizer over name hash and thread index */
+		score = h ^ ((unsigned int)idx * 0x9e3779b9U);
+		score ^= score >> 16;
+		score *= 0x85ebca6bU;
+		score ^= score >> 13;
+		score *= 0xc2b2ae35U;
+		score ^= score >> 16;
+		if (best != -1 && score <= best_score)
+			continue;
+		if (PXY_THRMGR_LOAD(ctx, idx) >= limit ||
+		    pxy_thrmgr_stuck(ctx, idx, now))
+			continue;
+		best = idx;
+		best_score = score;
+	}
+#ifdef DEBUG_THREAD
+	log_dbg_printf("snihash [%s]: thr[%d] limit %zu\n", sni, best, limit);
+#endif /* DEBUG_THREAD */
+	if (best == -1)
+		return pxy_thrmgr_select(ctx, wpoolidx, NULL);
+	return best;
+}
+
+/*
+ * Attach a new connection to a thread of worker pool wpoolidx.  Chooses the
+ * thread according to the configured thread selection policy, returns the
+ * appropriate event bases.  Peeraddr is used for client IP hashing and may be
+ * NULL.  Returns the index of the chosen thread (for passing to _detach
+ * later).  This function cannot fail.
+ */
+int
+pxy_thrmgr_attach(pxy_thrmgr_ctx_t *ctx, int wpoolidx,
+                  const struct sockaddr *peeraddr,
+                  struct event_base **evbase, struct evdns_base **dnsbase)
+{
+	int thridx;
+
+	thridx = pxy_thrmgr_select(ctx, wpoolidx, peeraddr);
+	return pxy_thrmgr_attach_thr(ctx, thridx, evbase, dnsbase);
+}
+
+/*
+ * Attach a new connection to a specific thread by index, bypassing the load
+ * based thread selection; used for connections accepted directly on the
+ * event base of a connection handling thread.  Returns the appropriate event
+ * bases and thridx for passing to _detach later.
+ * This function cannot fail.
+ */
+int
+pxy_thrmgr_attach_thr(pxy_thrmgr_ctx_t *ctx, int thridx,
+                      struct event_base **evbase,
+                      struct evdns_base **dnsbase)
+{
 	*evbase = ctx->thr[thridx]->evbase;
 	*dnsbase = ctx->thr[thridx]->dnsbase;
-	ctx->thr[thridx]->load++;
-	pthread_mutex_unlock(&ctx->mutex);
+	__atomic_add_fetch(&ctx->thr[thridx]->load, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&ctx->thr[thridx]->pending, 1, __ATOMIC_RELAXED);
+	stats_inc(STATS_CONN_PENDING);
 
 #ifdef DEBUG_THREAD
 	log_dbg_printf("thridx: %d\n", thridx);
@@ -275,6 +1178,599 @@ pxy_thrmgr_attach(pxy_thrmgr_ctx_t *ctx, struct event_base **evbase,
 	return thridx;
 }
 
+/*
+ * Publish the rate in octets per second at which thread thridx forwarded
+ * data over the last RebalanceInterval.  Called on thread thridx.
+ */
+void
+pxy_thrmgr_set_rate(pxy_thrmgr_ctx_t *ctx, int thridx, size_t rate)
+{
+	__atomic_store_n(&ctx->thr[thridx]->rate, rate, __ATOMIC_RELAXED);
+}
+
+/*
+ * Return the thread of the worker pool of thread thridx to move established
+ * connections of thread thridx to, based on the rates last published by
+ * pxy_thrmgr_set_rate():  the thread with the lowest rate that is not
+ * stuck, if thridx forwards more than PXY_THRMGR_REBALANCE_SLACK percent
+ * above the mean rate of the pool and that thread forwards less than the
+ * mean.  *excess is set to half the difference between the rates of the two
+ * threads, the rate of connections to move for evening them out.
+ * Returns -1 if no connections should be moved.
+ */
+int
+pxy_thrmgr_rebalance_target(pxy_thrmgr_ctx_t *ctx, int thridx,
+                            size_t *excess)
+{
+	pxy_thrmgr_wpool_t *wpool = NULL;
+	size_t rate, total = 0, mean, best_rate = SIZE_MAX;
+	long long now;
+	int best = -1;
+
+	*excess = 0;
+	for (int i = 0; i < ctx->num_wpool; i++) {
+		if (thridx >= ctx->wpool[i].first &&
+		    thridx < ctx->wpool[i].first + ctx->wpool[i].num_thr) {
+			wpool = &ctx->wpool[i];
+			break;
+		}
+	}
+	if (!wpool || wpool->num_thr < 2)
+		return -1;
+
+	for (int idx = wpool->first; idx < wpool->first + wpool->num_thr;
+	     idx++)
+		total += __atomic_load_n(&ctx->thr[idx]->rate,
+		                         __ATOMIC_RELAXED);
+	mean = total / wpool->num_thr;
+	rate = __atomic_load_n(&ctx->thr[thridx]->rate, __ATOMIC_RELAXED);
+	if (rate <= mean + mean * PXY_THRMGR_REBALANCE_SLACK / 100)
+		return -1;
+
+	now = stats_usec();
+	for (int idx = wpool->first; idx < wpool->first + wpool->num_thr;
+	     idx++) {
+		size_t r = __atomic_load_n(&ctx->thr[idx]->rate,
+		                           __ATOMIC_RELAXED);
+
+		if (idx == thridx || r >= best_rate || r >= mean ||
+		    pxy_thrmgr_stuck(ctx, idx, now))
+			continue;
+		best = idx;
+		best_rate = r;
+	}
+	if (best != -1)
+		*excess = (rate - best_rate) / 2;
+	return best;
+}
+
+/*
+ * Return the number of connection handling threads.
+ * Can be called before pxy_thrmgr_run().
+ */
+int
+pxy_thrmgr_num_thr(pxy_thrmgr_ctx_t *ctx)
+{
+	return ctx->num_thr;
+}
+
+/*
+ * Return the index of the worker pool named name, 0 for the default pool if
+ * name is NULL or "default" and no pool of that name is defined, or -1 if
+ * there is no such pool.
+ * Can be called before pxy_thrmgr_run().
+ */
+int
+pxy_thrmgr_wpool_find(pxy_thrmgr_ctx_t *ctx, const char *name)
+{
+	if (!name)
+		return 0;
+	for (int i = 0; i < ctx->opts->workerpool_count; i++) {
+		if (!strcmp(ctx->opts->workerpool[i].name, name))
+			return i + 1;
+	}
+	if (!strcmp(name, "default"))
+		return 0;
+	return -1;
+}
+
+/*
+ * Return the number of connection handling threads of worker pool wpoolidx
+ * and store the index of its first thread in *first.
+ * Can be called before pxy_thrmgr_run().
+ */
+int
+pxy_thrmgr_wpool_range(pxy_thrmgr_ctx_t *ctx, int wpoolidx, int *first)
+{
+	*first = ctx->wpool[wpoolidx].first;
+	return ctx->wpool[wpoolidx].num_thr;
+}
+
+/*
+ * Return the event base of connection handling thread thridx.
+ * Must only be called after pxy_thrmgr_run() returned successfully.
+ */
+struct event_base *
+pxy_thrmgr_get_evbase(pxy_thrmgr_ctx_t *ctx, int thridx)
+{
+	return ctx->thr[thridx]->evbase;
+}
+
+/*
+ * Return the certificate forging thread pool, or NULL if certificates are to
+ * be forged synchronously on the connection handling threads.
+ */
+pxy_forge_ctx_t *
+pxy_thrmgr_get_forge(pxy_thrmgr_ctx_t *ctx)
+{
+	return ctx->forge;
+}
+
+/*
+ * Return the pool of per-certificate leaf keys, or NULL if all forged
+ * certificates share the leaf key.
+ */
+keypool_t *
+pxy_thrmgr_get_keypool(pxy_thrmgr_ctx_t *ctx)
+{
+	return ctx->keypool;
+}
+
+/*
+ * Return 1 if thread thridx is currently overloaded, 0 otherwise.
+ * Always 0 unless OverloadPassthrough is set.  Thread-safe.
+ */
+int
+pxy_thrmgr_overloaded(pxy_thrmgr_ctx_t *ctx, int thridx)
+{
+	return __atomic_load_n(&ctx->thr[thridx]->overloaded,
+	                       __ATOMIC_RELAXED);
+}
+
+/*
+ * Return the rate limit group of thread thridx for the proxyspec with index
+ * idx, shaping the traffic of its connections to rate octets per second with
+ * bursts of up to burst octets.  The group is created on first use and
+ * reconfigured if rate or burst changed, e.g. on reload.  Connections set up
+ * on the listener thread use this too, hence the mutex.  Returns NULL on
+ * failure.
+ */
+struct bufferevent_rate_limit_group *
+pxy_thrmgr_get_shape(pxy_thrmgr_ctx_t *ctx, int thridx, int idx,
+                     size_t rate, size_t burst)
+{
+	pxy_thr_ctx_t *thr = ctx->thr[thridx];
+	struct timeval tick = {0, PXY_THRMGR_SHAPE_TICK * 1000};
+	struct bufferevent_rate_limit_group *group = NULL;
+	struct ev_token_bucket_cfg *cfg;
+	pxy_thr_shape_t *shape;
+	size_t pertick;
+
+	STATS_MUTEX_LOCK(&thr->shape_mutex, STATS_LOCK_THRMGR);
+	if ((size_t)idx >= thr->shape_len) {
+		shape = realloc(thr->shape, (idx + 1) * sizeof(*shape));
+		if (!shape)
+			goto leave;
+		memset(shape + thr->shape_len, 0,
+		       (idx + 1 - thr->shape_len) * sizeof(*shape));
+		thr->shape = shape;
+		thr->shape_len = idx + 1;
+	}
+	shape = &thr->shape[idx];
+	if (shape->group && shape->rate == rate && shape->burst == burst) {
+		group = shape->group;
+		goto leave;
+	}
+
+	pertick = rate / (1000 / PXY_THRMGR_SHAPE_TICK);
+	if (pertick == 0)
+		pertick = 1;
+	if (burst < pertick)
+		burst = pertick;
+	if (burst > EV_RATE_LIMIT_MAX)
+		burst = EV_RATE_LIMIT_MAX;
+	if (pertick > burst)
+		pertick = burst;
+	cfg = ev_token_bucket_cfg_new(pertick, burst, pertick, burst, &tick);
+	if (!cfg)
+		goto leave;
+	if (shape->group) {
+		bufferevent_rate_limit_group_set_cfg(shape->group, cfg);
+	} else {
+		shape->group = bufferevent_rate_limit_group_new(thr->evbase,
+		                                                cfg);
+	}
+	ev_token_bucket_cfg_free(cfg);
+	shape->rate = rate;
+	shape->burst = burst;
+	group = shape->group;
+leave:
+	STATS_MUTEX_UNLOCK(&thr->shape_mutex, STATS_LOCK_THRMGR);
+	return group;
+}
+
+/*
+ * Return the admission counters shared by all threads.
+ */
+admit_t *
+pxy_thrmgr_get_admit(pxy_thrmgr_ctx_t *ctx)
+{
+	return ctx->admit;
+}
+
+/*
+ * Return the timing wheel of thread thridx.
+ */
+tmwheel_t *
+pxy_thrmgr_get_wheel(pxy_thrmgr_ctx_t *ctx, int thridx)
+{
+	return ctx->thr[thridx]->wheel;
+}
+
+/*
+ * Return the CPU thread thridx is pinned to, or -1 if it is not pinned.
+ * Only valid after pxy_thrmgr_run().
+ */
+int
+pxy_thrmgr_get_cpu(pxy_thrmgr_ctx_t *ctx, int thridx)
+{
+	return ctx->thr[thridx]->cpu;
+}
+
+#ifdef HAVE_IOURING
+/*
+ * Return the io_uring of thread thridx, or NULL if IOUringForward is not set
+ * or the ring could not be set up.  Must only be used from within that
+ * thread.
+ */
+iouring_t *
+pxy_thrmgr_get_uring(pxy_thrmgr_ctx_t *ctx, int thridx)
+{
+	return ctx->thr[thridx]->uring;
+}
+#endif /* HAVE_IOURING */
+
+#ifdef HAVE_LIBCTX
+/*
+ * Return the OpenSSL library context of thread thridx, or NULL if the thread
+ * uses the default one.  Thread-safe.
+ */
+OSSL_LIB_CTX *
+pxy_thrmgr_get_libctx(pxy_thrmgr_ctx_t *ctx, int thridx)
+{
+	return ctx->thr[thridx]->libctx;
+}
+
+/*
+ * Return the upstream SSL_CTX of thread thridx set up for opts, or NULL if
+ * there is none yet.  Must only be used from within that thread.
+ */
+SSL_CTX *
+pxy_thrmgr_get_dstsslctx(pxy_thrmgr_ctx_t *ctx, int thridx, opts_t *opts)
+{
+	pxy_thr_ctx_t *thr = ctx->thr[thridx];
+
+	return thr->dstopts == opts ? thr->dstsslctx : NULL;
+}
+
+/*
+ * Make sslctx, set up for opts, the upstream SSL_CTX of thread thridx,
+ * replacing the one of a previous configuration.  Takes ownership of sslctx.
+ * Must only be used from within that thread.
+ */
+void
+pxy_thrmgr_set_dstsslctx(pxy_thrmgr_ctx_t *ctx, int thridx, opts_t *opts,
+                         SSL_CTX *sslctx)
+{
+	pxy_thr_ctx_t *thr = ctx->thr[thridx];
+
+	pxy_thrmgr_dstsslctx_free(thr);
+	thr->dstsslctx = sslctx;
+	thr->dstopts = opts_ref(opts);
+}
+#endif /* HAVE_LIBCTX */
+
+/*
+ * Return the JSON formatting buffer of thread thridx, or NULL if the connect
+ * log is not in JSON format.  Must only be used from within that thread.
+ */
+logjson_t *
+pxy_thrmgr_get_json(pxy_thrmgr_ctx_t *ctx, int thridx)
+{
+	return ctx->thr[thridx]->json;
+}
+
+/*
+ * Return the connect log rollup table of thread thridx, or NULL if
+ * ConnectLogRollup is disabled.  Thread-safe.
+ */
+logroll_t *
+pxy_thrmgr_get_rollup(pxy_thrmgr_ctx_t *ctx, int thridx)
+{
+	return ctx->thr[thridx]->rollup;
+}
+
+/*
+ * Merge the connect log rollup aggregates of all threads and write them
+ * through cb, one line at a time.  Each thread's table is only locked for
+ * swapping it for an empty one.  Returns 0 on success, -1 if aggregates
+ * were lost to allocation failure.
+ */
+int
+pxy_thrmgr_rollup_flush(pxy_thrmgr_ctx_t *ctx, logroll_line_cb_t cb,
+                        void *arg)
+{
+	logroll_t *merged;
+	logjson_t *js = NULL;
+	struct timespec ts;
+	int rv = 0;
+
+	if (!ctx->thr || !ctx->opts->connectlog_rollup)
+		return 0;
+	if (!(merged = logroll_new()))
+		return -1;
+	if (ctx->opts->connectlog_json &&
+	    !(js = logjson_new(PXY_THRMGR_JSON_SZ))) {
+		logroll_free(merged);
+		return -1;
+	}
+	for (int idx = 0; idx < ctx->num_thr; idx++) {
+		if (logroll_merge(merged, ctx->thr[idx]->rollup) == -1)
+			rv = -1;
+	}
+	if (clock_gettime(CLOCK_REALTIME, &ts) == -1)
+		ts.tv_sec = ts.tv_nsec = 0;
+	if (logroll_flush(merged, js, (long long)ts.tv_sec * 1000000 +
+	                              ts.tv_nsec / 1000,
+	                  ctx->opts->connectlog_rollup, cb, arg) == -1)
+		rv = -1;
+	if (js)
+		logjson_free(js);
+	logroll_free(merged);
+	return rv;
+}
+
+/*
+ * Return the number of connections currently attached to any thread.
+ * Thread-safe.
+ */
+size_t
+pxy_thrmgr_load(pxy_thrmgr_ctx_t *ctx)
+{
+	size_t load = 0;
+
+	for (int idx = 0; idx < ctx->num_thr; idx++) {
+		load += PXY_THRMGR_LOAD(ctx, idx);
+	}
+	return load;
+}
+
+/*
+ * Take a connection context object from the pool of thread thridx.
+ * Returns NULL if the pool is empty; the caller then allocates a new one.
+ */
+void *
+pxy_thrmgr_pool_get(pxy_thrmgr_ctx_t *ctx, int thridx)
+{
+	pxy_thr_ctx_t *thr = ctx->thr[thridx];
+	void *obj;
+
+	STATS_MUTEX_LOCK(&thr->pool_mutex, STATS_LOCK_THRMGR);
+	obj = thr->pool;
+	if (obj) {
+		thr->pool = *(void **)obj;
+		thr->pool_len--;
+	}
+	STATS_MUTEX_UNLOCK(&thr->pool_mutex, STATS_LOCK_THRMGR);
+	return obj;
+}
+
+/*
+ * Return a freed connection context object of at least pointer size to the
+ * pool of thread thridx.  Returns 0 if the pool took ownership of obj, or -1
+ * if the pool is full and the caller needs to free obj itself.
+ */
+int
+pxy_thrmgr_pool_put(pxy_thrmgr_ctx_t *ctx, int thridx, void *obj)
+{
+	pxy_thr_ctx_t *thr = ctx->thr[thridx];
+	int rv = -1;
+
+	STATS_MUTEX_LOCK(&thr->pool_mutex, STATS_LOCK_THRMGR);
+	if (thr->pool_len < PXY_THRMGR_POOL_MAX) {
+		*(void **)obj = thr->pool;
+		thr->pool = obj;
+		thr->pool_len++;
+		rv = 0;
+	}
+	STATS_MUTEX_UNLOCK(&thr->pool_mutex, STATS_LOCK_THRMGR);
+	return rv;
+}
+
+/*
+ * Register obj in the registry of active connections of thread thridx using
+ * link, which must stay valid until unregistered.  Thread-safe.
+ */
+void
+pxy_thrmgr_conn_register(pxy_thrmgr_ctx_t *ctx, int thridx,
+                         pxy_thr_link_t *link, void *obj)
+{
+	pxy_thr_ctx_t *thr = ctx->thr[thridx];
+
+	STATS_MUTEX_LOCK(&thr->conns_mutex, STATS_LOCK_THRMGR);
+	link->obj = obj;
+	link->prev = NULL;
+	link->next = thr->conns;
+	if (thr->conns)
+		thr->conns->prev = link;
+	thr->conns = link;
+	STATS_MUTEX_UNLOCK(&thr->conns_mutex, STATS_LOCK_THRMGR);
+}
+
+/*
+ * Remove link from the registry of thread thridx, if registered.
+ * Thread-safe.
+ */
+void
+pxy_thrmgr_conn_unregister(pxy_thrmgr_ctx_t *ctx, int thridx,
+                           pxy_thr_link_t *link)
+{
+	pxy_thr_ctx_t *thr = ctx->thr[thridx];
+
+	if (!link->obj)
+		return;
+	STATS_MUTEX_LOCK(&thr->conns_mutex, STATS_LOCK_THRMGR);
+	if (link->prev)
+		link->prev->next = link->next;
+	else
+		thr->conns = link->next;
+	if (link->next)
+		link->next->prev = link->prev;
+	link->obj = NULL;
+	STATS_MUTEX_UNLOCK(&thr->conns_mutex, STATS_LOCK_THRMGR);
+}
+
+/*
+ * Call cb with every object registered on thread thridx and arg, with the
+ * registry locked.  Objects are only guaranteed to be consistent if called
+ * on thread thridx itself.
+ */
+void
+pxy_thrmgr_conn_foreach(pxy_thrmgr_ctx_t *ctx, int thridx,
+                        void (*cb)(void *, void *), void *arg)
+{
+	pxy_thr_ctx_t *thr = ctx->thr[thridx];
+
+	STATS_MUTEX_LOCK(&thr->conns_mutex, STATS_LOCK_THRMGR);
+	for (pxy_thr_link_t *link = thr->conns; link; link = link->next)
+		cb(link->obj, arg);
+	STATS_MUTEX_UNLOCK(&thr->conns_mutex, STATS_LOCK_THRMGR);
+}
+
+/*
+ * Take a reset SSL instance bound to sslctx from the SSL pool of thread
+ * thridx.  Returns NULL if none is available; the caller then uses SSL_new().
+ */
+SSL *
+pxy_thrmgr_sslpool_get(pxy_thrmgr_ctx_t *ctx, int thridx, SSL_CTX *sslctx)
+{
+	pxy_thr_ctx_t *thr = ctx->thr[thridx];
+	SSL *ssl = NULL;
+
+	STATS_MUTEX_LOCK(&thr->pool_mutex, STATS_LOCK_THRMGR);
+	for (size_t i = thr->sslpool_len; i > 0; i--) {
+		if (SSL_get_SSL_CTX(thr->sslpool[i - 1]) == sslctx) {
+			ssl = thr->sslpool[i - 1];
+			thr->sslpool[i - 1] = thr->sslpool[--thr->sslpool_len];
+			break;
+		}
+	}
+	STATS_MUTEX_UNLOCK(&thr->pool_mutex, STATS_LOCK_THRMGR);
+	return ssl;
+}
+
+/*
+ * Return a reset SSL instance to the SSL pool of thread thridx.  If the pool
+ * is full, an older instance is evicted in round-robin order, such that
+ * instances bound to the SSL_CTX of a replaced configuration age out.  Pooled
+ * instances hold a reference to their SSL_CTX.
+ * Returns 0 if the pool took ownership of ssl, -1 otherwise.
+ */
+int
+pxy_thrmgr_sslpool_put(pxy_thrmgr_ctx_t *ctx, int thridx, SSL *ssl)
+{
+	pxy_thr_ctx_t *thr = ctx->thr[thridx];
+	SSL *evicted = NULL;
+
+	STATS_MUTEX_LOCK(&thr->pool_mutex, STATS_LOCK_THRMGR);
+	if (thr->sslpool_len < PXY_THRMGR_SSLPOOL_MAX) {
+		thr->sslpool[thr->sslpool_len++] = ssl;
+	} else {
+		thr->sslpool_next %= PXY_THRMGR_SSLPOOL_MAX;
+		evicted = thr->sslpool[thr->sslpool_next];
+		thr->sslpool[thr->sslpool_next++] = ssl;
+	}
+	STATS_MUTEX_UNLOCK(&thr->pool_mutex, STATS_LOCK_THRMGR);
+	if (evicted)
+		SSL_free(evicted);
+	return 0;
+}
+
+/*
+ * Take an established upstream connection to the static destination of spec
+ * out of the pre-connect pool of thread thridx.  The pools belong to the
+ * proxyspecs of the initial configuration; those of a reloaded configuration
+ * use the pool at the same position if the destination is unchanged.
+ * Thread-safe.
+ * Returns the connected socket, or -1 if none is available.
+ */
+evutil_socket_t
+pxy_thrmgr_connpool_get(pxy_thrmgr_ctx_t *ctx, int thridx, proxyspec_t *spec)
+{
+	pxy_thr_ctx_t *thr = ctx->thr[thridx];
+	proxyspec_t *p;
+	size_t i;
+
+	if (!thr->connpool)
+		return -1;
+	for (p = ctx->opts->spec, i = 0; p && p->idx != spec->idx;
+	     p = p->next, i++);
+	if (!p || !thr->connpool[i])
+		return -1;
+	/* proxyspec of a reloaded configuration with another destination */
+	if (p != spec && (p->connect_addrlen != spec->connect_addrlen ||
+	                  memcmp(&p->connect_addr, &spec->connect_addr,
+	                         p->connect_addrlen)))
+		return -1;
+	return pxy_connpool_get(thr->connpool[i]);
+}
+
+/*
+ * Take an idle persistent upstream HTTP connection to addr out of the
+ * keep-alive pool of thread thridx.  Thread-safe.
+ * Returns the connected socket, or -1 if none is available.
+ */
+evutil_socket_t
+pxy_thrmgr_httppool_get(pxy_thrmgr_ctx_t *ctx, int thridx,
+                        const struct sockaddr *addr, socklen_t addrlen)
+{
+	pxy_thr_ctx_t *thr = ctx->thr[thridx];
+
+	if (!thr->httppool)
+		return -1;
+	return pxy_httppool_get(thr->httppool, addr, addrlen);
+}
+
+/*
+ * Put an idle persistent upstream HTTP connection to addr into the
+ * keep-alive pool of thread thridx.  Must be called on thread thridx.
+ * Returns 0 if the pool took over fd, -1 if the caller still owns it.
+ */
+int
+pxy_thrmgr_httppool_put(pxy_thrmgr_ctx_t *ctx, int thridx,
+                        const struct sockaddr *addr, socklen_t addrlen,
+                        evutil_socket_t fd)
+{
+	pxy_thr_ctx_t *thr = ctx->thr[thridx];
+
+	if (!thr->httppool)
+		return -1;
+	return pxy_httppool_put(thr->httppool, addr, addrlen, fd);
+}
+
+/*
+ * Mark a connection attached to thread thridx as set up, i.e. no longer
+ * pending.  Must be called at most once per attached connection, and before
+ * pxy_thrmgr_detach().
+ * This function cannot fail.
+ */
+void
+pxy_thrmgr_setup_done(pxy_thrmgr_ctx_t *ctx, int thridx)
+{
+	__atomic_sub_fetch(&ctx->thr[thridx]->pending, 1, __ATOMIC_RELAXED);
+	stats_dec(STATS_CONN_PENDING);
+}
+
 /*
  * Detach a connection from a thread by index.
  * This function cannot fail.
@@ -282,9 +1778,7 @@ pxy_thrmgr_attach(pxy_thrmgr_ctx_t *ctx, struct event_base **evbase,
 void
 pxy_thrmgr_detach(pxy_thrmgr_ctx_t *ctx, int thridx)
 {
-	pthread_mutex_lock(&ctx->mutex);
-	ctx->thr[thridx]->load--;
-	pthread_mutex_unlock(&ctx->mutex);
+	__atomic_sub_fetch(&ctx->thr[thridx]->load, 1, __ATOMIC_RELAXED);
 }
 
 /* vim: set noet ft=c: */
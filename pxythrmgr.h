@@ -30,6 +30,14 @@
 #define PXYTHRMGR_H
 
 #include "opts.h"
+#include "pxyforge.h"
+#include "keypool.h"
+#include "logjson.h"
+#include "logroll.h"
+#include "iouring.h"
+#include "tmwheel.h"
+#include "admit.h"
+#include "ssl.h"
 #include "attrib.h"
 
 #include <sys/types.h>
@@ -37,16 +45,99 @@
 
 #include <event2/event.h>
 #include <event2/dns.h>
+#include <event2/bufferevent.h>
+
+#include <openssl/ssl.h>
+
+/*
+ * Event priorities on the worker thread event bases, lower is more urgent:
+ * forwarding on established connections, reading ClientHellos of new
+ * connections, connection setup steps, resumed handshakes and forge
+ * completions, and full upstream handshakes without a session to resume.
+ * Events without an explicit priority get PXY_PRIO_DEFAULT.
+ */
+#define PXY_PRIO_ESTAB		0
+#define PXY_PRIO_HIGH		1
+#define PXY_PRIO_DEFAULT	2
+#define PXY_PRIO_LOW		3
+#define PXY_NPRIOS		4
 
 typedef struct pxy_thrmgr_ctx pxy_thrmgr_ctx_t;
 
+/*
+ * Link of an object in the registry of active connections of a thread.
+ */
+typedef struct pxy_thr_link {
+	struct pxy_thr_link *next;
+	struct pxy_thr_link *prev;
+	void *obj;              /* registered object, NULL if not registered */
+} pxy_thr_link_t;
+
 pxy_thrmgr_ctx_t * pxy_thrmgr_new(opts_t *) MALLOC;
 int pxy_thrmgr_run(pxy_thrmgr_ctx_t *) NONNULL(1) WUNRES;
 void pxy_thrmgr_free(pxy_thrmgr_ctx_t *) NONNULL(1);
 
-int pxy_thrmgr_attach(pxy_thrmgr_ctx_t *, struct event_base **,
-                      struct evdns_base **) WUNRES;
+int pxy_thrmgr_select(pxy_thrmgr_ctx_t *, int, const struct sockaddr *)
+                      NONNULL(1) WUNRES;
+int pxy_thrmgr_select_sni(pxy_thrmgr_ctx_t *, int, const char *)
+                          NONNULL(1) WUNRES;
+int pxy_thrmgr_attach(pxy_thrmgr_ctx_t *, int, const struct sockaddr *,
+                      struct event_base **, struct evdns_base **) WUNRES;
+int pxy_thrmgr_attach_thr(pxy_thrmgr_ctx_t *, int, struct event_base **,
+                          struct evdns_base **) WUNRES;
+void pxy_thrmgr_set_rate(pxy_thrmgr_ctx_t *, int, size_t) NONNULL(1);
+int pxy_thrmgr_rebalance_target(pxy_thrmgr_ctx_t *, int, size_t *)
+                                NONNULL(1,3) WUNRES;
+void pxy_thrmgr_setup_done(pxy_thrmgr_ctx_t *, int);
 void pxy_thrmgr_detach(pxy_thrmgr_ctx_t *, int);
+void * pxy_thrmgr_pool_get(pxy_thrmgr_ctx_t *, int) NONNULL(1) WUNRES;
+int pxy_thrmgr_pool_put(pxy_thrmgr_ctx_t *, int, void *) NONNULL(1,3) WUNRES;
+SSL * pxy_thrmgr_sslpool_get(pxy_thrmgr_ctx_t *, int, SSL_CTX *)
+      NONNULL(1,3) WUNRES;
+int pxy_thrmgr_sslpool_put(pxy_thrmgr_ctx_t *, int, SSL *) NONNULL(1,3) WUNRES;
+void pxy_thrmgr_conn_register(pxy_thrmgr_ctx_t *, int, pxy_thr_link_t *,
+                              void *) NONNULL(1,3,4);
+void pxy_thrmgr_conn_unregister(pxy_thrmgr_ctx_t *, int, pxy_thr_link_t *)
+                                NONNULL(1,3);
+void pxy_thrmgr_conn_foreach(pxy_thrmgr_ctx_t *, int, void (*)(void *, void *),
+                             void *) NONNULL(1,3);
+evutil_socket_t pxy_thrmgr_connpool_get(pxy_thrmgr_ctx_t *, int,
+                                        proxyspec_t *) NONNULL(1,3) WUNRES;
+evutil_socket_t pxy_thrmgr_httppool_get(pxy_thrmgr_ctx_t *, int,
+                                        const struct sockaddr *, socklen_t)
+                                        NONNULL(1,3) WUNRES;
+int pxy_thrmgr_httppool_put(pxy_thrmgr_ctx_t *, int, const struct sockaddr *,
+                            socklen_t, evutil_socket_t) NONNULL(1,3) WUNRES;
+int pxy_thrmgr_num_thr(pxy_thrmgr_ctx_t *) NONNULL(1) WUNRES;
+int pxy_thrmgr_wpool_find(pxy_thrmgr_ctx_t *, const char *) NONNULL(1) WUNRES;
+int pxy_thrmgr_wpool_range(pxy_thrmgr_ctx_t *, int, int *) NONNULL(1,3) WUNRES;
+struct event_base * pxy_thrmgr_get_evbase(pxy_thrmgr_ctx_t *, int)
+                    NONNULL(1) WUNRES;
+pxy_forge_ctx_t * pxy_thrmgr_get_forge(pxy_thrmgr_ctx_t *) NONNULL(1) WUNRES;
+keypool_t * pxy_thrmgr_get_keypool(pxy_thrmgr_ctx_t *) NONNULL(1) WUNRES;
+int pxy_thrmgr_overloaded(pxy_thrmgr_ctx_t *, int) NONNULL(1) WUNRES;
+size_t pxy_thrmgr_load(pxy_thrmgr_ctx_t *) NONNULL(1) WUNRES;
+logjson_t * pxy_thrmgr_get_json(pxy_thrmgr_ctx_t *, int) NONNULL(1) WUNRES;
+logroll_t * pxy_thrmgr_get_rollup(pxy_thrmgr_ctx_t *, int) NONNULL(1) WUNRES;
+int pxy_thrmgr_rollup_flush(pxy_thrmgr_ctx_t *, logroll_line_cb_t, void *)
+    NONNULL(1,2) WUNRES;
+struct bufferevent_rate_limit_group *
+pxy_thrmgr_get_shape(pxy_thrmgr_ctx_t *, int, int, size_t, size_t)
+NONNULL(1) WUNRES;
+admit_t * pxy_thrmgr_get_admit(pxy_thrmgr_ctx_t *) NONNULL(1) WUNRES;
+tmwheel_t * pxy_thrmgr_get_wheel(pxy_thrmgr_ctx_t *, int) NONNULL(1) WUNRES;
+int pxy_thrmgr_get_cpu(pxy_thrmgr_ctx_t *, int) NONNULL(1) WUNRES;
+#ifdef HAVE_IOURING
+iouring_t * pxy_thrmgr_get_uring(pxy_thrmgr_ctx_t *, int) NONNULL(1) WUNRES;
+#endif /* HAVE_IOURING */
+#ifdef HAVE_LIBCTX
+OSSL_LIB_CTX * pxy_thrmgr_get_libctx(pxy_thrmgr_ctx_t *, int)
+               NONNULL(1) WUNRES;
+SSL_CTX * pxy_thrmgr_get_dstsslctx(pxy_thrmgr_ctx_t *, int, opts_t *)
+          NONNULL(1,3) WUNRES;
+void pxy_thrmgr_set_dstsslctx(pxy_thrmgr_ctx_t *, int, opts_t *, SSL_CTX *)
+     NONNULL(1,3,4);
+#endif /* HAVE_LIBCTX */
 
 #endif /* !PXYTHRMGR_H */
 
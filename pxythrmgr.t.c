@@ -28,10 +28,16 @@
 
 #include "pxythrmgr.h"
 
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include <check.h>
 
+#include <event2/thread.h>
+
 START_TEST(pxythrmgr_libevent_01)
 {
 	struct event_base *evbase;
@@ -107,6 +113,408 @@ START_TEST(pxythrmgr_libevent_05)
 }
 END_TEST
 
+START_TEST(pxythrmgr_attach_thr_01)
+{
+	pxy_thrmgr_ctx_t *ctx;
+	struct event_base *evbase;
+	struct evdns_base *dnsbase;
+	opts_t *opts;
+	int n, idx;
+
+	opts = opts_new();
+	ctx = pxy_thrmgr_new(opts);
+	fail_unless(!!ctx, "no thrmgr");
+	n = pxy_thrmgr_num_thr(ctx);
+	fail_unless(n > 0, "no threads");
+	fail_unless(pxy_thrmgr_run(ctx) == 0, "run failed");
+	idx = pxy_thrmgr_attach_thr(ctx, n - 1, &evbase, &dnsbase);
+	fail_unless(idx == n - 1, "wrong thread index");
+	fail_unless(evbase == pxy_thrmgr_get_evbase(ctx, n - 1),
+	            "wrong event base");
+	fail_unless(!dnsbase, "unexpected dns base");
+	pxy_thrmgr_detach(ctx, idx);
+	pxy_thrmgr_free(ctx);
+	opts_free(opts);
+}
+END_TEST
+
+START_TEST(pxythrmgr_attach_02)
+{
+	pxy_thrmgr_ctx_t *ctx;
+	struct event_base *evbase;
+	struct evdns_base *dnsbase;
+	opts_t *opts;
+	int n, idx, *seen;
+
+	opts = opts_new();
+	opts->thrsel = THRSEL_ROUNDROBIN;
+	ctx = pxy_thrmgr_new(opts);
+	fail_unless(!!ctx, "no thrmgr");
+	n = pxy_thrmgr_num_thr(ctx);
+	fail_unless(pxy_thrmgr_run(ctx) == 0, "run failed");
+	seen = calloc(n, sizeof(int));
+	fail_unless(!!seen, "out of memory");
+	for (int i = 0; i < n; i++) {
+		idx = pxy_thrmgr_attach(ctx, 0, NULL, &evbase, &dnsbase);
+		fail_unless(idx >= 0 && idx < n, "thread index out of range");
+		seen[idx]++;
+	}
+	for (int i = 0; i < n; i++) {
+		fail_unless(seen[i] == 1, "round robin not balanced");
+		pxy_thrmgr_detach(ctx, i);
+	}
+	free(seen);
+	pxy_thrmgr_free(ctx);
+	opts_free(opts);
+}
+END_TEST
+
+START_TEST(pxythrmgr_attach_03)
+{
+	pxy_thrmgr_ctx_t *ctx;
+	struct event_base *evbase;
+	struct evdns_base *dnsbase;
+	struct sockaddr_in sin;
+	opts_t *opts;
+	int idx1, idx2;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x0a000001);
+	opts = opts_new();
+	opts->thrsel = THRSEL_CLIENTHASH;
+	ctx = pxy_thrmgr_new(opts);
+	fail_unless(!!ctx, "no thrmgr");
+	fail_unless(pxy_thrmgr_run(ctx) == 0, "run failed");
+	idx1 = pxy_thrmgr_attach(ctx, 0, (struct sockaddr *)&sin,
+	                         &evbase, &dnsbase);
+	sin.sin_port = htons(1234);
+	idx2 = pxy_thrmgr_attach(ctx, 0, (struct sockaddr *)&sin,
+	                         &evbase, &dnsbase);
+	fail_unless(idx1 == idx2, "same client IP on different threads");
+	pxy_thrmgr_detach(ctx, idx1);
+	pxy_thrmgr_detach(ctx, idx2);
+	pxy_thrmgr_free(ctx);
+	opts_free(opts);
+}
+END_TEST
+
+static void
+pxythrmgr_attach_loaded(int thrsel)
+{
+	pxy_thrmgr_ctx_t *ctx;
+	struct event_base *evbase;
+	struct evdns_base *dnsbase;
+	opts_t *opts;
+	int n, idx;
+
+	opts = opts_new();
+	opts->thrsel = thrsel;
+	ctx = pxy_thrmgr_new(opts);
+	fail_unless(!!ctx, "no thrmgr");
+	n = pxy_thrmgr_num_thr(ctx);
+	fail_unless(pxy_thrmgr_run(ctx) == 0, "run failed");
+	/* load all threads but the last one */
+	for (int i = 0; i < n - 1; i++) {
+		idx = pxy_thrmgr_attach_thr(ctx, i, &evbase, &dnsbase);
+		fail_unless(idx == i, "wrong thread index");
+	}
+	for (int i = 0; i < 32; i++) {
+		idx = pxy_thrmgr_attach(ctx, 0, NULL, &evbase, &dnsbase);
+		fail_unless(idx >= 0 && idx < n, "thread index out of range");
+		pxy_thrmgr_detach(ctx, idx);
+		/* p2c only guarantees the least loaded pick with 2 threads */
+		if (thrsel == THRSEL_LEASTLOADED || n == 2)
+			fail_unless(idx == n - 1, "did not pick least loaded");
+	}
+	pxy_thrmgr_free(ctx);
+	opts_free(opts);
+}
+
+START_TEST(pxythrmgr_attach_04)
+{
+	pxythrmgr_attach_loaded(THRSEL_LEASTLOADED);
+}
+END_TEST
+
+START_TEST(pxythrmgr_attach_05)
+{
+	pxythrmgr_attach_loaded(THRSEL_P2C);
+}
+END_TEST
+
+static void
+pxythrmgr_block_cb(UNUSED evutil_socket_t fd, UNUSED short what, void *arg)
+{
+	__atomic_store_n((int *)arg, 1, __ATOMIC_RELEASE);
+	usleep(500000);
+}
+
+static void
+pxythrmgr_attach_stuck(int thrsel)
+{
+	pxy_thrmgr_ctx_t *ctx;
+	struct event_base *evbase;
+	struct evdns_base *dnsbase;
+	struct timeval tv = {0, 0};
+	opts_t *opts;
+	int blocked = 0;
+	int idx;
+
+	opts = opts_new();
+	opts->thrsel = thrsel;
+	opts_set_worker_threads(opts, "sslsplit", "2");
+	ctx = pxy_thrmgr_new(opts);
+	fail_unless(!!ctx, "no thrmgr");
+	fail_unless(pxy_thrmgr_run(ctx) == 0, "run failed");
+	/* load thread 1, then block thread 0 in a long running callback */
+	for (int i = 0; i < 3; i++) {
+		idx = pxy_thrmgr_attach_thr(ctx, 1, &evbase, &dnsbase);
+		fail_unless(idx == 1, "wrong thread index");
+	}
+	fail_unless(event_base_once(pxy_thrmgr_get_evbase(ctx, 0), -1,
+	                            EV_TIMEOUT, pxythrmgr_block_cb, &blocked,
+	                            &tv) == 0, "event_base_once failed");
+	while (!__atomic_load_n(&blocked, __ATOMIC_ACQUIRE))
+		usleep(1000);
+	usleep(250000);
+	for (int i = 0; i < 4; i++) {
+		idx = pxy_thrmgr_attach(ctx, 0, NULL, &evbase, &dnsbase);
+		fail_unless(idx == 1, "picked stuck thread");
+		pxy_thrmgr_detach(ctx, idx);
+	}
+	pxy_thrmgr_free(ctx);
+	opts_free(opts);
+}
+
+START_TEST(pxythrmgr_attach_06)
+{
+	pxythrmgr_attach_stuck(THRSEL_LEASTLOADED);
+}
+END_TEST
+
+START_TEST(pxythrmgr_attach_07)
+{
+	pxythrmgr_attach_stuck(THRSEL_ROUNDROBIN);
+}
+END_TEST
+
+START_TEST(pxythrmgr_select_sni_01)
+{
+	pxy_thrmgr_ctx_t *ctx;
+	opts_t *opts;
+	int idx1, idx2, idx3;
+
+	opts = opts_new();
+	opts->thrsel = THRSEL_SNIHASH;
+	opts_set_worker_threads(opts, "sslsplit", "8");
+	ctx = pxy_thrmgr_new(opts);
+	fail_unless(!!ctx, "no thrmgr");
+	fail_unless(pxy_thrmgr_run(ctx) == 0, "run failed");
+	idx1 = pxy_thrmgr_select_sni(ctx, 0, "www.example.org");
+	idx2 = pxy_thrmgr_select_sni(ctx, 0, "www.example.org");
+	idx3 = pxy_thrmgr_select_sni(ctx, 0, "WWW.Example.ORG");
+	fail_unless(idx1 >= 0 && idx1 < 8, "thread index out of range");
+	fail_unless(idx1 == idx2, "same name on different threads");
+	fail_unless(idx1 == idx3, "name case changed thread");
+	idx1 = pxy_thrmgr_select_sni(ctx, 0, NULL);
+	fail_unless(idx1 >= 0 && idx1 < 8, "thread index out of range");
+	pxy_thrmgr_free(ctx);
+	opts_free(opts);
+}
+END_TEST
+
+START_TEST(pxythrmgr_select_sni_02)
+{
+	pxy_thrmgr_ctx_t *ctx;
+	struct event_base *evbase;
+	struct evdns_base *dnsbase;
+	opts_t *opts;
+	int idx, first, seen[4] = {0};
+
+	opts = opts_new();
+	opts->thrsel = THRSEL_SNIHASH;
+	opts_set_worker_threads(opts, "sslsplit", "4");
+	ctx = pxy_thrmgr_new(opts);
+	fail_unless(!!ctx, "no thrmgr");
+	fail_unless(pxy_thrmgr_run(ctx) == 0, "run failed");
+	/* a single name spills over once its thread exceeds the bound */
+	first = pxy_thrmgr_select_sni(ctx, 0, "hot.example.org");
+	for (int i = 0; i < 40; i++) {
+		idx = pxy_thrmgr_select_sni(ctx, 0, "hot.example.org");
+		fail_unless(idx >= 0 && idx < 4, "thread index out of range");
+		idx = pxy_thrmgr_attach_thr(ctx, idx, &evbase, &dnsbase);
+		seen[idx]++;
+	}
+	fail_unless(seen[first] > 10, "preferred thread not preferred");
+	for (int i = 0; i < 4; i++) {
+		/* ceil(1.25 * 40 / 4) */
+		fail_unless(seen[i] <= 13, "load bound exceeded");
+		fail_unless(seen[i] > 0, "no spill over to thread");
+		while (seen[i]--)
+			pxy_thrmgr_detach(ctx, i);
+	}
+	pxy_thrmgr_free(ctx);
+	opts_free(opts);
+}
+END_TEST
+
+START_TEST(pxythrmgr_rebalance_01)
+{
+	pxy_thrmgr_ctx_t *ctx;
+	opts_t *opts;
+	size_t excess;
+
+	opts = opts_new();
+	opts_set_worker_threads(opts, "sslsplit", "4");
+	ctx = pxy_thrmgr_new(opts);
+	fail_unless(!!ctx, "no thrmgr");
+	fail_unless(pxy_thrmgr_run(ctx) == 0, "run failed");
+	pxy_thrmgr_set_rate(ctx, 0, 1000);
+	pxy_thrmgr_set_rate(ctx, 1, 400);
+	pxy_thrmgr_set_rate(ctx, 2, 200);
+	pxy_thrmgr_set_rate(ctx, 3, 600);
+	fail_unless(pxy_thrmgr_rebalance_target(ctx, 0, &excess) == 2,
+	            "hot thread not moving to coolest thread");
+	fail_unless(excess == 400, "wrong excess");
+	fail_unless(pxy_thrmgr_rebalance_target(ctx, 3, &excess) == -1,
+	            "thread within slack moving");
+	fail_unless(excess == 0, "excess set without target");
+	fail_unless(pxy_thrmgr_rebalance_target(ctx, 2, &excess) == -1,
+	            "cool thread moving");
+	pxy_thrmgr_free(ctx);
+	opts_free(opts);
+}
+END_TEST
+
+START_TEST(pxythrmgr_rebalance_02)
+{
+	pxy_thrmgr_ctx_t *ctx;
+	opts_t *opts;
+	size_t excess;
+
+	opts = opts_new();
+	opts_set_worker_threads(opts, "sslsplit", "1");
+	ctx = pxy_thrmgr_new(opts);
+	fail_unless(!!ctx, "no thrmgr");
+	fail_unless(pxy_thrmgr_run(ctx) == 0, "run failed");
+	pxy_thrmgr_set_rate(ctx, 0, 1000);
+	fail_unless(pxy_thrmgr_rebalance_target(ctx, 0, &excess) == -1,
+	            "single thread moving");
+	pxy_thrmgr_free(ctx);
+	opts_free(opts);
+}
+END_TEST
+
+static void
+pxythrmgr_setup(void)
+{
+	/* as in proxy_new(); required for breaking the loops cross-thread */
+	evthread_use_pthreads();
+}
+
+START_TEST(pxythrmgr_workers_01)
+{
+	pxy_thrmgr_ctx_t *ctx;
+	struct event_base *evbase;
+	struct evdns_base *dnsbase;
+	opts_t *opts;
+	int idx;
+
+	opts = opts_new();
+	opts_set_worker_threads(opts, "sslsplit", "3");
+	opts_set_worker_cpus(opts, "sslsplit", "0");
+	ctx = pxy_thrmgr_new(opts);
+	fail_unless(!!ctx, "no thrmgr");
+	fail_unless(pxy_thrmgr_num_thr(ctx) == 3, "wrong number of threads");
+	fail_unless(pxy_thrmgr_run(ctx) == 0, "run failed");
+	idx = pxy_thrmgr_attach(ctx, 0, NULL, &evbase, &dnsbase);
+	fail_unless(idx >= 0 && idx < 3, "thread index out of range");
+	fail_unless(!!evbase, "no event base");
+	pxy_thrmgr_detach(ctx, idx);
+	pxy_thrmgr_free(ctx);
+	opts_free(opts);
+}
+END_TEST
+
+START_TEST(pxythrmgr_workers_02)
+{
+	pxy_thrmgr_ctx_t *ctx;
+	struct event_base *evbase;
+	struct evdns_base *dnsbase;
+	opts_t *opts;
+	int wpool, first, n, idx;
+
+	opts = opts_new();
+	opts_set_worker_threads(opts, "sslsplit", "2");
+	opts_set_workerpool(opts, "sslsplit", "isolated 3");
+	ctx = pxy_thrmgr_new(opts);
+	fail_unless(!!ctx, "no thrmgr");
+	fail_unless(pxy_thrmgr_num_thr(ctx) == 5, "wrong number of threads");
+	fail_unless(pxy_thrmgr_wpool_find(ctx, NULL) == 0, "no default pool");
+	fail_unless(pxy_thrmgr_wpool_find(ctx, "other") == -1,
+	            "unknown pool found");
+	wpool = pxy_thrmgr_wpool_find(ctx, "isolated");
+	fail_unless(wpool == 1, "pool not found");
+	n = pxy_thrmgr_wpool_range(ctx, wpool, &first);
+	fail_unless(first == 2 && n == 3, "wrong pool range");
+	fail_unless(pxy_thrmgr_run(ctx) == 0, "run failed");
+	for (int i = 0; i < 16; i++) {
+		idx = pxy_thrmgr_attach(ctx, wpool, NULL, &evbase, &dnsbase);
+		fail_unless(idx >= 2 && idx < 5, "thread outside of pool");
+		pxy_thrmgr_detach(ctx, idx);
+		idx = pxy_thrmgr_attach(ctx, 0, NULL, &evbase, &dnsbase);
+		fail_unless(idx >= 0 && idx < 2, "thread outside of default");
+		pxy_thrmgr_detach(ctx, idx);
+	}
+	pxy_thrmgr_free(ctx);
+	opts_free(opts);
+}
+END_TEST
+
+static void
+pxythrmgr_conn_count_cb(void *obj, void *arg)
+{
+	*(int *)arg += *(int *)obj;
+}
+
+START_TEST(pxythrmgr_conns_01)
+{
+	pxy_thrmgr_ctx_t *ctx;
+	pxy_thr_link_t link[3];
+	int val[3] = {1, 10, 100};
+	opts_t *opts;
+	int sum;
+
+	opts = opts_new();
+	ctx = pxy_thrmgr_new(opts);
+	fail_unless(!!ctx, "no thrmgr");
+	fail_unless(pxy_thrmgr_num_thr(ctx) > 1, "not enough threads");
+	fail_unless(pxy_thrmgr_run(ctx) == 0, "run failed");
+	for (int i = 0; i < 3; i++)
+		pxy_thrmgr_conn_register(ctx, i == 2, &link[i], &val[i]);
+	sum = 0;
+	pxy_thrmgr_conn_foreach(ctx, 0, pxythrmgr_conn_count_cb, &sum);
+	fail_unless(sum == 11, "wrong connections on thread 0");
+	sum = 0;
+	pxy_thrmgr_conn_foreach(ctx, 1, pxythrmgr_conn_count_cb, &sum);
+	fail_unless(sum == 100, "wrong connections on thread 1");
+	pxy_thrmgr_conn_unregister(ctx, 0, &link[1]);
+	pxy_thrmgr_conn_unregister(ctx, 0, &link[1]);
+	sum = 0;
+	pxy_thrmgr_conn_foreach(ctx, 0, pxythrmgr_conn_count_cb, &sum);
+	fail_unless(sum == 1, "unregistering middle failed");
+	pxy_thrmgr_conn_unregister(ctx, 0, &link[0]);
+	pxy_thrmgr_conn_unregister(ctx, 1, &link[2]);
+	sum = 0;
+	pxy_thrmgr_conn_foreach(ctx, 0, pxythrmgr_conn_count_cb, &sum);
+	pxy_thrmgr_conn_foreach(ctx, 1, pxythrmgr_conn_count_cb, &sum);
+	fail_unless(sum == 0, "registry not empty");
+	pxy_thrmgr_free(ctx);
+	opts_free(opts);
+}
+END_TEST
+
 Suite *
 pxythrmgr_suite(void)
 {
@@ -123,6 +531,24 @@ pxythrmgr_suite(void)
 	tcase_add_test(tc, pxythrmgr_libevent_05);
 	suite_add_tcase(s, tc);
 
+	tc = tcase_create("pxythrmgr_attach");
+	tcase_add_checked_fixture(tc, pxythrmgr_setup, NULL);
+	tcase_add_test(tc, pxythrmgr_attach_thr_01);
+	tcase_add_test(tc, pxythrmgr_attach_02);
+	tcase_add_test(tc, pxythrmgr_attach_03);
+	tcase_add_test(tc, pxythrmgr_attach_04);
+	tcase_add_test(tc, pxythrmgr_attach_05);
+	tcase_add_test(tc, pxythrmgr_attach_06);
+	tcase_add_test(tc, pxythrmgr_attach_07);
+	tcase_add_test(tc, pxythrmgr_select_sni_01);
+	tcase_add_test(tc, pxythrmgr_select_sni_02);
+	tcase_add_test(tc, pxythrmgr_rebalance_01);
+	tcase_add_test(tc, pxythrmgr_rebalance_02);
+	tcase_add_test(tc, pxythrmgr_workers_01);
+	tcase_add_test(tc, pxythrmgr_workers_02);
+	tcase_add_test(tc, pxythrmgr_conns_01);
+	suite_add_tcase(s, tc);
+
 	return s;
 }
 
@@ -0,0 +1,710 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "rcache.h"
+
+#include "thrqueue.h"
+#include "sys.h"
+#include "log.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/*
+ * Client for a cache of opaque byte strings on one or more remote servers
+ * speaking the memcached text protocol, shared by all sslsplit instances
+ * configured with the same servers.
+ *
+ * All network I/O happens on a single remote cache thread, which processes
+ * requests from a queue one by one over one blocking connection per server,
+ * with every send and receive bounded by the configured timeout.  Stores
+ * and deletes are fire-and-forget and use the noreply flavour of the
+ * commands.  Lookups either complete through a callback invoked on the
+ * remote cache thread, such that connection handling threads never wait for
+ * the network, or block the calling thread, which is meant for threads that
+ * are off the event loops anyway, such as the forging threads.  Requests
+ * that do not fit into the queue are dropped; lookups then miss.
+ *
+ * Keys are hex-encoded with a fixed prefix to satisfy the key syntax of the
+ * protocol, and each key is stored on the server selected by a hash of the
+ * key that is the same for all instances.  A server that fails or times out
+ * is disconnected and skipped for RCACHE_RETRY seconds, while its keys are
+ * looked up on the next server instead.
+ */
+
+#define RCACHE_QUEUE_SIZE	1024
+#define RCACHE_MAXSERVERS	64
+#define RCACHE_RETRY		1
+#define RCACHE_PREFIX		"sslsplit:"
+#define RCACHE_MAXKEYSZ		120	/* hex-encoded keys fit 250 octets */
+#define RCACHE_MAXVALSZ		(1024*1024 - 4096)
+#define RCACHE_MAXLINESZ	512
+#define RCACHE_MAXTTL		(30*24*60*60)
+
+#define RCACHE_GET		0
+#define RCACHE_SET		1
+#define RCACHE_DEL		2
+
+typedef struct {
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	int fd;
+	time_t retry;		/* no reconnects before this time */
+	unsigned char *buf;	/* octets received from the server */
+	size_t len;
+	size_t sz;
+} rcache_server_t;
+
+typedef struct {
+	int op;
+	const unsigned char *key;
+	size_t keysz;
+	unsigned char *val;
+	size_t valsz;
+	unsigned int ttl;
+	rcache_cb_t cb;
+	void *arg;
+	/* set for synchronous lookups, which live on the caller's stack */
+	pthread_mutex_t *mutex;
+	pthread_cond_t *cond;
+	int done;
+} rcache_req_t;
+
+struct rcache {
+	rcache_server_t *srv;
+	size_t nsrv;
+	struct timeval timeout;
+	thrqueue_t *queue;
+	pthread_t thr;
+	int running;
+	int stopping;
+};
+
+/*
+ * Hash used to select the server for a key; must be the same for all
+ * instances sharing the servers, hence no per-process seed.
+ */
+static uint32_t
+rcache_hash(const unsigned char *key, size_t keysz)
+{
+	uint32_t h = 2166136261U;
+
+	for (size_t i = 0; i < keysz; i++) {
+		h ^= key[i];
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/*
+ * Parse a comma-separated list of host:port or [host]:port server
+ * addresses.  Returns -1 on errors, 0 on success.
+ */
+static int
+rcache_parse(rcache_t *cache, const char *servers)
+{
+	char *list, *tok, *save, *host, *port;
+	size_t sz;
+
+	if (!(list = strdup(servers)))
+		return -1;
+	for (tok = strtok_r(list, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		if (cache->nsrv == RCACHE_MAXSERVERS) {
+			log_err_printf("Too many remote cache servers, "
+			               "maximum is %d\n", RCACHE_MAXSERVERS);
+			goto errout;
+		}
+		host = tok;
+		if (!(port = strrchr(tok, ':')) || port == tok ||
+		    port[1] == '\0') {
+			log_err_printf("Invalid remote cache server '%s', "
+			               "use host:port\n", tok);
+			goto errout;
+		}
+		*port++ = '\0';
+		sz = strlen(host);
+		if (host[0] == '[' && sz > 2 && host[sz - 1] == ']') {
+			host[sz - 1] = '\0';
+			host++;
+		}
+		if (sys_sockaddr_parse(&cache->srv[cache->nsrv].addr,
+		                       &cache->srv[cache->nsrv].addrlen,
+		                       host, port, AF_UNSPEC, 0) == -1)
+			goto errout;
+		cache->srv[cache->nsrv].fd = -1;
+		cache->nsrv++;
+	}
+	free(list);
+	if (cache->nsrv == 0) {
+		log_err_printf("No remote cache servers in '%s'\n", servers);
+		return -1;
+	}
+	return 0;
+
+errout:
+	free(list);
+	return -1;
+}
+
+/*
+ * Create a remote cache client for the servers given as a comma-separated
+ * list of host:port addresses, with timeout milliseconds for each network
+ * operation.  Addresses are resolved immediately, such that no name
+ * resolution is needed after dropping privileges.  Does not start the
+ * remote cache thread yet.  Returns NULL on errors.
+ */
+rcache_t *
+rcache_new(const char *servers, unsigned int timeout)
+{
+	rcache_t *cache;
+
+	if (!(cache = malloc(sizeof(rcache_t))))
+		return NULL;
+	memset(cache, 0, sizeof(rcache_t));
+	if (!(cache->srv = calloc(RCACHE_MAXSERVERS,
+	                          sizeof(rcache_server_t)))) {
+		free(cache);
+		return NULL;
+	}
+	if (rcache_parse(cache, servers) == -1) {
+		free(cache->srv);
+		free(cache);
+		return NULL;
+	}
+	cache->timeout.tv_sec = timeout / 1000;
+	cache->timeout.tv_usec = (timeout % 1000) * 1000;
+	return cache;
+}
+
+static void
+rcache_disconnect(rcache_server_t *srv)
+{
+	close(srv->fd);
+	srv->fd = -1;
+	srv->len = 0;
+	srv->retry = time(NULL) + RCACHE_RETRY;
+}
+
+/*
+ * Connect to srv unless already connected, waiting at most for the timeout.
+ * Returns -1 if the server is unavailable, 0 if connected.
+ */
+static int
+rcache_connect(rcache_t *cache, rcache_server_t *srv)
+{
+	struct pollfd pfd;
+	int fd, flags, on = 1, err;
+	socklen_t errsz = sizeof(err);
+
+	if (srv->fd != -1)
+		return 0;
+	if (time(NULL) < srv->retry)
+		return -1;
+	if ((fd = socket(srv->addr.ss_family, SOCK_STREAM, 0)) == -1)
+		goto errout;
+	if ((flags = fcntl(fd, F_GETFL)) == -1 ||
+	    fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+		goto errout;
+	if (connect(fd, (struct sockaddr *)&srv->addr, srv->addrlen) == -1) {
+		if (errno != EINPROGRESS)
+			goto errout;
+		pfd.fd = fd;
+		pfd.events = POLLOUT;
+		if (poll(&pfd, 1, cache->timeout.tv_sec * 1000 +
+		                  cache->timeout.tv_usec / 1000) != 1)
+			goto errout;
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errsz) == -1 ||
+		    err != 0)
+			goto errout;
+	}
+	if (fcntl(fd, F_SETFL, flags) == -1 ||
+	    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &cache->timeout,
+	               sizeof(cache->timeout)) == -1 ||
+	    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &cache->timeout,
+	               sizeof(cache->timeout)) == -1 ||
+	    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) == -1)
+		goto errout;
+#ifdef SO_NOSIGPIPE
+	if (setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on)) == -1)
+		goto errout;
+#endif /* SO_NOSIGPIPE */
+	srv->fd = fd;
+	srv->len = 0;
+	return 0;
+
+errout:
+	if (fd != -1)
+		close(fd);
+	srv->retry = time(NULL) + RCACHE_RETRY;
+	log_dbg_printf("Remote cache server unavailable\n");
+	return -1;
+}
+
+/*
+ * Select the server for key and connect to it if needed, falling back to
+ * the following servers if it is unavailable.  Returns NULL if no server is
+ * available.
+ */
+static rcache_server_t *
+rcache_server(rcache_t *cache, const unsigned char *key, size_t keysz)
+{
+	size_t idx = rcache_hash(key, keysz) % cache->nsrv;
+
+	for (size_t i = 0; i < cache->nsrv; i++) {
+		rcache_server_t *srv = &cache->srv[(idx + i) % cache->nsrv];
+		if (rcache_connect(cache, srv) == 0)
+			return srv;
+	}
+	return NULL;
+}
+
+/*
+ * Write the protocol form of key into buf, which must hold
+ * sizeof(RCACHE_PREFIX) + 2 * RCACHE_MAXKEYSZ octets.
+ */
+static void
+rcache_mkkey(char *buf, const unsigned char *key, size_t keysz)
+{
+	static const char hex[] = "0123456789abcdef";
+	char *p;
+
+	memcpy(buf, RCACHE_PREFIX, sizeof(RCACHE_PREFIX) - 1);
+	p = buf + sizeof(RCACHE_PREFIX) - 1;
+	for (size_t i = 0; i < keysz; i++) {
+		*p++ = hex[key[i] >> 4];
+		*p++ = hex[key[i] & 0xf];
+	}
+	*p = '\0';
+}
+
+/*
+ * Receive from srv until at least need octets are buffered.
+ * Returns -1 on errors and timeouts, 0 on success.
+ */
+static int
+rcache_recv(rcache_server_t *srv, size_t need)
+{
+	size_t sz = need < RCACHE_MAXLINESZ ? RCACHE_MAXLINESZ : need;
+	ssize_t n;
+
+	if (sz > srv->sz) {
+		unsigned char *p = realloc(srv->buf, sz);
+		if (!p)
+			return -1;
+		srv->buf = p;
+		srv->sz = sz;
+	}
+	while (srv->len < need) {
+		do {
+			n = recv(srv->fd, srv->buf + srv->len,
+			         srv->sz - srv->len, 0);
+		} while (n == -1 && errno == EINTR);
+		if (n <= 0)
+			return -1;
+		srv->len += n;
+	}
+	return 0;
+}
+
+/*
+ * Receive the first line of a response.
+ * Returns the size of the line including CRLF, or 0 on errors.
+ */
+static size_t
+rcache_recv_line(rcache_server_t *srv)
+{
+	unsigned char *eol;
+
+	for (;;) {
+		if (srv->len > 0 &&
+		    (eol = memchr(srv->buf, '\n', srv->len))) {
+			if (eol == srv->buf || eol[-1] != '\r')
+				return 0;
+			return eol - srv->buf + 1;
+		}
+		if (srv->len >= RCACHE_MAXLINESZ ||
+		    rcache_recv(srv, srv->len + 1) == -1)
+			return 0;
+	}
+}
+
+static int
+rcache_send(rcache_server_t *srv, struct iovec *iov, int iovcnt)
+{
+	ssize_t n, total = 0;
+	struct msghdr msg;
+
+	for (int i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+	while (total > 0) {
+		do {
+#ifdef MSG_NOSIGNAL
+			n = sendmsg(srv->fd, &msg, MSG_NOSIGNAL);
+#else /* !MSG_NOSIGNAL */
+			n = sendmsg(srv->fd, &msg, 0);
+#endif /* !MSG_NOSIGNAL */
+		} while (n == -1 && errno == EINTR);
+		if (n <= 0)
+			return -1;
+		total -= n;
+		while (msg.msg_iovlen > 0 &&
+		       (size_t)n >= msg.msg_iov->iov_len) {
+			n -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (msg.msg_iovlen > 0) {
+			msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base
+			                        + n;
+			msg.msg_iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Look up req on srv, setting req->val on hits.
+ * Returns -1 on errors that leave the connection unusable, 0 otherwise.
+ */
+static int
+rcache_srv_get(rcache_server_t *srv, rcache_req_t *req)
+{
+	char key[sizeof(RCACHE_PREFIX) + 2 * RCACHE_MAXKEYSZ];
+	char cmd[sizeof(key) + 8];
+	struct iovec iov[1];
+	size_t linesz, valsz;
+	char line[RCACHE_MAXLINESZ + 1];
+
+	rcache_mkkey(key, req->key, req->keysz);
+	iov[0].iov_base = cmd;
+	iov[0].iov_len = snprintf(cmd, sizeof(cmd), "get %s\r\n", key);
+	if (rcache_send(srv, iov, 1) == -1)
+		return -1;
+	if (!(linesz = rcache_recv_line(srv)) || linesz > RCACHE_MAXLINESZ)
+		return -1;
+	memcpy(line, srv->buf, linesz);
+	line[linesz] = '\0';
+	if (!strcmp(line, "END\r\n")) {
+		if (srv->len != linesz)
+			return -1;
+		srv->len = 0;
+		return 0;
+	}
+	if (sscanf(line, "VALUE %*s %*u %zu\r\n", &valsz) != 1 ||
+	    valsz > RCACHE_MAXVALSZ)
+		return -1;
+	/* value, CRLF, END CRLF */
+	if (rcache_recv(srv, linesz + valsz + 7) == -1)
+		return -1;
+	if (srv->len != linesz + valsz + 7 ||
+	    memcmp(srv->buf + linesz + valsz, "\r\nEND\r\n", 7))
+		return -1;
+	srv->len = 0;
+	if (!(req->val = malloc(valsz ? valsz : 1)))
+		return 0;
+	memcpy(req->val, srv->buf + linesz, valsz);
+	req->valsz = valsz;
+	return 0;
+}
+
+/*
+ * Store or delete req on srv.
+ * Returns -1 on errors that leave the connection unusable, 0 otherwise.
+ */
+static int
+rcache_srv_store(rcache_server_t *srv, rcache_req_t *req)
+{
+	char key[sizeof(RCACHE_PREFIX) + 2 * RCACHE_MAXKEYSZ];
+	char cmd[sizeof(key) + 64];
+	struct iovec iov[3];
+
+	rcache_mkkey(key, req->key, req->keysz);
+	iov[0].iov_base = cmd;
+	if (req->op == RCACHE_DEL) {
+		iov[0].iov_len = snprintf(cmd, sizeof(cmd),
+		                          "delete %s noreply\r\n", key);
+		return rcache_send(srv, iov, 1);
+	}
+	iov[0].iov_len = snprintf(cmd, sizeof(cmd),
+	                          "set %s 0 %u %zu noreply\r\n",
+	                          key, req->ttl, req->valsz);
+	iov[1].iov_base = req->val;
+	iov[1].iov_len = req->valsz;
+	iov[2].iov_base = "\r\n";
+	iov[2].iov_len = 2;
+	return rcache_send(srv, iov, 3);
+}
+
+/*
+ * Complete a request and free it, unless it is a synchronous lookup, which
+ * is owned by the waiting thread.
+ */
+static void
+rcache_req_done(rcache_req_t *req)
+{
+	if (req->mutex) {
+		pthread_mutex_lock(req->mutex);
+		req->done = 1;
+		pthread_cond_signal(req->cond);
+		pthread_mutex_unlock(req->mutex);
+		return;
+	}
+	if (req->op == RCACHE_GET) {
+		req->cb(req->val, req->valsz, req->arg);
+	}
+	free(req);
+}
+
+/*
+ * Thread entry point; runs requests until the queue is unblocked.
+ * Requests still queued when stopping complete as misses.
+ */
+static void *
+rcache_thr(void *arg)
+{
+	rcache_t *cache = arg;
+	rcache_server_t *srv;
+	rcache_req_t *req;
+	int rv;
+
+	while ((req = thrqueue_dequeue(cache->queue))) {
+		if (__atomic_load_n(&cache->stopping, __ATOMIC_ACQUIRE)) {
+			rcache_req_done(req);
+			continue;
+		}
+		if ((srv = rcache_server(cache, req->key, req->keysz))) {
+			if (req->op == RCACHE_GET) {
+				rv = rcache_srv_get(srv, req);
+			} else {
+				rv = rcache_srv_store(srv, req);
+			}
+			if (rv == -1) {
+				log_dbg_printf("Remote cache server failed; "
+				               "disconnecting\n");
+				rcache_disconnect(srv);
+			}
+		}
+		rcache_req_done(req);
+	}
+	return NULL;
+}
+
+/*
+ * Start the remote cache thread; must be called after forking, in every
+ * process using the cache.  Returns -1 on failure, 0 on success.
+ */
+int
+rcache_run(rcache_t *cache)
+{
+	if (!(cache->queue = thrqueue_new(RCACHE_QUEUE_SIZE)))
+		return -1;
+	if (pthread_create(&cache->thr, NULL, rcache_thr, cache)) {
+		thrqueue_free(cache->queue);
+		cache->queue = NULL;
+		return -1;
+	}
+	cache->running = 1;
+	return 0;
+}
+
+/*
+ * Stop the remote cache thread and free the client.  Must not be called
+ * while other threads may still submit requests.
+ */
+void
+rcache_free(rcache_t *cache)
+{
+	rcache_req_t *req;
+
+	if (cache->running) {
+		__atomic_store_n(&cache->stopping, 1, __ATOMIC_RELEASE);
+		thrqueue_unblock_dequeue(cache->queue);
+		pthread_join(cache->thr, NULL);
+	}
+	if (cache->queue) {
+		while ((req = thrqueue_dequeue_nb(cache->queue)))
+			rcache_req_done(req);
+		thrqueue_free(cache->queue);
+	}
+	for (size_t i = 0; i < cache->nsrv; i++) {
+		if (cache->srv[i].fd != -1)
+			close(cache->srv[i].fd);
+		free(cache->srv[i].buf);
+	}
+	free(cache->srv);
+	free(cache);
+}
+
+/*
+ * Allocate an asynchronous request with copies of key and val.
+ */
+static rcache_req_t *
+rcache_req_new(int op, const void *key, size_t keysz, const void *val,
+               size_t valsz)
+{
+	rcache_req_t *req;
+
+	if (!(req = malloc(sizeof(rcache_req_t) + keysz + valsz)))
+		return NULL;
+	memset(req, 0, sizeof(rcache_req_t));
+	req->op = op;
+	memcpy(req + 1, key, keysz);
+	req->key = (unsigned char *)(req + 1);
+	req->keysz = keysz;
+	if (val) {
+		req->val = (unsigned char *)(req + 1) + keysz;
+		memcpy(req->val, val, valsz);
+		req->valsz = valsz;
+	}
+	return req;
+}
+
+/*
+ * Look up key, blocking the calling thread for up to about twice the
+ * timeout plus the time spent on requests queued before it.  Must not be
+ * called from connection handling threads.  On hits, returns 1 and a newly
+ * allocated copy of the value in *val and its size in *valsz.  Returns 0 on
+ * misses and errors.
+ */
+int
+rcache_get(rcache_t *cache, const void *key, size_t keysz,
+           unsigned char **val, size_t *valsz)
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	rcache_req_t req;
+
+	if (!cache->running || keysz > RCACHE_MAXKEYSZ)
+		return 0;
+	if (pthread_mutex_init(&mutex, NULL))
+		return 0;
+	if (pthread_cond_init(&cond, NULL)) {
+		pthread_mutex_destroy(&mutex);
+		return 0;
+	}
+	memset(&req, 0, sizeof(req));
+	req.op = RCACHE_GET;
+	req.key = key;
+	req.keysz = keysz;
+	req.mutex = &mutex;
+	req.cond = &cond;
+	if (thrqueue_enqueue_nb(cache->queue, &req)) {
+		pthread_mutex_lock(&mutex);
+		while (!req.done)
+			pthread_cond_wait(&cond, &mutex);
+		pthread_mutex_unlock(&mutex);
+	}
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&mutex);
+	if (!req.val)
+		return 0;
+	*val = req.val;
+	*valsz = req.valsz;
+	return 1;
+}
+
+/*
+ * Look up key without blocking.  cb is called with arg and the value, or
+ * NULL on misses, on the remote cache thread.
+ * Returns -1 if the lookup could not be queued, in which case cb is not
+ * called, 0 otherwise.
+ */
+int
+rcache_get_async(rcache_t *cache, const void *key, size_t keysz,
+                 rcache_cb_t cb, void *arg)
+{
+	rcache_req_t *req;
+
+	if (!cache->running || keysz > RCACHE_MAXKEYSZ)
+		return -1;
+	if (!(req = rcache_req_new(RCACHE_GET, key, keysz, NULL, 0)))
+		return -1;
+	req->cb = cb;
+	req->arg = arg;
+	if (!thrqueue_enqueue_nb(cache->queue, req)) {
+		free(req);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Store val under key for ttl seconds, at most 30 days, without blocking.
+ * The value is dropped if the queue is full or the value too large.
+ */
+void
+rcache_set(rcache_t *cache, const void *key, size_t keysz, const void *val,
+           size_t valsz, unsigned int ttl)
+{
+	rcache_req_t *req;
+
+	if (!cache->running || keysz > RCACHE_MAXKEYSZ ||
+	    valsz > RCACHE_MAXVALSZ || ttl == 0)
+		return;
+	if (!(req = rcache_req_new(RCACHE_SET, key, keysz, val, valsz)))
+		return;
+	req->ttl = ttl > RCACHE_MAXTTL ? RCACHE_MAXTTL : ttl;
+	if (!thrqueue_enqueue_nb(cache->queue, req))
+		free(req);
+}
+
+/*
+ * Delete key without blocking.
+ */
+void
+rcache_del(rcache_t *cache, const void *key, size_t keysz)
+{
+	rcache_req_t *req;
+
+	if (!cache->running || keysz > RCACHE_MAXKEYSZ)
+		return;
+	if (!(req = rcache_req_new(RCACHE_DEL, key, keysz, NULL, 0)))
+		return;
+	if (!thrqueue_enqueue_nb(cache->queue, req))
+		free(req);
+}
+
+/* vim: set noet ft=c: */
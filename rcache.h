@@ -0,0 +1,58 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RCACHE_H
+#define RCACHE_H
+
+#include "attrib.h"
+
+#include <stddef.h>
+
+typedef struct rcache rcache_t;
+
+/*
+ * Completion callback of rcache_get_async(), invoked on the remote cache
+ * thread.  The callback takes ownership of the value, which is NULL on
+ * misses and errors.
+ */
+typedef void (*rcache_cb_t)(unsigned char *, size_t, void *);
+
+rcache_t * rcache_new(const char *, unsigned int) NONNULL(1) MALLOC;
+int rcache_run(rcache_t *) NONNULL(1) WUNRES;
+void rcache_free(rcache_t *) NONNULL(1);
+int rcache_get(rcache_t *, const void *, size_t, unsigned char **,
+               size_t *) NONNULL(1,2,4,5) WUNRES;
+int rcache_get_async(rcache_t *, const void *, size_t, rcache_cb_t, void *)
+    NONNULL(1,2,4) WUNRES;
+void rcache_set(rcache_t *, const void *, size_t, const void *, size_t,
+                unsigned int) NONNULL(1,2,4);
+void rcache_del(rcache_t *, const void *, size_t) NONNULL(1,2);
+
+#endif /* !RCACHE_H */
+
+/* vim: set noet ft=c: */
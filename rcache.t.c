@@ -0,0 +1,282 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "rcache.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <check.h>
+
+/*
+ * Minimal memcached server for a single connection, supporting get, set and
+ * delete with noreply on a small table of entries.
+ */
+#define MCD_ENTRIES 16
+
+static struct {
+	char key[256];
+	char *val;
+	size_t valsz;
+} mcd_tab[MCD_ENTRIES];
+static int mcd_fd;
+static char mcd_addr[32];
+
+static int
+mcd_readline(FILE *f, char *buf, size_t sz)
+{
+	size_t len;
+
+	if (!fgets(buf, sz, f))
+		return -1;
+	len = strlen(buf);
+	if (len < 2 || buf[len - 2] != '\r')
+		return -1;
+	buf[len - 2] = '\0';
+	return 0;
+}
+
+static void *
+mcd_thr(UNUSED void *arg)
+{
+	char line[512], key[256];
+	unsigned int flags, ttl;
+	size_t sz;
+	FILE *f;
+	int fd;
+
+	if ((fd = accept(mcd_fd, NULL, NULL)) == -1)
+		return NULL;
+	f = fdopen(fd, "r+");
+	while (mcd_readline(f, line, sizeof(line)) == 0) {
+		int i;
+		if (sscanf(line, "get %255s", key) == 1) {
+			for (i = 0; i < MCD_ENTRIES; i++) {
+				if (mcd_tab[i].val &&
+				    !strcmp(mcd_tab[i].key, key)) {
+					fprintf(f, "VALUE %s 0 %zu\r\n", key,
+					        mcd_tab[i].valsz);
+					fwrite(mcd_tab[i].val, 1,
+					       mcd_tab[i].valsz, f);
+					fprintf(f, "\r\n");
+					break;
+				}
+			}
+			fprintf(f, "END\r\n");
+			fflush(f);
+		} else if (sscanf(line, "set %255s %u %u %zu noreply", key,
+		                  &flags, &ttl, &sz) == 4) {
+			for (i = 0; i < MCD_ENTRIES - 1; i++) {
+				if (!mcd_tab[i].val ||
+				    !strcmp(mcd_tab[i].key, key))
+					break;
+			}
+			free(mcd_tab[i].val);
+			strcpy(mcd_tab[i].key, key);
+			mcd_tab[i].val = malloc(sz + 2);
+			mcd_tab[i].valsz = sz;
+			if (fread(mcd_tab[i].val, 1, sz + 2, f) != sz + 2)
+				break;
+		} else if (sscanf(line, "delete %255s noreply", key) == 1) {
+			for (i = 0; i < MCD_ENTRIES; i++) {
+				if (mcd_tab[i].val &&
+				    !strcmp(mcd_tab[i].key, key)) {
+					free(mcd_tab[i].val);
+					mcd_tab[i].val = NULL;
+				}
+			}
+		} else {
+			break;
+		}
+		fseek(f, 0, SEEK_CUR);
+	}
+	fclose(f);
+	return NULL;
+}
+
+static pthread_t mcd_thread;
+
+static void
+mcd_setup(void)
+{
+	struct sockaddr_in sin;
+	socklen_t sinsz = sizeof(sin);
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	mcd_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (mcd_fd == -1 ||
+	    bind(mcd_fd, (struct sockaddr *)&sin, sizeof(sin)) == -1 ||
+	    listen(mcd_fd, 1) == -1 ||
+	    getsockname(mcd_fd, (struct sockaddr *)&sin, &sinsz) == -1) {
+		fprintf(stderr, "failed to set up memcached server\n");
+		exit(EXIT_FAILURE);
+	}
+	snprintf(mcd_addr, sizeof(mcd_addr), "127.0.0.1:%u",
+	         ntohs(sin.sin_port));
+	if (pthread_create(&mcd_thread, NULL, mcd_thr, NULL)) {
+		fprintf(stderr, "failed to start memcached server\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void
+mcd_teardown(void)
+{
+	close(mcd_fd);
+}
+
+START_TEST(rcache_new_01)
+{
+	fail_unless(!rcache_new("127.0.0.1", 50), "accepted missing port");
+	fail_unless(!rcache_new("127.0.0.1:", 50), "accepted empty port");
+	fail_unless(!rcache_new(":11211", 50), "accepted empty host");
+	fail_unless(!rcache_new("", 50), "accepted empty list");
+}
+END_TEST
+
+START_TEST(rcache_get_01)
+{
+	rcache_t *cache;
+	unsigned char *val;
+	size_t valsz;
+
+	cache = rcache_new(mcd_addr, 1000);
+	fail_unless(!!cache, "new failed");
+	fail_unless(rcache_run(cache) == 0, "run failed");
+	fail_unless(rcache_get(cache, "\x01key", 4, &val, &valsz) == 0,
+	            "hit on empty server");
+	rcache_set(cache, "\x01key", 4, "val\r\nue\0", 9, 60);
+	fail_unless(rcache_get(cache, "\x01key", 4, &val, &valsz) == 1,
+	            "miss after set");
+	fail_unless(valsz == 9 && !memcmp(val, "val\r\nue\0", 9),
+	            "wrong value");
+	free(val);
+	rcache_del(cache, "\x01key", 4);
+	fail_unless(rcache_get(cache, "\x01key", 4, &val, &valsz) == 0,
+	            "hit after del");
+	rcache_free(cache);
+}
+END_TEST
+
+static pthread_mutex_t async_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_cond = PTHREAD_COND_INITIALIZER;
+static int async_done;
+static unsigned char *async_val;
+static size_t async_valsz;
+
+static void
+rcache_get_async_cb(unsigned char *val, size_t valsz, void *arg)
+{
+	pthread_mutex_lock(&async_mutex);
+	async_val = val;
+	async_valsz = valsz;
+	async_done = (int)(intptr_t)arg;
+	pthread_cond_signal(&async_cond);
+	pthread_mutex_unlock(&async_mutex);
+}
+
+START_TEST(rcache_get_async_01)
+{
+	rcache_t *cache;
+
+	cache = rcache_new(mcd_addr, 1000);
+	fail_unless(!!cache, "new failed");
+	fail_unless(rcache_get_async(cache, "k", 1, rcache_get_async_cb,
+	                             NULL) == -1, "queued before run");
+	fail_unless(rcache_run(cache) == 0, "run failed");
+	rcache_set(cache, "k", 1, "v", 1, 60);
+	fail_unless(rcache_get_async(cache, "k", 1, rcache_get_async_cb,
+	                             (void *)1) == 0, "queueing failed");
+	pthread_mutex_lock(&async_mutex);
+	while (!async_done)
+		pthread_cond_wait(&async_cond, &async_mutex);
+	pthread_mutex_unlock(&async_mutex);
+	fail_unless(async_done == 1, "wrong callback arg");
+	fail_unless(async_val && async_valsz == 1 && async_val[0] == 'v',
+	            "wrong value");
+	free(async_val);
+	rcache_free(cache);
+}
+END_TEST
+
+/* unreachable servers miss within the timeout */
+START_TEST(rcache_get_02)
+{
+	rcache_t *cache;
+	unsigned char *val;
+	size_t valsz;
+	char addr[32];
+
+	/* nothing accepts on the listening socket's port once closed */
+	close(mcd_fd);
+	memcpy(addr, mcd_addr, sizeof(addr));
+	cache = rcache_new(addr, 50);
+	fail_unless(!!cache, "new failed");
+	fail_unless(rcache_run(cache) == 0, "run failed");
+	fail_unless(rcache_get(cache, "k", 1, &val, &valsz) == 0,
+	            "hit on unreachable server");
+	rcache_set(cache, "k", 1, "v", 1, 60);
+	fail_unless(rcache_get(cache, "k", 1, &val, &valsz) == 0,
+	            "hit on unreachable server");
+	rcache_free(cache);
+}
+END_TEST
+
+Suite *
+rcache_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("rcache");
+
+	tc = tcase_create("rcache_new");
+	tcase_add_test(tc, rcache_new_01);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("rcache_get");
+	tcase_add_checked_fixture(tc, mcd_setup, mcd_teardown);
+	tcase_add_test(tc, rcache_get_01);
+	tcase_add_test(tc, rcache_get_async_01);
+	tcase_add_test(tc, rcache_get_02);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
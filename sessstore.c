@@ -0,0 +1,310 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "sessstore.h"
+
+#include "dynbuf.h"
+#include "ssl.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*
+ * Persistent snapshot of the src and dst SSL session caches.
+ *
+ * Unlike the forged certificate store, the snapshot is not appended to as
+ * sessions come and go; it is rewritten as a whole on every save, and read
+ * back once at startup.  The file starts with a magic string, followed by a
+ * sequence of records:
+ *
+ *   uint8_t                         SESSSTORE_SRC or SESSSTORE_DST
+ *   uint16_t (big endian)           length of cache key
+ *   uint32_t (big endian)           length of DER encoding
+ *   unsigned char[]                 cache key
+ *   unsigned char[]                 DER encoded SSL_SESSION
+ *
+ * The cache keys are stored verbatim, i.e. the session ID for src sessions
+ * and the destination address, SNI and slot for dst sessions.  On load,
+ * sessions that expired in the meantime are skipped, as is everything from
+ * a truncated or otherwise malformed record on.
+ *
+ * The file holds session master secrets and is therefore created with mode
+ * 0600; it is opened before dropping privileges and kept open.
+ */
+
+#define SESSSTORE_MAGIC         "SSLsplit-sess-1"
+#define SESSSTORE_MAGICSZ       (sizeof(SESSSTORE_MAGIC) - 1)
+#define SESSSTORE_RECHDRSZ      7
+#define SESSSTORE_MAXKEYSZ      0xffff
+#define SESSSTORE_MAXDERSZ      (1 << 20)
+
+#define SESSSTORE_SRC           0
+#define SESSSTORE_DST           1
+
+struct sessstore {
+	int fd;
+	char *path;
+};
+
+typedef struct sessstore_buf {
+	unsigned char *buf;
+	size_t sz;
+	size_t len;
+	int type;
+	size_t n;
+} sessstore_buf_t;
+
+/*
+ * Open or create the session store at path.  Must be called before dropping
+ * privileges.
+ * Returns NULL on error.
+ */
+sessstore_t *
+sessstore_open(const char *path)
+{
+	sessstore_t *store;
+
+	if (!(store = calloc(1, sizeof(sessstore_t))))
+		return NULL;
+	if (!(store->path = strdup(path)))
+		goto out1;
+	store->fd = open(path, O_RDWR|O_CREAT, 0600);
+	if (store->fd == -1) {
+		log_err_printf("Failed to open session store '%s': %s (%i)\n",
+		               path, strerror(errno), errno);
+		goto out0;
+	}
+	return store;
+
+out0:
+	free(store->path);
+out1:
+	free(store);
+	return NULL;
+}
+
+/*
+ * Close the store and free all associated resources.
+ */
+void
+sessstore_close(sessstore_t *store)
+{
+	close(store->fd);
+	free(store->path);
+	free(store);
+}
+
+/*
+ * Read the whole store into a newly allocated buffer.
+ * Returns NULL on error, or if the store is empty.
+ */
+static unsigned char *
+sessstore_read(sessstore_t *store, size_t *sz)
+{
+	unsigned char *buf;
+	struct stat st;
+	size_t off;
+	ssize_t n;
+
+	if (fstat(store->fd, &st) == -1 || st.st_size == 0)
+		return NULL;
+	if (!(buf = malloc(st.st_size)))
+		return NULL;
+	for (off = 0; off < (size_t)st.st_size; off += n) {
+		n = pread(store->fd, buf + off, st.st_size - off, off);
+		if (n == -1 && errno == EINTR) {
+			n = 0;
+			continue;
+		}
+		if (n <= 0)
+			break;
+	}
+	*sz = off;
+	return buf;
+}
+
+/*
+ * Restore the sessions in the store into the src session cache ssess and
+ * the dst session cache dsess, skipping expired sessions.  Must be called
+ * before any connections are handled.
+ * Returns the number of restored sessions, or -1 on error.
+ */
+ssize_t
+sessstore_load(sessstore_t *store, cache_t *ssess, cache_t *dsess)
+{
+	unsigned char *buf;
+	const unsigned char *p, *k;
+	size_t sz, off, keysz, dersz;
+	ssize_t n = 0;
+	SSL_SESSION *sess;
+	dynbuf_t *key;
+	cache_t *cache;
+
+	if (!(buf = sessstore_read(store, &sz)))
+		return 0;
+	if (sz < SESSSTORE_MAGICSZ ||
+	    memcmp(buf, SESSSTORE_MAGIC, SESSSTORE_MAGICSZ)) {
+		log_dbg_printf("Session store '%s' has an unknown format, "
+		               "ignoring\n", store->path);
+		goto out;
+	}
+
+	off = SESSSTORE_MAGICSZ;
+	while (off + SESSSTORE_RECHDRSZ <= sz) {
+		p = buf + off;
+		keysz = ((size_t)p[1] << 8) | (size_t)p[2];
+		dersz = ((size_t)p[3] << 24) | ((size_t)p[4] << 16) |
+		        ((size_t)p[5] << 8) | (size_t)p[6];
+		if (p[0] > SESSSTORE_DST || keysz == 0 || dersz == 0 ||
+		    dersz > SESSSTORE_MAXDERSZ ||
+		    off + SESSSTORE_RECHDRSZ + keysz + dersz > sz)
+			break;
+		cache = p[0] == SESSSTORE_SRC ? ssess : dsess;
+		k = p + SESSSTORE_RECHDRSZ;
+		p = k + keysz;
+		off += SESSSTORE_RECHDRSZ + keysz + dersz;
+		if (!(sess = d2i_SSL_SESSION(NULL, &p, dersz)))
+			continue;
+		if (!ssl_session_is_valid(sess)) {
+			SSL_SESSION_free(sess);
+			continue;
+		}
+		key = dynbuf_new_copy(k, keysz);
+		if (!key) {
+			SSL_SESSION_free(sess);
+			n = -1;
+			goto out;
+		}
+		cache_set(cache, key, sess);
+		n++;
+	}
+	if (off < sz) {
+		log_dbg_printf("Session store '%s' has a malformed record at "
+		               "offset %zu, ignoring tail\n", store->path, off);
+	}
+out:
+	free(buf);
+	return n;
+}
+
+/*
+ * Append a record for key and session val to the buffer in arg.
+ */
+static int
+sessstore_save_cb(cache_key_t key, cache_val_t val, void *arg)
+{
+	sessstore_buf_t *b = arg;
+	dynbuf_t *k = key;
+	unsigned char *p;
+	size_t need;
+	int len;
+
+	len = i2d_SSL_SESSION(val, NULL);
+	if (len <= 0 || len > SESSSTORE_MAXDERSZ ||
+	    k->sz == 0 || k->sz > SESSSTORE_MAXKEYSZ)
+		return 0;
+	need = SESSSTORE_RECHDRSZ + k->sz + len;
+	if (b->len + need > b->sz) {
+		size_t sz = b->sz * 2 > b->len + need ? b->sz * 2
+		                                      : b->len + need;
+		if (!(p = realloc(b->buf, sz)))
+			return -1;
+		b->buf = p;
+		b->sz = sz;
+	}
+	p = b->buf + b->len;
+	p[0] = b->type;
+	p[1] = (k->sz >> 8) & 0xff;
+	p[2] = k->sz & 0xff;
+	p[3] = (len >> 24) & 0xff;
+	p[4] = (len >> 16) & 0xff;
+	p[5] = (len >> 8) & 0xff;
+	p[6] = len & 0xff;
+	memcpy(p + SESSSTORE_RECHDRSZ, k->buf, k->sz);
+	p += SESSSTORE_RECHDRSZ + k->sz;
+	i2d_SSL_SESSION(val, &p);
+	b->len += need;
+	b->n++;
+	return 0;
+}
+
+/*
+ * Replace the contents of the store with the valid sessions currently in
+ * the src session cache ssess and the dst session cache dsess.  Sessions
+ * are encoded into memory first, such that the caches are not locked while
+ * writing to the file.
+ * Returns the number of saved sessions, or -1 on error.
+ */
+ssize_t
+sessstore_save(sessstore_t *store, cache_t *ssess, cache_t *dsess)
+{
+	sessstore_buf_t b;
+	size_t off;
+	ssize_t n;
+
+	memset(&b, 0, sizeof(b));
+	b.sz = 4096;
+	if (!(b.buf = malloc(b.sz)))
+		return -1;
+	memcpy(b.buf, SESSSTORE_MAGIC, SESSSTORE_MAGICSZ);
+	b.len = SESSSTORE_MAGICSZ;
+	b.type = SESSSTORE_SRC;
+	if (cache_foreach(ssess, sessstore_save_cb, &b))
+		goto errout;
+	b.type = SESSSTORE_DST;
+	if (cache_foreach(dsess, sessstore_save_cb, &b))
+		goto errout;
+
+	for (off = 0; off < b.len; off += n) {
+		n = pwrite(store->fd, b.buf + off, b.len - off, off);
+		if (n == -1 && errno == EINTR) {
+			n = 0;
+			continue;
+		}
+		if (n <= 0)
+			goto errout;
+	}
+	if (ftruncate(store->fd, b.len) == -1)
+		goto errout;
+	free(b.buf);
+	return b.n;
+
+errout:
+	log_err_printf("Failed to save session store '%s': %s (%i)\n",
+	               store->path, strerror(errno), errno);
+	free(b.buf);
+	return -1;
+}
+
+/* vim: set noet ft=c: */
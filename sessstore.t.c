@@ -0,0 +1,250 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ssl.h"
+#include "cachemgr.h"
+#include "sessstore.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include <netinet/in.h>
+
+#include <check.h>
+
+#if defined(LIBRESSL_VERSION_NUMBER) && LIBRESSL_VERSION_NUMBER < 0x20501000L
+#define TMP_SESS_FILE "extra/pki/session-libressl-2.5.0.pem"
+#else
+#define TMP_SESS_FILE "extra/pki/session.pem"
+#endif
+
+static char template[] = "/tmp/sslsplit.test.XXXXXX";
+static char *basedir;
+static char *storefile;
+static struct sockaddr_storage addr;
+static socklen_t addrlen;
+static char sni[] = "daniel.roe.ch";
+
+static SSL_SESSION *
+ssl_session_from_file(const char *filename)
+{
+	SSL_SESSION *sess;
+	FILE *f;
+
+	f = fopen(filename, "r");
+	if (!f)
+		return NULL;
+	sess = PEM_read_SSL_SESSION(f, NULL, NULL, NULL);
+	fclose(f);
+	/* to avoid having to regenerate the session, just bump its time */
+	SSL_SESSION_set_time(sess, time(NULL) - 1);
+	return sess;
+}
+
+static void
+sessstore_setup(void)
+{
+	if ((ssl_init() == -1) || (cachemgr_preinit() == -1))
+		exit(EXIT_FAILURE);
+	basedir = strdup(template);
+	if (!mkdtemp(basedir)) {
+		perror("mkdtemp");
+		exit(EXIT_FAILURE);
+	}
+	if (asprintf(&storefile, "%s/sess.db", basedir) == -1) {
+		perror("asprintf");
+		exit(EXIT_FAILURE);
+	}
+	addrlen = sizeof(struct sockaddr_in);
+	memset(&addr, 0, addrlen);
+	addr.ss_family = AF_INET;
+}
+
+static void
+sessstore_teardown(void)
+{
+	cachemgr_fini();
+	unlink(storefile);
+	rmdir(basedir);
+	free(storefile);
+	free(basedir);
+	ssl_fini();
+}
+
+/*
+ * Put one src and one dst session into the caches.
+ */
+static SSL_SESSION *
+sessstore_fill(void)
+{
+	SSL_SESSION *s;
+
+	s = ssl_session_from_file(TMP_SESS_FILE);
+	if (!s)
+		return NULL;
+	cachemgr_ssess_set(s);
+	cachemgr_dsess_set((struct sockaddr*)&addr, addrlen, sni, s);
+	return s;
+}
+
+START_TEST(sessstore_01)
+{
+	sessstore_t *store;
+	SSL_SESSION *s1, *s2;
+	const unsigned char *id, *id2;
+	unsigned int len, len2;
+
+	s1 = sessstore_fill();
+	fail_unless(!!s1, "creating session failed");
+	store = sessstore_open(storefile);
+	fail_unless(!!store, "open failed");
+	fail_unless(sessstore_save(store, cachemgr_ssess, cachemgr_dsess) == 2,
+	            "did not save 2 sessions");
+	cache_flush(cachemgr_ssess);
+	cache_flush(cachemgr_dsess);
+	sessstore_close(store);
+
+	store = sessstore_open(storefile);
+	fail_unless(!!store, "reopen failed");
+	fail_unless(sessstore_load(store, cachemgr_ssess, cachemgr_dsess) == 2,
+	            "did not load 2 sessions");
+	sessstore_close(store);
+	id = SSL_SESSION_get_id(s1, &len);
+	s2 = cachemgr_ssess_get(id, len);
+	fail_unless(!!s2, "src session not restored");
+	fail_unless(s2 != s1, "src session not decoded");
+	id2 = SSL_SESSION_get_id(s2, &len2);
+	fail_unless(len2 == len && !memcmp(id, id2, len), "wrong src session");
+	SSL_SESSION_free(s2);
+	s2 = cachemgr_dsess_get((struct sockaddr*)&addr, addrlen, sni);
+	fail_unless(!!s2, "dst session not restored");
+	fail_unless(SSL_SESSION_get_time(s2) == SSL_SESSION_get_time(s1),
+	            "session time not preserved");
+	SSL_SESSION_free(s2);
+	SSL_SESSION_free(s1);
+}
+END_TEST
+
+START_TEST(sessstore_02)
+{
+	sessstore_t *store;
+	SSL_SESSION *s1;
+
+	s1 = sessstore_fill();
+	fail_unless(!!s1, "creating session failed");
+	SSL_SESSION_set_time(s1, time(NULL));
+	SSL_SESSION_set_timeout(s1, 1);
+	store = sessstore_open(storefile);
+	fail_unless(!!store, "open failed");
+	fail_unless(sessstore_save(store, cachemgr_ssess, cachemgr_dsess) == 2,
+	            "did not save 2 sessions");
+	cache_flush(cachemgr_ssess);
+	cache_flush(cachemgr_dsess);
+	sleep(2);
+	fail_unless(sessstore_load(store, cachemgr_ssess, cachemgr_dsess) == 0,
+	            "loaded expired sessions");
+	fail_unless(cache_entries(cachemgr_ssess) == 0, "src cache not empty");
+	fail_unless(cache_entries(cachemgr_dsess) == 0, "dst cache not empty");
+	sessstore_close(store);
+	SSL_SESSION_free(s1);
+}
+END_TEST
+
+START_TEST(sessstore_03)
+{
+	sessstore_t *store;
+	SSL_SESSION *s1;
+	struct stat st;
+
+	s1 = sessstore_fill();
+	fail_unless(!!s1, "creating session failed");
+	store = sessstore_open(storefile);
+	fail_unless(!!store, "open failed");
+	fail_unless(sessstore_save(store, cachemgr_ssess, cachemgr_dsess) == 2,
+	            "did not save 2 sessions");
+	cache_flush(cachemgr_ssess);
+	cache_flush(cachemgr_dsess);
+	sessstore_close(store);
+
+	fail_unless(stat(storefile, &st) == 0, "stat failed");
+	fail_unless(truncate(storefile, st.st_size - 1) == 0,
+	            "truncate failed");
+	store = sessstore_open(storefile);
+	fail_unless(!!store, "reopen failed");
+	fail_unless(sessstore_load(store, cachemgr_ssess, cachemgr_dsess) == 1,
+	            "did not load 1 session from truncated store");
+	fail_unless(cache_entries(cachemgr_ssess) == 1, "src session missing");
+	fail_unless(cache_entries(cachemgr_dsess) == 0, "dst session loaded");
+	sessstore_close(store);
+	SSL_SESSION_free(s1);
+}
+END_TEST
+
+START_TEST(sessstore_04)
+{
+	sessstore_t *store;
+	FILE *f;
+
+	f = fopen(storefile, "w");
+	fail_unless(!!f, "fopen failed");
+	fputs("SSLsplit-fkcrt-1 not a session store", f);
+	fclose(f);
+	store = sessstore_open(storefile);
+	fail_unless(!!store, "open failed");
+	fail_unless(sessstore_load(store, cachemgr_ssess, cachemgr_dsess) == 0,
+	            "loaded sessions from foreign file");
+	fail_unless(sessstore_save(store, cachemgr_ssess, cachemgr_dsess) == 0,
+	            "saved sessions from empty caches");
+	sessstore_close(store);
+}
+END_TEST
+
+Suite *
+sessstore_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("sessstore");
+
+	tc = tcase_create("sessstore");
+	tcase_add_checked_fixture(tc, sessstore_setup, sessstore_teardown);
+	tcase_add_test(tc, sessstore_01);
+	tcase_add_test(tc, sessstore_02);
+	tcase_add_test(tc, sessstore_03);
+	tcase_add_test(tc, sessstore_04);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
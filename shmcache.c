@@ -0,0 +1,355 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "shmcache.h"
+
+#include "util.h"
+#include "mempool.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/*
+ * Robust mutexes are not available on macOS; there, a process dying while
+ * holding a stripe lock leaves the stripe locked for good.
+ */
+#ifndef __APPLE__
+#define HAVE_ROBUST_MUTEX
+#endif /* !__APPLE__ */
+
+/*
+ * Cache of opaque byte strings in an anonymous shared memory mapping, shared
+ * by all processes forked after shmcache_new().
+ *
+ * The mapping consists of SHMCACHE_STRIPES process-shared mutexes followed
+ * by a set-associative table of fixed size slots.  A key hashes to a set of
+ * SHMCACHE_WAYS consecutive slots, and each set is protected by one of the
+ * stripe mutexes.  If a set is full, its least recently used slot is
+ * replaced, as tracked by a per-stripe use counter.  Keys and values are
+ * copied in and out under the stripe lock, such that no pointers into the
+ * mapping escape and a process can never see a partially written entry.
+ * If a process dies while holding a stripe lock, the sets of the stripe are
+ * emptied by the next process taking the lock.
+ *
+ * The cache stores serialized objects only; nothing in it can refer to
+ * memory of a particular process.
+ */
+
+#define SHMCACHE_WAYS		8
+#define SHMCACHE_STRIPES	256
+
+typedef struct {
+	pthread_mutex_t lock;
+	uint32_t clock;
+} shmcache_stripe_t;
+
+typedef struct {
+	uint32_t hash;
+	uint32_t keysz;		/* 0 for empty slots */
+	uint32_t valsz;
+	uint32_t used;		/* stripe clock at last use */
+} shmcache_slot_t;
+
+struct shmcache {
+	unsigned char *map;
+	size_t mapsz;
+	size_t slotsz;
+	size_t nsets;
+	shmcache_stripe_t *stripe;
+	unsigned char *slots;
+};
+
+#define SHMCACHE_SLOT(c, i) \
+        ((shmcache_slot_t *)((c)->slots + (i) * (c)->slotsz))
+#define SHMCACHE_DATA(s)	((unsigned char *)((s) + 1))
+#define SHMCACHE_LOCK(c, set) \
+        (&(c)->stripe[(set) % SHMCACHE_STRIPES])
+
+/*
+ * Create a cache of about size bytes total in slots of slotsz bytes each,
+ * which need to hold a key, a value and the per-slot header.  Must be called
+ * before forking the processes sharing the cache.
+ * Returns NULL if size is too small or on errors.
+ */
+shmcache_t *
+shmcache_new(size_t size, size_t slotsz)
+{
+	pthread_mutexattr_t attr;
+	shmcache_t *cache;
+	size_t hdrsz;
+	int i;
+
+	slotsz = (slotsz + 7) & ~(size_t)7;
+	if (slotsz <= sizeof(shmcache_slot_t))
+		return NULL;
+	hdrsz = (SHMCACHE_STRIPES * sizeof(shmcache_stripe_t) + 63) &
+	        ~(size_t)63;
+	if (size < hdrsz + SHMCACHE_WAYS * slotsz)
+		return NULL;
+
+	if (!(cache = malloc(sizeof(shmcache_t))))
+		return NULL;
+	memset(cache, 0, sizeof(shmcache_t));
+	cache->slotsz = slotsz;
+	cache->nsets = (size - hdrsz) / (SHMCACHE_WAYS * slotsz);
+	cache->mapsz = hdrsz + cache->nsets * SHMCACHE_WAYS * slotsz;
+	if (!(cache->map = mempool_huge_map_shared(cache->mapsz))) {
+		free(cache);
+		return NULL;
+	}
+	/* anonymous mappings are zero-filled, i.e. all slots are empty */
+	cache->stripe = (shmcache_stripe_t *)cache->map;
+	cache->slots = cache->map + hdrsz;
+
+	if (pthread_mutexattr_init(&attr) != 0)
+		goto errout;
+	if (pthread_mutexattr_setpshared(&attr,
+	                                 PTHREAD_PROCESS_SHARED) != 0) {
+		pthread_mutexattr_destroy(&attr);
+		goto errout;
+	}
+#ifdef HAVE_ROBUST_MUTEX
+	if (pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) != 0) {
+		pthread_mutexattr_destroy(&attr);
+		goto errout;
+	}
+#endif /* HAVE_ROBUST_MUTEX */
+	for (i = 0; i < SHMCACHE_STRIPES; i++) {
+		if (pthread_mutex_init(&cache->stripe[i].lock, &attr) != 0) {
+			while (--i >= 0)
+				pthread_mutex_destroy(&cache->stripe[i].lock);
+			pthread_mutexattr_destroy(&attr);
+			goto errout;
+		}
+	}
+	pthread_mutexattr_destroy(&attr);
+	return cache;
+
+errout:
+	mempool_huge_unmap_shared(cache->map, cache->mapsz);
+	free(cache);
+	return NULL;
+}
+
+/*
+ * Unmap the cache in the calling process.  The mapping stays valid in all
+ * other processes sharing it.
+ */
+void
+shmcache_free(shmcache_t *cache)
+{
+	mempool_huge_unmap_shared(cache->map, cache->mapsz);
+	free(cache);
+}
+
+/*
+ * Return the largest value that fits into a slot along with a key of keysz
+ * bytes, or 0 if the key does not fit.
+ */
+size_t
+shmcache_maxvalsz(shmcache_t *cache, size_t keysz)
+{
+	size_t avail = cache->slotsz - sizeof(shmcache_slot_t);
+
+	return keysz < avail ? avail - keysz : 0;
+}
+
+/*
+ * Lock the stripe of set and return it.  If the previous owner of the lock
+ * died while holding it, the sets protected by the stripe may hold partially
+ * written entries, so they are emptied before marking the lock consistent.
+ */
+static shmcache_stripe_t *
+shmcache_lock(shmcache_t *cache, size_t set)
+{
+	shmcache_stripe_t *stripe = SHMCACHE_LOCK(cache, set);
+
+#ifdef HAVE_ROBUST_MUTEX
+	if (pthread_mutex_lock(&stripe->lock) == EOWNERDEAD) {
+		for (set %= SHMCACHE_STRIPES; set < cache->nsets;
+		     set += SHMCACHE_STRIPES) {
+			for (size_t i = set * SHMCACHE_WAYS;
+			     i < (set + 1) * SHMCACHE_WAYS; i++)
+				SHMCACHE_SLOT(cache, i)->keysz = 0;
+		}
+		pthread_mutex_consistent(&stripe->lock);
+	}
+#else /* !HAVE_ROBUST_MUTEX */
+	pthread_mutex_lock(&stripe->lock);
+#endif /* !HAVE_ROBUST_MUTEX */
+	return stripe;
+}
+
+/*
+ * Find the slot holding key in set, or NULL.  Caller holds the stripe lock.
+ */
+static shmcache_slot_t *
+shmcache_find(shmcache_t *cache, size_t set, uint32_t hash,
+              const void *key, size_t keysz)
+{
+	for (size_t i = set * SHMCACHE_WAYS; i < (set + 1) * SHMCACHE_WAYS;
+	     i++) {
+		shmcache_slot_t *s = SHMCACHE_SLOT(cache, i);
+
+		if (s->keysz == keysz && s->hash == hash &&
+		    !memcmp(SHMCACHE_DATA(s), key, keysz))
+			return s;
+	}
+	return NULL;
+}
+
+/*
+ * Look up key and return a copy of its value in *val, to be freed by the
+ * caller, and its size in *valsz.
+ * Returns 1 on hits, 0 on misses, and -1 on errors.
+ */
+int
+shmcache_get(shmcache_t *cache, const void *key, size_t keysz,
+             unsigned char **val, size_t *valsz)
+{
+	uint32_t hash = util_hash(key, keysz);
+	size_t set = hash % cache->nsets;
+	shmcache_stripe_t *stripe;
+	shmcache_slot_t *s;
+	int rv = 0;
+
+	stripe = shmcache_lock(cache, set);
+	if ((s = shmcache_find(cache, set, hash, key, keysz))) {
+		if ((*val = malloc(s->valsz ? s->valsz : 1))) {
+			memcpy(*val, SHMCACHE_DATA(s) + s->keysz, s->valsz);
+			*valsz = s->valsz;
+			s->used = ++stripe->clock;
+			rv = 1;
+		} else {
+			rv = -1;
+		}
+	}
+	pthread_mutex_unlock(&stripe->lock);
+	return rv;
+}
+
+/*
+ * Insert or replace the value of key.
+ * Returns -1 if they do not fit into a slot, 0 on success.
+ */
+int
+shmcache_set(shmcache_t *cache, const void *key, size_t keysz,
+             const void *val, size_t valsz)
+{
+	uint32_t hash = util_hash(key, keysz);
+	size_t set = hash % cache->nsets;
+	shmcache_stripe_t *stripe;
+	shmcache_slot_t *s, *victim = NULL;
+
+	if (keysz == 0 || valsz > shmcache_maxvalsz(cache, keysz))
+		return -1;
+
+	stripe = shmcache_lock(cache, set);
+	if (!(s = shmcache_find(cache, set, hash, key, keysz))) {
+		for (size_t i = set * SHMCACHE_WAYS;
+		     i < (set + 1) * SHMCACHE_WAYS; i++) {
+			s = SHMCACHE_SLOT(cache, i);
+			if (s->keysz == 0) {
+				victim = s;
+				break;
+			}
+			/* wrap-around safe comparison of use counters */
+			if (!victim || (int32_t)(s->used - victim->used) < 0)
+				victim = s;
+		}
+		s = victim;
+		s->hash = hash;
+		s->keysz = keysz;
+		memcpy(SHMCACHE_DATA(s), key, keysz);
+	}
+	s->valsz = valsz;
+	memcpy(SHMCACHE_DATA(s) + keysz, val, valsz);
+	s->used = ++stripe->clock;
+	pthread_mutex_unlock(&stripe->lock);
+	return 0;
+}
+
+/*
+ * Remove key if present.
+ */
+void
+shmcache_del(shmcache_t *cache, const void *key, size_t keysz)
+{
+	uint32_t hash = util_hash(key, keysz);
+	size_t set = hash % cache->nsets;
+	shmcache_stripe_t *stripe;
+	shmcache_slot_t *s;
+
+	stripe = shmcache_lock(cache, set);
+	if ((s = shmcache_find(cache, set, hash, key, keysz)))
+		s->keysz = 0;
+	pthread_mutex_unlock(&stripe->lock);
+}
+
+/*
+ * Remove all entries, in all processes sharing the cache.
+ */
+void
+shmcache_flush(shmcache_t *cache)
+{
+	for (size_t set = 0; set < cache->nsets; set++) {
+		shmcache_stripe_t *stripe = shmcache_lock(cache, set);
+
+		for (size_t i = set * SHMCACHE_WAYS;
+		     i < (set + 1) * SHMCACHE_WAYS; i++)
+			SHMCACHE_SLOT(cache, i)->keysz = 0;
+		pthread_mutex_unlock(&stripe->lock);
+	}
+}
+
+/*
+ * Return the number of entries, for testing and statistics.
+ */
+size_t
+shmcache_entries(shmcache_t *cache)
+{
+	size_t n = 0;
+
+	for (size_t set = 0; set < cache->nsets; set++) {
+		shmcache_stripe_t *stripe = shmcache_lock(cache, set);
+
+		for (size_t i = set * SHMCACHE_WAYS;
+		     i < (set + 1) * SHMCACHE_WAYS; i++) {
+			if (SHMCACHE_SLOT(cache, i)->keysz)
+				n++;
+		}
+		pthread_mutex_unlock(&stripe->lock);
+	}
+	return n;
+}
+
+/* vim: set noet ft=c: */
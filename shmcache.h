@@ -0,0 +1,51 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SHMCACHE_H
+#define SHMCACHE_H
+
+#include "attrib.h"
+
+#include <stddef.h>
+
+typedef struct shmcache shmcache_t;
+
+shmcache_t * shmcache_new(size_t, size_t) MALLOC;
+void shmcache_free(shmcache_t *) NONNULL(1);
+int shmcache_get(shmcache_t *, const void *, size_t, unsigned char **,
+                 size_t *) NONNULL(1,2,4,5) WUNRES;
+int shmcache_set(shmcache_t *, const void *, size_t, const void *,
+                 size_t) NONNULL(1,2,4);
+void shmcache_del(shmcache_t *, const void *, size_t) NONNULL(1,2);
+void shmcache_flush(shmcache_t *) NONNULL(1);
+size_t shmcache_entries(shmcache_t *) NONNULL(1) WUNRES;
+size_t shmcache_maxvalsz(shmcache_t *, size_t) NONNULL(1) WUNRES;
+
+#endif /* !SHMCACHE_H */
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,176 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "shmcache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <check.h>
+
+START_TEST(shmcache_01)
+{
+	shmcache_t *cache;
+	unsigned char *val;
+	size_t valsz;
+
+	cache = shmcache_new(64 * 1024, 256);
+	fail_unless(!!cache, "new failed");
+	fail_unless(shmcache_get(cache, "k1", 2, &val, &valsz) == 0,
+	            "hit in empty cache");
+	fail_unless(shmcache_set(cache, "k1", 2, "value1", 6) == 0,
+	            "set failed");
+	fail_unless(shmcache_get(cache, "k1", 2, &val, &valsz) == 1,
+	            "miss after set");
+	fail_unless(valsz == 6 && !memcmp(val, "value1", 6), "wrong value");
+	free(val);
+	fail_unless(shmcache_set(cache, "k1", 2, "v2", 2) == 0,
+	            "replace failed");
+	fail_unless(shmcache_get(cache, "k1", 2, &val, &valsz) == 1,
+	            "miss after replace");
+	fail_unless(valsz == 2 && !memcmp(val, "v2", 2), "not replaced");
+	free(val);
+	fail_unless(shmcache_entries(cache) == 1, "wrong number of entries");
+	shmcache_del(cache, "k1", 2);
+	fail_unless(shmcache_get(cache, "k1", 2, &val, &valsz) == 0,
+	            "hit after del");
+	fail_unless(shmcache_entries(cache) == 0, "entries after del");
+	shmcache_free(cache);
+}
+END_TEST
+
+START_TEST(shmcache_02)
+{
+	shmcache_t *cache;
+	unsigned char buf[512];
+
+	fail_unless(!shmcache_new(1024, 256), "accepted too small size");
+	cache = shmcache_new(64 * 1024, 256);
+	fail_unless(!!cache, "new failed");
+	memset(buf, 'x', sizeof(buf));
+	fail_unless(shmcache_maxvalsz(cache, 4) < 256, "maxvalsz too large");
+	fail_unless(shmcache_set(cache, "key", 3, buf,
+	                         shmcache_maxvalsz(cache, 3)) == 0,
+	            "rejected value of maximal size");
+	fail_unless(shmcache_set(cache, "key", 3, buf,
+	                         shmcache_maxvalsz(cache, 3) + 1) == -1,
+	            "accepted oversized value");
+	fail_unless(shmcache_set(cache, buf, sizeof(buf), "v", 1) == -1,
+	            "accepted oversized key");
+	shmcache_free(cache);
+}
+END_TEST
+
+/* a full set replaces the least recently used entry */
+START_TEST(shmcache_03)
+{
+	shmcache_t *cache;
+	unsigned char *val;
+	size_t valsz;
+	char key[16];
+	int i, hits = 0;
+
+	/* a cache of only a few sets */
+	cache = shmcache_new(32 * 1024, 1024);
+	fail_unless(!!cache, "new failed");
+	for (i = 0; i < 64; i++) {
+		snprintf(key, sizeof(key), "key%i", i);
+		fail_unless(shmcache_set(cache, key, strlen(key), "v", 1) == 0,
+		            "set failed");
+		/* keep key0 in use */
+		fail_unless(shmcache_get(cache, "key0", 4, &val, &valsz) == 1,
+		            "recently used entry evicted");
+		free(val);
+	}
+	for (i = 0; i < 64; i++) {
+		snprintf(key, sizeof(key), "key%i", i);
+		if (shmcache_get(cache, key, strlen(key), &val, &valsz) == 1) {
+			free(val);
+			hits++;
+		}
+	}
+	fail_unless(hits > 1 && (size_t)hits == shmcache_entries(cache),
+	            "inconsistent entries");
+	fail_unless(hits < 64, "nothing evicted");
+	shmcache_flush(cache);
+	fail_unless(shmcache_entries(cache) == 0, "entries after flush");
+	shmcache_free(cache);
+}
+END_TEST
+
+/* entries are shared with processes forked after creation */
+START_TEST(shmcache_04)
+{
+	shmcache_t *cache;
+	unsigned char *val;
+	size_t valsz;
+	pid_t pid;
+	int status;
+
+	cache = shmcache_new(64 * 1024, 256);
+	fail_unless(!!cache, "new failed");
+	pid = fork();
+	fail_unless(pid != -1, "fork failed");
+	if (pid == 0) {
+		_exit(shmcache_set(cache, "child", 5, "hello", 5) == 0 ?
+		      0 : 1);
+	}
+	fail_unless(waitpid(pid, &status, 0) == pid, "waitpid failed");
+	fail_unless(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+	            "child failed");
+	fail_unless(shmcache_get(cache, "child", 5, &val, &valsz) == 1,
+	            "entry of child not shared");
+	fail_unless(valsz == 5 && !memcmp(val, "hello", 5), "wrong value");
+	free(val);
+	shmcache_free(cache);
+}
+END_TEST
+
+Suite *
+shmcache_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("shmcache");
+
+	tc = tcase_create("shmcache");
+	tcase_add_test(tc, shmcache_01);
+	tcase_add_test(tc, shmcache_02);
+	tcase_add_test(tc, shmcache_03);
+	tcase_add_test(tc, shmcache_04);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,196 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "srcpool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <netinet/in.h>
+
+/*
+ * Pool of local source addresses to bind upstream connections to.  Each
+ * connection to a destination address and port needs a distinct source
+ * address and port, so with a single source address, at most about 64k
+ * connections to the same destination can exist at a time.  Spreading the
+ * connections over several source addresses raises that limit accordingly.
+ *
+ * Usage of the sources is counted in a fixed-size table of buckets indexed
+ * by a hash of the destination address and port, and a connection is bound
+ * to the least used source of the matching address family in its bucket.
+ * Destinations sharing a bucket share their counters, which only makes the
+ * spreading less even, but keeps lookups free of locking and allocation.
+ * Counters are updated atomically; concurrent connects may pick the same
+ * source, which is harmless.
+ *
+ * Sockets are bound with IP_BIND_ADDRESS_NO_PORT where available, which
+ * defers choosing the source port until connect(), when the kernel knows the
+ * destination and can reuse a source port across different destinations.
+ */
+
+#define SRCPOOL_BUCKETS	256
+
+struct srcpool {
+	struct sockaddr_storage addr[SRCPOOL_MAX];
+	socklen_t addrlen[SRCPOOL_MAX];
+	int num;
+	unsigned int used[SRCPOOL_BUCKETS][SRCPOOL_MAX];
+};
+
+srcpool_t *
+srcpool_new(void)
+{
+	srcpool_t *pool;
+
+	pool = malloc(sizeof(srcpool_t));
+	if (!pool)
+		return NULL;
+	memset(pool, 0, sizeof(srcpool_t));
+	return pool;
+}
+
+void
+srcpool_free(srcpool_t *pool)
+{
+	free(pool);
+}
+
+/*
+ * Add the source address addr to pool; its port is ignored.
+ * Returns 0 on success, -1 if the pool is full or addr not IPv4 or IPv6.
+ */
+int
+srcpool_add(srcpool_t *pool, const struct sockaddr *addr, socklen_t addrlen)
+{
+	struct sockaddr_storage *ss;
+
+	if (pool->num == SRCPOOL_MAX || addrlen > sizeof(*ss) ||
+	    (addr->sa_family != AF_INET && addr->sa_family != AF_INET6))
+		return -1;
+	ss = &pool->addr[pool->num];
+	memcpy(ss, addr, addrlen);
+	if (ss->ss_family == AF_INET)
+		((struct sockaddr_in *)ss)->sin_port = 0;
+	else
+		((struct sockaddr_in6 *)ss)->sin6_port = 0;
+	pool->addrlen[pool->num++] = addrlen;
+	return 0;
+}
+
+int
+srcpool_size(srcpool_t *pool)
+{
+	return pool->num;
+}
+
+/*
+ * Pick the least used source address of the family of dst for connecting to
+ * dst and count it as used.  Returns the slot to pass to srcpool_bind() and
+ * srcpool_release(), or -1 if the pool has no source address of the family.
+ */
+int
+srcpool_acquire(srcpool_t *pool, const struct sockaddr *dst)
+{
+	const unsigned char *p;
+	unsigned int h = 2166136261U;
+	unsigned int min = 0;
+	unsigned int *used;
+	size_t sz;
+	int best = -1;
+
+	switch (dst->sa_family) {
+	case AF_INET:
+		p = (const unsigned char *)
+		    &((const struct sockaddr_in *)dst)->sin_port;
+		sz = sizeof(in_port_t) + sizeof(struct in_addr);
+		break;
+	case AF_INET6:
+		p = (const unsigned char *)
+		    &((const struct sockaddr_in6 *)dst)->sin6_addr;
+		sz = sizeof(struct in6_addr);
+		h ^= ((const struct sockaddr_in6 *)dst)->sin6_port;
+		break;
+	default:
+		return -1;
+	}
+	for (size_t i = 0; i < sz; i++) {
+		h ^= p[i];
+		h *= 16777619U;
+	}
+	h ^= h >> 16;
+	used = pool->used[h % SRCPOOL_BUCKETS];
+
+	/* start at a hash-dependent source, such that ties in different
+	 * buckets are not all broken in favour of the first source */
+	for (int n = 0, i = (h >> 8) % pool->num; n < pool->num;
+	     n++, i = (i + 1) % pool->num) {
+		unsigned int u;
+
+		if (pool->addr[i].ss_family != dst->sa_family)
+			continue;
+		u = __atomic_load_n(&used[i], __ATOMIC_RELAXED);
+		if (best == -1 || u < min) {
+			best = i;
+			min = u;
+		}
+	}
+	if (best == -1)
+		return -1;
+	__atomic_add_fetch(&used[best], 1, __ATOMIC_RELAXED);
+	return (int)(h % SRCPOOL_BUCKETS) * SRCPOOL_MAX + best;
+}
+
+/*
+ * Count the source of slot, acquired with srcpool_acquire(), as unused.
+ */
+void
+srcpool_release(srcpool_t *pool, int slot)
+{
+	__atomic_sub_fetch(&pool->used[slot / SRCPOOL_MAX][slot % SRCPOOL_MAX],
+	                   1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Bind the unconnected socket fd to the source address of slot.
+ * Returns 0 on success, -1 on failure with errno set.
+ */
+int
+srcpool_bind(srcpool_t *pool, int slot, evutil_socket_t fd)
+{
+	int i = slot % SRCPOOL_MAX;
+#ifdef IP_BIND_ADDRESS_NO_PORT
+	int on = 1;
+
+	/* not supported by older kernels, which then pick the port here */
+	(void)setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT,
+	                 (void*)&on, sizeof(on));
+#endif /* IP_BIND_ADDRESS_NO_PORT */
+	return bind(fd, (struct sockaddr *)&pool->addr[i], pool->addrlen[i]);
+}
+
+/* vim: set noet ft=c: */
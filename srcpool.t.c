@@ -0,0 +1,200 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "srcpool.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <check.h>
+
+static socklen_t
+srcpool_test_addr(struct sockaddr_storage *ss, const char *ip,
+                  unsigned short port)
+{
+	memset(ss, 0, sizeof(*ss));
+	if (strchr(ip, ':')) {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(port);
+		inet_pton(AF_INET6, ip, &sin6->sin6_addr);
+		return sizeof(*sin6);
+	} else {
+		struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(port);
+		inet_pton(AF_INET, ip, &sin->sin_addr);
+		return sizeof(*sin);
+	}
+}
+
+static srcpool_t *
+srcpool_test_new(const char **ips)
+{
+	struct sockaddr_storage ss;
+	srcpool_t *pool;
+	socklen_t len;
+
+	pool = srcpool_new();
+	fail_unless(!!pool, "srcpool_new failed");
+	for (; *ips; ips++) {
+		len = srcpool_test_addr(&ss, *ips, 0);
+		fail_unless(srcpool_add(pool, (struct sockaddr *)&ss, len) == 0,
+		            "srcpool_add failed");
+	}
+	return pool;
+}
+
+START_TEST(srcpool_01)
+{
+	const char *ips[] = {"127.0.0.1", "127.0.0.2", "127.0.0.3", NULL};
+	struct sockaddr_storage dst;
+	srcpool_t *pool;
+	int slot[6];
+	int seen[3] = {0, 0, 0};
+
+	pool = srcpool_test_new(ips);
+	fail_unless(srcpool_size(pool) == 3, "wrong size");
+	(void)srcpool_test_addr(&dst, "192.0.2.1", 443);
+	for (int i = 0; i < 6; i++) {
+		slot[i] = srcpool_acquire(pool, (struct sockaddr *)&dst);
+		fail_unless(slot[i] != -1, "no slot");
+		seen[slot[i] % SRCPOOL_MAX]++;
+	}
+	for (int i = 0; i < 3; i++)
+		fail_unless(seen[i] == 2, "sources not used evenly");
+	srcpool_release(pool, slot[0]);
+	fail_unless(srcpool_acquire(pool, (struct sockaddr *)&dst) == slot[0],
+	            "released source not picked");
+	srcpool_free(pool);
+}
+END_TEST
+
+START_TEST(srcpool_02)
+{
+	const char *ips[] = {"127.0.0.1", "::1", NULL};
+	struct sockaddr_storage dst;
+	srcpool_t *pool;
+	int slot;
+
+	pool = srcpool_test_new(ips);
+	(void)srcpool_test_addr(&dst, "2001:db8::1", 443);
+	for (int i = 0; i < 3; i++) {
+		slot = srcpool_acquire(pool, (struct sockaddr *)&dst);
+		fail_unless(slot != -1 && slot % SRCPOOL_MAX == 1,
+		            "IPv6 destination got IPv4 source");
+	}
+	(void)srcpool_test_addr(&dst, "192.0.2.1", 443);
+	for (int i = 0; i < 3; i++) {
+		slot = srcpool_acquire(pool, (struct sockaddr *)&dst);
+		fail_unless(slot != -1 && slot % SRCPOOL_MAX == 0,
+		            "IPv4 destination got IPv6 source");
+	}
+	srcpool_free(pool);
+}
+END_TEST
+
+START_TEST(srcpool_03)
+{
+	const char *ips[] = {"::1", NULL};
+	struct sockaddr_storage dst;
+	srcpool_t *pool;
+
+	pool = srcpool_test_new(ips);
+	(void)srcpool_test_addr(&dst, "192.0.2.1", 443);
+	fail_unless(srcpool_acquire(pool, (struct sockaddr *)&dst) == -1,
+	            "got source of wrong family");
+	srcpool_free(pool);
+}
+END_TEST
+
+START_TEST(srcpool_04)
+{
+	const char *ips[] = {"127.0.0.1", NULL};
+	struct sockaddr_storage dst, ss;
+	struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+	socklen_t len = sizeof(ss);
+	srcpool_t *pool;
+	int fd, slot;
+
+	pool = srcpool_test_new(ips);
+	(void)srcpool_test_addr(&dst, "127.0.0.1", 443);
+	slot = srcpool_acquire(pool, (struct sockaddr *)&dst);
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	fail_unless(fd != -1, "socket failed");
+	fail_unless(srcpool_bind(pool, slot, fd) == 0, "bind failed");
+	fail_unless(getsockname(fd, (struct sockaddr *)&ss, &len) == 0,
+	            "getsockname failed");
+	fail_unless(sin->sin_addr.s_addr == htonl(INADDR_LOOPBACK),
+	            "bound to wrong address");
+	close(fd);
+	srcpool_free(pool);
+}
+END_TEST
+
+START_TEST(srcpool_05)
+{
+	struct sockaddr_storage ss;
+	srcpool_t *pool;
+	socklen_t len;
+
+	pool = srcpool_new();
+	len = srcpool_test_addr(&ss, "127.0.0.1", 0);
+	for (int i = 0; i < SRCPOOL_MAX; i++)
+		fail_unless(srcpool_add(pool, (struct sockaddr *)&ss,
+		                        len) == 0, "srcpool_add failed");
+	fail_unless(srcpool_add(pool, (struct sockaddr *)&ss, len) == -1,
+	            "srcpool_add succeeded on full pool");
+	srcpool_free(pool);
+}
+END_TEST
+
+Suite *
+srcpool_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("srcpool");
+
+	tc = tcase_create("srcpool");
+	tcase_add_test(tc, srcpool_01);
+	tcase_add_test(tc, srcpool_02);
+	tcase_add_test(tc, srcpool_03);
+	tcase_add_test(tc, srcpool_04);
+	tcase_add_test(tc, srcpool_05);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,446 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bench.h"
+
+#include "ssl.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/ocsp.h>
+
+#define BENCHCACRT "extra/pki/rsa.crt"
+#define BENCHCAKEY "extra/pki/rsa.key"
+#define BENCHCERT "extra/pki/server.crt"
+
+typedef struct ssl_bench_forge {
+	X509 *cacrt;
+	EVP_PKEY *cakey;
+	X509 *origcrt;
+	EVP_PKEY *key;
+} ssl_bench_forge_t;
+
+static void
+ssl_bench_x509_forge(void *arg, size_t n)
+{
+	ssl_bench_forge_t *f = arg;
+	X509 *crt;
+
+	while (n--) {
+		crt = ssl_x509_forge(f->cacrt, f->cakey, f->origcrt, f->key,
+		                     NULL, NULL);
+		if (!crt) {
+			fprintf(stderr, "ssl_x509_forge() failed\n");
+			exit(EXIT_FAILURE);
+		}
+		X509_free(crt);
+	}
+}
+
+	/* TLS 1.2, SNI extension with hostname "daniel.roe.ch" */
+static unsigned char clienthello[] =
+	"\x16\x03\x03\x01\x7d\x01\x00\x01\x79\x03\x03\x4f\x7f\x27\xd0\x76"
+	"\x5f\xc1\x3b\xba\x73\xd5\x07\x8b\xd9\x79\xf9\x51\xd4\xce\x7d\x9a"
+	"\xdb\xdf\xf8\x4e\x95\x86\x38\x61\xdd\x84\x2a\x00\x00\xca\xc0\x30"
+	"\xc0\x2c\xc0\x28\xc0\x24\xc0\x14\xc0\x0a\xc0\x22\xc0\x21\x00\xa3"
+	"\x00\x9f\x00\x6b\x00\x6a\x00\x39\x00\x38\x00\x88\x00\x87\xc0\x19"
+	"\xc0\x20\x00\xa7\x00\x6d\x00\x3a\x00\x89\xc0\x32\xc0\x2e\xc0\x2a"
+	"\xc0\x26\xc0\x0f\xc0\x05\x00\x9d\x00\x3d\x00\x35\x00\x84\xc0\x12"
+	"\xc0\x08\xc0\x1c\xc0\x1b\x00\x16\x00\x13\xc0\x17\xc0\x1a\x00\x1b"
+	"\xc0\x0d\xc0\x03\x00\x0a\xc0\x2f\xc0\x2b\xc0\x27\xc0\x23\xc0\x13"
+	"\xc0\x09\xc0\x1f\xc0\x1e\x00\xa2\x00\x9e\x00\x67\x00\x40\x00\x33"
+	"\x00\x32\x00\x9a\x00\x99\x00\x45\x00\x44\xc0\x18\xc0\x1d\x00\xa6"
+	"\x00\x6c\x00\x34\x00\x9b\x00\x46\xc0\x31\xc0\x2d\xc0\x29\xc0\x25"
+	"\xc0\x0e\xc0\x04\x00\x9c\x00\x3c\x00\x2f\x00\x96\x00\x41\x00\x07"
+	"\xc0\x11\xc0\x07\xc0\x16\x00\x18\xc0\x0c\xc0\x02\x00\x05\x00\x04"
+	"\x00\x15\x00\x12\x00\x1a\x00\x09\x00\x14\x00\x11\x00\x19\x00\x08"
+	"\x00\x06\x00\x17\x00\x03\x00\xff\x02\x01\x00\x00\x85\x00\x00\x00"
+	"\x12\x00\x10\x00\x00\x0d\x64\x61\x6e\x69\x65\x6c\x2e\x72\x6f\x65"
+	"\x2e\x63\x68\x00\x0b\x00\x04\x03\x00\x01\x02\x00\x0a\x00\x34\x00"
+	"\x32\x00\x0e\x00\x0d\x00\x19\x00\x0b\x00\x0c\x00\x18\x00\x09\x00"
+	"\x0a\x00\x16\x00\x17\x00\x08\x00\x06\x00\x07\x00\x14\x00\x15\x00"
+	"\x04\x00\x05\x00\x12\x00\x13\x00\x01\x00\x02\x00\x03\x00\x0f\x00"
+	"\x10\x00\x11\x00\x23\x00\x00\x00\x0d\x00\x22\x00\x20\x06\x01\x06"
+	"\x02\x06\x03\x05\x01\x05\x02\x05\x03\x04\x01\x04\x02\x04\x03\x03"
+	"\x01\x03\x02\x03\x03\x02\x01\x02\x02\x02\x03\x01\x01\x00\x0f\x00"
+	"\x01\x01";
+	/* TLS 1.2, SNI extension with hostname "daniel.roe.ch" */
+
+static void
+ssl_bench_tls_clienthello_parse(UNUSED void *arg, size_t n)
+{
+	const unsigned char *ch;
+	char *sni;
+
+	while (n--) {
+		sni = NULL;
+		if (ssl_tls_clienthello_parse(clienthello,
+		                              sizeof(clienthello) - 1,
+		                              0, &ch, &sni, NULL) != 0 || !sni) {
+			fprintf(stderr, "ssl_tls_clienthello_parse() failed\n");
+			exit(EXIT_FAILURE);
+		}
+		free(sni);
+	}
+}
+
+/*
+ * Adversarial ClientHello input, parsed on the worker thread before anything
+ * else is known about the connection.
+ */
+#define SSL_BENCH_RECORD_MAXSZ (5 + 16384)
+#define SSL_BENCH_CHELLO_MAXSZ (128 * 1024) /* PXY_CLIENTHELLO_MAXSZ */
+
+typedef struct ssl_bench_worst {
+	unsigned char *buf;
+	size_t sz;
+	int rv;
+} ssl_bench_worst_t;
+
+static void *
+ssl_bench_malloc(size_t sz)
+{
+	void *p;
+
+	if (!(p = malloc(sz))) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+/*
+ * Write a ClientHello handshake message with one cipher suite and nexts
+ * empty extensions of unknown types to msg.  Returns the message size.
+ */
+static size_t
+ssl_bench_chello_msg(unsigned char *msg, size_t nexts)
+{
+	size_t sz, extsz = 4 * nexts;
+
+	sz = 4 + 2 + 32 + 1 + 4 + 2 + 2 + extsz;
+	msg[0] = 0x01;
+	msg[1] = (sz - 4) >> 16;
+	msg[2] = ((sz - 4) >> 8) & 0xff;
+	msg[3] = (sz - 4) & 0xff;
+	msg[4] = 0x03;
+	msg[5] = 0x03;
+	memset(msg + 6, 0x42, 32);
+	memcpy(msg + 38, "\x00\x00\x02\xc0\x2f\x01\x00", 7);
+	msg[45] = extsz >> 8;
+	msg[46] = extsz & 0xff;
+	for (size_t i = 0; i < nexts; i++) {
+		msg[47 + 4 * i] = 0x40 + (i >> 8);
+		msg[48 + 4 * i] = i & 0xff;
+		msg[49 + 4 * i] = 0;
+		msg[50 + 4 * i] = 0;
+	}
+	return sz;
+}
+
+/*
+ * A full record of ClientHello candidates nested in the cipher suites of
+ * each other, all failing on the compression methods shared at the end of
+ * the record, with a search restarting at the next candidate each time.
+ */
+static void
+ssl_bench_chello_nested(ssl_bench_worst_t *b)
+{
+	unsigned char *p;
+	size_t left;
+
+	b->sz = SSL_BENCH_RECORD_MAXSZ;
+	p = b->buf = ssl_bench_malloc(b->sz);
+	memset(p, 0, b->sz);
+	/* compression methods longer than the rest of the record */
+	b->buf[b->sz - 2] = 0xff;
+	for (left = b->sz; left >= 100; left -= 46, p += 46) {
+		p[0] = 0x16;
+		p[1] = 0x03;
+		p[2] = 0x01;
+		p[3] = (left - 5) >> 8;
+		p[4] = (left - 5) & 0xff;
+		p[5] = 0x01;
+		p[6] = 0x00;
+		p[7] = (left - 9) >> 8;
+		p[8] = (left - 9) & 0xff;
+		p[9] = 0x03;
+		p[10] = 0x03;
+		/* random and empty session id */
+		p[44] = (left - 48) >> 8;
+		p[45] = (left - 48) & 0xff;
+	}
+}
+
+/*
+ * A full record with a ClientHello carrying as many extensions as fit.
+ */
+static void
+ssl_bench_chello_exts(ssl_bench_worst_t *b)
+{
+	size_t sz;
+
+	b->buf = ssl_bench_malloc(SSL_BENCH_RECORD_MAXSZ);
+	sz = ssl_bench_chello_msg(b->buf + 5,
+	                          (SSL_BENCH_RECORD_MAXSZ - 5 - 47) / 4);
+	memcpy(b->buf, "\x16\x03\x01", 3);
+	b->buf[3] = sz >> 8;
+	b->buf[4] = sz & 0xff;
+	b->sz = 5 + sz;
+}
+
+/*
+ * The largest ClientHello the connection setup waits for, with as many
+ * extensions as fit when every single octet of the handshake message is sent
+ * in a record of its own.
+ */
+static void
+ssl_bench_chello_fragmented(ssl_bench_worst_t *b)
+{
+	unsigned char *msg;
+	size_t sz;
+
+	msg = ssl_bench_malloc(SSL_BENCH_CHELLO_MAXSZ / 6);
+	sz = ssl_bench_chello_msg(msg, (SSL_BENCH_CHELLO_MAXSZ / 6 - 47) / 4);
+	b->sz = 6 * sz;
+	b->buf = ssl_bench_malloc(b->sz);
+	for (size_t i = 0; i < sz; i++) {
+		memcpy(b->buf + 6 * i, "\x16\x03\x01\x00\x01", 5);
+		b->buf[6 * i + 5] = msg[i];
+	}
+	free(msg);
+}
+
+static void
+ssl_bench_tls_clienthello_search_worst(void *arg, size_t n)
+{
+	ssl_bench_worst_t *b = arg;
+	const unsigned char *ch;
+
+	while (n--) {
+		if (ssl_tls_clienthello_parse(b->buf, b->sz, 1, &ch,
+		                              NULL, NULL) != b->rv) {
+			fprintf(stderr, "ssl_tls_clienthello_parse() failed\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static void
+ssl_bench_tls_clienthello_summary_worst(void *arg, size_t n)
+{
+	ssl_bench_worst_t *b = arg;
+	const unsigned char *ch;
+	unsigned char *record;
+	size_t recordsz;
+	ssl_chello_t sum;
+	char *sni;
+
+	while (n--) {
+		if (ssl_tls_clienthello_reassemble(b->buf, b->sz, &record,
+		                                   &recordsz) != 0 || !record) {
+			fprintf(stderr, "ssl_tls_clienthello_reassemble() "
+			                "failed\n");
+			exit(EXIT_FAILURE);
+		}
+		sni = NULL;
+		if (ssl_tls_clienthello_summary(record, recordsz, 0, &ch,
+		                                &sni, &sum) != 0) {
+			fprintf(stderr, "ssl_tls_clienthello_summary() "
+			                "failed\n");
+			exit(EXIT_FAILURE);
+		}
+		free(record);
+	}
+}
+
+/*
+ * An OCSP request with count identical entries for crt.
+ */
+static OCSP_REQUEST *
+ssl_bench_ocspreq_new(X509 *crt, X509 *cacrt, int count)
+{
+	OCSP_REQUEST *req;
+	OCSP_CERTID *id;
+
+	if (!(req = OCSP_REQUEST_new()))
+		return NULL;
+	while (count--) {
+		if (!(id = OCSP_cert_to_id(NULL, crt, cacrt)))
+			goto errout;
+		if (!OCSP_request_add0_id(req, id)) {
+			OCSP_CERTID_free(id);
+			goto errout;
+		}
+	}
+	return req;
+errout:
+	OCSP_REQUEST_free(req);
+	return NULL;
+}
+
+/*
+ * An OCSP request with as many entries as fit into the Base64 from a 16 KiB
+ * request URI, as checked by the OCSP GET request detection.  With invalid
+ * set, the tag of the very last element is wrong, which is only detected
+ * after decoding everything before it.
+ */
+static void
+ssl_bench_ocspreq(ssl_bench_worst_t *b, X509 *crt, X509 *cacrt, int invalid)
+{
+	OCSP_REQUEST *req;
+	unsigned char *p;
+	int count, sz;
+
+	for (count = 1;; count++) {
+		if (!(req = ssl_bench_ocspreq_new(crt, cacrt, count + 1)))
+			goto errout;
+		sz = i2d_OCSP_REQUEST(req, NULL);
+		OCSP_REQUEST_free(req);
+		if (sz <= 0 || sz > 16384 / 4 * 3)
+			break;
+	}
+	if (!(req = ssl_bench_ocspreq_new(crt, cacrt, count)) ||
+	    (sz = i2d_OCSP_REQUEST(req, NULL)) <= 0)
+		goto errout;
+	b->sz = sz;
+	p = b->buf = ssl_bench_malloc(b->sz);
+	if (i2d_OCSP_REQUEST(req, &p) != sz)
+		goto errout;
+	OCSP_REQUEST_free(req);
+	b->rv = !invalid;
+	if (invalid) {
+		/* the serial number INTEGER ends the last entry */
+		sz = i2d_ASN1_INTEGER(X509_get_serialNumber(crt), NULL);
+		b->buf[b->sz - sz] = 0x04;
+	}
+	return;
+errout:
+	fprintf(stderr, "Failed to create OCSP request\n");
+	exit(EXIT_FAILURE);
+}
+
+static void
+ssl_bench_is_ocspreq_worst(void *arg, size_t n)
+{
+	ssl_bench_worst_t *b = arg;
+
+	while (n--) {
+		if (ssl_is_ocspreq(b->buf, b->sz) != b->rv) {
+			fprintf(stderr, "ssl_is_ocspreq() failed\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static void
+ssl_bench_worst(ssl_bench_forge_t *f)
+{
+	ssl_bench_worst_t b;
+
+	ssl_bench_chello_nested(&b);
+	b.rv = 1;
+	bench_run_worst("SSLTLSClientHelloSearchWorst",
+	                ssl_bench_tls_clienthello_search_worst, &b);
+	free(b.buf);
+	ssl_bench_chello_exts(&b);
+	bench_run_worst("SSLTLSClientHelloExtsWorst",
+	                ssl_bench_tls_clienthello_summary_worst, &b);
+	free(b.buf);
+	ssl_bench_chello_fragmented(&b);
+	bench_run_worst("SSLTLSClientHelloFragmentedWorst",
+	                ssl_bench_tls_clienthello_summary_worst, &b);
+	free(b.buf);
+
+	ssl_bench_ocspreq(&b, f->origcrt, f->cacrt, 0);
+	bench_run_worst("SSLIsOCSPReqWorst", ssl_bench_is_ocspreq_worst, &b);
+	free(b.buf);
+	ssl_bench_ocspreq(&b, f->origcrt, f->cacrt, 1);
+	bench_run_worst("SSLIsOCSPReqWorstInvalid",
+	                ssl_bench_is_ocspreq_worst, &b);
+	free(b.buf);
+}
+
+void
+ssl_bench(void)
+{
+	ssl_bench_forge_t f;
+
+	f.cacrt = ssl_x509_load(BENCHCACRT);
+	f.cakey = ssl_key_load(BENCHCAKEY);
+	f.origcrt = ssl_x509_load(BENCHCERT);
+	if (!f.cacrt || !f.cakey || !f.origcrt) {
+		fprintf(stderr, "Failed to load %s, %s or %s\n",
+		        BENCHCACRT, BENCHCAKEY, BENCHCERT);
+		exit(EXIT_FAILURE);
+	}
+
+	if (!(f.key = ssl_key_genrsa(2048))) {
+		fprintf(stderr, "Failed to generate RSA key\n");
+		exit(EXIT_FAILURE);
+	}
+	bench_run("SSLX509ForgeRSA", 1, ssl_bench_x509_forge, &f);
+	EVP_PKEY_free(f.key);
+
+#ifndef OPENSSL_NO_EC
+	{
+		ssl_bench_forge_t ec;
+
+		/* EC key certified by the RSA CA stands in for an ECDSA CA */
+		ec.origcrt = f.origcrt;
+		ec.cakey = ssl_key_genec(NULL);
+		ec.key = ssl_key_genec(NULL);
+		if (!ec.cakey || !ec.key) {
+			fprintf(stderr, "Failed to generate EC key\n");
+			exit(EXIT_FAILURE);
+		}
+		ec.cacrt = ssl_x509_forge(f.cacrt, f.cakey, f.cacrt, ec.cakey,
+		                          NULL, NULL);
+		if (!ec.cacrt) {
+			fprintf(stderr, "Failed to forge ECDSA CA\n");
+			exit(EXIT_FAILURE);
+		}
+		bench_run("SSLX509ForgeEC", 1, ssl_bench_x509_forge, &ec);
+		X509_free(ec.cacrt);
+		EVP_PKEY_free(ec.key);
+		EVP_PKEY_free(ec.cakey);
+	}
+#endif /* !OPENSSL_NO_EC */
+
+	bench_run("SSLTLSClientHelloParse", 1,
+	          ssl_bench_tls_clienthello_parse, NULL);
+	ssl_bench_worst(&f);
+
+	X509_free(f.origcrt);
+	EVP_PKEY_free(f.cakey);
+	X509_free(f.cacrt);
+}
+
+/* vim: set noet ft=c: */
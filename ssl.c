@@ -29,6 +29,8 @@
 #include "ssl.h"
 
 #include "log.h"
+#include "stats.h"
+#include "usdt.h"
 #include "defaults.h"
 #include "attrib.h"
 
@@ -38,6 +40,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <limits.h>
+#include <time.h>
 
 #include <openssl/crypto.h>
 #ifndef OPENSSL_NO_ENGINE
@@ -176,6 +179,31 @@ ssl_openssl_version(void)
 #else /* OPENSSL_NO_ENGINE */
 	fprintf(stderr, "OpenSSL has no engine support\n");
 #endif /* OPENSSL_NO_ENGINE */
+#ifdef SSL_MODE_ASYNC
+	fprintf(stderr, "OpenSSL has async job support\n");
+#else /* !SSL_MODE_ASYNC */
+	fprintf(stderr, "OpenSSL has no async job support\n");
+#endif /* !SSL_MODE_ASYNC */
+#ifdef HAVE_KTLS
+	fprintf(stderr, "OpenSSL has kernel TLS support\n");
+#else /* !HAVE_KTLS */
+	fprintf(stderr, "OpenSSL has no kernel TLS support\n");
+#endif /* !HAVE_KTLS */
+#ifdef HAVE_CERTCOMP
+	fprintf(stderr, "OpenSSL has certificate compression support\n");
+#else /* !HAVE_CERTCOMP */
+	fprintf(stderr, "OpenSSL has no certificate compression support\n");
+#endif /* !HAVE_CERTCOMP */
+#ifdef HAVE_EARLYDATA
+	fprintf(stderr, "OpenSSL has early data support\n");
+#else /* !HAVE_EARLYDATA */
+	fprintf(stderr, "OpenSSL has no early data support\n");
+#endif /* !HAVE_EARLYDATA */
+#ifdef HAVE_LIBCTX
+	fprintf(stderr, "OpenSSL has library context support\n");
+#else /* !HAVE_LIBCTX */
+	fprintf(stderr, "OpenSSL has no library context support\n");
+#endif /* !HAVE_LIBCTX */
 #ifdef SSL_MODE_RELEASE_BUFFERS
 	fprintf(stderr, "Using SSL_MODE_RELEASE_BUFFERS\n");
 #else /* !SSL_MODE_RELEASE_BUFFERS */
@@ -269,25 +297,100 @@ ssl_openssl_version(void)
  */
 static int ssl_initialized = 0;
 
+/*
+ * Message digests fetched from the providers once by ssl_init().  OpenSSL 3
+ * looks up the implementation of a legacy EVP_sha1() style digest in the
+ * providers on every use, taking a global lock; the fetched ones are
+ * immutable and shared by all threads.
+ */
+#if (OPENSSL_VERSION_NUMBER >= 0x30000000L) && !defined(LIBRESSL_VERSION_NUMBER)
+static const char *ssl_md_names[SSL_MD_MAX] = {
+	"MD5", "SHA1", "SHA224", "SHA256", "SHA384", "SHA512"
+};
+static EVP_MD *ssl_md_fetched[SSL_MD_MAX];
+#endif /* OPENSSL_VERSION_NUMBER >= 0x30000000L */
+
+#ifdef HAVE_LIBCTX
+/*
+ * Library contexts created by ssl_libctx_new(), freed by ssl_fini() after
+ * everything created from them is gone.
+ */
+static OSSL_LIB_CTX **ssl_libctx;
+static int ssl_libctx_num = 0;
+#endif /* HAVE_LIBCTX */
+
+/* ex_data index of the private key of a forged certificate, see below */
+static int ssl_x509_leafkey_idx = -1;
+
+static void
+ssl_x509_leafkey_free_cb(UNUSED void *parent, void *ptr,
+                         UNUSED CRYPTO_EX_DATA *ad, UNUSED int idx,
+                         UNUSED long argl, UNUSED void *argp)
+{
+	if (ptr)
+		EVP_PKEY_free(ptr);
+}
+
+/* ex_data index of the memoised metadata of a certificate, see below */
+static int ssl_x509_memo_idx = -1;
+
+static void
+ssl_x509_memo_free_cb(UNUSED void *parent, void *ptr,
+                      UNUSED CRYPTO_EX_DATA *ad, UNUSED int idx,
+                      UNUSED long argl, UNUSED void *argp)
+{
+	ssl_x509_memo_t *memo = ptr;
+
+	if (!memo)
+		return;
+	free(memo->fprstr);
+	free(memo->origfprstr);
+	free(memo->orignames);
+	free(memo);
+}
+
 #if defined(OPENSSL_THREADS) && ((OPENSSL_VERSION_NUMBER < 0x10100000L) || defined(LIBRESSL_VERSION_NUMBER))
+/*
+ * OpenSSL takes its static locks for reading where it can, such as for the
+ * X509 store and the error state, so they are read/write locks, each padded
+ * to a cache line of its own such that neighbouring locks taken by different
+ * threads do not share a cache line.
+ */
+#define SSL_LOCK_ALIGN 64
+typedef union ssl_lock {
+	pthread_rwlock_t rwlock;
+	char pad[(sizeof(pthread_rwlock_t) + SSL_LOCK_ALIGN - 1) /
+	         SSL_LOCK_ALIGN * SSL_LOCK_ALIGN];
+} ssl_lock_t;
+
 struct CRYPTO_dynlock_value {
-	pthread_mutex_t mutex;
+	pthread_rwlock_t rwlock;
 };
-static pthread_mutex_t *ssl_mutex;
+static ssl_lock_t *ssl_mutex;
 static int ssl_mutex_num;
 
+/*
+ * Take or release rwlock as requested by mode.
+ */
+static void
+ssl_thr_rwlock(int mode, pthread_rwlock_t *rwlock)
+{
+	if (!(mode & CRYPTO_LOCK))
+		STATS_RWLOCK_UNLOCK(rwlock, STATS_LOCK_OPENSSL);
+	else if (mode & CRYPTO_READ)
+		STATS_RWLOCK_RDLOCK(rwlock, STATS_LOCK_OPENSSL);
+	else
+		STATS_RWLOCK_WRLOCK(rwlock, STATS_LOCK_OPENSSL);
+}
+
 /*
  * OpenSSL thread-safety locking callback, #1.
  */
 static void
 ssl_thr_locking_cb(int mode, int type, UNUSED const char *file,
                    UNUSED int line) {
-	if (type < ssl_mutex_num) {
-		if (mode & CRYPTO_LOCK)
-			pthread_mutex_lock(&ssl_mutex[type]);
-		else
-			pthread_mutex_unlock(&ssl_mutex[type]);
-	}
+	if (type < ssl_mutex_num)
+		ssl_thr_rwlock(mode, &ssl_mutex[type].rwlock);
 }
 
 /*
@@ -299,7 +402,7 @@ ssl_thr_dyn_create_cb(UNUSED const char *file, UNUSED int line)
 	struct CRYPTO_dynlock_value *dl;
 
 	if ((dl = malloc(sizeof(struct CRYPTO_dynlock_value)))) {
-		if (pthread_mutex_init(&dl->mutex, NULL)) {
+		if (pthread_rwlock_init(&dl->rwlock, NULL)) {
 			free(dl);
 			return NULL;
 		}
@@ -314,11 +417,7 @@ static void
 ssl_thr_dyn_lock_cb(int mode, struct CRYPTO_dynlock_value *dl,
                     UNUSED const char *file, UNUSED int line)
 {
-	if (mode & CRYPTO_LOCK) {
-		pthread_mutex_lock(&dl->mutex);
-	} else {
-		pthread_mutex_unlock(&dl->mutex);
-	}
+	ssl_thr_rwlock(mode, &dl->rwlock);
 }
 
 /*
@@ -328,7 +427,7 @@ static void
 ssl_thr_dyn_destroy_cb(struct CRYPTO_dynlock_value *dl,
                        UNUSED const char *file, UNUSED int line)
 {
-	pthread_mutex_destroy(&dl->mutex);
+	pthread_rwlock_destroy(&dl->rwlock);
 	free(dl);
 }
 
@@ -352,6 +451,172 @@ ssl_thr_id_cb(CRYPTO_THREADID *id)
 #endif /* !OPENSSL_NO_THREADID */
 #endif /* OPENSSL_THREADS */
 
+/*
+ * Prefix filter BIO.  Returns a buffer of octets already read from the
+ * underlying transport before passing reads on to the next BIO in the chain.
+ * Writes and controls are passed on to the next BIO unmodified, which means
+ * that BIO_get_fd() on the chain yields the fd of the underlying socket BIO.
+ * This is used to hand a ClientHello that was consumed off the socket for
+ * SNI parsing to OpenSSL.
+ */
+#if (OPENSSL_VERSION_NUMBER < 0x10100000L) || (defined(LIBRESSL_VERSION_NUMBER) && LIBRESSL_VERSION_NUMBER < 0x20700000L)
+#define BIO_get_data(bio) ((bio)->ptr)
+#define BIO_set_data(bio, data) ((bio)->ptr = (data))
+#define BIO_set_init(bio, val) ((bio)->init = (val))
+#define BIO_next(bio) ((bio)->next_bio)
+typedef bio_info_cb BIO_info_cb;
+#endif /* OPENSSL_VERSION_NUMBER < 0x10100000L */
+#define SSL_BIO_TYPE_PREFIX (0x7f|BIO_TYPE_FILTER)
+
+typedef struct ssl_bio_prefix {
+	unsigned char *buf;
+	size_t sz;
+	size_t off;
+} ssl_bio_prefix_t;
+
+static int
+ssl_bio_prefix_create(BIO *bio)
+{
+	ssl_bio_prefix_t *pfx;
+
+	pfx = malloc(sizeof(ssl_bio_prefix_t));
+	if (!pfx)
+		return 0;
+	memset(pfx, 0, sizeof(ssl_bio_prefix_t));
+	BIO_set_data(bio, pfx);
+	BIO_set_init(bio, 1);
+	return 1;
+}
+
+static int
+ssl_bio_prefix_destroy(BIO *bio)
+{
+	ssl_bio_prefix_t *pfx;
+
+	if (!bio)
+		return 0;
+	pfx = BIO_get_data(bio);
+	if (pfx) {
+		if (pfx->buf)
+			free(pfx->buf);
+		free(pfx);
+	}
+	BIO_set_data(bio, NULL);
+	BIO_set_init(bio, 0);
+	return 1;
+}
+
+static int
+ssl_bio_prefix_read(BIO *bio, char *out, int outl)
+{
+	ssl_bio_prefix_t *pfx = BIO_get_data(bio);
+	BIO *next = BIO_next(bio);
+	int rv;
+
+	if (!out || outl <= 0)
+		return 0;
+	BIO_clear_retry_flags(bio);
+	if (pfx->buf) {
+		size_t n = pfx->sz - pfx->off;
+		if (n > (size_t)outl)
+			n = outl;
+		memcpy(out, pfx->buf + pfx->off, n);
+		pfx->off += n;
+		if (pfx->off == pfx->sz) {
+			free(pfx->buf);
+			pfx->buf = NULL;
+		}
+		return n;
+	}
+	if (!next)
+		return 0;
+	rv = BIO_read(next, out, outl);
+	BIO_copy_next_retry(bio);
+	return rv;
+}
+
+static int
+ssl_bio_prefix_write(BIO *bio, const char *in, int inl)
+{
+	BIO *next = BIO_next(bio);
+	int rv;
+
+	if (!next)
+		return 0;
+	BIO_clear_retry_flags(bio);
+	rv = BIO_write(next, in, inl);
+	BIO_copy_next_retry(bio);
+	return rv;
+}
+
+static long
+ssl_bio_prefix_ctrl(BIO *bio, int cmd, long num, void *ptr)
+{
+	ssl_bio_prefix_t *pfx = BIO_get_data(bio);
+	BIO *next = BIO_next(bio);
+	long rv;
+
+	if (!next)
+		return 0;
+	rv = BIO_ctrl(next, cmd, num, ptr);
+	if (cmd == BIO_CTRL_PENDING && pfx->buf)
+		rv += pfx->sz - pfx->off;
+	return rv;
+}
+
+static long
+ssl_bio_prefix_callback_ctrl(BIO *bio, int cmd, BIO_info_cb *fp)
+{
+	BIO *next = BIO_next(bio);
+
+	if (!next)
+		return 0;
+	return BIO_callback_ctrl(next, cmd, fp);
+}
+
+#if (OPENSSL_VERSION_NUMBER < 0x10100000L) || (defined(LIBRESSL_VERSION_NUMBER) && LIBRESSL_VERSION_NUMBER < 0x20700000L)
+static BIO_METHOD ssl_bio_prefix_method_s = {
+	SSL_BIO_TYPE_PREFIX,
+	"prefix",
+	ssl_bio_prefix_write,
+	ssl_bio_prefix_read,
+	NULL,
+	NULL,
+	ssl_bio_prefix_ctrl,
+	ssl_bio_prefix_create,
+	ssl_bio_prefix_destroy,
+	ssl_bio_prefix_callback_ctrl
+};
+static BIO_METHOD *ssl_bio_prefix_method = &ssl_bio_prefix_method_s;
+#else /* OPENSSL_VERSION_NUMBER >= 0x10100000L */
+static BIO_METHOD *ssl_bio_prefix_method = NULL;
+#endif /* OPENSSL_VERSION_NUMBER >= 0x10100000L */
+
+/*
+ * Push a prefix BIO returning the sz octets in buf onto next.  On success,
+ * ownership of buf passes to the returned BIO chain, which frees next along
+ * with itself when freed using BIO_free_all().
+ * Returns NULL on failure, in which case buf and next are left untouched.
+ */
+BIO *
+ssl_bio_prefix_new(BIO *next, unsigned char *buf, size_t sz)
+{
+	ssl_bio_prefix_t *pfx;
+	BIO *bio;
+
+	bio = BIO_new(ssl_bio_prefix_method);
+	if (!bio)
+		return NULL;
+	pfx = BIO_get_data(bio);
+	if (sz > 0) {
+		pfx->buf = buf;
+		pfx->sz = sz;
+	} else {
+		free(buf);
+	}
+	return BIO_push(bio, next);
+}
+
 /*
  * Initialize OpenSSL and verify the random number generator works.
  * Returns -1 on failure, 0 on success.
@@ -392,10 +657,14 @@ ssl_init(void)
 	/* thread-safety */
 #if defined(OPENSSL_THREADS) && ((OPENSSL_VERSION_NUMBER < 0x10100000L) || defined(LIBRESSL_VERSION_NUMBER))
 	ssl_mutex_num = CRYPTO_num_locks();
-	ssl_mutex = malloc(ssl_mutex_num * sizeof(*ssl_mutex));
+	if (posix_memalign((void **)&ssl_mutex, SSL_LOCK_ALIGN,
+	                   ssl_mutex_num * sizeof(*ssl_mutex))) {
+		log_err_printf("Failed to allocate locks\n");
+		return -1;
+	}
 	for (int i = 0; i < ssl_mutex_num; i++) {
-		if (pthread_mutex_init(&ssl_mutex[i], NULL)) {
-			log_err_printf("Failed to initialize mutex\n");
+		if (pthread_rwlock_init(&ssl_mutex[i].rwlock, NULL)) {
+			log_err_printf("Failed to initialize lock\n");
 			return -1;
 		}
 	}
@@ -446,6 +715,47 @@ ssl_init(void)
 	sk_SSL_COMP_zero(comp_methods);
 #endif /* USE_FOOTPRINT_HACKS */
 
+#if (OPENSSL_VERSION_NUMBER >= 0x10100000L) && !(defined(LIBRESSL_VERSION_NUMBER) && LIBRESSL_VERSION_NUMBER < 0x20700000L)
+	ssl_bio_prefix_method = BIO_meth_new(SSL_BIO_TYPE_PREFIX, "prefix");
+	if (!ssl_bio_prefix_method ||
+	    !BIO_meth_set_write(ssl_bio_prefix_method,
+	                        ssl_bio_prefix_write) ||
+	    !BIO_meth_set_read(ssl_bio_prefix_method,
+	                       ssl_bio_prefix_read) ||
+	    !BIO_meth_set_ctrl(ssl_bio_prefix_method,
+	                       ssl_bio_prefix_ctrl) ||
+	    !BIO_meth_set_create(ssl_bio_prefix_method,
+	                         ssl_bio_prefix_create) ||
+	    !BIO_meth_set_destroy(ssl_bio_prefix_method,
+	                          ssl_bio_prefix_destroy) ||
+	    !BIO_meth_set_callback_ctrl(ssl_bio_prefix_method,
+	                                ssl_bio_prefix_callback_ctrl)) {
+		log_err_printf("Failed to create prefix BIO method\n");
+		return -1;
+	}
+#endif /* OPENSSL_VERSION_NUMBER >= 0x10100000L */
+
+	ssl_x509_leafkey_idx = X509_get_ex_new_index(0, NULL, NULL, NULL,
+	                                             ssl_x509_leafkey_free_cb);
+	if (ssl_x509_leafkey_idx == -1) {
+		log_err_printf("Failed to allocate X509 ex_data index\n");
+		return -1;
+	}
+	ssl_x509_memo_idx = X509_get_ex_new_index(0, NULL, NULL, NULL,
+	                                          ssl_x509_memo_free_cb);
+	if (ssl_x509_memo_idx == -1) {
+		log_err_printf("Failed to allocate X509 ex_data index\n");
+		return -1;
+	}
+
+#if (OPENSSL_VERSION_NUMBER >= 0x30000000L) && !defined(LIBRESSL_VERSION_NUMBER)
+	/* digests unavailable from the loaded providers, such as MD5 with
+	 * only the FIPS provider, fall back to the legacy lookup */
+	for (int i = 0; i < SSL_MD_MAX; i++)
+		ssl_md_fetched[i] = EVP_MD_fetch(NULL, ssl_md_names[i], NULL);
+	ERR_clear_error();
+#endif /* OPENSSL_VERSION_NUMBER >= 0x30000000L */
+
 	ssl_initialized = 1;
 	return 0;
 }
@@ -461,7 +771,7 @@ ssl_reinit(void)
 
 #if defined(OPENSSL_THREADS) && ((OPENSSL_VERSION_NUMBER < 0x10100000L) || defined(LIBRESSL_VERSION_NUMBER))
 	for (int i = 0; i < ssl_mutex_num; i++) {
-		if (pthread_mutex_init(&ssl_mutex[i], NULL)) {
+		if (pthread_rwlock_init(&ssl_mutex[i].rwlock, NULL)) {
 			return -1;
 		}
 	}
@@ -470,6 +780,63 @@ ssl_reinit(void)
 	return 0;
 }
 
+#ifdef HAVE_LIBCTX
+/*
+ * Create a new OpenSSL library context with the providers configured in the
+ * default OpenSSL config file, or the default provider if there are none.
+ * The context lives until ssl_fini().  Not thread-safe.
+ */
+OSSL_LIB_CTX *
+ssl_libctx_new(void)
+{
+	OSSL_LIB_CTX **p, *libctx;
+	char *conf;
+
+	p = realloc(ssl_libctx, (ssl_libctx_num + 1) * sizeof(*p));
+	if (!p)
+		return NULL;
+	ssl_libctx = p;
+	if (!(libctx = OSSL_LIB_CTX_new()))
+		return NULL;
+	/* without explicitly loaded providers, the default provider is loaded
+	 * on first use, so a missing config file is not an error */
+	if ((conf = CONF_get1_default_config_file())) {
+		(void)OSSL_LIB_CTX_load_config(libctx, conf);
+		OPENSSL_free(conf);
+	}
+	ERR_clear_error();
+	ssl_libctx[ssl_libctx_num++] = libctx;
+	return libctx;
+}
+#endif /* HAVE_LIBCTX */
+
+/*
+ * Return the message digest SSL_MD_*, preferring the one fetched by
+ * ssl_init() over the legacy one.
+ */
+const EVP_MD *
+ssl_md(int which)
+{
+#if (OPENSSL_VERSION_NUMBER >= 0x30000000L) && !defined(LIBRESSL_VERSION_NUMBER)
+	if (ssl_md_fetched[which])
+		return ssl_md_fetched[which];
+#endif /* OPENSSL_VERSION_NUMBER >= 0x30000000L */
+	switch (which) {
+	case SSL_MD_MD5:
+		return EVP_md5();
+	case SSL_MD_SHA1:
+		return EVP_sha1();
+	case SSL_MD_SHA224:
+		return EVP_sha224();
+	case SSL_MD_SHA256:
+		return EVP_sha256();
+	case SSL_MD_SHA384:
+		return EVP_sha384();
+	default:
+		return EVP_sha512();
+	}
+}
+
 /*
  * Deinitialize OpenSSL and free as much memory as possible.
  * Some 10k-100k will still remain resident no matter what.
@@ -480,6 +847,14 @@ ssl_fini(void)
 	if (!ssl_initialized)
 		return;
 
+#ifdef HAVE_LIBCTX
+	for (int i = 0; i < ssl_libctx_num; i++)
+		OSSL_LIB_CTX_free(ssl_libctx[i]);
+	free(ssl_libctx);
+	ssl_libctx = NULL;
+	ssl_libctx_num = 0;
+#endif /* HAVE_LIBCTX */
+
 #if (OPENSSL_VERSION_NUMBER < 0x10100000L) || defined(LIBRESSL_VERSION_NUMBER)
 	ERR_remove_state(0); /* current thread */
 #endif
@@ -496,7 +871,7 @@ ssl_fini(void)
 	CRYPTO_THREADID_set_callback(NULL);
 #endif /* !OPENSSL_NO_THREADID */
 	for (int i = 0; i < ssl_mutex_num; i++) {
-		pthread_mutex_destroy(&ssl_mutex[i]);
+		pthread_rwlock_destroy(&ssl_mutex[i].rwlock);
 	}
 	free(ssl_mutex);
 #endif
@@ -512,6 +887,20 @@ ssl_fini(void)
 	EVP_cleanup();
 	ERR_free_strings();
 	CRYPTO_cleanup_all_ex_data();
+	ssl_x509_leafkey_idx = -1;
+	ssl_x509_memo_idx = -1;
+
+#if (OPENSSL_VERSION_NUMBER >= 0x30000000L) && !defined(LIBRESSL_VERSION_NUMBER)
+	for (int i = 0; i < SSL_MD_MAX; i++) {
+		EVP_MD_free(ssl_md_fetched[i]);
+		ssl_md_fetched[i] = NULL;
+	}
+#endif /* OPENSSL_VERSION_NUMBER >= 0x30000000L */
+
+#if (OPENSSL_VERSION_NUMBER >= 0x10100000L) && !(defined(LIBRESSL_VERSION_NUMBER) && LIBRESSL_VERSION_NUMBER < 0x20700000L)
+	BIO_meth_free(ssl_bio_prefix_method);
+	ssl_bio_prefix_method = NULL;
+#endif /* OPENSSL_VERSION_NUMBER >= 0x10100000L */
 
 	ssl_initialized = 0;
 }
@@ -561,6 +950,75 @@ ssl_sha1_to_str(unsigned char *rawhash, int colons)
 	return str;
 }
 
+#ifdef TLS1_3_VERSION
+#define SSL_CIPHER_TLS13(c) ((SSL_CIPHER_get_protocol_id(c) >> 8) == 0x13)
+#else /* !TLS1_3_VERSION */
+#define SSL_CIPHER_TLS13(c) 0
+#endif /* !TLS1_3_VERSION */
+
+/*
+ * Reorder the SSL 3.0 to TLS 1.2 cipher suites selected by the cipher spec
+ * ciphers such that the ChaCha20-Poly1305 ones come first, for connecting
+ * to servers on behalf of clients preferring ChaCha20-Poly1305.
+ * Returns a newly allocated cipher spec, or NULL if ciphers selects no
+ * ChaCha20-Poly1305 suites, it is invalid or on memory allocation failure.
+ */
+char *
+ssl_ciphers_chacha_first(const char *ciphers)
+{
+#if (OPENSSL_VERSION_NUMBER >= 0x10100000L) && !defined(OPENSSL_NO_CHACHA)
+	STACK_OF(SSL_CIPHER) *sk;
+	const SSL_CIPHER *c;
+	SSL_CTX *sslctx;
+	char *str = NULL;
+	size_t sz = 0, len = 0;
+	int pass, n, found = 0;
+
+	if (!(sslctx = SSL_CTX_new(TLS_method())))
+		return NULL;
+	SSL_CTX_set_security_level(sslctx, 0);
+	if (!SSL_CTX_set_cipher_list(sslctx, ciphers))
+		goto out;
+	sk = SSL_CTX_get_ciphers(sslctx);
+	n = sk_SSL_CIPHER_num(sk);
+	for (int i = 0; i < n; i++) {
+		c = sk_SSL_CIPHER_value(sk, i);
+		if (SSL_CIPHER_TLS13(c))
+			continue;
+		if (SSL_CIPHER_get_cipher_nid(c) == NID_chacha20_poly1305)
+			found = 1;
+		sz += strlen(SSL_CIPHER_get_name(c)) + 1;
+	}
+	if (!found || !(str = malloc(sz)))
+		goto out;
+	/* first pass ChaCha20-Poly1305, second pass all others */
+	for (pass = 0; pass < 2; pass++) {
+		for (int i = 0; i < n; i++) {
+			const char *name;
+
+			c = sk_SSL_CIPHER_value(sk, i);
+			if (SSL_CIPHER_TLS13(c))
+				continue;
+			if ((SSL_CIPHER_get_cipher_nid(c) ==
+			     NID_chacha20_poly1305) == pass)
+				continue;
+			name = SSL_CIPHER_get_name(c);
+			if (len)
+				str[len++] = ':';
+			memcpy(str + len, name, strlen(name));
+			len += strlen(name);
+		}
+	}
+	str[len] = '\0';
+out:
+	SSL_CTX_free(sslctx);
+	return str;
+#else /* OPENSSL_VERSION_NUMBER < 0x10100000L || OPENSSL_NO_CHACHA */
+	(void)ciphers;
+	return NULL;
+#endif /* OPENSSL_VERSION_NUMBER < 0x10100000L || OPENSSL_NO_CHACHA */
+}
+
 /*
  * Format SSL state into newly allocated string.
  * Returns pointer to string that must be freed by caller, or NULL on error.
@@ -584,56 +1042,71 @@ ssl_ssl_state_to_str(SSL *ssl)
 }
 
 /*
- * Generates a NSS key log format compatible string containing the client
- * random and the master key, intended to be used to decrypt externally
- * captured network traffic using tools like Wireshark.
+ * Formats a NSS key log format compatible line containing the client
+ * random and the master key into buf, which must be at least
+ * SSL_MASTERKEY_STRSZ octets, intended to be used to decrypt externally
+ * captured network traffic using tools like Wireshark.  The line is
+ * NUL-terminated; returns its length without the NUL, or 0 if the session
+ * has no master key.
  *
  * Only supports the CLIENT_RANDOM method (SSL 3.0 - TLS 1.2).
  *
  * https://developer.mozilla.org/en-US/docs/Mozilla/Projects/NSS/Key_Log_Format
  */
-char *
-ssl_ssl_masterkey_to_str(SSL *ssl)
+size_t
+ssl_ssl_masterkey_to_buf(SSL *ssl, char *buf)
 {
-	char *str = NULL;
-	int rv;
+	static const char hex[] = "0123456789ABCDEF";
 	unsigned char *k, *r;
+	char *p = buf;
 #if (OPENSSL_VERSION_NUMBER >= 0x10100000L) && !defined(LIBRESSL_VERSION_NUMBER)
 	unsigned char kbuf[48], rbuf[32];
 	k = &kbuf[0];
 	r = &rbuf[0];
-	SSL_SESSION_get_master_key(SSL_get0_session(ssl), k, sizeof(kbuf));
+	if (!SSL_get0_session(ssl) ||
+	    SSL_SESSION_get_master_key(SSL_get0_session(ssl), k,
+	                               sizeof(kbuf)) != sizeof(kbuf))
+		return 0;
 	SSL_get_client_random(ssl, r, sizeof(rbuf));
 #else /* OPENSSL_VERSION_NUMBER < 0x10100000L */
+	if (!ssl->session || ssl->session->master_key_length != 48)
+		return 0;
 	k = ssl->session->master_key;
 	r = ssl->s3->client_random;
 #endif /* OPENSSL_VERSION_NUMBER < 0x10100000L */
-	rv = asprintf(&str,
-	              "CLIENT_RANDOM "
-	              "%02X%02X%02X%02X%02X%02X%02X%02X"
-	              "%02X%02X%02X%02X%02X%02X%02X%02X"
-	              "%02X%02X%02X%02X%02X%02X%02X%02X"
-	              "%02X%02X%02X%02X%02X%02X%02X%02X"
-	              " "
-	              "%02X%02X%02X%02X%02X%02X%02X%02X"
-	              "%02X%02X%02X%02X%02X%02X%02X%02X"
-	              "%02X%02X%02X%02X%02X%02X%02X%02X"
-	              "%02X%02X%02X%02X%02X%02X%02X%02X"
-	              "%02X%02X%02X%02X%02X%02X%02X%02X"
-	              "%02X%02X%02X%02X%02X%02X%02X%02X"
-	              "\n",
-	              r[ 0], r[ 1], r[ 2], r[ 3], r[ 4], r[ 5], r[ 6], r[ 7],
-	              r[ 8], r[ 9], r[10], r[11], r[12], r[13], r[14], r[15],
-	              r[16], r[17], r[18], r[19], r[20], r[21], r[22], r[23],
-	              r[24], r[25], r[26], r[27], r[28], r[29], r[30], r[31],
-	              k[ 0], k[ 1], k[ 2], k[ 3], k[ 4], k[ 5], k[ 6], k[ 7],
-	              k[ 8], k[ 9], k[10], k[11], k[12], k[13], k[14], k[15],
-	              k[16], k[17], k[18], k[19], k[20], k[21], k[22], k[23],
-	              k[24], k[25], k[26], k[27], k[28], k[29], k[30], k[31],
-	              k[32], k[33], k[34], k[35], k[36], k[37], k[38], k[39],
-	              k[40], k[41], k[42], k[43], k[44], k[45], k[46], k[47]);
 
-	return (rv < 0) ? NULL : str;
+	memcpy(p, "CLIENT_RANDOM ", 14);
+	p += 14;
+	for (int i = 0; i < 32; i++) {
+		*p++ = hex[r[i] >> 4];
+		*p++ = hex[r[i] & 0xF];
+	}
+	*p++ = ' ';
+	for (int i = 0; i < 48; i++) {
+		*p++ = hex[k[i] >> 4];
+		*p++ = hex[k[i] & 0xF];
+	}
+	*p++ = '\n';
+	*p = '\0';
+	return p - buf;
+}
+
+/*
+ * Same as ssl_ssl_masterkey_to_buf(), but returns an allocated string, or
+ * NULL if the session has no master key or on allocation failure.
+ */
+char *
+ssl_ssl_masterkey_to_str(SSL *ssl)
+{
+	char *str;
+
+	if (!(str = malloc(SSL_MASTERKEY_STRSZ)))
+		return NULL;
+	if (ssl_ssl_masterkey_to_buf(ssl, str) == 0) {
+		free(str);
+		return NULL;
+	}
+	return str;
 }
 
 #ifndef OPENSSL_NO_DH
@@ -956,24 +1429,152 @@ ssl_key_usage_for_key(EVP_PKEY *key)
 }
 
 /*
- * Create a fake X509v3 certificate, signed by the provided CA,
- * based on the original certificate retrieved from the real server.
+ * Certificate forging template for a CA and leaf key pair, holding the v3
+ * extensions that are the same on all certificates forged with them, ready
+ * to be added without going through the OpenSSL config string parser.
+ */
+struct ssl_x509_tmpl {
+	X509 *cacrt;
+	EVP_PKEY *cakey;
+	EVP_PKEY *key;
+	X509_EXTENSION *skid;   /* subjectKeyIdentifier of key */
+	X509_EXTENSION *akid;   /* authorityKeyIdentifier of cacrt */
+	X509_EXTENSION *bc;     /* basicConstraints if not in original */
+	X509_EXTENSION *ku;     /* keyUsage for the type of key */
+	X509_EXTENSION *eku;    /* extendedKeyUsage if not in original */
+	X509_EXTENSION *crldp;  /* crlDistributionPoints or NULL */
+};
+
+/*
+ * Build a subjectKeyIdentifier extension for the public key of crt, the same
+ * as the "hash" method of the OpenSSL config string parser.
+ */
+static X509_EXTENSION *
+ssl_x509_skid_new(X509 *crt)
+{
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int len;
+	ASN1_OCTET_STRING *oct;
+	X509_EXTENSION *ext = NULL;
+
+	if (!X509_pubkey_digest(crt, ssl_md(SSL_MD_SHA1), md, &len))
+		return NULL;
+	if (!(oct = ASN1_OCTET_STRING_new()))
+		return NULL;
+	if (ASN1_OCTET_STRING_set(oct, md, len))
+		ext = X509V3_EXT_i2d(NID_subject_key_identifier, 0, oct);
+	ASN1_OCTET_STRING_free(oct);
+	return ext;
+}
+
+/*
+ * Create a forging template for certificates issued by cacrt with cakey for
+ * leaf key key, with a crlDistributionPoints extension if crlurl is not NULL.
+ * Returned template must be freed by the caller using ssl_x509_tmpl_free().
+ */
+ssl_x509_tmpl_t *
+ssl_x509_tmpl_new(X509 *cacrt, EVP_PKEY *cakey, EVP_PKEY *key,
+                  const char *crlurl)
+{
+	ssl_x509_tmpl_t *tmpl;
+	X509V3_CTX ctx;
+	X509 *crt;
+	char *crlurlval;
+
+	if (!(tmpl = calloc(1, sizeof(ssl_x509_tmpl_t))))
+		return NULL;
+	ssl_x509_refcount_inc(cacrt);
+	tmpl->cacrt = cacrt;
+	ssl_key_refcount_inc(cakey);
+	tmpl->cakey = cakey;
+	ssl_key_refcount_inc(key);
+	tmpl->key = key;
+
+	/* subject certificate standing in for the forged ones */
+	if (!(crt = X509_new()))
+		goto errout;
+	if (!X509_set_pubkey(crt, key))
+		goto errout2;
+	X509V3_set_ctx(&ctx, cacrt, crt, NULL, NULL, 0);
+	if (!(tmpl->skid = ssl_x509_skid_new(crt)) ||
+	    !(tmpl->akid = X509V3_EXT_conf(NULL, &ctx,
+	                                   "authorityKeyIdentifier",
+	                                   "keyid,issuer:always")) ||
+	    !(tmpl->bc = X509V3_EXT_conf(NULL, &ctx, "basicConstraints",
+	                                 "CA:FALSE")) ||
+	    !(tmpl->ku = X509V3_EXT_conf(NULL, &ctx, "keyUsage",
+	                                 ssl_key_usage_for_key(key))) ||
+	    !(tmpl->eku = X509V3_EXT_conf(NULL, &ctx, "extendedKeyUsage",
+	                                  "serverAuth")))
+		goto errout2;
+	if (crlurl) {
+		if (asprintf(&crlurlval, "URI:%s", crlurl) < 0)
+			goto errout2;
+		tmpl->crldp = X509V3_EXT_conf(NULL, &ctx,
+		                              "crlDistributionPoints",
+		                              crlurlval);
+		free(crlurlval);
+		if (!tmpl->crldp)
+			goto errout2;
+	}
+	X509_free(crt);
+	return tmpl;
+
+errout2:
+	X509_free(crt);
+errout:
+	ssl_x509_tmpl_free(tmpl);
+	return NULL;
+}
+
+/*
+ * Free a forging template.
+ */
+void
+ssl_x509_tmpl_free(ssl_x509_tmpl_t *tmpl)
+{
+	X509_free(tmpl->cacrt);
+	EVP_PKEY_free(tmpl->cakey);
+	EVP_PKEY_free(tmpl->key);
+	if (tmpl->skid)
+		X509_EXTENSION_free(tmpl->skid);
+	if (tmpl->akid)
+		X509_EXTENSION_free(tmpl->akid);
+	if (tmpl->bc)
+		X509_EXTENSION_free(tmpl->bc);
+	if (tmpl->ku)
+		X509_EXTENSION_free(tmpl->ku);
+	if (tmpl->eku)
+		X509_EXTENSION_free(tmpl->eku);
+	if (tmpl->crldp)
+		X509_EXTENSION_free(tmpl->crldp);
+	free(tmpl);
+}
+
+/*
+ * Create a fake X509v3 certificate, signed by the CA of the forging template,
+ * based on the original certificate retrieved from the real server.  Only the
+ * subject, subjectAltNames, serial, validity and signature are built for each
+ * certificate; the other extensions are taken from the template.  If key is
+ * not the leaf key of the template, its subjectKeyIdentifier is built here.
  * The returned certificate is created using X509_new() and thus must
  * be freed by the caller using X509_free().
  * The optional argument extraname is added to subjectAltNames if provided.
  */
-X509 *
-ssl_x509_forge(X509 *cacrt, EVP_PKEY *cakey, X509 *origcrt, EVP_PKEY *key,
-               const char *extraname, const char *crlurl)
+static X509 *
+ssl_x509_forge_crt(const ssl_x509_tmpl_t *tmpl, X509 *origcrt, EVP_PKEY *key,
+                   const char *extraname)
 {
 	X509_NAME *subject, *issuer;
 	GENERAL_NAMES *names;
 	GENERAL_NAME *gn;
+	X509_EXTENSION *skid = NULL, *ku = NULL;
+	EVP_PKEY *cakey = tmpl->cakey;
 	X509 *crt;
 	int rv;
 
 	subject = X509_get_subject_name(origcrt);
-	issuer = X509_get_subject_name(cacrt);
+	issuer = X509_get_subject_name(tmpl->cacrt);
 	if (!subject || !issuer)
 		return NULL;
 
@@ -993,46 +1594,50 @@ ssl_x509_forge(X509 *cacrt, EVP_PKEY *cakey, X509 *origcrt, EVP_PKEY *key,
 	/* add standard v3 extensions; cf. RFC 2459 */
 
 	X509V3_CTX ctx;
-	X509V3_set_ctx(&ctx, cacrt, crt, NULL, NULL, 0);
-	if (ssl_x509_v3ext_add(&ctx, crt, "subjectKeyIdentifier",
-	                                  "hash") == -1 ||
-	    ssl_x509_v3ext_add(&ctx, crt, "authorityKeyIdentifier",
-	                                  "keyid,issuer:always") == -1)
+	X509V3_set_ctx(&ctx, tmpl->cacrt, crt, NULL, NULL, 0);
+	if (key != tmpl->key) {
+		if (!(skid = ssl_x509_skid_new(crt)))
+			goto errout;
+		rv = X509_add_ext(crt, skid, -1);
+		X509_EXTENSION_free(skid);
+		if (rv != 1)
+			goto errout;
+	} else if (X509_add_ext(crt, tmpl->skid, -1) != 1) {
+		goto errout;
+	}
+	if (X509_add_ext(crt, tmpl->akid, -1) != 1)
 		goto errout;
 
 	rv = ssl_x509_v3ext_copy_by_nid(crt, origcrt,
 	                                NID_basic_constraints);
 	if (rv == 0)
-		rv = ssl_x509_v3ext_add(&ctx, crt, "basicConstraints",
-		                                   "CA:FALSE");
+		rv = X509_add_ext(crt, tmpl->bc, -1) == 1 ? 0 : -1;
 	if (rv == -1)
 		goto errout;
 
 	/* key usage depends on the key type, do not copy from original */
-	rv = ssl_x509_v3ext_add(&ctx, crt, "keyUsage",
-	                        ssl_key_usage_for_key(key));
-	if (rv == -1)
+	if (EVP_PKEY_type(EVP_PKEY_base_id(key)) !=
+	    EVP_PKEY_type(EVP_PKEY_base_id(tmpl->key))) {
+		if (!(ku = X509V3_EXT_conf(NULL, &ctx, "keyUsage",
+		                           ssl_key_usage_for_key(key))))
+			goto errout;
+		rv = X509_add_ext(crt, ku, -1);
+		X509_EXTENSION_free(ku);
+		if (rv != 1)
+			goto errout;
+	} else if (X509_add_ext(crt, tmpl->ku, -1) != 1) {
 		goto errout;
+	}
 
 	rv = ssl_x509_v3ext_copy_by_nid(crt, origcrt,
 	                                NID_ext_key_usage);
 	if (rv == 0)
-		rv = ssl_x509_v3ext_add(&ctx, crt, "extendedKeyUsage",
-		                                   "serverAuth");
+		rv = X509_add_ext(crt, tmpl->eku, -1) == 1 ? 0 : -1;
 	if (rv == -1)
 		goto errout;
 
-	if (crlurl) {
-		char *crlurlval;
-		if (asprintf(&crlurlval, "URI:%s", crlurl) < 0)
-			goto errout;
-		if (ssl_x509_v3ext_add(&ctx, crt, "crlDistributionPoints",
-		                       crlurlval) == -1) {
-			free(crlurlval);
-			goto errout;
-		}
-		free(crlurlval);
-	}
+	if (tmpl->crldp && X509_add_ext(crt, tmpl->crldp, -1) != 1)
+		goto errout;
 
 	if (!extraname) {
 		/* no extraname provided: copy original subjectAltName ext */
@@ -1088,25 +1693,25 @@ ssl_x509_forge(X509 *cacrt, EVP_PKEY *cakey, X509 *origcrt, EVP_PKEY *key,
 	case EVP_PKEY_RSA:
 		switch (X509_get_signature_nid(origcrt)) {
 		case NID_md5WithRSAEncryption:
-			md = EVP_md5();
+			md = ssl_md(SSL_MD_MD5);
 			break;
 		case NID_ripemd160WithRSA:
 			md = EVP_ripemd160();
 			break;
 		case NID_sha1WithRSAEncryption:
-			md = EVP_sha1();
+			md = ssl_md(SSL_MD_SHA1);
 			break;
 		case NID_sha224WithRSAEncryption:
-			md = EVP_sha224();
+			md = ssl_md(SSL_MD_SHA224);
 			break;
 		case NID_sha256WithRSAEncryption:
-			md = EVP_sha256();
+			md = ssl_md(SSL_MD_SHA256);
 			break;
 		case NID_sha384WithRSAEncryption:
-			md = EVP_sha384();
+			md = ssl_md(SSL_MD_SHA384);
 			break;
 		case NID_sha512WithRSAEncryption:
-			md = EVP_sha512();
+			md = ssl_md(SSL_MD_SHA512);
 			break;
 #ifndef OPENSSL_NO_SHA0
 		case NID_shaWithRSAEncryption:
@@ -1114,7 +1719,7 @@ ssl_x509_forge(X509 *cacrt, EVP_PKEY *cakey, X509 *origcrt, EVP_PKEY *key,
 			break;
 #endif /* !OPENSSL_NO_SHA0 */
 		default:
-			md = EVP_sha256();
+			md = ssl_md(SSL_MD_SHA256);
 			break;
 		}
 		break;
@@ -1124,13 +1729,13 @@ ssl_x509_forge(X509 *cacrt, EVP_PKEY *cakey, X509 *origcrt, EVP_PKEY *key,
 		switch (X509_get_signature_nid(origcrt)) {
 		case NID_dsaWithSHA1:
 		case NID_dsaWithSHA1_2:
-			md = EVP_sha1();
+			md = ssl_md(SSL_MD_SHA1);
 			break;
 		case NID_dsa_with_SHA224:
-			md = EVP_sha224();
+			md = ssl_md(SSL_MD_SHA224);
 			break;
 		case NID_dsa_with_SHA256:
-			md = EVP_sha256();
+			md = ssl_md(SSL_MD_SHA256);
 			break;
 #ifndef OPENSSL_NO_SHA0
 		case NID_dsaWithSHA:
@@ -1138,7 +1743,7 @@ ssl_x509_forge(X509 *cacrt, EVP_PKEY *cakey, X509 *origcrt, EVP_PKEY *key,
 			break;
 #endif /* !OPENSSL_NO_SHA0 */
 		default:
-			md = EVP_sha256();
+			md = ssl_md(SSL_MD_SHA256);
 			break;
 		}
 		break;
@@ -1147,22 +1752,22 @@ ssl_x509_forge(X509 *cacrt, EVP_PKEY *cakey, X509 *origcrt, EVP_PKEY *key,
 	case EVP_PKEY_EC:
 		switch (X509_get_signature_nid(origcrt)) {
 		case NID_ecdsa_with_SHA1:
-			md = EVP_sha1();
+			md = ssl_md(SSL_MD_SHA1);
 			break;
 		case NID_ecdsa_with_SHA224:
-			md = EVP_sha224();
+			md = ssl_md(SSL_MD_SHA224);
 			break;
 		case NID_ecdsa_with_SHA256:
-			md = EVP_sha256();
+			md = ssl_md(SSL_MD_SHA256);
 			break;
 		case NID_ecdsa_with_SHA384:
-			md = EVP_sha384();
+			md = ssl_md(SSL_MD_SHA384);
 			break;
 		case NID_ecdsa_with_SHA512:
-			md = EVP_sha512();
+			md = ssl_md(SSL_MD_SHA512);
 			break;
 		default:
-			md = EVP_sha256();
+			md = ssl_md(SSL_MD_SHA256);
 			break;
 		}
 		break;
@@ -1184,6 +1789,47 @@ errout:
 	return NULL;
 }
 
+/*
+ * Forge a certificate as above using forging template tmpl, accounting for it
+ * in the forge statistics.  If key is NULL, the leaf key of the template is
+ * used.
+ */
+X509 *
+ssl_x509_forge_tmpl(const ssl_x509_tmpl_t *tmpl, X509 *origcrt, EVP_PKEY *key,
+                    const char *extraname)
+{
+	long long usec;
+	X509 *crt;
+
+	USDT_PROBE1(forge__start, origcrt);
+	usec = stats_usec();
+	crt = ssl_x509_forge_crt(tmpl, origcrt, key ? key : tmpl->key,
+	                         extraname);
+	usec = stats_usec() - usec;
+	if (crt)
+		stats_observe(STATS_HIST_FORGE, usec);
+	USDT_PROBE3(forge__done, origcrt, crt, usec);
+	return crt;
+}
+
+/*
+ * Forge a certificate as above without a prepared forging template, such as
+ * for one-off certificates.
+ */
+X509 *
+ssl_x509_forge(X509 *cacrt, EVP_PKEY *cakey, X509 *origcrt, EVP_PKEY *key,
+               const char *extraname, const char *crlurl)
+{
+	ssl_x509_tmpl_t *tmpl;
+	X509 *crt;
+
+	if (!(tmpl = ssl_x509_tmpl_new(cacrt, cakey, key, crlurl)))
+		return NULL;
+	crt = ssl_x509_forge_tmpl(tmpl, origcrt, NULL, extraname);
+	ssl_x509_tmpl_free(tmpl);
+	return crt;
+}
+
 /*
  * Load a X509 certificate chain from a PEM file.
  * Returns the first certificate in *crt and all subsequent certificates in
@@ -1386,24 +2032,62 @@ ssl_key_genrsa(const int keysize)
 	return pkey;
 }
 
+#ifndef OPENSSL_NO_EC
 /*
- * Returns the subjectKeyIdentifier compatible key id of the public key.
- * keyid will receive a binary SHA-1 hash of SSL_KEY_IDSZ bytes.
- * Returns 0 on success, -1 on failure.
+ * Generate a new EC key on the named curve, or the default curve if
+ * curvename is NULL.
+ * Returned EVP_PKEY must be freed using EVP_PKEY_free() by the caller.
  */
-int
-ssl_key_identifier_sha1(EVP_PKEY *key, unsigned char *keyid)
+EVP_PKEY *
+ssl_key_genec(const char *curvename)
 {
-	X509_PUBKEY *pubkey = NULL;
-	const unsigned char *pk;
-	int length;
+#if (OPENSSL_VERSION_NUMBER >= 0x30000000L) && !defined(LIBRESSL_VERSION_NUMBER)
+	/* provider keys use named curve encoding by default */
+	if (!curvename)
+		curvename = DFLT_CURVE;
+	if (OBJ_sn2nid(curvename) == NID_undef)
+		return NULL;
+	return EVP_PKEY_Q_keygen(NULL, NULL, "EC", curvename);
+#else /* OPENSSL_VERSION_NUMBER < 0x30000000L */
+	EVP_PKEY *pkey;
+	EC_KEY *ec;
+
+	if (!(ec = ssl_ec_by_name(curvename)))
+		return NULL;
+	if (EC_KEY_generate_key(ec) != 1) {
+		EC_KEY_free(ec);
+		return NULL;
+	}
+	/* named curve encoding, required by most TLS clients */
+	EC_KEY_set_asn1_flag(ec, OPENSSL_EC_NAMED_CURVE);
+	if (!(pkey = EVP_PKEY_new())) {
+		EC_KEY_free(ec);
+		return NULL;
+	}
+	EVP_PKEY_assign_EC_KEY(pkey, ec); /* does not increment refcount */
+	return pkey;
+#endif /* OPENSSL_VERSION_NUMBER < 0x30000000L */
+}
+#endif /* !OPENSSL_NO_EC */
+
+/*
+ * Returns the subjectKeyIdentifier compatible key id of the public key.
+ * keyid will receive a binary SHA-1 hash of SSL_KEY_IDSZ bytes.
+ * Returns 0 on success, -1 on failure.
+ */
+int
+ssl_key_identifier_sha1(EVP_PKEY *key, unsigned char *keyid)
+{
+	X509_PUBKEY *pubkey = NULL;
+	const unsigned char *pk;
+	int length;
 
 	/* X509_PUBKEY_set() will attempt to free pubkey if != NULL */
 	if (X509_PUBKEY_set(&pubkey, key) != 1 || !pubkey)
 		return -1;
 	if (!X509_PUBKEY_get0_param(NULL, &pk, &length, NULL, pubkey))
 		goto errout;
-	if (!EVP_Digest(pk, length, keyid, NULL, EVP_sha1(), NULL))
+	if (!EVP_Digest(pk, length, keyid, NULL, ssl_md(SSL_MD_SHA1), NULL))
 		goto errout;
 	X509_PUBKEY_free(pubkey);
 	return 0;
@@ -1474,7 +2158,7 @@ ssl_x509_fingerprint_sha1(X509 *crt, unsigned char *fpr)
 {
 	unsigned int sz = SSL_X509_FPRSZ;
 
-	return X509_digest(crt, EVP_sha1(), fpr, &sz) ? 0 : -1;
+	return X509_digest(crt, ssl_md(SSL_MD_SHA1), fpr, &sz) ? 0 : -1;
 }
 
 /*
@@ -1537,6 +2221,93 @@ ssl_x509_refcount_inc(X509 *crt)
 #endif /* !OPENSSL_THREADS */
 }
 
+/*
+ * Attach the private key matching the public key of a forged certificate
+ * to the certificate, for forged certificates with a key of their own
+ * instead of the shared leaf key.  The certificate holds a reference to the
+ * key for as long as it exists, including in the forged certificate cache.
+ * Must be called before the certificate is shared with other threads.
+ * Returns -1 on error, 0 on success.
+ */
+int
+ssl_x509_leafkey_set(X509 *crt, EVP_PKEY *key)
+{
+	ssl_key_refcount_inc(key);
+	if (!X509_set_ex_data(crt, ssl_x509_leafkey_idx, key)) {
+		EVP_PKEY_free(key);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Return the private key attached to crt by ssl_x509_leafkey_set(), or NULL
+ * if crt uses the shared leaf key.  Does not increment the reference count.
+ */
+EVP_PKEY *
+ssl_x509_leafkey_get(X509 *crt)
+{
+	return X509_get_ex_data(crt, ssl_x509_leafkey_idx);
+}
+
+/*
+ * Attach the metadata derived from a forged certificate and the original
+ * certificate origcrt it was forged from to the certificate, such that
+ * connections reusing it from the cache do not need to recompute
+ * fingerprints and names.  Does nothing if crt already carries metadata.
+ * Must be called before the certificate is shared with other threads.
+ * Returns -1 on error, 0 on success.
+ */
+int
+ssl_x509_memo_set(X509 *crt, X509 *origcrt)
+{
+	ssl_x509_memo_t *memo;
+
+	if (X509_get_ex_data(crt, ssl_x509_memo_idx))
+		return 0;
+	if (!(memo = malloc(sizeof(ssl_x509_memo_t))))
+		return -1;
+	memset(memo, 0, sizeof(ssl_x509_memo_t));
+	if (ssl_x509_fingerprint_sha1(crt, memo->fpr) == -1)
+		goto errout;
+	if (!(memo->fprstr = ssl_sha1_to_str(memo->fpr, 0)))
+		goto errout;
+	if (!(memo->origfprstr = ssl_x509_fingerprint(origcrt, 0)))
+		goto errout;
+	if (!(memo->orignames = ssl_x509_names_to_str(origcrt)))
+		goto errout;
+	if (!X509_set_ex_data(crt, ssl_x509_memo_idx, memo))
+		goto errout;
+	return 0;
+
+errout:
+	ssl_x509_memo_free_cb(NULL, memo, NULL, 0, 0, NULL);
+	return -1;
+}
+
+/*
+ * Return the metadata attached to crt by ssl_x509_memo_set(), or NULL if
+ * there is none.  Valid for as long as the caller holds a reference to crt.
+ */
+const ssl_x509_memo_t *
+ssl_x509_memo_get(X509 *crt)
+{
+	return X509_get_ex_data(crt, ssl_x509_memo_idx);
+}
+
+/*
+ * Increment the reference count of an SSL context in a thread-safe manner.
+ */
+void
+ssl_ctx_refcount_inc(SSL_CTX *sslctx)
+{
+#if defined(OPENSSL_THREADS) && ((OPENSSL_VERSION_NUMBER < 0x10100000L) || defined(LIBRESSL_VERSION_NUMBER))
+	CRYPTO_add(&sslctx->references, 1, CRYPTO_LOCK_SSL_CTX);
+#else /* !OPENSSL_THREADS */
+	SSL_CTX_up_ref(sslctx);
+#endif /* !OPENSSL_THREADS */
+}
+
 /*
  * Match a URL/URI hostname against a single certificate DNS name
  * using RFC 6125 rules (6.4.3 Checking of Wildcard Certificates):
@@ -1853,6 +2624,19 @@ ssl_x509_is_valid(X509 *crt)
 	return 1;
 }
 
+/*
+ * Returns the notAfter time of a certificate as time_t, or -1 on errors.
+ */
+time_t
+ssl_x509_expiry(X509 *crt)
+{
+	int days, secs;
+
+	if (!ASN1_TIME_diff(&days, &secs, NULL, X509_get_notAfter(crt)))
+		return -1;
+	return time(NULL) + (time_t)days * 24 * 60 * 60 + secs;
+}
+
 /*
  * Print X509 certificate data to a newly allocated string.
  * Caller must free returned string.
@@ -1956,6 +2740,53 @@ ssl_session_is_valid(SSL_SESSION *sess)
 	return (SSL_SESSION_get_time(sess) > curtime - timeout);
 }
 
+/*
+ * Returns non-zero if the session is a TLS 1.3 session, which is resumed
+ * using a ticket that should only be used once (RFC 8446, C.4), zero
+ * otherwise.
+ */
+int
+ssl_session_is_single_use(SSL_SESSION *sess)
+{
+#if defined(TLS1_3_VERSION) && !defined(LIBRESSL_VERSION_NUMBER)
+	return SSL_SESSION_get_protocol_version(sess) == TLS1_3_VERSION;
+#else /* !TLS1_3_VERSION || LIBRESSL_VERSION_NUMBER */
+	(void)sess;
+	return 0;
+#endif /* !TLS1_3_VERSION || LIBRESSL_VERSION_NUMBER */
+}
+
+/*
+ * Increment the reference count of an SSL session in a thread-safe manner.
+ */
+void
+ssl_session_refcount_inc(SSL_SESSION *sess)
+{
+#if defined(OPENSSL_THREADS) && ((OPENSSL_VERSION_NUMBER < 0x10100000L) || defined(LIBRESSL_VERSION_NUMBER))
+	CRYPTO_add(&sess->references, 1, CRYPTO_LOCK_SSL_SESSION);
+#else /* !OPENSSL_THREADS */
+	SSL_SESSION_up_ref(sess);
+#endif /* !OPENSSL_THREADS */
+}
+
+/*
+ * Approximate memory footprint of an SSL session without serializing it:
+ * a fixed estimate for the session structure and its key material plus the
+ * DER size of the peer certificate, which X509 keeps cached after parsing.
+ */
+#define SSL_SESSION_BASESZ 512
+size_t
+ssl_session_memsz(SSL_SESSION *sess)
+{
+	X509 *peer;
+	int sz;
+
+	peer = SSL_SESSION_get0_peer(sess);
+	sz = peer ? i2d_X509(peer, NULL) : 0;
+	return SSL_SESSION_BASESZ + (sz > 0 ? sz : 0);
+}
+#undef SSL_SESSION_BASESZ
+
 /*
  * Returns 1 if buf contains a DER encoded OCSP request which can be parsed.
  * Returns 0 otherwise.
@@ -1974,6 +2805,188 @@ ssl_is_ocspreq(const unsigned char *buf, size_t sz)
 	return 1;
 }
 
+/*
+ * Create an OCSP response for crt, signed by its issuer cacrt with cakey,
+ * stating that crt is good until validity seconds from now.  The DER encoded
+ * response is returned in a newly allocated buffer in *der, which must be
+ * freed by the caller using OPENSSL_free().  Like forged certificates, the
+ * response is backdated by one day to accommodate clients with clock skew.
+ * Returns the size of the response, or -1 on error.
+ */
+int
+ssl_ocsp_response_new(X509 *crt, X509 *cacrt, EVP_PKEY *cakey, long validity,
+                      unsigned char **der)
+{
+	OCSP_CERTID *id;
+	OCSP_BASICRESP *bs = NULL;
+	OCSP_RESPONSE *resp = NULL;
+	ASN1_TIME *thisupd = NULL, *nextupd = NULL;
+	int sz = -1;
+
+	*der = NULL;
+	if (!(id = OCSP_cert_to_id(NULL, crt, cacrt)))
+		return -1;
+	if (!(bs = OCSP_BASICRESP_new()) ||
+	    !(thisupd = X509_gmtime_adj(NULL, (long)-60*60*24)) ||
+	    !(nextupd = X509_gmtime_adj(NULL, validity)))
+		goto errout;
+	if (!OCSP_basic_add1_status(bs, id, V_OCSP_CERTSTATUS_GOOD, 0, NULL,
+	                            thisupd, nextupd))
+		goto errout;
+	if (!OCSP_basic_sign(bs, cacrt, cakey, ssl_md(SSL_MD_SHA256), NULL,
+	                     OCSP_NOCERTS))
+		goto errout;
+	if (!(resp = OCSP_response_create(OCSP_RESPONSE_STATUS_SUCCESSFUL,
+	                                  bs)))
+		goto errout;
+	sz = i2d_OCSP_RESPONSE(resp, der);
+	if (sz <= 0) {
+		*der = NULL;
+		sz = -1;
+	}
+
+errout:
+	if (resp)
+		OCSP_RESPONSE_free(resp);
+	if (nextupd)
+		ASN1_TIME_free(nextupd);
+	if (thisupd)
+		ASN1_TIME_free(thisupd);
+	if (bs)
+		OCSP_BASICRESP_free(bs);
+	OCSP_CERTID_free(id);
+	return sz;
+}
+
+/*
+ * Returns 1 if the cipher suite identified by the two octets hi and lo can be
+ * negotiated with an ECDSA server certificate, 0 otherwise.  TLS 1.3 suites
+ * are independent of the certificate type.
+ */
+static int
+ssl_tls_ciphersuite_ecdsa(unsigned char hi, unsigned char lo)
+{
+	if (hi == 0x13)
+		return 1;
+	if (hi == 0xC0)
+		return (lo >= 0x06 && lo <= 0x0A) ||    /* ECDHE_ECDSA_* */
+		       lo == 0x23 || lo == 0x24 ||      /* ..._SHA256/384 */
+		       lo == 0x2B || lo == 0x2C ||      /* ..._GCM_* */
+		       (lo >= 0xAC && lo <= 0xAF);      /* ..._CCM* */
+	if (hi == 0xCC)
+		return lo == 0xA9;                      /* ..._CHACHA20 */
+	return 0;
+}
+
+/*
+ * Returns 1 if the cipher suite identified by the two octets hi and lo uses
+ * ChaCha20-Poly1305, 0 otherwise.
+ */
+static int
+ssl_tls_ciphersuite_chacha(unsigned char hi, unsigned char lo)
+{
+	return (hi == 0x13 && lo == 0x03) ||        /* TLS 1.3 */
+	       (hi == 0xCC && lo >= 0xA8 && lo <= 0xAE);
+}
+
+/*
+ * JA3 fingerprint string under construction: decimal values separated by
+ * '-' within and ',' between the fields.  Values in excess of the buffer are
+ * not fingerprinted; len is set to SSL_JA3_BUFSZ to mark the overflow.
+ *
+ * References:
+ * https://github.com/salesforce/ja3
+ * RFC 8701: Applying GREASE to TLS Extensibility
+ */
+#define SSL_JA3_BUFSZ 2048
+#define SSL_TLS_GREASE(v) \
+        (((v) & 0x0f0f) == 0x0a0a && ((v) >> 8) == ((v) & 0xff))
+
+static void
+ssl_ja3_add(char *buf, size_t *len, unsigned int v)
+{
+	if (SSL_TLS_GREASE(v))
+		return;
+	if (*len + 7 > SSL_JA3_BUFSZ) {
+		*len = SSL_JA3_BUFSZ;
+		return;
+	}
+	*len += snprintf(buf + *len, 7, "%u-", v);
+}
+
+static void
+ssl_ja3_end(char *buf, size_t *len)
+{
+	if (*len + 2 > SSL_JA3_BUFSZ) {
+		*len = SSL_JA3_BUFSZ;
+		return;
+	}
+	if (*len && buf[*len - 1] == '-')
+		buf[*len - 1] = ',';
+	else
+		buf[(*len)++] = ',';
+}
+
+/*
+ * Hash the JA3 string of len octets in buf, including the trailing ',',
+ * into the hex MD5 fingerprint at ja3.
+ */
+static void
+ssl_ja3_final(const char *buf, size_t len, char *ja3)
+{
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int mdlen;
+
+	ja3[0] = '\0';
+	if (len == 0 || len >= SSL_JA3_BUFSZ)
+		return;
+	if (!EVP_Digest(buf, len - 1, md, &mdlen, ssl_md(SSL_MD_MD5), NULL) ||
+	    mdlen != 16)
+		return;
+	for (unsigned int i = 0; i < mdlen; i++)
+		snprintf(ja3 + 2 * i, 3, "%02x", md[i]);
+}
+
+/*
+ * Complete the summary of a TLS ClientHello from the supported_groups list
+ * of groupslen octets at groups and the ec_point_formats list of fmtslen
+ * octets at fmts, both NULL if not offered, and the JA3 string of ja3len
+ * octets at ja3 holding the version, cipher suites and extensions fields.
+ */
+static void
+ssl_chello_finish(ssl_chello_t *sum, char *ja3, size_t ja3len,
+                  const unsigned char *groups, ssize_t groupslen,
+                  const unsigned char *fmts, ssize_t fmtslen)
+{
+	ssl_ja3_end(ja3, &ja3len);
+	for (ssize_t i = 0; groups && i + 1 < groupslen; i += 2) {
+		unsigned short g = groups[i] << 8 | groups[i + 1];
+		switch (g) {
+		case 23:
+			sum->groups |= SSL_CHELLO_GROUP_P256;
+			break;
+		case 24:
+			sum->groups |= SSL_CHELLO_GROUP_P384;
+			break;
+		case 25:
+			sum->groups |= SSL_CHELLO_GROUP_P521;
+			break;
+		case 29:
+			sum->groups |= SSL_CHELLO_GROUP_X25519;
+			break;
+		case 30:
+			sum->groups |= SSL_CHELLO_GROUP_X448;
+			break;
+		}
+		ssl_ja3_add(ja3, &ja3len, g);
+	}
+	ssl_ja3_end(ja3, &ja3len);
+	for (ssize_t i = 0; fmts && i < fmtslen; i++)
+		ssl_ja3_add(ja3, &ja3len, fmts[i]);
+	ssl_ja3_end(ja3, &ja3len);
+	ssl_ja3_final(ja3, ja3len, sum->ja3);
+}
+
 /*
  * Ugly hack to manually parse a clientHello message from a memory buffer.
  * This is needed in order to be able to support SNI and STARTTLS.
@@ -2005,11 +3018,21 @@ ssl_is_ocspreq(const unsigned char *buf, size_t sz)
  * as a newly allocated string that must be freed by the caller.  This may
  * only occur for a return value of 0.
  *
+ * If an ecdsa pointer was supplied by the caller, *ecdsa is set to 1 for a
+ * return value of 0 if the client offered at least one cipher suite usable
+ * with an ECDSA server certificate and either did not send the
+ * signature_algorithms extension or listed an ECDSA algorithm in it, and to 0
+ * otherwise.  SSL 2.0 ClientHello messages never indicate ECDSA support.
+ *
  * If search is non-zero, then the buffer will be searched for a ClientHello
  * message beginning at offsets >= 0, whereas if search is zero, only
  * ClientHello messages starting at offset 0 will be considered.
  *
- * This code currently supports SSL 2.0, SSL 3.0 and TLS 1.0-1.2.
+ * If a summary sum was supplied by the caller, it is filled in for a return
+ * value of 0 in the same pass, see ssl_tls_clienthello_summary().
+ *
+ * This code currently supports SSL 2.0, SSL 3.0 and TLS 1.0-1.2, and TLS 1.3
+ * ClientHello messages, which are backwards compatible.
  *
  * References:
  * draft-hickman-netscape-ssl-00: The SSL Protocol
@@ -2020,10 +3043,12 @@ ssl_is_ocspreq(const unsigned char *buf, size_t sz)
  * RFC 4366: Transport Layer Security (TLS) Extensions
  * RFC 5246: The Transport Layer Security (TLS) Protocol Version 1.2
  * RFC 6066: Transport Layer Security (TLS) Extensions: Extension Definitions
+ * RFC 8446: The Transport Layer Security (TLS) Protocol Version 1.3
  */
-int
-ssl_tls_clienthello_parse(const unsigned char *buf, ssize_t sz, int search,
-                          const unsigned char **clienthello, char **servername)
+static int
+ssl_tls_clienthello_scan(const unsigned char *buf, ssize_t sz, int search,
+                         const unsigned char **clienthello, char **servername,
+                         int *ecdsa, ssl_chello_t *sum)
 {
 #ifdef DEBUG_CLIENTHELLO_PARSER
 #define DBG_printf(...) log_dbg_printf("ClientHello parser: " __VA_ARGS__)
@@ -2033,8 +3058,16 @@ ssl_tls_clienthello_parse(const unsigned char *buf, ssize_t sz, int search,
 	const unsigned char *p = buf;
 	ssize_t n = sz;
 	char *sn = NULL;
+	int ecsuite = 0;
+	int ecsigalg = -1;
+	char ja3[SSL_JA3_BUFSZ];
+	size_t ja3len = 0;
+	const unsigned char *groups = NULL, *fmts = NULL;
+	ssize_t groupslen = 0, fmtslen = 0;
 
 	*clienthello = NULL;
+	if (sum)
+		memset(sum, 0, sizeof(ssl_chello_t));
 
 	DBG_printf("parsing buffer of sz %zd\n", sz);
 
@@ -2051,6 +3084,12 @@ ssl_tls_clienthello_parse(const unsigned char *buf, ssize_t sz, int search,
 				free(sn);
 				sn = NULL;
 			}
+			ecsuite = 0;
+			ecsigalg = -1;
+			if (sum)
+				memset(sum, 0, sizeof(ssl_chello_t));
+			ja3len = 0;
+			groups = fmts = NULL;
 		}
 
 		if (search) {
@@ -2106,6 +3145,11 @@ ssl_tls_clienthello_parse(const unsigned char *buf, ssize_t sz, int search,
 #endif /* HAVE_SSLV2 */
 			      (p[0] == 0x03 && p[1] <= 0x03)))
 				continue;
+			if (sum) {
+				sum->sslv2 = 1;
+				sum->version = p[0] << 8 | p[1];
+				sum->maxversion = sum->version;
+			}
 			p += 2; n -= 2;
 
 			DBG_printf("cipher-spec-len: %02x %02x\n", p[0], p[1]);
@@ -2132,6 +3176,7 @@ ssl_tls_clienthello_parse(const unsigned char *buf, ssize_t sz, int search,
 
 			p += cipherspec_len + sessionid_len + challenge_len;
 			n -= cipherspec_len + sessionid_len + challenge_len;
+			ecsigalg = 0;
 			goto done_parsing;
 		} else
 		if (*p != 0x16) {
@@ -2204,6 +3249,12 @@ ssl_tls_clienthello_parse(const unsigned char *buf, ssize_t sz, int search,
 		/* inner version check, see outer one above */
 		if (p[0] != 0x03 || p[1] > 0x03)
 			continue;
+		if (sum) {
+			sum->version = p[0] << 8 | p[1];
+			sum->maxversion = sum->version;
+			ssl_ja3_add(ja3, &ja3len, sum->version);
+			ssl_ja3_end(ja3, &ja3len);
+		}
 		p += 2; n -= 2;
 
 		if (n < 32)
@@ -2221,6 +3272,10 @@ ssl_tls_clienthello_parse(const unsigned char *buf, ssize_t sz, int search,
 		p += 1; n -= 1;
 		if (n < sidlen)
 			continue;
+		if (sum && sidlen > 0 && sidlen <= 32) {
+			sum->sidoff = p - *clienthello;
+			sum->sidlen = sidlen;
+		}
 		p += sidlen; n -= sidlen;
 
 		if (n < 2)
@@ -2231,6 +3286,23 @@ ssl_tls_clienthello_parse(const unsigned char *buf, ssize_t sz, int search,
 		p += 2; n -= 2;
 		if (n < suiteslen)
 			continue;
+		for (ssize_t i = 0, first = 1; i + 1 < suiteslen; i += 2) {
+			if (ssl_tls_ciphersuite_ecdsa(p[i], p[i + 1])) {
+				ecsuite = 1;
+				if (!sum)
+					break;
+			}
+			if (!sum)
+				continue;
+			if (first && !SSL_TLS_GREASE(p[i] << 8 | p[i + 1])) {
+				sum->chacha = ssl_tls_ciphersuite_chacha(
+				              p[i], p[i + 1]);
+				first = 0;
+			}
+			ssl_ja3_add(ja3, &ja3len, p[i] << 8 | p[i + 1]);
+		}
+		if (sum)
+			ssl_ja3_end(ja3, &ja3len);
 		p += suiteslen;
 		n -= suiteslen;
 
@@ -2251,6 +3323,14 @@ ssl_tls_clienthello_parse(const unsigned char *buf, ssize_t sz, int search,
 			DBG_printf("===> Match: rv 0, *clienthello set\n");
 			if (servername)
 				*servername = NULL;
+			if (ecdsa)
+				*ecdsa = ecsuite;
+			if (sum) {
+				sum->ecdsa = ecsuite;
+				for (int i = 0; i < 3; i++)
+					ssl_ja3_end(ja3, &ja3len);
+				ssl_ja3_final(ja3, ja3len, sum->ja3);
+			}
 			return 0;
 		}
 		if (n < 2)
@@ -2273,6 +3353,8 @@ ssl_tls_clienthello_parse(const unsigned char *buf, ssize_t sz, int search,
 			p += 4; n -= 4;
 			if (n < extlen)
 				goto continue_search;
+			if (sum)
+				ssl_ja3_add(ja3, &ja3len, exttype);
 			switch (exttype) {
 			case 0: {
 				ssize_t extn = extlen;
@@ -2324,6 +3406,73 @@ ssl_tls_clienthello_parse(const unsigned char *buf, ssize_t sz, int search,
 				}
 				break;
 			}
+			case 13: {
+				ssize_t extn = extlen;
+				const unsigned char *extp = p;
+
+				if (extn < 2)
+					goto continue_search;
+				ssize_t algslen = extp[1] + (extp[0] << 8);
+				DBG_printf("sigalgslen = %zd\n", algslen);
+				extp += 2;
+				extn -= 2;
+				if (algslen != extn || algslen % 2)
+					goto continue_search;
+
+				ecsigalg = 0;
+				for (ssize_t i = 0; i < algslen; i += 2) {
+					/* TLS 1.2 SignatureAlgorithm ecdsa(3);
+					 * TLS 1.3 ecdsa_* code points share
+					 * the same low octet */
+					if (extp[i + 1] == 0x03) {
+						ecsigalg = 1;
+						break;
+					}
+				}
+				break;
+			}
+			case 10: /* supported_groups */
+				if (extlen < 2 || extlen - 2 !=
+				                  (p[0] << 8 | p[1]))
+					break;
+				groups = p + 2;
+				groupslen = extlen - 2;
+				break;
+			case 11: /* ec_point_formats */
+				if (extlen < 1 || extlen - 1 != p[0])
+					break;
+				fmts = p + 1;
+				fmtslen = extlen - 1;
+				break;
+			case 16: /* application_layer_protocol_negotiation */
+				if (extlen < 3 || extlen - 2 !=
+				                  (p[0] << 8 | p[1]))
+					break;
+				if (sum) {
+					sum->alpnoff = p + 2 - *clienthello;
+					sum->alpnlen = extlen - 2;
+					sum->h2 = !!ssl_alpn_find(p + 2,
+					        extlen - 2,
+					        (const unsigned char *)"h2", 2);
+				}
+				break;
+			case 35: /* session_ticket */
+				if (sum)
+					sum->ticket = extlen > 0;
+				break;
+			case 43: /* supported_versions */
+				if (extlen < 1 || extlen - 1 != p[0] ||
+				    p[0] % 2)
+					break;
+				for (ssize_t i = 1; sum && i < extlen;
+				     i += 2) {
+					unsigned short v = p[i] << 8 |
+					                   p[i + 1];
+					if (!SSL_TLS_GREASE(v) &&
+					    v > sum->maxversion)
+						sum->maxversion = v;
+				}
+				break;
 			default:
 				DBG_printf("skipped\n");
 				break;
@@ -2346,6 +3495,15 @@ done_parsing:
 		DBG_printf("===> Match: rv 0, *clienthello set\n");
 		if (servername)
 			*servername = sn;
+		if (ecdsa)
+			*ecdsa = ecsuite && ecsigalg;
+		if (sum) {
+			sum->ecdsa = ecsuite && ecsigalg;
+			if (!sum->sslv2)
+				ssl_chello_finish(sum, ja3, ja3len,
+				                  groups, groupslen,
+				                  fmts, fmtslen);
+		}
 		return 0;
 continue_search:
 		;
@@ -2361,4 +3519,226 @@ continue_search:
 	return 1;
 }
 
+/*
+ * Parse a ClientHello message, see ssl_tls_clienthello_scan().
+ */
+int
+ssl_tls_clienthello_parse(const unsigned char *buf, ssize_t sz, int search,
+                          const unsigned char **clienthello, char **servername,
+                          int *ecdsa)
+{
+	return ssl_tls_clienthello_scan(buf, sz, search, clienthello,
+	                                servername, ecdsa, NULL);
+}
+
+/*
+ * Parse a ClientHello message like ssl_tls_clienthello_parse(), and fill in
+ * the summary sum in the same pass, for all consumers of the ClientHello to
+ * read instead of parsing it again: the offered versions, session ID,
+ * session ticket, ALPN protocols and groups, whether ECDSA server
+ * certificates are usable, and the JA3 fingerprint.  sum is zeroed for
+ * return values other than 0.
+ */
+int
+ssl_tls_clienthello_summary(const unsigned char *buf, ssize_t sz, int search,
+                            const unsigned char **clienthello,
+                            char **servername, ssl_chello_t *sum)
+{
+	int rv;
+
+	rv = ssl_tls_clienthello_scan(buf, sz, search, clienthello,
+	                              servername, NULL, sum);
+	if (rv != 0)
+		memset(sum, 0, sizeof(ssl_chello_t));
+	return rv;
+}
+
+/*
+ * Return the session ID offered in the TLS ClientHello record of sz octets
+ * at clienthello, as found by ssl_tls_clienthello_parse(), in *id and *idlen.
+ * Returns -1 if the ClientHello does not offer a session ID, 0 otherwise.
+ */
+int
+ssl_tls_clienthello_sessionid(const unsigned char *clienthello, size_t sz,
+                              const unsigned char **id, size_t *idlen)
+{
+	/* record header 5, handshake header 4, version 2, random 32 */
+	if (sz < 44 || clienthello[0] != 0x16)
+		return -1;
+	*idlen = clienthello[43];
+	if (*idlen == 0 || *idlen > 32 || sz < 44 + *idlen)
+		return -1;
+	*id = clienthello + 44;
+	return 0;
+}
+
+/*
+ * Return the protocol name list of the application_layer_protocol_negotiation
+ * extension in the TLS ClientHello record of sz octets at clienthello, as
+ * found by ssl_tls_clienthello_parse(), in *alpn and *alpnlen.  The list is
+ * in wire format, a sequence of length-prefixed protocol names, as expected
+ * by SSL_set_alpn_protos().
+ * Returns -1 if the ClientHello does not offer any protocols, 0 otherwise.
+ *
+ * References:
+ * RFC 7301: TLS Application-Layer Protocol Negotiation Extension
+ */
+int
+ssl_tls_clienthello_alpn(const unsigned char *clienthello, size_t sz,
+                         const unsigned char **alpn, size_t *alpnlen)
+{
+	size_t off, end, len;
+
+	/* record header 5, handshake header 4, version 2, random 32 */
+	if (sz < 44 || clienthello[0] != 0x16)
+		return -1;
+
+	/* session id, cipher suites, compression methods */
+	off = 44 + clienthello[43];
+	if (off + 2 > sz)
+		return -1;
+	off += 2 + (clienthello[off] << 8 | clienthello[off + 1]);
+	if (off + 1 > sz)
+		return -1;
+	off += 1 + clienthello[off];
+	if (off + 2 > sz)
+		return -1;
+	end = off + 2 + (clienthello[off] << 8 | clienthello[off + 1]);
+	off += 2;
+	if (end > sz)
+		return -1;
+
+	while (off + 4 <= end) {
+		unsigned short exttype = clienthello[off] << 8 |
+		                         clienthello[off + 1];
+		len = clienthello[off + 2] << 8 | clienthello[off + 3];
+		off += 4;
+		if (off + len > end)
+			return -1;
+		if (exttype == 16) {
+			if (len < 3 || (size_t)(clienthello[off] << 8 |
+			                        clienthello[off + 1]) != len - 2)
+				return -1;
+			*alpn = clienthello + off + 2;
+			*alpnlen = len - 2;
+			return 0;
+		}
+		off += len;
+	}
+	return -1;
+}
+
+/*
+ * Look up the protocol name proto of protolen octets in the ALPN protocol
+ * name list of len octets at list, in wire format.  Returns a pointer to the
+ * length prefix of the matching entry in list, or NULL if not found.
+ */
+const unsigned char *
+ssl_alpn_find(const unsigned char *list, size_t len,
+              const unsigned char *proto, size_t protolen)
+{
+	const unsigned char *p = list;
+	const unsigned char *end = list + len;
+
+	while (p < end && (size_t)(end - p) > p[0]) {
+		if (p[0] == protolen && !memcmp(p + 1, proto, protolen))
+			return p;
+		p += 1 + p[0];
+	}
+	return NULL;
+}
+
+/*
+ * Reassemble a ClientHello message from the octets received so far, which
+ * may contain the handshake message fragmented across several TLS records.
+ * This allows ssl_tls_clienthello_parse() to parse ClientHello messages that
+ * do not fit into a single record or arrived in several segments.
+ *
+ * Returns:
+ *  1  if buf does not contain a complete ClientHello message yet;
+ *     the caller should retry with more octets
+ *  0  if buf contains a complete ClientHello message; *record is set to a
+ *     newly allocated buffer of *recordsz octets containing the ClientHello
+ *     message in a single record, or to NULL if the message is too large to
+ *     fit into a single record
+ * -1  if buf does not start with an SSL/TLS handshake record
+ *
+ * SSL 2.0 records are returned as they are.  The record returned must be
+ * freed by the caller.
+ */
+int
+ssl_tls_clienthello_reassemble(const unsigned char *buf, size_t sz,
+                               unsigned char **record, size_t *recordsz)
+{
+	const unsigned char *p = buf;
+	size_t n = sz;
+	unsigned char *msg;
+	size_t msgsz = 0;
+	size_t msglen;
+
+	*record = NULL;
+	*recordsz = 0;
+
+	if (sz < 1)
+		return 1;
+	if (buf[0] == 0x80) {
+		if (sz < 2)
+			return 1;
+		if (sz < (size_t)buf[1] + 2)
+			return 1;
+		if (!(*record = malloc(buf[1] + 2)))
+			return -1;
+		memcpy(*record, buf, buf[1] + 2);
+		*recordsz = buf[1] + 2;
+		return 0;
+	}
+	if (buf[0] != 0x16)
+		return -1;
+
+	/* payload octets never exceed the input octets */
+	if (!(msg = malloc(sz)))
+		return -1;
+	while (n >= 5) {
+		size_t recordlen;
+
+		if (p[0] != 0x16 || p[1] != 0x03) {
+			free(msg);
+			return -1;
+		}
+		recordlen = p[4] + (p[3] << 8);
+		if (n - 5 < recordlen)
+			break;
+		memcpy(msg + msgsz, p + 5, recordlen);
+		msgsz += recordlen;
+		p += 5 + recordlen;
+		n -= 5 + recordlen;
+		if (msgsz < 4)
+			continue;
+		if (msg[0] != 0x01) {
+			free(msg);
+			return -1;
+		}
+		msglen = msg[3] + (msg[2] << 8) + (msg[1] << 16);
+		if (msgsz < msglen + 4)
+			continue;
+		if (msglen + 4 > 0xFFFF) {
+			free(msg);
+			return 0;
+		}
+		if (!(*record = malloc(msglen + 9))) {
+			free(msg);
+			return -1;
+		}
+		memcpy(*record, buf, 3);
+		(*record)[3] = (msglen + 4) >> 8;
+		(*record)[4] = (msglen + 4) & 0xFF;
+		memcpy(*record + 5, msg, msglen + 4);
+		*recordsz = msglen + 9;
+		free(msg);
+		return 0;
+	}
+	free(msg);
+	return 1;
+}
+
 /* vim: set noet ft=c: */
@@ -31,6 +31,8 @@
 
 #include "attrib.h"
 
+#include <time.h>
+
 #include <openssl/opensslv.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
@@ -87,9 +89,17 @@
 #endif /* < LibreSSL 2.5.1 and OpenSSL < 1.1.0 */
 #define ASN1_STRING_get0_data(value) ASN1_STRING_data(value)
 #define X509_get_signature_nid(x509) (OBJ_obj2nid(x509->sig_alg->algorithm))
+#define X509_STORE_CTX_get0_cert(store) ((store)->cert)
+#define X509_STORE_CTX_get0_untrusted(store) ((store)->untrusted)
+#define X509_STORE_CTX_get0_chain(store) X509_STORE_CTX_get_chain(store)
+#define SSL_SESSION_get0_peer(sess) ((sess)->peer)
 int DH_set0_pqg(DH *, BIGNUM *, BIGNUM *, BIGNUM *);
 #endif /* < OpenSSL 1.1.0 */
 
+#if (OPENSSL_VERSION_NUMBER < 0x30000000L) || defined(LIBRESSL_VERSION_NUMBER)
+#define EVP_PKEY_eq(a, b) EVP_PKEY_cmp(a, b)
+#endif /* < OpenSSL 3.0 */
+
 #if OPENSSL_VERSION_NUMBER < 0x1000000fL
 static inline int EVP_PKEY_base_id(const EVP_PKEY *pkey)
 {
@@ -167,6 +177,40 @@ X509 * ssl_ssl_cert_get(SSL *);
 #define HAVE_TLSV12
 #endif /* SSL_OP_NO_TLSv1_2 */
 
+/*
+ * SSL_OP_ENABLE_KTLS is available from OpenSSL 3.0; OPENSSL_NO_KTLS indicates
+ * that OpenSSL was built without kernel TLS support.
+ */
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+#define HAVE_KTLS
+#endif /* SSL_OP_ENABLE_KTLS && !OPENSSL_NO_KTLS */
+
+/*
+ * TLS 1.3 certificate compression (RFC 8879) is available from OpenSSL 3.2;
+ * OPENSSL_NO_COMP_ALG indicates that OpenSSL was built without it.
+ */
+#if (OPENSSL_VERSION_NUMBER >= 0x30200000L) && \
+    !defined(LIBRESSL_VERSION_NUMBER) && !defined(OPENSSL_NO_COMP_ALG)
+#define HAVE_CERTCOMP
+#endif /* OpenSSL >= 3.2 && !OPENSSL_NO_COMP_ALG */
+
+/*
+ * TLS 1.3 early data (0-RTT) is available from OpenSSL 1.1.1; the src side is
+ * read by driving the handshake manually like for SSL_MODE_ASYNC.
+ */
+#if (OPENSSL_VERSION_NUMBER >= 0x10101000L) && \
+    !defined(LIBRESSL_VERSION_NUMBER) && defined(SSL_MODE_ASYNC)
+#define HAVE_EARLYDATA
+#endif /* OpenSSL >= 1.1.1 && SSL_MODE_ASYNC */
+
+/*
+ * Separate OpenSSL library contexts, each with their own algorithm store and
+ * property cache, are available from OpenSSL 3.0.
+ */
+#if (OPENSSL_VERSION_NUMBER >= 0x30000000L) && !defined(LIBRESSL_VERSION_NUMBER)
+#define HAVE_LIBCTX
+#endif /* OpenSSL >= 3.0 */
+
 #ifdef HAVE_SSLV2
 #define SSL2_S "ssl2 "
 #else /* !HAVE_SSLV2 */
@@ -199,6 +243,18 @@ int ssl_init(void) WUNRES;
 int ssl_reinit(void) WUNRES;
 void ssl_fini(void);
 
+#define SSL_MD_MD5	0
+#define SSL_MD_SHA1	1
+#define SSL_MD_SHA224	2
+#define SSL_MD_SHA256	3
+#define SSL_MD_SHA384	4
+#define SSL_MD_SHA512	5
+#define SSL_MD_MAX	6
+const EVP_MD * ssl_md(int) WUNRES;
+#ifdef HAVE_LIBCTX
+OSSL_LIB_CTX * ssl_libctx_new(void) WUNRES;
+#endif /* HAVE_LIBCTX */
+
 #ifndef OPENSSL_NO_ENGINE
 int ssl_engine(const char *) WUNRES;
 #endif /* !OPENSSL_NO_ENGINE */
@@ -206,6 +262,10 @@ int ssl_engine(const char *) WUNRES;
 char * ssl_sha1_to_str(unsigned char *, int) NONNULL(1) MALLOC;
 
 char * ssl_ssl_state_to_str(SSL *) NONNULL(1) MALLOC;
+char * ssl_ciphers_chacha_first(const char *) NONNULL(1) MALLOC;
+/* length of a key log line including newline and NUL */
+#define SSL_MASTERKEY_STRSZ (14 + 2 * 32 + 1 + 2 * 48 + 2)
+size_t ssl_ssl_masterkey_to_buf(SSL *, char *) NONNULL(1,2);
 char * ssl_ssl_masterkey_to_str(SSL *) NONNULL(1) MALLOC;
 
 #ifndef OPENSSL_NO_DH
@@ -220,6 +280,9 @@ EC_KEY * ssl_ec_by_name(const char *) MALLOC;
 
 EVP_PKEY * ssl_key_load(const char *) NONNULL(1) MALLOC;
 EVP_PKEY * ssl_key_genrsa(const int) MALLOC;
+#ifndef OPENSSL_NO_EC
+EVP_PKEY * ssl_key_genec(const char *) MALLOC;
+#endif /* !OPENSSL_NO_EC */
 void ssl_key_refcount_inc(EVP_PKEY *) NONNULL(1);
 #define SSL_KEY_IDSZ 20
 int ssl_key_identifier_sha1(EVP_PKEY *, unsigned char *) NONNULL(1,2);
@@ -230,6 +293,12 @@ int ssl_x509_v3ext_add(X509V3_CTX *, X509 *, char *, char *) NONNULL(1,2,3,4);
 int ssl_x509_v3ext_copy_by_nid(X509 *, X509 *, int) NONNULL(1,2);
 #endif /* !OPENSSL_NO_TLSEXT */
 int ssl_x509_serial_copyrand(X509 *, X509 *) NONNULL(1,2);
+typedef struct ssl_x509_tmpl ssl_x509_tmpl_t;
+ssl_x509_tmpl_t * ssl_x509_tmpl_new(X509 *, EVP_PKEY *, EVP_PKEY *,
+                                    const char *) NONNULL(1,2,3) MALLOC;
+void ssl_x509_tmpl_free(ssl_x509_tmpl_t *) NONNULL(1);
+X509 * ssl_x509_forge_tmpl(const ssl_x509_tmpl_t *, X509 *, EVP_PKEY *,
+                           const char *) NONNULL(1,2) MALLOC;
 X509 * ssl_x509_forge(X509 *, EVP_PKEY *, X509 *, EVP_PKEY *,
                       const char *, const char *)
        NONNULL(1,2,3,4) MALLOC;
@@ -245,9 +314,21 @@ char * ssl_x509_names_to_str(X509 *) NONNULL(1) MALLOC;
 char ** ssl_x509_aias(X509 *, const int) NONNULL(1) MALLOC;
 char ** ssl_x509_ocsps(X509 *) NONNULL(1) MALLOC;
 int ssl_x509_is_valid(X509 *) NONNULL(1) WUNRES;
+time_t ssl_x509_expiry(X509 *) NONNULL(1) WUNRES;
 char * ssl_x509_to_str(X509 *) NONNULL(1) MALLOC;
 char * ssl_x509_to_pem(X509 *) NONNULL(1) MALLOC;
 void ssl_x509_refcount_inc(X509 *) NONNULL(1);
+int ssl_x509_leafkey_set(X509 *, EVP_PKEY *) NONNULL(1,2) WUNRES;
+EVP_PKEY * ssl_x509_leafkey_get(X509 *) NONNULL(1) WUNRES;
+typedef struct ssl_x509_memo {
+	unsigned char fpr[SSL_X509_FPRSZ];  /* SHA-1 of the certificate */
+	char *fprstr;                       /* fpr as hex without colons */
+	char *origfprstr;                   /* same for the original */
+	char *orignames;                    /* names of the original */
+} ssl_x509_memo_t;
+int ssl_x509_memo_set(X509 *, X509 *) NONNULL(1,2);
+const ssl_x509_memo_t * ssl_x509_memo_get(X509 *) NONNULL(1) WUNRES;
+void ssl_ctx_refcount_inc(SSL_CTX *) NONNULL(1);
 
 int ssl_x509chain_load(X509 **, STACK_OF(X509) **, const char *) NONNULL(2,3);
 int ssl_x509chain_use(SSL_CTX *, X509 *, STACK_OF(X509) *)
@@ -255,12 +336,61 @@ int ssl_x509chain_use(SSL_CTX *, X509 *, STACK_OF(X509) *)
 
 char * ssl_session_to_str(SSL_SESSION *) NONNULL(1) MALLOC;
 int ssl_session_is_valid(SSL_SESSION *) NONNULL(1);
+int ssl_session_is_single_use(SSL_SESSION *) NONNULL(1) WUNRES;
+void ssl_session_refcount_inc(SSL_SESSION *) NONNULL(1);
+size_t ssl_session_memsz(SSL_SESSION *) NONNULL(1) WUNRES;
 
 int ssl_is_ocspreq(const unsigned char *, size_t) NONNULL(1) WUNRES;
+int ssl_ocsp_response_new(X509 *, X509 *, EVP_PKEY *, long, unsigned char **)
+    NONNULL(1,2,3,5) WUNRES;
+
+/*
+ * Summary of a ClientHello message, filled by ssl_tls_clienthello_summary()
+ * in the same pass that finds the message.  Offsets are relative to the
+ * start of the ClientHello record and only valid as long as the buffer it
+ * was found in; all other fields are self-contained.
+ */
+#define SSL_CHELLO_GROUP_P256	0x01
+#define SSL_CHELLO_GROUP_P384	0x02
+#define SSL_CHELLO_GROUP_P521	0x04
+#define SSL_CHELLO_GROUP_X25519	0x08
+#define SSL_CHELLO_GROUP_X448	0x10
+typedef struct ssl_chello {
+	unsigned short version;    /* client_version of the ClientHello */
+	unsigned short maxversion;     /* highest supported_versions entry */
+	unsigned short sidoff;               /* session ID, if sidlen > 0 */
+	unsigned short alpnoff;   /* ALPN name list, wire format, if alpnlen */
+	unsigned short alpnlen;
+	unsigned char sidlen;
+	unsigned char groups;                /* SSL_CHELLO_GROUP_* offered */
+	unsigned int sslv2 : 1;             /* 1 if in an SSL 2.0 record */
+	unsigned int ecdsa : 1;    /* 1 if ECDSA server certs are usable */
+	unsigned int ticket : 1;        /* 1 if offering a session ticket */
+	unsigned int h2 : 1;                  /* 1 if ALPN offers h2 */
+	unsigned int chacha : 1;   /* 1 if ChaCha20-Poly1305 is preferred */
+	char ja3[33];     /* JA3 fingerprint as hex MD5, empty if unknown */
+} ssl_chello_t;
 
 int ssl_tls_clienthello_parse(const unsigned char *, ssize_t, int,
-                              const unsigned char **, char **)
+                              const unsigned char **, char **, int *)
     NONNULL(1,4) WUNRES;
+int ssl_tls_clienthello_summary(const unsigned char *, ssize_t, int,
+                                const unsigned char **, char **,
+                                ssl_chello_t *)
+    NONNULL(1,4,6) WUNRES;
+int ssl_tls_clienthello_sessionid(const unsigned char *, size_t,
+                                  const unsigned char **, size_t *)
+    NONNULL(1,3,4) WUNRES;
+int ssl_tls_clienthello_alpn(const unsigned char *, size_t,
+                             const unsigned char **, size_t *)
+    NONNULL(1,3,4) WUNRES;
+const unsigned char * ssl_alpn_find(const unsigned char *, size_t,
+                                    const unsigned char *, size_t)
+    NONNULL(1,3) WUNRES;
+int ssl_tls_clienthello_reassemble(const unsigned char *, size_t,
+                                   unsigned char **, size_t *)
+    NONNULL(1,3,4) WUNRES;
+BIO * ssl_bio_prefix_new(BIO *, unsigned char *, size_t) NONNULL(1) WUNRES;
 int ssl_dnsname_match(const char *, size_t, const char *, size_t)
     NONNULL(1,3) WUNRES;
 char * ssl_wildcardify(const char *) NONNULL(1) MALLOC;
@@ -27,12 +27,15 @@
  */
 
 #include "base64.h"
+#include "defaults.h"
 #include "ssl.h"
 
 #include <limits.h>
 #include <stdlib.h>
 #include <unistd.h>
 
+#include <openssl/ocsp.h>
+
 #include <check.h>
 
 #ifdef __APPLE__
@@ -44,6 +47,7 @@
 #define TESTKEY "extra/pki/server.key"
 #define TESTCERT "extra/pki/server.crt"
 #define TESTCERT2 "extra/pki/rsa.crt"
+#define TESTKEY2 "extra/pki/rsa.key"
 #define ENGINE "extra/engine/dummy-engine."DLSUFFIX
 
 static void
@@ -356,6 +360,16 @@ static unsigned char clienthello06[] =
 	"\x01\x01";
 	/* TLS 1.2, SNI extension with hostname "daniel.roe.ch" */
 
+static unsigned char clienthello07[] =
+	"\x16\x03\x01\x00\x55\x01\x00\x00\x51\x03\x03\x10\x11\x12\x13\x14"
+	"\x15\x16\x17\x18\x19\x1a\x1b\x1c\x1d\x1e\x1f\x20\x21\x22\x23\x24"
+	"\x25\x26\x27\x28\x29\x2a\x2b\x2c\x2d\x2e\x2f\x00\x00\x04\xc0\x2f"
+	"\x00\x2f\x01\x00\x00\x24\x00\x00\x00\x0e\x00\x0c\x00\x00\x09\x61"
+	"\x2e\x65\x78\x61\x6d\x70\x6c\x65\x00\x10\x00\x0e\x00\x0c\x02\x68"
+	"\x32\x08\x68\x74\x74\x70\x2f\x31\x2e\x31";
+	/* TLS 1.2, SNI extension with hostname "a.example",
+	 * ALPN extension with protocols "h2" and "http/1.1" */
+
 START_TEST(ssl_tls_clienthello_parse_00)
 {
 	int rv;
@@ -364,7 +378,7 @@ START_TEST(ssl_tls_clienthello_parse_00)
 
 	rv = ssl_tls_clienthello_parse(clienthello00,
 	                               sizeof(clienthello00) - 1,
-	                               0, &ch, &sni);
+	                               0, &ch, &sni, NULL);
 #ifdef HAVE_SSLV2
 	fail_unless(rv == 0, "rv not 0");
 	fail_unless(ch != NULL, "ch is NULL");
@@ -385,7 +399,7 @@ START_TEST(ssl_tls_clienthello_parse_01)
 
 	rv = ssl_tls_clienthello_parse(clienthello01,
 	                               sizeof(clienthello01) - 1,
-	                               0, &ch, &sni);
+	                               0, &ch, &sni, NULL);
 	fail_unless(rv == 0, "rv not 0");
 	fail_unless(ch != NULL, "ch is NULL");
 	fail_unless(sni == NULL, "sni not NULL");
@@ -400,7 +414,7 @@ START_TEST(ssl_tls_clienthello_parse_02)
 
 	rv = ssl_tls_clienthello_parse(clienthello02,
 	                                sizeof(clienthello02) - 1,
-	                                0, &ch, &sni);
+	                                0, &ch, &sni, NULL);
 	fail_unless(rv == 0, "rv not 0");
 	fail_unless(ch != NULL, "ch is NULL");
 	fail_unless(sni == NULL, "sni not NULL");
@@ -415,7 +429,7 @@ START_TEST(ssl_tls_clienthello_parse_03)
 
 	rv = ssl_tls_clienthello_parse(clienthello03,
 	                                sizeof(clienthello03) - 1,
-	                                0, &ch, &sni);
+	                                0, &ch, &sni, NULL);
 	fail_unless(rv == 0, "rv not 0");
 	fail_unless(ch != NULL, "ch is NULL");
 	fail_unless(sni && !strcmp(sni, "192.168.100.4"),
@@ -431,7 +445,7 @@ START_TEST(ssl_tls_clienthello_parse_04)
 
 	rv = ssl_tls_clienthello_parse(clienthello04,
 	                                sizeof(clienthello04) - 1,
-	                                0, &ch, &sni);
+	                                0, &ch, &sni, NULL);
 	fail_unless(rv == 0, "rv not 0");
 	fail_unless(ch != NULL, "ch is NULL");
 	fail_unless(sni && !strcmp(sni, "kamesh.com"),
@@ -448,7 +462,7 @@ START_TEST(ssl_tls_clienthello_parse_05)
 		ssize_t sz;
 
 		sz = (ssize_t)i;
-		rv = ssl_tls_clienthello_parse(clienthello04, sz, 0, &ch, &sni);
+		rv = ssl_tls_clienthello_parse(clienthello04, sz, 0, &ch, &sni, NULL);
 		fail_unless(rv == 1, "rv not 1");
 		fail_unless(ch != NULL, "ch is NULL");
 		fail_unless(sni == (void*)0xDEADBEEF, "sni modified");
@@ -464,7 +478,7 @@ START_TEST(ssl_tls_clienthello_parse_06)
 
 	rv = ssl_tls_clienthello_parse(clienthello05,
 	                                sizeof(clienthello05) - 1,
-	                                0, &ch, &sni);
+	                                0, &ch, &sni, NULL);
 	fail_unless(rv == 0, "rv not 0");
 	fail_unless(ch != NULL, "ch is NULL");
 	fail_unless(sni && !strcmp(sni, "daniel.roe.ch"),
@@ -481,7 +495,7 @@ START_TEST(ssl_tls_clienthello_parse_07)
 		ssize_t sz;
 
 		sz = (ssize_t)i;
-		rv = ssl_tls_clienthello_parse(clienthello05, sz, 0, &ch, &sni);
+		rv = ssl_tls_clienthello_parse(clienthello05, sz, 0, &ch, &sni, NULL);
 		fail_unless(rv == 1, "rv not 1");
 		fail_unless(ch != NULL, "ch is NULL");
 		fail_unless(sni == (void*)0xDEADBEEF, "sni modified");
@@ -497,7 +511,7 @@ START_TEST(ssl_tls_clienthello_parse_08)
 
 	rv = ssl_tls_clienthello_parse(clienthello06,
 	                                sizeof(clienthello06) - 1,
-	                                0, &ch, &sni);
+	                                0, &ch, &sni, NULL);
 	fail_unless(rv == 1, "rv not 1");
 	fail_unless(ch == NULL, "ch not NULL");
 	fail_unless(sni == (void*)0xDEADBEEF, "sni modified");
@@ -512,7 +526,7 @@ START_TEST(ssl_tls_clienthello_parse_09)
 
 	rv = ssl_tls_clienthello_parse(clienthello06,
 	                                sizeof(clienthello06) - 1,
-	                                1, &ch, &sni);
+	                                1, &ch, &sni, NULL);
 	fail_unless(rv == 0, "rv not 0");
 	fail_unless(ch != NULL, "ch is NULL");
 	fail_unless((ch - clienthello06) != 21, "ch does not point to start");
@@ -528,13 +542,445 @@ START_TEST(ssl_tls_clienthello_parse_10)
 
 	rv = ssl_tls_clienthello_parse(clienthello06,
 	                                sizeof(clienthello06) - 1,
-	                                1, &ch, NULL);
+	                                1, &ch, NULL, NULL);
 	fail_unless(rv == 0, "rv not 0");
 	fail_unless(ch != NULL, "ch is NULL");
 	fail_unless((ch - clienthello06) != 21, "ch does not point to start");
 }
 END_TEST
 
+START_TEST(ssl_tls_clienthello_parse_11)
+{
+	int rv;
+	const unsigned char *ch = NULL;
+	int ecdsa = -1;
+
+	rv = ssl_tls_clienthello_parse(clienthello05,
+	                                sizeof(clienthello05) - 1,
+	                                0, &ch, NULL, &ecdsa);
+	fail_unless(rv == 0, "rv not 0");
+	fail_unless(ecdsa == 1, "ECDSA not detected");
+}
+END_TEST
+
+START_TEST(ssl_tls_clienthello_parse_12)
+{
+	int rv;
+	const unsigned char *ch = NULL;
+	int ecdsa = -1;
+
+	rv = ssl_tls_clienthello_parse(clienthello04,
+	                                sizeof(clienthello04) - 1,
+	                                0, &ch, NULL, &ecdsa);
+	fail_unless(rv == 0, "rv not 0");
+	fail_unless(ecdsa == 0, "ECDSA detected without ECDSA suites");
+}
+END_TEST
+
+START_TEST(ssl_tls_clienthello_parse_13)
+{
+	int rv;
+	const unsigned char *ch = NULL;
+	int ecdsa = -1;
+
+	/* ECDSA suites without signature_algorithms extension */
+	rv = ssl_tls_clienthello_parse(clienthello03,
+	                                sizeof(clienthello03) - 1,
+	                                0, &ch, NULL, &ecdsa);
+	fail_unless(rv == 0, "rv not 0");
+	fail_unless(ecdsa == 1, "ECDSA not detected");
+}
+END_TEST
+
+START_TEST(ssl_tls_clienthello_sessionid_01)
+{
+	const unsigned char *id;
+	size_t idlen;
+	int rv;
+
+	rv = ssl_tls_clienthello_sessionid(clienthello02,
+	                                   sizeof(clienthello02) - 1,
+	                                   &id, &idlen);
+	fail_unless(rv == 0, "rv not 0");
+	fail_unless(idlen == 32, "wrong session ID length");
+	fail_unless(id == clienthello02 + 44, "wrong session ID");
+	rv = ssl_tls_clienthello_sessionid(clienthello02, 60, &id, &idlen);
+	fail_unless(rv == -1, "truncated session ID returned");
+}
+END_TEST
+
+START_TEST(ssl_tls_clienthello_sessionid_02)
+{
+	const unsigned char *id;
+	size_t idlen;
+
+	fail_unless(ssl_tls_clienthello_sessionid(clienthello04,
+	                                          sizeof(clienthello04) - 1,
+	                                          &id, &idlen) == -1,
+	            "empty session ID returned");
+	fail_unless(ssl_tls_clienthello_sessionid(clienthello00,
+	                                          sizeof(clienthello00) - 1,
+	                                          &id, &idlen) == -1,
+	            "session ID returned for SSL 2.0");
+}
+END_TEST
+
+START_TEST(ssl_tls_clienthello_alpn_01)
+{
+	const unsigned char *ch, *alpn;
+	size_t alpnlen;
+	char *sn;
+	int rv;
+
+	rv = ssl_tls_clienthello_parse(clienthello07,
+	                               sizeof(clienthello07) - 1,
+	                               0, &ch, &sn, NULL);
+	fail_unless(rv == 0, "rv not 0");
+	fail_unless(sn && !strcmp(sn, "a.example"), "wrong server name");
+	free(sn);
+	rv = ssl_tls_clienthello_alpn(clienthello07,
+	                              sizeof(clienthello07) - 1,
+	                              &alpn, &alpnlen);
+	fail_unless(rv == 0, "rv not 0");
+	fail_unless(alpnlen == 12, "wrong ALPN list length");
+	fail_unless(!memcmp(alpn, "\x02h2\x08http/1.1", 12),
+	            "wrong ALPN list");
+	rv = ssl_tls_clienthello_alpn(clienthello07,
+	                              sizeof(clienthello07) - 2,
+	                              &alpn, &alpnlen);
+	fail_unless(rv == -1, "truncated ALPN list returned");
+}
+END_TEST
+
+START_TEST(ssl_tls_clienthello_alpn_02)
+{
+	const unsigned char *alpn;
+	size_t alpnlen;
+
+	fail_unless(ssl_tls_clienthello_alpn(clienthello05,
+	                                     sizeof(clienthello05) - 1,
+	                                     &alpn, &alpnlen) == -1,
+	            "ALPN list returned without ALPN extension");
+	fail_unless(ssl_tls_clienthello_alpn(clienthello02,
+	                                     sizeof(clienthello02) - 1,
+	                                     &alpn, &alpnlen) == -1,
+	            "ALPN list returned without extensions");
+	fail_unless(ssl_tls_clienthello_alpn(clienthello00,
+	                                     sizeof(clienthello00) - 1,
+	                                     &alpn, &alpnlen) == -1,
+	            "ALPN list returned for SSL 2.0");
+}
+END_TEST
+
+START_TEST(ssl_tls_clienthello_summary_01)
+{
+	const unsigned char *ch;
+	ssl_chello_t sum;
+	char *sn;
+	int rv;
+
+	rv = ssl_tls_clienthello_summary(clienthello07,
+	                                 sizeof(clienthello07) - 1,
+	                                 0, &ch, &sn, &sum);
+	fail_unless(rv == 0, "rv not 0");
+	fail_unless(ch == clienthello07, "wrong ch");
+	fail_unless(sn && !strcmp(sn, "a.example"), "wrong server name");
+	free(sn);
+	fail_unless(sum.version == 0x0303, "wrong version");
+	fail_unless(sum.maxversion == 0x0303, "wrong max version");
+	fail_unless(!sum.sslv2, "SSL 2.0");
+	fail_unless(!sum.ecdsa, "ECDSA usable");
+	fail_unless(!sum.sidlen, "session ID found");
+	fail_unless(!sum.ticket, "session ticket found");
+	fail_unless(!sum.groups, "groups found");
+	fail_unless(sum.alpnlen == 12, "wrong ALPN list length");
+	fail_unless(!memcmp(ch + sum.alpnoff, "\x02h2\x08http/1.1", 12),
+	            "wrong ALPN list");
+	fail_unless(sum.h2, "h2 not found");
+	fail_unless(!strcmp(sum.ja3, "7eae0af172acf94539549e40fe3d5882"),
+	            "wrong JA3 fingerprint");
+}
+END_TEST
+
+START_TEST(ssl_tls_clienthello_summary_02)
+{
+	const unsigned char *ch;
+	ssl_chello_t sum;
+	char *sn;
+	int rv;
+
+	rv = ssl_tls_clienthello_summary(clienthello05,
+	                                 sizeof(clienthello05) - 1,
+	                                 0, &ch, &sn, &sum);
+	fail_unless(rv == 0, "rv not 0");
+	free(sn);
+	fail_unless(sum.ecdsa, "ECDSA not usable");
+	fail_unless(!sum.ticket, "empty session ticket found");
+	fail_unless(!sum.alpnlen && !sum.h2, "ALPN found");
+	fail_unless(sum.groups == (SSL_CHELLO_GROUP_P256 |
+	                           SSL_CHELLO_GROUP_P384 |
+	                           SSL_CHELLO_GROUP_P521), "wrong groups");
+	fail_unless(!strcmp(sum.ja3, "dbb53b9b21b5c1b543dde20bde00193c"),
+	            "wrong JA3 fingerprint");
+
+	rv = ssl_tls_clienthello_summary(clienthello02,
+	                                 sizeof(clienthello02) - 1,
+	                                 0, &ch, &sn, &sum);
+	fail_unless(rv == 0, "rv not 0");
+	fail_unless(sum.version == 0x0300, "wrong version");
+	fail_unless(sum.sidlen == 32 && sum.sidoff == 44,
+	            "wrong session ID");
+	fail_unless(!strcmp(sum.ja3, "081ce213243f802c8cc8fcfe683309de"),
+	            "wrong JA3 fingerprint");
+
+	rv = ssl_tls_clienthello_summary(clienthello07,
+	                                 sizeof(clienthello07) - 2,
+	                                 0, &ch, &sn, &sum);
+	fail_unless(rv == 1, "rv not 1");
+	fail_unless(!sum.version && !sum.alpnlen && !sum.ja3[0],
+	            "summary not zeroed");
+}
+END_TEST
+
+START_TEST(ssl_tls_clienthello_summary_03)
+{
+	unsigned char buf[sizeof(clienthello07)];
+	const unsigned char *ch;
+	ssl_chello_t sum;
+	char *sn;
+	int rv;
+
+	fail_unless(!memcmp(clienthello07 + 46, "\xc0\x2f\x00\x2f", 4),
+	                    "unexpected cipher suites");
+	rv = ssl_tls_clienthello_summary(clienthello07,
+	                                 sizeof(clienthello07) - 1,
+	                                 0, &ch, &sn, &sum);
+	fail_unless(rv == 0, "rv not 0");
+	free(sn);
+	fail_unless(!sum.chacha, "ChaCha20 preferred without offering it");
+
+	memcpy(buf, clienthello07, sizeof(buf));
+	memcpy(buf + 46, "\x0a\x0a\xcc\xa8", 4);
+	rv = ssl_tls_clienthello_summary(buf, sizeof(buf) - 1,
+	                                 0, &ch, &sn, &sum);
+	fail_unless(rv == 0, "rv not 0");
+	free(sn);
+	fail_unless(sum.chacha, "ChaCha20 after GREASE not preferred");
+
+	memcpy(buf + 46, "\x13\x03\x13\x01", 4);
+	rv = ssl_tls_clienthello_summary(buf, sizeof(buf) - 1,
+	                                 0, &ch, &sn, &sum);
+	fail_unless(rv == 0, "rv not 0");
+	free(sn);
+	fail_unless(sum.chacha, "TLS 1.3 ChaCha20 not preferred");
+
+	memcpy(buf + 46, "\x13\x01\x13\x03", 4);
+	rv = ssl_tls_clienthello_summary(buf, sizeof(buf) - 1,
+	                                 0, &ch, &sn, &sum);
+	fail_unless(rv == 0, "rv not 0");
+	free(sn);
+	fail_unless(!sum.chacha, "ChaCha20 preferred when offered second");
+}
+END_TEST
+
+START_TEST(ssl_ciphers_chacha_first_01)
+{
+	char *s;
+
+	s = ssl_ciphers_chacha_first("ECDHE-RSA-AES128-GCM-SHA256:"
+	                             "ECDHE-RSA-CHACHA20-POLY1305:"
+	                             "AES128-SHA");
+	fail_unless(!!s, "no cipher spec");
+	fail_unless(!strcmp(s, "ECDHE-RSA-CHACHA20-POLY1305:"
+	                       "ECDHE-RSA-AES128-GCM-SHA256:AES128-SHA"),
+	            "wrong cipher spec");
+	free(s);
+
+	s = ssl_ciphers_chacha_first(DFLT_CIPHERS);
+	fail_unless(!!s, "no cipher spec for default ciphers");
+	fail_unless(!!strstr(s, "CHACHA20") &&
+	            strstr(s, "CHACHA20") < strchr(s, ':'),
+	            "ChaCha20 not first");
+	fail_unless(!strstr(s, "TLS_"), "TLS 1.3 suites in cipher spec");
+	free(s);
+
+	fail_unless(!ssl_ciphers_chacha_first("AES128-SHA:!CHACHA20"),
+	            "cipher spec without ChaCha20");
+	fail_unless(!ssl_ciphers_chacha_first("NOSUCHCIPHER"),
+	            "invalid cipher spec");
+}
+END_TEST
+
+START_TEST(ssl_alpn_find_01)
+{
+	const unsigned char list[] = "\x02h2\x08http/1.1";
+	const unsigned char *p;
+
+	p = ssl_alpn_find(list, sizeof(list) - 1,
+	                  (const unsigned char *)"http/1.1", 8);
+	fail_unless(p == list + 3, "http/1.1 not found");
+	p = ssl_alpn_find(list, sizeof(list) - 1,
+	                  (const unsigned char *)"h2", 2);
+	fail_unless(p == list, "h2 not found");
+	p = ssl_alpn_find(list, sizeof(list) - 1,
+	                  (const unsigned char *)"h", 1);
+	fail_unless(!p, "prefix found");
+	p = ssl_alpn_find(list, sizeof(list) - 2,
+	                  (const unsigned char *)"http/1.1", 8);
+	fail_unless(!p, "truncated entry found");
+}
+END_TEST
+
+START_TEST(ssl_tls_clienthello_reassemble_01)
+{
+	unsigned char *rec;
+	size_t recsz;
+	int rv;
+
+	rv = ssl_tls_clienthello_reassemble(clienthello05,
+	                                    sizeof(clienthello05) - 1,
+	                                    &rec, &recsz);
+	fail_unless(rv == 0, "rv not 0");
+	fail_unless(!!rec, "record is NULL");
+	fail_unless(recsz == sizeof(clienthello05) - 1, "wrong record size");
+	fail_unless(!memcmp(rec, clienthello05, recsz), "record differs");
+	free(rec);
+}
+END_TEST
+
+/* clienthello05 with the handshake message split across two records */
+static unsigned char *
+ssl_tls_clienthello_split(size_t *sz)
+{
+	const size_t first = 100;
+	size_t len = sizeof(clienthello05) - 1 - 5;
+	unsigned char *buf;
+
+	buf = malloc(len + 10);
+	memcpy(buf, "\x16\x03\x03", 3);
+	buf[3] = first >> 8;
+	buf[4] = first & 0xFF;
+	memcpy(buf + 5, clienthello05 + 5, first);
+	memcpy(buf + 5 + first, "\x16\x03\x03", 3);
+	buf[8 + first] = (len - first) >> 8;
+	buf[9 + first] = (len - first) & 0xFF;
+	memcpy(buf + 10 + first, clienthello05 + 5 + first, len - first);
+	*sz = len + 10;
+	return buf;
+}
+
+START_TEST(ssl_tls_clienthello_reassemble_02)
+{
+	unsigned char *buf, *rec;
+	size_t sz, recsz;
+	const unsigned char *ch;
+	char *sni;
+	int rv;
+
+	buf = ssl_tls_clienthello_split(&sz);
+	rv = ssl_tls_clienthello_reassemble(buf, sz, &rec, &recsz);
+	fail_unless(rv == 0, "rv not 0");
+	fail_unless(!!rec, "record is NULL");
+	fail_unless(recsz == sizeof(clienthello05) - 1, "wrong record size");
+	fail_unless(!memcmp(rec, clienthello05, recsz), "record differs");
+	rv = ssl_tls_clienthello_parse(rec, recsz, 0, &ch, &sni, NULL);
+	fail_unless(rv == 0, "parse rv not 0");
+	fail_unless(sni && !strcmp(sni, "daniel.roe.ch"), "wrong sni");
+	free(sni);
+	free(rec);
+	free(buf);
+}
+END_TEST
+
+START_TEST(ssl_tls_clienthello_reassemble_03)
+{
+	unsigned char *buf, *rec;
+	size_t sz, recsz;
+	int rv;
+
+	buf = ssl_tls_clienthello_split(&sz);
+	for (size_t i = 0; i < sz; i++) {
+		rv = ssl_tls_clienthello_reassemble(buf, i, &rec, &recsz);
+		fail_unless(rv == 1, "rv not 1");
+		fail_unless(rec == NULL, "record not NULL");
+	}
+	free(buf);
+}
+END_TEST
+
+START_TEST(ssl_tls_clienthello_reassemble_04)
+{
+	unsigned char buf[] = "GET / HTTP/1.1\r\nHost: daniel.roe.ch\r\n";
+	unsigned char *rec;
+	size_t recsz;
+	int rv;
+
+	rv = ssl_tls_clienthello_reassemble(buf, sizeof(buf) - 1,
+	                                    &rec, &recsz);
+	fail_unless(rv == -1, "rv not -1");
+	fail_unless(rec == NULL, "record not NULL");
+}
+END_TEST
+
+START_TEST(ssl_bio_prefix_new_01)
+{
+	BIO *mbio, *bio;
+	unsigned char *pfx;
+	char buf[32];
+	int n, rv;
+
+	mbio = BIO_new(BIO_s_mem());
+	fail_unless(!!mbio, "no mem BIO");
+	BIO_write(mbio, "world", 5);
+	pfx = malloc(6);
+	memcpy(pfx, "hello ", 6);
+	bio = ssl_bio_prefix_new(mbio, pfx, 6);
+	fail_unless(!!bio, "no prefix BIO");
+	fail_unless(BIO_ctrl_pending(bio) == 11, "wrong pending");
+	n = 0;
+	while ((rv = BIO_read(bio, buf + n, 4)) > 0)
+		n += rv;
+	fail_unless(n == 11, "wrong length read");
+	fail_unless(!memcmp(buf, "hello world", 11), "wrong data read");
+	BIO_free_all(bio);
+}
+END_TEST
+
+START_TEST(ssl_md_01)
+{
+	static const int sizes[SSL_MD_MAX] = {16, 20, 28, 32, 48, 64};
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned char ref[EVP_MAX_MD_SIZE];
+	unsigned int len, reflen;
+
+	fail_unless(!!EVP_Digest("abc", 3, ref, &reflen, EVP_sha256(), NULL),
+	            "reference digest failed");
+	fail_unless(!!EVP_Digest("abc", 3, md, &len, ssl_md(SSL_MD_SHA256),
+	                         NULL), "digest failed");
+	fail_unless(len == reflen && !memcmp(md, ref, len), "digest mismatch");
+	for (int i = 0; i < SSL_MD_MAX; i++) {
+		fail_unless(!!ssl_md(i), "no digest");
+		fail_unless(EVP_MD_size(ssl_md(i)) == sizes[i],
+		            "wrong digest");
+	}
+}
+END_TEST
+
+#ifdef HAVE_LIBCTX
+START_TEST(ssl_libctx_new_01)
+{
+	OSSL_LIB_CTX *libctx;
+	SSL_CTX *sslctx;
+
+	libctx = ssl_libctx_new();
+	fail_unless(!!libctx, "ssl_libctx_new() failed");
+	sslctx = SSL_CTX_new_ex(libctx, NULL, TLS_method());
+	fail_unless(!!sslctx, "SSL_CTX_new_ex() failed");
+	SSL_CTX_free(sslctx);
+}
+END_TEST
+#endif /* HAVE_LIBCTX */
+
 START_TEST(ssl_key_identifier_sha1_01)
 {
 	X509 *c;
@@ -705,6 +1151,58 @@ START_TEST(ssl_is_ocspreq_01)
 }
 END_TEST
 
+START_TEST(ssl_ocsp_response_new_01)
+{
+	X509 *cacrt, *crt, *fkcrt;
+	EVP_PKEY *cakey, *key;
+	OCSP_RESPONSE *resp;
+	OCSP_BASICRESP *bs;
+	OCSP_CERTID *id;
+	STACK_OF(X509) *certs;
+	const unsigned char *p;
+	unsigned char *der;
+	int sz, status;
+
+	cacrt = ssl_x509_load(TESTCERT2);
+	cakey = ssl_key_load(TESTKEY2);
+	crt = ssl_x509_load(TESTCERT);
+	key = ssl_key_load(TESTKEY);
+	fail_unless(cacrt && cakey && crt && key, "loading failed");
+	fkcrt = ssl_x509_forge(cacrt, cakey, crt, key, NULL, NULL);
+	fail_unless(!!fkcrt, "forging failed");
+
+	sz = ssl_ocsp_response_new(fkcrt, cacrt, cakey, 3600, &der);
+	fail_unless(sz > 0, "creating response failed");
+	p = der;
+	resp = d2i_OCSP_RESPONSE(NULL, &p, sz);
+	fail_unless(!!resp, "parsing response failed");
+	fail_unless(OCSP_response_status(resp) ==
+	            OCSP_RESPONSE_STATUS_SUCCESSFUL, "not successful");
+	bs = OCSP_response_get1_basic(resp);
+	fail_unless(!!bs, "no basic response");
+	certs = sk_X509_new_null();
+	sk_X509_push(certs, cacrt);
+	fail_unless(OCSP_basic_verify(bs, certs, NULL,
+	                              OCSP_TRUSTOTHER | OCSP_NOVERIFY) == 1,
+	            "signature does not verify");
+	id = OCSP_cert_to_id(NULL, fkcrt, cacrt);
+	fail_unless(OCSP_resp_find_status(bs, id, &status, NULL, NULL, NULL,
+	                                  NULL) == 1, "certificate not found");
+	fail_unless(status == V_OCSP_CERTSTATUS_GOOD, "status not good");
+
+	OCSP_CERTID_free(id);
+	sk_X509_free(certs);
+	OCSP_BASICRESP_free(bs);
+	OCSP_RESPONSE_free(resp);
+	OPENSSL_free(der);
+	X509_free(fkcrt);
+	X509_free(crt);
+	X509_free(cacrt);
+	EVP_PKEY_free(key);
+	EVP_PKEY_free(cakey);
+}
+END_TEST
+
 START_TEST(ssl_features_01)
 {
 	long vdiff = ((OPENSSL_VERSION_NUMBER ^ SSLeay()) & 0xfffff000L);
@@ -757,6 +1255,78 @@ START_TEST(ssl_x509_refcount_inc_01)
 }
 END_TEST
 
+START_TEST(ssl_x509_leafkey_01)
+{
+	EVP_PKEY *key;
+	X509 *crt;
+
+	crt = ssl_x509_load(TESTCERT);
+	fail_unless(!!crt, "loading certificate failed");
+	key = ssl_key_load(TESTKEY);
+	fail_unless(!!key, "loading key failed");
+	fail_unless(ssl_x509_leafkey_get(crt) == NULL, "key attached");
+	fail_unless(ssl_x509_leafkey_set(crt, key) == 0, "attaching failed");
+	fail_unless(ssl_x509_leafkey_get(crt) == key, "wrong key attached");
+	EVP_PKEY_free(key);
+	/* the certificate still holds a reference to the key */
+	fail_unless(X509_check_private_key(crt, ssl_x509_leafkey_get(crt)),
+	            "attached key does not match");
+	X509_free(crt);
+}
+END_TEST
+
+START_TEST(ssl_x509_tmpl_01)
+{
+	ssl_x509_tmpl_t *tmpl;
+	X509 *cacrt, *crt, *fkcrt1, *fkcrt2;
+	EVP_PKEY *cakey, *key, *eckey;
+	ASN1_OCTET_STRING *skid;
+	unsigned char keyid[SSL_KEY_IDSZ];
+
+	cacrt = ssl_x509_load(TESTCERT2);
+	cakey = ssl_key_load(TESTKEY2);
+	crt = ssl_x509_load(TESTCERT);
+	key = ssl_key_load(TESTKEY);
+	eckey = ssl_key_genec(NULL);
+	fail_unless(cacrt && cakey && crt && key && eckey, "loading failed");
+	tmpl = ssl_x509_tmpl_new(cacrt, cakey, key, "http://example.org/crl");
+	fail_unless(!!tmpl, "creating template failed");
+
+	fkcrt1 = ssl_x509_forge_tmpl(tmpl, crt, NULL, NULL);
+	fail_unless(!!fkcrt1, "forging with template key failed");
+	fail_unless(X509_verify(fkcrt1, cakey) == 1, "not signed by CA");
+	fail_unless(X509_check_private_key(fkcrt1, key), "wrong key");
+	fail_unless(X509_get_ext_by_NID(fkcrt1, NID_crl_distribution_points,
+	                                -1) != -1, "no CRL distribution point");
+
+	fkcrt2 = ssl_x509_forge_tmpl(tmpl, crt, eckey, "example.org");
+	fail_unless(!!fkcrt2, "forging with other key failed");
+	fail_unless(X509_verify(fkcrt2, cakey) == 1, "not signed by CA");
+	fail_unless(X509_check_private_key(fkcrt2, eckey), "wrong key");
+	skid = X509_get_ext_d2i(fkcrt2, NID_subject_key_identifier, NULL,
+	                        NULL);
+	fail_unless(!!skid, "no subjectKeyIdentifier");
+	fail_unless(ssl_key_identifier_sha1(eckey, keyid) == 0, "no keyid");
+	fail_unless(ASN1_STRING_length(skid) == SSL_KEY_IDSZ &&
+	            !memcmp(ASN1_STRING_get0_data(skid), keyid, SSL_KEY_IDSZ),
+	            "subjectKeyIdentifier not of other key");
+	fail_unless(X509_get_key_usage(fkcrt2) & KU_KEY_AGREEMENT,
+	            "keyUsage not for other key");
+	fail_unless(X509_check_host(fkcrt2, "example.org", 0, 0, NULL) == 1,
+	            "extraname not added");
+
+	ASN1_OCTET_STRING_free(skid);
+	X509_free(fkcrt2);
+	X509_free(fkcrt1);
+	ssl_x509_tmpl_free(tmpl);
+	EVP_PKEY_free(eckey);
+	EVP_PKEY_free(key);
+	X509_free(crt);
+	EVP_PKEY_free(cakey);
+	X509_free(cacrt);
+}
+END_TEST
+
 #ifndef OPENSSL_NO_ENGINE
 START_TEST(ssl_engine_01)
 {
@@ -820,8 +1390,53 @@ ssl_suite(void)
 	tcase_add_test(tc, ssl_tls_clienthello_parse_08);
 	tcase_add_test(tc, ssl_tls_clienthello_parse_09);
 	tcase_add_test(tc, ssl_tls_clienthello_parse_10);
+	tcase_add_test(tc, ssl_tls_clienthello_parse_11);
+	tcase_add_test(tc, ssl_tls_clienthello_parse_12);
+	tcase_add_test(tc, ssl_tls_clienthello_parse_13);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("ssl_tls_clienthello_sessionid");
+	tcase_add_checked_fixture(tc, ssl_setup, ssl_teardown);
+	tcase_add_test(tc, ssl_tls_clienthello_sessionid_01);
+	tcase_add_test(tc, ssl_tls_clienthello_sessionid_02);
 	suite_add_tcase(s, tc);
 
+	tc = tcase_create("ssl_tls_clienthello_alpn");
+	tcase_add_checked_fixture(tc, ssl_setup, ssl_teardown);
+	tcase_add_test(tc, ssl_tls_clienthello_alpn_01);
+	tcase_add_test(tc, ssl_tls_clienthello_alpn_02);
+	tcase_add_test(tc, ssl_tls_clienthello_summary_01);
+	tcase_add_test(tc, ssl_tls_clienthello_summary_02);
+	tcase_add_test(tc, ssl_tls_clienthello_summary_03);
+	tcase_add_test(tc, ssl_ciphers_chacha_first_01);
+	tcase_add_test(tc, ssl_alpn_find_01);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("ssl_tls_clienthello_reassemble");
+	tcase_add_checked_fixture(tc, ssl_setup, ssl_teardown);
+	tcase_add_test(tc, ssl_tls_clienthello_reassemble_01);
+	tcase_add_test(tc, ssl_tls_clienthello_reassemble_02);
+	tcase_add_test(tc, ssl_tls_clienthello_reassemble_03);
+	tcase_add_test(tc, ssl_tls_clienthello_reassemble_04);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("ssl_bio_prefix_new");
+	tcase_add_checked_fixture(tc, ssl_setup, ssl_teardown);
+	tcase_add_test(tc, ssl_bio_prefix_new_01);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("ssl_md");
+	tcase_add_checked_fixture(tc, ssl_setup, ssl_teardown);
+	tcase_add_test(tc, ssl_md_01);
+	suite_add_tcase(s, tc);
+
+#ifdef HAVE_LIBCTX
+	tc = tcase_create("ssl_libctx_new");
+	tcase_add_checked_fixture(tc, ssl_setup, ssl_teardown);
+	tcase_add_test(tc, ssl_libctx_new_01);
+	suite_add_tcase(s, tc);
+#endif /* HAVE_LIBCTX */
+
 	tc = tcase_create("ssl_key_identifier_sha1");
 	tcase_add_checked_fixture(tc, ssl_setup, ssl_teardown);
 	tcase_add_test(tc, ssl_key_identifier_sha1_01);
@@ -859,6 +1474,11 @@ ssl_suite(void)
 	tcase_add_test(tc, ssl_is_ocspreq_01);
 	suite_add_tcase(s, tc);
 
+	tc = tcase_create("ssl_ocsp_response_new");
+	tcase_add_checked_fixture(tc, ssl_setup, ssl_teardown);
+	tcase_add_test(tc, ssl_ocsp_response_new_01);
+	suite_add_tcase(s, tc);
+
 	tc = tcase_create("ssl_features");
 	tcase_add_checked_fixture(tc, ssl_setup, ssl_teardown);
 	tcase_add_test(tc, ssl_features_01);
@@ -875,6 +1495,16 @@ ssl_suite(void)
 	tcase_add_test(tc, ssl_x509_refcount_inc_01);
 	suite_add_tcase(s, tc);
 
+	tc = tcase_create("ssl_x509_leafkey");
+	tcase_add_checked_fixture(tc, ssl_setup, ssl_teardown);
+	tcase_add_test(tc, ssl_x509_leafkey_01);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("ssl_x509_tmpl");
+	tcase_add_checked_fixture(tc, ssl_setup, ssl_teardown);
+	tcase_add_test(tc, ssl_x509_tmpl_01);
+	suite_add_tcase(s, tc);
+
 #ifndef OPENSSL_NO_ENGINE
 	tc = tcase_create("ssl_engine");
 	tcase_add_checked_fixture(tc, ssl_setup, ssl_teardown);
@@ -0,0 +1,351 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "sslticket.h"
+
+#include "log.h"
+#include "ssl.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#if (OPENSSL_VERSION_NUMBER >= 0x30000000L) && !defined(LIBRESSL_VERSION_NUMBER)
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#endif /* OPENSSL_VERSION_NUMBER >= 0x30000000L */
+
+/*
+ * Stateless TLS session tickets for client-facing connections.
+ *
+ * All SSL_CTX instances share one set of ticket keys, protected by a
+ * read-write lock, such that tickets issued on any worker thread can be
+ * used for resumption on any other.  Keys are either generated randomly
+ * and rotated by sslticket_rotate(), or loaded from a key file which is
+ * re-read on rotation, allowing several instances to share keys.  Worker
+ * processes share the keys through shared memory, see sslticket_share().
+ */
+
+typedef struct sslticket_key {
+	unsigned char name[SSLTICKET_NAMESZ];
+	unsigned char hmac[SSLTICKET_SECRETSZ];
+	unsigned char aes[SSLTICKET_SECRETSZ];
+} sslticket_key_t;
+
+typedef struct sslticket_state {
+	pthread_rwlock_t lock;
+	sslticket_key_t key[SSLTICKET_MAXKEYS];
+	int nkeys;
+} sslticket_state_t;
+
+static sslticket_state_t sslticket_local = {
+	.lock = PTHREAD_RWLOCK_INITIALIZER
+};
+static sslticket_state_t *sslticket = &sslticket_local;
+static char *sslticket_keyfile;
+
+/*
+ * Load keys from the key file into keys.
+ * Returns the number of keys loaded, or -1 on errors.
+ */
+static int
+sslticket_load(sslticket_key_t *keys)
+{
+	unsigned char buf[SSLTICKET_FILEKEYSZ];
+	FILE *f;
+	size_t n;
+	int i;
+
+	if (!(f = fopen(sslticket_keyfile, "r"))) {
+		log_err_printf("Failed to open session ticket key file "
+		               "'%s'\n", sslticket_keyfile);
+		return -1;
+	}
+	for (i = 0; i < SSLTICKET_MAXKEYS; i++) {
+		n = fread(buf, 1, sizeof(buf), f);
+		if (n == 0)
+			break;
+		if (n != sizeof(buf))
+			goto leave;
+		memcpy(keys[i].name, buf, SSLTICKET_NAMESZ);
+		memcpy(keys[i].hmac, buf + SSLTICKET_NAMESZ,
+		       SSLTICKET_SECRETSZ);
+		memcpy(keys[i].aes, buf + SSLTICKET_NAMESZ + SSLTICKET_SECRETSZ,
+		       SSLTICKET_SECRETSZ);
+	}
+	if (i == 0 || fread(buf, 1, 1, f) != 0)
+		goto leave;
+	OPENSSL_cleanse(buf, sizeof(buf));
+	fclose(f);
+	return i;
+
+leave:
+	OPENSSL_cleanse(buf, sizeof(buf));
+	fclose(f);
+	log_err_printf("Invalid session ticket key file '%s': must contain "
+	               "1-%d keys of %d bytes each\n", sslticket_keyfile,
+	               SSLTICKET_MAXKEYS, SSLTICKET_FILEKEYSZ);
+	return -1;
+}
+
+/*
+ * Generate a new random key.
+ * Returns -1 on errors, 0 on success.
+ */
+static int
+sslticket_generate(sslticket_key_t *key)
+{
+	if (RAND_bytes(key->name, sizeof(key->name)) != 1 ||
+	    RAND_bytes(key->hmac, sizeof(key->hmac)) != 1 ||
+	    RAND_bytes(key->aes, sizeof(key->aes)) != 1) {
+		log_err_printf("Failed to generate session ticket key\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Initialize the shared ticket keys, either from keyfile if not NULL, or
+ * with a single random key.  Not thread-safe.
+ * Returns -1 on errors, 0 on success.
+ */
+int
+sslticket_init(const char *keyfile)
+{
+	if (keyfile) {
+		if (!(sslticket_keyfile = strdup(keyfile)))
+			return -1;
+	}
+	return sslticket_rotate();
+}
+
+/*
+ * Rotate the shared ticket keys.  Re-reads the key file if configured;
+ * otherwise generates a new key for issuing tickets and keeps previous keys
+ * for resumption until they fall off the end of the list.  On errors, the
+ * previous keys remain in use.
+ * Returns -1 on errors, 0 on success.
+ */
+int
+sslticket_rotate(void)
+{
+	sslticket_key_t keys[SSLTICKET_MAXKEYS];
+	int n;
+
+	if (sslticket_keyfile) {
+		if ((n = sslticket_load(keys)) == -1)
+			return -1;
+	} else {
+		if (sslticket_generate(&keys[0]) == -1)
+			return -1;
+		pthread_rwlock_rdlock(&sslticket->lock);
+		n = sslticket->nkeys < SSLTICKET_MAXKEYS ? sslticket->nkeys + 1
+		                                        : SSLTICKET_MAXKEYS;
+		memcpy(&keys[1], &sslticket->key[0],
+		       (n - 1) * sizeof(sslticket_key_t));
+		pthread_rwlock_unlock(&sslticket->lock);
+	}
+
+	pthread_rwlock_wrlock(&sslticket->lock);
+	memcpy(sslticket->key, keys, n * sizeof(sslticket_key_t));
+	sslticket->nkeys = n;
+	pthread_rwlock_unlock(&sslticket->lock);
+	OPENSSL_cleanse(keys, sizeof(keys));
+	return 0;
+}
+
+/*
+ * Move the ticket keys into shared memory, such that all worker processes
+ * forked afterwards share one set of keys and see each others' rotations.
+ * Must be called after sslticket_init() and before forking.
+ * Returns -1 on errors, 0 on success.
+ */
+int
+sslticket_share(void)
+{
+	pthread_rwlockattr_t attr;
+	sslticket_state_t *st;
+
+	st = mmap(NULL, sizeof(*st), PROT_READ|PROT_WRITE,
+	          MAP_SHARED|MAP_ANON, -1, 0);
+	if (st == MAP_FAILED)
+		return -1;
+	if (pthread_rwlockattr_init(&attr) != 0)
+		goto errout;
+	if (pthread_rwlockattr_setpshared(&attr,
+	                                  PTHREAD_PROCESS_SHARED) != 0 ||
+	    pthread_rwlock_init(&st->lock, &attr) != 0) {
+		pthread_rwlockattr_destroy(&attr);
+		goto errout;
+	}
+	pthread_rwlockattr_destroy(&attr);
+	memcpy(st->key, sslticket_local.key, sizeof(st->key));
+	st->nkeys = sslticket_local.nkeys;
+	OPENSSL_cleanse(sslticket_local.key, sizeof(sslticket_local.key));
+	sslticket_local.nkeys = 0;
+	sslticket = st;
+	return 0;
+
+errout:
+	munmap(st, sizeof(*st));
+	return -1;
+}
+
+/*
+ * Wipe the shared ticket keys.
+ */
+void
+sslticket_fini(void)
+{
+	pthread_rwlock_wrlock(&sslticket->lock);
+	OPENSSL_cleanse(sslticket->key, sizeof(sslticket->key));
+	sslticket->nkeys = 0;
+	pthread_rwlock_unlock(&sslticket->lock);
+	if (sslticket != &sslticket_local) {
+		pthread_rwlock_destroy(&sslticket->lock);
+		munmap(sslticket, sizeof(*sslticket));
+		sslticket = &sslticket_local;
+	}
+	if (sslticket_keyfile) {
+		free(sslticket_keyfile);
+		sslticket_keyfile = NULL;
+	}
+}
+
+/*
+ * Returns the number of ticket keys currently in use.
+ */
+int
+sslticket_keys(void)
+{
+	int n;
+
+	pthread_rwlock_rdlock(&sslticket->lock);
+	n = sslticket->nkeys;
+	pthread_rwlock_unlock(&sslticket->lock);
+	return n;
+}
+
+/*
+ * The ticket key callback gets an EVP_MAC_CTX on OpenSSL 3.0 and later,
+ * where the HMAC_CTX based one is deprecated.
+ */
+#if (OPENSSL_VERSION_NUMBER >= 0x30000000L) && !defined(LIBRESSL_VERSION_NUMBER)
+typedef EVP_MAC_CTX sslticket_mac_ctx_t;
+
+static int
+sslticket_mac_init(sslticket_mac_ctx_t *hctx, sslticket_key_t *key)
+{
+	OSSL_PARAM params[3];
+
+	params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+	                                              key->hmac,
+	                                              SSLTICKET_SECRETSZ);
+	params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+	                                             "SHA256", 0);
+	params[2] = OSSL_PARAM_construct_end();
+	return EVP_MAC_CTX_set_params(hctx, params);
+}
+#else /* OPENSSL_VERSION_NUMBER < 0x30000000L */
+typedef HMAC_CTX sslticket_mac_ctx_t;
+
+static int
+sslticket_mac_init(sslticket_mac_ctx_t *hctx, sslticket_key_t *key)
+{
+	return HMAC_Init_ex(hctx, key->hmac, SSLTICKET_SECRETSZ,
+	                    ssl_md(SSL_MD_SHA256), NULL);
+}
+#endif /* OPENSSL_VERSION_NUMBER < 0x30000000L */
+
+/*
+ * Called by OpenSSL to set up encryption of a new ticket (enc == 1) or
+ * decryption of a ticket presented by the client (enc == 0).
+ * Returns 1 on success, 2 if the ticket was decrypted with an older key and
+ * should be renewed, 0 if the key is unknown and -1 on errors.
+ */
+static int
+sslticket_cb(UNUSED SSL *ssl, unsigned char *name, unsigned char *iv,
+             EVP_CIPHER_CTX *ectx, sslticket_mac_ctx_t *hctx, int enc)
+{
+	sslticket_key_t *key;
+	int i, rv = -1;
+
+	pthread_rwlock_rdlock(&sslticket->lock);
+	if (enc) {
+		if (sslticket->nkeys == 0)
+			goto out;
+		key = &sslticket->key[0];
+		if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1)
+			goto out;
+		memcpy(name, key->name, SSLTICKET_NAMESZ);
+		if (EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), NULL,
+		                       key->aes, iv) != 1)
+			goto out;
+		i = 0;
+	} else {
+		for (i = 0; i < sslticket->nkeys; i++) {
+			if (!memcmp(name, sslticket->key[i].name,
+			            SSLTICKET_NAMESZ))
+				break;
+		}
+		if (i == sslticket->nkeys) {
+			rv = 0;
+			goto out;
+		}
+		key = &sslticket->key[i];
+		if (EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), NULL,
+		                       key->aes, iv) != 1)
+			goto out;
+	}
+	if (sslticket_mac_init(hctx, key) != 1)
+		goto out;
+	rv = (i == 0) ? 1 : 2;
+out:
+	pthread_rwlock_unlock(&sslticket->lock);
+	return rv;
+}
+
+/*
+ * Enable session tickets using the shared keys on a server SSL_CTX.
+ */
+void
+sslticket_sslctx_setup(SSL_CTX *sslctx)
+{
+	SSL_CTX_clear_options(sslctx, SSL_OP_NO_TICKET);
+#if (OPENSSL_VERSION_NUMBER >= 0x30000000L) && !defined(LIBRESSL_VERSION_NUMBER)
+	SSL_CTX_set_tlsext_ticket_key_evp_cb(sslctx, sslticket_cb);
+#else /* OPENSSL_VERSION_NUMBER < 0x30000000L */
+	SSL_CTX_set_tlsext_ticket_key_cb(sslctx, sslticket_cb);
+#endif /* OPENSSL_VERSION_NUMBER < 0x30000000L */
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,55 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef SSLTICKET_H
+#define SSLTICKET_H
+
+#include "attrib.h"
+
+#include <openssl/ssl.h>
+
+/*
+ * Session ticket key file format: one or more concatenated 80 byte keys,
+ * each consisting of a 16 byte key name, a 32 byte HMAC secret and a 32 byte
+ * AES secret.  The first key is used for issuing new tickets, all keys are
+ * accepted for resumption.  Compatible with nginx 80 byte ticket key files.
+ */
+#define SSLTICKET_NAMESZ	16
+#define SSLTICKET_SECRETSZ	32
+#define SSLTICKET_FILEKEYSZ	(SSLTICKET_NAMESZ + 2 * SSLTICKET_SECRETSZ)
+#define SSLTICKET_MAXKEYS	4
+
+int sslticket_init(const char *) WUNRES;
+int sslticket_rotate(void) WUNRES;
+int sslticket_share(void) WUNRES;
+void sslticket_fini(void);
+int sslticket_keys(void) WUNRES;
+void sslticket_sslctx_setup(SSL_CTX *) NONNULL(1);
+
+#endif /* !SSLTICKET_H */
+
+/* vim: set noet ft=c: */
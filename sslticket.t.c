@@ -0,0 +1,238 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "sslticket.h"
+#include "ssl.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <openssl/rand.h>
+
+#include <check.h>
+
+#define TESTCERT "extra/pki/rsa.crt"
+#define TESTKEY "extra/pki/rsa.key"
+#define TMP_KEY_FILE "/tmp/sslsplit-ticket-test.key"
+
+static void
+sslticket_setup(void)
+{
+	if (ssl_init() == -1)
+		exit(EXIT_FAILURE);
+}
+
+static void
+sslticket_teardown(void)
+{
+	sslticket_fini();
+	unlink(TMP_KEY_FILE);
+	ssl_fini();
+}
+
+static int
+write_keyfile(size_t sz)
+{
+	unsigned char buf[SSLTICKET_MAXKEYS * SSLTICKET_FILEKEYSZ + 1];
+	FILE *f;
+
+	if (sz > sizeof(buf) || RAND_bytes(buf, sz) != 1)
+		return -1;
+	if (!(f = fopen(TMP_KEY_FILE, "w")))
+		return -1;
+	if (fwrite(buf, 1, sz, f) != sz) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	return 0;
+}
+
+static SSL_CTX *
+server_ctx_new(void)
+{
+	SSL_CTX *sslctx;
+
+	sslctx = SSL_CTX_new(SSLv23_server_method());
+	if (!sslctx)
+		return NULL;
+	if (SSL_CTX_use_certificate_file(sslctx, TESTCERT,
+	                                 SSL_FILETYPE_PEM) != 1 ||
+	    SSL_CTX_use_PrivateKey_file(sslctx, TESTKEY,
+	                                SSL_FILETYPE_PEM) != 1) {
+		SSL_CTX_free(sslctx);
+		return NULL;
+	}
+#if (OPENSSL_VERSION_NUMBER >= 0x10100000L) && !defined(LIBRESSL_VERSION_NUMBER)
+	SSL_CTX_set_max_proto_version(sslctx, TLS1_2_VERSION);
+#endif /* OPENSSL_VERSION_NUMBER >= 0x10100000L */
+	/* only allow resumption by ticket */
+	SSL_CTX_set_session_cache_mode(sslctx, SSL_SESS_CACHE_OFF);
+	sslticket_sslctx_setup(sslctx);
+	return sslctx;
+}
+
+/*
+ * Run a full handshake between a client and a server over a BIO pair,
+ * attempting to resume sess if not NULL.  Returns the new client session and
+ * sets *reused, or returns NULL if the handshake failed.
+ */
+static SSL_SESSION *
+handshake(SSL_CTX *sctx, SSL_CTX *cctx, SSL_SESSION *sess, int *reused)
+{
+	SSL_SESSION *newsess = NULL;
+	SSL *s, *c;
+	BIO *sbio, *cbio;
+	int rs = 0, rc = 0;
+
+	s = SSL_new(sctx);
+	c = SSL_new(cctx);
+	if (!s || !c || !BIO_new_bio_pair(&sbio, 0, &cbio, 0))
+		goto out;
+	SSL_set_bio(s, sbio, sbio);
+	SSL_set_bio(c, cbio, cbio);
+	SSL_set_accept_state(s);
+	SSL_set_connect_state(c);
+	if (sess)
+		SSL_set_session(c, sess);
+	for (int i = 0; i < 100 && (rs != 1 || rc != 1); i++) {
+		if (rc != 1)
+			rc = SSL_do_handshake(c);
+		if (rs != 1)
+			rs = SSL_do_handshake(s);
+	}
+	if (rs == 1 && rc == 1) {
+		*reused = SSL_session_reused(c);
+		newsess = SSL_get1_session(c);
+		/* clean shutdown, keeps the session resumable */
+		SSL_set_shutdown(c, SSL_SENT_SHUTDOWN|SSL_RECEIVED_SHUTDOWN);
+		SSL_set_shutdown(s, SSL_SENT_SHUTDOWN|SSL_RECEIVED_SHUTDOWN);
+	}
+out:
+	if (s)
+		SSL_free(s);
+	if (c)
+		SSL_free(c);
+	return newsess;
+}
+
+START_TEST(sslticket_01)
+{
+	fail_unless(sslticket_init(NULL) == 0, "init failed");
+	fail_unless(sslticket_keys() == 1, "not one key");
+	for (int i = 0; i < SSLTICKET_MAXKEYS + 2; i++) {
+		fail_unless(sslticket_rotate() == 0, "rotate failed");
+	}
+	fail_unless(sslticket_keys() == SSLTICKET_MAXKEYS,
+	            "wrong number of keys after rotation");
+}
+END_TEST
+
+START_TEST(sslticket_02)
+{
+	fail_unless(write_keyfile(2 * SSLTICKET_FILEKEYSZ) == 0,
+	            "writing key file failed");
+	fail_unless(sslticket_init(TMP_KEY_FILE) == 0, "init failed");
+	fail_unless(sslticket_keys() == 2, "not two keys");
+	fail_unless(write_keyfile(SSLTICKET_FILEKEYSZ) == 0,
+	            "writing key file failed");
+	fail_unless(sslticket_rotate() == 0, "reload failed");
+	fail_unless(sslticket_keys() == 1, "not reloaded");
+	fail_unless(write_keyfile(SSLTICKET_FILEKEYSZ + 1) == 0,
+	            "writing key file failed");
+	fail_unless(sslticket_rotate() == -1, "accepted truncated key");
+	fail_unless(sslticket_keys() == 1, "keys not kept on error");
+}
+END_TEST
+
+START_TEST(sslticket_03)
+{
+	fail_unless(write_keyfile(SSLTICKET_MAXKEYS * SSLTICKET_FILEKEYSZ + 1)
+	            == 0, "writing key file failed");
+	fail_unless(sslticket_init(TMP_KEY_FILE) == -1,
+	            "accepted too many keys");
+}
+END_TEST
+
+START_TEST(sslticket_04)
+{
+	SSL_CTX *sctx, *cctx;
+	SSL_SESSION *sess, *sess2;
+	int reused;
+
+	fail_unless(sslticket_init(NULL) == 0, "init failed");
+	sctx = server_ctx_new();
+	fail_unless(!!sctx, "creating server SSL_CTX failed");
+	cctx = SSL_CTX_new(SSLv23_client_method());
+	fail_unless(!!cctx, "creating client SSL_CTX failed");
+
+	sess = handshake(sctx, cctx, NULL, &reused);
+	fail_unless(!!sess, "initial handshake failed");
+	fail_unless(!reused, "initial handshake resumed");
+
+	/* resumption with current and previous keys */
+	for (int i = 0; i < SSLTICKET_MAXKEYS; i++) {
+		sess2 = handshake(sctx, cctx, sess, &reused);
+		fail_unless(!!sess2, "resumption handshake failed");
+		fail_unless(reused, "session not resumed (%d)", i);
+		SSL_SESSION_free(sess2);
+		fail_unless(sslticket_rotate() == 0, "rotate failed");
+	}
+
+	/* key has been rotated out */
+	sess2 = handshake(sctx, cctx, sess, &reused);
+	fail_unless(!!sess2, "handshake failed");
+	fail_unless(!reused, "session resumed with expired key");
+	SSL_SESSION_free(sess2);
+
+	SSL_SESSION_free(sess);
+	SSL_CTX_free(cctx);
+	SSL_CTX_free(sctx);
+}
+END_TEST
+
+Suite *
+sslticket_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("sslticket");
+
+	tc = tcase_create("sslticket");
+	tcase_add_checked_fixture(tc, sslticket_setup, sslticket_teardown);
+	tcase_add_test(tc, sslticket_01);
+	tcase_add_test(tc, sslticket_02);
+	tcase_add_test(tc, sslticket_03);
+	tcase_add_test(tc, sslticket_04);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
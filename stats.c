@@ -0,0 +1,1717 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "stats.h"
+
+#include "log.h"
+#include "cachemgr.h"
+#include "mempool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+/*
+ * Runtime statistics.  Every thread updating counters gets its own block of
+ * counters, allocated on first use and linked into a list of all blocks.
+ * Only the owning thread ever writes to a block, so updates need neither
+ * locks nor atomic read-modify-write operations, just relaxed atomic stores
+ * so that concurrent readers never see torn values.  Readers aggregate the
+ * counters on demand by summing up all blocks.  Blocks are kept until
+ * stats_fini(), such that counts of terminated threads are not lost.
+ *
+ * Counters are only collected after stats_init(); before that, updates are
+ * silently discarded.
+ *
+ * Histograms are made of one counter per bucket plus a count and a sum
+ * counter; buckets are not cumulative in storage, stats_prometheus() makes
+ * them cumulative when rendering.
+ *
+ * The connection phase histograms per proxyspec follow the HDR histogram
+ * layout: values below STATS_PHASE_SUB microseconds get a bucket each, and
+ * every power of two above is split linearly into STATS_PHASE_SUB buckets,
+ * which bounds the relative error of the reported quantiles to 1/8 across
+ * the whole range up to STATS_PHASE_MAXEXP.  They are appended to each block
+ * after the fixed counters, since the number of proxyspecs is only known at
+ * stats_init() time.
+ *
+ * Lock profiling wraps the lock operations on the hot path, see stats.h.
+ * Acquisitions first try the lock, and only if that fails, the time spent
+ * blocking is measured and the acquisition counted as contended.  The hold
+ * time is measured from the outermost acquisition of a lock of a class to
+ * its release, in the block of the thread holding it, such that nested locks
+ * of the same class, as taken by OpenSSL, are not counted twice.  Time
+ * spent waiting on a condition variable does not count as held.
+ *
+ * With performance counters enabled, every worker thread opens the counters
+ * of its own thread and hangs them off its block.  The connection handling
+ * code reads them around its callbacks and charges the difference to the
+ * phase of the connection in the phase counters of the block; the totals per
+ * worker are read directly from the counters when reporting, such that the
+ * event loop overhead outside of any callback is included.
+ */
+
+#define STATS_PHASE_SUBBITS	3
+#define STATS_PHASE_SUB		(1 << STATS_PHASE_SUBBITS)
+#define STATS_PHASE_MAXEXP	26	/* 2^27 usec, a bit over two minutes */
+#define STATS_PHASE_NBUCKETS	(STATS_PHASE_SUB + STATS_PHASE_SUB * \
+                                 (STATS_PHASE_MAXEXP - STATS_PHASE_SUBBITS + 1))
+#define STATS_PHASE_COUNT	STATS_PHASE_NBUCKETS
+#define STATS_PHASE_SUM		(STATS_PHASE_NBUCKETS + 1)
+#define STATS_PHASE_NCTRS	(STATS_PHASE_NBUCKETS + 2)
+#define STATS_PHASE(s, p)	(((s) * STATS_NPHASES + (p)) * STATS_PHASE_NCTRS)
+
+typedef struct stats_block {
+	long long c[STATS_MAX];
+	struct stats_block *next;
+	struct {
+		long long since;
+		int depth;
+	} held[STATS_NLOCKS];
+	perfctr_t *perf;	/* performance counters of a worker thread */
+	int worker;
+	long long perf_since;
+	long long p[];
+} stats_block_t;
+
+int stats_lockprof = 0;
+int stats_perf = 0;
+static int stats_perf_avail[PERFCTR_N];
+static int stats_ready = 0;
+static pthread_key_t stats_key;
+static stats_block_t *stats_blocks = NULL;
+static int stats_nspecs = 0;
+static char **stats_spec = NULL;
+
+/*
+ * Shutdown drain progress, only accessed from the main event loop thread.
+ */
+static int stats_drain_phase = STATS_DRAIN_NONE;
+static long long stats_drain_deadline = 0;
+
+/*
+ * CPU time per destination, tracked with the space-saving algorithm: the
+ * table holds STATS_CPU_SLOTS entries per reported destination, and once it
+ * is full, a new destination replaces the cheapest entry and inherits its
+ * CPU time.  The most expensive destinations are thus retained, with their
+ * cost overestimated by at most the cost of the evicted entry.  Updated once
+ * per connection, so a mutex is good enough.
+ */
+#define STATS_CPU_SLOTS		8
+
+typedef struct stats_cpu_entry {
+	char *key;			/* sni NUL dst NUL */
+	size_t keysz;
+	long long usec;
+	long long conns;
+} stats_cpu_entry_t;
+
+static pthread_mutex_t stats_cpu_mutex = PTHREAD_MUTEX_INITIALIZER;
+static stats_cpu_entry_t *stats_cpu_tab = NULL;
+static size_t stats_cpu_len = 0;
+static size_t stats_cpu_sz = 0;
+static size_t stats_cpu_topn = 0;
+
+/*
+ * TCP round trip times and retransmits per destination, sampled from both
+ * legs of a connection when it is closed.  Destinations are tracked by
+ * number of samples with the same space-saving table as the CPU time; a
+ * destination replacing an entry inherits its sample count, but starts with
+ * empty histograms.
+ */
+#define STATS_TCP_SLOTS		8
+
+typedef struct stats_tcp_entry {
+	char *key;			/* dst */
+	long long samples;
+	struct {
+		long long h[STATS_HIST_NBUCKETS];
+		long long count;
+		long long rtt_usec;
+		long long retrans;
+	} leg[STATS_NLEGS];
+} stats_tcp_entry_t;
+
+static pthread_mutex_t stats_tcp_mutex = PTHREAD_MUTEX_INITIALIZER;
+static stats_tcp_entry_t *stats_tcp_tab = NULL;
+static size_t stats_tcp_len = 0;
+static size_t stats_tcp_sz = 0;
+static size_t stats_tcp_topn = 0;
+
+static const char *stats_phase_name[STATS_NPHASES] = {
+	"sni", "nat", "dns", "connect", "dst_handshake", "cert",
+	"src_handshake", "ttfb"
+};
+
+/* reported quantiles in permille */
+static const int stats_phase_q[] = { 500, 900, 990, 999 };
+
+static const char *stats_lock_name[STATS_NLOCKS] = {
+	"cache", "thrqueue", "thrmgr", "openssl"
+};
+
+static const char *stats_perf_phase_name[STATS_NPERFPHASES] = {
+	"handshake", "forward", "log"
+};
+
+static const struct {
+	const char *name;
+	const char *help;
+} stats_perf_ctr[PERFCTR_N] = {
+	{"cycles", "CPU cycles"},
+	{"instructions", "Instructions retired"},
+	{"cache_misses", "Cache misses"},
+	{"context_switches", "Context switches"},
+	{"cpu_seconds", "CPU time"},
+};
+
+static const char *stats_cache_name[STATS_NCACHES] = {
+	"fkcrt", "tgcrt", "ssess", "dsess", "sslctx", "vrfy", "dns",
+	"sni", "pass", "ocsp", "http"
+};
+
+static cache_t **stats_cache[STATS_NCACHES] = {
+	&cachemgr_fkcrt, &cachemgr_tgcrt, &cachemgr_ssess, &cachemgr_dsess,
+	&cachemgr_sslctx, &cachemgr_vrfy, &cachemgr_dns, &cachemgr_sni,
+	&cachemgr_pass, &cachemgr_ocsp, &cachemgr_http
+};
+
+/* upper bounds of the histogram buckets in microseconds, except for +Inf */
+static const long long stats_hist_le[STATS_HIST_NBUCKETS - 1] = {
+	500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+	1000000
+};
+
+static const char *stats_leg_name[STATS_NLEGS] = {"src", "dst"};
+
+static const struct {
+	const char *name;
+	const char *help;
+	int count;
+	int sum;
+} stats_hist[STATS_NHISTS] = {
+	{"forge_duration_seconds", "Time spent forging a certificate.",
+	 STATS_FORGE, STATS_FORGE_USEC},
+	{"connection_setup_duration_seconds",
+	 "Time from accepting a connection until both ends are connected.",
+	 STATS_SETUP, STATS_SETUP_USEC},
+	{"event_loop_lag_seconds",
+	 "Delay of the worker thread event loops, sampled periodically.",
+	 STATS_LOOPLAG, STATS_LOOPLAG_USEC},
+};
+
+/*
+ * Initialize the statistics subsystem for nspecs proxyspecs.  Must be called
+ * before any threads are started.  Returns -1 on failure, 0 on success.
+ */
+int
+stats_init(int nspecs)
+{
+	if (stats_ready)
+		return 0;
+	if (nspecs > 0 && !(stats_spec = calloc(nspecs, sizeof(char *))))
+		return -1;
+	if (pthread_key_create(&stats_key, NULL) != 0) {
+		free(stats_spec);
+		stats_spec = NULL;
+		return -1;
+	}
+	stats_nspecs = nspecs;
+	__atomic_store_n(&stats_ready, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+ * Set the label used for proxyspec spec when rendering the phase histograms.
+ * Returns -1 on out of memory condition, 0 on success.
+ */
+int
+stats_set_spec(int spec, const char *name)
+{
+	if (spec < 0 || spec >= stats_nspecs)
+		return 0;
+	free(stats_spec[spec]);
+	if (!(stats_spec[spec] = strdup(name)))
+		return -1;
+	return 0;
+}
+
+/*
+ * Release all counter blocks.  Must be called after all threads updating
+ * counters have stopped.
+ */
+void
+stats_fini(void)
+{
+	stats_block_t *block;
+
+	if (!stats_ready)
+		return;
+	stats_ready = 0;
+	while ((block = stats_blocks)) {
+		stats_blocks = block->next;
+		if (block->perf)
+			perfctr_close(block->perf);
+		free(block);
+	}
+	pthread_key_delete(stats_key);
+	for (int i = 0; i < stats_nspecs; i++)
+		free(stats_spec[i]);
+	free(stats_spec);
+	stats_spec = NULL;
+	stats_nspecs = 0;
+	for (size_t i = 0; i < stats_cpu_len; i++)
+		free(stats_cpu_tab[i].key);
+	free(stats_cpu_tab);
+	stats_cpu_tab = NULL;
+	stats_cpu_len = stats_cpu_sz = stats_cpu_topn = 0;
+	for (size_t i = 0; i < stats_tcp_len; i++)
+		free(stats_tcp_tab[i].key);
+	free(stats_tcp_tab);
+	stats_tcp_tab = NULL;
+	stats_tcp_len = stats_tcp_sz = stats_tcp_topn = 0;
+}
+
+/*
+ * Return the counter block of the calling thread, or NULL on out of memory
+ * condition.  New blocks are pushed onto the list without locking.
+ */
+static stats_block_t *
+stats_block(void)
+{
+	stats_block_t *block;
+	size_t sz;
+	void *p;
+
+	if ((block = pthread_getspecific(stats_key)))
+		return block;
+	sz = sizeof(stats_block_t) +
+	     STATS_PHASE(stats_nspecs, 0) * sizeof(long long);
+	/* own cache line, so that blocks of different threads do not share */
+	if (posix_memalign(&p, 64, sz) != 0)
+		return NULL;
+	block = p;
+	memset(block, 0, sz);
+	if (pthread_setspecific(stats_key, block) != 0) {
+		free(block);
+		return NULL;
+	}
+	block->next = __atomic_load_n(&stats_blocks, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&stats_blocks, &block->next, block,
+	                                    1, __ATOMIC_RELEASE,
+	                                    __ATOMIC_RELAXED));
+	return block;
+}
+
+/*
+ * Add n to counter id of the calling thread.
+ */
+void
+stats_add(int id, long long n)
+{
+	stats_block_t *block;
+
+	if (!__atomic_load_n(&stats_ready, __ATOMIC_RELAXED))
+		return;
+	if (!(block = stats_block()))
+		return;
+	__atomic_store_n(&block->c[id], block->c[id] + n, __ATOMIC_RELAXED);
+}
+
+/*
+ * Return the fixed histogram bucket for a latency of usec microseconds.
+ */
+static int
+stats_hist_bucket(long long usec)
+{
+	int i;
+
+	for (i = 0; i < STATS_HIST_NBUCKETS - 1; i++) {
+		if (usec <= stats_hist_le[i])
+			break;
+	}
+	return i;
+}
+
+/*
+ * Record a latency of usec microseconds in histogram hist.
+ */
+void
+stats_observe(int hist, long long usec)
+{
+	stats_add(STATS_HIST(hist, stats_hist_bucket(usec)), 1);
+	stats_add(stats_hist[hist].count, 1);
+	stats_add(stats_hist[hist].sum, usec);
+}
+
+/*
+ * Return the phase histogram bucket for a latency of usec microseconds.
+ */
+static int
+stats_phase_bucket(long long usec)
+{
+	int e;
+
+	if (usec < STATS_PHASE_SUB)
+		return usec < 0 ? 0 : (int)usec;
+	for (e = STATS_PHASE_SUBBITS; e < STATS_PHASE_MAXEXP &&
+	                              (usec >> (e + 1)); e++);
+	if (usec >> (e + 1))
+		return STATS_PHASE_NBUCKETS - 1;
+	return STATS_PHASE_SUB + (e - STATS_PHASE_SUBBITS) * STATS_PHASE_SUB +
+	       (int)((usec >> (e - STATS_PHASE_SUBBITS)) &
+	             (STATS_PHASE_SUB - 1));
+}
+
+/*
+ * Return the highest latency in microseconds that falls into phase
+ * histogram bucket i.
+ */
+static long long
+stats_phase_upper(int i)
+{
+	int e, sub;
+
+	if (i < STATS_PHASE_SUB)
+		return i;
+	e = (i - STATS_PHASE_SUB) / STATS_PHASE_SUB + STATS_PHASE_SUBBITS;
+	sub = (i - STATS_PHASE_SUB) % STATS_PHASE_SUB;
+	return ((long long)(STATS_PHASE_SUB + sub + 1) <<
+	        (e - STATS_PHASE_SUBBITS)) - 1;
+}
+
+/*
+ * Record a latency of usec microseconds for connection phase phase of
+ * proxyspec spec.  Latencies for unknown proxyspecs are discarded.
+ */
+void
+stats_phase(int spec, int phase, long long usec)
+{
+	stats_block_t *block;
+	long long *p;
+	int i;
+
+	if (!__atomic_load_n(&stats_ready, __ATOMIC_RELAXED))
+		return;
+	if (spec < 0 || spec >= stats_nspecs)
+		return;
+	if (!(block = stats_block()))
+		return;
+	p = block->p + STATS_PHASE(spec, phase);
+	i = stats_phase_bucket(usec);
+	__atomic_store_n(&p[i], p[i] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&p[STATS_PHASE_COUNT], p[STATS_PHASE_COUNT] + 1,
+	                 __ATOMIC_RELAXED);
+	__atomic_store_n(&p[STATS_PHASE_SUM], p[STATS_PHASE_SUM] + usec,
+	                 __ATOMIC_RELAXED);
+}
+
+/*
+ * Return the quantile q in permille of the phase histogram h in
+ * microseconds, h being STATS_PHASE_NCTRS summed up counters.
+ */
+static long long
+stats_phase_quantile(const long long *h, int q)
+{
+	long long target, cum = 0;
+	int i;
+
+	target = (h[STATS_PHASE_COUNT] * q + 999) / 1000;
+	if (target < 1)
+		target = 1;
+	for (i = 0; i < STATS_PHASE_NBUCKETS - 1; i++) {
+		cum += h[i];
+		if (cum >= target)
+			break;
+	}
+	return stats_phase_upper(i);
+}
+
+/*
+ * Sum up the phase histograms of all threads.  Returns a newly allocated
+ * array to be freed by the caller, or NULL if there are no proxyspecs or on
+ * out of memory condition.
+ */
+static long long *
+stats_phase_sum(void)
+{
+	stats_block_t *block;
+	long long *sum;
+	int n;
+
+	if (!__atomic_load_n(&stats_ready, __ATOMIC_RELAXED))
+		return NULL;
+	n = STATS_PHASE(stats_nspecs, 0);
+	if (!n || !(sum = calloc(n, sizeof(long long))))
+		return NULL;
+	for (block = __atomic_load_n(&stats_blocks, __ATOMIC_ACQUIRE); block;
+	     block = block->next) {
+		for (int i = 0; i < n; i++)
+			sum[i] += __atomic_load_n(&block->p[i],
+			                          __ATOMIC_RELAXED);
+	}
+	return sum;
+}
+
+/*
+ * Return a monotonic timestamp in microseconds, for measuring latencies.
+ */
+long long
+stats_usec(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		return 0;
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Record the shutdown drain phase and the stats_usec() timestamp at which
+ * it is cut short, for reporting.  Called from the main event loop thread.
+ */
+void
+stats_drain(int phase, long long deadline)
+{
+	stats_drain_phase = phase;
+	stats_drain_deadline = deadline;
+}
+
+/*
+ * Return the microseconds left in the current shutdown drain phase.
+ */
+static long long
+stats_drain_left(void)
+{
+	long long left = stats_drain_deadline - stats_usec();
+
+	return left > 0 ? left : 0;
+}
+
+/*
+ * Return the CPU time consumed by the calling thread in microseconds.
+ */
+long long
+stats_cpu_usec(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == -1)
+		return 0;
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Enable lock profiling.  Must be called before any threads are started.
+ */
+void
+stats_lockprof_enable(void)
+{
+	stats_lockprof = 1;
+}
+
+static void
+stats_block_add(stats_block_t *block, int id, long long n)
+{
+	__atomic_store_n(&block->c[id], block->c[id] + n, __ATOMIC_RELAXED);
+}
+
+/*
+ * Account an acquisition of a lock of class l by the calling thread, which
+ * started waiting at t0 if contended, or if t0 is -1, got the lock right
+ * away.  Returns rv, the result of the lock operation.
+ */
+static int
+stats_lock_acquired(int l, long long t0, int rv)
+{
+	stats_block_t *block;
+	long long now;
+
+	if (rv != 0 || !__atomic_load_n(&stats_ready, __ATOMIC_RELAXED) ||
+	    !(block = stats_block()))
+		return rv;
+	now = stats_usec();
+	stats_block_add(block, STATS_LOCK(l, STATS_LOCK_ACQUIRED), 1);
+	if (t0 != -1) {
+		stats_block_add(block, STATS_LOCK(l, STATS_LOCK_CONTENDED), 1);
+		stats_block_add(block, STATS_LOCK(l, STATS_LOCK_WAIT_USEC),
+		                now - t0);
+	}
+	if (block->held[l].depth++ == 0)
+		block->held[l].since = now;
+	return rv;
+}
+
+/*
+ * Account the release of a lock of class l by the calling thread.
+ */
+static void
+stats_lock_released(int l)
+{
+	stats_block_t *block;
+
+	if (!__atomic_load_n(&stats_ready, __ATOMIC_RELAXED) ||
+	    !(block = stats_block()) || !block->held[l].depth)
+		return;
+	if (--block->held[l].depth == 0)
+		stats_block_add(block, STATS_LOCK(l, STATS_LOCK_HOLD_USEC),
+		                stats_usec() - block->held[l].since);
+}
+
+/*
+ * Account a condition variable wait on a mutex of class l, started at t0,
+ * after which the mutex is held again.  Returns rv.
+ */
+static int
+stats_lock_condwaited(int l, long long t0, int rv)
+{
+	stats_block_t *block;
+	long long now;
+
+	if (!__atomic_load_n(&stats_ready, __ATOMIC_RELAXED) ||
+	    !(block = stats_block()))
+		return rv;
+	now = stats_usec();
+	stats_block_add(block, STATS_LOCK(l, STATS_LOCK_CONDWAIT), 1);
+	stats_block_add(block, STATS_LOCK(l, STATS_LOCK_CONDWAIT_USEC),
+	                now - t0);
+	if (block->held[l].depth++ == 0)
+		block->held[l].since = now;
+	return rv;
+}
+
+int
+stats_mutex_lock(pthread_mutex_t *mutex, int l)
+{
+	long long t0;
+
+	if (pthread_mutex_trylock(mutex) == 0)
+		return stats_lock_acquired(l, -1, 0);
+	t0 = stats_usec();
+	return stats_lock_acquired(l, t0, pthread_mutex_lock(mutex));
+}
+
+int
+stats_mutex_unlock(pthread_mutex_t *mutex, int l)
+{
+	stats_lock_released(l);
+	return pthread_mutex_unlock(mutex);
+}
+
+int
+stats_rwlock_rdlock(pthread_rwlock_t *rwlock, int l)
+{
+	long long t0;
+
+	if (pthread_rwlock_tryrdlock(rwlock) == 0)
+		return stats_lock_acquired(l, -1, 0);
+	t0 = stats_usec();
+	return stats_lock_acquired(l, t0, pthread_rwlock_rdlock(rwlock));
+}
+
+int
+stats_rwlock_wrlock(pthread_rwlock_t *rwlock, int l)
+{
+	long long t0;
+
+	if (pthread_rwlock_trywrlock(rwlock) == 0)
+		return stats_lock_acquired(l, -1, 0);
+	t0 = stats_usec();
+	return stats_lock_acquired(l, t0, pthread_rwlock_wrlock(rwlock));
+}
+
+int
+stats_rwlock_unlock(pthread_rwlock_t *rwlock, int l)
+{
+	stats_lock_released(l);
+	return pthread_rwlock_unlock(rwlock);
+}
+
+int
+stats_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex, int l)
+{
+	long long t0;
+
+	stats_lock_released(l);
+	t0 = stats_usec();
+	return stats_lock_condwaited(l, t0, pthread_cond_wait(cond, mutex));
+}
+
+int
+stats_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                     const struct timespec *abstime, int l)
+{
+	long long t0;
+
+	stats_lock_released(l);
+	t0 = stats_usec();
+	return stats_lock_condwaited(l, t0, pthread_cond_timedwait(cond,
+	                             mutex, abstime));
+}
+
+/*
+ * Enable the performance counters of the worker threads, after checking that
+ * they can be opened on the calling thread.  Must be called before any
+ * threads are started.  Returns -1 with errno set if performance counters are
+ * not available, 0 on success.
+ */
+int
+stats_perf_enable(void)
+{
+	perfctr_t *pc;
+
+	if (!(pc = perfctr_open()))
+		return -1;
+	for (int i = 0; i < PERFCTR_N; i++)
+		stats_perf_avail[i] = perfctr_avail(pc, i);
+	perfctr_close(pc);
+	stats_perf = 1;
+	return 0;
+}
+
+/*
+ * Start counting on the calling thread, which is worker thread idx.
+ */
+void
+stats_perf_worker(int idx)
+{
+	stats_block_t *block;
+	perfctr_t *pc;
+
+	if (!stats_perf || !__atomic_load_n(&stats_ready, __ATOMIC_RELAXED) ||
+	    !(block = stats_block()) || block->perf)
+		return;
+	if (!(pc = perfctr_open())) {
+		log_err_printf("Warning: Failed to open performance counters "
+		               "for thread %d: %s (%i)\n", idx,
+		               strerror(errno), errno);
+		return;
+	}
+	/* counting the kernel may no longer be allowed after dropping privs */
+	for (int i = 0; i < PERFCTR_N; i++) {
+		if (!perfctr_avail(pc, i))
+			__atomic_store_n(&stats_perf_avail[i], 0,
+			                 __ATOMIC_RELAXED);
+	}
+	block->worker = idx;
+	block->perf_since = stats_usec();
+	__atomic_store_n(&block->perf, pc, __ATOMIC_RELEASE);
+}
+
+/*
+ * Charge the performance counters of the calling thread since the reading
+ * in mark to phase, and update mark to the current reading.  A mark which
+ * was never updated before, all zero, only gets updated.
+ */
+void
+stats_perf_charge(unsigned long long *mark, int phase)
+{
+	unsigned long long now[PERFCTR_N];
+	stats_block_t *block;
+
+	if (!__atomic_load_n(&stats_ready, __ATOMIC_RELAXED) ||
+	    !(block = stats_block()) || !block->perf ||
+	    perfctr_read(block->perf, now) == -1)
+		return;
+	if (mark[PERFCTR_TASK_CLOCK]) {
+		for (int i = 0; i < PERFCTR_N; i++)
+			stats_block_add(block, STATS_PERF(phase, i),
+			                now[i] - mark[i]);
+	}
+	memcpy(mark, now, sizeof(now));
+}
+
+/*
+ * Format the available counters in v into buf for the log.
+ */
+static void
+stats_perf_fmt(char *buf, size_t sz, const long long *v)
+{
+	size_t n = 0;
+
+	buf[0] = '\0';
+	for (int i = 0; i < PERFCTR_N && n < sz; i++) {
+		if (!stats_perf_avail[i])
+			continue;
+		if (i == PERFCTR_TASK_CLOCK) {
+			n += snprintf(buf + n, sz - n, " cpu %lld us",
+			              v[i] / 1000);
+		} else {
+			n += snprintf(buf + n, sz - n, " %s %lld",
+			              stats_perf_ctr[i].name, v[i]);
+		}
+		if (i == PERFCTR_INSTRUCTIONS && n < sz &&
+		    stats_perf_avail[PERFCTR_CYCLES] && v[PERFCTR_CYCLES]) {
+			n += snprintf(buf + n, sz - n, " ipc %.2f",
+			              (double)v[i] / v[PERFCTR_CYCLES]);
+		}
+	}
+}
+
+/*
+ * Log the performance counters per phase and per worker thread.
+ */
+static void
+stats_perf_log(const long long *s)
+{
+	unsigned long long v[PERFCTR_N];
+	long long w[PERFCTR_N], now;
+	stats_block_t *block;
+	perfctr_t *pc;
+	char buf[256];
+
+	for (int p = 0; p < STATS_NPERFPHASES; p++) {
+		stats_perf_fmt(buf, sizeof(buf), s + STATS_PERF(p, 0));
+		log_err_printf("Perf %s:%s\n", stats_perf_phase_name[p], buf);
+	}
+	now = stats_usec();
+	for (block = __atomic_load_n(&stats_blocks, __ATOMIC_ACQUIRE); block;
+	     block = block->next) {
+		if (!(pc = __atomic_load_n(&block->perf, __ATOMIC_ACQUIRE)) ||
+		    perfctr_read(pc, v) == -1)
+			continue;
+		for (int i = 0; i < PERFCTR_N; i++)
+			w[i] = v[i];
+		stats_perf_fmt(buf, sizeof(buf), w);
+		log_err_printf("Perf thread %d:%s busy %lld%%\n",
+		               block->worker, buf,
+		               now > block->perf_since ?
+		               w[PERFCTR_TASK_CLOCK] / 10 /
+		               (now - block->perf_since) : 0);
+	}
+}
+
+/*
+ * Enable tracking of the topn destinations with the highest CPU time.  Must
+ * be called after stats_init() and before any threads are started.  Returns
+ * -1 on out of memory condition, 0 on success.
+ */
+int
+stats_cpu_init(size_t topn)
+{
+	if (!topn)
+		return 0;
+	if (!(stats_cpu_tab = calloc(topn * STATS_CPU_SLOTS,
+	                             sizeof(stats_cpu_entry_t))))
+		return -1;
+	stats_cpu_sz = topn * STATS_CPU_SLOTS;
+	stats_cpu_topn = topn;
+	return 0;
+}
+
+/*
+ * Account usec microseconds of CPU time spent on a connection to
+ * destination dst with server name sni, which may be NULL.  Thread-safe.
+ */
+void
+stats_cpu(const char *sni, const char *dst, long long usec)
+{
+	stats_cpu_entry_t *e = NULL;
+	size_t snisz, keysz;
+	char *key;
+
+	if (!stats_cpu_sz)
+		return;
+	snisz = sni ? strlen(sni) + 1 : 1;
+	keysz = snisz + strlen(dst) + 1;
+	pthread_mutex_lock(&stats_cpu_mutex);
+	for (size_t i = 0; i < stats_cpu_len; i++) {
+		if (stats_cpu_tab[i].keysz == keysz &&
+		    !strcmp(stats_cpu_tab[i].key, sni ? sni : "") &&
+		    !strcmp(stats_cpu_tab[i].key + snisz, dst)) {
+			e = &stats_cpu_tab[i];
+			break;
+		}
+	}
+	if (!e) {
+		if (!(key = malloc(keysz)))
+			goto out;
+		memcpy(key, sni ? sni : "", snisz);
+		memcpy(key + snisz, dst, keysz - snisz);
+		if (stats_cpu_len < stats_cpu_sz) {
+			e = &stats_cpu_tab[stats_cpu_len++];
+		} else {
+			e = &stats_cpu_tab[0];
+			for (size_t i = 1; i < stats_cpu_len; i++) {
+				if (stats_cpu_tab[i].usec < e->usec)
+					e = &stats_cpu_tab[i];
+			}
+			free(e->key);
+		}
+		e->key = key;
+		e->keysz = keysz;
+	}
+	e->usec += usec;
+	e->conns++;
+out:
+	pthread_mutex_unlock(&stats_cpu_mutex);
+}
+
+static int
+stats_cpu_cmp(const void *a, const void *b)
+{
+	const stats_cpu_entry_t *ea = a, *eb = b;
+
+	return ea->usec < eb->usec ? 1 : ea->usec > eb->usec ? -1 : 0;
+}
+
+/*
+ * Return a copy of the most expensive destinations sorted by descending CPU
+ * time in *top, and their number, or 0 if there are none or on out of
+ * memory condition.  The keys point into the table and are only valid while
+ * the caller holds stats_cpu_mutex.
+ */
+static size_t
+stats_cpu_top(stats_cpu_entry_t **top)
+{
+	size_t n;
+
+	if (!stats_cpu_len || !(*top = malloc(stats_cpu_len *
+	                                      sizeof(stats_cpu_entry_t))))
+		return 0;
+	memcpy(*top, stats_cpu_tab, stats_cpu_len * sizeof(stats_cpu_entry_t));
+	qsort(*top, stats_cpu_len, sizeof(stats_cpu_entry_t), stats_cpu_cmp);
+	n = stats_cpu_len < stats_cpu_topn ? stats_cpu_len : stats_cpu_topn;
+	return n;
+}
+
+/*
+ * Enable tracking of the round trip times of the topn destinations with the
+ * most samples.  Must be called after stats_init() and before any threads
+ * are started.  Returns -1 on out of memory condition, 0 on success.
+ */
+int
+stats_tcp_init(size_t topn)
+{
+	if (!topn)
+		return 0;
+	if (!(stats_tcp_tab = calloc(topn * STATS_TCP_SLOTS,
+	                             sizeof(stats_tcp_entry_t))))
+		return -1;
+	stats_tcp_sz = topn * STATS_TCP_SLOTS;
+	stats_tcp_topn = topn;
+	return 0;
+}
+
+/*
+ * Account a TCP_INFO sample of leg STATS_LEG_SRC or STATS_LEG_DST of a
+ * connection to destination dst, with a smoothed round trip time of
+ * rtt_usec microseconds and retrans segments retransmitted in total.
+ * Samples without round trip time are ignored.  Thread-safe.
+ */
+void
+stats_tcp(const char *dst, int leg, long long rtt_usec, long long retrans)
+{
+	stats_tcp_entry_t *e = NULL;
+	char *key;
+
+	if (!stats_tcp_sz || rtt_usec < 0)
+		return;
+	pthread_mutex_lock(&stats_tcp_mutex);
+	for (size_t i = 0; i < stats_tcp_len; i++) {
+		if (!strcmp(stats_tcp_tab[i].key, dst)) {
+			e = &stats_tcp_tab[i];
+			break;
+		}
+	}
+	if (!e) {
+		if (!(key = strdup(dst)))
+			goto out;
+		if (stats_tcp_len < stats_tcp_sz) {
+			e = &stats_tcp_tab[stats_tcp_len++];
+		} else {
+			e = &stats_tcp_tab[0];
+			for (size_t i = 1; i < stats_tcp_len; i++) {
+				if (stats_tcp_tab[i].samples < e->samples)
+					e = &stats_tcp_tab[i];
+			}
+			free(e->key);
+			memset(e->leg, 0, sizeof(e->leg));
+		}
+		e->key = key;
+	}
+	e->samples++;
+	e->leg[leg].h[stats_hist_bucket(rtt_usec)]++;
+	e->leg[leg].count++;
+	e->leg[leg].rtt_usec += rtt_usec;
+	if (retrans > 0)
+		e->leg[leg].retrans += retrans;
+out:
+	pthread_mutex_unlock(&stats_tcp_mutex);
+}
+
+static int
+stats_tcp_cmp(const void *a, const void *b)
+{
+	const stats_tcp_entry_t *ea = a, *eb = b;
+
+	return ea->samples < eb->samples ? 1 :
+	       ea->samples > eb->samples ? -1 : 0;
+}
+
+/*
+ * Return a copy of the destinations with the most TCP_INFO samples sorted
+ * by descending number of samples in *top, and their number, or 0 if there
+ * are none or on out of memory condition.  The keys point into the table
+ * and are only valid while the caller holds stats_tcp_mutex.
+ */
+static size_t
+stats_tcp_top(stats_tcp_entry_t **top)
+{
+	size_t n;
+
+	if (!stats_tcp_len || !(*top = malloc(stats_tcp_len *
+	                                      sizeof(stats_tcp_entry_t))))
+		return 0;
+	memcpy(*top, stats_tcp_tab, stats_tcp_len * sizeof(stats_tcp_entry_t));
+	qsort(*top, stats_tcp_len, sizeof(stats_tcp_entry_t), stats_tcp_cmp);
+	n = stats_tcp_len < stats_tcp_topn ? stats_tcp_len : stats_tcp_topn;
+	return n;
+}
+
+/*
+ * Sum up the counters of all threads into sum, an array of STATS_MAX
+ * counters.  Thread-safe; the result is a snapshot that may be slightly
+ * inconsistent if other threads are concurrently updating counters.
+ */
+void
+stats_sum(long long *sum)
+{
+	stats_block_t *block;
+
+	memset(sum, 0, STATS_MAX * sizeof(long long));
+	if (!__atomic_load_n(&stats_ready, __ATOMIC_RELAXED))
+		return;
+	for (block = __atomic_load_n(&stats_blocks, __ATOMIC_ACQUIRE); block;
+	     block = block->next) {
+		for (int i = 0; i < STATS_MAX; i++)
+			sum[i] += __atomic_load_n(&block->c[i],
+			                          __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Sum up the approximate memory footprint of all caches, including the
+ * target certs loaded at startup, and of all log queues into *caches and
+ * *logs.
+ */
+static void
+stats_mem_sum(size_t *caches, size_t *logs)
+{
+	logger_stats_t st;
+	const char *name;
+
+	*caches = *logs = 0;
+	for (int i = 0; i < STATS_NCACHES; i++) {
+		if (*stats_cache[i])
+			*caches += cache_bytes(*stats_cache[i]);
+	}
+	if (cachemgr_tgmatch)
+		*caches += certmatch_bytes(cachemgr_tgmatch);
+	for (size_t i = 0; log_stats_get(i, &name, &st) != -1; i++) {
+		if (name)
+			*logs += st.bytes;
+	}
+}
+
+/*
+ * Log the aggregated counters to the error log.
+ */
+void
+stats_log(void)
+{
+	long long s[STATS_MAX];
+	stats_cpu_entry_t *top;
+	stats_tcp_entry_t *tcptop;
+	size_t caches, logs, n;
+	long long *p;
+
+	stats_sum(s);
+	stats_mem_sum(&caches, &logs);
+	log_err_printf("Stats: connections accepted %lld active %lld "
+	               "pending %lld timed out %lld limited %lld "
+	               "migrated %lld; "
+	               "SSL split %lld passthrough %lld error %lld "
+	               "mispredicted %lld reneg limited %lld; "
+	               "forged %lld (avg %lld us, stolen %lld); "
+	               "bytes from src %lld dst %lld; "
+	               "loop lag avg %lld us\n",
+	               s[STATS_CONN_ACCEPTED], s[STATS_CONN_ACTIVE],
+	               s[STATS_CONN_PENDING], s[STATS_CONN_TIMEOUT],
+	               s[STATS_CONN_LIMITED], s[STATS_CONN_MIGRATED],
+	               s[STATS_SSL_SPLIT], s[STATS_SSL_PASSTHROUGH],
+	               s[STATS_SSL_ERROR], s[STATS_SSL_MISPREDICT],
+	               s[STATS_SSL_RENEG], s[STATS_FORGE],
+	               s[STATS_FORGE] ? s[STATS_FORGE_USEC] / s[STATS_FORGE]
+	                              : 0,
+	               s[STATS_FORGE_STOLEN],
+	               s[STATS_SRC_BYTES], s[STATS_DST_BYTES],
+	               s[STATS_LOOPLAG] ? s[STATS_LOOPLAG_USEC] /
+	                                  s[STATS_LOOPLAG] : 0);
+	if (stats_drain_phase != STATS_DRAIN_NONE)
+		log_err_printf("Draining %s: %lld ms left\n",
+		               stats_drain_phase == STATS_DRAIN_CONNS
+		               ? "connections" : "logs",
+		               stats_drain_left() / 1000);
+	log_err_printf("Memory: connections %lld libevent %zu openssl %zu "
+	               "mempool %zu caches %zu logs %zu bytes\n",
+	               s[STATS_CONN_MEM], mempool_bytes(MEMPOOL_EVENT),
+	               mempool_bytes(MEMPOOL_CRYPTO),
+	               mempool_bytes(MEMPOOL_CACHED), caches, logs);
+	for (int i = 0; i < STATS_NCACHES; i++) {
+		size_t coll = 0, probes = 0, maxprobe = 0;
+
+		if (*stats_cache[i])
+			cache_probes(*stats_cache[i], &coll, &probes,
+			             &maxprobe);
+		log_err_printf("Cache %s: hit %lld miss %lld evict %lld "
+		               "demote %lld expire %lld bytes %zu "
+		               "collisions %zu probes %zu max %zu\n",
+		               stats_cache_name[i],
+		               s[STATS_CACHE(i, STATS_HIT)],
+		               s[STATS_CACHE(i, STATS_MISS)],
+		               s[STATS_CACHE(i, STATS_EVICT)],
+		               s[STATS_CACHE(i, STATS_DEMOTE)],
+		               s[STATS_CACHE(i, STATS_EXPIRE)],
+		               *stats_cache[i] ? cache_bytes(*stats_cache[i])
+		                               : 0,
+		               coll, probes, maxprobe);
+	}
+	for (int i = 0; stats_lockprof && i < STATS_NLOCKS; i++) {
+		log_err_printf("Lock %s: acquired %lld contended %lld "
+		               "wait %lld us hold %lld us condwait %lld "
+		               "(%lld us)\n", stats_lock_name[i],
+		               s[STATS_LOCK(i, STATS_LOCK_ACQUIRED)],
+		               s[STATS_LOCK(i, STATS_LOCK_CONTENDED)],
+		               s[STATS_LOCK(i, STATS_LOCK_WAIT_USEC)],
+		               s[STATS_LOCK(i, STATS_LOCK_HOLD_USEC)],
+		               s[STATS_LOCK(i, STATS_LOCK_CONDWAIT)],
+		               s[STATS_LOCK(i, STATS_LOCK_CONDWAIT_USEC)]);
+	}
+	if (stats_perf)
+		stats_perf_log(s);
+	pthread_mutex_lock(&stats_cpu_mutex);
+	n = stats_cpu_top(&top);
+	for (size_t i = 0; i < n; i++) {
+		log_err_printf("CPU %s %s: %lld us in %lld connections\n",
+		               *top[i].key ? top[i].key : "-",
+		               top[i].key + strlen(top[i].key) + 1,
+		               top[i].usec, top[i].conns);
+	}
+	pthread_mutex_unlock(&stats_cpu_mutex);
+	if (n)
+		free(top);
+	pthread_mutex_lock(&stats_tcp_mutex);
+	n = stats_tcp_top(&tcptop);
+	for (size_t i = 0; i < n; i++) {
+		for (int j = 0; j < STATS_NLEGS; j++) {
+			if (!tcptop[i].leg[j].count)
+				continue;
+			log_err_printf("TCP %s %s: rtt avg %lld us "
+			               "retransmits %lld in %lld samples\n",
+			               tcptop[i].key, stats_leg_name[j],
+			               tcptop[i].leg[j].rtt_usec /
+			               tcptop[i].leg[j].count,
+			               tcptop[i].leg[j].retrans,
+			               tcptop[i].leg[j].count);
+		}
+	}
+	pthread_mutex_unlock(&stats_tcp_mutex);
+	if (n)
+		free(tcptop);
+	if (!(p = stats_phase_sum()))
+		return;
+	for (int i = 0; i < stats_nspecs; i++) {
+		for (int j = 0; j < STATS_NPHASES; j++) {
+			const long long *h = p + STATS_PHASE(i, j);
+
+			if (!h[STATS_PHASE_COUNT])
+				continue;
+			log_err_printf("Latency %s %s: count %lld p50 %lld "
+			               "p90 %lld p99 %lld p99.9 %lld usec\n",
+			               stats_spec[i] ? stats_spec[i] : "-",
+			               stats_phase_name[j],
+			               h[STATS_PHASE_COUNT],
+			               stats_phase_quantile(h, 500),
+			               stats_phase_quantile(h, 900),
+			               stats_phase_quantile(h, 990),
+			               stats_phase_quantile(h, 999));
+		}
+	}
+	free(p);
+}
+
+/*
+ * Render a metric header in Prometheus text exposition format.
+ */
+#define STATS_PROM_HDR(buf, name, type, help) \
+	evbuffer_add_printf((buf), "# HELP sslsplit_" name " " help "\n" \
+	                           "# TYPE sslsplit_" name " " type "\n")
+
+/*
+ * Append str to buf as a Prometheus label value, escaping backslashes,
+ * double quotes and newlines.
+ */
+static int
+stats_prom_label(struct evbuffer *buf, const char *str)
+{
+	int rv = 0;
+
+	for (const char *p = str; *p; p++) {
+		if (*p == '\\' || *p == '"')
+			rv |= evbuffer_add_printf(buf, "\\%c", *p);
+		else if (*p == '\n')
+			rv |= evbuffer_add(buf, "\\n", 2);
+		else
+			rv |= evbuffer_add(buf, p, 1);
+	}
+	return rv;
+}
+
+/*
+ * Append the name and the dst and leg labels of a series of metric name
+ * for leg of destination e to buf, without the closing brace.
+ */
+static int
+stats_prom_tcp_series(struct evbuffer *buf, const char *name,
+                      const stats_tcp_entry_t *e, int leg)
+{
+	int rv = 0;
+
+	rv |= evbuffer_add_printf(buf, "sslsplit_%s{dst=\"", name);
+	rv |= stats_prom_label(buf, e->key);
+	rv |= evbuffer_add_printf(buf, "\",leg=\"%s\"", stats_leg_name[leg]);
+	return rv;
+}
+
+/*
+ * Append the round trip time histogram of leg of destination e to buf.
+ */
+static int
+stats_prom_tcp_rtt(struct evbuffer *buf, const stats_tcp_entry_t *e, int leg)
+{
+	long long cum = 0;
+	int rv = 0;
+
+	for (int i = 0; i < STATS_HIST_NBUCKETS; i++) {
+		cum += e->leg[leg].h[i];
+		rv |= stats_prom_tcp_series(buf, "destination_rtt_seconds_"
+		                            "bucket", e, leg);
+		if (i < STATS_HIST_NBUCKETS - 1) {
+			rv |= evbuffer_add_printf(buf, ",le=\"%g\"} %lld\n",
+			                          stats_hist_le[i] / 1000000.0,
+			                          cum);
+		} else {
+			rv |= evbuffer_add_printf(buf, ",le=\"+Inf\"} %lld\n",
+			                          cum);
+		}
+	}
+	rv |= stats_prom_tcp_series(buf, "destination_rtt_seconds_sum",
+	                            e, leg);
+	rv |= evbuffer_add_printf(buf, "} %.6f\n",
+	                          e->leg[leg].rtt_usec / 1000000.0);
+	rv |= stats_prom_tcp_series(buf, "destination_rtt_seconds_count",
+	                            e, leg);
+	rv |= evbuffer_add_printf(buf, "} %lld\n", e->leg[leg].count);
+	return rv;
+}
+
+/*
+ * Append the lock profiling counters in s to buf.
+ */
+static int
+stats_prom_locks(struct evbuffer *buf, const long long *s)
+{
+	static const struct {
+		const char *name;
+		const char *help;
+		int what;
+		int usec;
+	} m[] = {
+		{"lock_acquisitions_total",
+		 "Lock acquisitions by lock class.",
+		 STATS_LOCK_ACQUIRED, 0},
+		{"lock_contended_total",
+		 "Lock acquisitions that had to wait, by lock class.",
+		 STATS_LOCK_CONTENDED, 0},
+		{"lock_wait_seconds_total",
+		 "Time spent waiting to acquire locks, by lock class.",
+		 STATS_LOCK_WAIT_USEC, 1},
+		{"lock_hold_seconds_total",
+		 "Time locks were held, by lock class.",
+		 STATS_LOCK_HOLD_USEC, 1},
+		{"lock_condwaits_total",
+		 "Condition variable waits, by lock class.",
+		 STATS_LOCK_CONDWAIT, 0},
+		{"lock_condwait_seconds_total",
+		 "Time spent in condition variable waits, by lock class.",
+		 STATS_LOCK_CONDWAIT_USEC, 1},
+	};
+	int rv = 0;
+
+	for (size_t j = 0; j < sizeof(m) / sizeof(m[0]); j++) {
+		rv |= evbuffer_add_printf(buf,
+		        "# HELP sslsplit_%s %s\n# TYPE sslsplit_%s counter\n",
+		        m[j].name, m[j].help, m[j].name);
+		for (int i = 0; i < STATS_NLOCKS; i++) {
+			long long v = s[STATS_LOCK(i, m[j].what)];
+
+			if (m[j].usec) {
+				rv |= evbuffer_add_printf(buf,
+				        "sslsplit_%s{class=\"%s\"} %.6f\n",
+				        m[j].name, stats_lock_name[i],
+				        v / 1000000.0);
+			} else {
+				rv |= evbuffer_add_printf(buf,
+				        "sslsplit_%s{class=\"%s\"} %lld\n",
+				        m[j].name, stats_lock_name[i], v);
+			}
+		}
+	}
+	return rv;
+}
+
+/*
+ * Append counter i with value v and a label to buf.
+ */
+static int
+stats_prom_perf_value(struct evbuffer *buf, int i, const char *label,
+                      const char *value, long long v)
+{
+	if (i == PERFCTR_TASK_CLOCK) {
+		return evbuffer_add_printf(buf,
+		        "sslsplit_perf_%s_total{%s=\"%s\"} %.6f\n",
+		        stats_perf_ctr[i].name, label, value,
+		        v / 1000000000.0);
+	}
+	return evbuffer_add_printf(buf, "sslsplit_perf_%s_total{%s=\"%s\"} "
+	                           "%lld\n", stats_perf_ctr[i].name,
+	                           label, value, v);
+}
+
+/*
+ * Append the performance counters per phase from s and per worker thread to
+ * buf.
+ */
+static int
+stats_prom_perf(struct evbuffer *buf, const long long *s)
+{
+	unsigned long long v[PERFCTR_N];
+	stats_block_t *block;
+	perfctr_t *pc;
+	char worker[16];
+	int rv = 0;
+
+	for (int i = 0; i < PERFCTR_N; i++) {
+		if (!stats_perf_avail[i])
+			continue;
+		rv |= evbuffer_add_printf(buf,
+		        "# HELP sslsplit_perf_%s_total %s of the connection "
+		        "handling threads by phase and by thread.\n"
+		        "# TYPE sslsplit_perf_%s_total counter\n",
+		        stats_perf_ctr[i].name, stats_perf_ctr[i].help,
+		        stats_perf_ctr[i].name);
+		for (int p = 0; p < STATS_NPERFPHASES; p++) {
+			rv |= stats_prom_perf_value(buf, i, "phase",
+			                            stats_perf_phase_name[p],
+			                            s[STATS_PERF(p, i)]);
+		}
+		for (block = __atomic_load_n(&stats_blocks, __ATOMIC_ACQUIRE);
+		     block; block = block->next) {
+			if (!(pc = __atomic_load_n(&block->perf,
+			                           __ATOMIC_ACQUIRE)) ||
+			    perfctr_read(pc, v) == -1)
+				continue;
+			snprintf(worker, sizeof(worker), "%d", block->worker);
+			rv |= stats_prom_perf_value(buf, i, "thread", worker,
+			                            v[i]);
+		}
+	}
+	return rv;
+}
+
+/*
+ * Append all aggregated counters and histograms, the cache sizes, the memory
+ * accounting and the log queue statistics to buf in Prometheus text
+ * exposition format (version 0.0.4).  Returns -1 on out of memory condition,
+ * 0 on success.
+ */
+int
+stats_prometheus(struct evbuffer *buf)
+{
+	logger_stats_t st;
+	long long s[STATS_MAX], cum;
+	stats_cpu_entry_t *top;
+	stats_tcp_entry_t *tcptop;
+	size_t caches, logs, n;
+	size_t coll[STATS_NCACHES], probes[STATS_NCACHES];
+	size_t maxprobe[STATS_NCACHES];
+	const char *name;
+	long long *p;
+	int rv = 0;
+
+	stats_sum(s);
+	stats_mem_sum(&caches, &logs);
+
+	rv |= STATS_PROM_HDR(buf, "connections_accepted_total", "counter",
+	                     "Connections accepted.");
+	rv |= evbuffer_add_printf(buf, "sslsplit_connections_accepted_total "
+	                          "%lld\n", s[STATS_CONN_ACCEPTED]);
+	rv |= STATS_PROM_HDR(buf, "connections_active", "gauge",
+	                     "Connections currently open.");
+	rv |= evbuffer_add_printf(buf, "sslsplit_connections_active %lld\n",
+	                          s[STATS_CONN_ACTIVE]);
+	rv |= STATS_PROM_HDR(buf, "connections_pending", "gauge",
+	                     "Connections accepted but not yet set up.");
+	rv |= evbuffer_add_printf(buf, "sslsplit_connections_pending %lld\n",
+	                          s[STATS_CONN_PENDING]);
+	rv |= STATS_PROM_HDR(buf, "connections_timed_out_total", "counter",
+	                     "Connections closed on a connect, handshake, "
+	                     "header or idle timeout.");
+	rv |= evbuffer_add_printf(buf, "sslsplit_connections_timed_out_total "
+	                          "%lld\n", s[STATS_CONN_TIMEOUT]);
+	rv |= STATS_PROM_HDR(buf, "connections_limited_total", "counter",
+	                     "Connections over an admission limit, rejected "
+	                     "or passed through.");
+	rv |= evbuffer_add_printf(buf, "sslsplit_connections_limited_total "
+	                          "%lld\n", s[STATS_CONN_LIMITED]);
+	rv |= STATS_PROM_HDR(buf, "connections_migrated_total", "counter",
+	                     "Established connections moved to another "
+	                     "connection handling thread.");
+	rv |= evbuffer_add_printf(buf, "sslsplit_connections_migrated_total "
+	                          "%lld\n", s[STATS_CONN_MIGRATED]);
+	rv |= STATS_PROM_HDR(buf, "ssl_connections_total", "counter",
+	                     "SSL connections by outcome.");
+	rv |= evbuffer_add_printf(buf,
+	        "sslsplit_ssl_connections_total{outcome=\"split\"} %lld\n"
+	        "sslsplit_ssl_connections_total{outcome=\"passthrough\"} %lld\n"
+	        "sslsplit_ssl_connections_total{outcome=\"error\"} %lld\n",
+	        s[STATS_SSL_SPLIT], s[STATS_SSL_PASSTHROUGH],
+	        s[STATS_SSL_ERROR]);
+	rv |= STATS_PROM_HDR(buf, "ssl_mispredicted_total", "counter",
+	                     "Speculative client handshakes reset because the "
+	                     "server certificate changed.");
+	rv |= evbuffer_add_printf(buf, "sslsplit_ssl_mispredicted_total "
+	                          "%lld\n", s[STATS_SSL_MISPREDICT]);
+	rv |= STATS_PROM_HDR(buf, "ssl_reneg_limited_total", "counter",
+	                     "SSL connections over a renegotiation limit.");
+	rv |= evbuffer_add_printf(buf, "sslsplit_ssl_reneg_limited_total "
+	                          "%lld\n", s[STATS_SSL_RENEG]);
+	rv |= STATS_PROM_HDR(buf, "forges_stolen_total", "counter",
+	                     "Forging thread pool jobs run by idle connection "
+	                     "handling threads.");
+	rv |= evbuffer_add_printf(buf, "sslsplit_forges_stolen_total "
+	                          "%lld\n", s[STATS_FORGE_STOLEN]);
+	rv |= STATS_PROM_HDR(buf, "received_bytes_total", "counter",
+	                     "Octets received from clients and servers.");
+	rv |= evbuffer_add_printf(buf,
+	        "sslsplit_received_bytes_total{from=\"src\"} %lld\n"
+	        "sslsplit_received_bytes_total{from=\"dst\"} %lld\n",
+	        s[STATS_SRC_BYTES], s[STATS_DST_BYTES]);
+	rv |= STATS_PROM_HDR(buf, "drain_phase", "gauge",
+	                     "Shutdown drain phase: 0 running, 1 waiting for "
+	                     "connections, 2 flushing log queues.");
+	rv |= evbuffer_add_printf(buf, "sslsplit_drain_phase %d\n",
+	                          stats_drain_phase);
+	rv |= STATS_PROM_HDR(buf, "drain_remaining_seconds", "gauge",
+	                     "Time left in the current shutdown drain phase.");
+	rv |= evbuffer_add_printf(buf, "sslsplit_drain_remaining_seconds "
+	                          "%.3f\n", stats_drain_phase != STATS_DRAIN_NONE
+	                          ? stats_drain_left() / 1000000.0 : 0.0);
+
+	for (int h = 0; h < STATS_NHISTS; h++) {
+		rv |= evbuffer_add_printf(buf,
+		        "# HELP sslsplit_%s %s\n# TYPE sslsplit_%s histogram\n",
+		        stats_hist[h].name, stats_hist[h].help,
+		        stats_hist[h].name);
+		cum = 0;
+		for (int i = 0; i < STATS_HIST_NBUCKETS; i++) {
+			cum += s[STATS_HIST(h, i)];
+			if (i < STATS_HIST_NBUCKETS - 1) {
+				rv |= evbuffer_add_printf(buf,
+				        "sslsplit_%s_bucket{le=\"%g\"} %lld\n",
+				        stats_hist[h].name,
+				        stats_hist_le[i] / 1000000.0, cum);
+			} else {
+				rv |= evbuffer_add_printf(buf,
+				        "sslsplit_%s_bucket{le=\"+Inf\"} %lld\n",
+				        stats_hist[h].name, cum);
+			}
+		}
+		rv |= evbuffer_add_printf(buf, "sslsplit_%s_sum %.6f\n"
+		                          "sslsplit_%s_count %lld\n",
+		                          stats_hist[h].name,
+		                          s[stats_hist[h].sum] / 1000000.0,
+		                          stats_hist[h].name,
+		                          s[stats_hist[h].count]);
+	}
+
+	if (stats_lockprof)
+		rv |= stats_prom_locks(buf, s);
+	if (stats_perf)
+		rv |= stats_prom_perf(buf, s);
+
+	rv |= STATS_PROM_HDR(buf, "cache_lookups_total", "counter",
+	                     "Cache lookups by result.");
+	for (int i = 0; i < STATS_NCACHES; i++) {
+		rv |= evbuffer_add_printf(buf,
+		        "sslsplit_cache_lookups_total{cache=\"%s\","
+		        "result=\"hit\"} %lld\n"
+		        "sslsplit_cache_lookups_total{cache=\"%s\","
+		        "result=\"miss\"} %lld\n",
+		        stats_cache_name[i], s[STATS_CACHE(i, STATS_HIT)],
+		        stats_cache_name[i], s[STATS_CACHE(i, STATS_MISS)]);
+	}
+	rv |= STATS_PROM_HDR(buf, "cache_evictions_total", "counter",
+	                     "Cache entries evicted because of size limits.");
+	for (int i = 0; i < STATS_NCACHES; i++) {
+		rv |= evbuffer_add_printf(buf,
+		        "sslsplit_cache_evictions_total{cache=\"%s\"} %lld\n",
+		        stats_cache_name[i], s[STATS_CACHE(i, STATS_EVICT)]);
+	}
+	rv |= STATS_PROM_HDR(buf, "cache_demotions_total", "counter",
+	                     "Cache entries demoted to their compact form.");
+	for (int i = 0; i < STATS_NCACHES; i++) {
+		rv |= evbuffer_add_printf(buf,
+		        "sslsplit_cache_demotions_total{cache=\"%s\"} %lld\n",
+		        stats_cache_name[i], s[STATS_CACHE(i, STATS_DEMOTE)]);
+	}
+	rv |= STATS_PROM_HDR(buf, "cache_expirations_total", "counter",
+	                     "Cache entries expired by their adaptive TTL.");
+	for (int i = 0; i < STATS_NCACHES; i++) {
+		rv |= evbuffer_add_printf(buf,
+		        "sslsplit_cache_expirations_total{cache=\"%s\"} "
+		        "%lld\n",
+		        stats_cache_name[i], s[STATS_CACHE(i, STATS_EXPIRE)]);
+	}
+	rv |= STATS_PROM_HDR(buf, "cache_entries", "gauge",
+	                     "Entries currently cached.");
+	for (int i = 0; i < STATS_NCACHES; i++) {
+		if (!*stats_cache[i])
+			continue;
+		rv |= evbuffer_add_printf(buf,
+		        "sslsplit_cache_entries{cache=\"%s\"} %zu\n",
+		        stats_cache_name[i], cache_entries(*stats_cache[i]));
+	}
+
+	rv |= STATS_PROM_HDR(buf, "cache_bytes", "gauge",
+	                     "Approximate memory footprint of cached entries.");
+	for (int i = 0; i < STATS_NCACHES; i++) {
+		if (!*stats_cache[i])
+			continue;
+		rv |= evbuffer_add_printf(buf,
+		        "sslsplit_cache_bytes{cache=\"%s\"} %zu\n",
+		        stats_cache_name[i], cache_bytes(*stats_cache[i]));
+	}
+	for (int i = 0; i < STATS_NCACHES; i++) {
+		if (*stats_cache[i])
+			cache_probes(*stats_cache[i], &coll[i], &probes[i],
+			             &maxprobe[i]);
+	}
+	rv |= STATS_PROM_HDR(buf, "cache_collisions", "gauge",
+	                     "Cached entries not in their home hash bucket.");
+	for (int i = 0; i < STATS_NCACHES; i++) {
+		if (!*stats_cache[i])
+			continue;
+		rv |= evbuffer_add_printf(buf,
+		        "sslsplit_cache_collisions{cache=\"%s\"} %zu\n",
+		        stats_cache_name[i], coll[i]);
+	}
+	rv |= STATS_PROM_HDR(buf, "cache_probe_length_sum", "gauge",
+	                     "Sum of hash probe lengths of cached entries.");
+	for (int i = 0; i < STATS_NCACHES; i++) {
+		if (!*stats_cache[i])
+			continue;
+		rv |= evbuffer_add_printf(buf,
+		        "sslsplit_cache_probe_length_sum{cache=\"%s\"} %zu\n",
+		        stats_cache_name[i], probes[i]);
+	}
+	rv |= STATS_PROM_HDR(buf, "cache_probe_length_max", "gauge",
+	                     "Longest hash probe length of cached entries.");
+	for (int i = 0; i < STATS_NCACHES; i++) {
+		if (!*stats_cache[i])
+			continue;
+		rv |= evbuffer_add_printf(buf,
+		        "sslsplit_cache_probe_length_max{cache=\"%s\"} %zu\n",
+		        stats_cache_name[i], maxprobe[i]);
+	}
+	rv |= STATS_PROM_HDR(buf, "memory_bytes", "gauge",
+	                     "Approximate live memory by subsystem; caches "
+	                     "overlap with openssl.");
+	rv |= evbuffer_add_printf(buf,
+	        "sslsplit_memory_bytes{subsystem=\"connections\"} %lld\n"
+	        "sslsplit_memory_bytes{subsystem=\"libevent\"} %zu\n"
+	        "sslsplit_memory_bytes{subsystem=\"openssl\"} %zu\n"
+	        "sslsplit_memory_bytes{subsystem=\"mempool\"} %zu\n"
+	        "sslsplit_memory_bytes{subsystem=\"caches\"} %zu\n"
+	        "sslsplit_memory_bytes{subsystem=\"logs\"} %zu\n",
+	        s[STATS_CONN_MEM], mempool_bytes(MEMPOOL_EVENT),
+	        mempool_bytes(MEMPOOL_CRYPTO), mempool_bytes(MEMPOOL_CACHED),
+	        caches, logs);
+
+	rv |= STATS_PROM_HDR(buf, "log_queue_depth", "gauge",
+	                     "Log buffers queued for writing.");
+	for (size_t i = 0; log_stats_get(i, &name, &st) != -1; i++) {
+		if (!name)
+			continue;
+		rv |= evbuffer_add_printf(buf,
+		        "sslsplit_log_queue_depth{log=\"%s\"} %zu\n",
+		        name, st.depth);
+	}
+	rv |= STATS_PROM_HDR(buf, "log_queue_bytes", "gauge",
+	                     "Octets of log data queued for writing.");
+	for (size_t i = 0; log_stats_get(i, &name, &st) != -1; i++) {
+		if (!name)
+			continue;
+		rv |= evbuffer_add_printf(buf,
+		        "sslsplit_log_queue_bytes{log=\"%s\"} %zu\n",
+		        name, st.bytes);
+	}
+	rv |= STATS_PROM_HDR(buf, "log_dropped_total", "counter",
+	                     "Log buffers dropped because the log could not "
+	                     "keep up.");
+	for (size_t i = 0; log_stats_get(i, &name, &st) != -1; i++) {
+		if (!name)
+			continue;
+		rv |= evbuffer_add_printf(buf,
+		        "sslsplit_log_dropped_total{log=\"%s\"} %llu\n",
+		        name, st.dropped_bufs);
+	}
+
+	pthread_mutex_lock(&stats_cpu_mutex);
+	n = stats_cpu_top(&top);
+	if (n) {
+		rv |= STATS_PROM_HDR(buf, "destination_cpu_seconds_total",
+		                     "counter",
+		                     "CPU time spent on connections to the most "
+		                     "expensive destinations.");
+	}
+	for (size_t i = 0; i < n; i++) {
+		rv |= evbuffer_add_printf(buf, "sslsplit_destination_cpu_"
+		                               "seconds_total{sni=\"");
+		rv |= stats_prom_label(buf, top[i].key);
+		rv |= evbuffer_add_printf(buf, "\",dst=\"");
+		rv |= stats_prom_label(buf, top[i].key + strlen(top[i].key) + 1);
+		rv |= evbuffer_add_printf(buf, "\"} %.6f\n",
+		                          top[i].usec / 1000000.0);
+	}
+	if (n) {
+		rv |= STATS_PROM_HDR(buf, "destination_connections_total",
+		                     "counter",
+		                     "Connections to the most expensive "
+		                     "destinations.");
+	}
+	for (size_t i = 0; i < n; i++) {
+		rv |= evbuffer_add_printf(buf, "sslsplit_destination_"
+		                               "connections_total{sni=\"");
+		rv |= stats_prom_label(buf, top[i].key);
+		rv |= evbuffer_add_printf(buf, "\",dst=\"");
+		rv |= stats_prom_label(buf, top[i].key + strlen(top[i].key) + 1);
+		rv |= evbuffer_add_printf(buf, "\"} %lld\n", top[i].conns);
+	}
+	pthread_mutex_unlock(&stats_cpu_mutex);
+	if (n)
+		free(top);
+
+	pthread_mutex_lock(&stats_tcp_mutex);
+	n = stats_tcp_top(&tcptop);
+	if (n) {
+		rv |= STATS_PROM_HDR(buf, "destination_rtt_seconds",
+		                     "histogram",
+		                     "TCP round trip time of both legs of "
+		                     "connections to the most frequent "
+		                     "destinations, sampled at close.");
+	}
+	for (size_t i = 0; i < n; i++) {
+		for (int j = 0; j < STATS_NLEGS; j++)
+			rv |= stats_prom_tcp_rtt(buf, &tcptop[i], j);
+	}
+	if (n) {
+		rv |= STATS_PROM_HDR(buf, "destination_retransmits_total",
+		                     "counter",
+		                     "TCP segments retransmitted on both legs "
+		                     "of connections to the most frequent "
+		                     "destinations.");
+	}
+	for (size_t i = 0; i < n; i++) {
+		for (int j = 0; j < STATS_NLEGS; j++) {
+			rv |= stats_prom_tcp_series(buf, "destination_"
+			                            "retransmits_total",
+			                            &tcptop[i], j);
+			rv |= evbuffer_add_printf(buf, "} %lld\n",
+			                          tcptop[i].leg[j].retrans);
+		}
+	}
+	pthread_mutex_unlock(&stats_tcp_mutex);
+	if (n)
+		free(tcptop);
+
+	if (!(p = stats_phase_sum()))
+		return rv < 0 ? -1 : 0;
+	rv |= STATS_PROM_HDR(buf, "phase_duration_seconds", "summary",
+	                     "Duration of connection phases per proxyspec.");
+	for (int i = 0; i < stats_nspecs; i++) {
+		if (!stats_spec[i])
+			continue;
+		for (int j = 0; j < STATS_NPHASES; j++) {
+			const long long *h = p + STATS_PHASE(i, j);
+
+			for (size_t k = 0; k < sizeof(stats_phase_q) /
+			                       sizeof(stats_phase_q[0]); k++) {
+				rv |= evbuffer_add_printf(buf,
+				        "sslsplit_phase_duration_seconds{spec="
+				        "\"%s\",phase=\"%s\",quantile=\"%g\"} ",
+				        stats_spec[i], stats_phase_name[j],
+				        stats_phase_q[k] / 1000.0);
+				if (h[STATS_PHASE_COUNT]) {
+					rv |= evbuffer_add_printf(buf, "%g\n",
+					        stats_phase_quantile(h,
+					        stats_phase_q[k]) / 1000000.0);
+				} else {
+					rv |= evbuffer_add_printf(buf, "NaN\n");
+				}
+			}
+			rv |= evbuffer_add_printf(buf,
+			        "sslsplit_phase_duration_seconds_sum{spec=\"%s\","
+			        "phase=\"%s\"} %.6f\n"
+			        "sslsplit_phase_duration_seconds_count{spec="
+			        "\"%s\",phase=\"%s\"} %lld\n",
+			        stats_spec[i], stats_phase_name[j],
+			        h[STATS_PHASE_SUM] / 1000000.0,
+			        stats_spec[i], stats_phase_name[j],
+			        h[STATS_PHASE_COUNT]);
+		}
+	}
+	free(p);
+	return rv < 0 ? -1 : 0;
+}
+
+/* vim: set noet ft=c: */
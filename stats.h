@@ -0,0 +1,229 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include "attrib.h"
+#include "perfctr.h"
+
+#include <event2/buffer.h>
+
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * Caches with hit, miss, eviction and demotion counters; see cachemgr.
+ */
+#define STATS_CACHE_FKCRT	0
+#define STATS_CACHE_TGCRT	1
+#define STATS_CACHE_SSESS	2
+#define STATS_CACHE_DSESS	3
+#define STATS_CACHE_SSLCTX	4
+#define STATS_CACHE_VRFY	5
+#define STATS_CACHE_DNS		6
+#define STATS_CACHE_SNI		7
+#define STATS_CACHE_PASS	8
+#define STATS_CACHE_OCSP	9
+#define STATS_CACHE_HTTP	10
+#define STATS_NCACHES		11
+
+#define STATS_HIT		0
+#define STATS_MISS		1
+#define STATS_EVICT		2
+#define STATS_DEMOTE		3
+#define STATS_EXPIRE		4
+#define STATS_CACHE_NCTRS	5
+
+/*
+ * Latency histograms, with fixed buckets from 0.5ms to 1s plus +Inf.
+ */
+#define STATS_HIST_FORGE	0	/* forging a certificate */
+#define STATS_HIST_SETUP	1	/* accept until both ends connected */
+#define STATS_HIST_LOOPLAG	2	/* worker thread event loop lag */
+#define STATS_NHISTS		3
+#define STATS_HIST_NBUCKETS	12
+
+/*
+ * Connection legs sampled for TCP round trip times with StatsTCPInfoTop.
+ */
+#define STATS_LEG_SRC		0
+#define STATS_LEG_DST		1
+#define STATS_NLEGS		2
+
+/*
+ * Lock classes with contention counters, collected with StatsLockProfiling.
+ */
+#define STATS_LOCK_CACHE	0	/* cache shard rwlocks */
+#define STATS_LOCK_THRQUEUE	1	/* thread queue mutexes and condvars */
+#define STATS_LOCK_THRMGR	2	/* thread manager pool and shaper */
+#define STATS_LOCK_OPENSSL	3	/* OpenSSL locking callbacks */
+#define STATS_NLOCKS		4
+
+#define STATS_LOCK_ACQUIRED	0	/* acquisitions */
+#define STATS_LOCK_CONTENDED	1	/* acquisitions that had to wait */
+#define STATS_LOCK_WAIT_USEC	2	/* total time waiting to acquire */
+#define STATS_LOCK_HOLD_USEC	3	/* total time held */
+#define STATS_LOCK_CONDWAIT	4	/* condition variable waits */
+#define STATS_LOCK_CONDWAIT_USEC 5	/* total time in condition waits */
+#define STATS_LOCK_NCTRS	6
+
+/*
+ * Connection handling phases which the performance counters of the worker
+ * threads are attributed to, collected with StatsPerfCounters.  The counters
+ * are indexed by the PERFCTR_* identifiers.
+ */
+#define STATS_PERF_HANDSHAKE	0	/* connection setup and handshakes */
+#define STATS_PERF_FORWARD	1	/* forwarding data */
+#define STATS_PERF_LOG		2	/* content logging */
+#define STATS_NPERFPHASES	3
+
+/*
+ * Connection phases with log-linear latency histograms per proxyspec.
+ */
+#define STATS_PHASE_SNI		0	/* accept until SNI parsed */
+#define STATS_PHASE_NAT		1	/* NAT state table lookup */
+#define STATS_PHASE_DNS		2	/* resolving the SNI hostname */
+#define STATS_PHASE_CONNECT	3	/* upstream TCP connect */
+#define STATS_PHASE_DSTSSL	4	/* upstream TLS handshake */
+#define STATS_PHASE_CERT	5	/* cert lookup or forging */
+#define STATS_PHASE_SRCSSL	6	/* client TLS handshake */
+#define STATS_PHASE_TTFB	7	/* connected until first server octet */
+#define STATS_NPHASES		8
+
+/*
+ * Shutdown drain phases, see DrainTimeout.
+ */
+#define STATS_DRAIN_NONE	0	/* not draining */
+#define STATS_DRAIN_CONNS	1	/* waiting for connections to close */
+#define STATS_DRAIN_LOGS	2	/* waiting for log queues to empty */
+
+/*
+ * Counter identifiers.  STATS_CONN_ACTIVE and STATS_CONN_PENDING are gauges,
+ * incremented and decremented on possibly different threads, which only make
+ * sense as a sum over all threads.
+ */
+#define STATS_CONN_ACCEPTED	0	/* connections accepted */
+#define STATS_CONN_ACTIVE	1	/* connections currently open */
+#define STATS_SSL_SPLIT		2	/* SSL connections split */
+#define STATS_SSL_PASSTHROUGH	3	/* SSL connections passed through */
+#define STATS_SSL_ERROR		4	/* connections failed with SSL error */
+#define STATS_FORGE		5	/* certificates forged */
+#define STATS_FORGE_USEC	6	/* total time spent forging */
+#define STATS_SETUP		7	/* connections set up */
+#define STATS_SETUP_USEC	8	/* total time spent setting up */
+#define STATS_SRC_BYTES		9	/* octets received from clients */
+#define STATS_DST_BYTES		10	/* octets received from servers */
+#define STATS_CONN_PENDING	11	/* connections not yet set up */
+#define STATS_LOOPLAG		12	/* event loop lag samples */
+#define STATS_LOOPLAG_USEC	13	/* total event loop lag */
+#define STATS_CONN_MEM		14	/* octets of connection contexts */
+#define STATS_CONN_TIMEOUT	15	/* connections closed on timeout */
+#define STATS_CONN_LIMITED	16	/* connections over admission limits */
+#define STATS_SSL_MISPREDICT	17	/* speculative src handshakes reset */
+#define STATS_FORGE_STOLEN	18	/* forges run by connection threads */
+#define STATS_CONN_MIGRATED	19	/* connections moved between threads */
+#define STATS_SSL_RENEG		20	/* connections over reneg limits */
+#define STATS_CACHE_BASE	21
+#define STATS_CACHE(c, what)	(STATS_CACHE_BASE + (c) * STATS_CACHE_NCTRS + (what))
+#define STATS_HIST_BASE		STATS_CACHE(STATS_NCACHES, 0)
+#define STATS_HIST(h, i)	(STATS_HIST_BASE + (h) * STATS_HIST_NBUCKETS + (i))
+#define STATS_LOCK_BASE		STATS_HIST(STATS_NHISTS, 0)
+#define STATS_LOCK(l, what)	(STATS_LOCK_BASE + (l) * STATS_LOCK_NCTRS + (what))
+#define STATS_PERF_BASE		STATS_LOCK(STATS_NLOCKS, 0)
+#define STATS_PERF(p, i)	(STATS_PERF_BASE + (p) * PERFCTR_N + (i))
+#define STATS_MAX		STATS_PERF(STATS_NPERFPHASES, 0)
+
+int stats_init(int) WUNRES;
+int stats_set_spec(int, const char *) NONNULL(2) WUNRES;
+void stats_fini(void);
+
+void stats_add(int, long long);
+#define stats_inc(id) stats_add((id), 1)
+#define stats_dec(id) stats_add((id), -1)
+void stats_observe(int, long long);
+void stats_phase(int, int, long long);
+void stats_drain(int, long long);
+long long stats_usec(void) WUNRES;
+long long stats_cpu_usec(void) WUNRES;
+
+int stats_cpu_init(size_t) WUNRES;
+void stats_cpu(const char *, const char *, long long) NONNULL(2);
+
+int stats_tcp_init(size_t) WUNRES;
+void stats_tcp(const char *, int, long long, long long) NONNULL(1);
+
+extern int stats_lockprof;
+void stats_lockprof_enable(void);
+int stats_mutex_lock(pthread_mutex_t *, int) NONNULL(1);
+int stats_mutex_unlock(pthread_mutex_t *, int) NONNULL(1);
+int stats_rwlock_rdlock(pthread_rwlock_t *, int) NONNULL(1);
+int stats_rwlock_wrlock(pthread_rwlock_t *, int) NONNULL(1);
+int stats_rwlock_unlock(pthread_rwlock_t *, int) NONNULL(1);
+int stats_cond_wait(pthread_cond_t *, pthread_mutex_t *, int) NONNULL(1,2);
+int stats_cond_timedwait(pthread_cond_t *, pthread_mutex_t *,
+                         const struct timespec *, int) NONNULL(1,2,3);
+
+/*
+ * Lock operations on locks of class l, which are profiled if lock profiling
+ * was enabled before any threads were started, and cost a single branch
+ * otherwise.
+ */
+#define STATS_MUTEX_LOCK(m, l) \
+	(stats_lockprof ? stats_mutex_lock((m), (l)) : pthread_mutex_lock(m))
+#define STATS_MUTEX_UNLOCK(m, l) \
+	(stats_lockprof ? stats_mutex_unlock((m), (l)) : \
+	                  pthread_mutex_unlock(m))
+#define STATS_RWLOCK_RDLOCK(rw, l) \
+	(stats_lockprof ? stats_rwlock_rdlock((rw), (l)) : \
+	                  pthread_rwlock_rdlock(rw))
+#define STATS_RWLOCK_WRLOCK(rw, l) \
+	(stats_lockprof ? stats_rwlock_wrlock((rw), (l)) : \
+	                  pthread_rwlock_wrlock(rw))
+#define STATS_RWLOCK_UNLOCK(rw, l) \
+	(stats_lockprof ? stats_rwlock_unlock((rw), (l)) : \
+	                  pthread_rwlock_unlock(rw))
+#define STATS_COND_WAIT(c, m, l) \
+	(stats_lockprof ? stats_cond_wait((c), (m), (l)) : \
+	                  pthread_cond_wait((c), (m)))
+#define STATS_COND_TIMEDWAIT(c, m, ts, l) \
+	(stats_lockprof ? stats_cond_timedwait((c), (m), (ts), (l)) : \
+	                  pthread_cond_timedwait((c), (m), (ts)))
+
+extern int stats_perf;
+int stats_perf_enable(void) WUNRES;
+void stats_perf_worker(int);
+void stats_perf_charge(unsigned long long *, int) NONNULL(1);
+
+void stats_sum(long long *) NONNULL(1);
+void stats_log(void);
+int stats_prometheus(struct evbuffer *) NONNULL(1) WUNRES;
+
+#endif /* !STATS_H */
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,548 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "stats.h"
+#include "cachemgr.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include <event2/buffer.h>
+
+#include <check.h>
+
+#define STATS_TEST_THREADS	4
+#define STATS_TEST_ITEMS	10000
+
+static void
+stats_setup(void)
+{
+	if (stats_init(2) == -1)
+		exit(EXIT_FAILURE);
+}
+
+static void
+stats_teardown(void)
+{
+	stats_fini();
+}
+
+static void *
+stats_test_thr(UNUSED void *arg)
+{
+	for (int i = 0; i < STATS_TEST_ITEMS; i++) {
+		stats_inc(STATS_CONN_ACCEPTED);
+		stats_add(STATS_SRC_BYTES, 3);
+	}
+	return NULL;
+}
+
+START_TEST(stats_sum_01)
+{
+	long long s[STATS_MAX];
+
+	stats_sum(s);
+	fail_unless(s[STATS_CONN_ACCEPTED] == 0, "counter not zero");
+	stats_inc(STATS_CONN_ACTIVE);
+	stats_inc(STATS_CONN_ACTIVE);
+	stats_dec(STATS_CONN_ACTIVE);
+	stats_sum(s);
+	fail_unless(s[STATS_CONN_ACTIVE] == 1, "wrong gauge value");
+}
+END_TEST
+
+START_TEST(stats_sum_02)
+{
+	pthread_t thr[STATS_TEST_THREADS];
+	long long s[STATS_MAX];
+
+	for (int i = 0; i < STATS_TEST_THREADS; i++) {
+		fail_unless(!pthread_create(&thr[i], NULL, stats_test_thr,
+		                            NULL), "cannot create thread");
+	}
+	for (int i = 0; i < STATS_TEST_THREADS; i++)
+		pthread_join(thr[i], NULL);
+	stats_sum(s);
+	fail_unless(s[STATS_CONN_ACCEPTED] ==
+	            STATS_TEST_THREADS * STATS_TEST_ITEMS,
+	            "counts of exited threads lost");
+	fail_unless(s[STATS_SRC_BYTES] ==
+	            3 * STATS_TEST_THREADS * STATS_TEST_ITEMS,
+	            "wrong sum");
+}
+END_TEST
+
+START_TEST(stats_sum_03)
+{
+	long long s[STATS_MAX];
+	cachedns_val_t *val;
+
+	fail_unless(cachemgr_preinit() != -1, "cachemgr_preinit failed");
+	cache_set_limits(cachemgr_dns, 1, 0);
+	val = cachemgr_dns_get(AF_INET, "example.org");
+	fail_unless(val == NULL, "result was already in empty cache");
+	stats_sum(s);
+	fail_unless(s[STATS_CACHE(STATS_CACHE_DNS, STATS_MISS)] == 1,
+	            "miss not counted");
+	fail_unless(s[STATS_CACHE(STATS_CACHE_DNS, STATS_HIT)] == 0,
+	            "spurious hit counted");
+	cachemgr_fini();
+}
+END_TEST
+
+START_TEST(stats_sum_04)
+{
+	long long s[STATS_MAX];
+
+	stats_fini();
+	stats_inc(STATS_CONN_ACCEPTED);
+	stats_sum(s);
+	fail_unless(s[STATS_CONN_ACCEPTED] == 0, "counted while disabled");
+}
+END_TEST
+
+START_TEST(stats_prometheus_01)
+{
+	struct evbuffer *buf;
+	char *s;
+
+	stats_inc(STATS_CONN_ACCEPTED);
+	stats_observe(STATS_HIST_FORGE, 100);
+	stats_observe(STATS_HIST_FORGE, 2000);
+	stats_observe(STATS_HIST_FORGE, 5000000);
+	buf = evbuffer_new();
+	fail_unless(!!buf, "no buffer");
+	fail_unless(stats_prometheus(buf) == 0, "rendering failed");
+	evbuffer_add(buf, "", 1);
+	s = (char *)evbuffer_pullup(buf, -1);
+	fail_unless(!!strstr(s, "\nsslsplit_connections_accepted_total 1\n"),
+	            "counter missing");
+	fail_unless(!!strstr(s, "\nsslsplit_forge_duration_seconds_bucket"
+	                        "{le=\"0.0005\"} 1\n"),
+	            "first bucket wrong");
+	fail_unless(!!strstr(s, "\nsslsplit_forge_duration_seconds_bucket"
+	                        "{le=\"0.0025\"} 2\n"),
+	            "bucket not cumulative");
+	fail_unless(!!strstr(s, "\nsslsplit_forge_duration_seconds_bucket"
+	                        "{le=\"+Inf\"} 3\n"),
+	            "overflow bucket wrong");
+	fail_unless(!!strstr(s, "\nsslsplit_forge_duration_seconds_count 3\n"),
+	            "count wrong");
+	fail_unless(!!strstr(s, "\nsslsplit_forge_duration_seconds_sum "
+	                        "5.002100\n"),
+	            "sum wrong");
+	evbuffer_free(buf);
+}
+END_TEST
+
+START_TEST(stats_prometheus_02)
+{
+	struct evbuffer *buf;
+	char *s;
+
+	fail_unless(stats_set_spec(0, "spec0") == 0, "setting label failed");
+	for (int i = 0; i < 99; i++)
+		stats_phase(0, STATS_PHASE_CERT, 1000);
+	stats_phase(0, STATS_PHASE_CERT, 100000);
+	stats_phase(1, STATS_PHASE_CERT, 1000);
+	stats_phase(2, STATS_PHASE_CERT, 1000);
+	buf = evbuffer_new();
+	fail_unless(!!buf, "no buffer");
+	fail_unless(stats_prometheus(buf) == 0, "rendering failed");
+	evbuffer_add(buf, "", 1);
+	s = (char *)evbuffer_pullup(buf, -1);
+	fail_unless(!!strstr(s, "\nsslsplit_phase_duration_seconds{spec="
+	                        "\"spec0\",phase=\"cert\",quantile=\"0.5\"} "
+	                        "0.001023\n"),
+	            "median wrong");
+	fail_unless(!!strstr(s, "\nsslsplit_phase_duration_seconds{spec="
+	                        "\"spec0\",phase=\"cert\",quantile=\"0.99\"} "
+	                        "0.001023\n"),
+	            "p99 wrong");
+	fail_unless(!!strstr(s, "\nsslsplit_phase_duration_seconds{spec="
+	                        "\"spec0\",phase=\"cert\",quantile=\"0.999\"} "
+	                        "0.106495\n"),
+	            "p99.9 wrong");
+	fail_unless(!!strstr(s, "\nsslsplit_phase_duration_seconds_count{spec="
+	                        "\"spec0\",phase=\"cert\"} 100\n"),
+	            "count wrong");
+	fail_unless(!!strstr(s, "\nsslsplit_phase_duration_seconds{spec="
+	                        "\"spec0\",phase=\"sni\",quantile=\"0.5\"} "
+	                        "NaN\n"),
+	            "empty phase not NaN");
+	fail_unless(!strstr(s, "spec1"), "unlabeled spec rendered");
+	evbuffer_free(buf);
+}
+END_TEST
+
+START_TEST(stats_prometheus_03)
+{
+	struct evbuffer *buf;
+	cachedns_val_t val;
+	char *s;
+
+	fail_unless(cachemgr_preinit() != -1, "cachemgr_preinit failed");
+	memset(&val, 0, sizeof(val));
+	val.expiry = time(NULL) + 60;
+	cachemgr_dns_set(AF_INET, "example.org", &val);
+	stats_add(STATS_CONN_MEM, 4096);
+	buf = evbuffer_new();
+	fail_unless(!!buf, "no buffer");
+	fail_unless(stats_prometheus(buf) == 0, "rendering failed");
+	evbuffer_add(buf, "", 1);
+	s = (char *)evbuffer_pullup(buf, -1);
+	fail_unless(!!strstr(s, "\nsslsplit_memory_bytes{subsystem="
+	                        "\"connections\"} 4096\n"),
+	            "connection memory missing");
+	fail_unless(!!strstr(s, "\nsslsplit_memory_bytes{subsystem="
+	                        "\"openssl\"} "),
+	            "openssl memory missing");
+	fail_unless(!!strstr(s, "\nsslsplit_cache_bytes{cache=\"dns\"} "),
+	            "cache bytes missing");
+	fail_unless(!strstr(s, "\nsslsplit_cache_bytes{cache=\"dns\"} 0\n"),
+	            "cache bytes not accounted for");
+	evbuffer_free(buf);
+	cachemgr_fini();
+}
+END_TEST
+
+START_TEST(stats_prometheus_04)
+{
+	struct evbuffer *buf;
+	double left;
+	char *s, *p;
+
+	buf = evbuffer_new();
+	fail_unless(!!buf, "no buffer");
+	fail_unless(stats_prometheus(buf) == 0, "rendering failed");
+	evbuffer_add(buf, "", 1);
+	s = (char *)evbuffer_pullup(buf, -1);
+	fail_unless(!!strstr(s, "\nsslsplit_drain_phase 0\n"),
+	            "not running");
+	fail_unless(!!strstr(s, "\nsslsplit_drain_remaining_seconds 0.000\n"),
+	            "time left while running");
+	evbuffer_free(buf);
+
+	stats_drain(STATS_DRAIN_LOGS, stats_usec() + 5000000);
+	buf = evbuffer_new();
+	fail_unless(!!buf, "no buffer");
+	fail_unless(stats_prometheus(buf) == 0, "rendering failed");
+	evbuffer_add(buf, "", 1);
+	s = (char *)evbuffer_pullup(buf, -1);
+	fail_unless(!!strstr(s, "\nsslsplit_drain_phase 2\n"),
+	            "not flushing logs");
+	p = strstr(s, "\nsslsplit_drain_remaining_seconds ");
+	fail_unless(!!p, "time left missing");
+	left = strtod(p + strlen("\nsslsplit_drain_remaining_seconds "), NULL);
+	fail_unless(left > 4.0 && left <= 5.0, "time left wrong");
+	evbuffer_free(buf);
+	stats_drain(STATS_DRAIN_NONE, 0);
+}
+END_TEST
+
+START_TEST(stats_cpu_01)
+{
+	struct evbuffer *buf;
+	char dst[32];
+	char *s;
+
+	fail_unless(stats_cpu_init(2) == 0, "stats_cpu_init failed");
+	stats_cpu("a.example", "[192.0.2.1]:443", 1000000);
+	stats_cpu("a.example", "[192.0.2.1]:443", 500000);
+	stats_cpu("b\"x", "[192.0.2.2]:443", 2000000);
+	stats_cpu(NULL, "[192.0.2.3]:443", 10);
+	/* cheap destinations evict each other, not the expensive ones */
+	for (int i = 0; i < 100; i++) {
+		snprintf(dst, sizeof(dst), "[192.0.2.%d]:443", 10 + i);
+		stats_cpu(NULL, dst, 1);
+	}
+	buf = evbuffer_new();
+	fail_unless(!!buf, "no buffer");
+	fail_unless(stats_prometheus(buf) == 0, "rendering failed");
+	evbuffer_add(buf, "", 1);
+	s = (char *)evbuffer_pullup(buf, -1);
+	fail_unless(!!strstr(s, "\nsslsplit_destination_cpu_seconds_total{"
+	                        "sni=\"a.example\",dst=\"[192.0.2.1]:443\"} "
+	                        "1.500000\n"),
+	            "first destination wrong");
+	fail_unless(!!strstr(s, "\nsslsplit_destination_connections_total{"
+	                        "sni=\"a.example\",dst=\"[192.0.2.1]:443\"} "
+	                        "2\n"),
+	            "connection count wrong");
+	fail_unless(!!strstr(s, "\nsslsplit_destination_cpu_seconds_total{"
+	                        "sni=\"b\\\"x\",dst=\"[192.0.2.2]:443\"} "
+	                        "2.000000\n"),
+	            "label not escaped");
+	fail_unless(strstr(s, "b\\\"x") < strstr(s, "a.example"),
+	            "not sorted by CPU time");
+	fail_unless(!strstr(s, "192.0.2.3]"), "more than top-N rendered");
+	evbuffer_free(buf);
+}
+END_TEST
+
+START_TEST(stats_tcp_01)
+{
+	struct evbuffer *buf;
+	char dst[32];
+	char *s;
+
+	fail_unless(stats_tcp_init(1) == 0, "stats_tcp_init failed");
+	stats_tcp("[192.0.2.1]:443", STATS_LEG_SRC, 300, 0);
+	stats_tcp("[192.0.2.1]:443", STATS_LEG_DST, 20000, 3);
+	stats_tcp("[192.0.2.1]:443", STATS_LEG_DST, 40000, 1);
+	stats_tcp("[192.0.2.2]:443", STATS_LEG_DST, -1, 5);
+	/* rare destinations evict each other, not the frequent one */
+	for (int i = 0; i < 10; i++) {
+		snprintf(dst, sizeof(dst), "[192.0.2.%d]:443", 10 + i);
+		stats_tcp(dst, STATS_LEG_DST, 1000, 0);
+	}
+	buf = evbuffer_new();
+	fail_unless(!!buf, "no buffer");
+	fail_unless(stats_prometheus(buf) == 0, "rendering failed");
+	evbuffer_add(buf, "", 1);
+	s = (char *)evbuffer_pullup(buf, -1);
+	fail_unless(!!strstr(s, "\nsslsplit_destination_rtt_seconds_bucket{"
+	                        "dst=\"[192.0.2.1]:443\",leg=\"src\","
+	                        "le=\"0.0005\"} 1\n"),
+	            "src bucket wrong");
+	fail_unless(!!strstr(s, "\nsslsplit_destination_rtt_seconds_bucket{"
+	                        "dst=\"[192.0.2.1]:443\",leg=\"dst\","
+	                        "le=\"0.025\"} 1\n"),
+	            "dst bucket wrong");
+	fail_unless(!!strstr(s, "\nsslsplit_destination_rtt_seconds_bucket{"
+	                        "dst=\"[192.0.2.1]:443\",leg=\"dst\","
+	                        "le=\"+Inf\"} 2\n"),
+	            "buckets not cumulative");
+	fail_unless(!!strstr(s, "\nsslsplit_destination_rtt_seconds_sum{"
+	                        "dst=\"[192.0.2.1]:443\",leg=\"dst\"} "
+	                        "0.060000\n"),
+	            "sum wrong");
+	fail_unless(!!strstr(s, "\nsslsplit_destination_retransmits_total{"
+	                        "dst=\"[192.0.2.1]:443\",leg=\"dst\"} "
+	                        "4\n"),
+	            "retransmits wrong");
+	fail_unless(!strstr(s, "192.0.2.2]"), "sample without rtt counted");
+	fail_unless(!strstr(s, "192.0.2.10]"), "more than top-N rendered");
+	evbuffer_free(buf);
+}
+END_TEST
+
+static pthread_mutex_t stats_test_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int stats_test_locked;
+
+static void *
+stats_test_lock_thr(UNUSED void *arg)
+{
+	struct timespec ts = {0, 20000000};
+
+	STATS_MUTEX_LOCK(&stats_test_mutex, STATS_LOCK_THRMGR);
+	__atomic_store_n(&stats_test_locked, 1, __ATOMIC_RELEASE);
+	nanosleep(&ts, NULL);
+	STATS_MUTEX_UNLOCK(&stats_test_mutex, STATS_LOCK_THRMGR);
+	return NULL;
+}
+
+START_TEST(stats_lock_01)
+{
+	pthread_rwlock_t rw1 = PTHREAD_RWLOCK_INITIALIZER;
+	pthread_rwlock_t rw2 = PTHREAD_RWLOCK_INITIALIZER;
+	pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+	long long s[STATS_MAX];
+	struct evbuffer *buf;
+	struct timespec ts;
+	pthread_t thr;
+	char *str;
+
+	/* not profiled before enabling */
+	STATS_MUTEX_LOCK(&stats_test_mutex, STATS_LOCK_THRMGR);
+	STATS_MUTEX_UNLOCK(&stats_test_mutex, STATS_LOCK_THRMGR);
+	stats_sum(s);
+	fail_unless(!s[STATS_LOCK(STATS_LOCK_THRMGR, STATS_LOCK_ACQUIRED)],
+	            "profiled while disabled");
+	stats_lockprof_enable();
+
+	/* contended mutex */
+	fail_unless(pthread_create(&thr, NULL, stats_test_lock_thr,
+	                           NULL) == 0, "pthread_create failed");
+	while (!__atomic_load_n(&stats_test_locked, __ATOMIC_ACQUIRE))
+		sched_yield();
+	STATS_MUTEX_LOCK(&stats_test_mutex, STATS_LOCK_THRMGR);
+	STATS_MUTEX_UNLOCK(&stats_test_mutex, STATS_LOCK_THRMGR);
+	pthread_join(thr, NULL);
+	stats_sum(s);
+	fail_unless(s[STATS_LOCK(STATS_LOCK_THRMGR, STATS_LOCK_ACQUIRED)] == 2,
+	            "wrong acquisition count");
+	fail_unless(s[STATS_LOCK(STATS_LOCK_THRMGR, STATS_LOCK_CONTENDED)] ==
+	            1, "wrong contention count");
+	fail_unless(s[STATS_LOCK(STATS_LOCK_THRMGR, STATS_LOCK_WAIT_USEC)] >=
+	            5000, "wait time too short");
+	fail_unless(s[STATS_LOCK(STATS_LOCK_THRMGR, STATS_LOCK_HOLD_USEC)] >=
+	            15000, "hold time too short");
+
+	/* nested locks of the same class are held once */
+	STATS_RWLOCK_RDLOCK(&rw1, STATS_LOCK_CACHE);
+	STATS_RWLOCK_WRLOCK(&rw2, STATS_LOCK_CACHE);
+	STATS_RWLOCK_UNLOCK(&rw2, STATS_LOCK_CACHE);
+	STATS_RWLOCK_UNLOCK(&rw1, STATS_LOCK_CACHE);
+	STATS_RWLOCK_UNLOCK(&rw1, STATS_LOCK_CACHE);
+	stats_sum(s);
+	fail_unless(s[STATS_LOCK(STATS_LOCK_CACHE, STATS_LOCK_ACQUIRED)] == 2,
+	            "wrong nested acquisition count");
+	fail_unless(!s[STATS_LOCK(STATS_LOCK_CACHE, STATS_LOCK_CONTENDED)],
+	            "uncontended lock counted as contended");
+
+	/* condition wait time is not hold time */
+	STATS_MUTEX_LOCK(&stats_test_mutex, STATS_LOCK_THRQUEUE);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += 20000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	STATS_COND_TIMEDWAIT(&cond, &stats_test_mutex, &ts,
+	                     STATS_LOCK_THRQUEUE);
+	STATS_MUTEX_UNLOCK(&stats_test_mutex, STATS_LOCK_THRQUEUE);
+	stats_sum(s);
+	fail_unless(s[STATS_LOCK(STATS_LOCK_THRQUEUE, STATS_LOCK_CONDWAIT)] ==
+	            1, "wrong condition wait count");
+	fail_unless(s[STATS_LOCK(STATS_LOCK_THRQUEUE,
+	                         STATS_LOCK_CONDWAIT_USEC)] >= 15000,
+	            "condition wait time too short");
+	fail_unless(s[STATS_LOCK(STATS_LOCK_THRQUEUE, STATS_LOCK_HOLD_USEC)] <
+	            s[STATS_LOCK(STATS_LOCK_THRQUEUE,
+	                         STATS_LOCK_CONDWAIT_USEC)],
+	            "condition wait counted as held");
+
+	buf = evbuffer_new();
+	fail_unless(!!buf, "no buffer");
+	fail_unless(stats_prometheus(buf) == 0, "rendering failed");
+	evbuffer_add(buf, "", 1);
+	str = (char *)evbuffer_pullup(buf, -1);
+	fail_unless(!!strstr(str, "\nsslsplit_lock_contended_total{"
+	                          "class=\"thrmgr\"} 1\n"),
+	            "contention count not rendered");
+	fail_unless(!!strstr(str, "\nsslsplit_lock_acquisitions_total{"
+	                          "class=\"openssl\"} 0\n"),
+	            "lock class missing");
+	evbuffer_free(buf);
+	stats_lockprof = 0;
+}
+END_TEST
+
+START_TEST(stats_perf_01)
+{
+	unsigned long long mark[PERFCTR_N];
+	long long s[STATS_MAX];
+	struct evbuffer *buf;
+	long long t0;
+	char *str;
+
+	/* not available in all environments */
+	if (stats_perf_enable() == -1)
+		return;
+	stats_perf_worker(3);
+	memset(mark, 0, sizeof(mark));
+	stats_perf_charge(mark, STATS_PERF_FORWARD);
+	fail_unless(mark[PERFCTR_TASK_CLOCK] > 0, "mark not updated");
+	t0 = stats_cpu_usec();
+	while (stats_cpu_usec() - t0 < 2000);
+	stats_perf_charge(mark, STATS_PERF_FORWARD);
+	stats_sum(s);
+	fail_unless(s[STATS_PERF(STATS_PERF_FORWARD, PERFCTR_TASK_CLOCK)] >=
+	            1000000, "task clock not charged");
+	fail_unless(!s[STATS_PERF(STATS_PERF_LOG, PERFCTR_TASK_CLOCK)],
+	            "charged to wrong phase");
+
+	buf = evbuffer_new();
+	fail_unless(!!buf, "no buffer");
+	fail_unless(stats_prometheus(buf) == 0, "rendering failed");
+	evbuffer_add(buf, "", 1);
+	str = (char *)evbuffer_pullup(buf, -1);
+	fail_unless(!!strstr(str, "\nsslsplit_perf_cpu_seconds_total{"
+	                          "phase=\"forward\"} 0.00"),
+	            "phase not rendered");
+	fail_unless(!!strstr(str, "\nsslsplit_perf_cpu_seconds_total{"
+	                          "thread=\"3\"} "),
+	            "thread not rendered");
+	evbuffer_free(buf);
+	stats_perf = 0;
+}
+END_TEST
+
+Suite *
+stats_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("stats");
+
+	tc = tcase_create("stats_sum");
+	tcase_add_checked_fixture(tc, stats_setup, stats_teardown);
+	tcase_add_test(tc, stats_sum_01);
+	tcase_add_test(tc, stats_sum_02);
+	tcase_add_test(tc, stats_sum_03);
+	tcase_add_test(tc, stats_sum_04);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("stats_prometheus");
+	tcase_add_checked_fixture(tc, stats_setup, stats_teardown);
+	tcase_add_test(tc, stats_prometheus_01);
+	tcase_add_test(tc, stats_prometheus_02);
+	tcase_add_test(tc, stats_prometheus_03);
+	tcase_add_test(tc, stats_prometheus_04);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("stats_cpu");
+	tcase_add_checked_fixture(tc, stats_setup, stats_teardown);
+	tcase_add_test(tc, stats_cpu_01);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("stats_tcp");
+	tcase_add_checked_fixture(tc, stats_setup, stats_teardown);
+	tcase_add_test(tc, stats_tcp_01);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("stats_lock");
+	tcase_add_checked_fixture(tc, stats_setup, stats_teardown);
+	tcase_add_test(tc, stats_lock_01);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("stats_perf");
+	tcase_add_checked_fixture(tc, stats_setup, stats_teardown);
+	tcase_add_test(tc, stats_perf_01);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
@@ -41,13 +41,16 @@
 #include <sys/time.h>
 #include <net/if.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <netdb.h>
 #include <fcntl.h>
 #include <pwd.h>
 #include <grp.h>
 #include <fts.h>
+#include <dirent.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
@@ -56,6 +59,17 @@
 #include <sys/sysctl.h>
 #endif /* !_SC_NPROCESSORS_ONLN */
 
+#if defined(__linux__)
+#include <sched.h>
+#include <pthread.h>
+#include <linux/filter.h>
+#elif defined(__FreeBSD__)
+#include <sys/param.h>
+#include <sys/cpuset.h>
+#include <pthread.h>
+#include <pthread_np.h>
+#endif
+
 #if HAVE_DARWIN_LIBPROC
 #include <libproc.h>
 #endif
@@ -470,7 +484,6 @@ sys_sockaddr_str(struct sockaddr *addr, socklen_t addrlen,
                  char **host, char **serv)
 {
 	char tmphost[INET6_ADDRSTRLEN];
-	int rv;
 	size_t hostsz;
 
 	*serv = malloc(6); /* max decimal digits of short plus terminator */
@@ -478,13 +491,8 @@ sys_sockaddr_str(struct sockaddr *addr, socklen_t addrlen,
 		log_err_printf("Cannot allocate memory\n");
 		return -1;
 	}
-	rv = getnameinfo(addr, addrlen,
-	                 tmphost, sizeof(tmphost),
-	                 *serv, 6,
-	                 NI_NUMERICHOST | NI_NUMERICSERV);
-	if (rv != 0) {
-		log_err_printf("Cannot get nameinfo for socket address: %s\n",
-		               gai_strerror(rv));
+	if (sys_sockaddr_ntop(addr, addrlen, tmphost, sizeof(tmphost),
+	                      *serv, 6) == -1) {
 		free(*serv);
 		return -1;
 	}
@@ -499,6 +507,57 @@ sys_sockaddr_str(struct sockaddr *addr, socklen_t addrlen,
 	return 0;
 }
 
+/*
+ * Like sys_sockaddr_str(), but writes the printable string representations
+ * of the host and the service part into the caller-supplied buffers host and
+ * serv of size hostsz and servsz.  INET6_ADDRSTRLEN and 6 octets are always
+ * sufficient.  Plain IPv4 and IPv6 addresses are formatted using inet_ntop()
+ * instead of the much slower getnameinfo(); IPv6 addresses with a scope are
+ * left to getnameinfo() for the scope suffix.
+ * Returns 0 on success, -1 otherwise.
+ */
+int
+sys_sockaddr_ntop(struct sockaddr *addr, socklen_t addrlen,
+                  char *host, size_t hostsz, char *serv, size_t servsz)
+{
+	const void *src = NULL;
+	unsigned int port = 0;
+	char buf[6], *p;
+	int rv;
+
+	if (addr->sa_family == AF_INET &&
+	    addrlen >= (socklen_t)sizeof(struct sockaddr_in)) {
+		src = &((struct sockaddr_in *)addr)->sin_addr;
+		port = ntohs(((struct sockaddr_in *)addr)->sin_port);
+	} else if (addr->sa_family == AF_INET6 &&
+	           addrlen >= (socklen_t)sizeof(struct sockaddr_in6) &&
+	           !((struct sockaddr_in6 *)addr)->sin6_scope_id) {
+		src = &((struct sockaddr_in6 *)addr)->sin6_addr;
+		port = ntohs(((struct sockaddr_in6 *)addr)->sin6_port);
+	}
+	if (src && inet_ntop(addr->sa_family, src, host, hostsz)) {
+		p = buf + sizeof(buf);
+		*--p = '\0';
+		do {
+			*--p = '0' + port % 10;
+			port /= 10;
+		} while (port);
+		if ((size_t)(buf + sizeof(buf) - p) <= servsz) {
+			memcpy(serv, p, buf + sizeof(buf) - p);
+			return 0;
+		}
+	}
+
+	rv = getnameinfo(addr, addrlen, host, hostsz, serv, servsz,
+	                 NI_NUMERICHOST | NI_NUMERICSERV);
+	if (rv != 0) {
+		log_err_printf("Cannot get nameinfo for socket address: %s\n",
+		               gai_strerror(rv));
+		return -1;
+	}
+	return 0;
+}
+
 /*
  * Sanitizes a valid IPv4 or IPv6 address for use in a filename, i.e. removes
  * characters that are invalid on NTFS and replaces them with more innocent
@@ -627,6 +686,54 @@ sys_mkpath(const char *path, mode_t mode)
 	return 0;
 }
 
+/*
+ * Open or create file path relative to directory dirfd for reading and
+ * writing, positioned at the end of the file.  If mkpath is set and the
+ * file cannot be opened because parent directories are missing, they are
+ * created with mode dirmode and the open is retried; opening files in
+ * existing directories costs a single openat().  Path must be relative and
+ * must not contain dot-dot components.
+ * Returns the file descriptor on success, -1 and sets errno on error.
+ */
+int
+sys_openat_mkpath(int dirfd, const char *path, int mkpath,
+                  mode_t dirmode, mode_t filemode)
+{
+	size_t len = strlen(path);
+	char parent[len+1];
+	char *p;
+	int fd, tmp;
+
+	if (path[0] == '/' || !strcmp(path, "..") ||
+	    !strncmp(path, "../", 3) || strstr(path, "/../") ||
+	    (len >= 3 && !strcmp(path + len - 3, "/.."))) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	fd = openat(dirfd, path, O_RDWR|O_CREAT, filemode);
+	if (fd == -1 && mkpath && errno == ENOENT) {
+		memcpy(parent, path, sizeof(parent));
+		for (p = strchr(parent, '/'); p; p = strchr(p + 1, '/')) {
+			*p = '\0';
+			if (mkdirat(dirfd, parent, dirmode) == -1 &&
+			    errno != EEXIST)
+				return -1;
+			*p = '/';
+		}
+		fd = openat(dirfd, path, O_RDWR|O_CREAT, filemode);
+	}
+	if (fd == -1)
+		return -1;
+	if (lseek(fd, 0, SEEK_END) == -1) {
+		tmp = errno;
+		close(fd);
+		errno = tmp;
+		return -1;
+	}
+	return fd;
+}
+
 /*
  * Return realpath(dirname(path)) + / + basename(path) in a newly allocated
  * string.  Returns NULL on failure and sets errno to ENOENT if the directory
@@ -753,6 +860,224 @@ sys_get_cpu_cores(void)
 #endif /* !_SC_NPROCESSORS_ONLN */
 }
 
+/*
+ * Pin the calling thread to a single CPU.
+ * Returns 0 on success, -1 on failure with errno set; fails with ENOTSUP on
+ * platforms without support for thread CPU affinity.
+ */
+int
+sys_thread_setcpu(int cpu)
+{
+#if defined(__linux__)
+	cpu_set_t set;
+	int rv;
+
+	if (cpu < 0 || cpu >= CPU_SETSIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	rv = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (rv) {
+		errno = rv;
+		return -1;
+	}
+	return 0;
+#elif defined(__FreeBSD__)
+	cpuset_t set;
+	int rv;
+
+	if (cpu < 0 || cpu >= CPU_SETSIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	rv = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (rv) {
+		errno = rv;
+		return -1;
+	}
+	return 0;
+#else
+	(void)cpu;
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+/*
+ * Look up the NUMA node a CPU belongs to.
+ * Returns the node number, or -1 if unknown or not supported.
+ */
+int
+sys_get_cpu_node(int cpu)
+{
+#if defined(__linux__)
+	char path[64];
+	struct dirent *ent;
+	DIR *dir;
+	int node = -1;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	if (!(dir = opendir(path)))
+		return -1;
+	while ((ent = readdir(dir))) {
+		if (!strncmp(ent->d_name, "node", 4) &&
+		    ent->d_name[4] >= '0' && ent->d_name[4] <= '9') {
+			node = atoi(ent->d_name + 4);
+			break;
+		}
+	}
+	closedir(dir);
+	return node;
+#else
+	(void)cpu;
+	return -1;
+#endif
+}
+
+/*
+ * Attach a classic BPF program to the SO_REUSEPORT group of listener socket
+ * fd which selects the socket at index i of the group for connections whose
+ * packets were received on CPU cpus[i].  Sockets with cpus[i] set to -1 are
+ * never selected by CPU.  If several sockets share a CPU, connections are
+ * spread across them by the receive hash of the packet.  Connections received
+ * on CPUs not in cpus fall back to the regular hash based selection of the
+ * kernel.  Sockets are indexed in the order they started listening in.
+ * Returns 0 on success, -1 on error with errno set.
+ */
+int
+sys_reuseport_steer(int fd, const int *cpus, int n)
+{
+#ifdef HAVE_REUSEPORT_CBPF
+	struct sock_filter *code, *p;
+	struct sock_fprog prog;
+	int rv;
+
+	/* at most ld, jeq, ld, mod and jeq, ret per socket, plus final ret */
+	if (n < 0 || n > (BPF_MAXINSNS - 1) / 6) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!(code = malloc((n * 6 + 1) * sizeof(struct sock_filter))))
+		return -1;
+	p = code;
+	for (int i = 0; i < n; i++) {
+		int idx[n], m = 0, skip;
+
+		if (cpus[i] < 0)
+			continue;
+		/* handle each CPU once, at its first socket */
+		for (int j = 0; j < n; j++) {
+			if (cpus[j] != cpus[i])
+				continue;
+			if (j < i)
+				break;
+			idx[m++] = j;
+		}
+		if (m == 0)
+			continue;
+		skip = m == 1 ? 1 : 2 + 2 * (m - 1) + 1;
+		*p++ = (struct sock_filter)BPF_STMT(BPF_LD|BPF_W|BPF_ABS,
+		                                    SKF_AD_OFF + SKF_AD_CPU);
+		*p++ = (struct sock_filter)BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K,
+		                                    cpus[i], 0, skip);
+		if (m > 1) {
+			*p++ = (struct sock_filter)BPF_STMT(
+			       BPF_LD|BPF_W|BPF_ABS,
+			       SKF_AD_OFF + SKF_AD_RXHASH);
+			*p++ = (struct sock_filter)BPF_STMT(
+			       BPF_ALU|BPF_MOD|BPF_K, m);
+			for (int k = 0; k < m - 1; k++) {
+				*p++ = (struct sock_filter)BPF_JUMP(
+				       BPF_JMP|BPF_JEQ|BPF_K, k, 0, 1);
+				*p++ = (struct sock_filter)BPF_STMT(
+				       BPF_RET|BPF_K, idx[k]);
+			}
+		}
+		*p++ = (struct sock_filter)BPF_STMT(BPF_RET|BPF_K, idx[m - 1]);
+	}
+	/* out of range index makes the kernel fall back to hashing */
+	*p++ = (struct sock_filter)BPF_STMT(BPF_RET|BPF_K, 0xffffffff);
+
+	prog.len = p - code;
+	prog.filter = code;
+	rv = setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+	                &prog, sizeof(prog));
+	free(code);
+	return rv;
+#else /* !HAVE_REUSEPORT_CBPF */
+	(void)fd;
+	(void)cpus;
+	(void)n;
+	errno = ENOTSUP;
+	return -1;
+#endif /* !HAVE_REUSEPORT_CBPF */
+}
+
+/*
+ * Read the round trip time, retransmit count, congestion window and delivery
+ * rate of TCP socket fd into ti.  Values not available on the platform or
+ * the running kernel are set to -1.  Returns 0 on success, -1 on failure
+ * with errno set and all values set to -1; fails with ENOTSUP on platforms
+ * without TCP_INFO.
+ */
+int
+sys_tcpinfo(int fd, sys_tcpinfo_t *ti)
+{
+#if defined(__linux__)
+	/* the libc struct ends before the fields added in Linux 4.x; the
+	 * kernel only ever appends fields and copies as much as fits */
+	struct linux_tcp_info {
+		struct tcp_info ti;
+		uint64_t pacing_rate;
+		uint64_t max_pacing_rate;
+		uint64_t bytes_acked;
+		uint64_t bytes_received;
+		uint32_t segs_out;
+		uint32_t segs_in;
+		uint32_t notsent_bytes;
+		uint32_t min_rtt;
+		uint32_t data_segs_in;
+		uint32_t data_segs_out;
+		uint64_t delivery_rate;
+	} info;
+	socklen_t len = sizeof(info);
+#elif defined(__FreeBSD__)
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+#endif
+
+	ti->rtt = ti->rttvar = ti->retrans = ti->cwnd = ti->rate = -1;
+#if defined(__linux__)
+	memset(&info, 0, sizeof(info));
+	if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == -1)
+		return -1;
+	ti->rtt = info.ti.tcpi_rtt;
+	ti->rttvar = info.ti.tcpi_rttvar;
+	ti->retrans = info.ti.tcpi_total_retrans;
+	ti->cwnd = (long long)info.ti.tcpi_snd_cwnd * info.ti.tcpi_snd_mss;
+	if (len >= offsetof(struct linux_tcp_info, delivery_rate) +
+	           sizeof(info.delivery_rate))
+		ti->rate = info.delivery_rate;
+	return 0;
+#elif defined(__FreeBSD__)
+	if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == -1)
+		return -1;
+	ti->rtt = info.tcpi_rtt;
+	ti->rttvar = info.tcpi_rttvar;
+	ti->retrans = info.tcpi_snd_rexmitpack;
+	ti->cwnd = info.tcpi_snd_cwnd;
+	return 0;
+#else
+	(void)fd;
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
 /*
  * Send a message and optional file descriptor on a connected AF_UNIX
  * SOCKET_DGRAM socket s.  Returns the return value of sendmsg().
@@ -810,8 +1135,8 @@ sys_sendmsgfd(int sock, void *buf, size_t bufsz, int fd)
  * If pfd is NULL, no file descriptor is received; if a file descriptor was
  * part of the received message and pfd is NULL, then the kernel will close it.
  */
-ssize_t
-sys_recvmsgfd(int sock, void *buf, size_t bufsz, int *pfd)
+static ssize_t
+sys_recvmsgfd_flags(int sock, void *buf, size_t bufsz, int *pfd, int flags)
 {
 	ssize_t n;
 
@@ -831,7 +1156,7 @@ sys_recvmsgfd(int sock, void *buf, size_t bufsz, int *pfd)
 		msg.msg_control = cmsgbuf;
 		msg.msg_controllen = sizeof(cmsgbuf);
 		do {
-			n = recvmsg(sock, &msg, 0);
+			n = recvmsg(sock, &msg, flags);
 		} while (n == -1 && errno == EINTR);
 		if (n <= 0)
 			return n;
@@ -851,12 +1176,59 @@ sys_recvmsgfd(int sock, void *buf, size_t bufsz, int *pfd)
 		}
 	} else {
 		do {
-			n = recv(sock, buf, bufsz, 0);
+			n = recv(sock, buf, bufsz, flags);
 		} while (n == -1 && errno == EINTR);
 	}
 	return n;
 }
 
+ssize_t
+sys_recvmsgfd(int sock, void *buf, size_t bufsz, int *pfd)
+{
+	return sys_recvmsgfd_flags(sock, buf, bufsz, pfd, 0);
+}
+
+/*
+ * Like sys_recvmsgfd(), but without blocking; returns -1 with errno set to
+ * EAGAIN or EWOULDBLOCK if no message is available.
+ */
+ssize_t
+sys_recvmsgfd_nb(int sock, void *buf, size_t bufsz, int *pfd)
+{
+	return sys_recvmsgfd_flags(sock, buf, bufsz, pfd, MSG_DONTWAIT);
+}
+
+/*
+ * Write all iovcnt buffers in iov to fd using as few writev() calls as
+ * possible, retrying after partial writes and EINTR.  Iov is modified.
+ * Returns -1 on errors and sets errno, the total number of bytes written
+ * otherwise.
+ */
+ssize_t
+sys_writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t n, total = 0;
+
+	while (iovcnt > 0) {
+		do {
+			n = writev(fd, iov, iovcnt);
+		} while (n == -1 && errno == EINTR);
+		if (n == -1)
+			return -1;
+		total += n;
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return total;
+}
+
 /*
  * Format AF_UNIX socket address into printable string.
  * Returns newly allocated string that must be freed by caller.
@@ -33,8 +33,21 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdint.h>
 
+/* server and client side TCP Fast Open as on Linux 4.11 and later */
+#if defined(TCP_FASTOPEN) && defined(TCP_FASTOPEN_CONNECT)
+#define HAVE_TCP_FASTOPEN
+#endif /* TCP_FASTOPEN && TCP_FASTOPEN_CONNECT */
+
+/* SO_REUSEPORT group socket selection by classic BPF as on Linux 4.5+ */
+#if defined(__linux__) && defined(SO_ATTACH_REUSEPORT_CBPF)
+#define HAVE_REUSEPORT_CBPF
+#endif /* __linux__ && SO_ATTACH_REUSEPORT_CBPF */
+
 int sys_privdrop(const char *, const char *, const char *) WUNRES;
 
 int sys_pidf_open(const char *) NONNULL(1) WUNRES;
@@ -54,20 +67,39 @@ int sys_sockaddr_parse(struct sockaddr_storage *, socklen_t *,
                        char *, char *, int, int) NONNULL(1,2,3,4) WUNRES;
 int sys_sockaddr_str(struct sockaddr *, socklen_t,
                      char **, char **) NONNULL(1,3,4);
+int sys_sockaddr_ntop(struct sockaddr *, socklen_t,
+                      char *, size_t, char *, size_t) NONNULL(1,3,5);
 char * sys_ip46str_sanitize(const char *) NONNULL(1) MALLOC;
 size_t sys_get_mtu(const char *);
 
 int sys_isdir(const char *) NONNULL(1) WUNRES;
 int sys_mkpath(const char *, mode_t) NONNULL(1) WUNRES;
+int sys_openat_mkpath(int, const char *, int, mode_t, mode_t)
+    NONNULL(2) WUNRES;
 char * sys_realdir(const char *) NONNULL(1) MALLOC;
 
 typedef int (*sys_dir_eachfile_cb_t)(const char *, void *) NONNULL(1) WUNRES;
 int sys_dir_eachfile(const char *, sys_dir_eachfile_cb_t, void *) NONNULL(1,2) WUNRES;
 
 uint32_t sys_get_cpu_cores(void) WUNRES;
+int sys_thread_setcpu(int) WUNRES;
+int sys_get_cpu_node(int) WUNRES;
+int sys_reuseport_steer(int, const int *, int) NONNULL(2) WUNRES;
+
+typedef struct sys_tcpinfo {
+	long long rtt;          /* smoothed round trip time in microseconds */
+	long long rttvar;       /* round trip time variation in microseconds */
+	long long retrans;      /* retransmitted segments in total */
+	long long cwnd;         /* congestion window in octets */
+	long long rate;         /* recent delivery rate in octets per second */
+} sys_tcpinfo_t;
+
+int sys_tcpinfo(int, sys_tcpinfo_t *) NONNULL(2) WUNRES;
 
 ssize_t sys_sendmsgfd(int, void *, size_t, int) NONNULL(2) WUNRES;
 ssize_t sys_recvmsgfd(int, void *, size_t, int *) NONNULL(2) WUNRES;
+ssize_t sys_recvmsgfd_nb(int, void *, size_t, int *) NONNULL(2) WUNRES;
+ssize_t sys_writev_all(int, struct iovec *, int) NONNULL(2) WUNRES;
 
 void sys_dump_fds(void);
 
@@ -38,6 +38,11 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef HAVE_REUSEPORT_CBPF
+#include <sched.h>
+#endif /* HAVE_REUSEPORT_CBPF */
 
 #include <check.h>
 
@@ -175,6 +180,46 @@ START_TEST(sys_mkpath_01)
 }
 END_TEST
 
+START_TEST(sys_openat_mkpath_01)
+{
+	char *fn;
+	int dirfd, fd, rv;
+
+	dirfd = open(basedir, O_RDONLY|O_DIRECTORY);
+	fail_unless(dirfd != -1, "open dir failed");
+	fd = sys_openat_mkpath(dirfd, "x/yy/zzz.log", 1,
+	                       DFLT_DIRMODE, DFLT_FILEMODE);
+	fail_unless(fd != -1, "sys_openat_mkpath failed");
+	fail_unless(write(fd, "abc", 3) == 3, "write failed");
+	close(fd);
+	fd = sys_openat_mkpath(dirfd, "x/yy/zzz.log", 0,
+	                       DFLT_DIRMODE, DFLT_FILEMODE);
+	fail_unless(fd != -1, "sys_openat_mkpath reopen failed");
+	fail_unless(lseek(fd, 0, SEEK_CUR) == 3, "not at end of file");
+	close(fd);
+	fd = sys_openat_mkpath(dirfd, "x/yy/other.log", 1,
+	                       DFLT_DIRMODE, DFLT_FILEMODE);
+	fail_unless(fd != -1, "sys_openat_mkpath existing dir failed");
+	close(fd);
+	fail_unless(sys_openat_mkpath(dirfd, "x/nope/zzz.log", 0,
+	                              DFLT_DIRMODE, DFLT_FILEMODE) == -1,
+	            "missing dir created without mkpath");
+	fail_unless(errno == ENOENT, "errno not ENOENT");
+	rv = asprintf(&fn, "%s/x/yy/zzz.log", basedir);
+	fail_unless((rv != -1) && !!fn, "asprintf failed");
+	fail_unless(!sys_isdir(fn), "file is dir");
+	free(fn);
+	fail_unless(sys_openat_mkpath(dirfd, "x/../../escape.log", 1,
+	                              DFLT_DIRMODE, DFLT_FILEMODE) == -1,
+	            "dot-dot not rejected");
+	fail_unless(errno == EINVAL, "errno not EINVAL");
+	fail_unless(sys_openat_mkpath(dirfd, "/tmp/abs.log", 0,
+	                              DFLT_DIRMODE, DFLT_FILEMODE) == -1,
+	            "absolute path not rejected");
+	close(dirfd);
+}
+END_TEST
+
 START_TEST(sys_realdir_01)
 {
 	char *rd;
@@ -315,6 +360,182 @@ START_TEST(sys_ip46str_sanitize_03)
 END_TEST
 
 
+START_TEST(sys_writev_all_01)
+{
+	struct iovec iov[3];
+	char buf[16];
+	int fds[2];
+
+	fail_unless(pipe(fds) == 0, "pipe failed");
+	iov[0].iov_base = "123";
+	iov[0].iov_len = 3;
+	iov[1].iov_base = "";
+	iov[1].iov_len = 0;
+	iov[2].iov_base = "456789";
+	iov[2].iov_len = 6;
+	fail_unless(sys_writev_all(fds[1], iov, 3) == 9, "wrong length");
+	close(fds[1]);
+	fail_unless(read(fds[0], buf, sizeof(buf)) == 9, "wrong read length");
+	fail_unless(!memcmp(buf, "123456789", 9), "wrong data");
+	close(fds[0]);
+}
+END_TEST
+
+START_TEST(sys_sockaddr_ntop_01)
+{
+	struct sockaddr_in sin;
+	char host[INET6_ADDRSTRLEN], serv[6];
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(65535);
+	sin.sin_addr.s_addr = htonl(0xC0A80001);
+	fail_unless(sys_sockaddr_ntop((struct sockaddr *)&sin, sizeof(sin),
+	                              host, sizeof(host),
+	                              serv, sizeof(serv)) == 0,
+	            "failed");
+	fail_unless(!strcmp(host, "192.168.0.1"), "wrong host");
+	fail_unless(!strcmp(serv, "65535"), "wrong serv");
+	sin.sin_port = htons(0);
+	fail_unless(sys_sockaddr_ntop((struct sockaddr *)&sin, sizeof(sin),
+	                              host, sizeof(host),
+	                              serv, sizeof(serv)) == 0,
+	            "failed");
+	fail_unless(!strcmp(serv, "0"), "wrong serv");
+}
+END_TEST
+
+START_TEST(sys_sockaddr_ntop_02)
+{
+	struct sockaddr_in6 sin6;
+	char host[INET6_ADDRSTRLEN], serv[6];
+
+	memset(&sin6, 0, sizeof(sin6));
+	sin6.sin6_family = AF_INET6;
+	sin6.sin6_port = htons(443);
+	fail_unless(inet_pton(AF_INET6, "2001:db8::1", &sin6.sin6_addr) == 1,
+	            "inet_pton failed");
+	fail_unless(sys_sockaddr_ntop((struct sockaddr *)&sin6, sizeof(sin6),
+	                              host, sizeof(host),
+	                              serv, sizeof(serv)) == 0,
+	            "failed");
+	fail_unless(!strcmp(host, "2001:db8::1"), "wrong host");
+	fail_unless(!strcmp(serv, "443"), "wrong serv");
+}
+END_TEST
+
+START_TEST(sys_tcpinfo_01)
+{
+	struct sockaddr_in sin;
+	socklen_t sinlen = sizeof(sin);
+	sys_tcpinfo_t ti;
+	int l, c, a;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	l = socket(AF_INET, SOCK_STREAM, 0);
+	fail_unless(l != -1, "socket failed");
+	fail_unless(!bind(l, (struct sockaddr *)&sin, sinlen), "bind failed");
+	fail_unless(!listen(l, 1), "listen failed");
+	fail_unless(!getsockname(l, (struct sockaddr *)&sin, &sinlen),
+	            "getsockname failed");
+	c = socket(AF_INET, SOCK_STREAM, 0);
+	fail_unless(c != -1, "socket failed");
+	fail_unless(!connect(c, (struct sockaddr *)&sin, sinlen),
+	            "connect failed");
+	fail_unless((a = accept(l, NULL, NULL)) != -1, "accept failed");
+	if (sys_tcpinfo(c, &ti) == -1) {
+		fail_unless(errno == ENOTSUP, "failed on connected socket");
+		fail_unless(ti.rtt == -1, "rtt set on failure");
+	} else {
+		fail_unless(ti.rtt >= 0, "no rtt");
+		fail_unless(ti.retrans == 0, "retransmits on loopback");
+		fail_unless(ti.cwnd > 0, "no cwnd");
+	}
+	fail_unless(sys_tcpinfo(-1, &ti) == -1, "succeeded on bad fd");
+	fail_unless(ti.rtt == -1 && ti.rate == -1, "values set on failure");
+	close(a);
+	close(c);
+	close(l);
+}
+END_TEST
+
+#ifdef HAVE_REUSEPORT_CBPF
+START_TEST(sys_reuseport_steer_01)
+{
+	struct sockaddr_in sin;
+	socklen_t sinlen = sizeof(sin);
+	int fd[2], cpus[2], one = 1;
+
+	/* loopback packets are received on the CPU of the sender */
+	fail_unless((cpus[1] = sched_getcpu()) >= 0, "sched_getcpu failed");
+	fail_unless(sys_thread_setcpu(cpus[1]) == 0, "setcpu failed");
+	cpus[0] = -1;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	for (int i = 0; i < 2; i++) {
+		fd[i] = socket(AF_INET, SOCK_STREAM, 0);
+		fail_unless(fd[i] != -1, "socket failed");
+		fail_unless(!setsockopt(fd[i], SOL_SOCKET, SO_REUSEPORT,
+		                        &one, sizeof(one)), "reuseport failed");
+		fail_unless(!bind(fd[i], (struct sockaddr *)&sin, sinlen),
+		            "bind failed");
+		fail_unless(!listen(fd[i], 16), "listen failed");
+		fail_unless(!getsockname(fd[i], (struct sockaddr *)&sin,
+		                         &sinlen), "getsockname failed");
+		fail_unless(fcntl(fd[i], F_SETFL, O_NONBLOCK) != -1,
+		            "fcntl failed");
+	}
+	fail_unless(sys_reuseport_steer(fd[0], cpus, 2) == 0,
+	            "steer failed");
+
+	for (int i = 0; i < 8; i++) {
+		int c, a;
+
+		c = socket(AF_INET, SOCK_STREAM, 0);
+		fail_unless(c != -1, "socket failed");
+		fail_unless(!connect(c, (struct sockaddr *)&sin, sinlen),
+		            "connect failed");
+		fail_unless((a = accept(fd[1], NULL, NULL)) != -1,
+		            "not steered to listener of CPU");
+		fail_unless(accept(fd[0], NULL, NULL) == -1,
+		            "steered to wrong listener");
+		close(a);
+		close(c);
+	}
+	close(fd[0]);
+	close(fd[1]);
+}
+END_TEST
+
+START_TEST(sys_reuseport_steer_02)
+{
+	struct sockaddr_in sin;
+	int fd, one = 1, cpus[3] = {0, -1, 0};
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	fail_unless(fd != -1, "socket failed");
+	fail_unless(sys_reuseport_steer(fd, cpus, 3) == -1,
+	            "succeeded on non-reuseport socket");
+
+	/* CPU shared by several sockets */
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	fail_unless(!setsockopt(fd, SOL_SOCKET, SO_REUSEPORT,
+	                        &one, sizeof(one)), "reuseport failed");
+	fail_unless(!bind(fd, (struct sockaddr *)&sin, sizeof(sin)),
+	            "bind failed");
+	fail_unless(!listen(fd, 16), "listen failed");
+	fail_unless(sys_reuseport_steer(fd, cpus, 3) == 0, "steer failed");
+	close(fd);
+}
+END_TEST
+#endif /* HAVE_REUSEPORT_CBPF */
+
 Suite *
 sys_suite(void)
 {
@@ -335,6 +556,7 @@ sys_suite(void)
 	tc = tcase_create("sys_mkpath");
 	tcase_add_unchecked_fixture(tc, sys_mkpath_setup, sys_mkpath_teardown);
 	tcase_add_test(tc, sys_mkpath_01);
+	tcase_add_test(tc, sys_openat_mkpath_01);
 	suite_add_tcase(s, tc);
 
 	tc = tcase_create("sys_realdir");
@@ -370,6 +592,26 @@ sys_suite(void)
 	tcase_add_test(tc, sys_ip46str_sanitize_03);
 	suite_add_tcase(s, tc);
 
+	tc = tcase_create("sys_writev_all");
+	tcase_add_test(tc, sys_writev_all_01);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("sys_sockaddr_ntop");
+	tcase_add_test(tc, sys_sockaddr_ntop_01);
+	tcase_add_test(tc, sys_sockaddr_ntop_02);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("sys_tcpinfo");
+	tcase_add_test(tc, sys_tcpinfo_01);
+	suite_add_tcase(s, tc);
+
+#ifdef HAVE_REUSEPORT_CBPF
+	tc = tcase_create("sys_reuseport_steer");
+	tcase_add_test(tc, sys_reuseport_steer_01);
+	tcase_add_test(tc, sys_reuseport_steer_02);
+	suite_add_tcase(s, tc);
+#endif /* HAVE_REUSEPORT_CBPF */
+
 	return s;
 }
 
@@ -0,0 +1,121 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bench.h"
+
+#include "thrqueue.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#define THRQUEUE_BENCH_SIZE 1024
+
+typedef struct thrqueue_bench_consumer {
+	thrqueue_t *queue;
+	size_t n;
+} thrqueue_bench_consumer_t;
+
+static void
+thrqueue_bench_nb(void *arg, size_t n)
+{
+	thrqueue_t *queue;
+	void *item;
+
+	queue = arg ? thrqueue_new_mpsc(THRQUEUE_BENCH_SIZE)
+	            : thrqueue_new(THRQUEUE_BENCH_SIZE);
+	if (!queue) {
+		fprintf(stderr, "Failed to create queue\n");
+		exit(EXIT_FAILURE);
+	}
+	while (n--) {
+		item = thrqueue_enqueue_nb(queue, queue);
+		item = thrqueue_dequeue_nb(queue);
+		if (!item) {
+			fprintf(stderr, "Failed to dequeue item\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	thrqueue_free(queue);
+}
+
+static void *
+thrqueue_bench_consumer(void *arg)
+{
+	thrqueue_bench_consumer_t *c = arg;
+
+	while (c->n--) {
+		if (!thrqueue_dequeue(c->queue))
+			break;
+	}
+	return NULL;
+}
+
+/*
+ * Blocking producer/consumer throughput, with the calling thread enqueueing
+ * and a separate thread dequeueing.
+ */
+static void
+thrqueue_bench_pc(void *arg, size_t n)
+{
+	thrqueue_bench_consumer_t c;
+	pthread_t thr;
+
+	c.queue = arg ? thrqueue_new_mpsc(THRQUEUE_BENCH_SIZE)
+	              : thrqueue_new(THRQUEUE_BENCH_SIZE);
+	if (!c.queue) {
+		fprintf(stderr, "Failed to create queue\n");
+		exit(EXIT_FAILURE);
+	}
+	c.n = n;
+	if (pthread_create(&thr, NULL, thrqueue_bench_consumer, &c)) {
+		fprintf(stderr, "Failed to create thread\n");
+		exit(EXIT_FAILURE);
+	}
+	while (n--) {
+		if (!thrqueue_enqueue(c.queue, c.queue)) {
+			fprintf(stderr, "Failed to enqueue item\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	pthread_join(thr, NULL);
+	thrqueue_free(c.queue);
+}
+
+void
+thrqueue_bench(void)
+{
+	static int mpsc = 1;
+
+	bench_run("ThrqueueNB", 1, thrqueue_bench_nb, NULL);
+	bench_run("ThrqueueNBMPSC", 1, thrqueue_bench_nb, &mpsc);
+	bench_run("ThrqueueProdCons", 1, thrqueue_bench_pc, NULL);
+	bench_run("ThrqueueProdConsMPSC", 1, thrqueue_bench_pc, &mpsc);
+}
+
+/* vim: set noet ft=c: */
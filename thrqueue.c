@@ -28,16 +28,45 @@
 
 #include "thrqueue.h"
 
+#include "stats.h"
+
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <errno.h>
 
 /*
  * Thread-safe, bounded-size queue based on pthreads mutex and conds.
  * Both enqueue and dequeue are available in a blocking and non-blocking
  * version.
+ *
+ * Queues created using thrqueue_new_mpsc() instead use a lock-free ring
+ * buffer for multiple producers and a single consumer; slots are claimed
+ * and released using per-slot sequence numbers.  The mutex and conds are
+ * only used for waking up the consumer when the queue goes from empty to
+ * non-empty and for waking up producers waiting on a full queue.
  */
 
+#define THRQUEUE_CACHELINE 64
+
+/* mutex and cond operations, instrumented by lock profiling */
+#define THRQUEUE_LOCK(q) \
+	STATS_MUTEX_LOCK(&(q)->mutex, STATS_LOCK_THRQUEUE)
+#define THRQUEUE_UNLOCK(q) \
+	STATS_MUTEX_UNLOCK(&(q)->mutex, STATS_LOCK_THRQUEUE)
+#define THRQUEUE_WAIT(q, cond) \
+	STATS_COND_WAIT(&(q)->cond, &(q)->mutex, STATS_LOCK_THRQUEUE)
+#define THRQUEUE_TIMEDWAIT(q, cond, ts) \
+	STATS_COND_TIMEDWAIT(&(q)->cond, &(q)->mutex, (ts), \
+	                     STATS_LOCK_THRQUEUE)
+
+typedef struct thrqueue_slot {
+	size_t seq;
+	void *item;
+} thrqueue_slot_t;
+
 struct thrqueue {
 	void **data;
 	size_t sz, n;
@@ -47,6 +76,14 @@ struct thrqueue {
 	pthread_mutex_t mutex;
 	pthread_cond_t notempty;
 	pthread_cond_t notfull;
+	/* lock-free ring, only used if created using thrqueue_new_mpsc() */
+	thrqueue_slot_t *ring;
+	size_t mask;
+	size_t waiters;                 /* producers waiting for notfull */
+	char pad1[THRQUEUE_CACHELINE];
+	size_t tail;                    /* next slot to claim by producers */
+	char pad2[THRQUEUE_CACHELINE];
+	size_t head;                    /* next slot to read by consumer */
 };
 
 /*
@@ -73,6 +110,11 @@ thrqueue_new(size_t sz)
 	queue->out = 0;
 	queue->block_enqueue = 1;
 	queue->block_dequeue = 1;
+	queue->ring = NULL;
+	queue->mask = 0;
+	queue->waiters = 0;
+	queue->tail = 0;
+	queue->head = 0;
 	return queue;
 
 out4:
@@ -87,6 +129,34 @@ out0:
 	return NULL;
 }
 
+/*
+ * Create a new thread-safe queue of at least size sz, for use by any number
+ * of producer threads but only a single consumer thread.  Enqueue and
+ * dequeue do not take locks unless they need to wait or wake up a waiting
+ * thread.
+ */
+thrqueue_t *
+thrqueue_new_mpsc(size_t sz)
+{
+	thrqueue_t *queue;
+	size_t ringsz, i;
+
+	for (ringsz = 2; ringsz < sz; ringsz <<= 1);
+	if (!(queue = thrqueue_new(1)))
+		return NULL;
+	if (!(queue->ring = malloc(ringsz * sizeof(thrqueue_slot_t)))) {
+		thrqueue_free(queue);
+		return NULL;
+	}
+	for (i = 0; i < ringsz; i++) {
+		queue->ring[i].seq = i;
+		queue->ring[i].item = NULL;
+	}
+	queue->sz = ringsz;
+	queue->mask = ringsz - 1;
+	return queue;
+}
+
 /*
  * Free all resources associated with queue.
  * The caller must ensure that there are no threads still
@@ -95,6 +165,8 @@ out0:
 void
 thrqueue_free(thrqueue_t *queue)
 {
+	if (queue->ring)
+		free(queue->ring);
 	free(queue->data);
 	pthread_mutex_destroy(&queue->mutex);
 	pthread_cond_destroy(&queue->notempty);
@@ -102,6 +174,137 @@ thrqueue_free(thrqueue_t *queue)
 	free(queue);
 }
 
+/*
+ * Claim a slot in the ring and publish item.
+ * Returns 0 on success, -1 if the ring is full.
+ */
+static int
+thrqueue_ring_put(thrqueue_t *queue, void *item)
+{
+	thrqueue_slot_t *slot;
+	size_t pos, seq;
+
+	pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &queue->ring[pos & queue->mask];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&queue->tail, &pos,
+			                                pos + 1, 1,
+			                                __ATOMIC_RELAXED,
+			                                __ATOMIC_RELAXED))
+				break;
+		} else if ((ssize_t)(seq - pos) < 0) {
+			return -1;
+		} else {
+			pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+		}
+	}
+	slot->item = item;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	/* wake up the consumer if the queue was empty */
+	if (__atomic_fetch_add(&queue->n, 1, __ATOMIC_SEQ_CST) == 0) {
+		THRQUEUE_LOCK(queue);
+		pthread_cond_signal(&queue->notempty);
+		THRQUEUE_UNLOCK(queue);
+	}
+	return 0;
+}
+
+/*
+ * Return 1 if the ring has no free slot for producers, 0 otherwise.
+ */
+static int
+thrqueue_ring_isfull(thrqueue_t *queue)
+{
+	size_t pos = __atomic_load_n(&queue->tail, __ATOMIC_SEQ_CST);
+	size_t seq = __atomic_load_n(&queue->ring[pos & queue->mask].seq,
+	                             __ATOMIC_SEQ_CST);
+	return (ssize_t)(seq - pos) < 0;
+}
+
+static void *
+thrqueue_ring_enqueue(thrqueue_t *queue, void *item, int block)
+{
+	while (thrqueue_ring_put(queue, item) == -1) {
+		if (!block || !queue->block_enqueue)
+			return NULL;
+		THRQUEUE_LOCK(queue);
+		__atomic_add_fetch(&queue->waiters, 1, __ATOMIC_SEQ_CST);
+		while (thrqueue_ring_isfull(queue) && queue->block_enqueue)
+			THRQUEUE_WAIT(queue, notfull);
+		__atomic_sub_fetch(&queue->waiters, 1, __ATOMIC_SEQ_CST);
+		THRQUEUE_UNLOCK(queue);
+	}
+	return item;
+}
+
+/*
+ * Take the item at the head of the ring.  Must only be called by the single
+ * consumer thread.  Returns NULL if the queue is empty.
+ */
+static void *
+thrqueue_ring_get(thrqueue_t *queue)
+{
+	thrqueue_slot_t *slot;
+	size_t pos;
+	void *item;
+
+	if (__atomic_load_n(&queue->n, __ATOMIC_SEQ_CST) == 0)
+		return NULL;
+	pos = queue->head;
+	slot = &queue->ring[pos & queue->mask];
+	/* n counts published items, but the producer that claimed the head
+	 * slot may not have published it yet; it is about to */
+	while (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1)
+		sched_yield();
+	item = slot->item;
+	__atomic_store_n(&slot->seq, pos + queue->mask + 1, __ATOMIC_SEQ_CST);
+	queue->head = pos + 1;
+	__atomic_sub_fetch(&queue->n, 1, __ATOMIC_SEQ_CST);
+
+	/* wake up producers waiting for a free slot */
+	if (__atomic_load_n(&queue->waiters, __ATOMIC_SEQ_CST) > 0) {
+		THRQUEUE_LOCK(queue);
+		pthread_cond_broadcast(&queue->notfull);
+		THRQUEUE_UNLOCK(queue);
+	}
+	return item;
+}
+
+/*
+ * Wait for an item on the ring if block is set, until abstime if not NULL.
+ * Sets *timedout if abstime was reached.
+ */
+static void *
+thrqueue_ring_dequeue(thrqueue_t *queue, int block,
+                      const struct timespec *abstime, int *timedout)
+{
+	void *item;
+	int rv = 0;
+
+	while (!(item = thrqueue_ring_get(queue))) {
+		if (!block || !queue->block_dequeue)
+			return NULL;
+		if (rv == ETIMEDOUT) {
+			*timedout = 1;
+			return NULL;
+		}
+		THRQUEUE_LOCK(queue);
+		while (__atomic_load_n(&queue->n, __ATOMIC_SEQ_CST) == 0 &&
+		       queue->block_dequeue && rv != ETIMEDOUT) {
+			if (abstime)
+				rv = THRQUEUE_TIMEDWAIT(queue, notempty,
+				                        abstime);
+			else
+				THRQUEUE_WAIT(queue, notempty);
+		}
+		THRQUEUE_UNLOCK(queue);
+	}
+	return item;
+}
+
 /*
  * Enqueue an item into the queue.  Will block if the queue is full.
  * If enqueue has been switched to non-blocking mode, never blocks
@@ -111,18 +314,20 @@ thrqueue_free(thrqueue_t *queue)
 void *
 thrqueue_enqueue(thrqueue_t *queue, void *item)
 {
-	pthread_mutex_lock(&queue->mutex);
+	if (queue->ring)
+		return thrqueue_ring_enqueue(queue, item, 1);
+	THRQUEUE_LOCK(queue);
 	while (queue->n == queue->sz) {
 		if (!queue->block_enqueue) {
-			pthread_mutex_unlock(&queue->mutex);
+			THRQUEUE_UNLOCK(queue);
 			return NULL;
 		}
-		pthread_cond_wait(&queue->notfull, &queue->mutex);
+		THRQUEUE_WAIT(queue, notfull);
 	}
 	queue->data[queue->in++] = item;
 	queue->in %= queue->sz;
 	queue->n++;
-	pthread_mutex_unlock(&queue->mutex);
+	THRQUEUE_UNLOCK(queue);
 	pthread_cond_broadcast(&queue->notempty);
 	return item;
 }
@@ -135,15 +340,17 @@ thrqueue_enqueue(thrqueue_t *queue, void *item)
 void *
 thrqueue_enqueue_nb(thrqueue_t *queue, void *item)
 {
-	pthread_mutex_lock(&queue->mutex);
+	if (queue->ring)
+		return thrqueue_ring_enqueue(queue, item, 0);
+	THRQUEUE_LOCK(queue);
 	if (queue->n == queue->sz) {
-		pthread_mutex_unlock(&queue->mutex);
+		THRQUEUE_UNLOCK(queue);
 		return NULL;
 	}
 	queue->data[queue->in++] = item;
 	queue->in %= queue->sz;
 	queue->n++;
-	pthread_mutex_unlock(&queue->mutex);
+	THRQUEUE_UNLOCK(queue);
 	pthread_cond_signal(&queue->notempty);
 	return item;
 }
@@ -159,18 +366,65 @@ thrqueue_dequeue(thrqueue_t *queue)
 {
 	void *item;
 
-	pthread_mutex_lock(&queue->mutex);
+	if (queue->ring)
+		return thrqueue_ring_dequeue(queue, 1, NULL, NULL);
+	THRQUEUE_LOCK(queue);
+	while (queue->n == 0) {
+		if (!queue->block_dequeue) {
+			THRQUEUE_UNLOCK(queue);
+			return NULL;
+		}
+		THRQUEUE_WAIT(queue, notempty);
+	}
+	item = queue->data[queue->out++];
+	queue->out %= queue->sz;
+	queue->n--;
+	THRQUEUE_UNLOCK(queue);
+	pthread_cond_signal(&queue->notfull);
+	return item;
+}
+
+/*
+ * Dequeue an item from the queue, blocking for at most ms milliseconds.
+ * Returns NULL and sets *timedout to 1 if no item became available in time;
+ * returns NULL and leaves *timedout alone if dequeue has been switched to
+ * non-blocking mode and the queue is empty.
+ * Returns the dequeued item on success.
+ */
+void *
+thrqueue_dequeue_timed(thrqueue_t *queue, unsigned int ms, int *timedout)
+{
+	struct timespec abstime;
+	void *item;
+	int rv = 0;
+
+	clock_gettime(CLOCK_REALTIME, &abstime);
+	abstime.tv_sec += ms / 1000;
+	abstime.tv_nsec += (long)(ms % 1000) * 1000000;
+	if (abstime.tv_nsec >= 1000000000) {
+		abstime.tv_sec++;
+		abstime.tv_nsec -= 1000000000;
+	}
+
+	if (queue->ring)
+		return thrqueue_ring_dequeue(queue, 1, &abstime, timedout);
+	THRQUEUE_LOCK(queue);
 	while (queue->n == 0) {
 		if (!queue->block_dequeue) {
-			pthread_mutex_unlock(&queue->mutex);
+			THRQUEUE_UNLOCK(queue);
 			return NULL;
 		}
-		pthread_cond_wait(&queue->notempty, &queue->mutex);
+		if (rv == ETIMEDOUT) {
+			THRQUEUE_UNLOCK(queue);
+			*timedout = 1;
+			return NULL;
+		}
+		rv = THRQUEUE_TIMEDWAIT(queue, notempty, &abstime);
 	}
 	item = queue->data[queue->out++];
 	queue->out %= queue->sz;
 	queue->n--;
-	pthread_mutex_unlock(&queue->mutex);
+	THRQUEUE_UNLOCK(queue);
 	pthread_cond_signal(&queue->notfull);
 	return item;
 }
@@ -185,19 +439,40 @@ thrqueue_dequeue_nb(thrqueue_t *queue)
 {
 	void *item;
 
-	pthread_mutex_lock(&queue->mutex);
+	if (queue->ring)
+		return thrqueue_ring_dequeue(queue, 0, NULL, NULL);
+	THRQUEUE_LOCK(queue);
 	if (queue->n == 0) {
-		pthread_mutex_unlock(&queue->mutex);
+		THRQUEUE_UNLOCK(queue);
 		return NULL;
 	}
 	item = queue->data[queue->out++];
 	queue->out %= queue->sz;
 	queue->n--;
-	pthread_mutex_unlock(&queue->mutex);
+	THRQUEUE_UNLOCK(queue);
 	pthread_cond_signal(&queue->notfull);
 	return item;
 }
 
+/*
+ * Return the number of items currently in the queue.  The result is only a
+ * snapshot if other threads are using the queue concurrently.
+ */
+size_t
+thrqueue_depth(thrqueue_t *queue)
+{
+	return __atomic_load_n(&queue->n, __ATOMIC_RELAXED);
+}
+
+/*
+ * Return the maximum number of items the queue can hold.
+ */
+size_t
+thrqueue_size(thrqueue_t *queue)
+{
+	return queue->sz;
+}
+
 /*
  * Permanently make all enqueue operations on queue non-blocking and wake
  * up all threads currently waiting for the queue to become not full.
@@ -207,8 +482,10 @@ thrqueue_dequeue_nb(thrqueue_t *queue)
 void
 thrqueue_unblock_enqueue(thrqueue_t *queue)
 {
+	THRQUEUE_LOCK(queue);
 	queue->block_enqueue = 0;
 	pthread_cond_broadcast(&queue->notfull);
+	THRQUEUE_UNLOCK(queue);
 	sched_yield();
 }
 
@@ -221,8 +498,10 @@ thrqueue_unblock_enqueue(thrqueue_t *queue)
 void
 thrqueue_unblock_dequeue(thrqueue_t *queue)
 {
+	THRQUEUE_LOCK(queue);
 	queue->block_dequeue = 0;
 	pthread_cond_broadcast(&queue->notempty);
+	THRQUEUE_UNLOCK(queue);
 	sched_yield();
 }
 
@@ -36,12 +36,17 @@
 typedef struct thrqueue thrqueue_t;
 
 thrqueue_t * thrqueue_new(size_t) MALLOC;
+thrqueue_t * thrqueue_new_mpsc(size_t) MALLOC;
 void thrqueue_free(thrqueue_t *) NONNULL(1);
 
 void * thrqueue_enqueue(thrqueue_t *, void *) NONNULL(1) WUNRES;
 void * thrqueue_enqueue_nb(thrqueue_t *, void *) NONNULL(1) WUNRES;
 void * thrqueue_dequeue(thrqueue_t *) NONNULL(1) WUNRES;
+void * thrqueue_dequeue_timed(thrqueue_t *, unsigned int, int *)
+       NONNULL(1,3) WUNRES;
 void * thrqueue_dequeue_nb(thrqueue_t *) NONNULL(1) WUNRES;
+size_t thrqueue_depth(thrqueue_t *) NONNULL(1) WUNRES;
+size_t thrqueue_size(thrqueue_t *) NONNULL(1) WUNRES;
 void thrqueue_unblock_enqueue(thrqueue_t *) NONNULL(1);
 void thrqueue_unblock_dequeue(thrqueue_t *) NONNULL(1);
 
@@ -0,0 +1,168 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "thrqueue.h"
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <check.h>
+
+#define THRQUEUE_TEST_PRODUCERS 4
+#define THRQUEUE_TEST_ITEMS     20000
+
+START_TEST(thrqueue_new_mpsc_01)
+{
+	thrqueue_t *queue;
+	uintptr_t i;
+
+	queue = thrqueue_new_mpsc(3);
+	fail_unless(!!queue, "thrqueue_new_mpsc failed");
+	fail_unless(!thrqueue_dequeue_nb(queue), "dequeued from empty queue");
+	for (i = 1; i <= 4; i++) {
+		fail_unless(thrqueue_enqueue_nb(queue, (void *)i) == (void *)i,
+		            "enqueue failed");
+	}
+	fail_unless(!thrqueue_enqueue_nb(queue, (void *)5),
+	            "enqueued into full queue");
+	for (i = 1; i <= 4; i++) {
+		fail_unless(thrqueue_dequeue_nb(queue) == (void *)i,
+		            "wrong item dequeued");
+	}
+	fail_unless(!thrqueue_dequeue_nb(queue), "dequeued from empty queue");
+	thrqueue_unblock_dequeue(queue);
+	fail_unless(!thrqueue_dequeue(queue), "blocking dequeue not unblocked");
+	thrqueue_free(queue);
+}
+END_TEST
+
+static void *
+thrqueue_test_producer(void *arg)
+{
+	thrqueue_t *queue = ((void **)arg)[0];
+	uintptr_t id = (uintptr_t)((void **)arg)[1];
+	uintptr_t i;
+
+	for (i = 1; i <= THRQUEUE_TEST_ITEMS; i++) {
+		if (!thrqueue_enqueue(queue, (void *)(id << 24 | i)))
+			return arg;
+	}
+	return NULL;
+}
+
+START_TEST(thrqueue_new_mpsc_02)
+{
+	pthread_t thr[THRQUEUE_TEST_PRODUCERS];
+	void *args[THRQUEUE_TEST_PRODUCERS][2];
+	uintptr_t last[THRQUEUE_TEST_PRODUCERS];
+	thrqueue_t *queue;
+	uintptr_t item, id;
+	void *rv;
+	int i;
+
+	queue = thrqueue_new_mpsc(8);
+	fail_unless(!!queue, "thrqueue_new_mpsc failed");
+	for (i = 0; i < THRQUEUE_TEST_PRODUCERS; i++) {
+		args[i][0] = queue;
+		args[i][1] = (void *)(uintptr_t)i;
+		last[i] = 0;
+		fail_unless(!pthread_create(&thr[i], NULL,
+		                            thrqueue_test_producer, args[i]),
+		            "pthread_create failed");
+	}
+	for (i = 0; i < THRQUEUE_TEST_PRODUCERS * THRQUEUE_TEST_ITEMS; i++) {
+		item = (uintptr_t)thrqueue_dequeue(queue);
+		id = item >> 24;
+		fail_unless(id < THRQUEUE_TEST_PRODUCERS, "unknown producer");
+		fail_unless((item & 0xFFFFFF) == last[id] + 1,
+		            "items out of order");
+		last[id]++;
+	}
+	for (i = 0; i < THRQUEUE_TEST_PRODUCERS; i++) {
+		fail_unless(!pthread_join(thr[i], &rv), "pthread_join failed");
+		fail_unless(!rv, "enqueue failed");
+	}
+	fail_unless(!thrqueue_dequeue_nb(queue), "extra items in queue");
+	thrqueue_free(queue);
+}
+END_TEST
+
+static void
+thrqueue_test_dequeue_timed(thrqueue_t *queue)
+{
+	int timedout;
+
+	fail_unless(!!queue, "thrqueue_new failed");
+	timedout = 0;
+	fail_unless(!thrqueue_dequeue_timed(queue, 10, &timedout),
+	            "dequeued from empty queue");
+	fail_unless(timedout, "timeout not reported");
+	fail_unless(thrqueue_enqueue_nb(queue, (void *)1) == (void *)1,
+	            "enqueue failed");
+	timedout = 0;
+	fail_unless(thrqueue_dequeue_timed(queue, 10, &timedout) == (void *)1,
+	            "wrong item dequeued");
+	fail_unless(!timedout, "timeout reported");
+	thrqueue_unblock_dequeue(queue);
+	fail_unless(!thrqueue_dequeue_timed(queue, 1000, &timedout),
+	            "dequeued from empty queue");
+	fail_unless(!timedout, "timeout reported after unblock");
+	thrqueue_free(queue);
+}
+
+START_TEST(thrqueue_dequeue_timed_01)
+{
+	thrqueue_test_dequeue_timed(thrqueue_new(4));
+}
+END_TEST
+
+START_TEST(thrqueue_dequeue_timed_02)
+{
+	thrqueue_test_dequeue_timed(thrqueue_new_mpsc(4));
+}
+END_TEST
+
+Suite *
+thrqueue_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("thrqueue");
+
+	tc = tcase_create("thrqueue_new_mpsc");
+	tcase_add_test(tc, thrqueue_new_mpsc_01);
+	tcase_add_test(tc, thrqueue_new_mpsc_02);
+	tcase_add_test(tc, thrqueue_dequeue_timed_01);
+	tcase_add_test(tc, thrqueue_dequeue_timed_02);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,323 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "tmwheel.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+/*
+ * Hierarchical timing wheel in the style of the classic BSD and Linux kernel
+ * timer wheels, for large numbers of coarse timeouts that are usually
+ * cancelled or pushed back before they expire.  Adding and removing a timer
+ * is O(1) and does not touch the libevent min-heap; a single periodic event
+ * per wheel advances the wheel by one tick at a time while timers are
+ * pending.
+ *
+ * Level 0 has one slot per tick, each higher level one slot per full
+ * revolution of the level below.  Timers are placed in the lowest level that
+ * covers their expiry, and cascaded down one level whenever the level below
+ * wraps around, such that expiring a timer costs at most one relink per
+ * level.  Timers further out than the top level covers are clamped to the
+ * maximum delay.
+ *
+ * The wheel belongs to the thread running its event base, which runs all
+ * callbacks.  Timers may be added and removed from other threads as well.
+ * Removing a timer whose callback is running on the wheel thread waits for
+ * the callback to return, like event_del() does for libevent events.
+ */
+
+#define TMWHEEL_BITS	6
+#define TMWHEEL_SLOTS	(1U << TMWHEEL_BITS)
+#define TMWHEEL_MASK	(TMWHEEL_SLOTS - 1)
+#define TMWHEEL_LEVELS	4
+#define TMWHEEL_MAXDELTA (1ULL << (TMWHEEL_BITS * TMWHEEL_LEVELS))
+
+struct tmwheel {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct event *ev;
+	unsigned int tick_ms;
+	long long start_ms;
+	unsigned long long now;         /* ms since start as of last tick */
+	unsigned long long tick;        /* next tick to process */
+	size_t count;
+	tmwheel_timer_t *running;       /* timer whose callback is running */
+	pthread_t thread;               /* thread running the callbacks */
+	tmwheel_timer_t *slot[TMWHEEL_LEVELS][TMWHEEL_SLOTS];
+};
+
+static long long
+tmwheel_clock(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		return 0;
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+tmwheel_link(tmwheel_t *wheel, tmwheel_timer_t *t)
+{
+	unsigned long long delta;
+	tmwheel_timer_t **slot;
+	int level;
+
+	if (t->expiry < wheel->tick)
+		t->expiry = wheel->tick;
+	delta = t->expiry - wheel->tick;
+	if (delta >= TMWHEEL_MAXDELTA) {
+		delta = TMWHEEL_MAXDELTA - 1;
+		t->expiry = wheel->tick + delta;
+	}
+	for (level = 0; delta >= (1ULL << (TMWHEEL_BITS * (level + 1)));
+	     level++);
+	slot = &wheel->slot[level][(t->expiry >> (TMWHEEL_BITS * level)) &
+	                           TMWHEEL_MASK];
+	t->next = *slot;
+	if (t->next)
+		t->next->pprev = &t->next;
+	t->pprev = slot;
+	*slot = t;
+}
+
+static void
+tmwheel_unlink(tmwheel_timer_t *t)
+{
+	*t->pprev = t->next;
+	if (t->next)
+		t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+/*
+ * Relink all timers of a slot into lower levels.  Returns the slot index,
+ * which is 0 whenever the level has wrapped around.
+ */
+static unsigned int
+tmwheel_cascade(tmwheel_t *wheel, int level)
+{
+	unsigned int idx;
+	tmwheel_timer_t *t, *next;
+
+	idx = (wheel->tick >> (TMWHEEL_BITS * level)) & TMWHEEL_MASK;
+	t = wheel->slot[level][idx];
+	wheel->slot[level][idx] = NULL;
+	for (; t; t = next) {
+		next = t->next;
+		tmwheel_link(wheel, t);
+	}
+	return idx;
+}
+
+static void
+tmwheel_evcb(UNUSED evutil_socket_t fd, UNUSED short what, void *arg)
+{
+	tmwheel_t *wheel = arg;
+
+	tmwheel_advance(wheel, tmwheel_clock() - wheel->start_ms);
+}
+
+/*
+ * Create a timing wheel on evbase with a resolution of tick_ms milliseconds.
+ * Returns NULL on failure.
+ */
+tmwheel_t *
+tmwheel_new(struct event_base *evbase, unsigned int tick_ms)
+{
+	tmwheel_t *wheel;
+
+	if (!tick_ms)
+		return NULL;
+	wheel = malloc(sizeof(tmwheel_t));
+	if (!wheel)
+		return NULL;
+	memset(wheel, 0, sizeof(tmwheel_t));
+	wheel->ev = event_new(evbase, -1, EV_PERSIST, tmwheel_evcb, wheel);
+	if (!wheel->ev) {
+		free(wheel);
+		return NULL;
+	}
+	pthread_mutex_init(&wheel->mutex, NULL);
+	pthread_cond_init(&wheel->cond, NULL);
+	wheel->tick_ms = tick_ms;
+	wheel->start_ms = tmwheel_clock();
+	wheel->tick = 1;
+	return wheel;
+}
+
+/*
+ * Free the wheel.  Pending timers are dropped without calling them.
+ */
+void
+tmwheel_free(tmwheel_t *wheel)
+{
+	event_free(wheel->ev);
+	pthread_cond_destroy(&wheel->cond);
+	pthread_mutex_destroy(&wheel->mutex);
+	free(wheel);
+}
+
+void
+tmwheel_timer_init(tmwheel_timer_t *t, tmwheel_cb_t cb, void *arg)
+{
+	memset(t, 0, sizeof(tmwheel_timer_t));
+	t->cb = cb;
+	t->arg = arg;
+}
+
+/*
+ * Schedule timer t to expire in ms milliseconds, rounded up to the next
+ * tick.  A timer already pending is rescheduled.
+ */
+void
+tmwheel_add(tmwheel_t *wheel, tmwheel_timer_t *t, unsigned long long ms)
+{
+	pthread_mutex_lock(&wheel->mutex);
+	if (t->pprev) {
+		tmwheel_unlink(t);
+	} else {
+		if (!wheel->count) {
+			/* idle wheels do not tick; catch up first */
+			unsigned long long now = tmwheel_clock() -
+			                         wheel->start_ms;
+			if (now > wheel->now) {
+				__atomic_store_n(&wheel->now, now,
+				                 __ATOMIC_RELAXED);
+			}
+			if (wheel->tick <= wheel->now / wheel->tick_ms)
+				wheel->tick = wheel->now / wheel->tick_ms + 1;
+		}
+		wheel->count++;
+	}
+	t->expiry = (wheel->now + ms + wheel->tick_ms - 1) / wheel->tick_ms;
+	tmwheel_link(wheel, t);
+	if (wheel->count == 1 && !event_pending(wheel->ev, EV_TIMEOUT, NULL)) {
+		struct timeval tv;
+
+		tv.tv_sec = wheel->tick_ms / 1000;
+		tv.tv_usec = (wheel->tick_ms % 1000) * 1000;
+		event_add(wheel->ev, &tv);
+	}
+	pthread_mutex_unlock(&wheel->mutex);
+}
+
+/*
+ * Cancel timer t if it is pending.  If its callback is running on another
+ * thread, wait for the callback to return.
+ */
+void
+tmwheel_del(tmwheel_t *wheel, tmwheel_timer_t *t)
+{
+	pthread_mutex_lock(&wheel->mutex);
+	if (t->pprev) {
+		tmwheel_unlink(t);
+		wheel->count--;
+	} else if (wheel->running == t &&
+	           !pthread_equal(wheel->thread, pthread_self())) {
+		while (wheel->running == t)
+			pthread_cond_wait(&wheel->cond, &wheel->mutex);
+	}
+	pthread_mutex_unlock(&wheel->mutex);
+}
+
+/*
+ * Return the time of the last tick in milliseconds since the wheel was
+ * created.  Cheap enough to be called on every I/O event.
+ */
+unsigned long long
+tmwheel_now(tmwheel_t *wheel)
+{
+	return __atomic_load_n(&wheel->now, __ATOMIC_RELAXED);
+}
+
+/*
+ * Return the number of pending timers.
+ */
+size_t
+tmwheel_count(tmwheel_t *wheel)
+{
+	size_t count;
+
+	pthread_mutex_lock(&wheel->mutex);
+	count = wheel->count;
+	pthread_mutex_unlock(&wheel->mutex);
+	return count;
+}
+
+/*
+ * Advance the wheel to now milliseconds since it was created, calling the
+ * callbacks of all timers expired by then.  Called on every tick by the
+ * wheel's event; exposed for driving the wheel manually in tests.
+ */
+void
+tmwheel_advance(tmwheel_t *wheel, unsigned long long now)
+{
+	unsigned long long target = now / wheel->tick_ms;
+	tmwheel_timer_t *expired, *t;
+
+	pthread_mutex_lock(&wheel->mutex);
+	wheel->thread = pthread_self();
+	if (now > wheel->now)
+		__atomic_store_n(&wheel->now, now, __ATOMIC_RELAXED);
+	while (wheel->count && wheel->tick <= target) {
+		if (!(wheel->tick & TMWHEEL_MASK)) {
+			for (int level = 1; level < TMWHEEL_LEVELS &&
+			     tmwheel_cascade(wheel, level) == 0; level++);
+		}
+		expired = wheel->slot[0][wheel->tick & TMWHEEL_MASK];
+		wheel->slot[0][wheel->tick & TMWHEEL_MASK] = NULL;
+		if (expired)
+			expired->pprev = &expired;
+		/* callbacks rescheduling their timer land in later ticks */
+		wheel->tick++;
+		while ((t = expired)) {
+			tmwheel_unlink(t);
+			wheel->count--;
+			wheel->running = t;
+			pthread_mutex_unlock(&wheel->mutex);
+			t->cb(t);
+			pthread_mutex_lock(&wheel->mutex);
+			wheel->running = NULL;
+			pthread_cond_broadcast(&wheel->cond);
+		}
+	}
+	if (!wheel->count) {
+		if (wheel->tick <= target)
+			wheel->tick = target + 1;
+		event_del(wheel->ev);
+	}
+	pthread_mutex_unlock(&wheel->mutex);
+}
+
+/* vim: set noet ft=c: */
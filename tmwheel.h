@@ -0,0 +1,65 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef TMWHEEL_H
+#define TMWHEEL_H
+
+#include "attrib.h"
+
+#include <event2/event.h>
+
+typedef struct tmwheel tmwheel_t;
+typedef struct tmwheel_timer tmwheel_timer_t;
+typedef void (*tmwheel_cb_t)(tmwheel_timer_t *);
+
+/*
+ * Caller-owned timer, usually embedded in a larger structure.  Initialize
+ * with tmwheel_timer_init() before use; all other fields are private.
+ */
+struct tmwheel_timer {
+	tmwheel_timer_t *next;
+	tmwheel_timer_t **pprev;        /* NULL while not pending */
+	unsigned long long expiry;      /* in ticks */
+	tmwheel_cb_t cb;
+	void *arg;
+};
+
+tmwheel_t * tmwheel_new(struct event_base *, unsigned int) NONNULL(1) MALLOC;
+void tmwheel_free(tmwheel_t *) NONNULL(1);
+void tmwheel_timer_init(tmwheel_timer_t *, tmwheel_cb_t, void *) NONNULL(1,2);
+void tmwheel_add(tmwheel_t *, tmwheel_timer_t *, unsigned long long)
+     NONNULL(1,2);
+void tmwheel_del(tmwheel_t *, tmwheel_timer_t *) NONNULL(1,2);
+unsigned long long tmwheel_now(tmwheel_t *) NONNULL(1) WUNRES;
+size_t tmwheel_count(tmwheel_t *) NONNULL(1) WUNRES;
+void tmwheel_advance(tmwheel_t *, unsigned long long) NONNULL(1);
+
+#endif /* !TMWHEEL_H */
+
+/* vim: set noet ft=c: */
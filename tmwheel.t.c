@@ -0,0 +1,231 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "tmwheel.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <check.h>
+
+#define TICK	10
+
+typedef struct {
+	tmwheel_timer_t timer;
+	tmwheel_t *wheel;
+	unsigned long long due;
+	unsigned long long fired;
+	unsigned long long rearm;
+	int calls;
+} test_timer_t;
+
+static unsigned long long test_now;
+
+static void
+test_timer_cb(tmwheel_timer_t *t)
+{
+	test_timer_t *tt = t->arg;
+
+	tt->fired = test_now;
+	tt->calls++;
+	if (tt->rearm) {
+		tt->due = test_now + tt->rearm;
+		tmwheel_add(tt->wheel, &tt->timer, tt->rearm);
+	}
+}
+
+static void
+test_add(tmwheel_t *wheel, test_timer_t *tt, unsigned long long ms)
+{
+	tmwheel_timer_init(&tt->timer, test_timer_cb, tt);
+	tt->wheel = wheel;
+	tmwheel_add(wheel, &tt->timer, ms);
+	if (!test_now)
+		test_now = tmwheel_now(wheel);
+	tt->due = test_now + ms;
+}
+
+static void
+test_advance(tmwheel_t *wheel, unsigned long long ms)
+{
+	for (unsigned long long end = test_now + ms; test_now < end;) {
+		test_now += TICK;
+		tmwheel_advance(wheel, test_now);
+	}
+}
+
+START_TEST(tmwheel_01)
+{
+	struct event_base *evbase;
+	tmwheel_t *wheel;
+	test_timer_t tt[4];
+
+	memset(tt, 0, sizeof(tt));
+	test_now = 0;
+	evbase = event_base_new();
+	wheel = tmwheel_new(evbase, TICK);
+	fail_unless(!!wheel, "tmwheel_new failed");
+	test_add(wheel, &tt[0], 50);
+	test_add(wheel, &tt[1], 1000);
+	test_add(wheel, &tt[2], 10000);
+	test_add(wheel, &tt[3], 3000000);
+	fail_unless(tmwheel_count(wheel) == 4, "wrong count");
+
+	test_advance(wheel, 40);
+	fail_unless(tt[0].calls == 0, "fired early");
+	test_advance(wheel, 30);
+	fail_unless(tt[0].calls == 1, "did not fire");
+	test_advance(wheel, 1000);
+	fail_unless(tt[1].calls == 1, "level 1 timer did not fire");
+	test_advance(wheel, 8000);
+	fail_unless(tt[2].calls == 0, "level 1 timer fired early");
+	test_advance(wheel, 1100);
+	fail_unless(tt[2].calls == 1, "level 1 timer did not fire");
+	test_advance(wheel, 3000000);
+	fail_unless(tt[3].calls == 1, "level 3 timer did not fire");
+	for (int i = 0; i < 4; i++) {
+		fail_unless(tt[i].fired >= tt[i].due &&
+		            tt[i].fired <= tt[i].due + 2 * TICK,
+		            "fired at wrong time");
+	}
+	fail_unless(tmwheel_count(wheel) == 0, "timers left");
+
+	tmwheel_free(wheel);
+	event_base_free(evbase);
+}
+END_TEST
+
+START_TEST(tmwheel_02)
+{
+	struct event_base *evbase;
+	tmwheel_t *wheel;
+	test_timer_t tt[2];
+
+	memset(tt, 0, sizeof(tt));
+	test_now = 0;
+	evbase = event_base_new();
+	wheel = tmwheel_new(evbase, TICK);
+	test_add(wheel, &tt[0], 100);
+	test_add(wheel, &tt[1], 100);
+	tmwheel_del(wheel, &tt[0].timer);
+	tmwheel_del(wheel, &tt[0].timer);
+	fail_unless(tmwheel_count(wheel) == 1, "wrong count after del");
+	test_advance(wheel, 50);
+	/* reschedule */
+	tmwheel_add(wheel, &tt[1].timer, 500);
+	tt[1].due = test_now + 500;
+	fail_unless(tmwheel_count(wheel) == 1, "wrong count after re-add");
+	test_advance(wheel, 400);
+	fail_unless(tt[0].calls == 0, "deleted timer fired");
+	fail_unless(tt[1].calls == 0, "rescheduled timer fired early");
+	test_advance(wheel, 200);
+	fail_unless(tt[1].calls == 1, "rescheduled timer did not fire");
+
+	tmwheel_free(wheel);
+	event_base_free(evbase);
+}
+END_TEST
+
+START_TEST(tmwheel_03)
+{
+	struct event_base *evbase;
+	tmwheel_t *wheel;
+	test_timer_t tt;
+
+	memset(&tt, 0, sizeof(tt));
+	test_now = 0;
+	evbase = event_base_new();
+	wheel = tmwheel_new(evbase, TICK);
+	/* rearming from the callback fires once per period only */
+	tt.rearm = 640;
+	test_add(wheel, &tt, 640);
+	test_advance(wheel, 6550);
+	fail_unless(tt.calls == 10, "wrong number of periodic calls");
+	tmwheel_del(wheel, &tt.timer);
+	fail_unless(tmwheel_count(wheel) == 0, "timers left");
+
+	tmwheel_free(wheel);
+	event_base_free(evbase);
+}
+END_TEST
+
+START_TEST(tmwheel_04)
+{
+	struct event_base *evbase;
+	tmwheel_t *wheel;
+	test_timer_t *tt;
+	int n = 10000;
+
+	test_now = 0;
+	evbase = event_base_new();
+	wheel = tmwheel_new(evbase, TICK);
+	tt = calloc(n, sizeof(test_timer_t));
+	srandom(1);
+	for (int i = 0; i < n; i++)
+		test_add(wheel, &tt[i], random() % 100000);
+	for (int i = 0; i < n; i += 2)
+		tmwheel_del(wheel, &tt[i].timer);
+	test_advance(wheel, 100000 + 2 * TICK);
+	for (int i = 0; i < n; i++) {
+		if (i % 2) {
+			fail_unless(tt[i].calls == 1, "timer did not fire");
+			fail_unless(tt[i].fired >= tt[i].due &&
+			            tt[i].fired <= tt[i].due + 2 * TICK,
+			            "fired at wrong time");
+		} else {
+			fail_unless(tt[i].calls == 0, "deleted timer fired");
+		}
+	}
+	fail_unless(tmwheel_count(wheel) == 0, "timers left");
+
+	free(tt);
+	tmwheel_free(wheel);
+	event_base_free(evbase);
+}
+END_TEST
+
+Suite *
+tmwheel_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("tmwheel");
+
+	tc = tcase_create("tmwheel");
+	tcase_add_test(tc, tmwheel_01);
+	tcase_add_test(tc, tmwheel_02);
+	tcase_add_test(tc, tmwheel_03);
+	tcase_add_test(tc, tmwheel_04);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,115 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bench.h"
+
+#include "url.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* URL encoded Base64 of an OCSP GET request */
+static const char coded[] =
+	"MFEwTzBNMEswSTAJBgUrDgMCGgUABBTBL0V27RVZ7LBduom%2FnYB45SPUEwQU5Z1Z"
+	"MIJHWMys%2BghUNoZ7OrUETfACEAq9wyFaNcLx23%2BI0rDelzk%3D";
+
+static void
+url_bench_dec(UNUSED void *arg, size_t n)
+{
+	char *buf;
+	size_t sz;
+
+	while (n--) {
+		if (!(buf = url_dec(coded, sizeof(coded) - 1, &sz))) {
+			fprintf(stderr, "url_dec() failed\n");
+			exit(EXIT_FAILURE);
+		}
+		free(buf);
+	}
+}
+
+/*
+ * Worst case for the OCSP GET request detection on request URIs:  a path
+ * component of almost 16 KiB, the request line limit of common web servers,
+ * with every octet percent encoded, once valid and once with an invalid
+ * escape at the very end, which is only detected after decoding everything
+ * before it.
+ */
+#define URL_BENCH_WORST_SZ (3 * 5461)
+
+typedef struct url_bench_worst {
+	char *coded;
+	size_t sz;
+	int valid;
+} url_bench_worst_t;
+
+static void
+url_bench_dec_worst(void *arg, size_t n)
+{
+	url_bench_worst_t *b = arg;
+	char *buf;
+	size_t sz;
+
+	while (n--) {
+		buf = url_dec(b->coded, b->sz, &sz);
+		if (!buf != !b->valid) {
+			fprintf(stderr, "url_dec() failed\n");
+			exit(EXIT_FAILURE);
+		}
+		free(buf);
+	}
+}
+
+void
+url_bench(void)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	url_bench_worst_t b;
+	size_t i;
+
+	bench_run("URLDec", 1, url_bench_dec, NULL);
+
+	if (!(b.coded = malloc(URL_BENCH_WORST_SZ))) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	b.sz = URL_BENCH_WORST_SZ;
+	for (i = 0; i < b.sz; i += 3) {
+		b.coded[i] = '%';
+		b.coded[i + 1] = hex[(i / 3 * 7) % 16];
+		b.coded[i + 2] = hex[(i / 3) % 16];
+	}
+	b.valid = 1;
+	bench_run_worst("URLDecWorst", url_bench_dec_worst, &b);
+	b.coded[b.sz - 1] = 'G';
+	b.valid = 0;
+	bench_run_worst("URLDecWorstInvalid", url_bench_dec_worst, &b);
+	free(b.coded);
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,55 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2009-2019, Daniel Roethlisberger <daniel@roe.ch>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef USDT_H
+#define USDT_H
+
+/*
+ * Static user space tracepoints of provider sslsplit for DTrace, SystemTap
+ * and bpftrace; see probes.d for the list of probes and their arguments.
+ * Probes are only built in with -DWITH_USDT, otherwise they compile to
+ * nothing.  When built in, a disabled probe costs a nop instruction at the
+ * probe site; arguments should be cheap to evaluate for the same reason.
+ */
+
+#ifdef WITH_USDT
+#include <sys/sdt.h>
+#define USDT_PROBE0(name)		DTRACE_PROBE(sslsplit, name)
+#define USDT_PROBE1(name, a)		DTRACE_PROBE1(sslsplit, name, a)
+#define USDT_PROBE2(name, a, b)		DTRACE_PROBE2(sslsplit, name, a, b)
+#define USDT_PROBE3(name, a, b, c)	DTRACE_PROBE3(sslsplit, name, a, b, c)
+#else /* !WITH_USDT */
+#define USDT_PROBE0(name)		do {} while (0)
+#define USDT_PROBE1(name, a)		do {} while (0)
+#define USDT_PROBE2(name, a, b)		do {} while (0)
+#define USDT_PROBE3(name, a, b, c)	do {} while (0)
+#endif /* !WITH_USDT */
+
+#endif /* !USDT_H */
+
+/* vim: set noet ft=c: */
@@ -26,6 +26,8 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "util.h"
+
 #include <string.h>
 
 /*
@@ -42,4 +44,64 @@ util_skipws(const char *s)
 	return (char*) s + strspn(s, " \t");
 }
 
+/*
+ * Seeded hash for hash table keys of arbitrary binary content, following
+ * the structure of the small input path of XXH64:  every input bit affects
+ * every output bit, unlike XOR folding, which maps keys differing in
+ * symmetric or word-aligned ways to the same hash.  The seed must be set by
+ * util_hash_init() before the first key is hashed and not change while any
+ * hash table using util_hash() is populated.
+ */
+#define UTIL_HASH_P1	0x9E3779B185EBCA87ULL
+#define UTIL_HASH_P2	0xC2B2AE3D27D4EB4FULL
+#define UTIL_HASH_P3	0x165667B19E3779F9ULL
+#define UTIL_HASH_P4	0x85EBCA77C2B2AE63ULL
+#define UTIL_HASH_P5	0x27D4EB2F165667C5ULL
+#define UTIL_HASH_ROTL(x, r)	(((x) << (r)) | ((x) >> (64 - (r))))
+
+static uint64_t util_hash_seed;
+
+void
+util_hash_init(uint64_t seed)
+{
+	util_hash_seed = seed;
+}
+
+uint32_t
+util_hash(const void *buf, size_t sz)
+{
+	const unsigned char *p = buf;
+	const unsigned char *end = p + sz;
+	uint64_t h = util_hash_seed + UTIL_HASH_P5 + sz;
+
+	for (; end - p >= 8; p += 8) {
+		uint64_t k;
+
+		memcpy(&k, p, sizeof(k));
+		k *= UTIL_HASH_P2;
+		k = UTIL_HASH_ROTL(k, 31);
+		k *= UTIL_HASH_P1;
+		h ^= k;
+		h = UTIL_HASH_ROTL(h, 27) * UTIL_HASH_P1 + UTIL_HASH_P4;
+	}
+	if (end - p >= 4) {
+		uint32_t k;
+
+		memcpy(&k, p, sizeof(k));
+		h ^= (uint64_t)k * UTIL_HASH_P1;
+		h = UTIL_HASH_ROTL(h, 23) * UTIL_HASH_P2 + UTIL_HASH_P3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		h ^= *p * UTIL_HASH_P5;
+		h = UTIL_HASH_ROTL(h, 11) * UTIL_HASH_P1;
+	}
+	h ^= h >> 33;
+	h *= UTIL_HASH_P2;
+	h ^= h >> 29;
+	h *= UTIL_HASH_P3;
+	h ^= h >> 32;
+	return (uint32_t)h;
+}
+
 /* vim: set noet ft=c: */
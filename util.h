@@ -31,7 +31,12 @@
 
 #include "attrib.h"
 
+#include <stddef.h>
+#include <stdint.h>
+
 char * util_skipws(const char *) NONNULL(1) PURE;
+void util_hash_init(uint64_t);
+uint32_t util_hash(const void *, size_t) NONNULL(1) WUNRES;
 
 #define util_max(a,b) ((a) > (b) ? (a) : (b))
 
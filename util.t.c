@@ -28,6 +28,7 @@
 
 #include "util.h"
 
+#include <stdint.h>
 #include <string.h>
 
 #include <check.h>
@@ -98,6 +99,61 @@ START_TEST(util_skipws_06)
 }
 END_TEST
 
+START_TEST(util_hash_01)
+{
+	const char key[] = "192.0.2.1:443/www.example.org";
+	uint32_t h1, h2;
+
+	util_hash_init(1);
+	h1 = util_hash(key, sizeof(key));
+	fail_unless(util_hash(key, sizeof(key)) == h1,
+	            "hash not deterministic");
+	fail_unless(util_hash(key, sizeof(key) - 1) != h1,
+	            "length not hashed");
+	util_hash_init(2);
+	h2 = util_hash(key, sizeof(key));
+	fail_unless(h2 != h1, "seed not hashed");
+}
+END_TEST
+
+START_TEST(util_hash_02)
+{
+	/* keys whose 32 bit words XOR to the same value */
+	const unsigned char key1[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+	const unsigned char key2[8] = {5, 6, 7, 8, 1, 2, 3, 4};
+	const unsigned char key3[8] = {0, 0, 0, 0, 4, 4, 4, 12};
+
+	util_hash_init(0);
+	fail_unless(util_hash(key1, sizeof(key1)) !=
+	            util_hash(key2, sizeof(key2)), "swapped words collide");
+	fail_unless(util_hash(key1, sizeof(key1)) !=
+	            util_hash(key3, sizeof(key3)), "XOR folded words collide");
+}
+END_TEST
+
+START_TEST(util_hash_03)
+{
+	unsigned char key[37];
+	unsigned int buckets[64];
+	int maxbucket = 0;
+
+	/* sequential keys spread evenly over the low bits */
+	memset(buckets, 0, sizeof(buckets));
+	memset(key, 0, sizeof(key));
+	util_hash_init(0);
+	for (int i = 0; i < 6400; i++) {
+		key[0] = i & 0xff;
+		key[1] = i >> 8;
+		buckets[util_hash(key, sizeof(key)) & 63]++;
+	}
+	for (int i = 0; i < 64; i++) {
+		if (buckets[i] > (unsigned int)maxbucket)
+			maxbucket = buckets[i];
+	}
+	fail_unless(maxbucket < 200, "poor distribution");
+}
+END_TEST
+
 Suite *
 util_suite(void)
 {
@@ -115,6 +171,12 @@ util_suite(void)
 	tcase_add_test(tc, util_skipws_06);
 	suite_add_tcase(s, tc);
 
+	tc = tcase_create("util_hash");
+	tcase_add_test(tc, util_hash_01);
+	tcase_add_test(tc, util_hash_02);
+	tcase_add_test(tc, util_hash_03);
+	suite_add_tcase(s, tc);
+
 	return s;
 }
 